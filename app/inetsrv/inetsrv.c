@@ -28,6 +28,7 @@
 #include <stdlib.h>
 #include <compiler.h>
 #include <kernel/thread.h>
+#include <lib/fiber.h>
 #include <lib/minip.h>
 #include <lib/tftp.h>
 #include <lib/cksum.h>
@@ -35,7 +36,12 @@
 
 #include "inetsrv.h"
 
-static int chargen_worker(void *socket)
+/*
+ * The servers all run as fibers on one thread, a fiber per connection, so
+ * each connection costs a small stack rather than a thread.
+ */
+
+static void chargen_worker(void *socket)
 {
     uint64_t count = 0;
     tcp_socket_t *s = socket;
@@ -44,8 +50,10 @@ static int chargen_worker(void *socket)
 #define CHARGEN_BUFSIZE (0x5f * 0x5f) // 9025 bytes
 
     uint8_t *buf = malloc(CHARGEN_BUFSIZE);
-    if (!buf)
-        return ERR_NO_MEMORY;
+    if (!buf) {
+        tcp_close(s);
+        return;
+    }
 
     /* generate the sequence */
     uint8_t c = '!';
@@ -57,7 +65,7 @@ static int chargen_worker(void *socket)
 
     lk_time_t t = current_time();
     for (;;) {
-        ssize_t ret = tcp_write(s, buf, CHARGEN_BUFSIZE);
+        ssize_t ret = fiber_tcp_write(s, buf, CHARGEN_BUFSIZE);
         //TRACEF("tcp_write returns %d\n", ret);
         if (ret < 0)
             break;
@@ -70,56 +78,27 @@ static int chargen_worker(void *socket)
            count, (uint32_t)t, count * 1000 / t);
     free(buf);
     tcp_close(s);
-
-    return 0;
 }
 
-static int chargen_server(void *arg)
-{
-    status_t err;
-    tcp_socket_t *listen_socket;
-
-    err = tcp_open_listen(&listen_socket, 19);
-    if (err < 0) {
-        TRACEF("error opening chargen listen socket\n");
-        return -1;
-    }
-
-    for (;;) {
-        tcp_socket_t *accept_socket;
 
-        err = tcp_accept(listen_socket, &accept_socket);
-        TRACEF("tcp_accept returns returns %d, handle %p\n", err, accept_socket);
-        if (err < 0) {
-            TRACEF("error accepting socket, retrying\n");
-            continue;
-        }
-
-        TRACEF("starting chargen worker\n");
-        thread_detach_and_resume(thread_create("chargen_worker", &chargen_worker, accept_socket, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
-    }
-}
-
-static int discard_worker(void *socket)
+static void discard_worker(void *socket)
 {
     uint64_t count = 0;
     uint32_t crc = 0;
     tcp_socket_t *s = socket;
 
-#define DISCARD_BUFSIZE 1024
-
-    uint8_t *buf = malloc(DISCARD_BUFSIZE);
-    if (!buf) {
-        TRACEF("error allocating buffer\n");
-    }
-
     lk_time_t t = current_time();
     for (;;) {
-        ssize_t ret = tcp_read(s, buf, DISCARD_BUFSIZE);
+        /* checksum the data where it sits in the socket, nothing to copy it out for */
+        iovec_t regions[2];
+        ssize_t ret = fiber_tcp_read_peek(s, regions);
         if (ret <= 0)
             break;
 
-        crc = crc32(crc, buf, ret);
+        for (uint i = 0; i < countof(regions); i++)
+            crc = crc32(crc, regions[i].iov_base, regions[i].iov_len);
+
+        tcp_read_release(s, ret);
 
         count += ret;
     }
@@ -128,39 +107,10 @@ static int discard_worker(void *socket)
     TRACEF("discard worker exiting, read %llu bytes in %u msecs (%llu bytes/sec), crc32 0x%x\n",
            count, (uint32_t)t, count * 1000 / t, crc);
     tcp_close(s);
-
-    free(buf);
-
-    return 0;
 }
 
-static int discard_server(void *arg)
-{
-    status_t err;
-    tcp_socket_t *listen_socket;
-
-    err = tcp_open_listen(&listen_socket, 9);
-    if (err < 0) {
-        TRACEF("error opening discard listen socket\n");
-        return -1;
-    }
-
-    for (;;) {
-        tcp_socket_t *accept_socket;
 
-        err = tcp_accept(listen_socket, &accept_socket);
-        TRACEF("tcp_accept returns returns %d, handle %p\n", err, accept_socket);
-        if (err < 0) {
-            TRACEF("error accepting socket, retrying\n");
-            continue;
-        }
-
-        TRACEF("starting discard worker\n");
-        thread_detach_and_resume(thread_create("discard_worker", &discard_worker, accept_socket, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
-    }
-}
-
-static int echo_worker(void *socket)
+static void echo_worker(void *socket)
 {
     tcp_socket_t *s = socket;
 
@@ -169,15 +119,16 @@ static int echo_worker(void *socket)
     uint8_t *buf = malloc(ECHO_BUFSIZE);
     if (!buf) {
         TRACEF("error allocating buffer\n");
-        return ERR_NO_MEMORY;
+        tcp_close(s);
+        return;
     }
 
     for (;;) {
-        ssize_t ret = tcp_read(s, buf, sizeof(buf));
+        ssize_t ret = fiber_tcp_read(s, buf, ECHO_BUFSIZE);
         if (ret <= 0)
             break;
 
-        tcp_write(s, buf, ret);
+        ret = fiber_tcp_write(s, buf, ret);
         if (ret <= 0)
             break;
     }
@@ -185,36 +136,62 @@ static int echo_worker(void *socket)
     TRACEF("echo worker exiting\n");
     tcp_close(s);
     free(buf);
-
-    return 0;
 }
 
-static int echo_server(void *arg)
+
+struct server {
+    const char *name;
+    uint16_t port;
+    fiber_start_routine worker;
+};
+
+static const struct server servers[] = {
+    { "chargen", 19, chargen_worker },
+    { "discard", 9, discard_worker },
+    { "echo", 7, echo_worker },
+};
+
+static void server_fiber(void *arg)
 {
+    const struct server *srv = arg;
     status_t err;
     tcp_socket_t *listen_socket;
 
-    err = tcp_open_listen(&listen_socket, 7);
+    err = tcp_open_listen(&listen_socket, srv->port);
     if (err < 0) {
-        TRACEF("error opening echo listen socket\n");
-        return -1;
+        TRACEF("error opening %s listen socket\n", srv->name);
+        return;
     }
 
     for (;;) {
         tcp_socket_t *accept_socket;
 
-        err = tcp_accept(listen_socket, &accept_socket);
+        err = fiber_tcp_accept(listen_socket, &accept_socket);
         TRACEF("tcp_accept returns returns %d, handle %p\n", err, accept_socket);
         if (err < 0) {
             TRACEF("error accepting socket, retrying\n");
             continue;
         }
 
-        TRACEF("starting echo worker\n");
-        thread_detach_and_resume(thread_create("echo_worker", &echo_worker, accept_socket, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
+        TRACEF("starting %s worker\n", srv->name);
+        if (!fiber_create(srv->name, srv->worker, accept_socket, 0)) {
+            TRACEF("error starting %s worker\n", srv->name);
+            tcp_close(accept_socket);
+        }
     }
 }
 
+static void servers_main(void *arg)
+{
+    for (uint i = 0; i < countof(servers); i++)
+        fiber_create(servers[i].name, server_fiber, (void *)&servers[i], 0);
+}
+
+static int inetsrv_thread(void *arg)
+{
+    return fiber_run(servers_main, NULL, 0);
+}
+
 static void inetsrv_init(const struct app_descriptor *app)
 {
 }
@@ -225,9 +202,7 @@ static void inetsrv_entry(const struct app_descriptor *app, void *args)
 
     printf("starting internet servers\n");
 
-    thread_detach_and_resume(thread_create("chargen", &chargen_server, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
-    thread_detach_and_resume(thread_create("discard", &discard_server, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
-    thread_detach_and_resume(thread_create("echo", &echo_server, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
+    thread_detach_and_resume(thread_create("inetsrv", &inetsrv_thread, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
     tftp_server_init(NULL);
 }
 
@@ -35,9 +35,12 @@
 #include <pow2.h>
 
 #include <kernel/thread.h>
+#include <kernel/semaphore.h>
 #include <kernel/vm.h>
 
+#include <lib/arena.h>
 #include <lib/bio.h>
+#include <lib/cksum.h>
 #include <lib/bootargs.h>
 #include <lib/bootimage.h>
 #include <lib/ptable.h>
@@ -45,6 +48,8 @@
 
 #include <app/lkboot.h>
 
+#include "lkboot.h"
+
 #if PLATFORM_ZYNQ
 #include <platform/fpga.h>
 #include <platform/zynq.h>
@@ -54,6 +59,10 @@
 
 #define LOCAL_TRACE 0
 
+/* flash data is read from the host into a ring of these while a thread writes out the filled ones */
+#define FLASH_CHUNK_SIZE (64 * 1024)
+#define FLASH_CHUNK_COUNT 4
+
 struct lkb_command {
     struct lkb_command *next;
     const char *name;
@@ -234,45 +243,341 @@ status_t do_flash_boot(void)
         return ERR_NOT_FOUND;
     }
 
-    /* convert the bdev to a memory pointer */
+    /* a plain lk section on memory mapped flash runs in place */
+    bootimage_t *bi;
+    size_t len;
     err = bio_ioctl(bdev, BIO_IOCTL_GET_MEM_MAP, (void *)&ptr);
-    TRACEF("err %d, ptr %p\n", err, ptr);
+    LTRACEF("err %d, ptr %p\n", err, ptr);
+    if (err >= 0) {
+        if (bootimage_open((char *)ptr + entry.offset, entry.length, &bi) >= 0) {
+            /* it's a bootimage */
+            TRACEF("detected bootimage\n");
+
+            /* find the lk image, fails if it is compressed */
+            err = bootimage_get_file_section(bi, TYPE_LK, &ptr, &len);
+            if (err >= 0) {
+                TRACEF("found lk section at %p\n", ptr);
+
+                /* add the boot image to the argument list */
+                size_t bootimage_size;
+                bootimage_get_range(bi, NULL, &bootimage_size);
+
+                bootargs_add_bootimage_pointer(args, bootargs_size, bdev->name, entry.offset, bootimage_size);
+
+                TRACEF("chain loading binary at %p\n", ptr);
+                arch_chain_load((void *)ptr, lk_args[0], lk_args[1], lk_args[2], lk_args[3]);
+            }
+            bootimage_close(bi);
+        }
+
+        /* put the block device back into block mode */
+        bio_ioctl(bdev, BIO_IOCTL_PUT_MEM_MAP, NULL);
+    }
+
+    /*
+     * otherwise stream the lk section into memory. each section is hashed as it
+     * comes off the flash, and a compressed one is inflated as it arrives.
+     */
+    err = bootimage_open_bdev(bdev, entry.offset, entry.length, &bi);
     if (err < 0) {
-        TRACEF("error getting direct pointer to block device\n");
+        /* did not find a bootimage, abort */
+        TRACEF("no bootimage in system partition\n");
         return ERR_NOT_FOUND;
     }
 
-    /* sniff it to see if it's a bootimage or a raw image */
-    bootimage_t *bi;
-    if (bootimage_open((char *)ptr + entry.offset, entry.length, &bi) >= 0) {
-        size_t len;
+    bool compressed;
+    err = bootimage_get_file_section_size(bi, TYPE_LK, &len, &compressed);
+    if (err < 0) {
+        TRACEF("no lk section in bootimage\n");
+        goto out;
+    }
 
-        /* it's a bootimage */
-        TRACEF("detected bootimage\n");
+    void *buf;
+    err = vmm_alloc_contiguous(vmm_get_kernel_aspace(), "lkboot_lk",
+                               ROUNDUP(len, PAGE_SIZE), &buf, log2_uint(1024*1024), 0, 0);
+    if (err < 0) {
+        TRACEF("not enough memory for %zu byte lk section\n", len);
+        goto out;
+    }
 
-        /* find the lk image */
-        if (bootimage_get_file_section(bi, TYPE_LK, &ptr, &len) >= 0) {
-            TRACEF("found lk section at %p\n", ptr);
+    TRACEF("loading %s lk section, %zu bytes to %p\n", compressed ? "compressed" : "plain", len, buf);
+    ssize_t loaded = bootimage_load_file_section(bi, TYPE_LK, buf, len);
+    if (loaded < 0) {
+        TRACEF("error %ld loading lk section\n", loaded);
+        err = loaded;
+        vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)buf);
+        goto out;
+    }
+    arch_sync_cache_range((addr_t)buf, len);
 
-            /* add the boot image to the argument list */
-            size_t bootimage_size;
-            bootimage_get_range(bi, NULL, &bootimage_size);
+    /* add the boot image to the argument list */
+    size_t bootimage_size;
+    bootimage_get_range(bi, NULL, &bootimage_size);
+
+    bootargs_add_bootimage_pointer(args, bootargs_size, bdev->name, entry.offset, bootimage_size);
+
+    TRACEF("chain loading binary at %p\n", buf);
+    arch_chain_load(buf, lk_args[0], lk_args[1], lk_args[2], lk_args[3]);
+
+    /* we never get here */
+    err = NO_ERROR;
+
+out:
+    bootimage_close(bi);
+    return err;
+}
+
+struct flash_writer {
+    bio_program_t *prog;
+
+    void *buf[FLASH_CHUNK_COUNT];
+    size_t len[FLASH_CHUNK_COUNT]; // 0 tells the writer it has seen the last one
 
-            bootargs_add_bootimage_pointer(args, bootargs_size, bdev->name, entry.offset, bootimage_size);
+    semaphore_t empty;
+    semaphore_t full;
+    volatile bool failed;
+};
+
+static int flash_writer_thread(void *arg)
+{
+    struct flash_writer *w = arg;
+
+    for (uint i = 0; ; i = (i + 1) % FLASH_CHUNK_COUNT) {
+        sem_wait(&w->full);
+
+        size_t len = w->len[i];
+        if (len == 0)
+            break;
+
+        /* once a write failed keep draining, so the reader never blocks on us */
+        if (!w->failed && bio_program_write(w->prog, w->buf[i], len) != (ssize_t)len)
+            w->failed = true;
+
+        sem_post(&w->empty, false);
+    }
+
+    return 0;
+}
+
+/*
+ * stream len bytes from the host into a partition. erasing runs ahead of the writes and
+ * receiving overlaps both, the rest of the partition is erased once the data is down.
+ */
+static int flash_stream(lkb_t *lkb, bdev_t *bdev, const struct ptable_entry *entry, size_t len,
+                        const char **result)
+{
+    struct flash_writer w;
+    int err = 0;
+
+    memset(&w, 0, sizeof(w));
+    if (bio_program_start(bdev, entry->offset, entry->length, BIO_PROGRAM_FLAG_VERIFY,
+                          &w.prog) < 0) {
+        *result = "bio_program_start failed";
+        return -1;
+    }
+
+    /* the staging buffers only live as long as the command, take them from pages in one go */
+    size_t chunk = ROUNDUP(FLASH_CHUNK_SIZE, bdev->block_size);
+    arena_t *bufs = arena_create(chunk * FLASH_CHUNK_COUNT, ARENA_FLAG_PAGES);
+    for (uint i = 0; i < FLASH_CHUNK_COUNT; i++) {
+        w.buf[i] = bufs ? arena_alloc(bufs, chunk) : NULL;
+        if (!w.buf[i]) {
+            *result = "memory allocation failed";
+            err = -1;
+            goto done;
         }
-    } else {
-        /* did not find a bootimage, abort */
-        bio_ioctl(bdev, BIO_IOCTL_PUT_MEM_MAP, NULL);
-        return ERR_NOT_FOUND;
     }
 
-    TRACEF("chain loading binary at %p\n", ptr);
-    arch_chain_load((void *)ptr, lk_args[0], lk_args[1], lk_args[2], lk_args[3]);
+    sem_init(&w.empty, FLASH_CHUNK_COUNT);
+    sem_init(&w.full, 0);
+
+    thread_t *t = thread_create("lkb_flash", &flash_writer_thread, &w,
+                                DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+    if (!t) {
+        *result = "error creating writer thread";
+        err = -1;
+        goto done_sem;
+    }
+    thread_resume(t);
+
+    size_t pos = 0;
+    uint i = 0;
+    while (pos < len && !w.failed) {
+        size_t toread = MIN(len - pos, chunk);
+
+        LTRACEF("offset %zu, toread %zu\n", pos, toread);
 
-    /* put the block device back into block mode (though we never get here) */
-    bio_ioctl(bdev, BIO_IOCTL_PUT_MEM_MAP, NULL);
+        sem_wait(&w.empty);
+        if (lkb_read(lkb, w.buf[i], toread)) {
+            *result = "io error";
+            err = -1;
+            sem_post(&w.empty, false);
+            break;
+        }
+        w.len[i] = toread;
+        sem_post(&w.full, false);
 
-    return NO_ERROR;
+        pos += toread;
+        i = (i + 1) % FLASH_CHUNK_COUNT;
+    }
+
+    /* let the writer finish what it has and stop */
+    sem_wait(&w.empty);
+    w.len[i] = 0;
+    sem_post(&w.full, false);
+    thread_join(t, NULL, INFINITE_TIME);
+
+    if (err == 0 && w.failed) {
+        *result = "flash write failed";
+        err = -1;
+    }
+    if (err == 0 && len > 0 && lkb_read_end(lkb)) {
+        *result = "crc mismatch";
+        err = -1;
+    }
+
+done_sem:
+    sem_destroy(&w.empty);
+    sem_destroy(&w.full);
+done:
+    arena_destroy(bufs);
+
+    if (err < 0) {
+        bio_program_abort(w.prog);
+    } else if (bio_program_finish(w.prog) < 0) {
+        *result = "flash erase failed";
+        err = -1;
+    }
+
+    return err;
+}
+
+/* crc32 of len bytes from offset, read through buf */
+static int bdev_crc32(bdev_t *bdev, off_t offset, size_t len, void *buf, size_t buflen,
+                      uint32_t *crc)
+{
+    *crc = 0;
+    while (len > 0) {
+        size_t toread = MIN(len, buflen);
+        if (bio_read(bdev, buf, offset, toread) != (ssize_t)toread)
+            return -1;
+        *crc = crc32(*crc, buf, toread);
+        offset += toread;
+        len -= toread;
+    }
+    return 0;
+}
+
+/* erase size of the device at offset, 0 if it doesn't need erasing */
+static size_t bdev_erase_size(bdev_t *bdev, off_t offset)
+{
+    for (size_t i = 0; i < bdev->geometry_count; i++) {
+        const bio_erase_geometry_info_t *geo = &bdev->geometry[i];
+        if (offset >= geo->start && offset < geo->start + geo->size)
+            return geo->erase_size;
+    }
+    return 0;
+}
+
+/* apply a delta from the host to a partition, rewriting only the blocks it carries */
+static int flash_delta(lkb_t *lkb, bdev_t *bdev, const struct ptable_entry *entry,
+                       const char **result)
+{
+    lkb_delta_hdr_t hdr;
+    void *buf = NULL;
+    uint32_t crc;
+    uint written = 0;
+    int err = -1;
+
+    if (lkb_read(lkb, &hdr, sizeof(hdr))) {
+        *result = "io error";
+        return -1;
+    }
+    if (hdr.magic != LKB_DELTA_MAGIC) {
+        *result = "bad delta header";
+        return -1;
+    }
+
+    size_t erase_size = bdev_erase_size(bdev, entry->offset);
+    if (!ispow2(hdr.block_size) || hdr.block_size < bdev->block_size ||
+            (erase_size && hdr.block_size % erase_size)) {
+        *result = "delta block size doesn't suit the device";
+        return -1;
+    }
+    if (hdr.base_len > entry->length || hdr.image_len > entry->length) {
+        *result = "partition too small";
+        return -1;
+    }
+
+    buf = memalign(CACHE_LINE, hdr.block_size);
+    if (!buf) {
+        *result = "memory allocation failed";
+        return -1;
+    }
+
+    /* make sure the delta was made against what's actually there */
+    if (bdev_crc32(bdev, entry->offset, hdr.base_len, buf, hdr.block_size, &crc)) {
+        *result = "bio_read failed";
+        goto done;
+    }
+    if (crc != hdr.base_crc) {
+        *result = "partition doesn't match the delta's base";
+        goto done;
+    }
+
+    off_t blocks = ROUNDUP((off_t)hdr.image_len, hdr.block_size) / hdr.block_size;
+    for (;;) {
+        uint32_t block;
+        if (lkb_read(lkb, &block, sizeof(block))) {
+            *result = "io error";
+            goto done;
+        }
+        if (block == LKB_DELTA_END)
+            break;
+        if (block >= blocks) {
+            *result = "delta block out of range";
+            goto done;
+        }
+        if (lkb_read(lkb, buf, hdr.block_size)) {
+            *result = "io error";
+            goto done;
+        }
+
+        LTRACEF("block %u\n", block);
+
+        off_t offset = entry->offset + (off_t)block * hdr.block_size;
+        if (erase_size && bio_erase(bdev, offset, hdr.block_size) != (ssize_t)hdr.block_size) {
+            *result = "bio_erase failed";
+            goto done;
+        }
+        if (bio_write(bdev, buf, offset, hdr.block_size) != (ssize_t)hdr.block_size) {
+            *result = "bio_write failed";
+            goto done;
+        }
+        written++;
+    }
+
+    if (lkb_read_end(lkb)) {
+        *result = "crc mismatch";
+        goto done;
+    }
+
+    printf("lkboot: rewrote %u of %lld blocks\n", written, blocks);
+
+    if (bdev_crc32(bdev, entry->offset, hdr.image_len, buf, hdr.block_size, &crc)) {
+        *result = "bio_read failed";
+        goto done;
+    }
+    if (crc != hdr.image_crc) {
+        *result = "image crc mismatch after applying delta";
+        goto done;
+    }
+
+    err = 0;
+
+done:
+    free(buf);
+    return err;
 }
 
 // return NULL for success, error string for failure
@@ -315,44 +620,34 @@ int lkb_handle_command(lkb_t *lkb, const char *cmd, const char *arg, size_t len,
             return -1;
         }
 
-        printf("lkboot: erasing partition of size %llu\n", entry.length);
-        if (bio_erase(bdev, entry.offset, entry.length) != (ssize_t)entry.length) {
-            *result = "bio_erase failed";
-            return -1;
-        }
-
         if (!strcmp(cmd, "flash")) {
-            printf("lkboot: writing to partition\n");
+            printf("lkboot: writing to partition of size %llu\n", entry.length);
 
-            void *buf = malloc(bdev->block_size);
-            if (!buf) {
-                *result = "memory allocation failed";
+            if (flash_stream(lkb, bdev, &entry, len, result) < 0)
+                return -1;
+        } else {
+            printf("lkboot: erasing partition of size %llu\n", entry.length);
+            if (bio_erase(bdev, entry.offset, entry.length) != (ssize_t)entry.length) {
+                *result = "bio_erase failed";
                 return -1;
             }
+        }
+    } else if (!strcmp(cmd, "delta")) {
+        struct ptable_entry entry;
+        bdev_t *bdev;
 
-            size_t pos = 0;
-            while (pos < len) {
-                size_t toread = MIN(len - pos, bdev->block_size);
-
-                LTRACEF("offset %zu, toread %zu\n", pos, toread);
-
-                if (lkb_read(lkb, buf, toread)) {
-                    *result = "io error";
-                    free(buf);
-                    return -1;
-                }
-
-                if (bio_write(bdev, buf, entry.offset + pos, toread) != (ssize_t)toread) {
-                    *result = "bio_write failed";
-                    free(buf);
-                    return -1;
-                }
-
-                pos += toread;
-            }
-
-            free(buf);
+        if (ptable_find(arg, &entry) < 0) {
+            *result = "no such partition";
+            return -1;
         }
+        if (!(bdev = ptable_get_device())) {
+            *result = "ptable_get_device failed";
+            return -1;
+        }
+
+        printf("lkboot: applying delta to partition of size %llu\n", entry.length);
+        if (flash_delta(lkb, bdev, &entry, result) < 0)
+            return -1;
     } else if (!strcmp(cmd, "remove")) {
         if (ptable_remove(arg) < 0) {
             *result = "remove failed";
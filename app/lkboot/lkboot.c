@@ -34,6 +34,7 @@
 #include <assert.h>
 #include <trace.h>
 
+#include <lib/cksum.h>
 #include <lib/sysparam.h>
 
 #include <kernel/thread.h>
@@ -55,6 +56,10 @@
 #ifndef LKBOOT_AUTOBOOT_TIMEOUT
 #define LKBOOT_AUTOBOOT_TIMEOUT 5000
 #endif
+/* receive window for the tcp server, big enough to keep a fast link busy */
+#ifndef LKBOOT_TCP_RX_BUFFER
+#define LKBOOT_TCP_RX_BUFFER (256 * 1024)
+#endif
 
 #define LOCAL_TRACE 0
 
@@ -72,6 +77,11 @@ typedef struct LKB {
 
     int state;
     size_t avail;
+
+    /* crc32 of the data read so far, and the one the host sent at the end, if it did */
+    unsigned long crc;
+    bool have_host_crc;
+    uint32_t host_crc;
 } lkb_t;
 
 lkb_t *lkboot_create_lkb(void *cookie, lkb_read_hook *read, lkb_write_hook *write) {
@@ -82,6 +92,8 @@ lkb_t *lkboot_create_lkb(void *cookie, lkb_read_hook *read, lkb_write_hook *writ
     lkb->cookie = cookie;
     lkb->state = STATE_OPEN;
     lkb->avail = 0;
+    lkb->crc = 0;
+    lkb->have_host_crc = false;
     lkb->read = read;
     lkb->write = write;
 
@@ -150,6 +162,47 @@ int lkb_write(lkb_t *lkb, const void *_data, size_t len) {
     return 0;
 }
 
+/* the host is done sending, pick up the crc it may have sent along */
+static int lkb_end_data(lkb_t *lkb, const msg_hdr_t *hdr) {
+    lkb->state = STATE_RESP;
+    if (hdr->length == 0)
+        return 0;
+    if (hdr->length != sizeof(lkb->host_crc))
+        return -1;
+    if (lkb->read(lkb->cookie, &lkb->host_crc, sizeof(lkb->host_crc)))
+        return -1;
+    lkb->have_host_crc = true;
+    return 0;
+}
+
+static int lkb_read_data(lkb_t *lkb, void *data, size_t len) {
+    if (lkb->read(lkb->cookie, data, len))
+        return -1;
+    lkb->crc = crc32(lkb->crc, data, len);
+    return 0;
+}
+
+int lkb_read_end(lkb_t *lkb) {
+    if (lkb->state == STATE_DATA) {
+        msg_hdr_t hdr;
+        if (lkb->avail != 0) goto fail;
+        if (lkb->read(lkb->cookie, &hdr, sizeof(hdr))) goto fail;
+        if (hdr.opcode != MSG_END_DATA) goto fail;
+        if (lkb_end_data(lkb, &hdr)) goto fail;
+    }
+    if (lkb->state != STATE_RESP) goto fail;
+
+    if (lkb->have_host_crc && lkb->host_crc != (uint32_t)lkb->crc) {
+        printf("lkboot: crc mismatch, host 0x%08x ours 0x%08x\n", lkb->host_crc, (uint32_t)lkb->crc);
+        return -1;
+    }
+    return 0;
+
+fail:
+    lkb->state = STATE_ERROR;
+    return -1;
+}
+
 int lkb_read(lkb_t *lkb, void *_data, size_t len) {
     char *data = _data;
 
@@ -164,18 +217,18 @@ int lkb_read(lkb_t *lkb, void *_data, size_t len) {
             msg_hdr_t hdr;
             if (lkb->read(lkb->cookie, &hdr, sizeof(hdr))) goto fail;
             if (hdr.opcode == MSG_END_DATA) {
-                lkb->state = STATE_RESP;
+                if (lkb_end_data(lkb, &hdr)) goto fail;
                 return -1;
             }
             if (hdr.opcode != MSG_SEND_DATA) goto fail;
             lkb->avail = ((size_t) hdr.length) + 1;
         }
         if (lkb->avail >= len) {
-            if (lkb->read(lkb->cookie, data, len)) goto fail;
+            if (lkb_read_data(lkb, data, len)) goto fail;
             lkb->avail -= len;
             return 0;
         }
-        if (lkb->read(lkb->cookie, data, lkb->avail)) {
+        if (lkb_read_data(lkb, data, lkb->avail)) {
             lkb->state = STATE_ERROR;
             return -1;
         }
@@ -239,6 +292,7 @@ static status_t lkboot_server(lk_time_t timeout)
         printf("lkboot: error opening listen socket\n");
         return ERR_NO_MEMORY;
     }
+    tcp_set_option(listen_socket, TCP_OPT_RX_BUFFER_SIZE, LKBOOT_TCP_RX_BUFFER);
 #endif
 
     /* run the main lkserver loop */
@@ -30,6 +30,10 @@
 
 int lkb_handle_command(lkb_t *lkb, const char *cmd, const char *arg, size_t len, const char **result);
 
+/* consume the end of the data stream, failing if the host sent a crc32 with it
+ * that doesn't match what was read */
+int lkb_read_end(lkb_t *lkb);
+
 status_t do_flash_boot(void);
 
 typedef ssize_t lkb_read_hook(void *s, void *data, size_t len);
@@ -58,6 +58,8 @@ typedef struct {
 
 #define MSG_END_DATA    0x42
 // client ends data stream
+// length may be 4, if so data is the crc32 of all the data sent, which
+// commands writing it somewhere permanent check before reporting success
 // server will then respond with MSG_OKAY or MSG_FAIL
 
 // command strings are in the form of
@@ -78,3 +80,24 @@ typedef struct {
 //
 // C: MSG_CMD "reboot:0:"
 // S: MSG_OKAY
+
+// the "delta" command takes a block level diff against what's in the partition
+// now, and only erases and writes the blocks that changed. its data is an
+// lkb_delta_hdr_t, then for each changed block its number followed by block_size
+// bytes of new contents, then LKB_DELTA_END in place of a block number.
+//
+// block_size must be a multiple of the partition's erase size. the target checks
+// the first base_len bytes of the partition have crc32 base_crc before touching
+// anything, and that the first image_len bytes have crc32 image_crc after.
+
+typedef struct {
+    unsigned int magic;
+    unsigned int block_size;
+    unsigned int base_len;
+    unsigned int base_crc;
+    unsigned int image_len;
+    unsigned int image_crc;
+} lkb_delta_hdr_t;
+
+#define LKB_DELTA_MAGIC 0x41544c44 // "DLTA"
+#define LKB_DELTA_END   0xffffffff
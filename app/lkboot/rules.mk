@@ -3,10 +3,12 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 MODULE := $(LOCAL_DIR)
 
 MODULE_DEPS += \
+	lib/arena \
 	lib/bio \
 	lib/bootargs \
 	lib/bootimage \
 	lib/cbuf \
+	lib/cksum \
 	lib/ptable \
 	lib/sysparam
 
@@ -59,6 +59,9 @@ typedef struct {
     unsigned char *max;
     char name[FNAME_SIZE];
     download_type type;
+    // elf images are loaded as they arrive rather than into a slot
+    elf_stream_t elf;
+    bool started;
 } download_t;
 
 static download_t *make_download(const char *name)
@@ -96,66 +99,90 @@ static int run_elf(void *entry_point)
     return 0;
 }
 
-static void process_elf_blob(const void *start, size_t len)
+static bool entry_in_segments(const elf_handle_t *elf)
 {
-    void *entrypt;
-    elf_handle_t elf;
-
-    status_t st = elf_open_handle_memory(&elf, start, len);
-    if (st < 0) {
-        printf("unable to open elf handle\n");
-        return;
+    for (uint i = 0; i < elf->eheader.e_phnum; i++) {
+        if (elf->pheaders[i].p_type != PT_LOAD)
+            continue;
+        if (elf->entry >= elf->pheaders[i].p_vaddr &&
+                elf->entry - elf->pheaders[i].p_vaddr < elf->pheaders[i].p_memsz)
+            return true;
     }
+    return false;
+}
 
-    st = elf_load(&elf);
-    if (st < 0) {
-        printf("elf processing failed, status : %d\n", st);
-        goto exit;
-    }
+static void start_elf(download_t *download)
+{
+    void *entrypt = (void *)download->elf.handle.entry;
 
-    entrypt = (void *)elf.entry;
-    if (entrypt < start || entrypt >= (void *)((char *)start + len)) {
+    download->started = true;
+
+    if (!entry_in_segments(&download->elf.handle)) {
         printf("out of bounds entrypoint for elf : %p\n", entrypt);
-        goto exit;
+        return;
     }
 
-    printf("elf looks good\n");
+    printf("[%s] elf loaded at %llu bytes, starting\n", download->name,
+           (unsigned long long)download->elf.pos);
     thread_resume(thread_create("elf_runner", &run_elf, entrypt,
                                 DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
-exit:
-    elf_close_handle(&elf);
 }
 
 int tftp_callback(void *data, size_t len, void *arg)
 {
     download_t *download = arg;
-    size_t final_len;
 
-    if (!data) {
-        final_len = output_result(download);
-        if (download->type == DOWNLOAD_ELF) {
-            process_elf_blob(download->start, final_len);
-        }
+    // tftp writes straight into the slot, this is only called at the end.
+    download->end = download->start + len;
+    if (!len) {
+        printf("[%s] transfer failed\n", download->name);
+        return 0;
+    }
+
+    output_result(download);
 
-        download->end = download->start;
+    download->end = download->start;
+    return 0;
+}
+
+// Called with every block of an elf image. The segments land at their load
+// addresses as the blocks come in, and the image runs as soon as the last
+// one is in place; anything after that (section headers, symbols) is dropped.
+static int tftp_elf_callback(void *data, size_t len, void *arg)
+{
+    download_t *download = arg;
+
+    if (!data) {
+        if (!len)
+            printf("[%s] transfer failed\n", download->name);
+        else if (!download->started)
+            printf("[%s] done, %zu bytes but the elf is incomplete\n", download->name, len);
+
+        // ready for the next one
+        elf_stream_close(&download->elf);
+        elf_stream_init(&download->elf);
+        download->started = false;
         return 0;
     }
 
-    if ((download->end + len) > download->max) {
-        printf("transfer too big, aborting\n");
+    if (download->started)
+        return 0;
+
+    status_t st = elf_stream_write(&download->elf, data, len);
+    if (st < 0) {
+        printf("[%s] elf processing failed, status : %d\n", download->name, st);
         return -1;
     }
-    if (len) {
-        memcpy(download->end, data, len);
-        download->end += len;
-    }
+
+    if (elf_stream_complete(&download->elf))
+        start_elf(download);
+
     return 0;
 }
 
 static int loader(int argc, const cmd_args *argv)
 {
     static int any_slot = 0;
-    static int elf_slot = 1;
 
     download_t *download;
     int slot;
@@ -168,8 +195,9 @@ static int loader(int argc, const cmd_args *argv)
     if (argc < 3) {
 usage:
         printf("load any [filename] <slot>\n"
-               "load elf [filename] <slot>\n"
-               "protocol is tftp and <slot> is optional\n");
+               "load elf [filename]\n"
+               "protocol is tftp and <slot> is optional\n"
+               "elf images are loaded in place as they arrive\n");
         return 0;
     }
 
@@ -181,8 +209,10 @@ usage:
         any_slot += 2;
     } else if (strcmp(argv[1].str, "elf") == 0) {
         download->type = DOWNLOAD_ELF;
-        slot = elf_slot;
-        elf_slot += 2;
+        elf_stream_init(&download->elf);
+        tftp_set_write_client(download->name, &tftp_elf_callback, download);
+        printf("ready for %s over tftp\n", argv[2].str);
+        return 0;
     } else {
         goto usage;
     }
@@ -192,7 +222,8 @@ usage:
     }
 
     set_ram_zone(download, slot);
-    tftp_set_write_client(download->name, &tftp_callback, download);
+    tftp_set_write_memory(download->name, download->start, download->max - download->start,
+                          &tftp_callback, download);
     printf("ready for %s over tftp (at %p)\n", argv[2].str, download->start);
     return 0;
 }
@@ -87,18 +87,26 @@ void usb_xmit(void *data, unsigned len) {
 	event_wait(&txevt);
 }
 
-int usb_recv(void *data, unsigned len, lk_time_t timeout) {
+void usb_recv_start(void *data, unsigned len) {
 	event_unsignal(&rxevt);
 	rxreq->buffer = data;
 	rxreq->length = len;
 	rxstatus = 1;
 	udc_request_queue(rxept, rxreq);
+}
+
+int usb_recv_wait(lk_time_t timeout) {
 	if (event_wait_timeout(&rxevt, timeout)) {
 		return ERR_TIMED_OUT;
 	}
 	return rxactual;
 }
 
+int usb_recv(void *data, unsigned len, lk_time_t timeout) {
+	usb_recv_start(data, len);
+	return usb_recv_wait(timeout);
+}
+
 static udc_device_t lpcboot_device = {
 	.vendor_id = 0x1209,
 	.product_id = 0x5039,
@@ -172,6 +180,9 @@ void boot_app(void) {
 }
 
 int erase_page(u32 addr) {
+	/* reading a sector back is much quicker than erasing it */
+	if (spifi_verify_erased(addr, 0x1000/4) == 0)
+		return 0;
 	spifi_sector_erase(addr);
 	return spifi_verify_erased(addr, 0x1000/4);
 }
@@ -188,11 +199,13 @@ int write_page(u32 addr, void *ptr) {
 	return 0;
 }
 
-static uint32_t ram[4096/4];
+/* one buffer fills from usb while the other is programmed */
+static uint32_t ram[2][4096/4];
 
 void handle(u32 magic, u32 cmd, u32 arg) {
 	u32 reply[2];
-	u32 addr, xfer;
+	u32 addr, xfer = 0;
+	unsigned n;
 	int err = 0;
 
 	if (magic != 0xDB00A5A5)
@@ -218,13 +231,21 @@ void handle(u32 magic, u32 cmd, u32 arg) {
 		}
 		reply[1] = 0;
 		usb_xmit(reply, 8);
-		while (arg > 0) {
+		if (arg > 0) {
 			xfer = (arg > 4096) ? 4096 : arg;
-			usb_recv(ram, xfer, INFINITE_TIME);
+			usb_recv_start(ram[0], xfer);
+		}
+		for (n = 0; arg > 0; n ^= 1) {
+			usb_recv_wait(INFINITE_TIME);
+			arg -= xfer;
+			if (arg > 0) {
+				/* get the next sector coming while this one is written */
+				xfer = (arg > 4096) ? 4096 : arg;
+				usb_recv_start(ram[n ^ 1], xfer);
+			}
 			if (!err) err = erase_page(addr);
-			if (!err) err = write_page(addr, ram);
+			if (!err) err = write_page(addr, ram[n]);
 			addr += 4096;
-			arg -= xfer;
 		}
 		printf("flash %s\n", err ? "ERROR" : "OK");
 		reply[1] = err;
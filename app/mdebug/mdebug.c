@@ -33,18 +33,26 @@
 
 #define TX_AHEAD 1
 
+// receives that can be queued at once, they complete in order
+#define RX_QUEUE 2
+
 static event_t txevt = EVENT_INITIAL_VALUE(txevt, TX_AHEAD, 0);
-static event_t rxevt = EVENT_INITIAL_VALUE(rxevt, 0, 0);
 
 static udc_request_t *txreq;
-static udc_request_t *rxreq;
 static udc_endpoint_t *txept;
 static udc_endpoint_t *rxept;
 
+static struct {
+	udc_request_t *req;
+	event_t evt;
+	volatile int status;
+	volatile int actual;
+} rxq[RX_QUEUE];
+static unsigned rxq_head;
+static unsigned rxq_tail;
+
 static volatile int online;
 static volatile int txstatus;
-static volatile int rxstatus;
-static volatile int rxactual;
 
 static void mdebug_notify(udc_gadget_t *gadget, unsigned event) {
 	if (event == UDC_EVENT_ONLINE) {
@@ -55,9 +63,10 @@ static void mdebug_notify(udc_gadget_t *gadget, unsigned event) {
 }
 
 static void rx_complete(udc_request_t *req, unsigned actual, int status) {
-	rxactual = actual;
-	rxstatus = status;
-	event_signal(&rxevt, 0);
+	unsigned n = (unsigned) req->context;
+	rxq[n].actual = actual;
+	rxq[n].status = status;
+	event_signal(&rxq[n].evt, 0);
 }
 
 static void tx_complete(udc_request_t *req, unsigned actual, int status) {
@@ -89,17 +98,37 @@ void usb_xmit(void *data, unsigned len) {
 }
 #endif
 
-int usb_recv(void *data, unsigned len) {
-	event_unsignal(&rxevt);
-	rxreq->buffer = data;
-	rxreq->length = len;
-	rxstatus = 1;
-	if (udc_request_queue(rxept, rxreq)) {
+/* queue a receive into data behind any already queued, up to RX_QUEUE.
+ * usb_recv_wait() returns their results in the same order.
+ */
+int usb_recv_start(void *data, unsigned len) {
+	unsigned n = rxq_head % RX_QUEUE;
+	udc_request_t *req = rxq[n].req;
+
+	DEBUG_ASSERT(rxq_head - rxq_tail < RX_QUEUE);
+	rxq_head++;
+
+	event_unsignal(&rxq[n].evt);
+	req->buffer = data;
+	req->length = len;
+	rxq[n].status = 1;
+	if (udc_request_queue(rxept, req)) {
 		printf("rxqf\n");
+		rxq[n].status = -1;
+		event_signal(&rxq[n].evt, 0);
 		return -1;
 	}
-	event_wait(&rxevt);
-	return rxstatus ? rxstatus : rxactual;
+	return 0;
+}
+
+int usb_recv_wait(void) {
+	unsigned n = rxq_tail % RX_QUEUE;
+
+	DEBUG_ASSERT(rxq_head != rxq_tail);
+	rxq_tail++;
+
+	event_wait(&rxq[n].evt);
+	return rxq[n].status ? rxq[n].status : rxq[n].actual;
 }
 
 static udc_device_t mdebug_device = {
@@ -127,9 +156,13 @@ static void mdebug_init(const struct app_descriptor *app)
 	mdebug_endpoints[0] = txept = udc_endpoint_alloc(UDC_BULK_IN, 512);
 	mdebug_endpoints[1] = rxept = udc_endpoint_alloc(UDC_BULK_OUT, 512);
 	txreq = udc_request_alloc();
-	rxreq = udc_request_alloc();
-	rxreq->complete = rx_complete;
 	txreq->complete = tx_complete;
+	for (unsigned n = 0; n < RX_QUEUE; n++) {
+		rxq[n].req = udc_request_alloc();
+		rxq[n].req->complete = rx_complete;
+		rxq[n].req->context = (void *) n;
+		event_init(&rxq[n].evt, 0, 0);
+	}
 	udc_register_gadget(&mdebug_gadget);
 }
 
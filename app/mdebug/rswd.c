@@ -27,7 +27,15 @@
 #include "rswdp.h"
 
 void usb_xmit(void *data, unsigned len);
-int usb_recv(void *data, unsigned len);
+int usb_recv_start(void *data, unsigned len);
+int usb_recv_wait(void);
+
+// sizes of the io buffers below
+#define RXBUFFER_SIZE	8192
+#define TXBUFFER_WORDS	(8192 / 4)
+
+// room to leave at the end of a reply for the status and a NULL op
+#define TX_RESERVE	2
 
 unsigned swdp_trace = 0;
 
@@ -64,6 +72,51 @@ static void _reboot(void) {
 #define MODE_JTAG	1
 static unsigned mode = MODE_SWD;
 
+/* ADIv5 only promises TAR autoincrement within a 1K block */
+#define TAR_BLOCK	1024
+
+static int mem_read(u32 addr, u32 *data, unsigned count) {
+	unsigned xfer, tmp;
+	int status;
+	while (count > 0) {
+		xfer = (TAR_BLOCK - (addr & (TAR_BLOCK - 1))) / 4;
+		if (xfer > count)
+			xfer = count;
+		if ((status = swd_write(WR_AP1, addr)))
+			return status;
+		// AP reads are posted, each one returns the data of the one
+		// before it and RDBUFF holds the last
+		if ((status = swd_read(RD_AP3, &tmp)))
+			return status;
+		if ((status = swd_read_block(RD_AP3, data, xfer - 1)))
+			return status;
+		if ((status = swd_read(RD_BUFFER, data + xfer - 1)))
+			return status;
+		addr += xfer * 4;
+		data += xfer;
+		count -= xfer;
+	}
+	return 0;
+}
+
+static int mem_write(u32 addr, const u32 *data, unsigned count) {
+	unsigned xfer;
+	int status;
+	while (count > 0) {
+		xfer = (TAR_BLOCK - (addr & (TAR_BLOCK - 1))) / 4;
+		if (xfer > count)
+			xfer = count;
+		if ((status = swd_write(WR_AP1, addr)))
+			return status;
+		if ((status = swd_write_block(WR_AP3, data, xfer)))
+			return status;
+		addr += xfer * 4;
+		data += xfer;
+		count -= xfer;
+	}
+	return 0;
+}
+
 /* TODO bounds checking -- we trust the host far too much */
 void process_txn(u32 txnid, u32 *rx, int rxc, u32 *tx) {
 	unsigned msg, op, n;
@@ -86,25 +139,29 @@ void process_txn(u32 txnid, u32 *rx, int rxc, u32 *tx) {
 		case CMD_NULL:
 			continue;
 		case CMD_SWD_WRITE:
-			while (n-- > 0) {
-				rxc--;
-				status = swd_write(optable[op], *rx++);
-				if (status) {
-					goto done;
-				}
+			if ((int)n > rxc) {
+				status = ERR_INTERNAL;
+				goto done;
+			}
+			status = swd_write_block(optable[op], rx, n);
+			rx += n;
+			rxc -= n;
+			if (status) {
+				goto done;
 			}
 			continue;
 		case CMD_SWD_READ:
+			if (txc + 1 + n + TX_RESERVE > TXBUFFER_WORDS) {
+				status = ERR_INTERNAL;
+				goto done;
+			}
 			tx[txc++] = RSWD_MSG(CMD_SWD_DATA, 0, n);
-			while (n-- > 0) {
-				status = swd_read(optable[op], tx + txc);
-				if (status) {
-					txc++;
-					while (n-- > 0)
-						tx[txc++] = 0xfefefefe;
-					goto done;
-				}
-				txc++;
+			// words past an error read back as 0xfefefefe
+			memset(tx + txc, 0xfe, n * 4);
+			status = swd_read_block(optable[op], tx + txc, n);
+			txc += n;
+			if (status) {
+				goto done;
 			}
 			continue;
 		case CMD_SWD_DISCARD:
@@ -116,6 +173,34 @@ void process_txn(u32 txnid, u32 *rx, int rxc, u32 *tx) {
 				}
 			}
 			continue;
+		case CMD_MEM_READ:
+			if ((rxc < 1) || (rx[0] & 3) ||
+			    (txc + 1 + n + TX_RESERVE > TXBUFFER_WORDS)) {
+				status = ERR_INTERNAL;
+				goto done;
+			}
+			tx[txc++] = RSWD_MSG(CMD_SWD_DATA, 0, n);
+			memset(tx + txc, 0xfe, n * 4);
+			status = mem_read(rx[0], tx + txc, n);
+			rx++;
+			rxc--;
+			txc += n;
+			if (status) {
+				goto done;
+			}
+			continue;
+		case CMD_MEM_WRITE:
+			if ((rxc < 1 + (int)n) || (rx[0] & 3)) {
+				status = ERR_INTERNAL;
+				goto done;
+			}
+			status = mem_write(rx[0], rx + 1, n);
+			rx += 1 + n;
+			rxc -= 1 + n;
+			if (status) {
+				goto done;
+			}
+			continue;
 		case CMD_ATTACH:
 			if (mode != MODE_SWD) {
 				mode = MODE_SWD;
@@ -274,7 +359,7 @@ done:
 }
 
 // io buffers in AHB SRAM
-static u32 *rxbuffer = (void*) 0x20001000;
+static u32 *rxbuffer[2] = {(void*) 0x20001000, (void*) 0x20007000 };
 static u32 *txbuffer[2] = {(void*) 0x20003000, (void*) 0x20005000 };
 
 #include <kernel/thread.h>
@@ -282,6 +367,13 @@ static u32 *txbuffer[2] = {(void*) 0x20003000, (void*) 0x20005000 };
 void handle_rswd(void) {
 	int rxc;
 	int toggle = 0;
+	int rxtoggle = 0;
+	u32 *rxbuf;
+
+	// keep both rx buffers queued so the host's next transaction can
+	// land while this one is still being worked on
+	usb_recv_start(rxbuffer[0], RXBUFFER_SIZE);
+	usb_recv_start(rxbuffer[1], RXBUFFER_SIZE);
 
 #if CONFIG_MDEBUG_TRACE
 	printf("[ rswdp agent v0.9 ]\n");
@@ -289,31 +381,36 @@ void handle_rswd(void) {
 #endif
 
 	for (;;) {
-		rxc = usb_recv(rxbuffer, 8192);
+		rxc = usb_recv_wait();
+		rxbuf = rxbuffer[rxtoggle];
 
 #if CONFIG_MDEBUG_TRACE
 		int n;
 		printx("[ recv %d words ]\n", rxc/4);
 		for (n = 0; n < (rxc/4); n+=4) {
 			printx("%08x %08x %08x %08x\n",
-				rxbuffer[n], rxbuffer[n+1],
-				rxbuffer[n+2], rxbuffer[n+3]);
+				rxbuf[n], rxbuf[n+1],
+				rxbuf[n+2], rxbuf[n+3]);
 		}
 #endif
 
 		if ((rxc < 4) || (rxc & 3)) {
 			printf("error, runt frame, or strange frame... %d\n", rxc);
-			continue;
+			goto requeue;
 		}
 
 		rxc = rxc / 4;
 
-		if ((rxbuffer[0] & 0xFFFF0000) != 0xAA770000) {
-			printf("invalid frame %x\n", rxbuffer[0]);
-			continue;
+		if ((rxbuf[0] & 0xFFFF0000) != 0xAA770000) {
+			printf("invalid frame %x\n", rxbuf[0]);
+			goto requeue;
 		}
 
-		process_txn(rxbuffer[0], rxbuffer + 1, rxc - 1, txbuffer[toggle]);
+		process_txn(rxbuf[0], rxbuf + 1, rxc - 1, txbuffer[toggle]);
 		toggle ^= 1;
+
+requeue:
+		usb_recv_start(rxbuf, RXBUFFER_SIZE);
+		rxtoggle ^= 1;
 	}
 }
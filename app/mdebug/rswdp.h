@@ -62,6 +62,10 @@
 #define CMD_JTAG_TX	0x0D /* tms=op.0, arg=bitcount, data x (count/32) words of tdi */
 #define CMD_JTAG_RX	0x0E /* tms=op.0, tdi=op.1, arg=bitcount, return (count/32) words */
 #define CMD_JTAG_VRFY	0x0F /* arg=bitcount, tms/tdi data/mask, error if tdo&mask != data */
+#define CMD_MEM_READ	0x40 /* arg=count, payload: addr x 1, return data x count */
+#define CMD_MEM_WRITE	0x41 /* arg=count, payload: addr x 1, data x count */
+			     /* word aligned addr, through the selected MEM-AP's */
+			     /* TAR/DRW, CSW must be set up for 32bit autoincrement */
 
 /* valid: target to host */
 #define CMD_STATUS	0x10 /* op=errorcode, arg=commands since last TXN_START */
@@ -87,11 +91,12 @@
 #define ERR_PARITY	4
 #define ERR_BAD_MATCH	5
 
-#define RSWD_VERSION		0x0102
+#define RSWD_VERSION		0x0103
 
 #define RSWD_VERSION_1_0	0x0100
 #define RSWD_VERSION_1_1	0x0101
 #define RSWD_VERSION_1_2	0x0102
+#define RSWD_VERSION_1_3	0x0103
 
 // Pre-1.0
 //  - max packet size fixed at 2048 bytes
@@ -105,6 +110,11 @@
 //
 // Version 1.2
 // - CMD_JTAG_IO, CMD_JTAG_RX, CMD_JTAG_TX, CMD_JTAG_VRFY, CMD_JTAG_DATA added
+//
+// Version 1.3
+// - CMD_MEM_READ, CMD_MEM_WRITE added, the probe splits them at the
+//   1K boundaries TAR autoincrement is limited to and pipelines the
+//   posted AP reads
 
 /* CMD_SWD_OP operations - combine for direct AP/DP io */
 #define OP_RD 0x00
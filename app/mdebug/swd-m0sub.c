@@ -87,6 +87,19 @@ static unsigned parity(unsigned n) {
 
 #define RSP_BUSY	0xFFFFFFFF
 
+/* hand the command in the comm registers to the m0 */
+static inline void m0_start(void) {
+	writel(RSP_BUSY, COMM_RESP);
+	DSB;
+	asm("sev");
+}
+
+static inline unsigned m0_wait(void) {
+	unsigned n;
+	while ((n = readl(COMM_RESP)) == RSP_BUSY) ;
+	return n;
+}
+
 void swd_init(void) {
 	gpio_init();
 
@@ -119,10 +132,8 @@ int swd_write(unsigned hdr, unsigned data) {
 	writel(M0_CMD_WRITE, COMM_CMD);
 	writel((hdr << 8) | (p << 16), COMM_ARG1);
 	writel(data, COMM_ARG2);
-	writel(RSP_BUSY, COMM_RESP);
-	DSB;
-	asm("sev");
-	while ((n = readl(COMM_RESP)) == RSP_BUSY) ;
+	m0_start();
+	n = m0_wait();
 	//printf("wr s=%d\n", n);
 	return n;
 }
@@ -131,10 +142,8 @@ int swd_read(unsigned hdr, unsigned *val) {
 	unsigned n, data, p;
 	writel(M0_CMD_READ, COMM_CMD);
 	writel(hdr << 8, COMM_ARG1);
-	writel(RSP_BUSY, COMM_RESP);
-	DSB;
-	asm("sev");
-	while ((n = readl(COMM_RESP)) == RSP_BUSY) ;
+	m0_start();
+	n = m0_wait();
 	if (n) {
 		return n;
 	}
@@ -148,26 +157,75 @@ int swd_read(unsigned hdr, unsigned *val) {
 	return 0;
 }
 
+/* The block versions keep the m0 busy back to back: the next write's
+ * parity is worked out while the m0 shifts out the current one, and a
+ * read's result is stored while the next read is on the wire.
+ */
+int swd_write_block(unsigned hdr, const unsigned *val, unsigned count) {
+	unsigned n, data, p;
+	if (count == 0) {
+		return 0;
+	}
+	writel(M0_CMD_WRITE, COMM_CMD);
+	data = *val++;
+	p = parity(data);
+	while (count-- > 0) {
+		writel((hdr << 8) | (p << 16), COMM_ARG1);
+		writel(data, COMM_ARG2);
+		m0_start();
+		if (count > 0) {
+			data = *val++;
+			p = parity(data);
+		}
+		if ((n = m0_wait())) {
+			return n;
+		}
+	}
+	return 0;
+}
+
+int swd_read_block(unsigned hdr, unsigned *val, unsigned count) {
+	unsigned n, data, p;
+	if (count == 0) {
+		return 0;
+	}
+	writel(M0_CMD_READ, COMM_CMD);
+	writel(hdr << 8, COMM_ARG1);
+	m0_start();
+	while (count-- > 0) {
+		if ((n = m0_wait())) {
+			return n;
+		}
+		data = readl(COMM_ARG1);
+		p = readl(COMM_ARG2);
+		// check before starting the next read, a bad word ends the block
+		if (p != parity(data)) {
+			return ERR_PARITY;
+		}
+		if (count > 0) {
+			// the m0 left its result in ARG1, put the header back
+			writel(hdr << 8, COMM_ARG1);
+			m0_start();
+		}
+		*val++ = data;
+	}
+	return 0;
+}
+
 void swd_reset(void) {
-	unsigned n;
 	writel(M0_CMD_RESET, COMM_CMD);
-	writel(RSP_BUSY, COMM_RESP);
-	DSB;
-	asm("sev");
-	while ((n = readl(COMM_RESP)) == RSP_BUSY) ;
+	m0_start();
+	m0_wait();
 }
 
 unsigned swd_set_clock(unsigned khz) {
-	unsigned n;
 	if (khz > 8000) {
 		khz = 8000;
 	}
 	writel(M0_CMD_SETCLOCK, COMM_CMD);
 	writel(khz/1000, COMM_ARG1);
-	writel(RSP_BUSY, COMM_RESP);
-	DSB;
-	asm("sev");
-	while ((n = readl(COMM_RESP)) == RSP_BUSY) ;
+	m0_start();
+	m0_wait();
 
 	// todo: accurate value
 	return khz;
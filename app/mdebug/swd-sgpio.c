@@ -345,6 +345,28 @@ int swd_write(unsigned reg, unsigned val) {
 	return sgpio_swd_write(div, reg, val);
 }
 
+int swd_read_block(unsigned reg, unsigned *val, unsigned count) {
+	unsigned div = sgpio_div;
+	int status = 0;
+	sgpio_swd_clock_setup(div);
+	while (count-- > 0) {
+		if ((status = sgpio_swd_read(div, reg, val++)))
+			break;
+	}
+	return status;
+}
+
+int swd_write_block(unsigned reg, const unsigned *val, unsigned count) {
+	unsigned div = sgpio_div;
+	int status = 0;
+	sgpio_swd_clock_setup(div);
+	while (count-- > 0) {
+		if ((status = sgpio_swd_write(div, reg, *val++)))
+			break;
+	}
+	return status;
+}
+
 unsigned swd_set_clock(unsigned khz) {
 	unsigned div;
 	if (khz < 2000) khz = 2000;
@@ -23,6 +23,10 @@ void swd_reset(void);
 int swd_write(unsigned reg, unsigned val);
 int swd_read(unsigned reg, unsigned *val);
 
+// count transfers to/from the same register, stopping at the first error
+int swd_write_block(unsigned reg, const unsigned *val, unsigned count);
+int swd_read_block(unsigned reg, unsigned *val, unsigned count);
+
 unsigned swd_set_clock(unsigned khz);
 unsigned swo_set_clock(unsigned khz);
 void swd_hw_reset(int assert);
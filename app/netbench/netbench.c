@@ -0,0 +1,522 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <err.h>
+#include <debug.h>
+#include <trace.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <compiler.h>
+#include <kernel/thread.h>
+#include <kernel/event.h>
+#include <lib/minip.h>
+#include <platform.h>
+
+#if defined(WITH_LIB_CONSOLE)
+#include <lib/console.h>
+
+/*
+ * iperf style network benchmarks over minip.
+ *
+ * netbench server starts:
+ *  - a tcp sink on 5001, for "iperf -c <target>" or anything else that just sends
+ *  - a tcp source on 5002 that sends until the peer closes
+ *  - a tcp request/response server on 5003, replying to each read with the same bytes
+ *  - a udp sink on 5001 reading iperf2 datagram headers, for "iperf -c <target> -u",
+ *    counting loss and reordering and estimating jitter (RFC 3550)
+ * each prints a line per second and a summary at the end.
+ *
+ * minip can't open tcp connections, so the clients here are udp only: a paced
+ * sender in iperf2 format and a request/response timer against a udp echo port.
+ */
+
+#define NETBENCH_PORT       5001
+#define NETBENCH_SRC_PORT   5002
+#define NETBENCH_RR_PORT    5003
+#define NETBENCH_BUFSIZE    8192
+
+/* iperf2 udp datagram header, big endian */
+struct netbench_udp_hdr {
+    int32_t id;
+    uint32_t tv_sec;
+    uint32_t tv_usec;
+} __PACKED;
+
+/* throughput over one reporting interval */
+struct netbench_interval {
+    lk_time_ns_t start;
+    lk_time_ns_t last;
+    uint64_t bytes;
+    uint64_t total;
+};
+
+static void interval_start(struct netbench_interval *iv)
+{
+    iv->start = iv->last = current_time_ns();
+    iv->bytes = iv->total = 0;
+}
+
+static uint64_t kbits_per_sec(uint64_t bytes, lk_time_ns_t ns)
+{
+    return ns ? (bytes * 8 * 1000000ULL) / ns : 0;
+}
+
+/* account len bytes, printing the interval once a second has gone by */
+static void interval_add(struct netbench_interval *iv, const char *name, size_t len)
+{
+    iv->bytes += len;
+    iv->total += len;
+
+    lk_time_ns_t now = current_time_ns();
+    if (now - iv->last >= 1000000000ULL) {
+        printf("%s: %3llu s %8llu KB %8llu Kbits/s\n", name, (now - iv->start) / 1000000000ULL,
+               iv->bytes / 1024, kbits_per_sec(iv->bytes, now - iv->last));
+        iv->bytes = 0;
+        iv->last = now;
+    }
+}
+
+static void interval_summary(struct netbench_interval *iv, const char *name)
+{
+    lk_time_ns_t elapsed = current_time_ns() - iv->start;
+
+    printf("%s: total %llu KB in %llu ms, %llu Kbits/s\n", name, iv->total / 1024,
+           elapsed / 1000000, kbits_per_sec(iv->total, elapsed));
+}
+
+static int tcp_sink_worker(void *socket)
+{
+    tcp_socket_t *s = socket;
+    struct netbench_interval iv;
+
+    interval_start(&iv);
+    for (;;) {
+        /* nothing to look at, so leave the data in the socket buffer */
+        iovec_t regions[2];
+        ssize_t ret = tcp_read_peek(s, regions);
+        if (ret <= 0)
+            break;
+        tcp_read_release(s, ret);
+
+        interval_add(&iv, "tcp rx", ret);
+    }
+    interval_summary(&iv, "tcp rx");
+
+    tcp_close(s);
+    return 0;
+}
+
+static int tcp_source_worker(void *socket)
+{
+    tcp_socket_t *s = socket;
+    struct netbench_interval iv;
+
+    uint8_t *buf = malloc(NETBENCH_BUFSIZE);
+    if (!buf) {
+        tcp_close(s);
+        return ERR_NO_MEMORY;
+    }
+    memset(buf, 0x5a, NETBENCH_BUFSIZE);
+
+    interval_start(&iv);
+    for (;;) {
+        ssize_t ret = tcp_write(s, buf, NETBENCH_BUFSIZE);
+        if (ret < 0)
+            break;
+
+        interval_add(&iv, "tcp tx", ret);
+    }
+    interval_summary(&iv, "tcp tx");
+
+    free(buf);
+    tcp_close(s);
+    return 0;
+}
+
+static int tcp_rr_worker(void *socket)
+{
+    tcp_socket_t *s = socket;
+    uint64_t transactions = 0;
+    uint64_t interval = 0;
+
+    /* a reply read in pieces shouldn't wait on the ack for the first of them */
+    tcp_set_option(s, TCP_OPT_NODELAY, 1);
+
+    uint8_t *buf = malloc(NETBENCH_BUFSIZE);
+    if (!buf) {
+        tcp_close(s);
+        return ERR_NO_MEMORY;
+    }
+
+    lk_time_ns_t start = current_time_ns();
+    lk_time_ns_t last = start;
+    for (;;) {
+        ssize_t ret = tcp_read(s, buf, NETBENCH_BUFSIZE);
+        if (ret <= 0)
+            break;
+        if (tcp_write(s, buf, ret) < 0)
+            break;
+
+        transactions++;
+        interval++;
+
+        lk_time_ns_t now = current_time_ns();
+        if (now - last >= 1000000000ULL) {
+            printf("tcp rr: %3llu s %8llu trans/s\n", (now - start) / 1000000000ULL,
+                   interval * 1000000000ULL / (now - last));
+            interval = 0;
+            last = now;
+        }
+    }
+
+    lk_time_ns_t elapsed = current_time_ns() - start;
+    printf("tcp rr: %llu transactions in %llu ms, %llu trans/s\n", transactions,
+           elapsed / 1000000, elapsed ? transactions * 1000000000ULL / elapsed : 0);
+
+    free(buf);
+    tcp_close(s);
+    return 0;
+}
+
+struct tcp_server {
+    uint16_t port;
+    const char *name;
+    thread_start_routine worker;
+};
+
+static int tcp_server_thread(void *arg)
+{
+    const struct tcp_server *server = arg;
+    tcp_socket_t *listen_socket;
+
+    status_t err = tcp_open_listen(&listen_socket, server->port);
+    if (err < 0) {
+        printf("error %d listening on tcp port %u\n", err, server->port);
+        return err;
+    }
+
+    for (;;) {
+        tcp_socket_t *accept_socket;
+
+        err = tcp_accept(listen_socket, &accept_socket);
+        if (err < 0)
+            continue;
+
+        thread_detach_and_resume(thread_create(server->name, server->worker, accept_socket,
+                                               DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
+    }
+
+    return 0;
+}
+
+static const struct tcp_server tcp_servers[] = {
+    { NETBENCH_PORT, "netbench sink", &tcp_sink_worker },
+    { NETBENCH_SRC_PORT, "netbench source", &tcp_source_worker },
+    { NETBENCH_RR_PORT, "netbench rr", &tcp_rr_worker },
+};
+
+/* udp sink state, only touched from the rx path */
+static struct {
+    bool running;
+    struct netbench_interval iv;
+    int32_t next_id;
+    uint64_t received;
+    uint64_t lost;
+    uint64_t out_of_order;
+    int64_t last_transit;
+    int64_t jitter;     /* ns, scaled by 16 */
+} udp_sink;
+
+static void udp_sink_summary(void)
+{
+    uint64_t expected = udp_sink.received + udp_sink.lost;
+
+    interval_summary(&udp_sink.iv, "udp rx");
+    printf("udp rx: %llu datagrams, %llu lost (%llu.%02llu%%), %llu out of order, jitter %llu us\n",
+           udp_sink.received, udp_sink.lost,
+           expected ? udp_sink.lost * 100 / expected : 0,
+           expected ? (udp_sink.lost * 10000 / expected) % 100 : 0,
+           udp_sink.out_of_order, (uint64_t)(udp_sink.jitter / 16) / 1000);
+}
+
+static void udp_sink_callback(void *data, size_t len, uint32_t srcaddr, uint16_t srcport, void *arg)
+{
+    const struct netbench_udp_hdr *hdr = data;
+
+    if (len < sizeof(*hdr))
+        return;
+
+    int32_t id = ntohl(hdr->id);
+    lk_time_ns_t now = current_time_ns();
+
+    if (!udp_sink.running) {
+        if (id < 0)
+            return;
+
+        memset(&udp_sink, 0, sizeof(udp_sink));
+        udp_sink.running = true;
+        interval_start(&udp_sink.iv);
+        printf("udp rx: stream from %u.%u.%u.%u:%u\n", IPV4_SPLIT(srcaddr), srcport);
+    }
+
+    /* the sender marks the end of the stream with a negative id */
+    if (id < 0) {
+        udp_sink_summary();
+        udp_sink.running = false;
+        return;
+    }
+
+    udp_sink.received++;
+    if (id >= udp_sink.next_id) {
+        udp_sink.lost += id - udp_sink.next_id;
+        udp_sink.next_id = id + 1;
+    } else {
+        /* a late one we already counted as lost */
+        udp_sink.out_of_order++;
+        if (udp_sink.lost)
+            udp_sink.lost--;
+    }
+
+    /* the clocks aren't synchronized, but only the change in transit time matters */
+    int64_t sent = (int64_t)ntohl(hdr->tv_sec) * 1000000000LL + (int64_t)ntohl(hdr->tv_usec) * 1000;
+    int64_t transit = (int64_t)now - sent;
+    if (udp_sink.received > 1) {
+        int64_t d = transit - udp_sink.last_transit;
+        if (d < 0)
+            d = -d;
+        udp_sink.jitter += d - (udp_sink.jitter + 8) / 16;
+    }
+    udp_sink.last_transit = transit;
+
+    interval_add(&udp_sink.iv, "udp rx", len);
+}
+
+static status_t netbench_server(void)
+{
+    static bool started;
+
+    if (started) {
+        printf("already running\n");
+        return ERR_ALREADY_STARTED;
+    }
+    started = true;
+
+    for (uint i = 0; i < countof(tcp_servers); i++) {
+        thread_detach_and_resume(thread_create("netbench server", &tcp_server_thread,
+                                               (void *)&tcp_servers[i], DEFAULT_PRIORITY,
+                                               DEFAULT_STACK_SIZE));
+    }
+    udp_listen(NETBENCH_PORT, &udp_sink_callback, NULL);
+
+    printf("netbench: tcp sink %u, tcp source %u, tcp rr %u, udp sink %u\n",
+           NETBENCH_PORT, NETBENCH_SRC_PORT, NETBENCH_RR_PORT, NETBENCH_PORT);
+    return NO_ERROR;
+}
+
+/* send iperf2 format datagrams at a fixed rate */
+static status_t netbench_udp_client(uint32_t host, uint16_t port, uint32_t kbits, size_t len, uint secs)
+{
+    udp_socket_t *s;
+
+    if (len < sizeof(struct netbench_udp_hdr) || len > 1472 || kbits == 0)
+        return ERR_INVALID_ARGS;
+
+    status_t err = udp_open(host, NETBENCH_PORT, port, &s);
+    if (err < 0)
+        return err;
+
+    uint8_t *buf = calloc(1, len);
+    if (!buf) {
+        udp_close(s);
+        return ERR_NO_MEMORY;
+    }
+    struct netbench_udp_hdr *hdr = (struct netbench_udp_hdr *)buf;
+
+    lk_time_ns_t gap = (uint64_t)len * 8 * 1000000ULL / kbits;
+    lk_time_ns_t start = current_time_ns();
+    lk_time_ns_t end = start + (lk_time_ns_t)secs * 1000000000ULL;
+    lk_time_ns_t next = start;
+    struct netbench_interval iv;
+    int32_t id = 0;
+    uint64_t errors = 0;
+
+    interval_start(&iv);
+    for (;;) {
+        lk_time_ns_t now = current_time_ns();
+        if (now >= end)
+            break;
+
+        /* sleep off long gaps, spin through short ones */
+        if (next > now) {
+            if (next - now >= 2000000)
+                thread_sleep((next - now) / 1000000 - 1);
+            continue;
+        }
+
+        hdr->id = htonl(id);
+        id++;
+        hdr->tv_sec = htonl(now / 1000000000ULL);
+        hdr->tv_usec = htonl((now % 1000000000ULL) / 1000);
+        if (udp_send(buf, len, s) < 0)
+            errors++;
+        else
+            interval_add(&iv, "udp tx", len);
+
+        next += gap;
+    }
+    interval_summary(&iv, "udp tx");
+    printf("udp tx: %d datagrams, %llu send errors\n", id, errors);
+
+    /* end of stream marker */
+    lk_time_ns_t now = current_time_ns();
+    hdr->id = htonl(-id);
+    hdr->tv_sec = htonl(now / 1000000000ULL);
+    hdr->tv_usec = htonl((now % 1000000000ULL) / 1000);
+    udp_send(buf, len, s);
+
+    free(buf);
+    udp_close(s);
+    return NO_ERROR;
+}
+
+/* udp request/response, the reply comes back to the port we send from */
+static struct {
+    event_t event;
+    uint32_t seq;
+} udp_rr;
+
+static void udp_rr_callback(void *data, size_t len, uint32_t srcaddr, uint16_t srcport, void *arg)
+{
+    if (len >= sizeof(uint32_t) && *(uint32_t *)data == udp_rr.seq)
+        event_signal(&udp_rr.event, true);
+}
+
+static int netbench_lat_cmp(const void *a, const void *b)
+{
+    lk_time_ns_t x = *(const lk_time_ns_t *)a;
+    lk_time_ns_t y = *(const lk_time_ns_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static status_t netbench_udp_rr(uint32_t host, uint16_t port, size_t len, uint count)
+{
+    udp_socket_t *s;
+
+    if (len < sizeof(uint32_t) || len > 1472 || count == 0)
+        return ERR_INVALID_ARGS;
+
+    uint8_t *buf = calloc(1, len);
+    lk_time_ns_t *lat = malloc(count * sizeof(lk_time_ns_t));
+    if (!buf || !lat) {
+        free(buf);
+        free(lat);
+        return ERR_NO_MEMORY;
+    }
+
+    status_t err = udp_open(host, NETBENCH_RR_PORT, port, &s);
+    if (err < 0)
+        goto out;
+
+    event_init(&udp_rr.event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    udp_listen(NETBENCH_RR_PORT, &udp_rr_callback, NULL);
+
+    uint done = 0;
+    uint timeouts = 0;
+    for (uint i = 0; i < count; i++) {
+        udp_rr.seq = i + 1;
+        memcpy(buf, &udp_rr.seq, sizeof(udp_rr.seq));
+
+        lk_time_ns_t t = current_time_ns();
+        if (udp_send(buf, len, s) < 0 || event_wait_timeout(&udp_rr.event, 1000) < 0) {
+            timeouts++;
+            continue;
+        }
+        lat[done++] = current_time_ns() - t;
+    }
+
+    udp_listen(NETBENCH_RR_PORT, NULL, NULL);
+    udp_rr.seq = 0;
+    event_destroy(&udp_rr.event);
+    udp_close(s);
+
+    printf("udp rr: %u of %u answered\n", done, count);
+    if (done > 0) {
+        qsort(lat, done, sizeof(lk_time_ns_t), netbench_lat_cmp);
+        printf("udp rr: rtt usecs min %llu p50 %llu p99 %llu max %llu\n",
+               lat[0] / 1000, lat[done / 2] / 1000, lat[(done * 99) / 100] / 1000,
+               lat[done - 1] / 1000);
+    }
+
+out:
+    free(lat);
+    free(buf);
+    return err;
+}
+
+static int cmd_netbench(int argc, const cmd_args *argv)
+{
+    status_t err;
+
+    if (argc < 2) {
+usage:
+        printf("usage:\n");
+        printf("%s server\n", argv[0].str);
+        printf("%s udp <host> <port> <kbits/s> [length] [secs]\n", argv[0].str);
+        printf("%s udprr <host> <port> [length] [count]\n", argv[0].str);
+        return ERR_INVALID_ARGS;
+    }
+
+    if (!strcmp(argv[1].str, "server")) {
+        err = netbench_server();
+    } else if (!strcmp(argv[1].str, "udp")) {
+        if (argc < 5)
+            goto usage;
+
+        uint32_t host = minip_parse_ipaddr(argv[2].str, strlen(argv[2].str));
+        err = netbench_udp_client(host, argv[3].u, argv[4].u,
+                                  (argc > 5) ? argv[5].u : 1470,
+                                  (argc > 6) ? argv[6].u : 10);
+    } else if (!strcmp(argv[1].str, "udprr")) {
+        if (argc < 4)
+            goto usage;
+
+        uint32_t host = minip_parse_ipaddr(argv[2].str, strlen(argv[2].str));
+        err = netbench_udp_rr(host, argv[3].u,
+                              (argc > 4) ? argv[4].u : 64,
+                              (argc > 5) ? argv[5].u : 1000);
+    } else {
+        goto usage;
+    }
+
+    if (err < 0)
+        printf("error %d\n", err);
+    return err;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("netbench", "network throughput and latency benchmarks", &cmd_netbench)
+STATIC_COMMAND_END(netbench);
+
+#endif
@@ -0,0 +1,11 @@
+LOCAL_DIR := $(GET_LOCAL_DIR)
+
+MODULE := $(LOCAL_DIR)
+
+MODULE_SRCS += \
+	$(LOCAL_DIR)/netbench.c \
+
+MODULE_DEPS := \
+    lib/minip \
+
+include make/module.mk
@@ -32,6 +32,9 @@
 #include <kernel/semaphore.h>
 #include <kernel/event.h>
 #include <platform.h>
+#if WITH_LIB_DVFS
+#include <lib/dvfs.h>
+#endif
 
 const size_t BUFSIZE = (1024*1024);
 const uint ITER = 1024;
@@ -245,9 +248,63 @@ __NO_INLINE static void bench_sincos(void)
     printf("took %u cycles for sqrtf()\n", count);
 }
 
+#define VMATH_COUNT 1024
+
+/* libm only has double exp and log, which is what callers use today */
+static float bench_exp(float x) { return exp(x); }
+static float bench_log(float x) { return log(x); }
+
+__NO_INLINE static void bench_vmath_one(const char *name, float (*scalar)(float),
+                                        void (*batch)(float *, const float *, size_t),
+                                        float *out, const float *in)
+{
+    uint count = arch_cycle_count();
+    for (uint i = 0; i < VMATH_COUNT; i++)
+        out[i] = scalar(in[i]);
+    uint scalar_count = arch_cycle_count() - count;
+
+    count = arch_cycle_count();
+    batch(out, in, VMATH_COUNT);
+    count = arch_cycle_count() - count;
+
+    printf("took %u cycles for %u %s(), %u cycles for v%s() (%u.%02ux)\n",
+           scalar_count, VMATH_COUNT, name, count, name,
+           scalar_count / MAX(count, 1u), (scalar_count % MAX(count, 1u)) * 100 / MAX(count, 1u));
+}
+
+__NO_INLINE static void bench_vmath(void)
+{
+    float *in = malloc(VMATH_COUNT * sizeof(float));
+    float *pos = malloc(VMATH_COUNT * sizeof(float));
+    float *out = malloc(VMATH_COUNT * sizeof(float));
+    if (!in || !pos || !out) {
+        printf("failed to allocate buffer\n");
+        goto out;
+    }
+
+    /* [-4, 4) for the trig and exp, (0, 8] for log */
+    for (uint i = 0; i < VMATH_COUNT; i++) {
+        in[i] = (float)(int)(i - VMATH_COUNT / 2) * (8.0f / VMATH_COUNT);
+        pos[i] = (float)(i + 1) * (8.0f / VMATH_COUNT);
+    }
+
+    /* warm up the fpu and the caches */
+    vsinf(out, in, VMATH_COUNT);
+
+    bench_vmath_one("sinf", sinf, vsinf, out, in);
+    bench_vmath_one("cosf", cosf, vcosf, out, in);
+    bench_vmath_one("expf", bench_exp, vexpf, out, in);
+    bench_vmath_one("logf", bench_log, vlogf, out, pos);
+
+out:
+    free(in);
+    free(pos);
+    free(out);
+}
+
 #endif // WITH_LIB_LIBM
 
-void benchmarks(void)
+static void memory_benchmarks(void)
 {
     bench_set_overhead();
     bench_memset();
@@ -268,6 +325,38 @@ void benchmarks(void)
 #endif
 #if WITH_LIB_LIBM
     bench_sincos();
+    bench_vmath();
 #endif
 }
 
+int benchmarks(int argc, const cmd_args *argv)
+{
+    const char *name = (argc > 1) ? argv[1].str : NULL;
+    uint count = (argc > 2) ? argv[2].u : 0;
+
+    if (name && !strcmp(name, "help")) {
+        printf("usage: %s [mem|thread|yield|switch|sync|contend|timer|port] [samples]\n", argv[0].str);
+        return NO_ERROR;
+    }
+
+#if WITH_LIB_DVFS
+    /* numbers are only comparable at a fixed clock */
+    dvfs_hold_max();
+#endif
+
+    status_t err = NO_ERROR;
+    if (!name || !strcmp(name, "mem"))
+        memory_benchmarks();
+
+    if (!name || strcmp(name, "mem")) {
+        err = kernel_benchmarks(name, count);
+        if (err == ERR_NOT_FOUND)
+            printf("unknown benchmark '%s'\n", name);
+    }
+
+#if WITH_LIB_DVFS
+    dvfs_release_max();
+#endif
+
+    return err;
+}
@@ -1,11 +1,13 @@
 #include <assert.h>
 #include <debug.h>
 #include <err.h>
+#include <kernel/thread.h>
 #include <lib/cbuf.h>
 #include <lib/console.h>
 #include <lib/heap.h>
 #include <rand.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define ASSERT_EQ(a, b)                                            \
     do {                                                           \
@@ -25,6 +27,89 @@
         }                                                              \
     } while (0);
 
+#define SPSC_TEST_BYTES (64 * 1024)
+
+/* fills the cbuf in place through cbuf_reserve, in odd sized chunks */
+static int spsc_producer(void *arg)
+{
+    cbuf_t *cbuf = (cbuf_t *)arg;
+    uint pos = 0;
+
+    while (pos < SPSC_TEST_BYTES) {
+        iovec_t regions[2];
+        size_t avail = cbuf_reserve(cbuf, regions);
+        if (avail == 0) {
+            thread_yield();
+            continue;
+        }
+
+        size_t len = (rand() % 61) + 1;
+        len = MIN(len, avail);
+        len = MIN(len, (size_t)(SPSC_TEST_BYTES - pos));
+        size_t done = 0;
+        for (uint r = 0; r < 2 && done < len; r++) {
+            size_t chunk = MIN(regions[r].iov_len, len - done);
+            for (size_t i = 0; i < chunk; i++)
+                ((uint8_t *)regions[r].iov_base)[i] = (uint8_t)(pos + done + i);
+            done += chunk;
+        }
+
+        cbuf_commit(cbuf, len, false);
+        pos += len;
+    }
+
+    return 0;
+}
+
+static void spsc_tests(void)
+{
+    cbuf_t cbuf;
+
+    printf("running spsc tests...\n");
+
+    cbuf_initialize_flags(&cbuf, 64, NULL, CBUF_FLAG_SPSC);
+
+    // Reserve hands out the free space in the order it will be read.
+    {
+        iovec_t regions[2];
+        char buf[64];
+
+        ASSERT_EQ(40, cbuf_write(&cbuf, NULL, 40, false));
+        ASSERT_EQ(40, cbuf_read(&cbuf, NULL, 40, false));
+
+        ASSERT_EQ(63, cbuf_reserve(&cbuf, regions));
+        ASSERT_EQ(24, regions[0].iov_len);
+        ASSERT_EQ(39, regions[1].iov_len);
+        memcpy(regions[0].iov_base, "0123456789abcdefghijklmn", 24);
+        memcpy(regions[1].iov_base, "opq", 3);
+        cbuf_commit(&cbuf, 27, false);
+
+        ASSERT_EQ(27, cbuf_space_used(&cbuf));
+        ASSERT_EQ(27, cbuf_read(&cbuf, buf, sizeof(buf), false));
+        ASSERT_EQ(0, memcmp(buf, "0123456789abcdefghijklmnopq", 27));
+    }
+
+    // One thread filling it in place while this one drains it with blocking reads.
+    thread_t *t = thread_create("spsc producer", &spsc_producer, &cbuf,
+                                DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+    thread_resume(t);
+
+    uint pos = 0;
+    while (pos < SPSC_TEST_BYTES) {
+        uint8_t buf[32];
+        size_t want = (rand() % sizeof(buf)) + 1;
+        size_t len = cbuf_read(&cbuf, buf, want, true);
+        for (size_t i = 0; i < len; i++)
+            ASSERT_EQ((uint8_t)(pos + i), buf[i]);
+        pos += len;
+    }
+
+    thread_join(t, NULL, INFINITE_TIME);
+    ASSERT_EQ(0, cbuf_space_used(&cbuf));
+
+    free(cbuf.buf);
+}
+
 int cbuf_tests(int argc, const cmd_args *argv)
 {
     cbuf_t cbuf;
@@ -69,6 +154,29 @@ int cbuf_tests(int argc, const cmd_args *argv)
 
     ASSERT_EQ(15, cbuf_space_avail(&cbuf));
 
+    // Write ahead of a gap, wrapping around the end, then fill the gap.
+    {
+        char buf[16];
+        ASSERT_EQ(12, cbuf_write(&cbuf, "xxxxxxxxxxxx", 12, false));
+        ASSERT_EQ(12, cbuf_read(&cbuf, buf, 12, false));
+
+        ASSERT_EQ(4, cbuf_write_ahead(&cbuf, 3, "defg", 4));
+        ASSERT_EQ(0, cbuf_space_used(&cbuf));
+        // Only the free space can be written, 15 bytes with nothing used.
+        ASSERT_EQ(2, cbuf_write_ahead(&cbuf, 13, "nopq", 4));
+        ASSERT_EQ(0, cbuf_write_ahead(&cbuf, 15, "r", 1));
+
+        ASSERT_EQ(3, cbuf_write(&cbuf, "abc", 3, false));
+        cbuf_commit(&cbuf, 4, false);
+        ASSERT_EQ(7, cbuf_space_used(&cbuf));
+        ASSERT_EQ(7, cbuf_read(&cbuf, buf, 16, false));
+        for (int i = 0; i < 7; ++i) {
+            ASSERT_EQ(buf[i], 'a' + i);
+        }
+    }
+
+    cbuf_reset(&cbuf);
+
     // Random tests. Keep writing in random chunks up to 8 bytes, then
     // reading in chunks up to 8 bytes. Verify values.
 
@@ -110,6 +218,8 @@ int cbuf_tests(int argc, const cmd_args *argv)
 
     free(cbuf.buf);
 
+    spsc_tests();
+
     printf("cbuf tests passed\n");
 
     return NO_ERROR;
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <kernel/thread.h>
+#include <lib/console.h>
+#include <lib/fiber.h>
+#include <platform.h>
+#include <stdio.h>
+
+#define FIBERS 16
+#define ROUNDS 100
+
+static uint turns[FIBERS];
+static uint last;
+static fiber_t *sleeper;
+
+// Fibers take turns strictly in order, each one's turn comes after the last.
+static void round_robin_fiber(void *arg)
+{
+    uint id = (uintptr_t)arg;
+
+    for (uint i = 0; i < ROUNDS; i++) {
+        if (last != (id + FIBERS - 1) % FIBERS)
+            panic("fiber %u ran out of turn after %u\n", id, last);
+        last = id;
+        turns[id]++;
+        fiber_yield();
+    }
+}
+
+static int waker_thread(void *arg)
+{
+    thread_sleep(10);
+    fiber_wake(sleeper);
+    return 0;
+}
+
+static void main_fiber(void *arg)
+{
+    last = FIBERS - 1;
+    for (uint i = 0; i < FIBERS; i++) {
+        if (!fiber_create("rr", round_robin_fiber, (void *)(uintptr_t)i, 0))
+            panic("fiber create failed\n");
+    }
+
+    // Everyone else gets to finish while we sleep.
+    lk_time_t t = current_time();
+    fiber_sleep(50);
+    if (current_time() - t < 50)
+        panic("fiber_sleep returned early\n");
+    for (uint i = 0; i < FIBERS; i++) {
+        if (turns[i] != ROUNDS)
+            panic("fiber %u only had %u turns\n", i, turns[i]);
+    }
+
+    // Woken from another thread.
+    sleeper = fiber_current();
+    thread_detach_and_resume(thread_create("waker", waker_thread, NULL, DEFAULT_PRIORITY,
+                                           DEFAULT_STACK_SIZE));
+    if (fiber_wait(1000) != NO_ERROR)
+        panic("fiber_wait timed out\n");
+
+    // A wake that comes first isn't lost, and a timeout still times out.
+    fiber_wake(fiber_current());
+    if (fiber_wait(0) != NO_ERROR)
+        panic("early wake lost\n");
+    if (fiber_wait(5) != ERR_TIMED_OUT)
+        panic("fiber_wait didn't time out\n");
+}
+
+int fiber_tests(int argc, const cmd_args *argv)
+{
+    printf("running fiber tests...\n");
+
+    status_t err = fiber_run(main_fiber, NULL, 0);
+    if (err < 0)
+        panic("fiber_run returned %d\n", err);
+    if (fiber_current())
+        panic("still on a fiber\n");
+
+    printf("fiber tests passed\n");
+
+    return NO_ERROR;
+}
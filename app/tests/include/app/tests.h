@@ -26,11 +26,16 @@
 #include <lib/console.h>
 
 int cbuf_tests(int argc, const cmd_args *argv);
+int fiber_tests(int argc, const cmd_args *argv);
 int fibo(int argc, const cmd_args *argv);
 int port_tests(void);
+int slab_tests(int argc, const cmd_args *argv);
 int spinner(int argc, const cmd_args *argv);
 int thread_tests(void);
-void benchmarks(void);
+int workqueue_tests(int argc, const cmd_args *argv);
+int benchmarks(int argc, const cmd_args *argv);
+int kernel_benchmarks(const char *name, uint count);
+int mem_benchmarks(int argc, const cmd_args *argv);
 void clock_tests(void);
 void printf_tests(void);
 void printf_tests_float(void);
@@ -0,0 +1,420 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <sys/types.h>
+#include <stdio.h>
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <app/tests.h>
+#include <arch/ops.h>
+#include <kernel/thread.h>
+#include <kernel/mutex.h>
+#include <kernel/semaphore.h>
+#include <kernel/event.h>
+#include <kernel/timer.h>
+#include <kernel/port.h>
+#include <kernel/mp.h>
+#include <platform.h>
+
+/*
+ * Microbenchmarks of the kernel primitives. Each one takes a number of
+ * samples of a single operation, timed with the cycle counter unless noted,
+ * and reports the distribution rather than an average.
+ */
+
+#define DEFAULT_SAMPLES 1000
+
+static uint32_t *samples;
+static uint nsamples;
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void report(const char *name, const char *unit)
+{
+    qsort(samples, nsamples, sizeof(uint32_t), cmp_u32);
+
+    printf("%-32s min %8u median %8u p99 %8u max %8u %s\n", name,
+           samples[0], samples[nsamples / 2], samples[(nsamples * 99) / 100], samples[nsamples - 1], unit);
+}
+
+/* pin the calling thread to a cpu and make sure it's running there, returns the old affinity */
+static mp_cpu_mask_t pin_self(int cpu)
+{
+    mp_cpu_mask_t saved = thread_cpu_affinity(get_current_thread());
+
+    thread_set_pinned_cpu(get_current_thread(), cpu);
+    thread_yield();
+    return saved;
+}
+
+static void unpin_self(mp_cpu_mask_t saved)
+{
+    thread_set_cpu_affinity_mask(get_current_thread(), saved);
+}
+
+static int empty_thread(void *arg)
+{
+    return 0;
+}
+
+static void bench_thread_create_join(void)
+{
+    for (uint i = 0; i < nsamples; i++) {
+        uint32_t t = arch_cycle_count();
+        thread_t *thr = thread_create("bench", &empty_thread, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_resume(thr);
+        thread_join(thr, NULL, INFINITE_TIME);
+        samples[i] = arch_cycle_count() - t;
+    }
+    report("thread create/resume/join", "cycles");
+}
+
+static void bench_yield(void)
+{
+    for (uint i = 0; i < nsamples; i++) {
+        uint32_t t = arch_cycle_count();
+        thread_yield();
+        samples[i] = arch_cycle_count() - t;
+    }
+    report("thread yield (nothing else runnable)", "cycles");
+}
+
+/* the other half of the ping-pong tests, bounces ping back as pong */
+struct pingpong {
+    event_t ping;
+    event_t pong;
+    bool done;
+};
+
+static int pingpong_thread(void *arg)
+{
+    struct pingpong *pp = (struct pingpong *)arg;
+
+    for (;;) {
+        event_wait(&pp->ping);
+        if (pp->done)
+            break;
+        event_signal(&pp->pong, true);
+    }
+
+    return 0;
+}
+
+/* round trip through another thread, on the given cpu (or -1 for our own) */
+static void bench_pingpong(int cpu, const char *name)
+{
+    struct pingpong pp;
+
+    event_init(&pp.ping, false, EVENT_FLAG_AUTOUNSIGNAL);
+    event_init(&pp.pong, false, EVENT_FLAG_AUTOUNSIGNAL);
+    pp.done = false;
+
+    thread_t *thr = thread_create("pingpong", &pingpong_thread, &pp, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+    thread_set_pinned_cpu(thr, (cpu < 0) ? (int)arch_curr_cpu_num() : cpu);
+    thread_resume(thr);
+
+    for (uint i = 0; i < nsamples; i++) {
+        uint32_t t = arch_cycle_count();
+        event_signal(&pp.ping, true);
+        event_wait(&pp.pong);
+        samples[i] = arch_cycle_count() - t;
+    }
+
+    pp.done = true;
+    event_signal(&pp.ping, true);
+    thread_join(thr, NULL, INFINITE_TIME);
+    event_destroy(&pp.ping);
+    event_destroy(&pp.pong);
+
+    report(name, "cycles");
+}
+
+static void bench_context_switch(void)
+{
+    __UNUSED mp_cpu_mask_t saved = pin_self(0);
+
+    bench_pingpong(-1, "event round trip, same cpu");
+
+#if WITH_SMP
+    for (uint cpu = 1; cpu < SMP_MAX_CPUS; cpu++) {
+        if (!mp_is_cpu_active(cpu))
+            continue;
+
+        /* waking a thread on another cpu goes through a reschedule ipi */
+        char name[48];
+        snprintf(name, sizeof(name), "event round trip, cpu 0 <-> %u (ipi)", cpu);
+        bench_pingpong(cpu, name);
+    }
+#endif
+
+    unpin_self(saved);
+}
+
+static void bench_uncontended(void)
+{
+    mutex_t m;
+    semaphore_t s;
+    event_t e;
+
+    mutex_init(&m);
+    for (uint i = 0; i < nsamples; i++) {
+        uint32_t t = arch_cycle_count();
+        mutex_acquire(&m);
+        mutex_release(&m);
+        samples[i] = arch_cycle_count() - t;
+    }
+    report("mutex acquire/release", "cycles");
+    mutex_destroy(&m);
+
+    sem_init(&s, 0);
+    for (uint i = 0; i < nsamples; i++) {
+        uint32_t t = arch_cycle_count();
+        sem_post(&s, false);
+        sem_wait(&s);
+        samples[i] = arch_cycle_count() - t;
+    }
+    report("semaphore post/wait", "cycles");
+    sem_destroy(&s);
+
+    event_init(&e, false, EVENT_FLAG_AUTOUNSIGNAL);
+    for (uint i = 0; i < nsamples; i++) {
+        uint32_t t = arch_cycle_count();
+        event_signal(&e, false);
+        event_wait(&e);
+        samples[i] = arch_cycle_count() - t;
+    }
+    report("event signal/wait", "cycles");
+    event_destroy(&e);
+}
+
+struct contended {
+    mutex_t m;
+    semaphore_t s;
+    event_t go;
+    bool done;
+};
+
+/* higher priority than us, so it runs as soon as it's woken */
+static int contended_mutex_thread(void *arg)
+{
+    struct contended *c = (struct contended *)arg;
+
+    for (;;) {
+        event_wait(&c->go);
+        if (c->done)
+            break;
+        mutex_acquire(&c->m);
+        mutex_release(&c->m);
+    }
+
+    return 0;
+}
+
+static int contended_sem_thread(void *arg)
+{
+    struct contended *c = (struct contended *)arg;
+
+    for (;;) {
+        sem_wait(&c->s);
+        if (c->done)
+            break;
+    }
+
+    return 0;
+}
+
+static void bench_contended(void)
+{
+    struct contended c;
+    thread_t *thr;
+
+    __UNUSED mp_cpu_mask_t saved = pin_self(0);
+
+    mutex_init(&c.m);
+    sem_init(&c.s, 0);
+    event_init(&c.go, false, EVENT_FLAG_AUTOUNSIGNAL);
+    c.done = false;
+
+    /* release a mutex another thread is blocked on, until that thread has had it and let go */
+    thr = thread_create("contend", &contended_mutex_thread, &c, DEFAULT_PRIORITY + 1, DEFAULT_STACK_SIZE);
+    thread_set_pinned_cpu(thr, 0);
+    thread_resume(thr);
+    for (uint i = 0; i < nsamples; i++) {
+        mutex_acquire(&c.m);
+        event_signal(&c.go, true); /* it runs and blocks on the mutex */
+
+        uint32_t t = arch_cycle_count();
+        mutex_release(&c.m);
+        samples[i] = arch_cycle_count() - t;
+    }
+    c.done = true;
+    event_signal(&c.go, true);
+    thread_join(thr, NULL, INFINITE_TIME);
+    report("mutex release to a waiter", "cycles");
+
+    /* post to a semaphore another thread is blocked on */
+    c.done = false;
+    thr = thread_create("contend", &contended_sem_thread, &c, DEFAULT_PRIORITY + 1, DEFAULT_STACK_SIZE);
+    thread_set_pinned_cpu(thr, 0);
+    thread_resume(thr);
+    for (uint i = 0; i < nsamples; i++) {
+        uint32_t t = arch_cycle_count();
+        sem_post(&c.s, true);
+        samples[i] = arch_cycle_count() - t;
+    }
+    c.done = true;
+    sem_post(&c.s, true);
+    thread_join(thr, NULL, INFINITE_TIME);
+    report("semaphore post to a waiter", "cycles");
+
+    event_destroy(&c.go);
+    sem_destroy(&c.s);
+    mutex_destroy(&c.m);
+
+    unpin_self(saved);
+}
+
+struct timer_fire {
+    event_t fired;
+    lk_time_ns_t when;
+};
+
+static enum handler_return timer_fire_cb(timer_t *t, lk_time_t now, void *arg)
+{
+    struct timer_fire *tf = (struct timer_fire *)arg;
+
+    tf->when = current_time_ns();
+    event_signal(&tf->fired, false);
+    return INT_RESCHEDULE;
+}
+
+static enum handler_return timer_nop_cb(timer_t *t, lk_time_t now, void *arg)
+{
+    return INT_NO_RESCHEDULE;
+}
+
+static void bench_timer(void)
+{
+    timer_t t;
+    uint32_t *cancel = malloc(nsamples * sizeof(uint32_t));
+    if (!cancel)
+        return;
+
+    timer_initialize(&t);
+    for (uint i = 0; i < nsamples; i++) {
+        uint32_t c = arch_cycle_count();
+        timer_set_oneshot(&t, 1000, &timer_nop_cb, NULL);
+        uint32_t c2 = arch_cycle_count();
+        timer_cancel(&t);
+        cancel[i] = arch_cycle_count() - c2;
+        samples[i] = c2 - c;
+    }
+    report("timer arm", "cycles");
+    memcpy(samples, cancel, nsamples * sizeof(uint32_t));
+    report("timer cancel", "cycles");
+    free(cancel);
+
+    /* how late a 1ms timer fires, in ns, so it's comparable across clock rates */
+    struct timer_fire tf;
+    event_init(&tf.fired, false, EVENT_FLAG_AUTOUNSIGNAL);
+    uint count = MIN(nsamples, 200u);
+    for (uint i = 0; i < count; i++) {
+        lk_time_ns_t deadline = current_time_ns() + 1000000;
+        timer_set_oneshot_ns(&t, 1000000, &timer_fire_cb, &tf);
+        event_wait(&tf.fired);
+        samples[i] = (tf.when > deadline) ? (uint32_t)(tf.when - deadline) : 0;
+    }
+    event_destroy(&tf.fired);
+
+    uint saved = nsamples;
+    nsamples = count;
+    report("timer fire latency (1ms oneshot)", "ns");
+    nsamples = saved;
+}
+
+static void bench_port(void)
+{
+    port_t w, r;
+    port_result_t res;
+    port_packet_t pk = {{ 0 }};
+
+    if (port_create("bench", PORT_MODE_UNICAST, &w) < 0)
+        return;
+    if (port_open("bench", NULL, &r) < 0) {
+        port_destroy(w);
+        return;
+    }
+
+    for (uint i = 0; i < nsamples; i++) {
+        uint32_t t = arch_cycle_count();
+        port_write(w, &pk, 1);
+        port_read(r, 0, &res);
+        samples[i] = arch_cycle_count() - t;
+    }
+    report("port write/read", "cycles");
+
+    port_close(r);
+    port_destroy(w);
+}
+
+static const struct {
+    const char *name;
+    void (*func)(void);
+} kernel_benches[] = {
+    { "thread", bench_thread_create_join },
+    { "yield", bench_yield },
+    { "switch", bench_context_switch },
+    { "sync", bench_uncontended },
+    { "contend", bench_contended },
+    { "timer", bench_timer },
+    { "port", bench_port },
+};
+
+/* run the named kernel benchmark, or all of them for NULL */
+int kernel_benchmarks(const char *name, uint count)
+{
+    bool found = false;
+
+    nsamples = count ? count : DEFAULT_SAMPLES;
+    samples = malloc(nsamples * sizeof(uint32_t));
+    if (!samples)
+        return ERR_NO_MEMORY;
+
+    for (uint i = 0; i < countof(kernel_benches); i++) {
+        if (name && strcmp(name, kernel_benches[i].name))
+            continue;
+        kernel_benches[i].func();
+        found = true;
+    }
+
+    free(samples);
+    samples = NULL;
+
+    return found ? NO_ERROR : ERR_NOT_FOUND;
+}
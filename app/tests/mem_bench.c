@@ -0,0 +1,328 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <sys/types.h>
+#include <stdio.h>
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <app/tests.h>
+#include <kernel/thread.h>
+#include <kernel/mp.h>
+#include <platform.h>
+#if WITH_LIB_DVFS
+#include <lib/dvfs.h>
+#endif
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
+
+/*
+ * Memory subsystem benchmarks, for comparing boards and heap builds:
+ * streaming bandwidth and dependent load latency over a sweep of working set
+ * sizes (the steps show where each cache level ends), heap throughput from
+ * several threads, and page allocator rates.
+ */
+
+#define MIN_WORKING_SET (4 * 1024)
+#define MAX_WORKING_SET (16 * 1024 * 1024)
+#define STREAM_BYTES    (64 * 1024 * 1024)  /* moved per bandwidth measurement */
+#define CHASE_LOADS     (1024 * 1024)
+
+#if WITH_LIB_HEAP_MINIHEAP
+#define HEAP_NAME "miniheap"
+#elif WITH_LIB_HEAP_CMPCTMALLOC
+#define HEAP_NAME "cmpctmalloc"
+#elif WITH_LIB_HEAP_DLMALLOC
+#define HEAP_NAME "dlmalloc"
+#else
+#define HEAP_NAME "unknown heap"
+#endif
+
+static inline uint32_t lcg(uint32_t *seed)
+{
+    *seed = *seed * 1664525 + 1013904223;
+    return *seed >> 8;
+}
+
+/* bytes per ns * 1000 = MB/s */
+static uint mbps(uint64_t bytes, lk_time_ns_t ns)
+{
+    return ns ? (uint)((bytes * 1000) / ns) : 0;
+}
+
+__NO_INLINE static uint64_t stream_read(const uint64_t *buf, size_t words, uint passes)
+{
+    uint64_t sum = 0;
+
+    for (uint p = 0; p < passes; p++) {
+        for (size_t i = 0; i < words; i += 4)
+            sum += buf[i] + buf[i + 1] + buf[i + 2] + buf[i + 3];
+    }
+    return sum;
+}
+
+__NO_INLINE static void stream_write(uint64_t *buf, size_t words, uint passes)
+{
+    for (uint p = 0; p < passes; p++) {
+        for (size_t i = 0; i < words; i += 4) {
+            buf[i] = p;
+            buf[i + 1] = p;
+            buf[i + 2] = p;
+            buf[i + 3] = p;
+        }
+    }
+}
+
+static void bench_bandwidth(void)
+{
+    uint8_t *buf = memalign(CACHE_LINE, MAX_WORKING_SET * 2);
+    if (!buf) {
+        printf("failed to allocate buffer\n");
+        return;
+    }
+    memset(buf, 0, MAX_WORKING_SET * 2);
+
+    printf("%10s %12s %12s %12s\n", "set", "read MB/s", "write MB/s", "copy MB/s");
+    for (size_t size = MIN_WORKING_SET; size <= MAX_WORKING_SET; size *= 2) {
+        uint passes = MAX(STREAM_BYTES / size, 1u);
+        size_t words = size / sizeof(uint64_t);
+        lk_time_ns_t t;
+
+        /* warm up whatever level this fits in */
+        stream_read((uint64_t *)buf, words, 1);
+
+        t = current_time_ns();
+        __UNUSED volatile uint64_t sum = stream_read((uint64_t *)buf, words, passes);
+        uint read = mbps((uint64_t)size * passes, current_time_ns() - t);
+
+        t = current_time_ns();
+        stream_write((uint64_t *)buf, words, passes);
+        uint write = mbps((uint64_t)size * passes, current_time_ns() - t);
+
+        /* copy moves half the set each way so source and dest together fit the same level */
+        size_t half = size / 2;
+        t = current_time_ns();
+        for (uint p = 0; p < passes; p++)
+            memcpy(buf + half, buf, half);
+        uint copy = mbps((uint64_t)half * passes, current_time_ns() - t);
+
+        printf("%9zuK %12u %12u %12u\n", size / 1024, read, write, copy);
+    }
+
+    free(buf);
+}
+
+static void bench_latency(void)
+{
+    void **buf = memalign(CACHE_LINE, MAX_WORKING_SET);
+    uint *order = malloc((MAX_WORKING_SET / CACHE_LINE) * sizeof(uint));
+    if (!buf || !order) {
+        printf("failed to allocate buffer\n");
+        free(buf);
+        free(order);
+        return;
+    }
+
+    printf("%10s %12s\n", "set", "ns/load");
+    for (size_t size = MIN_WORKING_SET; size <= MAX_WORKING_SET; size *= 2) {
+        /* one pointer per cache line, linked in a random cycle so the prefetcher can't follow */
+        uint lines = size / CACHE_LINE;
+        uint stride = CACHE_LINE / sizeof(void *);
+        uint32_t seed = size;
+
+        for (uint i = 0; i < lines; i++)
+            order[i] = i;
+        for (uint i = lines - 1; i > 0; i--) {
+            uint j = lcg(&seed) % (i + 1);
+            uint tmp = order[i];
+            order[i] = order[j];
+            order[j] = tmp;
+        }
+        for (uint i = 0; i < lines; i++)
+            buf[order[i] * stride] = &buf[order[(i + 1) % lines] * stride];
+
+        void **p = &buf[order[0] * stride];
+        for (uint i = 0; i < lines; i++)
+            p = (void **)*p;
+
+        lk_time_ns_t t = current_time_ns();
+        for (uint i = 0; i < CHASE_LOADS; i++)
+            p = (void **)*p;
+        lk_time_ns_t elapsed = current_time_ns() - t;
+
+        /* keep the chase from being thrown away */
+        __UNUSED volatile void *sink = p;
+
+        printf("%9zuK %9u.%02u\n", size / 1024,
+               (uint)(elapsed / CHASE_LOADS), (uint)((elapsed * 100 / CHASE_LOADS) % 100));
+    }
+
+    free(order);
+    free(buf);
+}
+
+#define HEAP_SLOTS  256
+#define HEAP_OPS    100000
+
+/* mostly small objects, some medium, a few large */
+static size_t heap_size(uint32_t *seed)
+{
+    uint32_t r = lcg(seed);
+    uint pick = r % 100;
+
+    if (pick < 70)
+        return 16 + (r >> 8) % 112;
+    else if (pick < 95)
+        return 128 + (r >> 8) % 1920;
+    else
+        return 2048 + (r >> 8) % 14336;
+}
+
+static int heap_thread(void *arg)
+{
+    uint32_t seed = (uintptr_t)arg;
+    void *slots[HEAP_SLOTS] = { 0 };
+
+    for (uint i = 0; i < HEAP_OPS; i++) {
+        uint s = lcg(&seed) % HEAP_SLOTS;
+        if (slots[s]) {
+            free(slots[s]);
+            slots[s] = NULL;
+        } else {
+            slots[s] = malloc(heap_size(&seed));
+        }
+    }
+
+    for (uint s = 0; s < HEAP_SLOTS; s++)
+        free(slots[s]);
+
+    return 0;
+}
+
+static void bench_heap(uint max_threads)
+{
+    printf("heap: %s, %u random malloc/free per thread\n", HEAP_NAME, HEAP_OPS);
+
+    for (uint n = 1; n <= max_threads; n++) {
+        thread_t *threads[SMP_MAX_CPUS * 2];
+
+        lk_time_ns_t t = current_time_ns();
+        for (uint i = 0; i < n; i++) {
+            threads[i] = thread_create("heapbench", &heap_thread, (void *)(uintptr_t)(i + 1),
+                                       DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+            thread_resume(threads[i]);
+        }
+        for (uint i = 0; i < n; i++)
+            thread_join(threads[i], NULL, INFINITE_TIME);
+        lk_time_ns_t elapsed = current_time_ns() - t;
+
+        uint64_t ops = (uint64_t)n * HEAP_OPS;
+        printf("%2u threads: %8llu ops/s\n", n, elapsed ? (ops * 1000000000ULL) / elapsed : 0);
+    }
+}
+
+#if WITH_KERNEL_VM
+#define PAGE_OPS    4096
+#define VMM_OPS     256
+#define VMM_SIZE    (64 * 1024)
+
+static void bench_page_alloc(void)
+{
+    vm_page_t **pages = malloc(PAGE_OPS * sizeof(vm_page_t *));
+    if (!pages)
+        return;
+
+    lk_time_ns_t t = current_time_ns();
+    uint count;
+    for (count = 0; count < PAGE_OPS; count++) {
+        pages[count] = pmm_alloc_page();
+        if (!pages[count])
+            break;
+    }
+    lk_time_ns_t alloc = current_time_ns() - t;
+
+    t = current_time_ns();
+    for (uint i = 0; i < count; i++)
+        pmm_free_page(pages[i]);
+    lk_time_ns_t freed = current_time_ns() - t;
+
+    printf("pmm: %u pages, alloc %llu ns/page, free %llu ns/page\n", count,
+           count ? alloc / count : 0, count ? freed / count : 0);
+    free(pages);
+
+    void **regions = malloc(VMM_OPS * sizeof(void *));
+    if (!regions)
+        return;
+
+    t = current_time_ns();
+    for (count = 0; count < VMM_OPS; count++) {
+        if (vmm_alloc(vmm_get_kernel_aspace(), "vmmbench", VMM_SIZE, &regions[count], 0, 0, 0) < 0)
+            break;
+    }
+    alloc = current_time_ns() - t;
+
+    t = current_time_ns();
+    for (uint i = 0; i < count; i++)
+        vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)regions[i]);
+    freed = current_time_ns() - t;
+
+    printf("vmm: %u x %uK regions, alloc %llu ns, free %llu ns each\n", count, VMM_SIZE / 1024,
+           count ? alloc / count : 0, count ? freed / count : 0);
+    free(regions);
+}
+#endif
+
+int mem_benchmarks(int argc, const cmd_args *argv)
+{
+    const char *name = (argc > 1) ? argv[1].str : NULL;
+    uint threads = (argc > 2) ? argv[2].u : 0;
+
+    if (threads == 0) {
+        for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+            if (mp_is_cpu_active(i))
+                threads++;
+        }
+    }
+    threads = MIN(MAX(threads, 1u), SMP_MAX_CPUS * 2u);
+
+#if WITH_LIB_DVFS
+    dvfs_hold_max();
+#endif
+
+    if (!name || !strcmp(name, "bw"))
+        bench_bandwidth();
+    if (!name || !strcmp(name, "lat"))
+        bench_latency();
+    if (!name || !strcmp(name, "heap"))
+        bench_heap(threads);
+#if WITH_KERNEL_VM
+    if (!name || !strcmp(name, "pages"))
+        bench_page_alloc();
+#endif
+
+#if WITH_LIB_DVFS
+    dvfs_release_max();
+#endif
+
+    return NO_ERROR;
+}
@@ -29,146 +29,292 @@
 #include <lib/console.h>
 #include <platform.h>
 #include <debug.h>
+#include <kernel/spinlock.h>
+#include <lib/workqueue.h>
 
 #if WITH_KERNEL_VM
 #include <kernel/vm.h>
 #endif
 
-static void mem_test_fail(void *ptr, uint32_t should, uint32_t is)
+/*
+ * The tests are run on 64 bit words, split into pieces that every cpu's worker
+ * takes a share of. Writes go out a pair of words at a time with non-temporal
+ * stores where the cpu has them, which the uncached test mapping can turn into
+ * full bursts. Each piece is tested from start to finish on its own, the moving
+ * inversions walk up and back down within a piece.
+ */
+#define MEM_TEST_CHUNK (1024 * 1024)
+
+struct mem_test;
+typedef void (*mem_test_fn_t)(struct mem_test *t, uint64_t *ptr, size_t words, size_t first);
+
+struct mem_test {
+    uint64_t *base;
+    size_t len;
+    mem_test_fn_t fn;
+    uint64_t pat;
+
+    /* set by the first piece to find a bad word, the rest give up */
+    volatile int failed;
+
+    /* bytes tested and time spent by each cpu, since the last report */
+    spin_lock_t lock;
+    struct {
+        uint64_t bytes;
+        lk_time_ns_t time;
+    } cpu[SMP_MAX_CPUS];
+    lk_time_ns_t start;
+};
+
+static void mem_test_fail(volatile uint64_t *ptr, uint64_t should, uint64_t is)
 {
-    printf("ERROR at %p: should be 0x%x, is 0x%x\n", ptr, should, is);
+    printf("ERROR at %p: should be 0x%llx, is 0x%llx\n", ptr, should, is);
 
-    ptr = (void *)ROUNDDOWN((uintptr_t)ptr, 64);
-    hexdump(ptr, 128);
+    void *line = (void *)ROUNDDOWN((uintptr_t)ptr, 64);
+    hexdump(line, 128);
 }
 
-static status_t do_pattern_test(void *ptr, size_t len, uint32_t pat)
+static inline bool mem_test_check(struct mem_test *t, volatile uint64_t *ptr, uint64_t should)
 {
-    volatile uint32_t *vbuf32 = ptr;
-    size_t i;
+    uint64_t is = *ptr;
+    if (likely(is == should))
+        return true;
 
-    printf("\tpattern 0x%08x\n", pat);
-    for (i = 0; i < len / 4; i++) {
-        vbuf32[i] = pat;
-    }
+    if (atomic_swap(&t->failed, 1) == 0)
+        mem_test_fail(ptr, should, is);
+    return false;
+}
 
-    for (i = 0; i < len / 4; i++) {
-        if (vbuf32[i] != pat) {
-            mem_test_fail((void *)&vbuf32[i], pat, vbuf32[i]);
-            return ERR_GENERIC;
-        }
-    }
+/* write a pair of words, 16 byte aligned, around the cache where the cpu can */
+static inline void mem_test_store2(uint64_t *ptr, uint64_t a, uint64_t b)
+{
+#if ARCH_ARM64
+    __asm__ volatile("stnp %1, %2, [%0]" :: "r"(ptr), "r"(a), "r"(b) : "memory");
+#elif ARCH_X86_64
+    __asm__ volatile("movnti %1, %0" : "=m"(ptr[0]) : "r"(a));
+    __asm__ volatile("movnti %1, %0" : "=m"(ptr[1]) : "r"(b));
+#else
+    ((volatile uint64_t *)ptr)[0] = a;
+    ((volatile uint64_t *)ptr)[1] = b;
+#endif
+}
+
+/* the non-temporal stores are weakly ordered, finish them before reading back */
+static inline void mem_test_store_done(void)
+{
+#if ARCH_X86_64
+    __asm__ volatile("sfence" ::: "memory");
+#else
+    mb();
+#endif
+}
+
+static void mem_test_fill(uint64_t *ptr, size_t words, uint64_t pat)
+{
+    size_t i;
+    for (i = 0; i + 2 <= words; i += 2)
+        mem_test_store2(&ptr[i], pat, pat);
+    if (i < words)
+        ((volatile uint64_t *)ptr)[i] = pat;
 
-    return NO_ERROR;
+    mem_test_store_done();
 }
 
-static status_t do_moving_inversion_test(void *ptr, size_t len, uint32_t pat)
+/* each word holds its own index */
+static void mem_test_address(struct mem_test *t, uint64_t *ptr, size_t words, size_t first)
 {
-    volatile uint32_t *vbuf32 = ptr;
+    volatile uint64_t *v = ptr;
     size_t i;
 
-    printf("\tpattern 0x%08x\n", pat);
+    for (i = 0; i + 2 <= words; i += 2)
+        mem_test_store2(&ptr[i], first + i, first + i + 1);
+    if (i < words)
+        v[i] = first + i;
+    mem_test_store_done();
 
-    /* fill memory */
-    for (i = 0; i < len / 4; i++) {
-        vbuf32[i] = pat;
+    for (i = 0; i < words; i++) {
+        if (!mem_test_check(t, &v[i], first + i))
+            return;
     }
+}
 
-    /* from the bottom, walk through each cell, inverting the value */
-    //printf("\t\tbottom up invert\n");
-    for (i = 0; i < len / 4; i++) {
-        if (vbuf32[i] != pat) {
-            mem_test_fail((void *)&vbuf32[i], pat, vbuf32[i]);
-            return ERR_GENERIC;
-        }
+static void mem_test_pattern(struct mem_test *t, uint64_t *ptr, size_t words, size_t first)
+{
+    volatile uint64_t *v = ptr;
+    uint64_t pat = t->pat;
+
+    mem_test_fill(ptr, words, pat);
 
-        vbuf32[i] = ~pat;
+    for (size_t i = 0; i < words; i++) {
+        if (!mem_test_check(t, &v[i], pat))
+            return;
     }
+}
 
-    /* repeat, walking from top down */
-    //printf("\t\ttop down invert\n");
-    for (i = len / 4; i > 0; i--) {
-        if (vbuf32[i-1] != ~pat) {
-            mem_test_fail((void *)&vbuf32[i-1], ~pat, vbuf32[i-1]);
-            return ERR_GENERIC;
-        }
+static void mem_test_moving_inversion(struct mem_test *t, uint64_t *ptr, size_t words, size_t first)
+{
+    volatile uint64_t *v = ptr;
+    uint64_t pat = t->pat;
+    size_t i;
+
+    mem_test_fill(ptr, words, pat);
 
-        vbuf32[i-1] = pat;
+    /* from the bottom, walk through each cell, inverting the value */
+    for (i = 0; i < words; i++) {
+        if (!mem_test_check(t, &v[i], pat))
+            return;
+        v[i] = ~pat;
+    }
+
+    /* repeat, walking from top down */
+    for (i = words; i > 0; i--) {
+        if (!mem_test_check(t, &v[i - 1], ~pat))
+            return;
+        v[i - 1] = pat;
     }
 
     /* verify that we have the original pattern */
-    //printf("\t\tfinal test\n");
-    for (i = 0; i < len / 4; i++) {
-        if (vbuf32[i] != pat) {
-            mem_test_fail((void *)&vbuf32[i], pat, vbuf32[i]);
-            return ERR_GENERIC;
-        }
+    for (i = 0; i < words; i++) {
+        if (!mem_test_check(t, &v[i], pat))
+            return;
     }
+}
 
-    return NO_ERROR;
+static void mem_test_piece(size_t start, size_t end, void *arg)
+{
+    struct mem_test *t = arg;
+
+    if (t->failed)
+        return;
+
+    /* workers stay on their cpu, the caller may move but rarely does in a piece */
+    uint cpu = arch_curr_cpu_num();
+    lk_time_ns_t begin = current_time_ns();
+
+    t->fn(t, t->base + start / 8, (end - start) / 8, start / 8);
+
+    lk_time_ns_t took = current_time_ns() - begin;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&t->lock, state);
+    t->cpu[cpu].bytes += end - start;
+    t->cpu[cpu].time += took;
+    spin_unlock_irqrestore(&t->lock, state);
 }
 
-static void do_mem_tests(void *ptr, size_t len)
+static status_t mem_test_run(struct mem_test *t, mem_test_fn_t fn, uint64_t pat)
 {
-    size_t i;
+    t->fn = fn;
+    t->pat = pat;
 
-    /* test 1: simple write address to memory, read back */
-    printf("test 1: simple address write, read back\n");
-    volatile uint32_t *vbuf32 = ptr;
-    for (i = 0; i < len / 4; i++) {
-        vbuf32[i] = i;
+    parallel_for(0, t->len, MEM_TEST_CHUNK, mem_test_piece, t);
+
+    return t->failed ? ERR_GENERIC : NO_ERROR;
+}
+
+static status_t mem_test_run_pattern(struct mem_test *t, mem_test_fn_t fn, uint64_t pat)
+{
+    printf("\tpattern 0x%016llx\n", pat);
+
+    return mem_test_run(t, fn, pat);
+}
+
+static uint mem_test_mbps(uint64_t bytes, lk_time_ns_t ns)
+{
+    return ns ? (uint)((bytes * 1000) / ns) : 0;
+}
+
+/* throughput of each cpu since the last report, then start counting again */
+static void mem_test_report(struct mem_test *t)
+{
+    lk_time_ns_t elapsed = current_time_ns() - t->start;
+    uint64_t total = 0;
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (t->cpu[i].bytes == 0)
+            continue;
+        printf("\tcpu %u: %llu MB in %llu ms, %u MB/s\n", i, t->cpu[i].bytes >> 20,
+               t->cpu[i].time / 1000000, mem_test_mbps(t->cpu[i].bytes, t->cpu[i].time));
+        total += t->cpu[i].bytes;
     }
+    printf("\ttotal: %llu MB in %llu ms, %u MB/s\n", total >> 20, elapsed / 1000000,
+           mem_test_mbps(total, elapsed));
 
-    for (i = 0; i < len / 4; i++) {
-        if (vbuf32[i] != i) {
-            mem_test_fail((void *)&vbuf32[i], i, vbuf32[i]);
-            goto out;
-        }
+    memset(t->cpu, 0, sizeof(t->cpu));
+    t->start = current_time_ns();
+}
+
+static void do_mem_tests(void *ptr, size_t len)
+{
+    /* the paired stores want 16 byte alignment */
+    uintptr_t base = ROUNDUP((uintptr_t)ptr, 16);
+    if (base - (uintptr_t)ptr >= len) {
+        printf("test area too small\n");
+        return;
     }
+    len = ROUNDDOWN(len - (base - (uintptr_t)ptr), 8);
+
+    struct mem_test *t = calloc(1, sizeof(struct mem_test));
+    if (!t) {
+        printf("error allocating test state\n");
+        return;
+    }
+    t->base = (uint64_t *)base;
+    t->len = len;
+    t->lock = SPIN_LOCK_INITIAL_VALUE;
+    t->start = current_time_ns();
+
+    /* test 1: simple write address to memory, read back */
+    printf("test 1: simple address write, read back\n");
+    if (mem_test_run(t, mem_test_address, 0) < 0)
+        goto out;
+    mem_test_report(t);
 
     /* test 2: write various patterns, read back */
     printf("test 2: write patterns, read back\n");
 
-    static const uint32_t pat[] = {
-        0x0, 0xffffffff,
-        0xaaaaaaaa, 0x55555555,
+    static const uint64_t pat[] = {
+        0x0, 0xffffffffffffffffULL,
+        0xaaaaaaaaaaaaaaaaULL, 0x5555555555555555ULL,
     };
 
     for (size_t p = 0; p < countof(pat); p++) {
-        if (do_pattern_test(ptr, len, pat[p]) < 0)
+        if (mem_test_run_pattern(t, mem_test_pattern, pat[p]) < 0)
             goto out;
     }
-    // shift bits through 32bit word
-    for (uint32_t p = 1; p != 0; p <<= 1) {
-        if (do_pattern_test(ptr, len, p) < 0)
+    // shift bits through 64bit word
+    for (uint64_t p = 1; p != 0; p <<= 1) {
+        if (mem_test_run_pattern(t, mem_test_pattern, p) < 0)
             goto out;
     }
-    // shift bits through 16bit word, invert top of 32bit
-    for (uint16_t p = 1; p != 0; p <<= 1) {
-        if (do_pattern_test(ptr, len, ((~p) << 16) | p) < 0)
+    // shift bits through 32bit word, invert top of 64bit
+    for (uint32_t p = 1; p != 0; p <<= 1) {
+        if (mem_test_run_pattern(t, mem_test_pattern, ((uint64_t)~p << 32) | p) < 0)
             goto out;
     }
+    mem_test_report(t);
 
     /* test 3: moving inversion, patterns */
     printf("test 3: moving inversions with patterns\n");
     for (size_t p = 0; p < countof(pat); p++) {
-        if (do_moving_inversion_test(ptr, len, pat[p]) < 0)
+        if (mem_test_run_pattern(t, mem_test_moving_inversion, pat[p]) < 0)
             goto out;
-
     }
-    // shift bits through 32bit word
-    for (uint32_t p = 1; p != 0; p <<= 1) {
-        if (do_moving_inversion_test(ptr, len, p) < 0)
+    // shift bits through 64bit word
+    for (uint64_t p = 1; p != 0; p <<= 1) {
+        if (mem_test_run_pattern(t, mem_test_moving_inversion, p) < 0)
             goto out;
     }
-    // shift bits through 16bit word, invert top of 32bit
-    for (uint16_t p = 1; p != 0; p <<= 1) {
-        if (do_moving_inversion_test(ptr, len, ((~p) << 16) | p) < 0)
+    // shift bits through 32bit word, invert top of 64bit
+    for (uint32_t p = 1; p != 0; p <<= 1) {
+        if (mem_test_run_pattern(t, mem_test_moving_inversion, ((uint64_t)~p << 32) | p) < 0)
             goto out;
     }
+    mem_test_report(t);
 
 out:
     printf("done with tests\n");
+    free(t);
 }
 
 static int mem_test(int argc, const cmd_args *argv)
@@ -237,6 +383,90 @@ usage:
     return 0;
 }
 
+#if WITH_KERNEL_VM
+#define VM_OBJECT_TEST_PAGES 4
+
+static bool vm_object_check(const char *what, const uint8_t *ptr, uint8_t val)
+{
+    for (size_t i = 0; i < VM_OBJECT_TEST_PAGES * PAGE_SIZE; i++) {
+        if (ptr[i] != val) {
+            printf("%s: ERROR at %p: should be 0x%x, is 0x%x\n", what, &ptr[i], val, ptr[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+static int vm_object_test(int argc, const cmd_args *argv)
+{
+    vmm_aspace_t *aspace = vmm_get_kernel_aspace();
+    vmm_object_t *obj = NULL, *clone = NULL;
+    uint8_t *a = NULL, *b = NULL, *c = NULL;
+    bool ok = false;
+
+    status_t err = vmm_object_create(&obj, VM_OBJECT_TEST_PAGES * PAGE_SIZE, 0);
+    if (err < 0) {
+        printf("error %d creating object\n", err);
+        return err;
+    }
+
+    /* two mappings of one object see the same memory */
+    if (vmm_map_object(aspace, "vmobj a", obj, (void **)&a, 0, 0, 0) < 0 ||
+            vmm_map_object(aspace, "vmobj b", obj, (void **)&b, 0, 0, 0) < 0) {
+        printf("error mapping object\n");
+        goto out;
+    }
+    if (!vm_object_check("zero fill", b, 0))
+        goto out;
+    memset(a, 0x11, VM_OBJECT_TEST_PAGES * PAGE_SIZE);
+    if (!vm_object_check("shared", b, 0x11))
+        goto out;
+
+    /* a clone starts out with the same contents, then the two go their own ways */
+    if (vmm_object_clone(obj, &clone) < 0 ||
+            vmm_map_object(aspace, "vmobj clone", clone, (void **)&c, 0, 0, 0) < 0) {
+        printf("error cloning object\n");
+        goto out;
+    }
+    if (!vm_object_check("clone", c, 0x11))
+        goto out;
+    memset(a, 0x22, PAGE_SIZE);
+    if (b[0] != 0x22 || b[PAGE_SIZE] != 0x11) {
+        printf("ERROR: source write not seen through its other mapping\n");
+        goto out;
+    }
+    if (!vm_object_check("clone after source write", c, 0x11))
+        goto out;
+    memset(c, 0x33, VM_OBJECT_TEST_PAGES * PAGE_SIZE);
+    if (b[0] != 0x22 || b[PAGE_SIZE] != 0x11) {
+        printf("ERROR: source changed by clone write\n");
+        goto out;
+    }
+    memset(a, 0x44, VM_OBJECT_TEST_PAGES * PAGE_SIZE);
+    if (!vm_object_check("source", b, 0x44) || !vm_object_check("clone", c, 0x33))
+        goto out;
+
+    ok = true;
+
+out:
+    if (a)
+        vmm_free_region(aspace, (vaddr_t)a);
+    if (b)
+        vmm_free_region(aspace, (vaddr_t)b);
+    if (c)
+        vmm_free_region(aspace, (vaddr_t)c);
+    if (clone)
+        vmm_object_release(clone);
+    vmm_object_release(obj);
+
+    printf("vm object test %s\n", ok ? "passed" : "FAILED");
+    return ok ? 0 : -1;
+}
+#endif
+
 STATIC_COMMAND_START
 STATIC_COMMAND("mem_test", "test memory", &mem_test)
+#if WITH_KERNEL_VM
+STATIC_COMMAND("vm_object_test", "test shared and copy on write vm objects", &vm_object_test)
+#endif
 STATIC_COMMAND_END(mem_tests);
@@ -729,6 +729,83 @@ int group_waiting(void)
     return 0;
 }
 
+#define SPSC_PACKETS 2000
+
+static int spsc_writer_thread(void *arg)
+{
+    port_t w_port = (port_t)arg;
+
+    for (uint32_t ix = 0; ix != SPSC_PACKETS; ) {
+        port_packet_t pk = { { 0 } };
+        memcpy(pk.value, &ix, sizeof(ix));
+        status_t st = port_write(w_port, &pk, 1);
+        if (st == ERR_NOT_ENOUGH_BUFFER) {
+            thread_yield();
+            continue;
+        }
+        if (st < 0)
+            return __LINE__;
+        ix++;
+    }
+    return 0;
+}
+
+/* Stream packets through a single writer port and drain them in batches, they
+ * have to come out complete and in order.
+ */
+int single_writer_batch(void)
+{
+    port_t w_port, r_port;
+    status_t st = port_create("spsc_port", PORT_MODE_UNICAST | PORT_MODE_SINGLE_WRITER, &w_port);
+    if (st < 0)
+        return __LINE__;
+
+    st = port_open("spsc_port", context1, &r_port);
+    if (st < 0)
+        return __LINE__;
+
+    thread_t *t = thread_create("spsc writer", &spsc_writer_thread, w_port,
+                                DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+    thread_resume(t);
+
+    port_result_t res[5];
+    uint32_t expected = 0;
+    while (expected != SPSC_PACKETS) {
+        ssize_t count = port_read_batch(r_port, 1000, res, countof(res));
+        if (count <= 0)
+            return __LINE__;
+        for (ssize_t ix = 0; ix != count; ix++) {
+            uint32_t seq;
+            memcpy(&seq, res[ix].packet.value, sizeof(seq));
+            if (seq != expected || res[ix].ctx != context1) {
+                printf("got packet %u, expected %u\n", seq, expected);
+                return __LINE__;
+            }
+            expected++;
+        }
+    }
+
+    int ret;
+    thread_join(t, &ret, INFINITE_TIME);
+    if (ret)
+        return ret;
+
+    if (port_read_batch(r_port, 0, res, countof(res)) != ERR_TIMED_OUT)
+        return __LINE__;
+
+    st = port_close(r_port);
+    if (st < 0)
+        return __LINE__;
+    st = port_close(w_port);
+    if (st < 0)
+        return __LINE__;
+    st = port_destroy(w_port);
+    if (st < 0)
+        return __LINE__;
+
+    return 0;
+}
+
 #define RUN_TEST(t)  result = t(); if (result) goto fail
 
 int port_tests(void)
@@ -740,6 +817,7 @@ int port_tests(void)
         RUN_TEST(two_threads_basic);
         RUN_TEST(group_basic);
         RUN_TEST(group_dynamic);
+        RUN_TEST(single_writer_batch);
     }
 
     printf("all tests passed\n");
@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <arch/defines.h>
+#include <lib/console.h>
+#include <lib/slab.h>
+#include <rand.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define COUNT 1000
+#define OBJECT_SIZE 48
+#define OBJECT_ALIGN 16
+
+int slab_tests(int argc, const cmd_args *argv)
+{
+    static void *objects[COUNT];
+
+    printf("running basic tests...\n");
+
+    // Objects that can't fit a few to a page are refused.
+    if (slab_cache_create("too big", PAGE_SIZE / 2, 8) != NULL)
+        panic("oversized cache created\n");
+
+    slab_cache_t *cache = slab_cache_create("slab_tests", OBJECT_SIZE, OBJECT_ALIGN);
+    if (!cache)
+        panic("failed to create cache\n");
+
+    // Fill every object with its index so overlapping objects show up.
+    for (uint i = 0; i < COUNT; i++) {
+        objects[i] = slab_alloc(cache);
+        if (!objects[i])
+            panic("alloc %u failed\n", i);
+        if (!IS_ALIGNED(objects[i], OBJECT_ALIGN))
+            panic("object %p misaligned\n", objects[i]);
+        memset(objects[i], i & 0xff, OBJECT_SIZE);
+    }
+
+    printf("running random tests...\n");
+    for (uint n = 0; n < COUNT * 20; n++) {
+        uint i = rand() % COUNT;
+
+        const uint8_t *p = objects[i];
+        for (uint j = 0; j < OBJECT_SIZE; j++) {
+            if (p[j] != (i & 0xff))
+                panic("object %u corrupted at %u\n", i, j);
+        }
+
+        slab_free(cache, objects[i]);
+        objects[i] = slab_alloc(cache);
+        if (!objects[i])
+            panic("realloc %u failed\n", i);
+        memset(objects[i], i & 0xff, OBJECT_SIZE);
+    }
+
+    for (uint i = 0; i < COUNT; i++)
+        slab_free(cache, objects[i]);
+
+    size_t freed = slab_cache_reclaim(cache);
+    printf("reclaimed %zu pages\n", freed);
+    if (freed == 0)
+        panic("nothing reclaimed\n");
+
+    slab_cache_destroy(cache);
+
+    printf("slab tests passed\n");
+
+    return NO_ERROR;
+}
@@ -34,10 +34,14 @@ STATIC_COMMAND("printf_tests_float", "test printf with floating point", (console
 STATIC_COMMAND("thread_tests", "test the scheduler", (console_cmd)&thread_tests)
 STATIC_COMMAND("port_tests", "test the ports", (console_cmd)&port_tests)
 STATIC_COMMAND("clock_tests", "test clocks", (console_cmd)&clock_tests)
-STATIC_COMMAND("bench", "miscellaneous benchmarks", (console_cmd)&benchmarks)
+STATIC_COMMAND("bench", "memory and kernel primitive benchmarks", &benchmarks)
+STATIC_COMMAND("membench", "memory bandwidth, latency and allocator benchmarks [bw|lat|heap|pages] [threads]", &mem_benchmarks)
 STATIC_COMMAND("fibo", "threaded fibonacci", (console_cmd)&fibo)
+STATIC_COMMAND("fiber_tests", "test lib/fiber", &fiber_tests)
 STATIC_COMMAND("spinner", "create a spinning thread", (console_cmd)&spinner)
 STATIC_COMMAND("cbuf_tests", "test lib/cbuf", &cbuf_tests)
+STATIC_COMMAND("slab_tests", "test lib/slab", &slab_tests)
+STATIC_COMMAND("workqueue_tests", "test lib/workqueue", &workqueue_tests)
 STATIC_COMMAND_END(tests);
 
 #endif
@@ -26,11 +26,15 @@
 #include <err.h>
 #include <assert.h>
 #include <string.h>
+#include <stdlib.h>
 #include <app/tests.h>
 #include <kernel/thread.h>
 #include <kernel/mutex.h>
+#include <kernel/rwlock.h>
 #include <kernel/semaphore.h>
 #include <kernel/event.h>
+#include <kernel/rcu.h>
+#include <kernel/mp.h>
 #include <platform.h>
 
 static int sleep_thread(void *arg)
@@ -187,6 +191,43 @@ static int mutex_zerotimeout_thread(void *arg)
     return err;
 }
 
+static int mutex_pi_waiter_thread(void *arg)
+{
+    mutex_t *m = (mutex_t *)arg;
+
+    mutex_acquire(m);
+    mutex_release(m);
+
+    return 0;
+}
+
+static void mutex_pi_test(void)
+{
+    mutex_t m;
+    thread_t *t = get_current_thread();
+    int old_priority = t->base_priority;
+
+    printf("testing mutex priority inheritance\n");
+
+    mutex_init_etc(&m, MUTEX_FLAG_PRIORITY_INHERIT);
+    thread_set_priority(LOW_PRIORITY);
+    mutex_acquire(&m);
+
+    /* a higher priority waiter runs right away and blocks, lending us its priority */
+    thread_t *waiter = thread_create("mutex pi waiter", &mutex_pi_waiter_thread, &m, HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+    thread_resume(waiter);
+
+    printf("priority while held %d (should be %d)\n", t->priority, HIGH_PRIORITY);
+
+    mutex_release(&m);
+
+    printf("priority after release %d (should be %d)\n", t->priority, LOW_PRIORITY);
+
+    thread_join(waiter, NULL, INFINITE_TIME);
+    thread_set_priority(old_priority);
+    mutex_destroy(&m);
+}
+
 int mutex_test(void)
 {
     static mutex_t imutex = MUTEX_INITIAL_VALUE(imutex);
@@ -233,13 +274,176 @@ int mutex_test(void)
         thread_join(threads[i], NULL, INFINITE_TIME);
     }
 
+    mutex_destroy(&timeout_mutex);
+
+    mutex_pi_test();
+
     printf("done with mutex tests\n");
 
-    mutex_destroy(&timeout_mutex);
+    return 0;
+}
+
+static volatile int rwlock_readers;
+static volatile int rwlock_writer;
+
+static int rwlock_reader_thread(void *arg)
+{
+    rwlock_t *l = (rwlock_t *)arg;
+
+    for (int i = 0; i < 100000; i++) {
+        rwlock_acquire_read(l);
+        atomic_add(&rwlock_readers, 1);
+
+        if (rwlock_writer != 0)
+            panic("reader running alongside a writer\n");
+        if ((i % 16) == 0)
+            thread_yield();
+
+        atomic_add(&rwlock_readers, -1);
+        rwlock_release_read(l);
+    }
+
+    return 0;
+}
+
+static int rwlock_writer_thread(void *arg)
+{
+    rwlock_t *l = (rwlock_t *)arg;
+
+    for (int i = 0; i < 10000; i++) {
+        rwlock_acquire_write(l);
+
+        if (rwlock_writer != 0 || rwlock_readers != 0)
+            panic("writer running alongside writer %d or %d readers\n", rwlock_writer, rwlock_readers);
+        rwlock_writer = 1;
+        thread_yield();
+        rwlock_writer = 0;
+
+        rwlock_release_write(l);
+        thread_yield();
+    }
+
+    return 0;
+}
+
+static void rwlock_test_flags(uint32_t flags)
+{
+    rwlock_t l;
+    rwlock_init_etc(&l, flags);
+
+    printf("testing rwlock, flags 0x%x\n", flags);
+
+    thread_t *threads[6];
+    for (uint i=0; i < countof(threads); i++) {
+        bool writer = (i % 3) == 0;
+        threads[i] = thread_create(writer ? "rwlock writer" : "rwlock reader",
+                                   writer ? &rwlock_writer_thread : &rwlock_reader_thread,
+                                   &l, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_resume(threads[i]);
+    }
+
+    for (uint i=0; i < countof(threads); i++) {
+        thread_join(threads[i], NULL, INFINITE_TIME);
+    }
+
+    /* a write acquire with zero timeout must fail while readers hold it */
+    rwlock_acquire_read(&l);
+    status_t err = rwlock_acquire_write_timeout(&l, 0);
+    printf("zero timeout write acquire while read held returns %d (should be %d)\n", err, ERR_TIMED_OUT);
+    rwlock_release_read(&l);
+
+    rwlock_destroy(&l);
+}
+
+static void rwlock_test(void)
+{
+    rwlock_test_flags(0);
+    rwlock_test_flags(RWLOCK_FLAG_WRITER_PREFERENCE);
+
+    printf("done with rwlock tests\n");
+}
+
+#define RCU_OBJ_MAGIC 0x52435521
+
+struct rcu_obj {
+    uint32_t magic;
+    struct rcu_head rcu;
+};
+
+static struct rcu_obj *rcu_shared;
+static volatile bool rcu_test_done;
+static volatile int rcu_callbacks_pending;
+
+static void rcu_obj_free(struct rcu_obj *o)
+{
+    o->magic = 0;
+    free(o);
+}
+
+static void rcu_obj_callback(struct rcu_head *head)
+{
+    rcu_obj_free(containerof(head, struct rcu_obj, rcu));
+    atomic_add(&rcu_callbacks_pending, -1);
+}
+
+static int rcu_reader_thread(void *arg)
+{
+    while (!rcu_test_done) {
+        rcu_read_lock();
+        struct rcu_obj *o = rcu_dereference(rcu_shared);
+        for (int i = 0; i < 100; i++) {
+            if (o->magic != RCU_OBJ_MAGIC)
+                panic("rcu object %p freed under a reader\n", o);
+        }
+        rcu_read_unlock();
+    }
 
     return 0;
 }
 
+static void rcu_test(void)
+{
+    printf("testing rcu\n");
+
+    rcu_shared = malloc(sizeof(struct rcu_obj));
+    rcu_shared->magic = RCU_OBJ_MAGIC;
+    rcu_test_done = false;
+
+    thread_t *threads[4];
+    for (uint i=0; i < countof(threads); i++) {
+        threads[i] = thread_create("rcu reader", &rcu_reader_thread, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_resume(threads[i]);
+    }
+
+    /* replace the object over and over, alternating the two ways of retiring it */
+    for (int i = 0; i < 1000; i++) {
+        struct rcu_obj *n = malloc(sizeof(struct rcu_obj));
+        n->magic = RCU_OBJ_MAGIC;
+
+        struct rcu_obj *old = rcu_shared;
+        rcu_assign_pointer(rcu_shared, n);
+
+        if (i % 2) {
+            rcu_synchronize();
+            rcu_obj_free(old);
+        } else {
+            atomic_add(&rcu_callbacks_pending, 1);
+            rcu_call(&old->rcu, rcu_obj_callback);
+        }
+    }
+
+    rcu_test_done = true;
+    for (uint i=0; i < countof(threads); i++) {
+        thread_join(threads[i], NULL, INFINITE_TIME);
+    }
+
+    while (rcu_callbacks_pending > 0)
+        thread_sleep(10);
+    rcu_obj_free(rcu_shared);
+
+    printf("done with rcu tests\n");
+}
+
 static event_t e;
 
 static int event_signaler(void *arg)
@@ -576,6 +780,90 @@ static void join_test(void)
     printf("thread_join returns err %d, retval %d (should be 0 and 55)\n", err, ret);
 }
 
+#if WITH_SMP
+static volatile bool affinity_spin_stop;
+static volatile bool affinity_spinning;
+static volatile int affinity_ran_on;
+
+/* keep a cpu busy until told to stop */
+static int affinity_spinner(void *arg)
+{
+    affinity_spinning = true;
+    while (!affinity_spin_stop)
+        ;
+    return 0;
+}
+
+/* hog cpu 0 until the two cpu thread has run somewhere, or give up after a while */
+static int affinity_hog(void *arg)
+{
+    lk_time_t start = current_time();
+    while (affinity_ran_on < 0 && current_time() - start < 2000)
+        ;
+    return 0;
+}
+
+static int affinity_runner(void *arg)
+{
+    affinity_ran_on = arch_curr_cpu_num();
+    return 0;
+}
+
+/*
+ * A thread allowed on cpus 0 and 1 that gets queued on cpu 0 while cpu 0 is
+ * busy should be picked up by cpu 1 as soon as cpu 1 goes idle, rather than
+ * waiting for cpu 0.
+ */
+static void affinity_test(void)
+{
+    if ((mp.active_cpus & 3) != 3) {
+        printf("skipping affinity test, needs cpus 0 and 1\n");
+        return;
+    }
+
+    printf("testing a two cpu affinity thread with one of the cpus busy\n");
+
+    thread_t *self = get_current_thread();
+    mp_cpu_mask_t saved_affinity = thread_get_cpu_affinity(self);
+    int saved_priority = self->priority;
+
+    /* run the setup from cpu 0, ahead of the hog */
+    thread_set_priority(HIGH_PRIORITY);
+    thread_set_cpu_affinity(self, 1U << 0);
+
+    /* keep cpu 1 busy so the runner can't be placed on it directly */
+    affinity_spin_stop = false;
+    affinity_spinning = false;
+    affinity_ran_on = -1;
+    thread_t *spinner = thread_create("affinity spinner", &affinity_spinner, NULL, HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+    thread_set_cpu_affinity(spinner, 1U << 1);
+    thread_resume(spinner);
+    while (!affinity_spinning)
+        ;
+
+    /* queued on cpu 0 behind us, it only gets to run once we block */
+    thread_t *hog = thread_create("affinity hog", &affinity_hog, NULL, DEFAULT_PRIORITY + 1, DEFAULT_STACK_SIZE);
+    thread_set_cpu_affinity(hog, 1U << 0);
+    thread_resume(hog);
+
+    /* everything is busy, so this one lands on cpu 0, the local cpu */
+    thread_t *runner = thread_create("affinity runner", &affinity_runner, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+    thread_set_cpu_affinity(runner, (1U << 0) | (1U << 1));
+    thread_resume(runner);
+
+    /* free up cpu 1 and let the hog have cpu 0 */
+    affinity_spin_stop = true;
+    thread_join(spinner, NULL, INFINITE_TIME);
+    thread_join(runner, NULL, INFINITE_TIME);
+    thread_join(hog, NULL, INFINITE_TIME);
+
+    printf("two cpu thread ran on cpu %d (should be 1)\n", affinity_ran_on);
+
+    thread_set_cpu_affinity(self, saved_affinity);
+    thread_set_priority(saved_priority);
+}
+#endif
+
 static void spinlock_test(void)
 {
     spin_lock_saved_state_t state;
@@ -619,8 +907,10 @@ static void spinlock_test(void)
 int thread_tests(void)
 {
     mutex_test();
+    rwlock_test();
     semaphore_test();
     event_test();
+    rcu_test();
 
     spinlock_test();
     atomic_test();
@@ -632,6 +922,10 @@ int thread_tests(void)
 
     join_test();
 
+#if WITH_SMP
+    affinity_test();
+#endif
+
     return 0;
 }
 
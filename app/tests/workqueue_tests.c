@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <arch/ops.h>
+#include <kernel/event.h>
+#include <kernel/thread.h>
+#include <lib/console.h>
+#include <lib/workqueue.h>
+#include <stdio.h>
+#include <string.h>
+
+#define COUNT 10000
+#define CHUNK 64
+
+static uint8_t touched[COUNT];
+
+static void mark_range(size_t start, size_t end, void *arg)
+{
+    volatile int *calls = arg;
+
+    for (size_t i = start; i < end; i++)
+        touched[i]++;
+    atomic_add(calls, 1);
+}
+
+static void nop_work(void *arg)
+{
+}
+
+static void signal_work(void *arg)
+{
+    event_signal((event_t *)arg, false);
+}
+
+int workqueue_tests(int argc, const cmd_args *argv)
+{
+    printf("running work item tests...\n");
+
+    event_t ev;
+    event_init(&ev, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+    work_t w = WORK_INITIAL_VALUE(w, signal_work, &ev);
+    for (uint i = 0; i < 100; i++) {
+        if (workqueue_submit(&w) != NO_ERROR)
+            panic("submit %u failed\n", i);
+        if (event_wait_timeout(&ev, 1000) != NO_ERROR)
+            panic("work %u never ran\n", i);
+    }
+    event_destroy(&ev);
+
+    // Above the workers' priority our own cpu's worker can't get to the item
+    // before we cancel it, though another cpu's may occasionally steal it.
+    work_t c = WORK_INITIAL_VALUE(c, nop_work, NULL);
+    thread_t *t = get_current_thread();
+    int old_priority = t->priority;
+    uint cancelled = 0;
+    thread_set_priority(HIGHEST_PRIORITY);
+    for (uint i = 0; i < 100; i++) {
+        if (workqueue_submit(&c) != NO_ERROR)
+            panic("submit for cancel failed\n");
+        status_t err = workqueue_submit(&c);
+        if (err != ERR_ALREADY_EXISTS && err != NO_ERROR)
+            panic("double submit returned %d\n", err);
+        if (workqueue_cancel(&c))
+            cancelled++;
+        if (c.state != 0 || workqueue_cancel(&c))
+            panic("still queued after cancel\n");
+    }
+    thread_set_priority(old_priority);
+    if (cancelled == 0)
+        panic("nothing cancelled\n");
+
+    printf("running parallel_for tests...\n");
+
+    for (size_t chunk = 1; chunk <= COUNT; chunk *= 7) {
+        volatile int calls = 0;
+
+        memset(touched, 0, sizeof(touched));
+        parallel_for(0, COUNT, chunk, mark_range, (void *)&calls);
+
+        for (uint i = 0; i < COUNT; i++) {
+            if (touched[i] != 1)
+                panic("chunk %zu: index %u visited %u times\n", chunk, i, touched[i]);
+        }
+        if (calls != (int)((COUNT + chunk - 1) / chunk))
+            panic("chunk %zu: %d calls\n", chunk, calls);
+    }
+
+    // Empty and unaligned ranges.
+    volatile int calls = 0;
+    parallel_for(5, 5, CHUNK, mark_range, (void *)&calls);
+    if (calls != 0)
+        panic("empty range ran\n");
+
+    memset(touched, 0, sizeof(touched));
+    parallel_for(3, COUNT - 5, CHUNK, mark_range, (void *)&calls);
+    for (uint i = 0; i < COUNT; i++) {
+        if (touched[i] != (i >= 3 && i < COUNT - 5))
+            panic("unaligned range: index %u visited %u times\n", i, touched[i]);
+    }
+
+    printf("workqueue tests passed\n");
+
+    return NO_ERROR;
+}
@@ -191,13 +191,16 @@ static void zynq_common_target_init(uint level)
     minip_set_macaddr(mac_addr);
     gem_set_macaddr(mac_addr);
 
+    /* the gem fills in tcp checksums on the way out */
+    minip_set_tx_offloads(MINIP_TX_OFFLOAD_CSUM, 0);
+
     if (!use_dhcp && ip_addr != IPV4_NONE) {
         minip_init(gem_send_raw_pkt, NULL, ip_addr, ip_mask, ip_gateway);
     } else {
         /* Configure IP stack and hook to the driver */
         minip_init_dhcp(gem_send_raw_pkt, NULL);
     }
-    gem_set_callback(minip_rx_driver_callback);
+    gem_set_owned_callback(minip_rx_driver_callback_owned);
 #endif
 }
 
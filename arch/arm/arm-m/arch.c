@@ -92,6 +92,11 @@ void arch_early_init(void)
     /* FPU settings ------------------------------------------------------------*/
 #if (__FPU_PRESENT == 1) && (__FPU_USED == 1)
     SCB->CPACR |= ((3UL << 10*2)|(3UL << 11*2));  /* set CP10 and CP11 Full Access */
+
+    /* have exception entry only reserve room for the fpu registers of threads that
+     * used it, and only write them out if the handler or a context switch touches
+     * the fpu. threads that never use it take the short frame. */
+    FPU->FPCCR |= FPU_FPCCR_ASPEN_Msk | FPU_FPCCR_LSPEN_Msk;
 #endif
 
 #if ARM_WITH_CACHE
@@ -148,7 +153,7 @@ void _arm_cm_set_irqpri(uint32_t pri)
 #endif
 
 
-void arm_cm_irq_entry(void)
+__FAST_CODE void arm_cm_irq_entry(void)
 {
     // Set PRIMASK to 1
     // This is so that later calls to arch_ints_disabled() returns true while we're inside the int handler
@@ -162,7 +167,7 @@ void arm_cm_irq_entry(void)
     target_set_debug_led(1, true);
 }
 
-void arm_cm_irq_exit(bool reschedule)
+__FAST_CODE void arm_cm_irq_exit(bool reschedule)
 {
     target_set_debug_led(1, false);
 
@@ -27,6 +27,10 @@
 /* externals */
 extern unsigned int __data_start_rom, __data_start, __data_end;
 extern unsigned int __bss_start, __bss_end;
+#if WITH_FAST_SECTIONS
+extern unsigned int __fast_text_start_rom, __fast_text_start, __fast_text_end;
+extern unsigned int __fast_data_start_rom, __fast_data_start, __fast_data_end;
+#endif
 
 extern void lk_main(void) __NO_RETURN __EXTERNALLY_VISIBLE;
 
@@ -41,6 +45,22 @@ void _start(void)
             *dest++ = *src++;
     }
 
+#if WITH_FAST_SECTIONS
+    /* copy the hot paths into tightly coupled memory. this has to happen before bss
+     * is cleared, on one segment builds the images are loaded on top of it. */
+    unsigned int *src = &__fast_text_start_rom;
+    unsigned int *dest = &__fast_text_start;
+    while (dest != &__fast_text_end)
+        *dest++ = *src++;
+
+    src = &__fast_data_start_rom;
+    dest = &__fast_data_start;
+    while (dest != &__fast_data_end)
+        *dest++ = *src++;
+
+    __asm__ volatile("dsb; isb" ::: "memory");
+#endif
+
     /* zero out bss */
     unsigned int *bss = &__bss_start;
     while (bss != &__bss_end)
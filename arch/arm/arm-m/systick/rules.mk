@@ -2,6 +2,13 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 
 MODULE := $(LOCAL_DIR)
 
+# set ARM_CM_SYSTICK_TICKLESS := 1 in the platform or target to run SysTick
+# one-shot instead of as a periodic tick
+ifeq ($(ARM_CM_SYSTICK_TICKLESS),1)
+GLOBAL_DEFINES += \
+	PLATFORM_HAS_DYNAMIC_TIMER=1
+endif
+
 MODULE_SRCS += \
 	$(LOCAL_DIR)/systick.c
 
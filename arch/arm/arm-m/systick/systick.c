@@ -41,6 +41,205 @@
 
 #define LOCAL_TRACE 0
 
+#if PLATFORM_HAS_DYNAMIC_TIMER
+/*
+ * tickless mode. SysTick counts down from the longest reload it has and the cycles
+ * it has counted add up in a 64 bit total. a one-shot cuts the current count short
+ * to end on the deadline, or as close as 24 bits reach, after which the counter goes
+ * back to running free. the only interrupts are for deadlines and for wraps, which
+ * come every 2^24 cycles while idle.
+ */
+#define SYSTICK_MAX (SysTick_LOAD_RELOAD_Msk + 1)
+
+/* shortest count worth programming, anything less is over before the irq is taken */
+#define SYSTICK_MIN 64
+
+static uint32_t tick_rate = 0;
+
+/* cycles counted up to the start of the current count, and its length */
+static volatile uint64_t cycles;
+static volatile uint32_t count;
+
+/* in cycles, 0 if no one-shot is pending */
+static uint64_t deadline;
+
+static platform_timer_callback cb;
+static void *cb_args;
+
+/* cycles since the counter was started */
+static uint64_t systick_cycles(void)
+{
+    uint64_t c;
+    uint32_t n, val;
+    bool wrapped;
+
+    do {
+        c = cycles;
+        n = count;
+        val = SysTick->VAL;
+        wrapped = SCB->ICSR & SCB_ICSR_PENDSTSET_Msk;
+        if (wrapped) {
+            /* the first read may be from either side of the wrap, this one is after it */
+            val = SysTick->VAL;
+        }
+    } while (cycles != c || count != n);
+
+    /* zero is the last cycle of a count, the reload happens on the next one */
+    if (wrapped && val != 0)
+        return c + n + (SYSTICK_MAX - 1 - val);
+
+    return c + n - 1 - val;
+}
+
+/* fold what the current count has done into the total and start a new one of n cycles.
+ * called with interrupts disabled. */
+static void systick_restart(uint32_t n)
+{
+    uint64_t now = systick_cycles();
+
+    SysTick->LOAD = n - 1;
+    SysTick->VAL = 0;
+    DSB;
+    /* the counter has reloaded by now, every count after this one runs free */
+    SysTick->LOAD = SYSTICK_MAX - 1;
+    SCB->ICSR = SCB_ICSR_PENDSTCLR_Msk;
+
+    cycles = now;
+    count = n;
+}
+
+/* restart the counter to end on the deadline, if it's close enough */
+static void systick_arm(void)
+{
+    uint64_t now = systick_cycles();
+    uint64_t left = deadline > now ? deadline - now : 0;
+
+    if (left < SYSTICK_MAX)
+        systick_restart(MAX(left, SYSTICK_MIN));
+}
+
+static uint64_t cycles_to_units(uint64_t c, uint32_t units_per_sec)
+{
+    return c / tick_rate * units_per_sec + c % tick_rate * units_per_sec / tick_rate;
+}
+
+/* rounds up, a deadline mustn't come early */
+static uint64_t ns_to_cycles(lk_time_ns_t ns)
+{
+    return ns / 1000000000 * tick_rate + (ns % 1000000000 * tick_rate + 999999999) / 1000000000;
+}
+
+/* main systick irq handler */
+__FAST_CODE void _systick(void)
+{
+    arm_cm_irq_entry();
+
+    bool fire = false;
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    /* the count that just ended goes on the total, the one after it is running free */
+    cycles += count;
+    count = SYSTICK_MAX;
+
+    if (deadline != 0) {
+        if (systick_cycles() >= deadline) {
+            deadline = 0;
+            fire = true;
+        } else {
+            /* the deadline was further out than one count reaches */
+            systick_arm();
+        }
+    }
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    bool resched = false;
+    if (fire && cb) {
+        if (cb(cb_args, current_time()) == INT_RESCHEDULE)
+            resched = true;
+    }
+
+    arm_cm_irq_exit(resched);
+}
+
+static status_t systick_set_oneshot(platform_timer_callback callback, void *arg, uint64_t delta)
+{
+    DEBUG_ASSERT(tick_rate != 0);
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    cb = callback;
+    cb_args = arg;
+    deadline = systick_cycles() + MAX(delta, 1);
+    systick_arm();
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    return NO_ERROR;
+}
+
+status_t platform_set_oneshot_timer(platform_timer_callback callback, void *arg, lk_time_t interval)
+{
+    LTRACEF("callback %p, arg %p, interval %u\n", callback, arg, interval);
+
+    return systick_set_oneshot(callback, arg, ns_to_cycles(interval * 1000000ULL));
+}
+
+status_t platform_set_oneshot_timer_ns(platform_timer_callback callback, void *arg, lk_time_ns_t interval)
+{
+    LTRACEF("callback %p, arg %p, interval %llu\n", callback, arg, interval);
+
+    return systick_set_oneshot(callback, arg, ns_to_cycles(interval));
+}
+
+void platform_stop_timer(void)
+{
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    /* the counter keeps going for current_time(), the next wrap just won't call out */
+    deadline = 0;
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+status_t platform_set_periodic_timer(platform_timer_callback callback, void *arg, lk_time_t interval)
+{
+    /* the kernel only asks for one-shots when the timer is dynamic */
+    return ERR_NOT_SUPPORTED;
+}
+
+lk_time_t current_time(void)
+{
+    return cycles_to_units(systick_cycles(), 1000);
+}
+
+lk_bigtime_t current_time_hires(void)
+{
+    return cycles_to_units(systick_cycles(), 1000000);
+}
+
+lk_time_ns_t current_time_ns(void)
+{
+    return cycles_to_units(systick_cycles(), 1000000000);
+}
+
+void arm_cm_systick_init(uint32_t mhz)
+{
+    tick_rate = mhz;
+
+    /* start counting now, time has to run whether or not anything is waiting on it */
+    count = SYSTICK_MAX;
+    SysTick->LOAD = SYSTICK_MAX - 1;
+    SysTick->VAL = 0;
+    SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_TICKINT_Msk | SysTick_CTRL_ENABLE_Msk;
+}
+
+#else
+
 static volatile uint64_t ticks;
 static uint32_t tick_rate = 0;
 static uint32_t tick_rate_mhz = 0;
@@ -68,7 +267,7 @@ static void arm_cm_systick_cancel_periodic(void)
 }
 
 /* main systick irq handler */
-void _systick(void)
+__FAST_CODE void _systick(void)
 {
     ticks++;
 
@@ -143,3 +342,5 @@ void arm_cm_systick_init(uint32_t mhz)
     tick_rate = mhz;
     tick_rate_mhz = mhz / 1000000;
 }
+
+#endif // PLATFORM_HAS_DYNAMIC_TIMER
@@ -178,7 +178,7 @@ static void pendsv(struct arm_cm_exception_frame_long *frame)
  * raw pendsv exception handler, triggered by interrupt glue to schedule
  * a preemption check.
  */
-__NAKED void _pendsv(void)
+__NAKED __FAST_CODE void _pendsv(void)
 {
     __asm__ volatile(
         SAVE_REGS
@@ -214,10 +214,10 @@ __NAKED static void _half_save_and_svc(struct thread *oldthread, struct thread *
         "tst    r2, #1;"
         "beq    0f;"
 
-        /* save part of the fpu context on the stack */
+        /* s0-s15 are caller saved, so a thread that called its way here
+         * has nothing live in them. only fpscr goes on the stack. */
         "vmrs   r2, fpscr;"
         "push   { r2 };"
-        "vpush  { s0-s15 };"
 
         /* save the top regs into the thread struct */
         "add    r2, r0, %[fp_off];"
@@ -287,10 +287,10 @@ __NAKED static void _arch_non_preempt_context_switch(struct thread *oldthread, s
         "tst    r2, #1;"
         "beq    0f;"
 
-        /* save part of the fpu context on the stack */
+        /* s0-s15 are caller saved, so a thread that called its way here
+         * has nothing live in them. only fpscr goes on the stack. */
         "vmrs   r2, fpscr;"
         "push   { r2 };"
-        "vpush  { s0-s15 };"
 
         /* save the top regs into the thread struct */
         "add    r2, r0, %[fp_off];"
@@ -316,7 +316,6 @@ __NAKED static void _arch_non_preempt_context_switch(struct thread *oldthread, s
         "add    r3, r1, %[fp_off];"
         "vldm   r3, { s16-s31 };"
 
-        "vpop   { s0-s15 };"
         "pop    { r3 };"
         "vmsr   fpscr, r3;"
         "b      1f;"
@@ -351,8 +350,7 @@ __NAKED static void _thread_mode_bounce(bool fpused)
         "tst    r0, #1;"
         "beq    0f;"
 
-        /* restore fpu context */
-        "vpop   { s0-s15 };"
+        /* restore fpscr, s16-s31 were loaded before the bounce */
         "pop    { r0 };"
         "vmsr   fpscr, r0;"
         "b      1f;"
@@ -505,6 +503,44 @@ void arch_context_switch(struct thread *oldthread, struct thread *newthread)
 
 }
 
+/*
+ * With an fpu the first switch marks the thread as using it, so its fp context
+ * is saved from then on. That's the price of keeping s16-s31 across a switch.
+ */
+__NAKED void arch_fiber_switch(vaddr_t *old_sp, vaddr_t new_sp)
+{
+    __asm__ volatile(
+        SAVE_REGS
+#if (__FPU_PRESENT == 1) && (__FPU_USED == 1)
+        "vpush  { s16-s31 };"
+#endif
+        SAVE_SP(r0, r2, 0)
+
+        "mov    sp, r1;"
+#if (__FPU_PRESENT == 1) && (__FPU_USED == 1)
+        "vpop   { s16-s31 };"
+#endif
+        RESTORE_REGS
+        "bx     lr;"
+    );
+}
+
+vaddr_t arch_fiber_stack_init(vaddr_t stack_top, void (*entry)(void))
+{
+    struct {
+#if (__FPU_PRESENT == 1) && (__FPU_USED == 1)
+        uint32_t s[16];
+#endif
+        struct arm_cm_context_switch_frame regs;
+    } *frame = (void *)ROUNDDOWN(stack_top, 8);
+    frame--;
+
+    memset(frame, 0, sizeof(*frame));
+    frame->regs.lr = (uint32_t)entry;
+
+    return (vaddr_t)frame;
+}
+
 void arch_dump_thread(thread_t *t)
 {
     if (t->state != THREAD_RUNNING) {
@@ -140,9 +140,13 @@ void arch_init(void)
     /* flush the release of the lock, since the secondary cpus are running without cache on */
     arch_clean_cache_range((addr_t)&arm_boot_cpu_lock, sizeof(arm_boot_cpu_lock));
 
+    /* all of them are waiting in wfe for the release */
+    smp_mb();
+    __asm__ volatile("sev");
+
 #if ARM_ARCH_WAIT_FOR_SECONDARIES
-    /* wait for secondary cpus to boot before arm_mmu_init below, which will remove
-     * temporary boot mappings
+    /* wait for secondary cpus to get off the boot mappings before arm_mmu_init below,
+     * which will remove temporary boot mappings
      * TODO: find a cleaner way to do this than this #define
      */
     while (secondaries_to_init > 0) {
@@ -177,6 +181,13 @@ void arm_secondary_entry(uint asm_cpu_num)
     sctlr |= (1<<12) | (1<<2); // enable i and dcache
     arm_write_sctlr(sctlr);
 
+    /* we're running on the kernel mappings now, so the main cpu can carry on
+     * with its own init while this one runs its per cpu init in parallel.
+     */
+    atomic_add(&secondaries_to_init, -1);
+    smp_mb();
+    __asm__ volatile("sev");
+
     /* run early secondary cpu init routines up to the threading level */
     lk_init_level(LK_INIT_FLAG_SECONDARY_CPUS, LK_INIT_LEVEL_EARLIEST, LK_INIT_LEVEL_THREADING - 1);
 
@@ -186,11 +197,6 @@ void arm_secondary_entry(uint asm_cpu_num)
     LTRACEF("sctlr 0x%x\n", arm_read_sctlr());
     LTRACEF("actlr 0x%x\n", arm_read_actlr());
 
-    /* we're done, tell the main cpu we're up */
-    atomic_add(&secondaries_to_init, -1);
-    smp_mb();
-    __asm__ volatile("sev");
-
     lk_secondary_cpu_entry();
 }
 #endif
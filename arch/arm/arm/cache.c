@@ -20,3 +20,90 @@
  * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
+#include <arch/ops.h>
+#include <arch/arm.h>
+#include <arch/defines.h>
+#include <stdlib.h>
+#if WITH_DEV_CACHE_PL310
+#include <dev/cache/pl310.h>
+#endif
+
+#if ARCH_HAS_CACHE_RANGES
+
+/*
+ * Above this many bytes in one batch, clean and invalidate the whole inner
+ * cache by set/way instead of walking the ranges. Set/way operations only
+ * reach the calling cpu's caches and skip an outer pl310, so this is only
+ * done on uniprocessor builds without one, and never for a plain invalidate,
+ * which must not write back lines outside the ranges. 0 disables it.
+ */
+#ifndef ARM_CACHE_SETWAY_THRESHOLD
+#if WITH_SMP || WITH_DEV_CACHE_PL310
+#define ARM_CACHE_SETWAY_THRESHOLD 0
+#else
+#define ARM_CACHE_SETWAY_THRESHOLD (128 * 1024)
+#endif
+#endif
+
+#define CACHE_RANGES_OP(crm, opc2, ranges, count) \
+    for (size_t i = 0; i < (count); i++) { \
+        addr_t end = (ranges)[i].start + (ranges)[i].len; \
+        for (addr_t a = ROUNDDOWN((ranges)[i].start, CACHE_LINE); a < end; a += CACHE_LINE) \
+            __asm__ volatile("mcr p15, 0, %0, c7, " #crm ", " #opc2 :: "r" (a) : "memory"); \
+    }
+
+static bool cache_ranges_setway(const struct arch_cache_range *ranges, size_t count)
+{
+#if ARM_CACHE_SETWAY_THRESHOLD
+    size_t total = 0;
+
+    for (size_t i = 0; i < count; i++)
+        total += ranges[i].len;
+    if (total >= ARM_CACHE_SETWAY_THRESHOLD) {
+        arm_clean_invalidate_cache_all();
+        return true;
+    }
+#endif
+    return false;
+}
+
+void arch_clean_cache_ranges(const struct arch_cache_range *ranges, size_t count)
+{
+    if (cache_ranges_setway(ranges, count))
+        return;
+
+    CACHE_RANGES_OP(c10, 1, ranges, count);     // clean cache to PoC by MVA
+    DSB;
+
+#if WITH_DEV_CACHE_PL310
+    for (size_t i = 0; i < count; i++)
+        pl310_clean_range(ranges[i].start, ranges[i].len);
+#endif
+}
+
+void arch_clean_invalidate_cache_ranges(const struct arch_cache_range *ranges, size_t count)
+{
+    if (cache_ranges_setway(ranges, count))
+        return;
+
+    CACHE_RANGES_OP(c14, 1, ranges, count);     // clean & invalidate dcache to PoC by MVA
+    DSB;
+
+#if WITH_DEV_CACHE_PL310
+    for (size_t i = 0; i < count; i++)
+        pl310_clean_invalidate_range(ranges[i].start, ranges[i].len);
+#endif
+}
+
+void arch_invalidate_cache_ranges(const struct arch_cache_range *ranges, size_t count)
+{
+    CACHE_RANGES_OP(c6, 1, ranges, count);      // invalidate dcache to PoC by MVA
+    DSB;
+
+#if WITH_DEV_CACHE_PL310
+    for (size_t i = 0; i < count; i++)
+        pl310_invalidate_range(ranges[i].start, ranges[i].len);
+#endif
+}
+
+#endif // ARCH_HAS_CACHE_RANGES
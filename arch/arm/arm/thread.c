@@ -95,6 +95,26 @@ void arch_context_switch(thread_t *oldthread, thread_t *newthread)
     arm_context_switch(&oldthread->arch.sp, newthread->arch.sp);
 }
 
+vaddr_t arch_fiber_stack_init(vaddr_t stack_top, void (*entry)(void))
+{
+    struct {
+#if ARM_WITH_VFP
+        uint64_t d[8];
+#endif
+        vaddr_t pad; /* r3 in arch_fiber_switch */
+        struct context_switch_frame regs;
+    } *frame = (void *)ROUNDDOWN(stack_top, 8);
+    frame--;
+
+    /* the pops must leave sp where it started, 8 byte aligned */
+    STATIC_ASSERT(sizeof(*frame) % 8 == 0);
+
+    memset(frame, 0, sizeof(*frame));
+    frame->regs.lr = (vaddr_t)entry;
+
+    return (vaddr_t)frame;
+}
+
 void arch_dump_thread(thread_t *t)
 {
     if (t->state != THREAD_RUNNING) {
@@ -461,6 +461,11 @@ static inline uint32_t arch_cycle_count(void) { return _arch_cycle_count(); }
 #define wmb()       DSB
 #define rmb()       DSB
 
+#if ARM_WITH_CACHE && ARM_ISA_ARMV7 && !ARM_ISA_ARMV7M
+/* batched cache maintenance lives in arm/cache.c */
+#define ARCH_HAS_CACHE_RANGES 1
+#endif
+
 #ifdef WITH_SMP
 #define smp_mb()    DMB
 #define smp_wmb()   DMB
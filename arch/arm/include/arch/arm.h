@@ -54,6 +54,8 @@ void arm_context_switch(vaddr_t *old_sp, vaddr_t new_sp);
 
 void arm_chain_load(paddr_t entry, ulong arg0, ulong arg1, ulong arg2, ulong arg3) __NO_RETURN;
 
+void arm_clean_invalidate_cache_all(void);
+
 static inline uint32_t read_cpsr(void)
 {
     uint32_t cpsr;
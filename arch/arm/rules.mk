@@ -294,6 +294,19 @@ MODULE_DEPS += \
 
 ARCH_OPTFLAGS := -Os
 WITH_LINKER_GC ?= 1
+
+# platforms with tightly coupled memory set ARM_CM_ITCM_BASE/SIZE and
+# ARM_CM_DTCM_BASE/SIZE to have __FAST_CODE and __FAST_DATA copied into it at boot
+ifneq ($(ARM_CM_ITCM_BASE),)
+GLOBAL_DEFINES += \
+	WITH_FAST_SECTIONS=1
+
+EXTRA_LINKER_SCRIPTS += \
+	$(BUILDDIR)/system-tcm.ld
+
+GENERATED += \
+	$(BUILDDIR)/system-tcm.ld
+endif
 endif
 
 # try to find toolchain
@@ -348,6 +361,12 @@ $(BUILDDIR)/system-twosegment.ld: $(LOCAL_DIR)/system-twosegment.ld $(wildcard a
 	$(NOECHO)sed "s/%ROMBASE%/$(ROMBASE)/;s/%MEMBASE%/$(MEMBASE)/;s/%MEMSIZE%/$(MEMSIZE)/" < $< > $@.tmp
 	@$(call TESTANDREPLACEFILE,$@.tmp,$@)
 
+$(BUILDDIR)/system-tcm.ld: $(LOCAL_DIR)/arm-m/system-tcm.ld linkerscript.phony
+	@echo generating $@
+	@$(MKDIR)
+	$(NOECHO)sed "s/%ITCMBASE%/$(ARM_CM_ITCM_BASE)/g;s/%ITCMSIZE%/$(ARM_CM_ITCM_SIZE)/;s/%DTCMBASE%/$(ARM_CM_DTCM_BASE)/g;s/%DTCMSIZE%/$(ARM_CM_DTCM_SIZE)/" < $< > $@.tmp
+	@$(call TESTANDREPLACEFILE,$@.tmp,$@)
+
 linkerscript.phony:
 .PHONY: linkerscript.phony
 
@@ -36,8 +36,8 @@
 #define LOCAL_TRACE 0
 
 #if WITH_SMP
-/* smp boot lock */
-static spin_lock_t arm_boot_cpu_lock = 1;
+/* smp boot gate, the secondaries all wait for it to be cleared and then go at once */
+static volatile uint32_t arm_boot_cpu_hold = 1;
 static volatile int secondaries_to_init = 0;
 #endif
 
@@ -75,10 +75,14 @@ void arch_init(void)
     LTRACEF("releasing %d secondary cpus\n", secondaries_to_init);
 
     /* release the secondary cpus */
-    spin_unlock(&arm_boot_cpu_lock);
+    smp_mb();
+    arm_boot_cpu_hold = 0;
 
-    /* flush the release of the lock, since the secondary cpus are running without cache on */
-    arch_clean_cache_range((addr_t)&arm_boot_cpu_lock, sizeof(arm_boot_cpu_lock));
+    /* flush the release, since the secondary cpus are running without cache on */
+    arch_clean_cache_range((addr_t)&arm_boot_cpu_hold, sizeof(arm_boot_cpu_hold));
+
+    /* the secondaries are polling rather than holding the monitor, so wake them explicitly */
+    __asm__ volatile("dsb sy; sev" ::: "memory");
 #endif
 }
 
@@ -140,8 +144,14 @@ void arm64_secondary_entry(ulong asm_cpu_num)
 
     arm64_cpu_early_init();
 
-    spin_lock(&arm_boot_cpu_lock);
-    spin_unlock(&arm_boot_cpu_lock);
+    /*
+     * wait to be released. a lock here would let the secondaries through one
+     * at a time, only watching a flag lets them all start their per cpu init
+     * together.
+     */
+    while (arm_boot_cpu_hold != 0)
+        __asm__ volatile("wfe");
+    smp_mb();
 
     /* run early secondary cpu init routines up to the threading level */
     lk_init_level(LK_INIT_FLAG_SECONDARY_CPUS, LK_INIT_LEVEL_EARLIEST, LK_INIT_LEVEL_THREADING - 1);
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <arch/ops.h>
+#include <arch/arm64.h>
+#include <arch/defines.h>
+#include <stdlib.h>
+
+/*
+ * Above this many bytes in one batch, clean and invalidate the whole data
+ * cache by set/way instead of walking the ranges. Set/way operations only
+ * reach the calling cpu's caches, so this is only done on uniprocessor
+ * builds, and never for a plain invalidate, which must not write back lines
+ * outside the ranges. 0 disables it.
+ */
+#ifndef ARM64_CACHE_SETWAY_THRESHOLD
+#if WITH_SMP
+#define ARM64_CACHE_SETWAY_THRESHOLD 0
+#else
+#define ARM64_CACHE_SETWAY_THRESHOLD (256 * 1024)
+#endif
+#endif
+
+#define CACHE_RANGES_OP(insn, ranges, count) \
+    for (size_t i = 0; i < (count); i++) { \
+        addr_t end = (ranges)[i].start + (ranges)[i].len; \
+        for (addr_t a = ROUNDDOWN((ranges)[i].start, CACHE_LINE); a < end; a += CACHE_LINE) \
+            __asm__ volatile(insn ", %0" :: "r" (a) : "memory"); \
+    }
+
+static bool cache_ranges_setway(const struct arch_cache_range *ranges, size_t count)
+{
+#if ARM64_CACHE_SETWAY_THRESHOLD
+    size_t total = 0;
+
+    for (size_t i = 0; i < count; i++)
+        total += ranges[i].len;
+    if (total >= ARM64_CACHE_SETWAY_THRESHOLD) {
+        arm64_clean_invalidate_cache_all();
+        return true;
+    }
+#endif
+    return false;
+}
+
+void arch_clean_cache_ranges(const struct arch_cache_range *ranges, size_t count)
+{
+    if (cache_ranges_setway(ranges, count))
+        return;
+
+    CACHE_RANGES_OP("dc cvac", ranges, count);     // clean cache to PoC by MVA
+    __asm__ volatile("dsb sy" ::: "memory");
+}
+
+void arch_clean_invalidate_cache_ranges(const struct arch_cache_range *ranges, size_t count)
+{
+    if (cache_ranges_setway(ranges, count))
+        return;
+
+    CACHE_RANGES_OP("dc civac", ranges, count);    // clean & invalidate dcache to PoC by MVA
+    __asm__ volatile("dsb sy" ::: "memory");
+}
+
+void arch_invalidate_cache_ranges(const struct arch_cache_range *ranges, size_t count)
+{
+    CACHE_RANGES_OP("dc ivac", ranges, count);     // invalidate dcache to PoC by MVA
+    __asm__ volatile("dsb sy" ::: "memory");
+}
@@ -25,6 +25,9 @@
 #include <bits.h>
 #include <arch/arch_ops.h>
 #include <arch/arm64.h>
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
 
 #define SHUTDOWN_ON_FATAL 1
 
@@ -51,6 +54,43 @@ static void dump_iframe(const struct arm64_iframe_long *iframe)
     printf("spsr 0x%16llx\n", iframe->spsr);
 }
 
+/* hand translation and permission faults to the vm, true if it fixed things up */
+static bool arm64_vm_fault(struct arm64_iframe_long *iframe, uint64_t far, uint32_t iss,
+                           bool instruction, bool user)
+{
+#if WITH_KERNEL_VM
+    uint32_t fsc = BITS(iss, 5, 0);
+    uint pf_flags = 0;
+
+    if (instruction)
+        pf_flags |= VMM_PF_FLAG_INSTRUCTION;
+    else if (BIT(iss, 6)) /* WnR */
+        pf_flags |= VMM_PF_FLAG_WRITE;
+    if (user)
+        pf_flags |= VMM_PF_FLAG_USER;
+
+    switch (fsc & ~0x3) {
+        case 0b000100: /* translation fault, level 0-3 */
+            pf_flags |= VMM_PF_FLAG_NOT_PRESENT;
+            break;
+        case 0b001100: /* permission fault, level 0-3 */
+            break;
+        default:
+            return false;
+    }
+
+    /* it may block, so put irqs back the way the faulting code had them */
+    if (!(iframe->spsr & (1 << 7)))
+        arch_enable_ints();
+    status_t err = vmm_page_fault_handler(far, pf_flags);
+    arch_disable_ints();
+
+    return err >= 0;
+#else
+    return false;
+#endif
+}
+
 __WEAK void arm64_syscall(struct arm64_iframe_long *iframe, bool is_64bit)
 {
     panic("unhandled syscall vector\n");
@@ -82,10 +122,18 @@ void arm64_sync_exception(struct arm64_iframe_long *iframe)
 #endif
         case 0b100000: /* instruction abort from lower level */
         case 0b100001: /* instruction abort from same level */
+            if (arm64_vm_fault(iframe, ARM64_READ_SYSREG(far_el1), iss, true, ec == 0b100000))
+                return;
             printf("instruction abort: PC at 0x%llx\n", iframe->elr);
             break;
         case 0b100100: /* data abort from lower level */
         case 0b100101: { /* data abort from same level */
+            /* read the FAR register */
+            uint64_t far = ARM64_READ_SYSREG(far_el1);
+
+            if (arm64_vm_fault(iframe, far, iss, false, ec == 0b100100))
+                return;
+
             for (fault_handler = __fault_handler_table_start;
                     fault_handler < __fault_handler_table_end;
                     fault_handler++) {
@@ -95,9 +143,6 @@ void arm64_sync_exception(struct arm64_iframe_long *iframe)
                 }
             }
 
-            /* read the FAR register */
-            uint64_t far = ARM64_READ_SYSREG(far_el1);
-
             /* decode the iss */
             if (BIT(iss, 24)) { /* ISV bit */
                 printf("data fault: PC at 0x%llx, FAR 0x%llx, iss 0x%x (DFSC 0x%lx)\n",
@@ -22,12 +22,73 @@
  */
 
 #include <arch/arm64.h>
+#include <assert.h>
+#include <arch/mp.h>
+#include <kernel/spinlock.h>
 #include <kernel/thread.h>
 #include <trace.h>
 
 #define LOCAL_TRACE 0
 
-static struct fpstate *current_fpstate[SMP_MAX_CPUS];
+/*
+ * The fp registers of each cpu hold current_fpstate[cpu]. When fpstate_unsaved[cpu]
+ * is set they are the only up to date copy: the owner was switched out without
+ * saving, since it can't run anywhere else, and its state is written back only
+ * when another thread on this cpu traps on its first fp use. Switching between
+ * threads that don't touch fp then costs nothing.
+ *
+ * A cpu's slots are changed by that cpu, or by a dying thread dropping itself
+ * from wherever it was left, always under fpstate_lock[cpu]. If the owner is
+ * moved to another cpu while its registers are still here, that cpu asks for
+ * them with a generic ipi when the thread next touches fp.
+ */
+static struct fpstate * volatile current_fpstate[SMP_MAX_CPUS];
+static volatile bool fpstate_unsaved[SMP_MAX_CPUS];
+static spin_lock_t fpstate_lock[SMP_MAX_CPUS];
+
+static void arm64_fpu_save_regs(struct fpstate *fpstate);
+
+/* write back this cpu's unsaved registers, whether or not fp is enabled right now */
+static void arm64_fpu_writeback(uint cpu)
+{
+    uint32_t cpacr = ARM64_READ_SYSREG(cpacr_el1);
+
+    if (((cpacr >> 20) & 3) != 3)
+        ARM64_WRITE_SYSREG(cpacr_el1, cpacr | (3 << 20));
+    arm64_fpu_save_regs(current_fpstate[cpu]);
+    if (((cpacr >> 20) & 3) != 3)
+        ARM64_WRITE_SYSREG(cpacr_el1, cpacr);
+
+    /* the registers must be in memory before anyone sees them as saved */
+    smp_wmb();
+    fpstate_unsaved[cpu] = false;
+}
+
+/* called from the generic ipi, another cpu is waiting for a thread's registers */
+void arm64_fpu_flush(void)
+{
+    uint cpu = arch_curr_cpu_num();
+
+    spin_lock(&fpstate_lock[cpu]);
+    if (fpstate_unsaved[cpu])
+        arm64_fpu_writeback(cpu);
+    spin_unlock(&fpstate_lock[cpu]);
+}
+
+#if WITH_SMP
+/* pull back registers left unsaved on another cpu before the thread moved */
+static void arm64_fpu_fetch_stranded(struct fpstate *fpstate, uint cpu)
+{
+    LTRACEF("fpstate %p stranded on cpu %u\n", fpstate, cpu);
+
+    arch_mp_send_ipi(1U << cpu, MP_IPI_GENERIC);
+    while (current_fpstate[cpu] == fpstate && fpstate_unsaved[cpu]) {
+        /* the other cpu may be spinning here too, waiting on ours */
+        arm64_fpu_flush();
+    }
+    smp_rmb();
+}
+#endif
 
 static void arm64_fpu_load_state(struct thread *t)
 {
@@ -40,9 +101,24 @@ static void arm64_fpu_load_state(struct thread *t)
     }
     LTRACEF("cpu %d, thread %s, load fpstate %p, last cpu %d, last fpstate %p\n",
             cpu, t->name, fpstate, fpstate->current_cpu, current_fpstate[cpu]);
+
+#if WITH_SMP
+    uint last = fpstate->current_cpu;
+    if (last != cpu && current_fpstate[last] == fpstate && fpstate_unsaved[last])
+        arm64_fpu_fetch_stranded(fpstate, last);
+#endif
+
+    spin_lock(&fpstate_lock[cpu]);
+
+    /* evict the previous owner */
+    if (fpstate_unsaved[cpu])
+        arm64_fpu_writeback(cpu);
+
     fpstate->current_cpu = cpu;
     current_fpstate[cpu] = fpstate;
 
+    spin_unlock(&fpstate_lock[cpu]);
+
 
     STATIC_ASSERT(sizeof(fpstate->regs) == 16 * 32);
     __asm__ volatile("ldp     q0, q1, [%0, #(0 * 32)]\n"
@@ -66,9 +142,8 @@ static void arm64_fpu_load_state(struct thread *t)
                      :: "r"(fpstate), "r"(fpstate->fpcr), "r"(fpstate->fpsr));
 }
 
-void arm64_fpu_save_state(struct thread *t)
+static void arm64_fpu_save_regs(struct fpstate *fpstate)
 {
-    struct fpstate *fpstate = &t->arch.fpstate;
     __asm__ volatile("stp     q0, q1, [%2, #(0 * 32)]\n"
                      "stp     q2, q3, [%2, #(1 * 32)]\n"
                      "stp     q4, q5, [%2, #(2 * 32)]\n"
@@ -90,7 +165,80 @@ void arm64_fpu_save_state(struct thread *t)
                      : "=r"(fpstate->fpcr), "=r"(fpstate->fpsr)
                      : "r"(fpstate));
 
-    LTRACEF("thread %s, fpcr %x, fpsr %x\n", t->name, fpstate->fpcr, fpstate->fpsr);
+    LTRACEF("fpstate %p, fpcr %x, fpsr %x\n", fpstate, fpstate->fpcr, fpstate->fpsr);
+}
+
+/*
+ * A dying thread is about to be freed, possibly straight back into the thread
+ * pool. Forget it everywhere, so nothing writes registers into the struct or
+ * hands them to whatever is created in its place.
+ */
+static void arm64_fpu_drop(struct fpstate *fpstate)
+{
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        if (current_fpstate[cpu] != fpstate)
+            continue;
+
+        spin_lock(&fpstate_lock[cpu]);
+        if (current_fpstate[cpu] == fpstate) {
+            current_fpstate[cpu] = NULL;
+            fpstate_unsaved[cpu] = false;
+        }
+        spin_unlock(&fpstate_lock[cpu]);
+    }
+}
+
+static void arm64_fpu_switch_out(struct thread *t, uint cpu, bool enabled)
+{
+    struct fpstate *fpstate = &t->arch.fpstate;
+
+    if (!enabled) {
+        /* untouched since it was switched in, but it may have been moved off this cpu meanwhile */
+        if (SMP_MAX_CPUS > 1 && fpstate_unsaved[cpu] && current_fpstate[cpu] == fpstate &&
+                thread_pinned_cpu(t) != (int)cpu) {
+            spin_lock(&fpstate_lock[cpu]);
+            if (current_fpstate[cpu] == fpstate)
+                arm64_fpu_writeback(cpu);
+            spin_unlock(&fpstate_lock[cpu]);
+        }
+        return;
+    }
+
+    spin_lock(&fpstate_lock[cpu]);
+
+    if (current_fpstate[cpu] != fpstate) {
+        /* fp was turned on without going through the trap, the registers are this thread's now */
+        arm64_fpu_save_regs(fpstate);
+        fpstate->current_cpu = cpu;
+        current_fpstate[cpu] = fpstate;
+        fpstate_unsaved[cpu] = false;
+    } else if (SMP_MAX_CPUS > 1 && thread_pinned_cpu(t) != (int)cpu) {
+        /* it may be picked up by another cpu next, save now rather than have it ask */
+        arm64_fpu_save_regs(fpstate);
+        fpstate_unsaved[cpu] = false;
+    } else {
+        LTRACEF("cpu %u, thread %s, leaving fpstate in registers\n", cpu, t->name);
+        fpstate_unsaved[cpu] = true;
+    }
+
+    spin_unlock(&fpstate_lock[cpu]);
+}
+
+/* fp is turned back off for every thread switched in, the first use traps and brings its state in */
+void arm64_fpu_pre_context_switch(struct thread *t)
+{
+    uint32_t cpacr = ARM64_READ_SYSREG(cpacr_el1);
+    bool enabled = (cpacr >> 20) & 3;
+
+    if (t->state == THREAD_DEATH)
+        arm64_fpu_drop(&t->arch.fpstate);
+    else
+        arm64_fpu_switch_out(t, arch_curr_cpu_num(), enabled);
+
+    if (enabled) {
+        cpacr &= ~(3 << 20);
+        ARM64_WRITE_SYSREG(cpacr_el1, cpacr);
+    }
 }
 
 void arm64_fpu_exception(struct arm64_iframe_long *iframe)
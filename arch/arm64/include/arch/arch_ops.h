@@ -82,6 +82,9 @@ static inline bool arch_fiqs_disabled(void)
 #define rmb()       __asm__ volatile("dsb ld" : : : "memory")
 #define wmb()       __asm__ volatile("dsb st" : : : "memory")
 
+/* batched cache maintenance lives in cache.c */
+#define ARCH_HAS_CACHE_RANGES 1
+
 #ifdef WITH_SMP
 #define smp_mb()    __asm__ volatile("dmb ish" : : : "memory")
 #define smp_rmb()   __asm__ volatile("dmb ishld" : : : "memory")
@@ -70,20 +70,13 @@ struct thread;
 extern void arm64_exception_base(void);
 void arm64_el3_to_el1(void);
 void arm64_fpu_exception(struct arm64_iframe_long *iframe);
-void arm64_fpu_save_state(struct thread *thread);
-
-static inline void arm64_fpu_pre_context_switch(struct thread *thread)
-{
-    uint32_t cpacr = ARM64_READ_SYSREG(cpacr_el1);
-    if ((cpacr >> 20) & 3) {
-        arm64_fpu_save_state(thread);
-        cpacr &= ~(3 << 20);
-        ARM64_WRITE_SYSREG(cpacr_el1, cpacr);
-    }
-}
+void arm64_fpu_pre_context_switch(struct thread *thread);
+void arm64_fpu_flush(void);
 
 /* overridable syscall handler */
 void arm64_syscall(struct arm64_iframe_long *iframe, bool is_64bit);
 
+void arm64_clean_invalidate_cache_all(void);
+
 __END_CDECLS
 
@@ -38,6 +38,10 @@ struct arch_aspace {
     /* range of address space */
     vaddr_t base;
     size_t size;
+
+    /* asid generation in the upper bits, asid in the bottom MMU_ARM64_ASID_BITS,
+     * 0 until the first time it is switched to */
+    uint64_t asid;
 };
 
 __END_CDECLS
@@ -39,6 +39,13 @@
 #define PAGE_SIZE (1UL << PAGE_SIZE_SHIFT)
 #define USER_PAGE_SIZE (1UL << USER_PAGE_SIZE_SHIFT)
 
+/* block mappings one and two levels above the page level, if blocks are
+ * supported there (up to 1GB), used to map large physically contiguous regions */
+#define ARCH_LARGE_PAGE_SIZE_SHIFT (PAGE_SIZE_SHIFT + (PAGE_SIZE_SHIFT - 3))
+#if PAGE_SIZE_SHIFT == SHIFT_4K
+#define ARCH_HUGE_PAGE_SIZE_SHIFT (ARCH_LARGE_PAGE_SIZE_SHIFT + (PAGE_SIZE_SHIFT - 3))
+#endif
+
 #if ARM64_CPU_CORTEX_A53 || ARM64_CPU_CORTEX_A57 || ARM64_CPU_CORTEX_A72
 #define CACHE_LINE 64
 #else
@@ -27,6 +27,11 @@
 
 #define SPIN_LOCK_INITIAL_VALUE (0)
 
+/*
+ * ticket lock: the low 16 bits of the word are the ticket being served, the
+ * next 16 the next ticket to hand out. cpus get the lock in the order they
+ * asked for it.
+ */
 typedef unsigned long spin_lock_t;
 
 typedef unsigned int spin_lock_saved_state_t;
@@ -60,7 +65,9 @@ static inline void arch_spin_lock_init(spin_lock_t *lock)
 
 static inline bool arch_spin_lock_held(spin_lock_t *lock)
 {
-    return *lock != 0;
+    uint32_t val = *(volatile uint32_t *)lock;
+
+    return (val >> 16) != (val & 0xffff);
 }
 
 enum {
@@ -25,6 +25,7 @@
 #include <assert.h>
 #include <debug.h>
 #include <err.h>
+#include <kernel/spinlock.h>
 #include <kernel/vm.h>
 #include <lib/heap.h>
 #include <stdlib.h>
@@ -50,6 +51,15 @@ static inline bool is_valid_vaddr(arch_aspace_t *aspace, vaddr_t vaddr)
     return (vaddr >= aspace->base && vaddr <= aspace->base + aspace->size - 1);
 }
 
+#define ASID_MASK ((1ULL << MMU_ARM64_ASID_BITS) - 1)
+#define ASID_GENERATION_STEP (1ULL << MMU_ARM64_ASID_BITS)
+
+/* the asid to tag this user aspace's tlb entries with */
+static inline uint aspace_asid(const arch_aspace_t *aspace)
+{
+    return aspace->asid & ASID_MASK;
+}
+
 /* convert user level mmu flags to flags that go in L1 descriptors */
 static pte_t mmu_flags_to_pte_attr(uint flags)
 {
@@ -214,7 +224,8 @@ static int alloc_page_table(paddr_t *paddrp, uint page_size_shift)
 
     if (size >= PAGE_SIZE) {
         size_t count = size / PAGE_SIZE;
-        size_t ret = pmm_alloc_contiguous(count, page_size_shift, paddrp, NULL);
+        /* walked on every tlb miss, worth keeping in fast memory if there is any */
+        size_t ret = pmm_alloc_contiguous_etc(count, page_size_shift, PMM_ALLOC_FLAG_FAST, paddrp, NULL);
         if (ret != count)
             return ERR_NO_MEMORY;
     } else {
@@ -249,6 +260,87 @@ static void free_page_table(void *vaddr, paddr_t paddr, uint page_size_shift)
     }
 }
 
+/*
+ * Invalidations collected while unmapping and issued all at once, with a
+ * single barrier on either side. Past ARM64_TLB_GATHER_MAX entries it is
+ * cheaper to drop the whole asid. The inner shareable tlbi forms already reach
+ * every cpu, so this batches the cross cpu shootdown as well.
+ */
+#ifndef ARM64_TLB_GATHER_MAX
+#define ARM64_TLB_GATHER_MAX 32
+#endif
+
+struct tlb_gather {
+    uint asid;
+    uint count; /* more than ARM64_TLB_GATHER_MAX means flush the whole asid */
+    vaddr_t vaddr[ARM64_TLB_GATHER_MAX];
+
+    /* page tables that can't be freed until the walkers have forgotten them */
+    struct list_node free_tables;
+};
+
+static void tlb_gather_init(struct tlb_gather *tlb, uint asid)
+{
+    tlb->asid = asid;
+    tlb->count = 0;
+    list_initialize(&tlb->free_tables);
+}
+
+static void tlb_gather_add(struct tlb_gather *tlb, vaddr_t vaddr)
+{
+    if (tlb->count < ARM64_TLB_GATHER_MAX)
+        tlb->vaddr[tlb->count] = vaddr;
+    if (tlb->count <= ARM64_TLB_GATHER_MAX)
+        tlb->count++;
+}
+
+static void tlb_gather_flush(struct tlb_gather *tlb)
+{
+    if (tlb->count) {
+        /* make the cleared entries visible to the table walkers first */
+        __asm__ volatile("dsb ishst" ::: "memory");
+
+        if (tlb->count > ARM64_TLB_GATHER_MAX) {
+            if (tlb->asid == MMU_ARM64_GLOBAL_ASID)
+                ARM64_TLBI_NOADDR_NOSYNC(vmalle1is);
+            else
+                ARM64_TLBI_NOSYNC(aside1is, (vaddr_t)tlb->asid << 48);
+        } else {
+            for (uint i = 0; i < tlb->count; i++) {
+                if (tlb->asid == MMU_ARM64_GLOBAL_ASID)
+                    ARM64_TLBI_NOSYNC(vaae1is, tlb->vaddr[i] >> 12);
+                else
+                    ARM64_TLBI_NOSYNC(vae1is, tlb->vaddr[i] >> 12 | (vaddr_t)tlb->asid << 48);
+            }
+        }
+
+        __asm__ volatile("dsb ish" ::: "memory");
+        ISB;
+        tlb->count = 0;
+    }
+
+    pmm_free(&tlb->free_tables);
+}
+
+/* unhook a page table, it goes back once the tlb has been flushed */
+static void tlb_gather_free_page_table(struct tlb_gather *tlb, vaddr_t vaddr,
+                                       void *table, paddr_t paddr, uint page_size_shift)
+{
+    /* walk caches can hold on to the table even without any leaf entries */
+    tlb_gather_add(tlb, vaddr);
+
+    if ((1UL << page_size_shift) >= PAGE_SIZE) {
+        vm_page_t *page = paddr_to_vm_page(paddr);
+        if (!page)
+            panic("bad page table paddr 0x%lx\n", paddr);
+        list_add_tail(&tlb->free_tables, &page->node);
+    } else {
+        /* heap sub-page tables can't be queued, flush right away */
+        tlb_gather_flush(tlb);
+        free_page_table(table, paddr, page_size_shift);
+    }
+}
+
 static pte_t *arm64_mmu_get_page_table(vaddr_t index, uint page_size_shift, pte_t *page_table)
 {
     pte_t pte;
@@ -311,7 +403,7 @@ static bool page_table_is_clear(pte_t *page_table, uint page_size_shift)
 static void arm64_mmu_unmap_pt(vaddr_t vaddr, vaddr_t vaddr_rel,
                                size_t size,
                                uint index_shift, uint page_size_shift,
-                               pte_t *page_table, uint asid)
+                               pte_t *page_table, struct tlb_gather *tlb)
 {
     pte_t *next_page_table;
     vaddr_t index;
@@ -341,22 +433,18 @@ static void arm64_mmu_unmap_pt(vaddr_t vaddr, vaddr_t vaddr_rel,
             arm64_mmu_unmap_pt(vaddr, vaddr_rem, chunk_size,
                                index_shift - (page_size_shift - 3),
                                page_size_shift,
-                               next_page_table, asid);
+                               next_page_table, tlb);
             if (chunk_size == block_size ||
                     page_table_is_clear(next_page_table, page_size_shift)) {
                 LTRACEF("pte %p[0x%lx] = 0 (was page table)\n", page_table, index);
                 page_table[index] = MMU_PTE_DESCRIPTOR_INVALID;
-                __asm__ volatile("dmb ishst" ::: "memory");
-                free_page_table(next_page_table, page_table_paddr, page_size_shift);
+                tlb_gather_free_page_table(tlb, vaddr, next_page_table, page_table_paddr,
+                                           page_size_shift);
             }
         } else if (pte) {
             LTRACEF("pte %p[0x%lx] = 0\n", page_table, index);
             page_table[index] = MMU_PTE_DESCRIPTOR_INVALID;
-            CF;
-            if (asid == MMU_ARM64_GLOBAL_ASID)
-                ARM64_TLBI(vaae1is, vaddr >> 12);
-            else
-                ARM64_TLBI(vae1is, vaddr >> 12 | (vaddr_t)asid << 48);
+            tlb_gather_add(tlb, vaddr);
         } else {
             LTRACEF("pte %p[0x%lx] already clear\n", page_table, index);
         }
@@ -439,10 +527,13 @@ static int arm64_mmu_map_pt(vaddr_t vaddr_in, vaddr_t vaddr_rel_in,
 
     return 0;
 
-err:
-    arm64_mmu_unmap_pt(vaddr_in, vaddr_rel_in, size_in - size,
-                       index_shift, page_size_shift, page_table, asid);
-    DSB;
+err: {
+        struct tlb_gather tlb;
+        tlb_gather_init(&tlb, asid);
+        arm64_mmu_unmap_pt(vaddr_in, vaddr_rel_in, size_in - size,
+                           index_shift, page_size_shift, page_table, &tlb);
+        tlb_gather_flush(&tlb);
+    }
     return ERR_GENERIC;
 }
 
@@ -496,9 +587,11 @@ int arm64_mmu_unmap(vaddr_t vaddr, size_t size,
         return ERR_INVALID_ARGS;
     }
 
+    struct tlb_gather tlb;
+    tlb_gather_init(&tlb, asid);
     arm64_mmu_unmap_pt(vaddr, vaddr_rel, size,
-                       top_index_shift, page_size_shift, top_page_table, asid);
-    DSB;
+                       top_index_shift, page_size_shift, top_page_table, &tlb);
+    tlb_gather_flush(&tlb);
     return 0;
 }
 
@@ -531,10 +624,10 @@ int arch_mmu_map(arch_aspace_t *aspace, vaddr_t vaddr, paddr_t paddr, uint count
                          aspace->tt_virt, MMU_ARM64_GLOBAL_ASID);
     } else {
         ret = arm64_mmu_map(vaddr, paddr, count * PAGE_SIZE,
-                         mmu_flags_to_pte_attr(flags),
+                         mmu_flags_to_pte_attr(flags) | MMU_PTE_ATTR_NON_GLOBAL,
                          0, MMU_USER_SIZE_SHIFT,
                          MMU_USER_TOP_SHIFT, MMU_USER_PAGE_SIZE_SHIFT,
-                         aspace->tt_virt, MMU_ARM64_USER_ASID);
+                         aspace->tt_virt, aspace_asid(aspace));
     }
 
     return ret;
@@ -568,7 +661,7 @@ int arch_mmu_unmap(arch_aspace_t *aspace, vaddr_t vaddr, uint count)
                            0, MMU_USER_SIZE_SHIFT,
                            MMU_USER_TOP_SHIFT, MMU_USER_PAGE_SIZE_SHIFT,
                            aspace->tt_virt,
-                           MMU_ARM64_USER_ASID);
+                           aspace_asid(aspace));
     }
 
     return ret;
@@ -607,6 +700,7 @@ status_t arch_mmu_init_aspace(arch_aspace_t *aspace, vaddr_t base, size_t size,
 
         aspace->tt_virt = va;
         aspace->tt_phys = vaddr_to_paddr(aspace->tt_virt);
+        aspace->asid = 0;
 
         /* zero the top level translation table */
         /* XXX remove when PMM starts returning pre-zeroed pages */
@@ -634,6 +728,113 @@ status_t arch_mmu_destroy_aspace(arch_aspace_t *aspace)
     return NO_ERROR;
 }
 
+/*
+ * ASIDs are handed out per user aspace so switching between them doesn't
+ * need a tlb flush. Once they run out a new generation starts: every cpu
+ * flushes its tlb the next time it switches, and aspaces from the old
+ * generation pick up a new asid the next time they're switched to. The asids
+ * that are live on a cpu at the time of the rollover are carried over so
+ * their aspaces keep running undisturbed.
+ */
+static spin_lock_t asid_lock = SPIN_LOCK_INITIAL_VALUE;
+static uint64_t asid_generation = ASID_GENERATION_STEP;
+static uint32_t asid_map[(1U << MMU_ARM64_ASID_BITS) / 32];
+static uint asid_next = 1;
+static uint64_t active_asid[SMP_MAX_CPUS];
+static uint64_t reserved_asid[SMP_MAX_CPUS];
+static bool asid_flush_pending[SMP_MAX_CPUS];
+
+static inline bool asid_test_and_set(uint asid)
+{
+    uint32_t bit = 1U << (asid % 32);
+    bool was_set = asid_map[asid / 32] & bit;
+
+    asid_map[asid / 32] |= bit;
+    return was_set;
+}
+
+static void asid_rollover(void)
+{
+    asid_generation += ASID_GENERATION_STEP;
+    memset(asid_map, 0, sizeof(asid_map));
+    asid_test_and_set(0);
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        /* a cpu that hasn't switched since the last rollover is still on its reserved asid */
+        uint64_t asid = active_asid[i] ? active_asid[i] : reserved_asid[i];
+        active_asid[i] = 0;
+
+        if (asid)
+            asid_test_and_set(asid & ASID_MASK);
+        reserved_asid[i] = asid;
+        asid_flush_pending[i] = true;
+    }
+    asid_next = 1;
+}
+
+/* if the asid is still reserved on a cpu, move the reservation to the new generation */
+static bool asid_update_reserved(uint64_t asid, uint64_t new_asid)
+{
+    bool hit = false;
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (reserved_asid[i] == asid) {
+            reserved_asid[i] = new_asid;
+            hit = true;
+        }
+    }
+    return hit;
+}
+
+static uint64_t asid_new(arch_aspace_t *aspace)
+{
+    uint64_t old = aspace->asid;
+
+    if (old) {
+        uint64_t asid = asid_generation | (old & ASID_MASK);
+
+        if (asid_update_reserved(old, asid))
+            return asid;
+
+        /* try to hang on to the same number if nobody has taken it yet */
+        if (!asid_test_and_set(old & ASID_MASK))
+            return asid;
+    }
+
+    for (;;) {
+        for (uint i = asid_next; i <= ASID_MASK; i++) {
+            if (!asid_test_and_set(i)) {
+                asid_next = i + 1;
+                return asid_generation | i;
+            }
+        }
+
+        /* out of asids, start over. at most one per cpu survives the rollover */
+        asid_rollover();
+    }
+}
+
+/* make sure the aspace has an asid from the current generation and mark it
+ * active on this cpu, returns true if the local tlb needs to be flushed */
+static bool asid_switch(arch_aspace_t *aspace)
+{
+    spin_lock_saved_state_t state;
+    uint cpu = arch_curr_cpu_num();
+
+    spin_lock_irqsave(&asid_lock, state);
+
+    if ((aspace->asid & ~ASID_MASK) != asid_generation)
+        aspace->asid = asid_new(aspace);
+    active_asid[cpu] = aspace->asid;
+
+    bool flush = asid_flush_pending[cpu];
+    asid_flush_pending[cpu] = false;
+
+    spin_unlock_irqrestore(&asid_lock, state);
+
+    return flush;
+}
+
 void arch_mmu_context_switch(arch_aspace_t *aspace)
 {
     if (TRACE_CONTEXT_SWITCH)
@@ -644,13 +845,18 @@ void arch_mmu_context_switch(arch_aspace_t *aspace)
     if (aspace) {
         DEBUG_ASSERT((aspace->flags & ARCH_ASPACE_FLAG_KERNEL) == 0);
 
+        if (asid_switch(aspace)) {
+            __asm__ volatile("tlbi vmalle1" ::: "memory");
+            DSB;
+            ISB;
+        }
+
         tcr = MMU_TCR_FLAGS_USER;
-        ttbr = ((uint64_t)MMU_ARM64_USER_ASID << 48) | aspace->tt_phys;
+        ttbr = ((uint64_t)aspace_asid(aspace) << 48) | aspace->tt_phys;
         ARM64_WRITE_SYSREG(ttbr0_el1, ttbr);
 
         if (TRACE_CONTEXT_SWITCH)
             TRACEF("ttbr 0x%llx, tcr 0x%llx\n", ttbr, tcr);
-        ARM64_TLBI(aside1, (uint64_t)MMU_ARM64_USER_ASID << 48);
     } else {
         tcr = MMU_TCR_FLAGS_KERNEL;
 
@@ -27,6 +27,7 @@
 #include <err.h>
 #include <platform/interrupts.h>
 #include <arch/ops.h>
+#include <arch/arm64.h>
 
 #if WITH_DEV_INTERRUPT_ARM_GIC
 #include <dev/interrupt/arm_gic.h>
@@ -69,6 +70,9 @@ enum handler_return arm_ipi_generic_handler(void *arg)
 {
     LTRACEF("cpu %u, arg %p\n", arch_curr_cpu_num(), arg);
 
+    /* the only user so far, another cpu wants fp registers this one is holding */
+    arm64_fpu_flush();
+
     return INT_NO_RESCHEDULE;
 }
 
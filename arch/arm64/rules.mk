@@ -16,6 +16,7 @@ MODULE_SRCS += \
 	$(LOCAL_DIR)/thread.c \
 	$(LOCAL_DIR)/spinlock.S \
 	$(LOCAL_DIR)/start.S \
+	$(LOCAL_DIR)/cache.c \
 	$(LOCAL_DIR)/cache-ops.S \
 
 #	$(LOCAL_DIR)/arm/start.S \
@@ -48,6 +49,12 @@ endif
 
 ARCH_OPTFLAGS := -O2
 
+# the cpu has the armv8.1 large system extension atomics, used by the spinlocks
+ARM64_WITH_LSE ?= 0
+ifeq ($(ARM64_WITH_LSE),1)
+GLOBAL_DEFINES += ARM64_WITH_LSE=1
+endif
+
 # we have a mmu and want the vmm/pmm
 WITH_KERNEL_VM ?= 1
 
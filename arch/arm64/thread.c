@@ -90,6 +90,24 @@ void arch_thread_initialize(thread_t *t)
     t->arch.sp = (vaddr_t)frame;
 }
 
+vaddr_t arch_fiber_stack_init(vaddr_t stack_top, void (*entry)(void))
+{
+    struct {
+#if !WITH_NO_FP
+        uint64_t d[8];
+#endif
+        vaddr_t r19_28[10];
+        vaddr_t r29;
+        vaddr_t lr;
+    } *frame = (void *)ROUNDDOWN(stack_top, 16);
+    frame--;
+
+    memset(frame, 0, sizeof(*frame));
+    frame->lr = (vaddr_t)entry;
+
+    return (vaddr_t)frame;
+}
+
 void arch_context_switch(thread_t *oldthread, thread_t *newthread)
 {
     LTRACEF("old %p (%s), new %p (%s)\n", oldthread, oldthread->name, newthread, newthread->name);
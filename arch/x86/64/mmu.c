@@ -43,6 +43,9 @@
 uint8_t g_vaddr_width = 0;
 uint8_t g_paddr_width = 0;
 
+/* cpu supports 1GB pages */
+static bool x86_huge_pages;
+
 /* top level kernel page tables, initialized in start.S */
 map_addr_t pml4[NO_OF_PT_ENTRIES] __ALIGNED(PAGE_SIZE);
 map_addr_t pdp[NO_OF_PT_ENTRIES] __ALIGNED(PAGE_SIZE); /* temporary */
@@ -242,6 +245,13 @@ status_t x86_mmu_get_mapping(map_addr_t pml4, vaddr_t vaddr, uint32_t *ret_level
     }
     LTRACEF_LEVEL(2, "pdpe 0x%llx\n", pdpe);
 
+    /* 1 GB pages */
+    if (pdpe & X86_MMU_PG_PS) {
+        *last_valid_entry = (X86_VIRT_TO_PHYS(pdpe) & X86_1GB_PAGE_FRAME) + ((uint64_t)vaddr & PAGE_OFFSET_MASK_1GB);
+        *mmu_flags = get_arch_mmu_flags(pdpe & X86_FLAGS_MASK);
+        goto last;
+    }
+
     pde = get_pd_entry_from_pd_table(vaddr, pdpe);
     if ((pde & X86_MMU_PG_P) == 0) {
         *ret_level = PD_L;
@@ -382,6 +392,18 @@ static map_addr_t *_map_alloc_page(void)
     return page_ptr;
 }
 
+static void update_pd_large_entry(vaddr_t vaddr, paddr_t paddr, uint64_t pdpe, arch_flags_t flags)
+{
+    uint32_t pd_index;
+
+    uint64_t *pd_table = (uint64_t *)(pdpe & X86_PG_FRAME);
+    pd_index = (((uint64_t)vaddr >> PD_SHIFT) & ((1ul << ADDR_OFFSET) - 1));
+    pd_table[pd_index] = (uint64_t)paddr;
+    pd_table[pd_index] |= flags | X86_MMU_PG_P | X86_MMU_PG_PS;
+    if (!(flags & X86_MMU_PG_U))
+        pd_table[pd_index] |= X86_MMU_PG_G; /* setting global flag for kernel pages */
+}
+
 /**
  * @brief  Add a new mapping for the given virtual address & physical address
  *
@@ -422,8 +444,13 @@ status_t x86_mmu_add_mapping(map_addr_t pml4, map_addr_t paddr,
         X86_SET_FLAG(pdp_new);
     }
 
-    if (!pdp_new)
+    if (!pdp_new) {
         pdpe = get_pdp_entry_from_pdp_table(vaddr, pml4e);
+        if (pdpe & X86_MMU_PG_PS) {
+            /* already covered by a 1GB page */
+            return ERR_ALREADY_EXISTS;
+        }
+    }
 
     if (pdp_new || (pdpe & X86_MMU_PG_P) == 0) {
         /* Creating a new pd table  */
@@ -474,6 +501,195 @@ clean:
     return ret;
 }
 
+/**
+ * @brief  Add a new 2MB mapping for the given virtual address & physical address
+ *
+ * Both addresses must be 2MB aligned. Fails with ERR_ALREADY_EXISTS if there is
+ * a page table in the way, in which case the range has to be mapped with 4KB
+ * pages. Page directory tables created on the way are kept even on failure.
+ *
+ */
+static status_t x86_mmu_add_large_mapping(map_addr_t pml4, map_addr_t paddr,
+                                          vaddr_t vaddr, arch_flags_t mmu_flags)
+{
+    uint64_t pml4e, pdpe, pde;
+    map_addr_t *m;
+    bool pd_new = false;
+
+    LTRACEF("pml4 0x%llx paddr 0x%llx vaddr 0x%lx flags 0x%llx\n", pml4, paddr, vaddr, mmu_flags);
+
+    DEBUG_ASSERT(pml4);
+    DEBUG_ASSERT(IS_ALIGNED(paddr | vaddr, 1UL << PD_SHIFT));
+
+    pml4e = get_pml4_entry_from_pml4_table(vaddr, pml4);
+    if ((pml4e & X86_MMU_PG_P) == 0) {
+        /* Creating a new pdp table */
+        m = _map_alloc_page();
+        if (m == NULL)
+            return ERR_NO_MEMORY;
+
+        update_pml4_entry(vaddr, pml4, X86_VIRT_TO_PHYS(m), get_x86_arch_flags(mmu_flags));
+        pml4e = (uint64_t)m;
+        pdpe = 0;
+    } else {
+        pdpe = get_pdp_entry_from_pdp_table(vaddr, pml4e);
+    }
+
+    if ((pdpe & X86_MMU_PG_P) == 0) {
+        /* Creating a new pd table */
+        m = _map_alloc_page();
+        if (m == NULL)
+            return ERR_NO_MEMORY;
+
+        update_pdp_entry(vaddr, pml4e, X86_VIRT_TO_PHYS(m), get_x86_arch_flags(mmu_flags));
+        pdpe = (uint64_t)m;
+        pd_new = true;
+    } else if (pdpe & X86_MMU_PG_PS) {
+        /* already covered by a 1GB page */
+        return ERR_ALREADY_EXISTS;
+    }
+
+    if (!pd_new) {
+        pde = get_pd_entry_from_pd_table(vaddr, pdpe);
+        if (pde & X86_MMU_PG_P)
+            return ERR_ALREADY_EXISTS;
+    }
+
+    update_pd_large_entry(vaddr, paddr, pdpe, get_x86_arch_flags(mmu_flags));
+    return NO_ERROR;
+}
+
+/**
+ * @brief  Add a new 1GB mapping for the given virtual address & physical address
+ *
+ * Both addresses must be 1GB aligned and the cpu must support 1GB pages. Fails
+ * with ERR_ALREADY_EXISTS if anything is mapped in the way.
+ *
+ */
+static status_t x86_mmu_add_huge_mapping(map_addr_t pml4, map_addr_t paddr,
+                                         vaddr_t vaddr, arch_flags_t mmu_flags)
+{
+    uint64_t pml4e, pdpe;
+    map_addr_t *m;
+
+    LTRACEF("pml4 0x%llx paddr 0x%llx vaddr 0x%lx flags 0x%llx\n", pml4, paddr, vaddr, mmu_flags);
+
+    DEBUG_ASSERT(pml4);
+    DEBUG_ASSERT(x86_huge_pages);
+    DEBUG_ASSERT(IS_ALIGNED(paddr | vaddr, 1UL << PDP_SHIFT));
+
+    arch_flags_t flags = get_x86_arch_flags(mmu_flags);
+
+    pml4e = get_pml4_entry_from_pml4_table(vaddr, pml4);
+    if ((pml4e & X86_MMU_PG_P) == 0) {
+        /* Creating a new pdp table */
+        m = _map_alloc_page();
+        if (m == NULL)
+            return ERR_NO_MEMORY;
+
+        update_pml4_entry(vaddr, pml4, X86_VIRT_TO_PHYS(m), flags);
+        pml4e = (uint64_t)m;
+    } else {
+        pdpe = get_pdp_entry_from_pdp_table(vaddr, pml4e);
+        if (pdpe & X86_MMU_PG_P)
+            return ERR_ALREADY_EXISTS;
+    }
+
+    uint64_t *pdp_table = (uint64_t *)(pml4e & X86_PG_FRAME);
+    uint32_t pdp_index = (((uint64_t)vaddr >> PDP_SHIFT) & ((1ul << ADDR_OFFSET) - 1));
+    pdp_table[pdp_index] = (uint64_t)paddr | flags | X86_MMU_PG_P | X86_MMU_PG_PS;
+    if (!(flags & X86_MMU_PG_U))
+        pdp_table[pdp_index] |= X86_MMU_PG_G; /* setting global flag for kernel pages */
+
+    return NO_ERROR;
+}
+
+/**
+ * @brief  Return the page directory pointer entry mapping vaddr if it is a 1GB page
+ *
+ */
+static uint64_t *x86_mmu_get_huge_pdpe(map_addr_t pml4, vaddr_t vaddr)
+{
+    uint64_t pml4e;
+
+    pml4e = get_pml4_entry_from_pml4_table(vaddr, pml4);
+    if ((pml4e & X86_MMU_PG_P) == 0)
+        return NULL;
+
+    uint64_t *pdp_table = (uint64_t *)(pml4e & X86_PG_FRAME);
+    uint64_t *pdpep = &pdp_table[((uint64_t)vaddr >> PDP_SHIFT) & ((1ul << ADDR_OFFSET) - 1)];
+    if ((*pdpep & (X86_MMU_PG_P | X86_MMU_PG_PS)) != (X86_MMU_PG_P | X86_MMU_PG_PS))
+        return NULL;
+
+    return pdpep;
+}
+
+/**
+ * @brief  Break up a 1GB page into a page directory of 2MB pages with the same mapping
+ *
+ */
+static status_t x86_mmu_split_huge_pdpe(uint64_t *pdpep)
+{
+    uint64_t pdpe = *pdpep;
+    map_addr_t *pd = _map_alloc_page();
+    if (pd == NULL)
+        return ERR_NO_MEMORY;
+
+    arch_flags_t flags = pdpe & X86_FLAGS_MASK;
+    flags |= pdpe & X86_MMU_PG_NX;
+    paddr_t paddr = pdpe & X86_1GB_PAGE_FRAME;
+    for (uint i = 0; i < NO_OF_PT_ENTRIES; i++)
+        pd[i] = (paddr + ((uint64_t)i << PD_SHIFT)) | flags;
+
+    *pdpep = X86_VIRT_TO_PHYS(pd) | X86_MMU_PG_P | X86_MMU_PG_RW | (pdpe & (X86_MMU_PG_U | X86_MMU_PG_G));
+    return NO_ERROR;
+}
+
+/**
+ * @brief  Return the page directory entry mapping vaddr if it is a 2MB page
+ *
+ */
+static uint64_t *x86_mmu_get_large_pde(map_addr_t pml4, vaddr_t vaddr)
+{
+    uint64_t pml4e, pdpe;
+
+    pml4e = get_pml4_entry_from_pml4_table(vaddr, pml4);
+    if ((pml4e & X86_MMU_PG_P) == 0)
+        return NULL;
+
+    pdpe = get_pdp_entry_from_pdp_table(vaddr, pml4e);
+    if ((pdpe & X86_MMU_PG_P) == 0 || (pdpe & X86_MMU_PG_PS))
+        return NULL;
+
+    uint64_t *pd_table = (uint64_t *)(pdpe & X86_PG_FRAME);
+    uint64_t *pdep = &pd_table[((uint64_t)vaddr >> PD_SHIFT) & ((1ul << ADDR_OFFSET) - 1)];
+    if ((*pdep & (X86_MMU_PG_P | X86_MMU_PG_PS)) != (X86_MMU_PG_P | X86_MMU_PG_PS))
+        return NULL;
+
+    return pdep;
+}
+
+/**
+ * @brief  Break up a 2MB page into a page table of 4KB pages with the same mapping
+ *
+ */
+static status_t x86_mmu_split_large_pde(uint64_t *pdep)
+{
+    uint64_t pde = *pdep;
+    map_addr_t *pt = _map_alloc_page();
+    if (pt == NULL)
+        return ERR_NO_MEMORY;
+
+    arch_flags_t flags = pde & X86_FLAGS_MASK & ~X86_MMU_PG_PS;
+    flags |= pde & X86_MMU_PG_NX;
+    paddr_t paddr = pde & X86_2MB_PAGE_FRAME;
+    for (uint i = 0; i < NO_OF_PT_ENTRIES; i++)
+        pt[i] = (paddr + i * PAGE_SIZE) | flags;
+
+    *pdep = X86_VIRT_TO_PHYS(pt) | X86_MMU_PG_P | X86_MMU_PG_RW | (pde & (X86_MMU_PG_U | X86_MMU_PG_G));
+    return NO_ERROR;
+}
+
 /**
  * @brief  x86-64 MMU unmap an entry in the page tables recursively and clear out tables
  *
@@ -568,7 +784,41 @@ status_t x86_mmu_unmap(map_addr_t pml4, vaddr_t vaddr, uint count)
 
     next_aligned_v_addr = vaddr;
     while (count > 0) {
+        uint64_t *pdpep = x86_mmu_get_huge_pdpe(pml4, next_aligned_v_addr);
+        if (pdpep) {
+            if (IS_ALIGNED(next_aligned_v_addr, 1UL << PDP_SHIFT) && count >= NO_OF_PT_ENTRIES * NO_OF_PT_ENTRIES) {
+                /* the whole 1GB page goes */
+                *pdpep = 0;
+                x86_invlpg(next_aligned_v_addr);
+                next_aligned_v_addr += 1UL << PDP_SHIFT;
+                count -= NO_OF_PT_ENTRIES * NO_OF_PT_ENTRIES;
+                continue;
+            }
+            /* only part of it goes, break it into 2MB pages and carry on */
+            status_t err = x86_mmu_split_huge_pdpe(pdpep);
+            if (err)
+                return err;
+            x86_invlpg(next_aligned_v_addr);
+        }
+
+        uint64_t *pdep = x86_mmu_get_large_pde(pml4, next_aligned_v_addr);
+        if (pdep) {
+            if (IS_ALIGNED(next_aligned_v_addr, 1UL << PD_SHIFT) && count >= NO_OF_PT_ENTRIES) {
+                /* the whole 2MB page goes */
+                *pdep = 0;
+                x86_invlpg(next_aligned_v_addr);
+                next_aligned_v_addr += 1UL << PD_SHIFT;
+                count -= NO_OF_PT_ENTRIES;
+                continue;
+            }
+            /* only part of it goes, fall back to 4KB pages */
+            status_t err = x86_mmu_split_large_pde(pdep);
+            if (err)
+                return err;
+        }
+
         x86_mmu_unmap_entry(next_aligned_v_addr, X86_PAGING_LEVELS, pml4);
+        x86_invlpg(next_aligned_v_addr);
         next_aligned_v_addr += PAGE_SIZE;
         count--;
     }
@@ -623,6 +873,27 @@ status_t x86_mmu_map_range(map_addr_t pml4, struct map_range *range, arch_flags_
     next_aligned_p_addr = range->start_paddr;
 
     for (index = 0; index < no_of_pages; index++) {
+        /* likewise 1GB pages where the cpu has them */
+        if (x86_huge_pages &&
+                IS_ALIGNED(next_aligned_v_addr | next_aligned_p_addr, 1UL << PDP_SHIFT) &&
+                no_of_pages - index >= NO_OF_PT_ENTRIES * NO_OF_PT_ENTRIES &&
+                x86_mmu_add_huge_mapping(pml4, next_aligned_p_addr, next_aligned_v_addr, flags) == NO_ERROR) {
+            next_aligned_v_addr += 1UL << PDP_SHIFT;
+            next_aligned_p_addr += 1UL << PDP_SHIFT;
+            index += NO_OF_PT_ENTRIES * NO_OF_PT_ENTRIES - 1;
+            continue;
+        }
+
+        /* use 2MB pages wherever both addresses line up and there's enough left */
+        if (IS_ALIGNED(next_aligned_v_addr | next_aligned_p_addr, 1UL << PD_SHIFT) &&
+                no_of_pages - index >= NO_OF_PT_ENTRIES &&
+                x86_mmu_add_large_mapping(pml4, next_aligned_p_addr, next_aligned_v_addr, flags) == NO_ERROR) {
+            next_aligned_v_addr += 1UL << PD_SHIFT;
+            next_aligned_p_addr += 1UL << PD_SHIFT;
+            index += NO_OF_PT_ENTRIES - 1;
+            continue;
+        }
+
         map_status = x86_mmu_add_mapping(pml4, next_aligned_p_addr, next_aligned_v_addr, flags);
         if (map_status) {
             dprintf(SPEW, "Add mapping failed with err=%d\n", map_status);
@@ -711,6 +982,10 @@ void x86_mmu_early_init(void)
         cr4 |= X86_CR4_SMEP;
     if (check_smap_avail())
         cr4 |=X86_CR4_SMAP;
+    /* the kernel runs with pcid 0. cr3 bits 11:0 must be clear to turn this on,
+     * which is always the case here with the boot page tables */
+    if (check_pcid_avail() && (x86_get_cr3() & 0xfff) == 0)
+        cr4 |= X86_CR4_PCIDE;
     x86_set_cr4(cr4);
 
     /* Set NXE bit in MSR_EFER*/
@@ -727,11 +1002,18 @@ void x86_mmu_early_init(void)
 
     LTRACEF("paddr_width %u vaddr_width %u\n", g_paddr_width, g_vaddr_width);
 
+    /* start.S made the same check when it built the physmap */
+    x86_huge_pages = check_1gb_page_avail();
+
     /* unmap the lower identity mapping */
     pml4[0] = 0;
 
     /* tlb flush */
     x86_set_cr3(x86_get_cr3());
+
+    /* now that nothing stale is left, let the kernel's global mappings survive
+     * cr3 loads. unmapping them takes an invlpg from here on */
+    x86_set_cr4(x86_get_cr4() | X86_CR4_PGE);
 }
 
 void x86_mmu_init(void)
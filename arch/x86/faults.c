@@ -26,6 +26,9 @@
 #include <arch/x86.h>
 #include <arch/fpu.h>
 #include <kernel/thread.h>
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
 
 /* exceptions */
 #define INT_DIVIDE_0        0x00
@@ -109,14 +112,37 @@ void x86_unhandled_exception(x86_iframe_t *frame)
 
 void x86_pfe_handler(x86_iframe_t *frame)
 {
+    /* grab the faulting address before anything (another fault, a context switch) can replace it */
+    __UNUSED addr_t fault_addr = x86_get_cr2();
+
     /* Handle a page fault exception */
     uint32_t error_code;
     thread_t *current_thread;
     error_code = frame->err_code;
 
+#if WITH_KERNEL_VM
+    /* let the vm fault in lazily allocated pages */
+    if (!(error_code & PFEX_RSV)) {
+        uint pf_flags = 0;
+        pf_flags |= (error_code & PFEX_W) ? VMM_PF_FLAG_WRITE : 0;
+        pf_flags |= (error_code & PFEX_U) ? VMM_PF_FLAG_USER : 0;
+        pf_flags |= (error_code & PFEX_I) ? VMM_PF_FLAG_INSTRUCTION : 0;
+        pf_flags |= (error_code & PFEX_P) ? 0 : VMM_PF_FLAG_NOT_PRESENT;
+
+        /* it may block, so put interrupts back the way the faulting code had them */
+        if (frame->flags & X86_FLAGS_IF)
+            arch_enable_ints();
+        status_t err = vmm_page_fault_handler(fault_addr, pf_flags);
+        arch_disable_ints();
+
+        if (err >= 0)
+            return;
+    }
+#endif
+
 #ifdef PAGE_FAULT_DEBUG_INFO
     addr_t v_addr, ssp, esp, ip, rip;
-    v_addr = x86_get_cr2();
+    v_addr = fault_addr;
 
     ssp = frame->user_ss & X86_8BYTE_MASK;
     esp = frame->user_sp;
@@ -39,6 +39,8 @@
 #define ECX_SSSE3   (0x00000001 << 9)
 #define ECX_SSE4_1  (0x00000001 << 19)
 #define ECX_SSE4_2  (0x00000001 << 20)
+#define ECX_XSAVE   (0x00000001 << 26)
+#define ECX_AVX     (0x00000001 << 28)
 #define EDX_FXSR    (0x00000001 << 24)
 #define EDX_SSE     (0x00000001 << 25)
 #define EDX_SSE2    (0x00000001 << 26)
@@ -52,19 +54,147 @@
     )
 
 #define FXSAVE_CAP(ecx, edx) ((edx & EDX_FXSR) != 0)
+#define XSAVE_CAP(ecx, edx) ((ecx & ECX_XSAVE) != 0)
+
+/* xsave state components */
+#define XSTATE_X87  (1 << 0)
+#define XSTATE_SSE  (1 << 1)
+#define XSTATE_AVX  (1 << 2)
+
+/* CPUID EAX = 0xd, ECX = 1 return values */
+#define XSAVE_EAX_XSAVEOPT  (1 << 0)
+#define XSAVE_EAX_XSAVES    (1 << 3)
+
+#define MSR_IA32_XSS 0xda0
+
+/* how the state of the fp owner gets in and out of the registers */
+enum fpu_save_method {
+    FPU_FXSAVE,
+    FPU_XSAVE,
+    FPU_XSAVEOPT,   /* skips components unmodified since the last xrstor of the same area */
+    FPU_XSAVES,     /* xsaveopt's optimizations plus a compacted area */
+};
 
 static int fp_supported;
+static enum fpu_save_method fp_method;
+static size_t fp_area_size;
 static thread_t *fp_owner;
 
-/* FXSAVE area comprises 512 bytes starting with 16-byte aligned */
-static uint8_t __ALIGNED(16) fpu_init_states[512]= {0};
+/* the state new threads start with, in whatever format fp_method uses */
+static uint8_t __ALIGNED(64) fpu_init_states[X86_FPU_AREA_MAX]= {0};
 
 static void get_cpu_cap(uint32_t *ecx, uint32_t *edx)
 {
     uint32_t eax = 1;
 
     __asm__ __volatile__
-    ("cpuid" : "=c" (*ecx), "=d" (*edx) : "a" (eax));
+    ("cpuid" : "=c" (*ecx), "=d" (*edx) : "a" (eax) : "ebx");
+}
+
+static void cpuid_count(uint32_t leaf, uint32_t subleaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx)
+{
+    __asm__ __volatile__
+    ("cpuid" : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx) : "a" (leaf), "c" (subleaf));
+}
+
+static void xsetbv(uint32_t reg, uint64_t val)
+{
+    __asm__ __volatile__("xsetbv" : : "c" (reg), "a" ((uint32_t)val), "d" ((uint32_t)(val >> 32)));
+}
+
+/* requested-feature bitmap for the xsave family, everything enabled in xcr0 */
+#define XSAVE_MASK_LO 0xffffffff
+#define XSAVE_MASK_HI 0xffffffff
+
+static void fpu_save(void *area)
+{
+    switch (fp_method) {
+        case FPU_FXSAVE:
+            __asm__ __volatile__("fxsave %0" : "=m" (*(uint8_t (*)[512])area));
+            break;
+        case FPU_XSAVE:
+            __asm__ __volatile__("xsave %0" : "+m" (*(uint8_t (*)[X86_FPU_AREA_MAX])area)
+                                 : "a" (XSAVE_MASK_LO), "d" (XSAVE_MASK_HI));
+            break;
+        case FPU_XSAVEOPT:
+            __asm__ __volatile__("xsaveopt %0" : "+m" (*(uint8_t (*)[X86_FPU_AREA_MAX])area)
+                                 : "a" (XSAVE_MASK_LO), "d" (XSAVE_MASK_HI));
+            break;
+        case FPU_XSAVES:
+            __asm__ __volatile__("xsaves %0" : "+m" (*(uint8_t (*)[X86_FPU_AREA_MAX])area)
+                                 : "a" (XSAVE_MASK_LO), "d" (XSAVE_MASK_HI));
+            break;
+    }
+}
+
+static void fpu_restore(const void *area)
+{
+    switch (fp_method) {
+        case FPU_FXSAVE:
+            __asm__ __volatile__("fxrstor %0" : : "m" (*(const uint8_t (*)[512])area));
+            break;
+        case FPU_XSAVE:
+        case FPU_XSAVEOPT:
+            __asm__ __volatile__("xrstor %0" : : "m" (*(const uint8_t (*)[X86_FPU_AREA_MAX])area),
+                                 "a" (XSAVE_MASK_LO), "d" (XSAVE_MASK_HI));
+            break;
+        case FPU_XSAVES:
+            __asm__ __volatile__("xrstors %0" : : "m" (*(const uint8_t (*)[X86_FPU_AREA_MAX])area),
+                                 "a" (XSAVE_MASK_LO), "d" (XSAVE_MASK_HI));
+            break;
+    }
+}
+
+/*
+ * Turn on xsave with the x87, sse and avx components, if the cpu has them and
+ * the area for them fits in a thread's buffer. Picks the best save instruction
+ * and leaves the area size the cpu reports in fp_area_size.
+ */
+static bool fpu_init_xsave(uint32_t ecx)
+{
+    uint32_t eax, ebx, edx, ecx2;
+
+    if (!XSAVE_CAP(ecx, 0))
+        return false;
+
+    cpuid_count(0xd, 0, &eax, &ebx, &ecx2, &edx);
+    uint64_t xcr0 = XSTATE_X87 | XSTATE_SSE;
+    if ((ecx & ECX_AVX) && (eax & XSTATE_AVX))
+        xcr0 |= XSTATE_AVX;
+
+    x86_set_cr4(x86_get_cr4() | X86_CR4_OSXSAVE);
+    xsetbv(0, xcr0);
+
+    /* ebx is now the size of the standard format area for what's in xcr0 */
+    cpuid_count(0xd, 0, &eax, &ebx, &ecx2, &edx);
+    size_t size = ebx;
+
+    uint32_t features;
+    cpuid_count(0xd, 1, &features, &ebx, &ecx2, &edx);
+
+    if (features & XSAVE_EAX_XSAVES) {
+        /* no supervisor state components, ebx is now the compacted size of xcr0 | xss */
+        write_msr(MSR_IA32_XSS, 0);
+        cpuid_count(0xd, 1, &features, &ebx, &ecx2, &edx);
+        size = ebx;
+        fp_method = FPU_XSAVES;
+    } else if (features & XSAVE_EAX_XSAVEOPT) {
+        fp_method = FPU_XSAVEOPT;
+    } else {
+        fp_method = FPU_XSAVE;
+    }
+
+    if (size > X86_FPU_AREA_MAX) {
+        TRACEF("xsave area of %zu bytes doesn't fit, using fxsave\n", size);
+        x86_set_cr4(x86_get_cr4() & ~X86_CR4_OSXSAVE);
+        fp_method = FPU_FXSAVE;
+        return false;
+    }
+
+    LTRACEF("xcr0 0x%llx, area %zu bytes, method %d\n", xcr0, size, fp_method);
+    fp_area_size = size;
+
+    return true;
 }
 
 void fpu_init(void)
@@ -81,6 +211,8 @@ void fpu_init(void)
 
     fp_supported = 0;
     fp_owner = NULL;
+    fp_method = FPU_FXSAVE;
+    fp_area_size = 512;
 
     get_cpu_cap(&ecx, &edx);
 
@@ -116,6 +248,9 @@ void fpu_init(void)
     x &= ~X86_CR4_OSXSAVE;
     x86_set_cr4(x);
 
+    /* and AVX, through xsave */
+    fpu_init_xsave(ecx);
+
     __asm__ __volatile__("stmxcsr %0" : "=m" (mxcsr));
 #if FPU_MASK_ALL_EXCEPTIONS
     /* mask all exceptions */
@@ -127,7 +262,7 @@ void fpu_init(void)
     __asm__ __volatile__("ldmxcsr %0" : : "m" (mxcsr));
 
     /* save fpu initial states, and used when new thread creates */
-    __asm__ __volatile__("fxsave %0" : "=m" (fpu_init_states));
+    fpu_save(fpu_init_states);
 
     x86_set_cr0(x86_get_cr0() | X86_CR0_TS);
     return;
@@ -135,15 +270,24 @@ void fpu_init(void)
 
 void fpu_init_thread_states(thread_t *t)
 {
-    t->arch.fpu_states = (vaddr_t *)ROUNDUP(((vaddr_t)t->arch.fpu_buffer), 16);
-    memcpy(t->arch.fpu_states, fpu_init_states, sizeof(fpu_init_states));
+    t->arch.fpu_states = (vaddr_t *)ROUNDUP(((vaddr_t)t->arch.fpu_buffer), 64);
+    memcpy(t->arch.fpu_states, fpu_init_states, fp_area_size);
 }
 
+/*
+ * The registers stay with fp_owner across switches, with CR0.TS set for
+ * everyone else. The first fp instruction of another thread traps into
+ * fpu_dev_na_handler, which moves the owner's state out and the new thread's in.
+ */
 void fpu_context_switch(thread_t *old_thread, thread_t *new_thread)
 {
     if (fp_supported == 0)
         return;
 
+    /* a dying owner's state is never needed again, and its buffer is about to be freed */
+    if (old_thread == fp_owner && old_thread->state == THREAD_DEATH)
+        fp_owner = NULL;
+
     if (new_thread != fp_owner)
         x86_set_cr0(x86_get_cr0() | X86_CR0_TS);
     else
@@ -164,10 +308,12 @@ void fpu_dev_na_handler(void)
     self = get_current_thread();
 
     LTRACEF("owner %p self %p\n", fp_owner, self);
-    if ((fp_owner != NULL) && (fp_owner != self)) {
-        __asm__ __volatile__("fxsave %0" : "=m" (*fp_owner->arch.fpu_states));
-        __asm__ __volatile__("fxrstor %0" : : "m" (*self->arch.fpu_states));
-    }
+    if (fp_owner == self)
+        return;
+
+    if (fp_owner != NULL)
+        fpu_save(fp_owner->arch.fpu_states);
+    fpu_restore(self->arch.fpu_states);
 
     fp_owner = self;
     return;
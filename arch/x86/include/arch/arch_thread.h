@@ -25,11 +25,14 @@
 
 #include <sys/types.h>
 
+/* room for the x87, sse and avx parts of an xsave area, which needs 64 byte alignment */
+#define X86_FPU_AREA_MAX 1024
+
 struct arch_thread {
     vaddr_t sp;
 #if X86_WITH_FPU
     vaddr_t *fpu_states;
-    uint8_t fpu_buffer[512 + 16];
+    uint8_t fpu_buffer[X86_FPU_AREA_MAX + 64];
 #endif
 };
 
@@ -26,6 +26,13 @@
 #define PAGE_SIZE 4096
 #define PAGE_SIZE_SHIFT 12
 
+#if ARCH_X86_64
+/* 2MB pages, used to map large physically contiguous regions */
+#define ARCH_LARGE_PAGE_SIZE_SHIFT 21
+/* 1GB pages, where the cpu has them */
+#define ARCH_HUGE_PAGE_SIZE_SHIFT 30
+#endif
+
 #define CACHE_LINE 32
 
 #define ARCH_DEFAULT_STACK_SIZE 8192
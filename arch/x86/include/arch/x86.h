@@ -36,6 +36,7 @@ __BEGIN_CDECLS
 #define PFEX_U 0x04
 #define PFEX_RSV 0x08
 #define PFEX_I 0x10
+#define X86_FLAGS_IF (1<<9)
 #define X86_8BYTE_MASK 0xFFFFFFFF
 #define X86_CPUID_ADDR_WIDTH 0x80000008
 
@@ -146,8 +147,10 @@ typedef tss_64_t tss_t;
 #define X86_CR0_CD 0x40000000 /* cache disable */
 #define X86_CR0_PG 0x80000000 /* enable paging */
 #define X86_CR4_PAE 0x00000020 /* PAE paging */
+#define X86_CR4_PGE 0x00000080 /* global pages */
 #define X86_CR4_OSFXSR 0x00000200 /* os supports fxsave */
 #define X86_CR4_OSXMMEXPT 0x00000400 /* os supports xmm exception */
+#define X86_CR4_PCIDE 0x00020000 /* process context identifiers */
 #define X86_CR4_OSXSAVE 0x00040000 /* os supports xsave */
 #define X86_CR4_SMEP 0x00100000 /* SMEP protection enabling */
 #define X86_CR4_SMAP 0x00200000 /* SMAP protection enabling */
@@ -843,6 +846,43 @@ static inline uint64_t check_smap_avail(void)
     return ((reg_b>>0x13) & 0x1);
 }
 
+static inline uint32_t check_1gb_page_avail(void)
+{
+    uint32_t reg_a = 0x80000000;
+    uint32_t reg_b, reg_c, reg_d;
+    __asm__ __volatile__ (
+        "cpuid \n\t"
+        :"+a" (reg_a), "=b" (reg_b), "=c" (reg_c), "=d" (reg_d));
+    if (reg_a < 0x80000001)
+        return 0;
+
+    reg_a = 0x80000001;
+    __asm__ __volatile__ (
+        "cpuid \n\t"
+        :"+a" (reg_a), "=b" (reg_b), "=c" (reg_c), "=d" (reg_d));
+    return ((reg_d>>26) & 0x1);
+}
+
+static inline uint64_t check_pcid_avail(void)
+{
+    uint32_t reg_a = 0x01;
+    uint32_t reg_b, reg_c, reg_d;
+    __asm__ __volatile__ (
+        "cpuid \n\t"
+        :"+a" (reg_a), "=b" (reg_b), "=c" (reg_c), "=d" (reg_d));
+    return ((reg_c>>17) & 0x1);
+}
+
+/* drop the tlb entries for the page containing vaddr, global ones included */
+static inline void x86_invlpg(vaddr_t vaddr)
+{
+    __asm__ __volatile__ (
+        "invlpg (%0) \n\t"
+        :
+        :"r" (vaddr)
+        :"memory");
+}
+
 #endif // ARCH_X86_64
 
 __END_CDECLS
@@ -91,6 +91,36 @@ void arch_thread_initialize(thread_t *t)
     t->arch.sp = (vaddr_t)frame;
 }
 
+vaddr_t arch_fiber_stack_init(vaddr_t stack_top, void (*entry)(void))
+{
+    // lay the frame out so entry finds the stack aligned as if it had been called
+#if ARCH_X86_32
+    struct {
+        uint32_t edi, esi, ebx, ebp;
+        uint32_t eip;
+    } *frame = (void *)(ROUNDDOWN(stack_top, 16) - 8 + sizeof(uint32_t));
+#endif
+#if ARCH_X86_64
+    struct {
+        uint64_t r15, r14, r13, r12;
+        uint64_t rbp;
+        uint64_t rbx;
+        uint64_t rip;
+    } *frame = (void *)(ROUNDDOWN(stack_top, 16) - 16 + sizeof(uint64_t));
+#endif
+    frame--;
+
+    memset(frame, 0, sizeof(*frame));
+#if ARCH_X86_32
+    frame->eip = (vaddr_t)entry;
+#endif
+#if ARCH_X86_64
+    frame->rip = (vaddr_t)entry;
+#endif
+
+    return (vaddr_t)frame;
+}
+
 void arch_dump_thread(thread_t *t)
 {
     if (t->state != THREAD_RUNNING) {
@@ -36,3 +36,33 @@ void pl310_clean_invalidate_range(addr_t start, size_t len);
 void pl310_invalidate_range(addr_t start, size_t len);
 
 void pl310_pin_cache_range(addr_t start, size_t len);
+
+/* way lockdown. fills |ways| (a bitmap) with the physically contiguous range
+ * [start, start + len) and locks them, so nothing else can evict it from the L2
+ * and nothing else gets to allocate in those ways. at least one way has to stay
+ * unlocked. best done early, other cpus' misses can land in the ways while they
+ * are being filled. */
+status_t pl310_lock_ways(uint32_t ways, addr_t start, size_t len);
+void pl310_unlock_ways(uint32_t ways);
+uint32_t pl310_locked_ways(void);
+
+/* geometry */
+uint pl310_num_ways(void);
+size_t pl310_way_size(void);
+
+/* prefetch and interconnect behaviour, see the PL310 TRM for the trade-offs */
+struct pl310_tuning {
+    bool early_bresp;           /* acknowledge writes once the L2 has them */
+    bool instruction_prefetch;
+    bool data_prefetch;
+    bool double_linefill;       /* fetch 64 bytes on a line fill (r3p0 and up) */
+    bool prefetch_drop;         /* drop prefetches that would hold up real reads (r3p0 and up) */
+    uint prefetch_offset;       /* lines ahead to prefetch: 0-7, 15, 23 or 31 */
+    bool dynamic_clock_gating;  /* (r2p0 and up) */
+    bool standby;               /* stop the clock while the cpus are in wfi (r2p0 and up) */
+};
+
+/* the aux control register only takes writes with the cache off, so this
+ * flushes and disables the L2 around the update if it is running */
+status_t pl310_set_tuning(const struct pl310_tuning *tuning);
+void pl310_get_tuning(struct pl310_tuning *tuning);
@@ -90,11 +90,43 @@
 #define REG15_PREFETCH_CTRL        0xf60
 #define REG15_POWER_CTRL           0xf80
 
+/* aux control */
+#define AUX_FULL_LINE_ZERO      (1 << 0)
+#define AUX_EXCLUSIVE           (1 << 12)
+#define AUX_ASSOCIATIVITY_16    (1 << 16)
+#define AUX_WAY_SIZE_SHIFT      17
+#define AUX_WAY_SIZE_MASK       (7 << AUX_WAY_SIZE_SHIFT)
+#define AUX_D_PREFETCH          (1 << 28)
+#define AUX_I_PREFETCH          (1 << 29)
+#define AUX_EARLY_BRESP         (1 << 30)
+
+/* prefetch control */
+#define PREFETCH_OFFSET_MASK    (0x1f)
+#define PREFETCH_DROP           (1 << 24)
+#define PREFETCH_DOUBLE_LINEFILL (1 << 30)
+
+/* power control */
+#define POWER_STANDBY           (1 << 0)
+#define POWER_DYNAMIC_CLK_GATING (1 << 1)
+
+/* rtl release from the cache id */
+#define RTL_R2P0                0x4
+#define RTL_R3P0                0x5
+
+#define NUM_LOCKDOWN_REGS       8
+
+static uint32_t locked_ways;
+
 static inline bool pl310_enabled(void)
 {
     return !!(PL310_REG(REG1_CONTROL) & 1);
 }
 
+static inline uint pl310_rtl_release(void)
+{
+    return PL310_REG(REG0_CACHE_ID) & 0x3f;
+}
+
 static void pl310_init(uint level)
 {
     /* make sure it's already disabled */
@@ -106,7 +138,8 @@ static void pl310_init(uint level)
 
     /* configure */
     /* early BRESP enable, instruction/data prefetch, exclusive cache, full line of zero */
-    PL310_REG(REG1_AUX_CONTROL) |= (1<<30)|(1<<29)|(1<<28)|(1<<12)|(1<<0);
+    PL310_REG(REG1_AUX_CONTROL) |= AUX_EARLY_BRESP | AUX_I_PREFETCH | AUX_D_PREFETCH |
+                                   AUX_EXCLUSIVE | AUX_FULL_LINE_ZERO;
 
     /* flush all the ways */
     PL310_REG(REG7_INV_WAY) = 0xffff;
@@ -232,3 +265,159 @@ void pl310_pin_cache_range(addr_t start, size_t len)
     arch_enable_ints();
 }
 
+uint pl310_num_ways(void)
+{
+    return (PL310_REG(REG1_AUX_CONTROL) & AUX_ASSOCIATIVITY_16) ? 16 : 8;
+}
+
+size_t pl310_way_size(void)
+{
+    /* 16KB for a way size field of 1 up to 512KB for 6 */
+    uint field = (PL310_REG(REG1_AUX_CONTROL) & AUX_WAY_SIZE_MASK) >> AUX_WAY_SIZE_SHIFT;
+
+    return 8192UL << MAX(field, 1U);
+}
+
+/* the same allocation mask for every master, instruction and data side */
+static void pl310_set_lockdown(uint32_t mask)
+{
+    for (uint i = 0; i < NUM_LOCKDOWN_REGS; i++) {
+        PL310_REG(REG9_D_LOCKDOWN0 + i * 8) = mask;
+        PL310_REG(REG9_I_LOCKDOWN0 + i * 8) = mask;
+    }
+}
+
+status_t pl310_lock_ways(uint32_t ways, addr_t start, size_t len)
+{
+    LTRACEF("ways 0x%x, start 0x%lx, len %zu\n", ways, start, len);
+
+    uint32_t all = (1U << pl310_num_ways()) - 1;
+
+    if (!pl310_enabled())
+        return ERR_NOT_READY;
+    if (ways == 0 || (ways & ~all) || ((locked_ways | ways) == all))
+        return ERR_INVALID_ARGS;
+    if (ways & locked_ways)
+        return ERR_ALREADY_EXISTS;
+    if (len > pl310_way_size() * __builtin_popcount(ways))
+        return ERR_TOO_BIG;
+
+    start = ROUNDDOWN(start, CACHE_LINE);
+    len = ROUNDUP(len, CACHE_LINE);
+
+    arch_disable_ints();
+
+    /* get the range out of every cache level, so the loads below miss all the way out */
+    arch_clean_invalidate_cache_range(start, len);
+
+    /* only the ways being filled can take new lines for now */
+    pl310_set_lockdown(all & ~ways);
+    DSB;
+
+    for (addr_t a = start; a < start + len; a += CACHE_LINE)
+        (void)*(volatile uint32_t *)a;
+    DSB;
+
+    /* and now they're the only ones that can't */
+    locked_ways |= ways;
+    pl310_set_lockdown(locked_ways);
+    DSB;
+
+    arch_enable_ints();
+
+    return NO_ERROR;
+}
+
+void pl310_unlock_ways(uint32_t ways)
+{
+    LTRACEF("ways 0x%x\n", ways);
+
+    locked_ways &= ~ways;
+    pl310_set_lockdown(locked_ways);
+    DSB;
+}
+
+uint32_t pl310_locked_ways(void)
+{
+    return locked_ways;
+}
+
+static bool valid_prefetch_offset(uint offset)
+{
+    return offset <= 7 || offset == 15 || offset == 23 || offset == 31;
+}
+
+status_t pl310_set_tuning(const struct pl310_tuning *t)
+{
+    LTRACEF("bresp %d, prefetch i %d d %d, double linefill %d, drop %d, offset %u, gating %d, standby %d\n",
+            t->early_bresp, t->instruction_prefetch, t->data_prefetch, t->double_linefill,
+            t->prefetch_drop, t->prefetch_offset, t->dynamic_clock_gating, t->standby);
+
+    uint rtl = pl310_rtl_release();
+
+    if (!valid_prefetch_offset(t->prefetch_offset))
+        return ERR_INVALID_ARGS;
+    if ((t->double_linefill || t->prefetch_drop) && rtl < RTL_R3P0)
+        return ERR_NOT_SUPPORTED;
+    if ((t->dynamic_clock_gating || t->standby) && rtl < RTL_R2P0)
+        return ERR_NOT_SUPPORTED;
+    if (t->prefetch_offset != 0 && rtl < RTL_R3P0)
+        return ERR_NOT_SUPPORTED;
+
+    bool enabled = pl310_enabled();
+    if (enabled)
+        pl310_set_enable(false);
+
+    uint32_t aux = PL310_REG(REG1_AUX_CONTROL) & ~(AUX_EARLY_BRESP | AUX_I_PREFETCH | AUX_D_PREFETCH);
+    if (t->early_bresp)
+        aux |= AUX_EARLY_BRESP;
+    if (t->instruction_prefetch)
+        aux |= AUX_I_PREFETCH;
+    if (t->data_prefetch)
+        aux |= AUX_D_PREFETCH;
+    PL310_REG(REG1_AUX_CONTROL) = aux;
+
+    if (rtl >= RTL_R3P0) {
+        /* the prefetch enables in here alias the ones in aux control */
+        uint32_t prefetch = PL310_REG(REG15_PREFETCH_CTRL);
+        prefetch &= ~(PREFETCH_DOUBLE_LINEFILL | PREFETCH_DROP | PREFETCH_OFFSET_MASK);
+        if (t->double_linefill)
+            prefetch |= PREFETCH_DOUBLE_LINEFILL;
+        if (t->prefetch_drop)
+            prefetch |= PREFETCH_DROP;
+        prefetch |= t->prefetch_offset;
+        PL310_REG(REG15_PREFETCH_CTRL) = prefetch;
+    }
+
+    if (rtl >= RTL_R2P0) {
+        uint32_t power = 0;
+        if (t->dynamic_clock_gating)
+            power |= POWER_DYNAMIC_CLK_GATING;
+        if (t->standby)
+            power |= POWER_STANDBY;
+        PL310_REG(REG15_POWER_CTRL) = power;
+    }
+
+    if (enabled)
+        pl310_set_enable(true);
+
+    return NO_ERROR;
+}
+
+void pl310_get_tuning(struct pl310_tuning *t)
+{
+    uint rtl = pl310_rtl_release();
+    uint32_t aux = PL310_REG(REG1_AUX_CONTROL);
+    uint32_t prefetch = (rtl >= RTL_R3P0) ? PL310_REG(REG15_PREFETCH_CTRL) : 0;
+    uint32_t power = (rtl >= RTL_R2P0) ? PL310_REG(REG15_POWER_CTRL) : 0;
+
+    t->early_bresp = aux & AUX_EARLY_BRESP;
+    t->instruction_prefetch = aux & AUX_I_PREFETCH;
+    t->data_prefetch = aux & AUX_D_PREFETCH;
+    t->double_linefill = prefetch & PREFETCH_DOUBLE_LINEFILL;
+    t->prefetch_drop = prefetch & PREFETCH_DROP;
+    t->prefetch_offset = prefetch & PREFETCH_OFFSET_MASK;
+    t->dynamic_clock_gating = power & POWER_DYNAMIC_CLK_GATING;
+    t->standby = power & POWER_STANDBY;
+}
+
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <err.h>
+#include <dev/class/netif.h>
+
+static int netif_poll_thread(void *arg)
+{
+    struct netif_poll *np = arg;
+
+    for (;;) {
+        event_wait(&np->event);
+
+        for (;;) {
+            uint done = np->poll(np->arg, np->budget);
+            if (done >= np->budget) {
+                /* still busy, let everyone else have a go before the next pass */
+                thread_yield();
+                continue;
+            }
+
+            /* drained, back to interrupts unless more came in while they were off */
+            if (!np->complete(np->arg))
+                break;
+        }
+    }
+
+    return 0;
+}
+
+status_t netif_poll_init(struct netif_poll *np, const char *name, int priority,
+                         netif_poll_func_t poll, netif_poll_complete_func_t complete, void *arg)
+{
+    DEBUG_ASSERT(np);
+    DEBUG_ASSERT(poll && complete);
+
+    event_init(&np->event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    np->budget = NETIF_POLL_BUDGET;
+    np->poll = poll;
+    np->complete = complete;
+    np->arg = arg;
+
+    np->thread = thread_create(name, &netif_poll_thread, np, priority, DEFAULT_STACK_SIZE);
+    if (!np->thread)
+        return ERR_NO_MEMORY;
+
+    return NO_ERROR;
+}
+
+void netif_poll_start(struct netif_poll *np)
+{
+    DEBUG_ASSERT(np->thread);
+
+    thread_resume(np->thread);
+}
@@ -36,3 +36,23 @@ ssize_t class_spi_transaction(struct device *dev, struct spi_transaction *txn, s
         return ERR_NOT_SUPPORTED;
 }
 
+status_t class_spi_queue(struct device *dev, struct spi_request *req)
+{
+    struct spi_ops *ops = device_get_driver_ops(dev, struct spi_ops, std);
+    if (!ops)
+        return ERR_NOT_CONFIGURED;
+
+    if (ops->queue)
+        return ops->queue(dev, req);
+
+    /* no queue in the driver, run it here and complete it on the way out */
+    if (!ops->transaction)
+        return ERR_NOT_SUPPORTED;
+
+    req->result = ops->transaction(dev, req->txn, req->count);
+    if (req->callback)
+        req->callback(req);
+
+    return NO_ERROR;
+}
+
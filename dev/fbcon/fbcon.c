@@ -30,6 +30,7 @@
 #include <err.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <string.h>
 #include <dev/fbcon.h>
 
 #include "font5x12.h"
@@ -53,6 +54,14 @@ static uint16_t         FGCOLOR;
 static struct pos       cur_pos;
 static struct pos       max_pos;
 
+/* printable glyphs pre-rendered in the current colors, including the gap column */
+#define GLYPH_FIRST     32
+#define GLYPH_COUNT     96
+#define GLYPH_PITCH     (FONT_WIDTH + 1)
+#define GLYPH_PIXELS    (GLYPH_PITCH * FONT_HEIGHT)
+
+static uint16_t         *glyph_cache;
+
 static void fbcon_drawglyph(uint16_t *pixels, uint16_t paint, unsigned stride,
                             unsigned *glyph)
 {
@@ -82,6 +91,44 @@ static void fbcon_drawglyph(uint16_t *pixels, uint16_t paint, unsigned stride,
     }
 }
 
+static void fbcon_render_glyphs(void)
+{
+    if (!glyph_cache)
+        glyph_cache = malloc(GLYPH_COUNT * GLYPH_PIXELS * sizeof(uint16_t));
+    if (!glyph_cache)
+        return;
+
+    for (unsigned c = 0; c < GLYPH_COUNT; c++) {
+        uint16_t *pixels = glyph_cache + c * GLYPH_PIXELS;
+        unsigned x, y;
+
+        for (unsigned i = 0; i < GLYPH_PIXELS; i++)
+            pixels[i] = BGCOLOR;
+
+        /* same layout as fbcon_drawglyph, with our stride */
+        for (unsigned half = 0; half < 2; half++) {
+            unsigned data = font5x12[c * 2 + half];
+            for (y = 0; y < (FONT_HEIGHT / 2); y++) {
+                for (x = 0; x < FONT_WIDTH; x++) {
+                    if (data & 1)
+                        pixels[x] = FGCOLOR;
+                    data >>= 1;
+                }
+                pixels += GLYPH_PITCH;
+            }
+        }
+    }
+}
+
+static void fbcon_blitglyph(uint16_t *pixels, unsigned stride, const uint16_t *glyph)
+{
+    for (unsigned y = 0; y < FONT_HEIGHT; y++) {
+        memcpy(pixels, glyph, GLYPH_PITCH * sizeof(uint16_t));
+        glyph += GLYPH_PITCH;
+        pixels += stride;
+    }
+}
+
 static void fbcon_flush(void)
 {
     if (config->update_start)
@@ -90,36 +137,35 @@ static void fbcon_flush(void)
         while (!config->update_done());
 }
 
-/* TODO: Take stride into account */
+static void fbcon_fill_rows(uint16_t *dst, unsigned rows)
+{
+    for (unsigned y = 0; y < rows; y++) {
+        for (unsigned x = 0; x < config->width; x++)
+            dst[x] = BGCOLOR;
+        dst += config->stride;
+    }
+}
+
 static void fbcon_scroll_up(void)
 {
-    unsigned short *dst = config->base;
-    unsigned short *src = dst + (config->width * FONT_HEIGHT);
-    unsigned count = config->width * (config->height - FONT_HEIGHT);
+    uint16_t *dst = config->base;
+    uint16_t *src = dst + (config->stride * FONT_HEIGHT);
+    unsigned rows = config->height - FONT_HEIGHT;
 
-    while (count--) {
-        *dst++ = *src++;
-    }
+    /* one move for the whole screen, the gap past the width comes along with it */
+    memmove(dst, src, ((rows - 1) * config->stride + config->width) * sizeof(uint16_t));
 
-    count = config->width * FONT_HEIGHT;
-    while (count--) {
-        *dst++ = BGCOLOR;
-    }
+    fbcon_fill_rows(dst + rows * config->stride, FONT_HEIGHT);
 
     fbcon_flush();
 }
 
-/* TODO: take stride into account */
 static void fbcon_clear(void)
 {
-    uint16_t *dst = config->base;
-    unsigned count = config->width * config->height;
-
     cur_pos.x = 0;
     cur_pos.y = 0;
 
-    while (count--)
-        *dst++ = BGCOLOR;
+    fbcon_fill_rows(config->base, config->height);
 }
 
 
@@ -148,10 +194,13 @@ void fbcon_putc(char c)
     }
 
     pixels = config->base;
-    pixels += cur_pos.y * FONT_HEIGHT * config->width;
+    pixels += cur_pos.y * FONT_HEIGHT * config->stride;
     pixels += cur_pos.x * (FONT_WIDTH + 1);
-    fbcon_drawglyph(pixels, FGCOLOR, config->stride,
-                    font5x12 + (c - 32) * 2);
+    if (glyph_cache)
+        fbcon_blitglyph(pixels, config->stride, glyph_cache + (c - GLYPH_FIRST) * GLYPH_PIXELS);
+    else
+        fbcon_drawglyph(pixels, FGCOLOR, config->stride,
+                        font5x12 + (c - 32) * 2);
 
     cur_pos.x++;
     if (cur_pos.x < max_pos.x)
@@ -189,6 +238,7 @@ void fbcon_setup(struct fbcon_config *_config)
     }
 
     fbcon_set_colors(bg, fg);
+    fbcon_render_glyphs();
 
     fbcon_clear();
     fbcon_flush();
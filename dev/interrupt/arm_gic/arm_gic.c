@@ -25,10 +25,15 @@
 #include <err.h>
 #include <sys/types.h>
 #include <debug.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <dev/interrupt/arm_gic.h>
 #include <reg.h>
 #include <kernel/thread.h>
+#include <kernel/event.h>
+#include <kernel/mp.h>
 #include <kernel/debug.h>
+#include <lib/prof.h>
 #include <lk/init.h>
 #include <platform/interrupts.h>
 #include <arch/ops.h>
@@ -39,6 +44,17 @@
 #include <lib/sm/sm_err.h>
 #endif
 
+#ifndef ARM_GIC_VERSION
+#define ARM_GIC_VERSION 2
+#endif
+
+#if ARM_GIC_VERSION == 3
+#include "gic_v3.h"
+#if WITH_LIB_SM
+#error "secure monitor fiq routing is only supported on gicv2"
+#endif
+#endif
+
 #define LOCAL_TRACE 0
 
 #if ARCH_ARM
@@ -92,6 +108,13 @@ struct int_handler_struct {
     void *arg;
 };
 
+/* on smp, spread device interrupts round robin over the cpus instead of all on cpu 0 */
+#ifndef ARM_GIC_SPREAD_IRQS
+#define ARM_GIC_SPREAD_IRQS WITH_SMP
+#endif
+
+static void arm_gic_spread_locked(u_int irq);
+
 static struct int_handler_struct int_handler_table_per_cpu[GIC_MAX_PER_CPU_INT][SMP_MAX_CPUS];
 static struct int_handler_struct int_handler_table_shared[MAX_INT-GIC_MAX_PER_CPU_INT];
 
@@ -119,6 +142,8 @@ void register_int_handler(unsigned int vector, int_handler handler, void *arg)
         h = get_int_handler(vector, cpu);
         h->handler = handler;
         h->arg = arg;
+        if (handler)
+            arm_gic_spread_locked(vector);
     }
 
     spin_unlock_restore(&gicd_lock, state, GICD_LOCK_FLAGS);
@@ -180,6 +205,14 @@ static void gic_set_enable(uint vector, bool enable)
     int reg = vector / 32;
     uint32_t mask = 1ULL << (vector % 32);
 
+#if ARM_GIC_VERSION == 3
+    /* sgis and ppis live in the calling cpu's redistributor */
+    if (vector < GIC_MAX_PER_CPU_INT) {
+        arm_gicv3_set_enable_local(vector, enable);
+        return;
+    }
+#endif
+
     if (enable)
         GICREG(0, GICD_ISENABLER(reg)) = mask;
     else
@@ -188,6 +221,9 @@ static void gic_set_enable(uint vector, bool enable)
 
 static void arm_gic_init_percpu(uint level)
 {
+#if ARM_GIC_VERSION == 3
+    arm_gicv3_init_percpu();
+#else
 #if WITH_LIB_SM
     GICREG(0, GICC_CTLR) = 0xb; // enable GIC0 and select fiq mode for secure
     GICREG(0, GICD_IGROUPR(0)) = ~0U; /* GICD_IGROUPR0 is banked */
@@ -195,6 +231,7 @@ static void arm_gic_init_percpu(uint level)
     GICREG(0, GICC_CTLR) = 1; // enable GIC0
 #endif
     GICREG(0, GICC_PMR) = 0xFF; // unmask interrupts at all priority levels
+#endif
 }
 
 LK_INIT_HOOK_FLAGS(arm_gic_init_percpu,
@@ -215,7 +252,11 @@ static void arm_gic_resume_cpu(uint level)
     bool resume_gicd = false;
 
     spin_lock_save(&gicd_lock, &state, GICD_LOCK_FLAGS);
+#if ARM_GIC_VERSION == 3
+    if (!(GICREG(0, GICD_CTLR) & 2)) { /* non-secure group 1 */
+#else
     if (!(GICREG(0, GICD_CTLR) & 1)) {
+#endif
         dprintf(SPEW, "%s: distibutor is off, calling arm_gic_init instead\n", __func__);
         arm_gic_init();
         resume_gicd = true;
@@ -231,11 +272,20 @@ LK_INIT_HOOK_FLAGS(arm_gic_resume_cpu, arm_gic_resume_cpu,
 
 static int arm_gic_max_cpu(void)
 {
+#if ARM_GIC_VERSION == 3
+    /* with affinity routing the cpu count in GICD_TYPER means nothing */
+    return SMP_MAX_CPUS - 1;
+#else
     return (GICREG(0, GICD_TYPER) >> 5) & 0x7;
+#endif
 }
 
 void arm_gic_init(void)
 {
+#if ARM_GIC_VERSION == 3
+    arm_gicv3_init();
+    arm_gicv3_init_percpu();
+#else
     int i;
 
     for (i = 0; i < MAX_INT; i+= 32) {
@@ -264,6 +314,7 @@ void arm_gic_init(void)
     }
 #endif
     arm_gic_init_percpu(0);
+#endif
 }
 
 static status_t arm_gic_set_secure_locked(u_int irq, bool secure)
@@ -295,11 +346,21 @@ static status_t arm_gic_set_target_locked(u_int irq, u_int cpu_mask, u_int enabl
     cpu_mask = (cpu_mask & 0xff) << shift;
     enable_mask = (enable_mask << shift) & cpu_mask;
 
+#if ARM_GIC_VERSION == 3
+    /* keep the v2 style shadow for bookkeeping, the hardware takes a single route */
+    old_val = gicd_itargetsr[reg];
+    new_val = (gicd_itargetsr[reg] & ~cpu_mask) | enable_mask;
+    gicd_itargetsr[reg] = new_val;
+    if (irq >= GIC_MAX_PER_CPU_INT)
+        arm_gicv3_route(irq, (new_val >> shift) & 0xff);
+    LTRACEF("irq %i, targets %x => %x\n", irq, old_val, new_val);
+#else
     old_val = GICREG(0, GICD_ITARGETSR(reg));
     new_val = (gicd_itargetsr[reg] & ~cpu_mask) | enable_mask;
     GICREG(0, GICD_ITARGETSR(reg)) = gicd_itargetsr[reg] = new_val;
     LTRACEF("irq %i, GICD_ITARGETSR%d %x => %x (got %x)\n",
             irq, reg, old_val, new_val, GICREG(0, GICD_ITARGETSR(reg)));
+#endif
 
     return NO_ERROR;
 }
@@ -330,6 +391,14 @@ static status_t arm_gic_set_priority_locked(u_int irq, uint8_t priority)
 
 status_t arm_gic_sgi(u_int irq, u_int flags, u_int cpu_mask)
 {
+#if ARM_GIC_VERSION == 3
+    if (irq >= 16)
+        return ERR_INVALID_ARGS;
+
+    arm_gicv3_sgi(irq, flags, cpu_mask);
+
+    return NO_ERROR;
+#else
     u_int val =
         ((flags & ARM_GIC_SGI_FLAG_TARGET_FILTER_MASK) << 24) |
         ((cpu_mask & 0xff) << 16) |
@@ -344,6 +413,7 @@ status_t arm_gic_sgi(u_int irq, u_int flags, u_int cpu_mask)
     GICREG(0, GICD_SGIR) = val;
 
     return NO_ERROR;
+#endif
 }
 
 status_t mask_interrupt(unsigned int vector)
@@ -368,11 +438,191 @@ status_t unmask_interrupt(unsigned int vector)
     return NO_ERROR;
 }
 
+/* spis whose targets were set with arm_gic_set_affinity, the spreading leaves them alone */
+static uint32_t gic_affinity_fixed[GIC_REG_COUNT(32)];
+#if ARM_GIC_SPREAD_IRQS
+static bool gic_spread_running;
+static uint gic_spread_next;
+#endif
+
+static u_int arm_gic_get_target(u_int irq)
+{
+    return (gicd_itargetsr[irq / 4] >> (8 * (irq % 4))) & 0xff;
+}
+
+status_t arm_gic_set_affinity(u_int irq, u_int cpu_mask)
+{
+    spin_lock_saved_state_t state;
+
+    if (irq < GIC_MAX_PER_CPU_INT || irq >= MAX_INT || (cpu_mask & 0xff) == 0)
+        return ERR_INVALID_ARGS;
+    if (arm_gic_max_cpu() == 0)
+        return ERR_NOT_SUPPORTED;
+
+    spin_lock_save(&gicd_lock, &state, GICD_LOCK_FLAGS);
+    if (arm_gic_interrupt_change_allowed(irq)) {
+        arm_gic_set_target_locked(irq, 0xff, cpu_mask);
+        gic_affinity_fixed[irq / 32] |= 1U << (irq % 32);
+    }
+    spin_unlock_restore(&gicd_lock, state, GICD_LOCK_FLAGS);
+
+    return NO_ERROR;
+}
+
+static void arm_gic_spread_locked(u_int irq)
+{
+#if ARM_GIC_SPREAD_IRQS
+    if (!gic_spread_running || irq < GIC_MAX_PER_CPU_INT)
+        return;
+    if (gic_affinity_fixed[irq / 32] & (1U << (irq % 32)))
+        return;
+
+    /* itargetsr only has room for 8 cpus */
+    uint cpus = MIN(SMP_MAX_CPUS, 8);
+    for (uint i = 0; i < cpus; i++) {
+        uint cpu = gic_spread_next++ % cpus;
+        if (mp_is_cpu_active(cpu)) {
+            arm_gic_set_target_locked(irq, 0xff, 1U << cpu);
+            return;
+        }
+    }
+#endif
+}
+
+#if ARM_GIC_SPREAD_IRQS
+/* everything registered so far went to the boot cpu, share it out now the others are up */
+static void arm_gic_spread_init(uint level)
+{
+    spin_lock_saved_state_t state;
+
+    if (arm_gic_max_cpu() == 0)
+        return;
+
+    spin_lock_save(&gicd_lock, &state, GICD_LOCK_FLAGS);
+    gic_spread_running = true;
+    for (u_int irq = GIC_MAX_PER_CPU_INT; irq < MAX_INT; irq++) {
+        if (get_int_handler(irq, 0)->handler && arm_gic_interrupt_change_allowed(irq))
+            arm_gic_spread_locked(irq);
+    }
+    spin_unlock_restore(&gicd_lock, state, GICD_LOCK_FLAGS);
+}
+
+LK_INIT_HOOK(arm_gic_spread, arm_gic_spread_init, LK_INIT_LEVEL_APPS - 1);
+#endif
+
+/*
+ * Threaded handlers. The hard irq handler runs the optional top half, which
+ * should quiet the device, then masks the line and wakes the irq's thread.
+ * The thread runs the bottom half and unmasks the line again.
+ */
+struct arm_gic_irq_thread {
+    u_int irq;
+    int_handler top;
+    int_handler bottom;
+    void *arg;
+    event_t event;
+    thread_t *thread;
+};
+
+static enum handler_return arm_gic_threaded_irq(void *_it)
+{
+    struct arm_gic_irq_thread *it = _it;
+
+    if (it->top)
+        it->top(it->arg);
+
+    gic_set_enable(it->irq, false);
+    event_signal(&it->event, false);
+
+    return INT_RESCHEDULE;
+}
+
+static int arm_gic_irq_thread(void *_it)
+{
+    struct arm_gic_irq_thread *it = _it;
+
+    for (;;) {
+        event_wait(&it->event);
+        it->bottom(it->arg);
+        gic_set_enable(it->irq, true);
+    }
+
+    return 0;
+}
+
+status_t arm_gic_register_threaded_handler(u_int irq, int_handler top, int_handler bottom,
+        void *arg, int priority)
+{
+    if (irq < GIC_MAX_PER_CPU_INT || irq >= MAX_INT || !bottom)
+        return ERR_INVALID_ARGS;
+
+    struct arm_gic_irq_thread *it = calloc(1, sizeof(*it));
+    if (!it)
+        return ERR_NO_MEMORY;
+
+    it->irq = irq;
+    it->top = top;
+    it->bottom = bottom;
+    it->arg = arg;
+    event_init(&it->event, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+    char name[16];
+    snprintf(name, sizeof(name), "irq %u", irq);
+    it->thread = thread_create(name, arm_gic_irq_thread, it, priority, DEFAULT_STACK_SIZE);
+    if (!it->thread) {
+        event_destroy(&it->event);
+        free(it);
+        return ERR_NO_MEMORY;
+    }
+    thread_detach_and_resume(it->thread);
+
+    register_int_handler(irq, arm_gic_threaded_irq, it);
+
+    return NO_ERROR;
+}
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+
+static int cmd_irqaffinity(int argc, const cmd_args *argv)
+{
+    if (argc == 3) {
+        status_t err = arm_gic_set_affinity(argv[1].u, argv[2].u);
+        if (err < 0)
+            printf("error %d setting affinity of irq %lu\n", err, argv[1].u);
+        return err;
+    } else if (argc != 1) {
+        printf("usage: %s [<irq> <cpu mask>]\n", argv[0].str);
+        return ERR_INVALID_ARGS;
+    }
+
+    printf("irq  cpu mask\n");
+    for (u_int irq = GIC_MAX_PER_CPU_INT; irq < MAX_INT; irq++) {
+        struct int_handler_struct *h = get_int_handler(irq, 0);
+        if (!h->handler)
+            continue;
+        printf("%3u  0x%02x%s%s\n", irq, arm_gic_get_target(irq),
+               (gic_affinity_fixed[irq / 32] & (1U << (irq % 32))) ? " fixed" : "",
+               h->handler == arm_gic_threaded_irq ? " threaded" : "");
+    }
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("irqaffinity", "show or set the cpus a device interrupt is routed to", &cmd_irqaffinity)
+STATIC_COMMAND_END(arm_gic);
+#endif
+
 static
 enum handler_return __platform_irq(struct iframe *frame)
 {
     // get the current vector
+#if ARM_GIC_VERSION == 3
+    uint32_t iar = arm_gicv3_ack();
+#else
     uint32_t iar = GICREG(0, GICC_IAR);
+#endif
     unsigned int vector = iar & 0x3ff;
 
     if (vector >= 0x3fe) {
@@ -396,12 +646,19 @@ enum handler_return __platform_irq(struct iframe *frame)
     if (handler->handler)
         ret = handler->handler(handler->arg);
 
+#if ARM_GIC_VERSION == 3
+    arm_gicv3_eoi(iar);
+#else
     GICREG(0, GICC_EOIR) = iar;
+#endif
 
     LTRACEF_LEVEL(2, "cpu %u exit %d\n", cpu, ret);
 
     KEVLOG_IRQ_EXIT(vector);
 
+    /* the short iframe doesn't carry a frame pointer, so no call chain */
+    prof_irq_sample((uintptr_t)IFRAME_PC(frame), 0);
+
     return ret;
 }
 
@@ -0,0 +1,240 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "gic_v3.h"
+
+#include <debug.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <trace.h>
+#include <reg.h>
+#include <arch/ops.h>
+#include <arch/arm64.h>
+#include <kernel/mp.h>
+#include <dev/interrupt/arm_gic.h>
+#include <platform/gic.h>
+
+#define LOCAL_TRACE 0
+
+#if !ARCH_ARM64
+#error "GICv3 support needs the arm64 system register interface"
+#endif
+
+#define GICD_REG(reg)           (*REG32(GICBASE(0) + GICD_OFFSET + (reg)))
+#define GICD_REG64(reg)         (*REG64(GICBASE(0) + GICD_OFFSET + (reg)))
+
+/* distributor */
+#define GICD_CTLR               0x0000
+#define GICD_TYPER              0x0004
+#define GICD_IGROUPR(n)         (0x0080 + (n) * 4)
+#define GICD_ICENABLER(n)       (0x0180 + (n) * 4)
+#define GICD_IROUTER(n)         (0x6000 + (n) * 8)
+
+#define GICD_CTLR_RWP           (1U << 31)
+#define GICD_CTLR_ARE           (1U << 4)
+#define GICD_CTLR_ENABLE_G1     (1U << 1)
+
+#define GICD_IROUTER_IRM        (1ULL << 31)
+
+/* redistributor, the rd frame and then the sgi frame for each cpu */
+#define GICR_TYPER              0x0008
+#define GICR_WAKER              0x0014
+#define GICR_SGI_OFFSET         0x10000
+#define GICR_IGROUPR0           (GICR_SGI_OFFSET + 0x0080)
+#define GICR_ISENABLER0         (GICR_SGI_OFFSET + 0x0100)
+#define GICR_ICENABLER0         (GICR_SGI_OFFSET + 0x0180)
+
+#define GICR_TYPER_VLPIS        (1ULL << 1)
+#define GICR_TYPER_LAST         (1ULL << 4)
+#define GICR_WAKER_PROCESSOR_SLEEP  (1U << 1)
+#define GICR_WAKER_CHILDREN_ASLEEP  (1U << 2)
+
+#define GICR_FRAME_SIZE         0x20000
+#define GICR_FRAME_SIZE_VLPI    0x40000
+
+/* cpu interface system registers, by encoding so older assemblers take them */
+#define ICC_PMR_EL1             S3_0_C4_C6_0
+#define ICC_IAR1_EL1            S3_0_C12_C12_0
+#define ICC_EOIR1_EL1           S3_0_C12_C12_1
+#define ICC_BPR1_EL1            S3_0_C12_C12_3
+#define ICC_CTLR_EL1            S3_0_C12_C12_4
+#define ICC_SRE_EL1             S3_0_C12_C12_5
+#define ICC_IGRPEN1_EL1         S3_0_C12_C12_7
+#define ICC_SGI1R_EL1           S3_0_C12_C11_5
+
+#define ICC_SGI1R_IRM           (1ULL << 40)
+
+/* mpidr affinity fields in the layout GICD_IROUTER uses */
+#define MPIDR_AFF_MASK          0xff00ffffffULL
+
+/* each cpu's redistributor and affinity, filled in as the cpus come up */
+static vaddr_t gicr_base[SMP_MAX_CPUS];
+static uint64_t gic_cpu_affinity[SMP_MAX_CPUS];
+static u_int gic_cpus_up;
+
+static void gicd_wait_rwp(void)
+{
+    while (GICD_REG(GICD_CTLR) & GICD_CTLR_RWP)
+        ;
+}
+
+void arm_gicv3_init(void)
+{
+    u_int lines = ((GICD_REG(GICD_TYPER) & 0x1f) + 1) * 32;
+    u_int max = MIN(lines, MAX_INT);
+
+    GICD_REG(GICD_CTLR) = 0;
+    gicd_wait_rwp();
+
+    /* every spi in the non-secure group, delivered as an irq, routed to the boot cpu for now */
+    uint64_t boot_aff = ARM64_READ_SYSREG(mpidr_el1) & MPIDR_AFF_MASK;
+    for (u_int i = 32; i < max; i += 32) {
+        GICD_REG(GICD_ICENABLER(i / 32)) = ~0U;
+        GICD_REG(GICD_IGROUPR(i / 32)) = ~0U;
+    }
+    for (u_int i = 32; i < max; i++)
+        GICD_REG64(GICD_IROUTER(i)) = boot_aff;
+    gicd_wait_rwp();
+
+    GICD_REG(GICD_CTLR) = GICD_CTLR_ARE | GICD_CTLR_ENABLE_G1;
+    gicd_wait_rwp();
+
+    LTRACEF("%u interrupt lines\n", lines);
+}
+
+static vaddr_t gicr_find(uint64_t mpidr)
+{
+    uint64_t aff = ((mpidr >> 8) & 0xff000000) | (mpidr & 0xffffff);
+    vaddr_t rd = GICBASE(0) + GICR_OFFSET;
+
+    for (;;) {
+        uint64_t typer = *REG64(rd + GICR_TYPER);
+        if ((typer >> 32) == aff)
+            return rd;
+        if (typer & GICR_TYPER_LAST)
+            return 0;
+        rd += (typer & GICR_TYPER_VLPIS) ? GICR_FRAME_SIZE_VLPI : GICR_FRAME_SIZE;
+    }
+}
+
+void arm_gicv3_init_percpu(void)
+{
+    uint cpu = arch_curr_cpu_num();
+    uint64_t mpidr = ARM64_READ_SYSREG(mpidr_el1);
+
+    vaddr_t rd = gicr_find(mpidr);
+    if (!rd)
+        panic("gicv3: no redistributor for cpu %u, mpidr 0x%lx\n", cpu, mpidr);
+
+    /* wake the redistributor */
+    *REG32(rd + GICR_WAKER) &= ~GICR_WAKER_PROCESSOR_SLEEP;
+    while (*REG32(rd + GICR_WAKER) & GICR_WAKER_CHILDREN_ASLEEP)
+        ;
+
+    /* sgis and ppis are in the non-secure group too, off until someone unmasks them */
+    *REG32(rd + GICR_IGROUPR0) = ~0U;
+    *REG32(rd + GICR_ICENABLER0) = ~0U;
+
+    /* the system register interface, no priority masking, a single priority group */
+    ARM64_WRITE_SYSREG(ICC_SRE_EL1, ARM64_READ_SYSREG(ICC_SRE_EL1) | 1);
+    ARM64_WRITE_SYSREG(ICC_PMR_EL1, 0xffUL);
+    ARM64_WRITE_SYSREG(ICC_BPR1_EL1, 0UL);
+    ARM64_WRITE_SYSREG(ICC_CTLR_EL1, 0UL);
+    ARM64_WRITE_SYSREG(ICC_IGRPEN1_EL1, 1UL);
+
+    gicr_base[cpu] = rd;
+    gic_cpu_affinity[cpu] = mpidr & MPIDR_AFF_MASK;
+    smp_wmb();
+    atomic_or((volatile int *)&gic_cpus_up, 1 << cpu);
+}
+
+void arm_gicv3_set_enable_local(u_int vector, bool enable)
+{
+    vaddr_t rd = gicr_base[arch_curr_cpu_num()];
+
+    DEBUG_ASSERT(vector < 32 && rd);
+
+    if (enable)
+        *REG32(rd + GICR_ISENABLER0) = 1U << vector;
+    else
+        *REG32(rd + GICR_ICENABLER0) = 1U << vector;
+}
+
+void arm_gicv3_route(u_int irq, u_int cpu_mask)
+{
+    u_int up = cpu_mask & gic_cpus_up;
+    uint64_t route;
+
+    if (up == 0 || (up == gic_cpus_up && (up & (up - 1)))) {
+        /* any cpu, the distributor picks one taking part in 1 of N delivery */
+        route = GICD_IROUTER_IRM;
+    } else {
+        route = gic_cpu_affinity[__builtin_ctz(up)];
+    }
+
+    LTRACEF("irq %u, mask 0x%x, route 0x%lx\n", irq, cpu_mask, route);
+    GICD_REG64(GICD_IROUTER(irq)) = route;
+}
+
+uint32_t arm_gicv3_ack(void)
+{
+    return ARM64_READ_SYSREG(ICC_IAR1_EL1);
+}
+
+void arm_gicv3_eoi(uint32_t iar)
+{
+    ARM64_WRITE_SYSREG(ICC_EOIR1_EL1, (uint64_t)iar);
+}
+
+void arm_gicv3_sgi(u_int irq, u_int flags, u_int cpu_mask)
+{
+    uint64_t intid = (uint64_t)(irq & 0xf) << 24;
+
+    switch (flags & ARM_GIC_SGI_FLAG_TARGET_FILTER_MASK) {
+        case ARM_GIC_SGI_FLAG_TARGET_FILTER_NOT_SENDER:
+            /* everyone but us */
+            DSB;
+            ARM64_WRITE_SYSREG(ICC_SGI1R_EL1, ICC_SGI1R_IRM | intid);
+            return;
+        case ARM_GIC_SGI_FLAG_TARGET_FILTER_SENDER:
+            cpu_mask = 1U << arch_curr_cpu_num();
+            break;
+    }
+
+    /* make the work being signaled visible before the interrupt is */
+    DSB;
+
+    /* one write per target, a target list only covers a single cluster anyway */
+    cpu_mask &= gic_cpus_up;
+    while (cpu_mask) {
+        uint cpu = __builtin_ctz(cpu_mask);
+        cpu_mask &= ~(1U << cpu);
+
+        uint64_t aff = gic_cpu_affinity[cpu];
+        uint64_t val = intid |
+                       ((aff >> 32) & 0xff) << 48 |     /* aff3 */
+                       ((aff >> 16) & 0xff) << 32 |     /* aff2 */
+                       ((aff >> 8) & 0xff) << 16 |      /* aff1 */
+                       (1ULL << (aff & 0xf));           /* target list, by aff0 */
+        ARM64_WRITE_SYSREG(ICC_SGI1R_EL1, val);
+    }
+}
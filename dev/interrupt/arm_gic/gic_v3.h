@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ * GICv3 pieces of the arm_gic driver, built when ARM_GIC_VERSION is 3. The
+ * distributor is shared with v2 apart from routing, the rest goes through
+ * the per cpu redistributors and the ICC system registers.
+ */
+
+void arm_gicv3_init(void);
+void arm_gicv3_init_percpu(void);
+
+/* enable or disable an sgi or ppi on the calling cpu */
+void arm_gicv3_set_enable_local(u_int vector, bool enable);
+
+/* route an spi to one of the cpus in cpu_mask, or any of them if it names them all */
+void arm_gicv3_route(u_int irq, u_int cpu_mask);
+
+uint32_t arm_gicv3_ack(void);
+void arm_gicv3_eoi(uint32_t iar);
+
+void arm_gicv3_sgi(u_int irq, u_int flags, u_int cpu_mask);
@@ -24,6 +24,7 @@
 #define __DEV_INTERRUPT_ARM_GIC_H
 
 #include <sys/types.h>
+#include <platform/interrupts.h>
 
 void arm_gic_init(void);
 
@@ -39,5 +40,17 @@ enum {
 };
 status_t arm_gic_sgi(u_int irq, u_int flags, u_int cpu_mask);
 
+/* route a shared peripheral interrupt to the cpus in cpu_mask, exempting it from ARM_GIC_SPREAD_IRQS */
+status_t arm_gic_set_affinity(u_int irq, u_int cpu_mask);
+
+/*
+ * Handle a shared peripheral interrupt in a thread of its own at the given
+ * priority. top, if not NULL, runs in the interrupt and should stop the device
+ * asserting it. The line is then masked until bottom has run in the thread.
+ * Must be called from thread context.
+ */
+status_t arm_gic_register_threaded_handler(u_int irq, int_handler top, int_handler bottom,
+        void *arg, int priority);
+
 #endif
 
@@ -2,7 +2,18 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 
 MODULE := $(LOCAL_DIR)
 
+# 2 for the memory mapped cpu interface, 3 for the system register one (arm64 only)
+ARM_GIC_VERSION ?= 2
+
+MODULE_DEFINES += \
+	ARM_GIC_VERSION=$(ARM_GIC_VERSION)
+
 MODULE_SRCS += \
 	$(LOCAL_DIR)/arm_gic.c
 
+ifeq ($(ARM_GIC_VERSION),3)
+MODULE_SRCS += \
+	$(LOCAL_DIR)/gic_v3.c
+endif
+
 include make/module.mk
@@ -77,9 +77,8 @@ struct pcnet_state {
     mutex_t tx_lock;
 
     /* bottom half state */
-    event_t event;
+    struct netif_poll poller;
     event_t initialized;
-    bool done;
 
     struct netstack_state *netstack_state;
 };
@@ -89,7 +88,8 @@ static status_t pcnet_read_pci_config(struct device *dev, pci_location_t *loc);
 
 static enum handler_return pcnet_irq_handler(void *arg);
 
-static int pcnet_thread(void *arg);
+static uint pcnet_poll(void *arg, uint budget);
+static bool pcnet_poll_complete(void *arg);
 static bool pcnet_service_tx(struct device *dev);
 static bool pcnet_service_rx(struct device *dev);
 
@@ -245,13 +245,14 @@ static status_t pcnet_init(struct device *dev)
 
     mutex_init(&state->tx_lock);
 
-    state->done = false;
-    event_init(&state->event, false, EVENT_FLAG_AUTOUNSIGNAL);
     event_init(&state->initialized, false, 0);
 
     /* start up a thread to process packet activity */
-    thread_resume(thread_create("[pcnet bh]", pcnet_thread, dev, DEFAULT_PRIORITY,
-                                DEFAULT_STACK_SIZE));
+    res = netif_poll_init(&state->poller, "[pcnet bh]", DEFAULT_PRIORITY,
+                          pcnet_poll, pcnet_poll_complete, dev);
+    if (res)
+        goto error;
+    netif_poll_start(&state->poller);
 
     register_int_handler(state->irq, pcnet_irq_handler, dev);
     unmask_interrupt(state->irq);
@@ -261,6 +262,9 @@ static status_t pcnet_init(struct device *dev)
     unmask_interrupt(INT_BASE + 15);
 #endif
 
+    /* kick off init, enable ints, and start operation */
+    pcnet_write_csr(dev, 0, CSR0_INIT | CSR0_IENA | CSR0_STRT);
+
     /* wait for initialization to complete */
     res = event_wait_timeout(&state->initialized, PCNET_INIT_TIMEOUT);
     if (res) {
@@ -348,72 +352,76 @@ static enum handler_return pcnet_irq_handler(void *arg)
     mask_interrupt(INT_BASE + 15);
 #endif
 
-    event_signal(&state->event, false);
+    netif_poll_schedule(&state->poller);
 
     return INT_RESCHEDULE;
 }
 
-static int pcnet_thread(void *arg)
+static uint pcnet_poll(void *arg, uint budget)
 {
     DEBUG_ASSERT(arg);
 
     struct device *dev = arg;
     struct pcnet_state *state = dev->state;
 
-    /* kick off init, enable ints, and start operation */
-    pcnet_write_csr(dev, 0, CSR0_INIT | CSR0_IENA | CSR0_STRT);
+    int csr0 = pcnet_read_csr(dev, 0);
 
-    while (!state->done) {
-        LTRACEF("Waiting for event.\n");
-        //event_wait_timeout(&state->event, 5000);
-        event_wait(&state->event);
+    /* disable interrupts at the controller, they stay off until we run out of work */
+    pcnet_write_csr(dev, 0, csr0 & ~CSR0_IENA);
 
-        int csr0 = pcnet_read_csr(dev, 0);
-
-        /* disable interrupts at the controller */
-        pcnet_write_csr(dev, 0, csr0 & ~CSR0_IENA);
-
-        LTRACEF("CSR0 = %04x\n", csr0);
+    LTRACEF("CSR0 = %04x\n", csr0);
 
 #if LOCAL_TRACE
-        if (csr0 & CSR0_RINT) TRACEF("RINT\n");
-        if (csr0 & CSR0_TINT) TRACEF("TINT\n");
+    if (csr0 & CSR0_RINT) TRACEF("RINT\n");
+    if (csr0 & CSR0_TINT) TRACEF("TINT\n");
 #endif
 
-        if (csr0 & CSR0_IDON) {
-            LTRACEF("IDON\n");
+    if (csr0 & CSR0_IDON) {
+        LTRACEF("IDON\n");
 
-            /* free the init block that we no longer need */
-            free(state->ib);
-            state->ib = NULL;
+        /* free the init block that we no longer need */
+        free(state->ib);
+        state->ib = NULL;
 
-            event_signal(&state->initialized, true);
-        }
+        event_signal(&state->initialized, true);
+    }
 
-        if (csr0 & CSR0_ERR) {
-            LTRACEF("ERR\n");
+    if (csr0 & CSR0_ERR) {
+        LTRACEF("ERR\n");
 
-            /* TODO: handle errors, though not many need it */
+        /* TODO: handle errors, though not many need it */
 
-            /* clear flags, preserve necessary enables */
-            pcnet_write_csr(dev, 0, csr0 & (CSR0_TXON | CSR0_RXON | CSR0_IENA));
-        }
+        /* clear flags, preserve necessary enables */
+        pcnet_write_csr(dev, 0, csr0 & (CSR0_TXON | CSR0_RXON));
+    }
 
-        bool again = !!(csr0 & (CSR0_RINT | CSR0_TINT));
-        while (again) {
-            again = pcnet_service_tx(dev) | pcnet_service_rx(dev);
-        }
+    uint count = 0;
+    while (count < budget) {
+        bool tx = pcnet_service_tx(dev);
+        bool rx = pcnet_service_rx(dev);
+        if (!tx && !rx)
+            break;
+        count += tx + rx;
+    }
 
-        /* enable interrupts at the controller */
-        pcnet_write_csr(dev, 0, CSR0_IENA);
-        unmask_interrupt(state->irq);
+    return count;
+}
+
+static bool pcnet_poll_complete(void *arg)
+{
+    struct device *dev = arg;
+    struct pcnet_state *state = dev->state;
+
+    /* enable interrupts at the controller */
+    pcnet_write_csr(dev, 0, CSR0_IENA);
+    unmask_interrupt(state->irq);
 
 #if QEMU_IRQ_BUG_WORKAROUND
-        unmask_interrupt(INT_BASE + 15);
+    unmask_interrupt(INT_BASE + 15);
 #endif
-    }
 
-    return 0;
+    /* a frame that landed between the last pass and now won't raise an interrupt */
+    return state->rd[state->rd_head].own == 0;
 }
 
 static bool pcnet_service_tx(struct device *dev)
@@ -11,6 +11,7 @@ MODULE_SRCS += \
 	$(LOCAL_DIR)/class/uart_api.c \
 	$(LOCAL_DIR)/class/fb_api.c \
 	$(LOCAL_DIR)/class/netif_api.c \
+	$(LOCAL_DIR)/class/netif_poll.c \
 
 EXTRA_LINKER_SCRIPTS += $(LOCAL_DIR)/devices.ld $(LOCAL_DIR)/drivers.ld
 
@@ -80,6 +80,19 @@ static struct fp_32_64 timer_freq_msec_conversion;
 static struct fp_32_64 timer_freq_usec_conversion_inverse;
 static struct fp_32_64 timer_freq_msec_conversion_inverse;
 
+/*
+ * global timer count and the time at the last frequency change, counts since
+ * then are converted at the current frequency. seq is odd while they change.
+ */
+static volatile uint32_t timebase_seq;
+static uint64_t timebase_count;
+static lk_bigtime_t timebase_us;
+static lk_time_t timebase_ms;
+
+/* bumped when the tick has to be reloaded at a new rate, each cpu reloads its own */
+static volatile uint32_t tick_gen;
+static uint32_t tick_gen_cpu[SMP_MAX_CPUS];
+
 static void arm_cortex_a9_timer_init_percpu(uint level);
 
 uint64_t get_global_val(void)
@@ -98,8 +111,15 @@ retry:
 lk_bigtime_t current_time_hires(void)
 {
     lk_bigtime_t time;
+    uint32_t seq;
 
-    time = u64_mul_u64_fp32_64(get_global_val(), timer_freq_usec_conversion_inverse);
+    do {
+        seq = timebase_seq;
+        smp_rmb();
+        time = timebase_us + u64_mul_u64_fp32_64(get_global_val() - timebase_count,
+                                                 timer_freq_usec_conversion_inverse);
+        smp_rmb();
+    } while ((seq & 1) || seq != timebase_seq);
 
     return time;
 }
@@ -107,25 +127,40 @@ lk_bigtime_t current_time_hires(void)
 lk_time_t current_time(void)
 {
     lk_time_t time;
+    uint32_t seq;
 
-    time = u32_mul_u64_fp32_64(get_global_val(), timer_freq_msec_conversion_inverse);
+    do {
+        seq = timebase_seq;
+        smp_rmb();
+        time = timebase_ms + u32_mul_u64_fp32_64(get_global_val() - timebase_count,
+                                                 timer_freq_msec_conversion_inverse);
+        smp_rmb();
+    } while ((seq & 1) || seq != timebase_seq);
 
     return time;
 }
 
-status_t platform_set_periodic_timer(platform_timer_callback callback, void *arg, lk_time_t interval)
+/* an interval in ms as ticks for the private timer */
+static uint32_t interval_to_ticks(lk_time_t interval)
 {
-    LTRACEF("callback %p, arg %p, interval %u\n", callback, arg, interval);
-
     uint64_t ticks = u64_mul_u64_fp32_64(interval, timer_freq_msec_conversion);
     if (unlikely(ticks == 0))
         ticks = 1;
     if (unlikely(ticks > 0xffffffff))
         ticks = 0xffffffff;
 
+    return ticks;
+}
+
+status_t platform_set_periodic_timer(platform_timer_callback callback, void *arg, lk_time_t interval)
+{
+    LTRACEF("callback %p, arg %p, interval %u\n", callback, arg, interval);
+
     spin_lock_saved_state_t state;
     spin_lock_irqsave(&lock, state);
 
+    uint32_t ticks = interval_to_ticks(interval);
+
     t_callback = callback;
 
     periodic_interval = interval;
@@ -145,15 +180,11 @@ status_t platform_set_oneshot_timer (platform_timer_callback callback, void *arg
 {
     LTRACEF("callback %p, arg %p, timeout %u\n", callback, arg, interval);
 
-    uint64_t ticks = u64_mul_u64_fp32_64(interval, timer_freq_msec_conversion);
-    if (unlikely(ticks == 0))
-        ticks = 1;
-    if (unlikely(ticks > 0xffffffff))
-        ticks = 0xffffffff;
-
     spin_lock_saved_state_t state;
     spin_lock_irqsave(&lock, state);
 
+    uint32_t ticks = interval_to_ticks(interval);
+
     t_callback = callback;
     oneshot_interval = interval;
 
@@ -181,6 +212,16 @@ static enum handler_return platform_tick(void *arg)
 
     TIMREG(TIMER_ISR) = 1; // ack the irq
 
+    /* the frequency changed since this cpu's periodic tick was loaded */
+    uint cpu = arch_curr_cpu_num();
+    if (unlikely(tick_gen_cpu[cpu] != tick_gen)) {
+        spin_lock(&lock);
+        tick_gen_cpu[cpu] = tick_gen;
+        if (TIMREG(TIMER_CONTROL) & (1<<1))
+            TIMREG(TIMER_LOAD) = interval_to_ticks(periodic_interval);
+        spin_unlock(&lock);
+    }
+
     if (t_callback) {
         return t_callback(arg, current_time());
     } else {
@@ -203,6 +244,39 @@ void arm_cortex_a9_timer_init(addr_t _scu_control_base, uint32_t freq)
     fp_32_64_div_32_32(&timer_freq_msec_conversion_inverse, 1000, timer_freq);
 }
 
+void arm_cortex_a9_timer_set_freq(uint32_t freq)
+{
+    LTRACEF("freq %u\n", freq);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&lock, state);
+
+    /* carry the time up to now over at the old rate */
+    uint64_t count = get_global_val();
+    lk_bigtime_t us = timebase_us + u64_mul_u64_fp32_64(count - timebase_count, timer_freq_usec_conversion_inverse);
+    lk_time_t ms = timebase_ms + u32_mul_u64_fp32_64(count - timebase_count, timer_freq_msec_conversion_inverse);
+
+    timebase_seq++;
+    smp_wmb();
+
+    timebase_count = count;
+    timebase_us = us;
+    timebase_ms = ms;
+
+    timer_freq = freq;
+    fp_32_64_div_32_32(&timer_freq_msec_conversion, timer_freq, 1000);
+    fp_32_64_div_32_32(&timer_freq_usec_conversion_inverse, 1000000, timer_freq);
+    fp_32_64_div_32_32(&timer_freq_msec_conversion_inverse, 1000, timer_freq);
+
+    smp_wmb();
+    timebase_seq++;
+
+    /* the tick on every cpu is counting at the new rate too */
+    tick_gen++;
+
+    spin_unlock_irqrestore(&lock, state);
+}
+
 static void arm_cortex_a9_timer_init_percpu(uint level)
 {
     /* disable timer */
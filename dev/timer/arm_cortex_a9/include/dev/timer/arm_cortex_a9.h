@@ -25,3 +25,6 @@
 #include <sys/types.h>
 
 void arm_cortex_a9_timer_init(addr_t scu_control_base, uint32_t freq);
+
+/* the timers' input clock has just changed to freq, keep time going at the new rate */
+void arm_cortex_a9_timer_set_freq(uint32_t freq);
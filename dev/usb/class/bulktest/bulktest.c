@@ -32,9 +32,15 @@
 #include <dev/usbc.h>
 #include <dev/usb.h>
 #include <lk/init.h>
+#include <platform.h>
+#include <kernel/spinlock.h>
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+#endif
 
-/* a simple demo usb class device that reflects data written to
- * one endpoint to the other.
+/* a simple demo usb class device that sinks everything written to the
+ * out endpoint and sources a pattern on the in endpoint as fast as the
+ * host will take it. the bulktest command reports the rates achieved.
  */
 
 #define LOCAL_TRACE 0
@@ -45,42 +51,67 @@
 static status_t ep_cb_rx(ep_t endpoint, usbc_transfer_t *t);
 static status_t ep_cb_tx(ep_t endpoint, usbc_transfer_t *t);
 
-#define TRANSFER_SIZE 512
+#ifndef BULKTEST_TRANSFER_SIZE
+#define BULKTEST_TRANSFER_SIZE 2048
+#endif
 
-static void queue_rx(void)
-{
-    static usbc_transfer_t transfer;
-    static uint8_t buf[TRANSFER_SIZE];
+/* transfers kept queued each way, so the endpoints stay busy while a completion is handled */
+#ifndef BULKTEST_QUEUE_DEPTH
+#define BULKTEST_QUEUE_DEPTH 2
+#endif
 
-    transfer.callback = &ep_cb_rx;
-    transfer.result = 0;
-    transfer.buf = &buf;
-    transfer.buflen = sizeof(buf);
-    transfer.bufpos = 0;
-    transfer.extra = 0;
+static struct {
+    ep_t epin;
+    ep_t epout;
 
-    usbc_queue_rx(1, &transfer);
-}
+    usbc_transfer_t rx[BULKTEST_QUEUE_DEPTH];
+    usbc_transfer_t tx[BULKTEST_QUEUE_DEPTH];
+    uint8_t rx_buf[BULKTEST_QUEUE_DEPTH][BULKTEST_TRANSFER_SIZE];
+    uint8_t tx_buf[BULKTEST_TRANSFER_SIZE];
 
-static void queue_tx(void)
+    /* throughput since the last reset */
+    spin_lock_t lock;
+    lk_bigtime_t start;
+    uint64_t rx_bytes;
+    uint64_t tx_bytes;
+} bt;
+
+static void stats_reset(void)
 {
-    static usbc_transfer_t transfer;
-    static uint8_t buf[TRANSFER_SIZE];
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&bt.lock, state);
+    bt.start = current_time_hires();
+    bt.rx_bytes = bt.tx_bytes = 0;
+    spin_unlock_irqrestore(&bt.lock, state);
+}
 
-    for (uint i = 0; i < sizeof(buf); i++) {
-        buf[i] = ~i;
-    }
+static void stats_add(uint64_t *counter, size_t len)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&bt.lock, state);
+    *counter += len;
+    spin_unlock_irqrestore(&bt.lock, state);
+}
 
-    transfer.callback = &ep_cb_tx;
-    transfer.result = 0;
-    transfer.buf = &buf;
-    transfer.buflen = sizeof(buf);
-    transfer.bufpos = 0;
-    transfer.extra = 0;
+static void queue_rx(usbc_transfer_t *transfer)
+{
+    transfer->callback = &ep_cb_rx;
+    transfer->result = 0;
+    transfer->buflen = BULKTEST_TRANSFER_SIZE;
+    transfer->bufpos = 0;
 
-    usbc_queue_tx(1, &transfer);
+    usbc_queue_rx(bt.epout, transfer);
 }
 
+static void queue_tx(usbc_transfer_t *transfer)
+{
+    transfer->callback = &ep_cb_tx;
+    transfer->result = 0;
+    transfer->buflen = BULKTEST_TRANSFER_SIZE;
+    transfer->bufpos = 0;
+
+    usbc_queue_tx(bt.epin, transfer);
+}
 
 static status_t ep_cb_rx(ep_t endpoint, usbc_transfer_t *t)
 {
@@ -93,8 +124,10 @@ static status_t ep_cb_rx(ep_t endpoint, usbc_transfer_t *t)
     }
 #endif
 
-    if (t->result >= 0)
-        queue_rx();
+    if (t->result >= 0) {
+        stats_add(&bt.rx_bytes, t->bufpos);
+        queue_rx(t);
+    }
 
     return NO_ERROR;
 }
@@ -106,8 +139,10 @@ static status_t ep_cb_tx(ep_t endpoint, usbc_transfer_t *t)
     usbc_dump_transfer(t);
 #endif
 
-    if (t->result >= 0)
-        queue_tx();
+    if (t->result >= 0) {
+        stats_add(&bt.tx_bytes, t->bufpos);
+        queue_tx(t);
+    }
 
     return NO_ERROR;
 }
@@ -117,11 +152,14 @@ static status_t bulktest_usb_cb(void *cookie, usb_callback_op_t op, const union
     LTRACEF("cookie %p, op %u, args %p\n", cookie, op, args);
 
     if (op == USB_CB_ONLINE) {
-        usbc_setup_endpoint(1, USB_IN, 0x40, USB_BULK);
-        usbc_setup_endpoint(1, USB_OUT, 0x40, USB_BULK);
-
-        queue_rx();
-        queue_tx();
+        usbc_setup_endpoint(bt.epin, USB_IN, 0x40, USB_BULK);
+        usbc_setup_endpoint(bt.epout, USB_OUT, 0x40, USB_BULK);
+
+        stats_reset();
+        for (uint i = 0; i < BULKTEST_QUEUE_DEPTH; i++) {
+            queue_rx(&bt.rx[i]);
+            queue_tx(&bt.tx[i]);
+        }
     }
     return NO_ERROR;
 }
@@ -130,6 +168,17 @@ status_t usb_class_bulktest_init(uint interface_num, ep_t epin, ep_t epout)
 {
     LTRACEF("epin %u, epout %u\n", epin, epout);
 
+    bt.epin = epin;
+    bt.epout = epout;
+    bt.lock = SPIN_LOCK_INITIAL_VALUE;
+    for (uint i = 0; i < BULKTEST_QUEUE_DEPTH; i++) {
+        bt.rx[i].buf = bt.rx_buf[i];
+        bt.tx[i].buf = bt.tx_buf;
+    }
+    for (uint i = 0; i < sizeof(bt.tx_buf); i++) {
+        bt.tx_buf[i] = ~i;
+    }
+
     /* build a descriptor for it */
     uint8_t if_descriptor[] = {
         0x09,           /* length */
@@ -167,3 +216,35 @@ status_t usb_class_bulktest_init(uint interface_num, ep_t epin, ep_t epout)
     return NO_ERROR;
 }
 
+#if WITH_LIB_CONSOLE
+
+static int cmd_bulktest(int argc, const cmd_args *argv)
+{
+    if (argc > 1 && !strcmp(argv[1].str, "reset")) {
+        stats_reset();
+        return NO_ERROR;
+    }
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&bt.lock, state);
+    lk_bigtime_t elapsed = current_time_hires() - bt.start;
+    uint64_t rx = bt.rx_bytes;
+    uint64_t tx = bt.tx_bytes;
+    spin_unlock_irqrestore(&bt.lock, state);
+
+    if (elapsed == 0) {
+        printf("no data yet\n");
+        return NO_ERROR;
+    }
+
+    printf("%llu usecs: out %llu bytes, %llu KB/s, in %llu bytes, %llu KB/s\n", elapsed,
+           rx, rx * 1000000 / 1024 / elapsed, tx, tx * 1000000 / 1024 / elapsed);
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("bulktest", "usb bulk throughput since coming online, or \"reset\" to start over", &cmd_bulktest)
+STATIC_COMMAND_END(bulktest);
+
+#endif
@@ -30,6 +30,7 @@
 #include <dev/usbc.h>
 #include <dev/usbc.h>
 #include <err.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #include <trace.h>
 
@@ -197,8 +198,6 @@ static status_t usb_register_cb(
 
 void cdcserial_create_channel(cdcserial_channel_t *chan, int data_ep_addr, int ctrl_ep_addr)
 {
-    event_init(&chan->txevt, 0, EVENT_FLAG_AUTOUNSIGNAL);
-    event_init(&chan->rxevt, 0, EVENT_FLAG_AUTOUNSIGNAL);
     chan->usb_online = false;
     chan->registered_bulk_eps_in = 0;
     chan->registered_bulk_eps_out = 0;
@@ -235,17 +234,17 @@ void cdcserial_create_channel(cdcserial_channel_t *chan, int data_ep_addr, int c
     usb_register_callback(&usb_register_cb, chan);
 }
 
-static status_t usb_xmit_cplt_cb(ep_t endpoint, usbc_transfer_t *t)
-{
-    cdcserial_channel_t *chan = t->extra;
-    event_signal(&chan->txevt, false);
-    return 0;
-}
+// A transfer for the blocking calls. Each has its own event, since with
+// transfers queued up several callers can be waiting on the endpoint at once.
+struct cdcserial_sync_transfer {
+    usbc_transfer_t transfer;
+    event_t done;
+};
 
-static status_t usb_recv_cplt_cb(ep_t endpoint, usbc_transfer_t *t)
+static status_t usb_sync_cplt_cb(ep_t endpoint, usbc_transfer_t *t)
 {
-    cdcserial_channel_t *chan = t->extra;
-    event_signal(&chan->rxevt, false);
+    struct cdcserial_sync_transfer *st = containerof(t, struct cdcserial_sync_transfer, transfer);
+    event_signal(&st->done, false);
     return 0;
 }
 
@@ -274,15 +273,17 @@ status_t cdcserial_write_async(cdcserial_channel_t *chan, usbc_transfer_t *trans
 
 status_t cdcserial_write(cdcserial_channel_t *chan, size_t len, uint8_t *buf)
 {
-    usbc_transfer_t transfer;
-    status_t ret = cdcserial_write_async(chan, &transfer, &usb_xmit_cplt_cb, len, buf);
-    if (ret != NO_ERROR) {
-        return ret;
-    }
+    struct cdcserial_sync_transfer st;
+    event_init(&st.done, false, 0);
 
-    event_wait(&chan->txevt);
+    status_t ret = cdcserial_write_async(chan, &st.transfer, &usb_sync_cplt_cb, len, buf);
+    if (ret == NO_ERROR) {
+        event_wait(&st.done);
+        ret = MIN(st.transfer.result, NO_ERROR);
+    }
 
-    return NO_ERROR;
+    event_destroy(&st.done);
+    return ret;
 }
 
 // Read at most len bytes from the CDC Serial virtual Com Port. Returns the
@@ -311,13 +312,15 @@ ssize_t cdcserial_read_async(cdcserial_channel_t *chan, usbc_transfer_t *transfe
 
 ssize_t cdcserial_read(cdcserial_channel_t *chan, size_t len, uint8_t *buf)
 {
-    usbc_transfer_t transfer;
-    status_t ret = cdcserial_write_async(chan, &transfer, &usb_recv_cplt_cb, len, buf);
-    if (ret != NO_ERROR) {
-        return ret;
-    }
+    struct cdcserial_sync_transfer st;
+    event_init(&st.done, false, 0);
 
-    event_wait(&chan->rxevt);
+    ssize_t ret = cdcserial_read_async(chan, &st.transfer, &usb_sync_cplt_cb, len, buf);
+    if (ret == NO_ERROR) {
+        event_wait(&st.done);
+        ret = (st.transfer.result < 0) ? st.transfer.result : (ssize_t)st.transfer.bufpos;
+    }
 
-    return transfer.bufpos;
+    event_destroy(&st.done);
+    return ret;
 }
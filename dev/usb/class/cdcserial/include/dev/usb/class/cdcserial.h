@@ -33,9 +33,6 @@ typedef struct _cdcserial_channel_t {
     int data_ep_addr;
     int ctrl_ep_addr;
 
-    event_t txevt;
-    event_t rxevt;
-
     volatile bool usb_online;
     void (*online_cb)(cdcserial_channel_t *chan, bool online);
 
@@ -49,7 +46,9 @@ typedef struct _cdcserial_channel_t {
 
 void cdcserial_create_channel(cdcserial_channel_t *chan, int data_ep_addr, int ctrl_ep_addr);
 
-// Write len bytes to the CDC Serial Virtual Com Port.
+// Write len bytes to the CDC Serial Virtual Com Port. The async versions may
+// be called again before the previous transfer completes, transfers are
+// queued on the endpoint and complete in order.
 status_t cdcserial_write(cdcserial_channel_t *chan, size_t len, uint8_t *buf);
 status_t cdcserial_write_async(cdcserial_channel_t *chan, usbc_transfer_t *transfer, ep_callback cb,
                                size_t len, uint8_t *buf);
@@ -27,10 +27,11 @@
 #include <trace.h>
 #include <compiler.h>
 #include <list.h>
+#include <string.h>
 #include <err.h>
 #include <kernel/thread.h>
 #include <kernel/event.h>
-#include <kernel/mutex.h>
+#include <kernel/spinlock.h>
 #include <kernel/vm.h>
 #include <lib/bio.h>
 
@@ -46,6 +47,21 @@ struct virtio_blk_config {
         uint8_t sectors;
     } geometry;
     uint32_t blk_size;
+    struct virtio_blk_topology {
+        uint8_t physical_block_exp;
+        uint8_t alignment_offset;
+        uint16_t min_io_size;
+        uint32_t opt_io_size;
+    } topology;
+    uint8_t writeback;
+    uint8_t unused0[3];
+    uint32_t max_discard_sectors;
+    uint32_t max_discard_seg;
+    uint32_t discard_sector_alignment;
+    uint32_t max_write_zeroes_sectors;
+    uint32_t max_write_zeroes_seg;
+    uint8_t write_zeroes_may_unmap;
+    uint8_t unused1[3];
 } __PACKED;
 
 struct virtio_blk_req {
@@ -54,6 +70,15 @@ struct virtio_blk_req {
     uint64_t sector;
 } __PACKED;
 
+/* the data of a discard or write zeroes request */
+struct virtio_blk_discard_write_zeroes {
+    uint64_t sector;
+    uint32_t num_sectors;
+    uint32_t flags;
+} __PACKED;
+
+#define VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP (1<<0)
+
 #define VIRTIO_BLK_F_BARRIER  (1<<0)
 #define VIRTIO_BLK_F_SIZE_MAX (1<<1)
 #define VIRTIO_BLK_F_SEG_MAX  (1<<2)
@@ -64,35 +89,67 @@ struct virtio_blk_req {
 #define VIRTIO_BLK_F_FLUSH    (1<<9)
 #define VIRTIO_BLK_F_TOPOLOGY (1<<10)
 #define VIRTIO_BLK_F_CONFIG_WCE (1<<11)
+#define VIRTIO_BLK_F_DISCARD  (1<<13)
+#define VIRTIO_BLK_F_WRITE_ZEROES (1<<14)
 
 #define VIRTIO_BLK_T_IN         0
 #define VIRTIO_BLK_T_OUT        1
 #define VIRTIO_BLK_T_FLUSH      4
+#define VIRTIO_BLK_T_DISCARD    11
+#define VIRTIO_BLK_T_WRITE_ZEROES 13
 
 #define VIRTIO_BLK_S_OK         0
 #define VIRTIO_BLK_S_IOERR      1
 #define VIRTIO_BLK_S_UNSUPP     2
 
+/* ring size, and the most descriptors a request may take from its indirect table */
+#define VIRTIO_BLOCK_RING_SIZE      256
+#define VIRTIO_BLOCK_INDIRECT_MAX   16
+
 static enum handler_return virtio_block_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
 static ssize_t virtio_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count);
 static ssize_t virtio_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t block, uint count);
+static status_t virtio_bdev_submit(struct bdev *bdev, bio_request_t *req);
+static ssize_t virtio_bdev_erase(struct bdev *bdev, off_t offset, size_t len);
+static ssize_t virtio_bdev_write_zeroes(struct bdev *bdev, off_t offset, size_t len);
+static ssize_t virtio_bdev_discard(struct bdev *bdev, off_t offset, size_t len);
+static status_t virtio_bdev_flush(struct bdev *bdev);
+
+/* completion of a request, called from the irq handler */
+typedef void (*virtio_block_done_t)(void *arg, status_t err);
+
+/*
+ * a request in flight, one per ring slot and indexed by its head descriptor.
+ * aligned so the parts the device reads and writes never cross a page.
+ */
+struct virtio_block_txn {
+    struct virtio_blk_req req;
+    uint8_t status;
+
+    virtio_block_done_t done;
+    void *done_arg;
+} __ALIGNED(64);
 
 struct virtio_block_dev {
     struct virtio_device *dev;
 
-    mutex_t lock;
-    event_t io_event;
+    /* protects the ring */
+    spin_lock_t lock;
+
+    /* signaled when descriptors are handed back, for submitters waiting on a full ring */
+    event_t desc_event;
 
     /* bio block device */
     bdev_t bdev;
 
-    /* one blk_req structure for io, not crossing a page boundary */
-    struct virtio_blk_req *blk_req;
-    paddr_t blk_req_phys;
+    /* negotiated features, and the limits that go with them */
+    uint32_t features;
+    uint32_t max_discard_sectors;
+    uint32_t max_write_zeroes_sectors;
+    bool write_zeroes_may_unmap;
 
-    /* one uint8_t response word */
-    uint8_t blk_response;
-    paddr_t blk_response_phys;
+    /* request owning each in flight chain, indexed by its head descriptor */
+    struct virtio_block_txn *txns;
 };
 
 status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features)
@@ -100,30 +157,23 @@ status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features)
     LTRACEF("dev %p, host_features 0x%x\n", dev, host_features);
 
     /* allocate a new block device */
-    struct virtio_block_dev *bdev = malloc(sizeof(struct virtio_block_dev));
+    struct virtio_block_dev *bdev = calloc(1, sizeof(struct virtio_block_dev));
     if (!bdev)
         return ERR_NO_MEMORY;
 
-    mutex_init(&bdev->lock);
-    event_init(&bdev->io_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    bdev->txns = memalign(sizeof(struct virtio_block_txn), sizeof(struct virtio_block_txn) * VIRTIO_BLOCK_RING_SIZE);
+    if (!bdev->txns) {
+        free(bdev);
+        return ERR_NO_MEMORY;
+    }
+    memset(bdev->txns, 0, sizeof(struct virtio_block_txn) * VIRTIO_BLOCK_RING_SIZE);
+
+    bdev->lock = SPIN_LOCK_INITIAL_VALUE;
+    event_init(&bdev->desc_event, false, EVENT_FLAG_AUTOUNSIGNAL);
 
     bdev->dev = dev;
     dev->priv = bdev;
 
-    bdev->blk_req = memalign(sizeof(struct virtio_blk_req), sizeof(struct virtio_blk_req));
-#if WITH_KERNEL_VM
-    bdev->blk_req_phys = vaddr_to_paddr(bdev->blk_req);
-#else
-    bdev->blk_freq_phys = (uint64_t)(uintptr_t)bdev->blk_req;
-#endif
-    LTRACEF("blk_req structure at %p (0x%lx phys)\n", bdev->blk_req, bdev->blk_req_phys);
-
-#if WITH_KERNEL_VM
-    bdev->blk_response_phys = vaddr_to_paddr(&bdev->blk_response);
-#else
-    bdev->blk_response_phys = (uint64_t)(uintptr_t)&bdev->blk_response;
-#endif
-
     /* make sure the device is reset */
     virtio_reset_device(dev);
 
@@ -137,10 +187,27 @@ status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features)
     /* ack and set the driver status bit */
     virtio_status_acknowledge_driver(dev);
 
-    // XXX check features bits and ack/nak them
+    /* take the commands that save writing whole ranges, and flush if the device caches writes */
+    bdev->features = host_features & (VIRTIO_BLK_F_FLUSH | VIRTIO_BLK_F_DISCARD | VIRTIO_BLK_F_WRITE_ZEROES);
+    virtio_set_guest_features(dev, bdev->features);
+
+    if (bdev->features & VIRTIO_BLK_F_DISCARD)
+        bdev->max_discard_sectors = config->max_discard_sectors ? config->max_discard_sectors : UINT32_MAX;
+    if (bdev->features & VIRTIO_BLK_F_WRITE_ZEROES) {
+        bdev->max_write_zeroes_sectors = config->max_write_zeroes_sectors ? config->max_write_zeroes_sectors : UINT32_MAX;
+        bdev->write_zeroes_may_unmap = config->write_zeroes_may_unmap;
+    }
+    LTRACEF("features 0x%x, max discard %u, max write zeroes %u\n", bdev->features,
+            bdev->max_discard_sectors, bdev->max_write_zeroes_sectors);
 
     /* allocate a virtio ring */
-    virtio_alloc_ring(dev, 0, 256);
+    virtio_alloc_ring(dev, 0, VIRTIO_BLOCK_RING_SIZE);
+
+    /* with indirect tables a request only takes one slot on the ring */
+    if (dev->indirect_desc) {
+        if (virtio_ring_alloc_indirect(dev, 0, VIRTIO_BLOCK_INDIRECT_MAX) < 0)
+            TRACEF("failed to allocate indirect tables, using direct chains\n");
+    }
 
     /* set our irq handler */
     dev->irq_driver_callback = &virtio_block_irq_driver_callback;
@@ -159,6 +226,22 @@ status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features)
     /* override our block device hooks */
     bdev->bdev.read_block = &virtio_bdev_read_block;
     bdev->bdev.write_block = &virtio_bdev_write_block;
+    bdev->bdev.submit = &virtio_bdev_submit;
+    if (bdev->features & VIRTIO_BLK_F_FLUSH)
+        bdev->bdev.flush = &virtio_bdev_flush;
+    if (bdev->features & VIRTIO_BLK_F_DISCARD)
+        bdev->bdev.discard = &virtio_bdev_discard;
+    if (bdev->features & VIRTIO_BLK_F_WRITE_ZEROES) {
+        /* erased blocks read back as zero, so erase is a write zeroes that may unmap */
+        bdev->bdev.write_zeroes = &virtio_bdev_write_zeroes;
+        bdev->bdev.erase = &virtio_bdev_erase;
+    }
+
+    /* a request takes one slot with indirect tables, at least three without */
+    bdev->bdev.max_queue_depth = dev->ring[0].indirect ? VIRTIO_BLOCK_RING_SIZE : VIRTIO_BLOCK_RING_SIZE / 3;
+
+    /* merge adjacent requests, the host does its own scheduling */
+    bio_queue_attach(&bdev->bdev, 0, 0);
 
     bio_register_device(&bdev->bdev);
 
@@ -173,6 +256,17 @@ static enum handler_return virtio_block_irq_driver_callback(struct virtio_device
 
     LTRACEF("dev %p, ring %u, e %p, id %u, len %u\n", dev, ring, e, e->id, e->len);
 
+    spin_lock(&bdev->lock);
+
+    /* the slot is reusable as soon as its descriptors are, so take what we need now */
+    struct virtio_block_txn *txn = &bdev->txns[e->id];
+    virtio_block_done_t done = txn->done;
+    void *done_arg = txn->done_arg;
+    status_t err = (txn->status == VIRTIO_BLK_S_OK) ? NO_ERROR : ERR_IO;
+    txn->done = NULL;
+
+    LTRACEF("status 0x%hhx\n", txn->status);
+
     /* parse our descriptor chain, add back to the free queue */
     uint16_t i = e->id;
     for (;;) {
@@ -195,102 +289,140 @@ static enum handler_return virtio_block_irq_driver_callback(struct virtio_device
         i = next;
     }
 
-    /* signal our event */
-    event_signal(&bdev->io_event, false);
+    spin_unlock(&bdev->lock);
+
+    /* complete the request, and wake anyone waiting for ring space */
+    DEBUG_ASSERT(done);
+    done(done_arg, err);
+    event_signal(&bdev->desc_event, false);
 
     return INT_RESCHEDULE;
 }
 
-ssize_t virtio_block_read_write(struct virtio_device *dev, void *buf, off_t offset, size_t len, bool write)
+/* carve the next physically contiguous run off the front of a buffer */
+static size_t virtio_block_next_seg(vaddr_t *va, size_t *len, paddr_t *pa)
+{
+#if WITH_KERNEL_VM
+    *pa = vaddr_to_paddr((void *)*va);
+
+    /* the rest of the first page, then as many whole pages as follow it in physical memory */
+    size_t seg = MIN(PAGE_ALIGN(*va + 1) - *va, *len);
+    while (seg < *len && vaddr_to_paddr((void *)(*va + seg)) == *pa + seg)
+        seg += MIN(*len - seg, PAGE_SIZE);
+#else
+    *pa = (paddr_t)*va;
+    size_t seg = *len;
+#endif
+
+    *va += seg;
+    *len -= seg;
+
+    return seg;
+}
+
+static inline struct vring_desc *virtio_block_next_desc(struct virtio_device *dev, struct vring_desc *table, const struct vring_desc *desc)
+{
+    return table ? &table[desc->next] : virtio_desc_index_to_desc(dev, 0, desc->next);
+}
+
+/*
+ * queue a request of type with the iovecs as its data, calling done from the irq
+ * handler when it finishes. waits for room on the ring if need be, so may block.
+ */
+static status_t virtio_block_queue(struct virtio_device *dev, uint32_t type, const bio_iovec_t *iov, uint iov_count,
+                                   off_t offset, virtio_block_done_t done, void *done_arg)
 {
     struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
 
-    uint16_t i;
-    struct vring_desc *desc;
+    LTRACEF("dev %p, type %u, iov_count %u, offset 0x%llx\n", dev, type, iov_count, offset);
+
+    /* only reads have the device write the data */
+    bool write = (type != VIRTIO_BLK_T_IN);
+
+    /* count the scatter gather segments the buffers need */
+    uint seg_count = 0;
     paddr_t pa;
-    vaddr_t va = (vaddr_t)buf;
+    for (uint n = 0; n < iov_count; n++) {
+        vaddr_t va = (vaddr_t)iov[n].base;
+        size_t remaining = iov[n].len;
+        while (remaining > 0) {
+            virtio_block_next_seg(&va, &remaining, &pa);
+            seg_count++;
+        }
+    }
 
-    LTRACEF("dev %p, buf %p, offset 0x%llx, len %zu\n", dev, buf, offset, len);
+    /* plus the header and the status byte */
+    uint desc_count = seg_count + 2;
+    bool indirect = dev->ring[0].indirect && desc_count <= VIRTIO_BLOCK_INDIRECT_MAX;
+    if (!indirect && desc_count > VIRTIO_BLOCK_RING_SIZE)
+        return ERR_TOO_BIG;
 
-    mutex_acquire(&bdev->lock);
+    /* put together a transfer, waiting for room on the ring if need be */
+    uint16_t i;
+    struct vring_desc *table = NULL;
+    struct vring_desc *desc;
+    spin_lock_saved_state_t state;
+    for (;;) {
+        spin_lock_irqsave(&bdev->lock, state);
 
-    /* set up the request */
-    bdev->blk_req->type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
-    bdev->blk_req->ioprio = 0;
-    bdev->blk_req->sector = offset / 512;
-    LTRACEF("blk_req type %u ioprio %u sector %llu\n",
-            bdev->blk_req->type, bdev->blk_req->ioprio, bdev->blk_req->sector);
+        if (indirect) {
+            table = virtio_alloc_indirect_chain(dev, 0, desc_count, &i);
+            desc = table;
+        } else {
+            desc = virtio_alloc_desc_chain(dev, 0, desc_count, &i);
+        }
+        if (desc)
+            break;
 
-    /* put together a transfer */
-    desc = virtio_alloc_desc_chain(dev, 0, 3, &i);
-    LTRACEF("after alloc chain desc %p, i %u\n", desc, i);
+        spin_unlock_irqrestore(&bdev->lock, state);
+        event_wait(&bdev->desc_event);
+    }
+    LTRACEF("after alloc chain desc %p, i %u, indirect %d\n", desc, i, indirect);
+
+    /* set up the request in the slot belonging to the head descriptor */
+    struct virtio_block_txn *txn = &bdev->txns[i];
+    DEBUG_ASSERT(txn->done == NULL);
+    txn->done = done;
+    txn->done_arg = done_arg;
+    txn->status = 0xff;
+    txn->req.type = type;
+    txn->req.ioprio = 0;
+    txn->req.sector = offset / 512;
+    LTRACEF("blk_req type %u ioprio %u sector %llu\n",
+            txn->req.type, txn->req.ioprio, txn->req.sector);
 
     // XXX not cache safe.
     // At the moment only tested on arm qemu, which doesn't emulate cache.
 
     /* set up the descriptor pointing to the head */
-    desc->addr = bdev->blk_req_phys;
-    desc->len = sizeof(struct virtio_blk_req);
-    desc->flags |= VRING_DESC_F_NEXT;
-
-    /* set up the descriptor pointing to the buffer */
-    desc = virtio_desc_index_to_desc(dev, 0, desc->next);
 #if WITH_KERNEL_VM
-    /* translate the first buffer */
-    pa = vaddr_to_paddr((void *)va);
-    desc->addr = (uint64_t)pa;
-    /* desc->len is filled in below */
+    desc->addr = vaddr_to_paddr(&txn->req);
 #else
-    desc->addr = (uint64_t)(uintptr_t)buf;
-    desc->len = len;
+    desc->addr = (uint64_t)(uintptr_t)&txn->req;
 #endif
-    desc->flags |= write ? 0 : VRING_DESC_F_WRITE; /* mark buffer as write-only if its a block read */
-    desc->flags |= VRING_DESC_F_NEXT;
-
-#if WITH_KERNEL_VM
-    /* see if we need to add more descriptors due to scatter gather */
-    paddr_t next_pa = PAGE_ALIGN(pa + 1);
-    desc->len = MIN(next_pa - pa, len);
-    LTRACEF("first descriptor va 0x%lx desc->addr 0x%llx desc->len %u\n", va, desc->addr, desc->len);
-    len -= desc->len;
-    while (len > 0) {
-        /* amount of source buffer handled by this iteration of the loop */
-        size_t len_tohandle = MIN(len, PAGE_SIZE);
-
-        /* translate the next page in the buffer */
-        va = PAGE_ALIGN(va + 1);
-        pa = vaddr_to_paddr((void *)va);
-        LTRACEF("va now 0x%lx, pa 0x%lx, next_pa 0x%lx, remaining len %zu\n", va, pa, next_pa, len);
-
-        /* is the new translated physical address contiguous to the last one? */
-        if (next_pa == pa) {
-            LTRACEF("extending last one by %zu bytes\n", len_tohandle);
-            desc->len += len_tohandle;
-        } else {
-            uint16_t next_i = virtio_alloc_desc(dev, 0);
-            struct vring_desc *next_desc = virtio_desc_index_to_desc(dev, 0, next_i);
-            DEBUG_ASSERT(next_desc);
-
-            LTRACEF("doesn't extend, need new desc, allocated desc %i (%p)\n", next_i, next_desc);
-
-            /* fill this descriptor in and put it after the last one but before the response descriptor */
-            next_desc->addr = (uint64_t)pa;
-            next_desc->len = len_tohandle;
-            next_desc->flags = write ? 0 : VRING_DESC_F_WRITE; /* mark buffer as write-only if its a block read */
-            next_desc->flags |= VRING_DESC_F_NEXT;
-            next_desc->next = desc->next;
-            desc->next = next_i;
+    desc->len = sizeof(struct virtio_blk_req);
 
-            desc = next_desc;
+    /* a descriptor per contiguous run of each buffer */
+    for (uint n = 0; n < iov_count; n++) {
+        vaddr_t va = (vaddr_t)iov[n].base;
+        size_t remaining = iov[n].len;
+        while (remaining > 0) {
+            desc = virtio_block_next_desc(dev, table, desc);
+
+            desc->len = virtio_block_next_seg(&va, &remaining, &pa);
+            desc->addr = (uint64_t)pa;
+            desc->flags |= write ? 0 : VRING_DESC_F_WRITE; /* mark buffer as write-only if its a block read */
+            LTRACEF("data descriptor addr 0x%llx len %u\n", desc->addr, desc->len);
         }
-        len -= len_tohandle;
-        next_pa += PAGE_SIZE;
     }
-#endif
 
     /* set up the descriptor pointing to the response */
-    desc = virtio_desc_index_to_desc(dev, 0, desc->next);
-    desc->addr = bdev->blk_response_phys;
+    desc = virtio_block_next_desc(dev, table, desc);
+#if WITH_KERNEL_VM
+    desc->addr = vaddr_to_paddr(&txn->status);
+#else
+    desc->addr = (uint64_t)(uintptr_t)&txn->status;
+#endif
     desc->len = 1;
     desc->flags = VRING_DESC_F_WRITE;
 
@@ -300,14 +432,172 @@ ssize_t virtio_block_read_write(struct virtio_device *dev, void *buf, off_t offs
     /* kick it off */
     virtio_kick(dev, 0);
 
-    /* wait for the transfer to complete */
-    event_wait(&bdev->io_event);
+    spin_unlock_irqrestore(&bdev->lock, state);
+
+    return NO_ERROR;
+}
+
+/* a synchronous transfer, possibly split into several requests in flight at once */
+struct virtio_block_wait {
+    event_t event;
+    volatile int pending;
+    status_t err;
+};
 
-    LTRACEF("status 0x%hhx\n", bdev->blk_response);
+static void virtio_block_wait_done(void *arg, status_t err)
+{
+    struct virtio_block_wait *wait = (struct virtio_block_wait *)arg;
 
-    mutex_release(&bdev->lock);
+    if (err < 0)
+        wait->err = err;
+    if (atomic_add(&wait->pending, -1) == 1)
+        event_signal(&wait->event, false);
+}
 
+/* bytes of buffer at va that can go in one request without overflowing its descriptor table */
+static size_t virtio_block_piece_len(struct virtio_device *dev, vaddr_t va, size_t len)
+{
+#if WITH_KERNEL_VM
+    /* a page per data descriptor at worst, leaving room for the header and status */
+    uint segs = dev->ring[0].indirect ? VIRTIO_BLOCK_INDIRECT_MAX - 2 : VIRTIO_BLOCK_RING_SIZE / 4;
+    vaddr_t end = ROUNDDOWN(va, PAGE_SIZE) + segs * PAGE_SIZE;
+
+    return MIN(len, end - va);
+#else
     return len;
+#endif
+}
+
+ssize_t virtio_block_read_write(struct virtio_device *dev, void *buf, off_t offset, size_t len, bool write)
+{
+    LTRACEF("dev %p, buf %p, offset 0x%llx, len %zu\n", dev, buf, offset, len);
+
+    struct virtio_block_wait wait;
+    event_init(&wait.event, false, 0);
+    wait.pending = 1;
+    wait.err = NO_ERROR;
+
+    /*
+     * large transfers go out as a run of requests that each fit an indirect
+     * table, all queued before waiting so the device works on them together.
+     * pieces have to start on a sector, so a misaligned buffer goes as one.
+     */
+    vaddr_t va = (vaddr_t)buf;
+    size_t remaining = len;
+    while (remaining > 0) {
+        size_t piece = (va & 511) ? remaining : virtio_block_piece_len(dev, va, remaining);
+        bio_iovec_t iov = { .base = (void *)va, .len = piece };
+
+        atomic_add(&wait.pending, 1);
+        status_t err = virtio_block_queue(dev, write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN, &iov, 1, offset,
+                                          virtio_block_wait_done, &wait);
+        if (err < 0) {
+            wait.err = err;
+            atomic_add(&wait.pending, -1);
+            break;
+        }
+
+        va += piece;
+        offset += piece;
+        remaining -= piece;
+    }
+
+    /* drop our own count and wait for the rest to complete */
+    if (atomic_add(&wait.pending, -1) != 1)
+        event_wait(&wait.event);
+
+    event_destroy(&wait.event);
+
+    return wait.err;
+}
+
+/* issue a single request and wait for it */
+static status_t virtio_block_command(struct virtio_device *dev, uint32_t type, const bio_iovec_t *iov, uint iov_count,
+                                     off_t offset)
+{
+    struct virtio_block_wait wait;
+    event_init(&wait.event, false, 0);
+    wait.pending = 1;
+    wait.err = NO_ERROR;
+
+    status_t err = virtio_block_queue(dev, type, iov, iov_count, offset, virtio_block_wait_done, &wait);
+    if (err == NO_ERROR) {
+        event_wait(&wait.event);
+        err = wait.err;
+    }
+
+    event_destroy(&wait.event);
+
+    return err;
+}
+
+/* discard or zero a range, as many requests as the device's limit takes */
+static ssize_t virtio_block_range_command(struct virtio_block_dev *dev, uint32_t type, uint32_t flags,
+                                          uint32_t max_sectors, off_t offset, size_t len)
+{
+    LTRACEF("dev %p, type %u, offset 0x%llx, len %zu\n", dev, type, offset, len);
+
+    /* sectors on the device are always 512 bytes, these only deal in whole blocks */
+    if ((offset | len) & (dev->bdev.block_size - 1))
+        return ERR_INVALID_ARGS;
+
+    /* keep each request to whole blocks */
+    max_sectors = ROUNDDOWN(max_sectors, dev->bdev.block_size / 512);
+    if (max_sectors == 0)
+        return ERR_NOT_SUPPORTED;
+
+    uint64_t sector = offset / 512;
+    uint64_t sectors = len / 512;
+    while (sectors > 0) {
+        struct virtio_blk_discard_write_zeroes seg __ALIGNED(16);
+        seg.sector = sector;
+        seg.num_sectors = MIN(sectors, max_sectors);
+        seg.flags = flags;
+
+        bio_iovec_t iov = { .base = &seg, .len = sizeof(seg) };
+        status_t err = virtio_block_command(dev->dev, type, &iov, 1, 0);
+        if (err < 0)
+            return err;
+
+        sector += seg.num_sectors;
+        sectors -= seg.num_sectors;
+    }
+
+    return len;
+}
+
+static ssize_t virtio_bdev_erase(struct bdev *bdev, off_t offset, size_t len)
+{
+    struct virtio_block_dev *dev = containerof(bdev, struct virtio_block_dev, bdev);
+
+    return virtio_block_range_command(dev, VIRTIO_BLK_T_WRITE_ZEROES,
+                                      dev->write_zeroes_may_unmap ? VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP : 0,
+                                      dev->max_write_zeroes_sectors, offset, len);
+}
+
+static ssize_t virtio_bdev_write_zeroes(struct bdev *bdev, off_t offset, size_t len)
+{
+    struct virtio_block_dev *dev = containerof(bdev, struct virtio_block_dev, bdev);
+
+    return virtio_block_range_command(dev, VIRTIO_BLK_T_WRITE_ZEROES, 0,
+                                      dev->max_write_zeroes_sectors, offset, len);
+}
+
+static ssize_t virtio_bdev_discard(struct bdev *bdev, off_t offset, size_t len)
+{
+    struct virtio_block_dev *dev = containerof(bdev, struct virtio_block_dev, bdev);
+
+    return virtio_block_range_command(dev, VIRTIO_BLK_T_DISCARD, 0,
+                                      dev->max_discard_sectors, offset, len);
+}
+
+static status_t virtio_bdev_flush(struct bdev *bdev)
+{
+    struct virtio_block_dev *dev = containerof(bdev, struct virtio_block_dev, bdev);
+
+    LTRACEF("dev %p\n", bdev);
+
+    return virtio_block_command(dev->dev, VIRTIO_BLK_T_FLUSH, NULL, 0, 0);
 }
 
 static ssize_t virtio_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count)
@@ -338,3 +628,13 @@ static ssize_t virtio_bdev_write_block(struct bdev *bdev, const void *buf, bnum_
     }
 }
 
+static status_t virtio_bdev_submit(struct bdev *bdev, bio_request_t *req)
+{
+    struct virtio_block_dev *dev = containerof(bdev, struct virtio_block_dev, bdev);
+
+    LTRACEF("dev %p, req %p, block 0x%x, count %u\n", bdev, req, req->block, req->count);
+
+    return virtio_block_queue(dev->dev, req->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN,
+                              req->iov, req->iov_count, (off_t)req->block * dev->bdev.block_size,
+                              bio_request_complete_status, req);
+}
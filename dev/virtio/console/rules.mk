@@ -0,0 +1,18 @@
+LOCAL_DIR := $(GET_LOCAL_DIR)
+
+MODULE := $(LOCAL_DIR)
+
+MODULE_SRCS += \
+	$(LOCAL_DIR)/virtio-console.c \
+
+MODULE_DEPS += \
+	dev/virtio \
+	lib/cbuf
+
+# leave the debug uart quiet once the virtio console is up
+VIRTIO_CONSOLE_QUIET_UART ?= 1
+
+MODULE_DEFINES += \
+	VIRTIO_CONSOLE_QUIET_UART=$(VIRTIO_CONSOLE_QUIET_UART)
+
+include make/module.mk
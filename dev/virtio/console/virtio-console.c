@@ -0,0 +1,288 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * virtio console, port 0 only. console output is copied into a byte ring and
+ * handed to the device a whole print at a time, one descriptor per contiguous
+ * piece, instead of trapping to the host on every character the way an emulated
+ * uart does. input goes into the console input buffer.
+ */
+#include <dev/virtio/console.h>
+
+#include <debug.h>
+#include <assert.h>
+#include <trace.h>
+#include <compiler.h>
+#include <string.h>
+#include <stdlib.h>
+#include <err.h>
+#include <platform.h>
+#include <kernel/spinlock.h>
+#include <kernel/vm.h>
+#include <lib/cbuf.h>
+#include <lib/io.h>
+
+#define LOCAL_TRACE 0
+
+#define RING_RX 0
+#define RING_TX 1
+
+#define VIRTIO_CONSOLE_RING_SIZE    128
+#define VIRTIO_CONSOLE_TX_BUF_SIZE  16384
+#define VIRTIO_CONSOLE_RX_BUFS      16
+#define VIRTIO_CONSOLE_RX_BUF_SIZE  64
+
+/* how long a print waits for the device to make room before dropping the rest */
+#define VIRTIO_CONSOLE_TX_TIMEOUT   100
+
+STATIC_ASSERT((VIRTIO_CONSOLE_TX_BUF_SIZE & (VIRTIO_CONSOLE_TX_BUF_SIZE - 1)) == 0);
+
+struct virtio_console_dev {
+    struct virtio_device *dev;
+
+    /* protects the tx ring and the output buffer */
+    spin_lock_t lock;
+
+    /*
+     * output waiting for or on its way to the device. positions run freely and
+     * are masked on use. the device finishes transmit buffers in order, so the
+     * tail moves up by each completed descriptor's length.
+     */
+    uint8_t *tx_buf;
+    paddr_t tx_buf_pa;
+    uint tx_head;
+    uint tx_tail;
+
+    uint8_t *rx_buf;
+    paddr_t rx_buf_pa;
+
+    print_callback_t print_cb;
+};
+
+static struct virtio_console_dev *the_console;
+
+static enum handler_return virtio_console_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
+static enum handler_return virtio_console_ring_ready_callback(struct virtio_device *dev, uint ring);
+static void virtio_console_print(print_callback_t *cb, const char *str, size_t len);
+
+/* memory the device reads or writes, physically contiguous */
+static void *virtio_console_alloc_buf(size_t size, paddr_t *pa)
+{
+#if WITH_KERNEL_VM
+    void *ptr;
+    if (vmm_alloc_contiguous(vmm_get_kernel_aspace(), "virtio_console", size, &ptr, 0, 0, 0) < 0)
+        return NULL;
+    *pa = vaddr_to_paddr(ptr);
+#else
+    void *ptr = memalign(PAGE_SIZE, size);
+    if (!ptr)
+        return NULL;
+    *pa = (paddr_t)ptr;
+#endif
+    return ptr;
+}
+
+static void virtio_console_queue_rx(struct virtio_console_dev *cdev, uint16_t i)
+{
+    struct vring_desc *desc = virtio_desc_index_to_desc(cdev->dev, RING_RX, i);
+
+    desc->addr = cdev->rx_buf_pa + (paddr_t)i * VIRTIO_CONSOLE_RX_BUF_SIZE;
+    desc->len = VIRTIO_CONSOLE_RX_BUF_SIZE;
+    desc->flags = VRING_DESC_F_WRITE;
+
+    virtio_submit_chain(cdev->dev, RING_RX, i);
+}
+
+status_t virtio_console_init(struct virtio_device *dev, uint32_t host_features)
+{
+    LTRACEF("dev %p, host_features 0x%x\n", dev, host_features);
+
+    /* one console is plenty */
+    if (the_console)
+        return ERR_ALREADY_EXISTS;
+
+    struct virtio_console_dev *cdev = calloc(1, sizeof(struct virtio_console_dev));
+    if (!cdev)
+        return ERR_NO_MEMORY;
+
+    cdev->tx_buf = virtio_console_alloc_buf(VIRTIO_CONSOLE_TX_BUF_SIZE, &cdev->tx_buf_pa);
+    cdev->rx_buf = virtio_console_alloc_buf(VIRTIO_CONSOLE_RX_BUFS * VIRTIO_CONSOLE_RX_BUF_SIZE, &cdev->rx_buf_pa);
+    if (!cdev->tx_buf || !cdev->rx_buf) {
+        /* too early and too small to be worth giving back */
+        free(cdev);
+        return ERR_NO_MEMORY;
+    }
+
+    cdev->lock = SPIN_LOCK_INITIAL_VALUE;
+    cdev->dev = dev;
+    dev->priv = cdev;
+
+    /* make sure the device is reset */
+    virtio_reset_device(dev);
+
+    /* ack and set the driver status bit */
+    virtio_status_acknowledge_driver(dev);
+
+    /* no multiport or console size, port 0 is all we talk to */
+    virtio_set_guest_features(dev, 0);
+
+    uint rx_len = MIN(virtio_ring_max_len(dev, RING_RX), VIRTIO_CONSOLE_RX_BUFS);
+    uint tx_len = MIN(virtio_ring_max_len(dev, RING_TX), VIRTIO_CONSOLE_RING_SIZE);
+    if (rx_len == 0 || tx_len == 0)
+        return ERR_NOT_SUPPORTED;
+
+    status_t err = virtio_alloc_ring(dev, RING_RX, rx_len);
+    if (err < 0)
+        return err;
+    err = virtio_alloc_ring(dev, RING_TX, tx_len);
+    if (err < 0)
+        return err;
+
+    /* finished output is reclaimed by the next print rather than at irq time */
+    dev->polled_rings_bitmap |= (1u << RING_TX);
+    virtio_ring_irq_disable(dev, RING_TX);
+
+    dev->irq_driver_callback = &virtio_console_irq_driver_callback;
+    dev->ring_ready_callback = &virtio_console_ring_ready_callback;
+
+    /* fill the receive ring */
+    for (uint i = 0; i < rx_len; i++) {
+        uint16_t d = virtio_alloc_desc(dev, RING_RX);
+        DEBUG_ASSERT(d != 0xffff);
+        virtio_console_queue_rx(cdev, d);
+    }
+
+    /* set DRIVER_OK */
+    virtio_status_driver_ok(dev);
+
+    virtio_kick(dev, RING_RX);
+
+    the_console = cdev;
+
+    /* take the console */
+    cdev->print_cb.print = &virtio_console_print;
+    cdev->print_cb.context = cdev;
+    register_print_callback(&cdev->print_cb);
+
+    printf("found virtio console\n");
+
+#if VIRTIO_CONSOLE_QUIET_UART
+    console_set_platform_output(false);
+#endif
+
+    return NO_ERROR;
+}
+
+bool virtio_console_found(void)
+{
+    return the_console != NULL;
+}
+
+static enum handler_return virtio_console_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e)
+{
+    struct virtio_console_dev *cdev = (struct virtio_console_dev *)dev->priv;
+
+    LTRACEF("dev %p, ring %u, id %u, len %u\n", dev, ring, e->id, e->len);
+
+    if (ring == RING_TX) {
+        /* only from virtio_ring_poll with the lock held */
+        struct vring_desc *desc = virtio_desc_index_to_desc(dev, RING_TX, e->id);
+        cdev->tx_tail += desc->len;
+        virtio_free_desc(dev, RING_TX, e->id);
+        return INT_NO_RESCHEDULE;
+    }
+
+    /* input, pass it on and give the buffer straight back */
+    uint len = MIN(e->len, VIRTIO_CONSOLE_RX_BUF_SIZE);
+#if CONSOLE_HAS_INPUT_BUFFER
+    if (len > 0)
+        cbuf_write(&console_input_cbuf, cdev->rx_buf + e->id * VIRTIO_CONSOLE_RX_BUF_SIZE, len, false);
+#endif
+
+    virtio_console_queue_rx(cdev, e->id);
+    virtio_kick(dev, RING_RX);
+
+    return (len > 0) ? INT_RESCHEDULE : INT_NO_RESCHEDULE;
+}
+
+static enum handler_return virtio_console_ring_ready_callback(struct virtio_device *dev, uint ring)
+{
+    /* the used tx buffers wait for the next print */
+    return INT_NO_RESCHEDULE;
+}
+
+static void virtio_console_print(print_callback_t *cb, const char *str, size_t len)
+{
+    struct virtio_console_dev *cdev = cb->context;
+    struct virtio_device *dev = cdev->dev;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&cdev->lock, state);
+
+    virtio_ring_poll(dev, RING_TX, UINT_MAX);
+
+    bool queued = false;
+    lk_time_t wait_start = 0;
+    while (len > 0) {
+        /* the rest of the buffer, or as far as its end */
+        uint pos = cdev->tx_head & (VIRTIO_CONSOLE_TX_BUF_SIZE - 1);
+        size_t space = VIRTIO_CONSOLE_TX_BUF_SIZE - (cdev->tx_head - cdev->tx_tail);
+        size_t n = MIN(MIN(len, space), VIRTIO_CONSOLE_TX_BUF_SIZE - pos);
+
+        uint16_t i = (n > 0) ? virtio_alloc_desc(dev, RING_TX) : 0xffff;
+        if (i == 0xffff) {
+            /* full, let the device at what is queued and wait for it to finish some */
+            if (queued) {
+                virtio_kick(dev, RING_TX);
+                queued = false;
+            }
+            if (wait_start == 0) {
+                wait_start = current_time() | 1;
+            } else if (current_time() - wait_start > VIRTIO_CONSOLE_TX_TIMEOUT) {
+                /* the host isn't reading, better to lose output than hang */
+                break;
+            }
+            virtio_ring_poll(dev, RING_TX, UINT_MAX);
+            continue;
+        }
+        wait_start = 0;
+
+        memcpy(cdev->tx_buf + pos, str, n);
+
+        struct vring_desc *desc = virtio_desc_index_to_desc(dev, RING_TX, i);
+        desc->addr = cdev->tx_buf_pa + pos;
+        desc->len = n;
+        desc->flags = 0;
+        virtio_submit_chain(dev, RING_TX, i);
+
+        cdev->tx_head += n;
+        str += n;
+        len -= n;
+        queued = true;
+    }
+
+    if (queued)
+        virtio_kick(dev, RING_TX);
+
+    spin_unlock_irqrestore(&cdev->lock, state);
+}
@@ -29,9 +29,11 @@
 #include <list.h>
 #include <err.h>
 #include <string.h>
+#include <stdlib.h>
 #include <kernel/thread.h>
 #include <kernel/event.h>
 #include <kernel/mutex.h>
+#include <kernel/spinlock.h>
 #include <kernel/vm.h>
 #include <dev/display.h>
 
@@ -39,9 +41,15 @@
 
 #define LOCAL_TRACE 0
 
+/* damaged areas queued for the flush thread before they're merged together */
+#define MAX_DIRTY_RECTS 8
+
 static enum handler_return virtio_gpu_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
 static enum handler_return virtio_gpu_config_change_callback(struct virtio_device *dev);
 static int virtio_gpu_flush_thread(void *arg);
+void virtio_gpu_gfx_flush(uint starty, uint endy);
+void virtio_gpu_gfx_flush_rect(uint x, uint y, uint width, uint height);
+void virtio_gpu_gfx_wait_idle(void);
 
 struct virtio_gpu_dev {
     struct virtio_device *dev;
@@ -64,6 +72,14 @@ struct virtio_gpu_dev {
 
     event_t flush_event;
 
+    /* areas of the framebuffer waiting to be sent to the host */
+    spin_lock_t dirty_lock;
+    uint dirty_count;
+    struct virtio_gpu_rect dirty[MAX_DIRTY_RECTS];
+
+    /* signaled while nothing is queued or being sent */
+    event_t idle_event;
+
     /* framebuffer */
     void *fb;
 };
@@ -281,11 +297,11 @@ static status_t set_scanout(struct virtio_gpu_dev *gdev, uint32_t scanout_id, ui
     return err;
 }
 
-static status_t flush_resource(struct virtio_gpu_dev *gdev, uint32_t resource_id, uint32_t width, uint32_t height)
+static status_t flush_resource(struct virtio_gpu_dev *gdev, uint32_t resource_id, const struct virtio_gpu_rect *r)
 {
     status_t err;
 
-    LTRACEF("gdev %p, resource_id %u, width %u, height %u\n", gdev, resource_id, width, height);
+    LTRACEF("gdev %p, resource_id %u, x %u, y %u, width %u, height %u\n", gdev, resource_id, r->x, r->y, r->width, r->height);
 
     /* grab a lock to keep this single message at a time */
     mutex_acquire(&gdev->lock);
@@ -295,9 +311,7 @@ static status_t flush_resource(struct virtio_gpu_dev *gdev, uint32_t resource_id
     memset(&req, 0, sizeof(req));
 
     req.hdr.type = VIRTIO_GPU_CMD_RESOURCE_FLUSH;
-    req.r.x = req.r.y = 0;
-    req.r.width = width;
-    req.r.height = height;
+    req.r = *r;
     req.resource_id = resource_id;
 
     /* send the command and get a response */
@@ -315,11 +329,11 @@ static status_t flush_resource(struct virtio_gpu_dev *gdev, uint32_t resource_id
     return err;
 }
 
-static status_t transfer_to_host_2d(struct virtio_gpu_dev *gdev, uint32_t resource_id, uint32_t width, uint32_t height)
+static status_t transfer_to_host_2d(struct virtio_gpu_dev *gdev, uint32_t resource_id, const struct virtio_gpu_rect *r)
 {
     status_t err;
 
-    LTRACEF("gdev %p, resource_id %u, width %u, height %u\n", gdev, resource_id, width, height);
+    LTRACEF("gdev %p, resource_id %u, x %u, y %u, width %u, height %u\n", gdev, resource_id, r->x, r->y, r->width, r->height);
 
     /* grab a lock to keep this single message at a time */
     mutex_acquire(&gdev->lock);
@@ -329,10 +343,9 @@ static status_t transfer_to_host_2d(struct virtio_gpu_dev *gdev, uint32_t resour
     memset(&req, 0, sizeof(req));
 
     req.hdr.type = VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D;
-    req.r.x = req.r.y = 0;
-    req.r.width = width;
-    req.r.height = height;
-    req.offset = 0;
+    req.r = *r;
+    /* offset of the rect's first pixel within the backing store */
+    req.offset = ((uint64_t)r->y * gdev->pmode.r.width + r->x) * 4;
     req.resource_id = resource_id;
 
     /* send the command and get a response */
@@ -406,7 +419,7 @@ status_t virtio_gpu_start(struct virtio_device *dev)
     thread_detach_and_resume(t);
 
     /* kick it once */
-    event_signal(&gdev->flush_event, true);
+    virtio_gpu_gfx_flush(0, gdev->pmode.r.height - 1);
 
     LTRACE_EXIT;
 
@@ -434,6 +447,9 @@ status_t virtio_gpu_init(struct virtio_device *dev, uint32_t host_features)
     mutex_init(&gdev->lock);
     event_init(&gdev->io_event, false, EVENT_FLAG_AUTOUNSIGNAL);
     event_init(&gdev->flush_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    gdev->dirty_lock = SPIN_LOCK_INITIAL_VALUE;
+    gdev->dirty_count = 0;
+    event_init(&gdev->idle_event, true, 0);
 
     gdev->dev = dev;
     dev->priv = gdev;
@@ -460,6 +476,7 @@ status_t virtio_gpu_init(struct virtio_device *dev, uint32_t host_features)
     virtio_status_acknowledge_driver(dev);
 
     // XXX check features bits and ack/nak them
+    virtio_set_guest_features(dev, 0);
 
     /* allocate a virtio ring */
     virtio_alloc_ring(dev, 0, 16);
@@ -533,27 +550,113 @@ static int virtio_gpu_flush_thread(void *arg)
     for (;;) {
         event_wait(&gdev->flush_event);
 
-        /* transfer to host 2d */
-        err = transfer_to_host_2d(gdev, gdev->display_resource_id, gdev->pmode.r.width, gdev->pmode.r.height);
-        if (err < 0) {
-            LTRACEF("failed to flush resource\n");
-            continue;
-        }
+        /* take the pending damage */
+        struct virtio_gpu_rect rects[MAX_DIRTY_RECTS];
+        uint count;
+
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&gdev->dirty_lock, state);
+        count = gdev->dirty_count;
+        memcpy(rects, gdev->dirty, count * sizeof(rects[0]));
+        gdev->dirty_count = 0;
+        spin_unlock_irqrestore(&gdev->dirty_lock, state);
+
+        for (uint i = 0; i < count; i++) {
+            /* transfer to host 2d */
+            err = transfer_to_host_2d(gdev, gdev->display_resource_id, &rects[i]);
+            if (err < 0) {
+                LTRACEF("failed to flush resource\n");
+                continue;
+            }
 
-        /* resource flush */
-        err = flush_resource(gdev, gdev->display_resource_id, gdev->pmode.r.width, gdev->pmode.r.height);
-        if (err < 0) {
-            LTRACEF("failed to flush resource\n");
-            continue;
+            /* resource flush */
+            err = flush_resource(gdev, gdev->display_resource_id, &rects[i]);
+            if (err < 0) {
+                LTRACEF("failed to flush resource\n");
+                continue;
+            }
         }
+
+        /* idle unless more came in while we were busy */
+        spin_lock_irqsave(&gdev->dirty_lock, state);
+        if (gdev->dirty_count == 0)
+            event_signal(&gdev->idle_event, false);
+        spin_unlock_irqrestore(&gdev->dirty_lock, state);
     }
 
     return 0;
 }
 
+static inline bool rects_touch(const struct virtio_gpu_rect *a, const struct virtio_gpu_rect *b)
+{
+    return a->x <= b->x + b->width && b->x <= a->x + a->width &&
+           a->y <= b->y + b->height && b->y <= a->y + a->height;
+}
+
+static void rect_union(struct virtio_gpu_rect *a, const struct virtio_gpu_rect *b)
+{
+    uint32_t x2 = MAX(a->x + a->width, b->x + b->width);
+    uint32_t y2 = MAX(a->y + a->height, b->y + b->height);
+
+    a->x = MIN(a->x, b->x);
+    a->y = MIN(a->y, b->y);
+    a->width = x2 - a->x;
+    a->height = y2 - a->y;
+}
+
+void virtio_gpu_gfx_flush_rect(uint x, uint y, uint width, uint height)
+{
+    struct virtio_gpu_dev *gdev = the_gdev;
+
+    if (x >= gdev->pmode.r.width || y >= gdev->pmode.r.height)
+        return;
+    if (width == 0 || height == 0)
+        return;
+
+    struct virtio_gpu_rect r = {
+        .x = x,
+        .y = y,
+        .width = MIN(width, gdev->pmode.r.width - x),
+        .height = MIN(height, gdev->pmode.r.height - y),
+    };
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&gdev->dirty_lock, state);
+
+    event_unsignal(&gdev->idle_event);
+
+    uint i;
+    for (i = 0; i < gdev->dirty_count; i++) {
+        if (rects_touch(&gdev->dirty[i], &r)) {
+            rect_union(&gdev->dirty[i], &r);
+            break;
+        }
+    }
+    if (i == gdev->dirty_count) {
+        if (gdev->dirty_count < MAX_DIRTY_RECTS) {
+            gdev->dirty[gdev->dirty_count++] = r;
+        } else {
+            /* out of slots, collapse everything into one rect */
+            for (i = 1; i < gdev->dirty_count; i++)
+                rect_union(&gdev->dirty[0], &gdev->dirty[i]);
+            rect_union(&gdev->dirty[0], &r);
+            gdev->dirty_count = 1;
+        }
+    }
+
+    spin_unlock_irqrestore(&gdev->dirty_lock, state);
+
+    event_signal(&gdev->flush_event, !arch_ints_disabled());
+}
+
+void virtio_gpu_gfx_wait_idle(void)
+{
+    event_wait(&the_gdev->idle_event);
+}
+
 void virtio_gpu_gfx_flush(uint starty, uint endy)
 {
-    event_signal(&the_gdev->flush_event, !arch_ints_disabled());
+    virtio_gpu_gfx_flush_rect(0, starty, the_gdev->pmode.r.width, endy - starty + 1);
 }
 
 status_t display_get_framebuffer(struct display_framebuffer *fb)
@@ -571,6 +674,8 @@ status_t display_get_framebuffer(struct display_framebuffer *fb)
     fb->image.stride = fb->image.width;
     fb->image.rowbytes = fb->image.width * 4;
     fb->flush = virtio_gpu_gfx_flush;
+    fb->flush_rect = virtio_gpu_gfx_flush_rect;
+    fb->wait_idle = virtio_gpu_gfx_wait_idle;
     fb->format = DISPLAY_FORMAT_RGB_x888;
 
     return NO_ERROR;
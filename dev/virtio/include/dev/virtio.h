@@ -32,9 +32,15 @@
  * returns number of devices found */
 int virtio_mmio_detect(void *ptr, uint count, const uint irqs[]);
 
-#define MAX_VIRTIO_RINGS 4
+/* probe the pci bus for virtio 1.0 devices
+ * returns number of devices found */
+int virtio_pci_detect(void);
+
+/* enough for virtio-net with 8 rx/tx queue pairs and its control ring */
+#define MAX_VIRTIO_RINGS 17
 
 struct virtio_mmio_config;
+struct virtio_pci_common_cfg;
 
 struct virtio_device {
     bool valid;
@@ -45,13 +51,32 @@ struct virtio_device {
     volatile struct virtio_mmio_config *mmio_config;
     void *config_ptr;
 
+    /* pci transport, used instead of mmio_config when set */
+    volatile struct virtio_pci_common_cfg *pci_common;
+    volatile uint8_t *pci_isr;
+    volatile uint8_t *pci_notify;
+    uint32_t pci_notify_mult;
+    uint16_t pci_notify_off[MAX_VIRTIO_RINGS];
+    bool pci_msix; /* config changes and rings each have a message, the isr is unused */
+
     void *priv; /* a place for the driver to put private data */
 
+    /* VIRTIO_RING_F_EVENT_IDX was negotiated, notifications in both directions go by index */
+    bool event_idx;
+
+    /* VIRTIO_RING_F_INDIRECT_DESC was negotiated */
+    bool indirect_desc;
+
     enum handler_return (*irq_driver_callback)(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
     enum handler_return (*config_change_callback)(struct virtio_device *dev);
 
+    /* rings in polled_rings_bitmap are not walked in the irq handler, instead
+     * ring_ready_callback is called and the driver drains them with virtio_ring_poll */
+    enum handler_return (*ring_ready_callback)(struct virtio_device *dev, uint ring);
+
     /* virtio rings */
     uint32_t active_rings_bitmap;
+    uint32_t polled_rings_bitmap;
     struct vring ring[MAX_VIRTIO_RINGS];
 };
 
@@ -59,9 +84,20 @@ void virtio_reset_device(struct virtio_device *dev);
 void virtio_status_acknowledge_driver(struct virtio_device *dev);
 void virtio_status_driver_ok(struct virtio_device *dev);
 
+/* tell the device which of the features it offered the driver is going to use,
+ * ring features the core knows how to drive are added to these if offered */
+void virtio_set_guest_features(struct virtio_device *dev, uint32_t features);
+
 /* api used by devices to interact with the virtio bus */
 status_t virtio_alloc_ring(struct virtio_device *dev, uint index, uint16_t len) __NONNULL();
 
+/* largest ring the device supports at index, 0 if there is no such ring */
+uint virtio_ring_max_len(struct virtio_device *dev, uint index) __NONNULL();
+
+/* give every descriptor on a ring an indirect table of up to max_count entries,
+ * only valid if dev->indirect_desc */
+status_t virtio_ring_alloc_indirect(struct virtio_device *dev, uint index, uint16_t max_count) __NONNULL();
+
 /* add a descriptor at index desc_index to the free list on ring_index */
 void virtio_free_desc(struct virtio_device *dev, uint ring_index, uint16_t desc_index);
 
@@ -71,6 +107,10 @@ uint16_t virtio_alloc_desc(struct virtio_device *dev, uint ring_index);
 /* allocate a descriptor chain the free list */
 struct vring_desc *virtio_alloc_desc_chain(struct virtio_device *dev, uint ring_index, size_t count, uint16_t *start_index);
 
+/* allocate a single ring descriptor pointing at a chain of count descriptors in its
+ * indirect table. returns the table, walk it by the next field same as a direct chain */
+struct vring_desc *virtio_alloc_indirect_chain(struct virtio_device *dev, uint ring_index, size_t count, uint16_t *start_index);
+
 static inline struct vring_desc *virtio_desc_index_to_desc(struct virtio_device *dev, uint ring_index, uint16_t desc_index)
 {
     DEBUG_ASSERT(desc_index != 0xffff);
@@ -82,6 +122,16 @@ void virtio_dump_desc(const struct vring_desc *desc);
 /* submit a chain to the avail list */
 void virtio_submit_chain(struct virtio_device *dev, uint ring_index, uint16_t desc_index);
 
+/* notify the device of newly submitted chains, unless it said it doesn't need to hear about them */
 void virtio_kick(struct virtio_device *dev, uint ring_idnex);
 
+/* pass up to budget used elements on a polled ring to irq_driver_callback, returns how many */
+uint virtio_ring_poll(struct virtio_device *dev, uint ring_index, uint budget);
+
+/* ask the device not to interrupt for used buffers on a ring */
+void virtio_ring_irq_disable(struct virtio_device *dev, uint ring_index);
+
+/* let the device interrupt again, returns true if used buffers are already waiting */
+bool virtio_ring_irq_enable(struct virtio_device *dev, uint ring_index);
+
 
@@ -99,13 +99,19 @@ struct vring {
     uint16_t free_list; /* head of a free list of descriptors per ring. 0xffff is NULL */
     uint16_t free_count;
 
-    uint16_t last_used;
+    uint16_t last_used; /* free running, like used->idx */
+    uint16_t last_kicked; /* avail->idx as of the last time the device was notified */
 
     struct vring_desc *desc;
 
     struct vring_avail *avail;
 
     struct vring_used *used;
+
+    /* per descriptor indirect tables, indirect_max entries each, if the driver asked for them */
+    struct vring_desc *indirect;
+    uint64_t indirect_pa;
+    uint16_t indirect_max;
 };
 
 /* The standard layout for the ring is a continuous chunk of memory which looks
@@ -134,8 +140,10 @@ struct vring {
  */
 /* We publish the used event index at the end of the available ring, and vice
  * versa. They are at the end for backwards compatibility. */
-#define vring_used_event(vr) ((vr)->avail->ring[(vr)->num])
-#define vring_avail_event(vr) (*(uint16_t *)&(vr)->used->ring[(vr)->num])
+#define vring_used_event(vr) \
+    (*(volatile uint16_t *)((char *)(vr)->avail->ring + (vr)->num * sizeof((vr)->avail->ring[0])))
+#define vring_avail_event(vr) \
+    (*(volatile uint16_t *)((char *)(vr)->used->ring + (vr)->num * sizeof((vr)->used->ring[0])))
 
 static inline void vring_init(struct vring *vr, unsigned int num, void *p,
                               unsigned long align)
@@ -145,6 +153,10 @@ static inline void vring_init(struct vring *vr, unsigned int num, void *p,
     vr->free_list = 0xffff;
     vr->free_count = 0;
     vr->last_used = 0;
+    vr->last_kicked = 0;
+    vr->indirect = NULL;
+    vr->indirect_pa = 0;
+    vr->indirect_max = 0;
     vr->desc = p;
     vr->avail = p + num*sizeof(struct vring_desc);
     vr->used = (void *)(((unsigned long)&vr->avail->ring[num] + sizeof(uint16_t)
@@ -37,3 +37,18 @@ status_t virtio_net_get_mac_addr(uint8_t mac_addr[6]);
 struct pktbuf;
 extern status_t virtio_net_send_minip_pkt(struct pktbuf *p);
 
+/* send a frame, which may be a chain of pktbufs. the driver owns it from here on,
+ * and frees the segments as the device is done with them, possibly at irq time */
+status_t virtio_net_send_pktbuf(struct pktbuf *p);
+
+/*
+ * hand received frames to something other than minip, set before virtio_net_start.
+ * the handler runs on the rx poller thread. if owned is set it keeps p and frees it
+ * when done, otherwise p goes back to the rx ring as soon as the handler returns.
+ */
+typedef void (*virtio_net_rx_handler_t)(struct pktbuf *p, bool owned, void *arg);
+void virtio_net_set_rx_handler(virtio_net_rx_handler_t handler, void *arg);
+
+/* bring the interface up under lwIP rather than minip, only with lib/lwip in the build */
+status_t virtio_net_lwip_add(void);
+
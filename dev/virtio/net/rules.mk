@@ -3,7 +3,8 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 MODULE := $(LOCAL_DIR)
 
 MODULE_SRCS += \
-	$(LOCAL_DIR)/virtio-net.c
+	$(LOCAL_DIR)/virtio-net.c \
+	$(LOCAL_DIR)/virtio-net-lwip.c
 
 MODULE_DEPS += \
 	dev/virtio \
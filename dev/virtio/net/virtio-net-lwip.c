@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * lwIP netif for virtio-net that doesn't copy frames. outgoing pbufs are wrapped
+ * in pktbufs pointing at their payloads and go straight onto tx descriptors,
+ * received pktbufs are handed to lwIP as custom pbufs referencing their data.
+ */
+#if WITH_LIB_LWIP
+
+#include <dev/virtio/net.h>
+
+#include <debug.h>
+#include <assert.h>
+#include <trace.h>
+#include <string.h>
+#include <stdlib.h>
+#include <err.h>
+#include <kernel/spinlock.h>
+#include <lib/pktbuf.h>
+#include <lwip/netif.h>
+#include <lwip/netifapi.h>
+#include <lwip/pbuf.h>
+#include <lwip/tcpip.h>
+#include <netif/etharp.h>
+
+#define LOCAL_TRACE 0
+
+/*
+ * sent pbufs the device is done with. they can only be freed on the tcpip thread,
+ * so they wait here for the next transmit. every frame takes at least two tx
+ * descriptors, so this can't fill up before the tx ring does.
+ */
+#define TX_DONE_MAX 128
+
+struct virtio_netif {
+    struct netif netif;
+
+    spin_lock_t tx_done_lock;
+    struct pbuf *tx_done[TX_DONE_MAX];
+    uint tx_done_head;
+    uint tx_done_tail;
+};
+
+/* a received frame on loan to lwIP */
+struct virtio_netif_rx {
+    struct pbuf_custom pc;
+    pktbuf_t *p;
+};
+
+static struct virtio_netif vnif;
+
+/* called as the tx descriptors are freed, possibly at irq time */
+static void virtio_netif_tx_done(void *buf, void *arg)
+{
+    struct pbuf *p = (struct pbuf *)arg;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&vnif.tx_done_lock, state);
+
+    DEBUG_ASSERT(vnif.tx_done_head - vnif.tx_done_tail < TX_DONE_MAX);
+    vnif.tx_done[vnif.tx_done_head++ % TX_DONE_MAX] = p;
+
+    spin_unlock_irqrestore(&vnif.tx_done_lock, state);
+}
+
+static void virtio_netif_tx_reap(void)
+{
+    for (;;) {
+        struct pbuf *p = NULL;
+
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&vnif.tx_done_lock, state);
+        if (vnif.tx_done_tail != vnif.tx_done_head)
+            p = vnif.tx_done[vnif.tx_done_tail++ % TX_DONE_MAX];
+        spin_unlock_irqrestore(&vnif.tx_done_lock, state);
+
+        if (!p)
+            break;
+        pbuf_free(p);
+    }
+}
+
+static err_t virtio_netif_linkoutput(struct netif *netif, struct pbuf *p)
+{
+    LTRACEF("p %p, tot_len %u\n", p, p->tot_len);
+
+    virtio_netif_tx_reap();
+
+    /* one pktbuf per pbuf in the chain, pointing at its payload */
+    pktbuf_t *head = NULL;
+    pktbuf_t *last = NULL;
+    for (struct pbuf *q = p; q; q = q->next) {
+        if (q->len == 0)
+            continue;
+
+        pktbuf_t *seg = pktbuf_alloc_empty();
+        if (!seg) {
+            if (head)
+                pktbuf_free(head, true);
+            return ERR_MEM;
+        }
+        pktbuf_add_buffer(seg, q->payload, q->len, 0, 0, NULL, NULL);
+        seg->dlen = q->len;
+
+        if (head)
+            pktbuf_chain(head, seg);
+        else
+            head = seg;
+        last = seg;
+    }
+    if (!head)
+        return ERR_OK;
+
+    /* the whole chain completes at once, the last segment keeps the frame alive until then */
+    pbuf_ref(p);
+    last->cb = virtio_netif_tx_done;
+    last->cb_args = p;
+
+    status_t err = virtio_net_send_pktbuf(head);
+
+    switch (err) {
+        case NO_ERROR: return ERR_OK;
+        case ERR_NO_MEMORY: return ERR_MEM;
+        default: return ERR_IF;
+    }
+}
+
+static void virtio_netif_rx_free(struct pbuf *pb)
+{
+    struct virtio_netif_rx *rx = (struct virtio_netif_rx *)pb;
+
+    pktbuf_free(rx->p, true);
+    free(rx);
+}
+
+static void virtio_netif_rx(pktbuf_t *p, bool owned, void *arg)
+{
+    struct netif *netif = (struct netif *)arg;
+    struct pbuf *pb = NULL;
+
+    LTRACEF("p %p, dlen %u, owned %d\n", p, p->dlen, owned);
+
+    if (owned) {
+        /* lend the frame to lwIP, it comes back through virtio_netif_rx_free */
+        struct virtio_netif_rx *rx = malloc(sizeof(*rx));
+        if (rx) {
+            rx->p = p;
+            rx->pc.custom_free_function = virtio_netif_rx_free;
+            pb = pbuf_alloced_custom(PBUF_RAW, p->dlen, PBUF_REF, &rx->pc, p->data, p->dlen);
+            if (!pb)
+                free(rx);
+        }
+    }
+
+    if (!pb) {
+        /* the driver wants the buffer back, or we couldn't wrap it, so lwIP gets a copy */
+        pb = pbuf_alloc(PBUF_RAW, p->dlen, PBUF_POOL);
+        if (pb)
+            pbuf_take(pb, p->data, p->dlen);
+        if (owned)
+            pktbuf_free(p, true);
+        if (!pb)
+            return;
+    }
+
+    /* tcpip_input queues it for the tcpip thread */
+    if (netif->input(pb, netif) != ERR_OK)
+        pbuf_free(pb);
+}
+
+static err_t virtio_netif_init(struct netif *netif)
+{
+    netif->linkoutput = virtio_netif_linkoutput;
+    netif->output = etharp_output;
+
+    netif->hwaddr_len = 6;
+    virtio_net_get_mac_addr(netif->hwaddr);
+    netif->mtu = 1500;
+
+    netif->name[0] = 'v';
+    netif->name[1] = 'n';
+    netif->flags |= NETIF_FLAG_BROADCAST | NETIF_FLAG_ETHARP | NETIF_FLAG_LINK_UP;
+
+    return ERR_OK;
+}
+
+status_t virtio_net_lwip_add(void)
+{
+    ip_addr_t ipaddr, netmask, gw;
+
+    if (!virtio_net_found())
+        return ERR_NOT_FOUND;
+
+    vnif.tx_done_lock = SPIN_LOCK_INITIAL_VALUE;
+
+    IP4_ADDR(&gw, 0, 0, 0, 0);
+    IP4_ADDR(&ipaddr, 0, 0, 0, 0);
+    IP4_ADDR(&netmask, 255, 255, 255, 255);
+
+    /* received frames are queued for the tcpip thread, which does the rest */
+    if (netifapi_netif_add(&vnif.netif, &ipaddr, &netmask, &gw, NULL,
+                           virtio_netif_init, tcpip_input) != ERR_OK)
+        return ERR_NO_MEMORY;
+    netifapi_netif_set_default(&vnif.netif);
+
+    virtio_net_set_rx_handler(virtio_netif_rx, &vnif.netif);
+
+    status_t err = virtio_net_start();
+    if (err < 0)
+        return err;
+
+    netifapi_dhcp_start(&vnif.netif);
+
+    return NO_ERROR;
+}
+
+#endif // WITH_LIB_LWIP
@@ -28,11 +28,15 @@
 #include <compiler.h>
 #include <list.h>
 #include <string.h>
+#include <arch/ops.h>
 #include <err.h>
 #include <kernel/thread.h>
 #include <kernel/event.h>
 #include <kernel/spinlock.h>
+#include <kernel/mp.h>
 #include <kernel/vm.h>
+#include <kernel/debug.h>
+#include <dev/class/netif.h>
 #include <lib/pktbuf.h>
 #include <lib/minip.h>
 
@@ -76,37 +80,106 @@ struct virtio_net_hdr {
 #define VIRTIO_NET_F_MQ                     (1<<22)
 #define VIRTIO_NET_F_CTRL_MAC_ADDR          (1<<23)
 
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM         (1<<0)
+#define VIRTIO_NET_HDR_F_DATA_VALID         (1<<1)
+
+#define VIRTIO_NET_HDR_GSO_NONE             0
+#define VIRTIO_NET_HDR_GSO_TCPV4            1
+
 #define VIRTIO_NET_S_LINK_UP                (1<<0)
 #define VIRTIO_NET_S_ANNOUNCE               (1<<1)
 
-#define TX_RING_SIZE 16
-#define RX_RING_SIZE 16
+/* ring sizes to ask for, cut down to what the device supports */
+#ifndef VIRTIO_NET_TX_RING_SIZE
+#define VIRTIO_NET_TX_RING_SIZE 64
+#endif
+#ifndef VIRTIO_NET_RX_RING_SIZE
+#define VIRTIO_NET_RX_RING_SIZE 32
+#endif
+#define CTRL_RING_SIZE 4
+
+/* rings are a power of 2 long */
+STATIC_ASSERT((VIRTIO_NET_TX_RING_SIZE & (VIRTIO_NET_TX_RING_SIZE - 1)) == 0);
+STATIC_ASSERT((VIRTIO_NET_RX_RING_SIZE & (VIRTIO_NET_RX_RING_SIZE - 1)) == 0);
+
+/* queue pair n uses ring 2n for rx and 2n + 1 for tx, the control ring comes after the last pair */
+#define RING_RX(q) ((q) * 2)
+#define RING_TX(q) ((q) * 2 + 1)
+#define RING_CTRL(pairs) ((pairs) * 2)
 
-#define RING_RX 0
-#define RING_TX 1
+/* as many queue pairs as there are cpus, as long as the rings fit */
+#define VIRTIO_NET_MAX_QUEUES MIN(SMP_MAX_CPUS, (MAX_VIRTIO_RINGS - 1) / 2)
 
 #define VIRTIO_NET_MSS 1514
 
+/* offsets into an outgoing ethernet/ipv4 frame */
+#define ETH_HDR_LEN                         14
+#define ETH_TYPE_OFFSET                     12
+#define IPV4_PROTO_OFFSET                   (ETH_HDR_LEN + 9)
+#define IPV4_PROTO_TCP                      6
+#define IPV4_PROTO_UDP                      17
+#define TCP_CSUM_OFFSET                     16
+#define UDP_CSUM_OFFSET                     6
+
+/* control ring commands */
+struct virtio_net_ctrl_hdr {
+    uint8_t class;
+    uint8_t cmd;
+} __PACKED;
+
+#define VIRTIO_NET_CTRL_MQ                  4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET     0
+
+#define VIRTIO_NET_OK                       0
+#define VIRTIO_NET_ERR                      1
+
+struct virtio_net_dev;
+
+/* a rx/tx ring pair, each with its own lock and rx poller */
+struct virtio_net_queue {
+    struct virtio_net_dev *ndev;
+    uint index;
+
+    spin_lock_t lock;
+    struct netif_poll rx_poller;
+
+    /* active tx/rx packets to be freed at irq time, indexed by descriptor */
+    pktbuf_t **pending_tx_packet;
+    pktbuf_t **pending_rx_packet;
+
+    uint tx_pending_count;
+    struct list_node completed_rx_queue;
+    uint rx_skip; // buffers left of a frame too big to take
+};
+
 struct virtio_net_dev {
     struct virtio_device *dev;
     bool started;
 
     struct virtio_net_config *config;
+    uint32_t features;
+    size_t hdr_len; // the virtio_net_hdr only has num_buffers with VIRTIO_NET_F_MRG_RXBUF
 
-    spin_lock_t lock;
-    event_t rx_event;
+    uint tx_ring_size;
+    uint rx_ring_size;
 
-    /* list of active tx/rx packets to be freed at irq time */
-    pktbuf_t *pending_tx_packet[TX_RING_SIZE];
-    pktbuf_t *pending_rx_packet[RX_RING_SIZE];
+    uint queue_count;
+    struct virtio_net_queue queues[VIRTIO_NET_MAX_QUEUES];
 
-    uint tx_pending_count;
-    struct list_node completed_rx_queue;
+    /* control ring, only there if VIRTIO_NET_F_CTRL_VQ was negotiated */
+    uint ctrl_ring;
+    event_t ctrl_event;
+
+    /* where received frames go, minip unless another stack took over */
+    virtio_net_rx_handler_t rx_handler;
+    void *rx_handler_arg;
 };
 
 static enum handler_return virtio_net_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
-static int virtio_net_rx_worker(void *arg);
-static status_t virtio_net_queue_rx(struct virtio_net_dev *ndev, pktbuf_t *p);
+static enum handler_return virtio_net_ring_ready_callback(struct virtio_device *dev, uint ring);
+static uint virtio_net_rx_poll(void *arg, uint budget);
+static bool virtio_net_rx_poll_complete(void *arg);
+static status_t virtio_net_queue_rx(struct virtio_net_queue *q, pktbuf_t *p);
 
 // XXX remove need for this
 static struct virtio_net_dev *the_ndev;
@@ -138,6 +211,17 @@ static void dump_feature_bits(uint32_t feature)
     printf("\n");
 }
 
+/* the ring size we want, halved until the device can take it */
+static uint virtio_net_ring_len(struct virtio_device *dev, uint ring, uint len)
+{
+    uint max = virtio_ring_max_len(dev, ring);
+
+    while (len > 1 && len > max)
+        len /= 2;
+
+    return len;
+}
+
 status_t virtio_net_init(struct virtio_device *dev, uint32_t host_features)
 {
     LTRACEF("dev %p, host_features 0x%x\n", dev, host_features);
@@ -151,33 +235,140 @@ status_t virtio_net_init(struct virtio_device *dev, uint32_t host_features)
     dev->priv = ndev;
     ndev->started = false;
 
-    ndev->lock = SPIN_LOCK_INITIAL_VALUE;
-    event_init(&ndev->rx_event, false, EVENT_FLAG_AUTOUNSIGNAL);
-    list_initialize(&ndev->completed_rx_queue);
-
     ndev->config = (struct virtio_net_config *)dev->config_ptr;
 
     /* ack and set the driver status bit */
     virtio_status_acknowledge_driver(dev);
 
-    // XXX check features bits and ack/nak them
     dump_feature_bits(host_features);
 
+    ndev->features = host_features & (VIRTIO_NET_F_MAC | VIRTIO_NET_F_CSUM | VIRTIO_NET_F_GUEST_CSUM |
+                                      VIRTIO_NET_F_MRG_RXBUF);
+
+    /* the host can cut up tcp frames for us, given it fills in the checksums too */
+    if ((host_features & VIRTIO_NET_F_HOST_TSO4) && (host_features & VIRTIO_NET_F_CSUM))
+        ndev->features |= VIRTIO_NET_F_HOST_TSO4;
+
+    /*
+     * use one queue pair per cpu if the device has more than one, which takes
+     * the control ring to tell it how many we are going to use
+     */
+    ndev->queue_count = 1;
+    if ((host_features & VIRTIO_NET_F_MQ) && (host_features & VIRTIO_NET_F_CTRL_VQ) &&
+            RING_CTRL(ndev->config->max_virtqueue_pairs) < MAX_VIRTIO_RINGS) {
+        ndev->features |= VIRTIO_NET_F_MQ | VIRTIO_NET_F_CTRL_VQ;
+        ndev->queue_count = MIN(ndev->config->max_virtqueue_pairs, VIRTIO_NET_MAX_QUEUES);
+        ndev->ctrl_ring = RING_CTRL(ndev->config->max_virtqueue_pairs);
+    }
+    virtio_set_guest_features(dev, ndev->features);
+
+    ndev->hdr_len = sizeof(struct virtio_net_hdr);
+    if (!(ndev->features & VIRTIO_NET_F_MRG_RXBUF))
+        ndev->hdr_len -= sizeof(uint16_t);
+
+    /* every pair gets the same size rings, as big as asked for if the device allows */
+    ndev->tx_ring_size = virtio_net_ring_len(dev, RING_TX(0), VIRTIO_NET_TX_RING_SIZE);
+    ndev->rx_ring_size = virtio_net_ring_len(dev, RING_RX(0), VIRTIO_NET_RX_RING_SIZE);
+
+    LTRACEF("using %u queue pairs, tx ring %u rx ring %u\n",
+            ndev->queue_count, ndev->tx_ring_size, ndev->rx_ring_size);
+
+    for (uint i = 0; i < ndev->queue_count; i++) {
+        struct virtio_net_queue *q = &ndev->queues[i];
+
+        q->ndev = ndev;
+        q->index = i;
+        q->lock = SPIN_LOCK_INITIAL_VALUE;
+        list_initialize(&q->completed_rx_queue);
+
+        char name[32];
+        snprintf(name, sizeof(name), "virtio_net_rx%u", i);
+        status_t err = netif_poll_init(&q->rx_poller, name, HIGH_PRIORITY,
+                                       &virtio_net_rx_poll, &virtio_net_rx_poll_complete, q);
+        if (err < 0)
+            return err;
+
+        /* received frames are pulled off the ring by the poller, not at irq time */
+        dev->polled_rings_bitmap |= (1u << RING_RX(i));
+
+        q->pending_tx_packet = calloc(ndev->tx_ring_size, sizeof(pktbuf_t *));
+        q->pending_rx_packet = calloc(ndev->rx_ring_size, sizeof(pktbuf_t *));
+        if (!q->pending_tx_packet || !q->pending_rx_packet)
+            return ERR_NO_MEMORY;
+    }
+    event_init(&ndev->ctrl_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+
     /* set our irq handler */
     dev->irq_driver_callback = &virtio_net_irq_driver_callback;
+    dev->ring_ready_callback = &virtio_net_ring_ready_callback;
+
+    /* allocate a pair of virtio rings per queue, and the control ring, before DRIVER_OK as pci devices require */
+    for (uint i = 0; i < ndev->queue_count; i++) {
+        virtio_alloc_ring(dev, RING_RX(i), ndev->rx_ring_size);
+        virtio_alloc_ring(dev, RING_TX(i), ndev->tx_ring_size);
+    }
+    if (ndev->features & VIRTIO_NET_F_CTRL_VQ)
+        virtio_alloc_ring(dev, ndev->ctrl_ring, CTRL_RING_SIZE);
 
     /* set DRIVER_OK */
     virtio_status_driver_ok(dev);
 
-    /* allocate a pair of virtio rings */
-    virtio_alloc_ring(dev, RING_RX, RX_RING_SIZE); // rx
-    virtio_alloc_ring(dev, RING_TX, TX_RING_SIZE); // tx
-
     the_ndev = ndev;
 
     return NO_ERROR;
 }
 
+/* send a command with a single 16 bit argument down the control ring and wait for the answer */
+static status_t virtio_net_ctrl_cmd(struct virtio_net_dev *ndev, uint8_t class, uint8_t cmd, uint16_t arg)
+{
+    struct virtio_device *vdev = ndev->dev;
+
+    DEBUG_ASSERT(ndev->features & VIRTIO_NET_F_CTRL_VQ);
+
+    pktbuf_t *p = pktbuf_alloc();
+    if (!p)
+        return ERR_NO_MEMORY;
+
+    struct virtio_net_ctrl_hdr *hdr = pktbuf_append(p, sizeof(*hdr));
+    hdr->class = class;
+    hdr->cmd = cmd;
+    memcpy(pktbuf_append(p, sizeof(arg)), &arg, sizeof(arg));
+    volatile uint8_t *ack = pktbuf_append(p, 1);
+    *ack = VIRTIO_NET_ERR;
+
+    /* header and argument for the device to read, then the ack for it to write */
+    uint16_t i;
+    struct vring_desc *desc = virtio_alloc_desc_chain(vdev, ndev->ctrl_ring, 3, &i);
+    if (!desc) {
+        pktbuf_free(p, true);
+        return ERR_NO_MEMORY;
+    }
+
+    desc->addr = pktbuf_data_phys(p);
+    desc->len = sizeof(*hdr);
+    desc->flags |= VRING_DESC_F_NEXT;
+
+    desc = virtio_desc_index_to_desc(vdev, ndev->ctrl_ring, desc->next);
+    desc->addr = pktbuf_data_phys(p) + sizeof(*hdr);
+    desc->len = sizeof(arg);
+    desc->flags |= VRING_DESC_F_NEXT;
+
+    desc = virtio_desc_index_to_desc(vdev, ndev->ctrl_ring, desc->next);
+    desc->addr = pktbuf_data_phys(p) + sizeof(*hdr) + sizeof(arg);
+    desc->len = 1;
+    desc->flags = VRING_DESC_F_WRITE;
+
+    virtio_submit_chain(vdev, ndev->ctrl_ring, i);
+    virtio_kick(vdev, ndev->ctrl_ring);
+
+    event_wait(&ndev->ctrl_event);
+
+    status_t err = (*ack == VIRTIO_NET_OK) ? NO_ERROR : ERR_IO;
+    pktbuf_free(p, true);
+
+    return err;
+}
+
 status_t virtio_net_start(void)
 {
     if (the_ndev->started)
@@ -185,91 +376,167 @@ status_t virtio_net_start(void)
 
     the_ndev->started = true;
 
-    /* start the rx worker thread */
-    thread_resume(thread_create("virtio_net_rx", &virtio_net_rx_worker, (void *)the_ndev, HIGH_PRIORITY, DEFAULT_STACK_SIZE));
+    /* the device starts out using only the first pair */
+    if (the_ndev->queue_count > 1) {
+        status_t err = virtio_net_ctrl_cmd(the_ndev, VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET,
+                                           the_ndev->queue_count);
+        if (err < 0) {
+            TRACEF("failed to enable %u queue pairs, err %d\n", the_ndev->queue_count, err);
+            the_ndev->queue_count = 1;
+        }
+    }
 
-    /* queue up a bunch of rxes */
-    for (uint i = 0; i < RX_RING_SIZE - 1; i++) {
-        pktbuf_t *p = pktbuf_alloc();
-        if (p) {
-            virtio_net_queue_rx(the_ndev, p);
+    /* let the stack know what it can leave to the host */
+    uint32_t offloads = 0;
+    if (the_ndev->features & VIRTIO_NET_F_CSUM)
+        offloads |= MINIP_TX_OFFLOAD_CSUM;
+    if (the_ndev->features & VIRTIO_NET_F_HOST_TSO4)
+        offloads |= MINIP_TX_OFFLOAD_TSO;
+    /* a frame for the host to cut up can take at most half the tx ring */
+    size_t tso_max_len = 0;
+    if (the_ndev->tx_ring_size > 4)
+        tso_max_len = MIN((the_ndev->tx_ring_size / 2 - 2) * PKTBUF_SIZE, 0xffff);
+    minip_set_tx_offloads(offloads, tso_max_len);
+
+    for (uint i = 0; i < the_ndev->queue_count; i++) {
+        struct virtio_net_queue *q = &the_ndev->queues[i];
+
+        /*
+         * start the rx poller, on the cpu whose transmits go out on this pair
+         * so the host steers the replies back to it. a cpu that isn't up yet gets an
+         * unpinned poller rather than one that may never run.
+         */
+        if (the_ndev->queue_count > 1 && mp_is_cpu_active(i))
+            thread_set_pinned_cpu(q->rx_poller.thread, i);
+        netif_poll_start(&q->rx_poller);
+
+        /* fill up the rx ring, and let the device know once */
+        for (uint j = 0; j < the_ndev->rx_ring_size - 1; j++) {
+            pktbuf_t *p = pktbuf_alloc();
+            if (p) {
+                virtio_net_queue_rx(q, p);
+            }
         }
+        virtio_kick(the_ndev->dev, RING_RX(i));
     }
 
     return NO_ERROR;
 }
 
-static status_t virtio_net_queue_tx_pktbuf(struct virtio_net_dev *ndev, pktbuf_t *p2)
+/* fill in the checksum and segmentation offload requests for an outgoing ipv4 frame */
+static void virtio_net_fill_tx_hdr(struct virtio_net_hdr *hdr, const pktbuf_t *p)
 {
-    struct virtio_device *vdev = ndev->dev;
+    if (!(p->flags & PKTBUF_FLAG_CKSUM_PARTIAL))
+        return;
+
+    /* the stack keeps all the headers in the first segment */
+    const uint8_t *frame = p->data;
+    DEBUG_ASSERT(frame[ETH_TYPE_OFFSET] == 0x08 && frame[ETH_TYPE_OFFSET + 1] == 0x00);
+
+    uint16_t l4_start = ETH_HDR_LEN + (frame[ETH_HDR_LEN] & 0xf) * 4;
+    uint8_t proto = frame[IPV4_PROTO_OFFSET];
+
+    hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    hdr->csum_start = l4_start;
+    hdr->csum_offset = (proto == IPV4_PROTO_UDP) ? UDP_CSUM_OFFSET : TCP_CSUM_OFFSET;
+
+    if (p->gso_size > 0) {
+        DEBUG_ASSERT(proto == IPV4_PROTO_TCP);
+        hdr->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        hdr->gso_size = p->gso_size;
+        hdr->hdr_len = l4_start + (frame[l4_start + 12] >> 4) * 4;
+    }
+}
+
+static status_t virtio_net_queue_tx_pktbuf(struct virtio_net_queue *q, pktbuf_t *p2)
+{
+    struct virtio_device *vdev = q->ndev->dev;
+    uint ring = RING_TX(q->index);
 
     uint16_t i;
     pktbuf_t *p;
 
-    DEBUG_ASSERT(ndev);
+    DEBUG_ASSERT(q);
+
+    /* one descriptor for the header, plus one per segment of the frame */
+    uint desc_count = 1 + pktbuf_chain_count(p2);
 
     p = pktbuf_alloc();
     if (!p)
         return ERR_NO_MEMORY;
 
     /* point our header to the base of the first pktbuf */
-    struct virtio_net_hdr *hdr = pktbuf_append(p, sizeof(struct virtio_net_hdr) - 2);
+    struct virtio_net_hdr *hdr = pktbuf_append(p, q->ndev->hdr_len);
     memset(hdr, 0, p->dlen);
+    virtio_net_fill_tx_hdr(hdr, p2);
 
     spin_lock_saved_state_t state;
-    spin_lock_irqsave(&ndev->lock, state);
+    spin_lock_irqsave(&q->lock, state);
 
     /* only queue if we have enough tx descriptors */
-    if (ndev->tx_pending_count + 2 > TX_RING_SIZE)
+    if (q->tx_pending_count + desc_count > q->ndev->tx_ring_size)
         goto nodesc;
 
     /* allocate a chain of descriptors for our transfer */
-    struct vring_desc *desc = virtio_alloc_desc_chain(vdev, RING_TX, 2, &i);
+    struct vring_desc *desc = virtio_alloc_desc_chain(vdev, ring, desc_count, &i);
     if (!desc) {
-        spin_unlock_irqrestore(&ndev->lock, state);
+        spin_unlock_irqrestore(&q->lock, state);
 
 nodesc:
-        TRACEF("out of virtio tx descriptors, tx_pending_count %u\n", ndev->tx_pending_count);
+        TRACEF("out of virtio tx descriptors on queue %u, tx_pending_count %u\n", q->index, q->tx_pending_count);
         pktbuf_free(p, true);
 
         return ERR_NO_MEMORY;
     }
 
-    ndev->tx_pending_count += 2;
-
-    /* save a pointer to our pktbufs for the irq handler to free */
-    LTRACEF("saving pointer to pkt in index %u and %u\n", i, desc->next);
-    DEBUG_ASSERT(ndev->pending_tx_packet[i] == NULL);
-    DEBUG_ASSERT(ndev->pending_tx_packet[desc->next] == NULL);
-    ndev->pending_tx_packet[i] = p;
-    ndev->pending_tx_packet[desc->next] = p2;
+    q->tx_pending_count += desc_count;
 
     /* set up the descriptor pointing to the header */
+    LTRACEF("saving pointer to header in index %u\n", i);
+    DEBUG_ASSERT(q->pending_tx_packet[i] == NULL);
+    q->pending_tx_packet[i] = p;
+
     desc->addr = pktbuf_data_phys(p);
     desc->len = p->dlen;
     desc->flags |= VRING_DESC_F_NEXT;
 
-    /* set up the descriptor pointing to the buffer */
-    desc = virtio_desc_index_to_desc(vdev, RING_TX, desc->next);
-    desc->addr = pktbuf_data_phys(p2);
-    desc->len = p2->dlen;
-    desc->flags = 0;
+    /*
+     * set up a descriptor pointing at each segment, unchaining them as we go
+     * so the irq handler can free them one descriptor at a time
+     */
+    while (p2) {
+        uint16_t index = desc->next;
+        pktbuf_t *next = p2->next;
+
+        /* save a pointer to our pktbuf for the irq handler to free */
+        LTRACEF("saving pointer to pkt in index %u\n", index);
+        DEBUG_ASSERT(q->pending_tx_packet[index] == NULL);
+        q->pending_tx_packet[index] = p2;
+        p2->next = NULL;
+
+        desc = virtio_desc_index_to_desc(vdev, ring, index);
+        desc->addr = pktbuf_data_phys(p2);
+        desc->len = p2->dlen;
+        desc->flags = next ? VRING_DESC_F_NEXT : 0;
+
+        p2 = next;
+    }
 
     /* submit the transfer */
-    virtio_submit_chain(vdev, RING_TX, i);
+    virtio_submit_chain(vdev, ring, i);
 
     /* kick it off */
-    virtio_kick(vdev, RING_TX);
+    virtio_kick(vdev, ring);
 
-    spin_unlock_irqrestore(&ndev->lock, state);
+    spin_unlock_irqrestore(&q->lock, state);
 
     return NO_ERROR;
 }
 
 /* variant of the above function that copies the buffer into a pktbuf before sending */
-static status_t virtio_net_queue_tx(struct virtio_net_dev *ndev, const void *buf, size_t len)
+static status_t virtio_net_queue_tx(struct virtio_net_queue *q, const void *buf, size_t len)
 {
-    DEBUG_ASSERT(ndev);
+    DEBUG_ASSERT(q);
     DEBUG_ASSERT(buf);
 
     pktbuf_t *p = pktbuf_alloc();
@@ -282,7 +549,7 @@ static status_t virtio_net_queue_tx(struct virtio_net_dev *ndev, const void *buf
     memcpy(p->data, buf, len);
 
     /* call through to the variant of the function that takes a pre-populated pktbuf */
-    status_t err = virtio_net_queue_tx_pktbuf(ndev, p);
+    status_t err = virtio_net_queue_tx_pktbuf(q, p);
     if (err < 0) {
         pktbuf_free(p, true);
     }
@@ -290,31 +557,34 @@ static status_t virtio_net_queue_tx(struct virtio_net_dev *ndev, const void *buf
     return err;
 }
 
-static status_t virtio_net_queue_rx(struct virtio_net_dev *ndev, pktbuf_t *p)
+/* hand a buffer to the rx ring, the caller kicks the ring once it has queued a batch */
+static status_t virtio_net_queue_rx(struct virtio_net_queue *q, pktbuf_t *p)
 {
-    struct virtio_device *vdev = ndev->dev;
+    struct virtio_device *vdev = q->ndev->dev;
+    uint ring = RING_RX(q->index);
 
-    DEBUG_ASSERT(ndev);
+    DEBUG_ASSERT(q);
     DEBUG_ASSERT(p);
 
     /* point our header to the base of the pktbuf */
     p->data = p->buffer;
     struct virtio_net_hdr *hdr = (struct virtio_net_hdr *)p->data;
-    memset(hdr, 0, sizeof(struct virtio_net_hdr) - 2);
+    memset(hdr, 0, q->ndev->hdr_len);
 
-    p->dlen = sizeof(struct virtio_net_hdr) - 2 + VIRTIO_NET_MSS;
+    p->dlen = q->ndev->hdr_len + VIRTIO_NET_MSS;
+    p->flags &= ~(PKTBUF_FLAG_CKSUM_TCP_GOOD | PKTBUF_FLAG_CKSUM_UDP_GOOD);
 
     spin_lock_saved_state_t state;
-    spin_lock_irqsave(&ndev->lock, state);
+    spin_lock_irqsave(&q->lock, state);
 
     /* allocate a chain of descriptors for our transfer */
     uint16_t i;
-    struct vring_desc *desc = virtio_alloc_desc_chain(vdev, RING_RX, 1, &i);
+    struct vring_desc *desc = virtio_alloc_desc_chain(vdev, ring, 1, &i);
     DEBUG_ASSERT(desc); /* shouldn't be possible not to have a descriptor ready */
 
     /* save a pointer to our pktbufs for the irq handler to use */
-    DEBUG_ASSERT(ndev->pending_rx_packet[i] == NULL);
-    ndev->pending_rx_packet[i] = p;
+    DEBUG_ASSERT(q->pending_rx_packet[i] == NULL);
+    q->pending_rx_packet[i] = p;
 
     /* set up the descriptor pointing to the header */
     desc->addr = pktbuf_data_phys(p);
@@ -322,12 +592,9 @@ static status_t virtio_net_queue_rx(struct virtio_net_dev *ndev, pktbuf_t *p)
     desc->flags = VRING_DESC_F_WRITE;
 
     /* submit the transfer */
-    virtio_submit_chain(vdev, RING_RX, i);
-
-    /* kick it off */
-    virtio_kick(vdev, RING_RX);
+    virtio_submit_chain(vdev, ring, i);
 
-    spin_unlock_irqrestore(&ndev->lock, state);
+    spin_unlock_irqrestore(&q->lock, state);
 
     return NO_ERROR;
 }
@@ -338,7 +605,31 @@ static enum handler_return virtio_net_irq_driver_callback(struct virtio_device *
 
     LTRACEF("dev %p, ring %u, e %p, id %u, len %u\n", dev, ring, e, e->id, e->len);
 
-    spin_lock(&ndev->lock);
+    if ((ndev->features & VIRTIO_NET_F_CTRL_VQ) && ring == ndev->ctrl_ring) {
+        /* a control command finished, the thread waiting on it frees its buffer */
+        uint16_t i = e->id;
+        for (;;) {
+            struct vring_desc *desc = virtio_desc_index_to_desc(dev, ring, i);
+            int next = (desc->flags & VRING_DESC_F_NEXT) ? desc->next : -1;
+
+            virtio_free_desc(dev, ring, i);
+
+            if (next < 0)
+                break;
+            i = next;
+        }
+
+        event_signal(&ndev->ctrl_event, false);
+
+        return INT_RESCHEDULE;
+    }
+
+    struct virtio_net_queue *q = &ndev->queues[ring / 2];
+    bool rx = (ring == RING_RX(q->index));
+
+    /* rx completions come in from the poller thread, tx ones at irq time */
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&q->lock, state);
 
     /* parse our descriptor chain, add back to the free queue */
     uint16_t i = e->id;
@@ -355,28 +646,28 @@ static enum handler_return virtio_net_irq_driver_callback(struct virtio_device *
 
         virtio_free_desc(dev, ring, i);
 
-        if (ring == RING_RX) {
+        if (rx) {
             /* put the freed rx buffer in a queue */
-            pktbuf_t *p = ndev->pending_rx_packet[i];
-            ndev->pending_rx_packet[i] = NULL;
+            pktbuf_t *p = q->pending_rx_packet[i];
+            q->pending_rx_packet[i] = NULL;
 
             DEBUG_ASSERT(p);
             LTRACEF("rx pktbuf %p filled\n", p);
 
             /* trim the pktbuf according to the written length in the used element descriptor */
-            if (e->len > (sizeof(struct virtio_net_hdr) - 2 + VIRTIO_NET_MSS)) {
+            if (e->len > ndev->hdr_len + VIRTIO_NET_MSS) {
                 TRACEF("bad used len on RX %u\n", e->len);
                 p->dlen = 0;
             } else {
                 p->dlen = e->len;
             }
 
-            list_add_tail(&ndev->completed_rx_queue, &p->list);
-        } else { // ring == RING_TX
+            list_add_tail(&q->completed_rx_queue, &p->list);
+        } else {
             /* free the pktbuf associated with the tx packet we just consumed */
-            pktbuf_t *p = ndev->pending_tx_packet[i];
-            ndev->pending_tx_packet[i] = NULL;
-            ndev->tx_pending_count--;
+            pktbuf_t *p = q->pending_tx_packet[i];
+            q->pending_tx_packet[i] = NULL;
+            q->tx_pending_count--;
 
             DEBUG_ASSERT(p);
             LTRACEF("freeing pktbuf %p\n", p);
@@ -389,49 +680,97 @@ static enum handler_return virtio_net_irq_driver_callback(struct virtio_device *
         i = next;
     }
 
-    spin_unlock(&ndev->lock);
+    spin_unlock_irqrestore(&q->lock, state);
 
-    /* if rx ring, signal our event */
-    if (ring == 0) {
-        event_signal(&ndev->rx_event, false);
-    }
+    return rx ? INT_NO_RESCHEDULE : INT_RESCHEDULE;
+}
+
+/* an rx ring has new buffers, mask it and let the poller take it from here */
+static enum handler_return virtio_net_ring_ready_callback(struct virtio_device *dev, uint ring)
+{
+    struct virtio_net_dev *ndev = (struct virtio_net_dev *)dev->priv;
+    struct virtio_net_queue *q = &ndev->queues[ring / 2];
+
+    DEBUG_ASSERT(ring == RING_RX(q->index));
+
+    virtio_ring_irq_disable(dev, ring);
+    netif_poll_schedule(&q->rx_poller);
 
     return INT_RESCHEDULE;
 }
 
-static int virtio_net_rx_worker(void *arg)
+static uint virtio_net_rx_poll(void *arg, uint budget)
 {
-    struct virtio_net_dev *ndev = (struct virtio_net_dev *)arg;
+    struct virtio_net_queue *q = (struct virtio_net_queue *)arg;
+    struct virtio_net_dev *ndev = q->ndev;
 
-    for (;;) {
-        event_wait(&ndev->rx_event);
+    /* move up to a budget's worth of used buffers onto the completed queue */
+    uint count = virtio_ring_poll(ndev->dev, RING_RX(q->index), budget);
+    if (count == 0)
+        return 0;
 
-        /* pull some packets from the received queue */
-        for (;;) {
-            spin_lock_saved_state_t state;
-            spin_lock_irqsave(&ndev->lock, state);
+    /* pull everything received so far off the queue in one go */
+    struct list_node batch = LIST_INITIAL_VALUE(batch);
+    pktbuf_t *p;
 
-            pktbuf_t *p = list_remove_head_type(&ndev->completed_rx_queue, pktbuf_t, list);
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&q->lock, state);
 
-            spin_unlock_irqrestore(&ndev->lock, state);
+    while ((p = list_remove_head_type(&q->completed_rx_queue, pktbuf_t, list)))
+        list_add_tail(&batch, &p->list);
 
-            if (!p)
-                break; /* nothing left in the queue, go back to waiting */
+    spin_unlock_irqrestore(&q->lock, state);
 
-            LTRACEF("got packet len %u\n", p->dlen);
+    while ((p = list_remove_head_type(&batch, pktbuf_t, list))) {
+        LTRACEF("got packet len %u on queue %u\n", p->dlen, q->index);
 
+        if (q->rx_skip > 0) {
+            /* the rest of a frame we are dropping */
+            q->rx_skip--;
+        } else {
             /* process our packet */
-            struct virtio_net_hdr *hdr = pktbuf_consume(p, sizeof(struct virtio_net_hdr) - 2);
-            if (hdr) {
-                /* call up into the stack */
-                minip_rx_driver_callback(p);
+            struct virtio_net_hdr *hdr = pktbuf_consume(p, ndev->hdr_len);
+            if (hdr && (ndev->features & VIRTIO_NET_F_MRG_RXBUF) && hdr->num_buffers > 1) {
+                /* more than a buffer's worth, the host is sending past the mtu */
+                TRACEF("dropping frame spread over %u buffers\n", hdr->num_buffers);
+                q->rx_skip = hdr->num_buffers - 1;
+            } else if (hdr) {
+                /* the host checked the payload checksum, or it came from the host and never had one */
+                if (hdr->flags & (VIRTIO_NET_HDR_F_NEEDS_CSUM | VIRTIO_NET_HDR_F_DATA_VALID))
+                    p->flags |= PKTBUF_FLAG_CKSUM_TCP_GOOD | PKTBUF_FLAG_CKSUM_UDP_GOOD;
+
+                /* give the stack the buffer outright if there's a fresh one to put in its
+                 * place, so it can go on to a udp listener without a copy */
+                pktbuf_t *fresh = pktbuf_alloc_nowait();
+                KEVLOG_NET_RX(p, p->dlen);
+                if (ndev->rx_handler) {
+                    ndev->rx_handler(p, fresh != NULL, ndev->rx_handler_arg);
+                } else if (fresh) {
+                    minip_rx_driver_callback_owned(p);
+                } else {
+                    minip_rx_driver_callback(p);
+                }
+                if (fresh)
+                    p = fresh;
             }
-
-            /* requeue the pktbuf in the rx queue */
-            virtio_net_queue_rx(ndev, p);
         }
+
+        /* requeue the pktbuf in the rx queue */
+        virtio_net_queue_rx(q, p);
     }
-    return 0;
+
+    /* let the device know about the whole batch of buffers at once */
+    virtio_kick(ndev->dev, RING_RX(q->index));
+
+    return count;
+}
+
+static bool virtio_net_rx_poll_complete(void *arg)
+{
+    struct virtio_net_queue *q = (struct virtio_net_queue *)arg;
+
+    /* unmask the ring, and keep polling if something slipped in while it was masked */
+    return virtio_ring_irq_enable(q->ndev->dev, RING_RX(q->index));
 }
 
 int virtio_net_found(void)
@@ -449,25 +788,35 @@ status_t virtio_net_get_mac_addr(uint8_t mac_addr[6])
     return NO_ERROR;
 }
 
+void virtio_net_set_rx_handler(virtio_net_rx_handler_t handler, void *arg)
+{
+    DEBUG_ASSERT(the_ndev && !the_ndev->started);
+
+    the_ndev->rx_handler_arg = arg;
+    the_ndev->rx_handler = handler;
+}
+
 status_t virtio_net_send_minip_pkt(pktbuf_t *p)
+{
+    return virtio_net_send_pktbuf(p);
+}
+
+status_t virtio_net_send_pktbuf(pktbuf_t *p)
 {
     LTRACEF("p %p, dlen %u, flags 0x%x\n", p, p->dlen, p->flags);
 
     DEBUG_ASSERT(p && p->dlen);
 
-    if ((p->flags & PKTBUF_FLAG_EOF) == 0) {
-        /* can't handle multi part packets yet */
-        PANIC_UNIMPLEMENTED;
+    /* transmit on this cpu's queue pair, which is also where the host will send the replies */
+    struct virtio_net_queue *q = &the_ndev->queues[arch_curr_cpu_num() % the_ndev->queue_count];
 
-        return ERR_NOT_IMPLEMENTED;
-    }
+    KEVLOG_NET_TX(p, p->dlen);
 
     /* hand the pktbuf off to the nic, it owns the pktbuf from now on out unless it fails */
-    status_t err = virtio_net_queue_tx_pktbuf(the_ndev, p);
+    status_t err = virtio_net_queue_tx_pktbuf(q, p);
     if (err < 0) {
         pktbuf_free(p, true);
     }
 
     return err;
 }
-
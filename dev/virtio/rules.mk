@@ -5,4 +5,9 @@ MODULE := $(LOCAL_DIR)
 MODULE_SRCS += \
 	$(LOCAL_DIR)/virtio.c
 
+ifeq ($(PLATFORM_HAS_PCI),1)
+MODULE_SRCS += \
+	$(LOCAL_DIR)/virtio_pci.c
+endif
+
 include make/module.mk
@@ -48,6 +48,9 @@
 #if WITH_DEV_VIRTIO_GPU
 #include <dev/virtio/gpu.h>
 #endif
+#if WITH_DEV_VIRTIO_CONSOLE
+#include <dev/virtio/console.h>
+#endif
 
 #define LOCAL_TRACE 0
 
@@ -78,45 +81,58 @@ void virtio_dump_desc(const struct vring_desc *desc)
     printf("\tnext  0x%hhx\n", desc->next);
 }
 
-static enum handler_return virtio_mmio_irq(void *arg)
+enum handler_return virtio_handle_irq(struct virtio_device *dev, uint32_t irq_status)
 {
-    struct virtio_device *dev = (struct virtio_device *)arg;
-    LTRACEF("dev %p, index %u\n", dev, dev->index);
-
-    uint32_t irq_status = dev->mmio_config->interrupt_status;
-    LTRACEF("status 0x%x\n", irq_status);
+    LTRACEF("dev %p, index %u, status 0x%x\n", dev, dev->index, irq_status);
 
     enum handler_return ret = INT_NO_RESCHEDULE;
     if (irq_status & 0x1) { /* used ring update */
-        // XXX is this safe?
-        dev->mmio_config->interrupt_ack = 0x1;
-
         /* cycle through all the active rings */
         for (uint r = 0; r < MAX_VIRTIO_RINGS; r++) {
             if ((dev->active_rings_bitmap & (1<<r)) == 0)
                 continue;
 
             struct vring *ring = &dev->ring[r];
+
+            if (dev->polled_rings_bitmap & (1<<r)) {
+                /* the driver drains this one from its own thread */
+                if (ring->used->idx != ring->last_used) {
+                    DEBUG_ASSERT(dev->ring_ready_callback);
+                    ret |= dev->ring_ready_callback(dev, r);
+                }
+                continue;
+            }
+
             LTRACEF("ring %u: used flags 0x%hhx idx 0x%hhx last_used %u\n", r, ring->used->flags, ring->used->idx, ring->last_used);
 
-            uint cur_idx = ring->used->idx;
-            for (uint i = ring->last_used; i != (cur_idx & ring->num_mask); i = (i + 1) & ring->num_mask) {
-                LTRACEF("looking at idx %u\n", i);
+            for (;;) {
+                uint16_t cur_idx = ring->used->idx;
+                while (ring->last_used != cur_idx) {
+                    uint i = ring->last_used & ring->num_mask;
+                    LTRACEF("looking at idx %u\n", i);
+
+                    // process chain
+                    struct vring_used_elem *used_elem = &ring->used->ring[i];
+                    LTRACEF("id %u, len %u\n", used_elem->id, used_elem->len);
 
-                // process chain
-                struct vring_used_elem *used_elem = &ring->used->ring[i];
-                LTRACEF("id %u, len %u\n", used_elem->id, used_elem->len);
+                    DEBUG_ASSERT(dev->irq_driver_callback);
+                    ret |= dev->irq_driver_callback(dev, r, used_elem);
 
-                DEBUG_ASSERT(dev->irq_driver_callback);
-                ret |= dev->irq_driver_callback(dev, r, used_elem);
+                    ring->last_used++;
+                }
 
-                ring->last_used = (ring->last_used + 1) & ring->num_mask;
+                if (!dev->event_idx)
+                    break;
+
+                /* ask for an interrupt on the next used buffer, and pick up any that beat us to it */
+                vring_used_event(ring) = ring->last_used;
+                mb();
+                if (ring->used->idx == ring->last_used)
+                    break;
             }
         }
     }
     if (irq_status & 0x2) { /* config change */
-        dev->mmio_config->interrupt_ack = 0x2;
-
         if (dev->config_change_callback) {
             ret |= dev->config_change_callback(dev);
         }
@@ -127,6 +143,65 @@ static enum handler_return virtio_mmio_irq(void *arg)
     return ret;
 }
 
+static enum handler_return virtio_mmio_irq(void *arg)
+{
+    struct virtio_device *dev = (struct virtio_device *)arg;
+
+    uint32_t irq_status = dev->mmio_config->interrupt_status;
+
+    /* ack before looking at the rings, so an update after we've looked raises it again */
+    dev->mmio_config->interrupt_ack = irq_status;
+
+    return virtio_handle_irq(dev, irq_status);
+}
+
+status_t virtio_probe_device(struct virtio_device *dev, uint32_t device_id, uint32_t host_features)
+{
+    status_t err = ERR_NOT_SUPPORTED;
+
+    switch (device_id) {
+#if WITH_DEV_VIRTIO_BLOCK
+        case 2: // block device
+            LTRACEF("found block device\n");
+            err = virtio_block_init(dev, host_features);
+            break;
+#endif
+#if WITH_DEV_VIRTIO_NET
+        case 1: // network device
+            LTRACEF("found net device\n");
+            err = virtio_net_init(dev, host_features);
+            break;
+#endif
+#if WITH_DEV_VIRTIO_GPU
+        case 0x10: // virtio-gpu
+            LTRACEF("found gpu device\n");
+            err = virtio_gpu_init(dev, host_features);
+            break;
+#endif
+#if WITH_DEV_VIRTIO_CONSOLE
+        case 3: // console
+            LTRACEF("found console device\n");
+            err = virtio_console_init(dev, host_features);
+            break;
+#endif
+    }
+    if (err < 0)
+        return err;
+
+    // good device
+    dev->valid = true;
+
+    if (dev->irq_driver_callback)
+        unmask_interrupt(dev->irq);
+
+#if WITH_DEV_VIRTIO_GPU
+    if (device_id == 0x10)
+        virtio_gpu_start(dev);
+#endif
+
+    return NO_ERROR;
+}
+
 int virtio_mmio_detect(void *ptr, uint count, const uint irqs[])
 {
     LTRACEF("ptr %p, count %u\n", ptr, count);
@@ -164,74 +239,12 @@ int virtio_mmio_detect(void *ptr, uint count, const uint irqs[])
         }
 #endif
 
-#if WITH_DEV_VIRTIO_BLOCK
-        if (mmio->device_id == 2) { // block device
-            LTRACEF("found block device\n");
-
-            dev->mmio_config = mmio;
-            dev->config_ptr = (void *)mmio->config;
-
-            status_t err = virtio_block_init(dev, mmio->host_features);
-            if (err >= 0) {
-                // good device
-                dev->valid = true;
-
-                if (dev->irq_driver_callback)
-                    unmask_interrupt(dev->irq);
-
-                // XXX quick test code, remove
-#if 0
-                uint8_t buf[512];
-                memset(buf, 0x99, sizeof(buf));
-                virtio_block_read_write(dev, buf, 0, sizeof(buf), false);
-                hexdump8_ex(buf, sizeof(buf), 0);
-
-                buf[0]++;
-                virtio_block_read_write(dev, buf, 0, sizeof(buf), true);
-
-                virtio_block_read_write(dev, buf, 0, sizeof(buf), false);
-                hexdump8_ex(buf, sizeof(buf), 0);
-#endif
-            }
-
-        }
-#endif // WITH_DEV_VIRTIO_BLOCK
-#if WITH_DEV_VIRTIO_NET
-        if (mmio->device_id == 1) { // network device
-            LTRACEF("found net device\n");
-
-            dev->mmio_config = mmio;
-            dev->config_ptr = (void *)mmio->config;
-
-            status_t err = virtio_net_init(dev, mmio->host_features);
-            if (err >= 0) {
-                // good device
-                dev->valid = true;
-
-                if (dev->irq_driver_callback)
-                    unmask_interrupt(dev->irq);
-            }
-        }
-#endif // WITH_DEV_VIRTIO_NET
-#if WITH_DEV_VIRTIO_GPU
-        if (mmio->device_id == 0x10) { // virtio-gpu
-            LTRACEF("found gpu device\n");
-
+        if (mmio->device_id != 0) {
             dev->mmio_config = mmio;
             dev->config_ptr = (void *)mmio->config;
 
-            status_t err = virtio_gpu_init(dev, mmio->host_features);
-            if (err >= 0) {
-                // good device
-                dev->valid = true;
-
-                if (dev->irq_driver_callback)
-                    unmask_interrupt(dev->irq);
-
-                virtio_gpu_start(dev);
-            }
+            virtio_probe_device(dev, mmio->device_id, mmio->host_features);
         }
-#endif // WITH_DEV_VIRTIO_GPU
 
         if (dev->valid)
             found++;
@@ -298,6 +311,40 @@ struct vring_desc *virtio_alloc_desc_chain(struct virtio_device *dev, uint ring_
     return last;
 }
 
+struct vring_desc *virtio_alloc_indirect_chain(struct virtio_device *dev, uint ring_index, size_t count, uint16_t *start_index)
+{
+    struct vring *ring = &dev->ring[ring_index];
+
+    DEBUG_ASSERT(ring->indirect);
+    DEBUG_ASSERT(count > 0);
+
+    if (count > ring->indirect_max)
+        return NULL;
+
+    uint16_t i = virtio_alloc_desc(dev, ring_index);
+    if (i == 0xffff)
+        return NULL;
+
+    /* chain the front of this descriptor's table together */
+    struct vring_desc *table = &ring->indirect[i * ring->indirect_max];
+    for (uint j = 0; j < count; j++) {
+        table[j].flags = (j + 1 < count) ? VRING_DESC_F_NEXT : 0;
+        table[j].next = (j + 1 < count) ? j + 1 : 0;
+    }
+
+    /* and point the ring slot at it */
+    struct vring_desc *desc = &ring->desc[i];
+    desc->addr = ring->indirect_pa + (uint64_t)i * ring->indirect_max * sizeof(struct vring_desc);
+    desc->len = count * sizeof(struct vring_desc);
+    desc->flags = VRING_DESC_F_INDIRECT;
+    desc->next = 0;
+
+    if (start_index)
+        *start_index = i;
+
+    return table;
+}
+
 void virtio_submit_chain(struct virtio_device *dev, uint ring_index, uint16_t desc_index)
 {
     LTRACEF("dev %p, ring %u, desc %u\n", dev, ring_index, desc_index);
@@ -306,7 +353,7 @@ void virtio_submit_chain(struct virtio_device *dev, uint ring_index, uint16_t de
     struct vring_avail *avail = dev->ring[ring_index].avail;
 
     avail->ring[avail->idx & dev->ring[ring_index].num_mask] = desc_index;
-    DSB;
+    mb();
     avail->idx++;
 
 #if LOCAL_TRACE
@@ -318,8 +365,82 @@ void virtio_kick(struct virtio_device *dev, uint ring_index)
 {
     LTRACEF("dev %p, ring %u\n", dev, ring_index);
 
-    dev->mmio_config->queue_notify = ring_index;
-    DSB;
+    struct vring *ring = &dev->ring[ring_index];
+
+    /* the new avail index has to be visible before we look at what the device wants */
+    mb();
+
+    uint16_t new_idx = ring->avail->idx;
+    uint16_t old_idx = ring->last_kicked;
+    ring->last_kicked = new_idx;
+
+    bool notify;
+    if (dev->event_idx) {
+        /* only if the device went idle somewhere in the chains added since the last kick */
+        notify = vring_need_event(vring_avail_event(ring), new_idx, old_idx);
+    } else {
+        notify = !(ring->used->flags & VRING_USED_F_NO_NOTIFY);
+    }
+
+    if (!notify) {
+        LTRACEF("suppressed\n");
+        return;
+    }
+
+    if (dev->pci_common) {
+        volatile uint16_t *notify = (volatile uint16_t *)(dev->pci_notify +
+                                    dev->pci_notify_off[ring_index] * dev->pci_notify_mult);
+        *notify = ring_index;
+    } else {
+        dev->mmio_config->queue_notify = ring_index;
+    }
+    mb();
+}
+
+uint virtio_ring_poll(struct virtio_device *dev, uint ring_index, uint budget)
+{
+    LTRACEF("dev %p, ring %u, budget %u\n", dev, ring_index, budget);
+
+    DEBUG_ASSERT(dev->polled_rings_bitmap & (1<<ring_index));
+    DEBUG_ASSERT(dev->irq_driver_callback);
+
+    struct vring *ring = &dev->ring[ring_index];
+
+    uint count = 0;
+    uint16_t cur_idx = ring->used->idx;
+    while (count < budget && ring->last_used != cur_idx) {
+        struct vring_used_elem *used_elem = &ring->used->ring[ring->last_used & ring->num_mask];
+        LTRACEF("id %u, len %u\n", used_elem->id, used_elem->len);
+
+        dev->irq_driver_callback(dev, ring_index, used_elem);
+
+        ring->last_used++;
+        count++;
+    }
+
+    return count;
+}
+
+void virtio_ring_irq_disable(struct virtio_device *dev, uint ring_index)
+{
+    /* with event indexes the flag is ignored, leaving used_event behind last_used is
+     * enough to keep the device quiet until it is moved up again */
+    dev->ring[ring_index].avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
+}
+
+bool virtio_ring_irq_enable(struct virtio_device *dev, uint ring_index)
+{
+    struct vring *ring = &dev->ring[ring_index];
+
+    ring->avail->flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
+    if (dev->event_idx)
+        vring_used_event(ring) = ring->last_used;
+
+    /* make sure the device sees the flag before we look at the used index,
+     * otherwise a buffer landing in between would go unnoticed */
+    mb();
+
+    return ring->used->idx != ring->last_used;
 }
 
 status_t virtio_alloc_ring(struct virtio_device *dev, uint index, uint16_t len)
@@ -378,12 +499,34 @@ status_t virtio_alloc_ring(struct virtio_device *dev, uint index, uint16_t len)
     }
 
     /* register the ring with the device */
-    DEBUG_ASSERT(dev->mmio_config);
-    dev->mmio_config->guest_page_size = PAGE_SIZE;
-    dev->mmio_config->queue_sel = index;
-    dev->mmio_config->queue_num = len;
-    dev->mmio_config->queue_align = PAGE_SIZE;
-    dev->mmio_config->queue_pfn = pa / PAGE_SIZE;
+    if (dev->pci_common) {
+        volatile struct virtio_pci_common_cfg *common = dev->pci_common;
+        uint64_t desc_pa = pa;
+        uint64_t avail_pa = pa + ((uint8_t *)ring->avail - (uint8_t *)vptr);
+        uint64_t used_pa = pa + ((uint8_t *)ring->used - (uint8_t *)vptr);
+
+        common->queue_select = index;
+        common->queue_size = len;
+        common->queue_desc_lo = desc_pa;
+        common->queue_desc_hi = desc_pa >> 32;
+        common->queue_avail_lo = avail_pa;
+        common->queue_avail_hi = avail_pa >> 32;
+        common->queue_used_lo = used_pa;
+        common->queue_used_hi = used_pa >> 32;
+        /* without msi-x the ring interrupts come through the isr */
+        common->queue_msix_vector = dev->pci_msix ? VIRTIO_PCI_MSIX_RINGS : VIRTIO_MSI_NO_VECTOR;
+        if (dev->pci_msix && common->queue_msix_vector != VIRTIO_PCI_MSIX_RINGS)
+            TRACEF("device refused msi-x vector for ring %u\n", index);
+        dev->pci_notify_off[index] = common->queue_notify_off;
+        common->queue_enable = 1;
+    } else {
+        DEBUG_ASSERT(dev->mmio_config);
+        dev->mmio_config->guest_page_size = PAGE_SIZE;
+        dev->mmio_config->queue_sel = index;
+        dev->mmio_config->queue_num = len;
+        dev->mmio_config->queue_align = PAGE_SIZE;
+        dev->mmio_config->queue_pfn = pa / PAGE_SIZE;
+    }
 
     /* mark the ring active */
     dev->active_rings_bitmap |= (1 << index);
@@ -391,19 +534,136 @@ status_t virtio_alloc_ring(struct virtio_device *dev, uint index, uint16_t len)
     return NO_ERROR;
 }
 
+status_t virtio_ring_alloc_indirect(struct virtio_device *dev, uint index, uint16_t max_count)
+{
+    LTRACEF("dev %p, index %u, max_count %u\n", dev, index, max_count);
+
+    DEBUG_ASSERT(dev->indirect_desc);
+    DEBUG_ASSERT(dev->active_rings_bitmap & (1 << index));
+    DEBUG_ASSERT(max_count > 0);
+
+    struct vring *ring = &dev->ring[index];
+
+    /* one table per descriptor, all in a single chunk */
+    size_t size = (size_t)ring->num * max_count * sizeof(struct vring_desc);
+    LTRACEF("need %zu bytes\n", size);
+
+#if WITH_KERNEL_VM
+    void *vptr;
+    status_t err = vmm_alloc_contiguous(vmm_get_kernel_aspace(), "virtio_indirect", ROUNDUP(size, PAGE_SIZE),
+                                        &vptr, 0, 0, ARCH_MMU_FLAG_UNCACHED_DEVICE);
+    if (err < 0)
+        return ERR_NO_MEMORY;
+
+    paddr_t pa = vaddr_to_paddr(vptr);
+    if (pa == 0)
+        return ERR_NO_MEMORY;
+#else
+    void *vptr = memalign(sizeof(struct vring_desc), size);
+    if (!vptr)
+        return ERR_NO_MEMORY;
+
+    paddr_t pa = (paddr_t)vptr;
+#endif
+    memset(vptr, 0, size);
+
+    LTRACEF("indirect tables at va %p pa 0x%lx\n", vptr, pa);
+
+    ring->indirect = vptr;
+    ring->indirect_pa = pa;
+    ring->indirect_max = max_count;
+
+    return NO_ERROR;
+}
+
+uint virtio_ring_max_len(struct virtio_device *dev, uint index)
+{
+    if (dev->pci_common) {
+        if (index >= dev->pci_common->num_queues)
+            return 0;
+        dev->pci_common->queue_select = index;
+        return dev->pci_common->queue_size;
+    }
+
+    DEBUG_ASSERT(dev->mmio_config);
+
+    dev->mmio_config->queue_sel = index;
+    return dev->mmio_config->queue_num_max;
+}
+
+static void virtio_set_status_bits(struct virtio_device *dev, uint8_t bits)
+{
+    if (dev->pci_common)
+        dev->pci_common->device_status |= bits;
+    else
+        dev->mmio_config->status |= bits;
+}
+
 void virtio_reset_device(struct virtio_device *dev)
 {
+    if (dev->pci_common) {
+        /* a pci device reads back 0 once the reset is done */
+        dev->pci_common->device_status = 0;
+        while (dev->pci_common->device_status != 0)
+            ;
+
+        /* reset drops the config vector, the ring vectors come back in virtio_alloc_ring */
+        if (dev->pci_msix)
+            dev->pci_common->msix_config = VIRTIO_PCI_MSIX_CONFIG;
+        return;
+    }
+
     dev->mmio_config->status = 0;
 }
 
 void virtio_status_acknowledge_driver(struct virtio_device *dev)
 {
-    dev->mmio_config->status |= VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER;
+    virtio_set_status_bits(dev, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
 }
 
 void virtio_status_driver_ok(struct virtio_device *dev)
 {
-    dev->mmio_config->status |= VIRTIO_STATUS_DRIVER_OK;
+    virtio_set_status_bits(dev, VIRTIO_STATUS_DRIVER_OK);
+}
+
+void virtio_set_guest_features(struct virtio_device *dev, uint32_t features)
+{
+    uint32_t host_features;
+    if (dev->pci_common) {
+        dev->pci_common->device_feature_select = 0;
+        host_features = dev->pci_common->device_feature;
+    } else {
+        dev->mmio_config->host_features_sel = 0;
+        host_features = dev->mmio_config->host_features;
+    }
+
+    if (host_features & (1u << VIRTIO_RING_F_EVENT_IDX))
+        features |= (1u << VIRTIO_RING_F_EVENT_IDX);
+    dev->event_idx = !!(features & (1u << VIRTIO_RING_F_EVENT_IDX));
+
+    if (host_features & (1u << VIRTIO_RING_F_INDIRECT_DESC))
+        features |= (1u << VIRTIO_RING_F_INDIRECT_DESC);
+    dev->indirect_desc = !!(features & (1u << VIRTIO_RING_F_INDIRECT_DESC));
+
+    LTRACEF("dev %p, features 0x%x\n", dev, features);
+
+    if (dev->pci_common) {
+        volatile struct virtio_pci_common_cfg *common = dev->pci_common;
+
+        common->driver_feature_select = 0;
+        common->driver_feature = features;
+        common->driver_feature_select = 1;
+        common->driver_feature = VIRTIO_F_VERSION_1_HI;
+
+        /* the features are settled before any rings are set up */
+        common->device_status |= VIRTIO_STATUS_FEATURES_OK;
+        if (!(common->device_status & VIRTIO_STATUS_FEATURES_OK))
+            TRACEF("dev %p didn't accept features 0x%x\n", dev, features);
+        return;
+    }
+
+    dev->mmio_config->guest_features_sel = 0;
+    dev->mmio_config->guest_features = features;
 }
 
 void virtio_init(uint level)
@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <dev/virtio.h>
+#include <dev/pci.h>
+
+#include <debug.h>
+#include <assert.h>
+#include <trace.h>
+#include <err.h>
+#include <stdlib.h>
+#include <kernel/vm.h>
+#include <platform/interrupts.h>
+
+#include "virtio_priv.h"
+
+/*
+ * virtio 1.0 over pci. The registers are found through vendor specific
+ * capabilities pointing into the BARs, and the rings are driven by the
+ * common code in virtio.c.
+ *
+ * When the platform can deliver message signalled interrupts, config
+ * changes and the rings get an MSI-X vector each. Otherwise interrupts come
+ * in on the function's INTx line, which may be shared, so one handler per
+ * line walks the devices on it and reads each one's isr, which also acks it.
+ */
+
+#define LOCAL_TRACE 0
+
+#define VIRTIO_PCI_MAX_DEVICES 16
+
+/* pci device ids of the types we have drivers for, modern first */
+static const struct {
+    uint16_t pci_id;
+    uint16_t virtio_id;
+} virtio_pci_ids[] = {
+    { VIRTIO_PCI_DEVICE_ID_MODERN + 1, 1 },     // net
+    { VIRTIO_PCI_DEVICE_ID_BASE + 0, 1 },       // transitional net
+    { VIRTIO_PCI_DEVICE_ID_MODERN + 2, 2 },     // block
+    { VIRTIO_PCI_DEVICE_ID_BASE + 1, 2 },       // transitional block
+    { VIRTIO_PCI_DEVICE_ID_MODERN + 0x10, 0x10 }, // gpu
+};
+
+static struct virtio_device *pci_devices;
+static uint pci_device_count;
+
+static enum handler_return virtio_pci_irq(void *arg)
+{
+    uint vector = (uintptr_t)arg;
+    enum handler_return ret = INT_NO_RESCHEDULE;
+
+    for (uint i = 0; i < pci_device_count; i++) {
+        struct virtio_device *dev = &pci_devices[i];
+        if (!dev->valid || dev->pci_msix || dev->irq != vector)
+            continue;
+
+        /* reading the isr clears it and drops the line */
+        uint8_t isr = *dev->pci_isr;
+        if (isr)
+            ret |= virtio_handle_irq(dev, isr);
+    }
+
+    return ret;
+}
+
+static enum handler_return virtio_pci_config_irq(void *arg)
+{
+    return virtio_handle_irq(arg, 0x2);
+}
+
+static enum handler_return virtio_pci_ring_irq(void *arg)
+{
+    return virtio_handle_irq(arg, 0x1);
+}
+
+/* map len bytes at offset into a memory BAR */
+static volatile void *virtio_pci_map(const pci_location_t *loc, uint bar, uint32_t offset, uint32_t len)
+{
+    if (bar > 5 || len == 0)
+        return NULL;
+
+    uint32_t lo;
+    pci_read_config_word(loc, PCI_CONFIG_BASE_ADDRESSES + bar * 4, &lo);
+    if (lo & 0x1) {
+        /* io space, the modern registers are always memory */
+        return NULL;
+    }
+
+    uint64_t pa = lo & ~0xfu;
+    if (((lo >> 1) & 0x3) == 0x2 && bar < 5) {
+        uint32_t hi;
+        pci_read_config_word(loc, PCI_CONFIG_BASE_ADDRESSES + (bar + 1) * 4, &hi);
+        pa |= (uint64_t)hi << 32;
+    }
+    if (pa == 0)
+        return NULL;
+    pa += offset;
+
+    LTRACEF("bar %u offset 0x%x len 0x%x at pa 0x%llx\n", bar, offset, len, (unsigned long long)pa);
+
+#if WITH_KERNEL_VM
+    paddr_t base = ROUNDDOWN(pa, PAGE_SIZE);
+    size_t size = ROUNDUP(pa + len, PAGE_SIZE) - base;
+    void *ptr;
+    status_t err = vmm_alloc_physical(vmm_get_kernel_aspace(), "virtio_pci", size, &ptr, 0, base,
+                                      0, ARCH_MMU_FLAG_UNCACHED_DEVICE);
+    if (err < 0)
+        return NULL;
+
+    return (uint8_t *)ptr + (pa - base);
+#else
+    return (void *)(uintptr_t)pa;
+#endif
+}
+
+/* find the transport's registers and hand the device to its driver */
+static status_t virtio_pci_probe(struct virtio_device *dev, const pci_location_t *loc, uint virtio_id)
+{
+    uint16_t status;
+    pci_read_config_half(loc, PCI_CONFIG_STATUS, &status);
+    if (!(status & PCI_STATUS_NEW_CAPS))
+        return ERR_NOT_SUPPORTED;
+
+    volatile void *common = NULL, *isr = NULL, *notify = NULL, *device = NULL;
+    uint32_t notify_mult = 0;
+    bool msix = false;
+
+    uint8_t cap;
+    pci_read_config_byte(loc, PCI_CONFIG_CAPABILITIES, &cap);
+    for (uint guard = 0; cap >= 0x40 && guard < 48; guard++) {
+        uint8_t id, next;
+        pci_read_config_byte(loc, cap, &id);
+        pci_read_config_byte(loc, cap + 1, &next);
+
+        if (id == PCI_CAP_ID_MSIX) {
+            msix = true;
+        } else if (id == PCI_CAP_ID_VNDR) {
+            uint8_t type, bar;
+            uint32_t offset, length;
+            pci_read_config_byte(loc, cap + VIRTIO_PCI_CAP_CFG_TYPE, &type);
+            pci_read_config_byte(loc, cap + VIRTIO_PCI_CAP_BAR, &bar);
+            pci_read_config_word(loc, cap + VIRTIO_PCI_CAP_OFFSET, &offset);
+            pci_read_config_word(loc, cap + VIRTIO_PCI_CAP_LENGTH, &length);
+
+            LTRACEF("cap type %u bar %u offset 0x%x length 0x%x\n", type, bar, offset, length);
+
+            /* the first of each kind is the one to use */
+            switch (type) {
+                case VIRTIO_PCI_CAP_COMMON_CFG:
+                    if (!common && length >= sizeof(struct virtio_pci_common_cfg))
+                        common = virtio_pci_map(loc, bar, offset, length);
+                    break;
+                case VIRTIO_PCI_CAP_NOTIFY_CFG:
+                    if (!notify) {
+                        pci_read_config_word(loc, cap + VIRTIO_PCI_CAP_NOTIFY_MULT, &notify_mult);
+                        notify = virtio_pci_map(loc, bar, offset, length);
+                    }
+                    break;
+                case VIRTIO_PCI_CAP_ISR_CFG:
+                    if (!isr)
+                        isr = virtio_pci_map(loc, bar, offset, length);
+                    break;
+                case VIRTIO_PCI_CAP_DEVICE_CFG:
+                    if (!device)
+                        device = virtio_pci_map(loc, bar, offset, length);
+                    break;
+            }
+        }
+
+        cap = next;
+    }
+
+    /* a legacy only device, or one we couldn't map */
+    if (!common || !notify || !isr || !device)
+        return ERR_NOT_SUPPORTED;
+
+    uint16_t command;
+    pci_read_config_half(loc, PCI_CONFIG_COMMAND, &command);
+    pci_write_config_half(loc, PCI_CONFIG_COMMAND, command | PCI_COMMAND_MEM_EN | PCI_COMMAND_BUS_MASTER_EN);
+
+    dev->pci_common = common;
+    dev->pci_isr = isr;
+    dev->pci_notify = notify;
+    dev->pci_notify_mult = notify_mult;
+    dev->config_ptr = (void *)device;
+
+    /* pci devices have to speak virtio 1.0 */
+    dev->pci_common->device_feature_select = 1;
+    if (!(dev->pci_common->device_feature & VIRTIO_F_VERSION_1_HI))
+        return ERR_NOT_SUPPORTED;
+
+    uint vectors[VIRTIO_PCI_MSIX_VECTORS];
+    if (msix && pci_enable_msix(loc, VIRTIO_PCI_MSIX_VECTORS, vectors) == _PCI_SUCCESSFUL) {
+        LTRACEF("msi-x vectors 0x%x 0x%x\n", vectors[0], vectors[1]);
+
+        register_int_handler(vectors[VIRTIO_PCI_MSIX_CONFIG], &virtio_pci_config_irq, dev);
+        register_int_handler(vectors[VIRTIO_PCI_MSIX_RINGS], &virtio_pci_ring_irq, dev);
+        dev->irq = vectors[VIRTIO_PCI_MSIX_RINGS];
+        dev->pci_msix = true;
+        dev->pci_common->msix_config = VIRTIO_PCI_MSIX_CONFIG;
+    } else {
+        uint vector;
+        if (pci_get_irq_vector(loc, &vector) != _PCI_SUCCESSFUL) {
+            TRACEF("virtio pci device %02x:%02x.%u has no interrupt\n",
+                   loc->bus, loc->dev_fn >> 3, loc->dev_fn & 7);
+            return ERR_NOT_SUPPORTED;
+        }
+
+        /* the line may be shared, the handler looks at every device on it */
+        register_int_handler(vector, &virtio_pci_irq, (void *)(uintptr_t)vector);
+        dev->irq = vector;
+        if (msix)
+            dev->pci_common->msix_config = VIRTIO_MSI_NO_VECTOR;
+    }
+
+    dev->pci_common->device_feature_select = 0;
+    uint32_t host_features = dev->pci_common->device_feature;
+
+    return virtio_probe_device(dev, virtio_id, host_features);
+}
+
+int virtio_pci_detect(void)
+{
+    pci_location_t locs[VIRTIO_PCI_MAX_DEVICES];
+    uint16_t ids[VIRTIO_PCI_MAX_DEVICES];
+    uint count = 0;
+
+    DEBUG_ASSERT(!pci_devices);
+
+    for (uint i = 0; i < countof(virtio_pci_ids); i++) {
+        for (uint16_t index = 0; count < VIRTIO_PCI_MAX_DEVICES; index++) {
+            if (pci_find_pci_device(&locs[count], virtio_pci_ids[i].pci_id, VIRTIO_PCI_VENDOR_ID,
+                                    index) != _PCI_SUCCESSFUL)
+                break;
+            ids[count++] = virtio_pci_ids[i].virtio_id;
+        }
+    }
+
+    LTRACEF("%u candidate devices\n", count);
+
+    if (count == 0)
+        return 0;
+
+    pci_devices = calloc(count, sizeof(struct virtio_device));
+    if (!pci_devices)
+        return ERR_NO_MEMORY;
+    pci_device_count = count;
+
+    int found = 0;
+    for (uint i = 0; i < count; i++) {
+        struct virtio_device *dev = &pci_devices[i];
+        dev->index = i;
+
+        if (virtio_pci_probe(dev, &locs[i], ids[i]) >= 0)
+            found++;
+    }
+
+    return found;
+}
@@ -63,3 +63,65 @@ STATIC_ASSERT(sizeof(struct virtio_mmio_config) == 0x100);
 #define VIRTIO_STATUS_FEATURES_OK (1<<3)
 #define VIRTIO_STATUS_DEVICE_NEEDS_RESET (1<<6)
 #define VIRTIO_STATUS_FAILED      (1<<7)
+
+/* virtio 1.0 pci transport, laid out by vendor specific capabilities */
+#define VIRTIO_PCI_VENDOR_ID        0x1af4
+#define VIRTIO_PCI_DEVICE_ID_BASE   0x1000 // transitional devices are 0x1000-0x103f
+#define VIRTIO_PCI_DEVICE_ID_MODERN 0x1040 // plus the virtio device id
+#define VIRTIO_PCI_DEVICE_ID_LAST   0x107f
+
+#define PCI_CAP_ID_VNDR             0x09
+#define PCI_CAP_ID_MSIX             0x11
+
+#define VIRTIO_PCI_CAP_COMMON_CFG   1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG   2
+#define VIRTIO_PCI_CAP_ISR_CFG      3
+#define VIRTIO_PCI_CAP_DEVICE_CFG   4
+#define VIRTIO_PCI_CAP_PCI_CFG      5
+
+/* offsets into the vendor capability */
+#define VIRTIO_PCI_CAP_CFG_TYPE     3
+#define VIRTIO_PCI_CAP_BAR          4
+#define VIRTIO_PCI_CAP_OFFSET       8
+#define VIRTIO_PCI_CAP_LENGTH       12
+#define VIRTIO_PCI_CAP_NOTIFY_MULT  16
+
+#define VIRTIO_MSI_NO_VECTOR        0xffff
+
+/* msi-x table entries when the platform can deliver them */
+#define VIRTIO_PCI_MSIX_CONFIG      0
+#define VIRTIO_PCI_MSIX_RINGS       1
+#define VIRTIO_PCI_MSIX_VECTORS     2
+
+struct virtio_pci_common_cfg {
+    /* 0x00 */  uint32_t device_feature_select;
+    uint32_t device_feature;
+    uint32_t driver_feature_select;
+    uint32_t driver_feature;
+    /* 0x10 */  uint16_t msix_config;
+    uint16_t num_queues;
+    uint8_t device_status;
+    uint8_t config_generation;
+    /* 0x16 */  uint16_t queue_select;
+    uint16_t queue_size;
+    uint16_t queue_msix_vector;
+    uint16_t queue_enable;
+    uint16_t queue_notify_off;
+    /* 0x20 */  uint32_t queue_desc_lo;
+    uint32_t queue_desc_hi;
+    uint32_t queue_avail_lo;
+    uint32_t queue_avail_hi;
+    /* 0x30 */  uint32_t queue_used_lo;
+    uint32_t queue_used_hi;
+};
+
+STATIC_ASSERT(sizeof(struct virtio_pci_common_cfg) == 0x38);
+
+/* the high word of the features, VIRTIO_F_VERSION_1 is required of pci devices */
+#define VIRTIO_F_VERSION_1_HI       (1u << 0)
+
+/* give a device found on either transport to the driver for its type */
+status_t virtio_probe_device(struct virtio_device *dev, uint32_t device_id, uint32_t host_features);
+
+/* service a device's interrupt, irq_status as in the mmio interrupt_status register */
+enum handler_return virtio_handle_irq(struct virtio_device *dev, uint32_t irq_status);
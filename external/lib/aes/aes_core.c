@@ -37,6 +37,7 @@
 
 #include <lib/aes.h>
 #include "aes_locl.h"
+#include "aes_priv.h"
 
 /*
 Te0[x] = S [x].[02, 01, 01, 03];
@@ -723,7 +724,7 @@ static const u32 rcon[] = {
 /**
  * Expand the cipher key into the encryption key schedule.
  */
-int AES_set_encrypt_key(const unsigned char *userKey, const int bits,
+int aes_sw_set_encrypt_key(const unsigned char *userKey, const int bits,
 			AES_KEY *key) {
 
 	u32 *rk;
@@ -824,7 +825,7 @@ int AES_set_encrypt_key(const unsigned char *userKey, const int bits,
 /**
  * Expand the cipher key into the decryption key schedule.
  */
-int AES_set_decrypt_key(const unsigned char *userKey, const int bits,
+int aes_sw_set_decrypt_key(const unsigned char *userKey, const int bits,
 			 AES_KEY *key) {
 
         u32 *rk;
@@ -832,7 +833,7 @@ int AES_set_decrypt_key(const unsigned char *userKey, const int bits,
 	u32 temp;
 
 	/* first, start with an encryption schedule */
-	status = AES_set_encrypt_key(userKey, bits, key);
+	status = aes_sw_set_encrypt_key(userKey, bits, key);
 	if (status < 0)
 		return status;
 
@@ -876,7 +877,7 @@ int AES_set_decrypt_key(const unsigned char *userKey, const int bits,
  * Encrypt a single block
  * in and out can overlap
  */
-void AES_encrypt(const unsigned char *in, unsigned char *out,
+void aes_sw_encrypt(const unsigned char *in, unsigned char *out,
 		 const AES_KEY *key) {
 
 	const u32 *rk;
@@ -1067,7 +1068,7 @@ void AES_encrypt(const unsigned char *in, unsigned char *out,
  * Decrypt a single block
  * in and out can overlap
  */
-void AES_decrypt(const unsigned char *in, unsigned char *out,
+void aes_sw_decrypt(const unsigned char *in, unsigned char *out,
 		 const AES_KEY *key) {
 
 	const u32 *rk;
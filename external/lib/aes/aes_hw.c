@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Probing for the cpu's aes instructions, and the x86-64 block functions.
+ * The arm64 ones are in aes_arm64.S.
+ *
+ * Both want the simd registers, which the lazy fpu switch will hand to the
+ * current thread, so the table code still covers interrupt context and
+ * anything that runs with interrupts off.
+ */
+#include <arch/ops.h>
+#include "aes_priv.h"
+
+#if !HW_AES_IMPL && AES_HW_BLOCKS
+
+#if ARCH_ARM64
+#include <arch/arm64.h>
+
+#define ID_AA64ISAR0_AES_SHIFT 4
+
+bool aes_hw_probe(void)
+{
+    uint64_t isar0 = ARM64_READ_SYSREG(id_aa64isar0_el1);
+
+    return ((isar0 >> ID_AA64ISAR0_AES_SHIFT) & 0xf) != 0;
+}
+
+bool aes_hw_usable(void)
+{
+    return !arch_ints_disabled();
+}
+
+#elif ARCH_X86_64
+#include <arch/x86.h>
+#include <emmintrin.h>
+#include <wmmintrin.h>
+
+#define CPUID_1_ECX_AES (1 << 25)
+
+bool aes_hw_probe(void)
+{
+    uint32_t a = 1, b, c, d;
+
+    __asm__ __volatile__ ("cpuid" : "+a" (a), "=b" (b), "=c" (c), "=d" (d) : "c" (0));
+
+    return c & CPUID_1_ECX_AES;
+}
+
+bool aes_hw_usable(void)
+{
+    /* not before fpu_init has turned on sse */
+    return !arch_ints_disabled() && (x86_get_cr4() & X86_CR4_OSFXSR);
+}
+
+/* four blocks at a time keep the aes unit's pipeline full */
+#define AES_BLOCKS(round, last_round) \
+    __m128i k[15]; \
+    for (int i = 0; i <= rounds; i++) \
+        k[i] = _mm_load_si128((const __m128i *)rk + i); \
+    \
+    for (; blocks >= 4; blocks -= 4, in += 64, out += 64) { \
+        __m128i b0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in + 0), k[0]); \
+        __m128i b1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in + 1), k[0]); \
+        __m128i b2 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in + 2), k[0]); \
+        __m128i b3 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in + 3), k[0]); \
+        for (int r = 1; r < rounds; r++) { \
+            b0 = round(b0, k[r]); \
+            b1 = round(b1, k[r]); \
+            b2 = round(b2, k[r]); \
+            b3 = round(b3, k[r]); \
+        } \
+        _mm_storeu_si128((__m128i *)out + 0, last_round(b0, k[rounds])); \
+        _mm_storeu_si128((__m128i *)out + 1, last_round(b1, k[rounds])); \
+        _mm_storeu_si128((__m128i *)out + 2, last_round(b2, k[rounds])); \
+        _mm_storeu_si128((__m128i *)out + 3, last_round(b3, k[rounds])); \
+    } \
+    \
+    for (; blocks > 0; blocks--, in += 16, out += 16) { \
+        __m128i b0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in), k[0]); \
+        for (int r = 1; r < rounds; r++) \
+            b0 = round(b0, k[r]); \
+        _mm_storeu_si128((__m128i *)out, last_round(b0, k[rounds])); \
+    }
+
+__attribute__((target("aes,sse2")))
+void aes_hw_encrypt_blocks(const uint8_t *rk, int rounds, const uint8_t *in, uint8_t *out, size_t blocks)
+{
+    AES_BLOCKS(_mm_aesenc_si128, _mm_aesenclast_si128);
+}
+
+__attribute__((target("aes,sse2")))
+void aes_hw_decrypt_blocks(const uint8_t *rk, int rounds, const uint8_t *in, uint8_t *out, size_t blocks)
+{
+    AES_BLOCKS(_mm_aesdec_si128, _mm_aesdeclast_si128);
+}
+
+#endif
+
+#endif // !HW_AES_IMPL && AES_HW_BLOCKS
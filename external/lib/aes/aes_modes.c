@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Key setup and the block entry points, which hand off to the cpu's aes
+ * instructions when aes_hw.c finds them, plus the bulk modes.
+ */
+#include <lib/aes.h>
+#include <stdlib.h>
+#include <string.h>
+#include "aes_priv.h"
+
+/* blocks handed to the cipher at once by the bulk modes */
+#define CHUNK_BLOCKS 8
+
+#if !HW_AES_IMPL
+
+static inline bool use_hw(const AES_KEY *key)
+{
+#if AES_HW_BLOCKS
+    return key->hw && aes_hw_usable();
+#else
+    return false;
+#endif
+}
+
+static void set_hw_key(AES_KEY *key)
+{
+#if AES_HW_BLOCKS
+    key->hw = 0;
+    if (!aes_hw_probe())
+        return;
+
+    /* the table code keeps each column as a big endian word */
+    for (int i = 0; i < 4 * (key->rounds + 1); i++) {
+        uint32_t w = key->rd_key[i];
+        key->hw_rd_key[4 * i + 0] = w >> 24;
+        key->hw_rd_key[4 * i + 1] = w >> 16;
+        key->hw_rd_key[4 * i + 2] = w >> 8;
+        key->hw_rd_key[4 * i + 3] = w;
+    }
+    key->hw = 1;
+#endif
+}
+
+int AES_set_encrypt_key(const unsigned char *userKey, const int bits,
+                        AES_KEY *key)
+{
+    int status = aes_sw_set_encrypt_key(userKey, bits, key);
+    if (status == 0)
+        set_hw_key(key);
+    return status;
+}
+
+/*
+ * The table code's decrypt schedule is already the one the equivalent
+ * inverse cipher wants, reversed with InvMixColumns applied to the middle
+ * rounds, which is what aesdec/aesd expect.
+ */
+int AES_set_decrypt_key(const unsigned char *userKey, const int bits,
+                        AES_KEY *key)
+{
+    int status = aes_sw_set_decrypt_key(userKey, bits, key);
+    if (status == 0)
+        set_hw_key(key);
+    return status;
+}
+
+void AES_encrypt(const unsigned char *in, unsigned char *out,
+                 const AES_KEY *key)
+{
+#if AES_HW_BLOCKS
+    if (use_hw(key)) {
+        aes_hw_encrypt_blocks(key->hw_rd_key, key->rounds, in, out, 1);
+        return;
+    }
+#endif
+    aes_sw_encrypt(in, out, key);
+}
+
+void AES_decrypt(const unsigned char *in, unsigned char *out,
+                 const AES_KEY *key)
+{
+#if AES_HW_BLOCKS
+    if (use_hw(key)) {
+        aes_hw_decrypt_blocks(key->hw_rd_key, key->rounds, in, out, 1);
+        return;
+    }
+#endif
+    aes_sw_decrypt(in, out, key);
+}
+
+#endif // !HW_AES_IMPL
+
+/* ecb over a run of blocks, in may equal out */
+static void encrypt_blocks(const AES_KEY *key, const uint8_t *in, uint8_t *out, size_t blocks)
+{
+#if AES_HW_BLOCKS && !HW_AES_IMPL
+    if (use_hw(key)) {
+        aes_hw_encrypt_blocks(key->hw_rd_key, key->rounds, in, out, blocks);
+        return;
+    }
+#endif
+    for (; blocks > 0; blocks--, in += AES_BLOCK_SIZE, out += AES_BLOCK_SIZE)
+        AES_encrypt(in, out, key);
+}
+
+static void decrypt_blocks(const AES_KEY *key, const uint8_t *in, uint8_t *out, size_t blocks)
+{
+#if AES_HW_BLOCKS && !HW_AES_IMPL
+    if (use_hw(key)) {
+        aes_hw_decrypt_blocks(key->hw_rd_key, key->rounds, in, out, blocks);
+        return;
+    }
+#endif
+    for (; blocks > 0; blocks--, in += AES_BLOCK_SIZE, out += AES_BLOCK_SIZE)
+        AES_decrypt(in, out, key);
+}
+
+static inline void xor_block(uint8_t *out, const uint8_t *a, const uint8_t *b)
+{
+    for (int i = 0; i < AES_BLOCK_SIZE; i++)
+        out[i] = a[i] ^ b[i];
+}
+
+void AES_cbc_encrypt(const unsigned char *in, unsigned char *out,
+                     size_t len, const AES_KEY *key,
+                     unsigned char *ivec, const int enc)
+{
+    uint8_t buf[CHUNK_BLOCKS * AES_BLOCK_SIZE];
+    size_t blocks = len / AES_BLOCK_SIZE;
+
+    if (enc == AES_ENCRYPT) {
+        /* every block chains on the last, so these can only go one at a time */
+        const uint8_t *iv = ivec;
+        for (; blocks > 0; blocks--, in += AES_BLOCK_SIZE, out += AES_BLOCK_SIZE) {
+            xor_block(buf, in, iv);
+            encrypt_blocks(key, buf, out, 1);
+            iv = out;
+        }
+        if (iv != ivec)
+            memcpy(ivec, iv, AES_BLOCK_SIZE);
+        return;
+    }
+
+    /* decryption doesn't chain, so a batch can go through together */
+    while (blocks > 0) {
+        size_t n = MIN(blocks, CHUNK_BLOCKS);
+        size_t bytes = n * AES_BLOCK_SIZE;
+
+        /* keep the ciphertext, out may be on top of it */
+        memcpy(buf, in, bytes);
+        decrypt_blocks(key, buf, out, n);
+
+        xor_block(out, out, ivec);
+        for (size_t i = 1; i < n; i++)
+            xor_block(out + i * AES_BLOCK_SIZE, out + i * AES_BLOCK_SIZE, buf + (i - 1) * AES_BLOCK_SIZE);
+        memcpy(ivec, buf + bytes - AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+
+        in += bytes;
+        out += bytes;
+        blocks -= n;
+    }
+}
+
+/* the whole block is one big endian counter */
+static inline void ctr128_inc(uint8_t *counter)
+{
+    for (int i = AES_BLOCK_SIZE - 1; i >= 0; i--) {
+        if (++counter[i] != 0)
+            break;
+    }
+}
+
+void AES_ctr128_encrypt(const unsigned char *in, unsigned char *out,
+                        size_t length, const AES_KEY *key,
+                        unsigned char ivec[AES_BLOCK_SIZE],
+                        unsigned char ecount_buf[AES_BLOCK_SIZE],
+                        unsigned int *num)
+{
+    uint8_t buf[CHUNK_BLOCKS * AES_BLOCK_SIZE];
+    unsigned int n = *num;
+
+    /* use up what's left of the last call's block */
+    while (n && length) {
+        *out++ = *in++ ^ ecount_buf[n];
+        length--;
+        n = (n + 1) % AES_BLOCK_SIZE;
+    }
+
+    while (length >= AES_BLOCK_SIZE) {
+        size_t blocks = MIN(length / AES_BLOCK_SIZE, CHUNK_BLOCKS);
+        size_t bytes = blocks * AES_BLOCK_SIZE;
+
+        for (size_t i = 0; i < blocks; i++) {
+            memcpy(buf + i * AES_BLOCK_SIZE, ivec, AES_BLOCK_SIZE);
+            ctr128_inc(ivec);
+        }
+        encrypt_blocks(key, buf, buf, blocks);
+
+        for (size_t i = 0; i < bytes; i++)
+            out[i] = in[i] ^ buf[i];
+
+        in += bytes;
+        out += bytes;
+        length -= bytes;
+    }
+
+    if (length) {
+        encrypt_blocks(key, ivec, ecount_buf, 1);
+        ctr128_inc(ivec);
+        while (length--) {
+            out[n] = in[n] ^ ecount_buf[n];
+            n++;
+        }
+    }
+
+    *num = n;
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <lib/aes.h>
+
+/* the table driven versions in aes_core.c */
+int aes_sw_set_encrypt_key(const unsigned char *userKey, const int bits, AES_KEY *key);
+int aes_sw_set_decrypt_key(const unsigned char *userKey, const int bits, AES_KEY *key);
+void aes_sw_encrypt(const unsigned char *in, unsigned char *out, const AES_KEY *key);
+void aes_sw_decrypt(const unsigned char *in, unsigned char *out, const AES_KEY *key);
+
+#if AES_HW_BLOCKS
+/* true if the cpu has the aes instructions */
+bool aes_hw_probe(void);
+/* true if the simd registers can be used from here */
+bool aes_hw_usable(void);
+
+/* ecb over a run of blocks with the byte schedule in hw_rd_key, in may equal out */
+void aes_hw_encrypt_blocks(const uint8_t *rk, int rounds, const uint8_t *in, uint8_t *out, size_t blocks);
+void aes_hw_decrypt_blocks(const uint8_t *rk, int rounds, const uint8_t *in, uint8_t *out, size_t blocks);
+#endif
@@ -6,6 +6,8 @@
 #ifndef AES_H
 #define AES_H
 
+#include <compiler.h>
+#include <stddef.h>
 #include <stdint.h>
 
 enum AES_KEYSIZE {
@@ -24,9 +26,19 @@ typedef struct {
 
 #else // software implementation
 
+/* cpus with aes instructions the software version can hand blocks to */
+#if ARCH_ARM64 || ARCH_X86_64
+#define AES_HW_BLOCKS 1
+#endif
+
 struct aes_key_struct_sw {
     unsigned long rd_key[60];
     int rounds;
+#if AES_HW_BLOCKS
+    /* rd_key as bytes in the order the instructions want, if hw is set */
+    uint8_t hw_rd_key[15 * 16] __ALIGNED(16);
+    int hw;
+#endif
 };
 
 typedef struct aes_key_struct_sw AES_KEY;
@@ -47,5 +59,30 @@ void AES_decrypt(const unsigned char *in, unsigned char *out,
 void AES_encrypt(const unsigned char *in, unsigned char *out,
                  const AES_KEY *key);
 
+#define AES_ENCRYPT 1
+#define AES_DECRYPT 0
+
+/*
+ * Bulk modes, with the OpenSSL calling conventions. The cipher's
+ * instructions get several blocks at a time where the mode allows it.
+ *
+ * cbc: len is a multiple of AES_BLOCK_SIZE, ivec is updated for the next call.
+ * The key is an encrypt key for AES_ENCRYPT and a decrypt key for AES_DECRYPT.
+ */
+void AES_cbc_encrypt(const unsigned char *in, unsigned char *out,
+                     size_t len, const AES_KEY *key,
+                     unsigned char *ivec, const int enc);
+
+/*
+ * ctr: ivec is the 128 bit big endian counter block, ecount_buf and num carry
+ * a partially used block between calls; start with num at 0. Both ways use
+ * the encrypt key.
+ */
+void AES_ctr128_encrypt(const unsigned char *in, unsigned char *out,
+                        size_t length, const AES_KEY *key,
+                        unsigned char ivec[AES_BLOCK_SIZE],
+                        unsigned char ecount_buf[AES_BLOCK_SIZE],
+                        unsigned int *num);
+
 
 #endif
@@ -4,6 +4,13 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 MODULE := $(LOCAL_DIR)
 
 MODULE_SRCS := \
-	$(LOCAL_DIR)/aes_core.c
+	$(LOCAL_DIR)/aes_core.c \
+	$(LOCAL_DIR)/aes_hw.c \
+	$(LOCAL_DIR)/aes_modes.c
+
+ifeq ($(ARCH),arm64)
+MODULE_SRCS += \
+	$(LOCAL_DIR)/aes_arm64.S
+endif
 
 include make/module.mk
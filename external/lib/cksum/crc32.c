@@ -202,7 +202,8 @@ const z_crc_t FAR * ZEXPORT get_crc_table()
 #define DO8 DO1; DO1; DO1; DO1; DO1; DO1; DO1; DO1
 
 /* ========================================================================= */
-unsigned long ZEXPORT crc32(crc, buf, len)
+/* crc32() itself is in crc32_hw.c, which falls back to this */
+unsigned long ZEXPORT crc32_sw(crc, buf, len)
     unsigned long crc;
     const unsigned char FAR *buf;
     uInt len;
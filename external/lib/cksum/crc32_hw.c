@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Front end for crc32() and crc32c() that uses the cpu's crc support when
+ * it has some, probed the first time through:
+ *
+ * arm64: the armv8 crc32 and crc32c instructions, 8 bytes at a time.
+ * x86-64: sse4.2 crc32 for crc32c. crc32 folds 64 byte blocks with
+ *   pclmulqdq, which needs the sse registers, so it's only used from thread
+ *   context once the fpu is up; the lazy fpu switch saves them for us.
+ *
+ * Whatever is left over, or everything on other cpus, goes through the
+ * table driven versions.
+ */
+#include <lib/cksum.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <arch/ops.h>
+
+#if ARCH_ARM64
+#include <arch/arm64.h>
+#endif
+#if ARCH_X86_64
+#include <arch/x86.h>
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+/* the zlib table version in crc32.c */
+unsigned long crc32_sw(unsigned long crc, const unsigned char *buf, unsigned int len);
+
+static const uint32_t crc32c_table[256] = {
+    0x00000000U, 0xf26b8303U, 0xe13b70f7U, 0x1350f3f4U,
+    0xc79a971fU, 0x35f1141cU, 0x26a1e7e8U, 0xd4ca64ebU,
+    0x8ad958cfU, 0x78b2dbccU, 0x6be22838U, 0x9989ab3bU,
+    0x4d43cfd0U, 0xbf284cd3U, 0xac78bf27U, 0x5e133c24U,
+    0x105ec76fU, 0xe235446cU, 0xf165b798U, 0x030e349bU,
+    0xd7c45070U, 0x25afd373U, 0x36ff2087U, 0xc494a384U,
+    0x9a879fa0U, 0x68ec1ca3U, 0x7bbcef57U, 0x89d76c54U,
+    0x5d1d08bfU, 0xaf768bbcU, 0xbc267848U, 0x4e4dfb4bU,
+    0x20bd8edeU, 0xd2d60dddU, 0xc186fe29U, 0x33ed7d2aU,
+    0xe72719c1U, 0x154c9ac2U, 0x061c6936U, 0xf477ea35U,
+    0xaa64d611U, 0x580f5512U, 0x4b5fa6e6U, 0xb93425e5U,
+    0x6dfe410eU, 0x9f95c20dU, 0x8cc531f9U, 0x7eaeb2faU,
+    0x30e349b1U, 0xc288cab2U, 0xd1d83946U, 0x23b3ba45U,
+    0xf779deaeU, 0x05125dadU, 0x1642ae59U, 0xe4292d5aU,
+    0xba3a117eU, 0x4851927dU, 0x5b016189U, 0xa96ae28aU,
+    0x7da08661U, 0x8fcb0562U, 0x9c9bf696U, 0x6ef07595U,
+    0x417b1dbcU, 0xb3109ebfU, 0xa0406d4bU, 0x522bee48U,
+    0x86e18aa3U, 0x748a09a0U, 0x67dafa54U, 0x95b17957U,
+    0xcba24573U, 0x39c9c670U, 0x2a993584U, 0xd8f2b687U,
+    0x0c38d26cU, 0xfe53516fU, 0xed03a29bU, 0x1f682198U,
+    0x5125dad3U, 0xa34e59d0U, 0xb01eaa24U, 0x42752927U,
+    0x96bf4dccU, 0x64d4cecfU, 0x77843d3bU, 0x85efbe38U,
+    0xdbfc821cU, 0x2997011fU, 0x3ac7f2ebU, 0xc8ac71e8U,
+    0x1c661503U, 0xee0d9600U, 0xfd5d65f4U, 0x0f36e6f7U,
+    0x61c69362U, 0x93ad1061U, 0x80fde395U, 0x72966096U,
+    0xa65c047dU, 0x5437877eU, 0x4767748aU, 0xb50cf789U,
+    0xeb1fcbadU, 0x197448aeU, 0x0a24bb5aU, 0xf84f3859U,
+    0x2c855cb2U, 0xdeeedfb1U, 0xcdbe2c45U, 0x3fd5af46U,
+    0x7198540dU, 0x83f3d70eU, 0x90a324faU, 0x62c8a7f9U,
+    0xb602c312U, 0x44694011U, 0x5739b3e5U, 0xa55230e6U,
+    0xfb410cc2U, 0x092a8fc1U, 0x1a7a7c35U, 0xe811ff36U,
+    0x3cdb9bddU, 0xceb018deU, 0xdde0eb2aU, 0x2f8b6829U,
+    0x82f63b78U, 0x709db87bU, 0x63cd4b8fU, 0x91a6c88cU,
+    0x456cac67U, 0xb7072f64U, 0xa457dc90U, 0x563c5f93U,
+    0x082f63b7U, 0xfa44e0b4U, 0xe9141340U, 0x1b7f9043U,
+    0xcfb5f4a8U, 0x3dde77abU, 0x2e8e845fU, 0xdce5075cU,
+    0x92a8fc17U, 0x60c37f14U, 0x73938ce0U, 0x81f80fe3U,
+    0x55326b08U, 0xa759e80bU, 0xb4091bffU, 0x466298fcU,
+    0x1871a4d8U, 0xea1a27dbU, 0xf94ad42fU, 0x0b21572cU,
+    0xdfeb33c7U, 0x2d80b0c4U, 0x3ed04330U, 0xccbbc033U,
+    0xa24bb5a6U, 0x502036a5U, 0x4370c551U, 0xb11b4652U,
+    0x65d122b9U, 0x97baa1baU, 0x84ea524eU, 0x7681d14dU,
+    0x2892ed69U, 0xdaf96e6aU, 0xc9a99d9eU, 0x3bc21e9dU,
+    0xef087a76U, 0x1d63f975U, 0x0e330a81U, 0xfc588982U,
+    0xb21572c9U, 0x407ef1caU, 0x532e023eU, 0xa145813dU,
+    0x758fe5d6U, 0x87e466d5U, 0x94b49521U, 0x66df1622U,
+    0x38cc2a06U, 0xcaa7a905U, 0xd9f75af1U, 0x2b9cd9f2U,
+    0xff56bd19U, 0x0d3d3e1aU, 0x1e6dcdeeU, 0xec064eedU,
+    0xc38d26c4U, 0x31e6a5c7U, 0x22b65633U, 0xd0ddd530U,
+    0x0417b1dbU, 0xf67c32d8U, 0xe52cc12cU, 0x1747422fU,
+    0x49547e0bU, 0xbb3ffd08U, 0xa86f0efcU, 0x5a048dffU,
+    0x8ecee914U, 0x7ca56a17U, 0x6ff599e3U, 0x9d9e1ae0U,
+    0xd3d3e1abU, 0x21b862a8U, 0x32e8915cU, 0xc083125fU,
+    0x144976b4U, 0xe622f5b7U, 0xf5720643U, 0x07198540U,
+    0x590ab964U, 0xab613a67U, 0xb831c993U, 0x4a5a4a90U,
+    0x9e902e7bU, 0x6cfbad78U, 0x7fab5e8cU, 0x8dc0dd8fU,
+    0xe330a81aU, 0x115b2b19U, 0x020bd8edU, 0xf0605beeU,
+    0x24aa3f05U, 0xd6c1bc06U, 0xc5914ff2U, 0x37faccf1U,
+    0x69e9f0d5U, 0x9b8273d6U, 0x88d28022U, 0x7ab90321U,
+    0xae7367caU, 0x5c18e4c9U, 0x4f48173dU, 0xbd23943eU,
+    0xf36e6f75U, 0x0105ec76U, 0x12551f82U, 0xe03e9c81U,
+    0x34f4f86aU, 0xc69f7b69U, 0xd5cf889dU, 0x27a40b9eU,
+    0x79b737baU, 0x8bdcb4b9U, 0x988c474dU, 0x6ae7c44eU,
+    0xbe2da0a5U, 0x4c4623a6U, 0x5f16d052U, 0xad7d5351U,
+};
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *buf, size_t len)
+{
+    while (len--)
+        crc = crc32c_table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+static volatile bool probed;
+static bool have_crc32;
+static bool have_crc32c;
+
+#if ARCH_ARM64
+#define ID_AA64ISAR0_CRC32_SHIFT 16
+
+static void probe(void)
+{
+    uint64_t isar0 = ARM64_READ_SYSREG(id_aa64isar0_el1);
+
+    have_crc32 = have_crc32c = ((isar0 >> ID_AA64ISAR0_CRC32_SHIFT) & 0xf) != 0;
+}
+
+/* the instructions take the crc uninverted, same as the inner loop of the table version */
+#define ARM64_CRC_LOOP(insn, insn_b) \
+    while (len >= 8) { \
+        uint64_t v; \
+        __builtin_memcpy(&v, buf, 8); \
+        __asm__(".arch_extension crc\n" insn " %w0, %w0, %x1" : "+r" (crc) : "r" (v)); \
+        buf += 8; \
+        len -= 8; \
+    } \
+    while (len--) \
+        __asm__(".arch_extension crc\n" insn_b " %w0, %w0, %w1" : "+r" (crc) : "r" ((uint32_t)*buf++)); \
+    return crc;
+
+static uint32_t crc32_hw(uint32_t crc, const unsigned char *buf, size_t len)
+{
+    ARM64_CRC_LOOP("crc32x", "crc32b");
+}
+
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *buf, size_t len)
+{
+    ARM64_CRC_LOOP("crc32cx", "crc32cb");
+}
+
+#elif ARCH_X86_64
+#define CPUID_1_ECX_PCLMULQDQ (1 << 1)
+#define CPUID_1_ECX_SSE4_2 (1 << 20)
+
+static void probe(void)
+{
+    uint32_t a = 1, b, c, d;
+
+    __asm__ __volatile__ ("cpuid" : "+a" (a), "=b" (b), "=c" (c), "=d" (d) : "c" (0));
+
+    have_crc32 = c & CPUID_1_ECX_PCLMULQDQ;
+    have_crc32c = c & CPUID_1_ECX_SSE4_2;
+}
+
+/*
+ * Carry-less multiply folding, after Intel's "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction". The constants are
+ * x^n mod P for the bit reflected crc32 polynomial: four 128 bit lanes are
+ * folded forward 512 bits at a time, merged down to one, then reduced to
+ * 32 bits with a Barrett reduction. Takes a multiple of 16 bytes, at least 64.
+ */
+__attribute__((target("pclmul,sse2")))
+static uint32_t crc32_pclmul(uint32_t crc, const unsigned char *buf, size_t len)
+{
+    const __m128i k1k2 = _mm_set_epi64x(0x1c6e41596, 0x154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x0ccaa009e, 0x1751997d0);
+    const __m128i k5 = _mm_set_epi64x(0, 0x163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x1f7011641, 0x1db710641);
+    const __m128i mask32 = _mm_set_epi32(0, 0, 0, ~0);
+
+    __m128i x0 = _mm_loadu_si128((const __m128i *)buf + 0);
+    __m128i x1 = _mm_loadu_si128((const __m128i *)buf + 1);
+    __m128i x2 = _mm_loadu_si128((const __m128i *)buf + 2);
+    __m128i x3 = _mm_loadu_si128((const __m128i *)buf + 3);
+    x0 = _mm_xor_si128(x0, _mm_cvtsi32_si128(crc));
+    buf += 64;
+    len -= 64;
+
+#define FOLD(x, k, data) \
+    _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11)), data)
+
+    for (; len >= 64; buf += 64, len -= 64) {
+        x0 = FOLD(x0, k1k2, _mm_loadu_si128((const __m128i *)buf + 0));
+        x1 = FOLD(x1, k1k2, _mm_loadu_si128((const __m128i *)buf + 1));
+        x2 = FOLD(x2, k1k2, _mm_loadu_si128((const __m128i *)buf + 2));
+        x3 = FOLD(x3, k1k2, _mm_loadu_si128((const __m128i *)buf + 3));
+    }
+
+    x0 = FOLD(x0, k3k4, x1);
+    x0 = FOLD(x0, k3k4, x2);
+    x0 = FOLD(x0, k3k4, x3);
+
+    for (; len >= 16; buf += 16, len -= 16)
+        x0 = FOLD(x0, k3k4, _mm_loadu_si128((const __m128i *)buf));
+#undef FOLD
+
+    /* 128 -> 64 bits */
+    x0 = _mm_xor_si128(_mm_clmulepi64_si128(x0, k3k4, 0x10), _mm_srli_si128(x0, 8));
+
+    /* 64 -> 32 bits */
+    x0 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x0, mask32), k5, 0x00), _mm_srli_si128(x0, 4));
+
+    /* Barrett reduction */
+    __m128i t = _mm_clmulepi64_si128(_mm_and_si128(x0, mask32), poly, 0x10);
+    t = _mm_clmulepi64_si128(_mm_and_si128(t, mask32), poly, 0x00);
+    x0 = _mm_xor_si128(x0, t);
+
+    return _mm_cvtsi128_si32(_mm_srli_si128(x0, 4));
+}
+
+static uint32_t crc32_hw(uint32_t crc, const unsigned char *buf, size_t len)
+{
+    /* the sse state can only be borrowed from a thread, and not before fpu_init */
+    if (len < 64 || arch_ints_disabled() || !(x86_get_cr4() & X86_CR4_OSFXSR))
+        return ~crc32_sw(~crc, buf, len);
+
+    size_t blocks = len & ~(size_t)15;
+    crc = crc32_pclmul(crc, buf, blocks);
+    return ~crc32_sw(~crc, buf + blocks, len - blocks);
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *buf, size_t len)
+{
+    uint64_t c = crc;
+
+    while (len >= 8) {
+        uint64_t v;
+        __builtin_memcpy(&v, buf, 8);
+        c = __builtin_ia32_crc32di(c, v);
+        buf += 8;
+        len -= 8;
+    }
+    crc = c;
+    while (len--)
+        crc = __builtin_ia32_crc32qi(crc, *buf++);
+    return crc;
+}
+
+#else
+static void probe(void) {}
+static uint32_t crc32_hw(uint32_t crc, const unsigned char *buf, size_t len) { return 0; }
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *buf, size_t len) { return 0; }
+#endif
+
+static inline void probe_once(void)
+{
+    /* harmless if two cpus race through here, they'll find the same thing */
+    if (unlikely(!probed)) {
+        probe();
+        probed = true;
+    }
+}
+
+unsigned long crc32(unsigned long crc, const unsigned char *buf, unsigned int len)
+{
+    if (!buf)
+        return 0;
+
+    probe_once();
+    if (have_crc32)
+        return ~crc32_hw(~(uint32_t)crc, buf, len) & 0xffffffff;
+
+    return crc32_sw(crc, buf, len);
+}
+
+unsigned long crc32c(unsigned long crc, const unsigned char *buf, unsigned int len)
+{
+    if (!buf)
+        return 0;
+
+    probe_once();
+    if (have_crc32c)
+        return ~crc32c_hw(~(uint32_t)crc, buf, len) & 0xffffffff;
+
+    return ~crc32c_sw(~(uint32_t)crc, buf, len) & 0xffffffff;
+}
@@ -34,6 +34,7 @@
 
 static int cmd_crc16(int argc, const cmd_args *argv);
 static int cmd_crc32(int argc, const cmd_args *argv);
+static int cmd_crc32c(int argc, const cmd_args *argv);
 static int cmd_adler32(int argc, const cmd_args *argv);
 static int cmd_cksum_bench(int argc, const cmd_args *argv);
 
@@ -41,6 +42,7 @@ STATIC_COMMAND_START
 #if LK_DEBUGLEVEL > 0
 STATIC_COMMAND("crc16", "crc16", &cmd_crc16)
 STATIC_COMMAND("crc32", "crc32", &cmd_crc32)
+STATIC_COMMAND("crc32c", "crc32c", &cmd_crc32c)
 STATIC_COMMAND("adler32", "adler32", &cmd_adler32)
 #endif
 #if LK_DEBUGLEVEL > 1
@@ -78,6 +80,21 @@ static int cmd_crc32(int argc, const cmd_args *argv)
     return 0;
 }
 
+static int cmd_crc32c(int argc, const cmd_args *argv)
+{
+    if (argc < 3) {
+        printf("not enough arguments\n");
+        printf("usage: %s <address> <size>\n", argv[0].str);
+        return -1;
+    }
+
+    uint32_t crc = crc32c(0, argv[1].p, argv[2].u);
+
+    printf("0x%x\n", crc);
+
+    return 0;
+}
+
 static int cmd_adler32(int argc, const cmd_args *argv)
 {
     if (argc < 3) {
@@ -126,6 +143,16 @@ static int cmd_cksum_bench(int argc, const cmd_args *argv)
     printf("took %llu usecs to crc32 %d bytes (%lld bytes/sec)\n", t, BUFSIZE * ITER, (BUFSIZE * ITER) * 1000000ULL / t);
     thread_sleep(500);
 
+    t = current_time_hires();
+    crc = 0;
+    for (int i = 0; i < ITER; i++) {
+        crc = crc32c(crc, buf, BUFSIZE);
+    }
+    t = current_time_hires() - t;
+
+    printf("took %llu usecs to crc32c %d bytes (%lld bytes/sec)\n", t, BUFSIZE * ITER, (BUFSIZE * ITER) * 1000000ULL / t);
+    thread_sleep(500);
+
     t = current_time_hires();
     crc = 0;
     for (int i = 0; i < ITER; i++) {
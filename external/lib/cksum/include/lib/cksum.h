@@ -20,8 +20,15 @@ unsigned short crc16(const unsigned char *buf, unsigned int length);
  */
 unsigned short update_crc16(unsigned short crc, const unsigned char *buf, unsigned int len);
 
+/*
+ * zlib compatible crc32, start with crc 0. Uses the cpu's crc instructions
+ * where there are any.
+ */
 unsigned long crc32(unsigned long crc, const unsigned char *buf, unsigned int len);
 
+/* the same with the Castagnoli polynomial, as used by iSCSI, ext4 and btrfs */
+unsigned long crc32c(unsigned long crc, const unsigned char *buf, unsigned int len);
+
 unsigned long adler32(unsigned long adler, const unsigned char *buf, unsigned int len);
 
 __END_CDECLS
@@ -6,6 +6,7 @@ MODULE_SRCS += \
 	$(LOCAL_DIR)/adler32.c \
 	$(LOCAL_DIR)/crc16.c \
 	$(LOCAL_DIR)/crc32.c \
+	$(LOCAL_DIR)/crc32_hw.c \
 	$(LOCAL_DIR)/debug.c
 
 MODULE_CFLAGS += -Wno-strict-prototypes
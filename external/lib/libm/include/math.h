@@ -19,6 +19,7 @@
 
 #include <sys/cdefs.h>
 #include <limits.h>
+#include <stddef.h>
 
 __BEGIN_DECLS
 #pragma GCC visibility push(default)
@@ -468,6 +469,14 @@ void sincosf(float, float*, float*);
 void sincosl(long double, long double*, long double*);
 #endif /* _GNU_SOURCE */
 
+/*
+ * array versions, out[i] = f(in[i]) for i < n. out may be in.
+ */
+void    vsinf(float *, const float *, size_t);
+void    vcosf(float *, const float *, size_t);
+void    vexpf(float *, const float *, size_t);
+void    vlogf(float *, const float *, size_t);
+
 #pragma GCC visibility pop
 __END_DECLS
 
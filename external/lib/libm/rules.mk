@@ -40,5 +40,6 @@ MODULE_SRCS += \
 	$(LOCAL_DIR)/s_trunc.c \
 	$(LOCAL_DIR)/s_atan.c \
 	$(LOCAL_DIR)/e_atan2.c \
+	$(LOCAL_DIR)/v_mathf.c \
 
 include make/module.mk
@@ -0,0 +1,388 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Array versions of sinf, cosf, expf and logf for code that runs them over
+ * whole buffers of samples. Four lanes at a time with NEON or SSE2, one at a
+ * time in plain C otherwise, using the cephes single precision polynomials.
+ * exp and log are within 1 ulp. sin and cos are within 1e-7 absolute, which
+ * is a couple of ulp except close to their zeros away from 0. Lanes outside
+ * the range the polynomials handle (huge sin/cos arguments, exp over/underflow,
+ * log of non positive, denormal or non finite input) take the scalar routines,
+ * so the special cases behave exactly as they do there.
+ *
+ * in and out may be the same array.
+ */
+
+#include <compiler.h>
+#include <float.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "math.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+
+#define VLEN 4
+typedef float32x4_t vf;
+typedef uint32x4_t vu;
+
+static inline vf vf_load(const float *p) { return vld1q_f32(p); }
+static inline void vf_store(float *p, vf a) { vst1q_f32(p, a); }
+static inline vf vf_dup(float a) { return vdupq_n_f32(a); }
+static inline vf vf_add(vf a, vf b) { return vaddq_f32(a, b); }
+static inline vf vf_sub(vf a, vf b) { return vsubq_f32(a, b); }
+static inline vf vf_mul(vf a, vf b) { return vmulq_f32(a, b); }
+static inline vf vf_madd(vf a, vf b, vf c) { return vmlaq_f32(c, a, b); }
+static inline vu vf_le(vf a, vf b) { return vcleq_f32(a, b); }
+static inline vu vf_lt(vf a, vf b) { return vcltq_f32(a, b); }
+static inline vf vf_from_int(vu a) { return vcvtq_f32_s32(vreinterpretq_s32_u32(a)); }
+static inline vu vf_bits(vf a) { return vreinterpretq_u32_f32(a); }
+static inline vf vu_float(vu a) { return vreinterpretq_f32_u32(a); }
+static inline vu vu_dup(uint32_t a) { return vdupq_n_u32(a); }
+static inline vu vu_add(vu a, vu b) { return vaddq_u32(a, b); }
+static inline vu vu_sub(vu a, vu b) { return vsubq_u32(a, b); }
+static inline vu vu_and(vu a, vu b) { return vandq_u32(a, b); }
+static inline vu vu_or(vu a, vu b) { return vorrq_u32(a, b); }
+static inline vu vu_xor(vu a, vu b) { return veorq_u32(a, b); }
+static inline vf vf_sel(vu m, vf a, vf b) { return vbslq_f32(m, a, b); }
+#define vu_shl(a, n) vshlq_n_u32(a, n)
+#define vu_shr(a, n) vshrq_n_u32(a, n)
+
+static inline bool vu_all(vu m)
+{
+    uint32x2_t t = vand_u32(vget_low_u32(m), vget_high_u32(m));
+    return (vget_lane_u32(t, 0) & vget_lane_u32(t, 1)) == 0xffffffff;
+}
+
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+
+#define VLEN 4
+typedef __m128 vf;
+typedef __m128i vu;
+
+static inline vf vf_load(const float *p) { return _mm_loadu_ps(p); }
+static inline void vf_store(float *p, vf a) { _mm_storeu_ps(p, a); }
+static inline vf vf_dup(float a) { return _mm_set1_ps(a); }
+static inline vf vf_add(vf a, vf b) { return _mm_add_ps(a, b); }
+static inline vf vf_sub(vf a, vf b) { return _mm_sub_ps(a, b); }
+static inline vf vf_mul(vf a, vf b) { return _mm_mul_ps(a, b); }
+static inline vf vf_madd(vf a, vf b, vf c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+static inline vu vf_le(vf a, vf b) { return _mm_castps_si128(_mm_cmple_ps(a, b)); }
+static inline vu vf_lt(vf a, vf b) { return _mm_castps_si128(_mm_cmplt_ps(a, b)); }
+static inline vf vf_from_int(vu a) { return _mm_cvtepi32_ps(a); }
+static inline vu vf_bits(vf a) { return _mm_castps_si128(a); }
+static inline vf vu_float(vu a) { return _mm_castsi128_ps(a); }
+static inline vu vu_dup(uint32_t a) { return _mm_set1_epi32(a); }
+static inline vu vu_add(vu a, vu b) { return _mm_add_epi32(a, b); }
+static inline vu vu_sub(vu a, vu b) { return _mm_sub_epi32(a, b); }
+static inline vu vu_and(vu a, vu b) { return _mm_and_si128(a, b); }
+static inline vu vu_or(vu a, vu b) { return _mm_or_si128(a, b); }
+static inline vu vu_xor(vu a, vu b) { return _mm_xor_si128(a, b); }
+#define vu_shl(a, n) _mm_slli_epi32(a, n)
+#define vu_shr(a, n) _mm_srli_epi32(a, n)
+
+static inline vf vf_sel(vu m, vf a, vf b)
+{
+    __m128 mf = _mm_castsi128_ps(m);
+    return _mm_or_ps(_mm_and_ps(mf, a), _mm_andnot_ps(mf, b));
+}
+
+static inline bool vu_all(vu m)
+{
+    return _mm_movemask_ps(_mm_castsi128_ps(m)) == 0xf;
+}
+
+#else
+
+/* no simd, one lane of the same arithmetic */
+#define VLEN 1
+typedef float vf;
+typedef uint32_t vu;
+
+static inline vu vf_bits(vf a)
+{
+    union { float f; uint32_t u; } x = { .f = a };
+    return x.u;
+}
+
+static inline vf vu_float(vu a)
+{
+    union { float f; uint32_t u; } x = { .u = a };
+    return x.f;
+}
+
+static inline vf vf_load(const float *p) { return *p; }
+static inline void vf_store(float *p, vf a) { *p = a; }
+static inline vf vf_dup(float a) { return a; }
+static inline vf vf_add(vf a, vf b) { return a + b; }
+static inline vf vf_sub(vf a, vf b) { return a - b; }
+static inline vf vf_mul(vf a, vf b) { return a * b; }
+static inline vf vf_madd(vf a, vf b, vf c) { return a * b + c; }
+static inline vu vf_le(vf a, vf b) { return (a <= b) ? 0xffffffff : 0; }
+static inline vu vf_lt(vf a, vf b) { return (a < b) ? 0xffffffff : 0; }
+static inline vf vf_from_int(vu a) { return (float)(int32_t)a; }
+static inline vu vu_dup(uint32_t a) { return a; }
+static inline vu vu_add(vu a, vu b) { return a + b; }
+static inline vu vu_sub(vu a, vu b) { return a - b; }
+static inline vu vu_and(vu a, vu b) { return a & b; }
+static inline vu vu_or(vu a, vu b) { return a | b; }
+static inline vu vu_xor(vu a, vu b) { return a ^ b; }
+static inline vf vf_sel(vu m, vf a, vf b) { return vu_float((m & vf_bits(a)) | (~m & vf_bits(b))); }
+static inline bool vu_all(vu m) { return m == 0xffffffff; }
+#define vu_shl(a, n) ((a) << (n))
+#define vu_shr(a, n) ((a) >> (n))
+
+#endif
+
+/* adding and subtracting 1.5 * 2^23 rounds to the nearest integer, which is
+ * then also sitting in the low bits of the sum */
+static const float round_magic = 12582912.0f;
+
+static inline vf vf_round(vf x, vu *n)
+{
+    vf t = vf_add(x, vf_dup(round_magic));
+    *n = vu_sub(vf_bits(t), vf_bits(vf_dup(round_magic)));
+    return vf_sub(t, vf_dup(round_magic));
+}
+
+static inline vf vf_abs(vf x)
+{
+    return vu_float(vu_and(vf_bits(x), vu_dup(0x7fffffff)));
+}
+
+/*
+ * sin and cos. x is reduced by multiples of pi/2, split in three so the
+ * products stay exact for |x| up to SINCOS_MAX, then the quadrant picks
+ * which polynomial and sign to use. cos is sin one quadrant later.
+ */
+#define SINCOS_MAX 8192.0f
+
+static const float
+two_over_pi = 6.3661977236e-01f,
+pio2_1 = 1.5703125f,
+pio2_2 = 4.837512969970703125e-4f,
+pio2_3 = 7.54978995489188216e-8f,
+S1 = -1.6666654611e-1f,
+S2 = 8.3321608736e-3f,
+S3 = -1.9515295891e-4f,
+C1 = 4.166664568298827e-2f,
+C2 = -1.388731625493765e-3f,
+C3 = 2.443315711809948e-5f;
+
+static inline vf v_sincos(vf x, uint32_t quadrant)
+{
+    vu q;
+    vf n = vf_round(vf_mul(x, vf_dup(two_over_pi)), &q);
+    q = vu_add(q, vu_dup(quadrant));
+
+    vf r = vf_madd(n, vf_dup(-pio2_1), x);
+    r = vf_madd(n, vf_dup(-pio2_2), r);
+    r = vf_madd(n, vf_dup(-pio2_3), r);
+    vf z = vf_mul(r, r);
+
+    vf s = vf_madd(z, vf_dup(S3), vf_dup(S2));
+    s = vf_madd(s, z, vf_dup(S1));
+    s = vf_madd(vf_mul(s, z), r, r);
+
+    vf c = vf_madd(z, vf_dup(C3), vf_dup(C2));
+    c = vf_madd(c, z, vf_dup(C1));
+    c = vf_mul(vf_mul(c, z), z);
+    c = vf_add(vf_madd(z, vf_dup(-0.5f), vf_dup(1.0f)), c);
+
+    /* odd quadrants use the cos polynomial, the upper two are negated */
+    vu odd = vu_sub(vu_dup(0), vu_and(q, vu_dup(1)));
+    vf res = vf_sel(odd, c, s);
+    vu sign = vu_shl(vu_and(q, vu_dup(2)), 30);
+    return vu_float(vu_xor(vf_bits(res), sign));
+}
+
+static inline vf v_sin(vf x) { return v_sincos(x, 0); }
+static inline vf v_cos(vf x) { return v_sincos(x, 1); }
+
+static inline vu v_sincos_ok(vf x)
+{
+    return vf_le(vf_abs(x), vf_dup(SINCOS_MAX));
+}
+
+/*
+ * exp. x = k ln2 + r with |r| <= ln2 / 2, e^r from a polynomial, 2^k built
+ * straight into the exponent field. The fast path keeps 2^k normal.
+ */
+#define EXP_MAX 87.0f
+
+static const float
+log2e = 1.44269504088896341f,
+ln2_hi = 6.93359375e-1f,
+ln2_lo = -2.12194440e-4f,
+E0 = 1.9875691500e-4f,
+E1 = 1.3981999507e-3f,
+E2 = 8.3334519073e-3f,
+E3 = 4.1665795894e-2f,
+E4 = 1.6666665459e-1f,
+E5 = 5.0000001201e-1f;
+
+static inline vf v_exp(vf x)
+{
+    vu k;
+    vf n = vf_round(vf_mul(x, vf_dup(log2e)), &k);
+
+    vf r = vf_madd(n, vf_dup(-ln2_hi), x);
+    r = vf_madd(n, vf_dup(-ln2_lo), r);
+    vf z = vf_mul(r, r);
+
+    vf p = vf_madd(r, vf_dup(E0), vf_dup(E1));
+    p = vf_madd(p, r, vf_dup(E2));
+    p = vf_madd(p, r, vf_dup(E3));
+    p = vf_madd(p, r, vf_dup(E4));
+    p = vf_madd(p, r, vf_dup(E5));
+    p = vf_add(vf_madd(p, z, r), vf_dup(1.0f));
+
+    vf scale = vu_float(vu_shl(vu_add(k, vu_dup(127)), 23));
+    return vf_mul(p, scale);
+}
+
+static inline vu v_exp_ok(vf x)
+{
+    return vf_le(vf_abs(x), vf_dup(EXP_MAX));
+}
+
+/*
+ * log. x = 2^e * m with m in [sqrt(1/2), sqrt(2)), log(1 + f) for f = m - 1
+ * from a polynomial, e * ln2 added back in two parts.
+ */
+static const float
+sqrt_half = 7.0710678118654752440e-1f,
+L0 = 7.0376836292e-2f,
+L1 = -1.1514610310e-1f,
+L2 = 1.1676998740e-1f,
+L3 = -1.2420140846e-1f,
+L4 = 1.4249322787e-1f,
+L5 = -1.6668057665e-1f,
+L6 = 2.0000714765e-1f,
+L7 = -2.4999993993e-1f,
+L8 = 3.3333331174e-1f;
+
+static inline vf v_log(vf x)
+{
+    vu ix = vf_bits(x);
+    vu e = vu_sub(vu_shr(ix, 23), vu_dup(126));
+    vf m = vu_float(vu_or(vu_and(ix, vu_dup(0x007fffff)), vu_dup(0x3f000000)));
+
+    /* m is in [0.5, 1), below sqrt(1/2) double it and take one off e */
+    vu small = vf_lt(m, vf_dup(sqrt_half));
+    e = vu_add(e, small);
+    vf f = vf_sub(vf_add(m, vu_float(vu_and(small, vf_bits(m)))), vf_dup(1.0f));
+    vf ef = vf_from_int(e);
+    vf z = vf_mul(f, f);
+
+    vf p = vf_madd(f, vf_dup(L0), vf_dup(L1));
+    p = vf_madd(p, f, vf_dup(L2));
+    p = vf_madd(p, f, vf_dup(L3));
+    p = vf_madd(p, f, vf_dup(L4));
+    p = vf_madd(p, f, vf_dup(L5));
+    p = vf_madd(p, f, vf_dup(L6));
+    p = vf_madd(p, f, vf_dup(L7));
+    p = vf_madd(p, f, vf_dup(L8));
+
+    vf y = vf_mul(vf_mul(p, z), f);
+    y = vf_madd(ef, vf_dup(ln2_lo), y);
+    y = vf_madd(z, vf_dup(-0.5f), y);
+    return vf_madd(ef, vf_dup(ln2_hi), vf_add(f, y));
+}
+
+static inline vu v_log_ok(vf x)
+{
+    vu ok = vf_le(vf_dup(FLT_MIN), x);
+    return vu_and(ok, vf_le(x, vf_dup(FLT_MAX)));
+}
+
+/* libm has no single precision exp and log, the double ones are close enough here */
+static float exp_slow(float x) { return exp(x); }
+static float log_slow(float x) { return log(x); }
+
+static inline __ALWAYS_INLINE void
+v_apply(float *out, const float *in, size_t n, vf (*fn)(vf), vu (*ok)(vf),
+        float (*slow)(float))
+{
+    float buf[VLEN];
+    size_t i = 0;
+
+    for (;;) {
+        vf x;
+        size_t count = VLEN;
+
+        if (i + VLEN <= n) {
+            x = vf_load(in + i);
+        } else if (i < n) {
+            /* the last partial vector, padded with something every path takes */
+            count = n - i;
+            for (size_t j = 0; j < VLEN; j++)
+                buf[j] = (j < count) ? in[i + j] : 1.0f;
+            x = vf_load(buf);
+        } else {
+            break;
+        }
+
+        vf y;
+        if (vu_all(ok(x))) {
+            y = fn(x);
+        } else {
+            vf_store(buf, x);
+            for (size_t j = 0; j < VLEN; j++)
+                buf[j] = slow(buf[j]);
+            y = vf_load(buf);
+        }
+
+        if (count == VLEN) {
+            vf_store(out + i, y);
+        } else {
+            vf_store(buf, y);
+            memcpy(out + i, buf, count * sizeof(float));
+        }
+        i += count;
+    }
+}
+
+void vsinf(float *out, const float *in, size_t n)
+{
+    v_apply(out, in, n, v_sin, v_sincos_ok, sinf);
+}
+
+void vcosf(float *out, const float *in, size_t n)
+{
+    v_apply(out, in, n, v_cos, v_sincos_ok, cosf);
+}
+
+void vexpf(float *out, const float *in, size_t n)
+{
+    v_apply(out, in, n, v_exp, v_exp_ok, exp_slow);
+}
+
+void vlogf(float *out, const float *in, size_t n)
+{
+    v_apply(out, in, n, v_log, v_log_ok, log_slow);
+}
@@ -4,6 +4,7 @@
 #include <kernel/thread.h>
 #include <kernel/semaphore.h>
 #include <kernel/mutex.h>
+#include <kernel/port.h>
 
 #define MBOX_MAGIC 'mbox'
 
@@ -13,16 +14,10 @@ typedef mutex_t sys_mutex_t;
 typedef struct {
 	uint32_t magic;
 
-	semaphore_t empty;
-	semaphore_t full;
-	mutex_t lock;
-
-	int head;
-	int tail;
-
-	int size;
-
-	void **queue;
+	/* messages go through a unicast port, posters wait on space while it's full */
+	port_t write_port;
+	port_t read_port;
+	semaphore_t space;
 } sys_mbox_t;
 
 typedef thread_t * sys_thread_t;
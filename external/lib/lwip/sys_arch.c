@@ -6,6 +6,11 @@
 #include <trace.h>
 #include <err.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <compiler.h>
+#include <arch/ops.h>
+#include <kernel/port.h>
 #include <lk/init.h>
 
 #define LOCAL_TRACE 1
@@ -62,88 +67,99 @@ u32_t sys_arch_sem_wait(sys_sem_t * sem, u32_t timeout)
     return current_time() - start;
 }
 
+/* a port buffer holds PORT_BUFF_SIZE (8) packets, or 64 if it is made big */
+#define MBOX_PORT_SMALL 8
+#define MBOX_PORT_BIG   64
+
+STATIC_ASSERT(sizeof(void *) <= sizeof(port_packet_t));
+
+static volatile int mbox_id;
+
 err_t sys_mbox_new(sys_mbox_t * mbox, int size)
 {
-    sem_init(&mbox->empty, size);
-    sem_init(&mbox->full, 0);
-    mutex_init(&mbox->lock);
+    char name[PORT_NAME_LEN];
+    status_t err;
 
-    mbox->magic = MBOX_MAGIC;
-    mbox->head = 0;
-    mbox->tail = 0;
-    mbox->size = size;
+    bool big = size > MBOX_PORT_SMALL;
+    if (size <= 0 || size > MBOX_PORT_BIG)
+        size = big ? MBOX_PORT_BIG : MBOX_PORT_SMALL;
 
-    mbox->queue = calloc(size, sizeof(void *));
-    if (!mbox->queue)
+    /* ports are named, make up one nobody else is using */
+    do {
+        snprintf(name, sizeof(name), "lwmb%x", atomic_add(&mbox_id, 1) & 0xfffffff);
+        err = port_create(name, PORT_MODE_UNICAST | (big ? PORT_MODE_BIG_BUFFER : 0),
+                          &mbox->write_port);
+    } while (err == ERR_ALREADY_EXISTS || err == ERR_BUSY);
+    if (err < 0)
         return ERR_MEM;
 
+    err = port_open(name, NULL, &mbox->read_port);
+    if (err < 0) {
+        port_close(mbox->write_port);
+        port_destroy(mbox->write_port);
+        return ERR_MEM;
+    }
+
+    sem_init(&mbox->space, size);
+    mbox->magic = MBOX_MAGIC;
+
     return ERR_OK;
 }
 
 void sys_mbox_free(sys_mbox_t *mbox)
 {
-    free(mbox->queue);
-    mbox->queue = NULL;
+    port_close(mbox->write_port);
+    port_close(mbox->read_port);
+    port_destroy(mbox->write_port);
+    sem_destroy(&mbox->space);
 }
 
-void sys_mbox_post(sys_mbox_t * mbox, void *msg)
+static void mbox_write(sys_mbox_t *mbox, void *msg)
 {
-    sem_wait(&mbox->empty);
-    mutex_acquire(&mbox->lock);
+    port_packet_t pk;
 
-    mbox->queue[mbox->head] = msg;
-    mbox->head = (mbox->head + 1) % mbox->size;
+    memcpy(pk.value, &msg, sizeof(msg));
 
-    mutex_release(&mbox->lock);
-    sem_post(&mbox->full, true);
+    /* the space semaphore keeps the port from ever filling up */
+    __UNUSED status_t err = port_write(mbox->write_port, &pk, 1);
+    DEBUG_ASSERT(err == NO_ERROR);
 }
 
-u32_t sys_arch_mbox_tryfetch(sys_mbox_t * mbox, void **msg)
+static status_t mbox_read(sys_mbox_t *mbox, void **msg, lk_time_t timeout)
 {
-    //LTRACE_ENTRY;
+    port_result_t res;
 
-    status_t res;
+    status_t err = port_read(mbox->read_port, timeout, &res);
+    if (err < 0)
+        return err;
 
-    res = sem_trywait(&mbox->full);
-    if (res == ERR_NOT_READY) {
-        //LTRACE_EXIT;
-        return SYS_MBOX_EMPTY;
-    }
+    memcpy(msg, res.packet.value, sizeof(*msg));
+    sem_post(&mbox->space, true);
 
-    mutex_acquire(&mbox->lock);
+    return NO_ERROR;
+}
 
-    *msg = mbox->queue[mbox->tail];
-    mbox->tail = (mbox->tail + 1) % mbox->size;
+void sys_mbox_post(sys_mbox_t * mbox, void *msg)
+{
+    sem_wait(&mbox->space);
+    mbox_write(mbox, msg);
+}
 
-    mutex_release(&mbox->lock);
-    sem_post(&mbox->empty, true);
+u32_t sys_arch_mbox_tryfetch(sys_mbox_t * mbox, void **msg)
+{
+    if (mbox_read(mbox, msg, 0) < 0)
+        return SYS_MBOX_EMPTY;
 
-    //LTRACE_EXIT;
     return 0;
 }
 
 u32_t sys_arch_mbox_fetch(sys_mbox_t *mbox, void **msg, u32_t timeout)
 {
-    //LTRACE_ENTRY;
-
-    status_t res;
     lk_time_t start = current_time();
 
-    res = sem_timedwait(&mbox->full, timeout ? timeout : INFINITE_TIME);
-    if (res == ERR_TIMED_OUT) {
-        //LTRACE_EXIT;
-        return SYS_ARCH_TIMEOUT; //timeout ? SYS_ARCH_TIMEOUT : 0;
-    }
-
-    mutex_acquire(&mbox->lock);
-
-    *msg = mbox->queue[mbox->tail];
-    mbox->tail = (mbox->tail + 1) % mbox->size;
-
-    mutex_release(&mbox->lock);
-    sem_post(&mbox->empty, true);
+    if (mbox_read(mbox, msg, timeout ? timeout : INFINITE_TIME) < 0)
+        return SYS_ARCH_TIMEOUT;
 
-    //LTRACE_EXIT;
     return current_time() - start;
 }
 
@@ -151,17 +167,11 @@ err_t sys_mbox_trypost(sys_mbox_t * mbox, void *msg)
 {
     status_t res;
 
-    res = sem_trywait(&mbox->empty);
+    res = sem_trywait(&mbox->space);
     if (res == ERR_NOT_READY)
         return ERR_TIMEOUT;
 
-    mutex_acquire(&mbox->lock);
-
-    mbox->queue[mbox->head] = msg;
-    mbox->head = (mbox->head + 1) % mbox->size;
-
-    mutex_release(&mbox->lock);
-    sem_post(&mbox->full, true);
+    mbox_write(mbox, msg);
 
     return ERR_OK;
 }
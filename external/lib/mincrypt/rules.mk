@@ -4,6 +4,12 @@ MODULE := $(LOCAL_DIR)
 
 MODULE_SRCS += \
 	$(LOCAL_DIR)/sha.c \
-	$(LOCAL_DIR)/sha256.c
+	$(LOCAL_DIR)/sha256.c \
+	$(LOCAL_DIR)/sha256_hw.c
+
+ifeq ($(ARCH),arm64)
+MODULE_SRCS += \
+	$(LOCAL_DIR)/sha256_arm64.S
+endif
 
 include make/module.mk
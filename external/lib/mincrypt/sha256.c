@@ -33,10 +33,12 @@
 #include <string.h>
 #include <stdint.h>
 
+#include "sha256_hw.h"
+
 #define ror(value, bits) (((value) >> (bits)) | ((value) << (32 - (bits))))
 #define shr(value, bits) ((value) >> (bits))
 
-static const uint32_t K[64] = {
+const uint32_t sha256_k[64] = {
     0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
     0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
     0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
@@ -55,11 +57,10 @@ static const uint32_t K[64] = {
     0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
 };
 
-static void SHA256_Transform(SHA256_CTX *ctx)
+static void SHA256_Transform(uint32_t *state, const uint8_t *p)
 {
     uint32_t W[64];
     uint32_t A, B, C, D, E, F, G, H;
-    uint8_t *p = ctx->buf;
     int t;
 
     for (t = 0; t < 16; ++t) {
@@ -76,14 +77,14 @@ static void SHA256_Transform(SHA256_CTX *ctx)
         W[t] = W[t-16] + s0 + W[t-7] + s1;
     }
 
-    A = ctx->state[0];
-    B = ctx->state[1];
-    C = ctx->state[2];
-    D = ctx->state[3];
-    E = ctx->state[4];
-    F = ctx->state[5];
-    G = ctx->state[6];
-    H = ctx->state[7];
+    A = state[0];
+    B = state[1];
+    C = state[2];
+    D = state[3];
+    E = state[4];
+    F = state[5];
+    G = state[6];
+    H = state[7];
 
     for (t = 0; t < 64; t++) {
         uint32_t s0 = ror(A, 2) ^ ror(A, 13) ^ ror(A, 22);
@@ -91,7 +92,7 @@ static void SHA256_Transform(SHA256_CTX *ctx)
         uint32_t t2 = s0 + maj;
         uint32_t s1 = ror(E, 6) ^ ror(E, 11) ^ ror(E, 25);
         uint32_t ch = (E & F) ^ ((~E) & G);
-        uint32_t t1 = H + s1 + ch + K[t] + W[t];
+        uint32_t t1 = H + s1 + ch + sha256_k[t] + W[t];
 
         H = G;
         G = F;
@@ -103,14 +104,34 @@ static void SHA256_Transform(SHA256_CTX *ctx)
         A = t1 + t2;
     }
 
-    ctx->state[0] += A;
-    ctx->state[1] += B;
-    ctx->state[2] += C;
-    ctx->state[3] += D;
-    ctx->state[4] += E;
-    ctx->state[5] += F;
-    ctx->state[6] += G;
-    ctx->state[7] += H;
+    state[0] += A;
+    state[1] += B;
+    state[2] += C;
+    state[3] += D;
+    state[4] += E;
+    state[5] += F;
+    state[6] += G;
+    state[7] += H;
+}
+
+#if SHA256_HW_BLOCKS
+static int sha256_hw = -1;
+#endif
+
+/* the compression function over whole blocks, on the sha instructions if we can */
+static void SHA256_Blocks(uint32_t *state, const uint8_t *p, size_t blocks)
+{
+#if SHA256_HW_BLOCKS
+    if (sha256_hw < 0)
+        sha256_hw = sha256_hw_probe();
+    if (sha256_hw && sha256_hw_usable()) {
+        sha256_hw_blocks(state, p, blocks);
+        return;
+    }
+#endif
+
+    for (; blocks > 0; blocks--, p += 64)
+        SHA256_Transform(state, p);
 }
 
 static const HASH_VTAB SHA256_VTAB = {
@@ -143,13 +164,28 @@ void SHA256_update(SHA256_CTX *ctx, const void *data, int len)
 
     ctx->count += len;
 
-    while (len--) {
-        ctx->buf[i++] = *p++;
-        if (i == 64) {
-            SHA256_Transform(ctx);
-            i = 0;
-        }
+    // Top up a partially filled buffer first.
+    if (i) {
+        int n = 64 - i;
+        if (n > len)
+            n = len;
+        memcpy(ctx->buf + i, p, n);
+        i += n;
+        p += n;
+        len -= n;
+        if (i < 64)
+            return;
+        SHA256_Blocks(ctx->state, ctx->buf, 1);
     }
+
+    // Then hash whole blocks straight out of the caller's data.
+    if (len >= 64) {
+        SHA256_Blocks(ctx->state, p, len / 64);
+        p += len & ~63;
+        len &= 63;
+    }
+
+    memcpy(ctx->buf, p, len);
 }
 
 
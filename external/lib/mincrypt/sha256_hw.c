@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Probing for the cpu's sha256 instructions, and the x86-64 SHA-NI block
+ * function. The arm64 one is in sha256_arm64.S.
+ *
+ * Both want the simd registers, which the lazy fpu switch will hand to the
+ * current thread, so the plain c version still covers interrupt context and
+ * anything that runs with interrupts off.
+ */
+#include <arch/ops.h>
+#include "sha256_hw.h"
+
+#if SHA256_HW_BLOCKS
+
+#if ARCH_ARM64
+#include <arch/arm64.h>
+
+#define ID_AA64ISAR0_SHA2_SHIFT 12
+
+bool sha256_hw_probe(void)
+{
+    uint64_t isar0 = ARM64_READ_SYSREG(id_aa64isar0_el1);
+
+    return ((isar0 >> ID_AA64ISAR0_SHA2_SHIFT) & 0xf) != 0;
+}
+
+bool sha256_hw_usable(void)
+{
+    return !arch_ints_disabled();
+}
+
+#elif ARCH_X86_64
+#include <arch/x86.h>
+#include <smmintrin.h>
+
+#define CPUID_1_ECX_SSSE3 (1 << 9)
+#define CPUID_1_ECX_SSE41 (1 << 19)
+#define CPUID_7_EBX_SHA (1 << 29)
+
+static inline uint32_t cpuid(uint32_t leaf, uint32_t *b, uint32_t *c)
+{
+    uint32_t a = leaf, d;
+
+    __asm__ __volatile__ ("cpuid" : "+a" (a), "=b" (*b), "=c" (*c), "=d" (d) : "c" (0));
+    return a;
+}
+
+bool sha256_hw_probe(void)
+{
+    uint32_t b, c;
+
+    if (cpuid(0, &b, &c) < 7)
+        return false;
+
+    cpuid(1, &b, &c);
+    if ((c & (CPUID_1_ECX_SSSE3 | CPUID_1_ECX_SSE41)) != (CPUID_1_ECX_SSSE3 | CPUID_1_ECX_SSE41))
+        return false;
+
+    cpuid(7, &b, &c);
+    return b & CPUID_7_EBX_SHA;
+}
+
+bool sha256_hw_usable(void)
+{
+    /* not before fpu_init has turned on sse */
+    return !arch_ints_disabled() && (x86_get_cr4() & X86_CR4_OSFXSR);
+}
+
+/* shaintrin.h only comes through immintrin.h, which drags in all of avx512 */
+#define sha256rnds2(cdgh, abef, k) \
+    (__m128i)__builtin_ia32_sha256rnds2((__v4si)(cdgh), (__v4si)(abef), (__v4si)(k))
+#define sha256msg1(a, b) (__m128i)__builtin_ia32_sha256msg1((__v4si)(a), (__v4si)(b))
+#define sha256msg2(a, b) (__m128i)__builtin_ia32_sha256msg2((__v4si)(a), (__v4si)(b))
+
+/*
+ * Four rounds on w, the message words for rounds 4 * i .. 4 * i + 3.
+ * sha256rnds2 does two rounds with the state split as ABEF/CDGH.
+ */
+#define ROUNDS4(i, w) do { \
+        __m128i m = _mm_add_epi32(w, _mm_loadu_si128((const __m128i *)&sha256_k[4 * (i)])); \
+        cdgh = sha256rnds2(cdgh, abef, m); \
+        m = _mm_shuffle_epi32(m, 0x0e); \
+        abef = sha256rnds2(abef, cdgh, m); \
+    } while (0)
+
+/* the next four message words, w0..w3 being the previous sixteen, oldest first */
+#define SCHEDULE(w0, w1, w2, w3) \
+    w0 = sha256msg2(_mm_add_epi32(sha256msg1(w0, w1), _mm_alignr_epi8(w3, w2, 4)), w3)
+
+__attribute__((target("sha,sse4.1")))
+void sha256_hw_blocks(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    /* DCBA/HGFE in memory order, the instructions want ABEF/CDGH */
+    __m128i dcba = _mm_loadu_si128((const __m128i *)&state[0]);
+    __m128i hgfe = _mm_loadu_si128((const __m128i *)&state[4]);
+    __m128i cdab = _mm_shuffle_epi32(dcba, 0xb1);
+    __m128i efgh = _mm_shuffle_epi32(hgfe, 0x1b);
+    __m128i abef = _mm_alignr_epi8(cdab, efgh, 8);
+    __m128i cdgh = _mm_blend_epi16(efgh, cdab, 0xf0);
+
+    for (; blocks > 0; blocks--, data += 64) {
+        __m128i abef_save = abef;
+        __m128i cdgh_save = cdgh;
+
+        __m128i w0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data + 0), bswap);
+        __m128i w1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data + 1), bswap);
+        __m128i w2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data + 2), bswap);
+        __m128i w3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data + 3), bswap);
+
+        ROUNDS4(0, w0);
+        ROUNDS4(1, w1);
+        ROUNDS4(2, w2);
+        ROUNDS4(3, w3);
+        for (int i = 4; i < 16; i += 4) {
+            SCHEDULE(w0, w1, w2, w3);
+            ROUNDS4(i + 0, w0);
+            SCHEDULE(w1, w2, w3, w0);
+            ROUNDS4(i + 1, w1);
+            SCHEDULE(w2, w3, w0, w1);
+            ROUNDS4(i + 2, w2);
+            SCHEDULE(w3, w0, w1, w2);
+            ROUNDS4(i + 3, w3);
+        }
+
+        abef = _mm_add_epi32(abef, abef_save);
+        cdgh = _mm_add_epi32(cdgh, cdgh_save);
+    }
+
+    __m128i feba = _mm_shuffle_epi32(abef, 0x1b);
+    __m128i dchg = _mm_shuffle_epi32(cdgh, 0xb1);
+    _mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(feba, dchg, 0xf0));
+    _mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(dchg, feba, 8));
+}
+
+#endif
+
+#endif // SHA256_HW_BLOCKS
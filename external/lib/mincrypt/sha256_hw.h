@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* only the kernel build knows the arch, the host tools get the plain c */
+#if ARCH_ARM64 || ARCH_X86_64
+#define SHA256_HW_BLOCKS 1
+#endif
+
+/* the round constants, shared with the hardware versions */
+extern const uint32_t sha256_k[64];
+
+#if SHA256_HW_BLOCKS
+/* true if the cpu has the sha256 instructions */
+bool sha256_hw_probe(void);
+/* true if the simd registers can be used from here */
+bool sha256_hw_usable(void);
+
+/* run the compression function over consecutive 64 byte blocks */
+void sha256_hw_blocks(uint32_t state[8], const uint8_t *data, size_t blocks);
+#endif
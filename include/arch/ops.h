@@ -42,6 +42,7 @@ static int atomic_swap(volatile int *ptr, int val);
 static int atomic_add(volatile int *ptr, int val);
 static int atomic_and(volatile int *ptr, int val);
 static int atomic_or(volatile int *ptr, int val);
+static int atomic_cmpxchg(volatile int *ptr, int oldval, int newval); /* returns the old value */
 
 static uint32_t arch_cycle_count(void);
 
@@ -64,6 +65,12 @@ void arch_clean_invalidate_cache_range(addr_t start, size_t len);
 void arch_invalidate_cache_range(addr_t start, size_t len);
 void arch_sync_cache_range(addr_t start, size_t len);
 
+/* one entry in a batch for the arch_*_cache_ranges routines below */
+struct arch_cache_range {
+    addr_t start;
+    size_t len;
+};
+
 void arch_idle(void);
 
 __END_CDECLS
@@ -72,4 +79,46 @@ __END_CDECLS
 
 #include <arch/arch_ops.h>
 
+#ifndef ASSEMBLY
+/* the atomics above are not barriers. architectures without their own smp
+ * barriers only run uniprocessor, where the compiler is all that reorders */
+#ifndef smp_mb
+#define smp_mb()    CF
+#endif
+#ifndef smp_wmb
+#define smp_wmb()   CF
+#endif
+#ifndef smp_rmb
+#define smp_rmb()   CF
+#endif
+
+/* maintenance on a batch of ranges, finished with a single barrier. arches
+ * that can do better than one call per range set ARCH_HAS_CACHE_RANGES */
+__BEGIN_CDECLS
+#if ARCH_HAS_CACHE_RANGES
+void arch_clean_cache_ranges(const struct arch_cache_range *ranges, size_t count);
+void arch_clean_invalidate_cache_ranges(const struct arch_cache_range *ranges, size_t count);
+void arch_invalidate_cache_ranges(const struct arch_cache_range *ranges, size_t count);
+#else
+static inline void arch_clean_cache_ranges(const struct arch_cache_range *ranges, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        arch_clean_cache_range(ranges[i].start, ranges[i].len);
+}
+
+static inline void arch_clean_invalidate_cache_ranges(const struct arch_cache_range *ranges, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        arch_clean_invalidate_cache_range(ranges[i].start, ranges[i].len);
+}
+
+static inline void arch_invalidate_cache_ranges(const struct arch_cache_range *ranges, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        arch_invalidate_cache_range(ranges[i].start, ranges[i].len);
+}
+#endif
+__END_CDECLS
+#endif // !ASSEMBLY
+
 #endif
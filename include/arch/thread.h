@@ -31,4 +31,14 @@ struct thread;
 void arch_thread_initialize(struct thread *);
 void arch_context_switch(struct thread *oldthread, struct thread *newthread);
 
+/*
+ * Bare stack switching within the current thread, for lib/fiber. The switch
+ * saves the callee saved registers, floating point ones included, on the
+ * current stack and resumes whatever was saved at new_sp. stack_init lays out
+ * a fresh stack so that switching to the sp it returns calls entry, which must
+ * not return.
+ */
+vaddr_t arch_fiber_stack_init(vaddr_t stack_top, void (*entry)(void));
+void arch_fiber_switch(vaddr_t *old_sp, vaddr_t new_sp);
+
 #endif
@@ -29,5 +29,12 @@
 #define LOCAL_FUNCTION(x) .type x,STT_FUNC; x:
 #define LOCAL_DATA(x) .type x,STT_OBJECT; x:
 
+/* assembly counterpart of __FAST_CODE */
+#if WITH_FAST_SECTIONS
+#define FAST_TEXT .section .fast.text,"ax"
+#else
+#define FAST_TEXT .text
+#endif
+
 #endif
 
@@ -46,6 +46,14 @@
 #define __ISCONSTANT(x) __builtin_constant_p(x)
 #define __NO_INLINE __attribute((noinline))
 #define __SRAM __NO_INLINE __SECTION(".sram.text")
+/* hot code and data, run out of tightly coupled memory on platforms that have it */
+#if WITH_FAST_SECTIONS
+#define __FAST_CODE __SECTION(".fast.text")
+#define __FAST_DATA __SECTION(".fast.data")
+#else
+#define __FAST_CODE
+#define __FAST_DATA
+#endif
 #define __CONSTRUCTOR __attribute__((constructor))
 #define __DESTRUCTOR __attribute__((destructor))
 #define __OPTIMIZE(x) __attribute__((optimize(x)))
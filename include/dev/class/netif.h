@@ -26,6 +26,8 @@
 #include <list.h>
 #include <compiler.h>
 #include <dev/driver.h>
+#include <kernel/event.h>
+#include <kernel/thread.h>
 
 struct netstack_state;
 struct pbuf;
@@ -60,6 +62,43 @@ status_t class_netstack_input(struct device *dev, struct netstack_state *state,
 
 status_t class_netstack_wait_for_network(lk_time_t timeout);
 
+/*
+ * Interrupt mitigation for network drivers. Rather than handling each packet
+ * at interrupt time, the driver's irq handler masks the device interrupt and
+ * calls netif_poll_schedule(). A thread then calls poll() to handle up to
+ * budget packets at a time, yielding between passes while it keeps getting a
+ * full budget's worth, and calls complete() to unmask the interrupt once a
+ * pass comes up short. complete() returns true if more work showed up while
+ * the interrupt was off, which keeps the thread polling.
+ */
+#ifndef NETIF_POLL_BUDGET
+#define NETIF_POLL_BUDGET 64
+#endif
+
+typedef uint (*netif_poll_func_t)(void *arg, uint budget);
+typedef bool (*netif_poll_complete_func_t)(void *arg);
+
+struct netif_poll {
+    thread_t *thread;
+    event_t event;
+    uint budget;
+
+    netif_poll_func_t poll;
+    netif_poll_complete_func_t complete;
+    void *arg;
+};
+
+/* set up the polling thread, which starts with netif_poll_start() */
+status_t netif_poll_init(struct netif_poll *np, const char *name, int priority,
+                         netif_poll_func_t poll, netif_poll_complete_func_t complete, void *arg);
+void netif_poll_start(struct netif_poll *np);
+
+/* from the irq handler, with the device interrupt masked */
+static inline void netif_poll_schedule(struct netif_poll *np)
+{
+    event_signal(&np->event, false);
+}
+
 __END_CDECLS
 
 #endif
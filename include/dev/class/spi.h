@@ -24,6 +24,7 @@
 #define __DEV_CLASS_SPI_H
 
 #include <compiler.h>
+#include <list.h>
 #include <dev/driver.h>
 
 /* spi transaction flags */
@@ -42,17 +43,42 @@ struct spi_transaction {
     size_t len;
 };
 
+/*
+ * queued spi request, a run of transactions completed asynchronously. the
+ * callback may be made in interrupt context, and the transactions and their
+ * buffers belong to the driver until it is.
+ */
+struct spi_request;
+typedef void (*spi_request_callback_t)(struct spi_request *req);
+
+struct spi_request {
+    struct spi_transaction *txn;
+    size_t count;
+    spi_request_callback_t callback;
+    void *arg;
+
+    /* bytes transferred or an error, valid in the callback */
+    ssize_t result;
+
+    /* private to the driver */
+    struct list_node node;
+};
+
 /* spi interface */
 struct spi_ops {
     struct driver_ops std;
 
     ssize_t (*transaction)(struct device *dev, struct spi_transaction *txn, size_t count);
+    status_t (*queue)(struct device *dev, struct spi_request *req);
 };
 
 __BEGIN_CDECLS
 
 ssize_t class_spi_transaction(struct device *dev, struct spi_transaction *txn, size_t count);
 
+/* queue a request behind any others on the device, falls back to a synchronous transaction */
+status_t class_spi_queue(struct device *dev, struct spi_request *req);
+
 __END_CDECLS
 
 #endif
@@ -81,6 +81,10 @@ struct display_framebuffer {
     struct display_image image;
     // Update function
     void (*flush)(uint starty, uint endy);
+    // Optional, update just a rectangle
+    void (*flush_rect)(uint x, uint y, uint width, uint height);
+    // Optional, wait until the display is done reading out earlier flushes
+    void (*wait_idle)(void);
 };
 
 status_t display_get_framebuffer(struct display_framebuffer *fb)
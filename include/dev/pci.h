@@ -178,4 +178,14 @@ int pci_write_config_word(const pci_location_t *state, uint32_t reg, uint32_t va
 int pci_get_irq_routing_options(irq_routing_entry *entries, uint16_t *count, uint16_t *pci_irqs);
 int pci_set_irq_hw_int(const pci_location_t *state, uint8_t int_pin, uint8_t irq);
 
+/* the interrupt vector the function's INTx pin is routed to, for register_int_handler */
+int pci_get_irq_vector(const pci_location_t *state, uint *vector);
+
+/*
+ * switch the function to message signalled interrupts, returning the vectors
+ * they arrive on. msix sets up the first count table entries, one vector each.
+ */
+int pci_enable_msi(const pci_location_t *state, uint *vector);
+int pci_enable_msix(const pci_location_t *state, uint count, uint *vectors);
+
 #endif
@@ -24,6 +24,7 @@
 #define __DEV_USBC_H
 
 #include <compiler.h>
+#include <list.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <sys/types.h>
@@ -58,6 +59,8 @@ typedef struct usbc_transfer {
     size_t buflen;
     uint bufpos;
     void *extra; // extra pointer to store whatever you want
+
+    struct list_node node; // private to the driver while the transfer is queued
 } usbc_transfer_t;
 
 enum {
@@ -67,6 +70,9 @@ enum {
 };
 
 status_t usbc_setup_endpoint(ep_t ep, ep_dir_t dir, uint width, ep_type_t type);
+
+/* transfers may be queued while others are outstanding on the endpoint, they complete in order.
+ * keeping a few queued keeps the endpoint busy while each completion callback runs. */
 status_t usbc_queue_rx(ep_t ep, usbc_transfer_t *transfer);
 status_t usbc_queue_tx(ep_t ep, usbc_transfer_t *transfer);
 status_t usbc_flush_ep(ep_t ep);
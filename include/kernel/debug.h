@@ -29,19 +29,32 @@ __BEGIN_CDECLS;
 
 #include <debug.h>
 
-/* kernel event log */
+/* kernel event log, one ring per cpu */
 #if WITH_KERNEL_EVLOG
 
+#include <stdbool.h>
 #include <lib/evlog.h>
 
+/* entries per cpu */
 #ifndef KERNEL_EVLOG_LEN
 #define KERNEL_EVLOG_LEN 1024
 #endif
 
 void kernel_evlog_init(void);
 
-void kernel_evlog_add(uintptr_t id, uintptr_t arg0, uintptr_t arg1);
+extern volatile bool kernel_evlog_enable;
+void _kernel_evlog_add(uintptr_t id, uintptr_t arg0, uintptr_t arg1);
+
+/* keep the disabled case to a load and a branch at the call site */
+static inline void kernel_evlog_add(uintptr_t id, uintptr_t arg0, uintptr_t arg1)
+{
+    if (unlikely(kernel_evlog_enable))
+        _kernel_evlog_add(id, arg0, arg1);
+}
+
 void kernel_evlog_dump(void);
+void kernel_evlog_dump_json(void);
+void kernel_evlog_reset(void);
 
 #else // !WITH_KERNEL_EVLOG
 
@@ -49,6 +62,8 @@ void kernel_evlog_dump(void);
 static inline void kernel_evlog_init(void) {}
 static inline void kernel_evlog_add(uintptr_t id, uintptr_t arg0, uintptr_t arg1) {}
 static inline void kernel_evlog_dump(void) {}
+static inline void kernel_evlog_dump_json(void) {}
+static inline void kernel_evlog_reset(void) {}
 
 #endif
 
@@ -60,6 +75,12 @@ enum {
     KERNEL_EVLOG_TIMER_CALL,
     KERNEL_EVLOG_IRQ_ENTER,
     KERNEL_EVLOG_IRQ_EXIT,
+    KERNEL_EVLOG_MUTEX_BLOCK,
+    KERNEL_EVLOG_MUTEX_WAKE,
+    KERNEL_EVLOG_BIO_SUBMIT,
+    KERNEL_EVLOG_BIO_COMPLETE,
+    KERNEL_EVLOG_NET_RX,
+    KERNEL_EVLOG_NET_TX,
 };
 
 #define KEVLOG_THREAD_SWITCH(from, to) kernel_evlog_add(KERNEL_EVLOG_CONTEXT_SWITCH, (uintptr_t)from, (uintptr_t)to)
@@ -68,6 +89,12 @@ enum {
 #define KEVLOG_TIMER_CALL(ptr, arg) kernel_evlog_add(KERNEL_EVLOG_TIMER_CALL, (uintptr_t)ptr, (uintptr_t)arg)
 #define KEVLOG_IRQ_ENTER(irqn) kernel_evlog_add(KERNEL_EVLOG_IRQ_ENTER, (uintptr_t)irqn, 0)
 #define KEVLOG_IRQ_EXIT(irqn) kernel_evlog_add(KERNEL_EVLOG_IRQ_EXIT, (uintptr_t)irqn, 0)
+#define KEVLOG_MUTEX_BLOCK(m, holder) kernel_evlog_add(KERNEL_EVLOG_MUTEX_BLOCK, (uintptr_t)m, (uintptr_t)holder)
+#define KEVLOG_MUTEX_WAKE(m) kernel_evlog_add(KERNEL_EVLOG_MUTEX_WAKE, (uintptr_t)m, 0)
+#define KEVLOG_BIO_SUBMIT(req, block) kernel_evlog_add(KERNEL_EVLOG_BIO_SUBMIT, (uintptr_t)req, (uintptr_t)block)
+#define KEVLOG_BIO_COMPLETE(req, result) kernel_evlog_add(KERNEL_EVLOG_BIO_COMPLETE, (uintptr_t)req, (uintptr_t)result)
+#define KEVLOG_NET_RX(p, len) kernel_evlog_add(KERNEL_EVLOG_NET_RX, (uintptr_t)p, (uintptr_t)len)
+#define KEVLOG_NET_TX(p, len) kernel_evlog_add(KERNEL_EVLOG_NET_TX, (uintptr_t)p, (uintptr_t)len)
 
 __END_CDECLS;
 
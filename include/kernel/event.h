@@ -32,9 +32,14 @@ __BEGIN_CDECLS;
 
 #define EVENT_MAGIC (0x65766E74)  // "evnt"
 
+/* the state word holds the signaled bit plus a count of threads that are in
+ * the slow path of event_wait, in units of EVENT_STATE_WAITER */
+#define EVENT_STATE_SIGNALED 1
+#define EVENT_STATE_WAITER 2
+
 typedef struct event {
     int magic;
-    bool signaled;
+    volatile int state;
     uint flags;
     wait_queue_t wait;
 } event_t;
@@ -44,7 +49,7 @@ typedef struct event {
 #define EVENT_INITIAL_VALUE(e, initial, _flags) \
 { \
     .magic = EVENT_MAGIC, \
-    .signaled = initial, \
+    .state = (initial) ? EVENT_STATE_SIGNALED : 0, \
     .flags = _flags, \
     .wait = WAIT_QUEUE_INITIAL_VALUE((e).wait), \
 }
@@ -63,6 +68,8 @@ typedef struct event {
  *     in the signaled state until a thread attempts to wait (at which
  *     time it will unsignal atomicly and return immediately) or
  *     event_unsignal() is called.
+ * - Signaling an event that is already signaled or has no waiters, and waiting
+ *   on one that is already signaled, does not take the thread lock.
 */
 
 void event_init(event_t *, bool initial, uint flags);
@@ -71,6 +78,11 @@ status_t event_wait_timeout(event_t *, lk_time_t); /* wait on the event with a t
 status_t event_signal(event_t *, bool reschedule);
 status_t event_unsignal(event_t *);
 
+static inline bool event_signaled(event_t *e)
+{
+    return !!(e->state & EVENT_STATE_SIGNALED);
+}
+
 static inline bool event_initialized(event_t *e)
 {
     return e->magic == EVENT_MAGIC;
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <list.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+/*
+ * cpu idle states. A platform with something better than arch_idle() registers
+ * its states, shallowest first, and each time a cpu goes idle it takes the
+ * deepest one that pays for itself before the cpu's next timer interrupt and
+ * wakes up within the tightest latency anyone has asked for. Without any
+ * registered states the idle thread just calls arch_idle().
+ */
+#define IDLE_MAX_STATES 8
+
+typedef struct idle_state {
+    const char *name;
+
+    /* worst case time from a wakeup event to the cpu running again */
+    uint32_t exit_latency_us;
+
+    /* shortest sleep for which the state is worth entering */
+    uint32_t target_residency_us;
+
+    /* sleep until an interrupt is pending. called with interrupts disabled and returns
+     * with them still disabled, the interrupt is taken after the time is accounted.
+     * anything that stops in the state is the platform's to save and restore */
+    void (*enter)(const struct idle_state *state);
+} idle_state_t;
+
+/* register the platform's states, ordered by increasing exit latency. once, at init */
+status_t idle_register_states(const idle_state_t *states, uint count);
+
+/* called by the idle thread, sleeps in the chosen state until the next interrupt */
+void idle_enter(void);
+
+/*
+ * a limit on how long a sleeping cpu may take to wake up, for threads that
+ * can't wait on a deep state. the tightest active request applies to every cpu.
+ */
+typedef struct idle_latency_req {
+    struct list_node node;
+    uint32_t latency_us;
+} idle_latency_req_t;
+
+#define IDLE_LATENCY_REQ_INITIAL_VALUE { .node = LIST_INITIAL_CLEARED_VALUE, .latency_us = 0 }
+
+/* add the request, or change it if already active */
+void idle_latency_request(idle_latency_req_t *req, uint32_t latency_us);
+void idle_latency_release(idle_latency_req_t *req);
+
+/* the latency allowed right now, UINT32_MAX if there are no requests */
+uint32_t idle_latency_limit(void);
+
+__END_CDECLS
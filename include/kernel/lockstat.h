@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <list.h>
+#include <arch/ops.h>
+#include <kernel/spinlock.h>
+
+__BEGIN_CDECLS
+
+/*
+ * Lock contention statistics. With LOCK_STATS=1, spinlocks taken through the
+ * _stats variants below and named mutexes keep counts of acquisitions,
+ * contended acquisitions, wait cycles and hold cycles, shown by the lockstat
+ * console command. Off by default, where everything here compiles down to the
+ * plain lock calls.
+ */
+#ifndef LOCK_STATS
+#define LOCK_STATS 0
+#endif
+
+#if LOCK_STATS
+
+/* everything but the list linkage is only touched while holding the lock itself */
+struct lock_stats {
+    struct list_node node;
+    const char *name;
+    bool registered;
+    uint64_t acquires;
+    uint64_t contended;
+    uint64_t wait_total;
+    uint32_t wait_max;
+    uint32_t hold_max;
+    uint32_t hold_start;
+};
+
+#define LOCK_STATS_INITIAL_VALUE(_name) \
+{ \
+    .node = LIST_INITIAL_CLEARED_VALUE, \
+    .name = (_name), \
+}
+
+/* adds the stats to the lockstat list. done automatically on first use if given a name */
+void lock_stats_register(struct lock_stats *ls, const char *name);
+void lock_stats_unregister(struct lock_stats *ls);
+
+/* record an acquire that waited for wait cycles, if contended */
+static inline void lock_stats_acquired(struct lock_stats *ls, bool contended, uint32_t wait)
+{
+    if (unlikely(!ls->registered) && ls->name)
+        lock_stats_register(ls, ls->name);
+
+    ls->acquires++;
+    if (contended) {
+        ls->contended++;
+        ls->wait_total += wait;
+        if (wait > ls->wait_max)
+            ls->wait_max = wait;
+    }
+    ls->hold_start = arch_cycle_count();
+}
+
+static inline void lock_stats_released(struct lock_stats *ls)
+{
+    uint32_t hold = arch_cycle_count() - ls->hold_start;
+    if (hold > ls->hold_max)
+        ls->hold_max = hold;
+}
+
+static inline void spin_lock_stats(spin_lock_t *lock, struct lock_stats *ls)
+{
+    if (likely(spin_trylock(lock) == 0)) {
+        lock_stats_acquired(ls, false, 0);
+    } else {
+        uint32_t start = arch_cycle_count();
+        spin_lock(lock);
+        lock_stats_acquired(ls, true, arch_cycle_count() - start);
+    }
+}
+
+static inline void spin_unlock_stats(spin_lock_t *lock, struct lock_stats *ls)
+{
+    lock_stats_released(ls);
+    spin_unlock(lock);
+}
+
+#define spin_lock_irqsave_stats(lock, statep, ls) \
+    do { arch_interrupt_save(&(statep), SPIN_LOCK_FLAG_INTERRUPTS); spin_lock_stats(lock, ls); } while (0)
+#define spin_unlock_irqrestore_stats(lock, statep, ls) \
+    do { spin_unlock_stats(lock, ls); arch_interrupt_restore(statep, SPIN_LOCK_FLAG_INTERRUPTS); } while (0)
+
+#else
+
+#define spin_lock_stats(lock, ls) spin_lock(lock)
+#define spin_unlock_stats(lock, ls) spin_unlock(lock)
+#define spin_lock_irqsave_stats(lock, statep, ls) spin_lock_irqsave(lock, statep)
+#define spin_unlock_irqrestore_stats(lock, statep, ls) spin_unlock_irqrestore(lock, statep)
+
+#endif
+
+__END_CDECLS
@@ -57,6 +57,9 @@ enum handler_return mp_mbx_reschedule_irq(void);
 struct mp_state {
     volatile mp_cpu_mask_t active_cpus;
 
+    /* cpus with a reschedule ipi sent but not yet taken */
+    volatile mp_cpu_mask_t reschedule_pending;
+
     /* only safely accessible with thread lock held */
     mp_cpu_mask_t idle_cpus;
     mp_cpu_mask_t realtime_cpus;
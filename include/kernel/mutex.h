@@ -33,31 +33,64 @@ __BEGIN_CDECLS;
 
 #define MUTEX_MAGIC (0x6D757478)  // 'mutx'
 
+/* boost the holder to the priority of the highest priority waiter */
+#define MUTEX_FLAG_PRIORITY_INHERIT (1<<0)
+
 typedef struct mutex {
     uint32_t magic;
+    uint32_t flags;
     thread_t *holder;
     int count;
     wait_queue_t wait;
+    struct list_node holder_node; /* in holder's held_mutexes if priority inheriting */
+#if LOCK_STATS
+    struct lock_stats stats;
+#endif
 } mutex_t;
 
-#define MUTEX_INITIAL_VALUE(m) \
+#if LOCK_STATS
+/* statically initialized mutexes show up in lockstat under their variable name */
+#define MUTEX_STATS_INITIAL_VALUE(m) .stats = LOCK_STATS_INITIAL_VALUE(#m),
+#else
+#define MUTEX_STATS_INITIAL_VALUE(m)
+#endif
+
+#define MUTEX_INITIAL_VALUE_FLAGS(m, f) \
 { \
     .magic = MUTEX_MAGIC, \
+    .flags = (f), \
     .holder = NULL, \
     .count = 0, \
     .wait = WAIT_QUEUE_INITIAL_VALUE((m).wait), \
+    .holder_node = LIST_INITIAL_CLEARED_VALUE, \
+    MUTEX_STATS_INITIAL_VALUE(m) \
 }
 
+#define MUTEX_INITIAL_VALUE(m) MUTEX_INITIAL_VALUE_FLAGS(m, 0)
+
 /* Rules for Mutexes:
  * - Mutexes are only safe to use from thread context.
  * - Mutexes are non-recursive.
+ * - A priority inheriting mutex runs its holder at the priority of the highest
+ *   priority thread waiting for it, transitively through chains of such mutexes,
+ *   and hands off to the highest priority waiter on release.
+ * - On SMP a contended acquire spins briefly while the holder is running on
+ *   another cpu before blocking (see MUTEX_ADAPTIVE_SPIN).
 */
 
 void mutex_init(mutex_t *);
+void mutex_init_etc(mutex_t *, uint32_t flags);
 void mutex_destroy(mutex_t *);
 status_t mutex_acquire_timeout(mutex_t *, lk_time_t); /* try to acquire the mutex with a timeout value */
 status_t mutex_release(mutex_t *);
 
+/* name a mutex for lockstat, mutexes set up with mutex_init() aren't tracked until named */
+#if LOCK_STATS
+void mutex_set_stats_name(mutex_t *, const char *name);
+#else
+static inline void mutex_set_stats_name(mutex_t *m, const char *name) {}
+#endif
+
 static inline status_t mutex_acquire(mutex_t *m)
 {
     return mutex_acquire_timeout(m, INFINITE_TIME);
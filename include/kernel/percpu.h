@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <sys/types.h>
+#include <arch/ops.h>
+#include <arch/defines.h>
+#include <kernel/thread.h>
+#include <kernel/timer.h>
+
+__BEGIN_CDECLS;
+
+/*
+ * State owned by a single cpu. Each block starts on its own cache line so
+ * cpus updating their own counters and timers don't bounce lines between
+ * each other.
+ */
+struct percpu {
+#if THREAD_STATS
+    struct thread_stats thread_stats;
+#endif
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    /* preemption timer */
+    timer_t preempt_timer;
+#endif
+
+    /*
+     * bumped each time this cpu passes through the scheduler or takes a tick
+     * outside a preempt disabled section, see kernel/rcu.c
+     */
+    volatile ulong rcu_qs;
+
+    /* statically allocated idle thread */
+    thread_t idle_thread;
+} __CPU_ALIGN;
+
+extern struct percpu percpu[SMP_MAX_CPUS];
+
+/* an arch with a spare register for it may provide a faster arch_get_percpu() */
+static inline struct percpu *get_percpu(void)
+{
+#ifdef arch_get_percpu
+    return arch_get_percpu();
+#else
+    return &percpu[arch_curr_cpu_num()];
+#endif
+}
+
+static inline struct percpu *get_percpu_cpu(uint cpu)
+{
+    return &percpu[cpu];
+}
+
+__END_CDECLS;
@@ -51,6 +51,7 @@ typedef enum {
     PORT_MODE_BROADCAST   = 0,
     PORT_MODE_UNICAST     = 1,
     PORT_MODE_BIG_BUFFER  = 2,
+    PORT_MODE_SINGLE_WRITER = 4,
 } port_mode_t;
 
 /* Inits the port subsystem
@@ -60,6 +61,9 @@ void port_init(void);
 /* Make a named write-side port. broadcast ports can be opened by any
  * number of read-clients. |name| can be up to PORT_NAME_LEN chars. If
  * the write port exists it is returned even if the |mode| does not match.
+ * PORT_MODE_SINGLE_WRITER is only valid for unicast ports and promises that
+ * one thread writes the port and one thread reads it, which lets both sides
+ * skip the thread lock unless the reader has to block.
  */
 status_t port_create(const char *name, port_mode_t mode, port_t *port);
 
@@ -92,6 +96,12 @@ status_t port_write(port_t port, const port_packet_t *pk, size_t count);
  */
 status_t port_read(port_t port, lk_time_t timeout, port_result_t *result);
 
+/* Read up to |count| packets from the port or port group, blocking until at
+ * least one is available. Returns the number of packets read or a negative
+ * error, like port_read().
+ */
+ssize_t port_read_batch(port_t port, lk_time_t timeout, port_result_t *results, size_t count);
+
 /* Destroy the write-side port, flush queued packets and release all resources,
  * all calls will now fail on that port. Only a closed port can be destroyed.
  */
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <arch/ops.h>
+#include <kernel/thread.h>
+
+__BEGIN_CDECLS;
+
+/*
+ * Read-copy-update style deferred reclamation.
+ *
+ * Readers bracket their lookups with rcu_read_lock()/rcu_read_unlock(), which
+ * only disable preemption, and load shared pointers with rcu_dereference().
+ * Writers still serialize among themselves with a lock of their own. They
+ * publish new objects with rcu_assign_pointer(), unlink old ones, and only
+ * free them once every cpu has passed through a quiescent state, either by
+ * waiting in rcu_synchronize() or by handing them to rcu_call().
+ *
+ * Read side sections may be used from threads and interrupt handlers, may
+ * nest, and must not block.
+ */
+struct rcu_head {
+    struct rcu_head *next;
+    void (*func)(struct rcu_head *head);
+};
+
+static inline void rcu_read_lock(void)
+{
+    thread_preempt_disable();
+}
+
+static inline void rcu_read_unlock(void)
+{
+    thread_preempt_enable();
+}
+
+#define rcu_dereference(p) \
+    ({ __typeof__(p) __p = *(volatile __typeof__(p) *)&(p); __p; })
+
+/* make the contents of v visible before v itself */
+#define rcu_assign_pointer(p, v) \
+    do { smp_wmb(); *(volatile __typeof__(p) *)&(p) = (v); } while (0)
+
+/* wait until every read side section running at the time of the call is over */
+void rcu_synchronize(void);
+
+/*
+ * Call func(head) from the rcu thread once a grace period has gone by. Safe
+ * from interrupt context. head is usually embedded in the object to be freed.
+ */
+void rcu_call(struct rcu_head *head, void (*func)(struct rcu_head *head));
+
+__END_CDECLS;
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __KERNEL_RWLOCK_H
+#define __KERNEL_RWLOCK_H
+
+#include <compiler.h>
+#include <debug.h>
+#include <stdint.h>
+#include <kernel/thread.h>
+
+__BEGIN_CDECLS;
+
+#define RWLOCK_MAGIC (0x72776C6B)  // 'rwlk'
+
+/* new readers queue behind a waiting writer instead of overtaking it */
+#define RWLOCK_FLAG_WRITER_PREFERENCE (1<<0)
+
+typedef struct rwlock {
+    uint32_t magic;
+    uint32_t flags;
+    int count;          /* > 0: number of readers, -1: held by a writer, 0: free */
+    thread_t *writer;
+    wait_queue_t read_wait;
+    wait_queue_t write_wait;
+} rwlock_t;
+
+#define RWLOCK_INITIAL_VALUE_FLAGS(l, f) \
+{ \
+    .magic = RWLOCK_MAGIC, \
+    .flags = (f), \
+    .count = 0, \
+    .writer = NULL, \
+    .read_wait = WAIT_QUEUE_INITIAL_VALUE((l).read_wait), \
+    .write_wait = WAIT_QUEUE_INITIAL_VALUE((l).write_wait), \
+}
+
+#define RWLOCK_INITIAL_VALUE(l) RWLOCK_INITIAL_VALUE_FLAGS(l, 0)
+
+/* Rules for rwlocks:
+ * - Rwlocks are only safe to use from thread context.
+ * - Rwlocks are non-recursive, in either mode. A reader may not upgrade to writer.
+ * - Any number of readers may hold the lock at once, a writer holds it alone.
+ * - Ownership is handed directly to the woken threads on release: a releasing
+ *   writer wakes either the next writer or every waiting reader.
+ * - By default readers are admitted whenever no writer holds the lock and a
+ *   releasing writer prefers waiting readers. With RWLOCK_FLAG_WRITER_PREFERENCE
+ *   new readers block behind any waiting writer and writers are woken first.
+ */
+
+void rwlock_init(rwlock_t *);
+void rwlock_init_etc(rwlock_t *, uint32_t flags);
+void rwlock_destroy(rwlock_t *);
+status_t rwlock_acquire_read_timeout(rwlock_t *, lk_time_t);
+status_t rwlock_release_read(rwlock_t *);
+status_t rwlock_acquire_write_timeout(rwlock_t *, lk_time_t);
+status_t rwlock_release_write(rwlock_t *);
+
+static inline status_t rwlock_acquire_read(rwlock_t *l)
+{
+    return rwlock_acquire_read_timeout(l, INFINITE_TIME);
+}
+
+static inline status_t rwlock_acquire_write(rwlock_t *l)
+{
+    return rwlock_acquire_write_timeout(l, INFINITE_TIME);
+}
+
+/* does the current thread hold the lock for writing? */
+static inline bool is_rwlock_write_held(const rwlock_t *l)
+{
+    return l->writer == get_current_thread();
+}
+
+__END_CDECLS;
+#endif
+
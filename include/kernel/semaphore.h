@@ -27,7 +27,7 @@ __BEGIN_CDECLS;
 
 typedef struct semaphore {
     int magic;
-    int count;
+    volatile int count;
     wait_queue_t wait;
 } semaphore_t;
 
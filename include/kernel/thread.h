@@ -30,14 +30,20 @@
 #include <arch/ops.h>
 #include <arch/thread.h>
 #include <kernel/wait.h>
+#include <kernel/timer.h>
 #include <kernel/spinlock.h>
+#include <kernel/lockstat.h>
 #include <debug.h>
+#include <assert.h>
 
 #if WITH_KERNEL_VM
 /* forward declaration */
 typedef struct vmm_aspace vmm_aspace_t;
 #endif
 
+/* also declared in kernel/mp.h, which depends on this header */
+typedef uint32_t mp_cpu_mask_t;
+
 __BEGIN_CDECLS;
 
 /* debug-enable runtime checks */
@@ -68,6 +74,15 @@ enum thread_tls_list {
 #endif
 #ifdef WITH_LIB_LKUSER
     TLS_ENTRY_LKUSER,
+#endif
+#ifdef WITH_LIB_FIBER
+    TLS_ENTRY_FIBER,
+#endif
+#ifdef WITH_LIB_ARENA
+    TLS_ENTRY_ARENA,
+#endif
+#ifdef WITH_LIB_UNITTEST
+    TLS_ENTRY_UNITTEST,
 #endif
     MAX_TLS_ENTRY
 };
@@ -78,6 +93,7 @@ enum thread_tls_list {
 #define THREAD_FLAG_REAL_TIME                 (1<<3)
 #define THREAD_FLAG_IDLE                      (1<<4)
 #define THREAD_FLAG_DEBUG_STACK_BOUNDS_CHECK  (1<<5)
+#define THREAD_FLAG_POOL_STACK                (1<<6)
 
 #define THREAD_MAGIC (0x74687264) // 'thrd'
 
@@ -87,13 +103,21 @@ typedef struct thread {
 
     /* active bits */
     struct list_node queue_node;
-    int priority;
+    int priority; /* effective priority, base_priority or inherited_priority */
+    int base_priority;
+    int inherited_priority; /* boost from priority inheriting mutexes, -1 if none */
     enum thread_state state;
     int remaining_quantum;
     unsigned int flags;
+
+    /* preemption disable nesting count, and a preempt that arrived while it was held */
+    int preempt_disable;
+    volatile bool preempt_pending;
 #if WITH_SMP
     int curr_cpu;
-    int pinned_cpu; /* only run on pinned_cpu if >= 0 */
+    int last_cpu; /* cpu it last ran on, used to pick a run queue */
+    int queued_cpu; /* whose run queue it is in while ready */
+    mp_cpu_mask_t cpu_affinity; /* cpus it is allowed to run on */
 #endif
 #if WITH_KERNEL_VM
     vmm_aspace_t *aspace;
@@ -103,6 +127,21 @@ typedef struct thread {
     struct wait_queue *blocking_wait_queue;
     status_t wait_queue_block_ret;
 
+    /* priority inheriting mutexes held, and the one being waited on if any */
+    struct list_node held_mutexes;
+    struct mutex *blocking_mutex;
+
+    /* deadline scheduling class, period is 0 for regular priority threads */
+    struct {
+        lk_time_t period;
+        lk_time_t budget;
+        lk_time_t deadline; /* absolute end of the current period */
+        lk_bigtime_t remaining; /* usecs of budget left in this period */
+        lk_bigtime_t run_start; /* when the budget was last charged */
+        bool throttled; /* out of budget, parked until the next period */
+        timer_t replenish_timer;
+    } edf;
+
     /* architecture stuff */
     struct arch_thread arch;
 
@@ -122,17 +161,40 @@ typedef struct thread {
     uintptr_t tls[MAX_TLS_ENTRY];
 
     char name[32];
+
+#if THREAD_STATS
+    /* scheduler accounting, in current_time_hires() units */
+    lk_bigtime_t runtime; /* total time spent running */
+    lk_bigtime_t max_run; /* longest stretch on a cpu before being switched out */
+    lk_bigtime_t max_latency; /* longest wait from wakeup to running */
+    lk_bigtime_t last_run_timestamp;
+    lk_bigtime_t ready_timestamp; /* time of the last wakeup, 0 once running */
+#endif
 } thread_t;
 
+/* every cpu the system could have */
+#define THREAD_CPU_AFFINITY_ALL ((mp_cpu_mask_t)((1ULL << SMP_MAX_CPUS) - 1))
+
 #if WITH_SMP
 #define thread_curr_cpu(t) ((t)->curr_cpu)
-#define thread_pinned_cpu(t) ((t)->pinned_cpu)
 #define thread_set_curr_cpu(t,c) ((t)->curr_cpu = (c))
-#define thread_set_pinned_cpu(t, c) ((t)->pinned_cpu = (c))
+#define thread_last_cpu(t) ((t)->last_cpu)
+#define thread_set_last_cpu(t, c) ((t)->last_cpu = (c))
+#define thread_cpu_affinity(t) ((t)->cpu_affinity)
+#define thread_set_cpu_affinity_mask(t, m) ((t)->cpu_affinity = (m))
+/* pinning is an affinity mask with a single cpu in it */
+#define thread_pinned_cpu(t) \
+    (__builtin_popcount((t)->cpu_affinity) == 1 ? __builtin_ctz((t)->cpu_affinity) : -1)
+#define thread_set_pinned_cpu(t, c) \
+    ((t)->cpu_affinity = ((int)(c) < 0) ? THREAD_CPU_AFFINITY_ALL : (1U << (c)))
 #else
 #define thread_curr_cpu(t) (0)
-#define thread_pinned_cpu(t) (-1)
 #define thread_set_curr_cpu(t,c) do {} while(0)
+#define thread_last_cpu(t) (0)
+#define thread_set_last_cpu(t, c) do {} while(0)
+#define thread_cpu_affinity(t) (THREAD_CPU_AFFINITY_ALL)
+#define thread_set_cpu_affinity_mask(t, m) do {} while(0)
+#define thread_pinned_cpu(t) (-1)
 #define thread_set_pinned_cpu(t, c) do {} while(0)
 #endif
 
@@ -161,25 +223,31 @@ void thread_secondary_cpu_init_early(void);
 void thread_secondary_cpu_entry(void) __NO_RETURN;
 void thread_set_name(const char *name);
 void thread_set_priority(int priority);
+status_t thread_set_cpu_affinity(thread_t *t, mp_cpu_mask_t mask);
+mp_cpu_mask_t thread_get_cpu_affinity(thread_t *t);
 thread_t *thread_create(const char *name, thread_start_routine entry, void *arg, int priority, size_t stack_size);
 thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine entry, void *arg, int priority, void *stack, size_t stack_size);
 status_t thread_resume(thread_t *);
 void thread_exit(int retcode) __NO_RETURN;
 void thread_sleep(lk_time_t delay);
+void thread_sleep_ns(lk_time_ns_t delay);
 status_t thread_detach(thread_t *t);
 status_t thread_join(thread_t *t, int *retcode, lk_time_t timeout);
 status_t thread_detach_and_resume(thread_t *t);
 status_t thread_set_real_time(thread_t *t);
+status_t thread_set_deadline(thread_t *t, lk_time_t period, lk_time_t budget);
 
 void dump_thread(thread_t *t);
 void arch_dump_thread(thread_t *t);
 void dump_all_threads(void);
+void dump_all_thread_stats(void);
 
 /* scheduler routines */
 void thread_yield(void); /* give up the cpu voluntarily */
 void thread_preempt(void); /* get preempted (inserted into head of run queue) */
 void thread_block(void); /* block on something and reschedule */
 void thread_unblock(thread_t *t, bool resched); /* go back in the run queue */
+void thread_set_inherited_priority(thread_t *t, int priority); /* boost, -1 to drop (thread lock held) */
 
 #ifdef WITH_LIB_UTHREAD
 void uthread_context_switch(thread_t *oldthread, thread_t *newthread);
@@ -194,15 +262,41 @@ void set_current_thread(thread_t *);
 
 /* scheduler lock */
 extern spin_lock_t thread_lock;
+#if LOCK_STATS
+extern struct lock_stats thread_lock_stats;
+#endif
 
-#define THREAD_LOCK(state) spin_lock_saved_state_t state; spin_lock_irqsave(&thread_lock, state)
-#define THREAD_UNLOCK(state) spin_unlock_irqrestore(&thread_lock, state)
+#define THREAD_LOCK(state) spin_lock_saved_state_t state; spin_lock_irqsave_stats(&thread_lock, state, &thread_lock_stats)
+#define THREAD_UNLOCK(state) spin_unlock_irqrestore_stats(&thread_lock, state, &thread_lock_stats)
 
 static inline bool thread_lock_held(void)
 {
     return spin_lock_held(&thread_lock);
 }
 
+/*
+ * Keep the current thread on this cpu. Interrupts still run, but a reschedule
+ * they ask for is held off until the outermost thread_preempt_enable(). The
+ * thread must not block while preemption is disabled.
+ */
+void thread_preempt_deferred(void);
+
+static inline __ALWAYS_INLINE void thread_preempt_disable(void)
+{
+    get_current_thread()->preempt_disable++;
+    CF;
+}
+
+static inline __ALWAYS_INLINE void thread_preempt_enable(void)
+{
+    thread_t *t = get_current_thread();
+
+    CF;
+    DEBUG_ASSERT(t->preempt_disable > 0);
+    if (--t->preempt_disable == 0 && unlikely(t->preempt_pending))
+        thread_preempt_deferred();
+}
+
 /* thread local storage */
 static inline __ALWAYS_INLINE uintptr_t tls_get(uint entry)
 {
@@ -222,8 +316,19 @@ static inline __ALWAYS_INLINE uintptr_t __tls_set(uint entry, uintptr_t val)
         __tls_set(e, v); \
     })
 
+/*
+ * Give a tls entry a destructor, called by thread_exit() with the exiting
+ * thread's value of it when that isn't zero. An entry with a destructor
+ * belongs to its thread, so new threads start with it zeroed instead of
+ * inheriting it from their creator.
+ */
+typedef void (*tls_destructor_t)(uintptr_t val);
+void tls_set_destructor(uint entry, tls_destructor_t dtor);
+
 /* thread level statistics */
 #if THREAD_STATS
+#define THREAD_LATENCY_BUCKETS 16
+
 struct thread_stats {
     lk_bigtime_t idle_time;
     lk_bigtime_t last_idle_timestamp;
@@ -237,12 +342,17 @@ struct thread_stats {
 
 #if WITH_SMP
     ulong reschedule_ipis;
+    ulong reschedule_ipis_suppressed; /* not sent, one was already pending */
+    ulong steals; /* threads pulled from a sibling cpu's run queue */
 #endif
-};
 
-extern struct thread_stats thread_stats[SMP_MAX_CPUS];
+    /* wakeup to run latency by priority, bucket 0 counts latencies of 0us,
+     * bucket n those in [2^(n-1), 2^n) us and the last one everything above */
+    ulong latency_hist[NUM_PRIORITIES][THREAD_LATENCY_BUCKETS];
+};
 
-#define THREAD_STATS_INC(name) do { thread_stats[arch_curr_cpu_num()].name++; } while(0)
+/* kept per cpu in struct percpu */
+#define THREAD_STATS_INC(name) do { get_percpu()->thread_stats.name++; } while(0)
 
 #else
 
@@ -252,4 +362,7 @@ extern struct thread_stats thread_stats[SMP_MAX_CPUS];
 
 __END_CDECLS;
 
+/* needs the complete thread types above */
+#include <kernel/percpu.h>
+
 #endif
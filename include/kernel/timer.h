@@ -25,6 +25,7 @@
 
 #include <compiler.h>
 #include <list.h>
+#include <stdbool.h>
 #include <sys/types.h>
 
 __BEGIN_CDECLS;
@@ -42,6 +43,12 @@ typedef struct timer {
 
     lk_time_t scheduled_time;
     lk_time_t periodic_time;
+    lk_time_t slack;
+
+    /* set by the _ns calls, which use the fields below instead of the wheel */
+    bool hires;
+    lk_time_ns_t scheduled_time_ns;
+    lk_time_ns_t periodic_time_ns;
 
     timer_callback callback;
     void *arg;
@@ -53,6 +60,10 @@ typedef struct timer {
     .node = LIST_INITIAL_CLEARED_VALUE, \
     .scheduled_time = 0, \
     .periodic_time = 0, \
+    .slack = 0, \
+    .hires = false, \
+    .scheduled_time_ns = 0, \
+    .periodic_time_ns = 0, \
     .callback = NULL, \
     .arg = NULL, \
 }
@@ -61,13 +72,26 @@ typedef struct timer {
  * - Timer callbacks occur from interrupt context
  * - Timers may be programmed or canceled from interrupt or thread context
  * - Timers may be canceled or reprogrammed from within their callback
- * - Timers currently are dispatched from a 10ms periodic tick
+ * - Without PLATFORM_HAS_DYNAMIC_TIMER timers are dispatched from a 10ms periodic
+ *   tick, otherwise the hardware is programmed for the next deadline only
+ * - A timer given slack may fire up to that many ms late, letting nearby
+ *   deadlines share an interrupt
+ * - The _ns variants program the hardware for the exact deadline when the
+ *   platform has a dynamic timer, otherwise they round up to whole ms. Slack
+ *   does not apply to them.
 */
 void timer_initialize(timer_t *);
+void timer_set_slack(timer_t *, lk_time_t slack);
 void timer_set_oneshot(timer_t *, lk_time_t delay, timer_callback, void *arg);
 void timer_set_periodic(timer_t *, lk_time_t period, timer_callback, void *arg);
+void timer_set_oneshot_ns(timer_t *, lk_time_ns_t delay, timer_callback, void *arg);
+void timer_set_periodic_ns(timer_t *, lk_time_ns_t period, timer_callback, void *arg);
 void timer_cancel(timer_t *);
 
+/* when the current cpu's next timer interrupt is due on the current_time_ns() clock,
+ * UINT64_MAX if it has none coming */
+lk_time_ns_t timer_next_deadline_ns(void);
+
 __END_CDECLS;
 
 #endif
@@ -83,7 +83,8 @@ typedef struct vm_page {
     struct list_node node;
 
     uint flags : 8;
-    uint ref : 24;
+    uint order : 8; /* size of the free block this page heads, if it does */
+    uint ref : 16;  /* vm objects holding the page, see vmm_object_clone */
 } vm_page_t;
 
 #define VM_PAGE_FLAG_NONFREE  (0x1)
@@ -119,6 +120,12 @@ static inline bool is_user_address(vaddr_t va)
 }
 
 /* physical allocator */
+
+/* free pages are kept in naturally aligned blocks of up to 2^PMM_MAX_ORDER pages */
+#ifndef PMM_MAX_ORDER
+#define PMM_MAX_ORDER 10
+#endif
+
 typedef struct pmm_arena {
     struct list_node node;
     const char *name;
@@ -132,10 +139,11 @@ typedef struct pmm_arena {
     size_t free_count;
 
     struct vm_page *page_array;
-    struct list_node free_list;
+    struct list_node free_list[PMM_MAX_ORDER + 1];
 } pmm_arena_t;
 
 #define PMM_ARENA_FLAG_KMAP (0x1) /* this arena is already mapped and useful for kallocs */
+#define PMM_ARENA_FLAG_FAST (0x2) /* low latency memory, on chip sram and the like */
 
 /* Add a pre-filled memory arena to the physical allocator. */
 status_t pmm_add_arena(pmm_arena_t *arena) __NONNULL((1));
@@ -146,6 +154,41 @@ status_t pmm_add_arena(pmm_arena_t *arena) __NONNULL((1));
  */
 size_t pmm_alloc_pages(uint count, struct list_node *list) __NONNULL((2));
 
+/* As above, with PMM_ALLOC_FLAG_* flags.
+ * PMM_ALLOC_FLAG_ZEROED returns zero filled kmap pages, drawing first on a
+ * pool of pages zeroed ahead of time by a low priority thread.
+ */
+size_t pmm_alloc_pages_etc(uint count, uint flags, struct list_node *list) __NONNULL((3));
+
+#define PMM_ALLOC_FLAG_ZEROED (0x1)
+
+/* Placement. Without these arenas are tried in priority order. FAST tries
+ * PMM_ARENA_FLAG_FAST arenas first, BULK tries them last, either way falling
+ * back to the others unless STRICT is also passed.
+ */
+#define PMM_ALLOC_FLAG_FAST   (0x2)
+#define PMM_ALLOC_FLAG_BULK   (0x4)
+#define PMM_ALLOC_FLAG_STRICT (0x8)
+
+/* Page coloring. Pages whose physical addresses differ only above
+ * PMM_NUM_COLORS pages fall in the same sets of the last level cache, so
+ * threads whose pages have disjoint colors can't evict each other from it.
+ * The platform should set this to cache size / (ways * PAGE_SIZE).
+ */
+#ifndef PMM_NUM_COLORS
+#define PMM_NUM_COLORS 16
+#endif
+
+static inline uint pmm_page_color(paddr_t pa)
+{
+    return (pa / PAGE_SIZE) % PMM_NUM_COLORS;
+}
+
+/* As pmm_alloc_pages_etc, but only pages whose color is set in |colors|.
+ * Never served from the per cpu caches or the zeroed pool, 0 means any color.
+ */
+size_t pmm_alloc_pages_colored(uint count, uint flags, uint32_t colors, struct list_node *list) __NONNULL((4));
+
 /* Allocate a specific range of physical pages, adding to the tail of the passed list.
  * The list must be initialized.
  * Returns the number of pages allocated.
@@ -160,12 +203,21 @@ size_t pmm_free(struct list_node *list) __NONNULL((1));
 /* Helper routine for the above. */
 size_t pmm_free_page(vm_page_t *page) __NONNULL((1));
 
+/* Allocate a single page, NULL if out of memory.
+ * Single page allocations and frees are served from a per cpu cache of
+ * kmap pages where possible.
+ */
+vm_page_t *pmm_alloc_page(void);
+
 /* Allocate a run of contiguous pages, aligned on log2 byte boundary (0-31)
  * If the optional physical address pointer is passed, return the address.
  * If the optional list is passed, append the allocate page structures to the tail of the list.
  */
 size_t pmm_alloc_contiguous(uint count, uint8_t align_log2, paddr_t *pa, struct list_node *list);
 
+/* As above, with PMM_ALLOC_FLAG_* placement flags. */
+size_t pmm_alloc_contiguous_etc(uint count, uint8_t align_log2, uint flags, paddr_t *pa, struct list_node *list);
+
 /* Allocate a run of pages out of the kernel area and return the pointer in kernel space.
  * If the optional list is passed, append the allocate page structures to the tail of the list.
  */
@@ -202,6 +254,7 @@ typedef struct vmm_aspace {
     size_t  size;
 
     struct list_node region_list;
+    struct vmm_region *region_tree;
 
     arch_aspace_t arch_aspace;
 } vmm_aspace_t;
@@ -219,10 +272,43 @@ typedef struct vmm_region {
     size_t  size;
 
     struct list_node page_list;
+    uint32_t colors;    /* page colors lazy faults allocate from, 0 for any */
+
+    /* the vm object mapped here, if VMM_REGION_FLAG_OBJECT */
+    struct vmm_object *object;
+    struct vmm_aspace *aspace;
+    struct list_node object_node;
+
+    /* balanced tree of the aspace's regions, ordered by base and tracking
+     * the unused space in front of each region */
+    struct vmm_region *tree_left;
+    struct vmm_region *tree_right;
+    uint tree_height;
+    size_t gap;     /* free space between the previous region and this one */
+    size_t max_gap; /* largest gap in this subtree */
 } vmm_region_t;
 
 #define VMM_REGION_FLAG_RESERVED 0x1
 #define VMM_REGION_FLAG_PHYSICAL 0x2
+#define VMM_REGION_FLAG_LAZY     0x4
+#define VMM_REGION_FLAG_FAST_MEM 0x8
+#define VMM_REGION_FLAG_BULK_MEM 0x10
+#define VMM_REGION_FLAG_OBJECT   0x20
+
+/* A set of pages that can be mapped into any number of regions, in any
+ * number of address spaces, all of them seeing the same memory. Pages are
+ * zero filled on first touch. A clone starts out sharing every page with
+ * its source; a page stays shared, and mapped read only, until either side
+ * writes to it and gets a copy of its own. */
+typedef struct vmm_object {
+    int ref;            /* handles plus mapping regions */
+    size_t size;
+    uint pmm_flags;     /* what faults allocate with */
+    uint32_t colors;
+
+    vm_page_t **pages;  /* the page at each offset, NULL until touched */
+    struct list_node region_list;
+} vmm_object_t;
 
 /* grab a handle to the kernel address space */
 extern vmm_aspace_t _kernel_aspace;
@@ -256,6 +342,49 @@ status_t vmm_free_region(vmm_aspace_t *aspace, vaddr_t va);
 
 /* For the above region creation routines. Allocate virtual space at the passed in pointer. */
 #define VMM_FLAG_VALLOC_SPECIFIC 0x1
+/* For vmm_alloc. Back the region with zero filled pages. */
+#define VMM_FLAG_ZERO 0x2
+/* For vmm_alloc. Only reserve the range up front and fault in zero filled
+   pages on first touch. Lazy regions must not be touched with interrupts
+   disabled, the fault has to be able to block on the vmm and pmm locks. */
+#define VMM_FLAG_LAZY 0x4
+/* For vmm_alloc and vmm_alloc_contiguous. Prefer PMM_ARENA_FLAG_FAST memory
+   for hot data, or keep bulk buffers out of it. See PMM_ALLOC_FLAG_FAST/BULK. */
+#define VMM_FLAG_FAST_MEM 0x8
+#define VMM_FLAG_BULK_MEM 0x10
+/* For vmm_alloc. Back the region only with pages of the given set of
+   colors (a bitmap, see PMM_NUM_COLORS), to keep its working set apart in
+   the shared cache from everything allocated with other colors. */
+#define VMM_FLAG_COLORS(colors) ((uint)(colors) << 16)
+#define VMM_FLAG_GET_COLORS(flags) ((flags) >> 16)
+
+/* create a vm object of size bytes, returning a handle to it. Honors
+   VMM_FLAG_FAST_MEM, VMM_FLAG_BULK_MEM and VMM_FLAG_COLORS for its pages */
+status_t vmm_object_create(vmm_object_t **obj, size_t size, uint vmm_flags)
+__NONNULL((1));
+
+/* create a copy on write clone of a vm object, returning a handle to it */
+status_t vmm_object_clone(vmm_object_t *obj, vmm_object_t **clone)
+__NONNULL((1, 2));
+
+/* drop a handle. the object goes away once it is unmapped everywhere */
+void vmm_object_release(vmm_object_t *obj) __NONNULL((1));
+
+/* map all of a vm object into a new region, which holds its own reference
+   until vmm_free_region. Takes VMM_FLAG_VALLOC_SPECIFIC */
+status_t vmm_map_object(vmm_aspace_t *aspace, const char *name, vmm_object_t *obj, void **ptr,
+                        uint8_t align_log2, uint vmm_flags, uint arch_mmu_flags)
+__NONNULL((1, 3));
+
+/* fault in the page behind a lazy or object region. called by the arch fault
+   handlers, returns NO_ERROR if the faulting access can be retried */
+status_t vmm_page_fault_handler(vaddr_t addr, uint pf_flags);
+
+/* flags describing the faulting access */
+#define VMM_PF_FLAG_WRITE       0x1
+#define VMM_PF_FLAG_USER        0x2
+#define VMM_PF_FLAG_INSTRUCTION 0x4
+#define VMM_PF_FLAG_NOT_PRESENT 0x8
 
 /* allocate a new address space */
 status_t vmm_create_aspace(vmm_aspace_t **aspace, const char *name, uint flags)
@@ -75,6 +75,15 @@ status_t wait_queue_block(wait_queue_t *, lk_time_t timeout);
 int wait_queue_wake_one(wait_queue_t *, bool reschedule, status_t wait_queue_error);
 int wait_queue_wake_all(wait_queue_t *, bool reschedule, status_t wait_queue_error);
 
+/*
+ * same as wait_queue_wake_one(), but releases the highest priority thread
+ * instead of the one that has waited longest.
+ */
+int wait_queue_wake_highest(wait_queue_t *, bool reschedule, status_t wait_queue_error);
+
+/* priority of the highest priority thread waiting, or -1 if none */
+int wait_queue_highest_priority(wait_queue_t *);
+
 /*
  * remove the thread from whatever wait queue it's in.
  * return an error if the thread is not currently blocked (or is the current thread)
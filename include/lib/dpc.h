@@ -23,14 +23,52 @@
 #ifndef __KERNEL_DPC_H
 #define __KERNEL_DPC_H
 
+#include <compiler.h>
 #include <list.h>
 #include <sys/types.h>
 
+__BEGIN_CDECLS;
+
 typedef void (*dpc_callback)(void *arg);
 
 #define DPC_FLAG_NORESCHED 0x1
 
+/*
+ * A deferred procedure call node. Embed one in the object that owns the work
+ * and queue it with dpc_queue_etc(): queueing does not allocate or disable
+ * interrupts, so it is safe from interrupt context. A node can only be on the
+ * queue once at a time and must stay valid until its callback runs. It is
+ * marked idle again just before the callback is called, so the callback may
+ * requeue it.
+ */
+typedef struct dpc {
+    struct dpc *next;
+    volatile int queued;
+
+    dpc_callback cb;
+    void *arg;
+} dpc_t;
+
+#define DPC_INITIAL_VALUE(_cb, _arg) \
+{ \
+    .next = NULL, \
+    .queued = 0, \
+    .cb = (_cb), \
+    .arg = (_arg), \
+}
+
+void dpc_init(dpc_t *dpc, dpc_callback cb, void *arg);
+
+/* queue onto the current cpu's dpc thread,
+ * returns ERR_ALREADY_EXISTS if the node is already queued */
+status_t dpc_queue_etc(dpc_t *dpc, uint flags);
+
+/* queue onto the dpc thread of a specific cpu */
+status_t dpc_queue_cpu(dpc_t *dpc, uint cpu, uint flags);
+
+/* allocates a node per call, prefer dpc_queue_etc() from interrupt context */
 status_t dpc_queue(dpc_callback, void *arg, uint flags);
 
-#endif
+__END_CDECLS;
 
+#endif
@@ -41,6 +41,12 @@ typedef void (*evlog_dump_cb)(const uintptr_t *);
 
 void evlog_dump(evlog_t *e, evlog_dump_cb cb);
 
+/* walk the same entries as evlog_dump, oldest first, without a callback.
+ * start with index = evlog_iter_begin(e), evlog_iter_next returns NULL past the newest.
+ */
+uint evlog_iter_begin(evlog_t *e);
+const uintptr_t *evlog_iter_next(evlog_t *e, uint *index);
+
 /* bump the head pointer and return the old one.
  */
 uint evlog_bump_head(evlog_t *e);
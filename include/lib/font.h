@@ -33,6 +33,9 @@ __BEGIN_CDECLS
 
 void font_draw_char(gfx_surface *surface, unsigned char c, int x, int y, uint32_t color);
 
+// one row of a glyph as a bitmask, bit 0 is the leftmost pixel
+uint font_glyph_row(unsigned char c, uint row);
+
 __END_CDECLS
 
 #endif
@@ -47,6 +47,17 @@ typedef enum {
 
 #define MAX_ALPHA 255
 
+// a rectangle of pixels within a surface
+typedef struct gfx_rect {
+    uint x;
+    uint y;
+    uint width;
+    uint height;
+} gfx_rect;
+
+// number of separate damaged areas a surface tracks before merging them
+#define GFX_MAX_DIRTY_RECTS 8
+
 /**
  * @brief  Describe a graphics drawing surface
  *
@@ -73,6 +84,11 @@ typedef struct gfx_surface {
     void (*fillrect)(struct gfx_surface *, uint x, uint y, uint width, uint height, uint color);
     void (*putpixel)(struct gfx_surface *, uint x, uint y, uint color);
     void (*flush)(uint starty, uint endy);
+    void (*flush_rect)(uint x, uint y, uint width, uint height);
+
+    // areas drawn since the last flush
+    uint dirty_count;
+    gfx_rect dirty[GFX_MAX_DIRTY_RECTS];
 } gfx_surface;
 
 // copy a rect from x,y with width x height to x2, y2
@@ -84,25 +100,31 @@ void gfx_fillrect(gfx_surface *surface, uint x, uint y, uint width, uint height,
 // draw a pixel at x, y in the surface
 void gfx_putpixel(gfx_surface *surface, uint x, uint y, uint color);
 
+// write a row of ARGB8888 pixels starting at x, y, converted to the surface format
+void gfx_putrow(gfx_surface *surface, uint x, uint y, const uint32_t *pixels, uint count);
+
 // draw a single pixel line between x1,y1 and x2,y1
 void gfx_line(gfx_surface *surface, uint x1, uint y1, uint x2, uint y2, uint color);
 
-// clear the entire surface with a color
-static inline void gfx_clear(gfx_surface *surface, uint color)
-{
-    surface->fillrect(surface, 0, 0, surface->width, surface->height, color);
-
-    if (surface->flush)
-        surface->flush(0, surface->height-1);
-}
-
 // blend between two surfaces
 void gfx_surface_blend(struct gfx_surface *target, struct gfx_surface *source, uint destx, uint desty);
 
+// record that a rect was modified outside of the gfx routines, so the next flush picks it up
+void gfx_mark_dirty(gfx_surface *surface, uint x, uint y, uint width, uint height);
+
+// push the areas drawn since the last flush to the display,
+// or the whole surface if nothing has been recorded
 void gfx_flush(struct gfx_surface *surface);
 
 void gfx_flush_rows(struct gfx_surface *surface, uint start, uint end);
 
+// clear the entire surface with a color
+static inline void gfx_clear(gfx_surface *surface, uint color)
+{
+    gfx_fillrect(surface, 0, 0, surface->width, surface->height, color);
+    gfx_flush(surface);
+}
+
 // surface setup
 gfx_surface *gfx_create_surface(void *ptr, uint width, uint height, uint stride, gfx_format format);
 
@@ -51,6 +51,9 @@ __BEGIN_CDECLS;
 void *page_alloc(size_t pages, int arena_mask);
 void page_free(void *ptr, size_t pages);
 
+/* number of pages currently allocated through page_alloc */
+size_t page_alloc_pages_out(void);
+
 #if WITH_KERNEL_VM
 struct page_range {
     void *address;
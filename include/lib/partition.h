@@ -28,6 +28,10 @@
 /* examine and try to publish partitions on a particular device at a particular offset */
 int partition_publish(const char *device, off_t offset);
 
+/* same for several devices, reading all of their tables concurrently. returns the
+ * total number of partitions published */
+int partition_publish_devices(const char * const *devices, uint count, off_t offset);
+
 /* remove any published subdevices on this device */
 int partition_unpublish(const char *device);
 
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS;
+
+/*
+ * Sampling profiler. While running, a periodic timer on every cpu arms a
+ * sample and the platform's irq exit path records the interrupted pc, and
+ * the frame pointer chain above it where the arch can supply one.
+ */
+#if WITH_LIB_PROF
+
+extern volatile bool prof_running;
+void _prof_irq_sample(uintptr_t pc, uintptr_t fp);
+
+/* called by platform_irq after the handler runs. fp is 0 if there's no usable frame pointer */
+static inline void prof_irq_sample(uintptr_t pc, uintptr_t fp)
+{
+    if (unlikely(prof_running))
+        _prof_irq_sample(pc, fp);
+}
+
+status_t prof_start(uint hz);
+void prof_stop(void);
+void prof_reset(void);
+
+#else
+
+static inline void prof_irq_sample(uintptr_t pc, uintptr_t fp) {}
+
+#endif
+
+__END_CDECLS;
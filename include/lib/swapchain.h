@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <sys/types.h>
+#include <compiler.h>
+#include <dev/display.h>
+
+__BEGIN_CDECLS
+
+/*
+ * A small chain of back buffers in front of the display framebuffer.
+ *
+ * Producers acquire a free buffer, draw into it and present it. Present only
+ * queues the buffer, a worker thread copies queued frames to the framebuffer
+ * in order, at most one per frame interval, and releases each buffer once
+ * the display has it. Producers only block in acquire when every buffer is
+ * still queued.
+ */
+
+#define SWAPCHAIN_MAX_BUFFERS 3
+
+typedef struct swapchain swapchain_t;
+
+/* buffer_count is 2 for double buffering or 3 for triple, frame_interval 0 presents as fast as the display takes them */
+status_t swapchain_create(uint buffer_count, lk_time_t frame_interval, swapchain_t **sc);
+void swapchain_destroy(swapchain_t *sc);
+
+/* get a buffer to draw the next frame into */
+status_t swapchain_acquire(swapchain_t *sc, struct display_image **image, lk_time_t timeout);
+
+/* queue a frame returned by swapchain_acquire for display, returns immediately */
+status_t swapchain_present(swapchain_t *sc, struct display_image *image);
+
+/* frames that have made it to the display */
+uint64_t swapchain_frame_count(swapchain_t *sc);
+
+__END_CDECLS
@@ -55,6 +55,13 @@ enum lk_init_flags {
     LK_INIT_FLAG_ALL_CPUS        = LK_INIT_FLAG_PRIMARY_CPU | LK_INIT_FLAG_SECONDARY_CPUS,
     LK_INIT_FLAG_CPU_SUSPEND     = 0x4,
     LK_INIT_FLAG_CPU_RESUME      = 0x8,
+
+    /*
+     * may run on its own thread, alongside the other hooks at its level. the
+     * level still finishes before the next one starts. only honored for primary
+     * cpu hooks from LK_INIT_LEVEL_THREADING on, earlier ones always run in turn.
+     */
+    LK_INIT_FLAG_PARALLEL        = 0x10,
 };
 
 void lk_init_level(enum lk_init_flags flags, uint start_level, uint stop_level);
@@ -74,6 +81,7 @@ struct lk_init_struct {
     uint flags;
     lk_init_hook hook;
     const char *name;
+    const char * const *deps;   /* NULL terminated names of hooks to wait for, or NULL */
 };
 
 #define LK_INIT_HOOK_FLAGS(_name, _hook, _level, _flags) \
@@ -86,3 +94,26 @@ struct lk_init_struct {
 
 #define LK_INIT_HOOK(_name, _hook, _level) \
     LK_INIT_HOOK_FLAGS(_name, _hook, _level, LK_INIT_FLAG_PRIMARY_CPU)
+
+#define LK_INIT_HOOK_PARALLEL(_name, _hook, _level) \
+    LK_INIT_HOOK_FLAGS(_name, _hook, _level, LK_INIT_FLAG_PRIMARY_CPU | LK_INIT_FLAG_PARALLEL)
+
+/*
+ * a hook that waits for the named hooks to finish first. only hooks at the same
+ * level are waited for, lower levels are always done already. dependencies
+ * can't form a cycle, or wait on a serial hook that runs later in the level.
+ */
+#define LK_INIT_HOOK_DEPS(_name, _hook, _level, _flags, ...) \
+    static const char * const _init_deps_##_name[] = { __VA_ARGS__, NULL }; \
+    const struct lk_init_struct _init_struct_##_name __ALIGNED(sizeof(void *)) __SECTION(".lk_init") = { \
+        .level = _level, \
+        .flags = _flags, \
+        .hook = _hook, \
+        .name = #_name, \
+        .deps = _init_deps_##_name, \
+    };
+
+#if WITH_LK_INIT_PROFILE
+/* print how long each init hook took, slowest first. also the "initprof" command */
+void lk_init_profile_dump(void);
+#endif
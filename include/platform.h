@@ -50,6 +50,7 @@ typedef enum {
 
 lk_time_t current_time(void);
 lk_bigtime_t current_time_hires(void);
+lk_time_ns_t current_time_ns(void);
 
 /* super early platform initialization, before almost everything */
 void platform_early_init(void);
@@ -48,6 +48,7 @@ typedef int kobj_id;
 
 typedef uint32_t lk_time_t;
 typedef unsigned long long lk_bigtime_t;
+typedef unsigned long long lk_time_ns_t;
 #define INFINITE_TIME UINT32_MAX
 
 #define TIME_GTE(a, b) ((int32_t)((a) - (b)) >= 0)
@@ -33,10 +33,12 @@
 
 #include <debug.h>
 #include <stdio.h>
+#include <string.h>
 #include <kernel/thread.h>
 #include <kernel/timer.h>
 #include <kernel/debug.h>
 #include <kernel/mp.h>
+#include <kernel/spinlock.h>
 #include <err.h>
 #include <platform.h>
 
@@ -79,20 +81,50 @@ static int cmd_threadstats(int argc, const cmd_args *argv)
             continue;
 
         printf("thread stats (cpu %d):\n", i);
-        printf("\ttotal idle time: %lld\n", thread_stats[i].idle_time);
-        printf("\ttotal busy time: %lld\n", current_time_hires() - thread_stats[i].idle_time);
-        printf("\treschedules: %lu\n", thread_stats[i].reschedules);
+        printf("\ttotal idle time: %lld\n", percpu[i].thread_stats.idle_time);
+        printf("\ttotal busy time: %lld\n", current_time_hires() - percpu[i].thread_stats.idle_time);
+        printf("\treschedules: %lu\n", percpu[i].thread_stats.reschedules);
 #if WITH_SMP
-        printf("\treschedule_ipis: %lu\n", thread_stats[i].reschedule_ipis);
+        printf("\treschedule_ipis: %lu\n", percpu[i].thread_stats.reschedule_ipis);
+        printf("\treschedule_ipis suppressed: %lu\n", percpu[i].thread_stats.reschedule_ipis_suppressed);
+        printf("\tsteals: %lu\n", percpu[i].thread_stats.steals);
 #endif
-        printf("\tcontext_switches: %lu\n", thread_stats[i].context_switches);
-        printf("\tpreempts: %lu\n", thread_stats[i].preempts);
-        printf("\tyields: %lu\n", thread_stats[i].yields);
-        printf("\tinterrupts: %lu\n", thread_stats[i].interrupts);
-        printf("\ttimer interrupts: %lu\n", thread_stats[i].timer_ints);
-        printf("\ttimers: %lu\n", thread_stats[i].timers);
+        printf("\tcontext_switches: %lu\n", percpu[i].thread_stats.context_switches);
+        printf("\tpreempts: %lu\n", percpu[i].thread_stats.preempts);
+        printf("\tyields: %lu\n", percpu[i].thread_stats.yields);
+        printf("\tinterrupts: %lu\n", percpu[i].thread_stats.interrupts);
+        printf("\ttimer interrupts: %lu\n", percpu[i].thread_stats.timer_ints);
+        printf("\ttimers: %lu\n", percpu[i].thread_stats.timers);
     }
 
+    /* wakeup latency, summed across cpus, only for priorities that saw any */
+    printf("wakeup to run latency (us):\n");
+    printf("\tpri %7s", "0");
+    for (uint b = 1; b < THREAD_LATENCY_BUCKETS - 1; b++)
+        printf(" %6s%u", "<", 1U << b);
+    printf(" %7s\n", "more");
+
+    for (int pri = NUM_PRIORITIES - 1; pri >= 0; pri--) {
+        ulong hist[THREAD_LATENCY_BUCKETS] = { 0 };
+        ulong total = 0;
+
+        for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+            for (uint b = 0; b < THREAD_LATENCY_BUCKETS; b++) {
+                hist[b] += percpu[i].thread_stats.latency_hist[pri][b];
+                total += percpu[i].thread_stats.latency_hist[pri][b];
+            }
+        }
+        if (total == 0)
+            continue;
+
+        printf("\t%3d", pri);
+        for (uint b = 0; b < THREAD_LATENCY_BUCKETS; b++)
+            printf(" %7lu", hist[b]);
+        printf("\n");
+    }
+
+    dump_all_thread_stats();
+
     return 0;
 }
 
@@ -106,12 +138,12 @@ static enum handler_return threadload(struct timer *t, lk_time_t now, void *arg)
         if (!mp_is_cpu_active(i))
             continue;
 
-        lk_bigtime_t idle_time = thread_stats[i].idle_time;
+        lk_bigtime_t idle_time = percpu[i].thread_stats.idle_time;
 
         /* if the cpu is currently idle, add the time since it went idle up until now to the idle counter */
         bool is_idle = !!mp_is_cpu_idle(i);
         if (is_idle) {
-            idle_time += current_time_hires() - thread_stats[i].last_idle_timestamp;
+            idle_time += current_time_hires() - percpu[i].thread_stats.last_idle_timestamp;
         }
 
         lk_bigtime_t delta_time = idle_time - last_idle_time[i];
@@ -130,16 +162,16 @@ static enum handler_return threadload(struct timer *t, lk_time_t now, void *arg)
                "tmrs %lu\n",
                i,
                busypercent / 100, busypercent % 100,
-               thread_stats[i].context_switches - old_stats[i].context_switches,
-               thread_stats[i].preempts - old_stats[i].preempts,
+               percpu[i].thread_stats.context_switches - old_stats[i].context_switches,
+               percpu[i].thread_stats.preempts - old_stats[i].preempts,
 #if WITH_SMP
-               thread_stats[i].reschedule_ipis - old_stats[i].reschedule_ipis,
+               percpu[i].thread_stats.reschedule_ipis - old_stats[i].reschedule_ipis,
 #endif
-               thread_stats[i].interrupts - old_stats[i].interrupts,
-               thread_stats[i].timer_ints - old_stats[i].timer_ints,
-               thread_stats[i].timers - old_stats[i].timers);
+               percpu[i].thread_stats.interrupts - old_stats[i].interrupts,
+               percpu[i].thread_stats.timer_ints - old_stats[i].timer_ints,
+               percpu[i].thread_stats.timers - old_stats[i].timers);
 
-        old_stats[i] = thread_stats[i];
+        old_stats[i] = percpu[i].thread_stats;
         last_idle_time[i] = idle_time;
     }
 
@@ -172,30 +204,103 @@ static int cmd_threadload(int argc, const cmd_args *argv)
 
 #include <lib/evlog.h>
 
-static evlog_t kernel_evlog;
+/*
+ * Each cpu logs into its own ring with interrupts off, so writers never
+ * contend. An entry is 4 words: timestamp (low bits of current_time_hires),
+ * cpu << 16 | id, and two arguments.
+ */
+static evlog_t kernel_evlog[SMP_MAX_CPUS];
 volatile bool kernel_evlog_enable;
 
 void kernel_evlog_init(void)
 {
-    evlog_init(&kernel_evlog, KERNEL_EVLOG_LEN, 4);
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (evlog_init(&kernel_evlog[i], KERNEL_EVLOG_LEN, 4) < 0) {
+            printf("kernel evlog: failed to allocate log for cpu %u\n", i);
+            return;
+        }
+    }
 
     kernel_evlog_enable = true;
 }
 
-void kernel_evlog_add(uintptr_t id, uintptr_t arg0, uintptr_t arg1)
+void _kernel_evlog_add(uintptr_t id, uintptr_t arg0, uintptr_t arg1)
 {
-    if (kernel_evlog_enable) {
-        uint index = evlog_bump_head(&kernel_evlog);
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    uint cpu = arch_curr_cpu_num();
+    evlog_t *e = &kernel_evlog[cpu];
+    uint index = evlog_bump_head(e);
 
-        kernel_evlog.items[index] = (uintptr_t)current_time_hires();
-        kernel_evlog.items[index+1] = (arch_curr_cpu_num() << 16) | id;
-        kernel_evlog.items[index+2] = arg0;
-        kernel_evlog.items[index+3] = arg1;
+    e->items[index] = (uintptr_t)current_time_hires();
+    e->items[index+1] = (cpu << 16) | id;
+    e->items[index+2] = arg0;
+    e->items[index+3] = arg1;
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+void kernel_evlog_reset(void)
+{
+    bool enabled = kernel_evlog_enable;
+    kernel_evlog_enable = false;
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        evlog_t *e = &kernel_evlog[i];
+        if (!e->items)
+            continue;
+
+        e->head = 0;
+        memset(e->items, 0, sizeof(uintptr_t) << e->len_pow2);
     }
+
+    kernel_evlog_enable = enabled;
 }
 
 #if WITH_LIB_CONSOLE
 
+/* merges the per cpu logs back into a single timeline */
+struct kevlog_walk {
+    uint index[SMP_MAX_CPUS];
+    const uintptr_t *next[SMP_MAX_CPUS];
+};
+
+static void kevlog_walk_start(struct kevlog_walk *w)
+{
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        w->next[i] = NULL;
+        if (!kernel_evlog[i].items)
+            continue;
+
+        w->index[i] = evlog_iter_begin(&kernel_evlog[i]);
+        w->next[i] = evlog_iter_next(&kernel_evlog[i], &w->index[i]);
+    }
+}
+
+/* oldest remaining entry across all cpus, skipping slots that were never written */
+static const uintptr_t *kevlog_walk_next(struct kevlog_walk *w)
+{
+    for (;;) {
+        int best = -1;
+        for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+            if (!w->next[i])
+                continue;
+            /* timestamps are truncated to a word, compare them wrap safe */
+            if (best < 0 || (intptr_t)(w->next[i][0] - w->next[best][0]) < 0)
+                best = i;
+        }
+        if (best < 0)
+            return NULL;
+
+        const uintptr_t *item = w->next[best];
+        w->next[best] = evlog_iter_next(&kernel_evlog[best], &w->index[best]);
+
+        if ((item[1] & 0xffff) != KERNEL_EVLOG_NULL)
+            return item;
+    }
+}
+
 static void kevdump_cb(const uintptr_t *i)
 {
     switch (i[1] & 0xffff) {
@@ -217,6 +322,24 @@ static void kevdump_cb(const uintptr_t *i)
         case KERNEL_EVLOG_IRQ_EXIT:
             printf("%lu.%lu: irq exit  %lu\n", i[0], i[1] >> 16, i[2]);
             break;
+        case KERNEL_EVLOG_MUTEX_BLOCK:
+            printf("%lu.%lu: block on mutex %p held by %p\n", i[0], i[1] >> 16, (void *)i[2], (void *)i[3]);
+            break;
+        case KERNEL_EVLOG_MUTEX_WAKE:
+            printf("%lu.%lu: wake waiter on mutex %p\n", i[0], i[1] >> 16, (void *)i[2]);
+            break;
+        case KERNEL_EVLOG_BIO_SUBMIT:
+            printf("%lu.%lu: bio submit %p, block %lu\n", i[0], i[1] >> 16, (void *)i[2], i[3]);
+            break;
+        case KERNEL_EVLOG_BIO_COMPLETE:
+            printf("%lu.%lu: bio complete %p, result %ld\n", i[0], i[1] >> 16, (void *)i[2], (long)i[3]);
+            break;
+        case KERNEL_EVLOG_NET_RX:
+            printf("%lu.%lu: net rx %p, len %lu\n", i[0], i[1] >> 16, (void *)i[2], i[3]);
+            break;
+        case KERNEL_EVLOG_NET_TX:
+            printf("%lu.%lu: net tx %p, len %lu\n", i[0], i[1] >> 16, (void *)i[2], i[3]);
+            break;
         default:
             printf("%lu: unknown id 0x%lx 0x%lx 0x%lx\n", i[0], i[1], i[2], i[3]);
     }
@@ -224,15 +347,136 @@ static void kevdump_cb(const uintptr_t *i)
 
 void kernel_evlog_dump(void)
 {
+    struct kevlog_walk w;
+    const uintptr_t *i;
+
     kernel_evlog_enable = false;
-    evlog_dump(&kernel_evlog, &kevdump_cb);
+
+    kevlog_walk_start(&w);
+    while ((i = kevlog_walk_next(&w)))
+        kevdump_cb(i);
+
+    kernel_evlog_enable = true;
+}
+
+/*
+ * Chrome trace event format, as read by catapult's trace viewer and Perfetto.
+ * Each cpu is a track: threads and irqs are nested duration slices, everything
+ * else is an instant event. Timestamps are already in microseconds.
+ */
+static void kevdump_json_event(bool *first, const char *ph, const char *name, uintptr_t ts, uint cpu)
+{
+    printf("%s\n{\"ph\":\"%s\",\"name\":\"%s\",\"ts\":%lu,\"pid\":0,\"tid\":%u",
+           *first ? "" : ",", ph, name, ts, cpu);
+    if (ph[0] == 'i')
+        printf(",\"s\":\"t\"");
+    *first = false;
+}
+
+static void kevdump_json_cb(const uintptr_t *i, bool *first, uintptr_t running[])
+{
+    uint cpu = i[1] >> 16;
+    char name[32];
+
+    switch (i[1] & 0xffff) {
+        case KERNEL_EVLOG_CONTEXT_SWITCH:
+            if (running[cpu]) {
+                kevdump_json_event(first, "E", "", i[0], cpu);
+                printf("}");
+            }
+            snprintf(name, sizeof(name), "thread %p", (void *)i[3]);
+            kevdump_json_event(first, "B", name, i[0], cpu);
+            printf("}");
+            running[cpu] = i[3];
+            break;
+        case KERNEL_EVLOG_PREEMPT:
+            kevdump_json_event(first, "i", "preempt", i[0], cpu);
+            printf("}");
+            break;
+        case KERNEL_EVLOG_TIMER_TICK:
+            kevdump_json_event(first, "i", "timer tick", i[0], cpu);
+            printf("}");
+            break;
+        case KERNEL_EVLOG_TIMER_CALL:
+            kevdump_json_event(first, "i", "timer call", i[0], cpu);
+            printf(",\"args\":{\"callback\":\"%p\",\"arg\":\"%p\"}}", (void *)i[2], (void *)i[3]);
+            break;
+        case KERNEL_EVLOG_IRQ_ENTER:
+            snprintf(name, sizeof(name), "irq %lu", i[2]);
+            kevdump_json_event(first, "B", name, i[0], cpu);
+            printf("}");
+            break;
+        case KERNEL_EVLOG_IRQ_EXIT:
+            kevdump_json_event(first, "E", "", i[0], cpu);
+            printf("}");
+            break;
+        case KERNEL_EVLOG_MUTEX_BLOCK:
+            kevdump_json_event(first, "i", "mutex block", i[0], cpu);
+            printf(",\"args\":{\"mutex\":\"%p\",\"holder\":\"%p\"}}", (void *)i[2], (void *)i[3]);
+            break;
+        case KERNEL_EVLOG_MUTEX_WAKE:
+            kevdump_json_event(first, "i", "mutex wake", i[0], cpu);
+            printf(",\"args\":{\"mutex\":\"%p\"}}", (void *)i[2]);
+            break;
+        case KERNEL_EVLOG_BIO_SUBMIT:
+            kevdump_json_event(first, "i", "bio submit", i[0], cpu);
+            printf(",\"args\":{\"req\":\"%p\",\"block\":%lu}}", (void *)i[2], i[3]);
+            break;
+        case KERNEL_EVLOG_BIO_COMPLETE:
+            kevdump_json_event(first, "i", "bio complete", i[0], cpu);
+            printf(",\"args\":{\"req\":\"%p\",\"result\":%ld}}", (void *)i[2], (long)i[3]);
+            break;
+        case KERNEL_EVLOG_NET_RX:
+            kevdump_json_event(first, "i", "net rx", i[0], cpu);
+            printf(",\"args\":{\"len\":%lu}}", i[3]);
+            break;
+        case KERNEL_EVLOG_NET_TX:
+            kevdump_json_event(first, "i", "net tx", i[0], cpu);
+            printf(",\"args\":{\"len\":%lu}}", i[3]);
+            break;
+    }
+}
+
+void kernel_evlog_dump_json(void)
+{
+    struct kevlog_walk w;
+    const uintptr_t *i;
+    uintptr_t running[SMP_MAX_CPUS] = { 0 };
+    bool first = true;
+
+    kernel_evlog_enable = false;
+
+    printf("{\"traceEvents\":[");
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        if (!mp_is_cpu_active(cpu))
+            continue;
+        kevdump_json_event(&first, "M", "thread_name", 0, cpu);
+        printf(",\"args\":{\"name\":\"cpu %u\"}}", cpu);
+    }
+
+    kevlog_walk_start(&w);
+    while ((i = kevlog_walk_next(&w))) {
+        if ((i[1] >> 16) < SMP_MAX_CPUS)
+            kevdump_json_cb(i, &first, running);
+    }
+    printf("\n]}\n");
+
     kernel_evlog_enable = true;
 }
 
 static int cmd_kevlog(int argc, const cmd_args *argv)
 {
-    printf("kernel event log:\n");
-    kernel_evlog_dump();
+    if (argc < 2) {
+        printf("kernel event log:\n");
+        kernel_evlog_dump();
+    } else if (!strcmp(argv[1].str, "json")) {
+        kernel_evlog_dump_json();
+    } else if (!strcmp(argv[1].str, "reset")) {
+        kernel_evlog_reset();
+    } else {
+        printf("usage: %s [json|reset]\n", argv[0].str);
+        return ERR_INVALID_ARGS;
+    }
 
     return NO_ERROR;
 }
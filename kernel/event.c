@@ -44,6 +44,7 @@
 #include <debug.h>
 #include <assert.h>
 #include <err.h>
+#include <arch/ops.h>
 #include <kernel/thread.h>
 
 /**
@@ -74,7 +75,7 @@ void event_destroy(event_t *e)
     THREAD_LOCK(state);
 
     e->magic = 0;
-    e->signaled = false;
+    e->state = 0;
     e->flags = 0;
     wait_queue_destroy(&e->wait, true);
 
@@ -102,18 +103,37 @@ status_t event_wait_timeout(event_t *e, lk_time_t timeout)
 
     DEBUG_ASSERT(e->magic == EVENT_MAGIC);
 
+    /* fast path, fall through a signaled event without the thread lock. an
+     * autounsignal event can only be consumed here if nobody is in the slow path */
+    int s = e->state;
+    if (s & EVENT_STATE_SIGNALED) {
+        if ((e->flags & EVENT_FLAG_AUTOUNSIGNAL) == 0) {
+            smp_mb();
+            return NO_ERROR;
+        }
+        if (s == EVENT_STATE_SIGNALED &&
+                atomic_cmpxchg(&e->state, EVENT_STATE_SIGNALED, 0) == EVENT_STATE_SIGNALED) {
+            smp_mb();
+            return NO_ERROR;
+        }
+    }
+
     THREAD_LOCK(state);
 
-    if (e->signaled) {
+    /* count ourselves in before looking, so a racing signal sees a waiter and
+     * takes the slow path instead of setting the bit behind our back */
+    s = atomic_add(&e->state, EVENT_STATE_WAITER);
+    if (s & EVENT_STATE_SIGNALED) {
         /* signaled, we're going to fall through */
         if (e->flags & EVENT_FLAG_AUTOUNSIGNAL) {
             /* autounsignal flag lets one thread fall through before unsignaling */
-            e->signaled = false;
+            atomic_and(&e->state, ~EVENT_STATE_SIGNALED);
         }
     } else {
         /* unsignaled, block here */
         ret = wait_queue_block(&e->wait, timeout);
     }
+    atomic_add(&e->state, -EVENT_STATE_WAITER);
 
     THREAD_UNLOCK(state);
 
@@ -141,9 +161,19 @@ status_t event_signal(event_t *e, bool reschedule)
 {
     DEBUG_ASSERT(e->magic == EVENT_MAGIC);
 
+    /* fast path, already signaled is a no-op and with nobody waiting all there
+     * is to do is set the bit. fence first so whatever is being signaled is
+     * visible to whoever sees the bit */
+    smp_mb();
+    int s = e->state;
+    if (s & EVENT_STATE_SIGNALED)
+        return NO_ERROR;
+    if (s == 0 && atomic_cmpxchg(&e->state, 0, EVENT_STATE_SIGNALED) == 0)
+        return NO_ERROR;
+
     THREAD_LOCK(state);
 
-    if (!e->signaled) {
+    if (!(e->state & EVENT_STATE_SIGNALED)) {
         if (e->flags & EVENT_FLAG_AUTOUNSIGNAL) {
             /* try to release one thread and leave unsignaled if successful */
             if (wait_queue_wake_one(&e->wait, reschedule, NO_ERROR) <= 0) {
@@ -152,11 +182,11 @@ status_t event_signal(event_t *e, bool reschedule)
                  * signaled state and let the next call to event_wait
                  * unsignal the event.
                  */
-                e->signaled = true;
+                atomic_or(&e->state, EVENT_STATE_SIGNALED);
             }
         } else {
             /* release all threads and remain signaled */
-            e->signaled = true;
+            atomic_or(&e->state, EVENT_STATE_SIGNALED);
             wait_queue_wake_all(&e->wait, reschedule, NO_ERROR);
         }
     }
@@ -182,7 +212,7 @@ status_t event_unsignal(event_t *e)
 {
     DEBUG_ASSERT(e->magic == EVENT_MAGIC);
 
-    e->signaled = false;
+    atomic_and(&e->state, ~EVENT_STATE_SIGNALED);
 
     return NO_ERROR;
 }
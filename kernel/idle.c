@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <kernel/idle.h>
+
+#include <debug.h>
+#include <assert.h>
+#include <err.h>
+#include <trace.h>
+#include <stdio.h>
+#include <string.h>
+#include <arch/ops.h>
+#include <kernel/mp.h>
+#include <kernel/spinlock.h>
+#include <kernel/timer.h>
+#include <platform.h>
+
+#define LOCAL_TRACE 0
+
+/* stands in until a platform registers its states, never entered through the governor */
+static void idle_arch_enter(const idle_state_t *state)
+{
+    arch_idle();
+}
+
+static const idle_state_t arch_idle_state = {
+    .name = "arch",
+    .exit_latency_us = 0,
+    .target_residency_us = 0,
+    .enter = idle_arch_enter,
+};
+
+/* the states in use, set once at init */
+static const idle_state_t *idle_states = &arch_idle_state;
+static uint idle_state_count = 1;
+
+/* latency requests, and the tightest of them for the idle path to read without the lock */
+static spin_lock_t idle_latency_lock = SPIN_LOCK_INITIAL_VALUE;
+static struct list_node idle_latency_list = LIST_INITIAL_VALUE(idle_latency_list);
+static volatile uint32_t idle_latency_min = UINT32_MAX;
+
+/* only updated by the cpu they belong to */
+static struct idle_cpu_stats {
+    uint64_t count[IDLE_MAX_STATES];
+    uint64_t time_us[IDLE_MAX_STATES];
+    /* woken before the state's target residency, the pick cost more than it saved */
+    uint64_t early[IDLE_MAX_STATES];
+} idle_stats[SMP_MAX_CPUS] __CPU_ALIGN;
+
+status_t idle_register_states(const idle_state_t *states, uint count)
+{
+    if (count == 0 || count > IDLE_MAX_STATES)
+        return ERR_INVALID_ARGS;
+
+    for (uint i = 0; i < count; i++) {
+        if (!states[i].enter)
+            return ERR_INVALID_ARGS;
+        if (i > 0 && states[i].exit_latency_us < states[i - 1].exit_latency_us)
+            return ERR_INVALID_ARGS;
+    }
+
+    LTRACEF("%u states, deepest %s\n", count, states[count - 1].name);
+
+    /* cpus already in the idle loop pick these up on their next pass */
+    idle_state_count = count;
+    smp_wmb();
+    idle_states = states;
+
+    return NO_ERROR;
+}
+
+/* the deepest state allowed by the expected sleep and the latency limit */
+static uint idle_select(const idle_state_t *states, uint count, uint64_t sleep_us, uint32_t limit)
+{
+    uint pick = 0;
+
+    for (uint i = 1; i < count; i++) {
+        if (states[i].exit_latency_us > limit)
+            break;
+        if (states[i].target_residency_us > sleep_us)
+            continue;
+        pick = i;
+    }
+
+    return pick;
+}
+
+void idle_enter(void)
+{
+    const idle_state_t *states = idle_states;
+    smp_rmb();
+    uint count = idle_state_count;
+
+    /* nothing to choose from, skip the bookkeeping */
+    if (count == 1 && states == &arch_idle_state) {
+        arch_idle();
+        return;
+    }
+
+    /* so the choice holds until the cpu is asleep, and the wakeup interrupt doesn't
+     * get to run anything else before the sleep is accounted for */
+    arch_disable_ints();
+
+    lk_time_ns_t start = current_time_ns();
+    lk_time_ns_t deadline = timer_next_deadline_ns();
+    uint64_t sleep_us = (deadline == UINT64_MAX) ? UINT64_MAX :
+                        (deadline > start) ? (deadline - start) / 1000 : 0;
+
+    uint i = idle_select(states, count, sleep_us, idle_latency_min);
+    LTRACEF("sleep %llu us, state %s\n", sleep_us, states[i].name);
+
+    states[i].enter(&states[i]);
+
+    uint64_t slept_us = (current_time_ns() - start) / 1000;
+
+    struct idle_cpu_stats *s = &idle_stats[arch_curr_cpu_num()];
+    s->count[i]++;
+    s->time_us[i] += slept_us;
+    if (slept_us < states[i].target_residency_us)
+        s->early[i]++;
+
+    arch_enable_ints();
+}
+
+static void idle_latency_update_locked(void)
+{
+    uint32_t min = UINT32_MAX;
+    idle_latency_req_t *req;
+
+    list_for_every_entry(&idle_latency_list, req, idle_latency_req_t, node) {
+        if (req->latency_us < min)
+            min = req->latency_us;
+    }
+
+    bool tighter = min < idle_latency_min;
+    idle_latency_min = min;
+
+    /* cpus asleep in a state that is now too deep have to come out and choose again */
+    if (tighter && mp_get_idle_mask())
+        mp_reschedule(mp_get_idle_mask(), 0);
+}
+
+void idle_latency_request(idle_latency_req_t *req, uint32_t latency_us)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&idle_latency_lock, state);
+
+    if (!list_in_list(&req->node))
+        list_add_tail(&idle_latency_list, &req->node);
+    req->latency_us = latency_us;
+    idle_latency_update_locked();
+
+    spin_unlock_irqrestore(&idle_latency_lock, state);
+}
+
+void idle_latency_release(idle_latency_req_t *req)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&idle_latency_lock, state);
+
+    if (list_in_list(&req->node)) {
+        list_delete(&req->node);
+        idle_latency_update_locked();
+    }
+
+    spin_unlock_irqrestore(&idle_latency_lock, state);
+}
+
+uint32_t idle_latency_limit(void)
+{
+    return idle_latency_min;
+}
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+
+static int cmd_idle(int argc, const cmd_args *argv)
+{
+    static idle_latency_req_t console_req = IDLE_LATENCY_REQ_INITIAL_VALUE;
+
+    if (argc > 2 && !strcmp(argv[1].str, "latency")) {
+        if (!strcmp(argv[2].str, "off"))
+            idle_latency_release(&console_req);
+        else
+            idle_latency_request(&console_req, argv[2].u);
+    } else if (argc > 1 && !strcmp(argv[1].str, "reset")) {
+        memset(idle_stats, 0, sizeof(idle_stats));
+        return NO_ERROR;
+    } else if (argc > 1) {
+        printf("usage: %s [latency <usecs>|off] [reset]\n", argv[0].str);
+        return ERR_INVALID_ARGS;
+    }
+
+    uint32_t limit = idle_latency_min;
+    if (limit == UINT32_MAX)
+        printf("latency limit: none\n");
+    else
+        printf("latency limit: %u us\n", limit);
+
+    const idle_state_t *states = idle_states;
+    uint count = idle_state_count;
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        if (!mp_is_cpu_active(cpu))
+            continue;
+        printf("cpu %u:\n", cpu);
+        printf("  %-12s %8s %8s %12s %14s %10s\n", "state", "exit us", "target", "entries", "time us", "early");
+        for (uint i = 0; i < count; i++) {
+            const struct idle_cpu_stats *s = &idle_stats[cpu];
+            printf("  %-12s %8u %8u %12llu %14llu %10llu\n", states[i].name,
+                   states[i].exit_latency_us, states[i].target_residency_us,
+                   s->count[i], s->time_us[i], s->early[i]);
+        }
+    }
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("idle", "cpu idle states, [latency <usecs>|off] to limit wakeup latency, [reset] to clear stats", &cmd_idle)
+STATIC_COMMAND_END(idle);
+
+#endif // WITH_LIB_CONSOLE
@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <kernel/lockstat.h>
+
+#if LOCK_STATS
+
+#include <debug.h>
+#include <err.h>
+#include <list.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <kernel/spinlock.h>
+
+static struct list_node lock_stats_list = LIST_INITIAL_VALUE(lock_stats_list);
+static spin_lock_t lock_stats_list_lock = SPIN_LOCK_INITIAL_VALUE;
+
+void lock_stats_register(struct lock_stats *ls, const char *name)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&lock_stats_list_lock, state);
+
+    ls->name = name;
+    if (!ls->registered) {
+        list_add_tail(&lock_stats_list, &ls->node);
+        ls->registered = true;
+    }
+
+    spin_unlock_irqrestore(&lock_stats_list_lock, state);
+}
+
+void lock_stats_unregister(struct lock_stats *ls)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&lock_stats_list_lock, state);
+
+    if (ls->registered) {
+        list_delete(&ls->node);
+        ls->registered = false;
+    }
+
+    spin_unlock_irqrestore(&lock_stats_list_lock, state);
+}
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+
+static int lock_stats_cmp(const void *a, const void *b)
+{
+    const struct lock_stats *x = a;
+    const struct lock_stats *y = b;
+
+    if (x->contended != y->contended)
+        return (y->contended > x->contended) ? 1 : -1;
+    return (y->acquires > x->acquires) - (y->acquires < x->acquires);
+}
+
+static int cmd_lockstat(int argc, const cmd_args *argv)
+{
+    bool reset = argc > 1 && !strcmp(argv[1].str, "reset");
+    struct lock_stats *ls;
+    uint count = 0;
+
+    /* copy everything out so the printing happens without the list lock */
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&lock_stats_list_lock, state);
+    list_for_every_entry(&lock_stats_list, ls, struct lock_stats, node) {
+        count++;
+    }
+    spin_unlock_irqrestore(&lock_stats_list_lock, state);
+
+    struct lock_stats *snap = calloc(count, sizeof(struct lock_stats));
+    if (count && !snap)
+        return ERR_NO_MEMORY;
+
+    uint n = 0;
+    spin_lock_irqsave(&lock_stats_list_lock, state);
+    list_for_every_entry(&lock_stats_list, ls, struct lock_stats, node) {
+        if (n == count)
+            break;
+        snap[n++] = *ls;
+        if (reset) {
+            ls->acquires = ls->contended = ls->wait_total = 0;
+            ls->wait_max = ls->hold_max = 0;
+        }
+    }
+    spin_unlock_irqrestore(&lock_stats_list_lock, state);
+
+    qsort(snap, n, sizeof(struct lock_stats), lock_stats_cmp);
+
+    printf("%-24s %12s %12s %14s %10s %10s\n",
+           "name", "acquires", "contended", "wait total", "wait max", "hold max");
+    for (uint i = 0; i < n; i++) {
+        printf("%-24s %12llu %12llu %14llu %10u %10u\n", snap[i].name,
+               snap[i].acquires, snap[i].contended, snap[i].wait_total,
+               snap[i].wait_max, snap[i].hold_max);
+    }
+    printf("(waits and holds in cycles)\n");
+
+    free(snap);
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("lockstat", "lock contention statistics, [reset] to clear", &cmd_lockstat)
+STATIC_COMMAND_END(lockstat);
+
+#endif // WITH_LIB_CONSOLE
+
+#endif // LOCK_STATS
@@ -55,9 +55,21 @@ void mp_reschedule(mp_cpu_mask_t target, uint flags)
     }
     target &= ~(1U << local_cpu);
 
+    if (target == 0)
+        return;
+
+    /* a cpu with an ipi still in flight will look at the run queues once it takes
+     * it, so only kick the ones that don't have one pending */
+    mp_cpu_mask_t pending = atomic_or((volatile int *)&mp.reschedule_pending, target);
+#if THREAD_STATS
+    get_percpu_cpu(local_cpu)->thread_stats.reschedule_ipis_suppressed += __builtin_popcount(target & pending);
+#endif
+    target &= ~pending;
+
     LTRACEF("local %d, post mask target now 0x%x\n", local_cpu, target);
 
-    arch_mp_send_ipi(target, MP_IPI_RESCHEDULE);
+    if (target)
+        arch_mp_send_ipi(target, MP_IPI_RESCHEDULE);
 }
 
 void mp_set_curr_cpu_active(bool active)
@@ -73,6 +85,10 @@ enum handler_return mp_mbx_reschedule_irq(void)
 
     THREAD_STATS_INC(reschedule_ipis);
 
+    /* ack before the reschedule this triggers, so any request made after it
+     * has looked at the run queues sends a fresh ipi */
+    atomic_and((volatile int *)&mp.reschedule_pending, ~(1U << cpu));
+
     return (mp.active_cpus & (1U << cpu)) ? INT_RESCHEDULE : INT_NO_RESCHEDULE;
 }
 #endif
@@ -34,7 +34,9 @@
 #include <debug.h>
 #include <assert.h>
 #include <err.h>
+#include <stdlib.h>
 #include <kernel/thread.h>
+#include <kernel/debug.h>
 
 /**
  * @brief  Initialize a mutex_t
@@ -44,6 +46,128 @@ void mutex_init(mutex_t *m)
     *m = (mutex_t)MUTEX_INITIAL_VALUE(*m);
 }
 
+/**
+ * @brief  Initialize a mutex_t with MUTEX_FLAG_* behavior flags
+ */
+void mutex_init_etc(mutex_t *m, uint32_t flags)
+{
+    *m = (mutex_t)MUTEX_INITIAL_VALUE_FLAGS(*m, flags);
+#if LOCK_STATS
+    m->stats.name = NULL;
+#endif
+}
+
+#if LOCK_STATS
+void mutex_set_stats_name(mutex_t *m, const char *name)
+{
+    DEBUG_ASSERT(m->magic == MUTEX_MAGIC);
+
+    lock_stats_register(&m->stats, name);
+}
+#endif
+
+/* on smp, briefly spin on a contended mutex whose holder is running on
+ * another cpu before going to sleep on it */
+#ifndef MUTEX_ADAPTIVE_SPIN
+#define MUTEX_ADAPTIVE_SPIN WITH_SMP
+#endif
+
+#ifndef MUTEX_ADAPTIVE_SPIN_LOOPS
+#define MUTEX_ADAPTIVE_SPIN_LOOPS 1000
+#endif
+
+/* how often a spinning waiter goes back to the thread lock to see if the holder is still running */
+#ifndef MUTEX_ADAPTIVE_SPIN_CHECK
+#define MUTEX_ADAPTIVE_SPIN_CHECK 100
+#endif
+
+#if MUTEX_ADAPTIVE_SPIN
+/*
+ * Is the holder of m running on a cpu other than ours? Has to be asked under the
+ * thread lock: m->holder only changes under it and a thread can't go away while
+ * it holds a mutex, so that's the only place the holder's fields can be read.
+ */
+static thread_t *mutex_running_holder(mutex_t *m, uint cpu)
+{
+    THREAD_LOCK(state);
+
+    thread_t *holder = m->holder;
+    if (holder && (holder->state != THREAD_RUNNING || thread_curr_cpu(holder) == (int)cpu))
+        holder = NULL;
+
+    THREAD_UNLOCK(state);
+    return holder;
+}
+
+/*
+ * Spin for as long as the holder is running on another cpu, up to a limit.
+ * Between checks only m->count and the m->holder pointer are looked at, never
+ * what it points to, so the holder exiting or being freed under us is fine.
+ * The caller redoes the real acquire under the lock no matter what.
+ */
+static void mutex_adaptive_spin(mutex_t *m)
+{
+    uint cpu = arch_curr_cpu_num();
+    thread_t *holder = NULL;
+
+    for (uint i = 0; i < MUTEX_ADAPTIVE_SPIN_LOOPS; i++) {
+        if (*(volatile int *)&m->count == 0)
+            return;
+
+        /* a new holder, or time to see whether the old one blocked or got preempted */
+        if (holder != *(thread_t * volatile *)&m->holder || i % MUTEX_ADAPTIVE_SPIN_CHECK == 0) {
+            holder = mutex_running_holder(m, cpu);
+
+            /* nobody to wait on (mid handoff) or they're not making progress, go block */
+            if (!holder)
+                return;
+        }
+
+        CF;
+    }
+}
+#endif
+
+/* limit how far a priority boost follows a chain of blocked holders */
+#define MUTEX_PI_MAX_CHAIN 16
+
+/* highest priority waiting on any priority inheriting mutex the thread holds */
+static int mutex_pi_waiter_priority(thread_t *t)
+{
+    mutex_t *m;
+    int priority = -1;
+
+    list_for_every_entry(&t->held_mutexes, m, mutex_t, holder_node) {
+        priority = MAX(priority, wait_queue_highest_priority(&m->wait));
+    }
+
+    return priority;
+}
+
+/* recompute a holder's boost from scratch, after a waiter leaves or a mutex is released */
+static void mutex_pi_update(thread_t *t)
+{
+    thread_set_inherited_priority(t, mutex_pi_waiter_priority(t));
+}
+
+/* push priority down the chain of holders starting at the holder of m */
+static void mutex_pi_boost(mutex_t *m, int priority)
+{
+    for (uint i = 0; i < MUTEX_PI_MAX_CHAIN; i++) {
+        thread_t *holder = m->holder;
+
+        /* may be between a release and the next holder running, it picks up the boost itself */
+        if (!holder || holder->priority >= priority)
+            return;
+
+        thread_set_inherited_priority(holder, priority);
+
+        m = holder->blocking_mutex;
+        if (!m)
+            return;
+    }
+}
+
 /**
  * @brief  Destroy a mutex_t
  *
@@ -61,10 +185,18 @@ void mutex_destroy(mutex_t *m)
 #endif
 
     THREAD_LOCK(state);
+    if ((m->flags & MUTEX_FLAG_PRIORITY_INHERIT) && m->holder) {
+        list_delete(&m->holder_node);
+        mutex_pi_update(m->holder);
+    }
     m->magic = 0;
     m->count = 0;
     wait_queue_destroy(&m->wait, true);
     THREAD_UNLOCK(state);
+
+#if LOCK_STATS
+    lock_stats_unregister(&m->stats);
+#endif
 }
 
 /**
@@ -87,11 +219,45 @@ status_t mutex_acquire_timeout(mutex_t *m, lk_time_t timeout)
               get_current_thread(), get_current_thread()->name, m);
 #endif
 
+#if LOCK_STATS
+    uint32_t wait_start = arch_cycle_count();
+    bool contended = m->count > 0;
+#endif
+
+#if MUTEX_ADAPTIVE_SPIN
+    /* short critical sections on another cpu are cheaper to wait out than a context switch */
+    if (timeout != 0 && m->count > 0)
+        mutex_adaptive_spin(m);
+#endif
+
     THREAD_LOCK(state);
 
+    thread_t *current_thread = get_current_thread();
+    bool pi = m->flags & MUTEX_FLAG_PRIORITY_INHERIT;
+
     status_t ret = NO_ERROR;
     if (unlikely(++m->count > 1)) {
+#if LOCK_STATS
+        contended = true;
+#endif
+        if (pi && timeout != 0) {
+            current_thread->blocking_mutex = m;
+            mutex_pi_boost(m, current_thread->priority);
+        }
+
+        if (timeout != 0)
+            KEVLOG_MUTEX_BLOCK(m, m->holder);
+
         ret = wait_queue_block(&m->wait, timeout);
+
+        if (pi) {
+            current_thread->blocking_mutex = NULL;
+
+            /* if we gave up, whoever we were boosting may be able to come back down */
+            if (ret < NO_ERROR && ret != ERR_OBJECT_DESTROYED && m->holder)
+                mutex_pi_update(m->holder);
+        }
+
         if (unlikely(ret < NO_ERROR)) {
             /* if the acquisition timed out, back out the acquire and exit */
             if (likely(ret == ERR_TIMED_OUT)) {
@@ -109,7 +275,17 @@ status_t mutex_acquire_timeout(mutex_t *m, lk_time_t timeout)
         }
     }
 
-    m->holder = get_current_thread();
+    m->holder = current_thread;
+
+#if LOCK_STATS
+    lock_stats_acquired(&m->stats, contended, arch_cycle_count() - wait_start);
+#endif
+
+    if (pi) {
+        /* pick up the boost from anyone still queued behind us */
+        list_add_tail(&current_thread->held_mutexes, &m->holder_node);
+        mutex_pi_update(current_thread);
+    }
 
 err:
     THREAD_UNLOCK(state);
@@ -132,10 +308,26 @@ status_t mutex_release(mutex_t *m)
 
     THREAD_LOCK(state);
 
+#if LOCK_STATS
+    lock_stats_released(&m->stats);
+#endif
+
     m->holder = 0;
 
-    if (unlikely(--m->count >= 1)) {
+    if (m->flags & MUTEX_FLAG_PRIORITY_INHERIT) {
+        /* drop whatever this mutex was lending us and hand it to the most important waiter */
+        thread_t *current_thread = get_current_thread();
+
+        list_delete(&m->holder_node);
+        mutex_pi_update(current_thread);
+
+        if (unlikely(--m->count >= 1)) {
+            KEVLOG_MUTEX_WAKE(m);
+            wait_queue_wake_highest(&m->wait, true, NO_ERROR);
+        }
+    } else if (unlikely(--m->count >= 1)) {
         /* release a thread */
+        KEVLOG_MUTEX_WAKE(m);
         wait_queue_wake_one(&m->wait, true, NO_ERROR);
     }
 
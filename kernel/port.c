@@ -34,6 +34,7 @@
 #include <string.h>
 #include <pow2.h>
 #include <err.h>
+#include <arch/ops.h>
 #include <kernel/thread.h>
 #include <kernel/port.h>
 
@@ -53,11 +54,17 @@
 
 #define MAX_PORT_GROUP_COUNT 256
 
+// |head| and |tail| run freely and are only masked when indexing. the reader
+// only ever moves |head| and the writer only ever moves |tail|, which lets a
+// single writer port fill the buffer without the thread lock. |waiters| is
+// only modified with the thread lock held and is non zero while a reader of
+// the buffer may be blocked, telling such a writer to take the lock and wake.
 typedef struct {
     uint log2;
-    uint avail;
-    uint head;
-    uint tail;
+    volatile uint head;
+    volatile uint tail;
+    volatile int waiters;
+    bool single_writer;
     port_packet_t packet[1];
 } port_buf_t;
 
@@ -65,6 +72,7 @@ typedef struct {
     int magic;
     struct list_node node;
     port_buf_t *buf;
+    port_buf_t *single_buf;
     struct list_node rp_list;
     port_mode_t mode;
     char name[PORT_NAME_LEN];
@@ -100,36 +108,97 @@ static port_buf_t *make_buf(bool big)
         return NULL;
     buf->log2 = log2_uint(pk_count);
     buf->head = buf->tail = 0;
-    buf->avail = pk_count;
+    buf->waiters = 0;
+    buf->single_writer = false;
     return buf;
 }
 
 static inline bool buf_is_empty(port_buf_t *buf)
 {
-    return buf->avail == valpow2(buf->log2);
+    return buf->head == buf->tail;
 }
 
 static status_t buf_write(port_buf_t *buf, const port_packet_t *packets, size_t count)
 {
-    if (buf->avail < count)
+    uint tail = buf->tail;
+    if (valpow2(buf->log2) - (tail - buf->head) < count)
         return ERR_NOT_ENOUGH_BUFFER;
 
+    // the reader is done with the slots it has given back.
+    smp_mb();
     for (size_t ix = 0; ix != count; ix++) {
-        buf->packet[buf->tail] = packets[ix];
-        buf->tail = modpow2(++buf->tail, buf->log2);
+        buf->packet[modpow2(tail + ix, buf->log2)] = packets[ix];
     }
-    buf->avail -= count;
+    // publish the packets before the new tail.
+    smp_wmb();
+    buf->tail = tail + count;
     return NO_ERROR;
 }
 
-static status_t buf_read(port_buf_t *buf, port_result_t *pr)
+// read up to |count| packets into |pr|, returns the number read.
+static size_t buf_read(port_buf_t *buf, void *ctx, port_result_t *pr, size_t count)
 {
+    uint head = buf->head;
+    uint avail = buf->tail - head;
+    if (avail < count)
+        count = avail;
+    if (!count)
+        return 0;
+
+    // the packets were published before the tail we just read.
+    smp_rmb();
+    for (size_t ix = 0; ix != count; ix++) {
+        pr[ix].packet = buf->packet[modpow2(head + ix, buf->log2)];
+        pr[ix].ctx = ctx;
+    }
+    // done with the slots before giving them back to the writer.
+    smp_mb();
+    buf->head = head + count;
+    return count;
+}
+
+// block on |wait| until |buf| has packets, must hold the thread lock. a single
+// writer only takes the lock to wake us if it sees a waiter, so announce first
+// and look again in case a packet went in without the lock in between.
+static status_t buf_wait(port_buf_t *buf, wait_queue_t *wait, lk_time_t timeout)
+{
+    status_t rc = NO_ERROR;
+
+    buf->waiters++;
+    smp_mb();
     if (buf_is_empty(buf))
-        return ERR_NO_MSG;
-    pr->packet = buf->packet[buf->head];
-    buf->head = modpow2(++buf->head, buf->log2);
-    ++buf->avail;
-    return NO_ERROR;
+        rc = wait_queue_block(wait, timeout);
+    buf->waiters--;
+
+    return rc;
+}
+
+// the port group readers block on the group wait queue rather than through
+// buf_wait, so a read port in a group counts as always having a waiter.
+static inline void read_port_join_group(read_port_t *rp, port_group_t *pg)
+{
+    rp->gport = pg;
+    rp->buf->waiters++;
+    list_add_tail(&pg->rp_list, &rp->g_node);
+}
+
+static inline void read_port_leave_group(read_port_t *rp)
+{
+    rp->gport = NULL;
+    rp->buf->waiters--;
+}
+
+// wake a thread from the port group or from the read port itself.
+static int read_port_wake(read_port_t *rp)
+{
+    int awaken = 0;
+    if (rp->gport) {
+        awaken = wait_queue_wake_one(&rp->gport->wait, false, NO_ERROR);
+    }
+    if (!awaken) {
+        awaken = wait_queue_wake_one(&rp->wait, false, NO_ERROR);
+    }
+    return awaken;
 }
 
 // must be called before any use of ports.
@@ -149,6 +218,10 @@ status_t port_create(const char *name, port_mode_t mode, port_t *port)
             return ERR_INVALID_ARGS;
     }
 
+    // a single writer needs the one buffer only a unicast port has.
+    if ((mode & PORT_MODE_SINGLE_WRITER) && !(mode & PORT_MODE_UNICAST))
+        return ERR_INVALID_ARGS;
+
     if (strlen(name) >= PORT_NAME_LEN)
         return ERR_INVALID_ARGS;
 
@@ -187,6 +260,13 @@ status_t port_create(const char *name, port_mode_t mode, port_t *port)
         return ERR_NO_MEMORY;
     }
 
+    if (mode & PORT_MODE_SINGLE_WRITER) {
+        // a unicast port's buffer moves between the write port and its reader
+        // but is only freed along with the port, the writer can keep using it.
+        wp->buf->single_writer = true;
+        wp->single_buf = wp->buf;
+    }
+
     // todo: race condtion! a port with the same name could have been created
     // by another thread at is point.
     THREAD_LOCK(state2);
@@ -297,14 +377,13 @@ status_t port_group(port_t *ports, size_t count, port_t *group)
             // wrong type of port, or port already part of a group,
             // in any case, undo the changes to the previous read ports.
             for (size_t jx = 0; jx != ix; jx++) {
-                ((read_port_t *)ports[jx])->gport = NULL;
+                read_port_leave_group((read_port_t *)ports[jx]);
             }
             rc = ERR_BAD_HANDLE;
             break;
         }
         // link port group and read port.
-        rp->gport = pg;
-        list_add_tail(&pg->rp_list, &rp->g_node);
+        read_port_join_group(rp, pg);
     }
     THREAD_UNLOCK(state);
 
@@ -336,9 +415,8 @@ status_t port_group_add(port_t group, port_t port)
     if (list_length(&pg->rp_list) == MAX_PORT_GROUP_COUNT) {
         rc = ERR_TOO_BIG;
     } else {
-        rp->gport = pg;
-        list_add_tail(&pg->rp_list, &rp->g_node);
-        
+        read_port_join_group(rp, pg);
+
         // If the new read port being added has messages available, try to wake
         // any readers that might be present.
         if (!buf_is_empty(rp->buf)) {
@@ -375,22 +453,61 @@ status_t port_group_remove(port_t group, port_t port)
         }
     }
 
-    if (!found)
+    if (!found) {
+        THREAD_UNLOCK(state);
         return ERR_BAD_HANDLE;
+    }
 
     list_delete(&rp->g_node);
+    read_port_leave_group(rp);
 
     THREAD_UNLOCK(state);
 
     return NO_ERROR;
 }
 
+// the single writer owns the producing end of the port's buffer whether or not
+// a reader has it, so the thread lock is only needed to wake a waiting reader.
+static status_t port_write_single(write_port_t *wp, const port_packet_t *pk, size_t count)
+{
+    if (wp->magic != WRITEPORT_MAGIC_W)
+        return ERR_BAD_HANDLE;
+
+    status_t status = buf_write(wp->single_buf, pk, count);
+    if (status < 0)
+        return status;
+
+    // pairs with the barrier in buf_wait.
+    smp_mb();
+    if (likely(wp->single_buf->waiters == 0))
+        return NO_ERROR;
+
+    int awaken = 0;
+    THREAD_LOCK(state);
+    if (!wp->buf) {
+        // a reader has the buffer.
+        read_port_t *rp = list_peek_head_type(&wp->rp_list, read_port_t, w_node);
+        awaken = read_port_wake(rp);
+    }
+    THREAD_UNLOCK(state);
+
+#if RESCHEDULE_POLICY
+    if (awaken)
+        thread_yield();
+#endif
+
+    return NO_ERROR;
+}
+
 status_t port_write(port_t port, const port_packet_t *pk, size_t count)
 {
     if (!port || !pk)
         return ERR_INVALID_ARGS;
 
     write_port_t *wp = (write_port_t *)port;
+    if (wp->mode & PORT_MODE_SINGLE_WRITER)
+        return port_write_single(wp, pk, count);
+
     THREAD_LOCK(state);
     if (wp->magic != WRITEPORT_MAGIC_W) {
         // wrong port type.
@@ -415,15 +532,7 @@ status_t port_write(port_t port, const port_packet_t *pk, size_t count)
                 continue;
             }
 
-            int awaken = 0;
-            if (rp->gport) {
-                awaken = wait_queue_wake_one(&rp->gport->wait, false, NO_ERROR);
-            }
-            if (!awaken) {
-                awaken = wait_queue_wake_one(&rp->wait, false, NO_ERROR);
-            }
-
-            awake_count += awaken;
+            awake_count += read_port_wake(rp);
         }
     }
 
@@ -437,47 +546,60 @@ status_t port_write(port_t port, const port_packet_t *pk, size_t count)
     return status;
 }
 
-static inline status_t read_no_lock(read_port_t *rp, lk_time_t timeout, port_result_t *result)
+static inline ssize_t read_no_lock(read_port_t *rp, lk_time_t timeout, port_result_t *result, size_t count)
 {
-    status_t status = buf_read(rp->buf, result);
-    result->ctx = rp->ctx;
-
-    if (status != ERR_NO_MSG)
-        return status;
+    size_t read = buf_read(rp->buf, rp->ctx, result, count);
+    if (read)
+        return read;
 
     // early return allows compiler to elide the rest for the group read case.
     if (!timeout)
         return ERR_TIMED_OUT;
 
-    status_t wr = wait_queue_block(&rp->wait, timeout);
+    status_t wr = buf_wait(rp->buf, &rp->wait, timeout);
     if (wr != NO_ERROR)
         return wr;
     // recursive tail call is usually optimized away with a goto.
-    return read_no_lock(rp, timeout, result);
+    return read_no_lock(rp, timeout, result, count);
 }
 
-status_t port_read(port_t port, lk_time_t timeout, port_result_t *result)
+ssize_t port_read_batch(port_t port, lk_time_t timeout, port_result_t *results, size_t count)
 {
-    if (!port || !result)
+    if (!port || !results || !count)
         return ERR_INVALID_ARGS;
 
-    status_t rc = ERR_GENERIC;
+    ssize_t rc = ERR_GENERIC;
     read_port_t *rp = (read_port_t *)port;
 
+    if (rp->magic == READPORT_MAGIC && rp->buf->single_writer) {
+        // the only reader of a single writer port can take what is there
+        // without the lock, it only needs it to block.
+        size_t read = buf_read(rp->buf, rp->ctx, results, count);
+        if (read)
+            return read;
+        if (!timeout)
+            return ERR_TIMED_OUT;
+    }
+
     THREAD_LOCK(state);
     if (rp->magic == READPORT_MAGIC) {
         // dealing with a single port.
-        rc = read_no_lock(rp, timeout, result);
+        rc = read_no_lock(rp, timeout, results, count);
     } else if (rp->magic == PORTGROUP_MAGIC) {
         // dealing with a port group.
         port_group_t *pg = (port_group_t *)port;
         do {
-            // read each port with no timeout.
+            // drain the ports in turn until we run out of room.
             // todo: this order is fixed, probably a bad thing.
+            size_t read = 0;
             list_for_every_entry(&pg->rp_list, rp, read_port_t, g_node) {
-                rc = read_no_lock(rp, 0, result);
-                if (rc != ERR_TIMED_OUT)
-                    goto read_exit;
+                read += buf_read(rp->buf, rp->ctx, results + read, count - read);
+                if (read == count)
+                    break;
+            }
+            if (read) {
+                rc = read;
+                break;
             }
             // no data, block on the group waitqueue.
             rc = wait_queue_block(&pg->wait, timeout);
@@ -487,11 +609,19 @@ status_t port_read(port_t port, lk_time_t timeout, port_result_t *result)
         rc = ERR_BAD_HANDLE;
     }
 
-read_exit:
     THREAD_UNLOCK(state);
     return rc;
 }
 
+status_t port_read(port_t port, lk_time_t timeout, port_result_t *result)
+{
+    if (!result)
+        return ERR_INVALID_ARGS;
+
+    ssize_t rc = port_read_batch(port, timeout, result, 1);
+    return (rc < 0) ? (status_t)rc : NO_ERROR;
+}
+
 status_t port_destroy(port_t port)
 {
     if (!port)
@@ -545,6 +675,11 @@ status_t port_close(port_t port)
     THREAD_LOCK(state);
     if (rp->magic == READPORT_MAGIC) {
         // dealing with a read port.
+        if (rp->gport) {
+            // remove self from port group list.
+            list_delete(&rp->g_node);
+            read_port_leave_group(rp);
+        }
         if (rp->wport) {
             // remove self from write port list and reassign the bufer if last.
             list_delete(&rp->w_node);
@@ -555,10 +690,6 @@ status_t port_close(port_t port)
                 buf = rp->buf;
             }
         }
-        if (rp->gport) {
-            // remove self from port group list.
-            list_delete(&rp->g_node);
-        }
         // wake up waiters, the return code is ERR_OBJECT_DESTROYED.
         wait_queue_destroy(&rp->wait, true);
         rp->magic = 0;
@@ -571,7 +702,7 @@ status_t port_close(port_t port)
         // remove self from reader ports.
         rp = NULL;
         list_for_every_entry(&pg->rp_list, rp, read_port_t, g_node) {
-            rp->gport = NULL;
+            read_port_leave_group(rp);
         }
         pg->magic = 0;
 
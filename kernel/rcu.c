@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <kernel/rcu.h>
+
+#include <debug.h>
+#include <trace.h>
+#include <err.h>
+#include <lk/init.h>
+#include <kernel/event.h>
+#include <kernel/mp.h>
+#include <kernel/percpu.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+
+#define LOCAL_TRACE 0
+
+/*
+ * A cpu's percpu rcu_qs counter moves every time it goes through
+ * thread_resched() and on every timer tick that lands outside a preempt
+ * disabled section. Read side sections hold preemption off, so once the
+ * counter of each other cpu has moved past the value it had when an object
+ * was unlinked, nothing can still be looking at the object. Cpus that sit in
+ * a realtime thread or idle without ticks are nudged with a reschedule ipi.
+ */
+
+static spin_lock_t rcu_lock = SPIN_LOCK_INITIAL_VALUE;
+static struct rcu_head *rcu_pending;
+static struct rcu_head **rcu_pending_tail = &rcu_pending;
+static event_t rcu_event = EVENT_INITIAL_VALUE(rcu_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+void rcu_synchronize(void)
+{
+    DEBUG_ASSERT(get_current_thread()->preempt_disable == 0);
+
+#if WITH_SMP
+    ulong snap[SMP_MAX_CPUS];
+    mp_cpu_mask_t waiting = 0;
+
+    /* order the caller's unlinking before the snapshot */
+    smp_mb();
+
+    /* this cpu is running us, outside any read side section */
+    uint curr = arch_curr_cpu_num();
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        if (cpu == curr || !mp_is_cpu_active(cpu))
+            continue;
+        snap[cpu] = get_percpu_cpu(cpu)->rcu_qs;
+        waiting |= 1U << cpu;
+    }
+
+    for (uint tries = 0; ; tries++) {
+        for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+            if ((waiting & (1U << cpu)) &&
+                    (get_percpu_cpu(cpu)->rcu_qs != snap[cpu] || !mp_is_cpu_active(cpu)))
+                waiting &= ~(1U << cpu);
+        }
+        if (!waiting)
+            break;
+
+        /* give the ticks a chance first, then push the stragglers through the scheduler */
+        if (tries > 0) {
+            LTRACEF("kicking cpus 0x%x\n", waiting);
+            mp_reschedule(waiting, MP_RESCHEDULE_FLAG_REALTIME);
+        }
+        thread_sleep(1);
+    }
+
+    /* and the grace period before whatever the caller does next */
+    smp_mb();
+#endif
+}
+
+void rcu_call(struct rcu_head *head, void (*func)(struct rcu_head *head))
+{
+    DEBUG_ASSERT(head && func);
+
+    head->next = NULL;
+    head->func = func;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&rcu_lock, state);
+
+    *rcu_pending_tail = head;
+    rcu_pending_tail = &head->next;
+
+    spin_unlock_irqrestore(&rcu_lock, state);
+
+    event_signal(&rcu_event, false);
+}
+
+/* takes everything queued so far through a grace period, in batches */
+static int rcu_thread(void *arg)
+{
+    for (;;) {
+        event_wait(&rcu_event);
+
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&rcu_lock, state);
+
+        struct rcu_head *list = rcu_pending;
+        rcu_pending = NULL;
+        rcu_pending_tail = &rcu_pending;
+
+        spin_unlock_irqrestore(&rcu_lock, state);
+
+        if (!list)
+            continue;
+
+        rcu_synchronize();
+
+        while (list) {
+            struct rcu_head *next = list->next;
+            list->func(list);
+            list = next;
+        }
+    }
+
+    return 0;
+}
+
+static void rcu_init(uint level)
+{
+    thread_t *t = thread_create("rcu", &rcu_thread, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+    thread_detach_and_resume(t);
+}
+
+LK_INIT_HOOK(rcu, &rcu_init, LK_INIT_LEVEL_THREADING);
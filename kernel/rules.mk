@@ -10,12 +10,16 @@ MODULE_DEPS := \
 MODULE_SRCS := \
 	$(LOCAL_DIR)/debug.c \
 	$(LOCAL_DIR)/event.c \
+	$(LOCAL_DIR)/idle.c \
 	$(LOCAL_DIR)/init.c \
+	$(LOCAL_DIR)/lockstat.c \
 	$(LOCAL_DIR)/mutex.c \
+	$(LOCAL_DIR)/rwlock.c \
 	$(LOCAL_DIR)/thread.c \
 	$(LOCAL_DIR)/timer.c \
 	$(LOCAL_DIR)/semaphore.c \
 	$(LOCAL_DIR)/mp.c \
+	$(LOCAL_DIR)/rcu.c \
 	$(LOCAL_DIR)/port.c
 
 ifeq ($(WITH_KERNEL_VM),1)
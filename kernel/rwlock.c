@@ -0,0 +1,216 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * @file
+ * @brief  Reader/writer lock functions
+ *
+ * @defgroup rwlock Reader/writer lock
+ * @{
+ */
+
+#include <kernel/rwlock.h>
+#include <debug.h>
+#include <assert.h>
+#include <err.h>
+#include <kernel/thread.h>
+
+/**
+ * @brief  Initialize a rwlock_t
+ */
+void rwlock_init(rwlock_t *l)
+{
+    *l = (rwlock_t)RWLOCK_INITIAL_VALUE(*l);
+}
+
+/**
+ * @brief  Initialize a rwlock_t with RWLOCK_FLAG_* behavior flags
+ */
+void rwlock_init_etc(rwlock_t *l, uint32_t flags)
+{
+    *l = (rwlock_t)RWLOCK_INITIAL_VALUE_FLAGS(*l, flags);
+}
+
+/**
+ * @brief  Destroy a rwlock_t
+ *
+ * Any threads blocked on the lock are woken with ERR_OBJECT_DESTROYED.
+ */
+void rwlock_destroy(rwlock_t *l)
+{
+    DEBUG_ASSERT(l->magic == RWLOCK_MAGIC);
+
+    THREAD_LOCK(state);
+    l->magic = 0;
+    l->count = 0;
+    l->writer = NULL;
+    wait_queue_destroy(&l->read_wait, false);
+    wait_queue_destroy(&l->write_wait, true);
+    THREAD_UNLOCK(state);
+}
+
+/* hand the lock to every waiting reader at once, thread lock held */
+static void rwlock_wake_readers(rwlock_t *l, bool reschedule)
+{
+    DEBUG_ASSERT(l->count >= 0);
+
+    l->count += l->read_wait.count;
+    wait_queue_wake_all(&l->read_wait, reschedule, NO_ERROR);
+}
+
+/* hand the lock to the next waiting writer, thread lock held */
+static void rwlock_wake_writer(rwlock_t *l, bool reschedule)
+{
+    DEBUG_ASSERT(l->count == 0);
+
+    /* the woken writer fills in l->writer for itself */
+    l->count = -1;
+    wait_queue_wake_one(&l->write_wait, reschedule, NO_ERROR);
+}
+
+/**
+ * @brief  Acquire the lock for reading, with timeout
+ *
+ * Timeout may be zero, in which case this function returns immediately if
+ * the lock cannot be shared right now.
+ *
+ * @return  NO_ERROR on success, ERR_TIMED_OUT on timeout,
+ * other values on error
+ */
+status_t rwlock_acquire_read_timeout(rwlock_t *l, lk_time_t timeout)
+{
+    DEBUG_ASSERT(l->magic == RWLOCK_MAGIC);
+
+#if LK_DEBUGLEVEL > 0
+    if (unlikely(get_current_thread() == l->writer))
+        panic("rwlock_acquire_read: thread %p (%s) tried to read lock rwlock %p it holds for writing\n",
+              get_current_thread(), get_current_thread()->name, l);
+#endif
+
+    status_t ret = NO_ERROR;
+
+    THREAD_LOCK(state);
+
+    bool writer_blocks = (l->flags & RWLOCK_FLAG_WRITER_PREFERENCE) && l->write_wait.count > 0;
+    if (likely(l->count >= 0 && !writer_blocks)) {
+        l->count++;
+    } else {
+        /* on a successful wake the waker has already counted us in */
+        ret = wait_queue_block(&l->read_wait, timeout);
+    }
+
+    THREAD_UNLOCK(state);
+    return ret;
+}
+
+/**
+ * @brief  Release a lock held for reading
+ */
+status_t rwlock_release_read(rwlock_t *l)
+{
+    DEBUG_ASSERT(l->magic == RWLOCK_MAGIC);
+    DEBUG_ASSERT(l->count > 0);
+
+    THREAD_LOCK(state);
+
+    /* readers only queue up while others read if a writer is queued ahead of them */
+    if (--l->count == 0 && l->write_wait.count > 0)
+        rwlock_wake_writer(l, true);
+
+    THREAD_UNLOCK(state);
+    return NO_ERROR;
+}
+
+/**
+ * @brief  Acquire the lock for writing, with timeout
+ *
+ * Timeout may be zero, in which case this function returns immediately if
+ * the lock is not free.
+ *
+ * @return  NO_ERROR on success, ERR_TIMED_OUT on timeout,
+ * other values on error
+ */
+status_t rwlock_acquire_write_timeout(rwlock_t *l, lk_time_t timeout)
+{
+    DEBUG_ASSERT(l->magic == RWLOCK_MAGIC);
+
+#if LK_DEBUGLEVEL > 0
+    if (unlikely(get_current_thread() == l->writer))
+        panic("rwlock_acquire_write: thread %p (%s) tried to acquire rwlock %p it already owns.\n",
+              get_current_thread(), get_current_thread()->name, l);
+#endif
+
+    status_t ret = NO_ERROR;
+
+    THREAD_LOCK(state);
+
+    if (likely(l->count == 0)) {
+        l->count = -1;
+    } else {
+        ret = wait_queue_block(&l->write_wait, timeout);
+        if (unlikely(ret < NO_ERROR)) {
+            /* if we were the last writer holding back readers, let them in */
+            if (ret == ERR_TIMED_OUT && l->count >= 0 &&
+                    l->write_wait.count == 0 && l->read_wait.count > 0) {
+                rwlock_wake_readers(l, false);
+            }
+            goto err;
+        }
+    }
+
+    l->writer = get_current_thread();
+
+err:
+    THREAD_UNLOCK(state);
+    return ret;
+}
+
+/**
+ * @brief  Release a lock held for writing
+ */
+status_t rwlock_release_write(rwlock_t *l)
+{
+    DEBUG_ASSERT(l->magic == RWLOCK_MAGIC);
+
+#if LK_DEBUGLEVEL > 0
+    if (unlikely(get_current_thread() != l->writer)) {
+        panic("rwlock_release_write: thread %p (%s) tried to release rwlock %p it doesn't own. owned by %p (%s)\n",
+              get_current_thread(), get_current_thread()->name, l, l->writer, l->writer ? l->writer->name : "none");
+    }
+#endif
+
+    THREAD_LOCK(state);
+
+    l->writer = NULL;
+    l->count = 0;
+
+    bool prefer_writer = (l->flags & RWLOCK_FLAG_WRITER_PREFERENCE) || l->read_wait.count == 0;
+    if (l->write_wait.count > 0 && prefer_writer) {
+        rwlock_wake_writer(l, true);
+    } else if (l->read_wait.count > 0) {
+        rwlock_wake_readers(l, true);
+    }
+
+    THREAD_UNLOCK(state);
+    return NO_ERROR;
+}
@@ -16,6 +16,7 @@
 
 #include <debug.h>
 #include <err.h>
+#include <arch/ops.h>
 #include <kernel/semaphore.h>
 #include <kernel/thread.h>
 
@@ -32,17 +33,47 @@ void sem_destroy(semaphore_t *sem)
     THREAD_UNLOCK(state);
 }
 
+/*
+ * The count is only ever changed atomically. While it's not negative nobody is
+ * waiting, so posting, and taking a resource when one is available, can be done
+ * with a compare and swap without the thread lock. Only a count that goes
+ * negative, meaning threads block or are being woken, needs the lock.
+ */
+static bool sem_try_adjust(semaphore_t *sem, int delta, int min)
+{
+    /* the atomics don't order anything themselves, so fence on both sides to
+     * get release semantics for posts and acquire semantics for waits */
+    smp_mb();
+
+    int old = sem->count;
+
+    while (old >= min) {
+        int prev = atomic_cmpxchg(&sem->count, old, old + delta);
+        if (prev == old) {
+            smp_mb();
+            return true;
+        }
+        old = prev;
+    }
+
+    return false;
+}
+
 int sem_post(semaphore_t *sem, bool resched)
 {
     int ret = 0;
 
+    /* fast path, nobody waiting */
+    if (likely(sem_try_adjust(sem, 1, 0)))
+        return 0;
+
     THREAD_LOCK(state);
 
     /*
      * If the count is or was negative then a thread is waiting for a resource, otherwise
      * it's safe to just increase the count available with no downsides
      */
-    if (unlikely(++sem->count <= 0))
+    if (unlikely(atomic_add(&sem->count, 1) < 0))
         ret = wait_queue_wake_one(&sem->wait, resched, NO_ERROR);
 
     THREAD_UNLOCK(state);
@@ -53,13 +84,18 @@ int sem_post(semaphore_t *sem, bool resched)
 status_t sem_wait(semaphore_t *sem)
 {
     status_t ret = NO_ERROR;
+
+    /* fast path, a resource is available */
+    if (likely(sem_try_adjust(sem, -1, 1)))
+        return NO_ERROR;
+
     THREAD_LOCK(state);
 
     /*
      * If there are no resources available then we need to
      * sit in the wait queue until sem_post adds some.
      */
-    if (unlikely(--sem->count < 0))
+    if (unlikely(atomic_add(&sem->count, -1) <= 0))
         ret = wait_queue_block(&sem->wait, INFINITE_TIME);
 
     THREAD_UNLOCK(state);
@@ -68,28 +104,23 @@ status_t sem_wait(semaphore_t *sem)
 
 status_t sem_trywait(semaphore_t *sem)
 {
-    status_t ret = NO_ERROR;
-    THREAD_LOCK(state);
-
-    if (unlikely(sem->count <= 0))
-        ret = ERR_NOT_READY;
-    else
-        sem->count--;
-
-    THREAD_UNLOCK(state);
-    return ret;
+    return sem_try_adjust(sem, -1, 1) ? NO_ERROR : ERR_NOT_READY;
 }
 
 status_t sem_timedwait(semaphore_t *sem, lk_time_t timeout)
 {
     status_t ret = NO_ERROR;
+
+    if (likely(sem_try_adjust(sem, -1, 1)))
+        return NO_ERROR;
+
     THREAD_LOCK(state);
 
-    if (unlikely(--sem->count < 0)) {
+    if (unlikely(atomic_add(&sem->count, -1) <= 0)) {
         ret = wait_queue_block(&sem->wait, timeout);
         if (ret < NO_ERROR) {
             if (ret == ERR_TIMED_OUT) {
-                sem->count++;
+                atomic_add(&sem->count, 1);
             }
         }
     }
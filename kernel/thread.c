@@ -34,6 +34,7 @@
 #include <assert.h>
 #include <list.h>
 #include <malloc.h>
+#include <stdlib.h>
 #include <string.h>
 #include <printf.h>
 #include <err.h>
@@ -41,6 +42,7 @@
 #include <kernel/thread.h>
 #include <kernel/timer.h>
 #include <kernel/debug.h>
+#include <kernel/idle.h>
 #include <kernel/mp.h>
 #include <platform.h>
 #include <target.h>
@@ -49,9 +51,7 @@
 #include <kernel/vm.h>
 #endif
 
-#if THREAD_STATS
-struct thread_stats thread_stats[SMP_MAX_CPUS];
-#endif
+struct percpu percpu[SMP_MAX_CPUS];
 
 #define STACK_DEBUG_BYTE (0x99)
 #define STACK_DEBUG_WORD (0x99999999)
@@ -63,22 +63,38 @@ static struct list_node thread_list;
 
 /* master thread spinlock */
 spin_lock_t thread_lock = SPIN_LOCK_INITIAL_VALUE;
+#if LOCK_STATS
+struct lock_stats thread_lock_stats = LOCK_STATS_INITIAL_VALUE("thread_lock");
+#endif
 
-/* the run queue */
-static struct list_node run_queue[NUM_PRIORITIES];
-static uint32_t run_queue_bitmap;
+/* the run queues, one per cpu.
+ * threads pinned to a single cpu live in that cpu's bound_queue[], which no
+ * other cpu ever looks at. everything else lives in queue[] and may be pulled
+ * over by an idle sibling the thread is allowed to run on.
+ *
+ * each queue has its own lock, taken inside the thread lock by everything that
+ * changes thread state. an idle cpu pulls work over holding only the queue
+ * locks, the source and its own, always lowest cpu first.
+ */
+struct run_queue {
+    spin_lock_t lock;
+    struct list_node edf_queue; /* deadline class, sorted earliest deadline first */
+    struct list_node queue[NUM_PRIORITIES];
+    uint32_t bitmap;
+    struct list_node bound_queue[NUM_PRIORITIES];
+    uint32_t bound_bitmap;
+} __CPU_ALIGN;
+
+static struct run_queue run_queue[SMP_MAX_CPUS];
 
 /* make sure the bitmap is large enough to cover our number of priorities */
-STATIC_ASSERT(NUM_PRIORITIES <= sizeof(run_queue_bitmap) * 8);
+STATIC_ASSERT(NUM_PRIORITIES <= sizeof(run_queue[0].bitmap) * 8);
+
+/* per tls entry teardown, see tls_set_destructor() */
+static tls_destructor_t tls_destructors[MAX_TLS_ENTRY];
 
 /* the idle thread(s) (statically allocated) */
-#if WITH_SMP
-static thread_t _idle_threads[SMP_MAX_CPUS];
-#define idle_thread(cpu) (&_idle_threads[cpu])
-#else
-static thread_t _idle_thread;
-#define idle_thread(cpu) (&_idle_thread)
-#endif
+#define idle_thread(cpu) (&get_percpu_cpu(cpu)->idle_thread)
 
 /* local routines */
 static void thread_resched(void);
@@ -86,9 +102,122 @@ static void idle_thread_routine(void) __NO_RETURN;
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
 /* preemption timer */
-static timer_t preempt_timer[SMP_MAX_CPUS];
+#define preempt_timer(cpu) (&get_percpu_cpu(cpu)->preempt_timer)
+#endif
+
+#if WITH_SMP
+#define thread_queued_cpu(t) ((t)->queued_cpu)
+#define thread_set_queued_cpu(t, c) ((t)->queued_cpu = (c))
+#else
+#define thread_queued_cpu(t) (0)
+#define thread_set_queued_cpu(t, c) do {} while(0)
 #endif
 
+/* pinned to exactly one cpu, so no other cpu could ever take it */
+static inline bool thread_is_bound(thread_t *t)
+{
+    mp_cpu_mask_t mask = thread_cpu_affinity(t) & THREAD_CPU_AFFINITY_ALL;
+    return mask != THREAD_CPU_AFFINITY_ALL && __builtin_popcount(mask) == 1;
+}
+
+/* select which cpu's run queue a thread that is becoming ready should go into */
+static uint run_queue_select_cpu(thread_t *t)
+{
+#if WITH_SMP
+    uint local_cpu = arch_curr_cpu_num();
+    mp_cpu_mask_t allowed = t->cpu_affinity & mp.active_cpus;
+
+    /* if none of its cpus are up yet, park it on the first one it asked for */
+    if (!allowed)
+        return __builtin_ctz(t->cpu_affinity);
+
+    /* the current thread stays local */
+    if (t == get_current_thread() && (allowed & (1U << local_cpu)))
+        return local_cpu;
+
+    /* prefer the cpu it last ran on if it's idle, then any idle cpu */
+    mp_cpu_mask_t idle = mp_get_idle_mask() & allowed;
+    if (t->last_cpu >= 0 && (idle & (1U << t->last_cpu)))
+        return t->last_cpu;
+    if (idle)
+        return __builtin_ctz(idle);
+
+    /* everyone is busy, keep it cache warm if we can */
+    if (t->last_cpu >= 0 && (allowed & (1U << t->last_cpu)))
+        return t->last_cpu;
+    if (allowed & (1U << local_cpu))
+        return local_cpu;
+
+    return __builtin_ctz(allowed);
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Deadline (edf) class. Every period a thread gets budget ms of cpu time to be
+ * used before the period ends, which is also its deadline. Ready deadline threads
+ * run ahead of every priority scheduled thread, earliest deadline first. One
+ * that uses up its budget is parked off the run queues until its next period
+ * starts. A thread that becomes ready after its deadline has passed starts a
+ * fresh period right away. Deadline threads are never stolen by other cpus.
+ */
+static inline bool thread_is_edf(thread_t *t)
+{
+    return t->edf.period != 0;
+}
+
+/* take the time run since the last charge out of the thread's budget */
+static void thread_edf_charge(thread_t *t, lk_bigtime_t now)
+{
+    lk_bigtime_t used = now - t->edf.run_start;
+
+    t->edf.remaining = (used >= t->edf.remaining) ? 0 : t->edf.remaining - used;
+    t->edf.run_start = now;
+}
+
+static void thread_edf_new_period(thread_t *t, lk_time_t now)
+{
+    t->edf.deadline = now + t->edf.period;
+    t->edf.remaining = (lk_bigtime_t)t->edf.budget * 1000;
+}
+
+static enum handler_return thread_edf_replenish(timer_t *timer, lk_time_t now, void *arg);
+
+/* queue a ready deadline thread by deadline, or park it if it's out of budget */
+static void insert_in_edf_queue(thread_t *t)
+{
+    lk_time_t now = current_time();
+
+    if (t == get_current_thread())
+        thread_edf_charge(t, current_time_hires());
+
+    if (!TIME_LT(now, t->edf.deadline))
+        thread_edf_new_period(t, now);
+
+    if (t->edf.remaining == 0) {
+        t->edf.throttled = true;
+        timer_set_oneshot(&t->edf.replenish_timer, t->edf.deadline - now, &thread_edf_replenish, t);
+        return;
+    }
+
+    uint cpu = run_queue_select_cpu(t);
+    struct run_queue *rq = &run_queue[cpu];
+    thread_t *entry;
+
+    spin_lock(&rq->lock);
+    thread_set_queued_cpu(t, cpu);
+    list_for_every_entry(&rq->edf_queue, entry, thread_t, queue_node) {
+        if (TIME_LT(t->edf.deadline, entry->edf.deadline)) {
+            list_add_before(&entry->queue_node, &t->queue_node);
+            goto done;
+        }
+    }
+    list_add_tail(&rq->edf_queue, &t->queue_node);
+done:
+    spin_unlock(&rq->lock);
+}
+
 /* run queue manipulation */
 static void insert_in_run_queue_head(thread_t *t)
 {
@@ -98,8 +227,24 @@ static void insert_in_run_queue_head(thread_t *t)
     DEBUG_ASSERT(arch_ints_disabled());
     DEBUG_ASSERT(spin_lock_held(&thread_lock));
 
-    list_add_head(&run_queue[t->priority], &t->queue_node);
-    run_queue_bitmap |= (1<<t->priority);
+    if (thread_is_edf(t)) {
+        insert_in_edf_queue(t);
+        return;
+    }
+
+    uint cpu = run_queue_select_cpu(t);
+    struct run_queue *rq = &run_queue[cpu];
+
+    spin_lock(&rq->lock);
+    thread_set_queued_cpu(t, cpu);
+    if (thread_is_bound(t)) {
+        list_add_head(&rq->bound_queue[t->priority], &t->queue_node);
+        rq->bound_bitmap |= (1<<t->priority);
+    } else {
+        list_add_head(&rq->queue[t->priority], &t->queue_node);
+        rq->bitmap |= (1<<t->priority);
+    }
+    spin_unlock(&rq->lock);
 }
 
 static void insert_in_run_queue_tail(thread_t *t)
@@ -110,15 +255,215 @@ static void insert_in_run_queue_tail(thread_t *t)
     DEBUG_ASSERT(arch_ints_disabled());
     DEBUG_ASSERT(spin_lock_held(&thread_lock));
 
-    list_add_tail(&run_queue[t->priority], &t->queue_node);
-    run_queue_bitmap |= (1<<t->priority);
+    if (thread_is_edf(t)) {
+        insert_in_edf_queue(t);
+        return;
+    }
+
+    uint cpu = run_queue_select_cpu(t);
+    struct run_queue *rq = &run_queue[cpu];
+
+    spin_lock(&rq->lock);
+    thread_set_queued_cpu(t, cpu);
+    if (thread_is_bound(t)) {
+        list_add_tail(&rq->bound_queue[t->priority], &t->queue_node);
+        rq->bound_bitmap |= (1<<t->priority);
+    } else {
+        list_add_tail(&rq->queue[t->priority], &t->queue_node);
+        rq->bitmap |= (1<<t->priority);
+    }
+    spin_unlock(&rq->lock);
+}
+
+/* pull a ready thread back out of whichever run queue it is sitting in */
+static void remove_from_run_queue(thread_t *t)
+{
+    DEBUG_ASSERT(t->state == THREAD_READY);
+    DEBUG_ASSERT(list_in_list(&t->queue_node));
+    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+
+    /* an idle cpu may be pulling it over to its own queue right now, chase it */
+    struct run_queue *rq;
+    for (;;) {
+        uint cpu = thread_queued_cpu(t);
+        rq = &run_queue[cpu];
+        spin_lock(&rq->lock);
+        if (thread_queued_cpu(t) == cpu)
+            break;
+        spin_unlock(&rq->lock);
+    }
+
+    list_delete(&t->queue_node);
+
+    if (list_is_empty(&rq->queue[t->priority]))
+        rq->bitmap &= ~(1<<t->priority);
+    if (list_is_empty(&rq->bound_queue[t->priority]))
+        rq->bound_bitmap &= ~(1<<t->priority);
+
+    spin_unlock(&rq->lock);
+}
+
+/* highest priority with a queued thread, or -1 if the queue is empty */
+static inline int run_queue_top_priority(uint32_t bitmap)
+{
+    if (!bitmap)
+        return -1;
+    return sizeof(bitmap) * 8 - 1 - __builtin_clz(bitmap);
+}
+
+/*
+ * Cache of thread structs and DEFAULT_STACK_SIZE stacks left behind by dead
+ * threads, so creating a thread is usually a pair of list pops. Both lists are
+ * protected by the thread lock, which lets thread_exit() hand back the stack it
+ * is still running on: nobody can pop it until the switch away has finished.
+ */
+#ifndef THREAD_POOL_SIZE
+#define THREAD_POOL_SIZE 16
+#endif
+
+/* back pooled stacks with their own vm allocation and an unmapped page below
+ * them, so an overflow faults instead of scribbling on the heap. these stacks
+ * are never given back, the pool grows to the peak number of live threads. */
+#if WITH_KERNEL_VM
+#ifndef THREAD_POOL_GUARD_PAGES
+#define THREAD_POOL_GUARD_PAGES 0
+#endif
+#else
+#undef THREAD_POOL_GUARD_PAGES
+#define THREAD_POOL_GUARD_PAGES 0
+#endif
+
+static struct list_node thread_pool_structs = LIST_INITIAL_VALUE(thread_pool_structs);
+static struct list_node thread_pool_stacks = LIST_INITIAL_VALUE(thread_pool_stacks);
+static uint thread_pool_struct_count;
+static uint thread_pool_stack_count;
+
+static inline size_t thread_pool_stack_alloc_size(void)
+{
+    size_t size = DEFAULT_STACK_SIZE;
+#if THREAD_STACK_BOUNDS_CHECK
+    size += THREAD_STACK_PADDING_SIZE;
+#endif
+    return size;
+}
+
+static thread_t *thread_pool_alloc_struct(void)
+{
+    THREAD_LOCK(state);
+    thread_t *t = list_remove_head_type(&thread_pool_structs, thread_t, thread_list_node);
+    if (t)
+        thread_pool_struct_count--;
+    THREAD_UNLOCK(state);
+
+    if (!t)
+        t = malloc(sizeof(thread_t));
+    return t;
+}
+
+static void *thread_pool_alloc_stack(void)
+{
+    THREAD_LOCK(state);
+    struct list_node *node = list_remove_head(&thread_pool_stacks);
+    if (node)
+        thread_pool_stack_count--;
+    THREAD_UNLOCK(state);
+
+    if (node)
+        return node;
+
+#if THREAD_POOL_GUARD_PAGES
+    void *ptr;
+    vmm_aspace_t *aspace = vmm_get_kernel_aspace();
+    size_t size = ROUNDUP(thread_pool_stack_alloc_size(), PAGE_SIZE) + PAGE_SIZE;
+
+    if (vmm_alloc(aspace, "thread stack", size, &ptr, PAGE_SIZE_SHIFT, 0,
+                  ARCH_MMU_FLAG_PERM_NO_EXECUTE) < 0)
+        return NULL;
+
+    /* the page stays in the region, it is just no longer reachable */
+    arch_mmu_unmap(&aspace->arch_aspace, (vaddr_t)ptr, 1);
+
+    return (uint8_t *)ptr + PAGE_SIZE;
+#else
+    return malloc(thread_pool_stack_alloc_size());
+#endif
+}
+
+/* put a dead thread's struct and stack back in the pool, thread lock held.
+ * returns the THREAD_FLAG_FREE_* bits for whatever the caller still has to free */
+static uint thread_pool_reclaim(thread_t *t)
+{
+    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+
+    uint to_free = 0;
+
+    if (t->stack && (t->flags & THREAD_FLAG_POOL_STACK)) {
+        if (THREAD_POOL_GUARD_PAGES || thread_pool_stack_count < THREAD_POOL_SIZE) {
+            list_add_head(&thread_pool_stacks, (struct list_node *)t->stack);
+            thread_pool_stack_count++;
+        } else {
+            to_free |= THREAD_FLAG_FREE_STACK;
+        }
+    } else if (t->stack && (t->flags & THREAD_FLAG_FREE_STACK)) {
+        to_free |= THREAD_FLAG_FREE_STACK;
+    }
+
+    if (t->flags & THREAD_FLAG_FREE_STRUCT) {
+        if (thread_pool_struct_count < THREAD_POOL_SIZE) {
+            list_add_head(&thread_pool_structs, &t->thread_list_node);
+            thread_pool_struct_count++;
+        } else {
+            to_free |= THREAD_FLAG_FREE_STRUCT;
+        }
+    }
+
+    return to_free;
 }
 
+#if THREAD_STATS
+/* note when a blocked, sleeping or suspended thread becomes ready */
+static inline void thread_stats_wakeup(thread_t *t)
+{
+    t->ready_timestamp = current_time_hires();
+}
+
+/* charge the outgoing thread for its time on the cpu and record how long the
+ * incoming one waited since its wakeup */
+static void thread_stats_switch(thread_t *oldthread, thread_t *newthread, uint cpu, lk_bigtime_t now)
+{
+    lk_bigtime_t run = now - oldthread->last_run_timestamp;
+    oldthread->runtime += run;
+    if (run > oldthread->max_run)
+        oldthread->max_run = run;
+
+    newthread->last_run_timestamp = now;
+
+    if (newthread->ready_timestamp) {
+        lk_bigtime_t latency = now - newthread->ready_timestamp;
+        if (latency > newthread->max_latency)
+            newthread->max_latency = latency;
+
+        uint bucket = (latency > UINT32_MAX) ? 32 : (latency ? 32 - __builtin_clz((uint32_t)latency) : 0);
+        if (bucket >= THREAD_LATENCY_BUCKETS)
+            bucket = THREAD_LATENCY_BUCKETS - 1;
+        get_percpu_cpu(cpu)->thread_stats.latency_hist[newthread->priority][bucket]++;
+
+        newthread->ready_timestamp = 0;
+    }
+}
+#else
+#define thread_stats_wakeup(t) do { } while (0)
+#endif
+
 static void init_thread_struct(thread_t *t, const char *name)
 {
     memset(t, 0, sizeof(thread_t));
     t->magic = THREAD_MAGIC;
-    thread_set_pinned_cpu(t, -1);
+    thread_set_cpu_affinity_mask(t, THREAD_CPU_AFFINITY_ALL);
+    thread_set_last_cpu(t, -1);
+    t->inherited_priority = -1;
+    list_initialize(&t->held_mutexes);
+    timer_initialize(&t->edf.replenish_timer);
     strlcpy(t->name, name, sizeof(t->name));
 }
 
@@ -154,7 +499,7 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
     unsigned int flags = 0;
 
     if (!t) {
-        t = malloc(sizeof(thread_t));
+        t = thread_pool_alloc_struct();
         if (!t)
             return NULL;
         flags |= THREAD_FLAG_FREE_STRUCT;
@@ -165,6 +510,7 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
     t->entry = entry;
     t->arg = arg;
     t->priority = priority;
+    t->base_priority = priority;
     t->state = THREAD_SUSPENDED;
     t->blocking_wait_queue = NULL;
     t->wait_queue_block_ret = NO_ERROR;
@@ -177,19 +523,20 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
     t->aspace = NULL;
 #endif
 
-    /* create the stack */
+    /* create the stack, default sized ones come out of the pool */
     if (!stack) {
+        bool pool = (stack_size == DEFAULT_STACK_SIZE);
 #if THREAD_STACK_BOUNDS_CHECK
         stack_size += THREAD_STACK_PADDING_SIZE;
         flags |= THREAD_FLAG_DEBUG_STACK_BOUNDS_CHECK;
 #endif
-        t->stack = malloc(stack_size);
+        t->stack = pool ? thread_pool_alloc_stack() : malloc(stack_size);
         if (!t->stack) {
             if (flags & THREAD_FLAG_FREE_STRUCT)
                 free(t);
             return NULL;
         }
-        flags |= THREAD_FLAG_FREE_STACK;
+        flags |= pool ? THREAD_FLAG_POOL_STACK : THREAD_FLAG_FREE_STACK;
 #if THREAD_STACK_BOUNDS_CHECK
         memset(t->stack, STACK_DEBUG_BYTE, THREAD_STACK_PADDING_SIZE);
 #endif
@@ -210,11 +557,11 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
     /* save whether or not we need to free the thread struct and/or stack */
     t->flags = flags;
 
-    /* inheirit thread local storage from the parent */
+    /* inheirit thread local storage from the parent, except what gets torn down with it */
     thread_t *current_thread = get_current_thread();
     int i;
     for (i=0; i < MAX_TLS_ENTRY; i++)
-        t->tls[i] = current_thread->tls[i];
+        t->tls[i] = tls_destructors[i] ? 0 : current_thread->tls[i];
 
     /* set up the initial stack frame */
     arch_thread_initialize(t);
@@ -250,7 +597,7 @@ status_t thread_set_real_time(thread_t *t)
 #if PLATFORM_HAS_DYNAMIC_TIMER
     if (t == get_current_thread()) {
         /* if we're currently running, cancel the preemption timer. */
-        timer_cancel(&preempt_timer[arch_curr_cpu_num()]);
+        timer_cancel(&get_percpu()->preempt_timer);
     }
 #endif
     t->flags |= THREAD_FLAG_REAL_TIME;
@@ -274,6 +621,133 @@ static bool thread_is_real_time_or_idle(thread_t *t)
     return !!(t->flags & (THREAD_FLAG_REAL_TIME | THREAD_FLAG_IDLE));
 }
 
+/* timer callback when a throttled deadline thread's next period begins */
+static enum handler_return thread_edf_replenish(timer_t *timer, lk_time_t now, void *arg)
+{
+    thread_t *t = (thread_t *)arg;
+
+    DEBUG_ASSERT(t->magic == THREAD_MAGIC);
+
+    THREAD_LOCK(state);
+
+    if (t->edf.throttled) {
+        DEBUG_ASSERT(t->state == THREAD_READY);
+        t->edf.throttled = false;
+        insert_in_run_queue_tail(t);
+        mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
+    }
+
+    THREAD_UNLOCK(state);
+
+    return INT_RESCHEDULE;
+}
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+/* point this cpu's preemption timer at the end of the running deadline thread's budget */
+static void thread_edf_arm_budget_timer(thread_t *t, uint cpu)
+{
+    lk_time_t delay = (lk_time_t)((t->edf.remaining + 999) / 1000);
+
+    timer_cancel(preempt_timer(cpu));
+    timer_set_oneshot(preempt_timer(cpu), delay ? delay : 1, (timer_callback)thread_timer_tick, NULL);
+}
+#endif
+
+/* charge the running deadline thread, asking for a reschedule once it's out of budget */
+static enum handler_return thread_edf_tick(thread_t *t)
+{
+    enum handler_return ret = INT_NO_RESCHEDULE;
+
+    THREAD_LOCK(state);
+
+    thread_edf_charge(t, current_time_hires());
+    if (t->edf.remaining == 0) {
+        ret = INT_RESCHEDULE;
+    } else {
+#if PLATFORM_HAS_DYNAMIC_TIMER
+        /* woke up a little early, wait out the rest */
+        thread_edf_arm_budget_timer(t, arch_curr_cpu_num());
+#endif
+    }
+
+    THREAD_UNLOCK(state);
+
+    return ret;
+}
+
+/**
+ * @brief  Move a thread into or out of the deadline scheduling class
+ *
+ * A deadline thread may run for up to \a budget ms out of every \a period ms,
+ * and is scheduled ahead of all priority scheduled threads, earliest deadline
+ * first. The budget is enforced: once used up the thread does not run again
+ * until its next period starts. Its priority still applies to everything else,
+ * such as wait queue ordering.
+ *
+ * @param t       Thread to change
+ * @param period  Length of a period in ms, 0 to return to regular scheduling
+ * @param budget  Cpu time allowed per period in ms, at most \a period
+ *
+ * @return NO_ERROR on success.
+ */
+status_t thread_set_deadline(thread_t *t, lk_time_t period, lk_time_t budget)
+{
+    if (!t)
+        return ERR_INVALID_ARGS;
+    if (period != 0 && (budget == 0 || budget > period))
+        return ERR_INVALID_ARGS;
+
+    DEBUG_ASSERT(t->magic == THREAD_MAGIC);
+
+    THREAD_LOCK(state);
+
+    if (thread_is_idle(t)) {
+        THREAD_UNLOCK(state);
+        return ERR_INVALID_ARGS;
+    }
+
+    /* pull it off whatever it's queued on, it goes back on under the new rules */
+    bool requeue = false;
+    if (t->edf.throttled) {
+        timer_cancel(&t->edf.replenish_timer);
+        t->edf.throttled = false;
+        requeue = true;
+    } else if (t->state == THREAD_READY && list_in_list(&t->queue_node)) {
+        remove_from_run_queue(t);
+        requeue = true;
+    }
+
+    t->edf.period = period;
+    t->edf.budget = budget;
+    if (period != 0) {
+        thread_edf_new_period(t, current_time());
+        t->edf.run_start = current_time_hires();
+    }
+
+    if (requeue) {
+        insert_in_run_queue_tail(t);
+        mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
+    }
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    /* the running thread swaps between the budget one shot and the preemption tick */
+    if (t == get_current_thread()) {
+        uint cpu = arch_curr_cpu_num();
+        if (thread_is_edf(t)) {
+            thread_edf_arm_budget_timer(t, cpu);
+        } else {
+            timer_cancel(preempt_timer(cpu));
+            if (!thread_is_real_time_or_idle(t))
+                timer_set_periodic(preempt_timer(cpu), 10, (timer_callback)thread_timer_tick, NULL);
+        }
+    }
+#endif
+
+    THREAD_UNLOCK(state);
+
+    return NO_ERROR;
+}
+
 /**
  * @brief  Make a suspended thread executable.
  *
@@ -294,6 +768,7 @@ status_t thread_resume(thread_t *t)
     THREAD_LOCK(state);
     if (t->state == THREAD_SUSPENDED) {
         t->state = THREAD_READY;
+        thread_stats_wakeup(t);
         insert_in_run_queue_head(t);
         if (!ints_disabled) /* HACK, don't resced into bootstrap thread before idle thread is set up */
             resched = true;
@@ -354,13 +829,18 @@ status_t thread_join(thread_t *t, int *retcode, lk_time_t timeout)
     /* clear the structure's magic */
     t->magic = 0;
 
+    /* recycle its stack and the thread structure itself, once back in the
+     * pool they may be reused as soon as the lock is dropped */
+    void *stack = t->stack;
+    uint to_free = thread_pool_reclaim(t);
+
     THREAD_UNLOCK(state);
 
-    /* free its stack and the thread structure itself */
-    if (t->flags & THREAD_FLAG_FREE_STACK && t->stack)
-        free(t->stack);
+    /* free whatever the pool had no room for */
+    if (to_free & THREAD_FLAG_FREE_STACK)
+        free(stack);
 
-    if (t->flags & THREAD_FLAG_FREE_STRUCT)
+    if (to_free & THREAD_FLAG_FREE_STRUCT)
         free(t);
 
     return NO_ERROR;
@@ -405,6 +885,15 @@ void thread_exit(int retcode)
 
 //  dprintf("thread_exit: current %p\n", current_thread);
 
+    /* let go of whatever the thread kept in tls */
+    for (uint i = 0; i < MAX_TLS_ENTRY; i++) {
+        uintptr_t val = current_thread->tls[i];
+        if (tls_destructors[i] && val) {
+            current_thread->tls[i] = 0;
+            tls_destructors[i](val);
+        }
+    }
+
     THREAD_LOCK(state);
 
     /* enter the dead state */
@@ -419,15 +908,19 @@ void thread_exit(int retcode)
         /* clear the structure's magic */
         current_thread->magic = 0;
 
-        /* free its stack and the thread structure itself */
-        if (current_thread->flags & THREAD_FLAG_FREE_STACK && current_thread->stack) {
-            heap_delayed_free(current_thread->stack);
+        /* recycle or free its stack and the thread structure itself. the
+         * pool can't hand them out until we've switched away and dropped
+         * the thread lock */
+        void *stack = current_thread->stack;
+        uint to_free = thread_pool_reclaim(current_thread);
 
-            /* make sure its not going to get a bounds check performed on the half-freed stack */
-            current_thread->flags &= ~THREAD_FLAG_DEBUG_STACK_BOUNDS_CHECK;
-        }
+        /* make sure its not going to get a bounds check performed on the half-freed stack */
+        current_thread->flags &= ~THREAD_FLAG_DEBUG_STACK_BOUNDS_CHECK;
 
-        if (current_thread->flags & THREAD_FLAG_FREE_STRUCT)
+        if (to_free & THREAD_FLAG_FREE_STACK)
+            heap_delayed_free(stack);
+
+        if (to_free & THREAD_FLAG_FREE_STRUCT)
             heap_delayed_free(current_thread);
     } else {
         /* signal if anyone is waiting */
@@ -440,39 +933,159 @@ void thread_exit(int retcode)
     panic("somehow fell through thread_exit()\n");
 }
 
+#if WITH_SMP
+/* the most important thread in a sibling's main queue that may run on cpu, with its queue lock held */
+static thread_t *run_queue_find_pullable(struct run_queue *src, uint cpu, int *priority)
+{
+    for (int pri = run_queue_top_priority(src->bitmap); pri >= 0; pri--) {
+        thread_t *t;
+        list_for_every_entry(&src->queue[pri], t, thread_t, queue_node) {
+            if (thread_cpu_affinity(t) & (1U << cpu)) {
+                *priority = pri;
+                return t;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Move the most important thread queued on a sibling that we're allowed to run
+ * into our own queue. Only called once our queue has run dry, by the reschedule
+ * about to pick the idle thread and by the idle loop, which does it without the
+ * thread lock. The siblings' bitmaps are looked at without any lock, the queue
+ * locks are only taken once there is something to pull.
+ */
+static bool run_queue_pull(uint cpu)
+{
+    struct run_queue *rq = &run_queue[cpu];
+
+    /* siblings already found to have nothing we can take */
+    mp_cpu_mask_t tried = 1U << cpu;
+
+    for (;;) {
+        int best_priority = -1;
+        uint best = cpu;
+
+        for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+            if (tried & (1U << i))
+                continue;
+
+            int pri = run_queue_top_priority(*(volatile uint32_t *)&run_queue[i].bitmap);
+            if (pri > best_priority) {
+                best_priority = pri;
+                best = i;
+            }
+        }
+
+        if (best_priority < 0)
+            return false;
+
+        struct run_queue *src = &run_queue[best];
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&run_queue[MIN(cpu, best)].lock, state);
+        spin_lock(&run_queue[MAX(cpu, best)].lock);
+
+        /* usually the head, unless it has a restricted affinity that leaves us out */
+        int pri;
+        thread_t *t = run_queue_find_pullable(src, cpu, &pri);
+        if (t) {
+            /* relink it by hand rather than list_delete(), others check list_in_list()
+             * under the thread lock alone and must never see it in neither queue */
+            struct list_node *node = &t->queue_node;
+            node->next->prev = node->prev;
+            node->prev->next = node->next;
+            if (list_is_empty(&src->queue[pri]))
+                src->bitmap &= ~(1<<pri);
+
+            thread_set_queued_cpu(t, cpu);
+            list_add_tail(&rq->queue[pri], node);
+            rq->bitmap |= (1<<pri);
+        }
+
+        if (t)
+            THREAD_STATS_INC(steals);
+
+        spin_unlock(&run_queue[MAX(cpu, best)].lock);
+        spin_unlock_irqrestore(&run_queue[MIN(cpu, best)].lock, state);
+
+        if (t)
+            return true;
+
+        /* nothing there for us, or someone beat us to it, look at the others */
+        tried |= 1U << best;
+    }
+}
+#endif
+
 static void idle_thread_routine(void)
 {
-    for (;;)
-        arch_idle();
+    for (;;) {
+#if WITH_SMP
+        /* siblings may have queued work while we were asleep, take some before sleeping again */
+        if (run_queue_pull(arch_curr_cpu_num())) {
+            thread_yield();
+            continue;
+        }
+#endif
+        idle_enter();
+    }
 }
 
 static thread_t *get_top_thread(int cpu)
 {
     thread_t *newthread;
-    uint32_t local_run_queue_bitmap = run_queue_bitmap;
+    struct run_queue *rq = &run_queue[cpu];
 
-    while (local_run_queue_bitmap) {
-        /* find the first (remaining) queue with a thread in it */
-        uint next_queue = sizeof(run_queue_bitmap) * 8 - 1 - __builtin_clz(local_run_queue_bitmap);
+again:
+    spin_lock(&rq->lock);
 
-        list_for_every_entry(&run_queue[next_queue], newthread, thread_t, queue_node) {
-#if WITH_SMP
-            if (newthread->pinned_cpu < 0 || newthread->pinned_cpu == cpu)
-#endif
-            {
-                list_delete(&newthread->queue_node);
+    int pri = run_queue_top_priority(rq->bitmap);
+    int bound_pri = run_queue_top_priority(rq->bound_bitmap);
 
-                if (list_is_empty(&run_queue[next_queue]))
-                    run_queue_bitmap &= ~(1<<next_queue);
+    /* the deadline class comes before anything priority scheduled */
+    newthread = list_remove_head_type(&rq->edf_queue, thread_t, queue_node);
+    if (newthread)
+        goto done;
 
-                return newthread;
-            }
-        }
+    /* threads bound to us win ties, nobody else can run them */
+    if (bound_pri >= 0 && bound_pri >= pri) {
+        newthread = list_remove_head_type(&rq->bound_queue[bound_pri], thread_t, queue_node);
+        DEBUG_ASSERT(newthread);
+        DEBUG_ASSERT(thread_cpu_affinity(newthread) & (1U << cpu));
+
+        if (list_is_empty(&rq->bound_queue[bound_pri]))
+            rq->bound_bitmap &= ~(1<<bound_pri);
 
-        local_run_queue_bitmap &= ~(1<<next_queue);
+        goto done;
     }
+
+    if (pri >= 0) {
+        newthread = list_remove_head_type(&rq->queue[pri], thread_t, queue_node);
+        DEBUG_ASSERT(newthread);
+        DEBUG_ASSERT(thread_cpu_affinity(newthread) & (1U << cpu));
+
+        if (list_is_empty(&rq->queue[pri]))
+            rq->bitmap &= ~(1<<pri);
+
+        goto done;
+    }
+
+    spin_unlock(&rq->lock);
+
+#if WITH_SMP
+    /* nothing of our own left, see if a busy sibling can spare something */
+    if (run_queue_pull(cpu))
+        goto again;
+#endif
+
     /* no threads to run, select the idle thread for this cpu */
     return idle_thread(cpu);
+
+done:
+    spin_unlock(&rq->lock);
+    return newthread;
 }
 
 /**
@@ -485,7 +1098,7 @@ static thread_t *get_top_thread(int cpu)
  * This is probably not the function you're looking for. See
  * thread_yield() instead.
  */
-void thread_resched(void)
+__FAST_CODE void thread_resched(void)
 {
     thread_t *oldthread;
     thread_t *newthread;
@@ -496,9 +1109,13 @@ void thread_resched(void)
     DEBUG_ASSERT(arch_ints_disabled());
     DEBUG_ASSERT(spin_lock_held(&thread_lock));
     DEBUG_ASSERT(current_thread->state != THREAD_RUNNING);
+    DEBUG_ASSERT(current_thread->preempt_disable == 0);
 
     THREAD_STATS_INC(reschedules);
 
+    /* nothing on this cpu can still be inside a preempt disabled section */
+    get_percpu_cpu(cpu)->rcu_qs++;
+
     newthread = get_top_thread(cpu);
 
     DEBUG_ASSERT(newthread);
@@ -518,6 +1135,7 @@ void thread_resched(void)
     /* mark the cpu ownership of the threads */
     thread_set_curr_cpu(oldthread, -1);
     thread_set_curr_cpu(newthread, cpu);
+    thread_set_last_cpu(newthread, cpu);
 
 #if WITH_SMP
     if (thread_is_idle(newthread)) {
@@ -536,36 +1154,51 @@ void thread_resched(void)
 #if THREAD_STATS
     THREAD_STATS_INC(context_switches);
 
+    struct thread_stats *stats = &get_percpu_cpu(cpu)->thread_stats;
+    lk_bigtime_t now = current_time_hires();
     if (thread_is_idle(oldthread)) {
-        lk_bigtime_t now = current_time_hires();
-        thread_stats[cpu].idle_time += now - thread_stats[cpu].last_idle_timestamp;
+        stats->idle_time += now - stats->last_idle_timestamp;
     }
     if (thread_is_idle(newthread)) {
-        thread_stats[cpu].last_idle_timestamp = current_time_hires();
+        stats->last_idle_timestamp = now;
     }
+    thread_stats_switch(oldthread, newthread, cpu, now);
 #endif
 
+    /* settle the deadline budgets of the threads going off and on the cpu */
+    if (thread_is_edf(oldthread) || thread_is_edf(newthread)) {
+        lk_bigtime_t edf_now = current_time_hires();
+        if (thread_is_edf(oldthread))
+            thread_edf_charge(oldthread, edf_now);
+        if (thread_is_edf(newthread))
+            newthread->edf.run_start = edf_now;
+    }
+
     KEVLOG_THREAD_SWITCH(oldthread, newthread);
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
-    if (thread_is_real_time_or_idle(newthread)) {
-        if (!thread_is_real_time_or_idle(oldthread)) {
+    if (thread_is_edf(newthread)) {
+        /* deadline threads get a one shot at the end of their budget instead of the tick */
+        thread_edf_arm_budget_timer(newthread, cpu);
+    } else if (thread_is_real_time_or_idle(newthread)) {
+        if (!thread_is_real_time_or_idle(oldthread) || thread_is_edf(oldthread)) {
             /* if we're switching from a non real time to a real time, cancel
              * the preemption timer. */
 #if DEBUG_THREAD_CONTEXT_SWITCH
             dprintf(ALWAYS, "arch_context_switch: stop preempt, cpu %d, old %p (%s), new %p (%s)\n",
                     cpu, oldthread, oldthread->name, newthread, newthread->name);
 #endif
-            timer_cancel(&preempt_timer[cpu]);
+            timer_cancel(preempt_timer(cpu));
         }
-    } else if (thread_is_real_time_or_idle(oldthread)) {
-        /* if we're switching from a real time (or idle thread) to a regular one,
-         * set up a periodic timer to run our preemption tick. */
+    } else if (thread_is_real_time_or_idle(oldthread) || thread_is_edf(oldthread)) {
+        /* if we're switching from a real time (or idle or deadline thread) to a
+         * regular one, set up a periodic timer to run our preemption tick. */
 #if DEBUG_THREAD_CONTEXT_SWITCH
         dprintf(ALWAYS, "arch_context_switch: start preempt, cpu %d, old %p (%s), new %p (%s)\n",
                 cpu, oldthread, oldthread->name, newthread, newthread->name);
 #endif
-        timer_set_periodic(&preempt_timer[cpu], 10, (timer_callback)thread_timer_tick, NULL);
+        timer_cancel(preempt_timer(cpu));
+        timer_set_periodic(preempt_timer(cpu), 10, (timer_callback)thread_timer_tick, NULL);
     }
 #endif
 
@@ -667,6 +1300,13 @@ void thread_preempt(void)
     DEBUG_ASSERT(current_thread->magic == THREAD_MAGIC);
     DEBUG_ASSERT(current_thread->state == THREAD_RUNNING);
 
+    /* hold it until the thread leaves its preempt disabled section */
+    if (current_thread->preempt_disable) {
+        current_thread->preempt_pending = true;
+        return;
+    }
+    current_thread->preempt_pending = false;
+
 #if THREAD_STATS
     if (!thread_is_idle(current_thread))
         THREAD_STATS_INC(preempts); /* only track when a meaningful preempt happens */
@@ -689,6 +1329,15 @@ void thread_preempt(void)
     THREAD_UNLOCK(state);
 }
 
+/* a preempt came in while preemption was disabled, take it now */
+void thread_preempt_deferred(void)
+{
+    thread_t *current_thread = get_current_thread();
+
+    if (current_thread->preempt_pending && current_thread->preempt_disable == 0)
+        thread_preempt();
+}
+
 /**
  * @brief  Suspend thread until woken.
  *
@@ -720,16 +1369,53 @@ void thread_unblock(thread_t *t, bool resched)
     DEBUG_ASSERT(!thread_is_idle(t));
 
     t->state = THREAD_READY;
+    thread_stats_wakeup(t);
     insert_in_run_queue_head(t);
     mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
     if (resched)
         thread_resched();
 }
 
+/**
+ * @brief  Change the priority a thread inherited from the mutexes it holds
+ *
+ * The thread runs at the higher of its own priority and \a priority. Pass -1
+ * to drop back to its own priority. If the thread is sitting in a run queue
+ * it is requeued at its new priority.
+ */
+void thread_set_inherited_priority(thread_t *t, int priority)
+{
+    DEBUG_ASSERT(t->magic == THREAD_MAGIC);
+    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+
+    t->inherited_priority = priority;
+
+    int new_priority = MAX(t->base_priority, priority);
+    if (new_priority == t->priority || thread_is_idle(t))
+        return;
+
+    if (t->state == THREAD_READY && list_in_list(&t->queue_node)) {
+        remove_from_run_queue(t);
+        t->priority = new_priority;
+        insert_in_run_queue_head(t);
+        mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
+    } else {
+        /* running or waiting, it'll be queued at the new priority when it's next ready */
+        t->priority = new_priority;
+    }
+}
+
 enum handler_return thread_timer_tick(void)
 {
     thread_t *current_thread = get_current_thread();
 
+    /* the tick interrupted a thread outside any read side section */
+    if (current_thread->preempt_disable == 0)
+        get_percpu()->rcu_qs++;
+
+    if (thread_is_edf(current_thread))
+        return thread_edf_tick(current_thread);
+
     if (thread_is_real_time_or_idle(current_thread))
         return INT_NO_RESCHEDULE;
 
@@ -752,6 +1438,7 @@ static enum handler_return thread_sleep_handler(timer_t *timer, lk_time_t now, v
     THREAD_LOCK(state);
 
     t->state = THREAD_READY;
+    thread_stats_wakeup(t);
     insert_in_run_queue_head(t);
 
     THREAD_UNLOCK(state);
@@ -788,6 +1475,31 @@ void thread_sleep(lk_time_t delay)
     THREAD_UNLOCK(state);
 }
 
+/**
+ * @brief  Put thread to sleep; delay specified in ns
+ *
+ * Like thread_sleep(), but the wakeup is programmed with nanosecond
+ * resolution on platforms with a dynamic timer.
+ */
+void thread_sleep_ns(lk_time_ns_t delay)
+{
+    timer_t timer;
+
+    thread_t *current_thread = get_current_thread();
+
+    DEBUG_ASSERT(current_thread->magic == THREAD_MAGIC);
+    DEBUG_ASSERT(current_thread->state == THREAD_RUNNING);
+    DEBUG_ASSERT(!thread_is_idle(current_thread));
+
+    timer_initialize(&timer);
+
+    THREAD_LOCK(state);
+    timer_set_oneshot_ns(&timer, delay, thread_sleep_handler, (void *)current_thread);
+    current_thread->state = THREAD_SLEEPING;
+    thread_resched();
+    THREAD_UNLOCK(state);
+}
+
 /**
  * @brief  Initialize threading system
  *
@@ -800,8 +1512,16 @@ void thread_init_early(void)
     DEBUG_ASSERT(arch_curr_cpu_num() == 0);
 
     /* initialize the run queues */
-    for (i=0; i < NUM_PRIORITIES; i++)
-        list_initialize(&run_queue[i]);
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        for (i=0; i < NUM_PRIORITIES; i++) {
+            list_initialize(&run_queue[cpu].queue[i]);
+            list_initialize(&run_queue[cpu].bound_queue[i]);
+        }
+        list_initialize(&run_queue[cpu].edf_queue);
+        spin_lock_init(&run_queue[cpu].lock);
+        run_queue[cpu].bitmap = 0;
+        run_queue[cpu].bound_bitmap = 0;
+    }
 
     /* initialize the thread list */
     list_initialize(&thread_list);
@@ -811,7 +1531,7 @@ void thread_init_early(void)
     init_thread_struct(t, "bootstrap");
 
     /* half construct this thread, since we're already running */
-    t->priority = HIGHEST_PRIORITY;
+    t->priority = t->base_priority = HIGHEST_PRIORITY;
     t->state = THREAD_RUNNING;
     t->flags = THREAD_FLAG_DETACHED;
     thread_set_curr_cpu(t, 0);
@@ -830,11 +1550,23 @@ void thread_init(void)
 {
 #if PLATFORM_HAS_DYNAMIC_TIMER
     for (uint i = 0; i < SMP_MAX_CPUS; i++) {
-        timer_initialize(&preempt_timer[i]);
+        timer_initialize(preempt_timer(i));
     }
 #endif
 }
 
+/**
+ * @brief Set the destructor for a thread local storage entry
+ *
+ * Meant to be called once, at init time, by whoever owns the entry.
+ */
+void tls_set_destructor(uint entry, tls_destructor_t dtor)
+{
+    DEBUG_ASSERT(entry < MAX_TLS_ENTRY);
+
+    tls_destructors[entry] = dtor;
+}
+
 /**
  * @brief Change name of current thread
  */
@@ -859,7 +1591,8 @@ void thread_set_priority(int priority)
         priority = IDLE_PRIORITY + 1;
     if (priority > HIGHEST_PRIORITY)
         priority = HIGHEST_PRIORITY;
-    current_thread->priority = priority;
+    current_thread->base_priority = priority;
+    current_thread->priority = MAX(priority, current_thread->inherited_priority);
 
     current_thread->state = THREAD_READY;
     insert_in_run_queue_head(current_thread);
@@ -868,6 +1601,64 @@ void thread_set_priority(int priority)
     THREAD_UNLOCK(state);
 }
 
+/**
+ * @brief Set the set of cpus a thread is allowed to run on
+ *
+ * @param t     Thread to modify
+ * @param mask  Bitmap of cpus, bit n allowing cpu n. THREAD_CPU_AFFINITY_ALL
+ *              lets the thread float.
+ *
+ * If the thread is queued it is moved to an allowed cpu's run queue, if it is
+ * running somewhere it isn't allowed to be it is kicked off at that cpu's next
+ * reschedule.
+ *
+ * @return NO_ERROR on success, ERR_INVALID_ARGS if mask names no existing cpu.
+ */
+status_t thread_set_cpu_affinity(thread_t *t, mp_cpu_mask_t mask)
+{
+    DEBUG_ASSERT(t->magic == THREAD_MAGIC);
+
+    mask &= THREAD_CPU_AFFINITY_ALL;
+    if (mask == 0)
+        return ERR_INVALID_ARGS;
+
+#if WITH_SMP
+    THREAD_LOCK(state);
+
+    t->cpu_affinity = mask;
+
+    if (t->state == THREAD_READY && list_in_list(&t->queue_node)) {
+        /* requeue it so it lands in an allowed cpu's queue */
+        remove_from_run_queue(t);
+        insert_in_run_queue_tail(t);
+        mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
+    } else if (t->state == THREAD_RUNNING && (mask & (1U << t->curr_cpu)) == 0) {
+        if (t == get_current_thread()) {
+            t->state = THREAD_READY;
+            insert_in_run_queue_tail(t);
+            mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
+            thread_resched();
+        } else {
+            mp_reschedule(1U << t->curr_cpu, MP_RESCHEDULE_FLAG_REALTIME);
+        }
+    }
+
+    THREAD_UNLOCK(state);
+#endif
+
+    return NO_ERROR;
+}
+
+/**
+ * @brief Get the set of cpus a thread is allowed to run on
+ */
+mp_cpu_mask_t thread_get_cpu_affinity(thread_t *t)
+{
+    DEBUG_ASSERT(t->magic == THREAD_MAGIC);
+
+    return thread_cpu_affinity(t);
+}
+
 /**
  * @brief  Become an idle thread
  *
@@ -890,7 +1681,7 @@ void thread_become_idle(void)
 #endif
 
     /* mark ourself as idle */
-    t->priority = IDLE_PRIORITY;
+    t->priority = t->base_priority = IDLE_PRIORITY;
     t->flags |= THREAD_FLAG_IDLE;
     thread_set_pinned_cpu(t, arch_curr_cpu_num());
 
@@ -920,7 +1711,7 @@ void thread_secondary_cpu_init_early(void)
     thread_set_pinned_cpu(t, cpu);
 
     /* half construct this thread, since we're already running */
-    t->priority = HIGHEST_PRIORITY;
+    t->priority = t->base_priority = HIGHEST_PRIORITY;
     t->state = THREAD_RUNNING;
     t->flags = THREAD_FLAG_DETACHED | THREAD_FLAG_IDLE;
     thread_set_curr_cpu(t, cpu);
@@ -939,7 +1730,7 @@ void thread_secondary_cpu_entry(void)
 {
     uint cpu = arch_curr_cpu_num();
     thread_t *t = get_current_thread();
-    t->priority = IDLE_PRIORITY;
+    t->priority = t->base_priority = IDLE_PRIORITY;
 
     mp_set_curr_cpu_active(true);
     mp_set_cpu_idle(cpu);
@@ -996,11 +1787,11 @@ void dump_thread(thread_t *t)
 {
     dprintf(INFO, "dump_thread: t %p (%s)\n", t, t->name);
 #if WITH_SMP
-    dprintf(INFO, "\tstate %s, curr_cpu %d, pinned_cpu %d, priority %d, remaining quantum %d\n",
-            thread_state_to_str(t->state), t->curr_cpu, t->pinned_cpu, t->priority, t->remaining_quantum);
+    dprintf(INFO, "\tstate %s, curr_cpu %d, last_cpu %d, affinity 0x%x, priority %d (base %d), remaining quantum %d\n",
+            thread_state_to_str(t->state), t->curr_cpu, t->last_cpu, t->cpu_affinity, t->priority, t->base_priority, t->remaining_quantum);
 #else
-    dprintf(INFO, "\tstate %s, priority %d, remaining quantum %d\n",
-            thread_state_to_str(t->state), t->priority, t->remaining_quantum);
+    dprintf(INFO, "\tstate %s, priority %d (base %d), remaining quantum %d\n",
+            thread_state_to_str(t->state), t->priority, t->base_priority, t->remaining_quantum);
 #endif
 #ifdef THREAD_STACK_HIGHWATER
     dprintf(INFO, "\tstack %p, stack_size %zd, stack_used %zd\n",
@@ -1009,6 +1800,11 @@ void dump_thread(thread_t *t)
     dprintf(INFO, "\tstack %p, stack_size %zd\n", t->stack, t->stack_size);
 #endif
     dprintf(INFO, "\tentry %p, arg %p, flags 0x%x\n", t->entry, t->arg, t->flags);
+    if (thread_is_edf(t)) {
+        dprintf(INFO, "\tdeadline class: period %u, budget %u, deadline %u, remaining %llu us%s\n",
+                t->edf.period, t->edf.budget, t->edf.deadline, t->edf.remaining,
+                t->edf.throttled ? ", throttled" : "");
+    }
     dprintf(INFO, "\twait queue %p, wait queue ret %d\n", t->blocking_wait_queue, t->wait_queue_block_ret);
 #if WITH_KERNEL_VM
     dprintf(INFO, "\taspace %p\n", t->aspace);
@@ -1043,6 +1839,32 @@ void dump_all_threads(void)
     THREAD_UNLOCK(state);
 }
 
+#if THREAD_STATS
+void dump_all_thread_stats(void)
+{
+    thread_t *t;
+
+    printf("%-24s %4s %12s %10s %12s\n", "name", "pri", "runtime(us)", "maxrun", "maxlatency");
+
+    THREAD_LOCK(state);
+    lk_bigtime_t now = current_time_hires();
+    list_for_every_entry(&thread_list, t, thread_t, thread_list_node) {
+        lk_bigtime_t runtime = t->runtime;
+        lk_bigtime_t max_run = t->max_run;
+
+        /* count the stretch a running thread is in the middle of */
+        if (t->state == THREAD_RUNNING) {
+            runtime += now - t->last_run_timestamp;
+            max_run = MAX(max_run, now - t->last_run_timestamp);
+        }
+
+        printf("%-24s %4d %12llu %10llu %12llu\n", t->name, t->priority,
+               runtime, max_run, t->max_latency);
+    }
+    THREAD_UNLOCK(state);
+}
+#endif
+
 /** @} */
 
 
@@ -1127,6 +1949,36 @@ status_t wait_queue_block(wait_queue_t *wait, lk_time_t timeout)
     return current_thread->wait_queue_block_ret;
 }
 
+/* pull a specific thread out of a wait queue and make it ready to run */
+static void wait_queue_wake_thread(wait_queue_t *wait, thread_t *t, bool reschedule, status_t wait_queue_error)
+{
+    thread_t *current_thread = get_current_thread();
+
+    DEBUG_ASSERT(t->state == THREAD_BLOCKED);
+    DEBUG_ASSERT(t->blocking_wait_queue == wait);
+
+    list_delete(&t->queue_node);
+    wait->count--;
+    t->state = THREAD_READY;
+    thread_stats_wakeup(t);
+    t->wait_queue_block_ret = wait_queue_error;
+    t->blocking_wait_queue = NULL;
+
+    /* if we're instructed to reschedule, stick the current thread on the head
+     * of the run queue first, so that the newly awakened thread gets a chance to run
+     * before the current one, but the current one doesn't get unnecessarilly punished.
+     */
+    if (reschedule) {
+        current_thread->state = THREAD_READY;
+        insert_in_run_queue_head(current_thread);
+    }
+    insert_in_run_queue_head(t);
+    mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
+    if (reschedule) {
+        thread_resched();
+    }
+}
+
 /**
  * @brief  Wake up one thread sleeping on a wait queue
  *
@@ -1143,44 +1995,67 @@ status_t wait_queue_block(wait_queue_t *wait, lk_time_t timeout)
  */
 int wait_queue_wake_one(wait_queue_t *wait, bool reschedule, status_t wait_queue_error)
 {
-    thread_t *t;
-    int ret = 0;
+    DEBUG_ASSERT(wait->magic == WAIT_QUEUE_MAGIC);
+    DEBUG_ASSERT(arch_ints_disabled());
+    DEBUG_ASSERT(spin_lock_held(&thread_lock));
 
-    thread_t *current_thread = get_current_thread();
+    thread_t *t = list_peek_head_type(&wait->list, thread_t, queue_node);
+    if (!t)
+        return 0;
+
+    wait_queue_wake_thread(wait, t, reschedule, wait_queue_error);
+    return 1;
+}
+
+/**
+ * @brief  Wake up the highest priority thread sleeping on a wait queue
+ *
+ * Same as wait_queue_wake_one(), except that the thread woken is the highest
+ * priority one waiting, the longest waiting among equals.
+ *
+ * @return  The number of threads woken (zero or one)
+ */
+int wait_queue_wake_highest(wait_queue_t *wait, bool reschedule, status_t wait_queue_error)
+{
+    thread_t *t;
+    thread_t *best = NULL;
 
     DEBUG_ASSERT(wait->magic == WAIT_QUEUE_MAGIC);
     DEBUG_ASSERT(arch_ints_disabled());
     DEBUG_ASSERT(spin_lock_held(&thread_lock));
 
-    t = list_remove_head_type(&wait->list, thread_t, queue_node);
-    if (t) {
-        wait->count--;
-        DEBUG_ASSERT(t->state == THREAD_BLOCKED);
-        t->state = THREAD_READY;
-        t->wait_queue_block_ret = wait_queue_error;
-        t->blocking_wait_queue = NULL;
+    list_for_every_entry(&wait->list, t, thread_t, queue_node) {
+        if (!best || t->priority > best->priority)
+            best = t;
+    }
+    if (!best)
+        return 0;
 
-        /* if we're instructed to reschedule, stick the current thread on the head
-         * of the run queue first, so that the newly awakened thread gets a chance to run
-         * before the current one, but the current one doesn't get unnecessarilly punished.
-         */
-        if (reschedule) {
-            current_thread->state = THREAD_READY;
-            insert_in_run_queue_head(current_thread);
-        }
-        insert_in_run_queue_head(t);
-        mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
-        if (reschedule) {
-            thread_resched();
-        }
-        ret = 1;
+    wait_queue_wake_thread(wait, best, reschedule, wait_queue_error);
+    return 1;
+}
 
+/**
+ * @brief  Priority of the highest priority thread in a wait queue
+ *
+ * @return  The priority, or -1 if nothing is waiting
+ */
+int wait_queue_highest_priority(wait_queue_t *wait)
+{
+    thread_t *t;
+    int priority = -1;
+
+    DEBUG_ASSERT(wait->magic == WAIT_QUEUE_MAGIC);
+    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+
+    list_for_every_entry(&wait->list, t, thread_t, queue_node) {
+        if (t->priority > priority)
+            priority = t->priority;
     }
 
-    return ret;
+    return priority;
 }
 
-
 /**
  * @brief  Wake all threads sleeping on a wait queue
  *
@@ -1220,6 +2095,7 @@ int wait_queue_wake_all(wait_queue_t *wait, bool reschedule, status_t wait_queue
         wait->count--;
         DEBUG_ASSERT(t->state == THREAD_BLOCKED);
         t->state = THREAD_READY;
+        thread_stats_wakeup(t);
         t->wait_queue_block_ret = wait_queue_error;
         t->blocking_wait_queue = NULL;
 
@@ -1283,6 +2159,7 @@ status_t thread_unblock_from_wait_queue(thread_t *t, status_t wait_queue_error)
     t->blocking_wait_queue->count--;
     t->blocking_wait_queue = NULL;
     t->state = THREAD_READY;
+    thread_stats_wakeup(t);
     t->wait_queue_block_ret = wait_queue_error;
     insert_in_run_queue_head(t);
     mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
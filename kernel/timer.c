@@ -32,12 +32,23 @@
  *
  * Timer callback functions are called in interrupt context.
  *
+ * Pending timers are kept in a per cpu hierarchical timer wheel, which makes
+ * setting and canceling a timer O(1) regardless of how many are queued.
+ * Level 0 has one slot per ms for the next TIMER_WHEEL_SLOTS ms, each level
+ * above it has slots TIMER_WHEEL_SLOTS times coarser. Timers in the upper
+ * levels are cascaded down a level when the wheel reaches their slot.
+ *
+ * Timers set with nanosecond resolution skip the wheel and sit on a per cpu
+ * list sorted by deadline. The hardware is programmed for whichever of the
+ * two has the earliest deadline.
+ *
  * @{
  */
 #include <debug.h>
 #include <trace.h>
 #include <assert.h>
 #include <list.h>
+#include <stdio.h>
 #include <kernel/thread.h>
 #include <kernel/timer.h>
 #include <kernel/debug.h>
@@ -47,14 +58,52 @@
 
 #define LOCAL_TRACE 0
 
+#define TIMER_WHEEL_BITS 8
+#define TIMER_WHEEL_SLOTS (1U << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 3
+
+/* furthest out a timer can be placed directly, anything beyond is parked in
+ * the last slot of the top level and re-evaluated when it cascades */
+#define TIMER_WHEEL_SPAN (1U << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+#define TIMER_WHEEL_BITMAP_WORDS (TIMER_WHEEL_SLOTS / 32)
+
+#if !PLATFORM_HAS_DYNAMIC_TIMER
+#define TIMER_TICK_MSECS 10
+#endif
+
 spin_lock_t timer_lock;
 
+struct timer_wheel_level {
+    /* bit set if the slot may hold timers, cleared lazily when found empty */
+    uint32_t bitmap[TIMER_WHEEL_BITMAP_WORDS];
+    struct list_node slot[TIMER_WHEEL_SLOTS];
+};
+
 struct timer_state {
-    struct list_node timer_queue;
+    /* time the wheel has been advanced up to */
+    lk_time_t now;
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    /* deadline the hardware timer is currently programmed for */
+    bool armed;
+    lk_time_ns_t deadline_ns;
+
+    /* nanosecond timers, sorted by scheduled_time_ns */
+    struct list_node hires;
+#endif
+    struct timer_wheel_level level[TIMER_WHEEL_LEVELS];
 } __CPU_ALIGN;
 
 static struct timer_state timers[SMP_MAX_CPUS];
 
+/* protected by timer_lock */
+static struct timer_stats {
+    uint queued;
+    uint max_queued;
+    ulong cascades;
+} timer_stats;
+
 static enum handler_return timer_tick(void *arg, lk_time_t now);
 
 /**
@@ -65,23 +114,269 @@ void timer_initialize(timer_t *timer)
     *timer = (timer_t)TIMER_INITIAL_VALUE(*timer);
 }
 
+/**
+ * @brief  Allow a timer to fire late so it can share an interrupt
+ *
+ * A timer with slack may fire anywhere up to \a slack ms after its deadline.
+ * The deadline is pushed out to the most round value in that window, so timers
+ * set around the same time tend to land on the same ms and are serviced by a
+ * single interrupt. Takes effect the next time the timer is set.
+ *
+ * @param  timer The timer to modify
+ * @param  slack Maximum lateness in ms, 0 (the default) for none
+ */
+void timer_set_slack(timer_t *timer, lk_time_t slack)
+{
+    DEBUG_ASSERT(timer->magic == TIMER_MAGIC);
+
+    timer->slack = slack;
+}
+
+/* pick the roundest time in [when, when + slack] */
+static lk_time_t timer_apply_slack(lk_time_t when, lk_time_t slack)
+{
+    if (slack == 0)
+        return when;
+
+    lk_time_t limit = when + slack;
+    uint bit = 31 - __builtin_clz(when ^ limit);
+
+    return limit & ~((1U << bit) - 1);
+}
+
+static inline uint wheel_slot_index(lk_time_t t, uint level)
+{
+    return (t >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+}
+
+/* find the first slot at or after start (wrapping) that may be occupied, returning
+ * its distance from start or -1 if the whole level is empty */
+static int wheel_level_next_slot(struct timer_wheel_level *l, uint start)
+{
+    for (uint off = 0; off < TIMER_WHEEL_SLOTS; ) {
+        uint idx = (start + off) & TIMER_WHEEL_MASK;
+        uint32_t word = l->bitmap[idx / 32] >> (idx % 32);
+
+        if (word == 0) {
+            /* skip the rest of this bitmap word */
+            off += 32 - (idx % 32);
+            continue;
+        }
+
+        uint skip = __builtin_ctz(word);
+        off += skip;
+        if (off >= TIMER_WHEEL_SLOTS)
+            break;
+        idx = (start + off) & TIMER_WHEEL_MASK;
+
+        if (!list_is_empty(&l->slot[idx]))
+            return off;
+
+        /* stale bit left behind by a cancel */
+        l->bitmap[idx / 32] &= ~(1U << (idx % 32));
+        off++;
+    }
+
+    return -1;
+}
+
+/* place a timer in the slot it belongs in relative to the wheel's current time */
 static void insert_timer_in_queue(uint cpu, timer_t *timer)
 {
-    timer_t *entry;
+    struct timer_state *ts = &timers[cpu];
+    lk_time_t when = timer->scheduled_time;
 
     DEBUG_ASSERT(arch_ints_disabled());
 
     LTRACEF("timer %p, cpu %u, scheduled %u, periodic %u\n", timer, cpu, timer->scheduled_time, timer->periodic_time);
 
-    list_for_every_entry(&timers[cpu].timer_queue, entry, timer_t, node) {
-        if (TIME_GT(entry->scheduled_time, timer->scheduled_time)) {
+    /* due now or overdue, the current slot has already been run so make sure it
+     * goes off the next time the wheel moves */
+    if (!TIME_GT(when, ts->now))
+        when = ts->now + 1;
+
+    lk_time_t delta = when - ts->now;
+    if (delta >= TIMER_WHEEL_SPAN)
+        when = ts->now + TIMER_WHEEL_SPAN - 1;
+
+    uint level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 &&
+            (when - ts->now) >= (1U << (TIMER_WHEEL_BITS * (level + 1))))
+        level++;
+
+    uint idx = wheel_slot_index(when, level);
+    struct timer_wheel_level *l = &ts->level[level];
+
+    list_add_tail(&l->slot[idx], &timer->node);
+    l->bitmap[idx / 32] |= 1U << (idx % 32);
+
+    if (++timer_stats.queued > timer_stats.max_queued)
+        timer_stats.max_queued = timer_stats.queued;
+}
+
+/* time until the wheel next has work to do, either a level 0 slot to fire or an
+ * upper level slot to cascade. returns false if the wheel is empty. */
+static bool wheel_next_event(struct timer_state *ts, lk_time_t *delta)
+{
+    bool found = false;
+    lk_time_t best = 0;
+
+    for (uint level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        uint shift = TIMER_WHEEL_BITS * level;
+        lk_time_t base = ts->now >> shift;
+        int off = wheel_level_next_slot(&ts->level[level], (base + 1) & TIMER_WHEEL_MASK);
+        if (off < 0)
+            continue;
+
+        /* the first time the wheel crosses into that slot */
+        lk_time_t d = ((base + 1 + off) << shift) - ts->now;
+        if (!found || d < best) {
+            best = d;
+            found = true;
+        }
+    }
+
+    *delta = best;
+    return found;
+}
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+/* the earliest deadline of any pending timer. cascades don't need a wakeup of their
+ * own, whatever wakes the wheel up later will run them on the way. */
+static bool wheel_next_deadline(struct timer_state *ts, lk_time_t *deadline)
+{
+    bool found = false;
+
+    /* slots within a level are in time order, so only the first occupied one of
+     * each level matters. the levels overlap once the wheel has moved on from
+     * where a timer was queued, a level 1 timer can be due before the next level
+     * 0 slot, so take the earliest across all of them. */
+    for (uint level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        uint shift = TIMER_WHEEL_BITS * level;
+        lk_time_t base = ts->now >> shift;
+        int off = wheel_level_next_slot(&ts->level[level], (base + 1) & TIMER_WHEEL_MASK);
+        if (off < 0)
+            continue;
+
+        if (level == 0) {
+            *deadline = ts->now + 1 + off;
+            found = true;
+            continue;
+        }
+
+        uint idx = (base + 1 + off) & TIMER_WHEEL_MASK;
+        timer_t *timer;
+        list_for_every_entry(&ts->level[level].slot[idx], timer, timer_t, node) {
+            if (!found || TIME_LT(timer->scheduled_time, *deadline)) {
+                *deadline = timer->scheduled_time;
+                found = true;
+            }
+        }
+    }
+
+    return found;
+}
+
+/* a wheel deadline on the ns clock. both clocks count from the same source,
+ * so this comes out the same however far apart the calls are */
+static lk_time_ns_t wheel_deadline_ns(lk_time_t deadline, lk_time_ns_t now_ns)
+{
+    lk_time_t now_ms = now_ns / 1000000;
+
+    return now_ns - now_ns % 1000000 + (int64_t)(int32_t)(deadline - now_ms) * 1000000;
+}
+
+static void timer_hw_set(struct timer_state *ts, lk_time_ns_t deadline_ns, lk_time_ns_t now_ns)
+{
+    lk_time_ns_t delay = deadline_ns > now_ns ? deadline_ns - now_ns : 0;
+
+    LTRACEF("setting new timer for %llu nsecs\n", delay);
+    ts->armed = true;
+    ts->deadline_ns = deadline_ns;
+    platform_set_oneshot_timer_ns(timer_tick, NULL, delay);
+}
+
+/* program the hardware for this cpu's earliest deadline, or shut it off if idle */
+static void timer_program(struct timer_state *ts)
+{
+    lk_time_ns_t now_ns = current_time_ns();
+    lk_time_ns_t deadline_ns = 0;
+    bool pending = false;
+    lk_time_t deadline;
+
+    if (wheel_next_deadline(ts, &deadline)) {
+        deadline_ns = wheel_deadline_ns(deadline, now_ns);
+        pending = true;
+    }
+
+    timer_t *hires = list_peek_head_type(&ts->hires, timer_t, node);
+    if (hires && (!pending || hires->scheduled_time_ns < deadline_ns)) {
+        deadline_ns = hires->scheduled_time_ns;
+        pending = true;
+    }
+
+    if (!pending) {
+        if (ts->armed) {
+            LTRACEF("clearing old hw timer, nothing in the queue\n");
+            platform_stop_timer();
+            ts->armed = false;
+        }
+        return;
+    }
+
+    if (ts->armed && ts->deadline_ns == deadline_ns)
+        return;
+
+    timer_hw_set(ts, deadline_ns, now_ns);
+}
+
+/* sorted insert into this cpu's nanosecond list */
+static void insert_hires_timer(struct timer_state *ts, timer_t *timer)
+{
+    timer_t *entry;
+
+    list_for_every_entry(&ts->hires, entry, timer_t, node) {
+        if (timer->scheduled_time_ns < entry->scheduled_time_ns) {
             list_add_before(&entry->node, &timer->node);
-            return;
+            goto done;
+        }
+    }
+    list_add_tail(&ts->hires, &timer->node);
+
+done:
+    if (++timer_stats.queued > timer_stats.max_queued)
+        timer_stats.max_queued = timer_stats.queued;
+}
+#endif
+
+/* move every timer in the current slot of a level down towards level 0 */
+static void wheel_cascade(uint cpu, uint level)
+{
+    struct timer_state *ts = &timers[cpu];
+    struct timer_wheel_level *l = &ts->level[level];
+    uint idx = wheel_slot_index(ts->now, level);
+    timer_t *timer;
+
+    l->bitmap[idx / 32] &= ~(1U << (idx % 32));
+
+    struct list_node list = LIST_INITIAL_VALUE(list);
+    while ((timer = list_remove_head_type(&l->slot[idx], timer_t, node)))
+        list_add_tail(&list, &timer->node);
+
+    while ((timer = list_remove_head_type(&list, timer_t, node))) {
+        if (!TIME_GT(timer->scheduled_time, ts->now)) {
+            /* the level 0 slot for now is run right after the cascade, it can go there */
+            uint now_idx = wheel_slot_index(ts->now, 0);
+            list_add_tail(&ts->level[0].slot[now_idx], &timer->node);
+            ts->level[0].bitmap[now_idx / 32] |= 1U << (now_idx % 32);
+            continue;
         }
+
+        timer_stats.queued--;
+        insert_timer_in_queue(cpu, timer);
     }
 
-    /* walked off the end of the list */
-    list_add_tail(&timers[cpu].timer_queue, &timer->node);
+    timer_stats.cascades++;
 }
 
 static void timer_set(timer_t *timer, lk_time_t delay, lk_time_t period, timer_callback callback, void *arg)
@@ -97,7 +392,8 @@ static void timer_set(timer_t *timer, lk_time_t delay, lk_time_t period, timer_c
     }
 
     now = current_time();
-    timer->scheduled_time = now + delay;
+    timer->hires = false;
+    timer->scheduled_time = timer_apply_slack(now + delay, timer->slack);
     timer->periodic_time = period;
     timer->callback = callback;
     timer->arg = arg;
@@ -108,14 +404,25 @@ static void timer_set(timer_t *timer, lk_time_t delay, lk_time_t period, timer_c
     spin_lock_irqsave(&timer_lock, state);
 
     uint cpu = arch_curr_cpu_num();
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    struct timer_state *ts = &timers[cpu];
+
+    /* the wheel only moves when a timer interrupt comes in, so it may be lagging
+     * well behind. if nothing is due in between, catch it up first. */
+    lk_time_t next;
+    if (!wheel_next_event(ts, &next) || TIME_GT(ts->now + next, now))
+        ts->now = now;
+#endif
+
     insert_timer_in_queue(cpu, timer);
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
-    if (list_peek_head_type(&timers[cpu].timer_queue, timer_t, node) == timer) {
-        /* we just modified the head of the timer queue */
-        LTRACEF("setting new timer for %u msecs\n", delay);
-        platform_set_oneshot_timer(timer_tick, NULL, delay);
-    }
+    /* if we're due before whatever the hardware is waiting for, reprogram it */
+    lk_time_ns_t now_ns = current_time_ns();
+    lk_time_ns_t deadline_ns = wheel_deadline_ns(timer->scheduled_time, now_ns);
+    if (!ts->armed || deadline_ns < ts->deadline_ns)
+        timer_hw_set(ts, deadline_ns, now_ns);
 #endif
 
     spin_unlock_irqrestore(&timer_lock, state);
@@ -163,6 +470,75 @@ void timer_set_periodic(timer_t *timer, lk_time_t period, timer_callback callbac
     timer_set(timer, period, period, callback, arg);
 }
 
+static void timer_set_ns(timer_t *timer, lk_time_ns_t delay, lk_time_ns_t period, timer_callback callback, void *arg)
+{
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    LTRACEF("timer %p, delay %llu, period %llu, callback %p, arg %p\n", timer, delay, period, callback, arg);
+
+    DEBUG_ASSERT(timer->magic == TIMER_MAGIC);
+
+    if (list_in_list(&timer->node)) {
+        panic("timer %p already in list\n", timer);
+    }
+
+    lk_time_ns_t now_ns = current_time_ns();
+    timer->hires = true;
+    timer->scheduled_time_ns = now_ns + delay;
+    timer->periodic_time_ns = period;
+    timer->periodic_time = 0;
+    timer->callback = callback;
+    timer->arg = arg;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&timer_lock, state);
+
+    struct timer_state *ts = &timers[arch_curr_cpu_num()];
+    insert_hires_timer(ts, timer);
+
+    if (!ts->armed || timer->scheduled_time_ns < ts->deadline_ns)
+        timer_hw_set(ts, timer->scheduled_time_ns, now_ns);
+
+    spin_unlock_irqrestore(&timer_lock, state);
+#else
+    /* the wheel is all there is, round up to whole ms */
+    timer_set(timer, (delay + 999999) / 1000000, (period + 999999) / 1000000, callback, arg);
+#endif
+}
+
+/**
+ * @brief  Set up a timer that executes once, with nanosecond resolution
+ *
+ * @param  timer The timer to use
+ * @param  delay The delay, in ns, before the timer is executed
+ * @param  callback  The function to call when the timer expires
+ * @param  arg  The argument to pass to the callback
+ */
+void timer_set_oneshot_ns(timer_t *timer, lk_time_ns_t delay, timer_callback callback, void *arg)
+{
+    if (delay == 0)
+        delay = 1;
+    timer_set_ns(timer, delay, 0, callback, arg);
+}
+
+/**
+ * @brief  Set up a timer that executes repeatedly, with nanosecond resolution
+ *
+ * Each deadline is one period after the previous one rather than after the
+ * callback ran, so the timer doesn't drift. If it falls more than a period
+ * behind it skips ahead instead of firing back to back.
+ *
+ * @param  timer The timer to use
+ * @param  period The delay, in ns, between timer executions
+ * @param  callback  The function to call when the timer expires
+ * @param  arg  The argument to pass to the callback
+ */
+void timer_set_periodic_ns(timer_t *timer, lk_time_ns_t period, timer_callback callback, void *arg)
+{
+    if (period == 0)
+        period = 1;
+    timer_set_ns(timer, period, period, callback, arg);
+}
+
 /**
  * @brief  Cancel a pending timer
  */
@@ -173,43 +549,61 @@ void timer_cancel(timer_t *timer)
     spin_lock_saved_state_t state;
     spin_lock_irqsave(&timer_lock, state);
 
-#if PLATFORM_HAS_DYNAMIC_TIMER
-    uint cpu = arch_curr_cpu_num();
+    if (list_in_list(&timer->node)) {
+        list_delete(&timer->node);
+        timer_stats.queued--;
 
-    timer_t *oldhead = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
+#if PLATFORM_HAS_DYNAMIC_TIMER
+        /* if the hardware was waiting on us, point it at the next deadline instead
+         * so we don't take a pointless interrupt (or stop it entirely if idle) */
+        struct timer_state *ts = &timers[arch_curr_cpu_num()];
+        if (ts->armed) {
+            lk_time_ns_t deadline_ns = timer->hires ? timer->scheduled_time_ns :
+                                       wheel_deadline_ns(timer->scheduled_time, current_time_ns());
+            if (ts->deadline_ns == deadline_ns)
+                timer_program(ts);
+        }
 #endif
-
-    if (list_in_list(&timer->node))
-        list_delete(&timer->node);
+    }
 
     /* to keep it from being reinserted into the queue if called from
      * periodic timer callback.
      */
     timer->periodic_time = 0;
+    timer->periodic_time_ns = 0;
     timer->callback = NULL;
     timer->arg = NULL;
 
+    spin_unlock_irqrestore(&timer_lock, state);
+}
+
+/**
+ * @brief  When the current cpu will next take a timer interrupt
+ *
+ * For the idle loop, to judge how long the cpu is going to sleep.
+ *
+ * @return The deadline in ns on the current_time_ns() clock, UINT64_MAX if none
+ */
+lk_time_ns_t timer_next_deadline_ns(void)
+{
+    lk_time_ns_t deadline;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&timer_lock, state);
+
+    struct timer_state *ts = &timers[arch_curr_cpu_num()];
 #if PLATFORM_HAS_DYNAMIC_TIMER
-    /* see if we've just modified the head of the timer queue */
-    timer_t *newhead = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
-    if (newhead == NULL) {
-        LTRACEF("clearing old hw timer, nothing in the queue\n");
-        platform_stop_timer();
-    } else if (newhead != oldhead) {
-        lk_time_t delay;
-        lk_time_t now = current_time();
-
-        if (TIME_LT(newhead->scheduled_time, now))
-            delay = 0;
-        else
-            delay = newhead->scheduled_time - now;
-
-        LTRACEF("setting new timer to %u\n", (uint) delay);
-        platform_set_oneshot_timer(timer_tick, NULL, delay);
-    }
+    deadline = ts->armed ? ts->deadline_ns : UINT64_MAX;
+#else
+    /* the wheel is brought up to date on every tick, the next one follows the last */
+    lk_time_ns_t now_ns = current_time_ns();
+    int32_t left = (int32_t)(ts->now + TIMER_TICK_MSECS - current_time());
+    deadline = now_ns + (left > 0 ? (lk_time_ns_t)left * 1000000 : 0);
 #endif
 
     spin_unlock_irqrestore(&timer_lock, state);
+
+    return deadline;
 }
 
 /* called at interrupt time to process any pending timers */
@@ -224,64 +618,99 @@ static enum handler_return timer_tick(void *arg, lk_time_t now)
 //  KEVLOG_TIMER_TICK(); // enable only if necessary
 
     uint cpu = arch_curr_cpu_num();
+    struct timer_state *ts = &timers[cpu];
 
     LTRACEF("cpu %u now %u, sp %p\n", cpu, now, __GET_FRAME());
 
     spin_lock(&timer_lock);
 
     for (;;) {
-        /* see if there's an event to process */
-        timer = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
-        if (likely(timer == 0))
-            break;
-        LTRACEF("next item on timer queue %p at %u now %u (%p, arg %p)\n", timer, timer->scheduled_time, now, timer->callback, timer->arg);
-        if (likely(TIME_LT(now, timer->scheduled_time)))
+        /* find the next point the wheel has something to do */
+        lk_time_t delta;
+        if (!wheel_next_event(ts, &delta) || TIME_GT(ts->now + delta, now)) {
+            /* nothing else is due, jump the wheel forward */
+            if (TIME_GT(now, ts->now))
+                ts->now = now;
             break;
+        }
+
+        ts->now += delta;
+
+        /* cascade from the top down, a higher level may refill the slot below it */
+        for (int level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+            if ((ts->now & ((1U << (TIMER_WHEEL_BITS * level)) - 1)) == 0)
+                wheel_cascade(cpu, level);
+        }
+
+        /* everything left in the current level 0 slot is due */
+        struct timer_wheel_level *l = &ts->level[0];
+        uint idx = wheel_slot_index(ts->now, 0);
+
+        while ((timer = list_remove_head_type(&l->slot[idx], timer_t, node))) {
+            DEBUG_ASSERT(timer->magic == TIMER_MAGIC);
+            timer_stats.queued--;
 
-        /* process it */
-        LTRACEF("timer %p\n", timer);
-        DEBUG_ASSERT(timer && timer->magic == TIMER_MAGIC);
+            /* we pulled it off the list, release the list lock to handle it */
+            spin_unlock(&timer_lock);
+
+            LTRACEF("dequeued timer %p, scheduled %u periodic %u\n", timer, timer->scheduled_time, timer->periodic_time);
+
+            THREAD_STATS_INC(timers);
+
+            bool periodic = timer->periodic_time > 0;
+
+            LTRACEF("timer %p firing callback %p, arg %p\n", timer, timer->callback, timer->arg);
+            KEVLOG_TIMER_CALL(timer->callback, timer->arg);
+            if (timer->callback(timer, now, timer->arg) == INT_RESCHEDULE)
+                ret = INT_RESCHEDULE;
+
+            /* it may have been requeued or periodic, grab the lock so we can safely inspect it */
+            spin_lock(&timer_lock);
+
+            /* if it was a periodic timer and it hasn't been requeued
+             * by the callback put it back in the list
+             */
+            if (periodic && !list_in_list(&timer->node) && timer->periodic_time > 0) {
+                LTRACEF("periodic timer, period %u\n", timer->periodic_time);
+                timer->scheduled_time = timer_apply_slack(now + timer->periodic_time, timer->slack);
+                insert_timer_in_queue(cpu, timer);
+            }
+        }
+        l->bitmap[idx / 32] &= ~(1U << (idx % 32));
+    }
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    lk_time_ns_t now_ns = current_time_ns();
+    while ((timer = list_peek_head_type(&ts->hires, timer_t, node)) &&
+            timer->scheduled_time_ns <= now_ns) {
         list_delete(&timer->node);
+        timer_stats.queued--;
 
-        /* we pulled it off the list, release the list lock to handle it */
         spin_unlock(&timer_lock);
 
-        LTRACEF("dequeued timer %p, scheduled %u periodic %u\n", timer, timer->scheduled_time, timer->periodic_time);
-
         THREAD_STATS_INC(timers);
 
-        bool periodic = timer->periodic_time > 0;
+        bool periodic = timer->periodic_time_ns > 0;
 
-        LTRACEF("timer %p firing callback %p, arg %p\n", timer, timer->callback, timer->arg);
+        LTRACEF("hires timer %p firing callback %p, arg %p\n", timer, timer->callback, timer->arg);
         KEVLOG_TIMER_CALL(timer->callback, timer->arg);
         if (timer->callback(timer, now, timer->arg) == INT_RESCHEDULE)
             ret = INT_RESCHEDULE;
 
-        /* it may have been requeued or periodic, grab the lock so we can safely inspect it */
         spin_lock(&timer_lock);
 
-        /* if it was a periodic timer and it hasn't been requeued
-         * by the callback put it back in the list
-         */
-        if (periodic && !list_in_list(&timer->node) && timer->periodic_time > 0) {
-            LTRACEF("periodic timer, period %u\n", timer->periodic_time);
-            timer->scheduled_time = now + timer->periodic_time;
-            insert_timer_in_queue(cpu, timer);
+        if (periodic && !list_in_list(&timer->node) && timer->periodic_time_ns > 0) {
+            timer->scheduled_time_ns += timer->periodic_time_ns;
+            if (timer->scheduled_time_ns <= now_ns)
+                timer->scheduled_time_ns = now_ns + timer->periodic_time_ns;
+            insert_hires_timer(ts, timer);
         }
     }
 
-#if PLATFORM_HAS_DYNAMIC_TIMER
-    /* reset the timer to the next event */
-    timer = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
-    if (timer) {
-        /* has to be the case or it would have fired already */
-        DEBUG_ASSERT(TIME_GT(timer->scheduled_time, now));
-
-        lk_time_t delay = timer->scheduled_time - now;
-
-        LTRACEF("setting new timer for %u msecs for event %p\n", (uint)delay, timer);
-        platform_set_oneshot_timer(timer_tick, NULL, delay);
-    }
+    /* the oneshot that got us here is spent, set up the next real deadline.
+     * with nothing pending the cpu is left with no timer interrupts at all. */
+    ts->armed = false;
+    timer_program(ts);
 
     /* we're done manipulating the timer queue */
     spin_unlock(&timer_lock);
@@ -302,10 +731,66 @@ void timer_init(void)
 {
     timer_lock = SPIN_LOCK_INITIAL_VALUE;
     for (uint i = 0; i < SMP_MAX_CPUS; i++) {
-        list_initialize(&timers[i].timer_queue);
+        timers[i].now = current_time();
+#if PLATFORM_HAS_DYNAMIC_TIMER
+        list_initialize(&timers[i].hires);
+#endif
+        for (uint level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+            for (uint slot = 0; slot < TIMER_WHEEL_SLOTS; slot++)
+                list_initialize(&timers[i].level[level].slot[slot]);
+        }
     }
 #if !PLATFORM_HAS_DYNAMIC_TIMER
     /* register for a periodic timer tick */
-    platform_set_periodic_timer(timer_tick, NULL, 10); /* 10ms */
+    platform_set_periodic_timer(timer_tick, NULL, TIMER_TICK_MSECS);
 #endif
 }
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+
+static int cmd_timers(int argc, const cmd_args *argv)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&timer_lock, state);
+
+    struct timer_stats stats = timer_stats;
+    uint occupied[SMP_MAX_CPUS][TIMER_WHEEL_LEVELS];
+    lk_time_t wheel_now[SMP_MAX_CPUS];
+    uint hires[SMP_MAX_CPUS];
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        wheel_now[i] = timers[i].now;
+#if PLATFORM_HAS_DYNAMIC_TIMER
+        hires[i] = list_length(&timers[i].hires);
+#else
+        hires[i] = 0;
+#endif
+        for (uint level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+            occupied[i][level] = 0;
+            for (uint slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+                if (!list_is_empty(&timers[i].level[level].slot[slot]))
+                    occupied[i][level]++;
+            }
+        }
+    }
+
+    spin_unlock_irqrestore(&timer_lock, state);
+
+    printf("timers queued %u (max %u), cascades %lu\n", stats.queued, stats.max_queued, stats.cascades);
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        printf("\tcpu %u: wheel time %u, occupied slots", i, wheel_now[i]);
+        for (uint level = 0; level < TIMER_WHEEL_LEVELS; level++)
+            printf(" %u", occupied[i][level]);
+        printf(", ns timers %u\n", hires[i]);
+    }
+
+    return 0;
+}
+
+STATIC_COMMAND_START
+#if LK_DEBUGLEVEL > 1
+STATIC_COMMAND("timers", "timer wheel statistics", &cmd_timers)
+#endif
+STATIC_COMMAND_END(timers);
+#endif
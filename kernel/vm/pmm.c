@@ -31,12 +31,60 @@
 #include <string.h>
 #include <pow2.h>
 #include <lib/console.h>
+#include <arch/ops.h>
+#include <kernel/event.h>
 #include <kernel/mutex.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <lk/init.h>
 
 #define LOCAL_TRACE 0
 
+/* pages moved between a cpu's page cache and the arenas at a time */
+#ifndef PMM_PCPU_BATCH
+#define PMM_PCPU_BATCH 16
+#endif
+
+/* a cpu's page cache gives back a batch once it holds more than this */
+#ifndef PMM_PCPU_HIGH
+#define PMM_PCPU_HIGH (PMM_PCPU_BATCH * 2)
+#endif
+
+/* colors are picked out of a 32 bit mask */
+STATIC_ASSERT(PMM_NUM_COLORS <= 32 && (PMM_NUM_COLORS & (PMM_NUM_COLORS - 1)) == 0);
+#define PMM_ALL_COLORS ((uint32_t)((1ULL << PMM_NUM_COLORS) - 1))
+
 static struct list_node arena_list = LIST_INITIAL_VALUE(arena_list);
-static mutex_t lock = MUTEX_INITIAL_VALUE(lock);
+static mutex_t lock = MUTEX_INITIAL_VALUE_FLAGS(lock, MUTEX_FLAG_PRIORITY_INHERIT);
+
+/*
+ * Each cpu keeps a small cache of free kmap pages so single page allocations
+ * and frees usually don't touch the pmm lock. A cache is only touched by its
+ * own cpu with interrupts disabled. Cached pages still count as allocated
+ * as far as the arenas are concerned.
+ */
+struct pmm_pcpu_cache {
+    struct list_node pages;
+    uint count;
+} __CPU_ALIGN;
+
+static struct pmm_pcpu_cache pcpu_cache[SMP_MAX_CPUS];
+static bool pcpu_cache_initialized;
+
+/* size of the pool of pre-zeroed kmap pages a low priority thread keeps
+ * topped up for PMM_ALLOC_FLAG_ZEROED allocations, 0 disables it */
+#ifndef PMM_ZERO_POOL_PAGES
+#define PMM_ZERO_POOL_PAGES 64
+#endif
+
+#if PMM_ZERO_POOL_PAGES > 0
+/* protected by the pmm lock */
+static struct list_node zero_pool = LIST_INITIAL_VALUE(zero_pool);
+static size_t zero_pool_count;
+
+/* wakes the zeroing thread once the pool runs low */
+static event_t zero_pool_event = EVENT_INITIAL_VALUE(zero_pool_event, true, EVENT_FLAG_AUTOUNSIGNAL);
+#endif
 
 #define PAGE_BELONGS_TO_ARENA(page, arena) \
     (((uintptr_t)(page) >= (uintptr_t)(arena)->page_array) && \
@@ -53,6 +101,161 @@ static inline bool page_is_free(const vm_page_t *page)
     return !(page->flags & VM_PAGE_FLAG_NONFREE);
 }
 
+static pmm_arena_t *page_to_arena(const vm_page_t *page)
+{
+    pmm_arena_t *a;
+    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+        if (PAGE_BELONGS_TO_ARENA(page, a))
+            return a;
+    }
+    return NULL;
+}
+
+/*
+ * Each arena keeps its free pages in a binary buddy system: blocks of 2^order
+ * pages that are naturally aligned in physical address space, one free list
+ * per order. Only the first page of a free block is on a free list, with its
+ * order recorded in the page. A block being freed merges with its buddy (the
+ * other half of the block one order up) whenever that is free and whole, so
+ * free memory coalesces as it is returned and an aligned run of any size up
+ * to 2^PMM_MAX_ORDER pages is a free list pop plus at most PMM_MAX_ORDER
+ * splits away.
+ */
+static inline size_t arena_page_count(const pmm_arena_t *a)
+{
+    return a->size / PAGE_SIZE;
+}
+
+static inline size_t arena_pfn(const pmm_arena_t *a, size_t index)
+{
+    return (a->base / PAGE_SIZE) + index;
+}
+
+/* is the page at |index| the head of a free block of |order| */
+static inline bool buddy_is_free_block(pmm_arena_t *a, size_t index, uint order)
+{
+    vm_page_t *p = &a->page_array[index];
+
+    return page_is_free(p) && list_in_list(&p->node) && p->order == order;
+}
+
+static inline void buddy_add_block(pmm_arena_t *a, size_t index, uint order)
+{
+    vm_page_t *p = &a->page_array[index];
+
+    p->order = order;
+    list_add_head(&a->free_list[order], &p->node);
+}
+
+/* put a block of free pages on the free lists, coalescing it with its buddies */
+static void buddy_free_block(pmm_arena_t *a, size_t index, uint order)
+{
+    size_t count = arena_page_count(a);
+
+    while (order < PMM_MAX_ORDER) {
+        /* buddies pair up by physical address, not by index in the arena,
+         * which need not start on a block boundary */
+        size_t buddy = (arena_pfn(a, index) ^ (1UL << order)) - arena_pfn(a, 0);
+        if (buddy >= count || buddy + (1UL << order) > count)
+            break;
+        if (!buddy_is_free_block(a, buddy, order))
+            break;
+
+        list_delete(&a->page_array[buddy].node);
+        index = MIN(index, buddy);
+        order++;
+    }
+
+    buddy_add_block(a, index, order);
+}
+
+/* take a free block of |order| off the free lists, splitting a larger one if
+ * needed. returns the index of the first page or -1 */
+static ssize_t buddy_alloc_block(pmm_arena_t *a, uint order)
+{
+    uint o;
+    for (o = order; o <= PMM_MAX_ORDER; o++) {
+        if (!list_is_empty(&a->free_list[o]))
+            break;
+    }
+    if (o > PMM_MAX_ORDER)
+        return -1;
+
+    vm_page_t *p = list_remove_head_type(&a->free_list[o], vm_page_t, node);
+    size_t index = p - a->page_array;
+
+    /* give back the top halves until we're down to the right size */
+    while (o > order) {
+        o--;
+        buddy_add_block(a, index + (1UL << o), o);
+    }
+
+    return index;
+}
+
+/* carve the single free page at |index| out of whatever free block holds it */
+static void buddy_take_page(pmm_arena_t *a, size_t index)
+{
+    size_t pfn = arena_pfn(a, index);
+    size_t head = index;
+    uint o;
+
+    /* find the head of the free block containing the page */
+    for (o = 0; o <= PMM_MAX_ORDER; o++) {
+        size_t h = ROUNDDOWN(pfn, 1UL << o) - arena_pfn(a, 0);
+        if (h <= index && buddy_is_free_block(a, h, o)) {
+            head = h;
+            break;
+        }
+    }
+    DEBUG_ASSERT(o <= PMM_MAX_ORDER);
+
+    list_delete(&a->page_array[head].node);
+
+    /* split it, giving back the halves the page isn't in */
+    while (o > 0) {
+        o--;
+        size_t upper = head + (1UL << o);
+        if (index >= upper) {
+            buddy_add_block(a, head, o);
+            head = upper;
+        } else {
+            buddy_add_block(a, upper, o);
+        }
+    }
+    DEBUG_ASSERT(head == index);
+}
+
+/* free the run of pages [start, end) as the largest aligned blocks that fit */
+static void buddy_free_run(pmm_arena_t *a, size_t start, size_t end)
+{
+    while (start < end) {
+        uint order = 0;
+        while (order < PMM_MAX_ORDER &&
+                IS_ALIGNED(arena_pfn(a, start), 1UL << (order + 1)) &&
+                start + (1UL << (order + 1)) <= end) {
+            order++;
+        }
+
+        buddy_free_block(a, start, order);
+        start += 1UL << order;
+    }
+}
+
+static void arena_mark_allocated(pmm_arena_t *a, size_t index, size_t count, struct list_node *list)
+{
+    for (size_t i = index; i < index + count; i++) {
+        vm_page_t *p = &a->page_array[i];
+        DEBUG_ASSERT(page_is_free(p));
+        DEBUG_ASSERT(!list_in_list(&p->node));
+
+        p->flags |= VM_PAGE_FLAG_NONFREE;
+        if (list)
+            list_add_tail(list, &p->node);
+    }
+    a->free_count -= count;
+}
+
 paddr_t vm_page_to_paddr(const vm_page_t *page)
 {
     pmm_arena_t *a;
@@ -98,9 +301,16 @@ status_t pmm_add_arena(pmm_arena_t *arena)
 
 done_add:
 
+    if (!pcpu_cache_initialized) {
+        for (uint i = 0; i < SMP_MAX_CPUS; i++)
+            list_initialize(&pcpu_cache[i].pages);
+        pcpu_cache_initialized = true;
+    }
+
     /* zero out some of the structure */
     arena->free_count = 0;
-    list_initialize(&arena->free_list);
+    for (uint i = 0; i <= PMM_MAX_ORDER; i++)
+        list_initialize(&arena->free_list[i]);
 
     /* allocate an array of pages to back this one */
     size_t page_count = arena->size / PAGE_SIZE;
@@ -109,22 +319,211 @@ done_add:
     /* initialize all of the pages */
     memset(arena->page_array, 0, page_count * sizeof(vm_page_t));
 
-    /* add them to the free list */
-    for (size_t i = 0; i < page_count; i++) {
-        vm_page_t *p = &arena->page_array[i];
+    /* hand them all to the buddy allocator */
+    buddy_free_run(arena, 0, page_count);
+    arena->free_count = page_count;
 
-        list_add_tail(&arena->free_list, &p->node);
+    return NO_ERROR;
+}
 
-        arena->free_count++;
+#define PMM_ALLOC_FLAG_PLACEMENT (PMM_ALLOC_FLAG_FAST | PMM_ALLOC_FLAG_BULK)
+
+/* arenas are visited in two passes, the ones the placement flags prefer and
+ * then, unless the allocation is strict, the rest */
+static bool arena_in_pass(const pmm_arena_t *a, uint flags, uint pass)
+{
+    if (!(flags & PMM_ALLOC_FLAG_PLACEMENT))
+        return pass == 0;
+
+    bool fast = a->flags & PMM_ARENA_FLAG_FAST;
+    bool preferred = (flags & PMM_ALLOC_FLAG_FAST) ? fast : !fast;
+
+    if (pass == 0)
+        return preferred;
+    return !preferred && !(flags & PMM_ALLOC_FLAG_STRICT);
+}
+
+/* the next arena to try for an allocation with these flags, start with
+ * a == NULL and pass == 0. must hold the lock */
+static pmm_arena_t *arena_next(pmm_arena_t *a, uint flags, uint *pass)
+{
+    for (;;) {
+        a = a ? list_next_type(&arena_list, &a->node, pmm_arena_t, node)
+            : list_peek_head_type(&arena_list, pmm_arena_t, node);
+        if (!a) {
+            if (*pass > 0 || !(flags & PMM_ALLOC_FLAG_PLACEMENT))
+                return NULL;
+            (*pass)++;
+            continue;
+        }
+        if (arena_in_pass(a, flags, *pass))
+            return a;
     }
+}
 
-    return NO_ERROR;
+#define for_every_arena(a, flags, pass) \
+    for (a = arena_next(NULL, flags, &(pass)); a; a = arena_next(a, flags, &(pass)))
+
+/* take up to |count| pages from the arena, must hold the lock */
+static size_t arena_alloc_pages(pmm_arena_t *a, uint count, struct list_node *list)
+{
+    uint allocated = 0;
+
+    while (allocated < count && a->free_count > 0) {
+        /* take the largest block that doesn't overshoot, preferring blocks
+         * already that size or smaller over splitting a bigger one */
+        uint want = MIN(log2_uint(count - allocated), (uint)PMM_MAX_ORDER);
+        ssize_t index = -1;
+        uint order;
+        for (order = want + 1; order-- > 0; ) {
+            if (!list_is_empty(&a->free_list[order])) {
+                index = buddy_alloc_block(a, order);
+                break;
+            }
+        }
+        if (index < 0) {
+            order = want;
+            index = buddy_alloc_block(a, order);
+        }
+        if (index < 0)
+            break;
+
+        arena_mark_allocated(a, index, 1UL << order, list);
+        allocated += 1U << order;
+    }
+
+    return allocated;
 }
 
-size_t pmm_alloc_pages(uint count, struct list_node *list)
+static inline bool page_color_in(pmm_arena_t *a, size_t index, uint32_t colors)
 {
-    LTRACEF("count %u\n", count);
+    return colors & (1U << (arena_pfn(a, index) % PMM_NUM_COLORS));
+}
+
+/* does the free block of |order| at |index| hold a page of one of |colors|.
+ * blocks are aligned, so a small one covers a run of colors that doesn't wrap */
+static bool buddy_block_has_color(pmm_arena_t *a, size_t index, uint order, uint32_t colors)
+{
+    if ((1UL << order) >= PMM_NUM_COLORS)
+        return true;
 
+    uint first = arena_pfn(a, index) % PMM_NUM_COLORS;
+    uint32_t span = ((1U << (1U << order)) - 1) << first;
+
+    return colors & span;
+}
+
+/* take up to |count| pages of |colors| from the arena, must hold the lock */
+static size_t arena_alloc_colored(pmm_arena_t *a, uint count, uint32_t colors, struct list_node *list)
+{
+    uint allocated = 0;
+
+    while (allocated < count && a->free_count > 0) {
+        /* the smallest free block with a usable page in it, so big blocks stay whole */
+        ssize_t head = -1;
+        uint order;
+        for (order = 0; order <= PMM_MAX_ORDER; order++) {
+            vm_page_t *p;
+            list_for_every_entry(&a->free_list[order], p, vm_page_t, node) {
+                if (buddy_block_has_color(a, p - a->page_array, order, colors)) {
+                    head = p - a->page_array;
+                    break;
+                }
+            }
+            if (head >= 0)
+                break;
+        }
+        if (head < 0)
+            break;
+
+        /* take every usable page in it, the rest goes back on the free lists */
+        for (size_t i = head; i < head + (1UL << order) && allocated < count; i++) {
+            if (page_color_in(a, i, colors)) {
+                buddy_take_page(a, i);
+                arena_mark_allocated(a, i, 1, list);
+                allocated++;
+            }
+        }
+    }
+
+    return allocated;
+}
+
+static vm_page_t *pcpu_cache_get(void)
+{
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct pmm_pcpu_cache *c = &pcpu_cache[arch_curr_cpu_num()];
+    vm_page_t *page = list_remove_head_type(&c->pages, vm_page_t, node);
+    if (page)
+        c->count--;
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+    return page;
+}
+
+/* add a page to this cpu's cache. if that overflows it, |drain| is handed the
+ * coldest pages, which the caller needs to free */
+static void pcpu_cache_put(vm_page_t *page, struct list_node *drain)
+{
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct pmm_pcpu_cache *c = &pcpu_cache[arch_curr_cpu_num()];
+    list_add_head(&c->pages, &page->node);
+    if (++c->count > PMM_PCPU_HIGH) {
+        for (uint i = 0; i < PMM_PCPU_BATCH; i++) {
+            vm_page_t *p = list_remove_tail_type(&c->pages, vm_page_t, node);
+            list_add_tail(drain, &p->node);
+        }
+        c->count -= PMM_PCPU_BATCH;
+    }
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+/* a single kmap page, from this cpu's cache if it can */
+static vm_page_t *pmm_alloc_cached_page(void)
+{
+    /* no arenas yet */
+    if (unlikely(!pcpu_cache_initialized))
+        return NULL;
+
+    vm_page_t *page = pcpu_cache_get();
+    if (likely(page))
+        return page;
+
+    /* refill with a batch from the kmap arenas */
+    struct list_node list = LIST_INITIAL_VALUE(list);
+    size_t count = 0;
+
+    mutex_acquire(&lock);
+    pmm_arena_t *a;
+    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+        if (a->flags & PMM_ARENA_FLAG_KMAP) {
+            count += arena_alloc_pages(a, PMM_PCPU_BATCH - count, &list);
+            if (count == PMM_PCPU_BATCH)
+                break;
+        }
+    }
+    mutex_release(&lock);
+
+    page = list_remove_head_type(&list, vm_page_t, node);
+
+    /* we may be on another cpu by now, which is fine */
+    struct list_node drain = LIST_INITIAL_VALUE(drain);
+    vm_page_t *p;
+    while ((p = list_remove_head_type(&list, vm_page_t, node)))
+        pcpu_cache_put(p, &drain);
+    if (!list_is_empty(&drain))
+        pmm_free(&drain);
+
+    return page;
+}
+
+static size_t alloc_pages(uint count, uint flags, struct list_node *list)
+{
     /* list must be initialized prior to calling this */
     DEBUG_ASSERT(list);
 
@@ -132,30 +531,204 @@ size_t pmm_alloc_pages(uint count, struct list_node *list)
     if (count == 0)
         return 0;
 
+    /* the per cpu cache doesn't care where its pages came from */
+    if (count == 1 && !(flags & PMM_ALLOC_FLAG_PLACEMENT)) {
+        vm_page_t *page = pmm_alloc_cached_page();
+        if (page) {
+            list_add_tail(list, &page->node);
+            return 1;
+        }
+    }
+
     mutex_acquire(&lock);
 
     /* walk the arenas in order, allocating as many pages as we can from each */
     pmm_arena_t *a;
-    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
-        while (allocated < count) {
-            vm_page_t *page = list_remove_head_type(&a->free_list, vm_page_t, node);
-            if (!page)
-                goto done;
+    uint pass = 0;
+    for_every_arena(a, flags, pass) {
+        allocated += arena_alloc_pages(a, count - allocated, list);
+        if (allocated == count)
+            break;
+    }
+
+#if PMM_ZERO_POOL_PAGES > 0
+    /* rather than fail, dip into the zeroed pages, which could be from anywhere */
+    vm_page_t *p;
+    while (allocated < count && !(flags & PMM_ALLOC_FLAG_STRICT) &&
+            (p = list_remove_head_type(&zero_pool, vm_page_t, node))) {
+        zero_pool_count--;
+        list_add_tail(list, &p->node);
+        allocated++;
+    }
+#endif
 
-            a->free_count--;
+    mutex_release(&lock);
+    return allocated;
+}
 
-            page->flags |= VM_PAGE_FLAG_NONFREE;
-            list_add_tail(list, &page->node);
+size_t pmm_alloc_pages(uint count, struct list_node *list)
+{
+    LTRACEF("count %u\n", count);
 
-            allocated++;
-        }
+    return alloc_pages(count, 0, list);
+}
+
+size_t pmm_alloc_pages_etc(uint count, uint flags, struct list_node *list)
+{
+    LTRACEF("count %u flags 0x%x\n", count, flags);
+
+    DEBUG_ASSERT(list);
+
+    if (!(flags & PMM_ALLOC_FLAG_ZEROED))
+        return alloc_pages(count, flags, list);
+
+    uint allocated = 0;
+    if (count == 0)
+        return 0;
+
+    struct list_node dirty = LIST_INITIAL_VALUE(dirty);
+    vm_page_t *p;
+
+    mutex_acquire(&lock);
+
+#if PMM_ZERO_POOL_PAGES > 0
+    /* the pool's pages come from any arena, so placed allocations zero their own */
+    while (allocated < count && !(flags & PMM_ALLOC_FLAG_PLACEMENT) &&
+            (p = list_remove_head_type(&zero_pool, vm_page_t, node))) {
+        zero_pool_count--;
+        list_add_tail(list, &p->node);
+        allocated++;
+    }
+    bool refill = zero_pool_count < PMM_ZERO_POOL_PAGES / 2;
+#endif
+
+    /* anything else has to come from the kmap arenas so we can zero it here */
+    uint needed = count - allocated;
+    pmm_arena_t *a;
+    uint pass = 0;
+    for_every_arena(a, flags, pass) {
+        if (needed == 0)
+            break;
+        if (a->flags & PMM_ARENA_FLAG_KMAP)
+            needed -= arena_alloc_pages(a, needed, &dirty);
     }
 
-done:
     mutex_release(&lock);
+
+#if PMM_ZERO_POOL_PAGES > 0
+    if (refill)
+        event_signal(&zero_pool_event, false);
+#endif
+
+    while ((p = list_remove_head_type(&dirty, vm_page_t, node))) {
+        memset(paddr_to_kvaddr(vm_page_to_paddr(p)), 0, PAGE_SIZE);
+        list_add_tail(list, &p->node);
+        allocated++;
+    }
+
     return allocated;
 }
 
+size_t pmm_alloc_pages_colored(uint count, uint flags, uint32_t colors, struct list_node *list)
+{
+    LTRACEF("count %u flags 0x%x colors 0x%x\n", count, flags, colors);
+
+    DEBUG_ASSERT(list);
+
+    colors &= PMM_ALL_COLORS;
+    if (colors == 0 || colors == PMM_ALL_COLORS)
+        return pmm_alloc_pages_etc(count, flags, list);
+
+    uint allocated = 0;
+    if (count == 0)
+        return 0;
+
+    struct list_node colored = LIST_INITIAL_VALUE(colored);
+
+    mutex_acquire(&lock);
+
+    pmm_arena_t *a;
+    uint pass = 0;
+    for_every_arena(a, flags, pass) {
+        /* zeroing needs the pages mapped */
+        if ((flags & PMM_ALLOC_FLAG_ZEROED) && !(a->flags & PMM_ARENA_FLAG_KMAP))
+            continue;
+
+        allocated += arena_alloc_colored(a, count - allocated, colors, &colored);
+        if (allocated == count)
+            break;
+    }
+
+    mutex_release(&lock);
+
+    vm_page_t *p;
+    while ((p = list_remove_head_type(&colored, vm_page_t, node))) {
+        if (flags & PMM_ALLOC_FLAG_ZEROED)
+            memset(paddr_to_kvaddr(vm_page_to_paddr(p)), 0, PAGE_SIZE);
+        list_add_tail(list, &p->node);
+    }
+
+    return allocated;
+}
+
+#if PMM_ZERO_POOL_PAGES > 0
+static int pmm_zero_thread(void *arg)
+{
+    for (;;) {
+        event_wait(&zero_pool_event);
+
+        /* one page at a time, so allocations never wait on us for long */
+        for (;;) {
+            struct list_node list = LIST_INITIAL_VALUE(list);
+
+            mutex_acquire(&lock);
+            if (zero_pool_count < PMM_ZERO_POOL_PAGES) {
+                pmm_arena_t *a;
+                list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+                    if ((a->flags & PMM_ARENA_FLAG_KMAP) && arena_alloc_pages(a, 1, &list))
+                        break;
+                }
+            }
+            mutex_release(&lock);
+
+            vm_page_t *p = list_remove_head_type(&list, vm_page_t, node);
+            if (!p)
+                break;
+
+            memset(paddr_to_kvaddr(vm_page_to_paddr(p)), 0, PAGE_SIZE);
+
+            mutex_acquire(&lock);
+            list_add_tail(&zero_pool, &p->node);
+            zero_pool_count++;
+            mutex_release(&lock);
+        }
+    }
+
+    return 0;
+}
+
+static void pmm_zero_pool_init(uint level)
+{
+    thread_t *t = thread_create("pmm zero", &pmm_zero_thread, NULL, LOWEST_PRIORITY, DEFAULT_STACK_SIZE);
+    if (t) {
+        thread_detach(t);
+        thread_resume(t);
+    }
+}
+
+LK_INIT_HOOK(pmm_zero_pool, &pmm_zero_pool_init, LK_INIT_LEVEL_THREADING);
+#endif
+
+vm_page_t *pmm_alloc_page(void)
+{
+    struct list_node list = LIST_INITIAL_VALUE(list);
+
+    if (pmm_alloc_pages(1, &list) == 0)
+        return NULL;
+
+    return list_remove_head_type(&list, vm_page_t, node);
+}
+
 size_t pmm_alloc_range(paddr_t address, uint count, struct list_node *list)
 {
     LTRACEF("address 0x%lx, count %u\n", address, count);
@@ -184,13 +757,9 @@ size_t pmm_alloc_range(paddr_t address, uint count, struct list_node *list)
                 break;
             }
 
-            DEBUG_ASSERT(list_in_list(&page->node));
-
-            list_delete(&page->node);
-            page->flags |= VM_PAGE_FLAG_NONFREE;
-            list_add_tail(list, &page->node);
+            buddy_take_page(a, index);
+            arena_mark_allocated(a, index, 1, list);
 
-            a->free_count--;
             allocated++;
             address += PAGE_SIZE;
         }
@@ -224,7 +793,7 @@ size_t pmm_free(struct list_node *list)
             if (PAGE_BELONGS_TO_ARENA(page, a)) {
                 page->flags &= ~VM_PAGE_FLAG_NONFREE;
 
-                list_add_head(&a->free_list, &page->node);
+                buddy_free_block(a, page - a->page_array, 0);
                 a->free_count++;
                 count++;
                 break;
@@ -241,6 +810,18 @@ size_t pmm_free_page(vm_page_t *page)
     struct list_node list;
     list_initialize(&list);
 
+    DEBUG_ASSERT(!list_in_list(&page->node));
+    DEBUG_ASSERT(page->flags & VM_PAGE_FLAG_NONFREE);
+
+    /* kmap pages go back through this cpu's cache */
+    pmm_arena_t *a = page_to_arena(page);
+    if (a && (a->flags & PMM_ARENA_FLAG_KMAP)) {
+        pcpu_cache_put(page, &list);
+        if (!list_is_empty(&list))
+            pmm_free(&list);
+        return 1;
+    }
+
     list_add_head(&list, &page->node);
 
     return pmm_free(&list);
@@ -251,8 +832,14 @@ void *pmm_alloc_kpages(uint count, struct list_node *list)
 {
     LTRACEF("count %u\n", count);
 
-    // XXX do fast path for single page
-
+    if (count == 1) {
+        vm_page_t *page = pmm_alloc_cached_page();
+        if (!page)
+            return NULL;
+        if (list)
+            list_add_tail(list, &page->node);
+        return paddr_to_kvaddr(vm_page_to_paddr(page));
+    }
 
     paddr_t pa;
     size_t alloc_count = pmm_alloc_contiguous(count, PAGE_SIZE_SHIFT, &pa, list);
@@ -268,6 +855,11 @@ size_t pmm_free_kpages(void *_ptr, uint count)
 
     uint8_t *ptr = (uint8_t *)_ptr;
 
+    if (count == 1) {
+        vm_page_t *p = paddr_to_vm_page(vaddr_to_paddr(ptr));
+        return p ? pmm_free_page(p) : 0;
+    }
+
     struct list_node list;
     list_initialize(&list);
 
@@ -284,76 +876,100 @@ size_t pmm_free_kpages(void *_ptr, uint count)
     return pmm_free(&list);
 }
 
+/* the slow way, for runs no free buddy block can hold: scan the page array
+ * for an aligned run of free pages and carve it out page by page */
+static ssize_t arena_find_run(pmm_arena_t *a, uint count, uint8_t alignment_log2)
+{
+    /* walk the list starting at alignment boundaries.
+     * calculate the starting offset into this arena, based on the
+     * base address of the arena to handle the case where the arena
+     * is not aligned on the same boundary requested.
+     */
+    paddr_t rounded_base = ROUNDUP(a->base, 1UL << alignment_log2);
+    if (rounded_base < a->base || rounded_base > a->base + a->size - 1)
+        return -1;
+
+    uint aligned_offset = (rounded_base - a->base) / PAGE_SIZE;
+    uint start = aligned_offset;
+    LTRACEF("starting search at aligned offset %u\n", start);
+    LTRACEF("arena base 0x%lx size %zu\n", a->base, a->size);
+
+retry:
+    /* search while we're still within the arena and have a chance of finding a slot
+       (start + count < end of arena) */
+    while ((start < a->size / PAGE_SIZE) &&
+            ((start + count) <= a->size / PAGE_SIZE)) {
+        vm_page_t *p = &a->page_array[start];
+        for (uint i = 0; i < count; i++) {
+            if (p->flags & VM_PAGE_FLAG_NONFREE) {
+                /* this run is broken, break out of the inner loop.
+                 * start over at the next alignment boundary
+                 */
+                start = ROUNDUP(start - aligned_offset + i + 1, 1UL << (alignment_log2 - PAGE_SIZE_SHIFT)) + aligned_offset;
+                goto retry;
+            }
+            p++;
+        }
+
+        /* we found a run */
+        LTRACEF("found run from pn %u to %u\n", start, start + count);
+
+        for (uint i = start; i < start + count; i++)
+            buddy_take_page(a, i);
+
+        return start;
+    }
+
+    return -1;
+}
+
 size_t pmm_alloc_contiguous(uint count, uint8_t alignment_log2, paddr_t *pa, struct list_node *list)
 {
-    LTRACEF("count %u, align %u\n", count, alignment_log2);
+    return pmm_alloc_contiguous_etc(count, alignment_log2, 0, pa, list);
+}
+
+size_t pmm_alloc_contiguous_etc(uint count, uint8_t alignment_log2, uint flags, paddr_t *pa, struct list_node *list)
+{
+    LTRACEF("count %u, align %u, flags 0x%x\n", count, alignment_log2, flags);
 
     if (count == 0)
         return 0;
     if (alignment_log2 < PAGE_SIZE_SHIFT)
         alignment_log2 = PAGE_SIZE_SHIFT;
 
+    /* a block of this order is both big enough and aligned enough */
+    uint order = MAX(log2_uint(round_up_pow2_u32(count)), (uint)(alignment_log2 - PAGE_SIZE_SHIFT));
+
     mutex_acquire(&lock);
 
     pmm_arena_t *a;
-    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+    uint pass = 0;
+    for_every_arena(a, flags, pass) {
         // XXX make this a flag to only search kmap?
         if (a->flags & PMM_ARENA_FLAG_KMAP) {
-            /* walk the list starting at alignment boundaries.
-             * calculate the starting offset into this arena, based on the
-             * base address of the arena to handle the case where the arena
-             * is not aligned on the same boundary requested.
-             */
-            paddr_t rounded_base = ROUNDUP(a->base, 1UL << alignment_log2);
-            if (rounded_base < a->base || rounded_base > a->base + a->size - 1)
-                continue;
-
-            uint aligned_offset = (rounded_base - a->base) / PAGE_SIZE;
-            uint start = aligned_offset;
-            LTRACEF("starting search at aligned offset %u\n", start);
-            LTRACEF("arena base 0x%lx size %zu\n", a->base, a->size);
-
-retry:
-            /* search while we're still within the arena and have a chance of finding a slot
-               (start + count < end of arena) */
-            while ((start < a->size / PAGE_SIZE) &&
-                    ((start + count) <= a->size / PAGE_SIZE)) {
-                vm_page_t *p = &a->page_array[start];
-                for (uint i = 0; i < count; i++) {
-                    if (p->flags & VM_PAGE_FLAG_NONFREE) {
-                        /* this run is broken, break out of the inner loop.
-                         * start over at the next alignment boundary
-                         */
-                        start = ROUNDUP(start - aligned_offset + i + 1, 1UL << (alignment_log2 - PAGE_SIZE_SHIFT)) + aligned_offset;
-                        goto retry;
-                    }
-                    p++;
+            ssize_t start = -1;
+            if (order <= PMM_MAX_ORDER) {
+                start = buddy_alloc_block(a, order);
+                if (start >= 0) {
+                    /* give back the part of the block past the end of the run */
+                    buddy_free_run(a, start + count, start + (1UL << order));
                 }
+            }
+            if (start < 0) {
+                /* a run that isn't a whole block may still fit somewhere */
+                start = arena_find_run(a, count, alignment_log2);
+                if (start < 0)
+                    continue;
+            }
 
-                /* we found a run */
-                LTRACEF("found run from pn %u to %u\n", start, start + count);
-
-                /* remove the pages from the run out of the free list */
-                for (uint i = start; i < start + count; i++) {
-                    p = &a->page_array[i];
-                    DEBUG_ASSERT(!(p->flags & VM_PAGE_FLAG_NONFREE));
-                    DEBUG_ASSERT(list_in_list(&p->node));
-
-                    list_delete(&p->node);
-                    p->flags |= VM_PAGE_FLAG_NONFREE;
-                    a->free_count--;
+            arena_mark_allocated(a, start, count, list);
 
-                    if (list)
-                        list_add_tail(list, &p->node);
-                }
+            if (pa)
+                *pa = a->base + start * PAGE_SIZE;
 
-                if (pa)
-                    *pa = a->base + start * PAGE_SIZE;
+            mutex_release(&lock);
 
-                mutex_release(&lock);
-
-                return count;
-            }
+            return count;
         }
     }
 
@@ -368,13 +984,19 @@ static void dump_page(const vm_page_t *page)
     printf("page %p: address 0x%lx flags 0x%x\n", page, vm_page_to_paddr(page), page->flags);
 }
 
-static void dump_arena(const pmm_arena_t *arena, bool dump_pages)
+static void dump_arena(pmm_arena_t *arena, bool dump_pages)
 {
     printf("arena %p: name '%s' base 0x%lx size 0x%zx priority %u flags 0x%x\n",
            arena, arena->name, arena->base, arena->size, arena->priority, arena->flags);
     printf("\tpage_array %p, free_count %zu\n",
            arena->page_array, arena->free_count);
 
+    printf("\tfree blocks by order:");
+    for (uint i = 0; i <= PMM_MAX_ORDER; i++) {
+        printf(" %zu", list_length(&arena->free_list[i]));
+    }
+    printf("\n");
+
     /* dump all of the pages */
     if (dump_pages) {
         for (size_t i = 0; i < arena->size / PAGE_SIZE; i++) {
@@ -403,6 +1025,18 @@ static void dump_arena(const pmm_arena_t *arena, bool dump_pages)
     }
 }
 
+static void dump_pcpu_caches(void)
+{
+    printf("per cpu page caches:");
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        printf(" %u", pcpu_cache[i].count);
+    }
+    printf("\n");
+#if PMM_ZERO_POOL_PAGES > 0
+    printf("zeroed pages: %zu of %u\n", zero_pool_count, PMM_ZERO_POOL_PAGES);
+#endif
+}
+
 static int cmd_pmm(int argc, const cmd_args *argv)
 {
     if (argc < 2) {
@@ -412,6 +1046,7 @@ usage:
         printf("usage:\n");
         printf("%s arenas\n", argv[0].str);
         printf("%s alloc <count>\n", argv[0].str);
+        printf("%s alloc_colored <count> <color mask>\n", argv[0].str);
         printf("%s alloc_range <address> <count>\n", argv[0].str);
         printf("%s alloc_kpages <count>\n", argv[0].str);
         printf("%s alloc_contig <count> <alignment>\n", argv[0].str);
@@ -427,6 +1062,7 @@ usage:
         list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
             dump_arena(a, false);
         }
+        dump_pcpu_caches();
     } else if (!strcmp(argv[1].str, "alloc")) {
         if (argc < 3) goto notenoughargs;
 
@@ -441,6 +1077,26 @@ usage:
             printf("\tpage %p, address 0x%lx\n", p, vm_page_to_paddr(p));
         }
 
+        /* add the pages to the local allocated list */
+        struct list_node *node;
+        while ((node = list_remove_head(&list))) {
+            list_add_tail(&allocated, node);
+        }
+    } else if (!strcmp(argv[1].str, "alloc_colored")) {
+        if (argc < 4) goto notenoughargs;
+
+        struct list_node list;
+        list_initialize(&list);
+
+        uint count = pmm_alloc_pages_colored(argv[2].u, 0, argv[3].u, &list);
+        printf("alloc returns %u\n", count);
+
+        vm_page_t *p;
+        list_for_every_entry(&list, p, vm_page_t, node) {
+            paddr_t pa = vm_page_to_paddr(p);
+            printf("\tpage %p, address 0x%lx, color %u\n", p, pa, pmm_page_color(pa));
+        }
+
         /* add the pages to the local allocated list */
         struct list_node *node;
         while ((node = list_remove_head(&list))) {
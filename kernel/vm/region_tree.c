@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * AVL tree of the regions in an address space, keyed by base address.
+ *
+ * The sorted region_list is still the authority on ordering; the tree only
+ * indexes it so lookups don't have to walk the list. Every node also carries
+ * the size of the hole in front of it (gap) and the largest such hole in its
+ * subtree (max_gap), which lets alloc_spot skip whole subtrees that can't
+ * possibly fit the allocation.
+ */
+#include <assert.h>
+#include <kernel/vm.h>
+#include "vm_priv.h"
+
+static inline uint node_height(const vmm_region_t *n)
+{
+    return n ? n->tree_height : 0;
+}
+
+static inline size_t node_max_gap(const vmm_region_t *n)
+{
+    return n ? n->max_gap : 0;
+}
+
+static void node_update(vmm_region_t *n)
+{
+    uint hl = node_height(n->tree_left);
+    uint hr = node_height(n->tree_right);
+    n->tree_height = 1 + MAX(hl, hr);
+
+    size_t gap = n->gap;
+    gap = MAX(gap, node_max_gap(n->tree_left));
+    gap = MAX(gap, node_max_gap(n->tree_right));
+    n->max_gap = gap;
+}
+
+static vmm_region_t *rotate_right(vmm_region_t *n)
+{
+    vmm_region_t *l = n->tree_left;
+
+    n->tree_left = l->tree_right;
+    l->tree_right = n;
+    node_update(n);
+    node_update(l);
+    return l;
+}
+
+static vmm_region_t *rotate_left(vmm_region_t *n)
+{
+    vmm_region_t *r = n->tree_right;
+
+    n->tree_right = r->tree_left;
+    r->tree_left = n;
+    node_update(n);
+    node_update(r);
+    return r;
+}
+
+static vmm_region_t *rebalance(vmm_region_t *n)
+{
+    node_update(n);
+
+    int balance = (int)node_height(n->tree_left) - (int)node_height(n->tree_right);
+    if (balance > 1) {
+        if (node_height(n->tree_left->tree_left) < node_height(n->tree_left->tree_right))
+            n->tree_left = rotate_left(n->tree_left);
+        return rotate_right(n);
+    } else if (balance < -1) {
+        if (node_height(n->tree_right->tree_right) < node_height(n->tree_right->tree_left))
+            n->tree_right = rotate_right(n->tree_right);
+        return rotate_left(n);
+    }
+    return n;
+}
+
+static vmm_region_t *insert(vmm_region_t *n, vmm_region_t *r)
+{
+    if (!n)
+        return r;
+
+    DEBUG_ASSERT(r->base != n->base);
+    if (r->base < n->base)
+        n->tree_left = insert(n->tree_left, r);
+    else
+        n->tree_right = insert(n->tree_right, r);
+
+    return rebalance(n);
+}
+
+/* detach the leftmost node of the subtree, returned in *min */
+static vmm_region_t *remove_min(vmm_region_t *n, vmm_region_t **min)
+{
+    if (!n->tree_left) {
+        *min = n;
+        return n->tree_right;
+    }
+
+    n->tree_left = remove_min(n->tree_left, min);
+    return rebalance(n);
+}
+
+static vmm_region_t *remove(vmm_region_t *n, vmm_region_t *r)
+{
+    DEBUG_ASSERT(n);
+
+    if (r->base < n->base) {
+        n->tree_left = remove(n->tree_left, r);
+    } else if (r->base > n->base) {
+        n->tree_right = remove(n->tree_right, r);
+    } else {
+        DEBUG_ASSERT(n == r);
+
+        vmm_region_t *left = n->tree_left;
+        vmm_region_t *right = n->tree_right;
+        n->tree_left = n->tree_right = NULL;
+
+        if (!right)
+            return left;
+
+        vmm_region_t *min;
+        right = remove_min(right, &min);
+        min->tree_left = left;
+        min->tree_right = right;
+        return rebalance(min);
+    }
+
+    return rebalance(n);
+}
+
+/* recompute max_gap along the path from n down to key */
+static void update_path(vmm_region_t *n, vaddr_t key)
+{
+    if (!n)
+        return;
+
+    if (key < n->base)
+        update_path(n->tree_left, key);
+    else if (key > n->base)
+        update_path(n->tree_right, key);
+
+    node_update(n);
+}
+
+void region_tree_insert(vmm_aspace_t *aspace, vmm_region_t *r)
+{
+    r->tree_left = r->tree_right = NULL;
+    r->tree_height = 1;
+    r->max_gap = r->gap;
+
+    aspace->region_tree = insert(aspace->region_tree, r);
+}
+
+void region_tree_remove(vmm_aspace_t *aspace, vmm_region_t *r)
+{
+    aspace->region_tree = remove(aspace->region_tree, r);
+}
+
+void region_tree_update_gap(vmm_aspace_t *aspace, vmm_region_t *r, size_t gap)
+{
+    r->gap = gap;
+    update_path(aspace->region_tree, r->base);
+}
+
+/* the region containing vaddr, if any */
+vmm_region_t *region_tree_find(const vmm_aspace_t *aspace, vaddr_t vaddr)
+{
+    vmm_region_t *n = aspace->region_tree;
+
+    while (n) {
+        if (vaddr < n->base)
+            n = n->tree_left;
+        else if (vaddr > n->base + n->size - 1)
+            n = n->tree_right;
+        else
+            return n;
+    }
+
+    return NULL;
+}
+
+/* the lowest region that ends at or above vaddr */
+vmm_region_t *region_tree_find_next(const vmm_aspace_t *aspace, vaddr_t vaddr)
+{
+    vmm_region_t *n = aspace->region_tree;
+    vmm_region_t *found = NULL;
+
+    while (n) {
+        if (n->base + n->size - 1 >= vaddr) {
+            found = n;
+            n = n->tree_left;
+        } else {
+            n = n->tree_right;
+        }
+    }
+
+    return found;
+}
@@ -34,3 +34,10 @@ extern uintptr_t boot_alloc_end;
 void vmm_init_preheap(void);
 void vmm_init(void);
 
+/* region tree, all callers hold the vmm lock */
+void region_tree_insert(vmm_aspace_t *aspace, vmm_region_t *r);
+void region_tree_remove(vmm_aspace_t *aspace, vmm_region_t *r);
+void region_tree_update_gap(vmm_aspace_t *aspace, vmm_region_t *r, size_t gap);
+vmm_region_t *region_tree_find(const vmm_aspace_t *aspace, vaddr_t vaddr);
+vmm_region_t *region_tree_find_next(const vmm_aspace_t *aspace, vaddr_t vaddr);
+
@@ -27,12 +27,13 @@
 #include <lib/console.h>
 #include <kernel/vm.h>
 #include <kernel/mutex.h>
+#include <kernel/thread.h>
 #include "vm_priv.h"
 
 #define LOCAL_TRACE 0
 
 static struct list_node aspace_list = LIST_INITIAL_VALUE(aspace_list);
-static mutex_t vmm_lock = MUTEX_INITIAL_VALUE(vmm_lock);
+static mutex_t vmm_lock = MUTEX_INITIAL_VALUE_FLAGS(vmm_lock, MUTEX_FLAG_PRIORITY_INHERIT);
 
 vmm_aspace_t _kernel_aspace;
 
@@ -47,6 +48,7 @@ void vmm_init_preheap(void)
     _kernel_aspace.size = KERNEL_ASPACE_SIZE;
     _kernel_aspace.flags = VMM_ASPACE_FLAG_KERNEL;
     list_initialize(&_kernel_aspace.region_list);
+    _kernel_aspace.region_tree = NULL;
 
     arch_mmu_init_aspace(&_kernel_aspace.arch_aspace, KERNEL_ASPACE_BASE, KERNEL_ASPACE_SIZE, ARCH_ASPACE_FLAG_KERNEL);
 
@@ -126,6 +128,39 @@ static vmm_region_t *alloc_region_struct(const char *name, vaddr_t base, size_t
     return r;
 }
 
+/* free space between a listed region and the one before it */
+static size_t region_gap(vmm_aspace_t *aspace, vmm_region_t *r)
+{
+    vmm_region_t *prev = list_prev_type(&aspace->region_list, &r->node, vmm_region_t, node);
+
+    return r->base - (prev ? prev->base + prev->size : aspace->base);
+}
+
+/* link a region into the aspace list after |before| and into the region tree */
+static void insert_region(vmm_aspace_t *aspace, vmm_region_t *r, struct list_node *before)
+{
+    list_add_after(before, &r->node);
+
+    r->gap = region_gap(aspace, r);
+    region_tree_insert(aspace, r);
+
+    /* the hole in front of the next region just got smaller */
+    vmm_region_t *next = list_next_type(&aspace->region_list, &r->node, vmm_region_t, node);
+    if (next)
+        region_tree_update_gap(aspace, next, region_gap(aspace, next));
+}
+
+static void remove_region(vmm_aspace_t *aspace, vmm_region_t *r)
+{
+    vmm_region_t *next = list_next_type(&aspace->region_list, &r->node, vmm_region_t, node);
+
+    region_tree_remove(aspace, r);
+    list_delete(&r->node);
+
+    if (next)
+        region_tree_update_gap(aspace, next, region_gap(aspace, next));
+}
+
 /* add a region to the appropriate spot in the address space list,
  * testing to see if there's a space */
 static status_t add_region_to_aspace(vmm_aspace_t *aspace, vmm_region_t *r)
@@ -144,31 +179,15 @@ static status_t add_region_to_aspace(vmm_aspace_t *aspace, vmm_region_t *r)
 
     vaddr_t r_end = r->base + r->size - 1;
 
-    /* does it fit in front */
-    vmm_region_t *last;
-    last = list_peek_head_type(&aspace->region_list, vmm_region_t, node);
-    if (!last || r_end < last->base) {
-        /* empty list or not empty and fits before the first element */
-        list_add_head(&aspace->region_list, &r->node);
-        return NO_ERROR;
-    }
-
-    /* walk the list, finding the right spot to put it */
-    list_for_every_entry(&aspace->region_list, last, vmm_region_t, node) {
-        /* does it go after last? */
-        if (r->base > last->base + last->size - 1) {
-            /* get the next element in the list */
-            vmm_region_t *next = list_next_type(&aspace->region_list, &last->node, vmm_region_t, node);
-            if (!next || (r_end < next->base)) {
-                /* end of the list or next exists and it goes between them */
-                list_add_after(&last->node, &r->node);
-                return NO_ERROR;
-            }
-        }
+    /* the first region that doesn't end before us has to start after us */
+    vmm_region_t *next = region_tree_find_next(aspace, r->base);
+    if (next && next->base <= r_end) {
+        LTRACEF("couldn't find spot\n");
+        return ERR_NO_MEMORY;
     }
 
-    LTRACEF("couldn't find spot\n");
-    return ERR_NO_MEMORY;
+    insert_region(aspace, r, next ? next->node.prev : aspace->region_list.prev);
+    return NO_ERROR;
 }
 
 /*
@@ -231,6 +250,32 @@ not_found:
     return true; /* not_found: stop search */
 }
 
+/*
+ *  In order walk of the gaps in front of each region in the subtree,
+ *  skipping subtrees where no gap is large enough. Returns true when
+ *  check_gap stopped the search, with the region after the gap in *next.
+ */
+static bool search_gaps(vmm_aspace_t *aspace, vmm_region_t *n,
+                        vaddr_t *pva, vaddr_t align, size_t size,
+                        uint arch_mmu_flags, vmm_region_t **next)
+{
+    if (!n || n->max_gap < size)
+        return false;
+
+    if (search_gaps(aspace, n->tree_left, pva, align, size, arch_mmu_flags, next))
+        return true;
+
+    if (n->gap >= size) {
+        vmm_region_t *prev = list_prev_type(&aspace->region_list, &n->node, vmm_region_t, node);
+        if (check_gap(aspace, prev, n, pva, align, size, arch_mmu_flags)) {
+            *next = n;
+            return true;
+        }
+    }
+
+    return search_gaps(aspace, n->tree_right, pva, align, size, arch_mmu_flags, next);
+}
+
 static vaddr_t alloc_spot(vmm_aspace_t *aspace, size_t size, uint8_t align_pow2,
                           uint arch_mmu_flags, struct list_node **before)
 {
@@ -244,28 +289,24 @@ static vaddr_t alloc_spot(vmm_aspace_t *aspace, size_t size, uint8_t align_pow2,
     vaddr_t align = 1UL << align_pow2;
 
     vaddr_t spot;
-    vmm_region_t *r = NULL;
+    vmm_region_t *next = NULL;
 
-    /* try to pick spot at the beginning of address space */
-    if (check_gap(aspace, NULL,
-                  list_peek_head_type(&aspace->region_list, vmm_region_t, node),
-                  &spot, align, size, arch_mmu_flags))
+    /* search the gaps in front of each region, lowest address first */
+    if (search_gaps(aspace, aspace->region_tree, &spot, align, size, arch_mmu_flags, &next))
         goto done;
 
-    /* search the middle of the list */
-    list_for_every_entry(&aspace->region_list, r, vmm_region_t, node) {
-        if (check_gap(aspace, r,
-                      list_next_type(&aspace->region_list, &r->node, vmm_region_t, node),
-                      &spot, align, size, arch_mmu_flags))
-            goto done;
-    }
+    /* try the space past the last region */
+    if (check_gap(aspace,
+                  list_peek_tail_type(&aspace->region_list, vmm_region_t, node), NULL,
+                  &spot, align, size, arch_mmu_flags))
+        goto done;
 
     /* couldn't find anything */
     return -1;
 
 done:
     if (before)
-        *before = r ? &r->node : &aspace->region_list;
+        *before = next ? next->node.prev : aspace->region_list.prev;
     return spot;
 }
 
@@ -305,7 +346,7 @@ static vmm_region_t *alloc_region(vmm_aspace_t *aspace, const char *name, size_t
         r->base = (vaddr_t)vaddr;
 
         /* add it to the region list */
-        list_add_after(before, &r->node);
+        insert_region(aspace, r, before);
     }
 
     return r;
@@ -349,6 +390,44 @@ status_t vmm_reserve_space(vmm_aspace_t *aspace, const char *name, size_t size,
     return r ? NO_ERROR : ERR_NO_MEMORY;
 }
 
+/* the color set rides in the top half of the vmm flags */
+STATIC_ASSERT(PMM_NUM_COLORS <= 16);
+
+/* pmm placement flags for vmm_alloc* flags */
+static uint vmm_pmm_flags(uint vmm_flags)
+{
+    uint flags = 0;
+
+    if (vmm_flags & VMM_FLAG_FAST_MEM)
+        flags |= PMM_ALLOC_FLAG_FAST;
+    else if (vmm_flags & VMM_FLAG_BULK_MEM)
+        flags |= PMM_ALLOC_FLAG_BULK;
+    return flags;
+}
+
+/* the alignment that lets the mmu map as much of a |size| byte physically
+ * contiguous region as it can with block mappings, never less than |align| */
+static uint8_t vmm_large_page_align(size_t size, uint8_t align)
+{
+#ifdef ARCH_HUGE_PAGE_SIZE_SHIFT
+    if (size >= (1UL << ARCH_HUGE_PAGE_SIZE_SHIFT))
+        return MAX(align, ARCH_HUGE_PAGE_SIZE_SHIFT);
+#endif
+#ifdef ARCH_LARGE_PAGE_SIZE_SHIFT
+    if (size >= (1UL << ARCH_LARGE_PAGE_SIZE_SHIFT))
+        return MAX(align, ARCH_LARGE_PAGE_SIZE_SHIFT);
+#endif
+    return align;
+}
+
+/* |align| capped to what |paddr| is aligned to, but never less than |min_align| */
+static uint8_t vmm_paddr_align(paddr_t paddr, uint8_t align, uint8_t min_align)
+{
+    if (paddr)
+        align = MIN(align, (uint8_t)__builtin_ctzl(paddr));
+    return MAX(align, min_align);
+}
+
 status_t vmm_alloc_physical(vmm_aspace_t *aspace, const char *name, size_t size,
                             void **ptr, uint8_t align_log2, paddr_t paddr, uint vmm_flags, uint arch_mmu_flags)
 {
@@ -382,11 +461,18 @@ status_t vmm_alloc_physical(vmm_aspace_t *aspace, const char *name, size_t size,
         vaddr = (vaddr_t)*ptr;
     }
 
+    /* line the virtual address up with the physical one for block mappings */
+    uint8_t block_align = vmm_paddr_align(paddr, vmm_large_page_align(size, align_log2), align_log2);
+
     mutex_acquire(&vmm_lock);
 
     /* allocate a region and put it in the aspace list */
-    vmm_region_t *r = alloc_region(aspace, name, size, vaddr, align_log2, vmm_flags,
+    vmm_region_t *r = alloc_region(aspace, name, size, vaddr, block_align, vmm_flags,
                                    VMM_REGION_FLAG_PHYSICAL, arch_mmu_flags);
+    if (!r && block_align != align_log2) {
+        r = alloc_region(aspace, name, size, vaddr, align_log2, vmm_flags,
+                         VMM_REGION_FLAG_PHYSICAL, arch_mmu_flags);
+    }
     if (!r) {
         ret = ERR_NO_MEMORY;
         goto err_alloc_region;
@@ -441,19 +527,29 @@ status_t vmm_alloc_contiguous(vmm_aspace_t *aspace, const char *name, size_t siz
     list_initialize(&page_list);
 
     paddr_t pa = 0;
-    /* allocate a run of physical pages */
-    size_t count = pmm_alloc_contiguous(size / PAGE_SIZE, align_pow2, &pa, &page_list);
+    /* allocate a run of physical pages, aligned for block mappings if we can */
+    uint8_t block_align = vmm_large_page_align(size, align_pow2);
+    uint pmm_flags = vmm_pmm_flags(vmm_flags);
+    size_t count = pmm_alloc_contiguous_etc(size / PAGE_SIZE, block_align, pmm_flags, &pa, &page_list);
+    if (count < size / PAGE_SIZE && block_align != align_pow2)
+        count = pmm_alloc_contiguous_etc(size / PAGE_SIZE, align_pow2, pmm_flags, &pa, &page_list);
     if (count < size / PAGE_SIZE) {
         DEBUG_ASSERT(count == 0); /* check that the pmm didn't allocate a partial run */
         err = ERR_NO_MEMORY;
         goto err;
     }
 
+    block_align = vmm_paddr_align(pa, block_align, align_pow2);
+
     mutex_acquire(&vmm_lock);
 
     /* allocate a region and put it in the aspace list */
-    vmm_region_t *r = alloc_region(aspace, name, size, vaddr, align_pow2, vmm_flags,
+    vmm_region_t *r = alloc_region(aspace, name, size, vaddr, block_align, vmm_flags,
                                    VMM_REGION_FLAG_PHYSICAL, arch_mmu_flags);
+    if (!r && block_align != align_pow2) {
+        r = alloc_region(aspace, name, size, vaddr, align_pow2, vmm_flags,
+                         VMM_REGION_FLAG_PHYSICAL, arch_mmu_flags);
+    }
     if (!r) {
         err = ERR_NO_MEMORY;
         goto err1;
@@ -511,13 +607,43 @@ status_t vmm_alloc(vmm_aspace_t *aspace, const char *name, size_t size, void **p
         vaddr = (vaddr_t)*ptr;
     }
 
-    /* allocate physical memory up front, in case it cant be satisfied */
-
-    /* allocate a random pile of pages */
+    /* lazy regions get their pages from vmm_page_fault_handler */
     struct list_node page_list;
     list_initialize(&page_list);
 
-    size_t count = pmm_alloc_pages(size / PAGE_SIZE, &page_list);
+    if (vmm_flags & VMM_FLAG_LAZY) {
+        mutex_acquire(&vmm_lock);
+
+        /* remember the placement for the fault handler */
+        uint region_flags = VMM_REGION_FLAG_PHYSICAL | VMM_REGION_FLAG_LAZY;
+        if (vmm_flags & VMM_FLAG_FAST_MEM)
+            region_flags |= VMM_REGION_FLAG_FAST_MEM;
+        else if (vmm_flags & VMM_FLAG_BULK_MEM)
+            region_flags |= VMM_REGION_FLAG_BULK_MEM;
+
+        vmm_region_t *r = alloc_region(aspace, name, size, vaddr, align_pow2, vmm_flags,
+                                       region_flags, arch_mmu_flags);
+        if (!r) {
+            err = ERR_NO_MEMORY;
+            goto err1;
+        }
+        r->colors = VMM_FLAG_GET_COLORS(vmm_flags);
+
+        if (ptr)
+            *ptr = (void *)r->base;
+
+        mutex_release(&vmm_lock);
+        return NO_ERROR;
+    }
+
+    /* allocate physical memory up front, in case it cant be satisfied */
+
+    /* allocate a random pile of pages */
+    uint pmm_flags = vmm_pmm_flags(vmm_flags);
+    if (vmm_flags & VMM_FLAG_ZERO)
+        pmm_flags |= PMM_ALLOC_FLAG_ZEROED;
+    size_t count = pmm_alloc_pages_colored(size / PAGE_SIZE, pmm_flags,
+                                           VMM_FLAG_GET_COLORS(vmm_flags), &page_list);
     DEBUG_ASSERT(count <= size);
     if (count < size / PAGE_SIZE) {
         LTRACEF("failed to allocate enough pages (asked for %zu, got %zu)\n", size / PAGE_SIZE, count);
@@ -569,22 +695,315 @@ err:
     return err;
 }
 
-static vmm_region_t *vmm_find_region(const vmm_aspace_t *aspace, vaddr_t vaddr)
+status_t vmm_object_create(vmm_object_t **_obj, size_t size, uint vmm_flags)
+{
+    LTRACEF("size 0x%zx vmm_flags 0x%x\n", size, vmm_flags);
+
+    size = ROUNDUP(size, PAGE_SIZE);
+    if (size == 0)
+        return ERR_INVALID_ARGS;
+
+    vmm_object_t *obj = calloc(1, sizeof(vmm_object_t));
+    if (!obj)
+        return ERR_NO_MEMORY;
+
+    obj->pages = calloc(size / PAGE_SIZE, sizeof(vm_page_t *));
+    if (!obj->pages) {
+        free(obj);
+        return ERR_NO_MEMORY;
+    }
+
+    obj->ref = 1;
+    obj->size = size;
+    obj->pmm_flags = vmm_pmm_flags(vmm_flags) | PMM_ALLOC_FLAG_ZEROED;
+    obj->colors = VMM_FLAG_GET_COLORS(vmm_flags);
+    list_initialize(&obj->region_list);
+
+    *_obj = obj;
+    return NO_ERROR;
+}
+
+/* how a region maps one of its object's pages, read only while it is shared */
+static uint object_page_mmu_flags(const vmm_region_t *r, const vm_page_t *p)
+{
+    uint flags = r->arch_mmu_flags;
+
+    if (p->ref > 1)
+        flags |= ARCH_MMU_FLAG_PERM_RO;
+    return flags;
+}
+
+/* drop the mappings of an object's page everywhere, they fault back in as needed */
+static void object_unmap_page(vmm_object_t *obj, size_t index)
+{
+    vmm_region_t *r;
+    list_for_every_entry(&obj->region_list, r, vmm_region_t, object_node) {
+        arch_mmu_unmap(&r->aspace->arch_aspace, r->base + index * PAGE_SIZE, 1);
+    }
+}
+
+status_t vmm_object_clone(vmm_object_t *obj, vmm_object_t **_clone)
 {
+    LTRACEF("obj %p\n", obj);
+
+    vmm_object_t *clone = calloc(1, sizeof(vmm_object_t));
+    if (!clone)
+        return ERR_NO_MEMORY;
+
+    clone->pages = calloc(obj->size / PAGE_SIZE, sizeof(vm_page_t *));
+    if (!clone->pages) {
+        free(clone);
+        return ERR_NO_MEMORY;
+    }
+
+    clone->ref = 1;
+    clone->size = obj->size;
+    clone->pmm_flags = obj->pmm_flags;
+    clone->colors = obj->colors;
+    list_initialize(&clone->region_list);
+
+    mutex_acquire(&vmm_lock);
+
+    for (size_t i = 0; i < obj->size / PAGE_SIZE; i++) {
+        vm_page_t *p = obj->pages[i];
+        if (!p)
+            continue;
+
+        DEBUG_ASSERT(p->ref < 0xffff);
+        p->ref++;
+        clone->pages[i] = p;
+    }
+
+    /* writable mappings of the source come back read only */
     vmm_region_t *r;
+    list_for_every_entry(&obj->region_list, r, vmm_region_t, object_node) {
+        if (!(r->arch_mmu_flags & ARCH_MMU_FLAG_PERM_RO))
+            arch_mmu_unmap(&r->aspace->arch_aspace, r->base, r->size / PAGE_SIZE);
+    }
+
+    mutex_release(&vmm_lock);
+
+    *_clone = clone;
+    return NO_ERROR;
+}
+
+/* drop a reference with the vmm lock held, moving pages nobody holds anymore to free_list */
+static void object_put_locked(vmm_object_t *obj, struct list_node *free_list)
+{
+    DEBUG_ASSERT(is_mutex_held(&vmm_lock));
+    DEBUG_ASSERT(obj->ref > 0);
+
+    if (--obj->ref > 0)
+        return;
+
+    DEBUG_ASSERT(list_is_empty(&obj->region_list));
+
+    for (size_t i = 0; i < obj->size / PAGE_SIZE; i++) {
+        vm_page_t *p = obj->pages[i];
+        if (p && --p->ref == 0)
+            list_add_tail(free_list, &p->node);
+    }
+
+    free(obj->pages);
+    free(obj);
+}
+
+void vmm_object_release(vmm_object_t *obj)
+{
+    struct list_node free_list = LIST_INITIAL_VALUE(free_list);
+
+    mutex_acquire(&vmm_lock);
+    object_put_locked(obj, &free_list);
+    mutex_release(&vmm_lock);
+
+    pmm_free(&free_list);
+}
+
+status_t vmm_map_object(vmm_aspace_t *aspace, const char *name, vmm_object_t *obj, void **ptr,
+                        uint8_t align_pow2, uint vmm_flags, uint arch_mmu_flags)
+{
+    LTRACEF("aspace %p name '%s' obj %p size 0x%zx ptr %p align %hhu vmm_flags 0x%x arch_mmu_flags 0x%x\n",
+            aspace, name, obj, obj->size, ptr ? *ptr : 0, align_pow2, vmm_flags, arch_mmu_flags);
+
+    if (!name)
+        name = "";
 
+    vaddr_t vaddr = 0;
+    if (vmm_flags & VMM_FLAG_VALLOC_SPECIFIC) {
+        if (!ptr)
+            return ERR_INVALID_ARGS;
+        vaddr = (vaddr_t)*ptr;
+    }
+
+    mutex_acquire(&vmm_lock);
+
+    vmm_region_t *r = alloc_region(aspace, name, obj->size, vaddr, align_pow2, vmm_flags,
+                                   VMM_REGION_FLAG_OBJECT, arch_mmu_flags);
+    if (!r) {
+        mutex_release(&vmm_lock);
+        return ERR_NO_MEMORY;
+    }
+
+    r->object = obj;
+    r->aspace = aspace;
+
+    /* map whatever is already there, the rest faults in */
+    for (size_t i = 0; i < obj->size / PAGE_SIZE; i++) {
+        vm_page_t *p = obj->pages[i];
+        if (!p)
+            continue;
+
+        int ret = arch_mmu_map(&aspace->arch_aspace, r->base + i * PAGE_SIZE, vm_page_to_paddr(p), 1,
+                               object_page_mmu_flags(r, p));
+        if (ret < 0) {
+            LTRACEF("failed to map page %zu of obj %p, err %d\n", i, obj, ret);
+
+            /* back out the pages mapped so far and the region, the object was never touched */
+            if (i > 0)
+                arch_mmu_unmap(&aspace->arch_aspace, r->base, i);
+            remove_region(aspace, r);
+            mutex_release(&vmm_lock);
+
+            free(r);
+            return ret;
+        }
+    }
+
+    obj->ref++;
+    list_add_tail(&obj->region_list, &r->object_node);
+
+    if (ptr)
+        *ptr = (void *)r->base;
+
+    mutex_release(&vmm_lock);
+    return NO_ERROR;
+}
+
+/* the page fault handler for object regions, with the vmm lock held */
+static status_t object_fault_locked(vmm_aspace_t *aspace, vmm_region_t *r, vaddr_t va, uint pf_flags)
+{
+    vmm_object_t *obj = r->object;
+    size_t index = (va - r->base) / PAGE_SIZE;
+    vm_page_t *p = obj->pages[index];
+    struct list_node page_list = LIST_INITIAL_VALUE(page_list);
+
+    uint mapped_flags;
+    if (arch_mmu_query(&aspace->arch_aspace, va, NULL, &mapped_flags) >= 0) {
+        /* only a write to a page mapped read only because it was shared is ours to fix */
+        if (!(pf_flags & VMM_PF_FLAG_WRITE) || !(mapped_flags & ARCH_MMU_FLAG_PERM_RO)) {
+            /* someone else faulted it in while we were waiting for the lock */
+            return (pf_flags & VMM_PF_FLAG_NOT_PRESENT) ? NO_ERROR : ERR_ACCESS_DENIED;
+        }
+        arch_mmu_unmap(&aspace->arch_aspace, va, 1);
+    }
+
+    if (!p || ((pf_flags & VMM_PF_FLAG_WRITE) && p->ref > 1)) {
+        if (pmm_alloc_pages_colored(1, obj->pmm_flags, obj->colors, &page_list) < 1)
+            return ERR_NO_MEMORY;
+
+        vm_page_t *new_page = list_remove_head_type(&page_list, vm_page_t, node);
+        new_page->ref = 1;
+
+        if (p) {
+            /* break the share, every mapping of this object still points at the old page */
+            LTRACEF("copying page %p at offset 0x%zx\n", p, index * PAGE_SIZE);
+            memcpy(paddr_to_kvaddr(vm_page_to_paddr(new_page)),
+                   paddr_to_kvaddr(vm_page_to_paddr(p)), PAGE_SIZE);
+            p->ref--;
+            object_unmap_page(obj, index);
+        }
+
+        obj->pages[index] = p = new_page;
+    }
+
+    return arch_mmu_map(&aspace->arch_aspace, va, vm_page_to_paddr(p), 1, object_page_mmu_flags(r, p));
+}
+
+static vmm_region_t *vmm_find_region(const vmm_aspace_t *aspace, vaddr_t vaddr)
+{
     DEBUG_ASSERT(aspace);
 
     if (!aspace)
         return NULL;
 
-    /* search the region list */
-    list_for_every_entry(&aspace->region_list, r, vmm_region_t, node) {
-        if ((vaddr >= r->base) && (vaddr <= r->base + r->size - 1))
-            return r;
+    return region_tree_find(aspace, vaddr);
+}
+
+status_t vmm_page_fault_handler(vaddr_t addr, uint pf_flags)
+{
+    LTRACEF("addr 0x%lx pf_flags 0x%x\n", addr, pf_flags);
+
+    /* we may have to block to fault the page in */
+    if (arch_ints_disabled() || is_mutex_held(&vmm_lock))
+        return ERR_BAD_STATE;
+
+    vmm_aspace_t *aspace;
+    if (is_kernel_address(addr))
+        aspace = vmm_get_kernel_aspace();
+    else
+        aspace = get_current_thread()->aspace;
+    if (!aspace)
+        return ERR_NOT_FOUND;
+
+    vaddr_t va = ROUNDDOWN(addr, PAGE_SIZE);
+    status_t err;
+
+    mutex_acquire(&vmm_lock);
+
+    vmm_region_t *r = vmm_find_region(aspace, va);
+    if (!r || !(r->flags & (VMM_REGION_FLAG_LAZY | VMM_REGION_FLAG_OBJECT))) {
+        err = ERR_NOT_FOUND;
+        goto out;
+    }
+
+    /* a lazy page shows up with the region's permissions, make sure they'd allow this */
+    uint mmu_flags = r->arch_mmu_flags;
+    if (((pf_flags & VMM_PF_FLAG_USER) && !(mmu_flags & ARCH_MMU_FLAG_PERM_USER)) ||
+            ((pf_flags & VMM_PF_FLAG_WRITE) && (mmu_flags & ARCH_MMU_FLAG_PERM_RO)) ||
+            ((pf_flags & VMM_PF_FLAG_INSTRUCTION) && (mmu_flags & ARCH_MMU_FLAG_PERM_NO_EXECUTE))) {
+        err = ERR_ACCESS_DENIED;
+        goto out;
+    }
+
+    if (r->object) {
+        err = object_fault_locked(aspace, r, va, pf_flags);
+        goto out;
+    }
+
+    /* someone else faulted it in while we were waiting for the lock, anything
+     * other than a not present fault on a mapped page is a real violation */
+    if (arch_mmu_query(&aspace->arch_aspace, va, NULL, NULL) >= 0) {
+        err = (pf_flags & VMM_PF_FLAG_NOT_PRESENT) ? NO_ERROR : ERR_ACCESS_DENIED;
+        goto out;
+    }
+
+    uint pmm_flags = PMM_ALLOC_FLAG_ZEROED;
+    if (r->flags & VMM_REGION_FLAG_FAST_MEM)
+        pmm_flags |= PMM_ALLOC_FLAG_FAST;
+    else if (r->flags & VMM_REGION_FLAG_BULK_MEM)
+        pmm_flags |= PMM_ALLOC_FLAG_BULK;
+
+    struct list_node page_list = LIST_INITIAL_VALUE(page_list);
+    if (pmm_alloc_pages_colored(1, pmm_flags, r->colors, &page_list) < 1) {
+        err = ERR_NO_MEMORY;
+        goto out;
     }
 
-    return NULL;
+    vm_page_t *p = list_peek_head_type(&page_list, vm_page_t, node);
+    err = arch_mmu_map(&aspace->arch_aspace, va, vm_page_to_paddr(p), 1, mmu_flags);
+    if (err < 0) {
+        pmm_free(&page_list);
+        goto out;
+    }
+
+    list_delete(&p->node);
+    list_add_tail(&r->page_list, &p->node);
+    err = NO_ERROR;
+
+out:
+    mutex_release(&vmm_lock);
+    LTRACEF("returning %d\n", err);
+    return err;
 }
 
 status_t vmm_free_region(vmm_aspace_t *aspace, vaddr_t vaddr)
@@ -598,11 +1017,17 @@ status_t vmm_free_region(vmm_aspace_t *aspace, vaddr_t vaddr)
     }
 
     /* remove it from aspace */
-    list_delete(&r->node);
+    remove_region(aspace, r);
 
     /* unmap it */
     arch_mmu_unmap(&aspace->arch_aspace, r->base, r->size / PAGE_SIZE);
 
+    /* let go of the object it maps */
+    if (r->object) {
+        list_delete(&r->object_node);
+        object_put_locked(r->object, &r->page_list);
+    }
+
     mutex_release(&vmm_lock);
 
     /* return physical pages if any */
@@ -647,6 +1072,7 @@ status_t vmm_create_aspace(vmm_aspace_t **_aspace, const char *name, uint flags)
 
     list_clear_node(&aspace->node);
     list_initialize(&aspace->region_list);
+    aspace->region_tree = NULL;
 
     mutex_acquire(&vmm_lock);
     list_add_head(&aspace_list, &aspace->node);
@@ -677,7 +1103,14 @@ status_t vmm_free_aspace(vmm_aspace_t *aspace)
 
         /* unmap it */
         arch_mmu_unmap(&aspace->arch_aspace, r->base, r->size / PAGE_SIZE);
+
+        /* let go of the object it maps */
+        if (r->object) {
+            list_delete(&r->object_node);
+            object_put_locked(r->object, &r->page_list);
+        }
     }
+    aspace->region_tree = NULL;
     mutex_release(&vmm_lock);
 
     /* without the vmm lock held, free all of the pmm pages and the structure */
@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/arena.h>
+
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <kernel/thread.h>
+#include <lib/page_alloc.h>
+#include <lk/init.h>
+
+#define LOCAL_TRACE 0
+
+#ifndef ARENA_SCRATCH_CHUNK_SIZE
+#define ARENA_SCRATCH_CHUNK_SIZE 2048
+#endif
+
+/* what arena_alloc() hands out is aligned like malloc's */
+#define ARENA_ALIGN (2 * sizeof(void *))
+
+/* chunks are used newest first, each pointing back at the one before */
+typedef struct arena_chunk {
+    struct arena_chunk *prev;
+    size_t size;
+    size_t used;
+} arena_chunk_t;
+
+#define CHUNK_HDR ROUNDUP(sizeof(arena_chunk_t), ARENA_ALIGN)
+
+struct arena {
+    arena_chunk_t *cur;
+    size_t chunk_size;
+    uint flags;
+};
+
+static inline uintptr_t chunk_data(arena_chunk_t *c)
+{
+    return (uintptr_t)c + CHUNK_HDR;
+}
+
+static arena_chunk_t *chunk_alloc(arena_t *a, size_t size)
+{
+    if (size > SIZE_MAX - CHUNK_HDR - PAGE_SIZE)
+        return NULL;
+
+    size_t total = CHUNK_HDR + size;
+    arena_chunk_t *c;
+
+    if (a->flags & ARENA_FLAG_PAGES) {
+        total = ROUNDUP(total, PAGE_SIZE);
+        c = page_alloc(total / PAGE_SIZE, PAGE_ALLOC_ANY_ARENA);
+    } else {
+        c = malloc(total);
+    }
+    if (!c)
+        return NULL;
+
+    LTRACEF("arena %p chunk %p size %zu\n", a, c, total);
+
+    c->prev = a->cur;
+    c->size = total - CHUNK_HDR;
+    c->used = 0;
+    a->cur = c;
+
+    return c;
+}
+
+static void chunk_free(arena_t *a, arena_chunk_t *c)
+{
+    if (a->flags & ARENA_FLAG_PAGES)
+        page_free(c, (CHUNK_HDR + c->size) / PAGE_SIZE);
+    else
+        free(c);
+}
+
+/* free the chunks newer than stop */
+static void chunks_free_to(arena_t *a, arena_chunk_t *stop)
+{
+    while (a->cur != stop) {
+        arena_chunk_t *c = a->cur;
+
+        DEBUG_ASSERT(c);
+        a->cur = c->prev;
+        chunk_free(a, c);
+    }
+}
+
+/**
+ * @brief  Create an arena.
+ *
+ * @param chunk_size  Bytes to grab at a time, allocations bigger than this get
+ *                    a chunk of their own.
+ * @param flags       ARENA_FLAG_PAGES to use the page allocator.
+ *
+ * @return The arena, or NULL if the first chunk couldn't be allocated.
+ */
+arena_t *arena_create(size_t chunk_size, uint flags)
+{
+    arena_t *a = malloc(sizeof(arena_t));
+    if (!a)
+        return NULL;
+
+    a->cur = NULL;
+    a->chunk_size = MAX(chunk_size, ARENA_ALIGN);
+    a->flags = flags;
+
+    if (!chunk_alloc(a, a->chunk_size)) {
+        free(a);
+        return NULL;
+    }
+
+    return a;
+}
+
+void arena_destroy(arena_t *a)
+{
+    if (!a)
+        return;
+
+    chunks_free_to(a, NULL);
+    free(a);
+}
+
+void *arena_memalign(arena_t *a, size_t boundary, size_t size)
+{
+    DEBUG_ASSERT(a);
+
+    boundary = MAX(boundary, ARENA_ALIGN);
+    if ((boundary & (boundary - 1)) != 0)
+        return NULL;
+    if (size > SIZE_MAX / 2 - boundary)
+        return NULL;
+
+    arena_chunk_t *c = a->cur;
+    uintptr_t p = ROUNDUP(chunk_data(c) + c->used, boundary);
+
+    if (p + size > chunk_data(c) + c->size) {
+        c = chunk_alloc(a, MAX(a->chunk_size, size + boundary));
+        if (!c)
+            return NULL;
+        p = ROUNDUP(chunk_data(c), boundary);
+    }
+    c->used = p + size - chunk_data(c);
+
+    return (void *)p;
+}
+
+void *arena_alloc(arena_t *a, size_t size)
+{
+    return arena_memalign(a, ARENA_ALIGN, size);
+}
+
+void *arena_calloc(arena_t *a, size_t count, size_t size)
+{
+    if (size && count > SIZE_MAX / size)
+        return NULL;
+
+    void *ptr = arena_alloc(a, count * size);
+    if (ptr)
+        memset(ptr, 0, count * size);
+    return ptr;
+}
+
+char *arena_strdup(arena_t *a, const char *str)
+{
+    size_t len = strlen(str) + 1;
+
+    char *s = arena_memalign(a, 1, len);
+    if (s)
+        memcpy(s, str, len);
+    return s;
+}
+
+void arena_reset(arena_t *a)
+{
+    DEBUG_ASSERT(a);
+
+    /* everything but the oldest chunk */
+    while (a->cur->prev) {
+        arena_chunk_t *c = a->cur;
+        a->cur = c->prev;
+        chunk_free(a, c);
+    }
+    a->cur->used = 0;
+}
+
+arena_mark_t arena_mark(arena_t *a)
+{
+    DEBUG_ASSERT(a);
+
+    arena_mark_t mark = { a->cur, a->cur->used };
+    return mark;
+}
+
+void arena_release(arena_t *a, arena_mark_t mark)
+{
+    DEBUG_ASSERT(a);
+    DEBUG_ASSERT(mark.chunk);
+
+    chunks_free_to(a, mark.chunk);
+    DEBUG_ASSERT(mark.used <= a->cur->used);
+    a->cur->used = mark.used;
+}
+
+arena_t *arena_scratch(void)
+{
+    arena_t *a = (arena_t *)tls_get(TLS_ENTRY_ARENA);
+
+    if (unlikely(!a)) {
+        a = arena_create(ARENA_SCRATCH_CHUNK_SIZE, 0);
+        tls_set(TLS_ENTRY_ARENA, (uintptr_t)a);
+    }
+    return a;
+}
+
+static void arena_scratch_destroy(uintptr_t val)
+{
+    arena_destroy((arena_t *)val);
+}
+
+static void arena_init(uint level)
+{
+    /* a thread's scratch arena goes away with it, and isn't passed on to threads it creates */
+    tls_set_destructor(TLS_ENTRY_ARENA, &arena_scratch_destroy);
+}
+
+LK_INIT_HOOK(arena, &arena_init, LK_INIT_LEVEL_KERNEL);
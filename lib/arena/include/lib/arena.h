@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS;
+
+/*
+ * Region allocator for short lived allocations that all go away together.
+ * Allocation bumps a pointer through chunks obtained from the heap, or from
+ * the page allocator with ARENA_FLAG_PAGES; nothing is freed individually.
+ * arena_reset() drops everything, arena_mark()/arena_release() drop just what
+ * was allocated since the mark. An arena is not thread safe.
+ */
+typedef struct arena arena_t;
+
+typedef struct arena_mark {
+    void *chunk;
+    size_t used;
+} arena_mark_t;
+
+/* back the chunks with whole pages instead of the heap */
+#define ARENA_FLAG_PAGES (1 << 0)
+
+arena_t *arena_create(size_t chunk_size, uint flags);
+void arena_destroy(arena_t *a);
+
+void *arena_alloc(arena_t *a, size_t size);
+void *arena_memalign(arena_t *a, size_t boundary, size_t size);
+void *arena_calloc(arena_t *a, size_t count, size_t size);
+char *arena_strdup(arena_t *a, const char *str);
+
+/* free everything, keeping the first chunk for reuse */
+void arena_reset(arena_t *a);
+
+arena_mark_t arena_mark(arena_t *a);
+void arena_release(arena_t *a, arena_mark_t mark);
+
+/*
+ * The calling thread's scratch arena, created on first use and destroyed when
+ * the thread exits. Callers bracket their use with arena_mark()/arena_release()
+ * so nested users don't lose each other's allocations. The console does this
+ * around every command, so command handlers may simply allocate from it.
+ */
+arena_t *arena_scratch(void);
+
+__END_CDECLS;
@@ -27,16 +27,52 @@
 #include <sys/types.h>
 #include <debug.h>
 #include <trace.h>
+#include <kernel/mutex.h>
+#include <kernel/event.h>
+#include <kernel/thread.h>
+#include <platform.h>
 #include <lib/bcache.h>
 #include <lib/bio.h>
 
 #define LOCAL_TRACE 0
 
+/* most blocks a single readahead will fetch, further capped at half the cache */
+#define BCACHE_READAHEAD_MAX 16
+
+/* most blocks merged into a single write by the flusher */
+#define BCACHE_WRITE_MAX 16
+
+/* the flusher writes everything back once a block has been dirty this long (ms)... */
+#define BCACHE_DIRTY_AGE 5000
+/* ...or this percentage of the cache is dirty */
+#define BCACHE_DIRTY_RATIO 50
+/* how often the flusher checks the age of dirty blocks (ms) */
+#define BCACHE_FLUSH_PERIOD 1000
+
+/*
+ * Every block is in one of three states:
+ *  - free: on free_list, holding no data
+ *  - in use: hashed, referenced by a caller through bcache_get_block, on no list
+ *  - idle: hashed, unreferenced, on clean_list or dirty_list in lru order
+ * Victims come off the head of clean_list, falling back to flushing the head of
+ * dirty_list, so neither lookup nor allocation has to walk the cache.
+ *
+ * A miss on the block right after the last one asked for is treated as a
+ * sequential stream and fills a run of following blocks with one bio_read,
+ * doubling the run each time the stream keeps going.
+ *
+ * Dirty blocks are written back by a flusher thread once they get old or too
+ * much of the cache is dirty, in block order with contiguous blocks merged
+ * into one write. Blocks being written are held with a reference so they
+ * stay put while the cache lock is dropped for the i/o.
+ */
 struct bcache_block {
     struct list_node node;
+    struct list_node hash_node;
     bnum_t blocknum;
     int ref_count;
     bool is_dirty;
+    lk_time_t dirty_time;
     void *ptr;
 };
 
@@ -46,6 +82,8 @@ struct bcache_stats {
     uint32_t misses;
     uint32_t reads;
     uint32_t writes;
+    uint32_t readahead;
+    uint32_t flushes;
 };
 
 struct bcache {
@@ -54,39 +92,126 @@ struct bcache {
     int count;
     struct bcache_stats stats;
 
+    mutex_t lock;
+
     struct list_node free_list;
-    struct list_node lru_list;
+    struct list_node clean_list;
+    struct list_node dirty_list;
+
+    uint hash_mask;
+    struct list_node *hash;
+
+    /* sequential access detection */
+    uint next_blocknum;
+    uint ra_window;
+    uint ra_max;
+    void *ra_buf;
+
+    /* write back */
+    uint dirty_count;
+    mutex_t flush_lock;
+    struct bcache_block **flush_list;
+    void *wb_buf;
+    event_t flush_event;
+    thread_t *flusher;
+    volatile bool flusher_exit;
 
     struct bcache_block *blocks;
 };
 
+static int bcache_flusher(void *arg);
+
+static inline struct list_node *hash_bucket(struct bcache *cache, uint blocknum)
+{
+    /* fold in the high bits so strided metadata doesn't pile up in one bucket */
+    return &cache->hash[(blocknum ^ (blocknum >> 8)) & cache->hash_mask];
+}
+
 bcache_t bcache_create(bdev_t *dev, size_t block_size, int block_count)
 {
     struct bcache *cache;
 
     cache = malloc(sizeof(struct bcache));
+    if (!cache)
+        return NULL;
 
     cache->dev = dev;
     cache->block_size = block_size;
     cache->count = block_count;
     memset(&cache->stats, 0, sizeof(cache->stats));
 
-    list_initialize(&cache->free_list);
-    list_initialize(&cache->lru_list);
+    mutex_init(&cache->lock);
 
+    list_initialize(&cache->free_list);
+    list_initialize(&cache->clean_list);
+    list_initialize(&cache->dirty_list);
+
+    /* a power of two at least as big as the cache, so chains stay short */
+    uint hash_size = 1;
+    while (hash_size < (uint)block_count)
+        hash_size <<= 1;
+    cache->hash_mask = hash_size - 1;
+    cache->hash = malloc(sizeof(struct list_node) * hash_size);
     cache->blocks = malloc(sizeof(struct bcache_block) * block_count);
-    int i;
-    for (i=0; i < block_count; i++) {
+
+    cache->next_blocknum = 0;
+    cache->ra_window = 0;
+    cache->ra_max = MIN(BCACHE_READAHEAD_MAX, block_count / 2);
+    cache->ra_buf = NULL;
+    if (cache->ra_max > 1) {
+        /* bounce buffer so a whole run comes in with one read */
+        cache->ra_buf = malloc(cache->ra_max * block_size);
+        if (!cache->ra_buf)
+            cache->ra_max = 0;
+    } else {
+        cache->ra_max = 0;
+    }
+
+    cache->dirty_count = 0;
+    mutex_init(&cache->flush_lock);
+    event_init(&cache->flush_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    cache->flusher_exit = false;
+    cache->flush_list = malloc(sizeof(struct bcache_block *) * block_count);
+    cache->wb_buf = malloc(BCACHE_WRITE_MAX * block_size);
+
+    if (!cache->hash || !cache->blocks || !cache->flush_list || !cache->wb_buf) {
+        free(cache->wb_buf);
+        free(cache->flush_list);
+        free(cache->ra_buf);
+        free(cache->hash);
+        free(cache->blocks);
+        free(cache);
+        return NULL;
+    }
+
+    uint i;
+    for (i=0; i < hash_size; i++)
+        list_initialize(&cache->hash[i]);
+
+    for (i=0; i < (uint)block_count; i++) {
         cache->blocks[i].ref_count = 0;
         cache->blocks[i].is_dirty = false;
         cache->blocks[i].ptr = malloc(block_size);
+        list_clear_node(&cache->blocks[i].hash_node);
         // add to the free list
         list_add_head(&cache->free_list, &cache->blocks[i].node);
     }
 
+    cache->flusher = thread_create("bcache flush", &bcache_flusher, cache, LOW_PRIORITY, DEFAULT_STACK_SIZE);
+    thread_resume(cache->flusher);
+
     return (bcache_t)cache;
 }
 
+static void clear_dirty(struct bcache *cache, struct bcache_block *block)
+{
+    DEBUG_ASSERT(block->is_dirty);
+    DEBUG_ASSERT(cache->dirty_count > 0);
+
+    block->is_dirty = false;
+    cache->dirty_count--;
+}
+
 static int flush_block(struct bcache *cache, struct bcache_block *block)
 {
     int rc;
@@ -97,7 +222,7 @@ static int flush_block(struct bcache *cache, struct bcache_block *block)
     if (rc < 0)
         goto exit;
 
-    block->is_dirty = false;
+    clear_dirty(cache, block);
     cache->stats.writes++;
     rc = 0;
 exit:
@@ -109,6 +234,10 @@ void bcache_destroy(bcache_t _cache)
     struct bcache *cache = _cache;
     int i;
 
+    cache->flusher_exit = true;
+    event_signal(&cache->flush_event, true);
+    thread_join(cache->flusher, NULL, INFINITE_TIME);
+
     for (i=0; i < cache->count; i++) {
         DEBUG_ASSERT(cache->blocks[i].ref_count == 0);
 
@@ -119,36 +248,68 @@ void bcache_destroy(bcache_t _cache)
         free(cache->blocks[i].ptr);
     }
 
+    event_destroy(&cache->flush_event);
+    mutex_destroy(&cache->flush_lock);
+    mutex_destroy(&cache->lock);
+
+    free(cache->wb_buf);
+    free(cache->flush_list);
+    free(cache->ra_buf);
+    free(cache->blocks);
+    free(cache->hash);
     free(cache);
 }
 
+/* put an unreferenced block at the most recently used end of its idle list */
+static void make_idle(struct bcache *cache, struct bcache_block *block)
+{
+    DEBUG_ASSERT(block->ref_count == 0);
+
+    list_add_tail(block->is_dirty ? &cache->dirty_list : &cache->clean_list, &block->node);
+}
+
+static struct bcache_block *lookup_block(struct bcache *cache, uint blocknum, uint32_t *depth)
+{
+    struct bcache_block *block;
+
+    list_for_every_entry(hash_bucket(cache, blocknum), block, struct bcache_block, hash_node) {
+        LTRACEF("looking at entry %p, num %u\n", block, block->blocknum);
+        (*depth)++;
+
+        if (block->blocknum == blocknum)
+            return block;
+    }
+
+    return NULL;
+}
+
 /* find a block if it's already present */
 static struct bcache_block *find_block(struct bcache *cache, uint blocknum)
 {
     uint32_t depth = 0;
     struct bcache_block *block;
 
-    LTRACEF("num %u\n", blocknum);
+    DEBUG_ASSERT(is_mutex_held(&cache->lock));
 
-    block = NULL;
-    list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
-        LTRACEF("looking at entry %p, num %u\n", block, block->blocknum);
-        depth++;
+    LTRACEF("num %u\n", blocknum);
 
-        if (block->blocknum == blocknum) {
+    block = lookup_block(cache, blocknum, &depth);
+    if (block) {
+        /* bump idle blocks to the recent end of the lru */
+        if (block->ref_count == 0) {
             list_delete(&block->node);
-            list_add_tail(&cache->lru_list, &block->node);
-            cache->stats.hits++;
-            cache->stats.depth += depth;
-            return block;
+            make_idle(cache, block);
         }
+        cache->stats.hits++;
+        cache->stats.depth += depth;
+        return block;
     }
 
     cache->stats.misses++;
     return NULL;
 }
 
-/* allocate a new block */
+/* allocate a new block, returned on no list and unhashed */
 static struct bcache_block *alloc_block(struct bcache *cache)
 {
     int err;
@@ -157,36 +318,119 @@ static struct bcache_block *alloc_block(struct bcache *cache)
     /* pop one off the free list if it's present */
     block = list_remove_head_type(&cache->free_list, struct bcache_block, node);
     if (block) {
-        block->ref_count = 0;
-        list_add_tail(&cache->lru_list, &block->node);
         LTRACEF("found block %p on free list\n", block);
         return block;
     }
 
-    /* walk the lru, looking for a free block */
-    list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
-        LTRACEF("looking at %p, num %u\n", block, block->blocknum);
-        if (block->ref_count == 0) {
-            if (block->is_dirty) {
-                err = flush_block(cache, block);
-                if (err)
-                    return NULL;
-            }
+    /* the least recently used clean block costs nothing to evict */
+    block = list_remove_head_type(&cache->clean_list, struct bcache_block, node);
+    if (!block) {
+        /* otherwise write back the oldest dirty one */
+        block = list_peek_head_type(&cache->dirty_list, struct bcache_block, node);
+        if (!block)
+            return NULL;
 
-            // add it to the tail of the lru
-            list_delete(&block->node);
-            list_add_tail(&cache->lru_list, &block->node);
-            return block;
+        LTRACEF("flushing victim %p, num %u\n", block, block->blocknum);
+        err = flush_block(cache, block);
+        if (err)
+            return NULL;
+        list_delete(&block->node);
+    }
+
+    LTRACEF("evicting %p, num %u\n", block, block->blocknum);
+    DEBUG_ASSERT(block->ref_count == 0);
+    list_delete(&block->hash_node);
+
+    return block;
+}
+
+static void hash_block(struct bcache *cache, struct bcache_block *block, uint blocknum)
+{
+    block->blocknum = blocknum;
+    block->ref_count = 0;
+    block->is_dirty = false;
+    list_add_head(hash_bucket(cache, blocknum), &block->hash_node);
+}
+
+/* how many blocks to fetch for a miss on blocknum, adjusting the readahead window */
+static uint readahead_count(struct bcache *cache, uint blocknum)
+{
+    if (cache->ra_max == 0)
+        return 1;
+
+    if (blocknum != cache->next_blocknum) {
+        /* random access, stop reading ahead until a stream shows up again */
+        cache->ra_window = 0;
+        return 1;
+    }
+
+    cache->ra_window = cache->ra_window ? MIN(cache->ra_window * 2, cache->ra_max) : 2;
+
+    /* stop short of anything already cached */
+    uint count;
+    for (count = 1; count < cache->ra_window; count++) {
+        uint32_t depth = 0;
+        if (lookup_block(cache, blocknum + count, &depth))
+            break;
+    }
+
+    return count;
+}
+
+/* read count blocks starting at blocknum into the cache, returning the first one */
+static struct bcache_block *fill_blocks(struct bcache *cache, uint blocknum, uint count)
+{
+    struct bcache_block *run[BCACHE_READAHEAD_MAX];
+    ssize_t err;
+    uint i;
+
+    DEBUG_ASSERT(count >= 1 && count <= countof(run));
+
+    /*
+     * grab all the victims before hashing any of them, so filling the tail of
+     * the run can't evict the block that was actually asked for
+     */
+    for (i = 0; i < count; i++) {
+        run[i] = alloc_block(cache);
+        if (!run[i])
+            break;
+    }
+    if (i == 0)
+        return NULL;
+    count = i;
+
+    LTRACEF("block %u, count %u\n", blocknum, count);
+
+    /* single blocks go straight into place, runs through the bounce buffer */
+    void *buf = (count == 1) ? run[0]->ptr : cache->ra_buf;
+    err = bio_read(cache->dev, buf, (off_t)blocknum * cache->block_size, count * cache->block_size);
+
+    /* a short read at the end of the device only fills the front of the run */
+    uint filled = (err < 0) ? 0 : (size_t)err / cache->block_size;
+
+    for (i = 0; i < count; i++) {
+        if (i >= filled) {
+            list_add_tail(&cache->free_list, &run[i]->node);
+            continue;
         }
+
+        if (count > 1)
+            memcpy(run[i]->ptr, (uint8_t *)cache->ra_buf + i * cache->block_size, cache->block_size);
+        hash_block(cache, run[i], blocknum + i);
+        make_idle(cache, run[i]);
     }
 
-    return NULL;
+    if (filled == 0)
+        return NULL;
+
+    cache->stats.reads++;
+    cache->stats.readahead += filled - 1;
+
+    return run[0];
 }
 
 static struct bcache_block *find_or_fill_block(struct bcache *cache, uint blocknum)
 {
-    int err;
-
     LTRACEF("block %u\n", blocknum);
 
     /* see if it's already in the cache */
@@ -194,23 +438,16 @@ static struct bcache_block *find_or_fill_block(struct bcache *cache, uint blockn
     if (block == NULL) {
         LTRACEF("wasn't allocated\n");
 
-        /* allocate a new block and fill it */
-        block = alloc_block(cache);
-        DEBUG_ASSERT(block);
-
-        LTRACEF("wasn't allocated, new block %p\n", block);
-
-        block->blocknum = blocknum;
-        err = bio_read(cache->dev, block->ptr, (off_t)blocknum * cache->block_size, cache->block_size);
-        if (err < 0) {
-            /* free the block, return an error */
-            list_add_tail(&cache->free_list, &block->node);
+        /* allocate new blocks and fill them */
+        block = fill_blocks(cache, blocknum, readahead_count(cache, blocknum));
+        if (!block)
             return NULL;
-        }
 
-        cache->stats.reads++;
+        LTRACEF("wasn't allocated, new block %p\n", block);
     }
 
+    cache->next_blocknum = blocknum + 1;
+
     DEBUG_ASSERT(block->blocknum == blocknum);
 
     return block;
@@ -219,38 +456,50 @@ static struct bcache_block *find_or_fill_block(struct bcache *cache, uint blockn
 int bcache_read_block(bcache_t _cache, void *buf, uint blocknum)
 {
     struct bcache *cache = _cache;
+    int err = 0;
 
     LTRACEF("buf %p, blocknum %u\n", buf, blocknum);
 
+    mutex_acquire(&cache->lock);
+
     struct bcache_block *block = find_or_fill_block(cache, blocknum);
     if (block == NULL) {
         /* error */
-        return -1;
+        err = -1;
+    } else {
+        memcpy(buf, block->ptr, cache->block_size);
     }
 
-    memcpy(buf, block->ptr, cache->block_size);
-    return 0;
+    mutex_release(&cache->lock);
+
+    return err;
 }
 
 int bcache_get_block(bcache_t _cache, void **ptr, uint blocknum)
 {
     struct bcache *cache = _cache;
+    int err = 0;
 
     LTRACEF("ptr %p, blocknum %u\n", ptr, blocknum);
 
     DEBUG_ASSERT(ptr);
 
+    mutex_acquire(&cache->lock);
+
     struct bcache_block *block = find_or_fill_block(cache, blocknum);
     if (block == NULL) {
         /* error */
-        return -1;
+        err = -1;
+    } else {
+        /* take it off the idle lists to keep it from being evicted */
+        if (block->ref_count++ == 0)
+            list_delete(&block->node);
+        *ptr = block->ptr;
     }
 
-    /* increment the ref count to keep it from being freed */
-    block->ref_count++;
-    *ptr = block->ptr;
+    mutex_release(&cache->lock);
 
-    return 0;
+    return err;
 }
 
 int bcache_put_block(bcache_t _cache, uint blocknum)
@@ -259,32 +508,57 @@ int bcache_put_block(bcache_t _cache, uint blocknum)
 
     LTRACEF("blocknum %u\n", blocknum);
 
+    mutex_acquire(&cache->lock);
+
     struct bcache_block *block = find_block(cache, blocknum);
 
     /* be pretty hard on the caller for now */
     DEBUG_ASSERT(block);
     DEBUG_ASSERT(block->ref_count > 0);
 
-    block->ref_count--;
+    if (--block->ref_count == 0)
+        make_idle(cache, block);
+
+    mutex_release(&cache->lock);
 
     return 0;
 }
 
+static void set_dirty(struct bcache *cache, struct bcache_block *block)
+{
+    if (block->is_dirty)
+        return;
+
+    block->is_dirty = true;
+    block->dirty_time = current_time();
+    if (block->ref_count == 0) {
+        list_delete(&block->node);
+        make_idle(cache, block);
+    }
+
+    /* too much dirty, kick the flusher rather than waiting for eviction to do it */
+    if (++cache->dirty_count * 100 >= cache->count * BCACHE_DIRTY_RATIO)
+        event_signal(&cache->flush_event, false);
+}
+
 int bcache_mark_block_dirty(bcache_t priv, uint blocknum)
 {
     int err;
     struct bcache *cache = priv;
     struct bcache_block *block;
 
+    mutex_acquire(&cache->lock);
+
     block = find_block(cache, blocknum);
     if (!block) {
         err = -1;
         goto exit;
     }
 
-    block->is_dirty = true;
+    set_dirty(cache, block);
     err = 0;
 exit:
+    mutex_release(&cache->lock);
     return (err);
 }
 
@@ -294,6 +568,8 @@ int bcache_zero_block(bcache_t priv, uint blocknum)
     struct bcache *cache = priv;
     struct bcache_block *block;
 
+    mutex_acquire(&cache->lock);
+
     block = find_block(cache, blocknum);
     if (!block) {
         block = alloc_block(cache);
@@ -302,33 +578,166 @@ int bcache_zero_block(bcache_t priv, uint blocknum)
             goto exit;
         }
 
-        block->blocknum = blocknum;
+        hash_block(cache, block, blocknum);
+        make_idle(cache, block);
     }
 
     memset(block->ptr, 0, cache->block_size);
-    block->is_dirty = true;
+    set_dirty(cache, block);
     err = 0;
 exit:
+    mutex_release(&cache->lock);
     return (err);
 }
 
+static int flush_compare(const void *_a, const void *_b)
+{
+    const struct bcache_block *a = *(const struct bcache_block **)_a;
+    const struct bcache_block *b = *(const struct bcache_block **)_b;
+
+    if (a->blocknum < b->blocknum)
+        return -1;
+    return a->blocknum > b->blocknum;
+}
+
+/* take a block out of circulation while its contents are being written */
+static void hold_block(struct bcache *cache, struct bcache_block *block)
+{
+    if (block->ref_count++ == 0)
+        list_delete(&block->node);
+}
+
+static void release_block(struct bcache *cache, struct bcache_block *block)
+{
+    if (--block->ref_count == 0)
+        make_idle(cache, block);
+}
+
+/*
+ * write back every dirty block, in block order, merging runs of contiguous
+ * blocks into single writes. called with flush_lock held, drops the cache lock
+ * around each write.
+ */
+static int write_back(struct bcache *cache)
+{
+    int err = 0;
+    uint count = 0;
+    uint i;
+
+    DEBUG_ASSERT(is_mutex_held(&cache->flush_lock));
+
+    mutex_acquire(&cache->lock);
+
+    for (i = 0; i < (uint)cache->count; i++) {
+        if (cache->blocks[i].is_dirty)
+            cache->flush_list[count++] = &cache->blocks[i];
+    }
+    qsort(cache->flush_list, count, sizeof(struct bcache_block *), flush_compare);
+
+    LTRACEF("%u dirty blocks\n", count);
+
+    i = 0;
+    while (i < count) {
+        struct bcache_block *run[BCACHE_WRITE_MAX];
+        uint len = 0;
+        uint start = cache->flush_list[i]->blocknum;
+
+        /*
+         * gather a contiguous run. blocks may have been cleaned or written
+         * back by eviction while the lock was dropped for the last write.
+         */
+        for (; i < count && len < BCACHE_WRITE_MAX; i++) {
+            struct bcache_block *block = cache->flush_list[i];
+
+            if (!block->is_dirty)
+                continue;
+            if (len > 0 && block->blocknum != start + len)
+                break;
+            if (len == 0)
+                start = block->blocknum;
+
+            memcpy((uint8_t *)cache->wb_buf + len * cache->block_size, block->ptr, cache->block_size);
+            clear_dirty(cache, block);
+            hold_block(cache, block);
+            run[len++] = block;
+        }
+        if (len == 0)
+            continue;
+
+        mutex_release(&cache->lock);
+
+        LTRACEF("writing %u blocks at %u\n", len, start);
+        ssize_t rc = bio_write(cache->dev, cache->wb_buf,
+                               (off_t)start * cache->block_size, len * cache->block_size);
+
+        mutex_acquire(&cache->lock);
+
+        /* anything that didn't make it out is dirty again */
+        for (uint j = 0; j < len; j++) {
+            if (rc < 0 || (size_t)rc < (j + 1) * cache->block_size) {
+                run[j]->is_dirty = true;
+                cache->dirty_count++;
+            }
+            release_block(cache, run[j]);
+        }
+
+        if (rc < 0) {
+            err = rc;
+            break;
+        }
+
+        cache->stats.writes++;
+    }
+
+    mutex_release(&cache->lock);
+
+    return err;
+}
+
 int bcache_flush(bcache_t priv)
 {
     int err;
     struct bcache *cache = priv;
-    struct bcache_block *block;
 
-    list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
-        if (block->is_dirty) {
-            err = flush_block(cache, block);
-            if (err)
-                goto exit;
+    mutex_acquire(&cache->flush_lock);
+    err = write_back(cache);
+    if (err >= 0)
+        err = bio_flush(cache->dev);
+    mutex_release(&cache->flush_lock);
+
+    return (err);
+}
+
+static int bcache_flusher(void *arg)
+{
+    struct bcache *cache = arg;
+
+    while (!cache->flusher_exit) {
+        event_wait_timeout(&cache->flush_event, BCACHE_FLUSH_PERIOD);
+        if (cache->flusher_exit)
+            break;
+
+        bool flush;
+        lk_time_t now = current_time();
+
+        mutex_acquire(&cache->lock);
+        flush = cache->dirty_count * 100 >= cache->count * BCACHE_DIRTY_RATIO;
+        for (int i = 0; !flush && i < cache->count; i++) {
+            struct bcache_block *block = &cache->blocks[i];
+            if (block->is_dirty && now - block->dirty_time >= BCACHE_DIRTY_AGE)
+                flush = true;
+        }
+        mutex_release(&cache->lock);
+
+        if (flush) {
+            mutex_acquire(&cache->flush_lock);
+            if (write_back(cache) >= 0 && bio_flush(cache->dev) >= 0)
+                cache->stats.flushes++;
+            mutex_release(&cache->flush_lock);
         }
     }
 
-    err = 0;
-exit:
-    return (err);
+    return 0;
 }
 
 void bcache_dump(bcache_t priv, const char *name)
@@ -338,7 +747,7 @@ void bcache_dump(bcache_t priv, const char *name)
 
     finds = cache->stats.hits + cache->stats.misses;
 
-    printf("%s: hits=%u(%u%%) depth=%u misses=%u(%u%%) reads=%u writes=%u\n",
+    printf("%s: hits=%u(%u%%) depth=%u misses=%u(%u%%) reads=%u readahead=%u writes=%u flushes=%u dirty=%u\n",
            name,
            cache->stats.hits,
            finds ? (cache->stats.hits * 100) / finds : 0,
@@ -346,5 +755,8 @@ void bcache_dump(bcache_t priv, const char *name)
            cache->stats.misses,
            finds ? (cache->stats.misses * 100) / finds : 0,
            cache->stats.reads,
-           cache->stats.writes);
+           cache->stats.readahead,
+           cache->stats.writes,
+           cache->stats.flushes,
+           cache->dirty_count);
 }
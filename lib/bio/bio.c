@@ -29,17 +29,36 @@
 #include <list.h>
 #include <pow2.h>
 #include <lib/bio.h>
+#include <kernel/rwlock.h>
 #include <kernel/mutex.h>
+#include <kernel/semaphore.h>
+#include <kernel/thread.h>
+#include <kernel/debug.h>
 #include <lk/init.h>
+#include "bio_priv.h"
 
 #define LOCAL_TRACE 0
 
 static struct {
     struct list_node list;
-    mutex_t lock;
+    rwlock_t lock;
 } bdevs = {
     .list = LIST_INITIAL_VALUE(bdevs.list),
-    .lock = MUTEX_INITIAL_VALUE(bdevs.lock),
+    .lock = RWLOCK_INITIAL_VALUE(bdevs.lock),
+};
+
+/* most an unaligned write to a device that needs aligned buffers is bounced through at once */
+#define BIO_BOUNCE_MAX (16 * 1024)
+
+/* requests for devices without a submit hook of their own, run one at a time by a worker */
+static struct {
+    struct list_node queue;
+    mutex_t lock;
+    semaphore_t sem;
+    bool running;
+} bio_async = {
+    .queue = LIST_INITIAL_VALUE(bio_async.queue),
+    .lock = MUTEX_INITIAL_VALUE(bio_async.lock),
 };
 
 /* default implementation is to use the read_block hook to 'deblock' the device */
@@ -86,6 +105,30 @@ static ssize_t bio_default_read(struct bdev *dev, void *_buf, off_t offset, size
         (IS_ALIGNED((size_t)buf, CACHE_LINE) == false);
     /* handle middle blocks */
     if (requires_alignment) {
+        /*
+         * read all but the last of them straight into the first aligned spot in the
+         * caller's buffer and slide them down, rather than bouncing every block
+         */
+        uint32_t num_blocks = divpow2(len, dev->block_shift);
+        if (num_blocks > 1 && dev->block_size >= CACHE_LINE) {
+            uint8_t *aligned = (uint8_t *)ROUNDUP((uintptr_t)buf, CACHE_LINE);
+            size_t direct = (size_t)(num_blocks - 1) << dev->block_shift;
+
+            err = bio_read_block(dev, aligned, block, num_blocks - 1);
+            if (err < 0) {
+                goto err;
+            } else if ((size_t)err != direct) {
+                err = ERR_IO;
+                goto err;
+            }
+            memmove(buf, aligned, direct);
+
+            buf += direct;
+            len -= direct;
+            bytes_read += direct;
+            block += num_blocks - 1;
+        }
+
         while (len >= dev->block_size) {
             /* do the middle reads */
             err = bio_read_block(dev, temp, block, 1);
@@ -102,7 +145,7 @@ static ssize_t bio_default_read(struct bdev *dev, void *_buf, off_t offset, size
             bytes_read += dev->block_size;
             block++;
         }
-    } else {
+    } else if (len >= dev->block_size) {
         uint32_t num_blocks = divpow2(len, dev->block_shift);
         err = bio_read_block(dev, buf, block, num_blocks);
         if (err < 0) {
@@ -192,24 +235,39 @@ static ssize_t bio_default_write(struct bdev *dev, const void *_buf, off_t offse
         (IS_ALIGNED((size_t)buf, CACHE_LINE) == false);
 
     /* handle middle blocks */
-    if (requires_alignment) {
+    if (requires_alignment && len >= dev->block_size) {
+        /* bounce through as big an aligned buffer as we can get, falling back to the one block */
+        size_t bounce_len = MIN(ROUNDDOWN(len, dev->block_size),
+                                MAX(dev->block_size, (size_t)BIO_BOUNCE_MAX));
+        uint8_t *bounce = (bounce_len > dev->block_size) ? memalign(CACHE_LINE, bounce_len) : NULL;
+        if (!bounce) {
+            bounce = temp;
+            bounce_len = dev->block_size;
+        }
+
         while (len >= dev->block_size) {
-            /* do the middle reads */
-            memcpy(temp, buf, dev->block_size);
-            err = bio_write_block(dev, temp, block, 1);
+            /* do the middle writes */
+            size_t towrite = MIN(ROUNDDOWN(len, dev->block_size), bounce_len);
+            memcpy(bounce, buf, towrite);
+            err = bio_write_block(dev, bounce, block, towrite >> dev->block_shift);
             if (err < 0) {
-                goto err;
-            } else if ((size_t)err != dev->block_size) {
+                break;
+            } else if ((size_t)err != towrite) {
                 err = ERR_IO;
-                goto err;
+                break;
             }
 
-            buf += dev->block_size;
-            len -= dev->block_size;
-            bytes_written += dev->block_size;
-            block++;
+            buf += towrite;
+            len -= towrite;
+            bytes_written += towrite;
+            block += towrite >> dev->block_shift;
         }
-    } else {
+
+        if (bounce != temp)
+            free(bounce);
+        if (err < 0)
+            goto err;
+    } else if (len >= dev->block_size) {
         uint32_t block_count = divpow2(len, dev->block_shift);
         err = bio_write_block(dev, buf, block, block_count);
         if (err < 0) {
@@ -259,12 +317,12 @@ err:
     return (err >= 0) ? bytes_written : err;
 }
 
-static ssize_t bio_default_erase(struct bdev *dev, off_t offset, size_t len)
+/* write a byte pattern over a range a block at a time */
+static ssize_t bio_default_fill(struct bdev *dev, off_t offset, size_t len, uint8_t val)
 {
-    /* default erase operation is to just write zeros over the device */
     STACKBUF_DMA_ALIGN(erase_buf, dev->block_size);
 
-    memset(erase_buf, dev->erase_byte, dev->block_size);
+    memset(erase_buf, val, dev->block_size);
 
     ssize_t erased = 0;
     size_t remaining = len;
@@ -287,6 +345,29 @@ static ssize_t bio_default_erase(struct bdev *dev, off_t offset, size_t len)
     return erased;
 }
 
+static ssize_t bio_default_erase(struct bdev *dev, off_t offset, size_t len)
+{
+    /* default erase operation is to just write the erase byte over the device */
+    return bio_default_fill(dev, offset, len, dev->erase_byte);
+}
+
+static ssize_t bio_default_write_zeroes(struct bdev *dev, off_t offset, size_t len)
+{
+    return bio_default_fill(dev, offset, len, 0);
+}
+
+static ssize_t bio_default_discard(struct bdev *dev, off_t offset, size_t len)
+{
+    /* only a hint, so doing nothing is fine */
+    return len;
+}
+
+static status_t bio_default_flush(struct bdev *dev)
+{
+    /* nothing cached below us */
+    return NO_ERROR;
+}
+
 static ssize_t bio_default_read_block(struct bdev *dev, void *buf, bnum_t block, uint count)
 {
     return ERR_NOT_SUPPORTED;
@@ -297,6 +378,76 @@ static ssize_t bio_default_write_block(struct bdev *dev, const void *buf, bnum_t
     return ERR_NOT_SUPPORTED;
 }
 
+static status_t bio_default_submit(struct bdev *dev, bio_request_t *req)
+{
+    if (!bio_async.running)
+        return ERR_NOT_READY;
+
+    req->target = dev;
+
+    mutex_acquire(&bio_async.lock);
+    list_add_tail(&bio_async.queue, &req->node);
+    mutex_release(&bio_async.lock);
+
+    sem_post(&bio_async.sem, false);
+
+    return NO_ERROR;
+}
+
+/* run a queued request with the device's synchronous block hooks */
+static ssize_t bio_emulate_request(bio_request_t *req)
+{
+    bdev_t *dev = req->target;
+    bnum_t block = req->block;
+    ssize_t total = 0;
+
+    for (uint i = 0; i < req->iov_count; i++) {
+        uint count = req->iov[i].len / dev->block_size;
+        ssize_t err;
+
+        if (req->write)
+            err = dev->write_block(dev, req->iov[i].base, block, count);
+        else
+            err = dev->read_block(dev, req->iov[i].base, block, count);
+        if (err < 0)
+            return err;
+
+        total += err;
+        if ((size_t)err < req->iov[i].len)
+            break;
+        block += count;
+    }
+
+    return total;
+}
+
+static int bio_async_worker(void *arg)
+{
+    for (;;) {
+        sem_wait(&bio_async.sem);
+
+        mutex_acquire(&bio_async.lock);
+        bio_request_t *req = list_remove_head_type(&bio_async.queue, bio_request_t, node);
+        mutex_release(&bio_async.lock);
+
+        if (req)
+            bio_request_complete(req, bio_emulate_request(req));
+    }
+
+    return 0;
+}
+
+static void bio_async_init(uint level)
+{
+    sem_init(&bio_async.sem, 0);
+    bio_async.running = true;
+
+    thread_detach_and_resume(thread_create("bio async", &bio_async_worker, NULL,
+                                           DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
+}
+
+LK_INIT_HOOK(bio_async, &bio_async_init, LK_INIT_LEVEL_THREADING);
+
 static void bdev_inc_ref(bdev_t *dev)
 {
     LTRACEF("Add ref \"%s\" %d -> %d\n", dev->name, dev->ref, dev->ref + 1);
@@ -358,7 +509,7 @@ bdev_t *bio_open(const char *name)
 
     /* see if it's in our list */
     bdev_t *entry;
-    mutex_acquire(&bdevs.lock);
+    rwlock_acquire_read(&bdevs.lock);
     list_for_every_entry(&bdevs.list, entry, bdev_t, node) {
         DEBUG_ASSERT(entry->ref > 0);
         if (!strcmp(entry->name, name)) {
@@ -367,7 +518,7 @@ bdev_t *bio_open(const char *name)
             break;
         }
     }
-    mutex_release(&bdevs.lock);
+    rwlock_release_read(&bdevs.lock);
 
     return bdev;
 }
@@ -453,6 +604,43 @@ ssize_t bio_erase(bdev_t *dev, off_t offset, size_t len)
     return dev->erase(dev, offset, len);
 }
 
+ssize_t bio_write_zeroes(bdev_t *dev, off_t offset, size_t len)
+{
+    LTRACEF("dev '%s', offset %lld, len %zd\n", dev->name, offset, len);
+
+    DEBUG_ASSERT(dev && dev->ref > 0);
+
+    /* range check */
+    len = bio_trim_range(dev, offset, len);
+    if (len == 0)
+        return 0;
+
+    return dev->write_zeroes(dev, offset, len);
+}
+
+ssize_t bio_discard(bdev_t *dev, off_t offset, size_t len)
+{
+    LTRACEF("dev '%s', offset %lld, len %zd\n", dev->name, offset, len);
+
+    DEBUG_ASSERT(dev && dev->ref > 0);
+
+    /* range check */
+    len = bio_trim_range(dev, offset, len);
+    if (len == 0)
+        return 0;
+
+    return dev->discard(dev, offset, len);
+}
+
+status_t bio_flush(bdev_t *dev)
+{
+    LTRACEF("dev '%s'\n", dev->name);
+
+    DEBUG_ASSERT(dev && dev->ref > 0);
+
+    return dev->flush(dev);
+}
+
 int bio_ioctl(bdev_t *dev, int request, void *argp)
 {
     LTRACEF("dev '%s', request %08x, argp %p\n", dev->name, request, argp);
@@ -464,6 +652,85 @@ int bio_ioctl(bdev_t *dev, int request, void *argp)
     }
 }
 
+status_t bio_submit(bdev_t *dev, bio_request_t *req)
+{
+    LTRACEF("dev '%s', req %p, write %d, block %u, iov_count %u\n",
+            dev->name, req, req->write, req->block, req->iov_count);
+
+    DEBUG_ASSERT(dev && dev->ref > 0);
+    DEBUG_ASSERT(req);
+
+    if (!req->iov || req->iov_count == 0)
+        return ERR_INVALID_ARGS;
+
+    /* the whole request has to be blocks, and has to fit on the device */
+    uint count = 0;
+    for (uint i = 0; i < req->iov_count; i++) {
+        if (req->iov[i].len == 0 || (req->iov[i].len & (dev->block_size - 1)))
+            return ERR_INVALID_ARGS;
+        count += req->iov[i].len >> dev->block_shift;
+    }
+    if (bio_trim_block_range(dev, req->block, count) != count)
+        return ERR_OUT_OF_RANGE;
+
+    req->dev = dev;
+    req->count = count;
+    req->result = 0;
+    if (!req->callback)
+        event_init(&req->event, false, 0);
+
+    atomic_add(&dev->queue_depth, 1);
+
+    KEVLOG_BIO_SUBMIT(req, req->block);
+
+    status_t err = bio_submit_lower(dev, req);
+    if (err < 0) {
+        atomic_add(&dev->queue_depth, -1);
+        if (!req->callback)
+            event_destroy(&req->event);
+    }
+
+    return err;
+}
+
+void bio_request_complete(bio_request_t *req, ssize_t result)
+{
+    LTRACEF("req %p, result %ld\n", req, (long)result);
+
+    req->result = result;
+    atomic_add(&req->dev->queue_depth, -1);
+
+    KEVLOG_BIO_COMPLETE(req, result);
+
+    /* the request belongs to the caller again after this */
+    if (req->callback)
+        req->callback(req);
+    else
+        event_signal(&req->event, false);
+}
+
+void bio_request_complete_status(void *arg, status_t err)
+{
+    bio_request_t *req = (bio_request_t *)arg;
+
+    bio_request_complete(req, (err < 0) ? err : (ssize_t)(req->count * req->dev->block_size));
+}
+
+ssize_t bio_request_wait(bio_request_t *req)
+{
+    DEBUG_ASSERT(!req->callback);
+
+    event_wait(&req->event);
+    event_destroy(&req->event);
+
+    return req->result;
+}
+
+uint bio_queue_depth(bdev_t *dev)
+{
+    return dev->queue_depth;
+}
+
 void bio_initialize_bdev(bdev_t *dev,
                          const char *name,
                          size_t block_size,
@@ -489,6 +756,9 @@ void bio_initialize_bdev(bdev_t *dev,
     dev->erase_byte = 0;
     dev->ref = 0;
     dev->flags = flags;
+    dev->queue_depth = 0;
+    dev->max_queue_depth = 1;
+    dev->queue = NULL;
 
 #if DEBUG
     // If we have been supplied information about our erase geometry, sanity
@@ -537,6 +807,10 @@ void bio_initialize_bdev(bdev_t *dev,
     dev->write = bio_default_write;
     dev->write_block = bio_default_write_block;
     dev->erase = bio_default_erase;
+    dev->write_zeroes = bio_default_write_zeroes;
+    dev->discard = bio_default_discard;
+    dev->flush = bio_default_flush;
+    dev->submit = bio_default_submit;
     dev->close = NULL;
 }
 
@@ -548,9 +822,9 @@ void bio_register_device(bdev_t *dev)
 
     bdev_inc_ref(dev);
 
-    mutex_acquire(&bdevs.lock);
+    rwlock_acquire_write(&bdevs.lock);
     list_add_tail(&bdevs.list, &dev->node);
-    mutex_release(&bdevs.lock);
+    rwlock_release_write(&bdevs.lock);
 }
 
 void bio_unregister_device(bdev_t *dev)
@@ -560,9 +834,9 @@ void bio_unregister_device(bdev_t *dev)
     LTRACEF(" '%s'\n", dev->name);
 
     // remove it from the list
-    mutex_acquire(&bdevs.lock);
+    rwlock_acquire_write(&bdevs.lock);
     list_delete(&dev->node);
-    mutex_release(&bdevs.lock);
+    rwlock_release_write(&bdevs.lock);
 
     bdev_dec_ref(dev); // remove the ref the list used to have
 }
@@ -571,11 +845,12 @@ void bio_dump_devices(void)
 {
     printf("block devices:\n");
     bdev_t *entry;
-    mutex_acquire(&bdevs.lock);
+    rwlock_acquire_read(&bdevs.lock);
     list_for_every_entry(&bdevs.list, entry, bdev_t, node) {
 
-        printf("\t%s, size %lld, bsize %zd, ref %d",
-               entry->name, entry->total_size, entry->block_size, entry->ref);
+        printf("\t%s, size %lld, bsize %zd, ref %d, queue %d/%u",
+               entry->name, entry->total_size, entry->block_size, entry->ref,
+               entry->queue_depth, entry->max_queue_depth);
 
         if (!entry->geometry_count || !entry->geometry) {
             printf(" (no erase geometry)\n");
@@ -590,5 +865,5 @@ void bio_dump_devices(void)
 
         printf("\n");
     }
-    mutex_release(&bdevs.lock);
+    rwlock_release_read(&bdevs.lock);
 }
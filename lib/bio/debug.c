@@ -35,6 +35,9 @@
 #if WITH_LIB_CKSUM
 #include <lib/cksum.h>
 #endif
+#if WITH_LIB_BCACHE
+#include <lib/bcache.h>
+#endif
 
 #define DMA_ALIGNMENT (CACHE_LINE)
 #define THREE_BYTE_ADDR_BOUNDARY (16777216)
@@ -50,6 +53,207 @@ STATIC_COMMAND_START
 STATIC_COMMAND("bio", "block io debug commands", &cmd_bio)
 STATIC_COMMAND_END(bio);
 
+/*
+ * bio bench: time a stream of reads or writes, sequential or random, at a
+ * given transfer size and number of requests in flight, optionally through
+ * a block cache.
+ */
+#define BENCH_DEFAULT_BYTES (16 * 1024 * 1024)
+#define BENCH_CACHE_BLOCKS  (256)
+
+struct bio_bench_slot {
+    bio_request_t req;
+    bio_iovec_t iov;
+    event_t done_event;
+    lk_time_ns_t start;
+    lk_time_ns_t done;
+};
+
+static void bio_bench_callback(bio_request_t *req)
+{
+    struct bio_bench_slot *slot = req->arg;
+
+    slot->done = current_time_ns();
+    event_signal(&slot->done_event, false);
+}
+
+static int bio_bench_cmp(const void *a, const void *b)
+{
+    lk_time_ns_t x = *(const lk_time_ns_t *)a;
+    lk_time_ns_t y = *(const lk_time_ns_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static bnum_t bio_bench_next_block(bnum_t i, bool random, uint32_t *seed, bnum_t chunks, uint blocks_per_io)
+{
+    if (random) {
+        *seed = *seed * 1664525 + 1013904223;
+        i = (*seed >> 4) % chunks;
+    } else {
+        i %= chunks;
+    }
+    return i * blocks_per_io;
+}
+
+static int bio_bench(bdev_t *dev, bool write, bool random, size_t io_size, uint depth,
+                     uint64_t total, bool cached)
+{
+    if (io_size == 0)
+        io_size = dev->block_size;
+    if (depth == 0)
+        depth = 1;
+    if (io_size & (dev->block_size - 1)) {
+        printf("transfer size must be a multiple of the block size (%zu)\n", dev->block_size);
+        return ERR_INVALID_ARGS;
+    }
+
+    uint blocks_per_io = io_size >> dev->block_shift;
+    bnum_t chunks = dev->block_count / blocks_per_io;
+    if (chunks == 0) {
+        printf("transfer size larger than the device\n");
+        return ERR_INVALID_ARGS;
+    }
+    if (total == 0)
+        total = MIN((uint64_t)BENCH_DEFAULT_BYTES, (uint64_t)chunks * io_size);
+    uint count = MAX(total / io_size, 1u);
+
+#if WITH_LIB_BCACHE
+    bcache_t cache = NULL;
+    if (cached) {
+        if (write) {
+            printf("cached benchmarks are read only\n");
+            return ERR_NOT_SUPPORTED;
+        }
+        cache = bcache_create(dev, dev->block_size, BENCH_CACHE_BLOCKS);
+        if (!cache)
+            return ERR_NO_MEMORY;
+        depth = 1;
+    }
+#else
+    if (cached) {
+        printf("no block cache in this build\n");
+        return ERR_NOT_SUPPORTED;
+    }
+#endif
+
+    struct bio_bench_slot *slots = calloc(depth, sizeof(*slots));
+    lk_time_ns_t *lat = malloc(count * sizeof(lk_time_ns_t));
+    uint8_t *buf = memalign(DMA_ALIGNMENT, io_size * depth);
+    int rc = NO_ERROR;
+    if (!slots || !lat || !buf) {
+        rc = ERR_NO_MEMORY;
+        goto out;
+    }
+    memset(buf, 0x5a, io_size * depth);
+
+    printf("%s %s %s, %zu byte transfers, depth %u, %u transfers%s\n", dev->name,
+           random ? "random" : "sequential", write ? "write" : "read",
+           io_size, depth, count, cached ? ", cached" : "");
+
+    uint32_t seed = 1;
+    uint submitted = 0;
+    uint completed = 0;
+    lk_time_ns_t t = current_time_ns();
+
+    if (depth == 1) {
+        /* plain synchronous calls, the way most callers use the device */
+        for (; completed < count; completed++) {
+            bnum_t block = bio_bench_next_block(completed, random, &seed, chunks, blocks_per_io);
+            lk_time_ns_t start = current_time_ns();
+            ssize_t err;
+#if WITH_LIB_BCACHE
+            if (cache) {
+                err = 0;
+                for (uint i = 0; i < blocks_per_io && err >= 0; i++)
+                    err = bcache_read_block(cache, buf + i * dev->block_size, block + i);
+                if (err >= 0)
+                    err = io_size;
+            } else
+#endif
+            if (write)
+                err = bio_write_block(dev, buf, block, blocks_per_io);
+            else
+                err = bio_read_block(dev, buf, block, blocks_per_io);
+            lat[completed] = current_time_ns() - start;
+
+            if (err != (ssize_t)io_size) {
+                printf("transfer at block %u failed (%ld)\n", block, (long)err);
+                rc = err < 0 ? err : ERR_IO;
+                break;
+            }
+        }
+    } else {
+        /* keep depth requests in flight, reaping them in submission order */
+        for (uint i = 0; i < depth; i++)
+            event_init(&slots[i].done_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+        while (completed < count) {
+            while (submitted < count && submitted - completed < depth) {
+                struct bio_bench_slot *slot = &slots[submitted % depth];
+
+                slot->iov.base = buf + (submitted % depth) * io_size;
+                slot->iov.len = io_size;
+                slot->req.write = write;
+                slot->req.block = bio_bench_next_block(submitted, random, &seed, chunks, blocks_per_io);
+                slot->req.iov = &slot->iov;
+                slot->req.iov_count = 1;
+                slot->req.callback = bio_bench_callback;
+                slot->req.arg = slot;
+                slot->start = current_time_ns();
+
+                status_t err = bio_submit(dev, &slot->req);
+                if (err < 0) {
+                    printf("submit failed (%d)\n", err);
+                    rc = err;
+                    count = submitted;
+                    break;
+                }
+                submitted++;
+            }
+            if (completed == submitted)
+                break;
+
+            struct bio_bench_slot *slot = &slots[completed % depth];
+            event_wait(&slot->done_event);
+            lat[completed] = slot->done - slot->start;
+
+            if (slot->req.result != (ssize_t)io_size) {
+                printf("transfer at block %u failed (%ld)\n", slot->req.block, (long)slot->req.result);
+                rc = slot->req.result < 0 ? slot->req.result : ERR_IO;
+                count = submitted;
+            }
+            completed++;
+        }
+
+        for (uint i = 0; i < depth; i++)
+            event_destroy(&slots[i].done_event);
+    }
+
+    lk_time_ns_t elapsed = current_time_ns() - t;
+
+    if (completed > 0 && elapsed > 0) {
+        qsort(lat, completed, sizeof(lk_time_ns_t), bio_bench_cmp);
+
+        uint64_t bytes = (uint64_t)completed * io_size;
+        printf("%u IOPS, %llu KB/s\n", (uint)(completed * 1000000000ULL / elapsed),
+               bytes * 1000000000ULL / 1024 / elapsed);
+        printf("latency usecs: min %llu p50 %llu p99 %llu max %llu\n",
+               lat[0] / 1000, lat[completed / 2] / 1000,
+               lat[(completed * 99) / 100] / 1000, lat[completed - 1] / 1000);
+    }
+
+out:
+#if WITH_LIB_BCACHE
+    if (cache)
+        bcache_destroy(cache);
+#endif
+    free(buf);
+    free(lat);
+    free(slots);
+    return rc;
+}
+
 static int cmd_bio(int argc, const cmd_args *argv)
 {
     int rc = 0;
@@ -66,6 +270,7 @@ usage:
         printf("%s ioctl <device> <request> <arg>\n", argv[0].str);
         printf("%s remove <device>\n", argv[0].str);
         printf("%s test <device>\n", argv[0].str);
+        printf("%s bench <device> <read|write|randread|randwrite> [size] [depth] [bytes] [cached]\n", argv[0].str);
 #if WITH_LIB_PARTITION
         printf("%s partscan <device> [offset]\n", argv[0].str);
 #endif
@@ -223,6 +428,30 @@ usage:
         bio_close(dev);
 
         rc = err;
+    } else if (!strcmp(argv[1].str, "bench")) {
+        if (argc < 4) goto notenoughargs;
+
+        const char *mode = argv[3].str;
+        bool random = !strncmp(mode, "rand", 4);
+        if (random)
+            mode += 4;
+        if (strcmp(mode, "read") && strcmp(mode, "write")) {
+            printf("unknown mode %s\n", argv[3].str);
+            goto usage;
+        }
+
+        bdev_t *dev = bio_open(argv[2].str);
+        if (!dev) {
+            printf("error opening block device\n");
+            return -1;
+        }
+
+        rc = bio_bench(dev, !strcmp(mode, "write"), random,
+                       (argc > 4) ? argv[4].u : 0,
+                       (argc > 5) ? argv[5].u : 1,
+                       (argc > 6) ? argv[6].u : 0,
+                       (argc > 7) && !strcmp(argv[7].str, "cached"));
+        bio_close(dev);
 #if WITH_LIB_PARTITION
     } else if (!strcmp(argv[1].str, "partscan")) {
         if (argc < 3) goto notenoughargs;
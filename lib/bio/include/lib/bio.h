@@ -25,6 +25,7 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <list.h>
+#include <kernel/event.h>
 
 __BEGIN_CDECLS;
 
@@ -41,6 +42,44 @@ typedef struct bio_erase_geometry_info {
     size_t erase_shift;
 } bio_erase_geometry_info_t;
 
+/* a piece of the buffer of an asynchronous request, a whole number of blocks long */
+typedef struct bio_iovec {
+    void *base;
+    size_t len;
+} bio_iovec_t;
+
+struct bdev;
+struct bio_request;
+struct bio_queue;
+
+/* completion routine, may be called in interrupt context */
+typedef void (*bio_request_callback_t)(struct bio_request *req);
+
+/*
+ * An asynchronous block transfer. The caller owns the request and the buffers
+ * until it completes. Completion either calls the callback or, if there isn't
+ * one, signals the request's event for bio_request_wait().
+ */
+typedef struct bio_request {
+    /* filled in by the caller. block is rewritten as the request passes through subdevices */
+    bool write;
+    bnum_t block;
+    const bio_iovec_t *iov;
+    uint iov_count;
+    bio_request_callback_t callback;
+    void *arg;
+
+    /* bytes transferred or an error, valid once complete */
+    ssize_t result;
+
+    /* private to bio and the driver */
+    struct bdev *dev;       /* the device it was submitted to */
+    struct bdev *target;    /* the device emulating it, below any subdevices */
+    uint count;
+    struct list_node node;
+    event_t event;
+} bio_request_t;
+
 typedef struct bdev {
     struct list_node node;
     volatile int ref;
@@ -60,13 +99,24 @@ typedef struct bdev {
 
     uint32_t flags;
 
+    /* asynchronous requests in flight, and how many the device can usefully overlap */
+    volatile int queue_depth;
+    uint max_queue_depth;
+
+    /* optional request queue in front of submit */
+    struct bio_queue *queue;
+
     /* function pointers */
     ssize_t (*read)(struct bdev *, void *buf, off_t offset, size_t len);
     ssize_t (*read_block)(struct bdev *, void *buf, bnum_t block, uint count);
     ssize_t (*write)(struct bdev *, const void *buf, off_t offset, size_t len);
     ssize_t (*write_block)(struct bdev *, const void *buf, bnum_t block, uint count);
     ssize_t (*erase)(struct bdev *, off_t offset, size_t len);
+    ssize_t (*write_zeroes)(struct bdev *, off_t offset, size_t len);
+    ssize_t (*discard)(struct bdev *, off_t offset, size_t len);
+    status_t (*flush)(struct bdev *);
     int (*ioctl)(struct bdev *, int request, void *argp);
+    status_t (*submit)(struct bdev *, bio_request_t *req);
     void (*close)(struct bdev *);
 } bdev_t;
 
@@ -78,8 +128,48 @@ ssize_t bio_read_block(bdev_t *dev, void *buf, bnum_t block, uint count);
 ssize_t bio_write(bdev_t *dev, const void *buf, off_t offset, size_t len);
 ssize_t bio_write_block(bdev_t *dev, const void *buf, bnum_t block, uint count);
 ssize_t bio_erase(bdev_t *dev, off_t offset, size_t len);
+ssize_t bio_write_zeroes(bdev_t *dev, off_t offset, size_t len);
+ssize_t bio_discard(bdev_t *dev, off_t offset, size_t len); /* contents of the range are undefined after */
+status_t bio_flush(bdev_t *dev); /* make completed writes durable */
 int bio_ioctl(bdev_t *dev, int request, void *argp);
 
+/* asynchronous api */
+status_t bio_submit(bdev_t *dev, bio_request_t *req);
+ssize_t bio_request_wait(bio_request_t *req);
+uint bio_queue_depth(bdev_t *dev);
+
+/*
+ * put a request queue in front of a device's submit hook, merging contiguous
+ * requests and holding them back past max_inflight (0 for the device's
+ * max_queue_depth). sorting dispatches in block order, for media that care.
+ */
+#define BIO_QUEUE_FLAG_SORT (1 << 0)
+
+status_t bio_queue_attach(bdev_t *dev, uint max_inflight, uint flags);
+
+/*
+ * stream data onto erasable media. the region from offset is erased a sector at
+ * a time in the background, skipping sectors that are already blank, while
+ * bio_program_write appends data from offset and waits only for the sectors it
+ * touches. finish waits for the rest of the region and returns the first error.
+ */
+#define BIO_PROGRAM_FLAG_VERIFY (1 << 0) /* read back and compare each write */
+
+typedef struct bio_program bio_program_t;
+
+status_t bio_program_start(bdev_t *dev, off_t offset, size_t erase_len, uint flags,
+                           bio_program_t **prog);
+ssize_t bio_program_write(bio_program_t *prog, const void *buf, size_t len);
+status_t bio_program_finish(bio_program_t *prog);
+void bio_program_abort(bio_program_t *prog);
+
+/* called by drivers as each submitted request finishes */
+void bio_request_complete(bio_request_t *req, ssize_t result);
+
+/* the same, shaped as a (void *arg, status_t err) completion callback with the
+ * request as arg, for transfers that either move the whole request or fail */
+void bio_request_complete_status(void *req, status_t err);
+
 /* register a block device */
 void bio_register_device(bdev_t *dev);
 void bio_unregister_device(bdev_t *dev);
@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <debug.h>
+#include <assert.h>
+#include <err.h>
+#include <trace.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lib/bio.h>
+#include <kernel/event.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+
+#define LOCAL_TRACE 0
+
+/*
+ * Streaming programming of erasable media. A thread walks the region a sector
+ * at a time ahead of the writer, reading each sector first and only erasing it
+ * if it isn't already blank. Writes wait until the sectors under them are done,
+ * so erasing overlaps with whatever produces the data, and with programming
+ * the previous sector on devices that can do both at once.
+ */
+
+/* bytes read at a time while checking sectors are blank and verifying writes */
+#define BIO_PROGRAM_CHUNK (4 * 1024)
+
+#define DMA_ALIGNMENT (CACHE_LINE)
+
+struct bio_program {
+    bdev_t *dev;
+    uint flags;
+    off_t pos;      /* where the next write goes */
+    off_t end;      /* end of the region being erased */
+
+    uint8_t *erase_buf;
+    uint8_t *verify_buf;
+    size_t chunk;
+
+    /* protects erased and err, the erase thread signals event as erased advances */
+    spin_lock_t lock;
+    off_t erased;
+    status_t err;
+    volatile bool abort;
+    event_t event;
+    thread_t *thread;
+
+    /* stats for the caller, sectors erased and sectors found blank */
+    uint erase_count;
+    uint skip_count;
+};
+
+/* erase size of the sector at pos, or 0 if the device doesn't need erasing there */
+static size_t erase_size_at(const bdev_t *dev, off_t pos)
+{
+    for (size_t i = 0; i < dev->geometry_count; i++) {
+        const bio_erase_geometry_info_t *geo = &dev->geometry[i];
+        if (pos >= geo->start && pos < geo->start + geo->size)
+            return geo->erase_size;
+    }
+    return 0;
+}
+
+/* start of the first erase region past pos, or end if there isn't one before it */
+static off_t next_region(const bdev_t *dev, off_t pos, off_t end)
+{
+    for (size_t i = 0; i < dev->geometry_count; i++) {
+        const bio_erase_geometry_info_t *geo = &dev->geometry[i];
+        if (geo->start > pos && geo->start < end)
+            end = geo->start;
+    }
+    return end;
+}
+
+static bool range_is_blank(bio_program_t *prog, off_t pos, size_t len)
+{
+    bdev_t *dev = prog->dev;
+
+    while (len > 0) {
+        size_t toread = MIN(len, prog->chunk);
+        if (bio_read(dev, prog->erase_buf, pos, toread) != (ssize_t)toread)
+            return false;
+
+        for (size_t i = 0; i < toread; i++) {
+            if (prog->erase_buf[i] != dev->erase_byte)
+                return false;
+        }
+
+        pos += toread;
+        len -= toread;
+    }
+
+    return true;
+}
+
+static void set_erased(bio_program_t *prog, off_t erased, status_t err)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&prog->lock, state);
+    prog->erased = erased;
+    if (prog->err == NO_ERROR)
+        prog->err = err;
+    spin_unlock_irqrestore(&prog->lock, state);
+
+    event_signal(&prog->event, true);
+}
+
+static int bio_program_erase_thread(void *arg)
+{
+    bio_program_t *prog = arg;
+    bdev_t *dev = prog->dev;
+    off_t pos = prog->erased;
+
+    while (pos < prog->end && !prog->abort) {
+        size_t size = erase_size_at(dev, pos);
+        if (size == 0) {
+            /* nothing to erase here, writes can go straight through */
+            pos = next_region(dev, pos, prog->end);
+            set_erased(prog, pos, NO_ERROR);
+            continue;
+        }
+
+        /* reading a sector is much cheaper than erasing it, so check first */
+        if (range_is_blank(prog, pos, size)) {
+            LTRACEF("sector %lld blank\n", pos);
+            prog->skip_count++;
+        } else {
+            LTRACEF("erasing sector %lld\n", pos);
+            ssize_t err = bio_erase(dev, pos, size);
+            if (err != (ssize_t)size) {
+                set_erased(prog, pos, (err < 0) ? (status_t)err : ERR_IO);
+                return 0;
+            }
+            prog->erase_count++;
+        }
+
+        pos += size;
+        set_erased(prog, pos, NO_ERROR);
+    }
+
+    return 0;
+}
+
+status_t bio_program_start(bdev_t *dev, off_t offset, size_t erase_len, uint flags,
+                           bio_program_t **out)
+{
+    LTRACEF("dev '%s', offset %lld, erase_len %zu, flags 0x%x\n", dev->name, offset, erase_len, flags);
+
+    DEBUG_ASSERT(dev && dev->ref > 0);
+    DEBUG_ASSERT(out);
+
+    erase_len = bio_trim_range(dev, offset, erase_len);
+
+    /* the region has to start and end on sector boundaries */
+    size_t size = erase_size_at(dev, offset);
+    if (size && (offset & (size - 1)))
+        return ERR_INVALID_ARGS;
+    size = erase_len ? erase_size_at(dev, offset + erase_len - 1) : 0;
+    if (size && ((offset + erase_len) & (size - 1)))
+        return ERR_INVALID_ARGS;
+
+    bio_program_t *prog = calloc(1, sizeof(*prog));
+    if (!prog)
+        return ERR_NO_MEMORY;
+
+    prog->dev = dev;
+    prog->flags = flags;
+    prog->pos = offset;
+    prog->end = offset + erase_len;
+    prog->erased = offset;
+    prog->chunk = ROUNDUP(BIO_PROGRAM_CHUNK, dev->block_size);
+    prog->lock = SPIN_LOCK_INITIAL_VALUE;
+    event_init(&prog->event, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+    prog->erase_buf = memalign(DMA_ALIGNMENT, prog->chunk);
+    if (flags & BIO_PROGRAM_FLAG_VERIFY)
+        prog->verify_buf = memalign(DMA_ALIGNMENT, prog->chunk);
+    if (!prog->erase_buf || ((flags & BIO_PROGRAM_FLAG_VERIFY) && !prog->verify_buf)) {
+        bio_program_abort(prog);
+        return ERR_NO_MEMORY;
+    }
+
+    if (dev->geometry_count == 0) {
+        /* plain block device, nothing to erase */
+        prog->erased = prog->end;
+    } else {
+        prog->thread = thread_create("bio_program", &bio_program_erase_thread, prog,
+                                     DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        if (!prog->thread) {
+            bio_program_abort(prog);
+            return ERR_NO_MEMORY;
+        }
+        thread_resume(prog->thread);
+    }
+
+    *out = prog;
+    return NO_ERROR;
+}
+
+/* wait for the erase thread to get past end, returns the first error it hit */
+static status_t wait_erased(bio_program_t *prog, off_t end)
+{
+    for (;;) {
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&prog->lock, state);
+        off_t erased = prog->erased;
+        status_t err = prog->err;
+        spin_unlock_irqrestore(&prog->lock, state);
+
+        if (err < 0)
+            return err;
+        if (erased >= MIN(end, prog->end))
+            return NO_ERROR;
+
+        event_wait(&prog->event);
+    }
+}
+
+static status_t verify(bio_program_t *prog, const uint8_t *buf, off_t pos, size_t len)
+{
+    while (len > 0) {
+        size_t toread = MIN(len, prog->chunk);
+        if (bio_read(prog->dev, prog->verify_buf, pos, toread) != (ssize_t)toread)
+            return ERR_IO;
+        if (memcmp(prog->verify_buf, buf, toread))
+            return ERR_CHECKSUM_FAIL;
+
+        buf += toread;
+        pos += toread;
+        len -= toread;
+    }
+
+    return NO_ERROR;
+}
+
+ssize_t bio_program_write(bio_program_t *prog, const void *buf, size_t len)
+{
+    LTRACEF("prog %p, pos %lld, len %zu\n", prog, prog->pos, len);
+
+    DEBUG_ASSERT(prog);
+    DEBUG_ASSERT(buf);
+
+    status_t err = wait_erased(prog, prog->pos + len);
+    if (err < 0)
+        return err;
+
+    ssize_t written = bio_write(prog->dev, buf, prog->pos, len);
+    if (written < 0)
+        return written;
+
+    if (prog->verify_buf) {
+        err = verify(prog, buf, prog->pos, written);
+        if (err < 0)
+            return err;
+    }
+
+    prog->pos += written;
+    return written;
+}
+
+static status_t program_close(bio_program_t *prog, bool abort)
+{
+    DEBUG_ASSERT(prog);
+
+    status_t err = prog->err;
+    if (prog->thread) {
+        prog->abort = abort;
+        thread_join(prog->thread, NULL, INFINITE_TIME);
+        err = prog->err;
+
+        LTRACEF("erased %u sectors, skipped %u blank ones\n", prog->erase_count, prog->skip_count);
+    }
+
+    event_destroy(&prog->event);
+    free(prog->erase_buf);
+    free(prog->verify_buf);
+    free(prog);
+
+    return err;
+}
+
+status_t bio_program_finish(bio_program_t *prog)
+{
+    return program_close(prog, false);
+}
+
+void bio_program_abort(bio_program_t *prog)
+{
+    program_close(prog, true);
+}
@@ -0,0 +1,307 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <debug.h>
+#include <assert.h>
+#include <err.h>
+#include <trace.h>
+#include <stdlib.h>
+#include <string.h>
+#include <list.h>
+#include <lib/bio.h>
+#include <kernel/event.h>
+#include <kernel/mutex.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include "bio_priv.h"
+
+#define LOCAL_TRACE 0
+
+/*
+ * A request queue sits between bio_submit and a device's submit hook. Requests
+ * wait on the queue while the device has max_inflight of them outstanding, and
+ * as they're dispatched any that continue where the last one ends are merged
+ * onto it. With BIO_QUEUE_FLAG_SORT the pending requests are kept in block
+ * order and dispatched in one sweep across the device, wrapping to the lowest
+ * block at the end.
+ *
+ * Dispatch and completion of the original requests both happen on the queue's
+ * thread, so devices can complete in irq context and still block on submit.
+ */
+
+/* limits on a merged request */
+#define BIO_QUEUE_MERGE_MAX_IOV   64
+#define BIO_QUEUE_MERGE_MAX_BYTES (1024*1024)
+
+struct bio_queue {
+    bdev_t *dev;
+    uint max_inflight;
+    uint flags;
+
+    /* protects pending, inflight and next_block */
+    mutex_t lock;
+    struct list_node pending;
+    uint inflight;
+    bnum_t next_block;
+
+    /* merged requests the device has finished with, filled at irq time */
+    spin_lock_t done_lock;
+    struct list_node done;
+
+    event_t event;
+    thread_t *thread;
+};
+
+/* what actually goes to the device, covering one or more original requests */
+struct bio_queue_io {
+    bio_request_t req;
+    struct list_node node;
+    struct bio_queue *q;
+    struct list_node reqs;
+    bio_iovec_t iov[];
+};
+
+static void bio_queue_io_done(bio_request_t *req)
+{
+    struct bio_queue_io *io = containerof(req, struct bio_queue_io, req);
+    struct bio_queue *q = io->q;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&q->done_lock, state);
+    list_add_tail(&q->done, &io->node);
+    spin_unlock_irqrestore(&q->done_lock, state);
+
+    event_signal(&q->event, false);
+}
+
+/* hand each original its share of the merged result */
+static void bio_queue_io_finish(struct bio_queue_io *io, ssize_t result)
+{
+    bio_request_t *req;
+
+    while ((req = list_remove_head_type(&io->reqs, bio_request_t, node))) {
+        ssize_t len = (ssize_t)req->count * io->q->dev->block_size;
+
+        if (result < 0) {
+            bio_request_complete(req, result);
+        } else {
+            bio_request_complete(req, MIN(len, result));
+            result -= MIN(len, result);
+        }
+    }
+
+    free(io);
+}
+
+/* pick the next request to send, along the sweep if sorting */
+static bio_request_t *bio_queue_next(struct bio_queue *q)
+{
+    bio_request_t *req;
+
+    if (q->flags & BIO_QUEUE_FLAG_SORT) {
+        list_for_every_entry(&q->pending, req, bio_request_t, node) {
+            if (req->block >= q->next_block)
+                return req;
+        }
+    }
+
+    return list_peek_head_type(&q->pending, bio_request_t, node);
+}
+
+/* find a pending request of the same direction starting at block */
+static bio_request_t *bio_queue_find_merge(struct bio_queue *q, bool write, bnum_t block)
+{
+    bio_request_t *req;
+
+    list_for_every_entry(&q->pending, req, bio_request_t, node) {
+        if (req->write == write && req->block == block)
+            return req;
+        /* sorted, so nothing further along can start there */
+        if ((q->flags & BIO_QUEUE_FLAG_SORT) && req->block > block)
+            break;
+    }
+
+    return NULL;
+}
+
+/* pull the next run of contiguous requests off the queue, called with the lock held */
+static struct bio_queue_io *bio_queue_build(struct bio_queue *q)
+{
+    bio_request_t *first = bio_queue_next(q);
+    if (!first)
+        return NULL;
+
+    /* size it for the most a merge can take, give or take the first request */
+    uint iov_max = MAX(first->iov_count, BIO_QUEUE_MERGE_MAX_IOV);
+    struct bio_queue_io *io = malloc(sizeof(*io) + sizeof(bio_iovec_t) * iov_max);
+    if (!io)
+        return NULL;
+
+    io->q = q;
+    list_initialize(&io->reqs);
+
+    uint iov_count = 0;
+    uint count = 0;
+    bio_request_t *req = first;
+    do {
+        list_delete(&req->node);
+        list_add_tail(&io->reqs, &req->node);
+        memcpy(&io->iov[iov_count], req->iov, sizeof(bio_iovec_t) * req->iov_count);
+        iov_count += req->iov_count;
+        count += req->count;
+
+        req = bio_queue_find_merge(q, first->write, first->block + count);
+    } while (req && iov_count + req->iov_count <= iov_max &&
+             ((size_t)(count + req->count) << q->dev->block_shift) <= BIO_QUEUE_MERGE_MAX_BYTES);
+
+    LTRACEF("block %u, count %u, iov_count %u\n", first->block, count, iov_count);
+
+    memset(&io->req, 0, sizeof(io->req));
+    io->req.write = first->write;
+    io->req.block = first->block;
+    io->req.iov = io->iov;
+    io->req.iov_count = iov_count;
+    io->req.callback = bio_queue_io_done;
+    io->req.dev = q->dev;
+    io->req.count = count;
+
+    q->next_block = first->block + count;
+    q->inflight++;
+
+    return io;
+}
+
+static int bio_queue_thread(void *arg)
+{
+    struct bio_queue *q = arg;
+
+    for (;;) {
+        event_wait(&q->event);
+
+        /* finish off whatever the device has completed */
+        for (;;) {
+            struct bio_queue_io *io;
+
+            spin_lock_saved_state_t state;
+            spin_lock_irqsave(&q->done_lock, state);
+            io = list_remove_head_type(&q->done, struct bio_queue_io, node);
+            spin_unlock_irqrestore(&q->done_lock, state);
+
+            if (!io)
+                break;
+
+            mutex_acquire(&q->lock);
+            q->inflight--;
+            mutex_release(&q->lock);
+
+            bio_queue_io_finish(io, io->req.result);
+        }
+
+        /* and keep the device busy */
+        for (;;) {
+            struct bio_queue_io *io = NULL;
+
+            mutex_acquire(&q->lock);
+            if (q->inflight < q->max_inflight)
+                io = bio_queue_build(q);
+            mutex_release(&q->lock);
+
+            if (!io)
+                break;
+
+            /* counted against the device like any other request */
+            atomic_add(&q->dev->queue_depth, 1);
+
+            status_t err = q->dev->submit(q->dev, &io->req);
+            if (err < 0) {
+                atomic_add(&q->dev->queue_depth, -1);
+
+                mutex_acquire(&q->lock);
+                q->inflight--;
+                mutex_release(&q->lock);
+
+                bio_queue_io_finish(io, err);
+            }
+        }
+    }
+
+    return 0;
+}
+
+status_t bio_queue_add(struct bio_queue *q, bio_request_t *req)
+{
+    LTRACEF("q %p, req %p, block %u, count %u\n", q, req, req->block, req->count);
+
+    mutex_acquire(&q->lock);
+
+    if (q->flags & BIO_QUEUE_FLAG_SORT) {
+        /* after any others on the same block, so requests to it stay in order */
+        bio_request_t *entry;
+        list_for_every_entry(&q->pending, entry, bio_request_t, node) {
+            if (entry->block > req->block)
+                break;
+        }
+        list_add_before(&entry->node, &req->node);
+    } else {
+        list_add_tail(&q->pending, &req->node);
+    }
+
+    mutex_release(&q->lock);
+
+    event_signal(&q->event, true);
+
+    return NO_ERROR;
+}
+
+status_t bio_queue_attach(bdev_t *dev, uint max_inflight, uint flags)
+{
+    LTRACEF("dev '%s', max_inflight %u, flags 0x%x\n", dev->name, max_inflight, flags);
+
+    DEBUG_ASSERT(dev);
+    DEBUG_ASSERT(!dev->queue);
+
+    struct bio_queue *q = calloc(1, sizeof(struct bio_queue));
+    if (!q)
+        return ERR_NO_MEMORY;
+
+    q->dev = dev;
+    q->max_inflight = max_inflight ? max_inflight : MAX(dev->max_queue_depth, 1u);
+    q->flags = flags;
+    mutex_init(&q->lock);
+    list_initialize(&q->pending);
+    q->done_lock = SPIN_LOCK_INITIAL_VALUE;
+    list_initialize(&q->done);
+    event_init(&q->event, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+    char name[32];
+    snprintf(name, sizeof(name), "bioq %s", dev->name);
+    q->thread = thread_create(name, &bio_queue_thread, q, HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+    if (!q->thread) {
+        free(q);
+        return ERR_NO_MEMORY;
+    }
+    thread_detach_and_resume(q->thread);
+
+    dev->queue = q;
+
+    return NO_ERROR;
+}
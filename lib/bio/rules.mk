@@ -6,6 +6,8 @@ MODULE_SRCS += \
 	$(LOCAL_DIR)/bio.c \
 	$(LOCAL_DIR)/debug.c \
 	$(LOCAL_DIR)/mem.c \
+	$(LOCAL_DIR)/program.c \
+	$(LOCAL_DIR)/queue.c \
 	$(LOCAL_DIR)/subdev.c 
 
 include make/module.mk
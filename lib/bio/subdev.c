@@ -25,6 +25,7 @@
 #include <trace.h>
 #include <stdlib.h>
 #include <lib/bio.h>
+#include "bio_priv.h"
 
 #define LOCAL_TRACE 0
 
@@ -78,6 +79,51 @@ static ssize_t subdev_erase(struct bdev *_dev, off_t offset, size_t len)
     return bio_erase(subdev->parent, offset + subdev->offset * subdev->dev.block_size, len);
 }
 
+static ssize_t subdev_write_zeroes(struct bdev *_dev, off_t offset, size_t len)
+{
+    subdev_t *subdev = (subdev_t *)_dev;
+
+    return bio_write_zeroes(subdev->parent, offset + subdev->offset * subdev->dev.block_size, len);
+}
+
+static ssize_t subdev_discard(struct bdev *_dev, off_t offset, size_t len)
+{
+    subdev_t *subdev = (subdev_t *)_dev;
+
+    return bio_discard(subdev->parent, offset + subdev->offset * subdev->dev.block_size, len);
+}
+
+static status_t subdev_flush(struct bdev *_dev)
+{
+    subdev_t *subdev = (subdev_t *)_dev;
+
+    return bio_flush(subdev->parent);
+}
+
+static int subdev_ioctl(struct bdev *_dev, int request, void *argp)
+{
+    subdev_t *subdev = (subdev_t *)_dev;
+
+    int err = bio_ioctl(subdev->parent, request, argp);
+
+    /* maps of the parent start at its first block, move them to ours */
+    if (err >= 0 && argp && *(void **)argp &&
+            (request == BIO_IOCTL_GET_MEM_MAP || request == BIO_IOCTL_GET_MAP_ADDR)) {
+        *(uint8_t **)argp += (size_t)subdev->offset * subdev->dev.block_size;
+    }
+
+    return err;
+}
+
+static status_t subdev_submit(struct bdev *_dev, bio_request_t *req)
+{
+    subdev_t *subdev = (subdev_t *)_dev;
+
+    /* hand it straight to the parent, it completes against the device it was submitted to */
+    req->block += subdev->offset;
+    return bio_submit_lower(subdev->parent, req);
+}
+
 static void subdev_close(struct bdev *_dev)
 {
     subdev_t *subdev = (subdev_t *)_dev;
@@ -170,9 +216,10 @@ status_t bio_publish_subdevice(const char *parent_dev,
         geometry = NULL;
     }
 
+    /* the parent's alignment needs apply to us too, since buffers go straight through */
     bio_initialize_bdev(&sub->dev, subdev,
                         parent->block_size, block_count,
-                        geometry_count, geometry, BIO_FLAGS_NONE);
+                        geometry_count, geometry, parent->flags);
 
     sub->parent = parent;
     sub->offset = startblock;
@@ -182,6 +229,12 @@ status_t bio_publish_subdevice(const char *parent_dev,
     sub->dev.write = &subdev_write;
     sub->dev.write_block = &subdev_write_block;
     sub->dev.erase = &subdev_erase;
+    sub->dev.write_zeroes = &subdev_write_zeroes;
+    sub->dev.discard = &subdev_discard;
+    sub->dev.flush = &subdev_flush;
+    sub->dev.ioctl = &subdev_ioctl;
+    sub->dev.submit = &subdev_submit;
+    sub->dev.max_queue_depth = parent->max_queue_depth;
     sub->dev.close = &subdev_close;
 
     bio_register_device(&sub->dev);
@@ -28,34 +28,55 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <lib/bio.h>
 #include <lib/bootimage_struct.h>
+#include <lib/inflate.h>
 #include <lib/mincrypt/sha256.h>
+#include <lib/workqueue.h>
 
 #define LOCAL_TRACE 1
 
+#define BOOTIMAGE_HEADER_SIZE 4096
+#define BOOTIMAGE_MAX_ENTRIES (BOOTIMAGE_HEADER_SIZE / sizeof(bootentry))
+
+/* bytes read off a device at a time when loading an uncompressed section */
+#define BOOTIMAGE_CHUNK_SIZE (64 * 1024)
+
 struct bootimage {
-    const uint8_t *ptr;
+    const uint8_t *ptr;     /* the image, if it's in memory */
     size_t len;
+
+    bdev_t *dev;            /* or the device and offset it's read from */
+    off_t dev_offset;
+
+    bootentry *be;          /* the first page, in the image or a copy of it */
+    uint64_t verified;      /* entries whose hash has been checked */
+    uint hash_chunk_shift;  /* file sections are tree hashed, if nonzero */
 };
 
+/*
+ * Check the first page and that every section lies inside the image. Section
+ * hashes are checked as each one is used, so nothing has to read the whole
+ * image up front.
+ */
 static status_t validate_bootimage(bootimage_t *bi)
 {
     if (!bi)
         return ERR_INVALID_ARGS;
 
     /* is it large enough to hold the first entry */
-    if (bi->len < 4096) {
+    if (bi->len < BOOTIMAGE_HEADER_SIZE) {
         LTRACEF("bootentry too short\n");
         return ERR_BAD_LEN;
     }
 
-    bootentry *be = (bootentry *)bi->ptr;
+    bootentry *be = bi->be;
 
     /* check that the first entry is a file, type boot info, and is 4096 bytes at offset 0 */
     if (be->kind != KIND_FILE ||
             be->file.type != TYPE_BOOT_IMAGE ||
             be->file.offset != 0 ||
-            be->file.length != 4096 ||
+            be->file.length != BOOTIMAGE_HEADER_SIZE ||
             memcmp(be->file.name, BOOT_MAGIC, sizeof(be->file.name))) {
         LTRACEF("invalid first entry\n");
         return ERR_INVALID_ARGS;
@@ -65,7 +86,7 @@ static status_t validate_bootimage(bootimage_t *bi)
     SHA256_CTX ctx;
     SHA256_init(&ctx);
 
-    SHA256_update(&ctx, be + 1, 4096 - sizeof(bootentry));
+    SHA256_update(&ctx, be + 1, BOOTIMAGE_HEADER_SIZE - sizeof(bootentry));
     const uint8_t *hash = SHA256_final(&ctx);
 
     if (memcmp(hash, be->file.sha256, sizeof(be->file.sha256)) != 0) {
@@ -94,6 +115,22 @@ static status_t validate_bootimage(bootimage_t *bi)
         return ERR_INVALID_ARGS;
     }
 
+    /* tree hashes came in with 1.2, before that the field was reserved */
+    if (info->version >= 0x00010002 && info->hash_chunk_shift) {
+        if (info->hash_chunk_shift < BOOT_HASH_CHUNK_SHIFT_MIN ||
+                info->hash_chunk_shift > BOOT_HASH_CHUNK_SHIFT_MAX) {
+            LTRACEF("bad hash chunk shift %u\n", info->hash_chunk_shift);
+            return ERR_INVALID_ARGS;
+        }
+        bi->hash_chunk_shift = info->hash_chunk_shift;
+    }
+
+    /* the entries all live in the first page */
+    if (info->entry_count > BOOTIMAGE_MAX_ENTRIES) {
+        LTRACEF("too many entries (%u)\n", info->entry_count);
+        return ERR_INVALID_ARGS;
+    }
+
     /* trim the len to what the info block says */
     bi->len = info->image_size;
 
@@ -111,7 +148,9 @@ static status_t validate_bootimage(bootimage_t *bi)
                 break;
             case KIND_BUILD:
                 break;
-            case KIND_FILE: {
+            case KIND_FILE:
+            case KIND_ZFILE: {
+                /* the two share their type, offset and length fields */
                 LTRACEF("\ttype %c%c%c%c offset 0x%x, length 0x%x\n",
                         (be[i].file.type >> 0) & 0xff, (be[i].file.type >> 8) & 0xff,
                         (be[i].file.type >> 16) & 0xff, (be[i].file.type >> 24) & 0xff,
@@ -124,19 +163,6 @@ static status_t validate_bootimage(bootimage_t *bi)
                     return ERR_INVALID_ARGS;
                 }
 
-                /* check the sha256 hash */
-                SHA256_init(&ctx);
-
-                LTRACEF("\tvalidating SHA256 hash\n");
-                SHA256_update(&ctx, (const uint8_t *)bi->ptr + be[i].file.offset, be[i].file.length);
-                const uint8_t *hash = SHA256_final(&ctx);
-
-                if (memcmp(hash, be[i].file.sha256, sizeof(be[i].file.sha256)) != 0) {
-                    LTRACEF("bad hash of file section\n");
-
-                    return ERR_CHECKSUM_FAIL;
-                }
-
                 break;
             }
             default:
@@ -149,6 +175,94 @@ static status_t validate_bootimage(bootimage_t *bi)
     return NO_ERROR;
 }
 
+static const bootentry *find_section(bootimage_t *bi, uint32_t type, uint *index)
+{
+    const bootentry *be = bi->be;
+    const bootentry_info *info = &be[1].info;
+
+    for (uint i = 2; i < info->entry_count; i++) {
+        if (be[i].kind == 0)
+            break;
+
+        if (be[i].kind != KIND_FILE && be[i].kind != KIND_ZFILE)
+            continue;
+
+        if (type == be[i].file.type) {
+            *index = i;
+            return &be[i];
+        }
+    }
+
+    return NULL;
+}
+
+struct tree_hash {
+    const uint8_t *data;
+    size_t len;
+    size_t chunk;
+    uint8_t *leaves;
+};
+
+static void hash_leaves(size_t start, size_t end, void *arg)
+{
+    struct tree_hash *t = arg;
+
+    for (size_t i = start; i < end; i++) {
+        size_t off = i * t->chunk;
+        SHA256_hash(t->data + off, MIN(t->len - off, t->chunk), t->leaves + i * SHA256_DIGEST_SIZE);
+    }
+}
+
+/* the root of a tree hashed section, with its chunks hashed on every cpu */
+static status_t tree_hash(const void *data, size_t len, uint shift, uint8_t *hash)
+{
+    struct tree_hash t = {
+        .data = data,
+        .len = len,
+        .chunk = (size_t)1 << shift,
+    };
+    size_t count = (len + t.chunk - 1) >> shift;
+
+    t.leaves = malloc(MAX(count, 1u) * SHA256_DIGEST_SIZE);
+    if (!t.leaves)
+        return ERR_NO_MEMORY;
+
+    parallel_for(0, count, 1, hash_leaves, &t);
+    SHA256_hash(t.leaves, count * SHA256_DIGEST_SIZE, hash);
+
+    free(t.leaves);
+    return NO_ERROR;
+}
+
+/* check the hash of a section of an in memory image, once */
+static status_t verify_section(bootimage_t *bi, const bootentry *be, uint index)
+{
+    if (bi->verified & (1ULL << index))
+        return NO_ERROR;
+
+    LTRACEF("validating SHA256 hash of entry %u\n", index);
+
+    uint8_t hash[SHA256_DIGEST_SIZE];
+    uint shift = bi->hash_chunk_shift;
+    if (be->kind == KIND_FILE && shift) {
+        status_t err = tree_hash(bi->ptr + be->file.offset, be->file.length, shift, hash);
+        if (err < 0)
+            return err;
+    } else {
+        SHA256_hash(bi->ptr + be->file.offset, be->file.length, hash);
+    }
+
+    /* file and zfile entries keep their hash in different places */
+    const uint8_t *expected = (be->kind == KIND_ZFILE) ? be->zfile.sha256 : be->file.sha256;
+    if (memcmp(hash, expected, SHA256_DIGEST_SIZE) != 0) {
+        LTRACEF("bad hash of file section\n");
+        return ERR_CHECKSUM_FAIL;
+    }
+
+    bi->verified |= (1ULL << index);
+    return NO_ERROR;
+}
+
 status_t bootimage_open(const void *ptr, size_t len, bootimage_t **bi)
 {
     LTRACEF("ptr %p, len %zu\n", ptr, len);
@@ -162,6 +276,7 @@ status_t bootimage_open(const void *ptr, size_t len, bootimage_t **bi)
 
     (*bi)->ptr = ptr;
     (*bi)->len = len;
+    (*bi)->be = (bootentry *)ptr;
 
     /* try to validate it */
     status_t err = validate_bootimage(*bi);
@@ -173,10 +288,56 @@ status_t bootimage_open(const void *ptr, size_t len, bootimage_t **bi)
     return NO_ERROR;
 }
 
+status_t bootimage_open_bdev(bdev_t *dev, off_t offset, size_t len, bootimage_t **bi)
+{
+    LTRACEF("dev %p, offset %lld, len %zu\n", dev, offset, len);
+
+    if (!dev || !bi)
+        return ERR_INVALID_ARGS;
+
+    if (len < BOOTIMAGE_HEADER_SIZE)
+        return ERR_BAD_LEN;
+
+    *bi = calloc(1, sizeof(bootimage_t));
+    if (!*bi)
+        return ERR_NO_MEMORY;
+
+    (*bi)->len = len;
+    (*bi)->dev = dev;
+    (*bi)->dev_offset = offset;
+
+    /* only the first page is read now, sections are read as they're loaded */
+    status_t err;
+    (*bi)->be = malloc(BOOTIMAGE_HEADER_SIZE);
+    if (!(*bi)->be) {
+        err = ERR_NO_MEMORY;
+        goto err;
+    }
+
+    ssize_t readerr = bio_read(dev, (*bi)->be, offset, BOOTIMAGE_HEADER_SIZE);
+    if (readerr != BOOTIMAGE_HEADER_SIZE) {
+        err = (readerr < 0) ? readerr : ERR_IO;
+        goto err;
+    }
+
+    err = validate_bootimage(*bi);
+    if (err < 0)
+        goto err;
+
+    return NO_ERROR;
+
+err:
+    bootimage_close(*bi);
+    return err;
+}
+
 status_t bootimage_close(bootimage_t *bi)
 {
-    if (bi)
+    if (bi) {
+        if (bi->dev)
+            free(bi->be);
         free(bi);
+    }
 
     return NO_ERROR;
 }
@@ -199,25 +360,156 @@ status_t bootimage_get_file_section(bootimage_t *bi, uint32_t type, const void *
     if (!bi)
         return ERR_INVALID_ARGS;
 
-    bootentry *be = (bootentry *)bi->ptr;
-    bootentry_info *info = &be[1].info;
+    uint index;
+    const bootentry *be = find_section(bi, type, &index);
+    if (!be)
+        return ERR_NOT_FOUND;
 
-    for (size_t i = 2; i < info->entry_count; i++) {
-        if (be[i].kind == 0)
-            break;
+    /* compressed sections and images on a device have to be loaded */
+    if (be->kind != KIND_FILE || !bi->ptr)
+        return ERR_NOT_SUPPORTED;
 
-        if (be[i].kind != KIND_FILE)
-            continue;
+    status_t err = verify_section(bi, be, index);
+    if (err < 0)
+        return err;
 
-        if (type == be[i].file.type) {
-            if (ptr)
-                *ptr = bi->ptr + be[i].file.offset;
-            if (len)
-                *len = be[i].file.length;
-            return NO_ERROR;
+    if (ptr)
+        *ptr = bi->ptr + be->file.offset;
+    if (len)
+        *len = be->file.length;
+
+    return NO_ERROR;
+}
+
+status_t bootimage_get_file_section_size(bootimage_t *bi, uint32_t type, size_t *len, bool *compressed)
+{
+    if (!bi)
+        return ERR_INVALID_ARGS;
+
+    uint index;
+    const bootentry *be = find_section(bi, type, &index);
+    if (!be)
+        return ERR_NOT_FOUND;
+
+    if (len)
+        *len = (be->kind == KIND_ZFILE) ? be->zfile.inflated_length : be->file.length;
+    if (compressed)
+        *compressed = (be->kind == KIND_ZFILE);
+
+    return NO_ERROR;
+}
+
+static void hash_chunk(const void *buf, size_t len, void *arg)
+{
+    SHA256_update((SHA256_CTX *)arg, buf, len);
+}
+
+/* read a section off the device into dst, inflating it if need be, hashing it on the way */
+static ssize_t load_section_bdev(bootimage_t *bi, const bootentry *be, uint index, void *dst)
+{
+    off_t offset = bi->dev_offset + be->file.offset;
+    size_t len = be->file.length;
+    uint shift = (be->kind == KIND_FILE) ? bi->hash_chunk_shift : 0;
+    ssize_t ret;
+
+    SHA256_CTX ctx;
+    SHA256_init(&ctx);
+
+    if (be->kind == KIND_ZFILE) {
+        ret = inflate_bdev_etc(dst, be->zfile.inflated_length, bi->dev, offset, len,
+                               INFLATE_FLAG_ZLIB, hash_chunk, &ctx);
+    } else {
+        ret = len;
+        for (size_t pos = 0; pos < len; ) {
+            size_t n = MIN(len - pos, BOOTIMAGE_CHUNK_SIZE);
+            ssize_t readerr = bio_read(bi->dev, (uint8_t *)dst + pos, offset + pos, n);
+            if (readerr != (ssize_t)n) {
+                ret = (readerr < 0) ? readerr : ERR_IO;
+                break;
+            }
+            /* a tree hash waits until it's all in, then goes wide */
+            if (!shift)
+                hash_chunk((uint8_t *)dst + pos, n, &ctx);
+            pos += n;
         }
     }
 
-    return ERR_NOT_FOUND;
+    uint8_t hash[SHA256_DIGEST_SIZE];
+    if (shift) {
+        if (ret < 0)
+            return ret;
+        status_t err = tree_hash(dst, len, shift, hash);
+        if (err < 0)
+            return err;
+    } else {
+        memcpy(hash, SHA256_final(&ctx), SHA256_DIGEST_SIZE);
+    }
+
+    /* a stream that doesn't hash right is reported as such, whatever inflate made of it */
+    const uint8_t *expected = (be->kind == KIND_ZFILE) ? be->zfile.sha256 : be->file.sha256;
+    if (memcmp(hash, expected, SHA256_DIGEST_SIZE) != 0) {
+        LTRACEF("bad hash of file section\n");
+        return ERR_CHECKSUM_FAIL;
+    }
+
+    bi->verified |= (1ULL << index);
+    return ret;
 }
 
+ssize_t bootimage_load_file_section(bootimage_t *bi, uint32_t type, void *dst, size_t dst_len)
+{
+    if (!bi || !dst)
+        return ERR_INVALID_ARGS;
+
+    uint index;
+    const bootentry *be = find_section(bi, type, &index);
+    if (!be)
+        return ERR_NOT_FOUND;
+
+    size_t len = (be->kind == KIND_ZFILE) ? be->zfile.inflated_length : be->file.length;
+    if (dst_len < len)
+        return ERR_BAD_LEN;
+
+    ssize_t ret;
+    if (bi->dev) {
+        ret = load_section_bdev(bi, be, index, dst);
+    } else {
+        ret = verify_section(bi, be, index);
+        if (ret < 0)
+            return ret;
+
+        if (be->kind == KIND_ZFILE) {
+            ret = inflate_mem(dst, len, bi->ptr + be->file.offset, be->file.length, INFLATE_FLAG_ZLIB);
+        } else {
+            memcpy(dst, bi->ptr + be->file.offset, len);
+            ret = len;
+        }
+    }
+
+    if (ret >= 0 && (size_t)ret != len) {
+        LTRACEF("section inflated to %ld bytes, expected %zu\n", ret, len);
+        return ERR_IO;
+    }
+
+    return ret;
+}
+
+ssize_t bootimage_inflate_file_section(bootimage_t *bi, uint32_t type, void *dst, size_t dst_len)
+{
+    const void *ptr;
+    size_t len;
+    bool compressed;
+
+    status_t err = bootimage_get_file_section_size(bi, type, NULL, &compressed);
+    if (err < 0)
+        return err;
+
+    if (compressed)
+        return bootimage_load_file_section(bi, type, dst, dst_len);
+
+    err = bootimage_get_file_section(bi, type, &ptr, &len);
+    if (err < 0)
+        return err;
+
+    return inflate_mem(dst, dst_len, ptr, len, INFLATE_FLAG_ZLIB);
+}
@@ -24,14 +24,37 @@
 
 #include <sys/types.h>
 #include <compiler.h>
+#include <stdbool.h>
+#include <lib/bio.h>
 #include <lib/bootimage_struct.h>
 
 typedef struct bootimage bootimage_t;
 
+/*
+ * Opening an image only checks its first page. The hash of each section is
+ * checked the first time it is used.
+ */
 status_t bootimage_open(const void *ptr, size_t len, bootimage_t **bi) __NONNULL();
+
+/* open an image at offset on dev, which has to stay open until the image is closed */
+status_t bootimage_open_bdev(bdev_t *dev, off_t offset, size_t len, bootimage_t **bi) __NONNULL();
 status_t bootimage_close(bootimage_t *bi) __NONNULL();
 status_t bootimage_get_range(bootimage_t *bi, const void **ptr, size_t *len) __NONNULL((1));
 
-/* ask for a file section of the bootimage, by type */
+/* ask for a file section of the bootimage, by type. only for uncompressed sections of images in memory */
 status_t bootimage_get_file_section(bootimage_t *bi, uint32_t type, const void **ptr, size_t *len) __NONNULL((1));
 
+/* the size a section loads to, and whether it is stored compressed */
+status_t bootimage_get_file_section_size(bootimage_t *bi, uint32_t type, size_t *len, bool *compressed) __NONNULL((1));
+
+/*
+ * copy a section to dst, inflating a compressed one, returns the loaded length.
+ * sections on a device are hashed as they are read, and inflated while the next
+ * chunk is coming in.
+ */
+ssize_t bootimage_load_file_section(bootimage_t *bi, uint32_t type, void *dst, size_t dst_len) __NONNULL((1));
+
+/* inflate a zlib compressed file section straight to dst, returns the inflated length.
+ * a KIND_ZFILE section is loaded as with bootimage_load_file_section */
+ssize_t bootimage_inflate_file_section(bootimage_t *bi, uint32_t type, void *dst, size_t dst_len) __NONNULL((1));
+
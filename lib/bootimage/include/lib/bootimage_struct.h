@@ -34,6 +34,17 @@ typedef struct {
     uint8_t sha256[32];
 } __attribute__ ((packed)) bootentry_file;
 
+/* a zlib compressed file, hashed as stored so it can be checked while it streams in */
+typedef struct {
+    uint32_t kind;
+    uint32_t type;
+    uint32_t offset;            /* byte offset from start of file */
+    uint32_t length;            /* compressed length in bytes */
+    uint32_t inflated_length;   /* length in bytes once inflated */
+    uint8_t name[12];
+    uint8_t sha256[32];         /* of the compressed data */
+} __attribute__ ((packed)) bootentry_zfile;
+
 typedef struct {
     uint32_t kind;
     union {
@@ -47,17 +58,19 @@ typedef struct {
     uint32_t version;       /* bootimage version */
     uint32_t image_size;    /* byte size of entire image */
     uint32_t entry_count;   /* number of valid bootentries */
-    uint32_t reserved[12];
+    uint32_t hash_chunk_shift; /* 1.2: nonzero for tree hashed file sections, see below */
+    uint32_t reserved[11];
 } __attribute__((packed)) bootentry_info;
 
 typedef union {
     uint32_t kind;
     bootentry_file file;
+    bootentry_zfile zfile;
     bootentry_data data;
     bootentry_info info;
 } bootentry;
 
-#define BOOT_VERSION 0x00010000     /* 1.0 */
+#define BOOT_VERSION 0x00010002     /* 1.2, adds tree hashed file sections */
 
 #define BOOT_MAGIC "<lk-boot-image>"
 #define BOOT_MAGIC_LENGTH 16
@@ -66,11 +79,12 @@ typedef union {
 
 // bootentry kinds:
 #define KIND_FILE           0x656c6966  // 'file'
+#define KIND_ZFILE          0x6c69667a  // 'zfil' compressed file
 #define KIND_BOOT_INFO      0x6f666e69  // 'info'
 #define KIND_BOARD          0x67726174  // 'targ' board id string
 #define KIND_BUILD          0x706d7473  // 'stmp' build id string
 
-// bootentry_file types:
+// bootentry_file and bootentry_zfile types:
 #define TYPE_BOOT_IMAGE     0x746f6f62  // 'boot'
 #define TYPE_LK             0x6b6c6b6c  // 'lklk'
 #define TYPE_FPGA_IMAGE     0x61677066  // 'fpga'
@@ -91,4 +105,15 @@ typedef union {
 // second entry must be:
 //   kind: KIND_BOOT_INFO
 
+// the entries fill the first page, so there are at most 64 of them
+
 // offsets should be multiple-of-4096
+
+// tree hashes:
+//   if the boot info's hash_chunk_shift is nonzero, the sha256 of each KIND_FILE
+//   section is not of its contents but of the concatenated sha256s of each
+//   (1 << hash_chunk_shift) byte chunk of it, the last one possibly short. the
+//   chunks can be hashed independently, so a multi core loader checks them in
+//   parallel. compressed sections and the first page are always hashed flat.
+#define BOOT_HASH_CHUNK_SHIFT_MIN   12
+#define BOOT_HASH_CHUNK_SHIFT_MAX   24
@@ -3,7 +3,10 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 MODULE := $(LOCAL_DIR)
 
 MODULE_DEPS := \
-    lib/mincrypt
+    lib/bio \
+    lib/inflate \
+    lib/mincrypt \
+    lib/workqueue
 
 MODULE_SRCS := \
 	$(LOCAL_DIR)/bootimage.c
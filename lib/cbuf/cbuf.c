@@ -35,36 +35,90 @@
 #define INC_POINTER(cbuf, ptr, inc) \
     modpow2(((ptr) + (inc)), (cbuf)->len_pow2)
 
+/*
+ * The writer owns head and the reader owns tail. Each side reads the other's
+ * index with acquire and publishes its own with release, so the data copied
+ * in before head moves is visible to a reader that sees the new head, and the
+ * space freed before tail moves can't be overwritten early. That's enough on
+ * its own for one writer and one reader, which is what CBUF_FLAG_SPSC is;
+ * otherwise the spinlock serializes all the writers and readers.
+ */
+static inline uint cbuf_load(const uint *index)
+{
+    return __atomic_load_n(index, __ATOMIC_ACQUIRE);
+}
+
+static inline void cbuf_store(uint *index, uint val)
+{
+    __atomic_store_n(index, val, __ATOMIC_RELEASE);
+}
+
+static inline spin_lock_saved_state_t cbuf_lock(cbuf_t *cbuf)
+{
+    spin_lock_saved_state_t state = 0;
+
+    if (!(cbuf->flags & CBUF_FLAG_SPSC))
+        spin_lock_irqsave(&cbuf->lock, state);
+    return state;
+}
+
+static inline void cbuf_unlock(cbuf_t *cbuf, spin_lock_saved_state_t state)
+{
+    if (!(cbuf->flags & CBUF_FLAG_SPSC))
+        spin_unlock_irqrestore(&cbuf->lock, state);
+}
+
+/* the reader emptied the buffer */
+static void cbuf_emptied(cbuf_t *cbuf, uint tail)
+{
+    event_unsignal(&cbuf->event);
+
+    /* a writer may have added more and signaled just before we unsignaled */
+    if (cbuf->flags & CBUF_FLAG_SPSC) {
+        if (cbuf_load(&cbuf->head) != tail)
+            event_signal(&cbuf->event, false);
+    }
+}
+
 void cbuf_initialize(cbuf_t *cbuf, size_t len)
 {
     cbuf_initialize_etc(cbuf, len, malloc(len));
 }
 
 void cbuf_initialize_etc(cbuf_t *cbuf, size_t len, void *buf)
+{
+    cbuf_initialize_flags(cbuf, len, buf, 0);
+}
+
+void cbuf_initialize_flags(cbuf_t *cbuf, size_t len, void *buf, uint flags)
 {
     DEBUG_ASSERT(cbuf);
     DEBUG_ASSERT(len > 0);
     DEBUG_ASSERT(ispow2(len));
 
+    if (!buf)
+        buf = malloc(len);
+
     cbuf->head = 0;
     cbuf->tail = 0;
     cbuf->len_pow2 = log2_uint(len);
+    cbuf->flags = flags;
     cbuf->buf = buf;
     event_init(&cbuf->event, false, 0);
     spin_lock_init(&cbuf->lock);
 
-    LTRACEF("len %zd, len_pow2 %u\n", len, cbuf->len_pow2);
+    LTRACEF("len %zd, len_pow2 %u, flags 0x%x\n", len, cbuf->len_pow2, flags);
 }
 
 size_t cbuf_space_avail(cbuf_t *cbuf)
 {
-    uint consumed = modpow2((uint)(cbuf->head - cbuf->tail), cbuf->len_pow2);
+    uint consumed = modpow2((uint)(cbuf_load(&cbuf->head) - cbuf_load(&cbuf->tail)), cbuf->len_pow2);
     return valpow2(cbuf->len_pow2) - consumed - 1;
 }
 
 size_t cbuf_space_used(cbuf_t *cbuf)
 {
-    return modpow2((uint)(cbuf->head - cbuf->tail), cbuf->len_pow2);
+    return modpow2((uint)(cbuf_load(&cbuf->head) - cbuf_load(&cbuf->tail)), cbuf->len_pow2);
 }
 
 size_t cbuf_write(cbuf_t *cbuf, const void *_buf, size_t len, bool canreschedule)
@@ -76,55 +130,113 @@ size_t cbuf_write(cbuf_t *cbuf, const void *_buf, size_t len, bool canreschedule
     DEBUG_ASSERT(cbuf);
     DEBUG_ASSERT(len < valpow2(cbuf->len_pow2));
 
-    spin_lock_saved_state_t state;
-    spin_lock_irqsave(&cbuf->lock, state);
-
-    size_t write_len;
-    size_t pos = 0;
-
-    while (pos < len && cbuf_space_avail(cbuf) > 0) {
-        if (cbuf->head >= cbuf->tail) {
-            if (cbuf->tail == 0) {
-                // Special case - if tail is at position 0, we can't write all
-                // the way to the end of the buffer. Otherwise, head ends up at
-                // 0, head == tail, and buffer is considered "empty" again.
-                write_len =
-                    MIN(valpow2(cbuf->len_pow2) - cbuf->head - 1, len - pos);
-            } else {
-                // Write to the end of the buffer.
-                write_len =
-                    MIN(valpow2(cbuf->len_pow2) - cbuf->head, len - pos);
-            }
-        } else {
-            // Write from head to tail-1.
-            write_len = MIN(cbuf->tail - cbuf->head - 1, len - pos);
-        }
+    spin_lock_saved_state_t state = cbuf_lock(cbuf);
 
-        // if it's full, abort and return how much we've written
-        if (write_len == 0) {
-            break;
-        }
+    uint head = cbuf->head;
+    uint tail = cbuf_load(&cbuf->tail);
+    size_t sz = valpow2(cbuf->len_pow2);
 
-        if (NULL == buf) {
-            memset(cbuf->buf + cbuf->head, 0, write_len);
-        } else {
-            memcpy(cbuf->buf + cbuf->head, buf + pos, write_len);
-        }
+    // one byte always stays free, or a full buffer would look empty
+    size_t write_len = MIN(len, sz - modpow2(head - tail, cbuf->len_pow2) - 1);
 
-        cbuf->head = INC_POINTER(cbuf, cbuf->head, write_len);
-        pos += write_len;
+    // copy to the end of the buffer, then wrap around
+    size_t first = MIN(write_len, sz - head);
+    if (NULL == buf) {
+        memset(cbuf->buf + head, 0, first);
+        memset(cbuf->buf, 0, write_len - first);
+    } else {
+        memcpy(cbuf->buf + head, buf, first);
+        memcpy(cbuf->buf, buf + first, write_len - first);
     }
 
-    if (cbuf->head != cbuf->tail)
+    head = INC_POINTER(cbuf, head, write_len);
+    cbuf_store(&cbuf->head, head);
+
+    if (head != tail)
         event_signal(&cbuf->event, false);
 
-    spin_unlock_irqrestore(&cbuf->lock, state);
+    cbuf_unlock(cbuf, state);
 
     // XXX convert to only rescheduling if
     if (canreschedule)
         thread_preempt();
 
-    return pos;
+    return write_len;
+}
+
+size_t cbuf_write_ahead(cbuf_t *cbuf, size_t offset, const void *_buf, size_t len)
+{
+    const char *buf = (const char *)_buf;
+
+    LTRACEF("offset %zd, len %zd\n", offset, len);
+
+    DEBUG_ASSERT(cbuf);
+    DEBUG_ASSERT(buf || len == 0);
+
+    spin_lock_saved_state_t state = cbuf_lock(cbuf);
+
+    size_t avail = cbuf_space_avail(cbuf);
+    if (offset >= avail) {
+        cbuf_unlock(cbuf, state);
+        return 0;
+    }
+    len = MIN(len, avail - offset);
+
+    // copy from the start position to the end of the buffer, then wrap around
+    uint pos = INC_POINTER(cbuf, cbuf->head, offset);
+    size_t first = MIN(valpow2(cbuf->len_pow2) - pos, len);
+    memcpy(cbuf->buf + pos, buf, first);
+    memcpy(cbuf->buf, buf + first, len - first);
+
+    cbuf_unlock(cbuf, state);
+
+    return len;
+}
+
+size_t cbuf_reserve(cbuf_t *cbuf, iovec_t *regions)
+{
+    DEBUG_ASSERT(cbuf && regions);
+
+    spin_lock_saved_state_t state = cbuf_lock(cbuf);
+
+    uint head = cbuf->head;
+    size_t ret = cbuf_space_avail(cbuf);
+    size_t sz  = cbuf_size(cbuf);
+
+    regions[0].iov_base = ret ? (cbuf->buf + head) : NULL;
+    if (ret + head > sz) {
+        regions[0].iov_len  = sz - head;
+        regions[1].iov_base = cbuf->buf;
+        regions[1].iov_len  = ret - regions[0].iov_len;
+    } else {
+        regions[0].iov_len  = ret;
+        regions[1].iov_base = NULL;
+        regions[1].iov_len  = 0;
+    }
+
+    cbuf_unlock(cbuf, state);
+    return ret;
+}
+
+void cbuf_commit(cbuf_t *cbuf, size_t len, bool canreschedule)
+{
+    LTRACEF("len %zd\n", len);
+
+    DEBUG_ASSERT(cbuf);
+
+    spin_lock_saved_state_t state = cbuf_lock(cbuf);
+
+    DEBUG_ASSERT(len <= cbuf_space_avail(cbuf));
+    uint head = INC_POINTER(cbuf, cbuf->head, len);
+    cbuf_store(&cbuf->head, head);
+
+    if (head != cbuf_load(&cbuf->tail))
+        event_signal(&cbuf->event, false);
+
+    cbuf_unlock(cbuf, state);
+
+    if (canreschedule)
+        thread_preempt();
 }
 
 size_t cbuf_read(cbuf_t *cbuf, void *_buf, size_t buflen, bool block)
@@ -139,45 +251,33 @@ retry:
     if (block)
         event_wait(&cbuf->event);
 
-    spin_lock_saved_state_t state;
-    spin_lock_irqsave(&cbuf->lock, state);
+    spin_lock_saved_state_t state = cbuf_lock(cbuf);
 
     // see if there's data available
-    size_t ret = 0;
-    if (cbuf->tail != cbuf->head) {
-        size_t pos = 0;
-
-        // loop until we've read everything we need
-        // at most this will make two passes to deal with wraparound
-        while (pos < buflen && cbuf->tail != cbuf->head) {
-            size_t read_len;
-            if (cbuf->head > cbuf->tail) {
-                // simple case where there is no wraparound
-                read_len = MIN(cbuf->head - cbuf->tail, buflen - pos);
-            } else {
-                // read to the end of buffer in this pass
-                read_len = MIN(valpow2(cbuf->len_pow2) - cbuf->tail, buflen - pos);
-            }
-
-            // Only perform the copy if a buf was supplied
-            if (NULL != buf) {
-                memcpy(buf + pos, cbuf->buf + cbuf->tail, read_len);
-            }
-
-            cbuf->tail = INC_POINTER(cbuf, cbuf->tail, read_len);
-            pos += read_len;
+    uint tail = cbuf->tail;
+    uint head = cbuf_load(&cbuf->head);
+    size_t sz = valpow2(cbuf->len_pow2);
+    size_t ret = MIN(buflen, modpow2(head - tail, cbuf->len_pow2));
+
+    if (ret > 0) {
+        // read to the end of the buffer, then wrap around
+        // Only perform the copy if a buf was supplied
+        if (NULL != buf) {
+            size_t first = MIN(ret, sz - tail);
+            memcpy(buf, cbuf->buf + tail, first);
+            memcpy(buf + first, cbuf->buf, ret - first);
         }
 
-        if (cbuf->tail == cbuf->head) {
-            DEBUG_ASSERT(pos > 0);
+        tail = INC_POINTER(cbuf, tail, ret);
+        cbuf_store(&cbuf->tail, tail);
+
+        if (tail == head) {
             // we've emptied the buffer, unsignal the event
-            event_unsignal(&cbuf->event);
+            cbuf_emptied(cbuf, tail);
         }
-
-        ret = pos;
     }
 
-    spin_unlock_irqrestore(&cbuf->lock, state);
+    cbuf_unlock(cbuf, state);
 
     // we apparently blocked but raced with another thread and found no data, retry
     if (block && ret == 0)
@@ -190,18 +290,18 @@ size_t cbuf_peek(cbuf_t *cbuf, iovec_t *regions)
 {
     DEBUG_ASSERT(cbuf && regions);
 
-    spin_lock_saved_state_t state;
-    spin_lock_irqsave(&cbuf->lock, state);
+    spin_lock_saved_state_t state = cbuf_lock(cbuf);
 
+    uint tail = cbuf->tail;
     size_t ret = cbuf_space_used(cbuf);
     size_t sz  = cbuf_size(cbuf);
 
-    DEBUG_ASSERT(cbuf->tail < sz);
+    DEBUG_ASSERT(tail < sz);
     DEBUG_ASSERT(ret <= sz);
 
-    regions[0].iov_base = ret ? (cbuf->buf + cbuf->tail) : NULL;
-    if (ret + cbuf->tail > sz) {
-        regions[0].iov_len  = sz - cbuf->tail;
+    regions[0].iov_base = ret ? (cbuf->buf + tail) : NULL;
+    if (ret + tail > sz) {
+        regions[0].iov_len  = sz - tail;
         regions[1].iov_base = cbuf->buf;
         regions[1].iov_len  = ret - regions[0].iov_len;
     } else {
@@ -210,7 +310,7 @@ size_t cbuf_peek(cbuf_t *cbuf, iovec_t *regions)
         regions[1].iov_len  = 0;
     }
 
-    spin_unlock_irqrestore(&cbuf->lock, state);
+    cbuf_unlock(cbuf, state);
     return ret;
 }
 
@@ -218,21 +318,20 @@ size_t cbuf_write_char(cbuf_t *cbuf, char c, bool canreschedule)
 {
     DEBUG_ASSERT(cbuf);
 
-    spin_lock_saved_state_t state;
-    spin_lock_irqsave(&cbuf->lock, state);
+    spin_lock_saved_state_t state = cbuf_lock(cbuf);
 
     size_t ret = 0;
     if (cbuf_space_avail(cbuf) > 0) {
-        cbuf->buf[cbuf->head] = c;
+        uint head = cbuf->head;
 
-        cbuf->head = INC_POINTER(cbuf, cbuf->head, 1);
+        cbuf->buf[head] = c;
+        cbuf_store(&cbuf->head, INC_POINTER(cbuf, head, 1));
         ret = 1;
 
-        if (cbuf->head != cbuf->tail)
-            event_signal(&cbuf->event, canreschedule);
+        event_signal(&cbuf->event, canreschedule);
     }
 
-    spin_unlock_irqrestore(&cbuf->lock, state);
+    cbuf_unlock(cbuf, state);
 
     return ret;
 }
@@ -246,25 +345,27 @@ retry:
     if (block)
         event_wait(&cbuf->event);
 
-    spin_lock_saved_state_t state;
-    spin_lock_irqsave(&cbuf->lock, state);
+    spin_lock_saved_state_t state = cbuf_lock(cbuf);
 
     // see if there's data available
     size_t ret = 0;
-    if (cbuf->tail != cbuf->head) {
+    uint tail = cbuf->tail;
+    uint head = cbuf_load(&cbuf->head);
+    if (tail != head) {
 
-        *c = cbuf->buf[cbuf->tail];
-        cbuf->tail = INC_POINTER(cbuf, cbuf->tail, 1);
+        *c = cbuf->buf[tail];
+        tail = INC_POINTER(cbuf, tail, 1);
+        cbuf_store(&cbuf->tail, tail);
 
-        if (cbuf->tail == cbuf->head) {
+        if (tail == head) {
             // we've emptied the buffer, unsignal the event
-            event_unsignal(&cbuf->event);
+            cbuf_emptied(cbuf, tail);
         }
 
         ret = 1;
     }
 
-    spin_unlock_irqrestore(&cbuf->lock, state);
+    cbuf_unlock(cbuf, state);
 
     if (block && ret == 0)
         goto retry;
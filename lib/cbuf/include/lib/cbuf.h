@@ -34,6 +34,7 @@ typedef struct cbuf {
     uint head;
     uint tail;
     uint len_pow2;
+    uint flags;
     char *buf;
     event_t event;
     spin_lock_t lock;
@@ -63,6 +64,27 @@ void cbuf_initialize(cbuf_t *cbuf, size_t len);
  */
 void cbuf_initialize_etc(cbuf_t *cbuf, size_t len, void *buf);
 
+/* exactly one writer and one reader, which may be an irq handler, so no lock is needed */
+#define CBUF_FLAG_SPSC (1 << 0)
+
+/**
+ * cbuf_initialize_flags
+ *
+ * Initialize a cbuf structure with CBUF_FLAG_* options.
+ *
+ * With CBUF_FLAG_SPSC the cbuf takes no lock and doesn't disable interrupts,
+ * relying on there being a single writer (cbuf_write, cbuf_write_char,
+ * cbuf_write_ahead, cbuf_reserve, cbuf_commit) and a single reader
+ * (cbuf_read, cbuf_read_char, cbuf_peek) at any one time.
+ *
+ * @param[in] cbuf A pointer to the cbuf structure to allocate.
+ * @param[in] len The size of the buffer, in bytes.  Must be a power of two.
+ * @param[in] buf A pointer to the memory to be used for internal storage, or
+ * NULL to malloc it.
+ * @param[in] flags CBUF_FLAG_* options.
+ */
+void cbuf_initialize_flags(cbuf_t *cbuf, size_t len, void *buf, uint flags);
+
 /**
  * cbuf_read
  *
@@ -113,6 +135,54 @@ size_t cbuf_peek(cbuf_t *cbuf, iovec_t *regions);
  */
 size_t cbuf_write(cbuf_t *cbuf, const void *buf, size_t len, bool canreschedule);
 
+/**
+ * cbuf_write_ahead
+ *
+ * Copy data into the free space of the cbuf, offset bytes past the end of the
+ * data already in it, without making it available for read.  Used to stash data
+ * that arrived ahead of a gap, which is then made readable with cbuf_commit()
+ * once the gap has been filled with cbuf_write().
+ *
+ * @param[in] cbuf The cbuf instance to write to.
+ * @param[in] offset Where to put the data, in bytes past the current end.
+ * @param[in] buf A pointer to a buffer to read data from.
+ * @param[in] len The maximum number of bytes to copy.
+ *
+ * @return The number of bytes which were copied, less than len if it didn't
+ * all fit in the free space.
+ */
+size_t cbuf_write_ahead(cbuf_t *cbuf, size_t offset, const void *buf, size_t len);
+
+/**
+ * cbuf_reserve
+ *
+ * The writer's counterpart to cbuf_peek().  Fills out a pair of iovec
+ * structures describing the (up to) two contiguous free regions the writer can
+ * fill in place, which are then made readable with cbuf_commit().
+ *
+ * @param[in] cbuf The cbuf instance to write to.
+ * @param[out] regions A pointer to two iovec structures to hold the free
+ * regions, in the order they will be read.
+ *
+ * @return The total number of free bytes described.
+ */
+size_t cbuf_reserve(cbuf_t *cbuf, iovec_t *regions);
+
+/**
+ * cbuf_commit
+ *
+ * Make the next len bytes past the end of the data in the cbuf available for
+ * read, as previously filled in with cbuf_write_ahead() or through
+ * cbuf_reserve().
+ *
+ * @param[in] cbuf The cbuf instance to commit to.
+ * @param[in] len The number of bytes to commit.  Must be no more than
+ * cbuf_space_avail().
+ * @param[in] canreschedule Rescheduling policy passed through to the internal
+ * event when signaling that there is now data in the buffer to be read.
+ */
+void cbuf_commit(cbuf_t *cbuf, size_t len, bool canreschedule);
+
 /**
  * cbuf_space_avail
  *
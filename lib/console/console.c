@@ -30,6 +30,7 @@
 #include <stdlib.h>
 #include <kernel/thread.h>
 #include <kernel/mutex.h>
+#include <lib/arena.h>
 #include <lib/console.h>
 #if WITH_LIB_ENV
 #include <lib/env.h>
@@ -83,6 +84,23 @@ static void dump_history(void);
 /* list of installed commands */
 static cmd_block *command_list = NULL;
 
+/*
+ * open addressed hash of every registered command, so a lookup doesn't walk
+ * all the blocks. names can repeat with different availability masks, and the
+ * most recently registered block wins, so the hash is filled in list order and
+ * lookups take the first match along the probe chain. until console_init
+ * builds it, lookups walk the list.
+ */
+struct command_hash_entry {
+    uint32_t hash;
+    const cmd *command;
+};
+
+static struct command_hash_entry *command_hash;
+static size_t command_hash_size; /* power of 2 */
+
+static void command_hash_rebuild(void);
+
 /* a linear array of statically defined command blocks,
    defined in the linker script.
  */
@@ -128,6 +146,8 @@ int console_init(void)
         console_register_commands(block);
     }
 
+    command_hash_rebuild();
+
 #if CONSOLE_ENABLE_HISTORY
     init_history();
 #endif
@@ -273,11 +293,74 @@ usage:
 }
 #endif  // CONSOLE_ENABLE_REPEAT
 
+static uint32_t command_hash_string(const char *str)
+{
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+
+    while (*str) {
+        hash ^= (uint8_t)*str++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* (re)build the hash from the block list, falling back to the list if there's no memory */
+static void command_hash_rebuild(void)
+{
+    cmd_block *block;
+    size_t count = 0;
+    size_t size = 16;
+
+    for (block = command_list; block != NULL; block = block->next)
+        count += block->count;
+
+    /* keep it at most half full */
+    while (size < count * 2)
+        size *= 2;
+
+    struct command_hash_entry *hash_table = calloc(size, sizeof(struct command_hash_entry));
+    if (hash_table) {
+        for (block = command_list; block != NULL; block = block->next) {
+            for (size_t j = 0; j < block->count; j++) {
+                uint32_t hash = command_hash_string(block->list[j].cmd_str);
+                size_t i;
+
+                for (i = hash & (size - 1); hash_table[i].command; i = (i + 1) & (size - 1))
+                    ;
+                hash_table[i].hash = hash;
+                hash_table[i].command = &block->list[j];
+            }
+        }
+    }
+
+    free(command_hash);
+    command_hash_size = size;
+    command_hash = hash_table;
+}
+
 static const cmd *match_command(const char *command, const uint8_t availability_mask)
 {
     cmd_block *block;
     size_t i;
 
+    if (command_hash) {
+        uint32_t hash = command_hash_string(command);
+        size_t mask = command_hash_size - 1;
+
+        for (i = hash & mask; command_hash[i].command; i = (i + 1) & mask) {
+            const cmd *curr_cmd = command_hash[i].command;
+
+            if (command_hash[i].hash == hash &&
+                    (availability_mask & curr_cmd->availability_mask) &&
+                    strcmp(command, curr_cmd->cmd_str) == 0) {
+                return curr_cmd;
+            }
+        }
+
+        return NULL;
+    }
+
     for (block = command_list; block != NULL; block = block->next) {
         const cmd *curr_cmd = block->list;
         for (i = 0; i < block->count; i++) {
@@ -583,19 +666,37 @@ done:
     return arg;
 }
 
+/* the same results as atoul, atol and the boolean names, in one pass over each argument */
 static void convert_args(int argc, cmd_args *argv)
 {
     int i;
 
     for (i = 0; i < argc; i++) {
-        unsigned long u = atoul(argv[i].str);
-        argv[i].u = u;
-        argv[i].p = (void *)u;
-        argv[i].i = atol(argv[i].str);
+        const char *s = argv[i].str;
+        unsigned long value = 0;
+        bool neg = false;
+
+        if (s[0] == '0' && s[1] == 'x') {
+            for (s += 2; isxdigit(*s); s++)
+                value = value * 16 + (isdigit(*s) ? *s - '0' : (*s | 0x20) - 'a' + 10);
+        } else {
+            if (*s == '-') {
+                neg = true;
+                s++;
+            }
+            for (; isdigit(*s); s++)
+                value = value * 10 + *s - '0';
+        }
+
+        /* atoul stops at a sign */
+        argv[i].u = neg ? 0 : value;
+        argv[i].p = (void *)argv[i].u;
+        argv[i].i = neg ? -(long)value : (long)value;
 
-        if (!strcmp(argv[i].str, "true") || !strcmp(argv[i].str, "on")) {
+        s = argv[i].str;
+        if ((s[0] == 't' || s[0] == 'o') && (!strcmp(s, "true") || !strcmp(s, "on"))) {
             argv[i].b = true;
-        } else if (!strcmp(argv[i].str, "false") || !strcmp(argv[i].str, "off")) {
+        } else if ((s[0] == 'f' || s[0] == 'o') && (!strcmp(s, "false") || !strcmp(s, "off"))) {
             argv[i].b = false;
         } else {
             argv[i].b = (argv[i].u == 0) ? false : true;
@@ -660,9 +761,6 @@ static status_t command_loop(int (*get_line)(const char **, void *), void *get_l
 //      for (int i = 0; i < argc; i++)
 //          dprintf("%d: '%s'\n", i, args[i].str);
 
-        /* convert the args */
-        convert_args(argc, args);
-
         /* try to match the command */
         const cmd *command = match_command(args[0].str, CMD_AVAIL_NORMAL);
         if (!command) {
@@ -671,12 +769,25 @@ static status_t command_loop(int (*get_line)(const char **, void *), void *get_l
             continue;
         }
 
+        /* convert the args */
+        convert_args(argc, args);
+
         if (!locked)
             mutex_acquire(command_lock);
 
         abort_script = false;
+
+        /* whatever the command takes from the scratch arena goes away with it */
+        arena_t *scratch = arena_scratch();
+        arena_mark_t mark;
+        if (scratch)
+            mark = arena_mark(scratch);
+
         lastresult = command->cmd_callback(argc, args);
 
+        if (scratch)
+            arena_release(scratch, mark);
+
 #if WITH_LIB_ENV
         bool report_result;
         env_get_bool("reportresult", &report_result, false);
@@ -814,6 +925,10 @@ void console_register_commands(cmd_block *block)
 
     block->next = command_list;
     command_list = block;
+
+    /* the new block has to come first in the chains, so start over */
+    if (command_hash)
+        command_hash_rebuild();
 }
 
 
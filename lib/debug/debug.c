@@ -31,6 +31,7 @@
 #include <platform.h>
 #include <platform/debug.h>
 #include <kernel/spinlock.h>
+#include <lib/io.h>
 
 void spin(uint32_t usecs)
 {
@@ -42,6 +43,8 @@ void spin(uint32_t usecs)
 
 void _panic(void *caller, const char *fmt, ...)
 {
+    console_output_sync();
+
     printf("panic (caller %p): ", caller);
 
     va_list ap;
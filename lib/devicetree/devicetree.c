@@ -21,14 +21,19 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <string.h>
+
 #include "devicetree.h"
 
 #define DT_MAGIC	0xD00DFEED
 #define DT_NODE_BEGIN	1
 #define DT_NODE_END	2
 #define DT_PROP		3
+#define DT_NOP		4
 #define DT_END		9
 
+#define DT_MAX_DEPTH	32
+
 typedef struct dt_slice slice_t;
 
 u32 dt_rd32(u8 *data) {
@@ -207,3 +212,288 @@ int dt_walk(devicetree_t *dtree, dt_node_cb ncb, dt_prop_cb pcb, void *cookie) {
 
 	return 0;
 }
+
+/* fnv-1a */
+static u32 dt_hash(const char *s) {
+	u32 hash = 2166136261u;
+	while (*s) {
+		hash ^= (u8)*s++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+struct dt_counts {
+	u32 nodes;
+	u32 compat;
+	u32 phandles;
+};
+
+/* walk the structure block once, counting what the index needs,
+ * and filling it in too if idx is set
+ */
+static int dt_index_scan(devicetree_t *dtree, dt_index_t *idx, struct dt_counts *c) {
+	u32 stack[DT_MAX_DEPTH];
+	u32 last[DT_MAX_DEPTH + 1];
+	u32 depth = 0;
+	slice_t dt = dtree->dt;
+	slice_t ds = dtree->ds;
+
+	c->nodes = c->compat = c->phandles = 0;
+	last[0] = DT_NO_NODE;
+
+	while (!sempty(&dt)) {
+		u32 type = su32(&dt);
+		switch (type) {
+		case DT_END:
+			if (depth)
+				return oops(dtree, "unexpected DT_END");
+			return 0;
+		case DT_NOP:
+			break;
+		case DT_NODE_BEGIN: {
+			if (depth == DT_MAX_DEPTH)
+				return oops(dtree, "tree too deep");
+			const char *name = sstring(&dt);
+			u32 n = c->nodes++;
+			if (idx) {
+				dt_index_node_t *node = &idx->nodes[n];
+				node->name = name;
+				node->parent = depth ? stack[depth - 1] : DT_NO_NODE;
+				node->next_sibling = DT_NO_NODE;
+				node->props = dt.data - dtree->dt.data;
+				node->phandle = 0;
+				if (last[depth] != DT_NO_NODE)
+					idx->nodes[last[depth]].next_sibling = n;
+			}
+			last[depth] = n;
+			stack[depth++] = n;
+			last[depth] = DT_NO_NODE;
+			break;
+		}
+		case DT_NODE_END:
+			if (depth == 0)
+				return oops(dtree, "unexpected NODE_END");
+			depth--;
+			break;
+		case DT_PROP: {
+			if (depth == 0)
+				return oops(dtree, "PROP outside of NODE");
+			u32 sz = su32(&dt);
+			u32 str = su32(&dt);
+			u8 *data = sdata(&dt, sz);
+			if (sz && !data)
+				return oops(dtree, "truncated property");
+			if (str >= ds.size)
+				return oops(dtree, "invalid property name");
+			const char *name = (const char*) (ds.data + str);
+			u32 n = stack[depth - 1];
+
+			if (!strcmp(name, "compatible")) {
+				/* a list of strings, most specific first */
+				u32 pos = 0;
+				while (pos < sz) {
+					const char *compat = (const char*) data + pos;
+					u32 len = strnlen(compat, sz - pos);
+					if (len == sz - pos)
+						break;
+					if (idx) {
+						dt_index_compat_t *e = &idx->compat[c->compat];
+						e->compat = compat;
+						e->hash = dt_hash(compat);
+						e->node = n;
+					}
+					c->compat++;
+					pos += len + 1;
+				}
+			} else if ((!strcmp(name, "phandle") || !strcmp(name, "linux,phandle")) && sz == 4) {
+				if (idx) {
+					idx->nodes[n].phandle = dt_rd32(data);
+					idx->phandles[c->phandles].phandle = dt_rd32(data);
+					idx->phandles[c->phandles].node = n;
+				}
+				c->phandles++;
+			}
+			break;
+		}
+		default:
+			return oops(dtree, "invalid node type");
+		}
+	}
+
+	if (depth != 0)
+		return oops(dtree, "incomplete tree");
+
+	return 0;
+}
+
+static u32 dt_bucket_count(u32 compat) {
+	u32 n = 1;
+	while (n < compat)
+		n <<= 1;
+	return n;
+}
+
+static u32 dt_index_layout(const struct dt_counts *c) {
+	return c->nodes * sizeof(dt_index_node_t) +
+		c->compat * sizeof(dt_index_compat_t) +
+		c->phandles * sizeof(dt_index_phandle_t) +
+		dt_bucket_count(c->compat) * sizeof(u32);
+}
+
+/* bytes of memory dt_index_init needs for this tree, 0 if it's malformed */
+u32 dt_index_size(devicetree_t *dt) {
+	struct dt_counts c;
+	if (dt_index_scan(dt, NULL, &c))
+		return 0;
+	return dt_index_layout(&c);
+}
+
+int dt_index_init(dt_index_t *idx, devicetree_t *dt, void *mem, u32 len) {
+	struct dt_counts c;
+	u32 i;
+
+	/* count first, so the arrays can be laid out */
+	if (dt_index_scan(dt, NULL, &c))
+		return -1;
+	if (dt_index_layout(&c) > len)
+		return oops(dt, "not enough memory for index");
+
+	u8 *p = mem;
+	idx->dt = dt;
+	idx->nodes = (dt_index_node_t *) p;
+	p += c.nodes * sizeof(dt_index_node_t);
+	idx->compat = (dt_index_compat_t *) p;
+	p += c.compat * sizeof(dt_index_compat_t);
+	idx->phandles = (dt_index_phandle_t *) p;
+	p += c.phandles * sizeof(dt_index_phandle_t);
+	idx->buckets = (u32 *) p;
+	idx->bucket_count = dt_bucket_count(c.compat);
+
+	if (dt_index_scan(dt, idx, &c))
+		return -1;
+	idx->node_count = c.nodes;
+	idx->compat_count = c.compat;
+	idx->phandle_count = c.phandles;
+
+	/* chain the compatible strings into their buckets, keeping tree order in each */
+	for (i = 0; i < idx->bucket_count; i++)
+		idx->buckets[i] = DT_NO_NODE;
+	for (i = c.compat; i-- > 0; ) {
+		u32 b = idx->compat[i].hash & (idx->bucket_count - 1);
+		idx->compat[i].next = idx->buckets[b];
+		idx->buckets[b] = i;
+	}
+
+	/* sort the phandles, they're usually close to in order already */
+	for (i = 1; i < c.phandles; i++) {
+		dt_index_phandle_t e = idx->phandles[i];
+		u32 j = i;
+		while (j > 0 && idx->phandles[j - 1].phandle > e.phandle) {
+			idx->phandles[j] = idx->phandles[j - 1];
+			j--;
+		}
+		idx->phandles[j] = e;
+	}
+
+	return 0;
+}
+
+/* does a path component match a node name, which may have a unit address the component leaves off */
+static int dt_name_match(const char *name, const char *comp, u32 len) {
+	if (strncmp(name, comp, len))
+		return 0;
+	return name[len] == 0 || (name[len] == '@' && !memchr(comp, '@', len));
+}
+
+int dt_find_path(dt_index_t *idx, const char *path) {
+	u32 n = 0;
+
+	if (idx->node_count == 0 || *path != '/')
+		return -1;
+
+	for (;;) {
+		while (*path == '/')
+			path++;
+		if (*path == 0)
+			return n;
+
+		const char *end = strchr(path, '/');
+		u32 len = end ? (u32)(end - path) : strlen(path);
+
+		/* children follow their parent directly, and are chained by sibling */
+		u32 child = n + 1;
+		if (child >= idx->node_count || idx->nodes[child].parent != n)
+			return -1;
+		while (child != DT_NO_NODE && !dt_name_match(idx->nodes[child].name, path, len))
+			child = idx->nodes[child].next_sibling;
+		if (child == DT_NO_NODE)
+			return -1;
+
+		n = child;
+		path += len;
+	}
+}
+
+int dt_find_phandle(dt_index_t *idx, u32 phandle) {
+	u32 lo = 0, hi = idx->phandle_count;
+
+	while (lo < hi) {
+		u32 mid = lo + (hi - lo) / 2;
+		if (idx->phandles[mid].phandle == phandle)
+			return idx->phandles[mid].node;
+		if (idx->phandles[mid].phandle < phandle)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return -1;
+}
+
+int dt_find_compatible(dt_index_t *idx, const char *compat, int after) {
+	u32 hash = dt_hash(compat);
+	u32 i;
+
+	if (idx->compat_count == 0)
+		return -1;
+
+	for (i = idx->buckets[hash & (idx->bucket_count - 1)]; i != DT_NO_NODE; i = idx->compat[i].next) {
+		dt_index_compat_t *e = &idx->compat[i];
+		if (e->hash == hash && (after < 0 || e->node > (u32)after) && !strcmp(e->compat, compat))
+			return e->node;
+	}
+	return -1;
+}
+
+int dt_get_prop(dt_index_t *idx, int node, const char *name, u8 **data, u32 *size) {
+	slice_t dt;
+	slice_t ds = idx->dt->ds;
+
+	if (node < 0 || (u32)node >= idx->node_count)
+		return -1;
+
+	/* the node's properties come before any of its children */
+	dt = idx->dt->dt;
+	dt.data += idx->nodes[node].props;
+	dt.size -= idx->nodes[node].props;
+
+	while (!sempty(&dt)) {
+		u32 type = su32(&dt);
+		if (type == DT_NOP)
+			continue;
+		if (type != DT_PROP)
+			break;
+
+		u32 sz = su32(&dt);
+		u32 str = su32(&dt);
+		u8 *pdata = sdata(&dt, sz);
+		if (str < ds.size && !strcmp((const char*) (ds.data + str), name)) {
+			if (data)
+				*data = pdata;
+			if (size)
+				*size = sz;
+			return 0;
+		}
+	}
+	return -1;
+}
@@ -58,6 +58,53 @@ typedef int (*dt_prop_cb)(const char *name, u8 *data, u32 size, void *cookie);
 int dt_init(devicetree_t *dt, void *data, u32 len);
 int dt_walk(devicetree_t *dt, dt_node_cb ncb, dt_prop_cb pcb, void *cookie);
 
+/* an index of the tree built in one walk, for lookups that don't rescan the blob.
+ * nodes are numbered in tree order, the root is node 0. the index lives in
+ * memory the caller hands to dt_index_init, dt_index_size says how much.
+ */
+#define DT_NO_NODE 0xffffffff
+
+typedef struct dt_index_node {
+	const char *name;
+	u32 parent;
+	u32 next_sibling;
+	u32 props;		// offset in the structure block of the node's first property
+	u32 phandle;
+} dt_index_node_t;
+
+typedef struct dt_index_compat {
+	const char *compat;
+	u32 hash;
+	u32 node;
+	u32 next;		// next in the hash bucket
+} dt_index_compat_t;
+
+typedef struct dt_index_phandle {
+	u32 phandle;
+	u32 node;
+} dt_index_phandle_t;
+
+typedef struct dt_index {
+	devicetree_t *dt;
+	dt_index_node_t *nodes;
+	u32 node_count;
+	dt_index_compat_t *compat;	// every compatible string, in tree order
+	u32 compat_count;
+	u32 *buckets;
+	u32 bucket_count;
+	dt_index_phandle_t *phandles;	// sorted by phandle
+	u32 phandle_count;
+} dt_index_t;
+
+u32 dt_index_size(devicetree_t *dt);
+int dt_index_init(dt_index_t *idx, devicetree_t *dt, void *mem, u32 len);
+
+/* these return a node number, or -1 */
+int dt_find_path(dt_index_t *idx, const char *path);
+int dt_find_phandle(dt_index_t *idx, u32 phandle);
+int dt_find_compatible(dt_index_t *idx, const char *compat, int after); // after -1 to start
+int dt_get_prop(dt_index_t *idx, int node, const char *name, u8 **data, u32 *size);
+
 u32 dt_rd32(u8 *data);
 void dt_wr32(u32 n, u8 *data);
 
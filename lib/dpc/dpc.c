@@ -21,75 +21,199 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 #include <debug.h>
+#include <assert.h>
 #include <stddef.h>
-#include <list.h>
+#include <stdbool.h>
+#include <stdio.h>
 #include <malloc.h>
 #include <err.h>
+#include <arch/ops.h>
 #include <lib/dpc.h>
 #include <kernel/thread.h>
 #include <kernel/event.h>
+#include <kernel/mp.h>
 #include <lk/init.h>
 
-struct dpc {
-    struct list_node node;
+/*
+ * Each cpu has its own dpc thread, pinned to it, and its own queue. Queued
+ * nodes are pushed onto a singly linked lifo by any number of producers with
+ * a compare-and-swap on the head. The cpu's dpc thread is the only consumer:
+ * it swaps the whole list out at once and reverses it back into queue order,
+ * so there is never any contention on the consumer side.
+ */
+struct dpc_cpu {
+    dpc_t *volatile list;
+    event_t event;
+    thread_t *thread;
+} __CPU_ALIGN;
+
+static struct dpc_cpu dpc_cpu[SMP_MAX_CPUS];
+
+static int dpc_thread_routine(void *arg);
+
+#if ARM_ISA_ARMV6M
+/* no exclusive load/store on cortex-m0, fall back to masking interrupts */
+static bool dpc_list_cmpxchg(dpc_t *volatile *head, dpc_t **oldval, dpc_t *newval)
+{
+    bool ret;
+    spin_lock_saved_state_t state;
+
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    ret = (*head == *oldval);
+    if (ret)
+        *head = newval;
+    else
+        *oldval = *head;
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    return ret;
+}
+
+static dpc_t *dpc_list_take(dpc_t *volatile *head)
+{
+    dpc_t *list = *head;
+    while (!dpc_list_cmpxchg(head, &list, NULL))
+        ;
+    return list;
+}
+#else
+static bool dpc_list_cmpxchg(dpc_t *volatile *head, dpc_t **oldval, dpc_t *newval)
+{
+    return __atomic_compare_exchange_n(head, oldval, newval, true,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+static dpc_t *dpc_list_take(dpc_t *volatile *head)
+{
+    return __atomic_exchange_n(head, NULL, __ATOMIC_ACQUIRE);
+}
+#endif
+
+void dpc_init(dpc_t *dpc, dpc_callback cb, void *arg)
+{
+    *dpc = (dpc_t)DPC_INITIAL_VALUE(cb, arg);
+}
+
+status_t dpc_queue_cpu(dpc_t *dpc, uint cpu, uint flags)
+{
+    DEBUG_ASSERT(dpc);
+    DEBUG_ASSERT(dpc->cb);
+    DEBUG_ASSERT(cpu < SMP_MAX_CPUS);
+
+    /* a cpu that never came up would never run it, hand it to the boot cpu */
+    if (!mp_is_cpu_active(cpu))
+        cpu = 0;
+
+    if (atomic_cmpxchg(&dpc->queued, 0, 1) != 0)
+        return ERR_ALREADY_EXISTS;
+
+    struct dpc_cpu *c = &dpc_cpu[cpu];
+    dpc_t *head = c->list;
+    do {
+        dpc->next = head;
+    } while (!dpc_list_cmpxchg(&c->list, &head, dpc));
+
+    /* only the push onto an empty list needs to kick the dpc thread */
+    if (head == NULL)
+        event_signal(&c->event, (flags & DPC_FLAG_NORESCHED) ? false : true);
+
+    return NO_ERROR;
+}
+
+status_t dpc_queue_etc(dpc_t *dpc, uint flags)
+{
+    /* if we migrate after reading it the work just lands on the old cpu */
+    return dpc_queue_cpu(dpc, arch_curr_cpu_num(), flags);
+}
+
+/* node for the allocating dpc_queue() interface, freed after it runs */
+struct dpc_alloc {
+    dpc_t dpc;
 
     dpc_callback cb;
     void *arg;
 };
 
-static struct list_node dpc_list = LIST_INITIAL_VALUE(dpc_list);
-static event_t dpc_event;
+static void dpc_alloc_callback(void *arg)
+{
+    struct dpc_alloc *dpc = arg;
 
-static int dpc_thread_routine(void *arg);
+    dpc->cb(dpc->arg);
+    free(dpc);
+}
 
 status_t dpc_queue(dpc_callback cb, void *arg, uint flags)
 {
-    struct dpc *dpc;
+    struct dpc_alloc *dpc;
 
-    dpc = malloc(sizeof(struct dpc));
+    dpc = malloc(sizeof(struct dpc_alloc));
 
     if (dpc == NULL)
         return ERR_NO_MEMORY;
 
     dpc->cb = cb;
     dpc->arg = arg;
-    enter_critical_section();
-    list_add_tail(&dpc_list, &dpc->node);
-    event_signal(&dpc_event, (flags & DPC_FLAG_NORESCHED) ? false : true);
-    exit_critical_section();
+    dpc_init(&dpc->dpc, &dpc_alloc_callback, dpc);
 
-    return NO_ERROR;
+    return dpc_queue_etc(&dpc->dpc, flags);
 }
 
 static int dpc_thread_routine(void *arg)
 {
+    struct dpc_cpu *c = arg;
+
     for (;;) {
-        event_wait(&dpc_event);
+        event_wait(&c->event);
+
+        /* unsignal before taking the list, any push after the take will find
+         * the list empty and signal again */
+        event_unsignal(&c->event);
+        dpc_t *list = dpc_list_take(&c->list);
+
+        /* the list is newest first, flip it back into queue order */
+        dpc_t *ordered = NULL;
+        while (list) {
+            dpc_t *next = list->next;
+            list->next = ordered;
+            ordered = list;
+            list = next;
+        }
+
+        while (ordered) {
+            dpc_t *dpc = ordered;
+            ordered = dpc->next;
 
-        enter_critical_section();
-        struct dpc *dpc = list_remove_head_type(&dpc_list, struct dpc, node);
-        if (!dpc)
-            event_unsignal(&dpc_event);
-        exit_critical_section();
+            dpc_callback cb = dpc->cb;
+            void *cb_arg = dpc->arg;
 
-        if (dpc) {
-//          dprintf("dpc calling %p, arg %p\n", dpc->cb, dpc->arg);
-            dpc->cb(dpc->arg);
+            /* the node belongs to the caller again from here on */
+            dpc->next = NULL;
+            atomic_swap(&dpc->queued, 0);
 
-            free(dpc);
+//          dprintf("dpc calling %p, arg %p\n", cb, cb_arg);
+            cb(cb_arg);
         }
     }
 
     return 0;
 }
 
-static void dpc_init(uint level)
+static void dpc_init_hook(uint level)
 {
-    event_init(&dpc_event, false, 0);
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        struct dpc_cpu *c = &dpc_cpu[i];
+        char name[16];
 
-    thread_detach_and_resume(thread_create("dpc", &dpc_thread_routine, NULL, DPC_PRIORITY, DEFAULT_STACK_SIZE));
-}
+        event_init(&c->event, false, 0);
 
-LK_INIT_HOOK(libdpc, &dpc_init, LK_INIT_LEVEL_THREADING);
+        snprintf(name, sizeof(name), "dpc %u", i);
+        c->thread = thread_create(name, &dpc_thread_routine, c, DPC_PRIORITY, DEFAULT_STACK_SIZE);
+        if (!c->thread)
+            panic("unable to create dpc thread for cpu %u\n", i);
 
+        thread_set_pinned_cpu(c->thread, i);
+        thread_detach_and_resume(c->thread);
+    }
+}
 
+LK_INIT_HOOK(libdpc, &dpc_init_hook, LK_INIT_LEVEL_THREADING);
@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/dvfs.h>
+
+#include <debug.h>
+#include <assert.h>
+#include <err.h>
+#include <trace.h>
+#include <stdio.h>
+#include <string.h>
+#include <kernel/mp.h>
+#include <kernel/mutex.h>
+#include <kernel/percpu.h>
+#include <kernel/thread.h>
+#include <platform.h>
+
+#define LOCAL_TRACE 0
+
+/* how often the governor looks at the load */
+#define DVFS_SAMPLE_MSECS 20
+
+/* busiest cpu load, in percent, that sends the clock to the top. below it the
+ * clock is brought down to where the same work would come out at this load */
+#define DVFS_UP_THRESHOLD 80
+
+static struct {
+    mutex_t lock;
+
+    const dvfs_opp_t *opps;
+    uint count;
+    uint cur;
+    dvfs_set_opp_t set;
+    void *arg;
+
+    /* outstanding dvfs_hold_max() calls */
+    uint holds;
+
+    /* time spent at each operating point, up to since for the current one */
+    lk_bigtime_t time_us[DVFS_MAX_OPPS];
+    lk_bigtime_t since;
+    ulong transitions;
+} dvfs = {
+    .lock = MUTEX_INITIAL_VALUE(dvfs.lock),
+};
+
+/* with the lock held */
+static status_t dvfs_set_locked(uint index)
+{
+    DEBUG_ASSERT(index < dvfs.count);
+
+    if (index == dvfs.cur)
+        return NO_ERROR;
+
+    LTRACEF("%u -> %u khz\n", dvfs.opps[dvfs.cur].freq_khz, dvfs.opps[index].freq_khz);
+
+    status_t err = dvfs.set(&dvfs.opps[index], dvfs.arg);
+    if (err < 0) {
+        TRACEF("failed to switch to %u khz, err %d\n", dvfs.opps[index].freq_khz, err);
+        return err;
+    }
+
+    lk_bigtime_t now = current_time_hires();
+    dvfs.time_us[dvfs.cur] += now - dvfs.since;
+    dvfs.since = now;
+    dvfs.cur = index;
+    dvfs.transitions++;
+
+    return NO_ERROR;
+}
+
+#if THREAD_STATS
+/* how long a cpu has been idle in total, up to now */
+static lk_bigtime_t dvfs_cpu_idle_time(uint cpu, lk_bigtime_t now)
+{
+    const struct thread_stats *stats = &get_percpu_cpu(cpu)->thread_stats;
+
+    lk_bigtime_t idle = stats->idle_time;
+    if (mp_is_cpu_idle(cpu))
+        idle += now - stats->last_idle_timestamp;
+
+    return idle;
+}
+
+/* the slowest operating point that keeps up with load percent at the current one */
+static uint dvfs_target(uint load)
+{
+    if (load >= DVFS_UP_THRESHOLD)
+        return dvfs.count - 1;
+
+    uint64_t want = (uint64_t)dvfs.opps[dvfs.cur].freq_khz * load / DVFS_UP_THRESHOLD;
+    for (uint i = 0; i < dvfs.count; i++) {
+        if (dvfs.opps[i].freq_khz >= want)
+            return i;
+    }
+
+    return dvfs.count - 1;
+}
+
+static int dvfs_governor_thread(void *arg)
+{
+    lk_bigtime_t last_idle[SMP_MAX_CPUS];
+    lk_bigtime_t last = current_time_hires();
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++)
+        last_idle[i] = dvfs_cpu_idle_time(i, last);
+
+    for (;;) {
+        thread_sleep(DVFS_SAMPLE_MSECS);
+
+        lk_bigtime_t now = current_time_hires();
+        lk_bigtime_t elapsed = now - last;
+        last = now;
+        if (elapsed == 0)
+            continue;
+
+        /* the clock is shared, so the busiest cpu decides */
+        uint load = 0;
+        for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+            lk_bigtime_t idle_now = dvfs_cpu_idle_time(i, now);
+            lk_bigtime_t idle = idle_now - last_idle[i];
+            last_idle[i] = idle_now;
+
+            if (!mp_is_cpu_active(i))
+                continue;
+
+            /* the stats are read without the owning cpu stopping, clamp what comes out */
+            if ((int64_t)idle < 0)
+                idle = 0;
+            if (idle > elapsed)
+                idle = elapsed;
+            uint cpu_load = (elapsed - idle) * 100 / elapsed;
+            if (cpu_load > load)
+                load = cpu_load;
+        }
+
+        mutex_acquire(&dvfs.lock);
+        if (dvfs.holds == 0)
+            dvfs_set_locked(dvfs_target(load));
+        mutex_release(&dvfs.lock);
+    }
+
+    return 0;
+}
+#endif // THREAD_STATS
+
+status_t dvfs_register(const dvfs_opp_t *opps, uint count, uint current, dvfs_set_opp_t set, void *arg)
+{
+    if (!opps || !set || count == 0 || count > DVFS_MAX_OPPS || current >= count)
+        return ERR_INVALID_ARGS;
+
+    for (uint i = 1; i < count; i++) {
+        if (opps[i].freq_khz <= opps[i - 1].freq_khz)
+            return ERR_INVALID_ARGS;
+    }
+
+    mutex_acquire(&dvfs.lock);
+
+    if (dvfs.opps) {
+        mutex_release(&dvfs.lock);
+        return ERR_ALREADY_EXISTS;
+    }
+
+    dvfs.opps = opps;
+    dvfs.count = count;
+    dvfs.cur = current;
+    dvfs.set = set;
+    dvfs.arg = arg;
+    dvfs.since = current_time_hires();
+
+    /* start out at full speed, the governor brings it down once it sees the load */
+    dvfs_set_locked(count - 1);
+
+    mutex_release(&dvfs.lock);
+
+#if THREAD_STATS
+    thread_t *t = thread_create("dvfs", &dvfs_governor_thread, NULL, HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+    if (!t)
+        return ERR_NO_MEMORY;
+    thread_detach_and_resume(t);
+#endif
+
+    return NO_ERROR;
+}
+
+void dvfs_hold_max(void)
+{
+    mutex_acquire(&dvfs.lock);
+
+    if (dvfs.holds++ == 0 && dvfs.opps)
+        dvfs_set_locked(dvfs.count - 1);
+
+    mutex_release(&dvfs.lock);
+}
+
+void dvfs_release_max(void)
+{
+    mutex_acquire(&dvfs.lock);
+
+    DEBUG_ASSERT(dvfs.holds > 0);
+    if (dvfs.holds > 0)
+        dvfs.holds--;
+
+    mutex_release(&dvfs.lock);
+}
+
+uint32_t dvfs_get_freq_khz(void)
+{
+    const dvfs_opp_t *opps = dvfs.opps;
+
+    return opps ? opps[dvfs.cur].freq_khz : 0;
+}
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+
+static int cmd_dvfs(int argc, const cmd_args *argv)
+{
+    static bool console_hold;
+
+    if (argc > 1 && !strcmp(argv[1].str, "hold")) {
+        if (!console_hold)
+            dvfs_hold_max();
+        console_hold = true;
+    } else if (argc > 1 && !strcmp(argv[1].str, "release")) {
+        if (console_hold)
+            dvfs_release_max();
+        console_hold = false;
+    } else if (argc > 1) {
+        printf("usage: %s [hold|release]\n", argv[0].str);
+        return ERR_INVALID_ARGS;
+    }
+
+    mutex_acquire(&dvfs.lock);
+
+    if (!dvfs.opps) {
+        mutex_release(&dvfs.lock);
+        printf("no operating points registered\n");
+        return NO_ERROR;
+    }
+
+    lk_bigtime_t now = current_time_hires();
+    printf("  %10s %8s %14s\n", "khz", "mv", "time ms");
+    for (uint i = 0; i < dvfs.count; i++) {
+        lk_bigtime_t t = dvfs.time_us[i] + ((i == dvfs.cur) ? now - dvfs.since : 0);
+        printf("%c %10u %8u %14llu\n", (i == dvfs.cur) ? '*' : ' ',
+               dvfs.opps[i].freq_khz, dvfs.opps[i].voltage_mv, t / 1000);
+    }
+    printf("transitions %lu, max holds %u\n", dvfs.transitions, dvfs.holds);
+#if !THREAD_STATS
+    printf("no governor without THREAD_STATS\n");
+#endif
+
+    mutex_release(&dvfs.lock);
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("dvfs", "cpu operating points, [hold|release] to pin the top one", &cmd_dvfs)
+STATIC_COMMAND_END(dvfs);
+
+#endif // WITH_LIB_CONSOLE
@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+/*
+ * cpu frequency scaling. A platform that can change the cpu clock registers its
+ * operating points and a governor thread moves between them on the load seen in
+ * each cpu's idle time: to the top as soon as any cpu is busy, otherwise down to
+ * the slowest point that still keeps up. All cpus share the one clock.
+ *
+ * The load comes from THREAD_STATS. Without it the cpus are left at the top
+ * operating point.
+ */
+#define DVFS_MAX_OPPS 16
+
+typedef struct dvfs_opp {
+    uint32_t freq_khz;
+    /* for display, 0 if the platform doesn't scale the voltage */
+    uint32_t voltage_mv;
+} dvfs_opp_t;
+
+/* move every cpu to opp. called in thread context, may block */
+typedef status_t (*dvfs_set_opp_t)(const dvfs_opp_t *opp, void *arg);
+
+/* register the operating points, ordered by increasing frequency, and the index of
+ * the one the cpus are running at now. once, at init */
+status_t dvfs_register(const dvfs_opp_t *opps, uint count, uint current, dvfs_set_opp_t set, void *arg);
+
+/* run at the top operating point until released, for benchmarks and anything else
+ * that wants repeatable timing. holds nest */
+void dvfs_hold_max(void);
+void dvfs_release_max(void);
+
+/* the cpu frequency right now, 0 if nothing is registered */
+uint32_t dvfs_get_freq_khz(void);
+
+__END_CDECLS
@@ -29,6 +29,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <arch/ops.h>
+#include <arch/defines.h>
+#include <lib/bio.h>
 
 #define LOCAL_TRACE 0
 
@@ -82,6 +84,16 @@ static ssize_t elf_read_hook_memory(struct elf_handle *handle, void *buf, uint64
     return toread;
 }
 
+static ssize_t elf_read_hook_bdev(struct elf_handle *handle, void *buf, uint64_t offset, size_t len)
+{
+    LTRACEF("handle %p, buf %p, offset %lld, len %zu\n", handle, buf, offset, len);
+
+    DEBUG_ASSERT(handle);
+    DEBUG_ASSERT(handle->bdev);
+
+    return bio_read(handle->bdev, buf, handle->bdev_offset + offset, len);
+}
+
 status_t elf_open_handle(elf_handle_t *handle, elf_read_hook_t read_hook, void *read_hook_arg, bool free_read_hook_arg)
 {
     if (!handle)
@@ -114,6 +126,32 @@ status_t elf_open_handle_memory(elf_handle_t *handle, const void *ptr, size_t le
     return err;
 }
 
+status_t elf_open_handle_bdev(elf_handle_t *handle, const char *bdev_name, off_t offset)
+{
+    if (!bdev_name || offset < 0)
+        return ERR_INVALID_ARGS;
+
+    bdev_t *dev = bio_open(bdev_name);
+    if (!dev)
+        return ERR_NOT_FOUND;
+
+    if (offset >= dev->total_size) {
+        bio_close(dev);
+        return ERR_OUT_OF_RANGE;
+    }
+
+    status_t err = elf_open_handle(handle, elf_read_hook_bdev, NULL, false);
+    if (err < 0) {
+        bio_close(dev);
+        return err;
+    }
+
+    handle->bdev = dev;
+    handle->bdev_offset = offset;
+
+    return NO_ERROR;
+}
+
 void elf_close_handle(elf_handle_t *handle)
 {
     if (!handle || !handle->open)
@@ -121,6 +159,9 @@ void elf_close_handle(elf_handle_t *handle)
 
     handle->open = false;
 
+    if (handle->bdev)
+        bio_close(handle->bdev);
+
     if (handle->free_read_hook_arg)
         free(handle->read_hook_arg);
 
@@ -181,6 +222,159 @@ static int verify_eheader(const void *header)
     return NO_ERROR;
 }
 
+/* a PT_LOAD segment on its way into memory */
+struct elf_segment_load {
+    const elf_phdr_t *pheader;
+    void *ptr;
+
+    // the block aligned middle of the file data, read asynchronously
+    size_t async_offset;
+    size_t async_len;
+    bio_iovec_t iov;
+    bio_request_t req;
+};
+
+/* zero a range of memory, only the cache lines entirely within it if whole_lines */
+static void zero_range(uint8_t *start, uint8_t *end, bool whole_lines)
+{
+    if (whole_lines) {
+        start = (uint8_t *)ROUNDUP((uintptr_t)start, CACHE_LINE);
+        end = (uint8_t *)ROUNDDOWN((uintptr_t)end, CACHE_LINE);
+    }
+    if (end > start)
+        memset(start, 0, end - start);
+}
+
+static ssize_t read_range(elf_handle_t *handle, const struct elf_segment_load *load,
+                          size_t offset, size_t len)
+{
+    if (len == 0)
+        return 0;
+
+    ssize_t readerr = handle->read_hook(handle, (uint8_t *)load->ptr + offset,
+                                        load->pheader->p_offset + offset, len);
+    if (readerr < (ssize_t)len)
+        return (readerr < 0) ? readerr : ERR_IO;
+
+    return readerr;
+}
+
+/*
+ * Read the file portion of every segment and zero the rest. When streaming
+ * from a block device the block aligned part of each segment goes out as an
+ * asynchronous request, all of them at once, and BSS is cleared while they are
+ * in flight. Only whole cache lines are zeroed early, so nothing the cpu
+ * writes shares a line with memory a device is still filling. The unaligned
+ * ends are read synchronously once the requests are done.
+ */
+static status_t load_segments(elf_handle_t *handle, struct elf_segment_load *loads, uint count)
+{
+    status_t err = NO_ERROR;
+    bdev_t *dev = handle->bdev;
+
+    for (uint i = 0; i < count; i++) {
+        struct elf_segment_load *load = &loads[i];
+        size_t filesz = load->pheader->p_filesz;
+
+        LTRACEF("reading segment at offset " ELF_OFF_PRINT_U " to address %p\n",
+                load->pheader->p_offset, load->ptr);
+
+        if (!dev || filesz == 0)
+            continue;
+
+        off_t pos = handle->bdev_offset + load->pheader->p_offset;
+        size_t head = ROUNDUP(pos, (off_t)dev->block_size) - pos;
+        if (filesz <= head)
+            continue;
+
+        size_t len = ROUNDDOWN(filesz - head, dev->block_size);
+        if (len == 0)
+            continue;
+
+        load->iov.base = (uint8_t *)load->ptr + head;
+        load->iov.len = len;
+        load->req.write = false;
+        load->req.block = (pos + head) >> dev->block_shift;
+        load->req.iov = &load->iov;
+        load->req.iov_count = 1;
+
+        // if the device won't take it, the whole segment is read synchronously below
+        if (bio_submit(dev, &load->req) < 0)
+            continue;
+
+        load->async_offset = head;
+        load->async_len = len;
+    }
+
+    // clear bss while the reads are in flight
+    for (uint i = 0; i < count; i++) {
+        struct elf_segment_load *load = &loads[i];
+        uint8_t *ptr = load->ptr;
+
+        zero_range(ptr + load->pheader->p_filesz, ptr + load->pheader->p_memsz, true);
+    }
+
+    // wait for everything submitted, even after a failure, since the requests own the memory
+    for (uint i = 0; i < count; i++) {
+        struct elf_segment_load *load = &loads[i];
+
+        if (load->async_len == 0)
+            continue;
+
+        ssize_t readerr = bio_request_wait(&load->req);
+        if (readerr < (ssize_t)load->async_len) {
+            LTRACEF("error %ld reading segment %u\n", readerr, i);
+            if (err == NO_ERROR)
+                err = (readerr < 0) ? readerr : ERR_IO;
+        }
+    }
+    if (err < 0)
+        return err;
+
+    for (uint i = 0; i < count; i++) {
+        struct elf_segment_load *load = &loads[i];
+        uint8_t *ptr = load->ptr;
+        size_t filesz = load->pheader->p_filesz;
+        size_t memsz = load->pheader->p_memsz;
+        ssize_t readerr;
+
+        // whatever wasn't read asynchronously
+        if (load->async_len) {
+            size_t tail = load->async_offset + load->async_len;
+
+            readerr = read_range(handle, load, 0, load->async_offset);
+            if (readerr >= 0)
+                readerr = read_range(handle, load, tail, filesz - tail);
+        } else {
+            readerr = read_range(handle, load, 0, filesz);
+        }
+        if (readerr < 0) {
+            LTRACEF("error %ld reading segment %u\n", readerr, i);
+            return readerr;
+        }
+
+        // zero out the ends of bss that didn't cover whole cache lines
+        if (memsz > filesz) {
+            uint8_t *bss = ptr + filesz;
+            uint8_t *end = ptr + memsz;
+            uint8_t *mid = (uint8_t *)ROUNDUP((uintptr_t)bss, CACHE_LINE);
+
+            LTRACEF("zeroing memory at %p, size %zu\n", bss, memsz - filesz);
+            if (ROUNDDOWN((uintptr_t)end, CACHE_LINE) <= (uintptr_t)mid) {
+                zero_range(bss, end, false);
+            } else {
+                zero_range(bss, mid, false);
+                zero_range((uint8_t *)ROUNDDOWN((uintptr_t)end, CACHE_LINE), end, false);
+            }
+        }
+
+        // make sure the i&d cache are coherent, if they exist, once for the whole segment
+        arch_sync_cache_range((addr_t)ptr, memsz);
+    }
+
+    return NO_ERROR;
+}
+
 status_t elf_load(elf_handle_t *handle)
 {
     if (!handle)
@@ -221,6 +415,13 @@ status_t elf_load(elf_handle_t *handle)
         return ERR_NO_MEMORY;
     }
 
+    // allocate space for every load segment up front, so they can all be read at once
+    struct elf_segment_load *loads = calloc(handle->eheader.e_phnum, sizeof(*loads));
+    if (!loads) {
+        LTRACEF("failed to allocate memory for segment state\n");
+        return ERR_NO_MEMORY;
+    }
+
     LTRACEF("program headers:\n");
     uint load_count = 0;
     for (uint i = 0; i < handle->eheader.e_phnum; i++) {
@@ -234,46 +435,239 @@ status_t elf_load(elf_handle_t *handle)
                 pheader->p_paddr, pheader->p_memsz, pheader->p_filesz);
 
         // we only care about PT_LOAD segments at the moment
-        if (pheader->p_type == PT_LOAD) {
-            // if the memory allocation hook exists, call it
-            void *ptr = (void *)(uintptr_t)pheader->p_vaddr;
-
-            if (handle->mem_alloc_hook) {
-                status_t err = handle->mem_alloc_hook(handle, &ptr, pheader->p_memsz, load_count, 0);
-                if (err < 0) {
-                    LTRACEF("mem hook failed, abort\n");
-                    // XXX clean up what we got so far
-                    return err;
-                }
-            }
+        if (pheader->p_type != PT_LOAD)
+            continue;
 
-            // read the file portion of the segment into memory at vaddr
-            LTRACEF("reading segment at offset " ELF_OFF_PRINT_U " to address %p\n", pheader->p_offset, ptr);
-            readerr = handle->read_hook(handle, ptr, pheader->p_offset, pheader->p_filesz);
-            if (readerr < (ssize_t)pheader->p_filesz) {
-                LTRACEF("error %ld reading program header %u\n", readerr, i);
-                return (readerr < 0) ? readerr : ERR_IO;
-            }
+        if (pheader->p_filesz > pheader->p_memsz) {
+            LTRACEF("segment %u file size larger than memory size\n", i);
+            free(loads);
+            return ERR_NOT_VALID;
+        }
+
+        // if the memory allocation hook exists, call it
+        void *ptr = (void *)(uintptr_t)pheader->p_vaddr;
 
-            // zero out he difference between memsz and filesz
-            size_t tozero = pheader->p_memsz - pheader->p_filesz;
-            if (tozero > 0) {
-                uint8_t *ptr2 = (uint8_t *)ptr + pheader->p_filesz;
-                LTRACEF("zeroing memory at %p, size %zu\n", ptr2, tozero);
-                memset(ptr2, 0, tozero);
+        if (handle->mem_alloc_hook) {
+            status_t err = handle->mem_alloc_hook(handle, &ptr, pheader->p_memsz, load_count, 0);
+            if (err < 0) {
+                LTRACEF("mem hook failed, abort\n");
+                // XXX clean up what we got so far
+                free(loads);
+                return err;
             }
+        }
 
-            // make sure the i&d cache are coherent, if they exist
-            arch_sync_cache_range((addr_t)ptr, pheader->p_memsz);
+        loads[load_count].pheader = pheader;
+        loads[load_count].ptr = ptr;
 
-            // track the number of load segments we have seen to pass the mem alloc hook
-            load_count++;
-        }
+        // track the number of load segments we have seen to pass the mem alloc hook
+        load_count++;
     }
 
+    status_t err = load_segments(handle, loads, load_count);
+    free(loads);
+    if (err < 0)
+        return err;
+
     // save the entry point
     handle->entry = handle->eheader.e_entry;
 
     return NO_ERROR;
 }
 
+
+/* the program headers have to follow closely, nothing is placed until they're in */
+#define ELF_STREAM_HEADER_MAX 4096
+
+status_t elf_stream_init(elf_stream_t *stream)
+{
+    if (!stream)
+        return ERR_INVALID_ARGS;
+
+    memset(stream, 0, sizeof(*stream));
+    stream->handle.open = true;
+
+    return NO_ERROR;
+}
+
+static void stream_finish_segment(elf_stream_t *stream, uint i)
+{
+    const elf_phdr_t *pheader = &stream->handle.pheaders[i];
+    uint8_t *ptr = stream->seg_ptr[i];
+
+    if (pheader->p_memsz > pheader->p_filesz) {
+        LTRACEF("zeroing memory at %p, size " ELF_ADDR_PRINT_U "\n",
+                ptr + pheader->p_filesz, pheader->p_memsz - pheader->p_filesz);
+        memset(ptr + pheader->p_filesz, 0, pheader->p_memsz - pheader->p_filesz);
+    }
+    arch_sync_cache_range((addr_t)ptr, pheader->p_memsz);
+
+    stream->seg_pending &= ~(1u << i);
+}
+
+/* copy the bytes at file offset |pos| into whichever segments they belong to */
+static void stream_place(elf_stream_t *stream, const uint8_t *data, uint64_t pos, size_t len)
+{
+    uint64_t end = pos + len;
+
+    for (uint i = 0; i < stream->handle.eheader.e_phnum; i++) {
+        if (!(stream->seg_pending & (1u << i)))
+            continue;
+
+        const elf_phdr_t *pheader = &stream->handle.pheaders[i];
+        uint64_t seg_start = pheader->p_offset;
+        uint64_t seg_end = seg_start + pheader->p_filesz;
+
+        uint64_t from = MAX(pos, seg_start);
+        uint64_t to = MIN(end, seg_end);
+        if (from < to)
+            memcpy((uint8_t *)stream->seg_ptr[i] + (from - seg_start), data + (from - pos), to - from);
+
+        if (end >= seg_end)
+            stream_finish_segment(stream, i);
+    }
+}
+
+/* the headers are all in, work out where every segment goes */
+static status_t stream_setup(elf_stream_t *stream)
+{
+    elf_handle_t *handle = &stream->handle;
+    size_t phsize = handle->eheader.e_phnum * handle->eheader.e_phentsize;
+
+    handle->pheaders = malloc(phsize);
+    if (!handle->pheaders)
+        return ERR_NO_MEMORY;
+    memcpy(handle->pheaders, stream->hdr + handle->eheader.e_phoff, phsize);
+
+    uint load_count = 0;
+    for (uint i = 0; i < handle->eheader.e_phnum; i++) {
+        elf_phdr_t *pheader = &handle->pheaders[i];
+
+        if (pheader->p_type != PT_LOAD)
+            continue;
+
+        if (pheader->p_filesz > pheader->p_memsz) {
+            LTRACEF("segment %u file size larger than memory size\n", i);
+            return ERR_NOT_VALID;
+        }
+
+        void *ptr = (void *)(uintptr_t)pheader->p_vaddr;
+        if (handle->mem_alloc_hook) {
+            status_t err = handle->mem_alloc_hook(handle, &ptr, pheader->p_memsz, load_count, 0);
+            if (err < 0) {
+                LTRACEF("mem hook failed, abort\n");
+                return err;
+            }
+        }
+
+        LTRACEF("segment %u: offset 0x" ELF_OFF_PRINT_X " to %p, filesz " ELF_ADDR_PRINT_U
+                " memsz " ELF_ADDR_PRINT_U "\n",
+                i, pheader->p_offset, ptr, pheader->p_filesz, pheader->p_memsz);
+
+        stream->seg_ptr[i] = ptr;
+        stream->seg_pending |= 1u << i;
+        load_count++;
+    }
+
+    // whatever of the segments was in the headers
+    stream_place(stream, stream->hdr, 0, stream->hdr_len);
+    free(stream->hdr);
+    stream->hdr = NULL;
+
+    handle->entry = handle->eheader.e_entry;
+
+    return NO_ERROR;
+}
+
+static status_t stream_header(elf_stream_t *stream, const uint8_t *data, size_t len, size_t *used)
+{
+    elf_handle_t *handle = &stream->handle;
+    size_t ehsize = sizeof(handle->eheader);
+
+    // first the elf header itself
+    if (stream->pos < ehsize) {
+        size_t n = MIN(len, ehsize - stream->pos);
+        memcpy((uint8_t *)&handle->eheader + stream->pos, data, n);
+        *used = n;
+        if (stream->pos + n < ehsize)
+            return NO_ERROR;
+
+        if (verify_eheader(&handle->eheader)) {
+            LTRACEF("header not valid\n");
+            return ERR_NOT_FOUND;
+        }
+        if (handle->eheader.e_phnum > ELF_STREAM_MAX_PHDRS ||
+                handle->eheader.e_phentsize != sizeof(elf_phdr_t)) {
+            LTRACEF("too many program headers or bad size\n");
+            return ERR_NO_MEMORY;
+        }
+        if (handle->eheader.e_phoff < ehsize ||
+                handle->eheader.e_phoff + handle->eheader.e_phnum * handle->eheader.e_phentsize >
+                ELF_STREAM_HEADER_MAX) {
+            LTRACEF("program headers at " ELF_OFF_PRINT_U " are too far in\n", handle->eheader.e_phoff);
+            return ERR_NOT_SUPPORTED;
+        }
+
+        stream->hdr_len = handle->eheader.e_phoff + handle->eheader.e_phnum * handle->eheader.e_phentsize;
+        stream->hdr = malloc(stream->hdr_len);
+        if (!stream->hdr)
+            return ERR_NO_MEMORY;
+        memcpy(stream->hdr, &handle->eheader, ehsize);
+        return NO_ERROR;
+    }
+
+    // then everything up to the end of the program headers
+    size_t n = MIN(len, stream->hdr_len - stream->pos);
+    memcpy(stream->hdr + stream->pos, data, n);
+    *used = n;
+    if (stream->pos + n < stream->hdr_len)
+        return NO_ERROR;
+
+    return stream_setup(stream);
+}
+
+status_t elf_stream_write(elf_stream_t *stream, const void *_data, size_t len)
+{
+    const uint8_t *data = _data;
+
+    if (!stream)
+        return ERR_INVALID_ARGS;
+    if (!stream->handle.open)
+        return ERR_NOT_READY;
+    if (stream->err < 0)
+        return stream->err;
+
+    while (len > 0 && !stream->handle.pheaders) {
+        size_t used = 0;
+        status_t err = stream_header(stream, data, len, &used);
+        stream->pos += used;
+        if (err < 0) {
+            stream->err = err;
+            return err;
+        }
+        data += used;
+        len -= used;
+    }
+
+    if (len > 0 && stream->seg_pending) {
+        stream_place(stream, data, stream->pos, len);
+    }
+    stream->pos += len;
+
+    return NO_ERROR;
+}
+
+bool elf_stream_complete(const elf_stream_t *stream)
+{
+    return stream->err == NO_ERROR && stream->handle.pheaders && !stream->seg_pending;
+}
+
+void elf_stream_close(elf_stream_t *stream)
+{
+    if (!stream || !stream->handle.open)
+        return;
+
+    free(stream->hdr);
+    stream->hdr = NULL;
+    elf_close_handle(&stream->handle);
+}
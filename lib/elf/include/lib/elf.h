@@ -35,6 +35,7 @@
 
 /* api */
 struct elf_handle;
+struct bdev;
 typedef ssize_t (*elf_read_hook_t)(struct elf_handle *, void *buf, uint64_t offset, size_t len);
 typedef status_t (*elf_mem_alloc_t)(struct elf_handle *, void **ptr, size_t len, uint num, uint flags);
 
@@ -46,6 +47,11 @@ typedef struct elf_handle {
     void *read_hook_arg;
     bool free_read_hook_arg;
 
+    // block device the file sits on, if opened with elf_open_handle_bdev().
+    // segments are then streamed straight from it with parallel async reads.
+    struct bdev *bdev;
+    off_t bdev_offset;
+
     // memory allocation callback
     elf_mem_alloc_t mem_alloc_hook;
     void *mem_alloc_hook_arg;
@@ -65,7 +71,35 @@ typedef struct elf_handle {
 
 status_t elf_open_handle(elf_handle_t *handle, elf_read_hook_t read_hook, void *read_hook_arg, bool free_read_hook_arg);
 status_t elf_open_handle_memory(elf_handle_t *handle, const void *ptr, size_t len);
+status_t elf_open_handle_bdev(elf_handle_t *handle, const char *bdev_name, off_t offset);
 void     elf_close_handle(elf_handle_t *handle);
 
 status_t elf_load(elf_handle_t *handle);
 
+/*
+ * Loading an image as it arrives, a piece at a time and in file order, for
+ * when it comes over the network. Nothing is buffered but the headers, which
+ * have to be at the front of the file; every byte that belongs to a PT_LOAD
+ * segment is copied straight to where it goes as soon as it shows up. Once
+ * the last segment is in place (and its bss cleared) the image is complete
+ * and can be started, whatever comes after it in the file is ignored.
+ */
+#define ELF_STREAM_MAX_PHDRS 16
+
+typedef struct elf_stream {
+    elf_handle_t handle;        // headers, mem_alloc_hook and entry, as for elf_load()
+
+    uint64_t pos;               // file offset of the next byte
+    uint8_t *hdr;               // the file up to the end of the program headers
+    size_t hdr_len;
+    status_t err;               // sticky, once something went wrong
+
+    void *seg_ptr[ELF_STREAM_MAX_PHDRS];
+    uint32_t seg_pending;       // bitmap of the PT_LOAD segments not yet in place
+} elf_stream_t;
+
+status_t elf_stream_init(elf_stream_t *stream);
+status_t elf_stream_write(elf_stream_t *stream, const void *data, size_t len);
+bool     elf_stream_complete(const elf_stream_t *stream);
+void     elf_stream_close(elf_stream_t *stream);
+
@@ -71,10 +71,29 @@ uint evlog_bump_head(evlog_t *e)
     return index;
 }
 
+uint evlog_iter_begin(evlog_t *e)
+{
+    return INCPTR(e, e->head, e->unitsize);
+}
+
+const uintptr_t *evlog_iter_next(evlog_t *e, uint *index)
+{
+    if (*index == e->head)
+        return NULL;
+
+    const uintptr_t *item = &e->items[*index];
+    *index = INCPTR(e, *index, e->unitsize);
+
+    return item;
+}
+
 void evlog_dump(evlog_t *e, evlog_dump_cb cb)
 {
-    for (uint index = INCPTR(e, e->head, e->unitsize); index != e->head; index = INCPTR(e, index, e->unitsize)) {
-        cb(&e->items[index]);
+    uint index = evlog_iter_begin(e);
+    const uintptr_t *item;
+
+    while ((item = evlog_iter_next(e, &index))) {
+        cb(item);
     }
 }
 
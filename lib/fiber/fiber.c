@@ -0,0 +1,486 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/fiber.h>
+
+#include <debug.h>
+#include <assert.h>
+#include <trace.h>
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <list.h>
+#include <arch/thread.h>
+#include <kernel/thread.h>
+#include <kernel/event.h>
+#include <kernel/spinlock.h>
+#include <platform.h>
+
+#define LOCAL_TRACE 0
+
+enum fiber_state {
+    FIBER_READY,
+    FIBER_RUNNING,
+    FIBER_WAITING,
+    FIBER_DEAD,
+};
+
+struct fiber {
+    struct list_node node;      /* on the run queue, or the timed list while waiting */
+    struct fiber_sched *sched;
+    vaddr_t sp;
+
+    enum fiber_state state;
+    bool wake_pending;          /* woken while not waiting */
+    bool timed_out;
+    lk_time_t deadline;
+    uint32_t wait_events;       /* socket events that end a fiber_tcp_wait() */
+
+    fiber_start_routine entry;
+    void *arg;
+
+    void *stack;
+    size_t stack_size;
+    char name[16];
+};
+
+/* one per thread running fibers, on that thread's stack */
+struct fiber_sched {
+    spin_lock_t lock;           /* wakeups come from other threads and irqs */
+    struct list_node run_queue;
+    struct list_node timed_list;
+    lk_time_t next_deadline;
+
+    event_t event;              /* kicked when a fiber is woken from elsewhere */
+    vaddr_t sp;                 /* the thread's own stack while a fiber runs */
+    fiber_t *current;
+    uint count;
+};
+
+static struct fiber_sched *fiber_sched(void)
+{
+    return (struct fiber_sched *)tls_get(TLS_ENTRY_FIBER);
+}
+
+fiber_t *fiber_current(void)
+{
+    struct fiber_sched *sched = fiber_sched();
+
+    return sched ? sched->current : NULL;
+}
+
+/* back to the scheduler, the caller has set our state */
+static void fiber_switch_out(fiber_t *f)
+{
+    arch_fiber_switch(&f->sp, f->sched->sp);
+}
+
+static void fiber_trampoline(void) __NO_RETURN;
+static void fiber_trampoline(void)
+{
+    fiber_t *f = fiber_current();
+
+    f->entry(f->arg);
+    fiber_exit();
+}
+
+fiber_t *fiber_create(const char *name, fiber_start_routine entry, void *arg, size_t stack_size)
+{
+    struct fiber_sched *sched = fiber_sched();
+
+    DEBUG_ASSERT(entry);
+
+    if (!sched)
+        return NULL;
+
+    fiber_t *f = calloc(1, sizeof(fiber_t));
+    if (!f)
+        return NULL;
+
+    if (stack_size == 0)
+        stack_size = FIBER_DEFAULT_STACK_SIZE;
+    f->stack = malloc(stack_size);
+    if (!f->stack) {
+        free(f);
+        return NULL;
+    }
+
+    strlcpy(f->name, name, sizeof(f->name));
+    f->sched = sched;
+    f->entry = entry;
+    f->arg = arg;
+    f->stack_size = stack_size;
+    f->sp = arch_fiber_stack_init((vaddr_t)f->stack + stack_size, fiber_trampoline);
+    f->state = FIBER_READY;
+
+    LTRACEF("fiber %p (%s), stack %p size %zu\n", f, f->name, f->stack, stack_size);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&sched->lock, state);
+    list_add_tail(&sched->run_queue, &f->node);
+    sched->count++;
+    spin_unlock_irqrestore(&sched->lock, state);
+
+    return f;
+}
+
+void fiber_yield(void)
+{
+    fiber_t *f = fiber_current();
+
+    DEBUG_ASSERT(f);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&f->sched->lock, state);
+    f->state = FIBER_READY;
+    list_add_tail(&f->sched->run_queue, &f->node);
+    spin_unlock_irqrestore(&f->sched->lock, state);
+
+    fiber_switch_out(f);
+}
+
+void fiber_exit(void)
+{
+    fiber_t *f = fiber_current();
+
+    DEBUG_ASSERT(f);
+
+    /* the scheduler frees us, we're still on our stack */
+    f->state = FIBER_DEAD;
+    fiber_switch_out(f);
+
+    panic("dead fiber %p resumed\n", f);
+}
+
+status_t fiber_wait(lk_time_t timeout)
+{
+    fiber_t *f = fiber_current();
+
+    DEBUG_ASSERT(f);
+    struct fiber_sched *sched = f->sched;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&sched->lock, state);
+
+    if (f->wake_pending) {
+        f->wake_pending = false;
+        spin_unlock_irqrestore(&sched->lock, state);
+        return NO_ERROR;
+    }
+    if (timeout == 0) {
+        spin_unlock_irqrestore(&sched->lock, state);
+        return ERR_TIMED_OUT;
+    }
+
+    f->state = FIBER_WAITING;
+    f->timed_out = false;
+    if (timeout != INFINITE_TIME) {
+        f->deadline = current_time() + timeout;
+        list_add_tail(&sched->timed_list, &f->node);
+        if (TIME_LTE(f->deadline, sched->next_deadline))
+            sched->next_deadline = f->deadline;
+    }
+
+    spin_unlock_irqrestore(&sched->lock, state);
+
+    fiber_switch_out(f);
+
+    return f->timed_out ? ERR_TIMED_OUT : NO_ERROR;
+}
+
+void fiber_wake(fiber_t *f)
+{
+    struct fiber_sched *sched = f->sched;
+    bool kick = false;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&sched->lock, state);
+
+    if (f->state == FIBER_WAITING) {
+        /* off the timed list, if it's on it */
+        if (list_in_list(&f->node))
+            list_delete(&f->node);
+        f->state = FIBER_READY;
+        list_add_tail(&sched->run_queue, &f->node);
+        kick = true;
+    } else if (f->state != FIBER_DEAD) {
+        f->wake_pending = true;
+    }
+
+    spin_unlock_irqrestore(&sched->lock, state);
+
+    /* the scheduler may be asleep with nothing else to run */
+    if (kick)
+        event_signal(&sched->event, false);
+}
+
+void fiber_sleep(lk_time_t delay)
+{
+    lk_time_t deadline = current_time() + delay;
+
+    /* a stray wake ends the wait early */
+    while (fiber_wait(deadline - current_time()) != ERR_TIMED_OUT) {
+        if (TIME_GTE(current_time(), deadline))
+            break;
+    }
+}
+
+/* move waiters whose time is up to the run queue, returns the next deadline. lock held */
+static lk_time_t fiber_expire(struct fiber_sched *sched, lk_time_t now)
+{
+    fiber_t *f, *temp;
+    lk_time_t next = now + INFINITE_TIME / 2;
+
+    list_for_every_entry_safe(&sched->timed_list, f, temp, fiber_t, node) {
+        if (TIME_LTE(f->deadline, now)) {
+            list_delete(&f->node);
+            f->timed_out = true;
+            f->state = FIBER_READY;
+            list_add_tail(&sched->run_queue, &f->node);
+        } else if (TIME_LT(f->deadline, next)) {
+            next = f->deadline;
+        }
+    }
+
+    return next;
+}
+
+status_t fiber_run(fiber_start_routine entry, void *arg, size_t stack_size)
+{
+    struct fiber_sched sched;
+
+    /* one scheduler per thread, a fiber can't start another */
+    if (fiber_sched())
+        return ERR_BUSY;
+
+    spin_lock_init(&sched.lock);
+    list_initialize(&sched.run_queue);
+    list_initialize(&sched.timed_list);
+    event_init(&sched.event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    sched.current = NULL;
+    sched.count = 0;
+
+    tls_set(TLS_ENTRY_FIBER, (uintptr_t)&sched);
+
+    status_t err = NO_ERROR;
+    if (!fiber_create("main", entry, arg, stack_size)) {
+        err = ERR_NO_MEMORY;
+        goto done;
+    }
+
+    sched.next_deadline = current_time() + INFINITE_TIME / 2;
+    while (sched.count > 0) {
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&sched.lock, state);
+
+        lk_time_t now = current_time();
+        if (TIME_GTE(now, sched.next_deadline) || list_is_empty(&sched.run_queue))
+            sched.next_deadline = fiber_expire(&sched, now);
+
+        fiber_t *f = list_remove_head_type(&sched.run_queue, fiber_t, node);
+        if (f)
+            f->state = FIBER_RUNNING;
+
+        spin_unlock_irqrestore(&sched.lock, state);
+
+        if (!f) {
+            lk_time_t timeout = list_is_empty(&sched.timed_list) ? INFINITE_TIME
+                                : sched.next_deadline - now;
+            event_wait_timeout(&sched.event, timeout);
+            continue;
+        }
+
+        sched.current = f;
+        arch_fiber_switch(&sched.sp, f->sp);
+        sched.current = NULL;
+
+        if (f->state == FIBER_DEAD) {
+            LTRACEF("fiber %p (%s) exited\n", f, f->name);
+            free(f->stack);
+            free(f);
+            sched.count--;
+        }
+    }
+
+done:
+    tls_set(TLS_ENTRY_FIBER, 0);
+    event_destroy(&sched.event);
+
+    return err;
+}
+
+#if WITH_LIB_MINIP
+/* called with the socket locked, maybe on the network thread */
+static void fiber_tcp_event(void *arg, uint32_t events)
+{
+    fiber_t *f = arg;
+
+    if (events & (f->wait_events | TCP_EVENT_CLOSED))
+        fiber_wake(f);
+}
+
+/*
+ * Wait for the socket to be ready for something in events. The callback is
+ * only set while we wait, so it never outlives the fiber, and setting it
+ * posts whatever the socket is already ready for.
+ */
+static void fiber_tcp_wait(tcp_socket_t *socket, uint32_t events)
+{
+    fiber_t *f = fiber_current();
+
+    f->wait_events = events;
+    tcp_set_event_callback(socket, fiber_tcp_event, f);
+    fiber_wait(INFINITE_TIME);
+    tcp_set_event_callback(socket, NULL, NULL);
+}
+
+status_t fiber_tcp_accept(tcp_socket_t *listen_socket, tcp_socket_t **accept_socket)
+{
+    if (!fiber_current())
+        return tcp_accept(listen_socket, accept_socket);
+
+    for (;;) {
+        status_t err = tcp_accept_timeout(listen_socket, accept_socket, 0);
+        if (err != ERR_TIMED_OUT)
+            return err;
+
+        fiber_tcp_wait(listen_socket, TCP_EVENT_READ);
+    }
+}
+
+ssize_t fiber_tcp_read(tcp_socket_t *socket, void *buf, size_t len)
+{
+    if (!fiber_current())
+        return tcp_read(socket, buf, len);
+
+    tcp_set_option(socket, TCP_OPT_NONBLOCK, 1);
+    for (;;) {
+        ssize_t ret = tcp_read(socket, buf, len);
+        if (ret != ERR_NOT_READY)
+            return ret;
+
+        fiber_tcp_wait(socket, TCP_EVENT_READ);
+    }
+}
+
+ssize_t fiber_tcp_read_peek(tcp_socket_t *socket, iovec_t regions[2])
+{
+    if (!fiber_current())
+        return tcp_read_peek(socket, regions);
+
+    tcp_set_option(socket, TCP_OPT_NONBLOCK, 1);
+    for (;;) {
+        ssize_t ret = tcp_read_peek(socket, regions);
+        if (ret != ERR_NOT_READY)
+            return ret;
+
+        fiber_tcp_wait(socket, TCP_EVENT_READ);
+    }
+}
+
+ssize_t fiber_tcp_write(tcp_socket_t *socket, const void *buf, size_t len)
+{
+    if (!fiber_current())
+        return tcp_write(socket, buf, len);
+
+    tcp_set_option(socket, TCP_OPT_NONBLOCK, 1);
+    size_t off = 0;
+    while (off < len) {
+        ssize_t ret = tcp_write(socket, (const uint8_t *)buf + off, len - off);
+        if (ret == ERR_NOT_READY) {
+            fiber_tcp_wait(socket, TCP_EVENT_WRITE);
+            continue;
+        }
+        if (ret < 0)
+            return ret;
+
+        off += ret;
+    }
+
+    return len;
+}
+#endif
+
+#if WITH_LIB_BIO
+struct fiber_bio {
+    bio_request_t req;
+    fiber_t *fiber;
+    volatile bool done;
+};
+
+/* may be called in interrupt context, or from within bio_submit() */
+static void fiber_bio_done(bio_request_t *req)
+{
+    struct fiber_bio *fb = containerof(req, struct fiber_bio, req);
+
+    /* fb lives on the waiting fiber's stack, which may be gone as soon as done is
+     * seen, so nothing in it can be touched after the store */
+    fiber_t *fiber = fb->fiber;
+    smp_wmb();
+    fb->done = true;
+    fiber_wake(fiber);
+}
+
+static ssize_t fiber_bio_block(bdev_t *dev, bool write, void *buf, bnum_t block, uint count)
+{
+    if (count == 0)
+        return 0;
+
+    bio_iovec_t iov = { .base = buf, .len = (size_t)count * dev->block_size };
+    struct fiber_bio fb = {
+        .req = {
+            .write = write,
+            .block = block,
+            .iov = &iov,
+            .iov_count = 1,
+            .callback = fiber_bio_done,
+        },
+        .fiber = fiber_current(),
+        .done = false,
+    };
+
+    status_t err = bio_submit(dev, &fb.req);
+    if (err < 0)
+        return err;
+
+    while (!fb.done)
+        fiber_wait(INFINITE_TIME);
+
+    return fb.req.result;
+}
+
+ssize_t fiber_bio_read_block(bdev_t *dev, void *buf, bnum_t block, uint count)
+{
+    if (!fiber_current())
+        return bio_read_block(dev, buf, block, count);
+
+    return fiber_bio_block(dev, false, buf, block, count);
+}
+
+ssize_t fiber_bio_write_block(bdev_t *dev, const void *buf, bnum_t block, uint count)
+{
+    if (!fiber_current())
+        return bio_write_block(dev, buf, block, count);
+
+    return fiber_bio_block(dev, true, (void *)buf, block, count);
+}
+#endif
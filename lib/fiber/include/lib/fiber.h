@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <sys/types.h>
+
+#if WITH_LIB_MINIP
+#include <lib/minip.h>
+#endif
+#if WITH_LIB_BIO
+#include <lib/bio.h>
+#endif
+
+__BEGIN_CDECLS;
+
+/*
+ * Cooperative fibers: small stacks taking turns inside one kernel thread.
+ * fiber_run() makes the calling thread their scheduler and returns once the
+ * last of them has exited. A fiber runs until it yields, waits or exits, so
+ * fibers of one thread share data without locks; the thread itself is
+ * scheduled and preempted as usual.
+ *
+ * Anything that blocks the thread stalls all of its fibers, so fibers use the
+ * fiber_ wrappers below for socket and block i/o, which park just the fiber.
+ */
+typedef struct fiber fiber_t;
+typedef void (*fiber_start_routine)(void *arg);
+
+#ifndef FIBER_DEFAULT_STACK_SIZE
+#define FIBER_DEFAULT_STACK_SIZE 4096
+#endif
+
+/* run entry(arg) as the first fiber on this thread, until every fiber has exited */
+status_t fiber_run(fiber_start_routine entry, void *arg, size_t stack_size);
+
+/* start another fiber on the current fiber's thread, it runs once this one yields */
+fiber_t *fiber_create(const char *name, fiber_start_routine entry, void *arg, size_t stack_size);
+
+fiber_t *fiber_current(void); /* NULL if not on a fiber */
+void fiber_yield(void);
+void fiber_sleep(lk_time_t delay);
+void fiber_exit(void) __NO_RETURN;
+
+/*
+ * Park the current fiber until fiber_wake() or the timeout. fiber_wake() can
+ * be called from any thread or from interrupt context, and a wake that comes
+ * before the wait is kept so the wait returns at once. A wait may end for a
+ * stale wake, so callers recheck whatever they were waiting for.
+ */
+status_t fiber_wait(lk_time_t timeout);
+void fiber_wake(fiber_t *f);
+
+#if WITH_LIB_MINIP
+/*
+ * Socket calls that park the fiber instead of the thread. They make the
+ * socket nonblocking and use its event callback while they wait. Called off a
+ * fiber they block as usual.
+ */
+status_t fiber_tcp_accept(tcp_socket_t *listen_socket, tcp_socket_t **accept_socket);
+ssize_t fiber_tcp_read(tcp_socket_t *socket, void *buf, size_t len);
+ssize_t fiber_tcp_read_peek(tcp_socket_t *socket, iovec_t regions[2]);
+ssize_t fiber_tcp_write(tcp_socket_t *socket, const void *buf, size_t len);
+#endif
+
+#if WITH_LIB_BIO
+/* whole block transfers through bio_submit(), parking the fiber until they complete */
+ssize_t fiber_bio_read_block(bdev_t *dev, void *buf, bnum_t block, uint count);
+ssize_t fiber_bio_write_block(bdev_t *dev, const void *buf, bnum_t block, uint count);
+#endif
+
+__END_CDECLS;
@@ -32,11 +32,27 @@
  */
 
 #include <debug.h>
+#include <assert.h>
 #include <lib/gfx.h>
 #include <lib/font.h>
 
 #include "font.h"
 
+/**
+ * @brief Return one row of a character from the built-in font
+ *
+ * @ingroup graphics
+ */
+uint font_glyph_row(unsigned char c, uint row)
+{
+    DEBUG_ASSERT(row < FONT_Y);
+
+    if ((size_t)c * FONT_Y >= sizeof(FONT))
+        return 0;
+
+    return FONT[c * FONT_Y + row];
+}
+
 /**
  * @brief Draw one character from the built-in font
  *
@@ -168,6 +168,7 @@ usage:
         printf("%s format <type> [device]\n", argv[0].str);
         printf("%s stat <path>\n", argv[0].str);
         printf("%s ioctl <request> [args...]\n", argv[0].str);
+        printf("%s dcache\n", argv[0].str);
         return -1;
     }
 
@@ -236,6 +237,8 @@ usage:
 
     } else if (!strcmp(argv[1].str, "ioctl")) {
         return cmd_fs_ioctl(argc, argv);
+    } else if (!strcmp(argv[1].str, "dcache")) {
+        fs_dump_dcache();
     } else if (!strcmp(argv[1].str, "write")) {
         int err;
         off_t off;
@@ -29,6 +29,206 @@
 
 #define LOCAL_TRACE 0
 
+/* the root plus up to two levels of interior index nodes */
+#define DX_MAX_LEVELS 3
+
+/* where dx_root_info sits in the first block, right after "." and ".." */
+#define DX_ROOT_INFO_OFFSET 24
+
+/* where the dx_entry array starts in an interior node, after its empty entry */
+#define DX_NODE_ENTRIES_OFFSET 8
+
+/* the upper bits of a dx_entry block are reserved */
+#define DX_BLOCK_MASK 0x0fffffff
+
+/* one block of the index on the way down to a leaf */
+struct dx_frame {
+    struct dx_entry *entries;
+    uint count;
+    uint at;
+};
+
+/* walk through the entries of one directory block, looking for the one that matches */
+static int ext2_dir_scan_block(ext2_t *ext2, const uint8_t *buf, uint file_blocknum,
+                               const char *name, size_t namelen, inodenum_t *inum)
+{
+    const struct ext2_dir_entry_2 *ent;
+    uint pos = 0;
+
+    while (pos + 8 <= EXT2_BLOCK_SIZE(ext2->sb)) {
+        ent = (const struct ext2_dir_entry_2 *)&buf[pos];
+
+        LTRACEF("ent %d:%d: inode 0x%x, reclen %d, namelen %d\n",
+                file_blocknum, pos, LE32(ent->inode), LE16(ent->rec_len), ent->name_len/* , ent->name*/);
+
+        /* sanity check the record length */
+        if (LE16(ent->rec_len) == 0 || pos + 8 + ent->name_len > EXT2_BLOCK_SIZE(ext2->sb))
+            break;
+
+        if (LE32(ent->inode) != 0 && ent->name_len == namelen &&
+                memcmp(name, ent->name, ent->name_len) == 0) {
+            // match
+            *inum = LE32(ent->inode);
+            LTRACEF("match: inode %d\n", *inum);
+            return 1;
+        }
+
+        pos += ROUNDUP(LE16(ent->rec_len), 4);
+    }
+
+    return 0;
+}
+
+static int ext2_dir_read_block(ext2_t *ext2, struct ext2_inode *dir_inode, uint8_t *buf, uint file_blocknum)
+{
+    ssize_t err = ext2_read_inode(ext2, dir_inode, NULL, buf,
+                                  (off_t)file_blocknum * EXT2_BLOCK_SIZE(ext2->sb), EXT2_BLOCK_SIZE(ext2->sb));
+    if (err < (ssize_t)EXT2_BLOCK_SIZE(ext2->sb))
+        return (err < 0) ? err : ERR_NOT_VALID;
+    return 0;
+}
+
+/* point frame at the dx_entry array at offset in buf, if it looks sane */
+static int dx_load_entries(ext2_t *ext2, struct dx_frame *frame, uint8_t *buf, size_t offset)
+{
+    struct dx_countlimit *countlimit = (struct dx_countlimit *)(buf + offset);
+    uint limit = LE16(countlimit->limit);
+    uint count = LE16(countlimit->count);
+
+    if (limit != (EXT2_BLOCK_SIZE(ext2->sb) - offset) / sizeof(struct dx_entry) ||
+            count == 0 || count > limit) {
+        LTRACEF("bad index node, count %u limit %u\n", count, limit);
+        return ERR_NOT_VALID;
+    }
+
+    frame->entries = (struct dx_entry *)countlimit;
+    frame->count = count;
+    return 0;
+}
+
+/* the last entry with a hash no bigger than hash, the first one covers everything below the second */
+static uint dx_search(const struct dx_frame *frame, uint32_t hash)
+{
+    uint lo = 1;
+    uint hi = frame->count;
+
+    while (lo < hi) {
+        uint mid = lo + (hi - lo) / 2;
+        if (LE32(frame->entries[mid].hash) > hash)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo - 1;
+}
+
+static uint dx_block(const struct dx_frame *frame)
+{
+    return LE32(frame->entries[frame->at].block) & DX_BLOCK_MASK;
+}
+
+/*
+ * Look the name up through the directory's hash index, reading one block per
+ * level of the tree and then the leaf it lands on. Returns 1 if found, 0 if
+ * not, or ERR_NOT_VALID if the index can't be trusted and the directory has
+ * to be scanned instead.
+ */
+static int ext2_dx_lookup(ext2_t *ext2, struct ext2_inode *dir_inode, const char *name, size_t namelen, inodenum_t *inum)
+{
+    size_t block_size = EXT2_BLOCK_SIZE(ext2->sb);
+    struct dx_frame frames[DX_MAX_LEVELS];
+    uint8_t *buf;
+    uint8_t *leaf;
+    int err;
+
+    /* a block for every level of the index and one for the leaf */
+    buf = malloc(block_size * (DX_MAX_LEVELS + 1));
+    if (!buf)
+        return ERR_NO_MEMORY;
+    leaf = buf + block_size * DX_MAX_LEVELS;
+
+    err = ext2_dir_read_block(ext2, dir_inode, buf, 0);
+    if (err < 0)
+        goto out;
+
+    const struct dx_root_info *info = (const struct dx_root_info *)(buf + DX_ROOT_INFO_OFFSET);
+    if (info->reserved_zero != 0 || info->hash_version > DX_HASH_TEA ||
+            info->info_length != sizeof(struct dx_root_info) ||
+            info->indirect_levels >= DX_MAX_LEVELS) {
+        LTRACEF("bad index root, hash version %u levels %u\n", info->hash_version, info->indirect_levels);
+        err = ERR_NOT_VALID;
+        goto out;
+    }
+
+    uint hash_version = info->hash_version;
+    if (ext2->sb.s_flags & EXT2_FLAGS_UNSIGNED_HASH)
+        hash_version += DX_HASH_LEGACY_UNSIGNED;
+    uint32_t hash = ext2_dirhash(ext2, hash_version, name, namelen);
+    uint levels = info->indirect_levels + 1;
+
+    LTRACEF("name '%s' hash 0x%x, version %u, levels %u\n", name, hash, hash_version, levels);
+
+    /* down the tree */
+    for (uint i = 0; i < levels; i++) {
+        uint8_t *node = buf + block_size * i;
+        size_t offset = DX_ROOT_INFO_OFFSET + sizeof(struct dx_root_info);
+
+        if (i > 0) {
+            err = ext2_dir_read_block(ext2, dir_inode, node, dx_block(&frames[i - 1]));
+            if (err < 0)
+                goto out;
+            offset = DX_NODE_ENTRIES_OFFSET;
+        }
+
+        err = dx_load_entries(ext2, &frames[i], node, offset);
+        if (err < 0)
+            goto out;
+        frames[i].at = dx_search(&frames[i], hash);
+    }
+
+    for (;;) {
+        uint leaf_blocknum = dx_block(&frames[levels - 1]);
+
+        err = ext2_dir_read_block(ext2, dir_inode, leaf, leaf_blocknum);
+        if (err < 0)
+            goto out;
+
+        err = ext2_dir_scan_block(ext2, leaf, leaf_blocknum, name, namelen, inum);
+        if (err != 0)
+            goto out;
+
+        /*
+         * Names with the same hash can spill over into the following leaves,
+         * which then start with that hash with the low bit set. Step to the
+         * next leaf, up and back down through the interior nodes if need be.
+         */
+        int i = levels - 1;
+        while (i >= 0 && frames[i].at + 1 >= frames[i].count)
+            i--;
+        if (i < 0)
+            goto out;
+
+        frames[i].at++;
+        if ((LE32(frames[i].entries[frames[i].at].hash) & ~1u) != hash)
+            goto out;
+
+        for (uint j = i + 1; j < levels; j++) {
+            uint8_t *node = buf + block_size * j;
+
+            err = ext2_dir_read_block(ext2, dir_inode, node, dx_block(&frames[j - 1]));
+            if (err >= 0)
+                err = dx_load_entries(ext2, &frames[j], node, DX_NODE_ENTRIES_OFFSET);
+            if (err < 0)
+                goto out;
+            frames[j].at = 0;
+        }
+    }
+
+out:
+    free(buf);
+    return err;
+}
+
 /* read in the dir, look for the entry */
 static int ext2_dir_lookup(ext2_t *ext2, struct ext2_inode *dir_inode, const char *name, inodenum_t *inum)
 {
@@ -40,39 +240,36 @@ static int ext2_dir_lookup(ext2_t *ext2, struct ext2_inode *dir_inode, const cha
     if (!S_ISDIR(dir_inode->i_mode))
         return ERR_NOT_DIR;
 
+    /*
+     * Use the hash index if there is one, unless it turns out to be broken.
+     * "." and ".." live in the index root rather than in any leaf, so a scan
+     * finds them in the first block anyway.
+     */
+    bool dot = strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+    if (!dot && (ext2->sb.s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) &&
+            (dir_inode->i_flags & EXT2_INDEX_FL)) {
+        err = ext2_dx_lookup(ext2, dir_inode, name, namelen, inum);
+        if (err == 1)
+            return 1;
+        if (err != ERR_NOT_VALID)
+            return -1;
+        LTRACEF("falling back to a linear scan\n");
+    }
+
     buf = malloc(EXT2_BLOCK_SIZE(ext2->sb));
 
     file_blocknum = 0;
     for (;;) {
         /* read in the offset */
-        err = ext2_read_inode(ext2, dir_inode, buf, file_blocknum * EXT2_BLOCK_SIZE(ext2->sb), EXT2_BLOCK_SIZE(ext2->sb));
+        err = ext2_read_inode(ext2, dir_inode, NULL, buf, file_blocknum * EXT2_BLOCK_SIZE(ext2->sb), EXT2_BLOCK_SIZE(ext2->sb));
         if (err <= 0) {
             free(buf);
             return -1;
         }
 
-        /* walk through the directory entries, looking for the one that matches */
-        struct ext2_dir_entry_2 *ent;
-        uint pos = 0;
-        while (pos < EXT2_BLOCK_SIZE(ext2->sb)) {
-            ent = (struct ext2_dir_entry_2 *)&buf[pos];
-
-            LTRACEF("ent %d:%d: inode 0x%x, reclen %d, namelen %d\n",
-                    file_blocknum, pos, LE32(ent->inode), LE16(ent->rec_len), ent->name_len/* , ent->name*/);
-
-            /* sanity check the record length */
-            if (LE16(ent->rec_len) == 0)
-                break;
-
-            if (ent->name_len == namelen && memcmp(name, ent->name, ent->name_len) == 0) {
-                // match
-                *inum = LE32(ent->inode);
-                LTRACEF("match: inode %d\n", *inum);
-                free(buf);
-                return 1;
-            }
-
-            pos += ROUNDUP(LE16(ent->rec_len), 4);
+        if (ext2_dir_scan_block(ext2, buf, file_blocknum, name, namelen, inum)) {
+            free(buf);
+            return 1;
         }
 
         file_blocknum++;
@@ -185,6 +382,51 @@ nextcomponent:
     return 0;
 }
 
+/* look up a single name in a directory, following a symlink if it lands on one */
+status_t ext2_lookup_node(fscookie *cookie, uint64_t dir, const char *name, uint64_t *node)
+{
+    ext2_t *ext2 = (ext2_t *)cookie;
+    struct ext2_inode dir_inode;
+    struct ext2_inode inode;
+    inodenum_t inum;
+    int err;
+
+    LTRACEF("dir %llu, name '%s'\n", dir, name);
+
+    if (dir == FS_ROOT_NODE) {
+        memcpy(&dir_inode, &ext2->root_inode, sizeof(struct ext2_inode));
+    } else {
+        err = ext2_load_inode(ext2, dir, &dir_inode);
+        if (err < 0)
+            return err;
+    }
+
+    err = ext2_dir_lookup(ext2, &dir_inode, name, &inum);
+    if (err == ERR_NOT_DIR)
+        return err;
+    if (err < 0)
+        return ERR_NOT_FOUND;
+
+    err = ext2_load_inode(ext2, inum, &inode);
+    if (err < 0)
+        return err;
+
+    if (S_ISLNK(inode.i_mode)) {
+        char link[512];
+
+        err = ext2_read_link(ext2, &inode, link, sizeof(link));
+        if (err < 0)
+            return err;
+
+        err = ext2_walk(ext2, link, (link[0] == '/') ? &ext2->root_inode : &dir_inode, &inum, 1);
+        if (err < 0)
+            return err;
+    }
+
+    *node = inum;
+    return NO_ERROR;
+}
+
 /* do a path parse, looking up each component */
 int ext2_lookup(ext2_t *ext2, const char *_path, inodenum_t *inum)
 {
@@ -73,6 +73,11 @@ static void endian_swap_superblock(struct ext2_super_block *sb)
     LE32SWAP(sb->s_last_orphan);
     LE32SWAP(sb->s_default_mount_opts);
     LE32SWAP(sb->s_first_meta_bg);
+
+    /* htree */
+    for (int i = 0; i < 4; i++)
+        LE32SWAP(sb->s_hash_seed[i]);
+    LE32SWAP(sb->s_flags);
 }
 
 static void endian_swap_inode(struct ext2_inode *inode)
@@ -184,7 +189,7 @@ status_t ext2_mount(bdev_t *dev, fscookie **cookie)
     }
 
     /* initialize the block cache */
-    ext2->cache = bcache_create(ext2->dev, EXT2_BLOCK_SIZE(ext2->sb), 4);
+    ext2->cache = bcache_create(ext2->dev, EXT2_BLOCK_SIZE(ext2->sb), 16);
 
     /* load the first inode */
     err = ext2_load_inode(ext2, EXT2_ROOT_INO, &ext2->root_inode);
@@ -270,6 +275,9 @@ static const struct fs_api ext2_api = {
     .stat = ext2_stat_file,
     .read = ext2_read_file,
     .close = ext2_close_file,
+
+    .lookup = ext2_lookup_node,
+    .open_node = ext2_open_node,
 };
 
 STATIC_FS_IMPL(ext2, &ext2_api);
@@ -165,6 +165,11 @@ struct ext2_inode {
 #define i_gid_high  osd2.linux2.l_i_gid_high
 #define i_reserved2 osd2.linux2.l_i_reserved2
 
+/*
+ * Inode flags
+ */
+#define EXT2_INDEX_FL           0x00001000  /* hash-indexed directory */
+
 /*
  * File system states
  */
@@ -285,9 +290,23 @@ struct ext2_super_block {
     uint16_t    s_reserved_word_pad;
     uint32_t    s_default_mount_opts;
     uint32_t    s_first_meta_bg;    /* First metablock block group */
-    uint32_t    s_reserved[190];    /* Padding to the end of the block */
+    uint32_t    s_mkfs_time;        /* When the filesystem was created */
+    uint32_t    s_jnl_blocks[17];   /* Backup of the journal inode */
+    uint32_t    s_blocks_count_hi;  /* Blocks count */
+    uint32_t    s_r_blocks_count_hi;    /* Reserved blocks count */
+    uint32_t    s_free_blocks_hi;   /* Free blocks count */
+    uint16_t    s_min_extra_isize;  /* All inodes have at least # bytes */
+    uint16_t    s_want_extra_isize; /* New inodes should reserve # bytes */
+    uint32_t    s_flags;        /* Miscellaneous flags */
+    uint32_t    s_reserved[167];    /* Padding to the end of the block */
 };
 
+/*
+ * Superblock flags
+ */
+#define EXT2_FLAGS_SIGNED_HASH      0x0001  /* Signed dirhash in use */
+#define EXT2_FLAGS_UNSIGNED_HASH    0x0002  /* Unsigned dirhash in use */
+
 /*
  * Codes for operating systems
  */
@@ -406,6 +425,38 @@ struct ext2_dir_entry_2 {
     char    name[EXT2_NAME_LEN];    /* File name */
 };
 
+/*
+ * Hashed directory index (htree). The first block of an indexed directory
+ * holds "." and "..", the second of which covers the rest of the block,
+ * followed by dx_root_info and a dx_entry array. Interior nodes are a
+ * single empty entry covering the block, followed by a dx_entry array. The
+ * first dx_entry of each array has its hash replaced by dx_countlimit.
+ */
+struct dx_root_info {
+    uint32_t    reserved_zero;
+    uint8_t hash_version;
+    uint8_t info_length;    /* 8 */
+    uint8_t indirect_levels;
+    uint8_t unused_flags;
+};
+
+struct dx_countlimit {
+    uint16_t    limit;
+    uint16_t    count;
+};
+
+struct dx_entry {
+    uint32_t    hash;
+    uint32_t    block;
+};
+
+#define DX_HASH_LEGACY              0
+#define DX_HASH_HALF_MD4            1
+#define DX_HASH_TEA                 2
+#define DX_HASH_LEGACY_UNSIGNED     3
+#define DX_HASH_HALF_MD4_UNSIGNED   4
+#define DX_HASH_TEA_UNSIGNED        5
+
 /*
  * Ext2 directory file types.  Only the low 3 bits are used.  The
  * other bits are reserved for now.
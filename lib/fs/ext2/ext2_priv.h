@@ -43,16 +43,25 @@ typedef struct {
     struct ext2_inode root_inode;
 } ext2_t;
 
-struct cache_block {
-    blocknum_t num;
-    void *ptr;
+/* a run of file blocks stored contiguously on disk, or a hole if block is 0 */
+struct ext2_extent {
+    uint32_t file_block;
+    blocknum_t block;
+    uint32_t count;
+};
+
+/* the parts of a file's block map decoded so far, sorted by file block */
+struct ext2_block_map {
+    struct ext2_extent *extents;
+    uint count;
+    uint max;
 };
 
 /* open file handle */
 typedef struct {
     ext2_t *ext2;
 
-    struct cache_block ind_cache[3]; // cache of indirect blocks as they're scanned
+    struct ext2_block_map map;
     struct ext2_inode inode;
 } ext2_file_t;
 
@@ -66,13 +75,19 @@ int ext2_get_block(ext2_t *ext2, void **ptr, blocknum_t bnum);
 int ext2_put_block(ext2_t *ext2, blocknum_t bnum);
 
 off_t ext2_file_len(ext2_t *ext2, struct ext2_inode *inode);
-ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *buf, off_t offset, size_t len);
+ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, struct ext2_block_map *map, void *buf, off_t offset, size_t len);
+void ext2_free_block_map(struct ext2_block_map *map);
 int ext2_read_link(ext2_t *ext2, struct ext2_inode *inode, char *str, size_t len);
 
+/* htree */
+uint32_t ext2_dirhash(ext2_t *ext2, uint hash_version, const char *name, size_t namelen);
+
 /* fs api */
 status_t ext2_mount(bdev_t *dev, fscookie **cookie);
 status_t ext2_unmount(fscookie *cookie);
 status_t ext2_open_file(fscookie *cookie, const char *path, filecookie **fcookie);
+status_t ext2_lookup_node(fscookie *cookie, uint64_t dir, const char *name, uint64_t *node);
+status_t ext2_open_node(fscookie *cookie, uint64_t node, filecookie **fcookie);
 ssize_t ext2_read_file(filecookie *fcookie, void *buf, off_t offset, size_t len);
 status_t ext2_close_file(filecookie *fcookie);
 status_t ext2_stat_file(filecookie *fcookie, struct file_stat *);
@@ -42,6 +42,15 @@ int ext2_open_file(fscookie *cookie, const char *path, filecookie **fcookie)
     if (err < 0)
         return err;
 
+    return ext2_open_node(cookie, inum, fcookie);
+}
+
+status_t ext2_open_node(fscookie *cookie, uint64_t node, filecookie **fcookie)
+{
+    ext2_t *ext2 = (ext2_t *)cookie;
+    inodenum_t inum = (node == FS_ROOT_NODE) ? EXT2_ROOT_INO : node;
+    int err;
+
     /* create the file object */
     ext2_file_t *file = malloc(sizeof(ext2_file_t));
     memset(file, 0, sizeof(ext2_file_t));
@@ -71,7 +80,7 @@ ssize_t ext2_read_file(filecookie *fcookie, void *buf, off_t offset, size_t len)
     }
 
     // read from the inode
-    err = ext2_read_inode(file->ext2, &file->inode, buf, offset, len);
+    err = ext2_read_inode(file->ext2, &file->inode, &file->map, buf, offset, len);
 
     return err;
 }
@@ -80,14 +89,7 @@ int ext2_close_file(filecookie *fcookie)
 {
     ext2_file_t *file = (ext2_file_t *)fcookie;
 
-    // see if we need to free any of the cache blocks
-    int i;
-    for (i=0; i < 3; i++) {
-        if (file->ind_cache[i].num != 0) {
-            free(file->ind_cache[i].ptr);
-        }
-    }
-
+    ext2_free_block_map(&file->map);
     free(file);
 
     return 0;
@@ -129,7 +131,7 @@ int ext2_read_link(ext2_t *ext2, struct ext2_inode *inode, char *str, size_t len
         return ERR_NO_MEMORY;
 
     if (linklen > 60) {
-        int err = ext2_read_inode(ext2, inode, str, 0, linklen);
+        int err = ext2_read_inode(ext2, inode, NULL, str, 0, linklen);
         if (err < 0)
             return err;
         str[linklen] = 0;
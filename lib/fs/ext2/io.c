@@ -25,10 +25,14 @@
 #include <stdlib.h>
 #include <debug.h>
 #include <trace.h>
+#include <err.h>
 #include "ext2_priv.h"
 
 #define LOCAL_TRACE 0
 
+/* most runs a file's block map holds before it's thrown away and started over */
+#define EXT2_MAP_MAX_EXTENTS 1024
+
 int ext2_read_block(ext2_t *ext2, void *buf, blocknum_t bnum)
 {
     return bcache_read_block(ext2->cache, buf, bnum);
@@ -180,7 +184,152 @@ static blocknum_t file_block_to_fs_block(ext2_t *ext2, struct ext2_inode *inode,
     return block;
 }
 
-ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *_buf, off_t offset, size_t len)
+void ext2_free_block_map(struct ext2_block_map *map)
+{
+    free(map->extents);
+    map->extents = NULL;
+    map->count = map->max = 0;
+}
+
+/* index of the last extent starting at or before file_block, -1 if none */
+static int ext2_map_search(const struct ext2_block_map *map, uint32_t file_block)
+{
+    uint lo = 0;
+    uint hi = map->count;
+
+    while (lo < hi) {
+        uint mid = (lo + hi) / 2;
+        if (map->extents[mid].file_block <= file_block)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return (int)lo - 1;
+}
+
+static void ext2_map_add(struct ext2_block_map *map, uint32_t file_block, blocknum_t block, uint32_t count)
+{
+    int i = ext2_map_search(map, file_block);
+
+    if (i >= 0) {
+        struct ext2_extent *prev = &map->extents[i];
+
+        /* already known */
+        if (prev->file_block + prev->count > file_block)
+            return;
+
+        /* carries straight on from the previous run */
+        if (prev->file_block + prev->count == file_block &&
+                ((prev->block == 0 && block == 0) ||
+                 (prev->block != 0 && block != 0 && prev->block + prev->count == block))) {
+            prev->count += count;
+            return;
+        }
+    }
+
+    if (map->count == map->max) {
+        if (map->max >= EXT2_MAP_MAX_EXTENTS) {
+            /* badly fragmented, start again rather than grow without bound */
+            map->count = 0;
+            i = -1;
+        } else {
+            uint max = map->max ? map->max * 2 : 16;
+            struct ext2_extent *extents = realloc(map->extents, sizeof(struct ext2_extent) * max);
+            if (!extents)
+                return;
+            map->extents = extents;
+            map->max = max;
+        }
+    }
+
+    memmove(&map->extents[i + 2], &map->extents[i + 1], sizeof(struct ext2_extent) * (map->count - (i + 1)));
+    map->extents[i + 1].file_block = file_block;
+    map->extents[i + 1].block = block;
+    map->extents[i + 1].count = count;
+    map->count++;
+}
+
+/* add a table of block pointers, starting at file_block, to the map as runs */
+static void ext2_map_decode(struct ext2_block_map *map, uint32_t file_block, const uint32_t *table, uint count)
+{
+    uint i = 0;
+
+    while (i < count) {
+        blocknum_t block = LE32(table[i]);
+        uint j;
+
+        for (j = i + 1; j < count; j++) {
+            blocknum_t next = LE32(table[j]);
+            if (block == 0 ? next != 0 : next != block + (j - i))
+                break;
+        }
+
+        ext2_map_add(map, file_block + i, block, j - i);
+        i = j;
+    }
+}
+
+/* decode the whole pointer table holding fileblock into the map */
+static int ext2_map_fill(ext2_t *ext2, struct ext2_inode *inode, struct ext2_block_map *map, uint fileblock)
+{
+    uint32_t pos[4];
+    uint32_t level = 0;
+
+    if (ext2_calculate_block_pointer_pos(ext2, fileblock, &level, pos) < 0)
+        return ERR_OUT_OF_RANGE;
+
+    if (level == 0) {
+        ext2_map_decode(map, 0, inode->i_block, EXT2_NDIR_BLOCKS);
+    } else {
+        blocknum_t *ind_table;
+        blocknum_t phys_block;
+        if (ext2_get_indirect_block_pointer_cache_block(ext2, inode, &ind_table, level, pos, &phys_block) < 0) {
+            /* no table, so a hole */
+            ext2_map_add(map, fileblock, 0, 1);
+            return 0;
+        }
+
+        ext2_map_decode(map, fileblock - pos[level], ind_table, EXT2_ADDR_PER_BLOCK(ext2->sb));
+
+        ext2_put_block(ext2, phys_block);
+    }
+
+    return 0;
+}
+
+/*
+ * translate a file block to a physical block, also returning how many blocks
+ * from there on are contiguous (or holes). without a map it's one at a time.
+ */
+static int ext2_map_block(ext2_t *ext2, struct ext2_inode *inode, struct ext2_block_map *map,
+                          uint fileblock, blocknum_t *block, uint32_t *count)
+{
+    if (map) {
+        for (int tries = 0; tries < 2; tries++) {
+            int i = ext2_map_search(map, fileblock);
+            if (i >= 0) {
+                const struct ext2_extent *e = &map->extents[i];
+                if (fileblock < e->file_block + e->count) {
+                    *block = e->block ? e->block + (fileblock - e->file_block) : 0;
+                    *count = e->count - (fileblock - e->file_block);
+                    return 0;
+                }
+            }
+
+            int err = ext2_map_fill(ext2, inode, map, fileblock);
+            if (err < 0)
+                return err;
+        }
+    }
+
+    *block = file_block_to_fs_block(ext2, inode, fileblock);
+    *count = 1;
+
+    return 0;
+}
+
+ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, struct ext2_block_map *map, void *_buf, off_t offset, size_t len)
 {
     int err = 0;
     size_t bytes_read = 0;
@@ -226,25 +375,39 @@ ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *_buf, off_
         buf += tocopy;
     }
 
-    /* handle middle blocks */
+    /* handle middle blocks, a contiguous run at a time */
     while (len >= EXT2_BLOCK_SIZE(ext2->sb)) {
-        /* calculate the block and read it */
-        blocknum_t phys_block = file_block_to_fs_block(ext2, inode, file_block);
+        blocknum_t phys_block;
+        uint32_t count;
+        err = ext2_map_block(ext2, inode, map, file_block, &phys_block, &count);
+        if (err < 0)
+            break;
+
+        count = MIN(count, len / EXT2_BLOCK_SIZE(ext2->sb));
+        size_t run_len = (size_t)count * EXT2_BLOCK_SIZE(ext2->sb);
+
         if (phys_block == 0) {
-            memset(buf, 0, EXT2_BLOCK_SIZE(ext2->sb));
-        } else {
+            memset(buf, 0, run_len);
+        } else if (count == 1) {
             ext2_read_block(ext2, buf, phys_block);
+        } else {
+            /* bulk data goes straight from the device, leaving the cache to metadata */
+            ssize_t ret = bio_read(ext2->dev, buf, (off_t)phys_block * EXT2_BLOCK_SIZE(ext2->sb), run_len);
+            if (ret < (ssize_t)run_len) {
+                err = (ret < 0) ? ret : ERR_IO;
+                break;
+            }
         }
 
         /* increment our stuff */
-        file_block++;
-        len -= EXT2_BLOCK_SIZE(ext2->sb);
-        bytes_read += EXT2_BLOCK_SIZE(ext2->sb);
-        buf += EXT2_BLOCK_SIZE(ext2->sb);
+        file_block += count;
+        len -= run_len;
+        bytes_read += run_len;
+        buf += run_len;
     }
 
     /* handle partial last block */
-    if (len > 0) {
+    if (len > 0 && err >= 0) {
         uint8_t temp[EXT2_BLOCK_SIZE(ext2->sb)];
 
         /* calculate the block and read it */
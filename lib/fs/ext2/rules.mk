@@ -10,6 +10,7 @@ MODULE_DEPS += \
 MODULE_SRCS += \
 	$(LOCAL_DIR)/ext2.c \
 	$(LOCAL_DIR)/dir.c \
+	$(LOCAL_DIR)/hash.c \
 	$(LOCAL_DIR)/io.c \
 	$(LOCAL_DIR)/file.c
 
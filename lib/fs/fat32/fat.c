@@ -166,7 +166,7 @@ status_t fat32_mount(bdev_t *dev, fscookie **cookie)
     }
 
     fat->bytes_per_cluster = fat->sectors_per_cluster * fat->bytes_per_sector;
-    fat->cache = bcache_create(fat->dev, fat->bytes_per_sector, 4);
+    fat->cache = bcache_create(fat->dev, fat->bytes_per_sector, 16);
 
     *cookie = (fscookie *)fat;
 end:
@@ -189,6 +189,9 @@ static const struct fs_api fat32_api = {
     .stat = fat32_stat_file,
     .read = fat32_read_file,
     .close = fat32_close_file,
+
+    .lookup = fat32_lookup_node,
+    .open_node = fat32_open_node,
 };
 
 STATIC_FS_IMPL(fat32, &fat32_api);
@@ -34,6 +34,8 @@ status_t fat32_unmount(fscookie *cookie);
 
 /* file api */
 status_t fat32_open_file(fscookie *cookie, const char *path, filecookie **fcookie);
+status_t fat32_lookup_node(fscookie *cookie, uint64_t dir, const char *name, uint64_t *node);
+status_t fat32_open_node(fscookie *cookie, uint64_t node, filecookie **fcookie);
 ssize_t fat32_read_file(filecookie *fcookie, void *buf, off_t offset, size_t len);
 status_t fat32_close_file(filecookie *fcookie);
 status_t fat32_stat_file(filecookie *fcookie, struct file_stat *stat);
@@ -49,11 +49,24 @@ typedef struct {
     uint32_t root_start;
 } fat_fs_t;
 
+/* a run of physically contiguous clusters in a file */
+typedef struct {
+    uint32_t file_cluster;  /* index of the run's first cluster within the file */
+    uint32_t cluster;       /* and where it is on the volume */
+    uint32_t count;
+} fat_extent_t;
+
 typedef struct {
     fat_fs_t *fat_fs;
     uint32_t start_cluster;
     uint32_t length;
     uint8_t attributes;
+
+    /* the cluster chain decoded so far, extended as reads reach further into the file */
+    fat_extent_t *extents;
+    uint32_t extent_count;
+    uint32_t extent_max;
+    bool chain_done;
 } fat_file_t;
 
 typedef enum {
@@ -28,11 +28,14 @@
 #include <malloc.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <debug.h>
 
 #include "fat_fs.h"
 #include "fat32_priv.h"
 
+#define LOCAL_TRACE 0
+
 #define DIR_ENTRY_LENGTH 32
 #define USE_CACHE 1
 
@@ -73,6 +76,103 @@ uint32_t fat32_next_cluster_in_chain(fat_fs_t *fat, uint32_t cluster)
     return next_cluster;
 }
 
+static inline bool fat32_end_of_chain(uint32_t cluster)
+{
+    return cluster < 2 || cluster >= 0x0ffffff8;
+}
+
+/* decode one more cluster of the file's chain onto its extent list */
+static status_t fat32_extend_chain(fat_file_t *file)
+{
+    fat_fs_t *fat = file->fat_fs;
+    uint32_t next;
+    uint32_t file_cluster;
+
+    if (file->extent_count == 0) {
+        next = file->start_cluster;
+        file_cluster = 0;
+    } else {
+        fat_extent_t *last = &file->extents[file->extent_count - 1];
+
+        file_cluster = last->file_cluster + last->count;
+
+        /* a chain longer than the file is corrupt, don't follow it round in circles */
+        if ((uint64_t)file_cluster * fat->bytes_per_cluster >= file->length) {
+            file->chain_done = true;
+            return NO_ERROR;
+        }
+
+        next = fat32_next_cluster_in_chain(fat, last->cluster + last->count - 1);
+        if (!fat32_end_of_chain(next) && next == last->cluster + last->count) {
+            last->count++;
+            return NO_ERROR;
+        }
+    }
+
+    if (fat32_end_of_chain(next)) {
+        file->chain_done = true;
+        return NO_ERROR;
+    }
+
+    /* starts a new run */
+    if (file->extent_count == file->extent_max) {
+        uint32_t max = file->extent_max ? file->extent_max * 2 : 4;
+        fat_extent_t *extents = realloc(file->extents, sizeof(fat_extent_t) * max);
+        if (!extents)
+            return ERR_NO_MEMORY;
+        file->extents = extents;
+        file->extent_max = max;
+    }
+
+    fat_extent_t *e = &file->extents[file->extent_count++];
+    e->file_cluster = file_cluster;
+    e->cluster = next;
+    e->count = 1;
+
+    return NO_ERROR;
+}
+
+/*
+ * find where a cluster of the file lives, and how many clusters from there on are
+ * contiguous. the chain is only walked as far as it hasn't been already.
+ */
+static status_t fat32_map_cluster(fat_file_t *file, uint32_t file_cluster, uint32_t *cluster, uint32_t *count)
+{
+    for (;;) {
+        if (file->extent_count > 0) {
+            fat_extent_t *last = &file->extents[file->extent_count - 1];
+            if (file_cluster < last->file_cluster + last->count)
+                break;
+        }
+
+        if (file->chain_done)
+            return ERR_NOT_FOUND;
+
+        status_t err = fat32_extend_chain(file);
+        if (err < 0)
+            return err;
+    }
+
+    /* binary search for the extent covering it */
+    uint32_t lo = 0;
+    uint32_t hi = file->extent_count - 1;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi + 1) / 2;
+        if (file->extents[mid].file_cluster <= file_cluster)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    const fat_extent_t *e = &file->extents[lo];
+    DEBUG_ASSERT(file_cluster >= e->file_cluster && file_cluster < e->file_cluster + e->count);
+
+    *cluster = e->cluster + (file_cluster - e->file_cluster);
+    *count = e->count - (file_cluster - e->file_cluster);
+
+    return NO_ERROR;
+}
+
 static inline off_t fat32_offset_for_cluster(fat_fs_t *fat, uint32_t cluster)
 {
     off_t cluster_begin_lba = fat->reserved_sectors + (fat->fat_count * fat->sectors_per_fat);
@@ -133,149 +233,263 @@ char *fat32_dir_get_filename(uint8_t *dir, off_t offset, int lfn_sequences)
     return result;
 }
 
-status_t fat32_open_file(fscookie *cookie, const char *path, filecookie **fcookie)
+/*
+ * node ids name a directory entry by the cluster holding it and its byte offset
+ * within that cluster. the root directory, which has no entry, is FS_ROOT_NODE.
+ */
+#define FAT32_NODE(cluster, offset) (((uint64_t)(cluster) << 32) | (offset))
+#define FAT32_NODE_CLUSTER(node) ((uint32_t)((node) >> 32))
+#define FAT32_NODE_OFFSET(node) ((uint32_t)(node))
+
+static status_t fat32_read_entry(fat_fs_t *fat, uint64_t node, uint8_t *entry)
 {
-    fat_fs_t *fat = (fat_fs_t *)cookie;
-    status_t result = ERR_GENERIC;
+    off_t offset = fat32_offset_for_cluster(fat, FAT32_NODE_CLUSTER(node)) + FAT32_NODE_OFFSET(node);
 
-    uint8_t *dir = malloc(fat->bytes_per_cluster);
-    uint32_t dir_cluster = fat->root_cluster;
-    fat_file_t *file = NULL;
+    ssize_t err = bio_read(fat->dev, entry, offset, DIR_ENTRY_LENGTH);
+    if (err < 0)
+        return err;
+    if (err != DIR_ENTRY_LENGTH)
+        return ERR_IO;
 
-    const char *ptr;
-    /* chew up leading slashes */
-    ptr = &path[0];
-    while (*ptr == '/') {
-        ptr++;
+    return NO_ERROR;
+}
+
+static inline uint32_t fat32_entry_cluster(const uint8_t *entry)
+{
+    return fat_read16(entry, 0x1a) | (fat_read16(entry, 0x14) << 16);
+}
+
+status_t fat32_lookup_node(fscookie *cookie, uint64_t dir_node, const char *name, uint64_t *node)
+{
+    fat_fs_t *fat = (fat_fs_t *)cookie;
+    uint32_t dir_cluster = fat->root_cluster;
+    status_t result = ERR_NOT_FOUND;
+
+    LTRACEF("dir 0x%llx, name '%s'\n", dir_node, name);
+
+    if (dir_node != FS_ROOT_NODE) {
+        uint8_t entry[DIR_ENTRY_LENGTH];
+        result = fat32_read_entry(fat, dir_node, entry);
+        if (result < 0)
+            return result;
+        if (!(entry[0x0B] & fat_attribute_directory))
+            return ERR_NOT_DIR;
+
+        /* a '..' leading back to the root points at cluster 0 */
+        dir_cluster = fat32_entry_cluster(entry);
+        if (dir_cluster == 0)
+            dir_cluster = fat->root_cluster;
+        result = ERR_NOT_FOUND;
     }
 
-    bool done = false;
-    do {
-        // XXX: use the cache!
-        bio_read(fat->dev, dir, fat32_offset_for_cluster(fat, dir_cluster), fat->bytes_per_cluster);
-
-        char *next_sep = strchr(ptr, '/');
-        if (next_sep) {
-            /* terminate the next component, giving us a substring */
-            *next_sep = 0;
-        } else {
-            /* this is the last component */
-            done = true;
+    uint8_t *dir = malloc(fat->bytes_per_cluster);
+    if (!dir)
+        return ERR_NO_MEMORY;
+
+    while (!fat32_end_of_chain(dir_cluster)) {
+        ssize_t err = bio_read(fat->dev, dir, fat32_offset_for_cluster(fat, dir_cluster), fat->bytes_per_cluster);
+        if (err < 0) {
+            result = err;
+            break;
         }
 
         uint32_t offset = 0;
         uint32_t lfn_sequences = 0;
-        bool matched = false;
-        while (dir[offset] != 0x00 && offset < fat->bytes_per_cluster) {
-            if ( dir[offset] == 0xE5 /*deleted*/) {
-                offset += DIR_ENTRY_LENGTH;
+        bool end = false;
+        for (; offset < fat->bytes_per_cluster; offset += DIR_ENTRY_LENGTH) {
+            if (dir[offset] == 0x00) {
+                /* end of directory */
+                end = true;
+                break;
+            } else if (dir[offset] == 0xE5 /*deleted*/) {
                 continue;
             } else if ((dir[offset + 0x0B] & 0x08)) {
                 if (dir[offset + 0x0B] == 0x0f) {
                     lfn_sequences++;
                 }
-
-                offset += DIR_ENTRY_LENGTH;
                 continue;
             }
 
             char *filename = fat32_dir_get_filename(dir, offset, lfn_sequences);
             lfn_sequences = 0;
 
-            matched = (strnicmp(ptr, filename, strlen(filename)) == 0);
+            bool matched = (strcasecmp(name, filename) == 0);
             free(filename);
 
             if (matched) {
-                uint16_t target_cluster = fat_read16(dir, offset + 0x1a);
-                if (done == true) {
-                    file = malloc(sizeof(fat_file_t));
-                    file->fat_fs = fat;
-                    file->start_cluster = target_cluster;
-                    file->length = fat_read32(dir, offset + 0x1c);
-                    file->attributes = dir[0x0B + offset];
-                    result = NO_ERROR;
-                } else {
-                    dir_cluster = target_cluster;
-                }
+                *node = FAT32_NODE(dir_cluster, offset);
+                result = NO_ERROR;
+                end = true;
                 break;
             }
-
-            offset += DIR_ENTRY_LENGTH;
         }
+        if (end)
+            break;
 
-        if (matched == true) {
-            if (done == true) {
-                break;
-            } else {
-                /* move to the next separator */
-                ptr = next_sep + 1;
-
-                /* consume multiple separators */
-                while (*ptr == '/') {
-                    ptr++;
-                }
-            }
-        } else {
-            // XXX: untested!!!
-            dir_cluster = fat32_next_cluster_in_chain(fat, dir_cluster);
-            if (dir_cluster == 0x0fffffff) {
-                // no more clusters in the chain
-                break;
-            }
-        }
-    } while (true);
+        dir_cluster = fat32_next_cluster_in_chain(fat, dir_cluster);
+    }
 
-out:
-    *fcookie = (filecookie *)file;
     free(dir);
     return result;
 }
 
-ssize_t fat32_read_file(filecookie *fcookie, void *buf, off_t offset, size_t len)
+status_t fat32_open_node(fscookie *cookie, uint64_t node, filecookie **fcookie)
 {
-    fat_file_t *file = (fat_file_t *)fcookie;
-    fat_fs_t *fat = file->fat_fs;
-    bdev_t *dev = fat->dev;
+    fat_fs_t *fat = (fat_fs_t *)cookie;
+    fat_file_t *file;
+
+    file = calloc(1, sizeof(fat_file_t));
+    if (!file)
+        return ERR_NO_MEMORY;
+    file->fat_fs = fat;
 
-    uint32_t cluster = 0;
-    if (offset <= fat->bytes_per_cluster) {
-        cluster = file->start_cluster;
+    if (node == FS_ROOT_NODE) {
+        file->start_cluster = fat->root_cluster;
+        file->attributes = fat_attribute_directory;
     } else {
-        // XXX: support non-0 offsets
-        TRACE;
-        return -1;
+        uint8_t entry[DIR_ENTRY_LENGTH];
+        status_t err = fat32_read_entry(fat, node, entry);
+        if (err < 0) {
+            free(file);
+            return err;
+        }
+
+        file->start_cluster = fat32_entry_cluster(entry);
+        file->length = fat_read32(entry, 0x1c);
+        file->attributes = entry[0x0B];
     }
 
-    uint32_t length = file->length;
-    uint32_t amount_read = 0;
+    *fcookie = (filecookie *)file;
+    return NO_ERROR;
+}
 
-    do {
-        off_t lba_addr = fat32_offset_for_cluster(fat, cluster);
+status_t fat32_open_file(fscookie *cookie, const char *path, filecookie **fcookie)
+{
+    uint64_t node = FS_ROOT_NODE;
+    char name[FS_MAX_FILE_LEN];
+
+    /* look up a component at a time */
+    while (*path) {
+        while (*path == '/')
+            path++;
+        if (!*path)
+            break;
+
+        const char *next_sep = strchr(path, '/');
+        size_t len = next_sep ? (size_t)(next_sep - path) : strlen(path);
+        if (len >= sizeof(name))
+            return ERR_BAD_PATH;
+        memcpy(name, path, len);
+        name[len] = 0;
+        path += len;
+
+        status_t err = fat32_lookup_node(cookie, node, name, &node);
+        if (err < 0)
+            return err;
+    }
 
-        uint32_t to_read = fat->bytes_per_cluster;
-        uint32_t next_cluster = 0;
-        while ((next_cluster = fat32_next_cluster_in_chain(fat, cluster)) == cluster + 1) {
-            cluster = next_cluster;
-            to_read += fat->bytes_per_cluster;
-        }
-        cluster = next_cluster;
+    return fat32_open_node(cookie, node, fcookie);
+}
 
-        to_read = MIN(length - amount_read, to_read);
-        // XXX: support non-0 offsets
-        int err = bio_read(dev, buf+amount_read, lba_addr, to_read);
-        if (err < 0) {
-            return err;
+/* bulk reads are cut into requests of at most this size, this many kept in flight */
+#define FAT32_READ_CHUNK    (256 * 1024)
+#define FAT32_READ_INFLIGHT 8
+
+struct fat32_read_req {
+    bio_request_t req;
+    bio_iovec_t iov;
+};
+
+ssize_t fat32_read_file(filecookie *fcookie, void *_buf, off_t offset, size_t len)
+{
+    fat_file_t *file = (fat_file_t *)fcookie;
+    fat_fs_t *fat = file->fat_fs;
+    bdev_t *dev = fat->dev;
+    uint8_t *buf = _buf;
+
+    /* trim the read to the file */
+    if (offset < 0)
+        return ERR_INVALID_ARGS;
+    if (offset >= file->length)
+        return 0;
+    len = MIN(len, file->length - offset);
+
+    /*
+     * whole block runs going straight into the caller's buffer are submitted
+     * asynchronously, so the pieces of a fragmented file are all in flight at
+     * once. anything else goes through bio_read.
+     */
+    struct fat32_read_req reqs[FAT32_READ_INFLIGHT];
+    uint submitted = 0;
+    uint completed = 0;
+    ssize_t err = NO_ERROR;
+
+    size_t amount_read = 0;
+    while (amount_read < len) {
+        off_t pos = offset + amount_read;
+        uint32_t cluster, count;
+
+        status_t map_err = fat32_map_cluster(file, pos / fat->bytes_per_cluster, &cluster, &count);
+        if (map_err < 0) {
+            printf("no more clusters, amount_read=%zu\n", amount_read);
+            break;
         }
 
-        amount_read += to_read;
+        /* the rest of the contiguous run in one go */
+        uint32_t within = pos % fat->bytes_per_cluster;
+        size_t to_read = MIN(len - amount_read, (size_t)count * fat->bytes_per_cluster - within);
+        off_t dev_offset = fat32_offset_for_cluster(fat, cluster) + within;
+
+        bool aligned = IS_ALIGNED(dev_offset, dev->block_size) && to_read >= dev->block_size &&
+                       (!(dev->flags & BIO_FLAG_CACHE_ALIGNED_READS) ||
+                        IS_ALIGNED((uintptr_t)(buf + amount_read), CACHE_LINE));
+        if (aligned) {
+            to_read = MIN(ROUNDDOWN(to_read, dev->block_size), FAT32_READ_CHUNK);
+
+            /* make room */
+            if (submitted - completed == FAT32_READ_INFLIGHT) {
+                ssize_t ret = bio_request_wait(&reqs[completed++ % FAT32_READ_INFLIGHT].req);
+                if (ret < 0) {
+                    err = ret;
+                    break;
+                }
+            }
 
-        if (amount_read < length) {
-            if (cluster == 0x0fffffff) {
-                printf("no more clusters, amount_read=%i, to_read=%i\n", amount_read, to_read);
-                break;
+            struct fat32_read_req *r = &reqs[submitted % FAT32_READ_INFLIGHT];
+            memset(r, 0, sizeof(*r));
+            r->iov.base = buf + amount_read;
+            r->iov.len = to_read;
+            r->req.block = dev_offset >> dev->block_shift;
+            r->req.iov = &r->iov;
+            r->req.iov_count = 1;
+
+            if (bio_submit(dev, &r->req) == NO_ERROR) {
+                submitted++;
+                amount_read += to_read;
+                continue;
             }
         }
-    } while (amount_read < length);
+
+        ssize_t ret = bio_read(dev, buf + amount_read, dev_offset, to_read);
+        if (ret < 0) {
+            err = ret;
+            break;
+        }
+
+        amount_read += ret;
+        if ((size_t)ret < to_read)
+            break;
+    }
+
+    /* collect whatever's still outstanding */
+    while (completed < submitted) {
+        ssize_t ret = bio_request_wait(&reqs[completed++ % FAT32_READ_INFLIGHT].req);
+        if (ret < 0 && err == NO_ERROR)
+            err = ret;
+    }
+
+    if (err < 0)
+        return err;
 
     return amount_read;
 }
@@ -283,6 +497,7 @@ ssize_t fat32_read_file(filecookie *fcookie, void *buf, off_t offset, size_t len
 status_t fat32_close_file(filecookie *fcookie)
 {
     fat_file_t *file = (fat_file_t *)fcookie;
+    free(file->extents);
     free(file);
     return NO_ERROR;
 }
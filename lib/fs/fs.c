@@ -29,7 +29,14 @@
 #include <lib/fs.h>
 #include <lib/bio.h>
 #include <lk/init.h>
+#include <arch/ops.h>
+#include <kernel/rwlock.h>
 #include <kernel/mutex.h>
+#include <kernel/semaphore.h>
+#include <kernel/thread.h>
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
 
 #define LOCAL_TRACE 0
 
@@ -46,6 +53,22 @@ struct fs_mount {
 struct filehandle {
     filecookie *cookie;
     struct fs_mount *mount;
+
+    struct list_node mappings;
+
+    /* async requests */
+    volatile int pending;       /* submitted and not yet complete */
+    struct list_node queue;     /* waiting for a worker */
+    struct list_node ready_node;
+    bool ready;                 /* on the ready list */
+    bool busy;                  /* a worker is running one */
+};
+
+/* an outstanding fs_map_file */
+struct fs_mapping {
+    struct list_node node;
+    const void *ptr;
+    bool copy;  /* the range was read into a buffer we own */
 };
 
 struct dirhandle {
@@ -53,10 +76,61 @@ struct dirhandle {
     struct fs_mount *mount;
 };
 
-static mutex_t mount_lock = MUTEX_INITIAL_VALUE(mount_lock);
+static rwlock_t mount_lock = RWLOCK_INITIAL_VALUE(mount_lock);
 static struct list_node mounts = LIST_INITIAL_VALUE(mounts);
 static struct list_node fses = LIST_INITIAL_VALUE(fses);
 
+/*
+ * requests for filesystems without a submit hook are run by a pool of workers.
+ * files with queued requests wait on the ready list, and a file is only handed
+ * to one worker at a time since filesystems don't expect concurrent calls on
+ * the same file.
+ */
+#define FS_ASYNC_WORKERS 4
+
+static struct {
+    struct list_node ready;
+    mutex_t lock;
+    semaphore_t sem;
+    bool running;
+} fs_async = {
+    .ready = LIST_INITIAL_VALUE(fs_async.ready),
+    .lock = MUTEX_INITIAL_VALUE(fs_async.lock),
+};
+
+/*
+ * cache of path components resolved through the fs lookup hook, keyed by
+ * mount, directory node and name. misses are cached too, so probing for files
+ * that aren't there is cheap. anything that changes a mount's namespace
+ * drops all of its entries.
+ */
+#define FS_DCACHE_SIZE 64
+#define FS_DCACHE_HASH_SIZE 32
+
+struct fs_dentry {
+    struct list_node hash_node;
+    struct list_node lru_node;
+
+    struct fs_mount *mount;
+    uint64_t dir;
+    uint64_t node;
+    bool negative;
+    char name[FS_MAX_FILE_LEN];
+};
+
+static struct {
+    mutex_t lock;
+    bool initialized;
+    struct list_node hash[FS_DCACHE_HASH_SIZE];
+    struct list_node lru;   /* in use entries, least recently used first */
+    struct list_node free;
+    struct fs_dentry entries[FS_DCACHE_SIZE];
+    uint32_t hits;
+    uint32_t misses;
+} dcache = {
+    .lock = MUTEX_INITIAL_VALUE(dcache.lock),
+};
+
 // defined in the linker script
 extern const struct fs_impl __fs_impl_start;
 extern const struct fs_impl __fs_impl_end;
@@ -78,7 +152,7 @@ static struct fs_mount *find_mount(const char *path, const char **trimmed_path)
     struct fs_mount *mount;
     size_t pathlen = strlen(path);
 
-    mutex_acquire(&mount_lock);
+    rwlock_acquire_read(&mount_lock);
     list_for_every_entry(&mounts, mount, struct fs_mount, node) {
         size_t mountpathlen = strlen(mount->path);
         if (pathlen < mountpathlen)
@@ -90,31 +164,200 @@ static struct fs_mount *find_mount(const char *path, const char **trimmed_path)
             if (trimmed_path)
                 *trimmed_path = &path[mountpathlen];
 
-            mount->ref++;
+            /* other readers may be bumping it too */
+            atomic_add(&mount->ref, 1);
 
-            mutex_release(&mount_lock);
+            rwlock_release_read(&mount_lock);
             return mount;
         }
     }
 
-    mutex_release(&mount_lock);
+    rwlock_release_read(&mount_lock);
     return NULL;
 }
 
+static uint dcache_hash(struct fs_mount *mount, uint64_t dir, const char *name)
+{
+    uint hash = (uint)(uintptr_t)mount ^ (uint)dir ^ (uint)(dir >> 32);
+    while (*name)
+        hash = hash * 31 + (uint8_t)*name++;
+
+    return hash % FS_DCACHE_HASH_SIZE;
+}
+
+/* called with the dcache lock held */
+static void dcache_init(void)
+{
+    if (dcache.initialized)
+        return;
+
+    for (uint i = 0; i < FS_DCACHE_HASH_SIZE; i++)
+        list_initialize(&dcache.hash[i]);
+    list_initialize(&dcache.lru);
+    list_initialize(&dcache.free);
+    for (uint i = 0; i < FS_DCACHE_SIZE; i++)
+        list_add_tail(&dcache.free, &dcache.entries[i].lru_node);
+
+    dcache.initialized = true;
+}
+
+static bool dcache_lookup(struct fs_mount *mount, uint64_t dir, const char *name, uint64_t *node, bool *negative)
+{
+    struct fs_dentry *d;
+    bool found = false;
+
+    mutex_acquire(&dcache.lock);
+    dcache_init();
+
+    list_for_every_entry(&dcache.hash[dcache_hash(mount, dir, name)], d, struct fs_dentry, hash_node) {
+        if (d->mount == mount && d->dir == dir && !strcmp(d->name, name)) {
+            *node = d->node;
+            *negative = d->negative;
+
+            /* most recently used */
+            list_delete(&d->lru_node);
+            list_add_tail(&dcache.lru, &d->lru_node);
+
+            found = true;
+            break;
+        }
+    }
+
+    if (found)
+        dcache.hits++;
+    else
+        dcache.misses++;
+
+    mutex_release(&dcache.lock);
+
+    return found;
+}
+
+static void dcache_insert(struct fs_mount *mount, uint64_t dir, const char *name, uint64_t node, bool negative)
+{
+    if (strlen(name) >= FS_MAX_FILE_LEN)
+        return;
+
+    mutex_acquire(&dcache.lock);
+    dcache_init();
+
+    /* reuse a free entry, or the least recently used one */
+    struct fs_dentry *d = list_remove_head_type(&dcache.free, struct fs_dentry, lru_node);
+    if (!d) {
+        d = list_remove_head_type(&dcache.lru, struct fs_dentry, lru_node);
+        list_delete(&d->hash_node);
+    }
+
+    d->mount = mount;
+    d->dir = dir;
+    d->node = node;
+    d->negative = negative;
+    strlcpy(d->name, name, sizeof(d->name));
+
+    list_add_head(&dcache.hash[dcache_hash(mount, dir, name)], &d->hash_node);
+    list_add_tail(&dcache.lru, &d->lru_node);
+
+    mutex_release(&dcache.lock);
+}
+
+/* forget everything cached for a mount */
+static void dcache_purge(struct fs_mount *mount)
+{
+    mutex_acquire(&dcache.lock);
+    dcache_init();
+
+    struct fs_dentry *d, *temp;
+    list_for_every_entry_safe(&dcache.lru, d, temp, struct fs_dentry, lru_node) {
+        if (d->mount == mount) {
+            list_delete(&d->hash_node);
+            list_delete(&d->lru_node);
+            list_add_tail(&dcache.free, &d->lru_node);
+        }
+    }
+
+    mutex_release(&dcache.lock);
+}
+
+/* walk a path within a mount one component at a time, through the dcache */
+static status_t resolve_path(struct fs_mount *mount, const char *path, uint64_t *node)
+{
+    char name[FS_MAX_FILE_LEN];
+    uint64_t cur = FS_ROOT_NODE;
+
+    while (*path) {
+        /* pull off the next component */
+        while (*path == '/')
+            path++;
+        if (!*path)
+            break;
+
+        const char *end = strchr(path, '/');
+        size_t len = end ? (size_t)(end - path) : strlen(path);
+        if (len >= sizeof(name))
+            return ERR_BAD_PATH;
+        memcpy(name, path, len);
+        name[len] = 0;
+        path += len;
+
+        uint64_t next;
+        bool negative;
+        if (dcache_lookup(mount, cur, name, &next, &negative)) {
+            if (negative)
+                return ERR_NOT_FOUND;
+        } else {
+            status_t err = mount->api->lookup(mount->cookie, cur, name, &next);
+            if (err == ERR_NOT_FOUND) {
+                dcache_insert(mount, cur, name, 0, true);
+                return err;
+            }
+            if (err < 0)
+                return err;
+
+            dcache_insert(mount, cur, name, next, false);
+        }
+
+        cur = next;
+    }
+
+    *node = cur;
+    return NO_ERROR;
+}
+
+void fs_dump_dcache(void)
+{
+    mutex_acquire(&dcache.lock);
+    dcache_init();
+
+    uint used = 0;
+    uint negative = 0;
+    struct fs_dentry *d;
+    list_for_every_entry(&dcache.lru, d, struct fs_dentry, lru_node) {
+        used++;
+        if (d->negative)
+            negative++;
+    }
+
+    printf("dcache: %u/%u entries (%u negative), hits %u, misses %u\n",
+           used, FS_DCACHE_SIZE, negative, dcache.hits, dcache.misses);
+
+    mutex_release(&dcache.lock);
+}
+
 // decrement the ref to the mount structure, which may
 // cause an unmount operation
 static void put_mount(struct fs_mount *mount)
 {
-    mutex_acquire(&mount_lock);
-    if ((--mount->ref) == 0) {
+    rwlock_acquire_write(&mount_lock);
+    if (atomic_add(&mount->ref, -1) == 1) {
         list_delete(&mount->node);
+        dcache_purge(mount);
         mount->api->unmount(mount->cookie);
         free(mount->path);
         if (mount->dev)
             bio_close(mount->dev);
         free(mount);
     }
-    mutex_release(&mount_lock);
+    rwlock_release_write(&mount_lock);
 }
 
 static status_t mount(const char *path, const char *device, const struct fs_api *api)
@@ -159,7 +402,9 @@ static status_t mount(const char *path, const char *device, const struct fs_api
     mount->ref = 1;
     mount->api = api;
 
+    rwlock_acquire_write(&mount_lock);
     list_add_head(&mounts, &mount->node);
+    rwlock_release_write(&mount_lock);
 
     return 0;
 
@@ -231,15 +476,25 @@ status_t fs_open_file(const char *path, filehandle **handle)
     LTRACEF("path %s temppath %s newpath %s\n", path, temppath, newpath);
 
     filecookie *cookie;
-    status_t err = mount->api->open(mount->cookie, newpath, &cookie);
+    status_t err;
+    if (mount->api->lookup && mount->api->open_node) {
+        uint64_t node;
+        err = resolve_path(mount, newpath, &node);
+        if (err >= 0)
+            err = mount->api->open_node(mount->cookie, node, &cookie);
+    } else {
+        err = mount->api->open(mount->cookie, newpath, &cookie);
+    }
     if (err < 0) {
         put_mount(mount);
         return err;
     }
 
-    filehandle *f = malloc(sizeof(*f));
+    filehandle *f = calloc(1, sizeof(*f));
     f->cookie = cookie;
     f->mount = mount;
+    list_initialize(&f->mappings);
+    list_initialize(&f->queue);
     *handle = f;
 
     return 0;
@@ -276,14 +531,17 @@ status_t fs_create_file(const char *path, filehandle **handle, uint64_t len)
 
     filecookie *cookie;
     status_t err = mount->api->create(mount->cookie, newpath, &cookie, len);
+    dcache_purge(mount);
     if (err < 0) {
         put_mount(mount);
         return err;
     }
 
-    filehandle *f = malloc(sizeof(*f));
+    filehandle *f = calloc(1, sizeof(*f));
     f->cookie = cookie;
     f->mount = mount;
+    list_initialize(&f->mappings);
+    list_initialize(&f->queue);
     *handle = f;
 
     return 0;
@@ -317,6 +575,7 @@ status_t fs_remove_file(const char *path)
     }
 
     status_t err = mount->api->remove(mount->cookie, newpath);
+    dcache_purge(mount);
 
     put_mount(mount);
 
@@ -336,12 +595,282 @@ ssize_t fs_write_file(filehandle *handle, const void *buf, off_t offset, size_t
     return handle->mount->api->write(handle->cookie, buf, offset, len);
 }
 
+ssize_t fs_readv(filehandle *handle, const fs_iovec_t *iov, uint iov_count, off_t offset)
+{
+    if (handle->mount->api->readv)
+        return handle->mount->api->readv(handle->cookie, iov, iov_count, offset);
+
+    ssize_t total = 0;
+    for (uint i = 0; i < iov_count; i++) {
+        ssize_t err = handle->mount->api->read(handle->cookie, iov[i].base, offset, iov[i].len);
+        if (err < 0)
+            return total ? total : err;
+
+        total += err;
+        offset += err;
+        if ((size_t)err < iov[i].len)
+            break;
+    }
+
+    return total;
+}
+
+ssize_t fs_writev(filehandle *handle, const fs_iovec_t *iov, uint iov_count, off_t offset)
+{
+    if (handle->mount->api->writev)
+        return handle->mount->api->writev(handle->cookie, iov, iov_count, offset);
+    if (!handle->mount->api->write)
+        return ERR_NOT_SUPPORTED;
+
+    ssize_t total = 0;
+    for (uint i = 0; i < iov_count; i++) {
+        ssize_t err = handle->mount->api->write(handle->cookie, iov[i].base, offset, iov[i].len);
+        if (err < 0)
+            return total ? total : err;
+
+        total += err;
+        offset += err;
+        if ((size_t)err < iov[i].len)
+            break;
+    }
+
+    return total;
+}
+
+static status_t fs_default_submit(filehandle *handle, fs_request_t *req)
+{
+    if (!fs_async.running)
+        return ERR_NOT_READY;
+
+    mutex_acquire(&fs_async.lock);
+    list_add_tail(&handle->queue, &req->node);
+    bool post = false;
+    if (!handle->busy && !handle->ready) {
+        list_add_tail(&fs_async.ready, &handle->ready_node);
+        handle->ready = true;
+        post = true;
+    }
+    mutex_release(&fs_async.lock);
+
+    if (post)
+        sem_post(&fs_async.sem, false);
+
+    return NO_ERROR;
+}
+
+static int fs_async_worker(void *arg)
+{
+    for (;;) {
+        sem_wait(&fs_async.sem);
+
+        mutex_acquire(&fs_async.lock);
+        filehandle *handle = list_remove_head_type(&fs_async.ready, filehandle, ready_node);
+        fs_request_t *req = NULL;
+        if (handle) {
+            handle->ready = false;
+            handle->busy = true;
+            req = list_remove_head_type(&handle->queue, fs_request_t, node);
+        }
+        mutex_release(&fs_async.lock);
+
+        if (!req)
+            continue;
+
+        ssize_t result;
+        if (req->write)
+            result = fs_writev(handle, req->iov, req->iov_count, req->offset);
+        else
+            result = fs_readv(handle, req->iov, req->iov_count, req->offset);
+
+        /* hand the file on before completing, the callback may close it */
+        mutex_acquire(&fs_async.lock);
+        handle->busy = false;
+        bool post = false;
+        if (!list_is_empty(&handle->queue)) {
+            list_add_tail(&fs_async.ready, &handle->ready_node);
+            handle->ready = true;
+            post = true;
+        }
+        mutex_release(&fs_async.lock);
+
+        if (post)
+            sem_post(&fs_async.sem, false);
+
+        fs_request_complete(req, result);
+    }
+
+    return 0;
+}
+
+static void fs_async_init(uint level)
+{
+    sem_init(&fs_async.sem, 0);
+    fs_async.running = true;
+
+    for (uint i = 0; i < FS_ASYNC_WORKERS; i++) {
+        thread_detach_and_resume(thread_create("fs async", &fs_async_worker, NULL,
+                                               DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
+    }
+}
+
+LK_INIT_HOOK(fs_async, &fs_async_init, LK_INIT_LEVEL_THREADING);
+
+status_t fs_submit(filehandle *handle, fs_request_t *req)
+{
+    LTRACEF("filehandle %p, req %p, write %d, offset %lld, iov_count %u\n",
+            handle, req, req->write, req->offset, req->iov_count);
+
+    if (!req->iov || req->iov_count == 0 || req->offset < 0)
+        return ERR_INVALID_ARGS;
+    if (req->write && !handle->mount->api->write && !handle->mount->api->writev)
+        return ERR_NOT_SUPPORTED;
+
+    req->handle = handle;
+    req->result = 0;
+    if (!req->callback)
+        event_init(&req->event, false, 0);
+
+    atomic_add(&handle->pending, 1);
+
+    status_t err;
+    if (handle->mount->api->submit)
+        err = handle->mount->api->submit(handle->cookie, req);
+    else
+        err = fs_default_submit(handle, req);
+
+    if (err < 0) {
+        atomic_add(&handle->pending, -1);
+        if (!req->callback)
+            event_destroy(&req->event);
+    }
+
+    return err;
+}
+
+void fs_request_complete(fs_request_t *req, ssize_t result)
+{
+    LTRACEF("req %p, result %ld\n", req, (long)result);
+
+    req->result = result;
+    atomic_add(&req->handle->pending, -1);
+
+    /* the request belongs to the caller again after this */
+    if (req->callback)
+        req->callback(req);
+    else
+        event_signal(&req->event, false);
+}
+
+ssize_t fs_request_wait(fs_request_t *req)
+{
+    DEBUG_ASSERT(!req->callback);
+
+    event_wait(&req->event);
+    event_destroy(&req->event);
+
+    return req->result;
+}
+
+static void *map_alloc(size_t len)
+{
+#if WITH_KERNEL_VM
+    void *ptr;
+    status_t err = vmm_alloc(vmm_get_kernel_aspace(), "fs map", ROUNDUP(len, PAGE_SIZE), &ptr, 0, 0, 0);
+    return (err < 0) ? NULL : ptr;
+#else
+    return malloc(len);
+#endif
+}
+
+static void map_free(void *ptr)
+{
+#if WITH_KERNEL_VM
+    vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)ptr);
+#else
+    free(ptr);
+#endif
+}
+
+static void release_mapping(struct fs_mapping *map)
+{
+    list_delete(&map->node);
+    if (map->copy)
+        map_free((void *)map->ptr);
+    free(map);
+}
+
+status_t fs_map_file(filehandle *handle, off_t offset, size_t len, const void **ptr)
+{
+    LTRACEF("filehandle %p, offset %lld, len %zu\n", handle, offset, len);
+
+    if (offset < 0 || len == 0)
+        return ERR_INVALID_ARGS;
+
+    struct fs_mapping *map = malloc(sizeof(*map));
+    if (!map)
+        return ERR_NO_MEMORY;
+
+    status_t err = ERR_NOT_SUPPORTED;
+    if (handle->mount->api->map)
+        err = handle->mount->api->map(handle->cookie, offset, len, &map->ptr);
+
+    if (err == NO_ERROR) {
+        map->copy = false;
+    } else if (err == ERR_NOT_SUPPORTED) {
+        /* read the range into a buffer of our own */
+        void *buf = map_alloc(len);
+        if (!buf) {
+            free(map);
+            return ERR_NO_MEMORY;
+        }
+
+        ssize_t read_len = fs_read_file(handle, buf, offset, len);
+        if (read_len < 0 || (size_t)read_len != len) {
+            map_free(buf);
+            free(map);
+            return (read_len < 0) ? read_len : ERR_OUT_OF_RANGE;
+        }
+
+        map->ptr = buf;
+        map->copy = true;
+    } else {
+        free(map);
+        return err;
+    }
+
+    list_add_head(&handle->mappings, &map->node);
+    *ptr = map->ptr;
+
+    return NO_ERROR;
+}
+
+status_t fs_unmap_file(filehandle *handle, const void *ptr)
+{
+    struct fs_mapping *map;
+    list_for_every_entry(&handle->mappings, map, struct fs_mapping, node) {
+        if (map->ptr == ptr) {
+            release_mapping(map);
+            return NO_ERROR;
+        }
+    }
+
+    return ERR_NOT_FOUND;
+}
+
 status_t fs_close_file(filehandle *handle)
 {
+    if (handle->pending > 0)
+        return ERR_BUSY;
+
     status_t err = handle->mount->api->close(handle->cookie);
     if (err < 0)
         return err;
 
+    struct fs_mapping *map, *temp;
+    list_for_every_entry_safe(&handle->mappings, map, temp, struct fs_mapping, node) {
+        release_mapping(map);
+    }
+
     put_mount(handle->mount);
     free(handle);
     return 0;
@@ -370,6 +899,7 @@ status_t fs_make_dir(const char *path)
     }
 
     status_t err = mount->api->mkdir(mount->cookie, newpath);
+    dcache_purge(mount);
 
     put_mount(mount);
 
@@ -25,6 +25,8 @@
 #include <stdbool.h>
 #include <sys/types.h>
 #include <compiler.h>
+#include <list.h>
+#include <kernel/event.h>
 
 #define FS_MAX_PATH_LEN 128
 #define FS_MAX_FILE_LEN 64
@@ -59,6 +61,38 @@ struct dirent {
 typedef struct filehandle filehandle;
 typedef struct dirhandle dirhandle;
 
+typedef struct fs_iovec {
+    void *base;
+    size_t len;
+} fs_iovec_t;
+
+struct fs_request;
+
+/* completion routine, may be called in interrupt context */
+typedef void (*fs_request_callback_t)(struct fs_request *req);
+
+/*
+ * An asynchronous file transfer. The caller owns the request and the buffers
+ * until it completes. Completion either calls the callback or, if there isn't
+ * one, signals the request's event for fs_request_wait().
+ */
+typedef struct fs_request {
+    bool write;
+    off_t offset;
+    const fs_iovec_t *iov;
+    uint iov_count;
+    fs_request_callback_t callback;
+    void *arg;
+
+    /* bytes transferred or an error, valid once complete */
+    ssize_t result;
+
+    /* private to the fs layer and the filesystem */
+    filehandle *handle;
+    struct list_node node;
+    event_t event;
+} fs_request_t;
+
 
 status_t fs_format_device(const char *fsname, const char *device, const void *args) __NONNULL((1));
 status_t fs_mount(const char *path, const char *fs, const char *device) __NONNULL((1)) __NONNULL((2));
@@ -75,6 +109,26 @@ status_t fs_close_file(filehandle *handle) __NONNULL();
 status_t fs_stat_file(filehandle *handle, struct file_stat *) __NONNULL((1));
 status_t fs_truncate_file(filehandle *handle, uint64_t len) __NONNULL((1));
 
+/* scatter/gather versions of read and write, returning the total transferred */
+ssize_t fs_readv(filehandle *handle, const fs_iovec_t *iov, uint iov_count, off_t offset) __NONNULL();
+ssize_t fs_writev(filehandle *handle, const fs_iovec_t *iov, uint iov_count, off_t offset) __NONNULL();
+
+/*
+ * queue a request, returning once it's queued. requests on different files run
+ * concurrently, a file's own requests run one at a time unless its filesystem
+ * says otherwise. all of a file's requests must finish before it's closed.
+ */
+status_t fs_submit(filehandle *handle, fs_request_t *req) __NONNULL();
+ssize_t fs_request_wait(fs_request_t *req) __NONNULL();
+
+/*
+ * get a range of a file as a pointer. files on linear (XIP) devices and memfs are
+ * handed out in place, otherwise the range is read into a private buffer. the
+ * pointer is read only and stays valid until fs_unmap_file or the file is closed.
+ */
+status_t fs_map_file(filehandle *handle, off_t offset, size_t len, const void **ptr) __NONNULL();
+status_t fs_unmap_file(filehandle *handle, const void *ptr) __NONNULL();
+
 /* dir api */
 status_t fs_make_dir(const char *path) __NONNULL();
 status_t fs_open_dir(const char *path, dirhandle **handle) __NONNULL();
@@ -89,6 +143,9 @@ ssize_t fs_load_file(const char *path, void *ptr, size_t maxlen) __NONNULL();
 /* walk through a path string, removing duplicate path separators, flattening . and .. references */
 void fs_normalize_path(char *path) __NONNULL();
 
+/* print path lookup cache statistics */
+void fs_dump_dcache(void);
+
 /* Remove any leading spaces or slashes */
 const char *trim_name(const char *_name);
 
@@ -98,6 +155,9 @@ typedef struct filecookie filecookie;
 typedef struct dircookie dircookie;
 struct bdev;
 
+/* node id of the root directory, for the optional lookup/open_node hooks */
+#define FS_ROOT_NODE 0
+
 struct fs_api {
     status_t (*format)(struct bdev *, const void *);
     status_t (*fs_stat)(fscookie *, struct fs_stat *);
@@ -119,8 +179,34 @@ struct fs_api {
     status_t (*closedir)(dircookie *) __NONNULL();
 
     status_t (*file_ioctl)(filecookie *, int, void *);
+
+    /*
+     * optional, lets the fs layer cache path lookups. lookup resolves one name
+     * in a directory to an fs defined node id, returning ERR_NOT_FOUND if it
+     * doesn't exist, and open_node opens a file by id.
+     */
+    status_t (*lookup)(fscookie *, uint64_t dir, const char *name, uint64_t *node);
+    status_t (*open_node)(fscookie *, uint64_t node, filecookie **);
+
+    /*
+     * optional, return a direct pointer to a range of the file if it sits in
+     * memory, or ERR_NOT_SUPPORTED to have the fs layer fall back to a copy.
+     */
+    status_t (*map)(filecookie *, off_t offset, size_t len, const void **ptr);
+
+    /*
+     * optional scatter/gather and asynchronous i/o. without them, readv and
+     * writev loop over read and write, and submit runs the transfer on a
+     * worker thread. a submit hook finishes requests with fs_request_complete.
+     */
+    ssize_t (*readv)(filecookie *, const fs_iovec_t *, uint, off_t);
+    ssize_t (*writev)(filecookie *, const fs_iovec_t *, uint, off_t);
+    status_t (*submit)(filecookie *, fs_request_t *);
 };
 
+/* for filesystems with a submit hook */
+void fs_request_complete(fs_request_t *req, ssize_t result);
+
 struct fs_impl {
     const char *name;
     const struct fs_api *api;
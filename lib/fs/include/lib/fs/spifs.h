@@ -31,6 +31,10 @@
 
 typedef struct {
     uint32_t toc_pages;
+
+    // Pages set aside after the front ToC for journaled metadata updates. With
+    // none, every create/remove/resize rewrites a whole ToC.
+    uint32_t journal_pages;
 } spifs_format_args_t;
 
 #endif  // LIB_FS_SPIFS_H_
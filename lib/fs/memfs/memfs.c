@@ -33,8 +33,16 @@
 
 #define LOCAL_TRACE 0
 
+// files are stored as a list of pages, allocated as they're first written
+#define MEMFS_PAGE_SIZE 4096
+#define MEMFS_PAGE_SHIFT 12
+
+// buckets in the file name hash
+#define MEMFS_HASH_SIZE 64
+
 typedef struct {
     struct list_node files;
+    struct list_node hash[MEMFS_HASH_SIZE];
     struct list_node dcookies;
 
     mutex_t lock;
@@ -42,13 +50,15 @@ typedef struct {
 
 typedef struct {
     struct list_node node;
+    struct list_node hash_node;
     memfs_t *fs;
 
     // name
     char *name;
 
-    // main data area
-    uint8_t *ptr;
+    // data pages, NULL where nothing has been written yet
+    uint8_t **pages;
+    size_t page_max;
     size_t len;
 } memfs_file_t;
 
@@ -60,10 +70,19 @@ struct dircookie {
     memfs_file_t *next_file;
 };
 
+static uint hash_name(const char *name)
+{
+    uint hash = 0;
+    while (*name)
+        hash = hash * 31 + (uint8_t)*name++;
+
+    return hash % MEMFS_HASH_SIZE;
+}
+
 static memfs_file_t *find_file(memfs_t *mem, const char *name)
 {
     memfs_file_t *file;
-    list_for_every_entry(&mem->files, file, memfs_file_t, node) {
+    list_for_every_entry(&mem->hash[hash_name(name)], file, memfs_file_t, hash_node) {
         if (!strcmp(name, file->name))
             return file;
     }
@@ -71,6 +90,39 @@ static memfs_file_t *find_file(memfs_t *mem, const char *name)
     return NULL;
 }
 
+// make sure the page array covers len bytes
+static status_t grow_pages(memfs_file_t *file, size_t len)
+{
+    size_t count = ROUNDUP(len, MEMFS_PAGE_SIZE) >> MEMFS_PAGE_SHIFT;
+    if (count <= file->page_max)
+        return NO_ERROR;
+
+    size_t max = MAX(count, file->page_max * 2);
+    uint8_t **pages = realloc(file->pages, max * sizeof(uint8_t *));
+    if (!pages)
+        return ERR_NO_MEMORY;
+
+    memset(pages + file->page_max, 0, (max - file->page_max) * sizeof(uint8_t *));
+    file->pages = pages;
+    file->page_max = max;
+
+    return NO_ERROR;
+}
+
+// drop the data past len, so a later extension reads back as zeroes
+static void trim_pages(memfs_file_t *file, size_t len)
+{
+    size_t first = ROUNDUP(len, MEMFS_PAGE_SIZE) >> MEMFS_PAGE_SHIFT;
+    for (size_t i = first; i < file->page_max; i++) {
+        free(file->pages[i]);
+        file->pages[i] = NULL;
+    }
+
+    size_t tail = len & (MEMFS_PAGE_SIZE - 1);
+    if (tail && file->pages[len >> MEMFS_PAGE_SHIFT])
+        memset(file->pages[len >> MEMFS_PAGE_SHIFT] + tail, 0, MEMFS_PAGE_SIZE - tail);
+}
+
 static status_t memfs_mount(struct bdev *dev, fscookie **cookie)
 {
     LTRACEF("dev %p, cookie %p\n", dev, cookie);
@@ -80,6 +132,8 @@ static status_t memfs_mount(struct bdev *dev, fscookie **cookie)
         return ERR_NO_MEMORY;
 
     list_initialize(&mem->files);
+    for (uint i = 0; i < MEMFS_HASH_SIZE; i++)
+        list_initialize(&mem->hash[i]);
     list_initialize(&mem->dcookies);
     mutex_init(&mem->lock);
 
@@ -90,7 +144,9 @@ static status_t memfs_mount(struct bdev *dev, fscookie **cookie)
 
 static void free_file(memfs_file_t *file)
 {
-    free(file->ptr);
+    for (size_t i = 0; i < file->page_max; i++)
+        free(file->pages[i]);
+    free(file->pages);
     free(file->name);
     free(file);
 }
@@ -143,17 +199,16 @@ static status_t memfs_create(fscookie *cookie, const char *name, filecookie **fc
     }
 
     // allocate a new file
-    memfs_file_t *file = malloc(sizeof(*file));
+    memfs_file_t *file = calloc(1, sizeof(*file));
     if (!file) {
         err = ERR_NO_MEMORY;
         goto out;
     }
 
-    // allocate the space for it
-    file->ptr = calloc(1, len);
-    if (!file->ptr) {
+    // make room to track its pages, which start out as holes
+    err = grow_pages(file, len);
+    if (err < 0) {
         free(file);
-        err = ERR_NO_MEMORY;
         goto out;
     }
     file->len = len;
@@ -163,6 +218,7 @@ static status_t memfs_create(fscookie *cookie, const char *name, filecookie **fc
     file->fs = mem;
 
     list_add_tail(&mem->files, &file->node);
+    list_add_head(&mem->hash[hash_name(file->name)], &file->hash_node);
 
     *fcookie = (filecookie *)file;
 
@@ -206,8 +262,10 @@ static status_t memfs_remove(fscookie *cookie, const char *name)
 
     mutex_acquire(&mem->lock);
     memfs_file_t *file = find_file(mem, name);
-    if (file)
+    if (file) {
         list_delete(&file->node);
+        list_delete(&file->hash_node);
+    }
     mutex_release(&mem->lock);
 
     if (!file)
@@ -245,8 +303,24 @@ static ssize_t memfs_read(filecookie *fcookie, void *buf, off_t off, size_t len)
         len = file->len - off;
     }
 
-    // copy that floppy
-    memcpy(buf, file->ptr + off, len);
+    // copy that floppy, a page at a time
+    uint8_t *dst = buf;
+    size_t pos = off;
+    size_t remaining = len;
+    while (remaining > 0) {
+        size_t page_off = pos & (MEMFS_PAGE_SIZE - 1);
+        size_t tocopy = MIN(remaining, MEMFS_PAGE_SIZE - page_off);
+        uint8_t *page = file->pages[pos >> MEMFS_PAGE_SHIFT];
+
+        if (page)
+            memcpy(dst, page + page_off, tocopy);
+        else
+            memset(dst, 0, tocopy);
+
+        dst += tocopy;
+        pos += tocopy;
+        remaining -= tocopy;
+    }
 
     mutex_release(&file->fs->lock);
 
@@ -269,17 +343,8 @@ static status_t memfs_truncate(filecookie *fcookie, uint64_t len)
         goto finish;
     }
 
-    // NOTE: Don't allow allocations smaller than 1b. Although realloc(..., 0)
-    // is okay, it may yield an invalid pointer (likely NULL) which might be
-    // dereferenced elsewhere.
-    void *ptr = realloc(file->ptr, len == 0 ? 1 : len);
-    if (unlikely(ptr == NULL)) {
-        rc = ERR_NO_MEMORY;
-        goto finish;
-    }
-
+    trim_pages(file, len);
     file->len = len;
-    file->ptr = ptr;
 
 finish:
     mutex_release(&file->fs->lock);
@@ -297,23 +362,68 @@ static ssize_t memfs_write(filecookie *fcookie, const void *buf, off_t off, size
 
     mutex_acquire(&file->fs->lock);
 
-    // see if this write will extend the file
-    if (off + len > file->len) {
-        void *ptr = realloc(file->ptr, off + len);
-        if (!ptr) {
-            mutex_release(&file->fs->lock);
-            return ERR_NO_MEMORY;
+    // see if this write will extend the file, only the page list has to grow
+    if (grow_pages(file, off + len) < 0) {
+        mutex_release(&file->fs->lock);
+        return ERR_NO_MEMORY;
+    }
+
+    const uint8_t *src = buf;
+    size_t pos = off;
+    size_t remaining = len;
+    while (remaining > 0) {
+        size_t page_off = pos & (MEMFS_PAGE_SIZE - 1);
+        size_t tocopy = MIN(remaining, MEMFS_PAGE_SIZE - page_off);
+        uint8_t **page = &file->pages[pos >> MEMFS_PAGE_SHIFT];
+
+        if (!*page) {
+            *page = calloc(1, MEMFS_PAGE_SIZE);
+            if (!*page)
+                break;
         }
+        memcpy(*page + page_off, src, tocopy);
 
-        file->ptr = ptr;
-        file->len = off + len;
+        src += tocopy;
+        pos += tocopy;
+        remaining -= tocopy;
     }
 
-    memcpy(file->ptr + off, buf, len);
+    // a short write still extends the file as far as it got
+    size_t written = len - remaining;
+    if (off + written > file->len)
+        file->len = off + written;
 
     mutex_release(&file->fs->lock);
 
-    return len;
+    if (written == 0 && len > 0)
+        return ERR_NO_MEMORY;
+
+    return written;
+}
+
+static status_t memfs_map(filecookie *fcookie, off_t off, size_t len, const void **ptr)
+{
+    LTRACEF("filecookie %p offset %lld len %zu\n", fcookie, off, len);
+
+    memfs_file_t *file = (memfs_file_t *)fcookie;
+    status_t err = NO_ERROR;
+
+    mutex_acquire(&file->fs->lock);
+
+    // only ranges within a single page can be handed out in place, and the
+    // pointer goes stale if the file is truncated
+    uint8_t *page = NULL;
+    if (off + len > file->len)
+        err = ERR_OUT_OF_RANGE;
+    else if ((off >> MEMFS_PAGE_SHIFT) != ((off + len - 1) >> MEMFS_PAGE_SHIFT) ||
+             !(page = file->pages[off >> MEMFS_PAGE_SHIFT]))
+        err = ERR_NOT_SUPPORTED;
+    else
+        *ptr = page + (off & (MEMFS_PAGE_SIZE - 1));
+
+    mutex_release(&file->fs->lock);
+
+    return err;
 }
 
 static status_t memfs_stat(filecookie *fcookie, struct file_stat *stat)
@@ -417,6 +527,7 @@ static const struct fs_api memfs_api = {
     .write = memfs_write,
 
     .stat = memfs_stat,
+    .map = memfs_map,
 
 #if 0
     status_t (*mkdir)(fscookie *, const char *);
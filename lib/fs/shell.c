@@ -28,6 +28,7 @@
 #include <trace.h>
 #include <stdlib.h>
 #include <platform.h>
+#include <lib/arena.h>
 #include <lib/console.h>
 #include <lib/fs.h>
 
@@ -60,6 +61,14 @@ static const char *get_cwd(void)
     return cwd;
 }
 
+/* path buffers come from the console's scratch arena and go away with the command */
+static char *alloc_path(void)
+{
+    arena_t *scratch = arena_scratch();
+
+    return scratch ? arena_alloc(scratch, FS_MAX_PATH_LEN) : NULL;
+}
+
 static char *prepend_cwd(char *path, size_t len, const char *arg)
 {
     path[0] = '\0';
@@ -81,7 +90,9 @@ static int cmd_ls(int argc, const cmd_args *argv)
     status_t status = NO_ERROR;
 
     // construct the path
-    char *path = malloc(FS_MAX_PATH_LEN);
+    char *path = alloc_path();
+    if (!path)
+        return ERR_NO_MEMORY;
     prepend_cwd(path, FS_MAX_PATH_LEN, (argc >= 2) ? argv[1].str : NULL);
 
     dirhandle *dhandle;
@@ -127,7 +138,6 @@ static int cmd_ls(int argc, const cmd_args *argv)
     fs_close_dir(dhandle);
 
 err:
-    free(path);
     return status;;
 }
 
@@ -136,7 +146,9 @@ static int cmd_cd(int argc, const cmd_args *argv)
     if (argc < 2) {
         set_cwd(NULL);
     } else {
-        char *path = malloc(FS_MAX_PATH_LEN);
+        char *path = alloc_path();
+        if (!path)
+            return ERR_NO_MEMORY;
         prepend_cwd(path, FS_MAX_PATH_LEN, (argc >= 2) ? argv[1].str : NULL);
         fs_normalize_path(path);
 
@@ -145,7 +157,6 @@ static int cmd_cd(int argc, const cmd_args *argv)
         } else {
             set_cwd(path);
         }
-        free(path);
     }
     puts(get_cwd());
 
@@ -167,14 +178,15 @@ static int cmd_mkdir(int argc, const cmd_args *argv)
         return -1;
     }
 
-    char *path = malloc(FS_MAX_PATH_LEN);
+    char *path = alloc_path();
+    if (!path)
+        return ERR_NO_MEMORY;
 
     int status = fs_make_dir(prepend_cwd(path, FS_MAX_PATH_LEN, argv[1].str));
     if (status < 0) {
         printf("error %d making directory '%s'\n", status, path);
     }
 
-    free(path);
     return status;
 }
 
@@ -186,7 +198,9 @@ static int cmd_mkfile(int argc, const cmd_args *argv)
         return -1;
     }
 
-    char *path = malloc(FS_MAX_PATH_LEN);
+    char *path = alloc_path();
+    if (!path)
+        return ERR_NO_MEMORY;
     prepend_cwd(path, FS_MAX_PATH_LEN, argv[1].str);
 
     filehandle *handle;
@@ -199,7 +213,6 @@ static int cmd_mkfile(int argc, const cmd_args *argv)
     fs_close_file(handle);
 
 err:
-    free(path);
     return status;
 }
 
@@ -211,7 +224,9 @@ static int cmd_rm(int argc, const cmd_args *argv)
         return -1;
     }
 
-    char *path = malloc(FS_MAX_PATH_LEN);
+    char *path = alloc_path();
+    if (!path)
+        return ERR_NO_MEMORY;
     prepend_cwd(path, FS_MAX_PATH_LEN, argv[1].str);
 
     status_t err = fs_remove_file(path);
@@ -235,7 +250,9 @@ static int cmd_stat(int argc, const cmd_args *argv)
     struct file_stat stat;
     filehandle *handle;
 
-    char *path = malloc(FS_MAX_PATH_LEN);
+    char *path = alloc_path();
+    if (!path)
+        return ERR_NO_MEMORY;
     prepend_cwd(path, FS_MAX_PATH_LEN, argv[1].str);
 
     status = fs_open_file(path, &handle);
@@ -259,7 +276,6 @@ static int cmd_stat(int argc, const cmd_args *argv)
 
 
 err:
-    free(path);
     return status;
 }
 
@@ -273,7 +289,9 @@ static int cmd_cat(int argc, const cmd_args *argv)
         return -1;
     }
 
-    char *path = malloc(FS_MAX_PATH_LEN);
+    char *path = alloc_path();
+    if (!path)
+        return ERR_NO_MEMORY;
     prepend_cwd(path, FS_MAX_PATH_LEN, argv[1].str);
 
     filehandle *handle;
@@ -297,7 +315,6 @@ static int cmd_cat(int argc, const cmd_args *argv)
     fs_close_file(handle);
 
 err:
-    free(path);
     return status;
 }
 
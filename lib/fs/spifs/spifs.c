@@ -42,12 +42,20 @@
 #define LOCAL_TRACE 0
 
 #define FS_VERSION 1
+#define FS_VERSION_JOURNAL 2  // Same ToC layout, plus a metadata journal
 #define FS_MAGIC 0x53504653  // SPFS
+#define JOURNAL_MAGIC 0x53504a4e  // SPJN
+
+#define JOURNAL_OP_SET 1     // Create or update a file's entry
+#define JOURNAL_OP_REMOVE 2  // Remove a file's entry
+
+#define SPIFS_HASH_SIZE 32
 
 #define SPIFS_ENTRY_LENGTH 32
 
-#define TOC_HEADER_RESERVED_BYTES 16
+#define TOC_HEADER_RESERVED_BYTES 12
 #define TOC_FOOTER_RESERVED_BYTES 28
+#define JOURNAL_HEADER_RESERVED_BYTES 12
 #define MAX_FILENAME_LENGTH 20
 
 #define CORRUPT_TOC 0
@@ -61,6 +69,12 @@
 
 typedef int32_t toc_position_t;
 
+// A run of unallocated pages.
+typedef struct {
+    uint32_t page_idx;
+    uint32_t page_count;
+} spifs_extent_t;
+
 typedef struct {
     uint8_t *page;
     uint32_t page_size;
@@ -74,6 +88,20 @@ typedef struct {
     struct list_node files;
     struct list_node dcookies;
 
+    // Files by name, not including the ToC entries.
+    struct list_node hash[SPIFS_HASH_SIZE];
+
+    // Free space, sorted by page and coalesced. Every run but the last is
+    // followed by a file, so there can't be more than num_entries of them.
+    spifs_extent_t *free_runs;
+    uint32_t free_count;
+
+    // Metadata journal, replayed on top of the ToC of the same generation.
+    uint32_t journal_page;
+    uint32_t journal_pages;
+    uint32_t journal_next;   // Next record slot.
+    bool journal_dirty;      // Holds stale records, erase before appending.
+
     bdev_t *dev;
 
     mutex_t lock;
@@ -84,6 +112,7 @@ typedef struct {
     uint32_t version;
     uint32_t num_entries;
     uint32_t generation;
+    uint32_t journal_pages;
 
     uint8_t _reserved[TOC_HEADER_RESERVED_BYTES];
 } toc_header_t;
@@ -100,8 +129,24 @@ typedef struct {
     uint32_t checksum;
 } toc_footer_t;
 
+typedef struct {
+    uint32_t magic;
+    uint32_t generation;  // Generation of the ToC this applies on top of.
+    uint32_t sequence;    // Slot number, so stale records are never picked up.
+    uint32_t op;
+
+    uint8_t _reserved[JOURNAL_HEADER_RESERVED_BYTES];
+    uint32_t checksum;    // Over the rest of the header and the entry.
+} journal_header_t;
+
+typedef struct {
+    journal_header_t header;
+    toc_file_t entry;
+} journal_record_t;
+
 typedef struct {
     struct list_node node;
+    struct list_node hash_node;
     spifs_t *fs_handle;
     toc_file_t metadata;
 } spifs_file_t;
@@ -185,17 +230,28 @@ static status_t cursor_advance(cursor_t *cursor)
     return NO_ERROR;
 }
 
+static uint32_t hash_name(const char *name)
+{
+    uint32_t hash = 0;
+    for (size_t i = 0; i < MAX_FILENAME_LENGTH && name[i]; i++) {
+        hash = hash * 31 + (uint8_t)name[i];
+    }
+
+    return hash % SPIFS_HASH_SIZE;
+}
+
+static void hash_add(spifs_t *spifs, spifs_file_t *file)
+{
+    list_add_head(&spifs->hash[hash_name(file->metadata.filename)],
+                  &file->hash_node);
+}
+
 static spifs_file_t *find_file(spifs_t *spifs, const char *name)
 {
     spifs_file_t *file;
 
-    list_for_every_entry(&spifs->files, file, spifs_file_t, node) {
-        // Skip the ToC Entries
-        if (file == list_peek_head_type(&spifs->files, spifs_file_t, node) ||
-                file == list_peek_tail_type(&spifs->files, spifs_file_t, node)) {
-            continue;
-        }
-
+    list_for_every_entry(&spifs->hash[hash_name(name)], file, spifs_file_t,
+                         hash_node) {
         if (!strncmp(name, file->metadata.filename, MAX_FILENAME_LENGTH)) {
             return file;
         }
@@ -204,37 +260,106 @@ static spifs_file_t *find_file(spifs_t *spifs, const char *name)
     return NULL;
 }
 
-static uint32_t find_open_run(spifs_t *spifs, uint32_t requested_length)
+static uint32_t file_pages(spifs_t *spifs, spifs_file_t *file)
 {
-    spifs_file_t *file;
-    list_for_every_entry(&spifs->files, file, spifs_file_t, node) {
-        // Number of pages that this file occupies
-        uint32_t page_size_shift = log2_uint(file->fs_handle->page_size);
-
-        uint32_t file_page_length =
-            divpow2(file->metadata.capacity, page_size_shift);
+    return divpow2(file->metadata.capacity, log2_uint(spifs->page_size));
+}
 
-        // Index of the page immediately following the last page of this file.
-        uint32_t file_end_page = file->metadata.page_idx + file_page_length;
+// Work out the free runs from the gaps between files.
+static void build_free_runs(spifs_t *spifs)
+{
+    spifs->free_count = 0;
 
-        // Determine the page that the next file starts at.
+    spifs_file_t *file;
+    list_for_every_entry(&spifs->files, file, spifs_file_t, node) {
         spifs_file_t *next =
             list_next_type(&spifs->files, &file->node, spifs_file_t, node);
 
         // End of list?
         if (next == NULL) {
-            return NO_OPEN_RUNS;
+            break;
+        }
+
+        uint32_t file_end_page = file->metadata.page_idx + file_pages(spifs, file);
+        if (next->metadata.page_idx > file_end_page) {
+            DEBUG_ASSERT(spifs->free_count < spifs->num_entries);
+
+            spifs_extent_t *run = &spifs->free_runs[spifs->free_count++];
+            run->page_idx = file_end_page;
+            run->page_count = next->metadata.page_idx - file_end_page;
+        }
+    }
+}
+
+// Take the lowest free run that's big enough.
+static uint32_t alloc_run(spifs_t *spifs, uint32_t requested_length)
+{
+    uint32_t pages = divpow2(requested_length, log2_uint(spifs->page_size));
+
+    for (uint32_t i = 0; i < spifs->free_count; i++) {
+        spifs_extent_t *run = &spifs->free_runs[i];
+        if (run->page_count < pages) {
+            continue;
         }
 
-        uint32_t available_pages = next->metadata.page_idx - file_end_page;
-        uint32_t available_bytes = available_pages * file->fs_handle->page_size;
-        if (available_bytes >= requested_length) {
-            return file_end_page;
+        uint32_t page_idx = run->page_idx;
+        run->page_idx += pages;
+        run->page_count -= pages;
+
+        if (run->page_count == 0) {
+            memmove(run, run + 1,
+                    (spifs->free_count - i - 1) * sizeof(spifs_extent_t));
+            spifs->free_count--;
         }
+
+        return page_idx;
     }
+
     return NO_OPEN_RUNS;
 }
 
+// Return a file's pages to the free runs, merging with its neighbours.
+static void free_run(spifs_t *spifs, uint32_t page_idx, uint32_t pages)
+{
+    // Find the first run past this one.
+    uint32_t lo = 0;
+    uint32_t hi = spifs->free_count;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (spifs->free_runs[mid].page_idx < page_idx) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    spifs_extent_t *prev = lo > 0 ? &spifs->free_runs[lo - 1] : NULL;
+    spifs_extent_t *next = lo < spifs->free_count ? &spifs->free_runs[lo] : NULL;
+
+    bool merge_prev = prev && prev->page_idx + prev->page_count == page_idx;
+    bool merge_next = next && page_idx + pages == next->page_idx;
+
+    if (merge_prev && merge_next) {
+        prev->page_count += pages + next->page_count;
+        memmove(next, next + 1,
+                (spifs->free_count - lo - 1) * sizeof(spifs_extent_t));
+        spifs->free_count--;
+    } else if (merge_prev) {
+        prev->page_count += pages;
+    } else if (merge_next) {
+        next->page_idx = page_idx;
+        next->page_count += pages;
+    } else {
+        DEBUG_ASSERT(spifs->free_count < spifs->num_entries);
+
+        memmove(&spifs->free_runs[lo + 1], &spifs->free_runs[lo],
+                (spifs->free_count - lo) * sizeof(spifs_extent_t));
+        spifs->free_runs[lo].page_idx = page_idx;
+        spifs->free_runs[lo].page_count = pages;
+        spifs->free_count++;
+    }
+}
+
 static uint64_t used_space(spifs_t *spifs)
 {
     uint64_t result = 0;
@@ -294,10 +419,11 @@ static status_t spifs_commit_toc(spifs_t *spifs)
 
     // Setup the ToC Header.
     toc_header_t header = {
-        .magic       = FS_MAGIC,
-        .version     = FS_VERSION,
-        .num_entries = spifs->num_entries,
-        .generation  = target_generation,
+        .magic         = FS_MAGIC,
+        .version       = spifs->journal_pages ? FS_VERSION_JOURNAL : FS_VERSION,
+        .num_entries   = spifs->num_entries,
+        .generation    = target_generation,
+        .journal_pages = spifs->journal_pages,
     };
     memset(header._reserved, 0, TOC_HEADER_RESERVED_BYTES);
 
@@ -358,6 +484,149 @@ static status_t spifs_commit_toc(spifs_t *spifs)
     spifs->generation = target_generation;
     spifs->toc_position = target_toc;
 
+    // Everything journaled so far is in this ToC now. The old records belong
+    // to the previous generation so they're ignored from here on, but the
+    // space has to be erased before it can be appended to again.
+    if (spifs->journal_pages) {
+        size_t journal_len = spifs->journal_pages * spifs->page_size;
+        ssize_t bytes = bio_erase(spifs->dev,
+                                  spifs->journal_page * spifs->page_size,
+                                  journal_len);
+
+        spifs->journal_next = 0;
+        spifs->journal_dirty = (bytes != (ssize_t)journal_len);
+    }
+
+    return NO_ERROR;
+}
+
+static uint32_t journal_checksum(const journal_record_t *record)
+{
+    uint32_t crc = crc32(0, (const uint8_t *)&record->header,
+                         offsetof(journal_header_t, checksum));
+    return crc32(crc, (const uint8_t *)&record->entry, SPIFS_ENTRY_LENGTH);
+}
+
+static off_t journal_offset(spifs_t *spifs, uint32_t slot)
+{
+    return (off_t)spifs->journal_page * spifs->page_size +
+           slot * sizeof(journal_record_t);
+}
+
+static uint32_t journal_slots(spifs_t *spifs)
+{
+    return spifs->journal_pages * spifs->page_size / sizeof(journal_record_t);
+}
+
+// Record a change to a file's ToC entry. This appends to the journal where
+// there is one with room left, and rewrites the whole ToC otherwise.
+static status_t spifs_update_toc(spifs_t *spifs, uint32_t op, const toc_file_t *entry)
+{
+    if (!spifs->journal_pages || spifs->journal_dirty ||
+            spifs->journal_next >= journal_slots(spifs)) {
+        return spifs_commit_toc(spifs);
+    }
+
+    journal_record_t record;
+    memset(&record, 0, sizeof(record));
+    record.header.magic = JOURNAL_MAGIC;
+    record.header.generation = spifs->generation;
+    record.header.sequence = spifs->journal_next;
+    record.header.op = op;
+    memcpy(&record.entry, entry, SPIFS_ENTRY_LENGTH);
+    record.header.checksum = journal_checksum(&record);
+
+    ssize_t bytes = bio_write(spifs->dev, &record,
+                              journal_offset(spifs, spifs->journal_next),
+                              sizeof(record));
+    if (bytes != sizeof(record)) {
+        // Whatever made it out is garbage; get everything into a fresh ToC.
+        spifs->journal_dirty = true;
+        return spifs_commit_toc(spifs);
+    }
+
+    spifs->journal_next++;
+
+    return NO_ERROR;
+}
+
+static bool journal_slot_blank(spifs_t *spifs, const journal_record_t *record)
+{
+    const uint8_t *bytes = (const uint8_t *)record;
+    for (size_t i = 0; i < sizeof(*record); i++) {
+        if (bytes[i] != spifs->dev->erase_byte) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void spifs_add_ascending(spifs_t *spifs, spifs_file_t *target);
+
+// Apply the journal records made since the current ToC was written.
+static status_t spifs_replay_journal(spifs_t *spifs)
+{
+    uint32_t slot;
+    for (slot = 0; slot < journal_slots(spifs); slot++) {
+        journal_record_t record;
+        ssize_t bytes = bio_read(spifs->dev, &record,
+                                 journal_offset(spifs, slot), sizeof(record));
+        if (bytes != sizeof(record)) {
+            return ERR_IO;
+        }
+
+        if (record.header.magic != JOURNAL_MAGIC ||
+                record.header.generation != spifs->generation ||
+                record.header.sequence != slot ||
+                record.header.checksum != journal_checksum(&record)) {
+            // Anything but erased space is left over from an older
+            // generation, or a write that didn't finish.
+            spifs->journal_dirty = !journal_slot_blank(spifs, &record);
+            break;
+        }
+
+        spifs_file_t *file = find_file(spifs, record.entry.filename);
+
+        switch (record.header.op) {
+            case JOURNAL_OP_SET: {
+                if (file) {
+                    memcpy(&file->metadata, &record.entry, SPIFS_ENTRY_LENGTH);
+                    break;
+                }
+
+                if (list_length(&spifs->files) >= spifs->num_entries) {
+                    return ERR_BAD_STATE;
+                }
+
+                file = malloc(sizeof(*file));
+                if (!file) {
+                    return ERR_NO_MEMORY;
+                }
+
+                memcpy(&file->metadata, &record.entry, SPIFS_ENTRY_LENGTH);
+                file->fs_handle = spifs;
+
+                spifs_add_ascending(spifs, file);
+                hash_add(spifs, file);
+                break;
+            }
+            case JOURNAL_OP_REMOVE: {
+                if (file) {
+                    list_delete(&file->node);
+                    list_delete(&file->hash_node);
+                    free(file);
+                }
+                break;
+            }
+            default: {
+                return ERR_BAD_STATE;
+            }
+        }
+    }
+
+    spifs->journal_next = slot;
+
     return NO_ERROR;
 }
 
@@ -437,7 +706,7 @@ static uint32_t get_toc_generation(spifs_t *spifs, toc_position_t toc_pos)
         return CORRUPT_TOC;
     }
 
-    if (header->version != FS_VERSION) {
+    if (header->version != FS_VERSION && header->version != FS_VERSION_JOURNAL) {
         return CORRUPT_TOC;
     }
 
@@ -526,6 +795,7 @@ static status_t spifs_format(bdev_t *dev, const void *args)
     STATIC_ASSERT(sizeof(toc_header_t) == SPIFS_ENTRY_LENGTH);
     STATIC_ASSERT(sizeof(toc_file_t) == SPIFS_ENTRY_LENGTH);
     STATIC_ASSERT(sizeof(toc_footer_t) == SPIFS_ENTRY_LENGTH);
+    STATIC_ASSERT(sizeof(journal_header_t) == SPIFS_ENTRY_LENGTH);
 
     uint32_t page_size;
     uint32_t page_count;
@@ -558,6 +828,11 @@ static status_t spifs_format(bdev_t *dev, const void *args)
         return ERR_TOO_BIG;
     }
 
+    // Both ToCs, the journal and at least one page for files.
+    if (2 * spifs_args->toc_pages + spifs_args->journal_pages >= page_count) {
+        return ERR_TOO_BIG;
+    }
+
     // Create a mock spifs_t for the purposes of formatting the fs.
     spifs_t spifs = {
         .page_size = page_size,
@@ -566,6 +841,8 @@ static status_t spifs_format(bdev_t *dev, const void *args)
         .generation = 1,
         .num_entries = num_toc_entries,
         .toc_position = FRONT_TOC,
+        .journal_page = spifs_args->toc_pages,
+        .journal_pages = spifs_args->journal_pages,
         .dev = dev,
     };
     spifs.page = memalign(CACHE_LINE, page_size);
@@ -573,10 +850,14 @@ static status_t spifs_format(bdev_t *dev, const void *args)
     list_initialize(&spifs.dcookies);
     mutex_init(&spifs.lock);
 
+    // The journal sits right after the front ToC, and is accounted for as
+    // part of it.
+    uint32_t front_pages = spifs_args->toc_pages + spifs_args->journal_pages;
+
     spifs_file_t f_toc;
     f_toc.metadata.page_idx = 0;
-    f_toc.metadata.length = spifs_args->toc_pages * page_size;
-    f_toc.metadata.capacity = spifs_args->toc_pages * page_size;
+    f_toc.metadata.length = front_pages * page_size;
+    f_toc.metadata.capacity = front_pages * page_size;
     f_toc.fs_handle = &spifs;
     memset(f_toc.metadata.filename, 0, MAX_FILENAME_LENGTH);
     strlcpy(f_toc.metadata.filename, FRONT_TOC_LABEL, MAX_FILENAME_LENGTH);
@@ -614,7 +895,7 @@ static status_t spifs_mount(bdev_t *dev, fscookie **cookie)
 
     LTRACEF("dev %p, cookie %p\n", dev, cookie);
 
-    spifs_t *spifs = malloc(sizeof(*spifs));
+    spifs_t *spifs = calloc(1, sizeof(*spifs));
     if (!spifs) {
         return ERR_NO_MEMORY;
     }
@@ -637,6 +918,9 @@ static status_t spifs_mount(bdev_t *dev, fscookie **cookie)
 
     list_initialize(&spifs->files);
     list_initialize(&spifs->dcookies);
+    for (size_t i = 0; i < SPIFS_HASH_SIZE; i++) {
+        list_initialize(&spifs->hash[i]);
+    }
     mutex_init(&spifs->lock);
 
     // Determine which of the two Table of Contents we should use.
@@ -664,8 +948,22 @@ static status_t spifs_mount(bdev_t *dev, fscookie **cookie)
 
     toc_header_t *header = (toc_header_t *)cursor_get(&cursor);
     spifs->num_entries = header->num_entries;
+    if (header->version == FS_VERSION_JOURNAL) {
+        spifs->journal_pages = header->journal_pages;
+    }
     header = NULL;
 
+    // The ToC proper is as many pages as its entries take up, the journal
+    // follows it.
+    spifs->journal_page =
+        ((spifs->num_entries + 2) * SPIFS_ENTRY_LENGTH) / spifs->page_size;
+
+    spifs->free_runs = malloc(spifs->num_entries * sizeof(spifs_extent_t));
+    if (!spifs->free_runs) {
+        status = ERR_NO_MEMORY;
+        goto err;
+    }
+
     // Create in-memory versions of metadata for files.
     spifs_file_t *file;
     for (size_t i = 0; i < spifs->num_entries; i++) {
@@ -691,11 +989,27 @@ static status_t spifs_mount(bdev_t *dev, fscookie **cookie)
         list_add_tail(&spifs->files, &file->node);
     }
 
+    // Index everything but the ToC entries at either end.
+    list_for_every_entry(&spifs->files, file, spifs_file_t, node) {
+        if (file != list_peek_head_type(&spifs->files, spifs_file_t, node) &&
+                file != list_peek_tail_type(&spifs->files, spifs_file_t, node)) {
+            hash_add(spifs, file);
+        }
+    }
+
+    if (spifs->journal_pages) {
+        status = spifs_replay_journal(spifs);
+        if (status != NO_ERROR)
+            goto err;
+    }
+
     if (!consistency_check(spifs)) {
         status = ERR_BAD_STATE;
         goto err;
     }
 
+    build_free_runs(spifs);
+
     *cookie = (fscookie *)spifs;
 
     return NO_ERROR;
@@ -705,6 +1019,7 @@ err:
         free(file);
     }
 
+    free(spifs->free_runs);
     free(spifs->page);
     free(spifs);
     return status;
@@ -723,6 +1038,7 @@ static status_t spifs_unmount(fscookie *cookie)
         free(file);
     }
 
+    free(spifs->free_runs);
     free(spifs->page);
 
     mutex_release(&spifs->lock);
@@ -777,7 +1093,7 @@ static status_t spifs_create(fscookie *cookie, const char *name, filecookie **fc
         capacity = ROUNDUP(len, spifs->page_size);
     }
 
-    uint32_t open_run = find_open_run(spifs, capacity);
+    uint32_t open_run = alloc_run(spifs, capacity);
     if (open_run == NO_OPEN_RUNS) {
         status = ERR_TOO_BIG;
         goto err;
@@ -785,6 +1101,7 @@ static status_t spifs_create(fscookie *cookie, const char *name, filecookie **fc
 
     spifs_file_t *file = malloc(sizeof(*file));
     if (!file) {
+        free_run(spifs, open_run, capacity / spifs->page_size);
         status = ERR_NO_MEMORY;
         goto err;
     }
@@ -801,18 +1118,22 @@ static status_t spifs_create(fscookie *cookie, const char *name, filecookie **fc
             (ssize_t)capacity) {
 
         free(file);
+        free_run(spifs, open_run, capacity / spifs->page_size);
 
         status = ERR_IO;
         goto err;
     }
 
     spifs_add_ascending(spifs, file);
+    hash_add(spifs, file);
 
-    if (spifs_commit_toc(spifs) != NO_ERROR) {
+    if (spifs_update_toc(spifs, JOURNAL_OP_SET, &file->metadata) != NO_ERROR) {
         // If the commit fails, make sure we don't leave any residue of the file
         // lying around.
         list_delete(&file->node);
+        list_delete(&file->hash_node);
         free(file);
+        free_run(spifs, open_run, capacity / spifs->page_size);
         *fcookie = NULL;
 
         status = ERR_IO;
@@ -889,10 +1210,15 @@ static status_t spifs_remove(fscookie *cookie, const char *name)
         }
     }
 
+    toc_file_t entry;
+    memcpy(&entry, &file->metadata, SPIFS_ENTRY_LENGTH);
+
     list_delete(&file->node);
+    list_delete(&file->hash_node);
+    free_run(spifs, file->metadata.page_idx, file_pages(spifs, file));
     free(file);
 
-    status = spifs_commit_toc(spifs);
+    status = spifs_update_toc(spifs, JOURNAL_OP_REMOVE, &entry);
 
 err:
     mutex_release(&spifs->lock);
@@ -1028,7 +1354,7 @@ static ssize_t spifs_write(filecookie *fcookie, const void *buf, off_t off, size
     }
 
     if (dirty_toc) {
-        err = spifs_commit_toc(spifs);
+        err = spifs_update_toc(spifs, JOURNAL_OP_SET, &file->metadata);
     }
 
 err:
@@ -1056,7 +1382,7 @@ static status_t spifs_truncate(filecookie *fcookie, uint64_t len)
 
     file->metadata.length = len;
 
-    rc = spifs_commit_toc(spifs);
+    rc = spifs_update_toc(spifs, JOURNAL_OP_SET, &file->metadata);
 
 finish:
     mutex_release(&file->fs_handle->lock);
@@ -1218,6 +1544,30 @@ static status_t spifs_ioctl_is_linear(filecookie *cookie, void **argp)
     return NO_ERROR;
 }
 
+static status_t spifs_map(filecookie *cookie, off_t offset, size_t len, const void **ptr)
+{
+    LTRACEF("cookie %p, offset %lld, len %zu\n", cookie, offset, len);
+
+    spifs_file_t *file = (spifs_file_t *)cookie;
+
+    if (offset + len > file->metadata.length)
+        return ERR_OUT_OF_RANGE;
+
+    // only files on a memory mapped device can be used in place
+    bool linear;
+    if (spifs_ioctl_is_linear(cookie, (void **)&linear) != NO_ERROR || !linear)
+        return ERR_NOT_SUPPORTED;
+
+    void *addr;
+    status_t result = spifs_ioctl_get_file_addr(cookie, &addr);
+    if (result != NO_ERROR)
+        return ERR_NOT_SUPPORTED;
+
+    *ptr = (uint8_t *)addr + offset;
+
+    return NO_ERROR;
+}
+
 static status_t spifs_file_ioctl(filecookie *cookie, int request, void *argp)
 {
     LTRACEF("request %d, argp %p\n", request, argp);
@@ -1255,6 +1605,7 @@ static const struct fs_api spifs_api = {
     .stat = spifs_stat,
 
     .file_ioctl = spifs_file_ioctl,
+    .map = spifs_map,
 
     .opendir = spifs_opendir,
     .readdir = spifs_readdir,
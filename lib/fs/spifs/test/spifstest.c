@@ -44,6 +44,7 @@ typedef struct {
     test_func func;
     const char *name;
     uint32_t toc_pages;
+    uint32_t journal_pages;
 } test;
 
 static bool test_empty_after_format(const char *);
@@ -59,6 +60,8 @@ static bool test_write_with_offset(const char *);
 static bool test_read_write_big(const char *);
 static bool test_rm_active_dirent(const char *);
 static bool test_truncate_file(const char *);
+static bool test_journal_remount(const char *);
+static bool test_journal_wrap(const char *);
 
 static test tests[] = {
     {&test_empty_after_format, "Test no files in ToC after format.", 1},
@@ -74,12 +77,15 @@ static test tests[] = {
     {&test_read_write_big, "Test that an unaligned ~10kb buffer can be written and read.", 1},
     {&test_rm_active_dirent, "Test that we can remove a file with an open dirent.", 1},
     {&test_truncate_file, "Test that we can truncate a file.", 1},
+    {&test_journal_remount, "Test that journaled ToC updates survive a remount.", 1, 1},
+    {&test_journal_wrap, "Test that a full journal is folded back into the ToC.", 1, 1},
 };
 
-bool test_setup(const char *dev_name, uint32_t toc_pages)
+bool test_setup(const char *dev_name, uint32_t toc_pages, uint32_t journal_pages)
 {
     spifs_format_args_t args = {
         .toc_pages = toc_pages,
+        .journal_pages = journal_pages,
     };
 
     status_t res = fs_format_device(FS_NAME, dev_name, (void *)&args);
@@ -658,6 +664,96 @@ static bool test_truncate_file(const char *dev_name)
     return fs_close_file(handle) == NO_ERROR;
 }
 
+static bool file_size_is(const char *path, uint64_t size)
+{
+    filehandle *handle;
+    if (fs_open_file(path, &handle) != NO_ERROR) {
+        return false;
+    }
+
+    struct file_stat stat;
+    status_t status = fs_stat_file(handle, &stat);
+    fs_close_file(handle);
+
+    return status == NO_ERROR && stat.size == size;
+}
+
+static bool remount(const char *dev_name)
+{
+    return fs_unmount(MNT_PATH) == NO_ERROR &&
+           fs_mount(MNT_PATH, FS_NAME, dev_name) == NO_ERROR;
+}
+
+static bool test_journal_remount(const char *dev_name)
+{
+    filehandle *handle;
+
+    // Each of these is a journal record rather than a new ToC.
+    const char *paths[] = { MNT_PATH "/a", MNT_PATH "/b", MNT_PATH "/c" };
+    for (size_t i = 0; i < countof(paths); i++) {
+        if (fs_create_file(paths[i], &handle, 1024) != NO_ERROR) {
+            return false;
+        }
+        fs_close_file(handle);
+    }
+
+    if (fs_remove_file(paths[1]) != NO_ERROR) {
+        return false;
+    }
+
+    if (fs_open_file(paths[0], &handle) != NO_ERROR) {
+        return false;
+    }
+    status_t status = fs_truncate_file(handle, 100);
+    fs_close_file(handle);
+    if (status != NO_ERROR) {
+        return false;
+    }
+
+    // Everything has to come back from the journal.
+    if (!remount(dev_name)) {
+        return false;
+    }
+
+    if (!file_size_is(paths[0], 100) || !file_size_is(paths[2], 1024)) {
+        return false;
+    }
+
+    return fs_open_file(paths[1], &handle) == ERR_NOT_FOUND;
+}
+
+static bool test_journal_wrap(const char *dev_name)
+{
+    filehandle *handle;
+
+    if (fs_create_file(TEST_FILE_PATH, &handle, 512) != NO_ERROR) {
+        return false;
+    }
+    fs_close_file(handle);
+
+    // Enough updates to fill the journal several times over.
+    for (size_t i = 0; i < 200; i++) {
+        if (fs_create_file(MNT_PATH "/tmp", &handle, 0) != NO_ERROR) {
+            return false;
+        }
+        fs_close_file(handle);
+
+        if (fs_remove_file(MNT_PATH "/tmp") != NO_ERROR) {
+            return false;
+        }
+    }
+
+    if (!remount(dev_name)) {
+        return false;
+    }
+
+    if (!file_size_is(TEST_FILE_PATH, 512)) {
+        return false;
+    }
+
+    return fs_open_file(MNT_PATH "/tmp", &handle) == ERR_NOT_FOUND;
+}
+
 // Run the SPIFS test suite.
 static int spifs_test(int argc, const cmd_args *argv)
 {
@@ -678,7 +774,7 @@ static int spifs_test(int argc, const cmd_args *argv)
     size_t attempted = 0;
     for (size_t i = 0; i < countof(tests); i++) {
         ++attempted;
-        if (!test_setup(argv[2].str, tests[i].toc_pages)) {
+        if (!test_setup(argv[2].str, tests[i].toc_pages, tests[i].journal_pages)) {
             printf("Test Setup failed before %s. Exiting.\n", tests[i].name);
             break;
         }
@@ -35,6 +35,7 @@
 #include <debug.h>
 #include <trace.h>
 #include <string.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <arch/ops.h>
@@ -42,6 +43,8 @@
 #include <lib/gfx.h>
 #include <dev/display.h>
 
+#include "simd.h"
+
 #define LOCAL_TRACE 0
 
 // Convert a 32bit ARGB image to its respective gamma corrected grayscale value.
@@ -123,6 +126,7 @@ void gfx_copyrect(gfx_surface *surface, uint x, uint y, uint width, uint height,
         height = surface->height - y2;
 
     surface->copyrect(surface, x, y, width, height, x2, y2);
+    gfx_mark_dirty(surface, x2, y2, width, height);
 }
 
 /**
@@ -148,6 +152,7 @@ void gfx_fillrect(gfx_surface *surface, uint x, uint y, uint width, uint height,
         height = surface->height - y;
 
     surface->fillrect(surface, x, y, width, height, color);
+    gfx_mark_dirty(surface, x, y, width, height);
 }
 
 /**
@@ -161,6 +166,40 @@ void gfx_putpixel(gfx_surface *surface, uint x, uint y, uint color)
         return;
 
     surface->putpixel(surface, x, y, color);
+    gfx_mark_dirty(surface, x, y, 1, 1);
+}
+
+/**
+ * @brief  Write a row of ARGB8888 pixels to the screen, converting it to the surface format.
+ */
+void gfx_putrow(gfx_surface *surface, uint x, uint y, const uint32_t *pixels, uint count)
+{
+    if (unlikely(x >= surface->width))
+        return;
+    if (y >= surface->height)
+        return;
+    if (x + count > surface->width)
+        count = surface->width - x;
+
+    uint8_t *dest = (uint8_t *)surface->ptr + (x + y * surface->stride) * surface->pixelsize;
+    uint i = 0;
+
+    if (!surface->translate_color) {
+        // already in the surface's format
+        memcpy(dest, pixels, count * 4);
+    } else if (surface->format == GFX_FORMAT_RGB_565) {
+        uint16_t *dest16 = (uint16_t *)dest;
+        if (gfx_simd_usable())
+            i = gfx_simd_argb8888_to_rgb565(dest16, pixels, count);
+        for (; i < count; i++)
+            dest16[i] = surface->translate_color(pixels[i]);
+    } else {
+        DEBUG_ASSERT(surface->pixelsize == 1);
+        for (; i < count; i++)
+            dest[i] = surface->translate_color(pixels[i]);
+    }
+
+    gfx_mark_dirty(surface, x, y, count, 1);
 }
 
 static void putpixel16(gfx_surface *surface, uint x, uint y, uint color)
@@ -292,8 +331,37 @@ static void fillrect16(gfx_surface *surface, uint x, uint y, uint width, uint he
     }
 }
 
+static void copyrect32_simd(gfx_surface *surface, uint x, uint y, uint width, uint height, uint x2, uint y2)
+{
+    const uint32_t *src = &((const uint32_t *)surface->ptr)[x + y * surface->stride];
+    uint32_t *dest = &((uint32_t *)surface->ptr)[x2 + y2 * surface->stride];
+
+    if (y == y2) {
+        // rows overlap each other, let memmove sort out the direction
+        for (uint i = 0; i < height; i++)
+            memmove(dest + i * surface->stride, src + i * surface->stride, width * 4);
+        return;
+    }
+
+    // rows are copied forwards, walk them in whichever order doesn't overwrite the source
+    for (uint n = 0; n < height; n++) {
+        uint i = (dest < src) ? n : height - 1 - n;
+        uint32_t *d = dest + i * surface->stride;
+        const uint32_t *s = src + i * surface->stride;
+
+        uint j = gfx_simd_copy32(d, s, width);
+        for (; j < width; j++)
+            d[j] = s[j];
+    }
+}
+
 static void copyrect32(gfx_surface *surface, uint x, uint y, uint width, uint height, uint x2, uint y2)
 {
+    if (gfx_simd_usable()) {
+        copyrect32_simd(surface, x, y, width, height, x2, y2);
+        return;
+    }
+
     // copy
     const uint32_t *src = &((const uint32_t *)surface->ptr)[x + y * surface->stride];
     uint32_t *dest = &((uint32_t *)surface->ptr)[x2 + y2 * surface->stride];
@@ -332,10 +400,13 @@ static void fillrect32(gfx_surface *surface, uint x, uint y, uint width, uint he
 {
     uint32_t *dest = &((uint32_t *)surface->ptr)[x + y * surface->stride];
     uint stride_diff = surface->stride - width;
+    bool simd = gfx_simd_usable();
 
     uint i, j;
     for (i=0; i < height; i++) {
-        for (j=0; j < width; j++) {
+        j = simd ? gfx_simd_fill32(dest, color, width) : 0;
+        dest += j;
+        for (; j < width; j++) {
             *dest = color;
             dest++;
         }
@@ -370,6 +441,8 @@ void gfx_line(gfx_surface *surface, uint x1, uint y1, uint x2, uint y2, uint col
     uint px = x1;
     uint py = y1;
 
+    gfx_mark_dirty(surface, MIN(x1, x2), MIN(y1, y2), dxabs + 1, dyabs + 1);
+
     if (dxabs >= dyabs) {
         // mostly horizontal line.
         for (uint i = 0; i < dxabs; i++) {
@@ -435,11 +508,14 @@ uint32_t alpha32_add_ignore_destalpha(uint32_t dest, uint32_t src)
 /**
  * @brief  Copy pixels from source to dest.
  *
- * Currently does not support alpha channel.
+ * Currently does not support alpha channel. 32 bit sources are converted
+ * when the target is RGB565.
  */
 void gfx_surface_blend(struct gfx_surface *target, struct gfx_surface *source, uint destx, uint desty)
 {
-    DEBUG_ASSERT(target->format == source->format);
+    DEBUG_ASSERT(target->format == source->format ||
+                 (target->format == GFX_FORMAT_RGB_565 &&
+                  (source->format == GFX_FORMAT_ARGB_8888 || source->format == GFX_FORMAT_RGB_x888)));
 
     LTRACEF("target %p, source %p, destx %u, desty %u\n", target, source, destx, desty);
 
@@ -485,9 +561,13 @@ void gfx_surface_blend(struct gfx_surface *target, struct gfx_surface *source, u
 
         LTRACEF("w %u h %u dstride %u sstride %u\n", width, height, dest_stride_diff, source_stride_diff);
 
+        bool simd = gfx_simd_usable();
         uint i, j;
         for (i=0; i < height; i++) {
-            for (j=0; j < width; j++) {
+            j = simd ? gfx_simd_blend32(dest, src, width) : 0;
+            dest += j;
+            src += j;
+            for (; j < width; j++) {
                 // XXX ignores destination alpha
                 *dest = alpha32_add_ignore_destalpha(*dest, *src);
                 dest++;
@@ -505,9 +585,13 @@ void gfx_surface_blend(struct gfx_surface *target, struct gfx_surface *source, u
 
         LTRACEF("w %u h %u dstride %u sstride %u\n", width, height, dest_stride_diff, source_stride_diff);
 
+        bool simd = gfx_simd_usable();
         uint i, j;
         for (i=0; i < height; i++) {
-            for (j=0; j < width; j++) {
+            j = simd ? gfx_simd_copy32(dest, src, width) : 0;
+            dest += j;
+            src += j;
+            for (; j < width; j++) {
                 *dest = *src;
                 dest++;
                 src++;
@@ -515,6 +599,30 @@ void gfx_surface_blend(struct gfx_surface *target, struct gfx_surface *source, u
             dest += dest_stride_diff;
             src += source_stride_diff;
         }
+    } else if ((source->format == GFX_FORMAT_ARGB_8888 || source->format == GFX_FORMAT_RGB_x888) &&
+               target->format == GFX_FORMAT_RGB_565) {
+        // 32 bit onto 16 bit, converted rather than blended
+        const uint32_t *src = (const uint32_t *)source->ptr;
+        uint16_t *dest = &((uint16_t *)target->ptr)[destx + desty * target->stride];
+        uint dest_stride_diff = target->stride - width;
+        uint source_stride_diff = source->stride - width;
+
+        LTRACEF("w %u h %u dstride %u sstride %u\n", width, height, dest_stride_diff, source_stride_diff);
+
+        bool simd = gfx_simd_usable();
+        uint i, j;
+        for (i=0; i < height; i++) {
+            j = simd ? gfx_simd_argb8888_to_rgb565(dest, src, width) : 0;
+            dest += j;
+            src += j;
+            for (; j < width; j++) {
+                *dest = ARGB8888_to_RGB565(*src);
+                dest++;
+                src++;
+            }
+            dest += dest_stride_diff;
+            src += source_stride_diff;
+        }
     } else if (source->format == GFX_FORMAT_MONO && target->format == GFX_FORMAT_MONO) {
         // both are 8 bit modes, no alpha
         const uint8_t *src = (const uint8_t *)source->ptr;
@@ -537,13 +645,121 @@ void gfx_surface_blend(struct gfx_surface *target, struct gfx_surface *source, u
     } else {
         panic("gfx_surface_blend: unimplemented colorspace combination (source %d target %d)\n", source->format, target->format);
     }
+
+    gfx_mark_dirty(target, destx, desty, width, height);
+}
+
+static inline bool gfx_rects_touch(const gfx_rect *a, const gfx_rect *b)
+{
+    return a->x <= b->x + b->width && b->x <= a->x + a->width &&
+           a->y <= b->y + b->height && b->y <= a->y + a->height;
+}
+
+static void gfx_rect_union(gfx_rect *a, const gfx_rect *b)
+{
+    uint x2 = MAX(a->x + a->width, b->x + b->width);
+    uint y2 = MAX(a->y + a->height, b->y + b->height);
+
+    a->x = MIN(a->x, b->x);
+    a->y = MIN(a->y, b->y);
+    a->width = x2 - a->x;
+    a->height = y2 - a->y;
+}
+
+static size_t gfx_rect_union_area(const gfx_rect *a, const gfx_rect *b)
+{
+    gfx_rect u = *a;
+    gfx_rect_union(&u, b);
+    return (size_t)u.width * u.height;
+}
+
+/**
+ * @brief  Add a rectangle to the surface's damaged area.
+ *
+ * Rects that touch an existing one are merged into it. Once the list is full
+ * the new rect is merged into whichever existing rect grows the least.
+ */
+void gfx_mark_dirty(gfx_surface *surface, uint x, uint y, uint width, uint height)
+{
+    if (x >= surface->width || y >= surface->height)
+        return;
+    if (width == 0 || height == 0)
+        return;
+    if (x + width > surface->width)
+        width = surface->width - x;
+    if (y + height > surface->height)
+        height = surface->height - y;
+
+    gfx_rect r = { x, y, width, height };
+
+    for (uint i = 0; i < surface->dirty_count; i++) {
+        if (gfx_rects_touch(&surface->dirty[i], &r)) {
+            gfx_rect_union(&surface->dirty[i], &r);
+            return;
+        }
+    }
+
+    if (surface->dirty_count < GFX_MAX_DIRTY_RECTS) {
+        surface->dirty[surface->dirty_count++] = r;
+        return;
+    }
+
+    uint best = 0;
+    size_t best_growth = SIZE_MAX;
+    for (uint i = 0; i < surface->dirty_count; i++) {
+        size_t growth = gfx_rect_union_area(&surface->dirty[i], &r) -
+                        (size_t)surface->dirty[i].width * surface->dirty[i].height;
+        if (growth < best_growth) {
+            best = i;
+            best_growth = growth;
+        }
+    }
+    gfx_rect_union(&surface->dirty[best], &r);
+}
+
+/* clean the cache over a set of rects and hand them to the display */
+static void gfx_flush_rects(gfx_surface *surface, const gfx_rect *rects, uint count)
+{
+    struct arch_cache_range ranges[GFX_MAX_DIRTY_RECTS];
+    uint rowbytes = surface->stride * surface->pixelsize;
+    uint miny = UINT_MAX;
+    uint maxy = 0;
+
+    DEBUG_ASSERT(count <= GFX_MAX_DIRTY_RECTS);
+
+    for (uint i = 0; i < count; i++) {
+        const gfx_rect *r = &rects[i];
+
+        ranges[i].start = (addr_t)surface->ptr + r->y * rowbytes + r->x * surface->pixelsize;
+        ranges[i].len = (r->height - 1) * rowbytes + r->width * surface->pixelsize;
+
+        miny = MIN(miny, r->y);
+        maxy = MAX(maxy, r->y + r->height - 1);
+    }
+    arch_clean_cache_ranges(ranges, count);
+
+    if (surface->flush_rect) {
+        for (uint i = 0; i < count; i++)
+            surface->flush_rect(rects[i].x, rects[i].y, rects[i].width, rects[i].height);
+    } else if (surface->flush) {
+        surface->flush(miny, maxy);
+    }
 }
 
 /**
  * @brief  Ensure all graphics rendering is sent to display
+ *
+ * Only the areas drawn since the last flush are sent. If nothing was recorded
+ * the surface may have been written directly, so all of it is.
  */
 void gfx_flush(gfx_surface *surface)
 {
+    if (surface->dirty_count > 0) {
+        gfx_flush_rects(surface, surface->dirty, surface->dirty_count);
+        surface->dirty_count = 0;
+        return;
+    }
+
     arch_clean_cache_range((addr_t)surface->ptr, surface->len);
 
     if (surface->flush)
@@ -566,6 +782,33 @@ void gfx_flush_rows(struct gfx_surface *surface, uint start, uint end)
     if (end >= surface->height)
         end = surface->height - 1;
 
+    /* send just the damage within these rows, if we know where it is */
+    gfx_rect rects[GFX_MAX_DIRTY_RECTS];
+    uint count = 0;
+    uint remaining = 0;
+    for (uint i = 0; i < surface->dirty_count; i++) {
+        gfx_rect *r = &surface->dirty[i];
+
+        if (r->y > end || r->y + r->height - 1 < start) {
+            surface->dirty[remaining++] = *r;
+            continue;
+        }
+
+        uint y1 = MAX(r->y, start);
+        uint y2 = MIN(r->y + r->height - 1, end);
+        rects[count++] = (gfx_rect){ r->x, y1, r->width, y2 - y1 + 1 };
+
+        /* drop rects entirely covered by this flush */
+        if (r->y < start || r->y + r->height - 1 > end)
+            surface->dirty[remaining++] = *r;
+    }
+    surface->dirty_count = remaining;
+
+    if (count > 0) {
+        gfx_flush_rects(surface, rects, count);
+        return;
+    }
+
     uint32_t runlen = surface->stride * surface->pixelsize;
     arch_clean_cache_range((addr_t)surface->ptr + start * runlen, (end - start + 1) * runlen);
 
@@ -592,6 +835,9 @@ gfx_surface *gfx_create_surface(void *ptr, uint width, uint height, uint stride,
     surface->height = height;
     surface->stride = stride;
     surface->alpha = MAX_ALPHA;
+    surface->flush = NULL;
+    surface->flush_rect = NULL;
+    surface->dirty_count = 0;
 
     // set up some function pointers
     switch (format) {
@@ -690,6 +936,7 @@ gfx_surface *gfx_create_surface_from_display(struct display_framebuffer *fb)
     surface = gfx_create_surface(fb->image.pixels, fb->image.width, fb->image.height, fb->image.stride, format);
 
     surface->flush = fb->flush;
+    surface->flush_rect = fb->flush_rect;
 
     return surface;
 }
@@ -3,6 +3,7 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 MODULE := $(LOCAL_DIR)
 
 MODULE_SRCS += \
-	$(LOCAL_DIR)/gfx.c
+	$(LOCAL_DIR)/gfx.c \
+	$(LOCAL_DIR)/simd.c
 
 include make/module.mk
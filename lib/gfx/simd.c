@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * @file
+ * @brief  NEON and SSE2 inner loops for the graphics library
+ *
+ * These must produce exactly the same pixels as the C routines in gfx.c.
+ */
+
+#include "simd.h"
+
+#if GFX_WITH_SIMD
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+
+uint gfx_simd_fill32(uint32_t *dest, uint32_t color, uint count)
+{
+    uint32x4_t c = vdupq_n_u32(color);
+    uint i;
+
+    for (i = 0; i + 8 <= count; i += 8) {
+        vst1q_u32(dest + i, c);
+        vst1q_u32(dest + i + 4, c);
+    }
+    return i;
+}
+
+uint gfx_simd_copy32(uint32_t *dest, const uint32_t *src, uint count)
+{
+    uint i;
+
+    for (i = 0; i + 8 <= count; i += 8) {
+        uint32x4_t a = vld1q_u32(src + i);
+        uint32x4_t b = vld1q_u32(src + i + 4);
+        vst1q_u32(dest + i, a);
+        vst1q_u32(dest + i + 4, b);
+    }
+    return i;
+}
+
+static inline uint8x8_t blend_channel(uint8x8_t s, uint8x8_t d, uint8x8_t a, uint8x8_t ainv)
+{
+    return vadd_u8(vshrn_n_u16(vmull_u8(s, a), 8), vshrn_n_u16(vmull_u8(d, ainv), 8));
+}
+
+uint gfx_simd_blend32(uint32_t *dest, const uint32_t *src, uint count)
+{
+    uint i;
+
+    for (i = 0; i + 8 <= count; i += 8) {
+        /* deinterleaved into b, g, r, a */
+        uint8x8x4_t s = vld4_u8((const uint8_t *)(src + i));
+        uint8x8x4_t d = vld4_u8((uint8_t *)(dest + i));
+        uint8x8x4_t out;
+
+        /* same rounding as alpha32_add_ignore_destalpha */
+        uint8x8_t a = vadd_u8(s.val[3], vdup_n_u8(1));
+        uint8x8_t ainv = vmvn_u8(a);
+
+        out.val[0] = blend_channel(s.val[0], d.val[0], a, ainv);
+        out.val[1] = blend_channel(s.val[1], d.val[1], a, ainv);
+        out.val[2] = blend_channel(s.val[2], d.val[2], a, ainv);
+        out.val[3] = a;
+
+        /* fully transparent keeps dest, fully opaque takes src */
+        uint8x8_t transparent = vceq_u8(s.val[3], vdup_n_u8(0));
+        uint8x8_t opaque = vceq_u8(s.val[3], vdup_n_u8(255));
+        for (int c = 0; c < 4; c++) {
+            out.val[c] = vbsl_u8(transparent, d.val[c], out.val[c]);
+            out.val[c] = vbsl_u8(opaque, s.val[c], out.val[c]);
+        }
+
+        vst4_u8((uint8_t *)(dest + i), out);
+    }
+    return i;
+}
+
+uint gfx_simd_argb8888_to_rgb565(uint16_t *dest, const uint32_t *src, uint count)
+{
+    uint i;
+
+    for (i = 0; i + 8 <= count; i += 8) {
+        uint8x8x4_t s = vld4_u8((const uint8_t *)(src + i));
+
+        uint16x8_t out = vshlq_n_u16(vmovl_u8(vshr_n_u8(s.val[2], 3)), 11);
+        out = vorrq_u16(out, vshlq_n_u16(vmovl_u8(vshr_n_u8(s.val[1], 2)), 5));
+        out = vorrq_u16(out, vmovl_u8(vshr_n_u8(s.val[0], 3)));
+
+        vst1q_u16(dest + i, out);
+    }
+    return i;
+}
+
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+
+uint gfx_simd_fill32(uint32_t *dest, uint32_t color, uint count)
+{
+    __m128i c = _mm_set1_epi32(color);
+    uint i;
+
+    for (i = 0; i + 8 <= count; i += 8) {
+        _mm_storeu_si128((__m128i *)(dest + i), c);
+        _mm_storeu_si128((__m128i *)(dest + i + 4), c);
+    }
+    return i;
+}
+
+uint gfx_simd_copy32(uint32_t *dest, const uint32_t *src, uint count)
+{
+    uint i;
+
+    for (i = 0; i + 8 <= count; i += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i + 4));
+        _mm_storeu_si128((__m128i *)(dest + i), a);
+        _mm_storeu_si128((__m128i *)(dest + i + 4), b);
+    }
+    return i;
+}
+
+/* blend two pixels unpacked to 16 bits a channel */
+static inline __m128i blend_pair(__m128i s, __m128i d)
+{
+    /* same rounding as alpha32_add_ignore_destalpha */
+    __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    a = _mm_add_epi16(a, _mm_set1_epi16(1));
+    __m128i ainv = _mm_sub_epi16(_mm_set1_epi16(255), a);
+
+    return _mm_add_epi16(_mm_srli_epi16(_mm_mullo_epi16(s, a), 8),
+                         _mm_srli_epi16(_mm_mullo_epi16(d, ainv), 8));
+}
+
+uint gfx_simd_blend32(uint32_t *dest, const uint32_t *src, uint count)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rgb_mask = _mm_set1_epi32(0x00ffffff);
+    uint i;
+
+    for (i = 0; i + 4 <= count; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dest + i));
+
+        __m128i lo = blend_pair(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero));
+        __m128i hi = blend_pair(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero));
+        __m128i out = _mm_packus_epi16(lo, hi);
+
+        /* the result alpha is the bumped source alpha */
+        __m128i srca = _mm_srli_epi32(s, 24);
+        __m128i a = _mm_slli_epi32(_mm_add_epi32(srca, _mm_set1_epi32(1)), 24);
+        out = _mm_or_si128(_mm_and_si128(out, rgb_mask), a);
+
+        /* fully transparent keeps dest, fully opaque takes src */
+        __m128i transparent = _mm_cmpeq_epi32(srca, zero);
+        __m128i opaque = _mm_cmpeq_epi32(srca, _mm_set1_epi32(255));
+        out = _mm_or_si128(_mm_and_si128(transparent, d), _mm_andnot_si128(transparent, out));
+        out = _mm_or_si128(_mm_and_si128(opaque, s), _mm_andnot_si128(opaque, out));
+
+        _mm_storeu_si128((__m128i *)(dest + i), out);
+    }
+    return i;
+}
+
+uint gfx_simd_argb8888_to_rgb565(uint16_t *dest, const uint32_t *src, uint count)
+{
+    const __m128i bias = _mm_set1_epi32(0x8000);
+    uint i;
+
+    for (i = 0; i + 8 <= count; i += 8) {
+        __m128i out[2];
+
+        for (int j = 0; j < 2; j++) {
+            __m128i s = _mm_loadu_si128((const __m128i *)(src + i + j * 4));
+
+            __m128i p = _mm_and_si128(_mm_srli_epi32(s, 3), _mm_set1_epi32(0x1f));
+            p = _mm_or_si128(p, _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(s, 10), _mm_set1_epi32(0x3f)), 5));
+            p = _mm_or_si128(p, _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(s, 19), _mm_set1_epi32(0x1f)), 11));
+
+            /* no unsigned 32 -> 16 bit pack in SSE2, so go through a signed one */
+            out[j] = _mm_sub_epi32(p, bias);
+        }
+
+        __m128i packed = _mm_add_epi16(_mm_packs_epi32(out[0], out[1]), _mm_set1_epi16((short)0x8000));
+        _mm_storeu_si128((__m128i *)(dest + i), packed);
+    }
+    return i;
+}
+
+#endif
+
+#endif // GFX_WITH_SIMD
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <arch/ops.h>
+
+/*
+ * vector versions of the inner loops of the 32 bit surface routines. each one
+ * handles as much of a row as it can and returns the number of pixels done,
+ * the caller finishes off the rest with the plain C loop.
+ */
+#ifndef GFX_WITH_SIMD
+#if defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(__SSE2__)
+#define GFX_WITH_SIMD 1
+#else
+#define GFX_WITH_SIMD 0
+#endif
+#endif
+
+uint32_t alpha32_add_ignore_destalpha(uint32_t dest, uint32_t src);
+
+#if GFX_WITH_SIMD
+
+uint gfx_simd_fill32(uint32_t *dest, uint32_t color, uint count);
+uint gfx_simd_copy32(uint32_t *dest, const uint32_t *src, uint count);
+uint gfx_simd_blend32(uint32_t *dest, const uint32_t *src, uint count);
+uint gfx_simd_argb8888_to_rgb565(uint16_t *dest, const uint32_t *src, uint count);
+
+/* the vector registers are switched lazily, so stay off them with interrupts disabled */
+static inline bool gfx_simd_usable(void)
+{
+    return !arch_ints_disabled();
+}
+
+#else
+
+static inline uint gfx_simd_fill32(uint32_t *dest, uint32_t color, uint count) { return 0; }
+static inline uint gfx_simd_copy32(uint32_t *dest, const uint32_t *src, uint count) { return 0; }
+static inline uint gfx_simd_blend32(uint32_t *dest, const uint32_t *src, uint count) { return 0; }
+static inline uint gfx_simd_argb8888_to_rgb565(uint16_t *dest, const uint32_t *src, uint count) { return 0; }
+
+static inline bool gfx_simd_usable(void)
+{
+    return false;
+}
+
+#endif
@@ -32,6 +32,8 @@
 
 #include <debug.h>
 #include <assert.h>
+#include <string.h>
+#include <stdlib.h>
 #include <lib/io.h>
 #include <lk/init.h>
 #include <lib/gfx.h>
@@ -43,6 +45,9 @@
  * @{
  */
 
+// glyphs kept pre-rendered in the surface's pixel format
+#define GLYPH_COUNT 128
+
 /**
  * @brief  Represent state of graphics console
  */
@@ -55,8 +60,174 @@ static struct {
 
     uint32_t front_color;
     uint32_t back_color;
+
+    // text of the screen, a ring of rows starting at top
+    char *text;
+    uint top;
+
+    // lines scrolled during this print that haven't been moved on screen yet
+    uint scroll_pending;
+
+    // glyph cache for the current color pair
+    uint8_t *glyphs;
+    size_t glyph_size;
+    uint32_t glyph_front_color;
+    uint32_t glyph_back_color;
+    uint8_t glyph_valid[GLYPH_COUNT / 8];
 } gfxconsole;
 
+static inline char *text_row(uint row)
+{
+    return &gfxconsole.text[((gfxconsole.top + row) % gfxconsole.rows) * gfxconsole.columns];
+}
+
+static uint32_t translate(uint32_t color)
+{
+    gfx_surface *surface = gfxconsole.surface;
+
+    return surface->translate_color ? surface->translate_color(color) : color;
+}
+
+/* render a glyph with the current colors into the cache, if it isn't there already */
+static const uint8_t *get_glyph(unsigned char c)
+{
+    gfx_surface *surface = gfxconsole.surface;
+
+    if (!gfxconsole.glyphs || c >= GLYPH_COUNT)
+        return NULL;
+
+    if (gfxconsole.glyph_front_color != gfxconsole.front_color ||
+            gfxconsole.glyph_back_color != gfxconsole.back_color) {
+        memset(gfxconsole.glyph_valid, 0, sizeof(gfxconsole.glyph_valid));
+        gfxconsole.glyph_front_color = gfxconsole.front_color;
+        gfxconsole.glyph_back_color = gfxconsole.back_color;
+    }
+
+    uint8_t *glyph = gfxconsole.glyphs + c * gfxconsole.glyph_size;
+    if (gfxconsole.glyph_valid[c / 8] & (1 << (c % 8)))
+        return glyph;
+
+    uint32_t fg = translate(gfxconsole.front_color);
+    uint32_t bg = translate(gfxconsole.back_color);
+    for (uint i = 0; i < FONT_Y; i++) {
+        uint line = font_glyph_row(c, i);
+        for (uint j = 0; j < FONT_X; j++) {
+            uint32_t color = (line & (1 << j)) ? fg : bg;
+            uint index = i * FONT_X + j;
+
+            switch (surface->pixelsize) {
+                case 1:
+                    glyph[index] = color;
+                    break;
+                case 2:
+                    ((uint16_t *)glyph)[index] = color;
+                    break;
+                case 4:
+                    ((uint32_t *)glyph)[index] = color;
+                    break;
+            }
+        }
+    }
+    gfxconsole.glyph_valid[c / 8] |= 1 << (c % 8);
+
+    return glyph;
+}
+
+/* draw a character cell, background and all */
+static void draw_cell(uint col, uint row, unsigned char c)
+{
+    gfx_surface *surface = gfxconsole.surface;
+    uint x = col * FONT_X;
+    uint y = row * FONT_Y;
+
+    const uint8_t *glyph = get_glyph(c);
+    if (!glyph) {
+        gfx_fillrect(surface, x, y, FONT_X, FONT_Y, gfxconsole.back_color);
+        font_draw_char(surface, c, x, y, gfxconsole.front_color);
+        return;
+    }
+
+    size_t rowlen = FONT_X * surface->pixelsize;
+    uint8_t *dest = (uint8_t *)surface->ptr + (y * surface->stride + x) * surface->pixelsize;
+    for (uint i = 0; i < FONT_Y; i++) {
+        memcpy(dest, glyph, rowlen);
+        glyph += rowlen;
+        dest += surface->stride * surface->pixelsize;
+    }
+    gfx_mark_dirty(surface, x, y, FONT_X, FONT_Y);
+}
+
+/* redraw a whole text row from the text buffer, a pixel line at a time */
+static void draw_row(uint row)
+{
+    gfx_surface *surface = gfxconsole.surface;
+    const char *text = text_row(row);
+
+    if (!gfxconsole.glyphs) {
+        for (uint col = 0; col < gfxconsole.columns; col++)
+            draw_cell(col, row, text[col]);
+        return;
+    }
+
+    size_t rowlen = FONT_X * surface->pixelsize;
+    uint8_t *dest = (uint8_t *)surface->ptr + row * FONT_Y * surface->stride * surface->pixelsize;
+    for (uint i = 0; i < FONT_Y; i++) {
+        uint8_t *d = dest;
+        for (uint col = 0; col < gfxconsole.columns; col++) {
+            const uint8_t *glyph = get_glyph(text[col]);
+            if (!glyph)
+                glyph = get_glyph(' ');
+            memcpy(d, glyph + i * rowlen, rowlen);
+            d += rowlen;
+        }
+        dest += surface->stride * surface->pixelsize;
+    }
+    gfx_mark_dirty(surface, 0, row * FONT_Y, gfxconsole.columns * FONT_X, FONT_Y);
+}
+
+static void put_char(unsigned char c)
+{
+    text_row(gfxconsole.y)[gfxconsole.x] = c;
+
+    // once the screen has scrolled the pixels are behind, they get caught up at the end of the print
+    if (gfxconsole.scroll_pending == 0)
+        draw_cell(gfxconsole.x, gfxconsole.y, c);
+
+    gfxconsole.x++;
+}
+
+static void scroll(void)
+{
+    // the old top row becomes the new, blank, bottom row
+    memset(text_row(0), ' ', gfxconsole.columns);
+    gfxconsole.top = (gfxconsole.top + 1) % gfxconsole.rows;
+    gfxconsole.scroll_pending++;
+}
+
+/* bring the screen up to date with any scrolling done during this print */
+static void catch_up(void)
+{
+    gfx_surface *surface = gfxconsole.surface;
+    uint lines = gfxconsole.scroll_pending;
+
+    if (lines == 0)
+        return;
+
+    uint first;
+    if (lines < gfxconsole.rows) {
+        // one move for all of it
+        gfx_copyrect(surface, 0, lines * FONT_Y, surface->width, (gfxconsole.rows - lines) * FONT_Y, 0, 0);
+        first = gfxconsole.rows - lines;
+    } else {
+        first = 0;
+    }
+
+    for (uint row = first; row < gfxconsole.rows; row++)
+        draw_row(row);
+
+    gfxconsole.scroll_pending = 0;
+}
+
 static void gfxconsole_putc(char c)
 {
     static enum { NORMAL, ESCAPE } state = NORMAL;
@@ -71,8 +242,7 @@ static void gfxconsole_putc(char c)
                 p_num = 0;
                 state = ESCAPE;
             } else {
-                font_draw_char(gfxconsole.surface, c, gfxconsole.x * FONT_X, gfxconsole.y * FONT_Y, gfxconsole.front_color);
-                gfxconsole.x++;
+                put_char(c);
             }
             break;
         }
@@ -87,8 +257,7 @@ static void gfxconsole_putc(char c)
             } else if (c == '[') {
                 // eat this character
             } else {
-                font_draw_char(gfxconsole.surface, c, gfxconsole.x * FONT_X, gfxconsole.y * FONT_Y, gfxconsole.front_color);
-                gfxconsole.x++;
+                put_char(c);
                 state = NORMAL;
             }
             break;
@@ -100,19 +269,24 @@ static void gfxconsole_putc(char c)
         gfxconsole.y++;
     }
     if (gfxconsole.y >= gfxconsole.rows) {
-        // scroll up
-        gfx_copyrect(gfxconsole.surface, 0, FONT_Y, gfxconsole.surface->width, gfxconsole.surface->height - FONT_Y - gfxconsole.extray, 0, 0);
+        scroll();
         gfxconsole.y--;
-        gfx_fillrect(gfxconsole.surface, 0, gfxconsole.surface->height - FONT_Y - gfxconsole.extray, gfxconsole.surface->width, FONT_Y, gfxconsole.back_color);
-        gfx_flush(gfxconsole.surface);
     }
 }
 
 void gfxconsole_print_callback(print_callback_t *cb, const char *str, size_t len)
 {
+    gfx_surface *surface = gfxconsole.surface;
+
     for (size_t i = 0; i < len; i++) {
         gfxconsole_putc(str[i]);
     }
+
+    catch_up();
+
+    // push out whatever got drawn, all at once
+    if (surface->dirty_count > 0)
+        gfx_flush(surface);
 }
 
 static print_callback_t cb = {
@@ -149,6 +323,20 @@ void gfxconsole_start(gfx_surface *surface)
     gfxconsole.front_color = 0xffffffff;
     gfxconsole.back_color = 0;
 
+    // the text on screen, kept so scrolling can redraw from it
+    gfxconsole.text = malloc(gfxconsole.rows * gfxconsole.columns);
+    DEBUG_ASSERT(gfxconsole.text);
+    memset(gfxconsole.text, ' ', gfxconsole.rows * gfxconsole.columns);
+    gfxconsole.top = 0;
+    gfxconsole.scroll_pending = 0;
+
+    // glyphs are optional, without them characters are drawn a pixel at a time
+    gfxconsole.glyph_size = FONT_X * FONT_Y * surface->pixelsize;
+    gfxconsole.glyphs = malloc(GLYPH_COUNT * gfxconsole.glyph_size);
+    memset(gfxconsole.glyph_valid, 0, sizeof(gfxconsole.glyph_valid));
+    gfxconsole.glyph_front_color = gfxconsole.front_color;
+    gfxconsole.glyph_back_color = gfxconsole.back_color;
+
     // register for debug callbacks
     register_print_callback(&cb);
 }
@@ -38,6 +38,10 @@
 // Allocation strategy takes place with a global mutex.  Freelist entries are
 // kept in linked lists with 8 different sizes per binary order of magnitude
 // and the header size is two words with eager coalescing on free.
+//
+// Small allocations are fronted by per cpu caches of blocks that are still
+// allocated as far as the heap is concerned, so the common sizes don't need
+// the global lock.  The caches are refilled and drained in batches.
 
 #ifdef DEBUG
 #define CMPCT_DEBUG
@@ -57,10 +61,18 @@
 
 STATIC_ASSERT(IS_PAGE_ALIGNED(HEAP_GROW_SIZE));
 
-// Individual allocations above 4Mbytes are just fetched directly from the
-// block allocator.
+// The buckets go up to 4Mbytes.
 #define HEAP_ALLOC_VIRTUAL_BITS 22
 
+// Allocations of at least this many bytes get pages of their own straight
+// from the page allocator and go straight back when freed, so they neither
+// fragment the buckets nor leave big free areas behind.
+#ifndef CMPCT_DIRECT_THRESHOLD
+#define CMPCT_DIRECT_THRESHOLD (64 * 1024)
+#endif
+
+STATIC_ASSERT(CMPCT_DIRECT_THRESHOLD <= (1u << (HEAP_ALLOC_VIRTUAL_BITS - 1)));
+
 // When we grow the heap we have to have somewhere in the freelist to put the
 // resulting freelist entry, so the freelist has to have a certain number of
 // buckets.
@@ -74,6 +86,24 @@ STATIC_ASSERT(HEAP_GROW_SIZE <= (1u << HEAP_ALLOC_VIRTUAL_BITS));
 // is 16 bytes larger than the header, but we have it for simplicity.
 #define NUMBER_OF_BUCKETS (1 + 15 + (HEAP_ALLOC_VIRTUAL_BITS - 7) * 8)
 
+// Blocks in the smallest CMPCT_PCPU_BUCKETS buckets are cached per cpu.  24
+// covers everything up to the 256 byte bucket, 0 turns the caches off.
+#ifndef CMPCT_PCPU_BUCKETS
+#define CMPCT_PCPU_BUCKETS 24
+#endif
+
+// How many blocks move between a cache and the heap at a time, and how many
+// blocks of one size a cache holds before giving a batch back.
+#ifndef CMPCT_PCPU_BATCH
+#define CMPCT_PCPU_BATCH 8
+#endif
+#ifndef CMPCT_PCPU_HIGH
+#define CMPCT_PCPU_HIGH (CMPCT_PCPU_BATCH * 2)
+#endif
+
+STATIC_ASSERT(CMPCT_PCPU_BUCKETS <= NUMBER_OF_BUCKETS);
+STATIC_ASSERT(CMPCT_PCPU_HIGH >= CMPCT_PCPU_BATCH);
+
 // All individual memory areas on the heap start with this.
 typedef struct header_struct {
     struct header_struct *left;  // Pointer to the previous area in memory order.
@@ -100,6 +130,29 @@ struct heap {
 // Heap static vars.
 static struct heap theheap;
 
+// Pages handed out to direct allocations.
+static volatile int direct_pages;
+
+#if CMPCT_PCPU_BUCKETS > 0
+// A cached block, linked through its payload.
+typedef struct cached_struct {
+    struct cached_struct *next;
+} cached_t;
+
+struct pcpu_cache {
+    spin_lock_t lock;
+    cached_t *blocks[CMPCT_PCPU_BUCKETS];
+    uint count[CMPCT_PCPU_BUCKETS];
+} __CPU_ALIGN;
+
+static struct pcpu_cache pcpu_cache[SMP_MAX_CPUS];
+
+// Cleared while the self test runs, it looks at the heap's own bookkeeping.
+static bool pcpu_cache_enabled = true;
+
+static void pcpu_cache_drain_all(void);
+#endif
+
 static ssize_t heap_grow(size_t len, free_t **bucket);
 
 static void lock(void)
@@ -119,11 +172,22 @@ static void dump_free(header_t *header)
 
 void cmpct_dump(void)
 {
+#if CMPCT_PCPU_BUCKETS > 0
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        uint cached = 0;
+        for (int i = 0; i < CMPCT_PCPU_BUCKETS; i++)
+            cached += pcpu_cache[cpu].count[i];
+        if (cached)
+            dprintf(INFO, "\tcpu %u: %u cached blocks\n", cpu, cached);
+    }
+#endif
+
     lock();
     dprintf(INFO, "Heap dump (using cmpctmalloc):\n");
-    dprintf(INFO, "\tsize %lu, remaining %lu\n",
+    dprintf(INFO, "\tsize %lu, remaining %lu, direct %lu\n",
             (unsigned long)theheap.size,
-            (unsigned long)theheap.remaining);
+            (unsigned long)theheap.remaining,
+            (unsigned long)direct_pages * PAGE_SIZE);
 
     dprintf(INFO, "\tfree list:\n");
     for (int i = 0; i < NUMBER_OF_BUCKETS; i++) {
@@ -141,6 +205,12 @@ void cmpct_dump(void)
     unlock();
 }
 
+// Bytes sitting in the free lists, not counting blocks in the per cpu caches.
+size_t cmpct_get_free(void)
+{
+    return theheap.remaining;
+}
+
 // Operates in sizes that don't include the allocation header.
 static int size_to_index_helper(
     size_t size, size_t *rounded_up_out, int adjust, int increment)
@@ -338,7 +408,9 @@ static void *TestTrimHelper(ssize_t target)
     char *answer = NULL;
     size_t remaining = theheap.remaining;
     while (theheap.remaining - target > 512) {
-        char *next_block = cmpct_alloc(8 + ((theheap.remaining - target) >> 2));
+        // Stay under the direct threshold, those don't come out of the heap.
+        char *next_block = cmpct_alloc(
+            MIN(8 + ((theheap.remaining - target) >> 2), CMPCT_DIRECT_THRESHOLD - 1));
         *(char **)next_block = answer;
         answer = next_block;
         if (theheap.remaining > remaining) return answer;
@@ -572,6 +644,10 @@ static void cmpct_test_return_to_os(void)
 
 void cmpct_test(void)
 {
+#if CMPCT_PCPU_BUCKETS > 0
+    pcpu_cache_enabled = false;
+    pcpu_cache_drain_all();
+#endif
     cmpct_test_buckets();
     cmpct_test_get_back_newly_freed();
     cmpct_test_return_to_os();
@@ -628,38 +704,69 @@ void cmpct_test(void)
     }
 
     cmpct_dump();
+#if CMPCT_PCPU_BUCKETS > 0
+    pcpu_cache_enabled = true;
+#endif
+}
+
+// A direct allocation's header sits right in front of the payload like any
+// other, but its left pointer is the base of its pages tagged with
+// DIRECT_TAG, and its size covers all of them.
+#define DIRECT_TAG 2
+
+static inline bool is_direct(header_t *header)
+{
+    return ((uintptr_t)header->left & DIRECT_TAG) != 0;
 }
 
-static void *large_alloc(size_t size)
+static void *direct_alloc(size_t size, size_t alignment)
 {
+    if (size > SIZE_MAX / 2 - alignment) return NULL;
+
+    size_t offset = ROUNDUP(sizeof(header_t), alignment);
+    size_t total = ROUNDUP(size + offset + (alignment > PAGE_SIZE ? alignment : 0), PAGE_SIZE);
+    char *base = page_alloc(total >> PAGE_SIZE_SHIFT, PAGE_ALLOC_ANY_ARENA);
+    if (base == NULL) return NULL;
+
+    char *payload = (char *)ROUNDUP((uintptr_t)base + offset, alignment);
+    header_t *header = (header_t *)payload - 1;
+    header->left = (header_t *)((uintptr_t)base | DIRECT_TAG);
+    header->size = total;
+    atomic_add(&direct_pages, total >> PAGE_SIZE_SHIFT);
+
+    LTRACEF("size %zu alignment %zu: %zu bytes at %p\n", size, alignment, total, base);
 #ifdef CMPCT_DEBUG
-    size_t requested_size = size;
+    memset(payload, ALLOC_FILL, size);
 #endif
-    size = ROUNDUP(size, 8);
-    free_t *free_area = NULL;
-    lock();
-    if (heap_grow(size, &free_area) < 0) {
-      return 0;
+    return payload;
+}
+
+static void direct_free(header_t *header)
+{
+    void *base = (void *)((uintptr_t)header->left & ~(uintptr_t)DIRECT_TAG);
+    size_t pages = header->size >> PAGE_SIZE_SHIFT;
+
+    atomic_add(&direct_pages, -(int)pages);
+    page_free(base, pages);
+}
+
+// Bytes the caller may use.
+static size_t payload_size(header_t *header)
+{
+    if (is_direct(header)) {
+        uintptr_t base = (uintptr_t)header->left & ~(uintptr_t)DIRECT_TAG;
+        return base + header->size - (uintptr_t)(header + 1);
     }
-    void *result =
-        create_allocation_header(free_area, 0, free_area->header.size, free_area->header.left);
-    // Normally the 'remaining free space' counter would be decremented when we
-    // unlink the free area from its bucket.  However in this case the free
-    // area was too big to go in any bucket and we had it in our own
-    // "free_area" variable so there is no unlinking and we have to adjust the
-    // counter here.
-    theheap.remaining -= free_area->header.size;
-    unlock();
-#ifdef CMPCT_DEBUG
-    memset(result, ALLOC_FILL, requested_size);
-    memset((char *)result + requested_size, PADDING_FILL,
-        free_area->header.size - (requested_size + sizeof(header_t)));
-#endif
-    return result;
+    return header->size - sizeof(header_t);
 }
 
 void cmpct_trim(void)
 {
+#if CMPCT_PCPU_BUCKETS > 0
+    // Cached blocks pin their neighbors, hand them all back first.
+    pcpu_cache_drain_all();
+#endif
+
     // Look at free list entries that are at least as large as one page plus a
     // header. They might be at the start or the end of a block, so we can trim
     // them and free the page(s).
@@ -730,18 +837,11 @@ void cmpct_trim(void)
     unlock();
 }
 
-void *cmpct_alloc(size_t size)
+// Carve an allocation out of the free lists.  Called with the lock.
+// Find a bucket with an area of at least rounded_up bytes, growing the heap
+// if there isn't one.  Called with the lock.
+static int find_or_grow_bucket(int start_bucket, size_t rounded_up)
 {
-    if (size == 0u) return NULL;
-
-    if (size + sizeof(header_t) > (1u << HEAP_ALLOC_VIRTUAL_BITS)) return large_alloc(size);
-
-    size_t rounded_up;
-    int start_bucket = size_to_index_allocating(size, &rounded_up);
-
-    rounded_up += sizeof(header_t);
-
-    lock();
     int bucket = find_nonempty_bucket(start_bucket);
     if (bucket == -1) {
         // Grow heap by at least 12% if we can.
@@ -750,13 +850,21 @@ void *cmpct_alloc(size_t size)
                                 MAX(HEAP_GROW_SIZE, rounded_up)));
         while (heap_grow(growby, NULL) < 0) {
             if (growby <= rounded_up) {
-                unlock();
-                return NULL;
+                return -1;
             }
             growby = MAX(growby >> 1, rounded_up);
         }
         bucket = find_nonempty_bucket(start_bucket);
     }
+    return bucket;
+}
+
+static void *alloc_locked(size_t size, int start_bucket, size_t rounded_up)
+{
+    int bucket = find_or_grow_bucket(start_bucket, rounded_up);
+    if (bucket == -1) {
+        return NULL;
+    }
     free_t *head = theheap.free_lists[bucket];
     size_t left_over = head->header.size - rounded_up;
     // We can't carve off the rest for a new free space if it's smaller than the
@@ -780,46 +888,14 @@ void *cmpct_alloc(size_t size)
     memset(result, ALLOC_FILL, size);
     memset(((char *)result) + size, PADDING_FILL, rounded_up - size - sizeof(header_t));
 #endif
-    unlock();
     return result;
 }
 
-void *cmpct_memalign(size_t size, size_t alignment)
+// Return an allocation to the free lists, coalescing with its neighbors.
+// Called with the lock.
+static void free_locked(header_t *header)
 {
-    if (alignment < 8) return cmpct_alloc(size);
-    size_t padded_size =
-        size + alignment + sizeof(free_t) + sizeof(header_t);
-    char *unaligned = (char *)cmpct_alloc(padded_size);
-    lock();
-    size_t mask = alignment - 1;
-    uintptr_t payload_int = (uintptr_t)unaligned + sizeof(free_t) +
-                            sizeof(header_t) + mask;
-    char *payload = (char *)(payload_int & ~mask);
-    if (unaligned != payload) {
-        header_t *unaligned_header = (header_t *)unaligned - 1;
-        header_t *header = (header_t *)payload - 1;
-        size_t left_over = payload - unaligned;
-        create_allocation_header(
-            header, 0, unaligned_header->size - left_over, unaligned_header);
-        header_t *right = right_header(unaligned_header);
-        unaligned_header->size = left_over;
-        FixLeftPointer(right, header);
-        unlock();
-        cmpct_free(unaligned);
-    } else {
-        unlock();
-    }
-    // TODO: Free the part after the aligned allocation.
-    return payload;
-}
-
-void cmpct_free(void *payload)
-{
-    if (payload == NULL) return;
-    header_t *header = (header_t *)payload - 1;
-    DEBUG_ASSERT(!is_tagged_as_free(header));  // Double free!
     size_t size = header->size;
-    lock();
     header_t *left = header->left;
     if (left != NULL && is_tagged_as_free(left)) {
         // Coalesce with left free object.
@@ -848,6 +924,257 @@ void cmpct_free(void *payload)
             free_memory(header, left, size);
         }
     }
+}
+
+#if CMPCT_PCPU_BUCKETS > 0
+static void free_cached_chain(cached_t *block)
+{
+    if (!block) return;
+
+    lock();
+    while (block) {
+        cached_t *next = block->next;
+        free_locked((header_t *)block - 1);
+        block = next;
+    }
+    unlock();
+}
+
+static void pcpu_cache_drain_all(void)
+{
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        struct pcpu_cache *cache = &pcpu_cache[cpu];
+        for (int i = 0; i < CMPCT_PCPU_BUCKETS; i++) {
+            spin_lock_saved_state_t state;
+            spin_lock_irqsave(&cache->lock, state);
+            cached_t *chain = cache->blocks[i];
+            cache->blocks[i] = NULL;
+            cache->count[i] = 0;
+            spin_unlock_irqrestore(&cache->lock, state);
+
+            free_cached_chain(chain);
+        }
+    }
+}
+
+static void *cached_alloc(size_t size, int bucket, size_t rounded_up)
+{
+    spin_lock_saved_state_t state;
+    struct pcpu_cache *cache = &pcpu_cache[arch_curr_cpu_num()];
+
+    spin_lock_irqsave(&cache->lock, state);
+    cached_t *block = cache->blocks[bucket];
+    if (block) {
+        cache->blocks[bucket] = block->next;
+        cache->count[bucket]--;
+    }
+    spin_unlock_irqrestore(&cache->lock, state);
+
+    if (block) {
+#ifdef CMPCT_DEBUG
+        memset(block, ALLOC_FILL, size);
+#endif
+        return block;
+    }
+
+    // Miss, take a batch from the heap and keep all but the first.
+    cached_t *head = NULL, *tail = NULL;
+    uint count = 0;
+    lock();
+    void *result = alloc_locked(size, bucket, rounded_up);
+    while (result && count < CMPCT_PCPU_BATCH - 1) {
+        cached_t *extra = alloc_locked(size, bucket, rounded_up);
+        if (!extra) break;
+        extra->next = head;
+        head = extra;
+        if (!tail) tail = extra;
+        count++;
+    }
+    unlock();
+
+    if (head) {
+        cache = &pcpu_cache[arch_curr_cpu_num()];
+        spin_lock_irqsave(&cache->lock, state);
+        tail->next = cache->blocks[bucket];
+        cache->blocks[bucket] = head;
+        cache->count[bucket] += count;
+        spin_unlock_irqrestore(&cache->lock, state);
+    }
+
+    return result;
+}
+
+static void cached_free(void *payload, int bucket)
+{
+    spin_lock_saved_state_t state;
+    struct pcpu_cache *cache = &pcpu_cache[arch_curr_cpu_num()];
+    cached_t *block = payload;
+    cached_t *drain = NULL;
+
+    spin_lock_irqsave(&cache->lock, state);
+    block->next = cache->blocks[bucket];
+    cache->blocks[bucket] = block;
+    if (++cache->count[bucket] > CMPCT_PCPU_HIGH) {
+        // Too many, give a batch back.
+        drain = block;
+        cached_t *last = drain;
+        for (uint i = 1; i < CMPCT_PCPU_BATCH; i++)
+            last = last->next;
+        cache->blocks[bucket] = last->next;
+        last->next = NULL;
+        cache->count[bucket] -= CMPCT_PCPU_BATCH;
+    }
+    spin_unlock_irqrestore(&cache->lock, state);
+
+    free_cached_chain(drain);
+}
+#endif
+
+void *cmpct_alloc(size_t size)
+{
+    if (size == 0u) return NULL;
+
+    if (size >= CMPCT_DIRECT_THRESHOLD) return direct_alloc(size, 8);
+
+    size_t rounded_up;
+    int start_bucket = size_to_index_allocating(size, &rounded_up);
+
+    rounded_up += sizeof(header_t);
+
+#if CMPCT_PCPU_BUCKETS > 0
+    if (start_bucket < CMPCT_PCPU_BUCKETS && pcpu_cache_enabled)
+        return cached_alloc(size, start_bucket, rounded_up);
+#endif
+
+    lock();
+    void *result = alloc_locked(size, start_bucket, rounded_up);
+    unlock();
+    return result;
+}
+
+// Where an aligned allocation would start inside a free area, or NULL if it
+// doesn't fit.  Any space left in front has to be big enough to become a free
+// area of its own.
+static header_t *aligned_fit(free_t *area, size_t rounded_up, size_t alignment)
+{
+    uintptr_t start = (uintptr_t)area;
+    uintptr_t end = start + area->header.size;
+    uintptr_t header = ROUNDUP(start + sizeof(header_t), alignment) - sizeof(header_t);
+    if (header != start && header - start < sizeof(free_t)) {
+        header = ROUNDUP(start + sizeof(free_t) + sizeof(header_t), alignment) - sizeof(header_t);
+    }
+    if (header + rounded_up > end) return NULL;
+    return (header_t *)header;
+}
+
+// Allocate from the middle of a free area, handing the space on either side
+// back to the free lists.  Called with the lock.
+static void *carve_aligned(free_t *area, int bucket, header_t *header,
+                           size_t size, size_t rounded_up)
+{
+    header_t *left = untag(area->header.left);
+    header_t *right = right_header(&area->header);
+    size_t left_over = (char *)header - (char *)area;
+    size_t right_over = (char *)right - ((char *)header + rounded_up);
+    unlink_free(area, bucket);
+    if (left_over != 0) {
+        DEBUG_ASSERT(left_over >= sizeof(free_t));
+        create_free_area(area, left, left_over, NULL);
+        left = &area->header;
+    }
+    // Same rule as alloc_locked for carving off the tail.
+    if (right_over >= sizeof(free_t) && right_over > (size >> 6)) {
+        header_t *tail = (header_t *)((char *)header + rounded_up);
+        create_free_area(tail, header, right_over, NULL);
+        FixLeftPointer(right, tail);
+    } else {
+        rounded_up += right_over;
+        FixLeftPointer(right, header);
+    }
+    void *result = create_allocation_header(header, 0, rounded_up, left);
+#ifdef CMPCT_DEBUG
+    memset(result, ALLOC_FILL, size);
+    memset(((char *)result) + size, PADDING_FILL, rounded_up - size - sizeof(header_t));
+#endif
+    return result;
+}
+
+// Areas in the buckets between the exact size and the size that is sure to
+// fit might still fit depending on where they start. Only look at the first
+// few in each so a long free list doesn't turn this into a heap walk.
+#define ALIGNED_SCAN_DEPTH 4
+
+static void *alloc_aligned_locked(size_t size, size_t alignment, size_t rounded_up,
+                                  int start_bucket, int sure_bucket)
+{
+    for (int bucket = find_nonempty_bucket(start_bucket);
+            bucket != -1 && bucket < sure_bucket;
+            bucket = find_nonempty_bucket(bucket + 1)) {
+        free_t *area = theheap.free_lists[bucket];
+        for (int i = 0; area != NULL && i < ALIGNED_SCAN_DEPTH; i++, area = area->next) {
+            header_t *header = aligned_fit(area, rounded_up, alignment);
+            if (header) return carve_aligned(area, bucket, header, size, rounded_up);
+        }
+    }
+
+    size_t worst_case = rounded_up + alignment + sizeof(free_t);
+    int bucket = find_or_grow_bucket(sure_bucket, worst_case);
+    if (bucket == -1) return NULL;
+    free_t *area = theheap.free_lists[bucket];
+    header_t *header = aligned_fit(area, rounded_up, alignment);
+    DEBUG_ASSERT(header != NULL);
+    return carve_aligned(area, bucket, header, size, rounded_up);
+}
+
+void *cmpct_memalign(size_t size, size_t alignment)
+{
+    if (alignment < 8) return cmpct_alloc(size);
+    if (size == 0u) return NULL;
+    DEBUG_ASSERT((alignment & (alignment - 1)) == 0);
+
+    if (size >= CMPCT_DIRECT_THRESHOLD ||
+            size + sizeof(header_t) + alignment + sizeof(free_t) > (1u << HEAP_ALLOC_VIRTUAL_BITS)) {
+        return direct_alloc(size, alignment);
+    }
+
+    size_t rounded_up;
+    int start_bucket = size_to_index_allocating(size, &rounded_up);
+    rounded_up += sizeof(header_t);
+
+    // Every area in this bucket or above fits no matter where it starts.
+    size_t worst_case = rounded_up + alignment + sizeof(free_t);
+    if (worst_case > (1u << HEAP_ALLOC_VIRTUAL_BITS)) {
+        return direct_alloc(size, alignment);
+    }
+    size_t dummy;
+    int sure_bucket = size_to_index_allocating(worst_case - sizeof(header_t), &dummy);
+
+    lock();
+    void *result = alloc_aligned_locked(size, alignment, rounded_up, start_bucket, sure_bucket);
+    unlock();
+    return result;
+}
+
+void cmpct_free(void *payload)
+{
+    if (payload == NULL) return;
+    header_t *header = (header_t *)payload - 1;
+    DEBUG_ASSERT(!is_tagged_as_free(header));  // Double free!
+    if (is_direct(header)) {
+        direct_free(header);
+        return;
+    }
+#if CMPCT_PCPU_BUCKETS > 0
+    if (header->size <= (1u << HEAP_ALLOC_VIRTUAL_BITS) && pcpu_cache_enabled) {
+        int bucket = size_to_index_freeing(header->size - sizeof(header_t));
+        if (bucket < CMPCT_PCPU_BUCKETS) {
+            cached_free(payload, bucket);
+            return;
+        }
+    }
+#endif
+    lock();
+    free_locked(header);
     unlock();
 }
 
@@ -855,7 +1182,7 @@ void *cmpct_realloc(void *payload, size_t size)
 {
     if (payload == NULL) return cmpct_alloc(size);
     header_t *header = (header_t *)payload - 1;
-    size_t old_size = header->size - sizeof(header_t);
+    size_t old_size = payload_size(header);
     void *new_payload = cmpct_alloc(size);
     memcpy(new_payload, payload, MIN(size, old_size));
     cmpct_free(payload);
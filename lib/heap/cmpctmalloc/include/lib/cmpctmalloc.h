@@ -23,6 +23,7 @@
 #pragma once
 
 #include <compiler.h>
+#include <stddef.h>
 
 __BEGIN_CDECLS;
 
@@ -35,5 +36,6 @@ void cmpct_init(void);
 void cmpct_dump(void);
 void cmpct_test(void);
 void cmpct_trim(void);
+size_t cmpct_get_free(void);
 
 __END_CDECLS;
@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Heap allocation profiler.
+ *
+ * While enabled, every allocation that goes through the heap wrapper is
+ * recorded against its call site and a power of two size class. Live
+ * allocations are kept in a fixed hash table keyed by pointer so frees can be
+ * charged back to the site that made them. Allocations that had to grow the
+ * heap are counted too, which is usually the interesting bit when chasing
+ * fragmentation. Everything is fixed size; anything that doesn't fit is
+ * counted as dropped rather than tracked.
+ */
+#include "heap_profile.h"
+
+#if HEAP_PROFILE
+
+#include <debug.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <kernel/spinlock.h>
+#include <lib/page_alloc.h>
+
+/* must be powers of two */
+#ifndef HEAP_PROFILE_SITES
+#define HEAP_PROFILE_SITES 256
+#endif
+#ifndef HEAP_PROFILE_LIVE
+#define HEAP_PROFILE_LIVE 4096
+#endif
+
+/* size class n holds allocations of (2^(n-1), 2^n] bytes */
+#define HEAP_PROFILE_CLASSES (sizeof(size_t) * 8 + 1)
+
+struct heap_profile_site {
+    void *caller;
+    uint allocs;
+    uint frees;
+    uint grows;
+    size_t bytes;
+    size_t peak_bytes;
+    size_t total_bytes;
+};
+
+struct heap_profile_live {
+    void *ptr;
+    size_t size;
+    struct heap_profile_site *site;
+};
+
+struct heap_profile_class {
+    uint allocs;
+    uint live;
+};
+
+bool heap_profile_enabled;
+
+static spin_lock_t profile_lock = SPIN_LOCK_INITIAL_VALUE;
+
+static struct heap_profile_site sites[HEAP_PROFILE_SITES];
+static struct heap_profile_live live[HEAP_PROFILE_LIVE];
+static struct heap_profile_class classes[HEAP_PROFILE_CLASSES];
+static struct heap_profile_totals totals;
+
+struct heap_profile_totals {
+    uint allocs;
+    uint frees;
+    uint grows;
+    uint dropped;
+    uint live_count;
+    uint peak_count;
+    size_t bytes;
+    size_t peak_bytes;
+};
+
+static inline uint hash_ptr(const void *ptr)
+{
+    uintptr_t x = (uintptr_t)ptr;
+    x ^= x >> 16;
+    x *= 0x45d9f3b;
+    x ^= x >> 16;
+    return (uint)x;
+}
+
+static inline uint size_class(size_t size)
+{
+    if (size <= 1)
+        return 0;
+    return sizeof(size_t) * 8 - __builtin_clzl(size - 1);
+}
+
+static struct heap_profile_site *find_site(void *caller)
+{
+    uint i = hash_ptr(caller) & (HEAP_PROFILE_SITES - 1);
+
+    for (uint n = 0; n < HEAP_PROFILE_SITES; n++) {
+        struct heap_profile_site *site = &sites[i];
+        if (site->caller == caller)
+            return site;
+        if (!site->caller) {
+            site->caller = caller;
+            return site;
+        }
+        i = (i + 1) & (HEAP_PROFILE_SITES - 1);
+    }
+
+    return NULL;
+}
+
+static struct heap_profile_live *find_live(const void *ptr)
+{
+    uint i = hash_ptr(ptr) & (HEAP_PROFILE_LIVE - 1);
+
+    while (live[i].ptr) {
+        if (live[i].ptr == ptr)
+            return &live[i];
+        i = (i + 1) & (HEAP_PROFILE_LIVE - 1);
+    }
+
+    return NULL;
+}
+
+/* linear probing delete, pull later entries of the chain back into the hole */
+static void remove_live(struct heap_profile_live *entry)
+{
+    uint hole = entry - live;
+    uint i = hole;
+
+    for (;;) {
+        i = (i + 1) & (HEAP_PROFILE_LIVE - 1);
+        if (!live[i].ptr)
+            break;
+
+        /* leave entries whose home slot is between the hole and here */
+        uint home = hash_ptr(live[i].ptr) & (HEAP_PROFILE_LIVE - 1);
+        if (hole <= i ? (hole < home && home <= i) : (hole < home || home <= i))
+            continue;
+
+        live[hole] = live[i];
+        hole = i;
+    }
+
+    live[hole].ptr = NULL;
+}
+
+void heap_profile_alloc(void *caller, void *ptr, size_t size, size_t pages_before)
+{
+    if (!ptr)
+        return;
+
+    bool grew = page_alloc_pages_out() > pages_before;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&profile_lock, state);
+
+    totals.allocs++;
+    if (grew)
+        totals.grows++;
+
+    struct heap_profile_site *site = find_site(caller);
+
+    /* keep the table at most 3/4 full so probe chains stay short */
+    if (!site || totals.live_count >= HEAP_PROFILE_LIVE * 3 / 4) {
+        totals.dropped++;
+        goto done;
+    }
+
+    struct heap_profile_class *class = &classes[size_class(size)];
+    class->allocs++;
+    class->live++;
+
+    site->allocs++;
+    site->bytes += size;
+    site->total_bytes += size;
+    site->peak_bytes = MAX(site->peak_bytes, site->bytes);
+    if (grew)
+        site->grows++;
+
+    totals.live_count++;
+    totals.peak_count = MAX(totals.peak_count, totals.live_count);
+    totals.bytes += size;
+    totals.peak_bytes = MAX(totals.peak_bytes, totals.bytes);
+
+    uint i = hash_ptr(ptr) & (HEAP_PROFILE_LIVE - 1);
+    while (live[i].ptr) {
+        DEBUG_ASSERT(live[i].ptr != ptr);
+        i = (i + 1) & (HEAP_PROFILE_LIVE - 1);
+    }
+    live[i].ptr = ptr;
+    live[i].size = size;
+    live[i].site = site;
+
+done:
+    spin_unlock_irqrestore(&profile_lock, state);
+}
+
+void heap_profile_free(void *ptr)
+{
+    /* called for every free, so don't bother locking when nothing is tracked */
+    if (!ptr || (!heap_profile_enabled && totals.live_count == 0))
+        return;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&profile_lock, state);
+
+    totals.frees++;
+
+    /* allocations from before the profiler started aren't in the table */
+    struct heap_profile_live *entry = find_live(ptr);
+    if (entry) {
+        struct heap_profile_site *site = entry->site;
+        site->frees++;
+        site->bytes -= entry->size;
+
+        classes[size_class(entry->size)].live--;
+
+        totals.live_count--;
+        totals.bytes -= entry->size;
+
+        remove_live(entry);
+    }
+
+    spin_unlock_irqrestore(&profile_lock, state);
+}
+
+void heap_profile_start(void)
+{
+    heap_profile_enabled = true;
+}
+
+void heap_profile_stop(void)
+{
+    heap_profile_enabled = false;
+}
+
+void heap_profile_reset(void)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&profile_lock, state);
+
+    memset(sites, 0, sizeof(sites));
+    memset(live, 0, sizeof(live));
+    memset(classes, 0, sizeof(classes));
+    memset(&totals, 0, sizeof(totals));
+
+    spin_unlock_irqrestore(&profile_lock, state);
+}
+
+static int site_compare(const void *_a, const void *_b)
+{
+    const struct heap_profile_site *a = _a;
+    const struct heap_profile_site *b = _b;
+
+    /* live bytes first, then how many times the site grew the heap */
+    if (a->bytes != b->bytes)
+        return (a->bytes < b->bytes) ? 1 : -1;
+    if (a->grows != b->grows)
+        return (a->grows < b->grows) ? 1 : -1;
+    return (a->allocs < b->allocs) ? 1 : (a->allocs > b->allocs) ? -1 : 0;
+}
+
+void heap_profile_dump(void)
+{
+    /* snapshot so nothing gets printed with the lock held */
+    static struct heap_profile_site snapshot[HEAP_PROFILE_SITES];
+    struct heap_profile_class class_snapshot[HEAP_PROFILE_CLASSES];
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&profile_lock, state);
+    memcpy(snapshot, sites, sizeof(snapshot));
+    memcpy(class_snapshot, classes, sizeof(class_snapshot));
+    struct heap_profile_totals t = totals;
+    spin_unlock_irqrestore(&profile_lock, state);
+
+    printf("heap profile is %s\n", heap_profile_enabled ? "on" : "off");
+    printf("\tallocs %u frees %u heap grows %u dropped %u\n", t.allocs, t.frees, t.grows, t.dropped);
+    printf("\tlive %u allocations %zu bytes, peak %u allocations %zu bytes\n",
+           t.live_count, t.bytes, t.peak_count, t.peak_bytes);
+
+    printf("\tsize classes:\n");
+    printf("\t\t%12s %10s %10s\n", "size <=", "allocs", "live");
+    for (uint i = 0; i < HEAP_PROFILE_CLASSES; i++) {
+        if (class_snapshot[i].allocs == 0)
+            continue;
+        printf("\t\t%12zu %10u %10u\n", (size_t)1 << i, class_snapshot[i].allocs, class_snapshot[i].live);
+    }
+
+    qsort(snapshot, HEAP_PROFILE_SITES, sizeof(snapshot[0]), site_compare);
+
+    printf("\tcall sites:\n");
+    printf("\t\t%-18s %8s %8s %6s %10s %10s %12s\n",
+           "caller", "allocs", "frees", "grows", "live", "peak", "total");
+    for (uint i = 0; i < HEAP_PROFILE_SITES; i++) {
+        const struct heap_profile_site *site = &snapshot[i];
+        if (!site->caller)
+            continue;
+        printf("\t\t%-18p %8u %8u %6u %10zu %10zu %12zu\n", site->caller, site->allocs,
+               site->frees, site->grows, site->bytes, site->peak_bytes, site->total_bytes);
+    }
+}
+
+#endif
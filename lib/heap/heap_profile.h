@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* allocation tracking for the heap wrapper, compiled in with HEAP_PROFILE=1 */
+#ifndef HEAP_PROFILE
+#define HEAP_PROFILE 0
+#endif
+
+__BEGIN_CDECLS
+
+#if HEAP_PROFILE
+
+extern bool heap_profile_enabled;
+
+/* pages_before is page_alloc_pages_out() sampled before the allocation, to spot heap growth */
+void heap_profile_alloc(void *caller, void *ptr, size_t size, size_t pages_before);
+void heap_profile_free(void *ptr);
+
+void heap_profile_start(void);
+void heap_profile_stop(void);
+void heap_profile_reset(void);
+void heap_profile_dump(void);
+
+#endif
+
+__END_CDECLS
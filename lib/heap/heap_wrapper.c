@@ -32,9 +32,29 @@
 #include <kernel/spinlock.h>
 #include <lib/console.h>
 #include <lib/page_alloc.h>
+#include <lk/init.h>
+#include <kernel/thread.h>
+
+#include "heap_profile.h"
 
 #define LOCAL_TRACE 0
 
+/* drain the delayed free list and trim the heap from a background thread
+ * instead of on the allocation paths */
+#ifndef HEAP_MAINT_THREAD
+#define HEAP_MAINT_THREAD 0
+#endif
+
+/* how often the maintenance thread wakes up, in ms */
+#ifndef HEAP_MAINT_INTERVAL
+#define HEAP_MAINT_INTERVAL 1000
+#endif
+
+/* trim once this many more bytes are free than after the last trim */
+#ifndef HEAP_TRIM_WATERMARK
+#define HEAP_TRIM_WATERMARK (256 * 1024)
+#endif
+
 /* heap tracing */
 #if LK_DEBUGLEVEL > 0
 static bool heap_trace = false;
@@ -42,6 +62,19 @@ static bool heap_trace = false;
 #define heap_trace (false)
 #endif
 
+/* allocation profiling, see heap_profile.c */
+#if HEAP_PROFILE
+#define PROFILE_BEGIN() \
+    size_t _profile_pages = heap_profile_enabled ? page_alloc_pages_out() : 0
+#define PROFILE_ALLOC(caller, ptr, size) \
+    do { if (heap_profile_enabled) heap_profile_alloc(caller, ptr, size, _profile_pages); } while (0)
+#define PROFILE_FREE(ptr) heap_profile_free(ptr)
+#else
+#define PROFILE_BEGIN() do {} while (0)
+#define PROFILE_ALLOC(caller, ptr, size) do {} while (0)
+#define PROFILE_FREE(ptr) do {} while (0)
+#endif
+
 /* delayed free list */
 struct list_node delayed_free_list = LIST_INITIAL_VALUE(delayed_free_list);
 spin_lock_t delayed_free_lock = SPIN_LOCK_INITIAL_VALUE;
@@ -72,6 +105,13 @@ static inline void HEAP_INIT(void)
 }
 #define HEAP_DUMP miniheap_dump
 #define HEAP_TRIM miniheap_trim
+static inline size_t HEAP_GET_FREE(void)
+{
+    struct miniheap_stats stats;
+
+    miniheap_get_stats(&stats);
+    return stats.heap_free;
+}
 
 /* end miniheap implementation */
 #elif WITH_LIB_HEAP_CMPCTMALLOC
@@ -85,6 +125,7 @@ static inline void HEAP_INIT(void)
 #define HEAP_INIT cmpct_init
 #define HEAP_DUMP cmpct_dump
 #define HEAP_TRIM cmpct_trim
+#define HEAP_GET_FREE cmpct_get_free
 static inline void *HEAP_CALLOC(size_t n, size_t s)
 {
     size_t realsize = n * s;
@@ -129,8 +170,32 @@ static inline void HEAP_DUMP(void)
 }
 
 static inline void HEAP_TRIM(void) { dlmalloc_trim(0); }
+static inline size_t HEAP_GET_FREE(void) { return dlmallinfo().fordblks; }
 
 /* end dlmalloc implementation */
+#elif WITH_LIB_HEAP_TLSF
+/* tlsf implementation */
+#include <lib/tlsf.h>
+
+#define HEAP_MEMALIGN(boundary, s) tlsf_memalign(s, boundary)
+#define HEAP_MALLOC tlsf_alloc
+#define HEAP_REALLOC tlsf_realloc
+#define HEAP_FREE tlsf_free
+#define HEAP_INIT tlsf_init
+#define HEAP_DUMP tlsf_dump
+#define HEAP_TRIM tlsf_trim
+#define HEAP_GET_FREE tlsf_get_free
+static inline void *HEAP_CALLOC(size_t n, size_t s)
+{
+    size_t realsize = n * s;
+
+    void *ptr = tlsf_alloc(realsize);
+    if (likely(ptr))
+        memset(ptr, 0, realsize);
+    return ptr;
+}
+
+/* end tlsf implementation */
 #else
 #error need to select valid heap implementation or provide wrapper
 #endif
@@ -152,10 +217,34 @@ static void heap_free_delayed_list(void)
 
     while ((node = list_remove_head(&list))) {
         LTRACEF("freeing node %p\n", node);
+        PROFILE_FREE(node);
         HEAP_FREE(node);
     }
 }
 
+/* deal with the pending free list on the way into an allocation */
+static inline void heap_drain_delayed(void)
+{
+#if !HEAP_MAINT_THREAD
+    if (unlikely(!list_is_empty(&delayed_free_list))) {
+        heap_free_delayed_list();
+    }
+#endif
+}
+
+/* with the maintenance thread draining the list the allocation paths only
+ * fall back to it when they come up empty */
+static inline bool heap_retry_delayed(void *ptr)
+{
+#if HEAP_MAINT_THREAD
+    if (unlikely(!ptr && !list_is_empty(&delayed_free_list))) {
+        heap_free_delayed_list();
+        return true;
+    }
+#endif
+    return false;
+}
+
 void heap_init(void)
 {
     HEAP_INIT();
@@ -175,12 +264,13 @@ void *malloc(size_t size)
 {
     LTRACEF("size %zd\n", size);
 
-    // deal with the pending free list
-    if (unlikely(!list_is_empty(&delayed_free_list))) {
-        heap_free_delayed_list();
-    }
+    heap_drain_delayed();
 
+    PROFILE_BEGIN();
     void *ptr = HEAP_MALLOC(size);
+    if (heap_retry_delayed(ptr))
+        ptr = HEAP_MALLOC(size);
+    PROFILE_ALLOC(__GET_CALLER(), ptr, size);
     if (heap_trace)
         printf("caller %p malloc %zu -> %p\n", __GET_CALLER(), size, ptr);
     return ptr;
@@ -190,12 +280,13 @@ void *memalign(size_t boundary, size_t size)
 {
     LTRACEF("boundary %zu, size %zd\n", boundary, size);
 
-    // deal with the pending free list
-    if (unlikely(!list_is_empty(&delayed_free_list))) {
-        heap_free_delayed_list();
-    }
+    heap_drain_delayed();
 
+    PROFILE_BEGIN();
     void *ptr = HEAP_MEMALIGN(boundary, size);
+    if (heap_retry_delayed(ptr))
+        ptr = HEAP_MEMALIGN(boundary, size);
+    PROFILE_ALLOC(__GET_CALLER(), ptr, size);
     if (heap_trace)
         printf("caller %p memalign %zu, %zu -> %p\n", __GET_CALLER(), boundary, size, ptr);
     return ptr;
@@ -205,12 +296,13 @@ void *calloc(size_t count, size_t size)
 {
     LTRACEF("count %zu, size %zd\n", count, size);
 
-    // deal with the pending free list
-    if (unlikely(!list_is_empty(&delayed_free_list))) {
-        heap_free_delayed_list();
-    }
+    heap_drain_delayed();
 
+    PROFILE_BEGIN();
     void *ptr = HEAP_CALLOC(count, size);
+    if (heap_retry_delayed(ptr))
+        ptr = HEAP_CALLOC(count, size);
+    PROFILE_ALLOC(__GET_CALLER(), ptr, count * size);
     if (heap_trace)
         printf("caller %p calloc %zu, %zu -> %p\n", __GET_CALLER(), count, size, ptr);
     return ptr;
@@ -220,12 +312,15 @@ void *realloc(void *ptr, size_t size)
 {
     LTRACEF("ptr %p, size %zd\n", ptr, size);
 
-    // deal with the pending free list
-    if (unlikely(!list_is_empty(&delayed_free_list))) {
-        heap_free_delayed_list();
-    }
+    heap_drain_delayed();
 
+    PROFILE_BEGIN();
     void *ptr2 = HEAP_REALLOC(ptr, size);
+    if (size > 0 && heap_retry_delayed(ptr2))
+        ptr2 = HEAP_REALLOC(ptr, size);
+    if (ptr2 || size == 0)
+        PROFILE_FREE(ptr);
+    PROFILE_ALLOC(__GET_CALLER(), ptr2, size);
     if (heap_trace)
         printf("caller %p realloc %p, %zu -> %p\n", __GET_CALLER(), ptr, size, ptr2);
     return ptr2;
@@ -237,6 +332,7 @@ void free(void *ptr)
     if (heap_trace)
         printf("caller %p free %p\n", __GET_CALLER(), ptr);
 
+    PROFILE_FREE(ptr);
     HEAP_FREE(ptr);
 }
 
@@ -255,6 +351,45 @@ void heap_delayed_free(void *ptr)
     spin_unlock_irqrestore(&delayed_free_lock, state);
 }
 
+#if HEAP_MAINT_THREAD
+static int heap_maint_thread(void *arg)
+{
+    /* free bytes right after the last trim, anything much above that is
+     * probably pages we can give back */
+    size_t baseline = 0;
+
+    for (;;) {
+        thread_sleep(HEAP_MAINT_INTERVAL);
+
+        if (!list_is_empty(&delayed_free_list))
+            heap_free_delayed_list();
+
+        size_t avail = HEAP_GET_FREE();
+        if (avail < baseline)
+            baseline = avail;
+
+        if (avail - baseline >= HEAP_TRIM_WATERMARK) {
+            LTRACEF("trimming, %zu bytes free\n", avail);
+            HEAP_TRIM();
+            baseline = HEAP_GET_FREE();
+        }
+    }
+
+    return 0;
+}
+
+static void heap_maint_init(uint level)
+{
+    thread_t *t = thread_create("heap maint", &heap_maint_thread, NULL, LOWEST_PRIORITY, DEFAULT_STACK_SIZE);
+    if (!t)
+        panic("unable to create heap maintenance thread\n");
+
+    thread_detach_and_resume(t);
+}
+
+LK_INIT_HOOK(heap_maint, &heap_maint_init, LK_INIT_LEVEL_THREADING);
+#endif
+
 static void heap_dump(void)
 {
     HEAP_DUMP();
@@ -347,6 +482,9 @@ usage:
         printf("\t%s info\n", argv[0].str);
         printf("\t%s trace\n", argv[0].str);
         printf("\t%s trim\n", argv[0].str);
+#if HEAP_PROFILE
+        printf("\t%s profile [start|stop|reset]\n", argv[0].str);
+#endif
         printf("\t%s alloc <size> [alignment]\n", argv[0].str);
         printf("\t%s realloc <ptr> <size>\n", argv[0].str);
         printf("\t%s free <address>\n", argv[0].str);
@@ -362,6 +500,20 @@ usage:
         printf("heap trace is now %s\n", heap_trace ? "on" : "off");
     } else if (strcmp(argv[1].str, "trim") == 0) {
         heap_trim();
+#if HEAP_PROFILE
+    } else if (strcmp(argv[1].str, "profile") == 0) {
+        if (argc < 3) {
+            heap_profile_dump();
+        } else if (strcmp(argv[2].str, "start") == 0) {
+            heap_profile_start();
+        } else if (strcmp(argv[2].str, "stop") == 0) {
+            heap_profile_stop();
+        } else if (strcmp(argv[2].str, "reset") == 0) {
+            heap_profile_reset();
+        } else {
+            goto usage;
+        }
+#endif
     } else if (strcmp(argv[1].str, "alloc") == 0) {
         if (argc < 3) goto notenoughargs;
 
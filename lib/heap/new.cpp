@@ -23,15 +23,169 @@
 #include <new.h>
 #include <debug.h>
 #include <lib/heap.h>
+#include <lib/pool.h>
+#include <arch/ops.h>
+#include <kernel/spinlock.h>
 
-void *operator new(size_t s)
+/*
+ * Small objects come out of per size class pools, each behind its own spinlock,
+ * so the common new/delete pairs never touch the heap lock. A class's storage
+ * is one block taken from the heap the first time the class is used; a pointer
+ * is a pool object if it falls inside one of those blocks, which lets a plain
+ * delete of a pointer of unknown size find its way home. Anything larger than
+ * the biggest class, or allocated while its class is full, goes to the heap.
+ */
+#ifndef NEW_POOL_CLASS_BYTES
+#define NEW_POOL_CLASS_BYTES 2048
+#endif
+
+#define NEW_POOL_ALIGN 16
+
+struct new_pool {
+    size_t size;
+    spin_lock_t lock;
+    pool_t pool;
+    uint8_t *base;
+    uint8_t *end;
+    bool failed;
+};
+
+static struct new_pool new_pools[] = {
+    { 16, SPIN_LOCK_INITIAL_VALUE, {}, NULL, NULL, false },
+    { 32, SPIN_LOCK_INITIAL_VALUE, {}, NULL, NULL, false },
+    { 64, SPIN_LOCK_INITIAL_VALUE, {}, NULL, NULL, false },
+    { 128, SPIN_LOCK_INITIAL_VALUE, {}, NULL, NULL, false },
+    { 256, SPIN_LOCK_INITIAL_VALUE, {}, NULL, NULL, false },
+};
+
+#define NEW_POOL_COUNT (sizeof(new_pools) / sizeof(new_pools[0]))
+
+static spin_lock_t new_pool_init_lock = SPIN_LOCK_INITIAL_VALUE;
+
+static struct new_pool *new_pool_for_size(size_t s)
+{
+    for (uint i = 0; i < NEW_POOL_COUNT; i++) {
+        if (s <= new_pools[i].size)
+            return &new_pools[i];
+    }
+    return NULL;
+}
+
+static struct new_pool *new_pool_for_ptr(void *p)
+{
+    uint8_t *ptr = (uint8_t *)p;
+
+    for (uint i = 0; i < NEW_POOL_COUNT; i++) {
+        struct new_pool *np = &new_pools[i];
+        if (ptr >= np->base && ptr < np->end)
+            return np;
+    }
+    return NULL;
+}
+
+/* carve the class's storage out of the heap, once */
+static bool new_pool_setup(struct new_pool *np)
+{
+    if (np->failed)
+        return false;
+
+    /* allocate outside the lock, the loser of a setup race gives its copy back */
+    size_t count = NEW_POOL_CLASS_BYTES / np->size;
+    size_t len = POOL_STORAGE_SIZE(np->size, NEW_POOL_ALIGN, count);
+    uint8_t *storage = (uint8_t *)memalign(POOL_STORAGE_ALIGN(np->size, NEW_POOL_ALIGN), len);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&new_pool_init_lock, state);
+
+    if (!np->base && storage) {
+        pool_init(&np->pool, np->size, NEW_POOL_ALIGN, count, storage);
+        np->end = storage + len;
+        /* base is what the fast paths look at, publish it last */
+        smp_wmb();
+        np->base = storage;
+        storage = NULL;
+    } else if (!np->base) {
+        np->failed = true;
+    }
+
+    spin_unlock_irqrestore(&new_pool_init_lock, state);
+
+    if (storage)
+        free(storage);
+
+    return np->base != NULL;
+}
+
+static void *new_alloc(size_t s)
 {
+    struct new_pool *np = new_pool_for_size(s);
+
+    if (np && (np->base || new_pool_setup(np))) {
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&np->lock, state);
+        void *p = pool_alloc(&np->pool);
+        spin_unlock_irqrestore(&np->lock, state);
+
+        if (p)
+            return p;
+    }
+
     return malloc(s);
 }
 
+static void new_free_pool(struct new_pool *np, void *p)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&np->lock, state);
+    pool_free(&np->pool, p);
+    spin_unlock_irqrestore(&np->lock, state);
+}
+
+static void new_free(void *p)
+{
+    if (!p)
+        return;
+
+    struct new_pool *np = new_pool_for_ptr(p);
+    if (np)
+        new_free_pool(np, p);
+    else
+        free(p);
+}
+
+/* with the size known only the one class needs checking */
+static void new_free_sized(void *p, size_t s)
+{
+    if (!p)
+        return;
+
+    struct new_pool *np = new_pool_for_size(s);
+    if (np && (uint8_t *)p >= np->base && (uint8_t *)p < np->end)
+        new_free_pool(np, p);
+    else
+        free(p);
+}
+
+const std::nothrow_t std::nothrow = {};
+
+void *operator new(size_t s)
+{
+    return new_alloc(s);
+}
+
 void *operator new[](size_t s)
 {
-    return malloc(s);
+    return new_alloc(s);
+}
+
+void *operator new(size_t s, const std::nothrow_t &) noexcept
+{
+    return new_alloc(s);
+}
+
+void *operator new[](size_t s, const std::nothrow_t &) noexcept
+{
+    return new_alloc(s);
 }
 
 void *operator new(size_t , void *p)
@@ -41,11 +195,21 @@ void *operator new(size_t , void *p)
 
 void operator delete(void *p)
 {
-    return free(p);
+    return new_free(p);
 }
 
 void operator delete[](void *p)
 {
-    return free(p);
+    return new_free(p);
 }
 
+void operator delete(void *p, size_t s)
+{
+    return new_free_sized(p, s);
+}
+
+void operator delete[](void *p, size_t)
+{
+    /* the size of an array delete may include a cookie, don't trust it */
+    return new_free(p);
+}
@@ -27,6 +27,7 @@
 #include <assert.h>
 #include <string.h>
 #include <trace.h>
+#include <arch/ops.h>
 #if WITH_KERNEL_VM
 #include <kernel/vm.h>
 #else
@@ -50,15 +51,19 @@
 
 #endif
 
+/* pages currently handed out through page_alloc */
+static volatile int pages_out;
+
 void *page_alloc(size_t pages, int arena)
 {
 #if WITH_KERNEL_VM
     void *result = pmm_alloc_kpages(pages, NULL);
-    return result;
 #else
     void *result = novm_alloc_pages(pages, arena);
-    return result;
 #endif
+    if (result)
+        atomic_add(&pages_out, (int)pages);
+    return result;
 }
 
 void page_free(void *ptr, size_t pages)
@@ -70,6 +75,12 @@ void page_free(void *ptr, size_t pages)
 #else
     novm_free_pages(ptr, pages);
 #endif
+    atomic_add(&pages_out, -(int)pages);
+}
+
+size_t page_alloc_pages_out(void)
+{
+    return (size_t)pages_out;
 }
 
 int page_get_arenas(struct page_range *ranges, int number_of_ranges)
@@ -132,6 +143,7 @@ static void page_alloc_dump(void)
 #else
     dprintf(INFO, "Page allocator is based on novm\n");
 #endif
+    dprintf(INFO, "%zu pages allocated\n", page_alloc_pages_out());
 }
 
 #endif
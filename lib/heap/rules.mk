@@ -5,6 +5,7 @@ GLOBAL_INCLUDES += $(LOCAL_DIR)/include
 MODULE := $(LOCAL_DIR)
 
 MODULE_SRCS += \
+	$(LOCAL_DIR)/heap_profile.c \
 	$(LOCAL_DIR)/heap_wrapper.c \
 	$(LOCAL_DIR)/page_alloc.c
 
@@ -26,6 +27,13 @@ endif
 ifeq ($(LK_HEAP_IMPLEMENTATION),cmpctmalloc)
 MODULE_DEPS := lib/heap/cmpctmalloc
 endif
+ifeq ($(LK_HEAP_IMPLEMENTATION),tlsf)
+MODULE_DEPS := lib/heap/tlsf
+endif
+
+ifeq ($(WITH_CPP_SUPPORT),true)
+MODULE_DEPS += lib/pool
+endif
 
 GLOBAL_DEFINES += LK_HEAP_IMPLEMENTATION=$(LK_HEAP_IMPLEMENTATION)
 
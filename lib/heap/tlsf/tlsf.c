@@ -0,0 +1,585 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <debug.h>
+#include <err.h>
+#include <trace.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <list.h>
+#include <kernel/mutex.h>
+#include <lib/tlsf.h>
+#include <lib/heap.h>
+#include <lib/page_alloc.h>
+
+// Two level segregated fit allocator.
+//
+// Free blocks are kept in lists indexed first by the power of two of their
+// size and then linearly by the next TLSF_SL_LOG2 bits. A bitmap per level
+// finds the smallest non empty list that is big enough with a couple of find
+// first set instructions, so allocating and freeing take constant time no
+// matter how fragmented the heap is.  Blocks have a two word header and are
+// coalesced with their physical neighbours as soon as they are freed.
+//
+// The only unbounded work is going to the page allocator when the heap runs
+// dry, and trimming. Hard real-time users should set TLSF_HEAP_RESERVE to
+// cover their peak use so that never happens after boot.
+
+#define LOCAL_TRACE 0
+
+#ifndef TLSF_SL_LOG2
+#define TLSF_SL_LOG2 5
+#endif
+
+// Taken from the page allocator at init and never given back.
+#ifndef TLSF_HEAP_RESERVE
+#define TLSF_HEAP_RESERVE 0
+#endif
+
+#if WITH_KERNEL_VM && !defined(TLSF_HEAP_GROW_SIZE)
+#define TLSF_HEAP_GROW_SIZE (1 * 1024 * 1024)
+#elif !defined(TLSF_HEAP_GROW_SIZE)
+#define TLSF_HEAP_GROW_SIZE (4 * 1024)
+#endif
+
+#define SL_COUNT (1u << TLSF_SL_LOG2)
+
+// Two words, which also keeps every payload two word aligned.
+#define ALIGN_SIZE (2 * sizeof(size_t))
+#define ALIGN_LOG2 (sizeof(size_t) == 8 ? 4 : 3)
+
+// Sizes below SMALL_BLOCK all land in first level 0, one list per ALIGN_SIZE.
+#define FL_SHIFT (TLSF_SL_LOG2 + ALIGN_LOG2)
+#define SMALL_BLOCK ((size_t)1 << FL_SHIFT)
+
+// Blocks are smaller than 1 << FL_MAX.
+#define FL_MAX (sizeof(size_t) == 8 ? 36 : 31)
+#define FL_COUNT (FL_MAX - FL_SHIFT + 1)
+#define BLOCK_MAX (((size_t)1 << FL_MAX) - ALIGN_SIZE)
+
+STATIC_ASSERT(TLSF_SL_LOG2 >= 1 && TLSF_SL_LOG2 <= 5);
+STATIC_ASSERT(FL_COUNT <= 32);
+
+typedef struct block {
+    // Physically preceding block, NULL for the first one in a pool.
+    struct block *prev_phys;
+    // Payload bytes, with BLOCK_FREE in the low bit.
+    size_t size;
+    // Only valid while free.
+    struct block *next_free;
+    struct block *prev_free;
+} block_t;
+
+#define BLOCK_FREE 1
+#define BLOCK_HDR offsetof(block_t, next_free)
+#define BLOCK_MIN (sizeof(block_t) - BLOCK_HDR)
+
+STATIC_ASSERT(BLOCK_HDR == ALIGN_SIZE);
+STATIC_ASSERT(BLOCK_MIN == ALIGN_SIZE);
+
+// Each span of memory the heap manages starts with one of these, followed by
+// its blocks and a zero sized allocated block that stops coalescing.
+typedef struct pool {
+    struct list_node node;
+    size_t len;
+    bool trimmable; // came from heap growth and can go back to the page allocator
+} pool_t;
+
+#define POOL_HDR ROUNDUP(sizeof(pool_t), ALIGN_SIZE)
+
+static struct {
+    mutex_t lock;
+    uint32_t fl_bitmap;
+    uint32_t sl_bitmap[FL_COUNT];
+    block_t *free_lists[FL_COUNT][SL_COUNT];
+    struct list_node pools;
+    size_t size;
+    size_t remaining;
+} theheap;
+
+static void lock(void)
+{
+    mutex_acquire(&theheap.lock);
+}
+
+static void unlock(void)
+{
+    mutex_release(&theheap.lock);
+}
+
+static inline size_t block_size(const block_t *b)
+{
+    return b->size & ~(size_t)BLOCK_FREE;
+}
+
+static inline bool block_is_free(const block_t *b)
+{
+    return b->size & BLOCK_FREE;
+}
+
+static inline void *block_payload(block_t *b)
+{
+    return (char *)b + BLOCK_HDR;
+}
+
+static inline block_t *payload_block(void *ptr)
+{
+    return (block_t *)((char *)ptr - BLOCK_HDR);
+}
+
+static inline block_t *block_next(block_t *b)
+{
+    return (block_t *)((char *)b + BLOCK_HDR + block_size(b));
+}
+
+static inline block_t *pool_first_block(pool_t *pool)
+{
+    return (block_t *)((char *)pool + POOL_HDR);
+}
+
+static inline uint size_fls(size_t x)
+{
+    return sizeof(long) * 8 - 1 - __builtin_clzl(x);
+}
+
+// The list a free block of this size lives on.
+static void mapping_insert(size_t size, uint *fl, uint *sl)
+{
+    if (size < SMALL_BLOCK) {
+        *fl = 0;
+        *sl = size / (SMALL_BLOCK / SL_COUNT);
+    } else {
+        uint f = size_fls(size);
+        *sl = (size >> (f - TLSF_SL_LOG2)) ^ SL_COUNT;
+        *fl = f - FL_SHIFT + 1;
+    }
+}
+
+// The first list where every block is at least this big.
+static void mapping_search(size_t size, uint *fl, uint *sl)
+{
+    if (size >= SMALL_BLOCK)
+        size += ((size_t)1 << (size_fls(size) - TLSF_SL_LOG2)) - 1;
+    mapping_insert(size, fl, sl);
+}
+
+static block_t *find_free(uint *fl, uint *sl)
+{
+    uint32_t sl_map = theheap.sl_bitmap[*fl] & (~0u << *sl);
+
+    if (!sl_map) {
+        uint32_t fl_map = theheap.fl_bitmap & (~0u << (*fl + 1));
+        if (!fl_map)
+            return NULL;
+        *fl = __builtin_ctz(fl_map);
+        sl_map = theheap.sl_bitmap[*fl];
+        DEBUG_ASSERT(sl_map);
+    }
+    *sl = __builtin_ctz(sl_map);
+
+    return theheap.free_lists[*fl][*sl];
+}
+
+static void insert_free(block_t *b)
+{
+    uint fl, sl;
+    size_t size = block_size(b);
+
+    DEBUG_ASSERT(!block_is_free(b));
+    DEBUG_ASSERT(size >= BLOCK_MIN && size <= BLOCK_MAX);
+
+    mapping_insert(size, &fl, &sl);
+
+    block_t *head = theheap.free_lists[fl][sl];
+    b->next_free = head;
+    b->prev_free = NULL;
+    if (head)
+        head->prev_free = b;
+    theheap.free_lists[fl][sl] = b;
+    theheap.fl_bitmap |= 1u << fl;
+    theheap.sl_bitmap[fl] |= 1u << sl;
+
+    b->size |= BLOCK_FREE;
+    theheap.remaining += size;
+}
+
+static void remove_free(block_t *b)
+{
+    uint fl, sl;
+    size_t size = block_size(b);
+
+    DEBUG_ASSERT(block_is_free(b));
+
+    mapping_insert(size, &fl, &sl);
+
+    if (b->next_free)
+        b->next_free->prev_free = b->prev_free;
+    if (b->prev_free) {
+        b->prev_free->next_free = b->next_free;
+    } else {
+        DEBUG_ASSERT(theheap.free_lists[fl][sl] == b);
+        theheap.free_lists[fl][sl] = b->next_free;
+        if (!b->next_free) {
+            theheap.sl_bitmap[fl] &= ~(1u << sl);
+            if (!theheap.sl_bitmap[fl])
+                theheap.fl_bitmap &= ~(1u << fl);
+        }
+    }
+
+    b->size &= ~(size_t)BLOCK_FREE;
+    theheap.remaining -= size;
+}
+
+// Fold b, which physically follows a, into a. Neither may be on a free list.
+static void absorb(block_t *a, block_t *b)
+{
+    DEBUG_ASSERT(block_next(a) == b);
+
+    a->size += BLOCK_HDR + block_size(b);
+    block_next(a)->prev_phys = a;
+}
+
+// Put an unlisted block back, coalescing it with free neighbours.
+static void release(block_t *b)
+{
+    block_t *prev = b->prev_phys;
+    if (prev && block_is_free(prev)) {
+        remove_free(prev);
+        absorb(prev, b);
+        b = prev;
+    }
+
+    block_t *next = block_next(b);
+    if (block_is_free(next)) {
+        remove_free(next);
+        absorb(b, next);
+    }
+
+    insert_free(b);
+}
+
+// Trim an allocated block to size, releasing the tail if it's big enough to be a block.
+static void split(block_t *b, size_t size)
+{
+    DEBUG_ASSERT(!block_is_free(b));
+    DEBUG_ASSERT(block_size(b) >= size);
+
+    size_t rest = block_size(b) - size;
+    if (rest < BLOCK_HDR + BLOCK_MIN)
+        return;
+
+    b->size = size;
+    block_t *r = block_next(b);
+    r->prev_phys = b;
+    r->size = rest - BLOCK_HDR;
+    block_next(r)->prev_phys = r;
+
+    release(r);
+}
+
+static void add_pool(void *base, size_t len, bool trimmable)
+{
+    uintptr_t start = ROUNDUP((uintptr_t)base, ALIGN_SIZE);
+    uintptr_t end = ROUNDDOWN((uintptr_t)base + len, ALIGN_SIZE);
+
+    if (end <= start || end - start < POOL_HDR + 2 * BLOCK_HDR + BLOCK_MIN)
+        return;
+
+    pool_t *pool = (pool_t *)start;
+    pool->len = end - start;
+    pool->trimmable = trimmable;
+    list_add_tail(&theheap.pools, &pool->node);
+    theheap.size += pool->len;
+
+    // The first block takes everything between the pool header and the sentinel.
+    size_t size = MIN(pool->len - POOL_HDR - 2 * BLOCK_HDR, BLOCK_MAX);
+    block_t *b = pool_first_block(pool);
+    b->prev_phys = NULL;
+    b->size = size;
+
+    block_t *sentinel = block_next(b);
+    sentinel->prev_phys = b;
+    sentinel->size = 0;
+
+    LTRACEF("pool %p len 0x%zx, first block %p size 0x%zx\n", pool, pool->len, b, size);
+
+    insert_free(b);
+}
+
+// Called with the lock held.
+static status_t heap_grow(size_t size)
+{
+    // enough that whichever list mapping_search() picks has a block in it
+    if (size >= SMALL_BLOCK)
+        size += (size_t)1 << (size_fls(size) - TLSF_SL_LOG2);
+    size += POOL_HDR + 2 * BLOCK_HDR;
+    size = ROUNDUP(MAX(size, (size_t)TLSF_HEAP_GROW_SIZE), PAGE_SIZE);
+
+    void *ptr = page_alloc(size / PAGE_SIZE, PAGE_ALLOC_ANY_ARENA);
+    if (!ptr)
+        return ERR_NO_MEMORY;
+
+    LTRACEF("growing heap by 0x%zx bytes, new ptr %p\n", size, ptr);
+    add_pool(ptr, size, true);
+
+    return NO_ERROR;
+}
+
+// The requested size as a block payload size, 0 if it can't be satisfied.
+static size_t adjust_size(size_t size)
+{
+    if (size > BLOCK_MAX / 2)
+        return 0;
+    return MAX(ROUNDUP(size, ALIGN_SIZE), BLOCK_MIN);
+}
+
+// Take a free block of at least size off its list, growing the heap if there is none.
+static block_t *locate_free(size_t size)
+{
+    uint fl, sl;
+
+    mapping_search(size, &fl, &sl);
+    if (fl >= FL_COUNT)
+        return NULL;
+
+    block_t *b = find_free(&fl, &sl);
+    if (!b) {
+        if (heap_grow(size) < 0)
+            return NULL;
+        mapping_search(size, &fl, &sl);
+        b = find_free(&fl, &sl);
+        if (!b)
+            return NULL;
+    }
+    DEBUG_ASSERT(block_size(b) >= size);
+
+    remove_free(b);
+    return b;
+}
+
+void *tlsf_alloc(size_t size)
+{
+    size = adjust_size(size);
+    if (size == 0)
+        return NULL;
+
+    lock();
+
+    void *ptr = NULL;
+    block_t *b = locate_free(size);
+    if (b) {
+        split(b, size);
+        ptr = block_payload(b);
+    }
+
+    unlock();
+
+    LTRACEF("size %zu -> %p\n", size, ptr);
+    return ptr;
+}
+
+void *tlsf_memalign(size_t size, size_t alignment)
+{
+    if (alignment <= ALIGN_SIZE)
+        return tlsf_alloc(size);
+    if ((alignment & (alignment - 1)) != 0 || alignment > BLOCK_MAX / 4)
+        return NULL;
+
+    size = adjust_size(size);
+    if (size == 0 || size > BLOCK_MAX / 2 - alignment)
+        return NULL;
+
+    // room to carve a free block off the front to get to the boundary
+    const size_t gap_min = BLOCK_HDR + BLOCK_MIN;
+
+    lock();
+
+    void *ptr = NULL;
+    block_t *b = locate_free(size + alignment + gap_min);
+    if (b) {
+        uintptr_t payload = (uintptr_t)block_payload(b);
+        uintptr_t aligned = ROUNDUP(payload, alignment);
+
+        if (aligned != payload) {
+            if (aligned - payload < gap_min)
+                aligned = ROUNDUP(payload + gap_min, alignment);
+            size_t gap = aligned - payload;
+
+            block_t *nb = payload_block((void *)aligned);
+            nb->prev_phys = b;
+            nb->size = block_size(b) - gap;
+            block_next(nb)->prev_phys = nb;
+            b->size = gap - BLOCK_HDR;
+            insert_free(b);
+            b = nb;
+        }
+
+        split(b, size);
+        ptr = block_payload(b);
+    }
+
+    unlock();
+
+    return ptr;
+}
+
+void tlsf_free(void *ptr)
+{
+    if (!ptr)
+        return;
+
+    lock();
+
+    block_t *b = payload_block(ptr);
+    DEBUG_ASSERT(!block_is_free(b));
+    release(b);
+
+    unlock();
+}
+
+void *tlsf_realloc(void *ptr, size_t size)
+{
+    if (!ptr)
+        return tlsf_alloc(size);
+    if (size == 0) {
+        tlsf_free(ptr);
+        return NULL;
+    }
+
+    size_t adjusted = adjust_size(size);
+    if (adjusted == 0)
+        return NULL;
+
+    lock();
+
+    block_t *b = payload_block(ptr);
+    size_t old_size = block_size(b);
+    DEBUG_ASSERT(!block_is_free(b));
+
+    // shrink in place, or grow into a free block right after this one
+    block_t *next = block_next(b);
+    if (adjusted > old_size && block_is_free(next) &&
+            old_size + BLOCK_HDR + block_size(next) >= adjusted) {
+        remove_free(next);
+        absorb(b, next);
+    }
+    if (adjusted <= block_size(b)) {
+        split(b, adjusted);
+        unlock();
+        return ptr;
+    }
+
+    unlock();
+
+    void *new_ptr = tlsf_alloc(size);
+    if (new_ptr) {
+        memcpy(new_ptr, ptr, old_size);
+        tlsf_free(ptr);
+    }
+    return new_ptr;
+}
+
+// Hand pools that are entirely free back to the page allocator.
+void tlsf_trim(void)
+{
+    LTRACE_ENTRY;
+
+    lock();
+
+    pool_t *pool, *temp;
+    list_for_every_entry_safe(&theheap.pools, pool, temp, pool_t, node) {
+        block_t *b = pool_first_block(pool);
+        if (!pool->trimmable || !block_is_free(b) || block_next(b)->size != 0)
+            continue;
+
+        LTRACEF("returning pool %p len 0x%zx\n", pool, pool->len);
+
+        remove_free(b);
+        list_delete(&pool->node);
+        theheap.size -= pool->len;
+        page_free(pool, pool->len / PAGE_SIZE);
+    }
+
+    unlock();
+}
+
+size_t tlsf_get_free(void)
+{
+    return theheap.remaining;
+}
+
+void tlsf_dump(void)
+{
+    lock();
+
+    dprintf(INFO, "Heap dump (using tlsf):\n");
+    dprintf(INFO, "\tsize %lu, remaining %lu\n",
+            (unsigned long)theheap.size,
+            (unsigned long)theheap.remaining);
+
+    pool_t *pool;
+    list_for_every_entry(&theheap.pools, pool, pool_t, node) {
+        dprintf(INFO, "\tpool %p, len 0x%zx%s\n", pool, pool->len, pool->trimmable ? "" : ", fixed");
+        for (block_t *b = pool_first_block(pool); block_size(b) != 0; b = block_next(b)) {
+            if (block_is_free(b))
+                dprintf(INFO, "\t\tfree %p, len 0x%zx\n", block_payload(b), block_size(b));
+        }
+    }
+
+    dprintf(INFO, "\tfree lists:\n");
+    for (uint fl = 0; fl < FL_COUNT; fl++) {
+        for (uint sl = 0; sl < SL_COUNT; sl++) {
+            uint count = 0;
+            for (block_t *b = theheap.free_lists[fl][sl]; b; b = b->next_free)
+                count++;
+            if (count)
+                dprintf(INFO, "\t\tlist %u.%u: %u blocks\n", fl, sl, count);
+        }
+    }
+
+    unlock();
+}
+
+void tlsf_init(void)
+{
+    LTRACE_ENTRY;
+
+    mutex_init(&theheap.lock);
+    list_initialize(&theheap.pools);
+
+    // start off with whatever memory the page allocator has spare
+    size_t len;
+    void *ptr = page_first_alloc(&len);
+    if (ptr)
+        add_pool(ptr, len, false);
+
+    if (TLSF_HEAP_RESERVE > 0) {
+        size_t reserve = ROUNDUP(TLSF_HEAP_RESERVE, PAGE_SIZE);
+        ptr = page_alloc(reserve / PAGE_SIZE, PAGE_ALLOC_ANY_ARENA);
+        if (ptr)
+            add_pool(ptr, reserve, false);
+        else
+            dprintf(CRITICAL, "tlsf: couldn't reserve 0x%zx bytes\n", reserve);
+    }
+}
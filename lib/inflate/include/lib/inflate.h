@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <sys/types.h>
+#include <lib/bio.h>
+
+__BEGIN_CDECLS
+
+/*
+ * Inflate deflate streams straight into their final location.
+ *
+ * The output buffer has to be big enough for the whole stream, which lets
+ * the decompressor use it as its own history window, so there is no
+ * dictionary buffer and no copy out of one. The input from a block device
+ * is read in chunks by a helper thread, so the next chunk is coming off the
+ * device while the current one is being decompressed.
+ *
+ * All of them return the number of bytes written to dst, or an error:
+ * ERR_BAD_LEN if dst was too small, ERR_CHECKSUM_FAIL for a zlib stream
+ * whose adler32 didn't match, ERR_IO if the stream was corrupt or ended
+ * early.
+ */
+
+/* the stream has a zlib header and adler32 trailer, rather than raw deflate */
+#define INFLATE_FLAG_ZLIB (1 << 0)
+
+ssize_t inflate_mem(void *dst, size_t dst_len, const void *src, size_t src_len, uint flags);
+ssize_t inflate_bdev(void *dst, size_t dst_len, bdev_t *dev, off_t offset, size_t len, uint flags);
+
+/*
+ * inflate_bdev, also handing each chunk to hook as it comes off the device,
+ * before it is decompressed. hook runs on the reader thread, alongside the
+ * decompression of the previous chunk, so checking a hash of the stream there
+ * costs no extra time.
+ */
+typedef void (*inflate_read_hook_t)(const void *buf, size_t len, void *arg);
+
+ssize_t inflate_bdev_etc(void *dst, size_t dst_len, bdev_t *dev, off_t offset, size_t len, uint flags,
+                         inflate_read_hook_t hook, void *hook_arg);
+
+__END_CDECLS
@@ -0,0 +1,288 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/inflate.h>
+
+#include <debug.h>
+#include <err.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <kernel/semaphore.h>
+#include <kernel/thread.h>
+#include <lib/miniz.h>
+#include <platform.h>
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+#endif
+
+#define LOCAL_TRACE 0
+
+/* bytes per read off the device, there are two of these in flight */
+#ifndef INFLATE_CHUNK_SIZE
+#define INFLATE_CHUNK_SIZE (64 * 1024)
+#endif
+
+struct inflate_state {
+    tinfl_decompressor decomp;
+    uint8_t *dst;
+    size_t dst_len;
+    size_t written;
+    mz_uint32 flags;
+};
+
+static struct inflate_state *inflate_start(void *dst, size_t dst_len, uint flags)
+{
+    /* the decompressor's tables are ~11KB, too much for a thread stack */
+    struct inflate_state *s = malloc(sizeof(*s));
+    if (!s)
+        return NULL;
+
+    tinfl_init(&s->decomp);
+    s->dst = dst;
+    s->dst_len = dst_len;
+    s->written = 0;
+    s->flags = TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF;
+    if (flags & INFLATE_FLAG_ZLIB)
+        s->flags |= TINFL_FLAG_PARSE_ZLIB_HEADER;
+
+    return s;
+}
+
+/* feed the next piece of input, returns 1 once the stream is done */
+static status_t inflate_feed(struct inflate_state *s, const uint8_t *in, size_t len, bool more)
+{
+    mz_uint32 flags = s->flags | (more ? TINFL_FLAG_HAS_MORE_INPUT : 0);
+
+    for (;;) {
+        size_t in_len = len;
+        size_t out_len = s->dst_len - s->written;
+
+        tinfl_status status = tinfl_decompress(&s->decomp, in, &in_len,
+                                               s->dst, s->dst + s->written, &out_len, flags);
+        in += in_len;
+        len -= in_len;
+        s->written += out_len;
+
+        LTRACEF_LEVEL(2, "status %d, in %zu, out %zu\n", status, in_len, out_len);
+
+        switch (status) {
+            case TINFL_STATUS_DONE:
+                return 1;
+            case TINFL_STATUS_NEEDS_MORE_INPUT:
+                if (!more)
+                    return ERR_IO;
+                if (len == 0)
+                    return NO_ERROR;
+                break;
+            case TINFL_STATUS_HAS_MORE_OUTPUT:
+                return ERR_BAD_LEN;
+            case TINFL_STATUS_ADLER32_MISMATCH:
+                return ERR_CHECKSUM_FAIL;
+            default:
+                return ERR_IO;
+        }
+    }
+}
+
+static ssize_t inflate_finish(struct inflate_state *s, status_t err)
+{
+    ssize_t ret = (err == 1) ? (ssize_t)s->written : err;
+
+    LTRACEF("%zd\n", ret);
+
+    free(s);
+    return ret;
+}
+
+ssize_t inflate_mem(void *dst, size_t dst_len, const void *src, size_t src_len, uint flags)
+{
+    LTRACEF("dst %p, len %zu, src %p, len %zu, flags 0x%x\n", dst, dst_len, src, src_len, flags);
+
+    struct inflate_state *s = inflate_start(dst, dst_len, flags);
+    if (!s)
+        return ERR_NO_MEMORY;
+
+    return inflate_finish(s, inflate_feed(s, src, src_len, false));
+}
+
+/*
+ * The reader thread runs one chunk ahead of the decompressor. empty counts
+ * the buffers it may fill, full the ones waiting to be decompressed, and
+ * they are handed back and forth strictly in turn.
+ */
+struct inflate_reader {
+    bdev_t *dev;
+    off_t offset;
+    size_t len;
+    volatile bool stop;
+
+    inflate_read_hook_t hook;
+    void *hook_arg;
+
+    uint8_t *buf[2];
+    ssize_t filled[2];
+    semaphore_t empty;
+    semaphore_t full;
+};
+
+static int inflate_reader_thread(void *arg)
+{
+    struct inflate_reader *r = arg;
+
+    for (uint i = 0; r->len > 0; i ^= 1) {
+        sem_wait(&r->empty);
+        if (r->stop)
+            break;
+
+        size_t n = MIN(r->len, INFLATE_CHUNK_SIZE);
+        ssize_t err = bio_read(r->dev, r->buf[i], r->offset, n);
+        if (err >= 0 && (size_t)err != n)
+            err = ERR_IO;
+        if (err >= 0 && r->hook)
+            r->hook(r->buf[i], n, r->hook_arg);
+
+        r->filled[i] = err;
+        r->offset += n;
+        r->len -= n;
+        sem_post(&r->full, false);
+
+        if (err < 0)
+            break;
+    }
+
+    return 0;
+}
+
+ssize_t inflate_bdev(void *dst, size_t dst_len, bdev_t *dev, off_t offset, size_t len, uint flags)
+{
+    return inflate_bdev_etc(dst, dst_len, dev, offset, len, flags, NULL, NULL);
+}
+
+ssize_t inflate_bdev_etc(void *dst, size_t dst_len, bdev_t *dev, off_t offset, size_t len, uint flags,
+                         inflate_read_hook_t hook, void *hook_arg)
+{
+    LTRACEF("dst %p, len %zu, dev %p, offset %lld, len %zu, flags 0x%x\n",
+            dst, dst_len, dev, offset, len, flags);
+
+    if (!dev || len == 0)
+        return ERR_INVALID_ARGS;
+
+    struct inflate_state *s = inflate_start(dst, dst_len, flags);
+    if (!s)
+        return ERR_NO_MEMORY;
+
+    struct inflate_reader r = {
+        .dev = dev,
+        .offset = offset,
+        .len = len,
+        .hook = hook,
+        .hook_arg = hook_arg,
+    };
+    size_t chunk = MIN(len, INFLATE_CHUNK_SIZE);
+    r.buf[0] = malloc(chunk);
+    r.buf[1] = (len > chunk) ? malloc(chunk) : NULL;
+
+    status_t err = ERR_NO_MEMORY;
+    thread_t *t = NULL;
+    if (!r.buf[0] || (len > chunk && !r.buf[1]))
+        goto out;
+
+    sem_init(&r.empty, (len > chunk) ? 2 : 1);
+    sem_init(&r.full, 0);
+
+    t = thread_create("inflate reader", &inflate_reader_thread, &r, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+    if (!t)
+        goto out_sem;
+    thread_resume(t);
+
+    size_t left = len;
+    for (uint i = 0; ; i ^= 1) {
+        sem_wait(&r.full);
+        if (r.filled[i] < 0) {
+            err = r.filled[i];
+            break;
+        }
+
+        left -= r.filled[i];
+        err = inflate_feed(s, r.buf[i], r.filled[i], left > 0);
+        if (err != NO_ERROR)
+            break;
+
+        sem_post(&r.empty, false);
+    }
+
+    /* the stream may end, or go bad, before the reader does */
+    r.stop = true;
+    sem_post(&r.empty, false);
+    thread_join(t, NULL, INFINITE_TIME);
+
+out_sem:
+    sem_destroy(&r.full);
+    sem_destroy(&r.empty);
+out:
+    free(r.buf[0]);
+    free(r.buf[1]);
+    return inflate_finish(s, err);
+}
+
+#if WITH_LIB_CONSOLE
+
+static int cmd_inflate(int argc, const cmd_args *argv)
+{
+    if (argc < 6) {
+        printf("not enough arguments\n");
+        printf("usage: %s <device> <offset> <len> <dst address> <dst len> [zlib]\n", argv[0].str);
+        return -1;
+    }
+
+    bdev_t *dev = bio_open(argv[1].str);
+    if (!dev) {
+        printf("error opening block device\n");
+        return -1;
+    }
+
+    uint flags = (argc > 6 && !strcmp(argv[6].str, "zlib")) ? INFLATE_FLAG_ZLIB : 0;
+
+    lk_bigtime_t t = current_time_hires();
+    ssize_t err = inflate_bdev((void *)argv[4].u, argv[5].u, dev, argv[2].u, argv[3].u, flags);
+    t = current_time_hires() - t;
+
+    bio_close(dev);
+
+    if (err < 0) {
+        printf("error %zd inflating\n", err);
+        return (int)err;
+    }
+
+    printf("inflated %lu bytes to %zd in %llu usecs\n", argv[3].u, err, t);
+    return 0;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("inflate", "inflate a deflate stream from a block device", &cmd_inflate)
+STATIC_COMMAND_END(inflate);
+
+#endif
@@ -0,0 +1,12 @@
+LOCAL_DIR := $(GET_LOCAL_DIR)
+
+MODULE := $(LOCAL_DIR)
+
+MODULE_DEPS := \
+	lib/miniz \
+	lib/bio
+
+MODULE_SRCS := \
+	$(LOCAL_DIR)/inflate.c
+
+include make/module.mk
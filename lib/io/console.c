@@ -45,6 +45,7 @@
 
 static spin_lock_t print_spin_lock = 0;
 static struct list_node print_callbacks = LIST_INITIAL_VALUE(print_callbacks);
+static volatile bool platform_output = true;
 
 #if CONSOLE_HAS_INPUT_BUFFER
 #ifndef CONSOLE_BUF_LEN
@@ -56,6 +57,149 @@ cbuf_t console_input_cbuf;
 static uint8_t console_cbuf_buf[CONSOLE_BUF_LEN];
 #endif // CONSOLE_HAS_INPUT_BUFFER
 
+#if CONSOLE_ASYNC_OUTPUT
+#ifndef CONSOLE_OUTPUT_BUF_LEN
+#define CONSOLE_OUTPUT_BUF_LEN 4096
+#endif
+STATIC_ASSERT((CONSOLE_OUTPUT_BUF_LEN & (CONSOLE_OUTPUT_BUF_LEN - 1)) == 0);
+
+/* how long the drainer sleeps between looks at the buffer, if nobody wakes it */
+#define CONSOLE_DRAIN_POLL_MSECS 10
+
+/*
+ * Output waiting for the uart. The positions run freely and are masked on use.
+ * Writers claim space by moving out_reserve along, copy in, and then publish
+ * by moving out_head once every earlier claim is published. Only the drainer
+ * moves out_tail. Nothing here takes the thread lock, so output from irq
+ * handlers and from under the scheduler lands in the buffer like any other.
+ */
+static char out_buf[CONSOLE_OUTPUT_BUF_LEN];
+static volatile int out_reserve;
+static volatile int out_head;
+static volatile int out_tail;
+static volatile int out_dropped;
+static volatile bool out_async;
+static event_t out_event = EVENT_INITIAL_VALUE(out_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+static size_t out_buf_write(const char *str, size_t len)
+{
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, PRINT_LOCK_FLAGS);
+
+    uint start;
+    size_t n;
+    do {
+        start = out_reserve;
+        n = MIN(len, CONSOLE_OUTPUT_BUF_LEN - (start - (uint)out_tail));
+        if (n == 0)
+            break;
+    } while ((uint)atomic_cmpxchg(&out_reserve, start, start + n) != start);
+
+    if (n > 0) {
+        uint pos = start & (CONSOLE_OUTPUT_BUF_LEN - 1);
+        size_t first = MIN(n, CONSOLE_OUTPUT_BUF_LEN - pos);
+        memcpy(&out_buf[pos], str, first);
+        memcpy(&out_buf[0], str + first, n - first);
+
+        while ((uint)out_head != start)
+            ;
+        smp_wmb();
+        out_head = start + n;
+    }
+
+    arch_interrupt_restore(state, PRINT_LOCK_FLAGS);
+
+    return n;
+}
+
+/* push everything published so far out through out() */
+static void out_buf_drain(void (*out)(char))
+{
+    uint tail = out_tail;
+    uint head = out_head;
+    smp_rmb();
+
+    while (tail != head) {
+        out(out_buf[tail & (CONSOLE_OUTPUT_BUF_LEN - 1)]);
+        tail++;
+
+        /* give the space back as it goes */
+        smp_mb();
+        out_tail = tail;
+    }
+}
+
+static void out_async_write(const char *str, size_t len)
+{
+    size_t pos = 0;
+    for (;;) {
+        pos += out_buf_write(str + pos, len - pos);
+
+        /* waking the drainer takes the thread lock, leave it to its poll if that might be held */
+        bool ints_disabled = arch_ints_disabled();
+        if (!ints_disabled)
+            event_signal(&out_event, false);
+
+        if (pos == len)
+            break;
+
+        /* full. threads wait for room, anything that can't block loses the rest */
+        if (ints_disabled || !out_async) {
+            atomic_add(&out_dropped, len - pos);
+            break;
+        }
+        thread_sleep(1);
+    }
+}
+
+static int console_drain_thread(void *arg)
+{
+    for (;;) {
+        event_wait_timeout(&out_event, CONSOLE_DRAIN_POLL_MSECS);
+
+        if (!out_async)
+            continue;
+
+        out_buf_drain(platform_dputc);
+
+        int dropped = atomic_swap(&out_dropped, 0);
+        if (dropped > 0) {
+            char msg[48];
+            snprintf(msg, sizeof(msg), "\n[console dropped %d bytes]\n", dropped);
+            for (const char *c = msg; *c; c++)
+                platform_dputc(*c);
+        }
+    }
+
+    return 0;
+}
+
+void console_output_sync(void)
+{
+    if (!out_async)
+        return;
+
+    out_async = false;
+    smp_mb();
+
+    /* whatever the drainer was in the middle of gets written again, better than lost */
+    out_buf_drain(platform_pputc);
+}
+
+static void console_async_init_hook(uint level)
+{
+    thread_t *t = thread_create("console drain", &console_drain_thread, NULL,
+                                LOW_PRIORITY, DEFAULT_STACK_SIZE);
+    if (!t)
+        return;
+
+    out_async = true;
+    thread_detach_and_resume(t);
+}
+
+LK_INIT_HOOK(console_async, console_async_init_hook, LK_INIT_LEVEL_THREADING);
+#endif // CONSOLE_ASYNC_OUTPUT
+
 /* print lock must be held when invoking out, outs, outc */
 static void out_count(const char *str, size_t len)
 {
@@ -75,6 +219,16 @@ static void out_count(const char *str, size_t len)
         spin_unlock_restore(&print_spin_lock, state, PRINT_LOCK_FLAGS);
     }
 
+    if (!platform_output)
+        return;
+
+#if CONSOLE_ASYNC_OUTPUT
+    if (out_async) {
+        out_async_write(str, len);
+        return;
+    }
+#endif
+
     /* write out the serial port */
     for (i = 0; i < len; i++) {
         platform_dputc(str[i]);
@@ -101,6 +255,11 @@ void unregister_print_callback(print_callback_t *cb)
     spin_unlock_restore(&print_spin_lock, state, PRINT_LOCK_FLAGS);
 }
 
+void console_set_platform_output(bool enable)
+{
+    platform_output = enable;
+}
+
 static ssize_t __debug_stdio_write(io_handle_t *io, const char *s, size_t len)
 {
     out_count(s, len);
@@ -70,6 +70,29 @@ static inline void io_handle_init(io_handle_t *io, io_handle_hooks_t *hooks)
 /* the main console io handle */
 extern io_handle_t console_io;
 
+/*
+ * With CONSOLE_ASYNC_OUTPUT, console output goes into a buffer that a low
+ * priority thread writes out to the uart, rather than the writer waiting on
+ * the uart itself. console_output_sync() writes out whatever is buffered and
+ * switches back to writing directly, for panics.
+ */
+#ifndef CONSOLE_ASYNC_OUTPUT
+#define CONSOLE_ASYNC_OUTPUT 0
+#endif
+
+#if CONSOLE_ASYNC_OUTPUT
+void console_output_sync(void);
+#else
+static inline void console_output_sync(void) {}
+#endif
+
+/*
+ * Turn console output to the platform's debug uart off or back on. While off
+ * output only goes to the print callbacks, for when one of them is a faster way
+ * out, such as a virtio console. Panic output still goes to the uart.
+ */
+void console_set_platform_output(bool enable);
+
 #ifndef CONSOLE_HAS_INPUT_BUFFER
 #define CONSOLE_HAS_INPUT_BUFFER 0
 #endif
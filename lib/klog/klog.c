@@ -30,6 +30,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <platform.h>
+#include <arch/ops.h>
+#include <kernel/spinlock.h>
 #include <lib/cksum.h>
 
 #define LOCAL_TRACE 0
@@ -38,6 +40,11 @@
 #define MAX_KLOG_SIZE (32*1024)
 #endif
 
+/* klog_printf collects output on the caller's stack and writes it in pieces this big */
+#ifndef KLOG_STAGE_SIZE
+#define KLOG_STAGE_SIZE 128
+#endif
+
 #define KLOG_BUFFER_HEADER_MAGIC 'KLGB'
 
 struct klog_buffer_header {
@@ -65,6 +72,13 @@ static struct klog_buffer_header *klog_buf;
 /* current klog */
 static struct klog_header *klog;
 
+/*
+ * The end of the space claimed by writers in the current klog. It runs ahead of
+ * klog->head while writers copy their records in, head catches up as each one
+ * commits.
+ */
+static volatile int klog_reserve;
+
 static struct klog_header *find_nth_log(uint log)
 {
     DEBUG_ASSERT(klog_buf);
@@ -272,6 +286,8 @@ status_t klog_set_current_buffer(uint buffer)
     /* find the nth buffer */
     klog = find_nth_log(buffer);
 
+    klog_reserve = klog->head;
+
     /* update the klog buffer header */
     if (buffer != klog_buf->current_log) {
         klog_buf->current_log = buffer;
@@ -281,8 +297,6 @@ status_t klog_set_current_buffer(uint buffer)
     return NO_ERROR;
 }
 
-#include <arch/ops.h>
-
 ssize_t klog_read(char *buf, size_t len, int buf_id)
 {
     size_t offset = 0;
@@ -341,6 +355,73 @@ bool klog_has_data(void)
     return (klog->head != klog->tail);
 }
 
+/* copy a run of a record in, returning how much it changes the data checksum by */
+static uint32_t copy_run(uint8_t *dst, const char *src, size_t len)
+{
+    uint32_t deltasum = 0;
+    for (size_t i = 0; i < len; i++)
+        deltasum += (uint8_t)src[i] - dst[i];
+
+    memcpy(dst, src, len);
+
+    return deltasum;
+}
+
+/*
+ * Write one record into the current klog. The writer claims its space by
+ * moving klog_reserve past it, copies the record in alongside any other
+ * writers, then commits by moving the head over it once every earlier
+ * claim has committed. Interrupts are off from claim to commit, so a
+ * writer can't be stuck behind one it interrupted.
+ */
+static size_t klog_write_record(const char *str, size_t len)
+{
+    struct klog_header *k = klog;
+
+    /* keep records small enough that every cpu's claim fits in the log at once */
+    len = MIN(len, k->size / (SMP_MAX_CPUS + 1));
+    if (len == 0)
+        return 0;
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    uint start, end;
+    do {
+        start = klog_reserve;
+        end = start + len;
+        if (end >= k->size)
+            end -= k->size;
+    } while ((uint)atomic_cmpxchg(&klog_reserve, start, end) != start);
+
+    size_t first = MIN(len, k->size - start);
+    uint32_t deltasum = copy_run(&k->data[start], str, first);
+    if (first < len)
+        deltasum += copy_run(&k->data[0], str + first, len - first);
+
+    while (*(volatile uint32_t *)&k->head != start)
+        ;
+    smp_wmb();
+
+    /* the log holds size - 1 bytes, push the tail past anything overwritten */
+    uint used = start - k->tail;
+    if (start < k->tail)
+        used += k->size;
+    if (used + len >= k->size) {
+        uint newtail = end + 1;
+        if (newtail >= k->size)
+            newtail -= k->size;
+        k->tail = newtail;
+    }
+    k->head = end;
+
+    atomic_add((volatile int *)&k->data_checksum, deltasum);
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    return len;
+}
+
 static size_t klog_puts_len(const char *str, size_t len)
 {
     LTRACEF("puts '%s'\n", str);
@@ -348,40 +429,15 @@ static size_t klog_puts_len(const char *str, size_t len)
     DEBUG_ASSERT(klog);
     DEBUG_ASSERT(klog->magic == KLOG_HEADER_MAGIC);
 
-    LTRACEF("before write head %u tail %u size %u\n", klog->head, klog->tail, klog->size);
-    uint32_t deltasum = 0;
-    size_t count = 0;
-    while (count < len && *str) {
-        /* compute the delta checksum */
-        deltasum += *str - klog->data[klog->head];
-
-        /* store the data */
-        klog->data[klog->head] = *str;
-
-        /* bump the head */
-        uint newhead = klog->head + 1;
-        if (newhead >= klog->size)
-            newhead -= klog->size;
-        DEBUG_ASSERT(newhead < klog->size);
-
-        /* bump the tail if the head collided with it */
-        if (klog->tail == newhead) {
-            uint newtail = klog->tail + 1;
-            if (newtail >= klog->size)
-                newtail -= klog->size;
-            DEBUG_ASSERT(newtail < klog->size);
-            klog->tail = newtail;
-        }
-
-        /* writeback the head */
-        klog->head = newhead;
+    len = strnlen(str, len);
 
-        str++;
-        count++;
+    size_t count = 0;
+    while (count < len) {
+        size_t written = klog_write_record(str + count, len - count);
+        if (written == 0)
+            break;
+        count += written;
     }
-    LTRACEF("after write head %u tail %u\n", klog->head, klog->tail);
-
-    klog->data_checksum += deltasum;
 
     LTRACEF("kputs len %u\n", count);
 
@@ -401,19 +457,41 @@ void klog_puts(const char *str)
     klog_puts_len(str, SIZE_MAX);
 }
 
+/* the printf engine hands over output a few bytes at a time, batch it up into records */
+struct klog_stage {
+    size_t len;
+    char buf[KLOG_STAGE_SIZE];
+};
+
+static void klog_stage_flush(struct klog_stage *stage)
+{
+    if (stage->len > 0)
+        klog_puts_len(stage->buf, stage->len);
+    stage->len = 0;
+}
+
 static int _klog_output_func(const char *str, size_t len, void *state)
 {
-    return klog_puts_len(str, len);
+    struct klog_stage *stage = state;
+
+    for (size_t pos = 0; pos < len; ) {
+        size_t n = MIN(len - pos, sizeof(stage->buf) - stage->len);
+        memcpy(stage->buf + stage->len, str + pos, n);
+        stage->len += n;
+        pos += n;
+
+        if (stage->len == sizeof(stage->buf))
+            klog_stage_flush(stage);
+    }
+
+    return len;
 }
 
 void klog_printf(const char *fmt, ...)
 {
-    if (!klog_buf)
-        return;
-
     va_list ap;
     va_start(ap, fmt);
-    _printf_engine(&_klog_output_func, NULL, fmt, ap);
+    klog_vprintf(fmt, ap);
     va_end(ap);
 }
 
@@ -422,7 +500,10 @@ void klog_vprintf(const char *fmt, va_list ap)
     if (!klog_buf)
         return;
 
-    _printf_engine(&_klog_output_func, NULL, fmt, ap);
+    struct klog_stage stage;
+    stage.len = 0;
+    _printf_engine(&_klog_output_func, &stage, fmt, ap);
+    klog_stage_flush(&stage);
 }
 
 int klog_get_buffer(int buffer, iovec_t *vec)
@@ -25,11 +25,20 @@
 
 #include <sys/types.h>
 
+namespace std {
+struct nothrow_t { };
+extern const nothrow_t nothrow;
+}
+
 void *operator new(size_t);
 void *operator new(size_t, void *ptr);
 void *operator new[](size_t);
 void *operator new[](size_t, void *ptr);
+void *operator new(size_t, const std::nothrow_t &) noexcept;
+void *operator new[](size_t, const std::nothrow_t &) noexcept;
 void operator delete(void *p);
 void operator delete[](void *p);
+void operator delete(void *p, size_t);
+void operator delete[](void *p, size_t);
 
 #endif
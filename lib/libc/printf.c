@@ -27,9 +27,15 @@
 #include <stdarg.h>
 #include <sys/types.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <platform/debug.h>
 
+/* bytes of output _printf_engine collects on the stack before calling out() */
+#ifndef PRINTF_OUTPUT_BUFFER_SIZE
+#define PRINTF_OUTPUT_BUFFER_SIZE 128
+#endif
+
 #if WITH_NO_FP
 #define FLOAT_PRINTF 0
 #else
@@ -75,17 +81,13 @@ static int _vsnprintf_output(const char *str, size_t len, void *state)
 {
     struct _output_args *args = state;
 
-    size_t count = 0;
-    while (count < len) {
-        if (args->pos < args->len) {
-            args->outstr[args->pos++] = *str;
-        }
-
-        str++;
-        count++;
+    if (args->pos < args->len) {
+        size_t count = MIN(len, args->len - args->pos);
+        memcpy(&args->outstr[args->pos], str, count);
     }
+    args->pos += len;
 
-    return count;
+    return len;
 }
 
 int vsnprintf(char *str, size_t len, const char *fmt, va_list ap)
@@ -98,6 +100,8 @@ int vsnprintf(char *str, size_t len, const char *fmt, va_list ap)
     args.pos = 0;
 
     wlen = _printf_engine(&_vsnprintf_output, (void *)&args, fmt, ap);
+    if (len == 0)
+        return wlen;
     if (args.pos >= len)
         str[len-1] = '\0';
     else
@@ -120,6 +124,19 @@ int vsnprintf(char *str, size_t len, const char *fmt, va_list ap)
 #define LEADZEROFLAG   0x00001000
 #define BLANKPOSFLAG   0x00002000
 
+/* "00" "01" ... "99", so numbers can be converted two digits per divide */
+static const char digit_pairs[200] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
 __NO_INLINE static char *longlong_to_string(char *buf, unsigned long long n, size_t len, uint flag, char *signchar)
 {
     size_t pos = len;
@@ -132,15 +149,35 @@ __NO_INLINE static char *longlong_to_string(char *buf, unsigned long long n, siz
 
     buf[--pos] = 0;
 
-    /* only do the math if the number is >= 10 */
-    while (n >= 10) {
-        int digit = n % 10;
+    /* 64 bit divides are a library call on 32 bit cpus, so only do them while we have to */
+    while (n > UINT32_MAX) {
+        unsigned long long q = n / 100;
+        uint r = n - q * 100;
 
-        n /= 10;
+        n = q;
+        pos -= 2;
+        buf[pos] = digit_pairs[r * 2];
+        buf[pos + 1] = digit_pairs[r * 2 + 1];
+    }
 
-        buf[--pos] = digit + '0';
+    uint32_t n32 = n;
+    while (n32 >= 100) {
+        uint32_t q = n32 / 100;
+        uint r = n32 - q * 100;
+
+        n32 = q;
+        pos -= 2;
+        buf[pos] = digit_pairs[r * 2];
+        buf[pos + 1] = digit_pairs[r * 2 + 1];
+    }
+
+    if (n32 >= 10) {
+        pos -= 2;
+        buf[pos] = digit_pairs[n32 * 2];
+        buf[pos + 1] = digit_pairs[n32 * 2 + 1];
+    } else {
+        buf[--pos] = n32 + '0';
     }
-    buf[--pos] = n + '0';
 
     if (negative)
         *signchar = '-';
@@ -163,12 +200,16 @@ __NO_INLINE static char *longlong_to_hexstring(char *buf, unsigned long long u,
     const char *table = (flag & CAPSFLAG) ? hextable_caps : hextable;
 
     buf[--pos] = 0;
-    do {
-        unsigned int digit = u % 16;
-        u /= 16;
+    while (u > UINT32_MAX) {
+        buf[--pos] = table[u & 0xf];
+        u >>= 4;
+    }
 
-        buf[--pos] = table[digit];
-    } while (u != 0);
+    uint32_t u32 = u;
+    do {
+        buf[--pos] = table[u32 & 0xf];
+        u32 >>= 4;
+    } while (u32 != 0);
 
     return &buf[pos];
 }
@@ -403,6 +444,17 @@ __NO_INLINE static char *double_to_hexstring(char *buf, size_t len, double d, ui
 
 #endif // FLOAT_PRINTF
 
+/*
+ * The pieces are short, and a memcpy() of a size the compiler can bound gets
+ * inlined as a rep movs on x86, which costs more to start up than a plain
+ * byte loop takes to finish.
+ */
+static inline void copy_out(char *dst, const char *src, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+        dst[i] = src[i];
+}
+
 int _printf_engine(_printf_engine_output_func out, void *state, const char *fmt, va_list ap)
 {
     int err = 0;
@@ -418,8 +470,40 @@ int _printf_engine(_printf_engine_output_func out, void *state, const char *fmt,
     size_t chars_written = 0;
     char num_buffer[32];
 
-#define OUTPUT_STRING(str, len) do { err = out(str, len, state); if (err < 0) { goto exit; } else { chars_written += err; } } while(0)
-#define OUTPUT_CHAR(c) do { char __temp[1] = { c }; OUTPUT_STRING(__temp, 1); } while (0)
+    /*
+     * Output is gathered up and handed over in as few calls as possible,
+     * every call into out() tends to take a lock or poke a uart.
+     */
+    char out_buffer[PRINTF_OUTPUT_BUFFER_SIZE];
+    size_t out_pos = 0;
+
+#define FLUSH_OUTPUT() do { \
+        if (out_pos > 0) { \
+            err = out(out_buffer, out_pos, state); \
+            out_pos = 0; \
+            if (err < 0) { goto exit; } else { chars_written += err; } \
+        } \
+    } while (0)
+#define OUTPUT_STRING(str, len) do { \
+        const char *__str = (str); \
+        size_t __len = (len); \
+        if (__len > sizeof(out_buffer) - out_pos) { \
+            FLUSH_OUTPUT(); \
+        } \
+        if (__len > sizeof(out_buffer)) { \
+            err = out(__str, __len, state); \
+            if (err < 0) { goto exit; } else { chars_written += err; } \
+        } else { \
+            copy_out(&out_buffer[out_pos], __str, __len); \
+            out_pos += __len; \
+        } \
+    } while (0)
+#define OUTPUT_CHAR(c) do { \
+        if (out_pos == sizeof(out_buffer)) { \
+            FLUSH_OUTPUT(); \
+        } \
+        out_buffer[out_pos++] = (c); \
+    } while (0)
 
     for (;;) {
         /* reset the format state */
@@ -552,17 +636,17 @@ hex:
             case 'n':
                 ptr = va_arg(ap, void *);
                 if (flags & LONGLONGFLAG)
-                    *(long long *)ptr = chars_written;
+                    *(long long *)ptr = chars_written + out_pos;
                 else if (flags & LONGFLAG)
-                    *(long *)ptr = chars_written;
+                    *(long *)ptr = chars_written + out_pos;
                 else if (flags & HALFHALFFLAG)
-                    *(signed char *)ptr = chars_written;
+                    *(signed char *)ptr = chars_written + out_pos;
                 else if (flags & HALFFLAG)
-                    *(short *)ptr = chars_written;
+                    *(short *)ptr = chars_written + out_pos;
                 else if (flags & SIZETFLAG)
-                    *(size_t *)ptr = chars_written;
+                    *(size_t *)ptr = chars_written + out_pos;
                 else
-                    *(int *)ptr = chars_written;
+                    *(int *)ptr = chars_written + out_pos;
                 break;
 #if FLOAT_PRINTF
             case 'F':
@@ -598,10 +682,9 @@ _output_string:
         if (flags & LEFTFORMATFLAG) {
             /* left justify the text */
             OUTPUT_STRING(s, string_len);
-            uint written = err;
 
             /* pad to the right (if necessary) */
-            for (; format_num > written; format_num--)
+            for (; format_num > string_len; format_num--)
                 OUTPUT_CHAR(' ');
         } else {
             /* right justify the text (digits) */
@@ -629,6 +712,9 @@ _output_string:
         continue;
     }
 
+    FLUSH_OUTPUT();
+
+#undef FLUSH_OUTPUT
 #undef OUTPUT_STRING
 #undef OUTPUT_CHAR
 
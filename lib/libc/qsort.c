@@ -28,6 +28,8 @@
  * SUCH DAMAGE.
  */
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <sys/types.h>
 #include <stdlib.h>
 
@@ -80,27 +82,107 @@ med3(char *a, char *b, char *c, int (*cmp)(const void *, const void *))
                :(cmp(b, c) > 0 ? b : (cmp(a, c) < 0 ? a : c ));
 }
 
-void
-qsort(void *aa, size_t n, size_t es, int (*cmp)(const void *, const void *))
+/* partitions smaller than this are finished off with an insertion sort */
+#ifndef QSORT_INSERTION_THRESHOLD
+#define QSORT_INSERTION_THRESHOLD 7
+#endif
+
+/* elements out of place before the check for presorted input gives up */
+#ifndef QSORT_PRESORTED_LIMIT
+#define QSORT_PRESORTED_LIMIT 8
+#endif
+
+static void
+insertion_sort(char *a, size_t n, size_t es, int swaptype,
+               int (*cmp)(const void *, const void *))
+{
+    char *pm, *pl;
+
+    for (pm = a + es; pm < a + n * es; pm += es)
+        for (pl = pm; pl > a && cmp(pl - es, pl) > 0; pl -= es)
+            swap(pl, pl - es);
+}
+
+/*
+ * Insertion sort that gives up once it has had to move more than limit
+ * elements, for checking whether a range was already (nearly) sorted.
+ */
+static bool
+try_insertion_sort(char *a, size_t n, size_t es, int swaptype, size_t limit,
+                   int (*cmp)(const void *, const void *))
+{
+    char *pm, *pl;
+    size_t moved = 0;
+
+    for (pm = a + es; pm < a + n * es; pm += es) {
+        for (pl = pm; pl > a && cmp(pl - es, pl) > 0; pl -= es)
+            swap(pl, pl - es);
+        if (pl != pm && ++moved > limit)
+            return false;
+    }
+    return true;
+}
+
+static void
+siftdown(char *a, size_t root, size_t n, size_t es, int swaptype,
+         int (*cmp)(const void *, const void *))
+{
+    size_t child;
+
+    while ((child = 2 * root + 1) < n) {
+        if (child + 1 < n && cmp(a + child * es, a + (child + 1) * es) < 0)
+            child++;
+        if (cmp(a + root * es, a + child * es) >= 0)
+            return;
+        swap(a + root * es, a + child * es);
+        root = child;
+    }
+}
+
+static void
+heap_sort(char *a, size_t n, size_t es, int swaptype,
+          int (*cmp)(const void *, const void *))
+{
+    size_t i;
+
+    for (i = n / 2; i > 0; i--)
+        siftdown(a, i - 1, n, es, swaptype, cmp);
+    for (i = n - 1; i > 0; i--) {
+        swap(a, a + i * es);
+        siftdown(a, 0, i, es, swaptype, cmp);
+    }
+}
+
+/*
+ * Introsort: Bentley & McIlroy's quicksort, but once the partitioning has
+ * gone deeper than depth the range is heap sorted instead, so bad pivots
+ * can't make it quadratic. Only the smaller side of each partition is
+ * recursed into, which keeps the stack depth under log2(n).
+ */
+static void
+introsort(char *a, size_t n, size_t es, int (*cmp)(const void *, const void *),
+          uint depth)
 {
     char *pa, *pb, *pc, *pd, *pl, *pm, *pn;
-    int d, r, swaptype, swap_cnt;
-    char *a = aa;
+    ptrdiff_t d, r, rl, rr;
+    int cmp_result, swaptype, swap_cnt;
 
-loop:
     SWAPINIT(a, es);
-    swap_cnt = 0;
-    if (n < 7) {
-        for (pm = (char *)a + es; pm < (char *) a + n * es; pm += es)
-            for (pl = pm; pl > (char *) a && cmp(pl - es, pl) > 0;
-                    pl -= es)
-                swap(pl, pl - es);
+loop:
+    if (n < QSORT_INSERTION_THRESHOLD) {
+        insertion_sort(a, n, es, swaptype, cmp);
         return;
     }
-    pm = (char *)a + (n / 2) * es;
+    if (depth == 0) {
+        heap_sort(a, n, es, swaptype, cmp);
+        return;
+    }
+    depth--;
+
+    pm = a + (n / 2) * es;
     if (n > 7) {
-        pl = (char *)a;
-        pn = (char *)a + (n - 1) * es;
+        pl = a;
+        pn = a + (n - 1) * es;
         if (n > 40) {
             d = (n / 8) * es;
             pl = med3(pl, pl + d, pl + 2 * d, cmp);
@@ -110,20 +192,21 @@ loop:
         pm = med3(pl, pm, pn, cmp);
     }
     swap(a, pm);
-    pa = pb = (char *)a + es;
+    swap_cnt = 0;
+    pa = pb = a + es;
 
-    pc = pd = (char *)a + (n - 1) * es;
+    pc = pd = a + (n - 1) * es;
     for (;;) {
-        while (pb <= pc && (r = cmp(pb, a)) <= 0) {
-            if (r == 0) {
+        while (pb <= pc && (cmp_result = cmp(pb, a)) <= 0) {
+            if (cmp_result == 0) {
                 swap_cnt = 1;
                 swap(pa, pb);
                 pa += es;
             }
             pb += es;
         }
-        while (pb <= pc && (r = cmp(pc, a)) >= 0) {
-            if (r == 0) {
+        while (pb <= pc && (cmp_result = cmp(pc, a)) >= 0) {
+            if (cmp_result == 0) {
                 swap_cnt = 1;
                 swap(pc, pd);
                 pd -= es;
@@ -137,26 +220,50 @@ loop:
         pb += es;
         pc -= es;
     }
-    if (swap_cnt == 0) {  /* Switch to insertion sort */
-        for (pm = (char *) a + es; pm < (char *) a + n * es; pm += es)
-            for (pl = pm; pl > (char *) a && cmp(pl - es, pl) > 0;
-                    pl -= es)
-                swap(pl, pl - es);
-        return;
-    }
 
-    pn = (char *)a + n * es;
-    r = min(pa - (char *)a, pb - pa);
+    /* move the elements equal to the pivot into the middle */
+    pn = a + n * es;
+    r = min(pa - a, pb - pa);
     vecswap(a, pb - r, r);
-    r = min(pd - pc, pn - pd - (int)es);
+    r = min(pd - pc, pn - pd - (ptrdiff_t)es);
     vecswap(pb, pn - r, r);
-    if ((r = pb - pa) > (int)es)
-        qsort(a, r / es, es, cmp);
-    if ((r = pd - pc) > (int)es) {
-        /* Iterate rather than recurse to save stack space */
-        a = pn - r;
-        n = r / es;
-        goto loop;
+
+    /* recurse into the smaller side, iterate on the larger one */
+    rl = pb - pa;
+    rr = pd - pc;
+
+    /*
+     * Nothing had to be swapped, so the input may well have been sorted
+     * already. Check with an insertion sort of each side, but a bounded one:
+     * if either side turns out to be out of order it is partitioned as usual.
+     */
+    if (swap_cnt == 0 &&
+            try_insertion_sort(a, rl / es, es, swaptype, QSORT_PRESORTED_LIMIT, cmp) &&
+            try_insertion_sort(pn - rr, rr / es, es, swaptype, QSORT_PRESORTED_LIMIT, cmp))
+        return;
+
+    if (rl < rr) {
+        if (rl > (ptrdiff_t)es)
+            introsort(a, rl / es, es, cmp, depth);
+        a = pn - rr;
+        n = rr / es;
+    } else {
+        if (rr > (ptrdiff_t)es)
+            introsort(pn - rr, rr / es, es, cmp, depth);
+        n = rl / es;
     }
-    /* qsort(pn - r, r / es, es, cmp); */
+    goto loop;
+}
+
+void
+qsort(void *aa, size_t n, size_t es, int (*cmp)(const void *, const void *))
+{
+    uint depth = 0;
+    size_t i;
+
+    /* allow 2 * log2(n) levels of partitioning before falling back */
+    for (i = n; i > 1; i >>= 1)
+        depth += 2;
+
+    introsort(aa, n, es, cmp, depth);
 }
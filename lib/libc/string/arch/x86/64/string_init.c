@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <debug.h>
+#include <stdint.h>
+#include <lk/init.h>
+
+/* copies at least this big use rep movs, unless the cpu has fast short rep movsb */
+#ifndef X86_MEMCPY_REP_THRESHOLD
+#define X86_MEMCPY_REP_THRESHOLD 512
+#endif
+
+/* copies at least this big bypass the cache, 0 sizes it from the last level cache */
+#ifndef X86_MEMCPY_NT_THRESHOLD
+#define X86_MEMCPY_NT_THRESHOLD 0
+#endif
+
+/* fallback if the cpu won't describe its caches */
+#define DEFAULT_NT_THRESHOLD (1024 * 1024)
+
+#define CPUID_7_EBX_ERMS (1 << 9)
+#define CPUID_7_EDX_FSRM (1 << 4)
+
+/*
+ * Read by memcpy.S and memset.S. They start out sending everything down the
+ * register loop, memcpy gets called long before this runs.
+ */
+size_t x86_memcpy_rep_threshold = SIZE_MAX;
+size_t x86_memcpy_nt_threshold = SIZE_MAX;
+uint8_t x86_string_erms;
+
+static void cpuid(uint32_t leaf, uint32_t subleaf,
+                  uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d)
+{
+    __asm__ __volatile__
+    ("cpuid" : "=a" (*a), "=b" (*b), "=c" (*c), "=d" (*d) : "a" (leaf), "c" (subleaf));
+}
+
+/* size of the biggest cache the deterministic cache leaf knows about, 0 if none */
+static size_t last_level_cache_size(uint32_t max_leaf)
+{
+    uint32_t a, b, c, d;
+    size_t size = 0;
+
+    if (max_leaf < 4)
+        return 0;
+
+    for (uint32_t i = 0; ; i++) {
+        cpuid(4, i, &a, &b, &c, &d);
+        if ((a & 0x1f) == 0)
+            break;
+
+        size_t ways = (b >> 22) + 1;
+        size_t partitions = ((b >> 12) & 0x3ff) + 1;
+        size_t line = (b & 0xfff) + 1;
+        size_t sets = (size_t)c + 1;
+        size_t s = ways * partitions * line * sets;
+        if (s > size)
+            size = s;
+    }
+
+    return size;
+}
+
+static void x86_string_init(uint level)
+{
+    uint32_t max_leaf, a, b, c, d;
+    bool erms = false, fsrm = false;
+
+    cpuid(0, 0, &max_leaf, &b, &c, &d);
+    if (max_leaf >= 7) {
+        cpuid(7, 0, &a, &b, &c, &d);
+        erms = b & CPUID_7_EBX_ERMS;
+        fsrm = d & CPUID_7_EDX_FSRM;
+    }
+
+    size_t nt = X86_MEMCPY_NT_THRESHOLD;
+    if (nt == 0) {
+        nt = last_level_cache_size(max_leaf);
+        if (nt == 0)
+            nt = DEFAULT_NT_THRESHOLD;
+    }
+    /* the streaming loop needs at least a couple of lines past the alignment */
+    if (nt < 256)
+        nt = 256;
+
+    x86_string_erms = erms;
+    x86_memcpy_rep_threshold = fsrm ? 0 : X86_MEMCPY_REP_THRESHOLD;
+    x86_memcpy_nt_threshold = nt;
+
+    dprintf(SPEW, "x86 string ops: erms %d fsrm %d, rep above %zu, non temporal above %zu\n",
+            erms, fsrm, x86_memcpy_rep_threshold, x86_memcpy_nt_threshold);
+}
+
+LK_INIT_HOOK(x86_string, x86_string_init, LK_INIT_LEVEL_EARLIEST);
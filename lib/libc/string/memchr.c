@@ -26,20 +26,28 @@
  */
 #include <string.h>
 #include <sys/types.h>
+#include "word.h"
 
 void *
 memchr(void const *buf, int c, size_t len)
 {
-    size_t i;
     unsigned char const *b= buf;
     unsigned char        x= (c&0xff);
 
-    for (i= 0; i< len; i++) {
-        if (b[i]== x) {
-            return (void *)(b+i);
-        }
+    for (; len && !WORD_ALIGNED(b); len--, b++) {
+        if (*b == x)
+            return (void *)b;
+    }
+
+    const word pattern = WORD_REPEAT(x);
+    const word *w = (const word *)b;
+    for (; len >= lsize && !WORD_HAS_ZERO(*w ^ pattern); len -= lsize)
+        w++;
+
+    for (b = (unsigned char const *)w; len; len--, b++) {
+        if (*b == x)
+            return (void *)b;
     }
 
     return NULL;
 }
-
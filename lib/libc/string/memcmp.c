@@ -26,15 +26,33 @@
  */
 #include <string.h>
 #include <sys/types.h>
+#include "word.h"
 
 int
 memcmp(const void *cs, const void *ct, size_t count)
 {
-    const unsigned char *su1, *su2;
-    signed char res = 0;
+    const unsigned char *su1 = cs, *su2 = ct;
 
-    for (su1 = cs, su2 = ct; 0 < count; ++su1, ++su2, count--)
-        if ((res = *su1 - *su2) != 0)
-            break;
-    return res;
+    /* only worth going a word at a time if both line up the same way */
+    if ((((uintptr_t)su1 ^ (uintptr_t)su2) & lmask) == 0) {
+        for (; count && !WORD_ALIGNED(su1); count--, su1++, su2++) {
+            if (*su1 != *su2)
+                return *su1 - *su2;
+        }
+
+        const word *w1 = (const word *)su1, *w2 = (const word *)su2;
+        for (; count >= lsize && *w1 == *w2; count -= lsize) {
+            w1++;
+            w2++;
+        }
+        su1 = (const unsigned char *)w1;
+        su2 = (const unsigned char *)w2;
+    }
+
+    for (; count; count--, su1++, su2++) {
+        if (*su1 != *su2)
+            return *su1 - *su2;
+    }
+
+    return 0;
 }
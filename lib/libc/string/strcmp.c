@@ -26,16 +26,32 @@
  */
 #include <string.h>
 #include <sys/types.h>
+#include "word.h"
 
 int
 strcmp(char const *cs, char const *ct)
 {
-    signed char __res;
+    const unsigned char *s1 = (const unsigned char *)cs;
+    const unsigned char *s2 = (const unsigned char *)ct;
 
-    while (1) {
-        if ((__res = *cs - *ct++) != 0 || !*cs++)
-            break;
+    if ((((uintptr_t)s1 ^ (uintptr_t)s2) & lmask) == 0) {
+        for (; !WORD_ALIGNED(s1); s1++, s2++) {
+            if (*s1 != *s2 || !*s1)
+                return *s1 - *s2;
+        }
+
+        /* skip whole words that match and don't end the string */
+        const word *w1 = (const word *)s1, *w2 = (const word *)s2;
+        while (*w1 == *w2 && !WORD_HAS_ZERO(*w1)) {
+            w1++;
+            w2++;
+        }
+        s1 = (const unsigned char *)w1;
+        s2 = (const unsigned char *)w2;
     }
 
-    return __res;
+    for (;; s1++, s2++) {
+        if (*s1 != *s2 || !*s1)
+            return *s1 - *s2;
+    }
 }
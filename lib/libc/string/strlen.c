@@ -26,16 +26,24 @@
  */
 #include <string.h>
 #include <sys/types.h>
+#include "word.h"
 
 size_t
 strlen(char const *s)
 {
-    size_t i;
+    const char *p = s;
 
-    i= 0;
-    while (s[i]) {
-        i+= 1;
+    for (; !WORD_ALIGNED(p); p++) {
+        if (!*p)
+            return p - s;
     }
 
-    return i;
+    const word *w = (const word *)p;
+    while (!WORD_HAS_ZERO(*w))
+        w++;
+
+    for (p = (const char *)w; *p; p++)
+        ;
+
+    return p - s;
 }
@@ -26,17 +26,33 @@
  */
 #include <string.h>
 #include <sys/types.h>
+#include "word.h"
 
 int
 strncmp(char const *cs, char const *ct, size_t count)
 {
-    signed char __res = 0;
+    const unsigned char *s1 = (const unsigned char *)cs;
+    const unsigned char *s2 = (const unsigned char *)ct;
 
-    while (count > 0) {
-        if ((__res = *cs - *ct++) != 0 || !*cs++)
-            break;
-        count--;
+    if ((((uintptr_t)s1 ^ (uintptr_t)s2) & lmask) == 0) {
+        for (; count && !WORD_ALIGNED(s1); count--, s1++, s2++) {
+            if (*s1 != *s2 || !*s1)
+                return *s1 - *s2;
+        }
+
+        const word *w1 = (const word *)s1, *w2 = (const word *)s2;
+        for (; count >= lsize && *w1 == *w2 && !WORD_HAS_ZERO(*w1); count -= lsize) {
+            w1++;
+            w2++;
+        }
+        s1 = (const unsigned char *)w1;
+        s2 = (const unsigned char *)w2;
+    }
+
+    for (; count; count--, s1++, s2++) {
+        if (*s1 != *s2 || !*s1)
+            return *s1 - *s2;
     }
 
-    return __res;
+    return 0;
 }
@@ -26,13 +26,23 @@
  */
 #include <string.h>
 #include <sys/types.h>
+#include "word.h"
 
 size_t
 strnlen(char const *s, size_t count)
 {
-    const char *sc;
+    const char *sc = s;
 
-    for (sc = s; count-- && *sc != '\0'; ++sc)
+    for (; count && !WORD_ALIGNED(sc); count--, sc++) {
+        if (*sc == '\0')
+            return sc - s;
+    }
+
+    const word *w = (const word *)sc;
+    for (; count >= lsize && !WORD_HAS_ZERO(*w); count -= lsize)
+        w++;
+
+    for (sc = (const char *)w; count-- && *sc != '\0'; ++sc)
         ;
     return sc - s;
 }
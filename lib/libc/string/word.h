@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <stdint.h>
+
+/*
+ * Helpers for the routines that scan a word at a time. Once a pointer is
+ * word aligned, loading the whole word can't cross into another page, so
+ * it's fine to read a few bytes past the terminator.
+ */
+typedef unsigned long __MAY_ALIAS word;
+
+#define lsize sizeof(word)
+#define lmask (lsize - 1)
+
+#define WORD_ONES ((word)-1 / 0xff)
+#define WORD_HIGHS (WORD_ONES * 0x80)
+
+/* c copied into every byte */
+#define WORD_REPEAT(c) (WORD_ONES * (unsigned char)(c))
+
+/* nonzero if any byte of w is zero */
+#define WORD_HAS_ZERO(w) (((w) - WORD_ONES) & ~(w) & WORD_HIGHS)
+
+#define WORD_ALIGNED(p) (((uintptr_t)(p) & lmask) == 0)
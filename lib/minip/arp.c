@@ -27,8 +27,10 @@
 #include <string.h>
 #include <malloc.h>
 #include <stdio.h>
+#include <err.h>
 #include <kernel/thread.h>
-#include <kernel/mutex.h>
+#include <kernel/rwlock.h>
+#include <platform.h>
 #include <trace.h>
 
 typedef union {
@@ -37,34 +39,102 @@ typedef union {
 } ipv4_t;
 
 #define LOCAL_TRACE 0
-static struct list_node arp_list;
+
+/* table geometry, ARP_HASH_SIZE must be a power of 2 */
+#define ARP_HASH_SIZE       32
+#define ARP_MAX_ENTRIES     64
+
+/* frames held per unresolved entry, the oldest is dropped past this */
+#define ARP_PENDING_MAX     8
+
+/* requests go out this often while unresolved, the entry is dropped after the last one */
+#define ARP_RETRY_INTERVAL  250
+#define ARP_MAX_RETRIES     4
+
+/* resolved entries not heard from in this long are dropped, swept this often */
+#define ARP_ENTRY_TIMEOUT   (5 * 60 * 1000)
+#define ARP_AGE_INTERVAL    (30 * 1000)
+
 typedef struct {
     struct list_node node;
     uint32_t addr;
+    minip_iface_t *iface; /* the link the host is on */
     uint8_t mac[6];
+    bool resolved;
+    uint8_t retries;
+    lk_time_t updated; /* last time we heard from the host, or asked about it */
+
+    /* frames waiting on this entry to resolve */
+    struct list_node pending;
+    uint pending_count;
 } arp_entry_t;
 
-static mutex_t arp_mutex = MUTEX_INITIAL_VALUE(arp_mutex);
+static struct list_node arp_table[ARP_HASH_SIZE];
+static uint arp_entry_count;
+
+static net_timer_t arp_timer;
+static bool arp_timer_armed;
+
+static rwlock_t arp_lock = RWLOCK_INITIAL_VALUE(arp_lock);
+
+static void arp_timer_cb(void *arg);
 
 void arp_cache_init(void)
 {
-    list_initialize(&arp_list);
+    for (uint i = 0; i < ARP_HASH_SIZE; i++)
+        list_initialize(&arp_table[i]);
 }
 
-static inline void mru_update(struct list_node *entry)
+static inline struct list_node *arp_bucket(uint32_t addr)
 {
-    if (arp_list.next == entry)
-        return;
+    uint32_t h = addr ^ (addr >> 16);
+    h ^= h >> 8;
+
+    return &arp_table[h & (ARP_HASH_SIZE - 1)];
+}
+
+static arp_entry_t *arp_find(uint32_t addr)
+{
+    arp_entry_t *arp;
+
+    list_for_every_entry(arp_bucket(addr), arp, arp_entry_t, node) {
+        if (arp->addr == addr)
+            return arp;
+    }
+
+    return NULL;
+}
+
+/* call with the write lock held */
+static arp_entry_t *arp_create(minip_iface_t *iface, uint32_t addr)
+{
+    if (arp_entry_count >= ARP_MAX_ENTRIES)
+        return NULL;
+
+    arp_entry_t *arp = calloc(1, sizeof(arp_entry_t));
+    if (!arp)
+        return NULL;
+
+    arp->addr = addr;
+    arp->iface = iface;
+    list_initialize(&arp->pending);
+    list_add_head(arp_bucket(addr), &arp->node);
+    arp_entry_count++;
 
-    list_delete(entry);
-    list_add_head(&arp_list, entry);
+    return arp;
 }
 
-void arp_cache_update(uint32_t addr, const uint8_t mac[6])
+/* call with the write lock held */
+static void arp_timer_arm(lk_time_t delay)
+{
+    net_timer_set(&arp_timer, arp_timer_cb, NULL, delay);
+    arp_timer_armed = true;
+}
+
+void arp_cache_update(minip_iface_t *iface, uint32_t addr, const uint8_t mac[6])
 {
     arp_entry_t *arp;
     ipv4_t ip;
-    bool found = false;
 
     ip.u = addr;
 
@@ -73,56 +143,198 @@ void arp_cache_update(uint32_t addr, const uint8_t mac[6])
         return;
     }
 
-    /* If the entry is in the cache update the address and move
-     * it to head */
-    mutex_acquire(&arp_mutex);
-    list_for_every_entry(&arp_list, arp, arp_entry_t, node) {
-        if (arp->addr == addr) {
-            arp->addr = addr;
-            mru_update(&arp->node);
-            found = true;
-            break;
-        }
-    }
+    /* this is called for every packet received, so skip the exclusive lock for a
+     * host we already know about and heard from recently */
+    lk_time_t now = current_time();
+    rwlock_acquire_read(&arp_lock);
+    arp = arp_find(addr);
+    bool fresh = arp && arp->resolved && arp->iface == iface && memcmp(arp->mac, mac, sizeof(arp->mac)) == 0 &&
+                 now - arp->updated < ARP_ENTRY_TIMEOUT / 2;
+    rwlock_release_read(&arp_lock);
+    if (fresh)
+        return;
+
+    struct list_node flush = LIST_INITIAL_VALUE(flush);
+    pktbuf_t *p;
 
-    if (!found) {
+    rwlock_acquire_write(&arp_lock);
+    arp = arp_find(addr);
+    if (!arp) {
         LTRACEF("Adding %u.%u.%u.%u -> %02x:%02x:%02x:%02x:%02x:%02x to cache\n",
                 ip.b[0], ip.b[1], ip.b[2], ip.b[3],
                 mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
-        arp = malloc(sizeof(arp_entry_t));
+        arp = arp_create(iface, addr);
         if (arp == NULL) {
             goto err;
         }
-
-        arp->addr = addr;
-        memcpy(arp->mac, mac, sizeof(arp->mac));
-        list_add_head(&arp_list, &arp->node);
     }
 
+    memcpy(arp->mac, mac, sizeof(arp->mac));
+    arp->iface = iface;
+    arp->resolved = true;
+    arp->retries = 0;
+    arp->updated = now;
+
+    /* anything waiting on this host can go now */
+    while ((p = list_remove_head_type(&arp->pending, pktbuf_t, list)))
+        list_add_tail(&flush, &p->list);
+    arp->pending_count = 0;
+
+    if (!arp_timer_armed)
+        arp_timer_arm(ARP_AGE_INTERVAL);
+
 err:
-    mutex_release(&arp_mutex);
-    return;
+    rwlock_release_write(&arp_lock);
+
+    while ((p = list_remove_head_type(&flush, pktbuf_t, list))) {
+        struct eth_hdr *eth = (struct eth_hdr *)p->data;
+        mac_addr_copy(eth->dst_mac, mac);
+        iface->tx(p);
+    }
+}
+
+/* Looks up the MAC address for the provided ip addr, false if it isn't resolved */
+bool arp_cache_lookup(uint32_t addr, uint8_t mac[6])
+{
+    bool found = false;
+
+    rwlock_acquire_read(&arp_lock);
+    arp_entry_t *arp = arp_find(addr);
+    if (arp && arp->resolved) {
+        mac_addr_copy(mac, arp->mac);
+        found = true;
+    }
+    rwlock_release_read(&arp_lock);
+
+    return found;
+}
+
+status_t arp_output(pktbuf_t *p, minip_iface_t *iface, uint32_t host)
+{
+    struct eth_hdr *eth = (struct eth_hdr *)p->data;
+    arp_entry_t *arp;
+
+    if (host == IPV4_BCAST) {
+        mac_addr_copy(eth->dst_mac, bcast_mac);
+        iface->tx(p);
+        return NO_ERROR;
+    }
+
+    if (arp_cache_lookup(host, eth->dst_mac)) {
+        iface->tx(p);
+        return NO_ERROR;
+    }
+
+    bool send_request = false;
+    pktbuf_t *dropped = NULL;
+
+    rwlock_acquire_write(&arp_lock);
+
+    arp = arp_find(host);
+    if (arp && arp->resolved) {
+        /* resolved while we were switching locks */
+        mac_addr_copy(eth->dst_mac, arp->mac);
+        rwlock_release_write(&arp_lock);
+        iface->tx(p);
+        return NO_ERROR;
+    }
+
+    if (!arp) {
+        arp = arp_create(iface, host);
+        if (!arp) {
+            rwlock_release_write(&arp_lock);
+            pktbuf_free(p, true);
+            return ERR_NO_MEMORY;
+        }
+
+        /* first request goes out below, the timer handles the retries */
+        arp->retries = 1;
+        arp->updated = current_time();
+        send_request = true;
+        arp_timer_arm(ARP_RETRY_INTERVAL);
+    }
+
+    if (arp->pending_count == ARP_PENDING_MAX) {
+        dropped = list_remove_head_type(&arp->pending, pktbuf_t, list);
+        arp->pending_count--;
+    }
+    list_add_tail(&arp->pending, &p->list);
+    arp->pending_count++;
+
+    rwlock_release_write(&arp_lock);
+
+    if (dropped)
+        pktbuf_free(dropped, true);
+    if (send_request)
+        arp_send_request(iface, host);
+
+    return NO_ERROR;
 }
 
-/* Looks up and returns a MAC address based on the provided ip addr */
-uint8_t *arp_cache_lookup(uint32_t addr)
+/* retries requests for unresolved entries, gives up on them, and ages out stale ones */
+static void arp_timer_cb(void *arg)
 {
-    arp_entry_t *arp = NULL;
-    uint8_t *ret = NULL;
-
-    /* If the entry is in the cache update the address and move
-     * it to head */
-    mutex_acquire(&arp_mutex);
-    list_for_every_entry(&arp_list, arp, arp_entry_t, node) {
-        if (arp->addr == addr) {
-            mru_update(&arp->node);
-            ret = arp->mac;
-            break;
+    struct {
+        minip_iface_t *iface;
+        uint32_t addr;
+    } resend[ARP_MAX_ENTRIES];
+    uint resend_count = 0;
+    struct list_node dropped = LIST_INITIAL_VALUE(dropped);
+    bool resolving = false;
+
+    lk_time_t now = current_time();
+
+    rwlock_acquire_write(&arp_lock);
+    arp_timer_armed = false;
+
+    for (uint i = 0; i < ARP_HASH_SIZE; i++) {
+        arp_entry_t *arp, *temp;
+        list_for_every_entry_safe(&arp_table[i], arp, temp, arp_entry_t, node) {
+            if (arp->resolved) {
+                if (now - arp->updated < ARP_ENTRY_TIMEOUT)
+                    continue;
+                LTRACEF("aging out %u.%u.%u.%u\n", IPV4_SPLIT(arp->addr));
+            } else {
+                if (now - arp->updated < ARP_RETRY_INTERVAL) {
+                    resolving = true;
+                    continue;
+                }
+                if (arp->retries < ARP_MAX_RETRIES) {
+                    arp->retries++;
+                    arp->updated = now;
+                    resend[resend_count].iface = arp->iface;
+                    resend[resend_count].addr = arp->addr;
+                    resend_count++;
+                    resolving = true;
+                    continue;
+                }
+
+                /* nobody answered, let go of the frames that were waiting */
+                LTRACEF("giving up on %u.%u.%u.%u\n", IPV4_SPLIT(arp->addr));
+                pktbuf_t *p;
+                while ((p = list_remove_head_type(&arp->pending, pktbuf_t, list)))
+                    list_add_tail(&dropped, &p->list);
+            }
+
+            list_delete(&arp->node);
+            arp_entry_count--;
+            free(arp);
         }
     }
-    mutex_release(&arp_mutex);
 
-    return ret;
+    if (resolving)
+        arp_timer_arm(ARP_RETRY_INTERVAL);
+    else if (arp_entry_count > 0)
+        arp_timer_arm(ARP_AGE_INTERVAL);
+
+    rwlock_release_write(&arp_lock);
+
+    for (uint i = 0; i < resend_count; i++)
+        arp_send_request(resend[i].iface, resend[i].addr);
+
+    pktbuf_t *p;
+    while ((p = list_remove_head_type(&dropped, pktbuf_t, list)))
+        pktbuf_free(p, true);
 }
 
 void arp_cache_dump(void)
@@ -130,20 +342,29 @@ void arp_cache_dump(void)
     int i = 0;
     arp_entry_t *arp;
 
-    if (!list_is_empty(&arp_list)) {
-        list_for_every_entry(&arp_list, arp, arp_entry_t, node) {
-            ipv4_t ip;
-            ip.u = arp->addr;
-            printf("%2d: %u.%u.%u.%u -> %02x:%02x:%02x:%02x:%02x:%02x\n",
-                   i++, ip.b[0], ip.b[1], ip.b[2], ip.b[3],
-                   arp->mac[0], arp->mac[1], arp->mac[2], arp->mac[3], arp->mac[4], arp->mac[5]);
+    rwlock_acquire_read(&arp_lock);
+    if (arp_entry_count > 0) {
+        for (uint b = 0; b < ARP_HASH_SIZE; b++) {
+            list_for_every_entry(&arp_table[b], arp, arp_entry_t, node) {
+                ipv4_t ip;
+                ip.u = arp->addr;
+                if (arp->resolved) {
+                    printf("%2d: %u.%u.%u.%u -> %02x:%02x:%02x:%02x:%02x:%02x\n",
+                           i++, ip.b[0], ip.b[1], ip.b[2], ip.b[3],
+                           arp->mac[0], arp->mac[1], arp->mac[2], arp->mac[3], arp->mac[4], arp->mac[5]);
+                } else {
+                    printf("%2d: %u.%u.%u.%u -> (incomplete, %u queued)\n",
+                           i++, ip.b[0], ip.b[1], ip.b[2], ip.b[3], arp->pending_count);
+                }
+            }
         }
     } else {
         printf("The arp table is empty\n");
     }
+    rwlock_release_read(&arp_lock);
 }
 
-int arp_send_request(uint32_t addr)
+int arp_send_request(minip_iface_t *iface, uint32_t addr)
 {
     pktbuf_t *p;
     struct eth_hdr *eth;
@@ -155,50 +376,18 @@ int arp_send_request(uint32_t addr)
 
     eth = pktbuf_prepend(p, sizeof(struct eth_hdr));
     arp = pktbuf_append(p, sizeof(struct arp_pkt));
-    minip_build_mac_hdr(eth, bcast_mac, ETH_TYPE_ARP);
+    minip_build_mac_hdr(iface, eth, bcast_mac, ETH_TYPE_ARP);
 
     arp->htype = htons(0x0001);
     arp->ptype = htons(0x0800);
     arp->hlen = 6;
     arp->plen = 4;
     arp->oper = htons(ARP_OPER_REQUEST);
-    arp->spa = minip_get_ipaddr();
+    arp->spa = iface->ip;
     arp->tpa = addr;
-    minip_get_macaddr(arp->sha);
+    mac_addr_copy(arp->sha, iface->mac);
     mac_addr_copy(arp->tha, bcast_mac);
 
-    minip_tx_handler(p);
+    iface->tx(p);
     return 0;
 }
-
-static void handle_arp_timeout_cb(void *arg)
-{
-    *(bool *)arg = true;
-}
-
-const uint8_t *arp_get_dest_mac(uint32_t host)
-{
-    const uint8_t *dst_mac = NULL;
-    bool arp_timeout = false;
-    net_timer_t arp_timeout_timer;
-
-    if (host == IPV4_BCAST) {
-        return bcast_mac;
-    }
-
-    dst_mac = arp_cache_lookup(host);
-    if (dst_mac == NULL) {
-        arp_send_request(host);
-        memset(&arp_timeout_timer, 0, sizeof(arp_timeout_timer));
-        net_timer_set(&arp_timeout_timer, handle_arp_timeout_cb, &arp_timeout, 100);
-        while (!arp_timeout) {
-            dst_mac = arp_cache_lookup(host);
-            if (dst_mac) {
-                net_timer_cancel(&arp_timeout_timer);
-                break;
-            }
-        }
-    }
-
-    return dst_mac;
-}
@@ -23,76 +23,159 @@
 
 #include "minip-internal.h"
 
-/* XXX alternate implementation, merge */
-uint16_t ones_sum16(uint32_t sum, const void *_buf, int len)
+/*
+ * Ones complement sum over a buffer, in the byte order it's stored in.
+ *
+ * Rather than folding the carry back in on every 16 bit add, 32 bit words
+ * are accumulated into a 64 bit sum that can't overflow for anything that
+ * fits in a packet, and folded once at the end. 2^16 is 1 mod 0xffff, so
+ * the fold gives the same answer as adding 16 bits at a time.
+ *
+ * The loads follow the source alignment. If the buffer starts on an odd
+ * address the first byte is taken on its own and the rest summed from the
+ * next even address, which leaves every 16 bit word byte swapped; swapping
+ * the folded result back fixes that up.
+ */
+static inline __ALWAYS_INLINE uint64_t sum_copy(void *_dst, const void *_src, size_t len, bool copy)
 {
-    const uint16_t *buf = _buf;
+    uint8_t *dst = _dst;
+    const uint8_t *src = _src;
+    uint64_t sum = 0;
+    bool odd = (uintptr_t)src & 1;
+    uint16_t w;
+
+    if (odd && len) {
+        w = 0;
+        ((uint8_t *)&w)[1] = *src;
+        sum += w;
+        if (copy)
+            *dst++ = *src;
+        src++;
+        len--;
+    }
 
-    while (len >= 2) {
-        sum += *buf++;
-        if (sum & 0x80000000)
-            sum = (sum & 0xffff) + (sum >> 16);
+    if (((uintptr_t)src & 2) && len >= 2) {
+        memcpy(&w, src, 2);
+        sum += w;
+        if (copy) {
+            memcpy(dst, &w, 2);
+            dst += 2;
+        }
+        src += 2;
         len -= 2;
     }
 
+    /* src is word aligned from here on */
+    const uint32_t *s32 = (const uint32_t *)src;
+    while (len >= 16) {
+        uint32_t a = s32[0];
+        uint32_t b = s32[1];
+        uint32_t c = s32[2];
+        uint32_t d = s32[3];
+        sum += (uint64_t)a + b + c + d;
+        if (copy) {
+            memcpy(dst, s32, 16);
+            dst += 16;
+        }
+        s32 += 4;
+        len -= 16;
+    }
+    while (len >= 4) {
+        sum += *s32;
+        if (copy) {
+            memcpy(dst, s32, 4);
+            dst += 4;
+        }
+        s32++;
+        len -= 4;
+    }
+    src = (const uint8_t *)s32;
+
+    if (len >= 2) {
+        memcpy(&w, src, 2);
+        sum += w;
+        if (copy) {
+            memcpy(dst, &w, 2);
+            dst += 2;
+        }
+        src += 2;
+        len -= 2;
+    }
+
+    /* a trailing byte is the first half of a word padded with zero */
     if (len) {
-        uint16_t temp = htons((*(uint8_t *)buf) << 8);
-        sum += temp;
+        w = 0;
+        ((uint8_t *)&w)[0] = *src;
+        sum += w;
+        if (copy)
+            *dst = *src;
     }
 
-    while (sum >> 16)
-        sum = (sum & 0xffff) + (sum >> 16);
+    /* fold 64 -> 16 */
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+
+    if (odd)
+        sum = ((sum & 0xff) << 8) | (sum >> 8);
 
     return sum;
 }
 
-uint16_t rfc1701_chksum(const uint8_t *buf, size_t len)
+static inline uint16_t fold(uint64_t sum)
 {
-    uint32_t total = 0;
-    uint16_t chksum = 0;
-    const uint16_t *p = (const uint16_t *) buf;
-
-    // Length is in bytes
-    for (size_t i = 0; i < len / 2; i++ ) {
-        total += p[i];
-    }
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return sum;
+}
 
-    chksum = (total & 0xFFFF) + (total >> 16);
-    chksum = ~chksum;
+uint16_t ones_sum16(uint32_t sum, const void *_buf, int len)
+{
+    return fold((uint64_t)sum + sum_copy(NULL, _buf, len, false));
+}
 
-    return chksum;
+uint16_t ones_sum16_copy(uint32_t sum, void *dst, const void *src, size_t len)
+{
+    return fold((uint64_t)sum + sum_copy(dst, src, len, true));
 }
 
-#if MINIP_USE_UDP_CHECKSUM
-uint16_t rfc768_chksum(struct ipv4_hdr *ipv4, struct udp_hdr *udp)
+uint16_t ones_sum16_add(uint16_t sum, uint16_t part, size_t offset)
 {
-    uint32_t total = 0;
-    uint16_t chksum = 0;
-    size_t len = ntohs(udp->len);
-    uint16_t *p;
-
-    p = (uint16_t *)ipv4->src_addr;
-    total += htons(p[0]);
-    total += htons(p[1]);
-
-    p = (uint16_t *)ipv4->dst_addr;
-    total += htons(p[0]);
-    total += htons(p[1]);
-
-    p = (const uint16_t *)udp->data;
-    for (size_t i = 0; i < len / 2; i++ ) {
-        total += p[i];
-    }
+    /* a part that starts on an odd offset has all its bytes in the other lane */
+    if (offset & 1)
+        part = (part << 8) | (part >> 8);
 
-    total += IP_PROTO_UDP;
-    total += udp->len;
-    total += udp->src_port;
-    total += udp->dst_port;
-    total += ipv4->len;
+    return fold((uint32_t)sum + part);
+}
 
-    chksum = (total & 0xFFFF) + (total >> 16);
-    chksum = ~chksum;
+uint16_t rfc1701_chksum(const uint8_t *buf, size_t len)
+{
+    return ~ones_sum16(0, buf, len);
+}
 
-    return chksum;
+#if MINIP_USE_UDP_CHECKSUM
+uint16_t rfc768_chksum(struct ipv4_hdr *ipv4, udp_hdr_t *udp, uint16_t data_sum)
+{
+    struct {
+        uint32_t src_addr;
+        uint32_t dst_addr;
+        uint8_t zero;
+        uint8_t proto;
+        uint16_t len;
+    } __PACKED pheader;
+
+    pheader.src_addr = ipv4->src_addr;
+    pheader.dst_addr = ipv4->dst_addr;
+    pheader.zero = 0;
+    pheader.proto = IP_PROTO_UDP;
+    pheader.len = udp->len;
+
+    uint16_t sum = ones_sum16(data_sum, &pheader, sizeof(pheader));
+    sum = ~ones_sum16(sum, udp, sizeof(*udp));
+
+    /* a computed zero goes out as all ones, zero means no checksum */
+    return sum ? sum : 0xffff;
 }
 #endif
@@ -29,13 +29,27 @@
 #include <debug.h>
 #include <malloc.h>
 
+#include <kernel/event.h>
 #include <kernel/thread.h>
 #include <sys/types.h>
 #include <endian.h>
 #include <string.h>
+#include <stdlib.h>
+#if WITH_LIB_SYSPARAM
+#include <lib/sysparam.h>
+#endif
 
 #define TRACE_DHCP 0
 
+/* resends start quick and back off */
+#define DHCP_RETRY_MIN      250
+#define DHCP_RETRY_MAX      4000
+
+/* requests for the cached address before falling back to a discover */
+#define DHCP_REBOOT_TRIES   2
+
+#define DHCP_LEASE_SYSPARAM "net.dhcp.lease"
+
 typedef struct dhcp_msg {
     u8 opcode;
     u8 hwtype;  // hw addr type
@@ -77,6 +91,7 @@ udp_socket_t *dhcp_udp_handle;
 #define OPT_REQUEST_IP  50  // len 4
 #define OPT_MSG_TYPE    53  // len 1, type same as op
 #define OPT_SERVER_ID   54  // len 4, server ident ipaddr
+#define OPT_RAPID_COMMIT 80 // len 0, ack a discover straight away (RFC 4039)
 #define OPT_DONE    255
 
 #define DHCP_CLIENT_PORT    68
@@ -96,8 +111,35 @@ static void printip(const char *name, u32 x)
     printf("%s %d.%d.%d.%d\n", name, ip.b[0], ip.b[1], ip.b[2], ip.b[3]);
 }
 
-static volatile int configured = 0;
-static int cfgstate = 0;
+/*
+ * With a lease from a previous boot we start in REBOOTING, asking for the same
+ * address again (INIT-REBOOT, RFC 2131 3.2). A NAK, or no answer, falls back to
+ * SELECTING, which discovers, and takes the ack straight away if the server
+ * does rapid commit, or requests the offer in REQUESTING otherwise.
+ */
+enum dhcp_state {
+    DHCP_REBOOTING,
+    DHCP_SELECTING,
+    DHCP_REQUESTING,
+    DHCP_BOUND,
+};
+
+/* what is kept in sysparam across boots */
+struct dhcp_lease {
+    u8 mac[6];
+    u8 pad[2];
+    u32 ip;
+};
+
+static volatile enum dhcp_state cfgstate = DHCP_SELECTING;
+static u32 dhcp_xid;
+static struct dhcp_lease lease;
+static bool lease_valid;
+static bool lease_changed;
+
+/* signaled when the thread has something to do before its next resend, and once bound */
+static event_t dhcp_event;
+static event_t dhcp_bound_event;
 
 static void dhcp_discover(u32 xid)
 {
@@ -119,6 +161,9 @@ static void dhcp_discover(u32 xid)
     *opt++ = 1;
     *opt++ = OP_DHCPDISCOVER;
 
+    *opt++ = OPT_RAPID_COMMIT;
+    *opt++ = 0;
+
     if (hostname && hostname[0]) {
         size_t len = strlen(hostname);
         *opt++ = OPT_HOSTNAME;
@@ -129,7 +174,6 @@ static void dhcp_discover(u32 xid)
 
     *opt++ = OPT_DONE;
 
-    udp_send(&s.msg, sizeof(dhcp_msg_t) + (opt - s.opt), dhcp_udp_handle);
     status_t ret = udp_send(&s.msg, sizeof(dhcp_msg_t) + (opt - s.opt), dhcp_udp_handle);
     if (ret != NO_ERROR) {
         printf("DHCP_DISCOVER failed: %d\n", ret);
@@ -156,10 +200,13 @@ static void dhcp_request(u32 xid, u32 server, u32 reqip)
     *opt++ = 1;
     *opt++ = OP_DHCPREQUEST;
 
-    *opt++ = OPT_SERVER_ID;
-    *opt++ = 4;
-    memcpy(opt, &server, 4);
-    opt += 4;
+    /* a request for an address from an earlier boot doesn't name a server */
+    if (server) {
+        *opt++ = OPT_SERVER_ID;
+        *opt++ = 4;
+        memcpy(opt, &server, 4);
+        opt += 4;
+    }
 
     *opt++ = OPT_REQUEST_IP;
     *opt++ = 4;
@@ -195,16 +242,15 @@ static void dhcp_cb(void *data, size_t sz, uint32_t srcip, uint16_t srcport, voi
     if (sz < sizeof(dhcp_msg_t)) return;
 
     if (memcmp(msg->chaddr, mac, 6)) return;
+    if (msg->xid != dhcp_xid) return;
 
 #if TRACE_DHCP
     printf("dhcp op=%d len=%d from p=%d ip=", msg->opcode, sz, srcport);
     printip("", srcip);
 #endif
 
-    if (configured) {
-        printf("already configured\n");
+    if (cfgstate == DHCP_BOUND)
         return;
-    }
 #if TRACE_DHCP
     printip("ciaddr", msg->ciaddr);
     printip("yiaddr", msg->yiaddr);
@@ -254,34 +300,142 @@ done:
     if (gateway) printip("gateway", gateway);
     if (dns) printip("dns", dns);
 #endif
-    if (cfgstate == 0) {
-        if (op == OP_DHCPOFFER) {
-            printip("dhcp: offer:", msg->yiaddr);
-            if (server) {
-                dhcp_request(0xaabbccdd, server, msg->yiaddr);
-                cfgstate = 1;
+    bool ack = false;
+    switch (cfgstate) {
+        case DHCP_REBOOTING:
+            if (op == OP_DHCPACK) {
+                ack = true;
+            } else if (op == OP_DHCPNAK) {
+                /* our old address is no good here, start over */
+                printip("dhcp: nak for", lease.ip);
+                lease_valid = false;
+                lease_changed = true;
+                cfgstate = DHCP_SELECTING;
+                event_signal(&dhcp_event, false);
             }
+            break;
+        case DHCP_SELECTING:
+            if (op == OP_DHCPACK) {
+                /* rapid commit, the server skipped the offer */
+                ack = true;
+            } else if (op == OP_DHCPOFFER) {
+                printip("dhcp: offer:", msg->yiaddr);
+                if (server) {
+                    dhcp_request(dhcp_xid, server, msg->yiaddr);
+                    cfgstate = DHCP_REQUESTING;
+                }
+            }
+            break;
+        case DHCP_REQUESTING:
+            if (op == OP_DHCPACK) {
+                ack = true;
+            } else if (op == OP_DHCPNAK) {
+                cfgstate = DHCP_SELECTING;
+                event_signal(&dhcp_event, false);
+            }
+            break;
+        case DHCP_BOUND:
+            break;
+    }
+
+    if (ack) {
+        printip("dhcp: ack:", msg->yiaddr);
+        minip_set_ipaddr(msg->yiaddr);
+
+        if (!lease_valid || lease.ip != msg->yiaddr) {
+            memcpy(lease.mac, mac, sizeof(lease.mac));
+            lease.ip = msg->yiaddr;
+            lease_valid = true;
+            lease_changed = true;
         }
-    } else if (cfgstate == 1) {
-        if (op == OP_DHCPACK) {
-            printip("dhcp: ack:", msg->yiaddr);
-            minip_set_ipaddr(msg->yiaddr);
-            configured = 1;
-        }
+
+        cfgstate = DHCP_BOUND;
+        event_signal(&dhcp_event, false);
     }
 }
 
+#if WITH_LIB_SYSPARAM
+static void dhcp_load_lease(void)
+{
+    struct dhcp_lease l;
+
+    if (sysparam_read(DHCP_LEASE_SYSPARAM, &l, sizeof(l)) != sizeof(l))
+        return;
+
+    /* only good for the interface it was handed to */
+    if (memcmp(l.mac, mac, sizeof(l.mac)) || l.ip == IPV4_NONE)
+        return;
+
+    lease = l;
+    lease_valid = true;
+}
+#else
+static void dhcp_load_lease(void) {}
+#endif
+
+#if WITH_LIB_SYSPARAM && SYSPARAM_ALLOW_WRITE
+/* runs on the dhcp thread once bound, writing sysparams is too slow for the rx path */
+static void dhcp_save_lease(void)
+{
+    if (!lease_changed)
+        return;
+
+    sysparam_remove(DHCP_LEASE_SYSPARAM);
+    if (lease_valid)
+        sysparam_add(DHCP_LEASE_SYSPARAM, &lease, sizeof(lease));
+    sysparam_write();
+}
+#else
+static void dhcp_save_lease(void) {}
+#endif
+
 static int dhcp_thread(void *arg)
 {
+    lk_time_t delay = DHCP_RETRY_MIN;
+    uint reboot_tries = 0;
+
     for (;;) {
-        if (configured) break;
-        thread_sleep(500);
-        if (configured) break;
-        dhcp_discover(0xaabbccdd);
+        enum dhcp_state state = cfgstate;
+
+        if (state == DHCP_BOUND)
+            break;
+
+        if (state == DHCP_REBOOTING && reboot_tries++ >= DHCP_REBOOT_TRIES) {
+            /* nobody answered for our old address */
+            cfgstate = state = DHCP_SELECTING;
+            delay = DHCP_RETRY_MIN;
+        }
+
+        if (state == DHCP_REBOOTING) {
+            dhcp_request(dhcp_xid, 0, lease.ip);
+        } else {
+            /* a request that went unanswered starts over too */
+            cfgstate = DHCP_SELECTING;
+            dhcp_discover(dhcp_xid);
+        }
+
+        /* an answer that moves us along wakes us early, otherwise resend */
+        if (event_wait_timeout(&dhcp_event, delay) == NO_ERROR)
+            delay = DHCP_RETRY_MIN;
+        else
+            delay = MIN(delay * 2, DHCP_RETRY_MAX);
     }
+
+    event_signal(&dhcp_bound_event, true);
+
+    dhcp_save_lease();
+
     return 0;
 }
 
+status_t minip_dhcp_wait(lk_time_t timeout)
+{
+    if (!event_initialized(&dhcp_bound_event))
+        return ERR_NOT_READY;
+
+    return event_wait_timeout(&dhcp_bound_event, timeout);
+}
+
 static thread_t *dhcp_thr;
 
 void minip_init_dhcp(tx_func_t tx_func, void *tx_arg)
@@ -290,11 +444,22 @@ void minip_init_dhcp(tx_func_t tx_func, void *tx_arg)
 
     minip_init(tx_func, tx_arg, IPV4_NONE, IPV4_NONE, IPV4_NONE);
 
+    event_init(&dhcp_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    event_init(&dhcp_bound_event, false, 0);
+    dhcp_xid = rand();
+
+    dhcp_load_lease();
+    if (lease_valid) {
+        printip("dhcp: asking for our old address", lease.ip);
+        cfgstate = DHCP_REBOOTING;
+    }
+
     int ret = udp_open(IPV4_BCAST, DHCP_CLIENT_PORT, DHCP_SERVER_PORT, &dhcp_udp_handle);
     printf("dhcp opened udp: %d\n", ret);
 
     udp_listen(DHCP_CLIENT_PORT, dhcp_cb, NULL);
 
+    /* the first message goes out now, the rest of boot carries on while we wait for the answer */
     dhcp_thr = thread_create("dhcp", dhcp_thread, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
     thread_detach_and_resume(dhcp_thr);
 }
@@ -24,10 +24,13 @@
 #pragma once
 
 #include <endian.h>
+#include <iovec.h>
 #include <list.h>
 #include <stdint.h>
+#include <string.h>
 #include <sys/types.h>
 
+#include <kernel/port.h>
 #include <lib/pktbuf.h>
 
 #define IPV4(a,b,c,d) (((a)&0xFF)|(((b)&0xFF)<<8)|(((c)&0xFF)<<16)|(((d)&0xFF)<<24))
@@ -39,6 +42,8 @@
 typedef int (*tx_func_t)(pktbuf_t *p);
 typedef void (*udp_callback_t)(void *data, size_t len,
                                uint32_t srcaddr, uint16_t srcport, void *arg);
+/* the listener owns p, with p->data at the udp payload, and frees it with pktbuf_free when done */
+typedef void (*udp_pktbuf_callback_t)(pktbuf_t *p, uint32_t srcaddr, uint16_t srcport, void *arg);
 
 /* initialize minip with static configuration */
 void minip_init(tx_func_t tx_func, void *tx_arg,
@@ -47,9 +52,37 @@ void minip_init(tx_func_t tx_func, void *tx_arg,
 /* initialize minip with DHCP configuration */
 void minip_init_dhcp(tx_func_t tx_func, void *tx_arg);
 
+/* wait for minip_init_dhcp() to get an address, boot doesn't block on it otherwise */
+status_t minip_dhcp_wait(lk_time_t timeout);
+
+/* tx offloads the driver can do, and the most tcp payload it will cut up into mss sized frames */
+#define MINIP_TX_OFFLOAD_CSUM (1<<0) // fill in tcp checksums, see PKTBUF_FLAG_CKSUM_PARTIAL
+#define MINIP_TX_OFFLOAD_TSO  (1<<1) // cut up tcp frames, see pktbuf gso_size
+
+void minip_set_tx_offloads(uint32_t offloads, size_t tso_max_len);
+
 /* packet rx hook to hand to ethernet driver */
 void minip_rx_driver_callback(pktbuf_t *p);
 
+/* same, but the stack keeps p and frees it when it is done with it, so it can be
+ * handed on to a udp_listen_pktbuf listener without copying */
+void minip_rx_driver_callback_owned(pktbuf_t *p);
+
+/*
+ * more interfaces, minip_init sets up the first one and the calls above all act on it.
+ * a directly attached route is added for each, more go in with minip_route_add.
+ */
+typedef struct minip_iface minip_iface_t;
+
+minip_iface_t *minip_iface_add(tx_func_t tx_func, const uint8_t mac[6], uint32_t ip, uint32_t netmask);
+void minip_iface_rx(minip_iface_t *iface, pktbuf_t *p);
+void minip_iface_rx_owned(minip_iface_t *iface, pktbuf_t *p);
+
+/* the most specific route matching a destination wins, gateway is IPV4_NONE for a link.
+ * iface may be NULL to send through whichever one the gateway is attached to */
+status_t minip_route_add(uint32_t dest, uint32_t netmask, uint32_t gateway, minip_iface_t *iface);
+status_t minip_route_del(uint32_t dest, uint32_t netmask);
+
 /* global configuration state */
 void minip_get_macaddr(uint8_t *addr);
 void minip_set_macaddr(const uint8_t *addr);
@@ -66,6 +99,8 @@ uint32_t minip_parse_ipaddr(const char *addr, size_t len);
 typedef struct udp_socket udp_socket_t;
 
 int udp_listen(uint16_t port, udp_callback_t cb, void *arg);
+/* listen on port taking ownership of the received pktbufs, stop with udp_listen(port, NULL, NULL) */
+int udp_listen_pktbuf(uint16_t port, udp_pktbuf_callback_t cb, void *arg);
 status_t udp_open(uint32_t host, uint16_t sport, uint16_t dport, udp_socket_t **handle);
 status_t udp_send(void *buf, size_t len, udp_socket_t *handle);
 status_t udp_close(udp_socket_t *handle);
@@ -77,12 +112,83 @@ status_t tcp_open_listen(tcp_socket_t **handle, uint16_t port);
 status_t tcp_accept_timeout(tcp_socket_t *listen_socket, tcp_socket_t **accept_socket, lk_time_t timeout);
 status_t tcp_close(tcp_socket_t *socket);
 ssize_t tcp_read(tcp_socket_t *socket, void *buf, size_t len);
+
+/*
+ * Zero copy read: wait for received data and fill in up to two regions of
+ * the socket's receive buffer holding it, returning the total length. The
+ * data stays put, and keeps taking up the receive window, until it is handed
+ * back with tcp_read_release(), which may release less than was peeked.
+ */
+ssize_t tcp_read_peek(tcp_socket_t *socket, iovec_t regions[2]);
+status_t tcp_read_release(tcp_socket_t *socket, size_t len);
 ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len);
 
+/*
+ * Zero copy write: queue buf to be sent from where it is, without copying it
+ * into the socket's tx buffer. Returns without blocking; buf has to stay put
+ * until cb is called, with NO_ERROR once all of it has been acked or an error
+ * if the socket went away first. cb is called without the socket lock held.
+ */
+typedef void (*tcp_write_callback_t)(const void *buf, size_t len, void *arg, status_t err);
+status_t tcp_write_buffer(tcp_socket_t *socket, const void *buf, size_t len,
+                          tcp_write_callback_t cb, void *arg);
+
+typedef enum tcp_option {
+    TCP_OPT_RX_BUFFER_SIZE, // receive window, only on a listening socket
+    TCP_OPT_TX_BUFFER_SIZE, // send buffer, on a listening or a connected socket
+    TCP_OPT_ACCEPT_BACKLOG, // connections queued for tcp_accept(), only on a listening socket
+    TCP_OPT_NODELAY,        // nonzero sends short writes right away instead of waiting for an ack
+    TCP_OPT_CORK,           // nonzero holds short segments back until it is cleared again
+    TCP_OPT_NONBLOCK,       // nonzero makes reads and writes return ERR_NOT_READY instead of
+                            // blocking, a write queues what fits and returns that much
+} tcp_option_t;
+
+/* buffer sizes and nodelay set on a listening socket are used by the sockets it accepts */
+status_t tcp_set_option(tcp_socket_t *socket, tcp_option_t option, uint32_t value);
+
 static inline status_t tcp_accept(tcp_socket_t *listen_socket, tcp_socket_t **accept_socket)
 {
     return tcp_accept_timeout(listen_socket, accept_socket, INFINITE_TIME);
 }
 
+/* readiness, from tcp_poll() or posted to an event port */
+#define TCP_EVENT_READ   (1<<0) // tcp_read() or, when listening, tcp_accept() won't block
+#define TCP_EVENT_WRITE  (1<<1) // tcp_write() has room for some data
+#define TCP_EVENT_CLOSED (1<<2) // reset, or closed from both ends
+
+typedef struct tcp_event_packet {
+    uint32_t key;
+    uint32_t events;
+} tcp_event_packet_t;
+
+/*
+ * Post readiness to a write-side port, so one thread reading the port (or a
+ * port group) can service many sockets. Packets hold a tcp_event_packet_t
+ * with the given key and the events the socket has become ready for. Events
+ * are edge triggered: once posted, an event isn't posted again until
+ * tcp_poll() has been called on the socket, which returns what it's ready for
+ * at that moment. Setting a port posts what the socket is already ready for,
+ * a NULL port stops the packets, as does tcp_close(). Accepted sockets start
+ * without a port.
+ */
+status_t tcp_set_event_port(tcp_socket_t *socket, port_t port, uint32_t key);
+uint32_t tcp_poll(tcp_socket_t *socket);
+
+/*
+ * The same readiness as a call rather than a packet, same edge triggering.
+ * cb runs with the socket locked, usually on the network thread, so it must
+ * be quick and mustn't call back into the socket. Replaces any event port,
+ * as setting a port replaces the callback.
+ */
+typedef void (*tcp_event_callback_t)(void *arg, uint32_t events);
+status_t tcp_set_event_callback(tcp_socket_t *socket, tcp_event_callback_t cb, void *arg);
+
+static inline tcp_event_packet_t tcp_event_from_packet(const port_packet_t *pk)
+{
+    tcp_event_packet_t ev;
+    memcpy(&ev, pk->value, sizeof(ev));
+    return ev;
+}
+
 /* utilities */
 void gen_random_mac_address(uint8_t *mac_addr);
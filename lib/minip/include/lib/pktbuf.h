@@ -27,7 +27,7 @@
 #include <sys/types.h>
 #include <list.h>
 
-/* PAGE_SIZE minus 16 bytes of metadata in pktbuf_buf */
+/* objects in the pool at boot, it grows on demand up to PKTBUF_POOL_MAX */
 #ifndef PKTBUF_POOL_SIZE
 #define PKTBUF_POOL_SIZE 256
 #endif
@@ -48,7 +48,9 @@ typedef struct pktbuf {
     u32 dlen;
     paddr_t phys_base;
     struct list_node list;
+    struct pktbuf *next;  // next segment of the same frame, NULL on the last one
     u32 flags;
+    u16 gso_size;         // tx: payload size the nic should cut a tcp frame into, 0 for none
     pktbuf_free_callback cb;
     void *cb_args;
     u8 *buffer;
@@ -64,8 +66,9 @@ typedef struct pktbuf_pool_object {
 #define PKTBUF_FLAG_CKSUM_IP_GOOD  (1<<0)
 #define PKTBUF_FLAG_CKSUM_TCP_GOOD (1<<1)
 #define PKTBUF_FLAG_CKSUM_UDP_GOOD (1<<2)
-#define PKTBUF_FLAG_EOF            (1<<3)
+#define PKTBUF_FLAG_EOF            (1<<3) // last segment of the frame
 #define PKTBUF_FLAG_CACHED         (1<<4)
+#define PKTBUF_FLAG_CKSUM_PARTIAL  (1<<5) // tx: the nic fills in the tcp checksum, seeded with the pseudo header sum
 
 /* Return the physical address offset of data in the packet */
 static inline u32 pktbuf_data_phys(pktbuf_t *p)
@@ -85,10 +88,19 @@ static inline u32 pktbuf_avail_tail(pktbuf_t *p)
     return p->blen - (p->data - p->buffer) - p->dlen;
 }
 
-// allocate packet buffer from buffer pool
+// allocate packet buffer from buffer pool, growing the pool or
+// blocking until one is freed if it has run out
 pktbuf_t *pktbuf_alloc(void);
 pktbuf_t *pktbuf_alloc_empty(void);
 
+// same, but return NULL right away rather than grow or block,
+// for use from interrupt context
+pktbuf_t *pktbuf_alloc_nowait(void);
+pktbuf_t *pktbuf_alloc_empty_nowait(void);
+
+// add count objects to the pool, up to PKTBUF_POOL_MAX
+status_t pktbuf_pool_grow(uint count);
+
 /* Add a buffer to an existing packet buffer */
 void pktbuf_add_buffer(pktbuf_t *p, u8 *buf, u32 len, uint32_t header_sz,
                        uint32_t flags, pktbuf_free_callback cb, void *cb_args);
@@ -116,6 +128,35 @@ void *pktbuf_consume(pktbuf_t *p, size_t sz);
 // remove sz bytes from the end of the pktbuf
 void pktbuf_consume_tail(pktbuf_t *p, size_t sz);
 
+/*
+ * A frame may be a chain of pktbufs linked through next, each pointing at its
+ * own piece of the frame, with PKTBUF_FLAG_EOF set only on the last one. The
+ * plain helpers above only ever look at a single segment, these work on the
+ * whole chain starting at p. Freeing the head frees the whole chain.
+ */
+
+// add seg, and any segments chained after it, to the end of p's chain
+void pktbuf_chain(pktbuf_t *p, pktbuf_t *seg);
+
+// total number of data bytes in, and number of segments of, the chain
+size_t pktbuf_chain_len(pktbuf_t *p);
+uint pktbuf_chain_count(pktbuf_t *p);
+
+// grow the front of the chain by sz bytes, putting a fresh segment in front
+// if the first one has no room, which takes over the tx offload state, and
+// return the head of the chain, or NULL
+// with the chain left alone if a segment could not be allocated
+pktbuf_t *pktbuf_chain_prepend(pktbuf_t *p, size_t sz);
+
+// discard the first sz bytes of the chain, freeing any segments emptied
+// along the way, and return the new head of the chain, or NULL with the
+// chain left alone if there were not enough bytes to consume
+pktbuf_t *pktbuf_chain_consume(pktbuf_t *p, size_t sz);
+
+// copy up to len bytes starting offset bytes into the chain out to buf,
+// returning how many were copied
+size_t pktbuf_chain_copy(pktbuf_t *p, size_t offset, void *buf, size_t len);
+
 // create a new packet buffer from raw memory and add
 // it to the free pool
 void pktbuf_create(void *ptr, size_t size);
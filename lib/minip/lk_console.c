@@ -74,8 +74,14 @@ static int cmd_arp(int argc, const cmd_args *argv)
     } else if (argc == 3 && strncmp(cmd, "query", sizeof("query")) == 0) {
         const char *addr_s = argv[2].str;
         uint32_t addr = str_ip_to_int(addr_s, strlen(addr_s));
+        uint32_t next_hop;
+        minip_iface_t *iface = minip_route_lookup(addr, &next_hop);
 
-        arp_send_request(addr);
+        if (!iface) {
+            printf("no route to %u.%u.%u.%u\n", IPV4_SPLIT(addr));
+            return -1;
+        }
+        arp_send_request(iface, next_hop);
     } else {
         arp_usage();
     }
@@ -89,6 +95,7 @@ static int cmd_minip(int argc, const cmd_args *argv)
 minip_usage:
         printf("minip commands\n");
         printf("mi [a]rp                        dump arp table\n");
+        printf("mi [r]oute                      dump route table\n");
         printf("mi [s]tatus                     print ip status\n");
         printf("mi [t]est [dest] [port] [cnt]   send <cnt> test packets to the dest:port\n");
     } else {
@@ -98,6 +105,10 @@ minip_usage:
                 arp_cache_dump();
                 break;
 
+            case 'r':
+                minip_route_dump();
+                break;
+
             case 's': {
                 uint32_t ipaddr = minip_get_ipaddr();
 
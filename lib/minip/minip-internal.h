@@ -100,31 +100,61 @@ enum {
     ARP_OPER_REPLY   = 0x0002,
 };
 
-extern tx_func_t minip_tx_handler;
-typedef struct udp_hdr udp_hdr_t;
+/* a network interface */
+struct minip_iface {
+    uint index;
+    tx_func_t tx;
+    uint8_t mac[6];
+    uint32_t ip;
+    uint32_t netmask;
+    uint32_t broadcast;
+};
+
+#define MINIP_MAX_IFACES 4
+
+extern uint32_t minip_tx_offloads;
+extern size_t minip_tso_max_len;
+typedef struct udp_hdr {
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint16_t len;
+    uint16_t chksum;
+} __PACKED udp_hdr_t;
 static const uint8_t bcast_mac[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
 
 void arp_cache_init(void);
-void arp_cache_update(uint32_t addr, const uint8_t mac[6]);
-uint8_t *arp_cache_lookup(uint32_t addr);
+void arp_cache_update(minip_iface_t *iface, uint32_t addr, const uint8_t mac[6]);
+bool arp_cache_lookup(uint32_t addr, uint8_t mac[6]);
 void arp_cache_dump(void);
-int arp_send_request(uint32_t addr);
-const uint8_t *arp_get_dest_mac(uint32_t host);
+int arp_send_request(minip_iface_t *iface, uint32_t addr);
+/* fill in the destination mac of an ethernet frame and send it out iface, or queue it
+ * until next_hop resolves. never blocks, takes ownership of p */
+status_t arp_output(pktbuf_t *p, minip_iface_t *iface, uint32_t next_hop);
+
+/* the interface to reach dest through and the host to hand it to there, NULL if there's no route */
+minip_iface_t *minip_route_lookup(uint32_t dest, uint32_t *next_hop);
+/* replace the directly attached route of an interface after its address changed */
+void minip_route_set_link(minip_iface_t *iface);
+void minip_route_dump(void);
 
 uint16_t rfc1701_chksum(const uint8_t *buf, size_t len);
-uint16_t rfc768_chksum(struct ipv4_hdr *ipv4, udp_hdr_t *udp);
+/* data_sum is the ones_sum16 of the payload following the udp header */
+uint16_t rfc768_chksum(struct ipv4_hdr *ipv4, udp_hdr_t *udp, uint16_t data_sum);
 uint16_t ones_sum16(uint32_t sum, const void *_buf, int len);
+/* ones_sum16 while copying src to dst, so the data only gets touched once */
+uint16_t ones_sum16_copy(uint32_t sum, void *dst, const void *src, size_t len);
+/* add the sum of a piece that started offset bytes into the checksummed data */
+uint16_t ones_sum16_add(uint16_t sum, uint16_t part, size_t offset);
 
 /* Helper methods for building headers */
-void minip_build_mac_hdr(struct eth_hdr *pkt, const uint8_t *dst, uint16_t type);
-void minip_build_ipv4_hdr(struct ipv4_hdr *ipv4, uint32_t dst, uint8_t proto, uint16_t len);
+void minip_build_mac_hdr(const minip_iface_t *iface, struct eth_hdr *pkt, const uint8_t *dst, uint16_t type);
+void minip_build_ipv4_hdr(const minip_iface_t *iface, struct ipv4_hdr *ipv4, uint32_t dst, uint8_t proto, uint16_t len);
 
 status_t minip_ipv4_send(pktbuf_t *p, uint32_t dest_addr, uint8_t proto);
 
 void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip);
-void udp_input(pktbuf_t *p, uint32_t src_ip);
-
-const uint8_t *get_dest_mac(uint32_t host);
+/* returns true if it took p, which is only possible if owned */
+bool udp_input(pktbuf_t *p, uint32_t src_ip, bool owned);
 
 // timers
 typedef void (*net_timer_callback_t)(void *);
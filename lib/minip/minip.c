@@ -43,13 +43,20 @@ static struct list_node arp_list = LIST_INITIAL_VALUE(arp_list);
 // 1. Tear endian code out into something that flips words before/after tx/rx calls
 
 #define LOCAL_TRACE 0
-static uint32_t minip_ip      = IPV4_NONE;
-static uint32_t minip_netmask = IPV4_NONE;
-static uint32_t minip_broadcast = IPV4_BCAST;
-static uint32_t minip_gateway = IPV4_NONE;
+
+/* interface 0 is always there, it just has nowhere to send until minip_init */
+static minip_iface_t minip_ifaces[MINIP_MAX_IFACES] = {
+    [0] = {
+        .index = 0,
+        .mac = {0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC},
+        .ip = IPV4_NONE,
+        .netmask = IPV4_NONE,
+        .broadcast = IPV4_BCAST,
+    },
+};
+static uint minip_iface_count = 1;
 
 static const uint8_t broadcast_mac[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
-static uint8_t minip_mac[6] = {0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC};
 
 static char minip_hostname[32] = "";
 
@@ -66,30 +73,31 @@ const char *minip_get_hostname(void)
     return minip_hostname;
 }
 
-static void compute_broadcast_address(void)
+static void compute_broadcast_address(minip_iface_t *iface)
 {
-    minip_broadcast = (minip_ip & minip_netmask) | (IPV4_BCAST & ~minip_netmask);
+    iface->broadcast = (iface->ip & iface->netmask) | (IPV4_BCAST & ~iface->netmask);
 }
 
 void minip_get_macaddr(uint8_t *addr)
 {
-    mac_addr_copy(addr, minip_mac);
+    mac_addr_copy(addr, minip_ifaces[0].mac);
 }
 
 void minip_set_macaddr(const uint8_t *addr)
 {
-    mac_addr_copy(minip_mac, addr);
+    mac_addr_copy(minip_ifaces[0].mac, addr);
 }
 
 uint32_t minip_get_ipaddr(void)
 {
-    return minip_ip;
+    return minip_ifaces[0].ip;
 }
 
 void minip_set_ipaddr(const uint32_t addr)
 {
-    minip_ip = addr;
-    compute_broadcast_address();
+    minip_ifaces[0].ip = addr;
+    compute_broadcast_address(&minip_ifaces[0]);
+    minip_route_set_link(&minip_ifaces[0]);
 }
 
 void gen_random_mac_address(uint8_t *mac_addr)
@@ -102,23 +110,56 @@ void gen_random_mac_address(uint8_t *mac_addr)
     mac_addr[0] |= (1<<1);
 }
 
-/* This function is called by minip to send packets */
-tx_func_t minip_tx_handler;
 void *minip_tx_arg;
 
+uint32_t minip_tx_offloads;
+size_t minip_tso_max_len;
+
+void minip_set_tx_offloads(uint32_t offloads, size_t tso_max_len)
+{
+    minip_tx_offloads = offloads;
+    minip_tso_max_len = (offloads & MINIP_TX_OFFLOAD_TSO) ? tso_max_len : 0;
+}
+
 void minip_init(tx_func_t tx_handler, void *tx_arg,
                 uint32_t ip, uint32_t mask, uint32_t gateway)
 {
-    minip_tx_handler = tx_handler;
+    minip_iface_t *iface = &minip_ifaces[0];
+
+    iface->tx = tx_handler;
     minip_tx_arg = tx_arg;
 
-    minip_ip = ip;
-    minip_netmask = mask;
-    minip_gateway = gateway;
-    compute_broadcast_address();
+    iface->ip = ip;
+    iface->netmask = mask;
+    compute_broadcast_address(iface);
 
     arp_cache_init();
     net_timer_init();
+
+    minip_route_set_link(iface);
+    if (gateway != IPV4_NONE)
+        minip_route_add(IPV4_NONE, IPV4_NONE, gateway, iface);
+}
+
+minip_iface_t *minip_iface_add(tx_func_t tx_func, const uint8_t mac[6], uint32_t ip, uint32_t netmask)
+{
+    if (minip_iface_count == MINIP_MAX_IFACES)
+        return NULL;
+
+    minip_iface_t *iface = &minip_ifaces[minip_iface_count];
+
+    iface->index = minip_iface_count;
+    iface->tx = tx_func;
+    mac_addr_copy(iface->mac, mac);
+    iface->ip = ip;
+    iface->netmask = netmask;
+    compute_broadcast_address(iface);
+
+    minip_iface_count++;
+
+    minip_route_set_link(iface);
+
+    return iface;
 }
 
 uint16_t ipv4_payload_len(struct ipv4_hdr *pkt)
@@ -126,14 +167,14 @@ uint16_t ipv4_payload_len(struct ipv4_hdr *pkt)
     return (pkt->len - ((pkt->ver_ihl >> 4) * 5));
 }
 
-void minip_build_mac_hdr(struct eth_hdr *pkt, const uint8_t *dst, uint16_t type)
+void minip_build_mac_hdr(const minip_iface_t *iface, struct eth_hdr *pkt, const uint8_t *dst, uint16_t type)
 {
     mac_addr_copy(pkt->dst_mac, dst);
-    mac_addr_copy(pkt->src_mac, minip_mac);
+    mac_addr_copy(pkt->src_mac, iface->mac);
     pkt->type = htons(type);
 }
 
-void minip_build_ipv4_hdr(struct ipv4_hdr *ipv4, uint32_t dst, uint8_t proto, uint16_t len)
+void minip_build_ipv4_hdr(const minip_iface_t *iface, struct ipv4_hdr *ipv4, uint32_t dst, uint8_t proto, uint16_t len)
 {
     ipv4->ver_ihl       = 0x45;
     ipv4->dscp_ecn      = 0;
@@ -143,103 +184,48 @@ void minip_build_ipv4_hdr(struct ipv4_hdr *ipv4, uint32_t dst, uint8_t proto, ui
     ipv4->ttl           = 64;
     ipv4->proto         = proto;
     ipv4->dst_addr      = dst;
-    ipv4->src_addr      = minip_ip;
+    ipv4->src_addr      = iface->ip;
 
     /* This may be unnecessary if the controller supports checksum offloading */
     ipv4->chksum = 0;
     ipv4->chksum = rfc1701_chksum((uint8_t *) ipv4, sizeof(struct ipv4_hdr));
 }
 
-int send_arp_request(uint32_t addr)
-{
-    pktbuf_t *p;
-    struct eth_hdr *eth;
-    struct arp_pkt *arp;
-
-    if ((p = pktbuf_alloc()) == NULL) {
-        return -1;
-    }
-
-    eth = pktbuf_prepend(p, sizeof(struct eth_hdr));
-    arp = pktbuf_append(p, sizeof(struct arp_pkt));
-    minip_build_mac_hdr(eth, bcast_mac, ETH_TYPE_ARP);
-
-    arp->htype = htons(0x0001);
-    arp->ptype = htons(0x0800);
-    arp->hlen = 6;
-    arp->plen = 4;
-    arp->oper = htons(ARP_OPER_REQUEST);
-    arp->spa = minip_ip;
-    arp->tpa = addr;
-    mac_addr_copy(arp->sha, minip_mac);
-    mac_addr_copy(arp->tha, bcast_mac);
-
-    minip_tx_handler(p);
-    return 0;
-}
-
-static void handle_arp_timeout_cb(void *arg)
-{
-    *(bool *)arg = true;
-}
-
-const uint8_t *get_dest_mac(uint32_t host)
-{
-    uint8_t *dst_mac = NULL;
-    bool arp_timeout = false;
-    net_timer_t arp_timeout_timer;
-
-    if (host == IPV4_BCAST) {
-        return bcast_mac;
-    }
-
-    dst_mac = arp_cache_lookup(host);
-    if (dst_mac == NULL) {
-        send_arp_request(host);
-        memset(&arp_timeout_timer, 0, sizeof(arp_timeout_timer));
-        net_timer_set(&arp_timeout_timer, handle_arp_timeout_cb, &arp_timeout, 100);
-        while (!arp_timeout) {
-            dst_mac = arp_cache_lookup(host);
-            if (dst_mac) {
-                net_timer_cancel(&arp_timeout_timer);
-                break;
-            }
-        }
-    }
-
-    return dst_mac;
-}
-
 status_t minip_ipv4_send(pktbuf_t *p, uint32_t dest_addr, uint8_t proto)
 {
-    status_t ret = 0;
-    size_t data_len = p->dlen;
-    const uint8_t *dst_mac;
+    size_t data_len = pktbuf_chain_len(p);
 
-    struct ipv4_hdr *ip = pktbuf_prepend(p, sizeof(struct ipv4_hdr));
-    struct eth_hdr *eth = pktbuf_prepend(p, sizeof(struct eth_hdr));
+    /* p may be a chain, the headers go in front of it in a segment of their own if need be */
+    pktbuf_t *head = pktbuf_chain_prepend(p, sizeof(struct eth_hdr) + sizeof(struct ipv4_hdr));
+    if (!head) {
+        pktbuf_free(p, true);
+        return ERR_NO_MEMORY;
+    }
+    p = head;
 
+    struct eth_hdr *eth = (struct eth_hdr *)p->data;
+    struct ipv4_hdr *ip = (struct ipv4_hdr *)(eth + 1);
 
-    if (dest_addr == IPV4_BCAST || dest_addr == minip_broadcast) {
-        dst_mac = bcast_mac;
-        goto ready;
+    uint32_t next_hop;
+    minip_iface_t *iface = minip_route_lookup(dest_addr, &next_hop);
+    if (!iface && dest_addr == IPV4_BCAST) {
+        iface = &minip_ifaces[0];
     }
-
-    dst_mac = get_dest_mac(dest_addr);
-    if (!dst_mac) {
+    if (!iface || !iface->tx) {
         pktbuf_free(p, true);
-        ret = -EHOSTUNREACH;
-        goto err;
+        return -EHOSTUNREACH;
     }
 
-ready:
-    minip_build_mac_hdr(eth, dst_mac, ETH_TYPE_IPV4);
-    minip_build_ipv4_hdr(ip, dest_addr, proto, data_len);
+    /* the destination mac is left to arp, unless it's a broadcast */
+    minip_build_mac_hdr(iface, eth, bcast_mac, ETH_TYPE_IPV4);
+    minip_build_ipv4_hdr(iface, ip, dest_addr, proto, data_len);
 
-    minip_tx_handler(p);
+    if (dest_addr == IPV4_BCAST || dest_addr == iface->broadcast) {
+        iface->tx(p);
+        return NO_ERROR;
+    }
 
-err:
-    return ret;
+    return arp_output(p, iface, next_hop);
 }
 
 /* Swap the dst/src ip addresses and send an ICMP ECHO REPLY with the same payload.
@@ -250,8 +236,6 @@ void send_ping_reply(uint32_t ipaddr, struct icmp_pkt *req, size_t reqdatalen)
 {
     pktbuf_t *p;
     size_t len;
-    struct eth_hdr *eth;
-    struct ipv4_hdr *ip;
     struct icmp_pkt *icmp;
 
     if ((p = pktbuf_alloc()) == NULL) {
@@ -259,22 +243,18 @@ void send_ping_reply(uint32_t ipaddr, struct icmp_pkt *req, size_t reqdatalen)
     }
 
     icmp = pktbuf_prepend(p, sizeof(struct icmp_pkt));
-    ip = pktbuf_prepend(p, sizeof(struct ipv4_hdr));
-    eth = pktbuf_prepend(p, sizeof(struct eth_hdr));
     pktbuf_append_data(p, req->data, reqdatalen);
 
     len = sizeof(struct icmp_pkt) + reqdatalen;
 
-    minip_build_mac_hdr(eth, arp_cache_lookup(ipaddr), ETH_TYPE_IPV4);
-    minip_build_ipv4_hdr(ip, ipaddr, IP_PROTO_ICMP, len);
-
     icmp->type = ICMP_ECHO_REPLY;
     icmp->code = 0;
     memcpy(icmp->hdr_data, req->hdr_data, sizeof(icmp->hdr_data));
     icmp->chksum = 0;
     icmp->chksum = rfc1701_chksum((uint8_t *) icmp, len);
 
-    minip_tx_handler(p);
+    /* back the way the route says, not necessarily the way it came in */
+    minip_ipv4_send(p, ipaddr, IP_PROTO_ICMP);
 }
 
 static void dump_ipv4_addr(uint32_t addr)
@@ -294,13 +274,14 @@ static void dump_ipv4_packet(const struct ipv4_hdr *ip)
            (ip->ver_ihl & 0xf) * 4, ip->proto, ntohs(ip->chksum), ntohs(ip->len), ntohs(ip->id), ntohs(ip->flags_frags) & 0x1fff);
 }
 
-__NO_INLINE static void handle_ipv4_packet(pktbuf_t *p, const uint8_t *src_mac)
+/* returns true if p was handed on, which only happens if the stack owns it */
+__NO_INLINE static bool handle_ipv4_packet(minip_iface_t *iface, pktbuf_t *p, const uint8_t *src_mac, bool owned)
 {
     struct ipv4_hdr *ip;
 
     ip = (struct ipv4_hdr *)p->data;
     if (p->dlen < sizeof(struct ipv4_hdr))
-        return;
+        return false;
 
     /* print packets for us */
     if (LOCAL_TRACE) {
@@ -311,27 +292,27 @@ __NO_INLINE static void handle_ipv4_packet(pktbuf_t *p, const uint8_t *src_mac)
     if (((ip->ver_ihl >> 4) & 0xf) != 4) {
         /* not version 4 */
         LTRACEF("REJECT: not version 4\n");
-        return;
+        return false;
     }
 
     /* do we have enough buffer to hold the full header + options? */
     size_t header_len = (ip->ver_ihl & 0xf) * 4;
     if (p->dlen < header_len) {
         LTRACEF("REJECT: not enough buffer to hold header\n");
-        return;
+        return false;
     }
 
     /* compute checksum */
     if (rfc1701_chksum((void *)ip, header_len) != 0) {
         /* bad checksum */
         LTRACEF("REJECT: bad checksum\n");
-        return;
+        return false;
     }
 
     /* is the pkt_buf large enough to hold the length the header says the packet is? */
     if (htons(ip->len) > p->dlen) {
         LTRACEF("REJECT: packet exceeds size of buffer (header %d, dlen %d)\n", htons(ip->len), p->dlen);
-        return;
+        return false;
     }
 
     /* trim any excess bytes at the end of the packet */
@@ -341,17 +322,17 @@ __NO_INLINE static void handle_ipv4_packet(pktbuf_t *p, const uint8_t *src_mac)
 
     /* remove the header from the front of the packet_buf  */
     if (pktbuf_consume(p, header_len) == NULL) {
-        return;
+        return false;
     }
 
     /* the packet is good, we can use it to populate our arp cache */
-    arp_cache_update(ip->src_addr, src_mac);
+    arp_cache_update(iface, ip->src_addr, src_mac);
 
     /* see if it's for us */
     if (ip->dst_addr != IPV4_BCAST) {
-        if (minip_ip != IPV4_NONE && ip->dst_addr != minip_ip && ip->dst_addr != minip_broadcast) {
+        if (iface->ip != IPV4_NONE && ip->dst_addr != iface->ip && ip->dst_addr != iface->broadcast) {
             LTRACEF("REJECT: for another host\n");
-            return;
+            return false;
         }
     }
 
@@ -369,16 +350,17 @@ __NO_INLINE static void handle_ipv4_packet(pktbuf_t *p, const uint8_t *src_mac)
         break;
 
         case IP_PROTO_UDP:
-            udp_input(p, ip->src_addr);
-            break;
+            return udp_input(p, ip->src_addr, owned);
 
         case IP_PROTO_TCP:
             tcp_input(p, ip->src_addr, ip->dst_addr);
             break;
     }
+
+    return false;
 }
 
-__NO_INLINE static int handle_arp_pkt(pktbuf_t *p)
+__NO_INLINE static int handle_arp_pkt(minip_iface_t *iface, pktbuf_t *p)
 {
     struct eth_hdr *eth;
     struct arp_pkt *arp;
@@ -395,7 +377,7 @@ __NO_INLINE static int handle_arp_pkt(pktbuf_t *p)
             struct eth_hdr *reth;
             struct arp_pkt *rarp;
 
-            if (memcmp(&arp->tpa, &minip_ip, sizeof(minip_ip)) == 0) {
+            if (memcmp(&arp->tpa, &iface->ip, sizeof(iface->ip)) == 0) {
                 if ((rp = pktbuf_alloc()) == NULL) {
                     break;
                 }
@@ -404,7 +386,7 @@ __NO_INLINE static int handle_arp_pkt(pktbuf_t *p)
                 rarp = pktbuf_append(rp, sizeof(struct arp_pkt));
 
                 // Eth header
-                minip_build_mac_hdr(reth, eth->src_mac, ETH_TYPE_ARP);
+                minip_build_mac_hdr(iface, reth, eth->src_mac, ETH_TYPE_ARP);
 
                 // ARP packet
                 rarp->oper = htons(ARP_OPER_REPLY);
@@ -412,12 +394,12 @@ __NO_INLINE static int handle_arp_pkt(pktbuf_t *p)
                 rarp->ptype = htons(0x0800);
                 rarp->hlen = 6;
                 rarp->plen = 4;
-                mac_addr_copy(rarp->sha, minip_mac);
-                rarp->spa = minip_ip;
+                mac_addr_copy(rarp->sha, iface->mac);
+                rarp->spa = iface->ip;
                 mac_addr_copy(rarp->tha, arp->sha);
                 rarp->tpa = arp->spa;
 
-                minip_tx_handler(rp);
+                iface->tx(rp);
             }
         }
         break;
@@ -425,7 +407,7 @@ __NO_INLINE static int handle_arp_pkt(pktbuf_t *p)
         case ARP_OPER_REPLY: {
             uint32_t addr;
             memcpy(&addr, &arp->spa, sizeof(addr)); // unaligned word
-            arp_cache_update(addr, arp->sha);
+            arp_cache_update(iface, addr, arp->sha);
         }
         break;
     }
@@ -448,35 +430,59 @@ static void dump_eth_packet(const struct eth_hdr *eth)
     printf(" type 0x%hx\n", htons(eth->type));
 }
 
-void minip_rx_driver_callback(pktbuf_t *p)
+/* returns true if p was handed on, which only happens if the stack owns it */
+static bool minip_rx(minip_iface_t *iface, pktbuf_t *p, bool owned)
 {
     struct eth_hdr *eth;
 
     if ((eth = (void *) pktbuf_consume(p, sizeof(struct eth_hdr))) == NULL) {
-        return;
+        return false;
     }
 
     if (LOCAL_TRACE) {
         dump_eth_packet(eth);
     }
 
-    if (memcmp(eth->dst_mac, minip_mac, 6) != 0 &&
+    if (memcmp(eth->dst_mac, iface->mac, 6) != 0 &&
             memcmp(eth->dst_mac, broadcast_mac, 6) != 0) {
         /* not for us */
-        return;
+        return false;
     }
 
     switch (htons(eth->type)) {
         case ETH_TYPE_IPV4:
             LTRACEF("ipv4 pkt\n");
-            handle_ipv4_packet(p, eth->src_mac);
-            break;
+            return handle_ipv4_packet(iface, p, eth->src_mac, owned);
 
         case ETH_TYPE_ARP:
             LTRACEF("arp pkt\n");
-            handle_arp_pkt(p);
+            handle_arp_pkt(iface, p);
             break;
     }
+
+    return false;
+}
+
+void minip_iface_rx(minip_iface_t *iface, pktbuf_t *p)
+{
+    minip_rx(iface, p, false);
+}
+
+void minip_iface_rx_owned(minip_iface_t *iface, pktbuf_t *p)
+{
+    if (!minip_rx(iface, p, true)) {
+        pktbuf_free(p, true);
+    }
+}
+
+void minip_rx_driver_callback(pktbuf_t *p)
+{
+    minip_iface_rx(&minip_ifaces[0], p);
+}
+
+void minip_rx_driver_callback_owned(pktbuf_t *p)
+{
+    minip_iface_rx_owned(&minip_ifaces[0], p);
 }
 
 uint32_t minip_parse_ipaddr(const char *ipaddr_str, size_t len)
@@ -37,45 +37,87 @@
 
 #define LOCAL_TRACE 0
 
-static struct list_node net_timer_list = LIST_INITIAL_VALUE(net_timer_list);
-static event_t net_timer_event = EVENT_INITIAL_VALUE(net_timer_event, false, 0);
+/*
+ * Timers hang off a wheel of NET_TIMER_SLOTS lists, one per NET_TIMER_TICK ms,
+ * so setting and cancelling them doesn't depend on how many there are. One due
+ * further out than a turn of the wheel sits in its slot until its turn comes around.
+ *
+ * Pushing a queued timer further out, which tcp does on nearly every segment,
+ * only updates its time; the worker moves it along when it gets to its old slot.
+ */
+#define NET_TIMER_TICK  10
+#define NET_TIMER_SLOTS 256 // must be a power of 2
+
+static struct list_node net_timer_wheel[NET_TIMER_SLOTS];
+static lk_time_t net_timer_wheel_time; // start of the next tick the worker has to go through
+static uint net_timer_count;
+
+/* time the worker is going to wake up at next, set timers due before it kick it awake */
+static lk_time_t net_timer_wake_time = INFINITE_TIME;
+static event_t net_timer_event = EVENT_INITIAL_VALUE(net_timer_event, false, EVENT_FLAG_AUTOUNSIGNAL);
 static mutex_t net_timer_lock = MUTEX_INITIAL_VALUE(net_timer_lock);
 
-static void add_to_queue(net_timer_t *t)
+static inline lk_time_t tick_start(lk_time_t t)
 {
-    net_timer_t *e;
-    list_for_every_entry(&net_timer_list, e, net_timer_t, node) {
-        if (TIME_GT(e->sched_time, t->sched_time)) {
-            list_add_before(&e->node, &t->node);
-            return;
-        }
-    }
+    return t - (t % NET_TIMER_TICK);
+}
 
-    list_add_tail(&net_timer_list, &t->node);
+static inline struct list_node *slot_for(lk_time_t t)
+{
+    return &net_timer_wheel[(t / NET_TIMER_TICK) & (NET_TIMER_SLOTS - 1)];
+}
+
+static void add_to_wheel(net_timer_t *t)
+{
+    /* anything already due goes in the next slot the worker looks at */
+    lk_time_t when = TIME_LT(t->sched_time, net_timer_wheel_time) ? net_timer_wheel_time : t->sched_time;
+
+    list_add_tail(slot_for(when), &t->node);
 }
 
 bool net_timer_set(net_timer_t *t, net_timer_callback_t cb, void *callback_args, lk_time_t delay)
 {
     bool newly_queued = true;
+    bool kick = false;
 
     lk_time_t now = current_time();
+    lk_time_t sched_time = now + delay;
 
     mutex_acquire(&net_timer_lock);
 
+    t->cb = cb;
+    t->arg = callback_args;
+
     if (list_in_list(&t->node)) {
-        list_delete(&t->node);
         newly_queued = false;
+
+        if (TIME_GTE(sched_time, t->sched_time)) {
+            /* later than before, leave it where it is and let the worker move it */
+            t->sched_time = sched_time;
+            goto done;
+        }
+
+        list_delete(&t->node);
+    } else {
+        if (net_timer_count++ == 0) {
+            /* the wheel sat idle, bring it up to date */
+            net_timer_wheel_time = tick_start(now);
+        }
     }
 
-    t->cb = cb;
-    t->arg = callback_args;
-    t->sched_time = now + delay;
+    t->sched_time = sched_time;
+    add_to_wheel(t);
 
-    add_to_queue(t);
+    if (net_timer_wake_time == INFINITE_TIME || TIME_LT(sched_time, net_timer_wake_time)) {
+        net_timer_wake_time = sched_time;
+        kick = true;
+    }
 
+done:
     mutex_release(&net_timer_lock);
 
-    event_signal(&net_timer_event, true);
+    if (kick)
+        event_signal(&net_timer_event, true);
 
     return newly_queued;
 }
@@ -88,6 +130,7 @@ bool net_timer_cancel(net_timer_t *t)
 
     if (list_in_list(&t->node)) {
         list_delete(&t->node);
+        net_timer_count--;
         was_queued = true;
     }
 
@@ -96,28 +139,44 @@ bool net_timer_cancel(net_timer_t *t)
     return was_queued;
 }
 
-/* returns the delay to the next event */
+/* returns the delay to the next slot with something in it */
 static lk_time_t net_timer_work_routine(void)
 {
+    struct list_node expired = LIST_INITIAL_VALUE(expired);
     lk_time_t now = current_time();
     lk_time_t delay = INFINITE_TIME;
 
     mutex_acquire(&net_timer_lock);
 
-    for (;;) {
-        net_timer_t *e;
-        e = list_peek_head_type(&net_timer_list, net_timer_t, node);
-        if (!e) {
-            delay = INFINITE_TIME;
-            goto done;
+    /* go through every tick up to now, collecting what's due */
+    while (net_timer_count > 0 && TIME_LTE(net_timer_wheel_time, now)) {
+        struct list_node *slot = slot_for(net_timer_wheel_time);
+        net_timer_wheel_time += NET_TIMER_TICK;
+
+        net_timer_t *e, *temp;
+        list_for_every_entry_safe(slot, e, temp, net_timer_t, node) {
+            if (TIME_LTE(e->sched_time, now)) {
+                list_delete(&e->node);
+                list_add_tail(&expired, &e->node);
+            } else if (slot_for(e->sched_time) != slot) {
+                /* pushed out since it was queued */
+                list_delete(&e->node);
+                add_to_wheel(e);
+            }
         }
+    }
+
+    for (;;) {
+        net_timer_t *e = list_remove_head_type(&expired, net_timer_t, node);
+        if (!e)
+            break;
 
         if (TIME_GT(e->sched_time, now)) {
-            delay = e->sched_time - now;
-            goto done;
+            /* pushed out again by an earlier callback */
+            add_to_wheel(e);
+            continue;
         }
-
-        list_delete(&e->node);
+        net_timer_count--;
 
         mutex_release(&net_timer_lock);
 
@@ -127,9 +186,18 @@ static lk_time_t net_timer_work_routine(void)
         mutex_acquire(&net_timer_lock);
     }
 
-done:
-    if (delay == INFINITE_TIME)
-        event_unsignal(&net_timer_event);
+    /* sleep until the next slot that has anything in it */
+    if (net_timer_count > 0) {
+        now = current_time();
+        for (uint i = 0; i < NET_TIMER_SLOTS; i++) {
+            lk_time_t t = net_timer_wheel_time + i * NET_TIMER_TICK;
+            if (!list_is_empty(slot_for(t))) {
+                delay = TIME_GT(t, now) ? t - now : 0;
+                break;
+            }
+        }
+    }
+    net_timer_wake_time = (delay == INFINITE_TIME) ? INFINITE_TIME : now + delay;
 
     mutex_release(&net_timer_lock);
 
@@ -139,12 +207,9 @@ done:
 int net_timer_work_thread(void *args)
 {
     for (;;) {
-        event_wait(&net_timer_event);
-
         lk_time_t delay = net_timer_work_routine();
-        if (delay != INFINITE_TIME) {
-            thread_sleep(MIN(delay, 100));
-        }
+        if (delay > 0)
+            event_wait_timeout(&net_timer_event, delay);
     }
 
     return 0;
@@ -152,7 +217,8 @@ int net_timer_work_thread(void *args)
 
 void net_timer_init(void)
 {
+    for (uint i = 0; i < NET_TIMER_SLOTS; i++)
+        list_initialize(&net_timer_wheel[i]);
+
     thread_detach_and_resume(thread_create("net timer", &net_timer_work_thread, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
 }
-
-
@@ -24,13 +24,16 @@
 
 #include <assert.h>
 #include <debug.h>
+#include <err.h>
 #include <trace.h>
 #include <printf.h>
 #include <string.h>
 #include <malloc.h>
 
+#include <arch/ops.h>
+#include <kernel/event.h>
+#include <kernel/mutex.h>
 #include <kernel/thread.h>
-#include <kernel/semaphore.h>
 #include <kernel/spinlock.h>
 #include <lib/pktbuf.h>
 #include <lib/pool.h>
@@ -42,24 +45,195 @@
 
 #define LOCAL_TRACE 0
 
+/* free objects each cpu keeps in front of the shared pool */
+#ifndef PKTBUF_CACHE_SIZE
+#define PKTBUF_CACHE_SIZE 16
+#endif
+
+/* objects added each time the pool runs dry and grows */
+#ifndef PKTBUF_POOL_GROW
+#define PKTBUF_POOL_GROW 32
+#endif
+
+/* the pool starts at PKTBUF_POOL_SIZE objects and may grow up to this many */
+#ifndef PKTBUF_POOL_MAX
+#define PKTBUF_POOL_MAX (PKTBUF_POOL_SIZE * 2)
+#endif
+
+struct pktbuf_cache {
+    spin_lock_t lock;
+    uint count;
+    void *objects[PKTBUF_CACHE_SIZE];
+} __CPU_ALIGN;
+
+static struct pktbuf_cache pktbuf_cache[SMP_MAX_CPUS];
+
+/* the shared pool and how many objects are in it, under lock */
 static pool_t pktbuf_pool;
-static semaphore_t pktbuf_sem;
+static uint pktbuf_pool_free;
 static spin_lock_t lock;
 
+/* objects handed to the pool so far, under pktbuf_grow_lock */
+static uint pktbuf_pool_total;
+static mutex_t pktbuf_grow_lock = MUTEX_INITIAL_VALUE(pktbuf_grow_lock);
 
-/* Take an object from the pool of pktbuf objects to act as a header or buffer.  */
-static void *get_pool_object(void)
+/* threads blocked in get_pool_object(), woken as objects are freed */
+static volatile int pktbuf_waiters;
+static event_t pktbuf_freed_event = EVENT_INITIAL_VALUE(pktbuf_freed_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+/* hand objects back to the shared pool */
+static void put_pool_objects(void **objects, uint count)
+{
+    spin_lock_saved_state_t state;
+
+    spin_lock_irqsave(&lock, state);
+    for (uint i = 0; i < count; i++)
+        pool_free(&pktbuf_pool, objects[i]);
+    pktbuf_pool_free += count;
+    spin_unlock_irqrestore(&lock, state);
+}
+
+/* the pool and our own cache are empty, take an object cached on some other cpu */
+static void *steal_pool_object(void)
+{
+    spin_lock_saved_state_t state;
+    void *entry = NULL;
+
+    for (uint i = 0; i < SMP_MAX_CPUS && !entry; i++) {
+        struct pktbuf_cache *cache = &pktbuf_cache[i];
+
+        spin_lock_irqsave(&cache->lock, state);
+        if (cache->count > 0)
+            entry = cache->objects[--cache->count];
+        spin_unlock_irqrestore(&cache->lock, state);
+    }
+
+    return entry;
+}
+
+/*
+ * Take an object from the pool of pktbuf objects to act as a header or buffer,
+ * or NULL if there are none free right now. Safe to call from interrupt context.
+ */
+static void *get_pool_object_nowait(void)
 {
-    pool_t *entry;
     spin_lock_saved_state_t state;
+    struct pktbuf_cache *cache = &pktbuf_cache[arch_curr_cpu_num()];
+    void *entry = NULL;
+
+    spin_lock_irqsave(&cache->lock, state);
+    if (cache->count > 0)
+        entry = cache->objects[--cache->count];
+    spin_unlock_irqrestore(&cache->lock, state);
+
+    if (entry)
+        return entry;
+
+    /* cache is empty, grab half a cache worth plus the one we hand out */
+    void *batch[PKTBUF_CACHE_SIZE / 2 + 1];
+    uint count = 0;
 
-    sem_wait(&pktbuf_sem);
     spin_lock_irqsave(&lock, state);
-    entry = pool_alloc(&pktbuf_pool);
+    while (count < countof(batch) && (batch[count] = pool_alloc(&pktbuf_pool)))
+        count++;
+    pktbuf_pool_free -= count;
     spin_unlock_irqrestore(&lock, state);
 
-    return (pktbuf_pool_object_t *) entry;
+    if (count == 0)
+        return steal_pool_object();
+
+    entry = batch[--count];
+    if (count == 0)
+        return entry;
+
+    /* we may have migrated, or someone may have filled it in the meantime */
+    cache = &pktbuf_cache[arch_curr_cpu_num()];
+    spin_lock_irqsave(&cache->lock, state);
+    uint fit = MIN(count, PKTBUF_CACHE_SIZE - cache->count);
+    memcpy(&cache->objects[cache->count], batch, fit * sizeof(void *));
+    cache->count += fit;
+    spin_unlock_irqrestore(&cache->lock, state);
 
+    if (fit < count)
+        put_pool_objects(&batch[fit], count - fit);
+
+    return entry;
+}
+
+/* carve count more objects out of fresh memory, unless only_if_empty and some were freed meanwhile */
+static status_t pktbuf_pool_add(uint count, bool only_if_empty)
+{
+    status_t err = NO_ERROR;
+    void *slab;
+
+    mutex_acquire(&pktbuf_grow_lock);
+
+    /* someone else may have grown it while we waited for the lock */
+    if (only_if_empty && pktbuf_pool_free > 0)
+        goto out;
+
+    count = MIN(count, PKTBUF_POOL_MAX - pktbuf_pool_total);
+    if (count == 0) {
+        err = ERR_NO_RESOURCES;
+        goto out;
+    }
+
+    LTRACEF("adding %u objects to %u\n", count, pktbuf_pool_total);
+
+#if WITH_KERNEL_VM
+    /* contiguous, so a buffer crossing a page boundary is still one run of physical memory */
+    if (vmm_alloc_contiguous(vmm_get_kernel_aspace(), "pktbuf",
+                             count * sizeof(pktbuf_pool_object_t),
+                             &slab, 0, 0, ARCH_MMU_FLAG_CACHED) < 0) {
+        slab = NULL;
+    }
+#else
+    slab = memalign(CACHE_LINE, count * sizeof(pktbuf_pool_object_t));
+#endif
+    if (!slab) {
+        err = ERR_NO_MEMORY;
+        goto out;
+    }
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&lock, state);
+    for (uint i = 0; i < count; i++)
+        pool_free(&pktbuf_pool, (pktbuf_pool_object_t *)slab + i);
+    pktbuf_pool_free += count;
+    spin_unlock_irqrestore(&lock, state);
+
+    pktbuf_pool_total += count;
+
+out:
+    mutex_release(&pktbuf_grow_lock);
+
+    if (err == NO_ERROR && pktbuf_waiters > 0)
+        event_signal(&pktbuf_freed_event, false);
+
+    return err;
+}
+
+status_t pktbuf_pool_grow(uint count)
+{
+    return pktbuf_pool_add(count, false);
+}
+
+/* Take an object from the pool, growing it or waiting for one to be freed if need be. */
+static void *get_pool_object(void)
+{
+    void *entry = get_pool_object_nowait();
+    if (entry)
+        return entry;
+
+    atomic_add(&pktbuf_waiters, 1);
+    while (!(entry = get_pool_object_nowait())) {
+        if (pktbuf_pool_add(PKTBUF_POOL_GROW, true) == NO_ERROR)
+            continue;
+        event_wait(&pktbuf_freed_event);
+    }
+    atomic_add(&pktbuf_waiters, -1);
+
+    return entry;
 }
 
 /* Return an object to thje pktbuf object pool. */
@@ -67,11 +241,26 @@ static void free_pool_object(pktbuf_pool_object_t *entry, bool reschedule)
 {
     DEBUG_ASSERT(entry);
     spin_lock_saved_state_t state;
+    struct pktbuf_cache *cache = &pktbuf_cache[arch_curr_cpu_num()];
+    void *batch[PKTBUF_CACHE_SIZE / 2];
+    uint count = 0;
+
+    spin_lock_irqsave(&cache->lock, state);
+    if (cache->count == PKTBUF_CACHE_SIZE) {
+        /* full, send the oldest half back to the pool */
+        count = PKTBUF_CACHE_SIZE / 2;
+        memcpy(batch, cache->objects, count * sizeof(void *));
+        memmove(cache->objects, &cache->objects[count], (PKTBUF_CACHE_SIZE - count) * sizeof(void *));
+        cache->count -= count;
+    }
+    cache->objects[cache->count++] = entry;
+    spin_unlock_irqrestore(&cache->lock, state);
 
-    spin_lock_irqsave(&lock, state);
-    pool_free(&pktbuf_pool, entry);
-    spin_unlock_irqrestore(&lock, state);
-    sem_post(&pktbuf_sem, reschedule);
+    if (count > 0)
+        put_pool_objects(batch, count);
+
+    if (pktbuf_waiters > 0)
+        event_signal(&pktbuf_freed_event, reschedule);
 }
 
 /* Callback used internally to place a pktbuf_pool_object back in the pool after
@@ -116,17 +305,17 @@ void pktbuf_add_buffer(pktbuf_t *p, u8 *buf, u32 len, uint32_t header_sz, uint32
 #endif
 }
 
-pktbuf_t *pktbuf_alloc(void)
+static pktbuf_t *pktbuf_alloc_etc(void *(*get)(void))
 {
     pktbuf_t *p = NULL;
     void *buf = NULL;
 
-    p = get_pool_object();
+    p = get();
     if (!p) {
         return NULL;
     }
 
-    buf = get_pool_object();
+    buf = get();
     if (!buf) {
         free_pool_object((pktbuf_pool_object_t *)p, false);
         return NULL;
@@ -137,22 +326,53 @@ pktbuf_t *pktbuf_alloc(void)
     return p;
 }
 
-pktbuf_t *pktbuf_alloc_empty(void)
+pktbuf_t *pktbuf_alloc(void)
 {
-    pktbuf_t *p = (pktbuf_t *) get_pool_object();
+    return pktbuf_alloc_etc(get_pool_object);
+}
 
+pktbuf_t *pktbuf_alloc_nowait(void)
+{
+    return pktbuf_alloc_etc(get_pool_object_nowait);
+}
+
+static pktbuf_t *pktbuf_alloc_empty_etc(void *(*get)(void))
+{
+    pktbuf_t *p = (pktbuf_t *) get();
+    if (!p) {
+        return NULL;
+    }
+
+    p->next = NULL;
+    p->gso_size = 0;
     p->flags = PKTBUF_FLAG_EOF;
     return p;
 }
 
+pktbuf_t *pktbuf_alloc_empty(void)
+{
+    return pktbuf_alloc_empty_etc(get_pool_object);
+}
+
+pktbuf_t *pktbuf_alloc_empty_nowait(void)
+{
+    return pktbuf_alloc_empty_etc(get_pool_object_nowait);
+}
+
 int pktbuf_free(pktbuf_t *p, bool reschedule)
 {
     DEBUG_ASSERT(p);
 
-    if (p->cb) {
-        p->cb(p->buffer, p->cb_args);
+    while (p) {
+        pktbuf_t *next = p->next;
+
+        if (p->cb) {
+            p->cb(p->buffer, p->cb_args);
+        }
+        free_pool_object((pktbuf_pool_object_t *)p, false);
+
+        p = next;
     }
-    free_pool_object((pktbuf_pool_object_t *)p, false);
 
     return 1;
 }
@@ -215,36 +435,130 @@ void pktbuf_consume_tail(pktbuf_t *p, size_t sz)
     p->dlen -= sz;
 }
 
+void pktbuf_chain(pktbuf_t *p, pktbuf_t *seg)
+{
+    DEBUG_ASSERT(p);
+    DEBUG_ASSERT(seg);
+
+    while (p->next)
+        p = p->next;
+
+    p->flags &= ~PKTBUF_FLAG_EOF;
+    p->next = seg;
+}
+
+size_t pktbuf_chain_len(pktbuf_t *p)
+{
+    size_t len = 0;
+
+    for (; p; p = p->next)
+        len += p->dlen;
+
+    return len;
+}
+
+uint pktbuf_chain_count(pktbuf_t *p)
+{
+    uint count = 0;
+
+    for (; p; p = p->next)
+        count++;
+
+    return count;
+}
+
+pktbuf_t *pktbuf_chain_prepend(pktbuf_t *p, size_t sz)
+{
+    DEBUG_ASSERT(p);
+
+    if (pktbuf_avail_head(p) >= sz) {
+        pktbuf_prepend(p, sz);
+        return p;
+    }
+
+    /* no room in front, start a new segment with the whole buffer as headroom */
+    pktbuf_t *head = pktbuf_alloc();
+    if (!head) {
+        return NULL;
+    }
+
+    head->data = head->buffer + head->blen;
+    head->flags &= ~PKTBUF_FLAG_EOF;
+    head->flags |= p->flags & PKTBUF_FLAG_CKSUM_PARTIAL;
+    head->gso_size = p->gso_size;
+    head->next = p;
+    pktbuf_prepend(head, sz);
+
+    return head;
+}
+
+pktbuf_t *pktbuf_chain_consume(pktbuf_t *p, size_t sz)
+{
+    DEBUG_ASSERT(p);
+
+    if (sz > pktbuf_chain_len(p)) {
+        return NULL;
+    }
+
+    /* free whole segments off the front, always keeping the last one */
+    while (p->next && sz >= p->dlen) {
+        pktbuf_t *next = p->next;
+
+        sz -= p->dlen;
+        p->next = NULL;
+        pktbuf_free(p, false);
+        p = next;
+    }
+
+    pktbuf_consume(p, sz);
+
+    return p;
+}
+
+size_t pktbuf_chain_copy(pktbuf_t *p, size_t offset, void *buf, size_t len)
+{
+    size_t copied = 0;
+
+    for (; p && copied < len; p = p->next) {
+        if (offset >= p->dlen) {
+            offset -= p->dlen;
+            continue;
+        }
+
+        size_t chunk = MIN(p->dlen - offset, len - copied);
+        memcpy((u8 *)buf + copied, p->data + offset, chunk);
+        copied += chunk;
+        offset = 0;
+    }
+
+    return copied;
+}
+
 void pktbuf_dump(pktbuf_t *p)
 {
     printf("pktbuf data %p, buffer %p, dlen %u, data offset %lu, phys_base %p\n",
            p->data, p->buffer, p->dlen, (uintptr_t) p->data - (uintptr_t) p->buffer,
            (void *)p->phys_base);
+    if (p->next) {
+        printf("\tchained to %u more segments, %zu bytes total\n",
+               pktbuf_chain_count(p->next), pktbuf_chain_len(p));
+    }
 }
 
 static void pktbuf_init(uint level)
 {
-    void *slab;
-
 #if LK_DEBUGLEVEL > 0
-    printf("pktbuf: creating %u pktbuf entries of size %zu (total %zu)\n",
+    printf("pktbuf: creating %u pktbuf entries of size %zu (total %zu), growing up to %u\n",
            PKTBUF_POOL_SIZE, sizeof(struct pktbuf_pool_object),
-           PKTBUF_POOL_SIZE * sizeof(struct pktbuf_pool_object));
+           PKTBUF_POOL_SIZE * sizeof(struct pktbuf_pool_object), PKTBUF_POOL_MAX);
 #endif
 
-#if WITH_KERNEL_VM
-    if (vmm_alloc_contiguous(vmm_get_kernel_aspace(), "pktbuf",
-                             PKTBUF_POOL_SIZE * sizeof(struct pktbuf_pool_object),
-                             &slab, 0, 0, ARCH_MMU_FLAG_CACHED) < 0) {
+    for (uint i = 0; i < SMP_MAX_CPUS; i++)
+        spin_lock_init(&pktbuf_cache[i].lock);
+
+    if (pktbuf_pool_add(PKTBUF_POOL_SIZE, false) < 0) {
         printf("Failed to initialize pktbuf hdr slab\n");
-        return;
     }
-#else
-    slab = memalign(CACHE_LINE, PKTBUF_POOL_SIZE * sizeof(pktbuf_pool_object_t));
-#endif
-
-    pool_init(&pktbuf_pool, sizeof(struct pktbuf_pool_object), CACHE_LINE, PKTBUF_POOL_SIZE, slab);
-    sem_init(&pktbuf_sem, PKTBUF_POOL_SIZE);
 }
 
 LK_INIT_HOOK(pktbuf, pktbuf_init, LK_INIT_LEVEL_THREADING);
@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "minip-internal.h"
+
+#include <err.h>
+#include <stdio.h>
+#include <string.h>
+#include <trace.h>
+#include <kernel/rwlock.h>
+
+#define LOCAL_TRACE 0
+
+#define MINIP_MAX_ROUTES 16
+
+typedef struct {
+    uint32_t dest;
+    uint32_t netmask;
+    uint32_t gateway; /* IPV4_NONE if dest is directly attached */
+    minip_iface_t *iface;
+    uint prefix_len;
+    bool connected; /* added for the interface's own address, follows it around */
+} minip_route_t;
+
+/* kept sorted longest prefix first, so the first match is the best one */
+static minip_route_t routes[MINIP_MAX_ROUTES];
+static uint route_count;
+
+static rwlock_t route_lock = RWLOCK_INITIAL_VALUE(route_lock);
+
+static inline uint prefix_len(uint32_t netmask)
+{
+    return __builtin_popcount(netmask);
+}
+
+/* call with the write lock held */
+static void route_remove(uint i)
+{
+    memmove(&routes[i], &routes[i + 1], (route_count - i - 1) * sizeof(minip_route_t));
+    route_count--;
+}
+
+/* call with the write lock held */
+static status_t route_insert(uint32_t dest, uint32_t netmask, uint32_t gateway,
+                             minip_iface_t *iface, bool connected)
+{
+    dest &= netmask;
+
+    /* same destination replaces the old route */
+    for (uint i = 0; i < route_count; i++) {
+        if (routes[i].dest == dest && routes[i].netmask == netmask) {
+            route_remove(i);
+            break;
+        }
+    }
+
+    if (route_count == MINIP_MAX_ROUTES)
+        return ERR_NO_RESOURCES;
+
+    uint len = prefix_len(netmask);
+    uint i;
+    for (i = 0; i < route_count; i++) {
+        if (routes[i].prefix_len < len)
+            break;
+    }
+    memmove(&routes[i + 1], &routes[i], (route_count - i) * sizeof(minip_route_t));
+    route_count++;
+
+    routes[i].dest = dest;
+    routes[i].netmask = netmask;
+    routes[i].gateway = gateway;
+    routes[i].iface = iface;
+    routes[i].prefix_len = len;
+    routes[i].connected = connected;
+
+    LTRACEF("%u.%u.%u.%u/%u via %u.%u.%u.%u if %u\n", IPV4_SPLIT(dest), len,
+            IPV4_SPLIT(gateway), iface->index);
+
+    return NO_ERROR;
+}
+
+minip_iface_t *minip_route_lookup(uint32_t dest, uint32_t *next_hop)
+{
+    minip_iface_t *iface = NULL;
+
+    rwlock_acquire_read(&route_lock);
+    for (uint i = 0; i < route_count; i++) {
+        if ((dest & routes[i].netmask) == routes[i].dest) {
+            iface = routes[i].iface;
+            if (next_hop)
+                *next_hop = (routes[i].gateway != IPV4_NONE) ? routes[i].gateway : dest;
+            break;
+        }
+    }
+    rwlock_release_read(&route_lock);
+
+    return iface;
+}
+
+status_t minip_route_add(uint32_t dest, uint32_t netmask, uint32_t gateway, minip_iface_t *iface)
+{
+    /* a gateway has to be reachable directly, pick the interface for it if we weren't told */
+    if (!iface) {
+        uint32_t next_hop;
+        if (gateway == IPV4_NONE)
+            return ERR_INVALID_ARGS;
+        iface = minip_route_lookup(gateway, &next_hop);
+        if (!iface || next_hop != gateway)
+            return ERR_NOT_FOUND;
+    }
+
+    rwlock_acquire_write(&route_lock);
+    status_t err = route_insert(dest, netmask, gateway, iface, false);
+    rwlock_release_write(&route_lock);
+
+    return err;
+}
+
+status_t minip_route_del(uint32_t dest, uint32_t netmask)
+{
+    status_t err = ERR_NOT_FOUND;
+
+    dest &= netmask;
+
+    rwlock_acquire_write(&route_lock);
+    for (uint i = 0; i < route_count; i++) {
+        if (routes[i].dest == dest && routes[i].netmask == netmask) {
+            route_remove(i);
+            err = NO_ERROR;
+            break;
+        }
+    }
+    rwlock_release_write(&route_lock);
+
+    return err;
+}
+
+void minip_route_set_link(minip_iface_t *iface)
+{
+    rwlock_acquire_write(&route_lock);
+    for (uint i = 0; i < route_count; i++) {
+        if (routes[i].connected && routes[i].iface == iface) {
+            route_remove(i);
+            break;
+        }
+    }
+
+    /* no address yet, nothing is reachable through it */
+    if (iface->ip != IPV4_NONE)
+        route_insert(iface->ip, iface->netmask, IPV4_NONE, iface, true);
+    rwlock_release_write(&route_lock);
+}
+
+void minip_route_dump(void)
+{
+    rwlock_acquire_read(&route_lock);
+    if (route_count == 0) {
+        printf("The route table is empty\n");
+    }
+    for (uint i = 0; i < route_count; i++) {
+        minip_route_t *r = &routes[i];
+        if (r->gateway != IPV4_NONE) {
+            printf("%2u: %u.%u.%u.%u/%u via %u.%u.%u.%u if %u\n", i,
+                   IPV4_SPLIT(r->dest), r->prefix_len, IPV4_SPLIT(r->gateway), r->iface->index);
+        } else {
+            printf("%2u: %u.%u.%u.%u/%u link if %u\n", i,
+                   IPV4_SPLIT(r->dest), r->prefix_len, r->iface->index);
+        }
+    }
+    rwlock_release_read(&route_lock);
+}
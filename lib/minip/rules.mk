@@ -15,6 +15,7 @@ MODULE_SRCS += \
 	$(LOCAL_DIR)/minip.c \
 	$(LOCAL_DIR)/net_timer.c \
 	$(LOCAL_DIR)/pktbuf.c \
+	$(LOCAL_DIR)/route.c \
 	$(LOCAL_DIR)/tcp.c \
 	$(LOCAL_DIR)/udp.c
 
@@ -29,11 +29,16 @@
 #include <stdlib.h>
 #include <err.h>
 #include <string.h>
+#include <pow2.h>
+#include <iovec.h>
 #include <sys/types.h>
 #include <lib/console.h>
 #include <lib/cbuf.h>
 #include <kernel/mutex.h>
+#include <kernel/rcu.h>
+#include <kernel/rwlock.h>
 #include <kernel/semaphore.h>
+#include <kernel/spinlock.h>
 #include <arch/ops.h>
 #include <platform.h>
 
@@ -60,11 +65,38 @@ typedef struct tcp_pseudo_header {
     uint16_t tcp_length;
 } __PACKED tcp_pseudo_header_t;
 
-typedef struct tcp_mss_option {
-    uint8_t kind; /* 0x2 */
-    uint8_t len;  /* 0x4 */
-    uint16_t mss;
-} __PACKED tcp_mss_option_t;
+/* header option kinds */
+enum {
+    OPTION_END = 0,
+    OPTION_NOP = 1,
+    OPTION_MSS = 2,
+    OPTION_WSCALE = 3,
+    OPTION_SACK_PERMITTED = 4,
+    OPTION_SACK = 5,
+};
+
+/* a span of sequence space, [start, end) */
+typedef struct tcp_range {
+    uint32_t start;
+    uint32_t end;
+} tcp_range_t;
+
+/* most SACK blocks that fit in the options, without timestamps (RFC 2018) */
+#define TCP_MAX_SACK_BLOCKS 4
+
+/* number of sacked ranges remembered per socket for retransmission */
+#ifndef TCP_SACK_SCOREBOARD_SIZE
+#define TCP_SACK_SCOREBOARD_SIZE 8
+#endif
+
+/* the options we care about from an incoming segment */
+typedef struct tcp_options {
+    uint32_t mss;
+    int      wscale;     // -1 if not present
+    bool     sack_permitted;
+    uint     sack_count;
+    tcp_range_t sack[TCP_MAX_SACK_BLOCKS];
+} tcp_options_t;
 
 typedef enum tcp_state {
     STATE_CLOSED,
@@ -89,8 +121,20 @@ typedef enum tcp_flags {
     PKT_URG = 32
 } tcp_flags_t;
 
+/* a caller owned buffer queued with tcp_write_buffer(), sent straight from where it is */
+typedef struct tcp_tx_ext {
+    struct list_node node;
+    const uint8_t *buf;
+    size_t len;
+    size_t acked;       // bytes at the front the other end has acked
+    tcp_write_callback_t cb;
+    void *arg;
+} tcp_tx_ext_t;
+
 typedef struct tcp_socket {
     struct list_node node;
+    struct tcp_socket *hash_next;
+    struct rcu_head rcu;
 
     mutex_t lock;
     volatile int ref;
@@ -102,39 +146,121 @@ typedef struct tcp_socket {
     uint16_t remote_port;
 
     uint32_t mss;
+    uint8_t  rx_wscale; // shift applied to the windows we advertise
+    uint8_t  tx_wscale; // shift applied to the windows they advertise
+    bool     sack_ok;   // both ends agreed to SACK on the handshake
 
     /* rx */
-    uint32_t rx_win_size;
+    uint32_t rx_win_size; // size of rx_buffer
     uint32_t rx_win_low;
     uint32_t rx_win_high;
     uint8_t  *rx_buffer_raw;
     cbuf_t   rx_buffer;
     event_t  rx_event;
     int      rx_full_mss_count; // number of packets we have received in a row with a full mss
+    tcp_range_t rx_ooo[TCP_MAX_SACK_BLOCKS]; // data past a hole, already sitting in rx_buffer past its end
+    uint     rx_ooo_count;
+    uint32_t rx_ooo_recent; // sequence of the last out of order segment, its block is reported first
     net_timer_t ack_delay_timer;
 
     /* tx */
     uint32_t tx_win_low;  // low side of the acked window
     uint32_t tx_win_high; // tx_win_low + their advertised window size
-    uint32_t tx_highest_seq; // highest sequence we have txed them
-    uint8_t  *tx_buffer;  // our outgoing buffer
+    uint32_t tx_highest_seq; // next sequence to send, pulled back to tx_win_low on a timeout
+    uint32_t tx_max_seq;  // highest sequence ever sent
+    uint8_t  *tx_buffer_raw;
+    cbuf_t   tx_buffer;   // written data that hasn't been acked, starting at tx_win_low
     uint32_t tx_buffer_size; // size of tx_buffer
-    uint32_t tx_buffer_offset; // offset into the buffer to append new data to
+    struct list_node tx_ext_list; // tcp_tx_ext_t, the stream continues with these after tx_buffer
+    size_t   tx_ext_len;  // unacked bytes in tx_ext_list
+    struct list_node tx_done_list; // acked tcp_tx_ext_t, to complete once the lock is dropped
+    bool     tx_fin_queued; // tcp_close() has been called, FIN goes out at tx_fin_seq
+    bool     nodelay;     // send short segments even with data in flight, no Nagle
+    bool     corked;      // hold short segments until uncorked
+    bool     nonblock;    // reads and writes return ERR_NOT_READY rather than wait
+    uint32_t tx_fin_seq;
     event_t  tx_event;
     net_timer_t retransmit_timer;
 
-    /* listen accept */
+    /* congestion control, NewReno (RFC 5681, 6582) */
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t recover;     // tx_max_seq when the last loss was detected
+    uint     dup_acks;
+    bool     in_recovery;
+    uint32_t rexmit_next; // where to look for the next hole to fill when recovering
+
+    /* what the receiver has told us it holds above tx_win_low */
+    tcp_range_t tx_sacked[TCP_SACK_SCOREBOARD_SIZE];
+    uint     tx_sacked_count;
+
+    /* round trip time estimation (RFC 6298), in ms */
+    bool     rtt_valid;   // srtt and rttvar hold at least one sample
+    bool     rtt_timing;  // rtt_seq was sent at rtt_time and hasn't been acked yet
+    uint32_t rtt_seq;
+    lk_time_t rtt_time;
+    uint32_t srtt;        // smoothed rtt << 3
+    uint32_t rttvar;      // rtt variance << 2
+    lk_time_t rto;
+
+    /* listen accept, connections wait on accept_list until tcp_accept() takes them */
     semaphore_t accept_sem;
-    struct tcp_socket *accepted;
+    struct list_node accept_list;
+    uint     accept_queued;
+    uint     accept_backlog;
+    struct list_node accept_node; // on the listening socket's accept_list
+
+    /* readiness packets, see tcp_set_event_port(), or calls instead */
+    port_t   event_port;
+    uint32_t event_key;
+    tcp_event_callback_t event_cb;
+    void     *event_cb_arg;
+    uint32_t events_posted; // posted and not yet collected with tcp_poll()
 
     net_timer_t time_wait_timer;
 } tcp_socket_t;
 
 #define DEFAULT_MSS (1460)
+
+/* the smallest mss we'll take from a peer, anything below is clamped up to it */
+#define MIN_MSS (64)
+
+/* per socket buffer sizes, can be changed with tcp_set_option() */
+#ifndef DEFAULT_RX_WINDOW_SIZE
 #define DEFAULT_RX_WINDOW_SIZE (8192)
+#endif
+#ifndef DEFAULT_TX_BUFFER_SIZE
 #define DEFAULT_TX_BUFFER_SIZE (8192)
+#endif
+#define MIN_BUFFER_SIZE (2048)
+#define MAX_BUFFER_SIZE (1024 * 1024)
+
+/* connections a listening socket holds for tcp_accept(), can be changed with tcp_set_option() */
+#ifndef DEFAULT_ACCEPT_BACKLOG
+#define DEFAULT_ACCEPT_BACKLOG (8)
+#endif
+#define MAX_ACCEPT_BACKLOG (128)
+
+/* retransmit timeout bounds, in ms */
+#ifndef TCP_INITIAL_RTO
+#define TCP_INITIAL_RTO (1000)
+#endif
+#ifndef TCP_MIN_RTO
+#define TCP_MIN_RTO (200)
+#endif
+#define TCP_MAX_RTO (60000)
+
+/* congestion window for a new connection, in segments (RFC 6928) */
+#ifndef TCP_INITIAL_CWND
+#define TCP_INITIAL_CWND (10)
+#endif
+
+/* largest tcp payload handed to a nic doing segmentation offload, so the ip length fits */
+#define TCP_TSO_MAX_LEN (0xffff - 60 - 60)
+
+/* most pieces of tx data a segment is gathered from */
+#define TCP_TX_MAX_IOVECS (8)
 
-#define RETRANSMIT_TIMEOUT (50)
 #define DELAYED_ACK_TIMEOUT (50)
 #define TIME_WAIT_TIMEOUT (60000) // 1 minute
 
@@ -145,28 +271,61 @@ typedef struct tcp_socket {
 #define SEQUENCE_GT(a, b) ((int32_t)((a) - (b)) > 0)
 #define SEQUENCE_LT(a, b) ((int32_t)((a) - (b)) < 0)
 
-static mutex_t tcp_socket_list_lock = MUTEX_INITIAL_VALUE(tcp_socket_list_lock);
+/* number of hash chains for connected sockets and for listening ones, powers of 2 */
+#ifndef TCP_HASH_BUCKETS
+#define TCP_HASH_BUCKETS 256
+#endif
+#ifndef TCP_LISTEN_HASH_BUCKETS
+#define TCP_LISTEN_HASH_BUCKETS 16
+#endif
+
+STATIC_ASSERT(TCP_HASH_BUCKETS > 1 && (TCP_HASH_BUCKETS & (TCP_HASH_BUCKETS - 1)) == 0);
+STATIC_ASSERT(TCP_LISTEN_HASH_BUCKETS > 1 && (TCP_LISTEN_HASH_BUCKETS & (TCP_LISTEN_HASH_BUCKETS - 1)) == 0);
+
+/* all sockets, for walking them from the console */
+static rwlock_t tcp_socket_list_lock = RWLOCK_INITIAL_VALUE(tcp_socket_list_lock);
 static struct list_node tcp_socket_list = LIST_INITIAL_VALUE(tcp_socket_list);
 
+/*
+ * Inbound segments find their socket through these instead. Lookups walk the
+ * chains under rcu_read_lock() without taking anything; the per chain spinlock
+ * only serializes adds and removes, and sockets are freed after a grace period
+ * so a lookup racing with the last close still sees valid memory.
+ */
+typedef struct tcp_hash_bucket {
+    spin_lock_t lock;
+    tcp_socket_t *head;
+} tcp_hash_bucket_t;
+
+static tcp_hash_bucket_t tcp_conn_hash[TCP_HASH_BUCKETS];
+static tcp_hash_bucket_t tcp_listen_hash[TCP_LISTEN_HASH_BUCKETS];
+
 static bool tcp_debug = false;
 
 /* local routines */
 static tcp_socket_t *lookup_socket(ipv4_addr remote_ip, ipv4_addr local_ip, uint16_t remote_port, uint16_t local_port);
 static void add_socket_to_list(tcp_socket_t *s);
 static void remove_socket_from_list(tcp_socket_t *s);
-static tcp_socket_t *create_tcp_socket(bool alloc_buffers);
-static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port, const void *buf,
-                         size_t len, tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size);
-static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, tcp_flags_t flags, const void *options, size_t options_length, uint32_t sequence);
+static tcp_socket_t *create_tcp_socket(void);
+static status_t tcp_alloc_buffers(tcp_socket_t *s);
+static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port, const iovec_t *data,
+                         uint data_cnt, tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size,
+                         uint16_t gso_size);
+static status_t tcp_socket_send(tcp_socket_t *s, const iovec_t *data, uint data_cnt, tcp_flags_t flags, const void *options, size_t options_length, uint32_t sequence);
 static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t sequence);
 static void send_ack(tcp_socket_t *s);
-static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size);
+static void tcp_queue_out_of_order(tcp_socket_t *s, const void *data, size_t len, uint32_t sequence);
+static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size, bool can_be_dup, const tcp_options_t *opts);
+static void tcp_write_pending_data(tcp_socket_t *s);
+static bool fin_acked(const tcp_socket_t *s);
 static void handle_retransmit_timeout(void *_s);
 static void handle_time_wait_timeout(void *_s);
 static void handle_delayed_ack_timeout(void *_s);
 static void tcp_remote_close(tcp_socket_t *s);
 static void tcp_wakeup_waiters(tcp_socket_t *s);
+static void tcp_post_events(tcp_socket_t *s);
 static void inc_socket_ref(tcp_socket_t *s);
+static bool try_inc_socket_ref(tcp_socket_t *s);
 static bool dec_socket_ref(tcp_socket_t *s);
 
 static uint16_t cksum_pheader(const tcp_pseudo_header_t *pheader, const void *buf, size_t len)
@@ -226,54 +385,77 @@ static void dump_socket(tcp_socket_t *s)
         printf("\trx: wsize %u wlo %u whi %u (%u)\n",
                s->rx_win_size, s->rx_win_low, s->rx_win_high,
                s->rx_win_high - s->rx_win_low);
-        printf("\ttx: wlo %u whi %u (%u) highest_seq %u (%u) bufsize %u bufoff %u\n",
+        printf("\ttx: wlo %u whi %u (%u) highest_seq %u (%u) bufsize %u buffered %zu zero copy %zu\n",
                s->tx_win_low, s->tx_win_high, s->tx_win_high - s->tx_win_low,
                s->tx_highest_seq, s->tx_highest_seq - s->tx_win_low,
-               s->tx_buffer_size, s->tx_buffer_offset);
+               s->tx_buffer_size, cbuf_space_used(&s->tx_buffer), s->tx_ext_len);
+        printf("\tmss %u wscale rx %u tx %u cwnd %u ssthresh %u%s srtt %u rttvar %u rto %u\n",
+               s->mss, s->rx_wscale, s->tx_wscale, s->cwnd, s->ssthresh,
+               s->in_recovery ? " (recovery)" : "",
+               s->srtt >> 3, s->rttvar >> 2, s->rto);
+        printf("\tsack %s, out of order ranges %u, sacked ranges %u\n",
+               s->sack_ok ? "on" : "off", s->rx_ooo_count, s->tx_sacked_count);
     }
 }
 
+static inline uint32_t hash_mix(uint32_t h)
+{
+    /* fibonacci hashing, the high bits are the well mixed ones */
+    return h * 0x9e3779b1;
+}
+
+static tcp_hash_bucket_t *conn_bucket(ipv4_addr remote_ip, ipv4_addr local_ip, uint16_t remote_port, uint16_t local_port)
+{
+    uint32_t h = hash_mix(remote_ip ^ ((uint32_t)remote_port << 16 | local_port));
+    h = hash_mix(h ^ local_ip);
+
+    return &tcp_conn_hash[h >> (32 - log2_uint(TCP_HASH_BUCKETS))];
+}
+
+static tcp_hash_bucket_t *listen_bucket(uint16_t local_port)
+{
+    return &tcp_listen_hash[hash_mix(local_port) >> (32 - log2_uint(TCP_LISTEN_HASH_BUCKETS))];
+}
+
+/* sockets are hashed by their state when added: listening ones by port, all others by 4-tuple */
+static tcp_hash_bucket_t *socket_bucket(const tcp_socket_t *s)
+{
+    if (s->state == STATE_LISTEN)
+        return listen_bucket(s->local_port);
+    else
+        return conn_bucket(s->remote_ip, s->local_ip, s->remote_port, s->local_port);
+}
+
 static tcp_socket_t *lookup_socket(ipv4_addr remote_ip, ipv4_addr local_ip, uint16_t remote_port, uint16_t local_port)
 {
     LTRACEF("remote ip 0x%x local ip 0x%x remote port %u local port %u\n", remote_ip, local_ip, remote_port, local_port);
 
-    mutex_acquire(&tcp_socket_list_lock);
+    tcp_hash_bucket_t *b = conn_bucket(remote_ip, local_ip, remote_port, local_port);
+    tcp_socket_t *s;
 
-    /* XXX replace with something faster, like a hash table */
-    tcp_socket_t *s = NULL;
-    list_for_every_entry(&tcp_socket_list, s, tcp_socket_t, node) {
-        if (s->state == STATE_CLOSED || s->state == STATE_LISTEN) {
-            continue;
-        } else {
-            /* full check */
-            if (s->remote_ip == remote_ip &&
-                    s->local_ip == local_ip &&
-                    s->remote_port == remote_port &&
-                    s->local_port == local_port) {
-                goto out;
-            }
+    rcu_read_lock();
+    for (s = rcu_dereference(b->head); s; s = rcu_dereference(s->hash_next)) {
+        if (s->remote_ip == remote_ip &&
+                s->local_ip == local_ip &&
+                s->remote_port == remote_port &&
+                s->local_port == local_port &&
+                s->state != STATE_CLOSED &&
+                try_inc_socket_ref(s)) {
+            break;
         }
     }
 
-    /* walk the list again, looking only for listen matches */
-    list_for_every_entry(&tcp_socket_list, s, tcp_socket_t, node) {
-        if (s->state == STATE_LISTEN) {
-            /* sockets in listen state only care about local port */
-            if (s->local_port == local_port) {
-                goto out;
-            }
+    if (!s) {
+        /* sockets in listen state only care about local port */
+        b = listen_bucket(local_port);
+
+        for (s = rcu_dereference(b->head); s; s = rcu_dereference(s->hash_next)) {
+            if (s->local_port == local_port && s->state == STATE_LISTEN &&
+                    try_inc_socket_ref(s))
+                break;
         }
     }
-
-    /* fall through case returns null */
-    s = NULL;
-
-out:
-    /* bump the ref before returning it */
-    if (s)
-        inc_socket_ref(s);
-
-    mutex_release(&tcp_socket_list_lock);
+    rcu_read_unlock();
 
     return s;
 }
@@ -283,11 +465,19 @@ static void add_socket_to_list(tcp_socket_t *s)
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(s->ref > 0); // we should have implicitly bumped the ref when creating the socket
 
-    mutex_acquire(&tcp_socket_list_lock);
+    rwlock_acquire_write(&tcp_socket_list_lock);
 
     list_add_head(&tcp_socket_list, &s->node);
 
-    mutex_release(&tcp_socket_list_lock);
+    rwlock_release_write(&tcp_socket_list_lock);
+
+    spin_lock_saved_state_t state;
+    tcp_hash_bucket_t *b = socket_bucket(s);
+
+    spin_lock_irqsave(&b->lock, state);
+    s->hash_next = b->head;
+    rcu_assign_pointer(b->head, s);
+    spin_unlock_irqrestore(&b->lock, state);
 }
 
 static void remove_socket_from_list(tcp_socket_t *s)
@@ -295,12 +485,39 @@ static void remove_socket_from_list(tcp_socket_t *s)
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(s->ref > 0);
 
-    mutex_acquire(&tcp_socket_list_lock);
+    /*
+     * A socket that was hashed while listening may be closed by now, so look
+     * in both tables rather than trusting the current state.
+     */
+    spin_lock_saved_state_t state;
+    tcp_hash_bucket_t *buckets[2] = {
+        conn_bucket(s->remote_ip, s->local_ip, s->remote_port, s->local_port),
+        listen_bucket(s->local_port),
+    };
+    bool found = false;
+
+    for (uint i = 0; i < countof(buckets) && !found; i++) {
+        tcp_hash_bucket_t *b = buckets[i];
+
+        spin_lock_irqsave(&b->lock, state);
+        for (tcp_socket_t **prev = &b->head; *prev; prev = &(*prev)->hash_next) {
+            if (*prev == s) {
+                /* leave hash_next alone, a lookup may still be walking through s */
+                rcu_assign_pointer(*prev, s->hash_next);
+                found = true;
+                break;
+            }
+        }
+        spin_unlock_irqrestore(&b->lock, state);
+    }
+    DEBUG_ASSERT(found);
+
+    rwlock_acquire_write(&tcp_socket_list_lock);
 
     DEBUG_ASSERT(list_in_list(&s->node));
     list_delete(&s->node);
 
-    mutex_release(&tcp_socket_list_lock);
+    rwlock_release_write(&tcp_socket_list_lock);
 }
 
 static void inc_socket_ref(tcp_socket_t *s)
@@ -312,6 +529,52 @@ static void inc_socket_ref(tcp_socket_t *s)
     DEBUG_ASSERT(oldval > 0);
 }
 
+/* for lookups under rcu, which may find a socket whose last ref is already gone */
+static bool try_inc_socket_ref(tcp_socket_t *s)
+{
+    int oldval = s->ref;
+
+    while (oldval > 0) {
+        int seen = atomic_cmpxchg(&s->ref, oldval, oldval + 1);
+        if (seen == oldval) {
+            LTRACEF("caller %p, thread %p, socket %p, ref now %d\n", __GET_CALLER(), get_current_thread(), s, oldval + 1);
+            return true;
+        }
+        oldval = seen;
+    }
+    return false;
+}
+
+static void free_socket_rcu(struct rcu_head *head)
+{
+    free(containerof(head, tcp_socket_t, rcu));
+}
+
+/* finish off zero copy writes, with err if they never got acked */
+static void tcp_complete_writes(struct list_node *list, status_t err)
+{
+    tcp_tx_ext_t *e;
+
+    while ((e = list_remove_head_type(list, tcp_tx_ext_t, node))) {
+        e->cb(e->buf, e->len, e->arg, err);
+        free(e);
+    }
+}
+
+/* drop the socket lock, then tell the owners of any zero copy buffers that got acked */
+static void tcp_unlock(tcp_socket_t *s)
+{
+    struct list_node done = LIST_INITIAL_VALUE(done);
+    tcp_tx_ext_t *e;
+
+    while ((e = list_remove_head_type(&s->tx_done_list, tcp_tx_ext_t, node)))
+        list_add_tail(&done, &e->node);
+
+    mutex_release(&s->lock);
+
+    tcp_complete_writes(&done, NO_ERROR);
+}
+
 static bool dec_socket_ref(tcp_socket_t *s)
 {
     DEBUG_ASSERT(s);
@@ -325,9 +588,13 @@ static bool dec_socket_ref(tcp_socket_t *s)
         event_destroy(&s->rx_event);
 
         free(s->rx_buffer_raw);
-        free(s->tx_buffer);
+        free(s->tx_buffer_raw);
 
-        free(s);
+        tcp_complete_writes(&s->tx_done_list, NO_ERROR);
+        tcp_complete_writes(&s->tx_ext_list, ERR_CHANNEL_CLOSED);
+
+        /* lookups may still be walking through it */
+        rcu_call(&s->rcu, free_socket_rcu);
     }
     return (oldval == 1);
 }
@@ -351,6 +618,117 @@ static void tcp_timer_cancel(tcp_socket_t *s, net_timer_t *timer)
         dec_socket_ref(s);
 }
 
+static void parse_options(const uint8_t *opt, size_t len, tcp_options_t *opts)
+{
+    /* the mss to assume if it isn't given (RFC 1122) */
+    opts->mss = 536;
+    opts->wscale = -1;
+    opts->sack_permitted = false;
+    opts->sack_count = 0;
+
+    size_t i = 0;
+    while (i < len) {
+        uint8_t kind = opt[i];
+        if (kind == OPTION_END)
+            break;
+        if (kind == OPTION_NOP) {
+            i++;
+            continue;
+        }
+
+        if (i + 1 >= len)
+            break;
+        uint8_t optlen = opt[i + 1];
+        if (optlen < 2 || i + optlen > len)
+            break;
+
+        if (kind == OPTION_MSS) {
+            /* a bad length is ignored, a silly value is clamped so it can't zero the cwnd */
+            if (optlen == 4) {
+                uint32_t mss = (opt[i + 2] << 8) | opt[i + 3];
+                opts->mss = MAX(MIN(mss, DEFAULT_MSS), MIN_MSS);
+            }
+        } else if (kind == OPTION_WSCALE && optlen == 3) {
+            opts->wscale = MIN(opt[i + 2], 14);
+        } else if (kind == OPTION_SACK_PERMITTED && optlen == 2) {
+            opts->sack_permitted = true;
+        } else if (kind == OPTION_SACK && (optlen - 2) % 8 == 0) {
+            for (const uint8_t *b = opt + i + 2; b < opt + i + optlen && opts->sack_count < TCP_MAX_SACK_BLOCKS; b += 8) {
+                tcp_range_t *r = &opts->sack[opts->sack_count++];
+                r->start = (b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+                r->end = (b[4] << 24) | (b[5] << 16) | (b[6] << 8) | b[7];
+            }
+        }
+        i += optlen;
+    }
+
+    LTRACEF("mss %u wscale %d sack ok %u blocks %u\n", opts->mss, opts->wscale, opts->sack_permitted, opts->sack_count);
+}
+
+/*
+ * Add [start, end) to a sorted list of disjoint ranges, merging it with any it
+ * touches. Returns false if it would have needed a new entry and there was no room.
+ */
+static bool range_add(tcp_range_t *ranges, uint *count, uint max, uint32_t start, uint32_t end)
+{
+    uint i;
+
+    /* find the first range that ends at or after the new one starts */
+    for (i = 0; i < *count; i++) {
+        if (SEQUENCE_GTE(ranges[i].end, start))
+            break;
+    }
+
+    if (i < *count && SEQUENCE_LTE(ranges[i].start, end)) {
+        /* overlaps or abuts, extend it and swallow whatever it now reaches */
+        if (SEQUENCE_LT(start, ranges[i].start))
+            ranges[i].start = start;
+        if (SEQUENCE_GT(end, ranges[i].end))
+            ranges[i].end = end;
+        while (i + 1 < *count && SEQUENCE_LTE(ranges[i + 1].start, ranges[i].end)) {
+            if (SEQUENCE_GT(ranges[i + 1].end, ranges[i].end))
+                ranges[i].end = ranges[i + 1].end;
+            memmove(&ranges[i + 1], &ranges[i + 2], (*count - i - 2) * sizeof(tcp_range_t));
+            (*count)--;
+        }
+        return true;
+    }
+
+    if (*count == max)
+        return false;
+
+    memmove(&ranges[i + 1], &ranges[i], (*count - i) * sizeof(tcp_range_t));
+    ranges[i].start = start;
+    ranges[i].end = end;
+    (*count)++;
+    return true;
+}
+
+/* drop everything below seq from a sorted range list */
+static void range_trim(tcp_range_t *ranges, uint *count, uint32_t seq)
+{
+    uint i = 0;
+
+    while (i < *count && SEQUENCE_LTE(ranges[i].end, seq))
+        i++;
+    if (i > 0) {
+        memmove(&ranges[0], &ranges[i], (*count - i) * sizeof(tcp_range_t));
+        *count -= i;
+    }
+    if (*count > 0 && SEQUENCE_LT(ranges[0].start, seq))
+        ranges[0].start = seq;
+}
+
+/* the smallest shift that lets a window this size fit in the 16 bit field */
+static uint8_t wscale_for_window(uint32_t size)
+{
+    uint8_t shift = 0;
+
+    while (shift < 14 && (size >> shift) > 0xffff)
+        shift++;
+    return shift;
+}
+
 void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
 {
     if (unlikely(tcp_debug))
@@ -405,6 +783,12 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
     size_t data_len = p->dlen - header_len;
     uint32_t highest_sequence = header->seq_num + ((data_len > 0) ? (data_len - 1) : 0);
 
+    /* only a bare ack can count as a duplicate, see RFC 5681 */
+    bool can_be_dup = data_len == 0 && !(packet_flags & (PKT_SYN|PKT_FIN));
+
+    tcp_options_t opts;
+    parse_options((const uint8_t *)(header + 1), header_len - sizeof(tcp_header_t), &opts);
+
     /* see if it matches a socket we have */
     tcp_socket_t *s = lookup_socket(src_ip, dst_ip, header->source_port, header->dest_port);
     if (!s) {
@@ -441,22 +825,39 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
                 goto send_reset;
             }
 
-            /* see if we have a slot to accept */
-            if (s->accepted != NULL)
+            /* drop the SYN if the backlog is full, they'll retry */
+            if (s->accept_queued >= s->accept_backlog)
                 goto done;
 
-            /* make a new accept socket */
-            tcp_socket_t *accept_socket = create_tcp_socket(true);
+            /* make a new accept socket, with the buffer sizes set on the listening one */
+            tcp_socket_t *accept_socket = create_tcp_socket();
             if (!accept_socket)
                 goto done;
 
+            accept_socket->rx_win_size = s->rx_win_size;
+            accept_socket->tx_buffer_size = s->tx_buffer_size;
+            accept_socket->nodelay = s->nodelay;
+            if (tcp_alloc_buffers(accept_socket) < 0) {
+                dec_socket_ref(accept_socket);
+                goto done;
+            }
+
             /* set it up */
-            accept_socket->local_ip = minip_get_ipaddr();
+            accept_socket->local_ip = dst_ip;
             accept_socket->local_port = s->local_port;
             accept_socket->remote_ip = src_ip;
             accept_socket->remote_port = header->source_port;
             accept_socket->state = STATE_SYN_RCVD;
 
+            /* only scale windows if they offered to, and then only our own by what the buffer needs */
+            accept_socket->mss = MIN(DEFAULT_MSS, opts.mss);
+            accept_socket->cwnd = TCP_INITIAL_CWND * accept_socket->mss;
+            if (opts.wscale >= 0) {
+                accept_socket->tx_wscale = opts.wscale;
+                accept_socket->rx_wscale = wscale_for_window(accept_socket->rx_win_size);
+            }
+            accept_socket->sack_ok = opts.sack_permitted;
+
             mutex_acquire(&accept_socket->lock);
 
             add_socket_to_list(accept_socket);
@@ -465,22 +866,42 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
             accept_socket->rx_win_low = header->seq_num + 1;
             accept_socket->rx_win_high = accept_socket->rx_win_low + accept_socket->rx_win_size - 1;
 
-            /* save this socket and wake anyone up that is waiting to accept */
-            s->accepted = accept_socket;
+            /* queue this socket and wake one of the threads waiting to accept */
+            list_add_tail(&s->accept_list, &accept_socket->accept_node);
+            s->accept_queued++;
             sem_post(&s->accept_sem, true);
-
-            /* set up a mss option for sending back */
-            tcp_mss_option_t mss_option;
-            mss_option.kind = 0x2;
-            mss_option.len = 0x4;
-            mss_option.mss = ntohs(s->mss); // XXX make sure we fit in their mss
+            tcp_post_events(s);
+
+            /* tell them our mss, and our window scale and SACK if they offered them */
+            uint8_t options[12];
+            size_t options_length = 0;
+
+            options[options_length++] = OPTION_MSS;
+            options[options_length++] = 4;
+            options[options_length++] = DEFAULT_MSS >> 8;
+            options[options_length++] = DEFAULT_MSS & 0xff;
+            if (opts.wscale >= 0) {
+                options[options_length++] = OPTION_NOP;
+                options[options_length++] = OPTION_WSCALE;
+                options[options_length++] = 3;
+                options[options_length++] = accept_socket->rx_wscale;
+            }
+            if (opts.sack_permitted) {
+                options[options_length++] = OPTION_NOP;
+                options[options_length++] = OPTION_NOP;
+                options[options_length++] = OPTION_SACK_PERMITTED;
+                options[options_length++] = 2;
+            }
 
             /* send a response */
-            tcp_socket_send(accept_socket, NULL, 0, PKT_ACK|PKT_SYN, &mss_option, sizeof(mss_option),
+            tcp_socket_send(accept_socket, NULL, 0, PKT_ACK|PKT_SYN, options, options_length,
                             accept_socket->tx_win_low);
 
             /* SYN consumed a sequence */
             accept_socket->tx_win_low++;
+            accept_socket->tx_highest_seq = accept_socket->tx_win_low;
+            accept_socket->tx_max_seq = accept_socket->tx_win_low;
+            accept_socket->recover = accept_socket->tx_win_low;
 
             mutex_release(&accept_socket->lock);
             break;
@@ -498,25 +919,30 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
                     goto send_reset;
                 }
 
-                s->tx_win_high = s->tx_win_low + header->win_size;
-                s->tx_highest_seq = s->tx_win_low;
+                s->tx_win_high = s->tx_win_low + ((uint32_t)header->win_size << s->tx_wscale);
 
                 s->state = STATE_ESTABLISHED;
+                tcp_post_events(s);
             } else {
                 goto send_reset;
             }
 
-            break;
+            /* the ack may have come with data */
+            goto established;
 
         case STATE_ESTABLISHED:
+established:
             if (packet_flags & PKT_ACK) {
                 /* they're acking us */
-                handle_ack(s, header->ack_num, header->win_size);
+                handle_ack(s, header->ack_num, header->win_size, can_be_dup, &opts);
             }
 
             if (data_len > 0) {
                 LTRACEF("new data, len %zu\n", data_len);
                 handle_data(s, p->data, p->dlen, header->seq_num);
+            } else if (header->seq_num != s->rx_win_low && !(packet_flags & PKT_FIN)) {
+                /* a window probe or keepalive from below the window, answer it (RFC 793) */
+                send_ack(s);
             }
 
             if ((packet_flags & PKT_FIN) && SEQUENCE_GTE(s->rx_win_low, highest_sequence)) {
@@ -531,13 +957,14 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
 
                 /* wake up any read waiters */
                 event_signal(&s->rx_event, true);
+                tcp_post_events(s);
             }
             break;
 
         case STATE_CLOSE_WAIT:
             if (packet_flags & PKT_ACK) {
                 /* they're acking us */
-                handle_ack(s, header->ack_num, header->win_size);
+                handle_ack(s, header->ack_num, header->win_size, can_be_dup, &opts);
             }
             if (packet_flags & PKT_FIN) {
                 /* they must have missed our ack, ack them again */
@@ -545,8 +972,10 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
             }
             break;
         case STATE_LAST_ACK:
-            if (packet_flags & PKT_ACK) {
-                /* they're acking our FIN, probably */
+            if (packet_flags & PKT_ACK)
+                handle_ack(s, header->ack_num, header->win_size, can_be_dup, &opts);
+            if (fin_acked(s)) {
+                /* they've acked our FIN */
                 tcp_remote_close(s);
 
                 /* tcp_close() was already called on us, remove us from the list and drop the ref */
@@ -555,16 +984,18 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
             }
             break;
         case STATE_FIN_WAIT_1:
-            if (packet_flags & PKT_ACK) {
-                /* they're acking our FIN, probably */
+            if (packet_flags & PKT_ACK)
+                handle_ack(s, header->ack_num, header->win_size, can_be_dup, &opts);
+            if (fin_acked(s)) {
+                /* they've acked our FIN */
                 s->state = STATE_FIN_WAIT_2;
                 /* drop into fin_wait_2 state logic, in case they were FINning us too */
                 goto fin_wait_2;
             } else if (packet_flags & PKT_FIN) {
                 /* simultaneous close. they finned us without acking our fin */
                 s->rx_win_low++;
-                send_ack(s);
                 s->state = STATE_CLOSING;
+                send_ack(s);
             }
             break;
         case STATE_FIN_WAIT_2:
@@ -580,8 +1011,10 @@ fin_wait_2:
             }
             break;
         case STATE_CLOSING:
-            if (packet_flags & PKT_ACK) {
-                /* they're acking our FIN, probably */
+            if (packet_flags & PKT_ACK)
+                handle_ack(s, header->ack_num, header->win_size, can_be_dup, &opts);
+            if (fin_acked(s)) {
+                /* they've acked our FIN */
                 s->state = STATE_TIME_WAIT;
 
                 /* set timed wait timer */
@@ -597,7 +1030,7 @@ fin_wait_2:
     }
 
 done:
-    mutex_release(&s->lock);
+    tcp_unlock(s);
     dec_socket_ref(s);
     return;
 
@@ -610,7 +1043,7 @@ send_reset:
     LTRACEF("SEND RST\n");
     if (!(packet_flags & PKT_RST)) {
         tcp_send(src_ip, header->source_port, dst_ip, header->dest_port,
-                 NULL, 0, PKT_RST, NULL, 0, 0, header->ack_num, 0);
+                 NULL, 0, PKT_RST, NULL, 0, 0, header->ack_num, 0, 0);
     }
 }
 
@@ -640,7 +1073,21 @@ static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t
         s->rx_win_low += copy_len;
 
         cbuf_write(&s->rx_buffer, (uint8_t *)data + offset, copy_len, false);
+
+        /* pull in anything queued up behind the hole this filled */
+        bool filled_hole = false;
+        while (s->rx_ooo_count > 0 && SEQUENCE_LTE(s->rx_ooo[0].start, s->rx_win_low)) {
+            if (SEQUENCE_GT(s->rx_ooo[0].end, s->rx_win_low)) {
+                uint32_t queued = s->rx_ooo[0].end - s->rx_win_low;
+                cbuf_commit(&s->rx_buffer, queued, false);
+                s->rx_win_low += queued;
+            }
+            range_trim(s->rx_ooo, &s->rx_ooo_count, s->rx_win_low);
+            filled_hole = true;
+        }
+
         event_signal(&s->rx_event, true);
+        tcp_post_events(s);
 
         /* keep a counter if they've been sending a full mss */
         if (copy_len >= s->mss) {
@@ -649,29 +1096,63 @@ static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t
             s->rx_full_mss_count = 0;
         }
 
-        /* immediately ack if we're more than halfway into our buffer or they've sent 2 or more full packets */
-        if (s->rx_full_mss_count >= 2 ||
+        /*
+         * immediately ack if we're more than halfway into our buffer, they've sent 2 or more full packets,
+         * or this filled in a hole so the sender hears about it while it's recovering
+         */
+        if (filled_hole || s->rx_full_mss_count >= 2 ||
                 (int)(s->rx_win_low + s->rx_win_size - s->rx_win_high) > (int)s->rx_win_size / 2) {
             send_ack(s);
             s->rx_full_mss_count = 0;
         } else {
-            tcp_timer_set(s, &s->ack_delay_timer, &handle_delayed_ack_timeout, DELAYED_ACK_TIMEOUT);
+            /* anything we can send now carries the ack, otherwise give the application a moment to write some */
+            uint32_t before = s->tx_highest_seq;
+            tcp_write_pending_data(s);
+            if (s->tx_highest_seq == before)
+                tcp_timer_set(s, &s->ack_delay_timer, &handle_delayed_ack_timeout, DELAYED_ACK_TIMEOUT);
         }
     } else {
-        // either out of order or completely out of our window, drop
-        // duplicately ack the last thing we really got
+        if (SEQUENCE_GT(sequence, s->rx_win_low))
+            tcp_queue_out_of_order(s, data, len, sequence);
+
+        // duplicately ack the last thing we really got, with what we are holding past it
         send_ack(s);
     }
 }
 
-static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, tcp_flags_t flags,
+/*
+ * Data past a hole goes straight into rx_buffer at its place past the end of the
+ * in order data, and is committed once the hole is filled. Only the ranges are
+ * tracked, and if there are too many holes to track the segment is dropped.
+ */
+static void tcp_queue_out_of_order(tcp_socket_t *s, const void *data, size_t len, uint32_t sequence)
+{
+    DEBUG_ASSERT(SEQUENCE_GT(sequence, s->rx_win_low));
+
+    /* only what fits in the window we advertised */
+    uint32_t end = sequence + len;
+    if (SEQUENCE_GT(end, s->rx_win_high))
+        end = s->rx_win_high;
+    if (SEQUENCE_LTE(end, sequence))
+        return;
+
+    if (!range_add(s->rx_ooo, &s->rx_ooo_count, countof(s->rx_ooo), sequence, end))
+        return;
+
+    __UNUSED size_t written = cbuf_write_ahead(&s->rx_buffer, sequence - s->rx_win_low, data, end - sequence);
+    DEBUG_ASSERT(written == end - sequence);
+
+    s->rx_ooo_recent = sequence;
+
+    LTRACEF("s %p queued %u-%u, %u ranges\n", s, sequence, end, s->rx_ooo_count);
+}
+
+static status_t tcp_socket_send(tcp_socket_t *s, const iovec_t *data, uint data_cnt, tcp_flags_t flags,
                                 const void *options, size_t options_length, uint32_t sequence)
 {
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(is_mutex_held(&s->lock));
-    DEBUG_ASSERT(len == 0 || data);
-    DEBUG_ASSERT(options_length == 0 || options);
-    DEBUG_ASSERT((options_length % 4) == 0);
+    DEBUG_ASSERT(data_cnt == 0 || data);
 
     // calculate the new right edge of the rx window
     uint32_t rx_win_high = s->rx_win_low + s->rx_win_size - cbuf_space_used(&s->rx_buffer) - 1;
@@ -679,7 +1160,7 @@ static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, t
     LTRACEF("rx_win_low %u rx_win_size %u read_buf_len %zu, new win high %u\n",
             s->rx_win_low, s->rx_win_size, cbuf_space_used(&s->rx_buffer), rx_win_high);
 
-    uint16_t win_size;
+    uint32_t win_size;
     if (SEQUENCE_GTE(rx_win_high, s->rx_win_high)) {
         s->rx_win_high = rx_win_high;
         win_size = rx_win_high - s->rx_win_low;
@@ -689,13 +1170,22 @@ static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, t
         win_size = s->rx_win_high - s->rx_win_low;
     }
 
+    // the window in a SYN is never scaled
+    if (!(flags & PKT_SYN))
+        win_size >>= s->rx_wscale;
+    win_size = MIN(win_size, 0xffff);
+
     // we are piggybacking a pending ACK, so clear the delayed ACK timer
     if (flags & PKT_ACK) {
         tcp_timer_cancel(s, &s->ack_delay_timer);
     }
 
-    status_t err = tcp_send(s->remote_ip, s->remote_port, s->local_ip, s->local_port, data, len, flags,
-                            options, options_length, (flags & PKT_ACK) ? s->rx_win_low : 0, sequence, win_size);
+    // more than a segment's worth only comes this way when the nic is going to cut it up
+    uint16_t gso_size = ((size_t)iovec_size(data, data_cnt) > s->mss) ? s->mss : 0;
+
+    status_t err = tcp_send(s->remote_ip, s->remote_port, s->local_ip, s->local_port, data, data_cnt, flags,
+                            options, options_length, (flags & PKT_ACK) ? s->rx_win_low : 0, sequence, win_size,
+                            gso_size);
 
     return err;
 }
@@ -705,16 +1195,50 @@ static void send_ack(tcp_socket_t *s)
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(is_mutex_held(&s->lock));
 
-    if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT && s->state != STATE_FIN_WAIT_2)
+    switch (s->state) {
+        case STATE_ESTABLISHED:
+        case STATE_CLOSE_WAIT:
+        case STATE_FIN_WAIT_1:
+        case STATE_FIN_WAIT_2:
+        case STATE_CLOSING:
+            break;
+        default:
+            return;
+    }
+
+    if (!s->sack_ok || s->rx_ooo_count == 0) {
+        tcp_socket_send(s, NULL, 0, PKT_ACK, NULL, 0, s->tx_highest_seq);
         return;
+    }
+
+    /* tell them what we're holding past the hole, the block with the latest segment first (RFC 2018) */
+    uint8_t options[4 + 8 * TCP_MAX_SACK_BLOCKS];
+    size_t options_length = 4;
+    uint first = 0;
+
+    for (uint i = 0; i < s->rx_ooo_count; i++) {
+        if (SEQUENCE_GTE(s->rx_ooo_recent, s->rx_ooo[i].start) && SEQUENCE_LT(s->rx_ooo_recent, s->rx_ooo[i].end))
+            first = i;
+    }
+    for (uint i = 0; i < s->rx_ooo_count; i++) {
+        const tcp_range_t *r = &s->rx_ooo[(i == 0) ? first : (i <= first) ? i - 1 : i];
+        uint32_t block[2] = { htonl(r->start), htonl(r->end) };
+        memcpy(&options[options_length], block, sizeof(block));
+        options_length += sizeof(block);
+    }
+    options[0] = OPTION_NOP;
+    options[1] = OPTION_NOP;
+    options[2] = OPTION_SACK;
+    options[3] = options_length - 2;
 
-    tcp_socket_send(s, NULL, 0, PKT_ACK, NULL, 0, s->tx_win_low);
+    tcp_socket_send(s, NULL, 0, PKT_ACK, options, options_length, s->tx_highest_seq);
 }
 
-static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port, const void *buf,
-                         size_t len, tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size)
+static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port, const iovec_t *data,
+                         uint data_cnt, tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size,
+                         uint16_t gso_size)
 {
-    DEBUG_ASSERT(len == 0 || buf);
+    DEBUG_ASSERT(data_cnt == 0 || data);
     DEBUG_ASSERT(options_length == 0 || options);
     DEBUG_ASSERT((options_length % 4) == 0);
 
@@ -722,6 +1246,15 @@ static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip
     if (!p)
         return ERR_NO_MEMORY;
 
+    /*
+     * the headroom only leaves space for a few bytes of options, but a segment
+     * without data (like an ack with SACK blocks) can start further into the buffer
+     */
+    if (data_cnt == 0 && options_length > 0) {
+        pktbuf_append(p, options_length);
+        pktbuf_consume(p, options_length);
+    }
+
     tcp_header_t *header = pktbuf_prepend(p, sizeof(tcp_header_t) + options_length);
     DEBUG_ASSERT(header);
 
@@ -737,21 +1270,64 @@ static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip
     if (options)
         memcpy(header + 1, options, options_length);
 
-    /* append the data */
-    if (len > 0)
-        pktbuf_append_data(p, buf, len);
+    /*
+     * append the data, summing it for the checksum as it's copied unless the nic
+     * is going to. whatever doesn't fit goes in more buffers chained after this one.
+     */
+    bool csum_offload = !FORCE_TCP_CHECKSUM && (minip_tx_offloads & MINIP_TX_OFFLOAD_CSUM);
+    uint16_t data_sum = 0;
+    size_t data_len = 0;
+    pktbuf_t *seg = p;
+    for (uint i = 0; i < data_cnt; i++) {
+        const uint8_t *src = data[i].iov_base;
+        size_t left = data[i].iov_len;
+
+        while (left > 0) {
+            if (pktbuf_avail_tail(seg) == 0) {
+                seg = pktbuf_alloc();
+                if (!seg) {
+                    pktbuf_free(p, true);
+                    return ERR_NO_MEMORY;
+                }
+                seg->data = seg->buffer;
+                pktbuf_chain(p, seg);
+            }
 
-    /* compute the checksum */
-    /* XXX get the tx ckecksum capability from the nic */
-    if (FORCE_TCP_CHECKSUM || true) {
-        tcp_pseudo_header_t pheader;
-        pheader.source_addr = src_ip;
-        pheader.dest_addr = dest_ip;
-        pheader.zero = 0;
-        pheader.protocol = IP_PROTO_TCP;
-        pheader.tcp_length = htons(p->dlen);
+            size_t chunk = MIN(left, pktbuf_avail_tail(seg));
+            void *dst = pktbuf_append(seg, chunk);
+            if (csum_offload) {
+                memcpy(dst, src, chunk);
+            } else {
+                uint16_t sum = ones_sum16_copy(0, dst, src, chunk);
+                data_sum = ones_sum16_add(data_sum, sum, data_len);
+            }
+
+            data_len += chunk;
+            src += chunk;
+            left -= chunk;
+        }
+    }
+
+    /* compute the checksum, or just the pseudo header part for the nic to finish */
+    tcp_pseudo_header_t pheader;
+    pheader.source_addr = src_ip;
+    pheader.dest_addr = dest_ip;
+    pheader.zero = 0;
+    pheader.protocol = IP_PROTO_TCP;
+    pheader.tcp_length = htons(sizeof(tcp_header_t) + options_length + data_len);
+
+    if (csum_offload) {
+        header->checksum = ones_sum16(0, &pheader, sizeof(pheader));
+        p->flags |= PKTBUF_FLAG_CKSUM_PARTIAL;
+    } else {
+        /* the header is a multiple of 4 bytes, so the payload sum lines up */
+        uint16_t checksum = ones_sum16(data_sum, &pheader, sizeof(pheader));
+        header->checksum = ~ones_sum16(checksum, header, sizeof(tcp_header_t) + options_length);
+    }
 
-        header->checksum = cksum_pheader(&pheader, p->data, p->dlen);
+    if (gso_size > 0 && data_len > gso_size) {
+        DEBUG_ASSERT(minip_tx_offloads & MINIP_TX_OFFLOAD_TSO);
+        p->gso_size = gso_size;
     }
 
     if (LOCAL_TRACE) {
@@ -764,127 +1340,501 @@ static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip
     return err;
 }
 
-static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size)
+/* everything written and not acked yet, copied or not */
+static uint32_t tcp_tx_queued(tcp_socket_t *s)
 {
-    LTRACEF("socket %p ack sequence %u, win_size %u\n", s, sequence, win_size);
+    return cbuf_space_used(&s->tx_buffer) + s->tx_ext_len;
+}
 
-    DEBUG_ASSERT(s);
+/*
+ * Send up to len bytes of queued data, starting at sequence. The data is
+ * gathered from the tx buffer, in at most two pieces wherever the cbuf wraps,
+ * then from the zero copy buffers after it. Returns how much went in the segment,
+ * which is less than len if it would have been made of too many pieces.
+ */
+static uint32_t tcp_send_data(tcp_socket_t *s, uint32_t sequence, uint32_t len, tcp_flags_t flags)
+{
     DEBUG_ASSERT(is_mutex_held(&s->lock));
+    DEBUG_ASSERT(len > 0);
 
-    LTRACEF("s %p, tx_win_low %u tx_win_high %u tx_highest_seq %u bufsize %u offset %u\n",
-            s, s->tx_win_low, s->tx_win_high, s->tx_highest_seq, s->tx_buffer_size, s->tx_buffer_offset);
-    if (SEQUENCE_LTE(sequence, s->tx_win_low)) {
-        /* they're acking stuff we've already received an ack for */
-        return;
-    } else if (SEQUENCE_GT(sequence, s->tx_highest_seq)) {
-        /* they're acking stuff we haven't sent */
-        return;
-    } else {
-        /* their ack is somewhere in our window */
-        uint32_t acked_len;
-
-        acked_len = (sequence - s->tx_win_low);
+    iovec_t regions[2];
+    iovec_t data[TCP_TX_MAX_IOVECS];
+    uint data_cnt = 0;
+    uint32_t offset = sequence - s->tx_win_low;
+    uint32_t remaining = len;
 
-        LTRACEF("acked len %u\n", acked_len);
+    cbuf_peek(&s->tx_buffer, regions);
+    for (uint i = 0; i < countof(regions) && remaining > 0; i++) {
+        if (offset >= regions[i].iov_len) {
+            offset -= regions[i].iov_len;
+            continue;
+        }
 
-        DEBUG_ASSERT(acked_len <= s->tx_buffer_size);
-        DEBUG_ASSERT(acked_len <= s->tx_buffer_offset);
+        size_t chunk = MIN(regions[i].iov_len - offset, remaining);
+        data[data_cnt].iov_base = (uint8_t *)regions[i].iov_base + offset;
+        data[data_cnt].iov_len = chunk;
+        data_cnt++;
 
-        memmove(s->tx_buffer, s->tx_buffer + acked_len, s->tx_buffer_offset - acked_len);
+        remaining -= chunk;
+        offset = 0;
+    }
 
-        s->tx_buffer_offset -= acked_len;
-        s->tx_win_low += acked_len;
-        s->tx_win_high = s->tx_win_low + win_size;
+    tcp_tx_ext_t *e;
+    list_for_every_entry(&s->tx_ext_list, e, tcp_tx_ext_t, node) {
+        if (remaining == 0 || data_cnt == countof(data))
+            break;
 
-        /* cancel or reset our retransmit timer */
-        if (s->tx_win_low == s->tx_highest_seq) {
-            tcp_timer_cancel(s, &s->retransmit_timer);
-        } else {
-            tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, RETRANSMIT_TIMEOUT);
+        size_t unacked = e->len - e->acked;
+        if (offset >= unacked) {
+            offset -= unacked;
+            continue;
         }
 
-        /* we have opened the transmit buffer */
-        event_signal(&s->tx_event, true);
+        size_t chunk = MIN(unacked - offset, remaining);
+        data[data_cnt].iov_base = (void *)(e->buf + e->acked + offset);
+        data[data_cnt].iov_len = chunk;
+        data_cnt++;
+
+        remaining -= chunk;
+        offset = 0;
     }
+    DEBUG_ASSERT(remaining < len);
+
+    tcp_socket_send(s, data, data_cnt, flags, NULL, 0, sequence);
+
+    return len - remaining;
 }
 
-static ssize_t tcp_write_pending_data(tcp_socket_t *s)
+/* the front of the zero copy buffers got acked, move any that are done to the completion list */
+static void tcp_ack_ext(tcp_socket_t *s, size_t len)
 {
-    LTRACEF("s %p, tx_win_low %u tx_win_high %u tx_highest_seq %u bufsize %u offset %u\n",
-            s, s->tx_win_low, s->tx_win_high, s->tx_highest_seq, s->tx_buffer_size, s->tx_buffer_offset);
-
-    DEBUG_ASSERT(s);
-    DEBUG_ASSERT(is_mutex_held(&s->lock));
-    DEBUG_ASSERT(s->tx_buffer_size > 0);
-    DEBUG_ASSERT(s->tx_buffer_offset <= s->tx_buffer_size);
+    DEBUG_ASSERT(len <= s->tx_ext_len);
 
-    /* do we have any new data to send? */
-    uint32_t outstanding = (s->tx_highest_seq - s->tx_win_low);
-    uint32_t pending = s->tx_buffer_offset - outstanding;
-    LTRACEF("outstanding %u, pending %u\n", outstanding, pending);
+    s->tx_ext_len -= len;
+    while (len > 0) {
+        tcp_tx_ext_t *e = list_peek_head_type(&s->tx_ext_list, tcp_tx_ext_t, node);
+        DEBUG_ASSERT(e);
 
-    /* send packets that cover the pending area of the window */
-    uint32_t offset = 0;
-    while (offset < pending) {
-        uint32_t tosend = MIN(s->mss, pending - offset);
+        size_t chunk = MIN(e->len - e->acked, len);
+        e->acked += chunk;
+        len -= chunk;
 
-        tcp_socket_send(s, s->tx_buffer + outstanding + offset, tosend, PKT_ACK|PKT_PSH, NULL, 0, s->tx_highest_seq);
-        s->tx_highest_seq += tosend;
-        offset += tosend;
+        if (e->acked == e->len) {
+            list_delete(&e->node);
+            list_add_tail(&s->tx_done_list, &e->node);
+        }
     }
+}
 
-    /* reset the retransmit timer if we sent anything */
-    if (offset > 0) {
-        tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, RETRANSMIT_TIMEOUT);
+/* can we have data or a FIN in flight in this state? */
+static bool tcp_can_send(const tcp_socket_t *s)
+{
+    switch (s->state) {
+        case STATE_ESTABLISHED:
+        case STATE_CLOSE_WAIT:
+        case STATE_FIN_WAIT_1:
+        case STATE_CLOSING:
+        case STATE_LAST_ACK:
+            return s->tx_buffer_size > 0;
+        default:
+            return false;
     }
-
-    return offset;
 }
 
-static ssize_t tcp_retransmit(tcp_socket_t *s)
+static bool fin_acked(const tcp_socket_t *s)
 {
-    DEBUG_ASSERT(s);
-    DEBUG_ASSERT(is_mutex_held(&s->lock));
-
-    if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT)
-        return 0;
+    return s->tx_fin_queued && SEQUENCE_GT(s->tx_win_low, s->tx_fin_seq);
+}
 
-    /* how much data have we sent but not gotten an ack for? */
-    uint32_t outstanding = (s->tx_highest_seq - s->tx_win_low);
-    if (outstanding == 0)
-        return 0;
+/* sequence space that has been sent and not acked, including a FIN */
+static uint32_t tcp_flight_size(const tcp_socket_t *s)
+{
+    return s->tx_max_seq - s->tx_win_low;
+}
 
-    uint32_t tosend = MIN(s->mss, outstanding);
+static void tcp_update_rtt(tcp_socket_t *s, lk_time_t rtt)
+{
+    /* Jacobson/Karels, as in RFC 6298 */
+    if (!s->rtt_valid) {
+        s->srtt = rtt << 3;
+        s->rttvar = rtt << 1;
+        s->rtt_valid = true;
+    } else {
+        int32_t delta = rtt - (s->srtt >> 3);
+        s->srtt += delta;
+        if (delta < 0)
+            delta = -delta;
+        s->rttvar += delta - (s->rttvar >> 2);
+    }
 
-    LTRACEF("s %p, tosend %u seq %u\n", s, tosend, s->tx_win_low);
-    tcp_socket_send(s, s->tx_buffer, tosend, PKT_ACK|PKT_PSH, NULL, 0, s->tx_win_low);
+    lk_time_t rto = (s->srtt >> 3) + MAX(s->rttvar, 1U);
+    s->rto = MIN(MAX(rto, (lk_time_t)TCP_MIN_RTO), (lk_time_t)TCP_MAX_RTO);
 
-    return tosend;
+    LTRACEF("s %p rtt %u srtt %u rttvar %u rto %u\n", s, rtt, s->srtt >> 3, s->rttvar >> 2, s->rto);
 }
 
-static void handle_retransmit_timeout(void *_s)
+/*
+ * Resend the next piece the receiver is missing at or after rexmit_next, skipping
+ * whatever it has sacked. Past the first unacked segment only holes below
+ * something sacked are known to be lost. Returns false if there was nothing to send.
+ */
+static bool tcp_retransmit_next(tcp_socket_t *s)
 {
-    tcp_socket_t *s = _s;
+    uint32_t seq = s->rexmit_next;
+    if (SEQUENCE_LT(seq, s->tx_win_low))
+        seq = s->tx_win_low;
+
+    /* step over the sacked ranges, which are sorted, to find the hole and its end */
+    uint32_t hole_end = s->tx_max_seq;
+    for (uint i = 0; i < s->tx_sacked_count; i++) {
+        const tcp_range_t *r = &s->tx_sacked[i];
+        if (SEQUENCE_LTE(r->start, seq)) {
+            if (SEQUENCE_GT(r->end, seq))
+                seq = r->end;
+        } else {
+            hole_end = r->start;
+            break;
+        }
+    }
+    if (seq != s->tx_win_low && hole_end == s->tx_max_seq)
+        return false;
+    if (SEQUENCE_GTE(seq, s->tx_max_seq))
+        return false;
+
+    uint32_t buffered_end = s->tx_win_low + tcp_tx_queued(s);
+    if (SEQUENCE_LT(seq, buffered_end)) {
+        uint32_t len = MIN(MIN(hole_end, buffered_end) - seq, s->mss);
+        s->rexmit_next = seq + tcp_send_data(s, seq, len, PKT_ACK|PKT_PSH);
+    } else if (s->tx_fin_queued && seq == s->tx_fin_seq) {
+        tcp_socket_send(s, NULL, 0, PKT_ACK|PKT_FIN, NULL, 0, s->tx_fin_seq);
+        s->rexmit_next = seq + 1;
+    } else {
+        return false;
+    }
 
-    LTRACEF("s %p\n", s);
+    LTRACEF("s %p resent from %u, next %u\n", s, seq, s->rexmit_next);
+    return true;
+}
 
-    DEBUG_ASSERT(s);
+/* remember the blocks the receiver says it is holding */
+static void tcp_update_sacked(tcp_socket_t *s, const tcp_options_t *opts)
+{
+    for (uint i = 0; i < opts->sack_count; i++) {
+        uint32_t start = opts->sack[i].start;
+        uint32_t end = opts->sack[i].end;
 
-    mutex_acquire(&s->lock);
+        /* ignore anything bogus, or at or below what is already acked */
+        if (SEQUENCE_GTE(start, end) || SEQUENCE_LTE(end, s->tx_win_low) || SEQUENCE_GT(end, s->tx_max_seq))
+            continue;
+        if (SEQUENCE_LT(start, s->tx_win_low))
+            start = s->tx_win_low;
 
-    if (tcp_retransmit(s) == 0)
-        goto done;
+        /* if the scoreboard is full the block is just not used, it only costs a retransmit */
+        range_add(s->tx_sacked, &s->tx_sacked_count, countof(s->tx_sacked), start, end);
+    }
+}
 
-    tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, RETRANSMIT_TIMEOUT);
+/* how much they've told us they hold past tx_win_low */
+static uint32_t tcp_sacked_bytes(const tcp_socket_t *s)
+{
+    uint32_t bytes = 0;
 
-done:
-    mutex_release(&s->lock);
-    dec_socket_ref(s);
+    for (uint i = 0; i < s->tx_sacked_count; i++)
+        bytes += s->tx_sacked[i].end - s->tx_sacked[i].start;
+    return bytes;
 }
 
-static void handle_delayed_ack_timeout(void *_s)
+static void tcp_dup_ack(tcp_socket_t *s)
 {
-    tcp_socket_t *s = _s;
+    s->dup_acks++;
+    LTRACEF("s %p dup ack %u\n", s, s->dup_acks);
+
+    if (s->in_recovery) {
+        /*
+         * every dup ack is a segment that left the network, which makes room for
+         * filling the next hole if they've told us about one, or for new data
+         */
+        if (!tcp_retransmit_next(s))
+            s->cwnd += s->mss;
+    } else if ((s->dup_acks >= 3 || tcp_sacked_bytes(s) >= 3 * s->mss) && SEQUENCE_GT(s->tx_win_low, s->recover)) {
+        /*
+         * fast retransmit, then fast recovery. With SACK, three segments worth
+         * held past the hole counts as a loss too, whatever the dup ack count (RFC 6675)
+         */
+        s->ssthresh = MAX(tcp_flight_size(s) / 2, 2 * s->mss);
+        s->recover = s->tx_max_seq;
+        s->in_recovery = true;
+        s->rtt_timing = false;
+
+        s->rexmit_next = s->tx_win_low;
+        tcp_retransmit_next(s);
+        s->cwnd = s->ssthresh + 3 * s->mss;
+    }
+}
+
+static void tcp_new_ack(tcp_socket_t *s, uint32_t acked_len)
+{
+    s->dup_acks = 0;
+
+    if (s->in_recovery) {
+        if (SEQUENCE_GTE(s->tx_win_low, s->recover)) {
+            /*
+             * everything outstanding when the loss was detected is acked. Deflating to
+             * the flight size would leave a single segment out if the recovery drained
+             * it, where one lost ack means a timeout, so go straight to ssthresh.
+             */
+            s->in_recovery = false;
+            s->cwnd = s->ssthresh;
+        } else {
+            /* partial ack, the next segment was lost too, unless it's already been resent */
+            if (SEQUENCE_LTE(s->rexmit_next, s->tx_win_low))
+                tcp_retransmit_next(s);
+            s->cwnd -= MIN(acked_len, s->cwnd);
+            if (acked_len >= s->mss)
+                s->cwnd += s->mss;
+            s->cwnd = MAX(s->cwnd, s->mss);
+        }
+    } else if (s->cwnd < s->ssthresh) {
+        /* slow start, counting bytes so stretch acks don't slow it down (RFC 3465) */
+        s->cwnd += MIN(acked_len, 2 * s->mss);
+    } else {
+        /* congestion avoidance, about a segment per round trip */
+        uint32_t incr = (uint64_t)s->mss * MIN(acked_len, s->cwnd) / s->cwnd;
+        s->cwnd += MAX(incr, 1U);
+    }
+
+    /* no point letting it grow past what we could ever have in flight, zero copy writes aren't bound by the buffer */
+    uint32_t limit = s->tx_buffer_size;
+    if (s->tx_ext_len > 0)
+        limit = MAX(limit, s->tx_win_high - s->tx_win_low);
+    s->cwnd = MIN(s->cwnd, MAX(limit, 2 * s->mss));
+}
+
+static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size, bool can_be_dup, const tcp_options_t *opts)
+{
+    LTRACEF("socket %p ack sequence %u, win_size %u\n", s, sequence, win_size);
+
+    DEBUG_ASSERT(s);
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+
+    LTRACEF("s %p, tx_win_low %u tx_win_high %u tx_highest_seq %u bufsize %u used %zu\n",
+            s, s->tx_win_low, s->tx_win_high, s->tx_highest_seq, s->tx_buffer_size, cbuf_space_used(&s->tx_buffer));
+
+    if (SEQUENCE_LT(sequence, s->tx_win_low)) {
+        /* they're acking stuff we've already received an ack for */
+        return;
+    } else if (SEQUENCE_GT(sequence, s->tx_max_seq)) {
+        /* they're acking stuff we haven't sent */
+        return;
+    }
+
+    uint32_t win_high = sequence + (win_size << s->tx_wscale);
+
+    if (s->sack_ok && opts->sack_count > 0)
+        tcp_update_sacked(s, opts);
+
+    if (sequence == s->tx_win_low) {
+        /*
+         * nothing new acked, but a bare ack with data out is a possible loss. Not
+         * insisting on an unchanged window like RFC 5681 does, receivers nudge it
+         * a little as out of order data piles up.
+         */
+        if (can_be_dup && tcp_flight_size(s) > 0)
+            tcp_dup_ack(s);
+        else
+            s->dup_acks = 0;
+        s->tx_win_high = win_high;
+    } else {
+        /* their ack is somewhere in our window */
+        uint32_t acked_len = sequence - s->tx_win_low;
+
+        LTRACEF("acked len %u\n", acked_len);
+
+        /* the tx buffer comes first, then the zero copy buffers, and a FIN takes up a sequence in neither */
+        size_t buffered = cbuf_space_used(&s->tx_buffer);
+        cbuf_read(&s->tx_buffer, NULL, MIN(acked_len, buffered), false);
+        if (acked_len > buffered)
+            tcp_ack_ext(s, MIN(acked_len - buffered, s->tx_ext_len));
+
+        s->tx_win_low = sequence;
+        s->tx_win_high = win_high;
+        range_trim(s->tx_sacked, &s->tx_sacked_count, sequence);
+        if (SEQUENCE_LT(s->tx_highest_seq, sequence)) {
+            /* acks for what went out before a timeout */
+            s->tx_highest_seq = sequence;
+        }
+
+        /* Karn: only time segments that weren't retransmitted */
+        if (s->rtt_timing && SEQUENCE_GT(sequence, s->rtt_seq)) {
+            s->rtt_timing = false;
+            tcp_update_rtt(s, current_time() - s->rtt_time);
+        }
+
+        tcp_new_ack(s, acked_len);
+
+        /* cancel or reset our retransmit timer */
+        if (tcp_flight_size(s) == 0) {
+            tcp_timer_cancel(s, &s->retransmit_timer);
+        } else {
+            tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
+        }
+
+        /* we have opened the transmit buffer */
+        event_signal(&s->tx_event, true);
+        tcp_post_events(s);
+    }
+
+    /* the window or cwnd may have opened up */
+    tcp_write_pending_data(s);
+}
+
+static void tcp_write_pending_data(tcp_socket_t *s)
+{
+    LTRACEF("s %p, tx_win_low %u tx_win_high %u tx_highest_seq %u bufsize %u used %zu\n",
+            s, s->tx_win_low, s->tx_win_high, s->tx_highest_seq, s->tx_buffer_size, cbuf_space_used(&s->tx_buffer));
+
+    DEBUG_ASSERT(s);
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+
+    if (!tcp_can_send(s))
+        return;
+
+    /* send as far as both their window and our congestion window allow */
+    uint32_t data_end = s->tx_win_low + tcp_tx_queued(s);
+    uint32_t cwnd = s->cwnd;
+    if (!s->in_recovery && s->dup_acks < 3) {
+        /* limited transmit, a new segment for each of the first dup acks keeps them coming (RFC 3042) */
+        cwnd += s->dup_acks * s->mss;
+    }
+    uint32_t send_limit = s->tx_win_high;
+    if (SEQUENCE_LT(s->tx_win_low + cwnd, send_limit))
+        send_limit = s->tx_win_low + cwnd;
+
+    bool was_idle = (s->tx_highest_seq == s->tx_win_low);
+    bool held = false;
+    uint32_t sent = 0;
+
+    /* a nic doing segmentation offload gets several segments' worth at once */
+    DEBUG_ASSERT(s->mss > 0);
+    uint32_t seg_max = s->mss;
+    if (s->mss > 0 && minip_tso_max_len > 0 && minip_tso_max_len >= 2 * s->mss)
+        seg_max = MIN(minip_tso_max_len, TCP_TSO_MAX_LEN) / s->mss * s->mss;
+
+    while (SEQUENCE_LT(s->tx_highest_seq, data_end)) {
+        uint32_t pending = data_end - s->tx_highest_seq;
+        int32_t usable = send_limit - s->tx_highest_seq;
+        if (usable <= 0)
+            break;
+
+        uint32_t tosend = MIN(MIN(seg_max, pending), (uint32_t)usable);
+
+        /* a large segment stops at an mss boundary unless it carries the last of the data */
+        if (seg_max > s->mss && tosend > s->mss && tosend < pending)
+            tosend -= tosend % s->mss;
+
+        if (tosend < s->mss) {
+            bool all_queued = (tosend == pending);
+            bool in_flight = (s->tx_highest_seq != s->tx_win_low);
+
+            /* corked, the tail waits for more data, until the FIN has to go out behind it */
+            if (all_queued && s->corked && !s->tx_fin_queued) {
+                held = true;
+                break;
+            }
+
+            /*
+             * don't dribble out runts while there is data in flight to clock out the rest,
+             * and unless told not to, hold the tail back until the ack comes (Nagle, RFC 896)
+             */
+            if (in_flight && (!all_queued || !s->nodelay))
+                break;
+        }
+
+        /* time one new segment per round trip */
+        if (!s->rtt_timing && SEQUENCE_GTE(s->tx_highest_seq, s->tx_max_seq)) {
+            s->rtt_timing = true;
+            s->rtt_seq = s->tx_highest_seq;
+            s->rtt_time = current_time();
+        }
+
+        tosend = tcp_send_data(s, s->tx_highest_seq, tosend, PKT_ACK|PKT_PSH);
+        s->tx_highest_seq += tosend;
+        sent += tosend;
+    }
+
+    /* the FIN goes out after the last of the data */
+    if (s->tx_fin_queued && s->tx_highest_seq == s->tx_fin_seq) {
+        tcp_socket_send(s, NULL, 0, PKT_ACK|PKT_FIN, NULL, 0, s->tx_fin_seq);
+        s->tx_highest_seq++;
+        sent++;
+    }
+
+    if (SEQUENCE_GT(s->tx_highest_seq, s->tx_max_seq))
+        s->tx_max_seq = s->tx_highest_seq;
+
+    if (sent > 0 && was_idle) {
+        /* start the retransmit timer if this is all that's outstanding */
+        tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
+    } else if (!held && tcp_flight_size(s) == 0 && SEQUENCE_LT(s->tx_highest_seq, data_end)) {
+        /* their window is shut, keep probing it */
+        tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
+    }
+}
+
+static void handle_retransmit_timeout(void *_s)
+{
+    tcp_socket_t *s = _s;
+
+    LTRACEF("s %p\n", s);
+
+    DEBUG_ASSERT(s);
+
+    mutex_acquire(&s->lock);
+
+    if (!tcp_can_send(s))
+        goto done;
+
+    uint32_t buffered = tcp_tx_queued(s);
+    if (tcp_flight_size(s) == 0 && buffered == 0)
+        goto done;
+
+    if (s->tx_win_high != s->tx_win_low) {
+        /* a real timeout rather than a window probe, start over from one segment */
+        s->ssthresh = MAX(tcp_flight_size(s) / 2, 2 * s->mss);
+        s->cwnd = s->mss;
+    }
+    s->in_recovery = false;
+    s->dup_acks = 0;
+    s->recover = s->tx_max_seq;
+
+    /* the receiver is allowed to have thrown away what it sacked, so start over (RFC 2018) */
+    s->tx_sacked_count = 0;
+    s->rexmit_next = s->tx_win_low;
+    s->rtt_timing = false;
+    s->rto = MIN(s->rto * 2, (lk_time_t)TCP_MAX_RTO);
+
+    /* go back to the first unacked byte and send again from there */
+    s->tx_highest_seq = s->tx_win_low;
+    tcp_write_pending_data(s);
+
+    if (s->tx_highest_seq == s->tx_win_low && buffered > 0) {
+        /* their window is shut, poke a byte at it to get a fresh window */
+        tcp_send_data(s, s->tx_win_low, 1, PKT_ACK);
+        s->tx_highest_seq++;
+        if (SEQUENCE_GT(s->tx_highest_seq, s->tx_max_seq))
+            s->tx_max_seq = s->tx_highest_seq;
+    }
+
+    tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
+
+done:
+    tcp_unlock(s);
+    dec_socket_ref(s);
+}
+
+static void handle_delayed_ack_timeout(void *_s)
+{
+    tcp_socket_t *s = _s;
 
     LTRACEF("s %p\n", s);
 
@@ -916,6 +1866,69 @@ static void handle_time_wait_timeout(void *_s)
     dec_socket_ref(s);
 }
 
+/* what the socket is ready for right now, TCP_EVENT_* */
+static uint32_t tcp_events(tcp_socket_t *s)
+{
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+
+    uint32_t events = 0;
+    switch (s->state) {
+        case STATE_LISTEN:
+            if (s->accept_queued > 0)
+                events |= TCP_EVENT_READ;
+            break;
+        case STATE_SYN_RCVD:
+            break;
+        case STATE_ESTABLISHED:
+        case STATE_CLOSE_WAIT:
+            if (cbuf_space_used(&s->rx_buffer) > 0 || s->state == STATE_CLOSE_WAIT)
+                events |= TCP_EVENT_READ;
+            if (cbuf_space_avail(&s->tx_buffer) > 0 && list_is_empty(&s->tx_ext_list))
+                events |= TCP_EVENT_WRITE;
+            break;
+        case STATE_CLOSED:
+            events |= TCP_EVENT_READ | TCP_EVENT_CLOSED;
+            break;
+        default:
+            /* closing from our end, only what was left to read */
+            if (s->rx_buffer_raw && cbuf_space_used(&s->rx_buffer) > 0)
+                events |= TCP_EVENT_READ;
+            break;
+    }
+    return events;
+}
+
+/*
+ * Tell the event port about anything the socket just became ready for. Each
+ * event is posted once until tcp_poll() collects it, so a busy socket doesn't
+ * flood the port. If the port is full the event is tried again next time.
+ */
+static void tcp_post_events(tcp_socket_t *s)
+{
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+
+    if (!s->event_port && !s->event_cb)
+        return;
+
+    uint32_t events = tcp_events(s) & ~s->events_posted;
+    if (events == 0)
+        return;
+
+    if (s->event_cb) {
+        s->event_cb(s->event_cb_arg, events);
+        s->events_posted |= events;
+        return;
+    }
+
+    tcp_event_packet_t ev = { .key = s->event_key, .events = events };
+    port_packet_t pk;
+    STATIC_ASSERT(sizeof(ev) <= sizeof(pk.value));
+    memcpy(pk.value, &ev, sizeof(ev));
+
+    if (port_write(s->event_port, &pk, 1) == NO_ERROR)
+        s->events_posted |= events;
+}
+
 static void tcp_wakeup_waiters(tcp_socket_t *s)
 {
     DEBUG_ASSERT(s);
@@ -924,6 +1937,7 @@ static void tcp_wakeup_waiters(tcp_socket_t *s)
     // wake up any waiters
     event_signal(&s->rx_event, true);
     event_signal(&s->tx_event, true);
+    tcp_post_events(s);
 }
 
 static void tcp_remote_close(tcp_socket_t *s)
@@ -945,7 +1959,7 @@ static void tcp_remote_close(tcp_socket_t *s)
     tcp_wakeup_waiters(s);
 }
 
-static tcp_socket_t *create_tcp_socket(bool alloc_buffers)
+static tcp_socket_t *create_tcp_socket(void)
 {
     tcp_socket_t *s;
 
@@ -965,22 +1979,42 @@ static tcp_socket_t *create_tcp_socket(bool alloc_buffers)
     s->tx_win_low = rand();
     s->tx_win_high = s->tx_win_low;
     s->tx_highest_seq = s->tx_win_low;
+    s->tx_max_seq = s->tx_win_low;
+    s->tx_buffer_size = DEFAULT_TX_BUFFER_SIZE;
+    list_initialize(&s->tx_ext_list);
+    list_initialize(&s->tx_done_list);
     event_init(&s->tx_event, true, 0);
 
-    if (alloc_buffers) {
-        // XXX check for error
-        s->rx_buffer_raw = malloc(s->rx_win_size);
-        cbuf_initialize_etc(&s->rx_buffer, s->rx_win_size, s->rx_buffer_raw);
-
-        s->tx_buffer_size = DEFAULT_TX_BUFFER_SIZE;
-        s->tx_buffer = malloc(s->tx_buffer_size);
-    }
+    s->cwnd = TCP_INITIAL_CWND * DEFAULT_MSS;
+    s->ssthresh = UINT32_MAX;
+    s->recover = s->tx_win_low;
+    s->rto = TCP_INITIAL_RTO;
 
     sem_init(&s->accept_sem, 0);
+    list_initialize(&s->accept_list);
+    s->accept_backlog = DEFAULT_ACCEPT_BACKLOG;
 
     return s;
 }
 
+/* the buffers are only allocated for connected sockets, using the sizes set on the socket */
+static status_t tcp_alloc_buffers(tcp_socket_t *s)
+{
+    DEBUG_ASSERT(!s->rx_buffer_raw && !s->tx_buffer_raw);
+
+    s->rx_buffer_raw = malloc(s->rx_win_size);
+    if (!s->rx_buffer_raw)
+        return ERR_NO_MEMORY;
+    cbuf_initialize_etc(&s->rx_buffer, s->rx_win_size, s->rx_buffer_raw);
+
+    s->tx_buffer_raw = malloc(s->tx_buffer_size);
+    if (!s->tx_buffer_raw)
+        return ERR_NO_MEMORY;
+    cbuf_initialize_etc(&s->tx_buffer, s->tx_buffer_size, s->tx_buffer_raw);
+
+    return NO_ERROR;
+}
+
 /* user api */
 
 status_t tcp_open_listen(tcp_socket_t **handle, uint16_t port)
@@ -990,7 +2024,7 @@ status_t tcp_open_listen(tcp_socket_t **handle, uint16_t port)
     if (!handle)
         return ERR_INVALID_ARGS;
 
-    s = create_tcp_socket(false);
+    s = create_tcp_socket();
     if (!s)
         return ERR_NO_MEMORY;
 
@@ -1024,51 +2058,59 @@ status_t tcp_accept_timeout(tcp_socket_t *listen_socket, tcp_socket_t **accept_s
 
     mutex_acquire(&s->lock);
 
-    /* we got here, grab the accepted socket and return */
-    DEBUG_ASSERT(s->accepted);
-    *accept_socket = s->accepted;
-    s->accepted = NULL;
+    /* we got here, take the oldest queued socket and return */
+    tcp_socket_t *a = list_remove_head_type(&s->accept_list, tcp_socket_t, accept_node);
+    if (a)
+        s->accept_queued--;
 
     mutex_release(&s->lock);
     dec_socket_ref(s);
 
+    /* the listening socket was closed and its queue dropped */
+    if (!a)
+        return ERR_CHANNEL_CLOSED;
+
+    *accept_socket = a;
     return NO_ERROR;
 }
 
-ssize_t tcp_read(tcp_socket_t *socket, void *buf, size_t len)
+/*
+ * Wait for received data. Returns with the socket lock held and the number of
+ * bytes in the receive buffer, or ERR_CHANNEL_CLOSED once it is empty and the
+ * other end has closed, or ERR_NOT_READY for a nonblocking socket with nothing
+ * to read yet.
+ */
+static ssize_t tcp_wait_rx(tcp_socket_t *s)
 {
-    LTRACEF("socket %p, buf %p, len %zu\n", socket, buf, len);
-    if (!socket)
-        return ERR_INVALID_ARGS;
-    if (len == 0)
-        return 0;
-    if (!buf)
-        return ERR_INVALID_ARGS;
-
-    tcp_socket_t *s = socket;
-    inc_socket_ref(s);
+    for (;;) {
+        /* block on available data */
+        if (!s->nonblock)
+            event_wait(&s->rx_event);
 
-    ssize_t ret = 0;
-retry:
-    /* block on available data */
-    event_wait(&s->rx_event);
+        mutex_acquire(&s->lock);
 
-    mutex_acquire(&s->lock);
+        /* hand out what is left in the receive buffer, even if we're closed */
+        size_t avail = cbuf_space_used(&s->rx_buffer);
+        if (avail > 0)
+            return avail;
 
-    /* try to read some data from the receive buffer, even if we're closed */
-    ret = cbuf_read(&s->rx_buffer, buf, len, false);
-    if (ret == 0) {
         /* check to see if we've closed */
-        if (s->state != STATE_ESTABLISHED) {
-            ret = ERR_CHANNEL_CLOSED;
-            goto out;
-        }
+        if (s->state != STATE_ESTABLISHED)
+            return ERR_CHANNEL_CLOSED;
+
+        if (s->nonblock)
+            return ERR_NOT_READY;
 
         /* we must have raced with another thread */
         event_unsignal(&s->rx_event);
         mutex_release(&s->lock);
-        goto retry;
     }
+}
+
+/* data was taken out of the receive buffer */
+static void tcp_rx_consumed(tcp_socket_t *s)
+{
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
 
     /* if we've used up the last byte in the read buffer, unsignal the read event */
     size_t remaining_bytes = cbuf_space_used(&s->rx_buffer);
@@ -1082,14 +2124,78 @@ retry:
     /* if we've opened it enough, send an ack */
     if (new_rx_win_size >= s->mss && s->rx_win_high - s->rx_win_low < s->mss)
         send_ack(s);
+}
+
+ssize_t tcp_read(tcp_socket_t *socket, void *buf, size_t len)
+{
+    LTRACEF("socket %p, buf %p, len %zu\n", socket, buf, len);
+    if (!socket)
+        return ERR_INVALID_ARGS;
+    if (len == 0)
+        return 0;
+    if (!buf)
+        return ERR_INVALID_ARGS;
+
+    tcp_socket_t *s = socket;
+    inc_socket_ref(s);
+
+    ssize_t ret = tcp_wait_rx(s);
+    if (ret > 0) {
+        ret = cbuf_read(&s->rx_buffer, buf, len, false);
+        tcp_rx_consumed(s);
+    }
 
-out:
     mutex_release(&s->lock);
     dec_socket_ref(s);
 
     return ret;
 }
 
+ssize_t tcp_read_peek(tcp_socket_t *socket, iovec_t regions[2])
+{
+    LTRACEF("socket %p\n", socket);
+    if (!socket || !regions)
+        return ERR_INVALID_ARGS;
+
+    tcp_socket_t *s = socket;
+    inc_socket_ref(s);
+
+    /*
+     * Only the head of the cbuf moves while data arrives, so what is peeked
+     * here stays where it is until it is released.
+     */
+    ssize_t ret = tcp_wait_rx(s);
+    if (ret > 0)
+        ret = cbuf_peek(&s->rx_buffer, regions);
+
+    mutex_release(&s->lock);
+    dec_socket_ref(s);
+
+    return ret;
+}
+
+status_t tcp_read_release(tcp_socket_t *socket, size_t len)
+{
+    LTRACEF("socket %p, len %zu\n", socket, len);
+    if (!socket)
+        return ERR_INVALID_ARGS;
+
+    tcp_socket_t *s = socket;
+    mutex_acquire(&s->lock);
+
+    status_t err = NO_ERROR;
+    if (len > cbuf_space_used(&s->rx_buffer)) {
+        err = ERR_INVALID_ARGS;
+    } else if (len > 0) {
+        cbuf_read(&s->rx_buffer, NULL, len, false);
+        tcp_rx_consumed(s);
+    }
+
+    mutex_release(&s->lock);
+
+    return err;
+}
+
 ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len)
 {
     LTRACEF("socket %p, buf %p, len %zu\n", socket, buf, len);
@@ -1108,7 +2214,8 @@ ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len)
         LTRACEF("off %zu, len %zu\n", off, len);
 
         /* wait for the tx buffer to open up */
-        event_wait(&s->tx_event);
+        if (!s->nonblock)
+            event_wait(&s->tx_event);
         LTRACEF("after event_wait\n");
 
         mutex_acquire(&s->lock);
@@ -1120,22 +2227,26 @@ ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len)
             return ERR_CHANNEL_CLOSED;
         }
 
-        DEBUG_ASSERT(s->tx_buffer_size > 0);
-        DEBUG_ASSERT(s->tx_buffer_offset <= s->tx_buffer_size);
-
-        /* figure out how much data to copy in */
-        size_t to_copy = MIN(s->tx_buffer_size - s->tx_buffer_offset, len - off);
+        /* figure out how much data to copy in, none until any zero copy writes ahead of it are out */
+        size_t to_copy = 0;
+        if (list_is_empty(&s->tx_ext_list))
+            to_copy = MIN(cbuf_space_avail(&s->tx_buffer), len - off);
         if (to_copy == 0) {
+            event_unsignal(&s->tx_event);
             mutex_release(&s->lock);
+
+            /* a nonblocking write takes what fits */
+            if (s->nonblock) {
+                dec_socket_ref(s);
+                return off ? (ssize_t)off : ERR_NOT_READY;
+            }
             continue;
         }
 
-        memcpy(s->tx_buffer + s->tx_buffer_offset, (uint8_t *)buf + off, to_copy);
-        s->tx_buffer_offset += to_copy;
+        cbuf_write(&s->tx_buffer, (const uint8_t *)buf + off, to_copy, false);
 
         /* if this has completely filled it, unsignal the event */
-        DEBUG_ASSERT(s->tx_buffer_offset <= s->tx_buffer_size);
-        if (s->tx_buffer_offset == s->tx_buffer_size) {
+        if (cbuf_space_avail(&s->tx_buffer) == 0) {
             event_unsignal(&s->tx_event);
         }
 
@@ -1151,22 +2262,250 @@ ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len)
     return len;
 }
 
+status_t tcp_write_buffer(tcp_socket_t *socket, const void *buf, size_t len,
+                          tcp_write_callback_t cb, void *arg)
+{
+    LTRACEF("socket %p, buf %p, len %zu\n", socket, buf, len);
+    if (!socket || !buf || len == 0 || !cb)
+        return ERR_INVALID_ARGS;
+
+    tcp_tx_ext_t *e = malloc(sizeof(*e));
+    if (!e)
+        return ERR_NO_MEMORY;
+
+    e->buf = buf;
+    e->len = len;
+    e->acked = 0;
+    e->cb = cb;
+    e->arg = arg;
+
+    tcp_socket_t *s = socket;
+    mutex_acquire(&s->lock);
+
+    if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT) {
+        mutex_release(&s->lock);
+        free(e);
+        return ERR_CHANNEL_CLOSED;
+    }
+
+    list_add_tail(&s->tx_ext_list, &e->node);
+    s->tx_ext_len += len;
+
+    tcp_write_pending_data(s);
+
+    mutex_release(&s->lock);
+
+    return NO_ERROR;
+}
+
+status_t tcp_set_option(tcp_socket_t *socket, tcp_option_t option, uint32_t value)
+{
+    if (!socket)
+        return ERR_INVALID_ARGS;
+
+    switch (option) {
+        case TCP_OPT_RX_BUFFER_SIZE:
+        case TCP_OPT_TX_BUFFER_SIZE:
+            if (value < MIN_BUFFER_SIZE || value > MAX_BUFFER_SIZE)
+                return ERR_INVALID_ARGS;
+
+            /* the buffers are cbufs, which have to be a power of 2 */
+            value = round_up_pow2_u32(value);
+            break;
+        case TCP_OPT_ACCEPT_BACKLOG:
+            if (value == 0 || value > MAX_ACCEPT_BACKLOG)
+                return ERR_INVALID_ARGS;
+            break;
+        default:
+            break;
+    }
+
+    tcp_socket_t *s = socket;
+    inc_socket_ref(s);
+    mutex_acquire(&s->lock);
+
+    status_t err = NO_ERROR;
+    switch (option) {
+        case TCP_OPT_RX_BUFFER_SIZE:
+            /* the window scale is fixed by the handshake, so this can't change once connected */
+            if (s->state != STATE_LISTEN) {
+                err = ERR_BAD_STATE;
+                break;
+            }
+            s->rx_win_size = value;
+            break;
+        case TCP_OPT_TX_BUFFER_SIZE: {
+            if (s->state == STATE_LISTEN) {
+                s->tx_buffer_size = value;
+                break;
+            }
+            if (!s->tx_buffer_raw || !tcp_can_send(s)) {
+                err = ERR_BAD_STATE;
+                break;
+            }
+
+            /* move whatever is buffered over to a new buffer */
+            size_t used = cbuf_space_used(&s->tx_buffer);
+            if (used >= value) {
+                err = ERR_BUSY;
+                break;
+            }
+
+            uint8_t *raw = malloc(value);
+            if (!raw) {
+                err = ERR_NO_MEMORY;
+                break;
+            }
+
+            cbuf_t buffer;
+            cbuf_initialize_etc(&buffer, value, raw);
+
+            iovec_t regions[2];
+            cbuf_peek(&s->tx_buffer, regions);
+            for (uint i = 0; i < countof(regions); i++)
+                cbuf_write(&buffer, regions[i].iov_base, regions[i].iov_len, false);
+
+            free(s->tx_buffer_raw);
+            s->tx_buffer_raw = raw;
+            s->tx_buffer = buffer;
+            s->tx_buffer_size = value;
+
+            /* a writer may be waiting for the room */
+            if (cbuf_space_avail(&s->tx_buffer) > 0) {
+                event_signal(&s->tx_event, true);
+                tcp_post_events(s);
+            }
+            break;
+        }
+        case TCP_OPT_ACCEPT_BACKLOG:
+            /* a smaller backlog leaves what is already queued alone */
+            if (s->state != STATE_LISTEN) {
+                err = ERR_BAD_STATE;
+                break;
+            }
+            s->accept_backlog = value;
+            break;
+        case TCP_OPT_NODELAY:
+            s->nodelay = !!value;
+            if (s->nodelay)
+                tcp_write_pending_data(s);
+            break;
+        case TCP_OPT_CORK:
+            /* uncorking sends whatever was held back */
+            s->corked = !!value;
+            if (!s->corked)
+                tcp_write_pending_data(s);
+            break;
+        case TCP_OPT_NONBLOCK:
+            s->nonblock = !!value;
+            break;
+        default:
+            err = ERR_INVALID_ARGS;
+    }
+
+    mutex_release(&s->lock);
+    dec_socket_ref(s);
+
+    return err;
+}
+
+status_t tcp_set_event_port(tcp_socket_t *socket, port_t port, uint32_t key)
+{
+    if (!socket)
+        return ERR_INVALID_ARGS;
+
+    tcp_socket_t *s = socket;
+    mutex_acquire(&s->lock);
+
+    s->event_port = port;
+    s->event_key = key;
+    s->event_cb = NULL;
+    s->events_posted = 0;
+
+    /* whatever it is already ready for goes out now */
+    tcp_post_events(s);
+
+    mutex_release(&s->lock);
+
+    return NO_ERROR;
+}
+
+status_t tcp_set_event_callback(tcp_socket_t *socket, tcp_event_callback_t cb, void *arg)
+{
+    if (!socket)
+        return ERR_INVALID_ARGS;
+
+    tcp_socket_t *s = socket;
+    mutex_acquire(&s->lock);
+
+    s->event_port = NULL;
+    s->event_cb = cb;
+    s->event_cb_arg = arg;
+    s->events_posted = 0;
+
+    tcp_post_events(s);
+
+    mutex_release(&s->lock);
+
+    return NO_ERROR;
+}
+
+uint32_t tcp_poll(tcp_socket_t *socket)
+{
+    if (!socket)
+        return 0;
+
+    tcp_socket_t *s = socket;
+    mutex_acquire(&s->lock);
+
+    uint32_t events = tcp_events(s);
+    s->events_posted = 0;
+
+    mutex_release(&s->lock);
+
+    return events;
+}
+
+/* the FIN goes out behind whatever is still buffered, and is retransmitted like data */
+static void tcp_queue_fin(tcp_socket_t *s)
+{
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+    DEBUG_ASSERT(!s->tx_fin_queued);
+
+    s->tx_fin_queued = true;
+    s->tx_fin_seq = s->tx_win_low + tcp_tx_queued(s);
+
+    tcp_write_pending_data(s);
+}
+
 status_t tcp_close(tcp_socket_t *socket)
 {
     if (!socket)
         return ERR_INVALID_ARGS;
 
     tcp_socket_t *s = socket;
+    struct list_node unaccepted = LIST_INITIAL_VALUE(unaccepted);
 
     inc_socket_ref(s);
     mutex_acquire(&s->lock);
 
     LTRACEF("socket %p, state %d (%s), ref %d\n", s, s->state, tcp_state_to_string(s->state), s->ref);
 
+    /* the owner is done with it, nothing more goes to its event port */
+    s->event_port = NULL;
+    s->event_cb = NULL;
+
     status_t err;
     switch (s->state) {
+        case STATE_LISTEN: {
+            /* connections nobody accepted are closed below, once our lock is dropped */
+            tcp_socket_t *a;
+            while ((a = list_remove_head_type(&s->accept_list, tcp_socket_t, accept_node)))
+                list_add_tail(&unaccepted, &a->accept_node);
+            s->accept_queued = 0;
+        }
+        /* fallthrough */
         case STATE_CLOSED:
-        case STATE_LISTEN:
             /* we can directly remove this socket */
             remove_socket_from_list(s);
 
@@ -1182,17 +2521,13 @@ status_t tcp_close(tcp_socket_t *socket)
         case STATE_SYN_RCVD:
         case STATE_ESTABLISHED:
             s->state = STATE_FIN_WAIT_1;
-            tcp_socket_send(s, NULL, 0, PKT_ACK|PKT_FIN, NULL, 0, s->tx_win_low);
-            s->tx_win_low++;
+            tcp_queue_fin(s);
 
             /* stick around and wait for them to FIN us */
             break;
         case STATE_CLOSE_WAIT:
             s->state = STATE_LAST_ACK;
-            tcp_socket_send(s, NULL, 0, PKT_ACK|PKT_FIN, NULL, 0, s->tx_win_low);
-            s->tx_win_low++;
-
-            // XXX set up fin retransmit timer here
+            tcp_queue_fin(s);
             break;
         case STATE_FIN_WAIT_1:
         case STATE_FIN_WAIT_2:
@@ -1211,6 +2546,10 @@ status_t tcp_close(tcp_socket_t *socket)
 
     mutex_release(&s->lock);
 
+    tcp_socket_t *a;
+    while ((a = list_remove_head_type(&unaccepted, tcp_socket_t, accept_node)))
+        tcp_close(a);
+
     err = NO_ERROR;
 
 out:
@@ -1238,12 +2577,12 @@ usage:
 
     if (!strcmp(argv[1].str, "sockets")) {
 
-        mutex_acquire(&tcp_socket_list_lock);
+        rwlock_acquire_read(&tcp_socket_list_lock);
         tcp_socket_t *s = NULL;
         list_for_every_entry(&tcp_socket_list, s, tcp_socket_t, node) {
             dump_socket(s);
         }
-        mutex_release(&tcp_socket_list_lock);
+        rwlock_release_read(&tcp_socket_list_lock);
     } else if (!strcmp(argv[1].str, "listenclose")) {
         /* listen for a connection, accept it, then immediately close it */
         if (argc < 3) goto notenoughargs;
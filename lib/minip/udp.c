@@ -32,15 +32,21 @@
 #include <malloc.h>
 #include <stdint.h>
 #include <trace.h>
+#include <kernel/mutex.h>
 
 #define LOCAL_TRACE 0
 
-static struct list_node udp_list = LIST_INITIAL_VALUE(udp_list);
+/* listeners hashed by port, UDP_HASH_SIZE must be a power of 2 */
+#define UDP_HASH_SIZE 16
+
+static struct list_node udp_table[UDP_HASH_SIZE];
+static mutex_t udp_lock = MUTEX_INITIAL_VALUE(udp_lock);
 
 struct udp_listener {
     struct list_node list;
     uint16_t port;
     udp_callback_t callback;
+    udp_pktbuf_callback_t pktbuf_callback;
     void *arg;
 };
 
@@ -48,42 +54,73 @@ typedef struct udp_socket {
     uint32_t host;
     uint16_t sport;
     uint16_t dport;
-    const uint8_t *mac;
 } udp_socket_t;
 
-typedef struct udp_hdr {
-    uint16_t src_port;
-    uint16_t dst_port;
-    uint16_t len;
-    uint16_t chksum;
-} __PACKED udp_hdr_t;
+static inline struct list_node *udp_bucket(uint16_t port)
+{
+    struct list_node *bucket = &udp_table[(port ^ (port >> 8)) & (UDP_HASH_SIZE - 1)];
 
+    /* buckets start out zeroed, set them up the first time they are used, under udp_lock */
+    if (!bucket->next)
+        list_initialize(bucket);
 
-int udp_listen(uint16_t port, udp_callback_t cb, void *arg)
+    return bucket;
+}
+
+static int udp_listen_common(uint16_t port, udp_callback_t cb, udp_pktbuf_callback_t pktbuf_cb, void *arg)
 {
     struct udp_listener *entry, *temp;
+    int ret = 0;
 
-    list_for_every_entry_safe(&udp_list, entry, temp, struct udp_listener, list) {
+    mutex_acquire(&udp_lock);
+
+    struct list_node *bucket = udp_bucket(port);
+    list_for_every_entry_safe(bucket, entry, temp, struct udp_listener, list) {
         if (entry->port == port) {
-            if (cb == NULL) {
+            if (cb == NULL && pktbuf_cb == NULL) {
                 list_delete(&entry->list);
-                return 0;
+                free(entry);
+            } else {
+                ret = -1;
             }
-            return -1;
+            goto done;
         }
     }
 
+    if (cb == NULL && pktbuf_cb == NULL) {
+        goto done;
+    }
+
     if ((entry = malloc(sizeof(struct udp_listener))) == NULL) {
-        return -1;
+        ret = -1;
+        goto done;
     }
 
     entry->port = port;
     entry->callback = cb;
+    entry->pktbuf_callback = pktbuf_cb;
     entry->arg = arg;
 
-    list_add_tail(&udp_list, &entry->list);
+    list_add_tail(bucket, &entry->list);
+
+done:
+    mutex_release(&udp_lock);
+
+    return ret;
+}
+
+int udp_listen(uint16_t port, udp_callback_t cb, void *arg)
+{
+    return udp_listen_common(port, cb, NULL, arg);
+}
+
+int udp_listen_pktbuf(uint16_t port, udp_pktbuf_callback_t cb, void *arg)
+{
+    if (cb == NULL) {
+        return -1;
+    }
 
-    return 0;
+    return udp_listen_common(port, NULL, cb, arg);
 }
 
 status_t udp_open(uint32_t host, uint16_t sport, uint16_t dport, udp_socket_t **handle)
@@ -91,7 +128,6 @@ status_t udp_open(uint32_t host, uint16_t sport, uint16_t dport, udp_socket_t **
     LTRACEF("host %u.%u.%u.%u sport %u dport %u handle %p\n",
             IPV4_SPLIT(host), sport, dport, handle);
     udp_socket_t *socket;
-    const uint8_t *dst_mac;
 
     if (handle == NULL) {
         return -EINVAL;
@@ -102,16 +138,10 @@ status_t udp_open(uint32_t host, uint16_t sport, uint16_t dport, udp_socket_t **
         return -ENOMEM;
     }
 
-    dst_mac = arp_get_dest_mac(host);
-    if (dst_mac == NULL) {
-        free(socket);
-        return -EHOSTUNREACH;
-    }
-
+    /* the host is resolved, or not, as packets go out */
     socket->host = host;
     socket->sport = sport;
     socket->dport = dport;
-    socket->mac = dst_mac;
 
     *handle = socket;
 
@@ -142,6 +172,12 @@ status_t udp_send_iovec(const iovec_t *iov, uint iov_count, udp_socket_t *handle
         return -EINVAL;
     }
 
+    uint32_t next_hop;
+    minip_iface_t *iface = minip_route_lookup(handle->host, &next_hop);
+    if (!iface) {
+        return -EHOSTUNREACH;
+    }
+
     if ((p = pktbuf_alloc()) == NULL) {
         return -ENOMEM;
     }
@@ -153,21 +189,33 @@ status_t udp_send_iovec(const iovec_t *iov, uint iov_count, udp_socket_t *handle
     ip = pktbuf_prepend(p, sizeof(struct ipv4_hdr));
     eth = pktbuf_prepend(p, sizeof(struct eth_hdr));
 
+#if (MINIP_USE_UDP_CHECKSUM != 0)
+    /* sum the payload on the way in rather than going over it again after */
+    uint16_t data_sum = 0;
+    size_t off = 0;
+    for (uint i = 0; i < iov_count; i++) {
+        uint16_t part = ones_sum16_copy(0, (uint8_t *)buf + off, iov[i].iov_base, iov[i].iov_len);
+        data_sum = ones_sum16_add(data_sum, part, off);
+        off += iov[i].iov_len;
+    }
+#else
     iovec_to_membuf(buf, len, iov, iov_count, 0);
+#endif
 
     udp->src_port   = htons(handle->sport);
     udp->dst_port   = htons(handle->dport);
     udp->len        = htons(sizeof(udp_hdr_t) + len);
     udp->chksum     = 0;
 
-    minip_build_mac_hdr(eth, handle->mac, ETH_TYPE_IPV4);
-    minip_build_ipv4_hdr(ip, handle->host, IP_PROTO_UDP, len + sizeof(udp_hdr_t));
+    minip_build_mac_hdr(iface, eth, bcast_mac, ETH_TYPE_IPV4);
+    minip_build_ipv4_hdr(iface, ip, handle->host, IP_PROTO_UDP, len + sizeof(udp_hdr_t));
 
 #if (MINIP_USE_UDP_CHECKSUM != 0)
-    udp->chksum = rfc768_chksum(ip, udp);
+    udp->chksum = rfc768_chksum(ip, udp, data_sum);
 #endif
 
-    minip_tx_handler(p);
+    /* fills in the destination mac, or holds on to the packet until it can */
+    ret = arp_output(p, iface, next_hop);
 
     return ret;
 }
@@ -188,22 +236,51 @@ status_t udp_send(void *buf, size_t len, udp_socket_t *handle)
     return udp_send_iovec(&iov, 1, handle);
 }
 
-void udp_input(pktbuf_t *p, uint32_t src_ip)
+bool udp_input(pktbuf_t *p, uint32_t src_ip, bool owned)
 {
     udp_hdr_t *udp;
     struct udp_listener *e;
     uint16_t port;
+    udp_callback_t cb = NULL;
+    udp_pktbuf_callback_t pktbuf_cb = NULL;
+    void *arg = NULL;
 
     if ((udp = pktbuf_consume(p, sizeof(udp_hdr_t))) == NULL) {
-        return;
+        return false;
     }
 
     port = ntohs(udp->dst_port);
 
-    list_for_every_entry(&udp_list, e, struct udp_listener, list) {
+    mutex_acquire(&udp_lock);
+    list_for_every_entry(udp_bucket(port), e, struct udp_listener, list) {
         if (e->port == port) {
-            e->callback(p->data, p->dlen, src_ip, ntohs(udp->src_port), e->arg);
-            return;
+            cb = e->callback;
+            pktbuf_cb = e->pktbuf_callback;
+            arg = e->arg;
+            break;
         }
     }
+    mutex_release(&udp_lock);
+
+    if (cb) {
+        cb(p->data, p->dlen, src_ip, ntohs(udp->src_port), arg);
+        return false;
+    }
+
+    if (pktbuf_cb) {
+        if (owned) {
+            pktbuf_cb(p, src_ip, ntohs(udp->src_port), arg);
+            return true;
+        }
+
+        /* the driver wants its buffer back, so the listener gets a copy */
+        pktbuf_t *copy = pktbuf_alloc_nowait();
+        if (!copy) {
+            return false;
+        }
+        pktbuf_append_data(copy, p->data, p->dlen);
+        pktbuf_cb(copy, src_ip, ntohs(udp->src_port), arg);
+    }
+
+    return false;
 }
@@ -36,6 +36,20 @@
 #define NORFS_AVAILABLE_SPACE ((NORFS_NVRAM_SIZE - NORFS_NUM_BLOCKS * NORFS_BLOCK_HEADER_SIZE) / 2)
 #define NORFS_MIN_FREE_BLOCKS 1
 
+/* Buckets in the inode hash table. */
+#define NORFS_INODE_HASH_SIZE 32
+
+/*
+ * Garbage is collected in the background a few objects at a time, to keep
+ * this many blocks free so writes don't have to stop and collect a whole
+ * block themselves.
+ */
+#ifndef NORFS_BACKGROUND_GC
+#define NORFS_BACKGROUND_GC 1
+#endif
+#define NORFS_GC_RESERVE_BLOCKS 2
+#define NORFS_GC_BUDGET 8
+
 #define NORFS_KEY_OFFSET 0
 #define NORFS_VERSION_OFFSET 4
 #define NORFS_LENGTH_OFFSET 6
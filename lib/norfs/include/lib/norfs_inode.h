@@ -28,6 +28,8 @@
 
 struct norfs_inode {
     struct list_node lnode;
+    struct list_node hnode;
+    uint32_t key;
     uint32_t location;
     uint32_t reference_count;
 };
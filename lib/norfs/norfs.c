@@ -33,6 +33,9 @@
 #include <platform/flash_nor_config.h>
 #include <list.h>
 #include <debug.h>
+#include <kernel/mutex.h>
+#include <kernel/event.h>
+#include <kernel/thread.h>
 
 /* FRIEND_TEST non-static if unit testing, in order to
  * allow functions to be exposed by a test header file.
@@ -78,11 +81,29 @@ FRIEND_TEST uint8_t num_free_blocks = 0;
 static bool fs_mounted = false;
 FRIEND_TEST uint32_t norfs_nvram_offset;
 static struct list_node inode_list;
+static struct list_node inode_hash[NORFS_INODE_HASH_SIZE];
 
 static bool block_free[NORFS_NUM_BLOCKS];
 
+/* Block being garbage collected, or -1, and how far through it we are. */
+static int gc_block = -1;
+static uint32_t gc_read_ptr;
+
+/* Serializes the api against the background collector. */
+static mutex_t norfs_lock = MUTEX_INITIAL_VALUE(norfs_lock);
+
+#if NORFS_BACKGROUND_GC
+static event_t gc_event = EVENT_INITIAL_VALUE(gc_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+static bool gc_thread_started = false;
+
+/* Set by the unit tests, which poke at collector state directly. */
+FRIEND_TEST bool norfs_gc_paused = false;
+#endif
+
 static status_t collect_garbage(void);
 static status_t load_and_verify_obj(uint32_t *ptr, struct norfs_header *header);
+static status_t put_obj_iovec(uint32_t key, const iovec_t *iov,
+                              uint32_t iov_count, uint8_t flags);
 
 FRIEND_TEST uint8_t block_num(uint32_t flash_pointer)
 {
@@ -119,9 +140,17 @@ static bool block_full(uint8_t block, uint32_t ptr)
     return curr_block_free_space(ptr) < NORFS_OBJ_OFFSET;
 }
 
-static uint8_t select_garbage_block(uint32_t ptr)
+/* Round robin, starting after the block being written to. */
+static status_t select_garbage_block(uint32_t ptr, uint8_t *block)
 {
-    return (block_num(ptr) + 1) % 8;
+    for (uint8_t i = 1; i < NORFS_NUM_BLOCKS; i++) {
+        uint8_t candidate = (block_num(ptr) + i) % NORFS_NUM_BLOCKS;
+        if (!block_free[candidate]) {
+            *block = candidate;
+            return NO_ERROR;
+        }
+    }
+    return ERR_NOT_FOUND;
 }
 
 static ssize_t nvram_read(size_t offset, size_t length, void *ptr)
@@ -146,21 +175,28 @@ unsigned char *nvram_flash_pointer(uint32_t loc)
     return FLASH_PTR(flash_nor_get_bank(NORFS_BANK), loc + norfs_nvram_offset);
 }
 
+static struct list_node *inode_bucket(uint32_t key)
+{
+    return &inode_hash[key % NORFS_INODE_HASH_SIZE];
+}
+
+static void add_inode(struct norfs_inode *inode, uint32_t key)
+{
+    inode->key = key;
+    list_add_tail(&inode_list, &inode->lnode);
+    list_add_head(inode_bucket(key), &inode->hnode);
+}
+
 FRIEND_TEST bool get_inode(uint32_t key, struct norfs_inode **inode)
 {
-    struct list_node *curr_lnode;
     struct norfs_inode *curr_inode;
-    uint32_t curr_key;
 
     if (!inode)
         return false;
 
     *inode = NULL;
-    list_for_every(&inode_list, curr_lnode) {
-        curr_inode = containerof(curr_lnode, struct norfs_inode, lnode);
-        nvram_read(curr_inode->location + NORFS_KEY_OFFSET,
-                   sizeof(curr_key), &curr_key);
-        if (curr_key == key) {
+    list_for_every_entry(inode_bucket(key), curr_inode, struct norfs_inode, hnode) {
+        if (curr_inode->key == key) {
             *inode = curr_inode;
             return true;
         }
@@ -220,12 +256,9 @@ static ssize_t read_header(uint32_t ptr, struct norfs_header *header)
     return total_bytes_read;
 }
 
-status_t norfs_read_obj_iovec(uint32_t key, iovec_t *obj_iov,
-                              uint32_t iov_count, size_t *bytes_read, uint8_t flags)
+static status_t read_obj_iovec(uint32_t key, iovec_t *obj_iov,
+                               uint32_t iov_count, size_t *bytes_read, uint8_t flags)
 {
-    if (!fs_mounted)
-        return ERR_NOT_MOUNTED;
-
     uint32_t read_ptr;
     uint16_t to_read, total_to_read;
     struct norfs_inode *inode;
@@ -273,6 +306,19 @@ status_t norfs_read_obj_iovec(uint32_t key, iovec_t *obj_iov,
     return NO_ERROR;
 }
 
+status_t norfs_read_obj_iovec(uint32_t key, iovec_t *obj_iov,
+                              uint32_t iov_count, size_t *bytes_read, uint8_t flags)
+{
+    if (!fs_mounted)
+        return ERR_NOT_MOUNTED;
+
+    mutex_acquire(&norfs_lock);
+    status_t status = read_obj_iovec(key, obj_iov, iov_count, bytes_read, flags);
+    mutex_release(&norfs_lock);
+
+    return status;
+}
+
 static status_t write_obj_header(uint32_t *ptr, uint32_t key, uint16_t version,
                                  uint16_t len, uint8_t flags, uint16_t crc)
 {
@@ -383,6 +429,7 @@ static status_t initialize_next_block(uint32_t *ptr)
             sizeof(NORFS_BLOCK_GC_FINISHED_HEADER);
 
     if (num_free_blocks < NORFS_MIN_FREE_BLOCKS) {
+        /* Out of reserve, finish collecting a block before going on. */
         status = collect_garbage();
         if (status) {
             TRACEF("Failed to collection garbage.  Error: %d\n.",
@@ -390,6 +437,11 @@ static status_t initialize_next_block(uint32_t *ptr)
             return status;
         }
     }
+#if NORFS_BACKGROUND_GC
+    else if (num_free_blocks < NORFS_GC_RESERVE_BLOCKS) {
+        event_signal(&gc_event, false);
+    }
+#endif
 
     status = nvram_write(header_pointer,
                          sizeof(NORFS_BLOCK_GC_FINISHED_HEADER),
@@ -477,14 +529,20 @@ status_t norfs_remove_obj(uint32_t key)
     uint16_t prior_len;
     struct iovec iov[1];
     status_t status;
+
+    mutex_acquire(&norfs_lock);
+
     bool success = get_inode(key, &inode);
-    if (!success || is_deleted(inode->location))
+    if (!success || is_deleted(inode->location)) {
+        mutex_release(&norfs_lock);
         return ERR_NOT_FOUND;
+    }
 
     status = nvram_read(inode->location + NORFS_LENGTH_OFFSET,
                         sizeof(uint16_t), &prior_len);
     if (status < 0) {
         TRACEF("Failed to read during norfs_remove_obj.  Status: %d\n", status);
+        mutex_release(&norfs_lock);
         return status;
     }
 
@@ -495,10 +553,12 @@ status_t norfs_remove_obj(uint32_t key)
      * Write a deleted object by passing a null iovec pointer.  Only header
      * will be written.
      */
-    status = norfs_put_obj_iovec(key, iov, 0, NORFS_DELETED_MASK);
+    status = put_obj_iovec(key, iov, 0, NORFS_DELETED_MASK);
     if (status)
         TRACEF("Error putting object. %d\n", status);
 
+    mutex_release(&norfs_lock);
+
     return status;
 }
 
@@ -535,6 +595,16 @@ status_t norfs_put_obj_iovec(uint32_t key, const iovec_t *iov,
         return ERR_INVALID_ARGS;
     }
 
+    mutex_acquire(&norfs_lock);
+    status_t status = put_obj_iovec(key, iov, iov_count, flags);
+    mutex_release(&norfs_lock);
+
+    return status;
+}
+
+static status_t put_obj_iovec(uint32_t key, const iovec_t *iov,
+                              uint32_t iov_count, uint8_t flags)
+{
     uint8_t block_num_to_write;
     struct norfs_inode *inode;
     uint16_t len = iovec_size(iov, iov_count);
@@ -563,6 +633,8 @@ status_t norfs_put_obj_iovec(uint32_t key, const iovec_t *iov,
         return ERR_NOT_FOUND;
     } else {
         inode = malloc(sizeof(struct norfs_inode));
+        if (!inode)
+            return ERR_NO_MEMORY;
         inode->reference_count = 1;
     }
 
@@ -571,6 +643,8 @@ status_t norfs_put_obj_iovec(uint32_t key, const iovec_t *iov,
     if (NORFS_FLASH_SIZE(len) > NORFS_MAX_OBJ_LEN) {
         TRACEF("Object too big.  Not adding.\n");
         flash_nor_end(NORFS_BANK);
+        if (!obj_preexists)
+            free(inode);
         return ERR_TOO_BIG;
     }
 
@@ -578,6 +652,8 @@ status_t norfs_put_obj_iovec(uint32_t key, const iovec_t *iov,
         TRACEF("Not enough remaining space.  Remaining space:  %d\tObject len: \
 			    %d\n", total_remaining_space, len);
         flash_nor_end(NORFS_BANK);
+        if (!obj_preexists)
+            free(inode);
         return ERR_NO_MEMORY;
     }
 
@@ -585,6 +661,8 @@ status_t norfs_put_obj_iovec(uint32_t key, const iovec_t *iov,
     if (status) {
         TRACEF("Error finding space for object.  Status: %d\n", status);
         flash_nor_end(NORFS_BANK);
+        if (!obj_preexists)
+            free(inode);
         return ERR_IO;
     }
 
@@ -594,7 +672,7 @@ status_t norfs_put_obj_iovec(uint32_t key, const iovec_t *iov,
                              version, flags);
     if (!status) {
         if (!obj_preexists) {
-            list_add_tail(&inode_list, &inode->lnode);
+            add_inode(inode, key);
         } else {
             /* If object preexists, remove outdated version from remaining space. */
             uint16_t prior_len;
@@ -607,6 +685,8 @@ status_t norfs_put_obj_iovec(uint32_t key, const iovec_t *iov,
         total_remaining_space -= NORFS_FLASH_SIZE(len);
     } else {
         TRACEF("Error writing object. Status: %d\n", status);
+        if (!obj_preexists)
+            free(inode);
     }
 
     /* If write error, or if fell off block, find new block. */
@@ -623,6 +703,7 @@ static void remove_inode(struct norfs_inode *inode)
     if (!inode)
         return;
     list_delete(&inode->lnode);
+    list_delete(&inode->hnode);
     free(inode);
     inode = NULL;
 }
@@ -732,15 +813,100 @@ FRIEND_TEST status_t collect_block(uint32_t garbage_block,
     return erase_block(garbage_block);
 }
 
-static status_t collect_garbage(void)
+/*
+ * Collect up to budget objects from the block being garbage collected,
+ * picking a new one if there isn't one under way, and erase it once it's
+ * empty. Returns ERR_BUSY if the block isn't done yet.
+ */
+static status_t gc_step(uint32_t budget)
 {
     status_t status;
-    uint8_t garbage_read_block = select_garbage_block(write_pointer);
-    status = collect_block(garbage_read_block, &write_pointer);
 
-    return status;
+    if (gc_block < 0) {
+        uint8_t block;
+        status = select_garbage_block(write_pointer, &block);
+        if (status)
+            return status;
+
+        gc_block = block;
+        gc_read_ptr = block * FLASH_PAGE_SIZE + NORFS_BLOCK_HEADER_SIZE;
+    }
+
+    while (!block_full(gc_block, gc_read_ptr)) {
+        if (budget-- == 0)
+            return ERR_BUSY;
+
+        struct norfs_header header;
+        if (read_header(gc_read_ptr, &header) < 0 ||
+                NORFS_FLASH_SIZE(header.len) > NORFS_MAX_OBJ_LEN) {
+            /* Reached the unwritten end of the block. */
+            break;
+        }
+
+        /*
+         * Make sure a live copy has somewhere to go. Only move on to a new
+         * block while that leaves the reserve alone, so this never recurses
+         * into collect_garbage.
+         */
+        if (curr_block_free_space(write_pointer) < NORFS_FLASH_SIZE(header.len)) {
+            if (num_free_blocks <= NORFS_MIN_FREE_BLOCKS)
+                return ERR_NO_MEMORY;
+
+            status = initialize_next_block(&write_pointer);
+            if (status)
+                return status;
+        }
+
+        status = collect_garbage_object(&gc_read_ptr, &write_pointer);
+        if (status)
+            break;
+    }
+
+    uint8_t block = gc_block;
+    gc_block = -1;
+    return erase_block(block);
 }
 
+/* Finish collecting a block, whatever it takes. */
+static status_t collect_garbage(void)
+{
+    return gc_step(UINT32_MAX);
+}
+
+#if NORFS_BACKGROUND_GC
+/*
+ * Keeps NORFS_GC_RESERVE_BLOCKS blocks free, collecting a few objects at a
+ * time so it never holds up the api for long.
+ */
+static int norfs_gc_thread(void *arg)
+{
+    for (;;) {
+        event_wait(&gc_event);
+
+        for (;;) {
+            mutex_acquire(&norfs_lock);
+
+            status_t status = ERR_NOT_READY;
+            if (fs_mounted && !norfs_gc_paused &&
+                    (gc_block >= 0 || num_free_blocks < NORFS_GC_RESERVE_BLOCKS)) {
+                flash_nor_begin(NORFS_BANK);
+                status = gc_step(NORFS_GC_BUDGET);
+                flash_nor_end(NORFS_BANK);
+            }
+
+            mutex_release(&norfs_lock);
+
+            if (status != NO_ERROR && status != ERR_BUSY)
+                break;
+
+            thread_yield();
+        }
+    }
+
+    return 0;
+}
+#endif
+
 /*
  * Load object into buffer and verify object's integrity via crc.  ptr parameter
  * is updated upon successful verification.
@@ -858,11 +1024,13 @@ static status_t mount_next_obj(void)
     } else {
         /* Object not yet held in memory.  Create new inode. */
         inode = malloc(sizeof(struct norfs_inode));
+        if (!inode)
+            return ERR_NO_MEMORY;
         inode->location = curr_obj_loc;
 
         inode->reference_count = 1;
 
-        list_add_tail(&inode_list, &inode->lnode);
+        add_inode(inode, header.key);
         total_remaining_space -= NORFS_FLASH_SIZE(header.len);
     }
 
@@ -896,6 +1064,9 @@ status_t norfs_mount_fs(uint32_t offset)
     norfs_nvram_offset = offset;
 
     list_initialize(&inode_list);
+    for (uint i = 0; i < NORFS_INODE_HASH_SIZE; i++)
+        list_initialize(&inode_hash[i]);
+    gc_block = -1;
     flash_nor_begin(NORFS_BANK);
     srand(current_time());
 
@@ -939,6 +1110,17 @@ status_t norfs_mount_fs(uint32_t offset)
     TRACEF("NOR filesystem successfully mounted.\n");
     flash_nor_end(NORFS_BANK);
     fs_mounted = true;
+
+#if NORFS_BACKGROUND_GC
+    if (!gc_thread_started) {
+        gc_thread_started = true;
+        thread_detach_and_resume(thread_create("norfs gc", &norfs_gc_thread, NULL,
+                                               LOW_PRIORITY, DEFAULT_STACK_SIZE));
+    }
+    if (num_free_blocks < NORFS_GC_RESERVE_BLOCKS)
+        event_signal(&gc_event, false);
+#endif
+
     return NO_ERROR;
 }
 
@@ -953,6 +1135,9 @@ void norfs_unmount_fs(void)
         TRACEF("Filesystem not mounted.\n");
         return;
     }
+
+    /* Wait out any background collection step. */
+    mutex_acquire(&norfs_lock);
     if (!list_is_empty(&inode_list)) {
         list_for_every_safe(&inode_list, curr_lnode, temp_node) {
             if (curr_lnode) {
@@ -967,7 +1152,10 @@ void norfs_unmount_fs(void)
     for (uint8_t i = 0; i < NORFS_NUM_BLOCKS; i++) {
         block_free[i] = false;
     }
+    gc_block = -1;
     fs_mounted = false;
+
+    mutex_release(&norfs_lock);
 }
 
 void norfs_wipe_fs(void)
@@ -35,6 +35,9 @@
 
 extern uint32_t total_remaining_space;
 extern uint8_t num_free_blocks;
+#if NORFS_BACKGROUND_GC
+extern bool norfs_gc_paused;
+#endif
 
 static uint8_t *norfs_test_bank;
 static uint8_t norfs_test_bank_len;
@@ -705,9 +708,51 @@ static bool test_wrapping(void)
     END_TEST;
 }
 
+static bool test_many_keys(void)
+{
+    BEGIN_TEST;
+    size_t bytes_read;
+    uint32_t val;
+
+    wipe_fs();
+    norfs_mount_fs(norfs_nvram_offset);
+
+    /* More keys than hash buckets, so chains get some use. */
+    for (uint32_t key = 0; key < 4 * NORFS_INODE_HASH_SIZE; key++) {
+        val = key * 3;
+        EXPECT_EQ(NO_ERROR, norfs_put_obj(key, (unsigned char *)&val, sizeof(val), 0),
+                  "Error putting object");
+    }
+    for (uint32_t key = 0; key < 4 * NORFS_INODE_HASH_SIZE; key += 2) {
+        EXPECT_EQ(NO_ERROR, norfs_remove_obj(key), "Error removing object");
+    }
+
+    /* Everything has to be found again from flash too. */
+    norfs_unmount_fs();
+    norfs_mount_fs(norfs_nvram_offset);
+
+    for (uint32_t key = 0; key < 4 * NORFS_INODE_HASH_SIZE; key++) {
+        status_t status = norfs_read_obj(key, (unsigned char *)&val, sizeof(val),
+                                         &bytes_read, 0);
+        if (key % 2) {
+            EXPECT_EQ(NO_ERROR, status, "Error reading object");
+            EXPECT_EQ(key * 3, val, "Bad value for object");
+        } else {
+            EXPECT_EQ(ERR_NOT_FOUND, status, "Removed object still readable");
+        }
+    }
+
+    wipe_fs();
+    END_TEST;
+}
+
 static void init_tests(void)
 {
     platform_init();
+#if NORFS_BACKGROUND_GC
+    /* The tests poke at collector state directly, keep it in the foreground. */
+    norfs_gc_paused = true;
+#endif
     wipe_fs();
 }
 
@@ -723,4 +768,5 @@ RUN_TEST(test_total_remaining_space);
 RUN_TEST(test_thrash_fs);
 RUN_TEST(test_wrapping);
 RUN_TEST(test_overflow_filesystem);
+RUN_TEST(test_many_keys);
 END_TEST_CASE(norfs_tests);
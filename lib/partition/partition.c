@@ -26,9 +26,17 @@
 #include <compiler.h>
 #include <stdlib.h>
 #include <arch.h>
+#include <err.h>
 #include <lib/bio.h>
+#include <lib/cksum.h>
 #include <lib/partition.h>
 
+/* most partitions we'll publish on a device, and look for when unpublishing */
+#define MAX_PARTITIONS 128
+
+/* what's read up front: the mbr, the gpt header and the usual 128 gpt entries after it */
+#define GPT_ENTRIES_LEN (128 * 128)
+
 struct chs {
     uint8_t c;
     uint8_t h;
@@ -44,6 +52,49 @@ struct mbr_part {
     uint32_t lba_length;
 } __PACKED;
 
+#define MBR_TYPE_GPT_PROTECTIVE 0xee
+
+#define GPT_SIGNATURE "EFI PART"
+
+struct gpt_header {
+    uint8_t signature[8];
+    uint32_t revision;
+    uint32_t header_size;
+    uint32_t header_crc32;  /* over header_size bytes, with this field zero */
+    uint32_t reserved;
+    uint64_t my_lba;
+    uint64_t alternate_lba;
+    uint64_t first_usable_lba;
+    uint64_t last_usable_lba;
+    uint8_t disk_guid[16];
+    uint64_t entries_lba;
+    uint32_t num_entries;
+    uint32_t entry_size;
+    uint32_t entries_crc32;
+} __PACKED;
+
+struct gpt_entry {
+    uint8_t type_guid[16];
+    uint8_t unique_guid[16];
+    uint64_t first_lba;
+    uint64_t last_lba;
+    uint64_t attributes;
+    uint16_t name[36];
+} __PACKED;
+
+/* a device being scanned, the reads for all of them are in flight at once */
+struct partition_scan {
+    const char *name;
+    bdev_t *dev;
+    off_t offset;
+
+    uint8_t *buf;
+    size_t len;
+    bio_iovec_t iov;
+    bio_request_t req;
+    bool submitted;
+};
+
 static status_t validate_mbr_partition(bdev_t *dev, const struct mbr_part *part)
 {
     /* check for invalid types */
@@ -64,68 +115,242 @@ static status_t validate_mbr_partition(bdev_t *dev, const struct mbr_part *part)
     return 0;
 }
 
-int partition_publish(const char *device, off_t offset)
+static int publish(const char *device, int index, bnum_t start, bnum_t len)
 {
-    int err = 0;
+    char subdevice[128];
+
+    snprintf(subdevice, sizeof(subdevice), "%sp%d", device, index);
+
+    status_t err = bio_publish_subdevice(device, subdevice, start, len);
+    if (err < 0) {
+        dprintf(INFO, "error publishing subdevice '%s'\n", subdevice);
+        return 0;
+    }
+    return 1;
+}
+
+/* publish the partitions in a gpt, using what was read with the mbr if the entries are there */
+static int gpt_publish(struct partition_scan *s)
+{
+    bdev_t *dev = s->dev;
+    size_t bs = dev->block_size;
     int count = 0;
 
-    // clear any partitions that may have already existed
-    partition_unpublish(device);
+    if (s->len < 2 * bs)
+        return ERR_NOT_FOUND;
 
-    bdev_t *dev = bio_open(device);
-    if (!dev) {
-        printf("partition_publish: unable to open device\n");
-        return -1;
+    struct gpt_header hdr;
+    memcpy(&hdr, s->buf + bs, sizeof(hdr));
+
+    if (memcmp(hdr.signature, GPT_SIGNATURE, sizeof(hdr.signature)))
+        return ERR_NOT_FOUND;
+    if (hdr.header_size < sizeof(hdr) || hdr.header_size > bs)
+        return ERR_NOT_VALID;
+
+    uint32_t saved_crc = hdr.header_crc32;
+    memset(s->buf + bs + offsetof(struct gpt_header, header_crc32), 0, sizeof(uint32_t));
+    uint32_t crc = crc32(0, s->buf + bs, hdr.header_size);
+    if (crc != saved_crc) {
+        dprintf(INFO, "gpt header crc mismatch on '%s'\n", s->name);
+        return ERR_CRC_FAIL;
     }
 
-    // get a dma aligned and padded block to read info
-    STACKBUF_DMA_ALIGN(buf, dev->block_size);
+    if (hdr.entry_size < sizeof(struct gpt_entry) || hdr.num_entries == 0 ||
+            hdr.num_entries > 1024 || hdr.entries_lba >= dev->block_count)
+        return ERR_NOT_VALID;
+
+    /* the entries are almost always right after the header, in what we've already read */
+    size_t entries_len = (size_t)hdr.num_entries * hdr.entry_size;
+    off_t entries_off = s->offset + hdr.entries_lba * bs;
+    uint8_t *entries;
+    uint8_t *extra = NULL;
+    if (entries_off >= s->offset && entries_off + entries_len <= s->offset + s->len) {
+        entries = s->buf + (entries_off - s->offset);
+    } else {
+        extra = malloc(entries_len);
+        if (!extra)
+            return ERR_NO_MEMORY;
+        if (bio_read(dev, extra, entries_off, entries_len) != (ssize_t)entries_len) {
+            free(extra);
+            return ERR_IO;
+        }
+        entries = extra;
+    }
 
-    /* sniff for MBR partition types */
-    do {
-        int i;
+    if (crc32(0, entries, entries_len) != hdr.entries_crc32) {
+        dprintf(INFO, "gpt entries crc mismatch on '%s'\n", s->name);
+        free(extra);
+        return ERR_CRC_FAIL;
+    }
 
-        err = bio_read(dev, buf, offset, 512);
-        if (err < 0)
-            goto err;
+    for (uint i = 0; i < hdr.num_entries && i < MAX_PARTITIONS; i++) {
+        struct gpt_entry e;
+        memcpy(&e, entries + i * hdr.entry_size, sizeof(e));
 
-        /* look for the aa55 tag */
-        if (buf[510] != 0x55 || buf[511] != 0xaa)
-            break;
+        static const uint8_t unused[16];
+        if (!memcmp(e.type_guid, unused, sizeof(unused)))
+            continue;
+        if (e.last_lba < e.first_lba || e.last_lba >= dev->block_count)
+            continue;
+
+        dprintf(INFO, "\t%u: gpt start 0x%llx, len 0x%llx\n", i, e.first_lba,
+                e.last_lba - e.first_lba + 1);
+
+        count += publish(s->name, i, e.first_lba, e.last_lba - e.first_lba + 1);
+    }
 
-        /* see if a partition table makes sense here */
-        struct mbr_part part[4];
-        memcpy(part, buf + 446, sizeof(part));
+    free(extra);
+    return count;
+}
+
+static int mbr_publish(struct partition_scan *s)
+{
+    uint8_t *buf = s->buf;
+    int count = 0;
+    int i;
+
+    /* look for the aa55 tag */
+    if (s->len < 512 || buf[510] != 0x55 || buf[511] != 0xaa)
+        return 0;
+
+    /* see if a partition table makes sense here */
+    struct mbr_part part[4];
+    memcpy(part, buf + 446, sizeof(part));
 
 #if LK_DEBUGLEVEL >= INFO
-        dprintf(INFO, "mbr partition table dump:\n");
-        for (i=0; i < 4; i++) {
-            dprintf(INFO, "\t%i: status 0x%hhx, type 0x%hhx, start 0x%x, len 0x%x\n", i, part[i].status, part[i].type, part[i].lba_start, part[i].lba_length);
-        }
+    dprintf(INFO, "mbr partition table dump:\n");
+    for (i=0; i < 4; i++) {
+        dprintf(INFO, "\t%i: status 0x%hhx, type 0x%hhx, start 0x%x, len 0x%x\n", i, part[i].status, part[i].type, part[i].lba_start, part[i].lba_length);
+    }
 #endif
 
-        /* validate each of the partition entries */
-        for (i=0; i < 4; i++) {
-            if (validate_mbr_partition(dev, &part[i]) >= 0) {
-                // publish it
-                char subdevice[128];
-
-                sprintf(subdevice, "%sp%d", device, i);
-
-                err = bio_publish_subdevice(device, subdevice, part[i].lba_start, part[i].lba_length);
-                if (err < 0) {
-                    dprintf(INFO, "error publishing subdevice '%s'\n", subdevice);
-                    continue;
-                }
-                count++;
-            }
+    /* a protective mbr covers a gpt, publish that instead */
+    for (i=0; i < 4; i++) {
+        if (part[i].type == MBR_TYPE_GPT_PROTECTIVE) {
+            int err = gpt_publish(s);
+            if (err >= 0)
+                return err;
+            dprintf(INFO, "no valid gpt on '%s' (%d), using the mbr\n", s->name, err);
+            break;
         }
-    } while (0);
+    }
+
+    /* validate each of the partition entries */
+    for (i=0; i < 4; i++) {
+        if (part[i].type == MBR_TYPE_GPT_PROTECTIVE)
+            continue;
+        if (validate_mbr_partition(s->dev, &part[i]) >= 0) {
+            // publish it
+            count += publish(s->name, i, part[i].lba_start, part[i].lba_length);
+        }
+    }
+
+    return count;
+}
+
+/* open the device and start reading its tables */
+static status_t scan_start(struct partition_scan *s)
+{
+    bdev_t *dev = bio_open(s->name);
+    if (!dev) {
+        printf("partition_publish: unable to open device '%s'\n", s->name);
+        return ERR_NOT_FOUND;
+    }
+    s->dev = dev;
+
+    s->len = MAX(512, 2 * dev->block_size + ROUNDUP(GPT_ENTRIES_LEN, dev->block_size));
+    s->len = MIN(s->len, (size_t)bio_trim_range(dev, s->offset, s->len));
+    s->len = ROUNDDOWN(s->len, dev->block_size);
+
+    // get a dma aligned and padded buffer to read into
+    s->buf = memalign(CACHE_LINE, ROUNDUP(MAX(s->len, 512u), CACHE_LINE));
+    if (!s->buf)
+        return ERR_NO_MEMORY;
 
-    bio_close(dev);
+    if ((s->offset & (dev->block_size - 1)) == 0 && s->len > 0) {
+        s->iov.base = s->buf;
+        s->iov.len = s->len;
+        memset(&s->req, 0, sizeof(s->req));
+        s->req.block = s->offset >> dev->block_shift;
+        s->req.iov = &s->iov;
+        s->req.iov_count = 1;
+        if (bio_submit(dev, &s->req) >= 0) {
+            s->submitted = true;
+            return NO_ERROR;
+        }
+    }
 
-err:
-    return (err < 0) ? err : count;
+    /* not on a block boundary, or the device wouldn't take it, read it the slow way */
+    s->len = MAX(s->len, 512u);
+    ssize_t err = bio_read(dev, s->buf, s->offset, s->len);
+    if (err < 0)
+        return err;
+    s->len = err;
+    return NO_ERROR;
+}
+
+/* wait for the reads and publish what's there */
+static int scan_finish(struct partition_scan *s)
+{
+    int err = 0;
+
+    if (s->submitted) {
+        ssize_t len = bio_request_wait(&s->req);
+        if (len < 0)
+            err = len;
+        else
+            s->len = len;
+    }
+
+    if (err >= 0 && s->dev && s->buf)
+        err = mbr_publish(s);
+
+    free(s->buf);
+    if (s->dev)
+        bio_close(s->dev);
+
+    return err;
+}
+
+int partition_publish_devices(const char * const *devices, uint count, off_t offset)
+{
+    int total = 0;
+    int err = 0;
+
+    struct partition_scan *scans = calloc(count, sizeof(*scans));
+    if (!scans)
+        return ERR_NO_MEMORY;
+
+    /* get all of the reads going before waiting on any of them */
+    for (uint i = 0; i < count; i++) {
+        // clear any partitions that may have already existed
+        partition_unpublish(devices[i]);
+
+        scans[i].name = devices[i];
+        scans[i].offset = offset;
+        status_t serr = scan_start(&scans[i]);
+        if (serr < 0 && err == 0)
+            err = serr;
+    }
+
+    for (uint i = 0; i < count; i++) {
+        int r = scan_finish(&scans[i]);
+        if (r < 0) {
+            if (err == 0)
+                err = r;
+        } else {
+            total += r;
+        }
+    }
+
+    free(scans);
+
+    return (count == 1 && err < 0) ? err : total;
+}
+
+int partition_publish(const char *device, off_t offset)
+{
+    return partition_publish_devices(&device, 1, offset);
 }
 
 int partition_unpublish(const char *device)
@@ -136,8 +361,8 @@ int partition_unpublish(const char *device)
     char devname[512];
 
     count = 0;
-    for (i=0; i < 16; i++) {
-        sprintf(devname, "%sp%d", device, i);
+    for (i=0; i < MAX_PARTITIONS; i++) {
+        snprintf(devname, sizeof(devname), "%sp%d", device, i);
 
         dev = bio_open(devname);
         if (!dev)
@@ -150,4 +375,3 @@ int partition_unpublish(const char *device)
 
     return count;
 }
-
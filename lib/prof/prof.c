@@ -0,0 +1,341 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/prof.h>
+
+#include <debug.h>
+#include <assert.h>
+#include <trace.h>
+#include <err.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <arch/ops.h>
+#include <kernel/thread.h>
+#include <kernel/timer.h>
+#include <kernel/mp.h>
+
+#define LOCAL_TRACE 0
+
+/* samples kept per cpu before new ones are counted as dropped */
+#ifndef PROF_SAMPLES
+#define PROF_SAMPLES 4096
+#endif
+
+/* words per sample, the pc followed by up to PROF_MAX_DEPTH - 1 return addresses */
+#ifndef PROF_MAX_DEPTH
+#define PROF_MAX_DEPTH 8
+#endif
+
+#define PROF_DEFAULT_HZ 1000
+
+struct prof_cpu {
+    timer_t timer;
+    volatile bool pending;
+    uint count;
+    uint dropped;
+    uintptr_t *samples;
+};
+
+static struct prof_cpu prof_cpus[SMP_MAX_CPUS];
+static lk_time_t prof_period;
+volatile bool prof_running;
+
+static enum handler_return prof_timer_cb(struct timer *t, lk_time_t now, void *arg)
+{
+    struct prof_cpu *pc = (struct prof_cpu *)arg;
+
+    /* the sample is taken on the way out of this same interrupt */
+    pc->pending = true;
+
+    return INT_NO_RESCHEDULE;
+}
+
+/*
+ * Follow {previous fp, return address} frame records while they stay inside
+ * the interrupted thread's stack and keep moving up it. Anything built without
+ * frame pointers just ends the chain early.
+ */
+static uint prof_walk_frames(uintptr_t *out, uint max, uintptr_t fp)
+{
+    thread_t *t = get_current_thread();
+    uintptr_t stack_lo = (uintptr_t)t->stack;
+    uintptr_t stack_hi = stack_lo + t->stack_size;
+    uint depth = 0;
+
+    while (depth < max && fp) {
+        if ((fp & (sizeof(uintptr_t) - 1)) || fp < stack_lo || fp + 2 * sizeof(uintptr_t) > stack_hi)
+            break;
+
+        const uintptr_t *frame = (const uintptr_t *)fp;
+        if (!frame[1])
+            break;
+        out[depth++] = frame[1];
+
+        if (frame[0] <= fp)
+            break;
+        fp = frame[0];
+    }
+
+    return depth;
+}
+
+void _prof_irq_sample(uintptr_t pc, uintptr_t fp)
+{
+    struct prof_cpu *p = &prof_cpus[arch_curr_cpu_num()];
+
+    if (!p->pending)
+        return;
+    p->pending = false;
+
+    if (p->count >= PROF_SAMPLES) {
+        p->dropped++;
+        return;
+    }
+
+    uintptr_t *s = &p->samples[p->count * PROF_MAX_DEPTH];
+    s[0] = pc;
+    uint depth = 1 + prof_walk_frames(&s[1], PROF_MAX_DEPTH - 1, fp);
+    if (depth < PROF_MAX_DEPTH)
+        s[depth] = 0;
+
+    p->count++;
+}
+
+/* timers belong to the cpu that sets them, so each cpu starts and stops its own */
+static int prof_cpu_thread(void *arg)
+{
+    struct prof_cpu *p = (struct prof_cpu *)arg;
+
+    if (prof_period) {
+        timer_set_periodic(&p->timer, prof_period, prof_timer_cb, p);
+    } else {
+        timer_cancel(&p->timer);
+        p->pending = false;
+    }
+
+    return 0;
+}
+
+static void prof_on_each_cpu(void)
+{
+    thread_t *threads[SMP_MAX_CPUS];
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        threads[i] = NULL;
+        if (!mp_is_cpu_active(i))
+            continue;
+
+        threads[i] = thread_create("prof", prof_cpu_thread, &prof_cpus[i], HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+        if (!threads[i])
+            continue;
+        thread_set_pinned_cpu(threads[i], i);
+        thread_resume(threads[i]);
+    }
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (threads[i])
+            thread_join(threads[i], NULL, INFINITE_TIME);
+    }
+}
+
+status_t prof_start(uint hz)
+{
+    LTRACEF("hz %u\n", hz);
+
+    if (prof_running)
+        return ERR_BUSY;
+    if (hz == 0)
+        return ERR_INVALID_ARGS;
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        struct prof_cpu *p = &prof_cpus[i];
+
+        if (!p->samples) {
+            p->samples = calloc(PROF_SAMPLES * PROF_MAX_DEPTH, sizeof(uintptr_t));
+            if (!p->samples)
+                return ERR_NO_MEMORY;
+            timer_initialize(&p->timer);
+        }
+    }
+
+    /* the kernel timer runs in milliseconds, which caps the rate at 1khz */
+    prof_period = MAX(1000 / hz, 1u);
+
+    prof_running = true;
+    prof_on_each_cpu();
+
+    return NO_ERROR;
+}
+
+void prof_stop(void)
+{
+    if (!prof_running)
+        return;
+
+    prof_period = 0;
+    prof_on_each_cpu();
+    prof_running = false;
+}
+
+void prof_reset(void)
+{
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        prof_cpus[i].count = 0;
+        prof_cpus[i].dropped = 0;
+    }
+}
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+
+struct prof_hist {
+    uintptr_t pc;
+    uint count;
+};
+
+static int prof_cmp_pc(const void *a, const void *b)
+{
+    uintptr_t x = *(const uintptr_t *)a;
+    uintptr_t y = *(const uintptr_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static int prof_cmp_count(const void *a, const void *b)
+{
+    const struct prof_hist *x = a;
+    const struct prof_hist *y = b;
+
+    return (y->count > x->count) - (y->count < x->count);
+}
+
+/* sample pcs, most frequent first. the host turns the addresses into symbols */
+static void prof_dump_hist(uint limit)
+{
+    uint total = 0;
+    uint dropped = 0;
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        total += prof_cpus[i].count;
+        dropped += prof_cpus[i].dropped;
+    }
+
+    printf("%u samples, %u dropped\n", total, dropped);
+    if (total == 0)
+        return;
+
+    uintptr_t *pcs = malloc(total * sizeof(uintptr_t));
+    struct prof_hist *hist = malloc(total * sizeof(struct prof_hist));
+    if (!pcs || !hist) {
+        printf("not enough memory to sort samples\n");
+        goto out;
+    }
+
+    uint n = 0;
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        for (uint j = 0; j < prof_cpus[i].count; j++)
+            pcs[n++] = prof_cpus[i].samples[j * PROF_MAX_DEPTH];
+    }
+    qsort(pcs, n, sizeof(uintptr_t), prof_cmp_pc);
+
+    uint buckets = 0;
+    for (uint i = 0; i < n; i++) {
+        if (buckets == 0 || hist[buckets - 1].pc != pcs[i]) {
+            hist[buckets].pc = pcs[i];
+            hist[buckets].count = 0;
+            buckets++;
+        }
+        hist[buckets - 1].count++;
+    }
+    qsort(hist, buckets, sizeof(struct prof_hist), prof_cmp_count);
+
+    if (limit == 0 || limit > buckets)
+        limit = buckets;
+    for (uint i = 0; i < limit; i++) {
+        uint permille = (uint)((uint64_t)hist[i].count * 1000 / total);
+        printf("%8u %3u.%u%% 0x%lx\n", hist[i].count, permille / 10, permille % 10, hist[i].pc);
+    }
+
+out:
+    free(hist);
+    free(pcs);
+}
+
+/* one line per sample, outermost caller first, in the folded format flame graph tools read */
+static void prof_dump_chains(void)
+{
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        for (uint j = 0; j < prof_cpus[i].count; j++) {
+            const uintptr_t *s = &prof_cpus[i].samples[j * PROF_MAX_DEPTH];
+
+            uint depth = 1;
+            while (depth < PROF_MAX_DEPTH && s[depth])
+                depth++;
+
+            for (int k = depth - 1; k >= 0; k--)
+                printf("0x%lx%s", s[k], k ? ";" : " 1\n");
+        }
+    }
+}
+
+static int cmd_prof(int argc, const cmd_args *argv)
+{
+    if (argc < 2) {
+usage:
+        printf("usage:\n");
+        printf("%s start [hz]\n", argv[0].str);
+        printf("%s stop\n", argv[0].str);
+        printf("%s reset\n", argv[0].str);
+        printf("%s dump [count]\n", argv[0].str);
+        printf("%s chains\n", argv[0].str);
+        return ERR_INVALID_ARGS;
+    }
+
+    if (!strcmp(argv[1].str, "start")) {
+        status_t err = prof_start(argc > 2 ? argv[2].u : PROF_DEFAULT_HZ);
+        if (err < 0) {
+            printf("error %d starting profiler\n", err);
+            return err;
+        }
+        printf("profiling every %u ms\n", prof_period);
+    } else if (!strcmp(argv[1].str, "stop")) {
+        prof_stop();
+    } else if (!strcmp(argv[1].str, "reset")) {
+        prof_reset();
+    } else if (!strcmp(argv[1].str, "dump")) {
+        prof_dump_hist(argc > 2 ? argv[2].u : 0);
+    } else if (!strcmp(argv[1].str, "chains")) {
+        prof_dump_chains();
+    } else {
+        printf("unknown command\n");
+        goto usage;
+    }
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("prof", "sampling profiler", &cmd_prof)
+STATIC_COMMAND_END(prof);
+
+#endif
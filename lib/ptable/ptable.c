@@ -159,6 +159,13 @@ static status_t ptable_write(void)
         BAIL(ERR_IO);
     }
 
+    /* make sure it's on the media before anyone relies on it */
+    err = bio_flush(bdev);
+    if (err < 0) {
+        LTRACEF("error %d flushing device\n", (int)err);
+        BAIL(ERR_IO);
+    }
+
     LTRACEF("wrote ptable:\n");
     if (LOCAL_TRACE)
         hexdump(buf, total_length);
@@ -574,6 +581,7 @@ static status_t ptable_allocate_at(off_t _offset, uint64_t *plength)
 status_t ptable_scan(const char *bdev_name, uint64_t offset)
 {
     ssize_t err;
+    struct ptable_entry *entries = NULL;
     DEBUG_ASSERT(bdev_name);
 
     ptable_reset();
@@ -622,17 +630,22 @@ status_t ptable_scan(const char *bdev_name, uint64_t offset)
     header.crc32 = saved_crc;
     bool found_ptable = false;
 
-    /* read the entries into memory */
-    off_t off = offset + sizeof(struct ptable_header);
-    for (uint i = 0; i < PTABLE_HEADER_NUM_ENTRIES(header); i++) {
-        struct ptable_entry entry;
+    /* read all of the entries in one go, the table fits in a block */
+    size_t entries_len = header.total_length - sizeof(struct ptable_header);
+    entries = malloc(MAX(entries_len, 1u));
+    if (!entries)
+        BAIL(ERR_NO_MEMORY);
 
-        /* read the next entry off the device */
-        err = bio_read(ptable.bdev, &entry, off, sizeof(entry));
-        if (err < 0) {
-            LTRACEF("failed to read entry\n");
-            goto bailout;
-        }
+    err = bio_read(ptable.bdev, entries, offset + sizeof(struct ptable_header), entries_len);
+    if (err < (ssize_t)entries_len) {
+        LTRACEF("failed to read entries\n");
+        if (err >= 0)
+            err = ERR_IO;
+        goto bailout;
+    }
+
+    for (uint i = 0; i < PTABLE_HEADER_NUM_ENTRIES(header); i++) {
+        struct ptable_entry entry = entries[i];
 
         LTRACEF("looking at entry:\n");
         if (LOCAL_TRACE)
@@ -657,9 +670,6 @@ status_t ptable_scan(const char *bdev_name, uint64_t offset)
 
         /* append the crc */
         crc = crc32(crc, (void *)&entry, sizeof(entry));
-
-        /* Move on to the next entry */
-        off += sizeof(struct ptable_entry);
     }
 
     if (header.crc32 != crc) {
@@ -675,6 +685,7 @@ status_t ptable_scan(const char *bdev_name, uint64_t offset)
     err = NO_ERROR;
 
 bailout:
+    free(entries);
     if (err < 0)
         ptable_reset();
 
@@ -886,6 +897,8 @@ usage:
         if (ptable_dev) {
             status_t err;
             err = bio_erase(ptable_dev, 0, ptable_dev->total_size);
+            if (err >= 0)
+                err = bio_flush(ptable_dev);
             if (err < 0) {
                 printf("ptable nuke failed (err %d)\n", err);
             } else {
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <stddef.h>
+
+__BEGIN_CDECLS
+
+/*
+ * Growable caches of fixed size objects.
+ *
+ * Each slab is a page from the page allocator carved up with lib/pool, and
+ * every cpu keeps a small magazine of free objects in front of the slabs so
+ * the common alloc and free don't touch the cache lock. Objects have to fit
+ * at least a handful to a page, bigger ones should come from the heap.
+ *
+ * slab_cache_t *foo_cache = slab_cache_create("foo", sizeof(foo_t), __alignof(foo_t));
+ * foo_t *foo = slab_alloc(foo_cache);
+ * ...
+ * slab_free(foo_cache, foo);
+ */
+typedef struct slab_cache slab_cache_t;
+
+/* returns NULL if out of memory or the object can't be slab allocated */
+slab_cache_t *slab_cache_create(const char *name, size_t object_size, size_t object_align);
+
+/* every object has to have been freed */
+void slab_cache_destroy(slab_cache_t *cache);
+
+void *slab_alloc(slab_cache_t *cache);
+void slab_free(slab_cache_t *cache, void *object);
+
+/* empty the magazines and hand empty slabs back, returns the number of pages freed */
+size_t slab_cache_reclaim(slab_cache_t *cache);
+
+/* slab_cache_reclaim on every cache, for when memory gets tight */
+size_t slab_reclaim(void);
+
+__END_CDECLS
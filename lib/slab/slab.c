@@ -0,0 +1,444 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/slab.h>
+
+#include <assert.h>
+#include <debug.h>
+#include <list.h>
+#include <malloc.h>
+#include <pow2.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <arch/ops.h>
+#include <kernel/mutex.h>
+#include <kernel/spinlock.h>
+#include <lib/page_alloc.h>
+#include <lib/pool.h>
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+#endif
+
+#define LOCAL_TRACE 0
+
+/* free objects each cpu keeps in front of the slabs */
+#ifndef SLAB_MAGAZINE_SIZE
+#define SLAB_MAGAZINE_SIZE 16
+#endif
+
+/* a cache refuses objects that don't fit at least this many to a page */
+#ifndef SLAB_MIN_OBJECTS
+#define SLAB_MIN_OBJECTS 4
+#endif
+
+/* empty slabs a cache holds on to before handing pages back */
+#ifndef SLAB_MAX_EMPTY
+#define SLAB_MAX_EMPTY 1
+#endif
+
+/* sits at the start of every slab page, the objects follow it */
+typedef struct slab {
+    struct list_node node;
+    pool_t pool;
+    uint in_use;
+} slab_t;
+
+struct magazine {
+    spin_lock_t lock;
+    uint count;
+    void *objects[SLAB_MAGAZINE_SIZE];
+} __CPU_ALIGN;
+
+struct slab_cache {
+    struct list_node node;
+    char name[32];
+
+    size_t object_size;
+    size_t object_align;
+    size_t storage_offset;
+    uint objects_per_slab;
+
+    /* protects the slab lists and counts */
+    mutex_t lock;
+    struct list_node partial;
+    struct list_node full;
+    struct list_node empty;
+    uint empty_count;
+    uint slab_count;
+
+    struct magazine magazine[SMP_MAX_CPUS];
+};
+
+static struct list_node cache_list = LIST_INITIAL_VALUE(cache_list);
+static mutex_t cache_list_lock = MUTEX_INITIAL_VALUE(cache_list_lock);
+
+static inline slab_t *slab_of(const void *object)
+{
+    return (slab_t *)ROUNDDOWN((uintptr_t)object, PAGE_SIZE);
+}
+
+static slab_t *slab_create(slab_cache_t *cache)
+{
+    slab_t *slab = page_alloc(1, PAGE_ALLOC_ANY_ARENA);
+    if (!slab)
+        return NULL;
+
+    LTRACEF("cache %s slab %p\n", cache->name, slab);
+
+    list_clear_node(&slab->node);
+    slab->in_use = 0;
+    pool_init(&slab->pool, cache->object_size, cache->object_align, cache->objects_per_slab,
+              (uint8_t *)slab + cache->storage_offset);
+    cache->slab_count++;
+
+    return slab;
+}
+
+static void slab_destroy(slab_cache_t *cache, slab_t *slab)
+{
+    LTRACEF("cache %s slab %p\n", cache->name, slab);
+
+    DEBUG_ASSERT(slab->in_use == 0);
+    page_free(slab, 1);
+    cache->slab_count--;
+}
+
+/* pull up to count objects out of the slabs, called with the cache lock held */
+static uint slab_take(slab_cache_t *cache, void **objects, uint count)
+{
+    uint taken = 0;
+
+    while (taken < count) {
+        slab_t *slab = list_peek_head_type(&cache->partial, slab_t, node);
+        if (!slab) {
+            slab = list_remove_head_type(&cache->empty, slab_t, node);
+            if (slab) {
+                cache->empty_count--;
+            } else {
+                slab = slab_create(cache);
+                if (!slab)
+                    break;
+            }
+            list_add_head(&cache->partial, &slab->node);
+        }
+
+        objects[taken] = pool_alloc(&slab->pool);
+        DEBUG_ASSERT(objects[taken]);
+        taken++;
+
+        if (++slab->in_use == cache->objects_per_slab) {
+            list_delete(&slab->node);
+            list_add_head(&cache->full, &slab->node);
+        }
+    }
+
+    return taken;
+}
+
+/* return objects to their slabs, called with the cache lock held */
+static void slab_put(slab_cache_t *cache, void **objects, uint count)
+{
+    for (uint i = 0; i < count; i++) {
+        slab_t *slab = slab_of(objects[i]);
+
+        DEBUG_ASSERT(slab->in_use > 0);
+        pool_free(&slab->pool, objects[i]);
+
+        if (slab->in_use-- == cache->objects_per_slab) {
+            list_delete(&slab->node);
+            list_add_head(&cache->partial, &slab->node);
+        }
+
+        if (slab->in_use == 0) {
+            list_delete(&slab->node);
+            if (cache->empty_count < SLAB_MAX_EMPTY) {
+                list_add_head(&cache->empty, &slab->node);
+                cache->empty_count++;
+            } else {
+                slab_destroy(cache, slab);
+            }
+        }
+    }
+}
+
+slab_cache_t *slab_cache_create(const char *name, size_t object_size, size_t object_align)
+{
+    DEBUG_ASSERT(object_size > 0);
+
+    if (object_align == 0)
+        object_align = sizeof(void *);
+    DEBUG_ASSERT(ispow2(object_align));
+
+    size_t align = POOL_STORAGE_ALIGN(object_size, object_align);
+    size_t padded = POOL_PADDED_OBJECT_SIZE(object_size, object_align);
+    size_t offset = ROUNDUP(sizeof(slab_t), align);
+
+    if (offset >= PAGE_SIZE || (PAGE_SIZE - offset) / padded < SLAB_MIN_OBJECTS) {
+        LTRACEF("%s: object size %zu align %zu too big for a slab\n", name, object_size, object_align);
+        return NULL;
+    }
+
+    slab_cache_t *cache = memalign(CACHE_LINE, sizeof(*cache));
+    if (!cache)
+        return NULL;
+
+    memset(cache, 0, sizeof(*cache));
+    strlcpy(cache->name, name, sizeof(cache->name));
+    cache->object_size = object_size;
+    cache->object_align = object_align;
+    cache->storage_offset = offset;
+    cache->objects_per_slab = (PAGE_SIZE - offset) / padded;
+
+    mutex_init(&cache->lock);
+    list_initialize(&cache->partial);
+    list_initialize(&cache->full);
+    list_initialize(&cache->empty);
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++)
+        spin_lock_init(&cache->magazine[i].lock);
+
+    LTRACEF("%s: size %zu align %zu, %u per slab\n", name, object_size, object_align,
+            cache->objects_per_slab);
+
+    mutex_acquire(&cache_list_lock);
+    list_add_tail(&cache_list, &cache->node);
+    mutex_release(&cache_list_lock);
+
+    return cache;
+}
+
+void slab_cache_destroy(slab_cache_t *cache)
+{
+    DEBUG_ASSERT(cache);
+
+    mutex_acquire(&cache_list_lock);
+    list_delete(&cache->node);
+    mutex_release(&cache_list_lock);
+
+    slab_cache_reclaim(cache);
+
+    DEBUG_ASSERT(list_is_empty(&cache->partial));
+    DEBUG_ASSERT(list_is_empty(&cache->full));
+    DEBUG_ASSERT(cache->slab_count == 0);
+
+    mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+void *slab_alloc(slab_cache_t *cache)
+{
+    DEBUG_ASSERT(cache);
+
+    spin_lock_saved_state_t state;
+    struct magazine *mag = &cache->magazine[arch_curr_cpu_num()];
+    void *object = NULL;
+
+    spin_lock_irqsave(&mag->lock, state);
+    if (mag->count > 0)
+        object = mag->objects[--mag->count];
+    spin_unlock_irqrestore(&mag->lock, state);
+
+    if (object)
+        return object;
+
+    /* magazine is empty, grab half a magazine worth plus the one we hand out */
+    void *batch[SLAB_MAGAZINE_SIZE / 2 + 1];
+
+    mutex_acquire(&cache->lock);
+    uint count = slab_take(cache, batch, countof(batch));
+    mutex_release(&cache->lock);
+
+    if (count == 0)
+        return NULL;
+
+    object = batch[--count];
+    if (count == 0)
+        return object;
+
+    /* we may have migrated, or someone may have filled it in the meantime */
+    mag = &cache->magazine[arch_curr_cpu_num()];
+    spin_lock_irqsave(&mag->lock, state);
+    uint fit = MIN(count, SLAB_MAGAZINE_SIZE - mag->count);
+    memcpy(&mag->objects[mag->count], batch, fit * sizeof(void *));
+    mag->count += fit;
+    spin_unlock_irqrestore(&mag->lock, state);
+
+    if (fit < count) {
+        mutex_acquire(&cache->lock);
+        slab_put(cache, &batch[fit], count - fit);
+        mutex_release(&cache->lock);
+    }
+
+    return object;
+}
+
+void slab_free(slab_cache_t *cache, void *object)
+{
+    DEBUG_ASSERT(cache);
+
+    if (!object)
+        return;
+
+    DEBUG_ASSERT(IS_ALIGNED(object, cache->object_align));
+    DEBUG_ASSERT((uintptr_t)object - (uintptr_t)slab_of(object) >= cache->storage_offset);
+
+    spin_lock_saved_state_t state;
+    struct magazine *mag = &cache->magazine[arch_curr_cpu_num()];
+    void *batch[SLAB_MAGAZINE_SIZE / 2];
+    uint count = 0;
+
+    spin_lock_irqsave(&mag->lock, state);
+    if (mag->count == SLAB_MAGAZINE_SIZE) {
+        /* full, send the oldest half back to the slabs */
+        count = SLAB_MAGAZINE_SIZE / 2;
+        memcpy(batch, mag->objects, count * sizeof(void *));
+        memmove(mag->objects, &mag->objects[count], (SLAB_MAGAZINE_SIZE - count) * sizeof(void *));
+        mag->count -= count;
+    }
+    mag->objects[mag->count++] = object;
+    spin_unlock_irqrestore(&mag->lock, state);
+
+    if (count > 0) {
+        mutex_acquire(&cache->lock);
+        slab_put(cache, batch, count);
+        mutex_release(&cache->lock);
+    }
+}
+
+size_t slab_cache_reclaim(slab_cache_t *cache)
+{
+    DEBUG_ASSERT(cache);
+
+    /* empty every cpu's magazine back into the slabs */
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        struct magazine *mag = &cache->magazine[i];
+        spin_lock_saved_state_t state;
+        void *batch[SLAB_MAGAZINE_SIZE];
+
+        spin_lock_irqsave(&mag->lock, state);
+        uint count = mag->count;
+        memcpy(batch, mag->objects, count * sizeof(void *));
+        mag->count = 0;
+        spin_unlock_irqrestore(&mag->lock, state);
+
+        if (count > 0) {
+            mutex_acquire(&cache->lock);
+            slab_put(cache, batch, count);
+            mutex_release(&cache->lock);
+        }
+    }
+
+    size_t freed = 0;
+    slab_t *slab;
+
+    mutex_acquire(&cache->lock);
+    while ((slab = list_remove_head_type(&cache->empty, slab_t, node))) {
+        slab_destroy(cache, slab);
+        freed++;
+    }
+    cache->empty_count = 0;
+    mutex_release(&cache->lock);
+
+    LTRACEF("cache %s freed %zu pages\n", cache->name, freed);
+
+    return freed;
+}
+
+size_t slab_reclaim(void)
+{
+    size_t freed = 0;
+    slab_cache_t *cache;
+
+    mutex_acquire(&cache_list_lock);
+    list_for_every_entry(&cache_list, cache, slab_cache_t, node) {
+        freed += slab_cache_reclaim(cache);
+    }
+    mutex_release(&cache_list_lock);
+
+    return freed;
+}
+
+#if LK_DEBUGLEVEL > 1
+#if WITH_LIB_CONSOLE
+
+static void slab_dump(void)
+{
+    slab_cache_t *cache;
+
+    printf("%-24s %8s %8s %8s %8s %8s\n", "name", "size", "perslab", "slabs", "inuse", "cached");
+
+    mutex_acquire(&cache_list_lock);
+    list_for_every_entry(&cache_list, cache, slab_cache_t, node) {
+        uint in_use = 0;
+        uint cached = 0;
+        slab_t *slab;
+
+        mutex_acquire(&cache->lock);
+        list_for_every_entry(&cache->partial, slab, slab_t, node) {
+            in_use += slab->in_use;
+        }
+        in_use += list_length(&cache->full) * cache->objects_per_slab;
+        uint slabs = cache->slab_count;
+        mutex_release(&cache->lock);
+
+        /* objects sitting in the magazines show up as in use in the slabs */
+        for (uint i = 0; i < SMP_MAX_CPUS; i++)
+            cached += cache->magazine[i].count;
+
+        printf("%-24s %8zu %8u %8u %8u %8u\n", cache->name, cache->object_size,
+               cache->objects_per_slab, slabs, in_use - cached, cached);
+    }
+    mutex_release(&cache_list_lock);
+}
+
+static int cmd_slab(int argc, const cmd_args *argv)
+{
+    if (argc < 2) {
+        printf("not enough arguments\n");
+usage:
+        printf("usage:\n");
+        printf("\t%s info\n", argv[0].str);
+        printf("\t%s reclaim\n", argv[0].str);
+        return -1;
+    }
+
+    if (!strcmp(argv[1].str, "info")) {
+        slab_dump();
+    } else if (!strcmp(argv[1].str, "reclaim")) {
+        printf("reclaimed %zu pages\n", slab_reclaim());
+    } else {
+        printf("unrecognized command\n");
+        goto usage;
+    }
+
+    return 0;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("slab", "slab allocator debug commands", &cmd_slab)
+STATIC_COMMAND_END(slab);
+
+#endif
+#endif
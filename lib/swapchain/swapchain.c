@@ -0,0 +1,302 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * @file
+ * @brief  Double and triple buffered presentation on top of the display framebuffer
+ */
+
+#include <lib/swapchain.h>
+
+#include <debug.h>
+#include <assert.h>
+#include <trace.h>
+#include <err.h>
+#include <string.h>
+#include <stdlib.h>
+#include <list.h>
+#include <platform.h>
+#include <kernel/thread.h>
+#include <kernel/mutex.h>
+#include <kernel/event.h>
+#include <kernel/semaphore.h>
+
+#define LOCAL_TRACE 0
+
+enum swapchain_buffer_state {
+    BUFFER_FREE,
+    BUFFER_ACQUIRED,
+    BUFFER_QUEUED,
+};
+
+struct swapchain_buffer {
+    struct display_image image;
+    enum swapchain_buffer_state state;
+};
+
+struct swapchain {
+    struct display_framebuffer fb;
+    size_t len;
+
+    uint count;
+    struct swapchain_buffer buffers[SWAPCHAIN_MAX_BUFFERS];
+
+    mutex_t lock;
+    semaphore_t free_sem;
+
+    /* presented buffers in order */
+    uint queue[SWAPCHAIN_MAX_BUFFERS];
+    uint queue_head;
+    uint queue_tail;
+    event_t queue_event;
+
+    thread_t *thread;
+    bool shutdown;
+
+    lk_time_t frame_interval;
+    lk_time_t last_frame;
+    uint64_t frame_count;
+};
+
+static struct swapchain_buffer *swapchain_dequeue(swapchain_t *sc)
+{
+    struct swapchain_buffer *buf = NULL;
+
+    mutex_acquire(&sc->lock);
+    if (sc->queue_tail != sc->queue_head)
+        buf = &sc->buffers[sc->queue[sc->queue_tail++ % SWAPCHAIN_MAX_BUFFERS]];
+    mutex_release(&sc->lock);
+
+    return buf;
+}
+
+static void swapchain_show(swapchain_t *sc, struct swapchain_buffer *buf)
+{
+    struct display_image *dest = &sc->fb.image;
+
+    /* hold frames to the interval */
+    if (sc->frame_interval) {
+        lk_time_t now = current_time();
+        lk_time_t next = sc->last_frame + sc->frame_interval;
+        if ((long)(next - now) > 0)
+            thread_sleep(next - now);
+    }
+
+    /* don't write the framebuffer while the display is still reading the last frame out of it */
+    if (sc->fb.wait_idle)
+        sc->fb.wait_idle();
+
+    const uint8_t *src = buf->image.pixels;
+    uint8_t *dst = dest->pixels;
+    if (buf->image.rowbytes == dest->rowbytes) {
+        memcpy(dst, src, sc->len);
+    } else {
+        for (uint y = 0; y < dest->height; y++) {
+            memcpy(dst, src, buf->image.rowbytes);
+            src += buf->image.rowbytes;
+            dst += dest->rowbytes;
+        }
+    }
+
+    if (sc->fb.flush)
+        sc->fb.flush(0, dest->height - 1);
+
+    sc->last_frame = current_time();
+    sc->frame_count++;
+}
+
+static int swapchain_thread(void *arg)
+{
+    swapchain_t *sc = (swapchain_t *)arg;
+
+    for (;;) {
+        event_wait(&sc->queue_event);
+
+        struct swapchain_buffer *buf;
+        while ((buf = swapchain_dequeue(sc)) != NULL) {
+            LTRACEF("showing buffer %p\n", buf);
+
+            swapchain_show(sc, buf);
+
+            /* the display has its copy, the buffer can be drawn into again */
+            mutex_acquire(&sc->lock);
+            buf->state = BUFFER_FREE;
+            mutex_release(&sc->lock);
+            sem_post(&sc->free_sem, true);
+        }
+
+        if (sc->shutdown)
+            break;
+    }
+
+    return 0;
+}
+
+status_t swapchain_create(uint buffer_count, lk_time_t frame_interval, swapchain_t **_sc)
+{
+    status_t err;
+
+    LTRACEF("count %u, interval %u\n", buffer_count, frame_interval);
+
+    DEBUG_ASSERT(_sc);
+
+    if (buffer_count < 2 || buffer_count > SWAPCHAIN_MAX_BUFFERS)
+        return ERR_INVALID_ARGS;
+
+    swapchain_t *sc = calloc(1, sizeof(*sc));
+    if (!sc)
+        return ERR_NO_MEMORY;
+
+    err = display_get_framebuffer(&sc->fb);
+    if (err < 0)
+        goto err;
+
+    /* back buffers are packed, whatever the framebuffer's stride */
+    const struct display_image *fbimage = &sc->fb.image;
+    int pixelsize = fbimage->rowbytes / fbimage->stride;
+    int rowbytes = fbimage->width * pixelsize;
+    sc->len = rowbytes * fbimage->height;
+    sc->count = buffer_count;
+
+    for (uint i = 0; i < buffer_count; i++) {
+        struct swapchain_buffer *buf = &sc->buffers[i];
+
+        buf->image = *fbimage;
+        buf->image.stride = fbimage->width;
+        buf->image.rowbytes = rowbytes;
+        buf->image.pixels = malloc(sc->len);
+        if (!buf->image.pixels) {
+            err = ERR_NO_MEMORY;
+            goto err;
+        }
+
+        /* start from what's on screen */
+        for (uint y = 0; y < fbimage->height; y++) {
+            memcpy((uint8_t *)buf->image.pixels + y * rowbytes,
+                   (uint8_t *)fbimage->pixels + y * fbimage->rowbytes, rowbytes);
+        }
+        buf->state = BUFFER_FREE;
+    }
+
+    mutex_init(&sc->lock);
+    sem_init(&sc->free_sem, buffer_count);
+    event_init(&sc->queue_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    sc->frame_interval = frame_interval;
+    sc->last_frame = current_time();
+
+    sc->thread = thread_create("swapchain", &swapchain_thread, sc, HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+    if (!sc->thread) {
+        err = ERR_NO_MEMORY;
+        goto err_thread;
+    }
+    thread_resume(sc->thread);
+
+    *_sc = sc;
+    return NO_ERROR;
+
+err_thread:
+    event_destroy(&sc->queue_event);
+    sem_destroy(&sc->free_sem);
+    mutex_destroy(&sc->lock);
+err:
+    for (uint i = 0; i < SWAPCHAIN_MAX_BUFFERS; i++)
+        free(sc->buffers[i].image.pixels);
+    free(sc);
+    return err;
+}
+
+void swapchain_destroy(swapchain_t *sc)
+{
+    DEBUG_ASSERT(sc);
+
+    /* let the worker finish what's queued and exit */
+    sc->shutdown = true;
+    event_signal(&sc->queue_event, true);
+    thread_join(sc->thread, NULL, INFINITE_TIME);
+
+    event_destroy(&sc->queue_event);
+    sem_destroy(&sc->free_sem);
+    mutex_destroy(&sc->lock);
+    for (uint i = 0; i < sc->count; i++)
+        free(sc->buffers[i].image.pixels);
+    free(sc);
+}
+
+status_t swapchain_acquire(swapchain_t *sc, struct display_image **image, lk_time_t timeout)
+{
+    DEBUG_ASSERT(sc);
+    DEBUG_ASSERT(image);
+
+    status_t err = sem_timedwait(&sc->free_sem, timeout);
+    if (err < 0)
+        return err;
+
+    mutex_acquire(&sc->lock);
+
+    struct swapchain_buffer *buf = NULL;
+    for (uint i = 0; i < sc->count; i++) {
+        if (sc->buffers[i].state == BUFFER_FREE) {
+            buf = &sc->buffers[i];
+            break;
+        }
+    }
+    DEBUG_ASSERT(buf);
+    buf->state = BUFFER_ACQUIRED;
+
+    mutex_release(&sc->lock);
+
+    LTRACEF("acquired buffer %p\n", buf);
+
+    *image = &buf->image;
+    return NO_ERROR;
+}
+
+status_t swapchain_present(swapchain_t *sc, struct display_image *image)
+{
+    DEBUG_ASSERT(sc);
+    DEBUG_ASSERT(image);
+
+    struct swapchain_buffer *buf = containerof(image, struct swapchain_buffer, image);
+    uint index = buf - sc->buffers;
+    if (index >= sc->count)
+        return ERR_INVALID_ARGS;
+
+    mutex_acquire(&sc->lock);
+    if (buf->state != BUFFER_ACQUIRED) {
+        mutex_release(&sc->lock);
+        return ERR_BAD_STATE;
+    }
+    buf->state = BUFFER_QUEUED;
+    sc->queue[sc->queue_head++ % SWAPCHAIN_MAX_BUFFERS] = index;
+    mutex_release(&sc->lock);
+
+    LTRACEF("presented buffer %p\n", buf);
+
+    event_signal(&sc->queue_event, false);
+    return NO_ERROR;
+}
+
+uint64_t swapchain_frame_count(swapchain_t *sc)
+{
+    return sc->frame_count;
+}
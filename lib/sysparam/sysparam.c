@@ -38,9 +38,25 @@
 /* sysparams are simple name/value pairs, with the data unstructured */
 #define LOCAL_TRACE 0
 
+/*
+ * The block holds a sequence of records. sysparam_write appends the params
+ * that changed as SYSPARAM_MAGIC_APPEND records after the last one, where the
+ * block is still erased, and only erases and rewrites the whole block when it
+ * runs out of room. A later record replaces an earlier one with the same name,
+ * and one with SYSPARAM_FLAG_DELETED removes it. Code that predates appending
+ * skips the records it doesn't know and sees the block as of the last rewrite.
+ *
+ * sysparam_scan reads the block once and keeps it, params found there point
+ * into it rather than being copied out, and lookups go through a hash of the
+ * names.
+ */
 #define SYSPARAM_MAGIC 'SYSP'
+#define SYSPARAM_MAGIC_APPEND 'SYSA'
 
-#define SYSPARAM_FLAG_LOCK 0x1
+#define SYSPARAM_FLAG_LOCK    0x1
+#define SYSPARAM_FLAG_DELETED 0x2
+
+#define SYSPARAM_HASH_SIZE 32
 
 struct sysparam_phys {
     uint32_t magic;
@@ -57,30 +73,43 @@ struct sysparam_phys {
     uint8_t namedata[0];
 };
 
-/* a copy we keep in memory */
+/* what we keep in memory, either pointing into the block image or holding its own copy */
 struct sysparam {
     struct list_node node;
+    struct sysparam *hash_next;
 
     uint32_t flags;
+    uint32_t hash;
 
-    char *name;
+    /* the name isn't terminated when it's in the block image */
+    const char *name;
+    size_t namelen;
 
     size_t datalen;
-    void *data;
+    const void *data;
+
+    bool inplace;   /* name and data are in params.image */
+    bool dirty;     /* changed since the block was last written */
 
-    /* in memory size to hold this structure, the name string, and the data */
+    /* in memory size to hold this structure, and the name and data if they're copies */
     size_t memlen;
 };
 
 /* global state */
 static struct {
     struct list_node list;
+    struct sysparam *hash[SYSPARAM_HASH_SIZE];
 
     bool dirty;
 
+    /* the block as it was scanned, trimmed to the end of the last record */
+    uint8_t *image;
+    size_t image_len;
+
     bdev_t *bdev;
     off_t offset;
     size_t len;
+    size_t used;    /* end of the last record in the block, where appends go */
 } params;
 
 static void sysparam_init(uint level)
@@ -95,6 +124,11 @@ static inline bool sysparam_is_locked(const struct sysparam *param)
     return param->flags & SYSPARAM_FLAG_LOCK;
 }
 
+static inline bool sysparam_is_deleted(const struct sysparam *param)
+{
+    return param->flags & SYSPARAM_FLAG_DELETED;
+}
+
 static inline size_t sysparam_len(const struct sysparam_phys *sp)
 {
     size_t len = sizeof(struct sysparam_phys);
@@ -105,6 +139,11 @@ static inline size_t sysparam_len(const struct sysparam_phys *sp)
     return len;
 }
 
+static inline size_t sysparam_phys_len(const struct sysparam *param)
+{
+    return sizeof(struct sysparam_phys) + ROUNDUP(param->namelen, 4) + ROUNDUP(param->datalen, 4);
+}
+
 static inline uint32_t sysparam_crc32(const struct sysparam_phys *sp)
 {
     size_t len = sysparam_len(sp);
@@ -116,55 +155,128 @@ static inline uint32_t sysparam_crc32(const struct sysparam_phys *sp)
     return sum;
 }
 
+static uint32_t sysparam_hash(const char *name, size_t namelen)
+{
+    /* fnv-1a */
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < namelen; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void sysparam_insert(struct sysparam *param)
+{
+    struct sysparam **bucket = &params.hash[param->hash % SYSPARAM_HASH_SIZE];
+
+    param->hash_next = *bucket;
+    *bucket = param;
+    list_add_tail(&params.list, &param->node);
+}
+
+static void sysparam_delete(struct sysparam *param)
+{
+    struct sysparam **p = &params.hash[param->hash % SYSPARAM_HASH_SIZE];
+    while (*p != param)
+        p = &(*p)->hash_next;
+    *p = param->hash_next;
+
+    list_delete(&param->node);
+
+    /* copies are allocated along with the structure */
+    free(param);
+}
+
 static struct sysparam *sysparam_create(const char *name, size_t namelen, const void *data, size_t datalen, uint32_t flags)
 {
-    struct sysparam *param = malloc(sizeof(struct sysparam));
+    /* the structure, the name with a terminator and the data padded to a multiple of 4 */
+    size_t alloclen = ROUNDUP(datalen, 4);
+    size_t memlen = sizeof(struct sysparam) + ROUNDUP(namelen + 1, 4) + alloclen;
+
+    struct sysparam *param = malloc(memlen);
     if (!param)
         return NULL;
 
-    param->flags = flags;
-    param->memlen = sizeof(struct sysparam);
-
-    param->name = malloc(namelen + 1);
-    if (!param->name) {
-        free(param);
-        return NULL;
-    }
-    param->memlen += namelen + 1;
+    char *namecopy = (char *)(param + 1);
+    memcpy(namecopy, name, namelen);
+    namecopy[namelen] = '\0';
 
-    memcpy(param->name, name, namelen);
-    param->name[namelen] = '\0';
+    uint8_t *datacopy = (uint8_t *)namecopy + ROUNDUP(namelen + 1, 4);
+    memcpy(datacopy, data, datalen);
+    memset(datacopy + datalen, 0, alloclen - datalen); /* zero out the trailing space */
 
+    param->flags = flags;
+    param->hash = sysparam_hash(name, namelen);
+    param->name = namecopy;
+    param->namelen = namelen;
     param->datalen = datalen;
-    size_t alloclen = ROUNDUP(datalen, 4); /* allocate a multiple of 4 for padding purposes */
-    param->data = malloc(alloclen);
-    if (!param->data) {
-        free(param->name);
-        free(param);
+    param->data = datacopy;
+    param->inplace = false;
+    param->dirty = false;
+    param->memlen = memlen;
+
+    return param;
+}
+
+/* a param referring to a record in the block image */
+static struct sysparam *sysparam_read_phys(const struct sysparam_phys *sp)
+{
+    struct sysparam *param = malloc(sizeof(struct sysparam));
+    if (!param)
         return NULL;
-    }
-    param->memlen += alloclen;
 
-    memcpy(param->data, data, datalen);
-    memset((char *)param->data + datalen, 0, alloclen - datalen); /* zero out the trailing space */
+    param->flags = sp->flags;
+    param->name = (const char *)sp->namedata;
+    param->namelen = sp->namelen;
+    param->hash = sysparam_hash(param->name, param->namelen);
+    param->datalen = sp->datalen;
+    param->data = sp->namedata + ROUNDUP(sp->namelen, 4);
+    param->inplace = true;
+    param->dirty = false;
+    param->memlen = sizeof(struct sysparam);
 
     return param;
 }
 
-static struct sysparam *sysparam_read_phys(const struct sysparam_phys *sp)
+/* finds deleted params too, callers that care check */
+static struct sysparam *sysparam_find_any(const char *name, size_t namelen)
 {
-    return sysparam_create((const char *)sp->namedata, sp->namelen, sp->namedata + ROUNDUP(sp->namelen, 4), sp->datalen, sp->flags);
+    uint32_t hash = sysparam_hash(name, namelen);
+
+    for (struct sysparam *param = params.hash[hash % SYSPARAM_HASH_SIZE]; param;
+            param = param->hash_next) {
+        if (param->hash == hash && param->namelen == namelen &&
+                memcmp(name, param->name, namelen) == 0)
+            return param;
+    }
+
+    return NULL;
 }
 
 static struct sysparam *sysparam_find(const char *name)
+{
+    struct sysparam *param = sysparam_find_any(name, strlen(name));
+
+    if (param && sysparam_is_deleted(param))
+        return NULL;
+
+    return param;
+}
+
+static void sysparam_free_all(void)
 {
     struct sysparam *param;
-    list_for_every_entry(&params.list, param, struct sysparam, node) {
-        if (strcmp(name, param->name) == 0)
-            return param;
+    struct sysparam *temp;
+    list_for_every_entry_safe(&params.list, param, temp, struct sysparam, node) {
+        list_delete(&param->node);
+        free(param);
     }
+    memset(params.hash, 0, sizeof(params.hash));
 
-    return NULL;
+    free(params.image);
+    params.image = NULL;
+    params.image_len = 0;
 }
 
 status_t sysparam_scan(bdev_t *bdev, off_t offset, size_t len)
@@ -178,9 +290,12 @@ status_t sysparam_scan(bdev_t *bdev, off_t offset, size_t len)
     DEBUG_ASSERT(offset + len <= bdev->total_size);
     DEBUG_ASSERT((offset % bdev->block_size) == 0);
 
+    sysparam_free_all();
+
     params.bdev = bdev;
     params.offset = offset;
     params.len = len;
+    params.used = 0;
     params.dirty = false;
 
     /* allocate a len sized block */
@@ -191,9 +306,10 @@ status_t sysparam_scan(bdev_t *bdev, off_t offset, size_t len)
     /* read in the sector at the scan offset */
     err = bio_read(bdev, buf, offset, len);
     if (err < (ssize_t)len) {
-        err = ERR_IO;
-        goto err;
+        free(buf);
+        return ERR_IO;
     }
+    err = NO_ERROR;
 
     LTRACEF("looking for sysparams in block:\n");
     if (LOCAL_TRACE)
@@ -204,7 +320,7 @@ status_t sysparam_scan(bdev_t *bdev, off_t offset, size_t len)
         struct sysparam_phys *sp = (struct sysparam_phys *)(buf + pos);
 
         /* examine the sysparam entry, making sure it's valid */
-        if (sp->magic != SYSPARAM_MAGIC) {
+        if (sp->magic != SYSPARAM_MAGIC && sp->magic != SYSPARAM_MAGIC_APPEND) {
             pos += 4; /* try searching in the next spot */
             //LTRACEF("failed magic check\n");
             continue;
@@ -212,7 +328,7 @@ status_t sysparam_scan(bdev_t *bdev, off_t offset, size_t len)
 
         /* looks valid, see if length is sane */
         size_t splen = sysparam_len(sp);
-        if (pos + splen > offset + len) {
+        if (pos + splen > len) {
             /* length exceeds the size of the area */
             LTRACEF("param at 0x%x: bad length\n", pos);
             break;
@@ -230,6 +346,14 @@ status_t sysparam_scan(bdev_t *bdev, off_t offset, size_t len)
         }
 
         LTRACEF("got param at offset 0x%zx\n", pos - splen);
+        params.used = pos;
+
+        /* a later record for the same name replaces the earlier one */
+        struct sysparam *old = sysparam_find_any((const char *)sp->namedata, sp->namelen);
+        if (old)
+            sysparam_delete(old);
+        if (sp->flags & SYSPARAM_FLAG_DELETED)
+            continue;
 
         struct sysparam *param = sysparam_read_phys(sp);
         if (!param) {
@@ -238,12 +362,24 @@ status_t sysparam_scan(bdev_t *bdev, off_t offset, size_t len)
             break;
         }
 
-        list_add_tail(&params.list, &param->node);
+        sysparam_insert(param);
     }
 
-
-err:
-    free(buf);
+    /* keep the image, minus the erased space past the last record */
+    params.image = buf;
+    params.image_len = params.used;
+    if (params.used < len) {
+        uint8_t *shrunk = realloc(buf, MAX(params.used, 1u));
+        if (shrunk && shrunk != buf) {
+            struct sysparam *param;
+            list_for_every_entry(&params.list, param, struct sysparam, node) {
+                param->name = (const char *)shrunk + ((uintptr_t)param->name - (uintptr_t)buf);
+                param->data = shrunk + ((uintptr_t)param->data - (uintptr_t)buf);
+            }
+        }
+        if (shrunk)
+            params.image = shrunk;
+    }
 
     LTRACE_EXIT;
     return err;
@@ -257,15 +393,7 @@ status_t sysparam_reload(void)
         return ERR_INVALID_ARGS;
 
     /* wipe out the existing memory entries */
-    struct sysparam *param;
-    struct sysparam *temp;
-    list_for_every_entry_safe(&params.list, param, temp, struct sysparam, node) {
-        list_delete(&param->node);
-
-        free(param->name);
-        free(param->data);
-        free(param);
-    }
+    sysparam_free_all();
 
     /* reset the list back to scratch */
     params.dirty = false;
@@ -318,35 +446,121 @@ status_t sysparam_get_ptr(const char *name, const void **ptr, size_t *len)
 
 #if SYSPARAM_ALLOW_WRITE
 
-/* write all of the parameters in memory to the space reserved in flash */
-status_t sysparam_write(void)
+/* lay out a record for param at buf, returning its length */
+static size_t sysparam_serialize(const struct sysparam *param, uint32_t magic, uint8_t *buf)
 {
-    if (params.bdev == NULL)
-        return ERR_INVALID_ARGS;
-    if (params.len == 0)
-        return ERR_INVALID_ARGS;
+    struct sysparam_phys phys;
+    size_t namelen = ROUNDUP(param->namelen, 4);
+    size_t datalen = ROUNDUP(param->datalen, 4);
+
+    /* start filling out a struct */
+    phys.magic = magic;
+    phys.crc32 = 0;
+    phys.flags = param->flags;
+    phys.namelen = param->namelen;
+    phys.datalen = param->datalen;
+
+    /* name and data, with the padding zeroed */
+    uint8_t *namedata = buf + sizeof(struct sysparam_phys);
+    memset(namedata, 0, namelen + datalen);
+    memcpy(namedata, param->name, param->namelen);
+    memcpy(namedata + namelen, param->data, param->datalen);
+
+    /* calculate the crc of the entire thing + padding */
+    uint32_t sum = crc32(0, (const void *)&phys.flags, 8);
+    sum = crc32(sum, namedata, namelen + datalen);
+    phys.crc32 = sum;
+
+    /* structure portion */
+    memcpy(buf, &phys, sizeof(struct sysparam_phys));
+
+    return sizeof(struct sysparam_phys) + namelen + datalen;
+}
 
-    if (!params.dirty)
+/* mark everything as written, dropping the deletions that have been recorded */
+static void sysparam_written(void)
+{
+    struct sysparam *param;
+    struct sysparam *temp;
+    list_for_every_entry_safe(&params.list, param, temp, struct sysparam, node) {
+        param->dirty = false;
+        if (sysparam_is_deleted(param))
+            sysparam_delete(param);
+    }
+
+    params.dirty = false;
+}
+
+/* try to append the changed params after the last record, where the block is still erased */
+static status_t sysparam_append(void)
+{
+    struct sysparam *param;
+    size_t total_len = 0;
+    list_for_every_entry(&params.list, param, struct sysparam, node) {
+        if (param->dirty)
+            total_len += sysparam_phys_len(param);
+    }
+
+    if (total_len == 0)
         return NO_ERROR;
+    if (params.used + total_len > params.len)
+        return ERR_NO_MEMORY;
+
+    uint8_t *buf = malloc(total_len);
+    if (!buf)
+        return ERR_NO_MEMORY;
+
+    /* make sure the space is still erased */
+    status_t err = NO_ERROR;
+    if (bio_read(params.bdev, buf, params.offset + params.used, total_len) != (ssize_t)total_len) {
+        err = ERR_IO;
+        goto done;
+    }
+    for (size_t i = 0; i < total_len; i++) {
+        if (buf[i] != params.bdev->erase_byte) {
+            err = ERR_NOT_READY;
+            goto done;
+        }
+    }
+
+    size_t pos = 0;
+    list_for_every_entry(&params.list, param, struct sysparam, node) {
+        if (param->dirty)
+            pos += sysparam_serialize(param, SYSPARAM_MAGIC_APPEND, buf + pos);
+    }
 
+    if (bio_write(params.bdev, buf, params.offset + params.used, total_len) != (ssize_t)total_len) {
+        err = ERR_IO;
+        goto done;
+    }
+    params.used += total_len;
+
+done:
+    free(buf);
+    return err;
+}
+
+/* erase the block and write all of the parameters in memory to it */
+static status_t sysparam_rewrite(void)
+{
     /* preflight the length, make sure we have enough space */
     struct sysparam *param;
     off_t total_len = 0;
     list_for_every_entry(&params.list, param, struct sysparam, node) {
-        total_len += sizeof(struct sysparam_phys);
-        total_len += ROUNDUP(strlen(param->name), 4);
-        total_len += ROUNDUP(param->datalen, 4);
+        if (!sysparam_is_deleted(param))
+            total_len += sysparam_phys_len(param);
     }
 
     if (total_len > params.len)
         return ERR_NO_MEMORY;
 
     /* allocate a buffer to stage it */
-    uint8_t *buf = calloc(1, params.len);
+    uint8_t *buf = malloc(params.len);
     if (!buf) {
         TRACEF("error allocating buffer to stage write\n");
         return ERR_NO_MEMORY;
     }
+    memset(buf, params.bdev->erase_byte, params.len);
 
     /* erase the block device area this covers */
     ssize_t err = bio_erase(params.bdev, params.offset, params.len);
@@ -357,41 +571,10 @@ status_t sysparam_write(void)
     }
 
     /* serialize all of the parameters */
-    off_t pos = 0;
+    size_t pos = 0;
     list_for_every_entry(&params.list, param, struct sysparam, node) {
-        struct sysparam_phys phys;
-
-        /* start filling out a struct */
-        phys.magic = SYSPARAM_MAGIC;
-        phys.crc32 = 0;
-        phys.flags = param->flags;
-        phys.namelen = strlen(param->name);
-        phys.datalen = param->datalen;
-
-        /* calculate the crc of the entire thing + padding */
-        uint32_t zero = 0;
-        uint32_t sum = crc32(0, (const void *)&phys.flags, 8);
-        sum = crc32(sum, (const void *)param->name, strlen(param->name));
-        if (strlen(param->name) % 4)
-            sum = crc32(sum, (const void *)&zero, 4 - (strlen(param->name) % 4));
-        sum = crc32(sum, (const void *)param->data, ROUNDUP(param->datalen, 4));
-        phys.crc32 = sum;
-
-        /* structure portion */
-        memcpy(buf + pos, &phys, sizeof(struct sysparam_phys));
-        pos += sizeof(struct sysparam_phys);
-
-        /* name portion */
-        memcpy(buf + pos, param->name, strlen(param->name));
-        pos += ROUNDUP(strlen(param->name), 2);
-        if (pos % 4) {
-            /* write 2 zeros to realign */
-            pos += 2;
-        }
-
-        /* data portion */
-        memcpy(buf + pos, param->data, param->datalen);
-        pos += ROUNDUP(param->datalen, 4);
+        if (!sysparam_is_deleted(param))
+            pos += sysparam_serialize(param, SYSPARAM_MAGIC, buf + pos);
     }
 
     /* write the block out */
@@ -399,7 +582,31 @@ status_t sysparam_write(void)
 
     free(buf);
 
-    params.dirty = false;
+    params.used = pos;
+
+    return NO_ERROR;
+}
+
+/* write the parameters in memory to the space reserved in flash */
+status_t sysparam_write(void)
+{
+    if (params.bdev == NULL)
+        return ERR_INVALID_ARGS;
+    if (params.len == 0)
+        return ERR_INVALID_ARGS;
+
+    if (!params.dirty)
+        return NO_ERROR;
+
+    status_t err = sysparam_append();
+    if (err < 0) {
+        LTRACEF("append failed (%d), rewriting the block\n", err);
+        err = sysparam_rewrite();
+        if (err < 0)
+            return err;
+    }
+
+    sysparam_written();
 
     return NO_ERROR;
 }
@@ -408,15 +615,20 @@ status_t sysparam_add(const char *name, const void *value, size_t len)
 {
     struct sysparam *param;
 
-    param = sysparam_find(name);
-    if (param)
+    param = sysparam_find_any(name, strlen(name));
+    if (param && !sysparam_is_deleted(param))
         return ERR_ALREADY_EXISTS;
 
-    param = sysparam_create(name, strlen(name), value, len, 0);
-    if (!param)
+    struct sysparam *new_param = sysparam_create(name, strlen(name), value, len, 0);
+    if (!new_param)
         return ERR_NO_MEMORY;
 
-    list_add_tail(&params.list, &param->node);
+    /* takes the place of a deletion that hasn't been written yet */
+    if (param)
+        sysparam_delete(param);
+
+    new_param->dirty = true;
+    sysparam_insert(new_param);
 
     params.dirty = true;
 
@@ -434,11 +646,16 @@ status_t sysparam_remove(const char *name)
     if (sysparam_is_locked(param))
         return ERR_NOT_ALLOWED;
 
-    list_delete(&param->node);
+    /* replace it with a deletion record, so an append can supersede what's on flash */
+    struct sysparam *deleted = sysparam_create(param->name, param->namelen, "", 0,
+                                               SYSPARAM_FLAG_DELETED);
+    if (!deleted)
+        return ERR_NO_MEMORY;
 
-    free(param->name);
-    free(param->data);
-    free(param);
+    sysparam_delete(param);
+
+    deleted->dirty = true;
+    sysparam_insert(deleted);
 
     params.dirty = true;
 
@@ -456,6 +673,7 @@ status_t sysparam_lock(const char *name)
     /* set the lock bit if it isn't already */
     if (!sysparam_is_locked(param)) {
         param->flags |= SYSPARAM_FLAG_LOCK;
+        param->dirty = true;
         params.dirty = true;
     }
 
@@ -474,9 +692,13 @@ void sysparam_dump(bool show_all)
 
     struct sysparam *param;
     list_for_every_entry(&params.list, param, struct sysparam, node) {
-        printf("________%c %-16s : ",
+        if (sysparam_is_deleted(param))
+            continue;
+
+        printf("________%c%c %-16.*s : ",
                (param->flags & SYSPARAM_FLAG_LOCK) ? 'L' : '_',
-               param->name);
+               param->dirty ? 'D' : '_',
+               (int)param->namelen, param->name);
 
         const uint8_t *dat = (const uint8_t *)param->data;
         uint32_t pr_len = param->datalen;
@@ -497,7 +719,9 @@ void sysparam_dump(bool show_all)
         total_memlen += param->memlen;
     }
 
-    printf("total in-memory usage: %zu bytes\n", total_memlen);
+    printf("total in-memory usage: %zu bytes, plus %zu byte block image\n", total_memlen,
+           params.image_len);
+    printf("%zu of %zu bytes of the block used\n", params.used, params.len);
 }
 
 #if WITH_LIB_CONSOLE
@@ -563,7 +787,8 @@ usage:
     } else if (!strcmp(argv[1].str, "list")) {
         struct sysparam *param;
         list_for_every_entry(&params.list, param, struct sysparam, node) {
-            printf("%s\n", param->name);
+            if (!sysparam_is_deleted(param))
+                printf("%.*s\n", (int)param->namelen, param->name);
         }
     } else if (!strcmp(argv[1].str, "reload")) {
         err = sysparam_reload();
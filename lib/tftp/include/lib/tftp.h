@@ -24,13 +24,29 @@
 #pragma once
 
 #include <compiler.h>
+#include <sys/types.h>
 
 __BEGIN_CDECLS
 
+struct bdev;
+
+// Called with each block of a transfer, then with a NULL |data| and the
+// total length received once it is over, or 0 if it was aborted.
 typedef int (*tftp_callback_t)(void *data, size_t len, void *arg);
 
 int tftp_server_init(void *arg);
 
+// Registers, or if already registered removes, a client for writes to
+// |file_name|. Blocks of up to 1468 bytes are accepted, and up to 64 of
+// them in flight, if the sender asks for blksize and windowsize options.
 int tftp_set_write_client(const char *file_name, tftp_callback_t cb, void *arg);
 
+// Same, but the data is stored directly at |buf| or from |offset| into |dev|,
+// up to the end of either, and |done| (which may be NULL) is only called at the
+// end of the transfer. Registering again replaces the previous destination.
+int tftp_set_write_memory(const char *file_name, void *buf, size_t len,
+                          tftp_callback_t done, void *arg);
+int tftp_set_write_bdev(const char *file_name, struct bdev *dev, off_t offset,
+                        tftp_callback_t done, void *arg);
+
 __END_CDECLS
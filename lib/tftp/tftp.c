@@ -30,6 +30,8 @@
 #include <compiler.h>
 #include <endian.h>
 #include <stdbool.h>
+#include <ctype.h>
+#include <lib/bio.h>
 #include <lib/minip.h>
 #include <platform.h>
 
@@ -43,6 +45,7 @@
 #define TFTP_OPCODE_DATA  3UL
 #define TFTP_OPCODE_ACK   4UL
 #define TFTP_OPCODE_ERROR 5UL
+#define TFTP_OPCODE_OACK  6UL
 
 // TFTP Errors:
 #define TFTP_ERROR_UNDEF        0UL
@@ -56,11 +59,28 @@
 
 #define TFTP_PORT 69
 
+// Block size without options, and the largest we agree to (RFC 2348), which
+// keeps a data packet in one ethernet frame since minip doesn't reassemble.
+#define TFTP_DEFAULT_BLKSIZE 512
+#define TFTP_MAX_BLKSIZE     1468
+
+// Blocks the sender may have in flight before waiting for an ack (RFC 7440).
+#define TFTP_MAX_WINDOWSIZE  64
+
+// Received data bound for a block device is written this many bytes at a time.
+#define TFTP_BDEV_CHUNK      (64 * 1024)
+
 #define RD_U16(ptr) \
     (uint16_t)(((uint16_t)*((uint8_t*)(ptr)+1)<<8)|(uint16_t)*(uint8_t*)(ptr))
 
 static struct list_node tftp_list = LIST_INITIAL_VALUE(tftp_list);
 
+typedef enum {
+    TFTP_SINK_CALLBACK,
+    TFTP_SINK_MEMORY,
+    TFTP_SINK_BDEV,
+} tftp_sink_t;
+
 // Represents tftp jobs and clients of them. If |socket| is not null the
 // job is in progress and members below it are valid.
 typedef struct {
@@ -69,12 +89,30 @@ typedef struct {
     const char *file_name;
     tftp_callback_t callback;
     void *arg;
+    tftp_sink_t sink;
+    union {
+        struct {
+            uint8_t *buf;
+            size_t len;
+        } mem;
+        struct {
+            bdev_t *dev;
+            off_t offset;
+            uint8_t *chunk;
+            size_t chunk_len;
+        } bdev;
+    };
     // Current job info.
     udp_socket_t *socket;
     uint32_t src_addr;
     uint16_t src_port;
     uint16_t listen_port;
-    uint16_t pkt_count;
+    uint16_t block;        // last block received in order
+    uint16_t blksize;
+    uint16_t windowsize;
+    uint16_t window_count; // blocks received since the last ack
+    bool resync;           // acked out of order, waiting for the next block in order
+    size_t total;
 } tftp_job_t;
 
 uint16_t next_port = 2224;
@@ -110,20 +148,77 @@ static void end_transfer(tftp_job_t *job, bool do_callback)
     udp_close(job->socket);
     job->socket = NULL;
     job->src_addr = 0UL;
-    if (do_callback) {
-        job->callback(NULL, 0UL, job->arg);
+    if (job->sink == TFTP_SINK_BDEV) {
+        free(job->bdev.chunk);
+        job->bdev.chunk = NULL;
     }
+    if (do_callback && job->callback) {
+        job->callback(NULL, job->total, job->arg);
+    }
+}
+
+static void abort_transfer(tftp_job_t *job, uint16_t code)
+{
+    send_error(job->socket, code);
+    job->total = 0;
+    end_transfer(job, true);
+}
+
+static int flush_bdev_chunk(tftp_job_t *job)
+{
+    if (job->bdev.chunk_len == 0)
+        return 0;
+
+    off_t offset = job->bdev.offset + job->total - job->bdev.chunk_len;
+    ssize_t written = bio_write(job->bdev.dev, job->bdev.chunk, offset, job->bdev.chunk_len);
+    if (written != (ssize_t)job->bdev.chunk_len) {
+        LTRACEF("bio_write at %lld failed: %ld\n", offset, written);
+        return -1;
+    }
+    job->bdev.chunk_len = 0;
+    return 0;
+}
+
+// Puts a block where the client asked for it to go.
+static int store_block(tftp_job_t *job, void *data, size_t len)
+{
+    switch (job->sink) {
+        case TFTP_SINK_CALLBACK:
+            if (job->callback(data, len, job->arg) < 0)
+                return -1;
+            break;
+        case TFTP_SINK_MEMORY:
+            if (len > job->mem.len - job->total)
+                return -1;
+            memcpy(job->mem.buf + job->total, data, len);
+            break;
+        case TFTP_SINK_BDEV:
+            if (job->bdev.offset + job->total + len > job->bdev.dev->total_size)
+                return -1;
+            while (len > 0) {
+                size_t n = MIN(len, TFTP_BDEV_CHUNK - job->bdev.chunk_len);
+                memcpy(job->bdev.chunk + job->bdev.chunk_len, data, n);
+                job->bdev.chunk_len += n;
+                job->total += n;
+                data = (uint8_t *)data + n;
+                len -= n;
+                if (job->bdev.chunk_len == TFTP_BDEV_CHUNK && flush_bdev_chunk(job) < 0)
+                    return -1;
+            }
+            return 0;
+    }
+    job->total += len;
+    return 0;
 }
 
 static void udp_wrq_callback(void *data, size_t len,
                              uint32_t srcaddr, uint16_t srcport,
                              void *arg)
 {
-    // Packet is [3][count][data]. All packets but the last have 512
+    // Packet is [3][block][data]. All packets but the last have blksize
     // bytes of data, including zero data.
     char *data_c = data;
     tftp_job_t *job = arg;
-    job->pkt_count++;
 
     if (len < 4) {
         // Not to spec. Ignore.
@@ -138,33 +233,111 @@ static void udp_wrq_callback(void *data, size_t len,
 
     if ((srcaddr != job->src_addr) || (srcport != job->src_port)) {
         LTRACEF("invalid source\n");
-        send_error(job->socket, TFTP_ERROR_UNKNOWN_XFER);
-        end_transfer(job, true);
+        abort_transfer(job, TFTP_ERROR_UNKNOWN_XFER);
         return;
     }
 
     if (RD_U16(data_c) != htons(TFTP_OPCODE_DATA)) {
         LTRACEF("invalid opcode\n");
-        send_error(job->socket, TFTP_ERROR_ILLEGAL_OP);
-        end_transfer(job, true);
+        abort_transfer(job, TFTP_ERROR_ILLEGAL_OP);
         return;
     }
 
-    send_ack(job->socket, job->pkt_count);
+    uint16_t block = ntohs(RD_U16(&data_c[2]));
+    size_t data_len = len - 4;
+
+    if (block != (uint16_t)(job->block + 1)) {
+        // A duplicate, or one went missing. Ack the last block we have in
+        // order, once, so the sender goes again from right after it.
+        if (!job->resync) {
+            LTRACEF("block %u out of order, expected %u\n", block, (uint16_t)(job->block + 1));
+            send_ack(job->socket, job->block);
+            job->resync = true;
+            job->window_count = 0;
+        }
+        return;
+    }
 
-    if (job->callback(&data_c[4], len - 4, job->arg) < 0) {
-        // The client wants to abort.
-        send_error(job->socket, TFTP_ERROR_FULL);
-        end_transfer(job, true);
+    if (data_len > job->blksize) {
+        LTRACEF("block of %zu bytes\n", data_len);
+        abort_transfer(job, TFTP_ERROR_ILLEGAL_OP);
+        return;
     }
 
-    // 512 bytes payload plus 4 of fixed header. The last packet.
-    // has always less than 512 bytes of payload.
-    if (len != 516) {
+    job->block = block;
+    job->resync = false;
+
+    if (store_block(job, &data_c[4], data_len) < 0) {
+        // The client wants to abort, or there's no more room.
+        abort_transfer(job, TFTP_ERROR_FULL);
+        return;
+    }
+
+    // The last packet always has less than blksize bytes of payload.
+    bool last = data_len < job->blksize;
+    if (last && job->sink == TFTP_SINK_BDEV && flush_bdev_chunk(job) < 0) {
+        abort_transfer(job, TFTP_ERROR_FULL);
+        return;
+    }
+
+    // Only the last block of a window, or of the file, gets an ack.
+    if (last || ++job->window_count == job->windowsize) {
+        send_ack(job->socket, block);
+        job->window_count = 0;
+    }
+
+    if (last) {
         end_transfer(job, true);
     }
 }
 
+static void send_oack(udp_socket_t *socket, uint16_t blksize, uint16_t windowsize)
+{
+    // Packet is [6] followed by [option][0][value][0] for each one taken.
+    status_t st;
+    char oack[2 + sizeof("blksize") + 6 + sizeof("windowsize") + 6];
+    size_t len = 2;
+
+    oack[0] = 0;
+    oack[1] = TFTP_OPCODE_OACK;
+    if (blksize) {
+        len += snprintf(&oack[len], sizeof(oack) - len, "blksize%c%u", 0, blksize) + 1;
+    }
+    if (windowsize) {
+        len += snprintf(&oack[len], sizeof(oack) - len, "windowsize%c%u", 0, windowsize) + 1;
+    }
+    st = udp_send(oack, len, socket);
+    if (st < 0) {
+        LTRACEF("send_oack failed: %d\n", st);
+    }
+}
+
+// Splits a run of null terminated strings, returning how many were found
+// before the buffer or |max| ran out. An unterminated last one is dropped.
+static uint parse_strings(char *buf, size_t len, const char **strs, uint max)
+{
+    uint count = 0;
+    while (len > 0 && count < max) {
+        size_t n = strnlen(buf, len);
+        if (n == len)
+            break;
+        strs[count++] = buf;
+        buf += n + 1;
+        len -= n + 1;
+    }
+    return count;
+}
+
+// Option names are case insensitive.
+static bool option_is(const char *opt, const char *name)
+{
+    while (*opt && tolower(*opt) == *name) {
+        opt++;
+        name++;
+    }
+    return *opt == 0 && *name == 0;
+}
+
 static tftp_job_t *get_job_by_name(const char *file_name)
 {
     DEBUG_ASSERT(file_name);
@@ -192,7 +365,7 @@ static void udp_svc_callback(void *data, size_t len,
         return;
     }
 
-    opcode = ntohs(RD_U16(data));
+    opcode = (len >= 2) ? ntohs(RD_U16(data)) : 0;
 
     if (opcode != TFTP_OPCODE_WRQ) {
         // Operation not supported.
@@ -202,9 +375,19 @@ static void udp_svc_callback(void *data, size_t len,
         return;
     }
 
-    // Look for a client that can hadle the file. TODO: |data|
-    // needs to be null terminated. A malicious client can crash us.
-    job = get_job_by_name(((char *)data) + 2);
+    // Request is [2][file name][0][mode][0] and then any options as
+    // [name][0][value][0] pairs.
+    const char *strs[2 + 2 * 2];
+    uint str_count = parse_strings((char *)data + 2, len - 2, strs, countof(strs));
+    if (str_count < 2) {
+        LTRACEF("malformed request\n");
+        send_error(socket, TFTP_ERROR_ILLEGAL_OP);
+        udp_close(socket);
+        return;
+    }
+
+    // Look for a client that can hadle the file.
+    job = get_job_by_name(strs[0]);
 
     if (!job) {
         // Nobody claims to handle that file.
@@ -228,27 +411,62 @@ static void udp_svc_callback(void *data, size_t len,
     // Request accepted. The rest of the transfer happens between
     // next_port <----> srcport via udp_wrq_callback().
 
+    if (job->sink == TFTP_SINK_BDEV) {
+        job->bdev.chunk = malloc(TFTP_BDEV_CHUNK);
+        if (!job->bdev.chunk) {
+            send_error(socket, TFTP_ERROR_FULL);
+            udp_close(socket);
+            return;
+        }
+        job->bdev.chunk_len = 0;
+    }
+
     job->socket = socket;
     job->src_addr = srcaddr;
     job->src_port = srcport;
-    job->pkt_count = 0UL;
+    job->block = 0;
+    job->blksize = TFTP_DEFAULT_BLKSIZE;
+    job->windowsize = 1;
+    job->window_count = 0;
+    job->resync = false;
+    job->total = 0;
     job->listen_port = next_port;
 
+    // Take up the options we know, within our limits. The sender learns
+    // what we agreed to from the oack, and the absence of any others.
+    bool blksize_set = false;
+    bool windowsize_set = false;
+    for (uint i = 2; i + 1 < str_count; i += 2) {
+        unsigned long val = strtoul(strs[i + 1], NULL, 10);
+        if (option_is(strs[i], "blksize") && val >= 8) {
+            job->blksize = MIN(val, TFTP_MAX_BLKSIZE);
+            blksize_set = true;
+        } else if (option_is(strs[i], "windowsize") && val >= 1) {
+            job->windowsize = MIN(val, TFTP_MAX_WINDOWSIZE);
+            windowsize_set = true;
+        }
+    }
+
     st = udp_listen(job->listen_port, &udp_wrq_callback, job);
     if (st < 0) {
         LTRACEF("error listening on port\n");
         return;
     }
 
-    send_ack(socket, 0UL);
+    LTRACEF("blksize %u windowsize %u\n", job->blksize, job->windowsize);
+
+    if (blksize_set || windowsize_set) {
+        send_oack(socket, blksize_set ? job->blksize : 0, windowsize_set ? job->windowsize : 0);
+    } else {
+        send_ack(socket, 0UL);
+    }
     next_port++;
 }
 
-int tftp_set_write_client(const char *file_name, tftp_callback_t cb, void *arg)
+// Drops the registration for |file_name|, silently cancelling any
+// transfer in progress. Returns true if there was one.
+static bool remove_job(const char *file_name)
 {
-    DEBUG_ASSERT(file_name);
-    DEBUG_ASSERT(cb);
-
     tftp_job_t *job;
 
     list_for_every_entry(&tftp_list, job, tftp_job_t, list) {
@@ -258,20 +476,75 @@ int tftp_set_write_client(const char *file_name, tftp_callback_t cb, void *arg)
                 // There is a job in progress. It will be cancelled silently.
                 end_transfer(job, false);
             }
-            return 0;
+            free(job);
+            return true;
         }
     }
+    return false;
+}
+
+static tftp_job_t *add_job(const char *file_name, tftp_sink_t sink,
+                           tftp_callback_t cb, void *arg)
+{
+    tftp_job_t *job;
 
     if ((job = malloc(sizeof(tftp_job_t))) == NULL) {
-        return -1;
+        return NULL;
     }
 
     memset(job, 0, sizeof(tftp_job_t));
     job->file_name = file_name;
+    job->sink = sink;
     job->callback = cb;
     job->arg = arg;
 
     list_add_tail(&tftp_list, &job->list);
+    return job;
+}
+
+int tftp_set_write_client(const char *file_name, tftp_callback_t cb, void *arg)
+{
+    DEBUG_ASSERT(file_name);
+    DEBUG_ASSERT(cb);
+
+    if (remove_job(file_name)) {
+        return 0;
+    }
+
+    return add_job(file_name, TFTP_SINK_CALLBACK, cb, arg) ? 0 : -1;
+}
+
+int tftp_set_write_memory(const char *file_name, void *buf, size_t len,
+                          tftp_callback_t done, void *arg)
+{
+    DEBUG_ASSERT(file_name);
+    DEBUG_ASSERT(buf);
+
+    remove_job(file_name);
+
+    tftp_job_t *job = add_job(file_name, TFTP_SINK_MEMORY, done, arg);
+    if (!job) {
+        return -1;
+    }
+    job->mem.buf = buf;
+    job->mem.len = len;
+    return 0;
+}
+
+int tftp_set_write_bdev(const char *file_name, bdev_t *dev, off_t offset,
+                        tftp_callback_t done, void *arg)
+{
+    DEBUG_ASSERT(file_name);
+    DEBUG_ASSERT(dev);
+
+    remove_job(file_name);
+
+    tftp_job_t *job = add_job(file_name, TFTP_SINK_BDEV, done, arg);
+    if (!job) {
+        return -1;
+    }
+    job->bdev.dev = dev;
+    job->bdev.offset = offset;
     return 0;
 }
 
@@ -28,5 +28,17 @@
 
 gfx_surface *tga_decode(const void *ptr, size_t len, gfx_format format);
 
+/* read len bytes at offset from the image source, returns bytes read, 0 at the end or an error */
+typedef ssize_t (*tga_read_func)(void *cookie, void *buf, off_t offset, size_t len);
+
+gfx_surface *tga_decode_stream(tga_read_func read, void *cookie, gfx_format format);
+
+#if WITH_LIB_FS
+gfx_surface *tga_decode_file(const char *path, gfx_format format);
+#endif
+#if WITH_LIB_BIO
+gfx_surface *tga_decode_bdev(const char *name, off_t offset, gfx_format format);
+#endif
+
 #endif
 
@@ -32,10 +32,22 @@
 #include <trace.h>
 #include <assert.h>
 #include <compiler.h>
+#include <err.h>
+#include <string.h>
+#include <stdlib.h>
 #include <lib/tga.h>
+#if WITH_LIB_FS
+#include <lib/fs.h>
+#endif
+#if WITH_LIB_BIO
+#include <lib/bio.h>
+#endif
 
 #define LOCAL_TRACE 0
 
+/* how much of the source is read at a time */
+#define TGA_READ_CHUNK 4096
+
 struct tga_header {
     uint8_t  idlength;
     uint8_t  colormaptype;
@@ -68,165 +80,347 @@ static void print_tga_info(const struct tga_header *header)
 
 }
 
-static void decode_2byte(gfx_surface *surface, uint x, uint y, const void *input)
+/* buffered sequential reads from the source */
+struct tga_reader {
+    tga_read_func read;
+    void *cookie;
+
+    off_t offset; /* source offset of buf[0] */
+    size_t len;
+    size_t pos;
+    uint8_t buf[TGA_READ_CHUNK];
+};
+
+static status_t tga_read(struct tga_reader *r, void *_out, size_t len)
 {
-    const uint8_t *in = (const uint8_t *)input;
+    uint8_t *out = (uint8_t *)_out;
+
+    while (len > 0) {
+        if (r->pos == r->len) {
+            r->offset += r->len;
+            ssize_t err = r->read(r->cookie, r->buf, r->offset, sizeof(r->buf));
+            if (err <= 0)
+                return (err < 0) ? err : ERR_IO;
+            r->len = err;
+            r->pos = 0;
+        }
 
-//  printf("in 0x%hhx 0x%hhx\n", in[0], in[1]);
-    uint r,g,b;
+        size_t tocopy = MIN(len, r->len - r->pos);
+        memcpy(out, r->buf + r->pos, tocopy);
+        r->pos += tocopy;
+        out += tocopy;
+        len -= tocopy;
+    }
 
-    b = (in[0] & 0x1f) << 3;
-    g = (((in[0] >> 5) & 0x7) | ((in[1] & 0x3) << 3)) << 3;
-    r = ((in[1] >> 2) & 0x1f) << 3;
+    return NO_ERROR;
+}
+
+static status_t tga_skip(struct tga_reader *r, size_t len)
+{
+    uint8_t scratch[32];
+
+    while (len > 0) {
+        size_t toread = MIN(len, sizeof(scratch));
+        status_t err = tga_read(r, scratch, toread);
+        if (err < 0)
+            return err;
+        len -= toread;
+    }
 
-    gfx_putpixel(surface, x, y, 0xff000000 | r << 16 | g << 8 | b);
+    return NO_ERROR;
 }
 
-static void decode_3byte(gfx_surface *surface, uint x, uint y, const void *input)
+/* convert count source pixels of the given size to ARGB8888 */
+static void decode_row(uint32_t *out, const uint8_t *in, uint count, uint step)
 {
-    const uint8_t *in = (const uint8_t *)input;
+    uint i;
+
+    switch (step) {
+        case 2:
+            for (i = 0; i < count; i++, in += 2) {
+                uint r,g,b;
 
-//  printf("in 0x%hhx 0x%hhx\n", in[0], in[1]);
+                b = (in[0] & 0x1f) << 3;
+                g = (((in[0] >> 5) & 0x7) | ((in[1] & 0x3) << 3)) << 3;
+                r = ((in[1] >> 2) & 0x1f) << 3;
 
-    gfx_putpixel(surface, x, y, 0xff000000 | in[2] << 16 | in[1] << 8 | in[0]);
+                out[i] = 0xff000000 | r << 16 | g << 8 | b;
+            }
+            break;
+        case 3:
+            for (i = 0; i < count; i++, in += 3)
+                out[i] = 0xff000000 | in[2] << 16 | in[1] << 8 | in[0];
+            break;
+        case 4:
+            for (i = 0; i < count; i++, in += 4) {
+                if (in[3] == 0)
+                    out[i] = 0;
+                else
+                    out[i] = (uint32_t)in[3] << 24 | in[2] << 16 | in[1] << 8 | in[0];
+            }
+            break;
+    }
 }
 
-static void decode_4byte(gfx_surface *surface, uint x, uint y, const void *input)
+/* state of an RLE packet that may carry over into the next row */
+struct tga_rle {
+    uint remaining;
+    bool repeat;
+    uint32_t pixel;
+};
+
+static status_t decode_rle_row(struct tga_reader *r, struct tga_rle *rle, uint32_t *out, uint width, uint step)
 {
-    const uint8_t *in = (const uint8_t *)input;
+    uint8_t in[4];
+    uint x = 0;
+
+    while (x < width) {
+        if (rle->remaining == 0) {
+            uint8_t run;
+            status_t err = tga_read(r, &run, 1);
+            if (err < 0)
+                return err;
+
+            rle->repeat = (run & 0x80);
+            rle->remaining = (run & 0x7f) + 1;
+
+            /* a repeated run has its one pixel right after the run byte */
+            if (rle->repeat) {
+                err = tga_read(r, in, step);
+                if (err < 0)
+                    return err;
+                decode_row(&rle->pixel, in, 1, step);
+            }
+        }
+
+        uint count = MIN(rle->remaining, width - x);
+        if (rle->repeat) {
+            for (uint i = 0; i < count; i++)
+                out[x + i] = rle->pixel;
+        } else {
+            /* raw pixels go straight through the row decoder, a chunk at a time */
+            for (uint i = 0; i < count; ) {
+                uint8_t raw[32 * 4];
+                uint n = MIN(count - i, sizeof(raw) / step);
+
+                status_t err = tga_read(r, raw, n * step);
+                if (err < 0)
+                    return err;
+                decode_row(out + x + i, raw, n, step);
+                i += n;
+            }
+        }
 
-//  printf("in 0x%hhx 0x%hhx 0x%hhx 0x%hhx\n", in[0], in[1], in[2], in[3]);
+        rle->remaining -= count;
+        x += count;
+    }
 
-    if (in[3] == 0)
-        gfx_putpixel(surface, x, y, 0);
-    else
-        gfx_putpixel(surface, x, y, in[3] << 24 | in[2] << 16 | in[1] << 8 | in[0]);
+    return NO_ERROR;
 }
 
 /**
- * @brief  Decode a tga image
+ * @brief  Decode a tga image from a stream
  *
- * @param  ptr  Pointer to tga data in memory
- * @param  len  Length of tga data
+ * The image is read sequentially through the read callback and converted a
+ * row at a time into the new surface, the file is never held in memory as a
+ * whole.
+ *
+ * @param  read  Callback returning bytes from the source at a given offset
+ * @param  cookie  Passed to the read callback
  * @param  format  Desired format of returned graphics surface
  *
  * @return Graphics surface or NULL on error.
  *
  * @ingroup graphics
  */
-gfx_surface *tga_decode(const void *ptr, size_t len, gfx_format format)
+gfx_surface *tga_decode_stream(tga_read_func read, void *cookie, gfx_format format)
 {
-    const struct tga_header *header = (const struct tga_header *)ptr;
+    struct tga_header header;
+    gfx_surface *surface = NULL;
+    uint8_t *raw = NULL;
+    uint32_t *row = NULL;
 
-    LTRACEF("ptr %p, len %zu\n", ptr, len);
+    LTRACEF("read %p, cookie %p\n", read, cookie);
+
+    struct tga_reader *r = malloc(sizeof(*r));
+    if (!r)
+        return NULL;
+    r->read = read;
+    r->cookie = cookie;
+    r->offset = 0;
+    r->len = 0;
+    r->pos = 0;
+
+    if (tga_read(r, &header, sizeof(header)) < 0) {
+        dprintf(INFO, "tga_decode: short header\n");
+        goto out;
+    }
 
 #if LOCAL_TRACE > 0
-    print_tga_info(header);
+    print_tga_info(&header);
 #endif
 
     /* do some sanity checks */
-    if (header->datatypecode != 2 && header->datatypecode != 10) {
-        dprintf(INFO, "tga_decode: unknown data type %d\n", header->datatypecode);
-        return NULL;
+    if (header.datatypecode != 2 && header.datatypecode != 10) {
+        dprintf(INFO, "tga_decode: unknown data type %d\n", header.datatypecode);
+        goto out;
     }
-    if (header->bitsperpixel != 16 && header->bitsperpixel != 24 && header->bitsperpixel != 32) {
-        dprintf(INFO, "tga_decode: unsupported bits per pixel %d\n", header->bitsperpixel);
-        return NULL;
+    if (header.bitsperpixel != 16 && header.bitsperpixel != 24 && header.bitsperpixel != 32) {
+        dprintf(INFO, "tga_decode: unsupported bits per pixel %d\n", header.bitsperpixel);
+        goto out;
     }
-    if (header->colormaptype != 0) {
+    if (header.colormaptype != 0) {
         dprintf(INFO, "tga_decode: has colormap, can't handle\n");
-        return NULL;
+        goto out;
+    }
+    if (header.width == 0 || header.height == 0) {
+        dprintf(INFO, "tga_decode: empty image\n");
+        goto out;
     }
 
-    const void *imagestart = ((const uint8_t *)ptr + sizeof(struct tga_header) + header->idlength);
+    if (tga_skip(r, header.idlength) < 0)
+        goto out;
+
+    uint step = header.bitsperpixel / 8;
+    bool top_down = (header.imagedescriptor & (1 << 5));
+
+    /* one row of input and one of decoded pixels */
+    row = malloc(header.width * sizeof(uint32_t));
+    if (header.datatypecode == 2)
+        raw = malloc(header.width * step);
+    if (!row || (header.datatypecode == 2 && !raw))
+        goto out;
 
     /* create a surface to hold the decoded bits */
-    gfx_surface *surface = gfx_create_surface(NULL, header->width, header->height, header->width, format);
-    DEBUG_ASSERT(surface);
-
-    /* copy the bits out */
-    void (*decodefunc)(gfx_surface *, uint x, uint y, const void *) = NULL;
-
-    uint step = 1;
-    if (header->bitsperpixel == 16) {
-        step = 2;
-        decodefunc = decode_2byte;
-    } else if (header->bitsperpixel == 24) {
-        step = 3;
-        decodefunc = decode_3byte;
-    } else if (header->bitsperpixel == 32) {
-        step = 4;
-        decodefunc = decode_4byte;
+    surface = gfx_create_surface(NULL, header.width, header.height, header.width, format);
+    if (!surface)
+        goto out;
+
+    struct tga_rle rle = { 0 };
+    for (uint y = 0; y < header.height; y++) {
+        uint surfacey = top_down ? y : (surface->height - 1) - y;
+        status_t err;
+
+        if (header.datatypecode == 2) {
+            /* no RLE */
+            err = tga_read(r, raw, header.width * step);
+            if (err >= 0)
+                decode_row(row, raw, header.width, step);
+        } else {
+            /* RLE compression, runs may cross rows */
+            err = decode_rle_row(r, &rle, row, header.width, step);
+        }
+        if (err < 0) {
+            dprintf(INFO, "tga_decode: truncated image at row %u\n", y);
+            gfx_surface_destroy(surface);
+            surface = NULL;
+            goto out;
+        }
+
+        gfx_putrow(surface, 0, surfacey, row, header.width);
     }
 
-    if (header->datatypecode == 2) {
-        /* no RLE */
-        uint pos = 0;
-        uint x, y;
-        uint surfacey;
+out:
+    free(raw);
+    free(row);
+    free(r);
+    return surface;
+}
 
-        for (y = 0; y < header->height; y++) {
+struct tga_mem_source {
+    const uint8_t *ptr;
+    size_t len;
+};
 
-            if ((header->imagedescriptor & (1 << 5)) == 0)
-                surfacey = (surface->height - 1) - y;
-            else
-                surfacey = y;
+static ssize_t tga_mem_read(void *cookie, void *buf, off_t offset, size_t len)
+{
+    const struct tga_mem_source *src = (const struct tga_mem_source *)cookie;
 
-            for (x = 0; x < header->width; x++) {
-                decodefunc(surface, x, surfacey, (const uint8_t *)imagestart + pos);
-                pos += step;
-            }
-        }
-    } else if (header->datatypecode == 10) {
-        /* RLE compression */
-        uint pos = 0;
-        uint count = 0;
-        uint x, y;
-
-        x = 0;
-        if ((header->imagedescriptor & (1 << 5)) == 0)
-            y = header->height - 1;
-        else
-            y = 0;
-
-        while (count < (uint)header->height * (uint)header->width) {
-            uint runpos;
-
-            uint8_t run = *((const uint8_t *)imagestart + pos);
-            bool repeat_run = (run & 0x80);
-            uint runlen = (run & 0x7f) + 1;
-
-//          printf("pos 0x%x count %u run 0x%hhx runtype %d runlen %u\n", pos, count, run, run & 0x80, runlen);
-
-            /* consume the run byte */
-            pos++;
-
-            /* start of a run */
-            for (runpos = 0; runpos < runlen; runpos++) {
-                decodefunc(surface, x, y, (const uint8_t *)imagestart + pos);
-                count++;
-
-                x++;
-                if (x == surface->width) {
-                    if ((header->imagedescriptor & (1 << 5)) == 0)
-                        y--;
-                    else
-                        y++;
-                    x = 0;
-                }
-
-                /* if a run of raw pixels, consume an input pixel */
-                if (!repeat_run)
-                    pos += step;
-            }
-            /* if this was a run of repeated pixels, consume the one input pixel we repeated */
-            if (repeat_run)
-                pos += step;
+    if ((size_t)offset >= src->len)
+        return 0;
 
-        }
-//      printf("done with RLE: x %d, y %d, pos %d, count %d\n", x, y, pos, count);
-    }
+    len = MIN(len, src->len - offset);
+    memcpy(buf, src->ptr + offset, len);
+    return len;
+}
+
+/**
+ * @brief  Decode a tga image
+ *
+ * @param  ptr  Pointer to tga data in memory
+ * @param  len  Length of tga data
+ * @param  format  Desired format of returned graphics surface
+ *
+ * @return Graphics surface or NULL on error.
+ *
+ * @ingroup graphics
+ */
+gfx_surface *tga_decode(const void *ptr, size_t len, gfx_format format)
+{
+    struct tga_mem_source src = { ptr, len };
+
+    LTRACEF("ptr %p, len %zu\n", ptr, len);
+
+    return tga_decode_stream(tga_mem_read, &src, format);
+}
+
+#if WITH_LIB_FS
+static ssize_t tga_file_read(void *cookie, void *buf, off_t offset, size_t len)
+{
+    return fs_read_file((filehandle *)cookie, buf, offset, len);
+}
+
+/**
+ * @brief  Decode a tga image straight from a file
+ *
+ * @ingroup graphics
+ */
+gfx_surface *tga_decode_file(const char *path, gfx_format format)
+{
+    filehandle *handle;
+
+    if (fs_open_file(path, &handle) < 0)
+        return NULL;
+
+    gfx_surface *surface = tga_decode_stream(tga_file_read, handle, format);
+
+    fs_close_file(handle);
 
     return surface;
 }
+#endif
+
+#if WITH_LIB_BIO
+struct tga_bdev_source {
+    bdev_t *dev;
+    off_t offset;
+};
+
+static ssize_t tga_bdev_read(void *cookie, void *buf, off_t offset, size_t len)
+{
+    const struct tga_bdev_source *src = (const struct tga_bdev_source *)cookie;
+
+    return bio_read(src->dev, buf, src->offset + offset, len);
+}
+
+/**
+ * @brief  Decode a tga image stored at an offset within a block device
+ *
+ * @ingroup graphics
+ */
+gfx_surface *tga_decode_bdev(const char *name, off_t offset, gfx_format format)
+{
+    struct tga_bdev_source src;
+
+    src.dev = bio_open(name);
+    if (!src.dev)
+        return NULL;
+    src.offset = offset;
+
+    gfx_surface *surface = tga_decode_stream(tga_bdev_read, &src, format);
+
+    bio_close(src.dev);
 
+    return surface;
+}
+#endif
@@ -26,9 +26,23 @@
  */
 #include <unittest.h>
 #include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <platform.h>
+#include <arch/ops.h>
+#include <kernel/mp.h>
+#include <kernel/mutex.h>
+#include <kernel/thread.h>
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+#endif
+
+#include "unittest_priv.h"
 
 static struct test_case_element *test_case_list = NULL;
 static struct test_case_element *failed_test_case_list = NULL;
+static mutex_t failed_lock = MUTEX_INITIAL_VALUE(failed_lock);
 
 /*
  * Registers a test case with the unit test framework.
@@ -41,27 +55,154 @@ void unittest_register_test_case(struct test_case_element *elem)
     test_case_list = elem;
 }
 
+/*
+ * Runs one test case on the current thread, with its output buffered if
+ * other cases are running at the same time.
+ */
+static bool run_test_case(struct test_case_element *elem, uint flags, bool buffered)
+{
+    struct unittest_ctx ctx = {
+        .case_name = elem->name,
+        .flags = flags,
+    };
+
+    if (buffered)
+        ctx.buf = malloc(UNITTEST_CASE_BUFFER_SIZE);
+
+    uintptr_t old = tls_set(TLS_ENTRY_UNITTEST, (uintptr_t)&ctx);
+
+    lk_bigtime_t usecs = current_time_hires();
+    bool passed = elem->test_case();
+    usecs = current_time_hires() - usecs;
+
+    if (flags & UNITTEST_MACHINE) {
+        unittest_printf(UNITTEST_RESULT_TAG "{\"case\": \"%s\", \"passed\": %s, \"us\": %llu}\n",
+                        elem->name, passed ? "true" : "false", usecs);
+    }
+
+    unittest_flush(&ctx);
+    tls_set(TLS_ENTRY_UNITTEST, old);
+    free(ctx.buf);
+
+    if (!passed) {
+        mutex_acquire(&failed_lock);
+        elem->failed_next = failed_test_case_list;
+        failed_test_case_list = elem;
+        mutex_release(&failed_lock);
+    }
+
+    return passed;
+}
+
+/* parallel cases waiting for a runner */
+struct parallel_run {
+    struct test_case_element **cases;
+    int count;
+    volatile int next;
+    uint flags;
+};
+
+static int parallel_runner(void *arg)
+{
+    struct parallel_run *run = arg;
+
+    for (;;) {
+        int i = atomic_add(&run->next, 1);
+        if (i >= run->count)
+            break;
+        run_test_case(run->cases[i], run->flags, true);
+    }
+
+    return 0;
+}
+
+/*
+ * Runs the TEST_CASE_PARALLEL cases in the list with one runner pinned to
+ * each active cpu, pulling cases until there are none left.
+ */
+static void run_parallel_cases(struct test_case_element **cases, int count, uint flags)
+{
+    struct parallel_run run = {
+        .cases = cases,
+        .count = count,
+        .next = 0,
+        .flags = flags,
+    };
+    thread_t *threads[SMP_MAX_CPUS];
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        threads[i] = NULL;
+        if (!mp_is_cpu_active(i) || (int)i >= count)
+            continue;
+
+        threads[i] = thread_create("unittest", parallel_runner, &run, DEFAULT_PRIORITY,
+                                   DEFAULT_STACK_SIZE);
+        if (!threads[i])
+            continue;
+        thread_set_pinned_cpu(threads[i], i);
+        thread_resume(threads[i]);
+    }
+
+    /* picks up whatever is left if no runner could be created */
+    parallel_runner(&run);
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (threads[i])
+            thread_join(threads[i], NULL, INFINITE_TIME);
+    }
+}
+
 /*
  * Runs all registered test cases.
  */
 bool run_all_tests(void)
+{
+    return unittest_run_tests(NULL, 0);
+}
+
+bool unittest_run_tests(const char *name, uint flags)
 {
     unsigned int n_tests   = 0;
     unsigned int n_success = 0;
     unsigned int n_failed  = 0;
+    unsigned int n_parallel = 0;
+
+    struct test_case_element **parallel = NULL;
+    if (flags & UNITTEST_PARALLEL) {
+        struct test_case_element *current;
+        unsigned int count = 0;
+        for (current = test_case_list; current; current = current->next)
+            count++;
+        parallel = calloc(count, sizeof(*parallel));
+    }
+
+    lk_bigtime_t usecs = current_time_hires();
 
-    bool all_success = true;
+    /* the serial cases run first, the parallel ones are collected for after */
     struct test_case_element *current = test_case_list;
     while (current) {
-        if (!current->test_case()) {
-            current->failed_next = failed_test_case_list;
-            failed_test_case_list = current;
-            all_success = false;
+        if (!name || !strcmp(name, current->name)) {
+            if (parallel && (current->flags & TEST_CASE_PARALLEL))
+                parallel[n_parallel++] = current;
+            else
+                run_test_case(current, flags, false);
+            n_tests++;
         }
         current = current->next;
-        n_tests++;
     }
 
+    if (n_parallel > 0)
+        run_parallel_cases(parallel, n_parallel, flags);
+    free(parallel);
+
+    usecs = current_time_hires() - usecs;
+
+    if (name && n_tests == 0) {
+        unittest_printf("no test case named %s\n", name);
+        return false;
+    }
+
+    bool all_success = (failed_test_case_list == NULL);
     if (all_success) {
         n_success = n_tests;
         unittest_printf("SUCCESS!  All test cases passed!\n");
@@ -70,6 +211,7 @@ bool run_all_tests(void)
         while (failed) {
             struct test_case_element *failed_next =
                         failed->failed_next;
+            unittest_printf("FAILED:  %s\n", failed->name);
             failed->failed_next = NULL;
             failed = failed_next;
             n_failed++;
@@ -81,7 +223,47 @@ bool run_all_tests(void)
     unittest_printf("\n====================================================\n");
     unittest_printf  ("    CASES:  %d     SUCCESS:  %d     FAILED:  %d   ",
                       n_tests, n_success, n_failed);
+    unittest_printf("\n    TIME:   %llu us (%d in parallel)", usecs, n_parallel);
     unittest_printf("\n====================================================\n");
 
+    if (flags & UNITTEST_MACHINE) {
+        unittest_printf(UNITTEST_RESULT_TAG "{\"cases\": %d, \"passed\": %d, \"failed\": %d, "
+                        "\"us\": %llu}\n", n_tests, n_success, n_failed, usecs);
+    }
+
     return all_success;
 }
+
+#if WITH_LIB_CONSOLE
+
+static int cmd_unittest(int argc, const cmd_args *argv)
+{
+    const char *name = NULL;
+    uint flags = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i].str, "-p")) {
+            flags |= UNITTEST_PARALLEL;
+        } else if (!strcmp(argv[i].str, "-m")) {
+            flags |= UNITTEST_MACHINE;
+        } else if (!strcmp(argv[i].str, "-n")) {
+            flags |= UNITTEST_IGNORE_CYCLES;
+        } else if (argv[i].str[0] == '-') {
+            printf("usage: %s [-p] [-m] [-n] [case]\n", argv[0].str);
+            printf("\t-p run parallel safe cases concurrently\n");
+            printf("\t-m print machine readable results\n");
+            printf("\t-n don't fail tests over their cycle limits\n");
+            return ERR_INVALID_ARGS;
+        } else {
+            name = argv[i].str;
+        }
+    }
+
+    return unittest_run_tests(name, flags) ? NO_ERROR : ERR_GENERIC;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("unittest", "run unit tests", &cmd_unittest)
+STATIC_COMMAND_END(unittest);
+
+#endif
@@ -63,6 +63,20 @@
  *      END_TEST;
  * }
  *
+ * Every test is timed and its cycle count and elapsed time are printed
+ * next to [PASSED]. Performance sensitive code can be measured inside a
+ * test with BENCHMARK, which runs a statement a few times and returns the
+ * best cycle count, and held to a budget with EXPECT_MAX_CYCLES:
+ *
+ *      EXPECT_MAX_CYCLES(2000, BENCHMARK("memcpy 4k", memcpy(a, b, 4096)),
+ *                        "memcpy is too slow");
+ *
+ * Cycle counts are whatever arch_cycle_count() provides, which wraps at
+ * 32 bits and is not meaningful under every emulator, so keep budgets
+ * loose. Cases that share no state with other cases can end with
+ * END_TEST_CASE_PARALLEL instead of END_TEST_CASE, and will then run
+ * concurrently with each other when the runner is asked to.
+ *
  * To your rules.mk file, add lib/unittest to MODULE_DEPS:
  *
  * MODULE_DEPS += \
@@ -75,6 +89,7 @@
 #include <string.h>
 #include <trace.h>
 #include <stdarg.h>
+#include <arch/ops.h>
 
 #define PRINT_BUFFER_SIZE                                       (512)
 
@@ -122,7 +137,11 @@ void unittest_set_output_function (test_output_func fun, void *arg);
     void (*_register_##case_name##_ptr)(void) __SECTION(".ctors") =     \
         _register_##case_name;
 
-#define END_TEST_CASE(case_name)                                        \
+#define END_TEST_CASE(case_name) _END_TEST_CASE(case_name, 0)
+#define END_TEST_CASE_PARALLEL(case_name) \
+    _END_TEST_CASE(case_name, TEST_CASE_PARALLEL)
+
+#define _END_TEST_CASE(case_name, case_flags)                           \
     if (all_success) {                                                  \
         unittest_printf("CASE %-59s [PASSED]\n", #case_name);           \
     } else {                                                            \
@@ -135,15 +154,13 @@ void unittest_set_output_function (test_output_func fun, void *arg);
         .failed_next = NULL,                                            \
         .name = #case_name,                                             \
         .test_case = case_name,                                         \
+        .flags = case_flags,                                            \
     };                                                                  \
     DEFINE_REGISTER_TEST_CASE(case_name);
 
 #define RUN_TEST(test)                                  \
-    unittest_printf("    %-50s [RUNNING]",  #test );    \
-    if (! test ()) {                                    \
+    if (!unittest_run_test(#test, test)) {              \
          all_success = false;                           \
-    } else {                                            \
-        unittest_printf(" [PASSED] \n");                \
     }
 
 /*
@@ -264,6 +281,38 @@ void unittest_set_output_function (test_output_func fun, void *arg);
         }                                                                 \
     }
 
+/*
+ * Runs stmt UNITTEST_BENCH_RUNS times and evaluates to the lowest cycle
+ * count of a single run, which is also reported under name.
+ */
+#define UNITTEST_BENCH_RUNS 16
+
+#define BENCHMARK(name, stmt...)                                          \
+    ({                                                                    \
+        uint32_t _best = UINT32_MAX;                                      \
+        for (int _run = 0; _run < UNITTEST_BENCH_RUNS; _run++) {          \
+            uint32_t _c = arch_cycle_count();                             \
+            stmt;                                                         \
+            _c = arch_cycle_count() - _c;                                 \
+            if (_c < _best)                                               \
+                _best = _c;                                               \
+        }                                                                 \
+        unittest_report_cycles(name, _best);                              \
+        _best;                                                            \
+    })
+
+/* Fails if cycles is over max, unless the run ignores cycle limits. */
+#define EXPECT_MAX_CYCLES(max, cycles, msg)                               \
+    {                                                                     \
+        const uint32_t _m = max;                                          \
+        const uint32_t _c = cycles;                                       \
+        if (_c > _m && unittest_check_cycles()) {                         \
+            UNITTEST_TRACEF("%s: took %u cycles, limit %u\n",             \
+                   msg, _c, _m);                                          \
+            all_ok = false;                                               \
+        }                                                                 \
+    }
+
 /*
  * The ASSERT_* macros are similar to the EXPECT_* macros except that
  * they return on failure.
@@ -282,8 +331,25 @@ struct test_case_element {
     struct test_case_element *failed_next;
     const char *name;
     bool (*test_case)(void);
+    unsigned int flags;
 };
 
+/* the case shares no state with other cases and may run alongside them */
+#define TEST_CASE_PARALLEL (1 << 0)
+
+/*
+ * Flags for unittest_run_tests.
+ */
+/* run TEST_CASE_PARALLEL cases concurrently, one runner thread per cpu */
+#define UNITTEST_PARALLEL       (1 << 0)
+/* also print a json line per test, case and benchmark, prefixed with
+ * UNITTEST_RESULT_TAG, for scripts to pick out of the console */
+#define UNITTEST_MACHINE        (1 << 1)
+/* report EXPECT_MAX_CYCLES overruns but don't fail on them */
+#define UNITTEST_IGNORE_CYCLES  (1 << 2)
+
+#define UNITTEST_RESULT_TAG "@unittest "
+
 
 /*
  * Registers a test case with the unit test framework.
@@ -295,6 +361,27 @@ void unittest_register_test_case(struct test_case_element *elem);
  */
 bool run_all_tests(void);
 
+/*
+ * Runs the registered test case called name, or all of them if name is
+ * NULL, with UNITTEST_* flags.
+ */
+bool unittest_run_tests(const char *name, unsigned int flags);
+
+/*
+ * Runs and times a single test, called by RUN_TEST.
+ */
+bool unittest_run_test(const char *name, bool (*test)(void));
+
+/*
+ * Reports a cycle count measured by the current test, called by BENCHMARK.
+ */
+void unittest_report_cycles(const char *name, uint32_t cycles);
+
+/*
+ * Returns false if the current run ignores EXPECT_MAX_CYCLES limits.
+ */
+bool unittest_check_cycles(void);
+
 /*
  * Returns false if expected does not equal actual and prints msg and a hexdump8
  * of the input buffers.
@@ -30,6 +30,11 @@
 #include <stdio.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <platform.h>
+#include <kernel/mutex.h>
+#include <kernel/thread.h>
+
+#include "unittest_priv.h"
 
 /**
  * \brief Default function to dump unit test results
@@ -40,13 +45,20 @@
  */
 static void default_printf (const char *line, int len, void *arg)
 {
-    printf (line);
+    printf ("%s", line);
 }
 
 // Default output function is the printf
 static test_output_func out_func = default_printf;
 // Buffer the argument to be sent to the output function
 static void *out_func_arg = NULL;
+// Serializes print_buffer and whole cases' output from parallel runs
+static mutex_t out_lock = MUTEX_INITIAL_VALUE(out_lock);
+
+static struct unittest_ctx *current_ctx(void)
+{
+    return (struct unittest_ctx *)tls_get(TLS_ENTRY_UNITTEST);
+}
 
 /**
  * \brief Function called to dump results
@@ -56,19 +68,102 @@ static void *out_func_arg = NULL;
 void unittest_printf (const char *format, ...)
 {
     static char print_buffer[PRINT_BUFFER_SIZE];
+    struct unittest_ctx *ctx = current_ctx();
 
     va_list argp;
     va_start (argp, format);
 
+    if (ctx && ctx->buf) {
+        // Append to the case's output, if it fits
+        size_t space = UNITTEST_CASE_BUFFER_SIZE - ctx->buf_len;
+        int len = vsnprintf(ctx->buf + ctx->buf_len, space, format, argp);
+        va_end (argp);
+        if (len >= 0 && (size_t)len < space) {
+            ctx->buf_len += len;
+            return;
+        }
+
+        // Otherwise print what there is and this line on its own
+        ctx->buf[ctx->buf_len] = '\0';
+        unittest_flush(ctx);
+        va_start (argp, format);
+    }
+
+    mutex_acquire(&out_lock);
     if (out_func != NULL) {
         // Format the string
         vsnprintf(print_buffer, PRINT_BUFFER_SIZE, format, argp);
         out_func (print_buffer, PRINT_BUFFER_SIZE, out_func_arg);
     }
+    mutex_release(&out_lock);
 
     va_end (argp);
 }
 
+void unittest_flush(struct unittest_ctx *ctx)
+{
+    if (!ctx->buf || ctx->buf_len == 0)
+        return;
+
+    mutex_acquire(&out_lock);
+    if (out_func != NULL)
+        out_func (ctx->buf, ctx->buf_len, out_func_arg);
+    mutex_release(&out_lock);
+
+    ctx->buf_len = 0;
+    ctx->buf[0] = '\0';
+}
+
+bool unittest_run_test(const char *name, bool (*test)(void))
+{
+    struct unittest_ctx *ctx = current_ctx();
+
+    if (ctx)
+        ctx->test_name = name;
+
+    unittest_printf("    %-50s [RUNNING]", name);
+
+    lk_bigtime_t usecs = current_time_hires();
+    uint32_t cycles = arch_cycle_count();
+    bool passed = test();
+    cycles = arch_cycle_count() - cycles;
+    usecs = current_time_hires() - usecs;
+
+    if (passed)
+        unittest_printf(" [PASSED] %u cycles %llu us\n", cycles, usecs);
+
+    if (ctx && (ctx->flags & UNITTEST_MACHINE)) {
+        unittest_printf(UNITTEST_RESULT_TAG "{\"case\": \"%s\", \"test\": \"%s\", "
+                        "\"passed\": %s, \"cycles\": %u, \"us\": %llu}\n",
+                        ctx->case_name, name, passed ? "true" : "false", cycles, usecs);
+    }
+
+    if (ctx)
+        ctx->test_name = NULL;
+
+    return passed;
+}
+
+void unittest_report_cycles(const char *name, uint32_t cycles)
+{
+    struct unittest_ctx *ctx = current_ctx();
+
+    unittest_printf("\n        %-46s %10u cycles", name, cycles);
+
+    if (ctx && (ctx->flags & UNITTEST_MACHINE)) {
+        unittest_printf("\n" UNITTEST_RESULT_TAG "{\"case\": \"%s\", \"test\": \"%s\", "
+                        "\"benchmark\": \"%s\", \"cycles\": %u}\n",
+                        ctx->case_name, ctx->test_name ? ctx->test_name : "", name, cycles);
+    }
+}
+
+bool unittest_check_cycles(void)
+{
+    struct unittest_ctx *ctx = current_ctx();
+
+    return !ctx || !(ctx->flags & UNITTEST_IGNORE_CYCLES);
+}
+
 bool expect_bytes_eq(const uint8_t *expected, const uint8_t *actual, size_t len,
                      const char *msg)
 {
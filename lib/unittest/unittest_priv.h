@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2013, Google, Inc. All rights reserved
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <unittest.h>
+#include <sys/types.h>
+
+/*
+ * State of the test case a thread is running, found through its
+ * TLS_ENTRY_UNITTEST slot. Threads without one run tests unbuffered with
+ * the default flags, as when a case function is called directly.
+ */
+struct unittest_ctx {
+    const char *case_name;
+    const char *test_name;
+    uint flags;
+
+    /* output of a case running alongside others, printed in one piece
+     * when the case ends so cases don't interleave */
+    char *buf;
+    size_t buf_len;
+};
+
+#define UNITTEST_CASE_BUFFER_SIZE (16 * 1024)
+
+/* prints and empties the context's buffered output */
+void unittest_flush(struct unittest_ctx *ctx);
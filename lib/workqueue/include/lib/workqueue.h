@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <list.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS;
+
+typedef void (*work_func_t)(void *arg);
+
+/*
+ * A unit of work for the worker pool. Embed one in the object that owns the
+ * work and submit it with workqueue_submit(). A work item can only be queued
+ * once at a time and must stay valid until it has run or been cancelled. It is
+ * marked idle just before its function is called, so the function may free or
+ * resubmit it.
+ */
+typedef struct work {
+    struct list_node node;
+    volatile int state;
+    uint cpu;
+
+    work_func_t func;
+    void *arg;
+} work_t;
+
+#define WORK_INITIAL_VALUE(w, _func, _arg) \
+{ \
+    .node = LIST_INITIAL_CLEARED_VALUE, \
+    .state = 0, \
+    .cpu = 0, \
+    .func = (_func), \
+    .arg = (_arg), \
+}
+
+void work_init(work_t *w, work_func_t func, void *arg);
+
+/* queue onto the current cpu's worker, idle workers on other cpus steal from
+ * it. safe from interrupt context. returns ERR_ALREADY_EXISTS if queued. */
+status_t workqueue_submit(work_t *w);
+
+/* queue onto a particular cpu's worker, it can still be stolen */
+status_t workqueue_submit_cpu(work_t *w, uint cpu);
+
+/* take a work item back off the queue if no worker has picked it up yet.
+ * returns true if it was removed and so will not run. */
+bool workqueue_cancel(work_t *w);
+
+/*
+ * Call fn(start, end, arg) over [start, end) in pieces of at most |chunk|,
+ * spread over every cpu's worker and the calling thread, and return once all
+ * of them have completed. Pieces may run in any order and concurrently with
+ * each other. Must be called from a thread.
+ */
+typedef void (*parallel_for_func_t)(size_t start, size_t end, void *arg);
+
+void parallel_for(size_t start, size_t end, size_t chunk, parallel_for_func_t fn, void *arg);
+
+__END_CDECLS;
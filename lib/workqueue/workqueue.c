@@ -0,0 +1,361 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/workqueue.h>
+
+#include <debug.h>
+#include <assert.h>
+#include <trace.h>
+#include <err.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <arch/ops.h>
+#include <kernel/thread.h>
+#include <kernel/event.h>
+#include <kernel/mp.h>
+#include <kernel/spinlock.h>
+#include <lk/init.h>
+
+#define LOCAL_TRACE 0
+
+#ifndef WORKQUEUE_PRIORITY
+#define WORKQUEUE_PRIORITY DEFAULT_PRIORITY
+#endif
+
+/* work_t state */
+#define WORK_IDLE   0
+#define WORK_QUEUED 1
+
+/*
+ * One worker thread per cpu, pinned to it, each with its own deque of work.
+ * The owner runs its newest work first, while the cache is still warm with
+ * whatever queued it. A worker that runs dry steals the oldest work from the
+ * other cpus' deques before it goes to sleep. The deques are short and only
+ * held for a list operation, so a spinlock each is plenty.
+ */
+struct wq_cpu {
+    spin_lock_t lock;
+    struct list_node deque; /* head is the oldest */
+    uint count;
+
+    event_t event;
+    thread_t *thread;
+    volatile int idle;
+
+    /* stats */
+    ulong ran;
+    ulong stolen;
+} __CPU_ALIGN;
+
+static struct wq_cpu wq_cpu[SMP_MAX_CPUS];
+static bool wq_initialized;
+
+void work_init(work_t *w, work_func_t func, void *arg)
+{
+    *w = (work_t)WORK_INITIAL_VALUE(*w, func, arg);
+}
+
+/* get an idle worker other than |cpu| looking at the deques again */
+static void wq_kick_idle(uint cpu)
+{
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (i != cpu && wq_cpu[i].thread && wq_cpu[i].idle) {
+            event_signal(&wq_cpu[i].event, false);
+            return;
+        }
+    }
+}
+
+status_t workqueue_submit_cpu(work_t *w, uint cpu)
+{
+    DEBUG_ASSERT(w);
+    DEBUG_ASSERT(w->func);
+    DEBUG_ASSERT(cpu < SMP_MAX_CPUS);
+    DEBUG_ASSERT(wq_initialized);
+
+    /* a cpu that never came up would never run it, hand it to the boot cpu */
+    if (!mp_is_cpu_active(cpu))
+        cpu = 0;
+
+    if (atomic_cmpxchg(&w->state, WORK_IDLE, WORK_QUEUED) != WORK_IDLE)
+        return ERR_ALREADY_EXISTS;
+
+    struct wq_cpu *c = &wq_cpu[cpu];
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&c->lock, state);
+
+    w->cpu = cpu;
+    list_add_tail(&c->deque, &w->node);
+    bool backlog = c->count++ > 0;
+
+    spin_unlock_irqrestore(&c->lock, state);
+
+    event_signal(&c->event, false);
+
+    /* the owner is busy with earlier work, let someone else help out */
+    if (backlog)
+        wq_kick_idle(cpu);
+
+    return NO_ERROR;
+}
+
+status_t workqueue_submit(work_t *w)
+{
+    /* if we migrate after reading it the work just lands on the old cpu */
+    return workqueue_submit_cpu(w, arch_curr_cpu_num());
+}
+
+bool workqueue_cancel(work_t *w)
+{
+    DEBUG_ASSERT(w);
+
+    if (w->state != WORK_QUEUED)
+        return false;
+
+    struct wq_cpu *c = &wq_cpu[w->cpu];
+    bool removed = false;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&c->lock, state);
+
+    /* still queued, and on this deque, only while the node is on a list */
+    if (w->state == WORK_QUEUED && list_in_list(&w->node)) {
+        list_delete(&w->node);
+        c->count--;
+        w->state = WORK_IDLE;
+        removed = true;
+    }
+
+    spin_unlock_irqrestore(&c->lock, state);
+
+    return removed;
+}
+
+/* newest from our own deque, or oldest from our own when |steal| */
+static work_t *wq_take(struct wq_cpu *c, bool steal)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&c->lock, state);
+
+    work_t *w = steal ? list_remove_head_type(&c->deque, work_t, node)
+                : list_remove_tail_type(&c->deque, work_t, node);
+    if (w)
+        c->count--;
+
+    spin_unlock_irqrestore(&c->lock, state);
+
+    return w;
+}
+
+static work_t *wq_steal(uint self)
+{
+    for (uint i = 1; i < SMP_MAX_CPUS; i++) {
+        struct wq_cpu *victim = &wq_cpu[(self + i) % SMP_MAX_CPUS];
+        if (victim->count == 0)
+            continue;
+
+        work_t *w = wq_take(victim, true);
+        if (w)
+            return w;
+    }
+    return NULL;
+}
+
+static int wq_worker(void *arg)
+{
+    uint cpu = (uint)(uintptr_t)arg;
+    struct wq_cpu *c = &wq_cpu[cpu];
+
+    for (;;) {
+        work_t *w = wq_take(c, false);
+        if (!w) {
+            w = wq_steal(cpu);
+            if (w)
+                c->stolen++;
+        }
+
+        if (!w) {
+            /* anything queued from here on signals the event, so nothing is missed */
+            c->idle = 1;
+            event_wait(&c->event);
+            c->idle = 0;
+            continue;
+        }
+
+        work_func_t func = w->func;
+        void *func_arg = w->arg;
+
+        /* the work item belongs to the caller again from here on */
+        atomic_swap(&w->state, WORK_IDLE);
+
+        c->ran++;
+        func(func_arg);
+    }
+
+    return 0;
+}
+
+/* shared by everyone working on one parallel_for */
+struct pfor {
+    size_t start;
+    size_t end;
+    size_t chunk;
+    parallel_for_func_t fn;
+    void *arg;
+
+    volatile int next;      /* next chunk to hand out */
+    int chunks;
+
+    volatile int helpers;   /* helpers queued or running */
+    event_t done;
+};
+
+static void pfor_run_chunks(struct pfor *p)
+{
+    for (;;) {
+        int i = atomic_add(&p->next, 1);
+        if (i >= p->chunks)
+            return;
+
+        size_t s = p->start + (size_t)i * p->chunk;
+        size_t e = MIN(s + p->chunk, p->end);
+        p->fn(s, e, p->arg);
+    }
+}
+
+static void pfor_helper(void *arg)
+{
+    struct pfor *p = arg;
+
+    pfor_run_chunks(p);
+
+    /* the last one out lets the caller go, unless that was the caller itself */
+    if (atomic_add(&p->helpers, -1) == 1)
+        event_signal(&p->done, false);
+}
+
+void parallel_for(size_t start, size_t end, size_t chunk, parallel_for_func_t fn, void *arg)
+{
+    LTRACEF("start %zu, end %zu, chunk %zu, fn %p\n", start, end, chunk, fn);
+
+    DEBUG_ASSERT(fn);
+    DEBUG_ASSERT(chunk > 0);
+
+    if (end <= start)
+        return;
+
+    struct pfor p = {
+        .start = start,
+        .end = end,
+        .chunk = chunk,
+        .fn = fn,
+        .arg = arg,
+        .next = 0,
+        .chunks = (end - start + chunk - 1) / chunk,
+    };
+
+    /* one helper on each other cpu, no more than there are chunks to go round */
+    work_t helper[SMP_MAX_CPUS];
+    uint cur = arch_curr_cpu_num();
+    int count = 0;
+
+    if (wq_initialized) {
+        event_init(&p.done, false, 0);
+        p.helpers = 0;
+
+        for (uint i = 0; i < SMP_MAX_CPUS && count < p.chunks - 1; i++) {
+            if (i == cur || !mp_is_cpu_active(i))
+                continue;
+
+            work_init(&helper[count], pfor_helper, &p);
+            atomic_add(&p.helpers, 1);
+            workqueue_submit_cpu(&helper[count], i);
+            count++;
+        }
+    }
+
+    pfor_run_chunks(&p);
+
+    if (count == 0)
+        return;
+
+    /*
+     * every chunk has been handed out, so a helper that hasn't started has
+     * nothing left to do. whoever drops the count to zero is the last one
+     * touching |p|; if that wasn't us, wait for it to say so.
+     */
+    bool last = false;
+    for (int i = 0; i < count; i++) {
+        if (workqueue_cancel(&helper[i]))
+            last = atomic_add(&p.helpers, -1) == 1;
+    }
+
+    if (!last)
+        event_wait(&p.done);
+
+    event_destroy(&p.done);
+}
+
+static void workqueue_init(uint level)
+{
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        struct wq_cpu *c = &wq_cpu[i];
+        char name[16];
+
+        spin_lock_init(&c->lock);
+        list_initialize(&c->deque);
+        event_init(&c->event, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+        snprintf(name, sizeof(name), "worker %u", i);
+        c->thread = thread_create(name, &wq_worker, (void *)(uintptr_t)i,
+                                  WORKQUEUE_PRIORITY, DEFAULT_STACK_SIZE);
+        if (!c->thread)
+            panic("unable to create worker thread for cpu %u\n", i);
+
+        thread_set_pinned_cpu(c->thread, i);
+        thread_detach_and_resume(c->thread);
+    }
+
+    wq_initialized = true;
+}
+
+LK_INIT_HOOK(workqueue, &workqueue_init, LK_INIT_LEVEL_THREADING);
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+
+static int cmd_workqueue(int argc, const cmd_args *argv)
+{
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        struct wq_cpu *c = &wq_cpu[i];
+        printf("cpu %u: queued %u, ran %lu, stolen %lu%s\n", i, c->count, c->ran, c->stolen,
+               c->idle ? ", idle" : "");
+    }
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("workqueue", "worker pool stats", &cmd_workqueue)
+STATIC_COMMAND_END(workqueue);
+#endif
@@ -26,6 +26,7 @@
 #include <reg.h>
 #include <kernel/thread.h>
 #include <kernel/debug.h>
+#include <lib/prof.h>
 #include <platform/interrupts.h>
 #include <platform/armemu.h>
 #include <arch/ops.h>
@@ -92,6 +93,8 @@ enum handler_return platform_irq(struct arm_iframe *frame)
 
     KEVLOG_IRQ_EXIT(vector);
 
+    prof_irq_sample(frame->pc, 0);
+
     return ret;
 }
 
@@ -244,7 +244,8 @@ decoded:
         *REG32(INTC_LOCAL_MAILBOX0_CLR0 + 0x10 * cpu) = pend;
 
         if (pend & (1 << MP_IPI_GENERIC)) {
-            PANIC_UNIMPLEMENTED;
+            extern enum handler_return arm_ipi_generic_handler(void *arg);
+            ret = arm_ipi_generic_handler(NULL);
         }
         if (pend & (1 << MP_IPI_RESCHEDULE)) {
             ret = mp_mbx_reschedule_irq();
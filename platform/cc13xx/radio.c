@@ -53,7 +53,7 @@ void ti_cc_rfc_cpe_0_irq(void) {
 	NVIC_DisableIRQ(rfc_cpe_0_IRQn);
 
 	// reschedule if we woke a thread (indicated by !signaled)
-	arm_cm_irq_exit(!cpe0_evt.signaled);
+	arm_cm_irq_exit(!event_signaled(&cpe0_evt));
 }
 
 static inline uint32_t cpe0_reason(void) {
@@ -77,7 +77,7 @@ void ti_cc_rfc_cmd_ack_irq(void) {
 	HWREG(RFC_DBELL_BASE + RFC_DBELL_O_RFACKIFG) = 0;
 	event_signal(&ack_evt, false);
 	// reschedule if we woke a thread (indicated by !signaled)
-	arm_cm_irq_exit(!ack_evt.signaled);
+	arm_cm_irq_exit(!event_signaled(&ack_evt));
 }
 
 uint32_t radio_send_cmd(uint32_t cmd) {
@@ -166,7 +166,7 @@ void udc_endpoint_free(struct udc_endpoint *ept)
     // todo
 }
 
-static void handle_ept_complete(struct udc_endpoint *ept);
+static void endpoint_cancel(struct udc_endpoint *ept);
 
 static void endpoint_flush(usb_t *usb, udc_endpoint_t *ept)
 {
@@ -174,9 +174,7 @@ static void endpoint_flush(usb_t *usb, udc_endpoint_t *ept)
         // flush outstanding transfers
         writel(ept->bit, usb->base + USB_ENDPTFLUSH);
         while (readl(usb->base + USB_ENDPTFLUSH)) ;
-        while (ept->req) {
-            handle_ept_complete(ept);
-        }
+        endpoint_cancel(ept);
     }
 }
 
@@ -242,6 +240,31 @@ void udc_request_free(struct udc_request *req)
     free(req);
 }
 
+static void endpoint_prime(udc_endpoint_t *ept, usb_request_t *req)
+{
+    ept->head->next_dtd = (unsigned) req->dtd;
+    ept->head->dtd_config = 0;
+    DSB;
+    writel(ept->bit, ept->usb->base + USB_ENDPTPRIME);
+}
+
+// is the controller still working through the endpoint's dtd list?
+static bool endpoint_busy(udc_endpoint_t *ept)
+{
+    return (readl(ept->usb->base + USB_ENDPTPRIME) | readl(ept->usb->base + USB_ENDPTSTAT)) & ept->bit;
+}
+
+// prime the first request the controller hasn't gotten to, if any
+static void endpoint_restart(udc_endpoint_t *ept)
+{
+    for (usb_request_t *req = ept->req; req; req = req->next) {
+        if (req->dtd->config & DTD_ACTIVE) {
+            endpoint_prime(ept, req);
+            return;
+        }
+    }
+}
+
 int udc_request_queue(udc_endpoint_t *ept, struct udc_request *_req)
 {
     spin_lock_saved_state_t state;
@@ -264,14 +287,28 @@ int udc_request_queue(udc_endpoint_t *ept, struct udc_request *_req)
     if (!USB.online && ept->num) {
         ret = -1;
     } else if (ept->req) {
-        // already a transfer in flight, add us to the list
-        // we'll get queue'd by the irq handler when it's our turn
+        // already transfers in flight, link our dtd on behind them so the
+        // controller moves straight on to it without waiting for the irq
         ept->last->next = req;
-    } else {
-        ept->head->next_dtd = (unsigned) dtd;
-        ept->head->dtd_config = 0;
+        ept->last->dtd->next_dtd = (unsigned) dtd;
         DSB;
-        writel(ept->bit, ept->usb->base + USB_ENDPTPRIME);
+
+        if (!(readl(ept->usb->base + USB_ENDPTPRIME) & ept->bit)) {
+            // per the databook, use the add dtd tripwire to safely check
+            // whether the controller already ran off the end of the list
+            unsigned stat;
+            do {
+                writel(readl(ept->usb->base + USB_CMD) | CMD_ATDTW, ept->usb->base + USB_CMD);
+                stat = readl(ept->usb->base + USB_ENDPTSTAT);
+            } while (!(readl(ept->usb->base + USB_CMD) & CMD_ATDTW));
+            writel(readl(ept->usb->base + USB_CMD) & ~CMD_ATDTW, ept->usb->base + USB_CMD);
+
+            if (!(stat & ept->bit)) {
+                endpoint_restart(ept);
+            }
+        }
+    } else {
+        endpoint_prime(ept, req);
         ept->req = req;
     }
     ept->last = req;
@@ -281,41 +318,59 @@ int udc_request_queue(udc_endpoint_t *ept, struct udc_request *_req)
     return ret;
 }
 
-static void handle_ept_complete(struct udc_endpoint *ept)
+static void request_complete(struct udc_endpoint *ept, usb_request_t *req)
 {
-    usb_request_t *req;
-    usb_dtd_t *dtd;
+    usb_dtd_t *dtd = req->dtd;
     unsigned actual;
     int status;
 
+    if (dtd->config & 0xff) {
+        actual = 0;
+        status = -1;
+        dprintf(INFO, "EP%d/%s FAIL nfo=%x pg0=%x\n",
+                ept->num, ept->in ? "in" : "out", dtd->config, dtd->bptr0);
+    } else {
+        actual = req->req.length - ((dtd->config >> 16) & 0x7fff);
+        status = 0;
+    }
+    if (req->req.complete) {
+        req->req.complete(&req->req, actual, status);
+    }
+}
+
+static void handle_ept_complete(struct udc_endpoint *ept)
+{
+    usb_request_t *req;
+
     DBG("ept%d %s complete req=%p\n",
         ept->num, ept->in ? "in" : "out", ept->req);
 
-    if ((req = ept->req)) {
-        if (req->next) {
-            // queue next req to hw
-            ept->head->next_dtd = (unsigned) req->next->dtd;
-            ept->head->dtd_config = 0;
-            DSB;
-            writel(ept->bit, ept->usb->base + USB_ENDPTPRIME);
-            ept->req = req->next;
-        } else {
-            ept->req = 0;
+    // the dtds are linked, so several may have finished since the last irq
+    while ((req = ept->req) && !(req->dtd->config & DTD_ACTIVE)) {
+        ept->req = req->next;
+        if (!ept->req) {
             ept->last = 0;
         }
-        dtd = req->dtd;
-        if (dtd->config & 0xff) {
-            actual = 0;
-            status = -1;
-            dprintf(INFO, "EP%d/%s FAIL nfo=%x pg0=%x\n",
-                    ept->num, ept->in ? "in" : "out", dtd->config, dtd->bptr0);
-        } else {
-            actual = req->req.length - ((dtd->config >> 16) & 0x7fff);
-            status = 0;
-        }
-        if (req->req.complete) {
-            req->req.complete(&req->req, actual, status);
-        }
+        request_complete(ept, req);
+    }
+
+    // the controller stops at a failed dtd, carry on with the rest
+    if (ept->req && !endpoint_busy(ept)) {
+        endpoint_restart(ept);
+    }
+}
+
+// fail everything outstanding on the endpoint, once the controller has let go of it
+static void endpoint_cancel(struct udc_endpoint *ept)
+{
+    usb_request_t *req = ept->req;
+
+    ept->req = 0;
+    ept->last = 0;
+    while (req) {
+        usb_request_t *next = req->next;
+        request_complete(ept, req);
+        req = next;
     }
 }
 
@@ -552,7 +607,7 @@ void lpc43xx_USB0_IRQ(void)
         for (ept = usb->ept_list; ept; ept = ept->next) {
             if (ept->req) {
                 ept->req->dtd->config = DTD_HALTED;
-                handle_ept_complete(ept);
+                endpoint_cancel(ept);
             }
         }
     }
@@ -0,0 +1,943 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * AHCI SATA host controllers. Each port with a disk on it becomes a bio
+ * device. Reads and writes go out as native command queuing commands when
+ * the controller and drive both do it, up to a command per slot in flight,
+ * with the buffers described to the controller by PRD scatter gather lists.
+ */
+
+#include <reg.h>
+#include <debug.h>
+#include <trace.h>
+#include <assert.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <arch/ops.h>
+#include <kernel/event.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <kernel/vm.h>
+#include <lib/bio.h>
+#include <platform.h>
+#include <platform/interrupts.h>
+#include <platform/ahci.h>
+#include <platform/pc.h>
+#include <dev/pci.h>
+
+#define LOCAL_TRACE 0
+
+/* mass storage, sata, ahci 1.0 */
+#define AHCI_PCI_CLASS          0x010601
+#define AHCI_ABAR               5
+
+#define AHCI_MAX_PORTS          32
+#define AHCI_MAX_SLOTS          32
+
+/* PRD entries per command table, which keeps each table to 1KB */
+#define AHCI_PRD_MAX            56
+#define AHCI_PRD_MAX_BYTES      (4 * 1024 * 1024)
+
+/* generic host control */
+#define AHCI_CAP                0x00
+#define AHCI_GHC                0x04
+#define AHCI_IS                 0x08
+#define AHCI_PI                 0x0c
+#define AHCI_VS                 0x10
+
+#define AHCI_CAP_NP(cap)        ((cap) & 0x1f)
+#define AHCI_CAP_NCS(cap)       (((cap) >> 8) & 0x1f)
+#define AHCI_CAP_SCLO           (1u << 24)
+#define AHCI_CAP_SNCQ           (1u << 30)
+#define AHCI_CAP_S64A           (1u << 31)
+
+#define AHCI_GHC_HR             (1u << 0)
+#define AHCI_GHC_IE             (1u << 1)
+#define AHCI_GHC_AE             (1u << 31)
+
+/* per port registers */
+#define AHCI_PORT_BASE(p)       (0x100 + (p) * 0x80)
+#define AHCI_PxCLB              0x00
+#define AHCI_PxCLBU             0x04
+#define AHCI_PxFB               0x08
+#define AHCI_PxFBU              0x0c
+#define AHCI_PxIS               0x10
+#define AHCI_PxIE               0x14
+#define AHCI_PxCMD              0x18
+#define AHCI_PxTFD              0x20
+#define AHCI_PxSIG              0x24
+#define AHCI_PxSSTS             0x28
+#define AHCI_PxSCTL             0x2c
+#define AHCI_PxSERR             0x30
+#define AHCI_PxSACT             0x34
+#define AHCI_PxCI               0x38
+
+#define AHCI_PxCMD_ST           (1u << 0)
+#define AHCI_PxCMD_SUD          (1u << 1)
+#define AHCI_PxCMD_POD          (1u << 2)
+#define AHCI_PxCMD_CLO          (1u << 3)
+#define AHCI_PxCMD_FRE          (1u << 4)
+#define AHCI_PxCMD_FR           (1u << 14)
+#define AHCI_PxCMD_CR           (1u << 15)
+
+#define AHCI_PxIS_DHRS          (1u << 0)
+#define AHCI_PxIS_PSS           (1u << 1)
+#define AHCI_PxIS_SDBS          (1u << 3)
+#define AHCI_PxIS_DPS           (1u << 5)
+#define AHCI_PxIS_IFS           (1u << 27)
+#define AHCI_PxIS_HBDS          (1u << 28)
+#define AHCI_PxIS_HBFS          (1u << 29)
+#define AHCI_PxIS_TFES          (1u << 30)
+#define AHCI_PxIS_ERRORS        (AHCI_PxIS_IFS | AHCI_PxIS_HBDS | AHCI_PxIS_HBFS | AHCI_PxIS_TFES)
+
+#define AHCI_PxTFD_ERR          (1u << 0)
+#define AHCI_PxTFD_DRQ          (1u << 3)
+#define AHCI_PxTFD_BSY          (1u << 7)
+
+#define AHCI_PxSSTS_DET(s)      ((s) & 0xf)
+#define AHCI_PxSCTL_DET_MASK    0xf
+#define AHCI_PxSCTL_DET_INIT    0x1
+#define AHCI_DET_PRESENT        3
+
+#define AHCI_SIG_ATA            0x00000101
+
+/* ATA commands */
+#define ATA_CMD_READ_DMA_EXT    0x25
+#define ATA_CMD_WRITE_DMA_EXT   0x35
+#define ATA_CMD_READ_FPDMA      0x60
+#define ATA_CMD_WRITE_FPDMA     0x61
+#define ATA_CMD_FLUSH_CACHE_EXT 0xea
+#define ATA_CMD_IDENTIFY        0xec
+
+#define FIS_TYPE_REG_H2D        0x27
+#define FIS_H2D_C               0x80
+#define ATA_DEVICE_LBA          0x40
+
+/* command list entry */
+struct ahci_cmd_header {
+    uint16_t flags;     /* fis length in dwords, write, etc */
+    uint16_t prdtl;     /* PRD entries */
+    uint32_t prdbc;     /* bytes transferred */
+    uint32_t ctba;
+    uint32_t ctbau;
+    uint32_t reserved[4];
+} __PACKED;
+
+#define AHCI_CMD_FLAGS_CFL(dw)  ((dw) & 0x1f)
+#define AHCI_CMD_FLAGS_W        (1u << 6)
+
+struct ahci_prd {
+    uint32_t dba;
+    uint32_t dbau;
+    uint32_t reserved;
+    uint32_t dbc;       /* byte count - 1, bit 31 asks for an interrupt */
+} __PACKED;
+
+struct ahci_cmd_table {
+    uint8_t cfis[64];
+    uint8_t acmd[16];
+    uint8_t reserved[48];
+    struct ahci_prd prdt[AHCI_PRD_MAX];
+} __PACKED;
+
+STATIC_ASSERT(sizeof(struct ahci_cmd_header) == 32);
+STATIC_ASSERT(sizeof(struct ahci_cmd_table) == 1024);
+
+/* per port dma memory: command list, received fis area, then a table per slot */
+#define AHCI_CMD_LIST_OFFSET    0
+#define AHCI_RX_FIS_OFFSET      1024
+#define AHCI_CMD_TABLE_OFFSET   4096
+#define AHCI_PORT_DMA_PAGES     ((AHCI_CMD_TABLE_OFFSET + AHCI_MAX_SLOTS * sizeof(struct ahci_cmd_table)) / PAGE_SIZE)
+
+/* completion of a command, called from the irq handler */
+typedef void (*ahci_done_t)(void *arg, status_t err);
+
+struct ahci_txn {
+    ahci_done_t done;
+    void *done_arg;
+};
+
+struct ahci_hba;
+
+struct ahci_port {
+    struct ahci_hba *hba;
+    uint num;
+    volatile uint32_t *regs;
+
+    /* protects the slots */
+    spin_lock_t lock;
+
+    /* signaled as slots free up, for submitters waiting on a full port */
+    event_t slot_event;
+
+    /* slots handed to the controller, and whether one of them is a non queued command */
+    uint32_t inflight;
+    bool exclusive;
+
+    /* an error stopped the port, nothing is issued until the recovery thread restarts it */
+    bool recovering;
+    event_t recover_event;
+
+    uint slots;
+    bool ncq;
+
+    uint8_t *dma;
+    paddr_t dma_pa;
+    struct ahci_cmd_header *cmd_list;
+    struct ahci_cmd_table *tables;
+
+    struct ahci_txn txns[AHCI_MAX_SLOTS];
+
+    bdev_t bdev;
+};
+
+struct ahci_hba {
+    volatile uint8_t *abar;
+    uint32_t cap;
+    struct ahci_port *ports[AHCI_MAX_PORTS];
+};
+
+static uint ahci_found;
+
+static inline uint32_t hba_read(struct ahci_hba *hba, uint reg)
+{
+    return *REG32(hba->abar + reg);
+}
+
+static inline void hba_write(struct ahci_hba *hba, uint reg, uint32_t val)
+{
+    *REG32(hba->abar + reg) = val;
+}
+
+static inline uint32_t port_read(struct ahci_port *port, uint reg)
+{
+    return port->regs[reg / 4];
+}
+
+static inline void port_write(struct ahci_port *port, uint reg, uint32_t val)
+{
+    port->regs[reg / 4] = val;
+}
+
+/* spin until (reg & mask) == val, for up to timeout_ms */
+static status_t port_wait(struct ahci_port *port, uint reg, uint32_t mask, uint32_t val, uint timeout_ms)
+{
+    lk_time_t start = current_time();
+    while ((port_read(port, reg) & mask) != val) {
+        if (current_time() - start > timeout_ms)
+            return ERR_TIMED_OUT;
+    }
+    return NO_ERROR;
+}
+
+static status_t ahci_port_stop(struct ahci_port *port)
+{
+    uint32_t cmd = port_read(port, AHCI_PxCMD);
+    port_write(port, AHCI_PxCMD, cmd & ~AHCI_PxCMD_ST);
+    if (port_wait(port, AHCI_PxCMD, AHCI_PxCMD_CR, 0, 500) < 0)
+        return ERR_TIMED_OUT;
+
+    cmd = port_read(port, AHCI_PxCMD);
+    port_write(port, AHCI_PxCMD, cmd & ~AHCI_PxCMD_FRE);
+    return port_wait(port, AHCI_PxCMD, AHCI_PxCMD_FR, 0, 500);
+}
+
+static void ahci_port_start(struct ahci_port *port)
+{
+    uint32_t cmd = port_read(port, AHCI_PxCMD);
+    port_write(port, AHCI_PxCMD, cmd | AHCI_PxCMD_FRE);
+    port_write(port, AHCI_PxCMD, cmd | AHCI_PxCMD_FRE | AHCI_PxCMD_ST);
+}
+
+/* carve the next physically contiguous run off the front of a buffer */
+static size_t ahci_next_seg(vaddr_t *va, size_t *len, paddr_t *pa)
+{
+    *pa = vaddr_to_paddr((void *)*va);
+
+    /* the rest of the first page, then as many whole pages as follow it in physical memory */
+    size_t seg = MIN(PAGE_ALIGN(*va + 1) - *va, *len);
+    while (seg < *len && seg < AHCI_PRD_MAX_BYTES && vaddr_to_paddr((void *)(*va + seg)) == *pa + seg)
+        seg += MIN(*len - seg, PAGE_SIZE);
+    seg = MIN(seg, AHCI_PRD_MAX_BYTES);
+
+    *va += seg;
+    *len -= seg;
+
+    return seg;
+}
+
+/* fill in a register host to device fis */
+static void ahci_build_fis(uint8_t *fis, uint8_t command, uint64_t lba, uint count, uint tag, bool ncq)
+{
+    memset(fis, 0, 20);
+    fis[0] = FIS_TYPE_REG_H2D;
+    fis[1] = FIS_H2D_C;
+    fis[2] = command;
+    fis[4] = lba;
+    fis[5] = lba >> 8;
+    fis[6] = lba >> 16;
+    fis[7] = ATA_DEVICE_LBA;
+    fis[8] = lba >> 24;
+    fis[9] = lba >> 32;
+    fis[10] = lba >> 40;
+
+    if (ncq) {
+        /* the sector count moves to the features field and the tag takes its place */
+        fis[3] = count;
+        fis[11] = count >> 8;
+        fis[12] = tag << 3;
+    } else {
+        fis[12] = count;
+        fis[13] = count >> 8;
+    }
+}
+
+/*
+ * queue a command with the iovecs as its data, calling done from the irq handler
+ * when it finishes. queued commands run alongside each other, anything else waits
+ * for the port to go idle and has it to itself. may block waiting for a slot.
+ */
+static status_t ahci_queue(struct ahci_port *port, uint8_t command, bool write, bool queued,
+                           uint64_t lba, uint count, const bio_iovec_t *iov, uint iov_count,
+                           ahci_done_t done, void *done_arg)
+{
+    LTRACEF("port %u, command 0x%x, lba 0x%llx, count %u, iov_count %u\n",
+            port->num, command, lba, count, iov_count);
+
+    bool s64a = port->hba->cap & AHCI_CAP_S64A;
+
+    /* check the buffers fit a PRD table and the controller can reach them */
+    uint seg_count = 0;
+    paddr_t pa;
+    for (uint n = 0; n < iov_count; n++) {
+        if (((uintptr_t)iov[n].base | iov[n].len) & 1)
+            return ERR_INVALID_ARGS;
+
+        vaddr_t va = (vaddr_t)iov[n].base;
+        size_t remaining = iov[n].len;
+        while (remaining > 0) {
+            size_t seg = ahci_next_seg(&va, &remaining, &pa);
+            if (!s64a && (uint64_t)pa + seg > 0x100000000ULL)
+                return ERR_NOT_SUPPORTED;
+            seg_count++;
+        }
+    }
+    if (seg_count > AHCI_PRD_MAX)
+        return ERR_TOO_BIG;
+
+    /* wait for a slot, or for the port to drain if this one can't be queued */
+    uint32_t slot_mask = (port->slots == 32) ? 0xffffffff : ((1u << port->slots) - 1);
+    uint tag;
+    spin_lock_saved_state_t state;
+    for (;;) {
+        spin_lock_irqsave(&port->lock, state);
+
+        if (!port->exclusive && !port->recovering) {
+            if (queued) {
+                uint32_t free = ~port->inflight & slot_mask;
+                if (free) {
+                    tag = __builtin_ctz(free);
+                    break;
+                }
+            } else if (port->inflight == 0) {
+                tag = 0;
+                port->exclusive = true;
+                break;
+            }
+        }
+
+        spin_unlock_irqrestore(&port->lock, state);
+        event_wait(&port->slot_event);
+    }
+
+    struct ahci_txn *txn = &port->txns[tag];
+    DEBUG_ASSERT(txn->done == NULL);
+    txn->done = done;
+    txn->done_arg = done_arg;
+
+    /* the command table for the slot */
+    struct ahci_cmd_table *table = &port->tables[tag];
+    ahci_build_fis(table->cfis, command, lba, count, tag, queued);
+
+    uint prd = 0;
+    for (uint n = 0; n < iov_count; n++) {
+        vaddr_t va = (vaddr_t)iov[n].base;
+        size_t remaining = iov[n].len;
+        while (remaining > 0) {
+            size_t seg = ahci_next_seg(&va, &remaining, &pa);
+            table->prdt[prd].dba = (uint32_t)pa;
+            table->prdt[prd].dbau = (uint64_t)pa >> 32;
+            table->prdt[prd].reserved = 0;
+            table->prdt[prd].dbc = seg - 1;
+            prd++;
+        }
+    }
+
+    struct ahci_cmd_header *hdr = &port->cmd_list[tag];
+    hdr->flags = AHCI_CMD_FLAGS_CFL(5) | (write ? AHCI_CMD_FLAGS_W : 0);
+    hdr->prdtl = prd;
+    hdr->prdbc = 0;
+
+    /* make the tables visible before the controller is told about them */
+    mb();
+
+    port->inflight |= (1u << tag);
+    if (queued)
+        port_write(port, AHCI_PxSACT, 1u << tag);
+    port_write(port, AHCI_PxCI, 1u << tag);
+
+    spin_unlock_irqrestore(&port->lock, state);
+
+    return NO_ERROR;
+}
+
+/* a synchronous command, waited on by the caller */
+struct ahci_wait {
+    event_t event;
+    volatile int pending;
+    status_t err;
+};
+
+static void ahci_wait_done(void *arg, status_t err)
+{
+    struct ahci_wait *wait = (struct ahci_wait *)arg;
+
+    if (err < 0)
+        wait->err = err;
+    if (atomic_add(&wait->pending, -1) == 1)
+        event_signal(&wait->event, false);
+}
+
+static status_t ahci_command(struct ahci_port *port, uint8_t command, bool write, uint64_t lba, uint count,
+                             void *buf, size_t len)
+{
+    struct ahci_wait wait;
+    event_init(&wait.event, false, 0);
+    wait.pending = 1;
+    wait.err = NO_ERROR;
+
+    bio_iovec_t iov = { .base = buf, .len = len };
+    status_t err = ahci_queue(port, command, write, false, lba, count, &iov, buf ? 1 : 0,
+                              ahci_wait_done, &wait);
+    if (err == NO_ERROR) {
+        event_wait(&wait.event);
+        err = wait.err;
+    }
+
+    event_destroy(&wait.event);
+
+    return err;
+}
+
+/* take every command off the port, for recovery to fail them */
+static uint ahci_port_take_all(struct ahci_port *port, struct ahci_txn *done)
+{
+    uint done_count = 0;
+    for (uint32_t m = port->inflight; m; m &= m - 1) {
+        uint tag = __builtin_ctz(m);
+        done[done_count++] = port->txns[tag];
+        port->txns[tag].done = NULL;
+    }
+    port->inflight = 0;
+    port->exclusive = false;
+
+    return done_count;
+}
+
+/*
+ * Bring a port back after an error. Runs on the port's own thread, since
+ * stopping the engine and resetting the link can take up to a second or so.
+ * A failed queued command aborts the rest of the queue on the drive, so
+ * everything in flight is failed. Finding out which command actually failed
+ * would take a READ LOG EXT of the ncq error log.
+ */
+static void ahci_port_recover(struct ahci_port *port)
+{
+    TRACEF("port %u error, tfd 0x%x serr 0x%x\n", port->num,
+           port_read(port, AHCI_PxTFD), port_read(port, AHCI_PxSERR));
+
+    /* the engine has to be idle before anything else can be touched */
+    port_write(port, AHCI_PxCMD, port_read(port, AHCI_PxCMD) & ~AHCI_PxCMD_ST);
+    if (port_wait(port, AHCI_PxCMD, AHCI_PxCMD_CR, 0, 500) < 0)
+        TRACEF("port %u: command engine won't stop\n", port->num);
+
+    /* a drive left busy needs a command list override to take new commands, or
+     * a link reset (COMRESET) if the hba can't do that or it doesn't help */
+    uint32_t busy = AHCI_PxTFD_BSY | AHCI_PxTFD_DRQ;
+    if ((port_read(port, AHCI_PxTFD) & busy) && (port->hba->cap & AHCI_CAP_SCLO)) {
+        port_write(port, AHCI_PxCMD, port_read(port, AHCI_PxCMD) | AHCI_PxCMD_CLO);
+        port_wait(port, AHCI_PxCMD, AHCI_PxCMD_CLO, 0, 500);
+    }
+    if (port_read(port, AHCI_PxTFD) & busy) {
+        LTRACEF("port %u: comreset\n", port->num);
+
+        uint32_t sctl = port_read(port, AHCI_PxSCTL) & ~AHCI_PxSCTL_DET_MASK;
+        port_write(port, AHCI_PxSCTL, sctl | AHCI_PxSCTL_DET_INIT);
+        thread_sleep(2); /* at least 1ms of reset on the wire */
+        port_write(port, AHCI_PxSCTL, sctl);
+
+        if (port_wait(port, AHCI_PxSSTS, 0xf, AHCI_DET_PRESENT, 1000) < 0 ||
+                port_wait(port, AHCI_PxTFD, busy, 0, 1000) < 0)
+            TRACEF("port %u: drive didn't come back, tfd 0x%x\n", port->num, port_read(port, AHCI_PxTFD));
+    }
+
+    port_write(port, AHCI_PxSERR, 0xffffffff);
+    port_write(port, AHCI_PxIS, 0xffffffff);
+
+    /* fail everything that was in flight */
+    struct ahci_txn done[AHCI_MAX_SLOTS];
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&port->lock, state);
+    uint done_count = ahci_port_take_all(port, done);
+    spin_unlock_irqrestore(&port->lock, state);
+
+    for (uint i = 0; i < done_count; i++) {
+        DEBUG_ASSERT(done[i].done);
+        done[i].done(done[i].done_arg, ERR_IO);
+    }
+
+    /* and start taking commands again */
+    spin_lock_irqsave(&port->lock, state);
+    ahci_port_start(port);
+    port_write(port, AHCI_PxIE, AHCI_PxIS_DHRS | AHCI_PxIS_PSS | AHCI_PxIS_SDBS | AHCI_PxIS_DPS |
+               AHCI_PxIS_ERRORS);
+    port->recovering = false;
+    spin_unlock_irqrestore(&port->lock, state);
+
+    event_signal(&port->slot_event, true);
+}
+
+static int ahci_port_recover_thread(void *arg)
+{
+    struct ahci_port *port = (struct ahci_port *)arg;
+
+    for (;;) {
+        event_wait(&port->recover_event);
+        ahci_port_recover(port);
+    }
+
+    return 0;
+}
+
+static enum handler_return ahci_port_irq(struct ahci_port *port)
+{
+    uint32_t is = port_read(port, AHCI_PxIS);
+    port_write(port, AHCI_PxIS, is);
+
+    LTRACEF("port %u, is 0x%x\n", port->num, is);
+
+    spin_lock(&port->lock);
+
+    /* the recovery thread owns the port until it restarts it */
+    if (port->recovering) {
+        spin_unlock(&port->lock);
+        return INT_NO_RESCHEDULE;
+    }
+
+    if (is & AHCI_PxIS_ERRORS) {
+        /* quiet the port and leave the slow part to its thread */
+        port_write(port, AHCI_PxIE, 0);
+        port->recovering = true;
+        spin_unlock(&port->lock);
+
+        event_signal(&port->recover_event, false);
+        return INT_RESCHEDULE;
+    }
+
+    /* queued commands leave SACT as they finish, the rest leave CI */
+    uint32_t done_mask = port->inflight & ~(port_read(port, AHCI_PxSACT) | port_read(port, AHCI_PxCI));
+
+    struct ahci_txn done[AHCI_MAX_SLOTS];
+    uint done_count = 0;
+    for (uint32_t m = done_mask; m; m &= m - 1) {
+        uint tag = __builtin_ctz(m);
+        done[done_count++] = port->txns[tag];
+        port->txns[tag].done = NULL;
+    }
+    port->inflight &= ~done_mask;
+    if (port->inflight == 0)
+        port->exclusive = false;
+
+    spin_unlock(&port->lock);
+
+    if (done_count == 0)
+        return INT_NO_RESCHEDULE;
+
+    /* complete the commands, and wake anyone waiting for a slot */
+    for (uint i = 0; i < done_count; i++) {
+        DEBUG_ASSERT(done[i].done);
+        done[i].done(done[i].done_arg, NO_ERROR);
+    }
+    event_signal(&port->slot_event, false);
+
+    return INT_RESCHEDULE;
+}
+
+static enum handler_return ahci_irq(void *arg)
+{
+    struct ahci_hba *hba = (struct ahci_hba *)arg;
+    enum handler_return ret = INT_NO_RESCHEDULE;
+
+    uint32_t is = hba_read(hba, AHCI_IS);
+    for (uint32_t m = is; m; m &= m - 1) {
+        uint p = __builtin_ctz(m);
+        if (hba->ports[p])
+            ret |= ahci_port_irq(hba->ports[p]);
+        else
+            *REG32(hba->abar + AHCI_PORT_BASE(p) + AHCI_PxIS) = 0xffffffff;
+    }
+
+    /* the port bits only clear once the ports' own status has been */
+    hba_write(hba, AHCI_IS, is);
+
+    return ret;
+}
+
+/* bytes of buffer at va that fit one command's PRD table, at a page per entry at worst */
+static size_t ahci_piece_len(vaddr_t va, size_t len)
+{
+    vaddr_t end = ROUNDDOWN(va, PAGE_SIZE) + (AHCI_PRD_MAX - 1) * PAGE_SIZE;
+
+    return MIN(len, end - va);
+}
+
+static ssize_t ahci_read_write(struct ahci_port *port, void *buf, bnum_t block, uint count, bool write)
+{
+    struct ahci_wait wait;
+    event_init(&wait.event, false, 0);
+    wait.pending = 1;
+    wait.err = NO_ERROR;
+
+    /* controllers only do 16 bit aligned dma, so odd buffers go through a bounce buffer */
+    size_t len = (size_t)count * port->bdev.block_size;
+    void *bounce = NULL;
+    if ((uintptr_t)buf & 1) {
+        bounce = memalign(PAGE_SIZE, len);
+        if (!bounce)
+            return ERR_NO_MEMORY;
+        if (write)
+            memcpy(bounce, buf, len);
+    }
+
+    /* queue as many commands as it takes, then wait for all of them */
+    uint8_t command = port->ncq ? (write ? ATA_CMD_WRITE_FPDMA : ATA_CMD_READ_FPDMA)
+                      : (write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT);
+    vaddr_t va = (vaddr_t)(bounce ? bounce : buf);
+    size_t remaining = len;
+    bnum_t lba = block;
+    while (remaining > 0) {
+        size_t piece = ahci_piece_len(va, remaining);
+        piece = ROUNDDOWN(piece, port->bdev.block_size);
+        if (piece == 0)
+            piece = MIN(remaining, port->bdev.block_size);
+        bio_iovec_t iov = { .base = (void *)va, .len = piece };
+        uint blocks = piece >> port->bdev.block_shift;
+
+        atomic_add(&wait.pending, 1);
+        status_t err = ahci_queue(port, command, write, port->ncq, lba, blocks, &iov, 1,
+                                  ahci_wait_done, &wait);
+        if (err < 0) {
+            wait.err = err;
+            atomic_add(&wait.pending, -1);
+            break;
+        }
+
+        va += piece;
+        lba += blocks;
+        remaining -= piece;
+    }
+
+    if (atomic_add(&wait.pending, -1) != 1)
+        event_wait(&wait.event);
+
+    event_destroy(&wait.event);
+
+    if (bounce) {
+        if (!write && wait.err == NO_ERROR)
+            memcpy(buf, bounce, len);
+        free(bounce);
+    }
+
+    return (wait.err < 0) ? wait.err : (ssize_t)len;
+}
+
+static ssize_t ahci_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count)
+{
+    struct ahci_port *port = containerof(bdev, struct ahci_port, bdev);
+
+    LTRACEF("port %u, buf %p, block 0x%x, count %u\n", port->num, buf, block, count);
+
+    return ahci_read_write(port, buf, block, count, false);
+}
+
+static ssize_t ahci_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t block, uint count)
+{
+    struct ahci_port *port = containerof(bdev, struct ahci_port, bdev);
+
+    LTRACEF("port %u, buf %p, block 0x%x, count %u\n", port->num, buf, block, count);
+
+    return ahci_read_write(port, (void *)buf, block, count, true);
+}
+
+static status_t ahci_bdev_flush(struct bdev *bdev)
+{
+    struct ahci_port *port = containerof(bdev, struct ahci_port, bdev);
+
+    return ahci_command(port, ATA_CMD_FLUSH_CACHE_EXT, false, 0, 0, NULL, 0);
+}
+
+static status_t ahci_bdev_submit(struct bdev *bdev, bio_request_t *req)
+{
+    struct ahci_port *port = containerof(bdev, struct ahci_port, bdev);
+
+    LTRACEF("port %u, req %p, block 0x%x, count %u\n", port->num, req, req->block, req->count);
+
+    uint8_t command = port->ncq ? (req->write ? ATA_CMD_WRITE_FPDMA : ATA_CMD_READ_FPDMA)
+                      : (req->write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT);
+
+    return ahci_queue(port, command, req->write, port->ncq, req->block, req->count,
+                      req->iov, req->iov_count, bio_request_complete_status, req);
+}
+
+/* identify the drive on a running port and publish it */
+static status_t ahci_port_identify(struct ahci_port *port)
+{
+    uint16_t *id = memalign(16, 512);
+    if (!id)
+        return ERR_NO_MEMORY;
+
+    status_t err = ahci_command(port, ATA_CMD_IDENTIFY, false, 0, 0, id, 512);
+    if (err < 0) {
+        free(id);
+        return err;
+    }
+
+    /* lba48 is required, it's what the dma and fpdma commands take */
+    if (!(id[83] & (1u << 10))) {
+        TRACEF("port %u: drive doesn't do lba48\n", port->num);
+        free(id);
+        return ERR_NOT_SUPPORTED;
+    }
+    uint64_t sectors = id[100] | ((uint64_t)id[101] << 16) | ((uint64_t)id[102] << 32) |
+                       ((uint64_t)id[103] << 48);
+
+    /* logical sectors larger than 512 bytes, in words */
+    size_t block_size = 512;
+    if ((id[106] & 0xc000) == 0x4000 && (id[106] & (1u << 12)))
+        block_size = ((uint32_t)id[117] | ((uint32_t)id[118] << 16)) * 2;
+
+    /* ncq needs the controller and the drive, and a depth of the lesser of the two */
+    bool drive_ncq = id[76] != 0xffff && (id[76] & (1u << 8));
+    uint drive_depth = (id[75] & 0x1f) + 1;
+    free(id);
+
+    port->ncq = (port->hba->cap & AHCI_CAP_SNCQ) && drive_ncq;
+    if (port->ncq)
+        port->slots = MIN(port->slots, drive_depth);
+
+    if (sectors > UINT32_MAX) {
+        /* bnum_t is 32 bits */
+        sectors = UINT32_MAX;
+    }
+
+    char name[16];
+    snprintf(name, sizeof(name), "ahci%u", ahci_found++);
+    bio_initialize_bdev(&port->bdev, name, block_size, sectors, 0, NULL, BIO_FLAGS_NONE);
+
+    port->bdev.read_block = &ahci_bdev_read_block;
+    port->bdev.write_block = &ahci_bdev_write_block;
+    port->bdev.submit = &ahci_bdev_submit;
+    port->bdev.flush = &ahci_bdev_flush;
+    port->bdev.max_queue_depth = port->ncq ? port->slots : 1;
+
+    /* merge adjacent requests, and keep the drive's queue full */
+    bio_queue_attach(&port->bdev, 0, 0);
+
+    bio_register_device(&port->bdev);
+
+    printf("ahci port %u: %s, %llu sectors of %zu bytes, %s depth %u\n", port->num, name,
+           sectors, block_size, port->ncq ? "ncq" : "no ncq", port->bdev.max_queue_depth);
+
+    return NO_ERROR;
+}
+
+static status_t ahci_port_init(struct ahci_hba *hba, uint num)
+{
+    struct ahci_port *port = calloc(1, sizeof(struct ahci_port));
+    if (!port)
+        return ERR_NO_MEMORY;
+
+    port->hba = hba;
+    port->num = num;
+    port->regs = (volatile uint32_t *)(hba->abar + AHCI_PORT_BASE(num));
+    port->lock = SPIN_LOCK_INITIAL_VALUE;
+    port->slots = AHCI_CAP_NCS(hba->cap) + 1;
+    event_init(&port->slot_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    event_init(&port->recover_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+    /* anything other than a disk with the link up is left alone */
+    uint32_t ssts = port_read(port, AHCI_PxSSTS);
+    uint32_t sig = port_read(port, AHCI_PxSIG);
+    LTRACEF("port %u ssts 0x%x sig 0x%x\n", num, ssts, sig);
+    if (AHCI_PxSSTS_DET(ssts) != AHCI_DET_PRESENT || sig != AHCI_SIG_ATA) {
+        free(port);
+        return ERR_NOT_FOUND;
+    }
+
+    if (ahci_port_stop(port) < 0) {
+        TRACEF("port %u won't stop\n", num);
+        free(port);
+        return ERR_TIMED_OUT;
+    }
+
+    /* command list, received fises and command tables, physically contiguous */
+    port->dma = pmm_alloc_kpages(AHCI_PORT_DMA_PAGES, NULL);
+    if (!port->dma) {
+        free(port);
+        return ERR_NO_MEMORY;
+    }
+    memset(port->dma, 0, AHCI_PORT_DMA_PAGES * PAGE_SIZE);
+    port->dma_pa = vaddr_to_paddr(port->dma);
+    port->cmd_list = (struct ahci_cmd_header *)(port->dma + AHCI_CMD_LIST_OFFSET);
+    port->tables = (struct ahci_cmd_table *)(port->dma + AHCI_CMD_TABLE_OFFSET);
+
+    if (!(hba->cap & AHCI_CAP_S64A) && (uint64_t)port->dma_pa + AHCI_PORT_DMA_PAGES * PAGE_SIZE > 0x100000000ULL) {
+        TRACEF("port %u: no memory below 4GB for the command list\n", num);
+        pmm_free_kpages(port->dma, AHCI_PORT_DMA_PAGES);
+        free(port);
+        return ERR_NO_MEMORY;
+    }
+
+    for (uint i = 0; i < AHCI_MAX_SLOTS; i++) {
+        uint64_t pa = port->dma_pa + AHCI_CMD_TABLE_OFFSET + i * sizeof(struct ahci_cmd_table);
+        port->cmd_list[i].ctba = (uint32_t)pa;
+        port->cmd_list[i].ctbau = pa >> 32;
+    }
+
+    uint64_t clb = port->dma_pa + AHCI_CMD_LIST_OFFSET;
+    uint64_t fb = port->dma_pa + AHCI_RX_FIS_OFFSET;
+    port_write(port, AHCI_PxCLB, (uint32_t)clb);
+    port_write(port, AHCI_PxCLBU, clb >> 32);
+    port_write(port, AHCI_PxFB, (uint32_t)fb);
+    port_write(port, AHCI_PxFBU, fb >> 32);
+
+    port_write(port, AHCI_PxSERR, 0xffffffff);
+    port_write(port, AHCI_PxIS, 0xffffffff);
+    port_write(port, AHCI_PxIE, AHCI_PxIS_DHRS | AHCI_PxIS_PSS | AHCI_PxIS_SDBS | AHCI_PxIS_DPS |
+               AHCI_PxIS_ERRORS);
+
+    /* the drive has to be idle before commands go to it */
+    if (port_wait(port, AHCI_PxTFD, AHCI_PxTFD_BSY | AHCI_PxTFD_DRQ, 0, 1000) < 0)
+        TRACEF("port %u: drive still busy, tfd 0x%x\n", num, port_read(port, AHCI_PxTFD));
+
+    char name[32];
+    snprintf(name, sizeof(name), "ahci%u recover", num);
+    thread_t *t = thread_create(name, ahci_port_recover_thread, port, HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+    if (!t) {
+        pmm_free_kpages(port->dma, AHCI_PORT_DMA_PAGES);
+        free(port);
+        return ERR_NO_MEMORY;
+    }
+    thread_detach_and_resume(t);
+
+    hba->ports[num] = port;
+    ahci_port_start(port);
+
+    return NO_ERROR;
+}
+
+static status_t ahci_hba_init(const pci_location_t *loc)
+{
+    uint32_t bar;
+    pci_read_config_word(loc, PCI_CONFIG_BASE_ADDRESSES + AHCI_ABAR * 4, &bar);
+    if ((bar & 0x1) || (bar & ~0xfu) == 0)
+        return ERR_NOT_FOUND;
+
+    struct ahci_hba *hba = calloc(1, sizeof(struct ahci_hba));
+    if (!hba)
+        return ERR_NO_MEMORY;
+
+    /* the generic registers and all 32 ports' */
+    paddr_t pa = bar & ~0xfu;
+    void *ptr;
+    status_t err = vmm_alloc_physical(vmm_get_kernel_aspace(), "ahci", ROUNDUP(AHCI_PORT_BASE(AHCI_MAX_PORTS), PAGE_SIZE),
+                                      &ptr, 0, ROUNDDOWN(pa, PAGE_SIZE), 0, ARCH_MMU_FLAG_UNCACHED_DEVICE);
+    if (err < 0) {
+        free(hba);
+        return err;
+    }
+    hba->abar = (uint8_t *)ptr + (pa - ROUNDDOWN(pa, PAGE_SIZE));
+
+    uint16_t command;
+    pci_read_config_half(loc, PCI_CONFIG_COMMAND, &command);
+    pci_write_config_half(loc, PCI_CONFIG_COMMAND, command | PCI_COMMAND_MEM_EN | PCI_COMMAND_BUS_MASTER_EN);
+
+    hba_write(hba, AHCI_GHC, hba_read(hba, AHCI_GHC) | AHCI_GHC_AE);
+    hba->cap = hba_read(hba, AHCI_CAP);
+    uint32_t pi = hba_read(hba, AHCI_PI);
+
+    dprintf(INFO, "ahci: version 0x%x, cap 0x%x, ports 0x%x\n", hba_read(hba, AHCI_VS), hba->cap, pi);
+
+    /* a message of its own if the platform can, the INTx line otherwise */
+    uint vector;
+    if (pci_enable_msi(loc, &vector) != _PCI_SUCCESSFUL) {
+        if (pci_get_irq_vector(loc, &vector) != _PCI_SUCCESSFUL) {
+            TRACEF("ahci controller has no interrupt\n");
+            free(hba);
+            return ERR_NOT_SUPPORTED;
+        }
+    }
+    register_int_handler(vector, &ahci_irq, hba);
+
+    for (uint p = 0; p < AHCI_MAX_PORTS; p++) {
+        if (pi & (1u << p))
+            ahci_port_init(hba, p);
+    }
+
+    hba_write(hba, AHCI_IS, 0xffffffff);
+    hba_write(hba, AHCI_GHC, hba_read(hba, AHCI_GHC) | AHCI_GHC_IE);
+    unmask_interrupt(vector);
+
+    /* identify needs the interrupt to complete */
+    for (uint p = 0; p < AHCI_MAX_PORTS; p++) {
+        if (hba->ports[p])
+            ahci_port_identify(hba->ports[p]);
+    }
+
+    return NO_ERROR;
+}
+
+int ahci_init(void)
+{
+    pci_location_t loc;
+    for (uint16_t index = 0; pci_find_pci_class_code(&loc, AHCI_PCI_CLASS, index) == _PCI_SUCCESSFUL; index++) {
+        LTRACEF("ahci controller at %02x:%02x.%u\n", loc.bus, loc.dev_fn >> 3, loc.dev_fn & 7);
+        ahci_hba_init(&loc);
+    }
+
+    return ahci_found;
+}
@@ -30,7 +30,7 @@
 /* NOTE: keep arch/x86/crt0.S in sync with these definitions */
 
 /* interrupts */
-#define INT_VECTORS 0x31
+#define INT_VECTORS 0x50
 
 /* defined interrupts */
 #define INT_BASE            0x20
@@ -47,6 +47,11 @@
 /* APIC vectors */
 #define INT_APIC_TIMER      0x22
 
+/* 0x30 is the syscall gate, message signalled interrupts are handed out above it */
+#define INT_MSI_BASE        0x31
+#define INT_MSI_COUNT       0x1e
+#define INT_APIC_SPURIOUS   0x4f
+
 /* PIC remap bases */
 #define PIC1_BASE 0x20
 #define PIC2_BASE 0x28
@@ -27,6 +27,8 @@
 #include <reg.h>
 #include <assert.h>
 #include <kernel/thread.h>
+#include <kernel/debug.h>
+#include <lib/prof.h>
 #include <platform/interrupts.h>
 #include <arch/ops.h>
 #include <arch/x86.h>
@@ -56,6 +58,9 @@ struct int_handler_struct {
 
 static struct int_handler_struct int_handler_table[INT_VECTORS];
 
+/* msi vectors handed out so far, they are never given back */
+static uint msi_allocated;
+
 /*
  * Cached IRQ mask (enabled/disabled)
  */
@@ -213,6 +218,14 @@ enum handler_return platform_irq(x86_iframe_t *frame)
 
     DEBUG_ASSERT(vector >= 0x20);
 
+    KEVLOG_IRQ_ENTER(vector);
+
+    // spurious apic interrupts are not acked
+    if (vector == INT_APIC_SPURIOUS) {
+        KEVLOG_IRQ_EXIT(vector);
+        return INT_NO_RESCHEDULE;
+    }
+
     // deliver the interrupt
     enum handler_return ret = INT_NO_RESCHEDULE;
 
@@ -220,11 +233,47 @@ enum handler_return platform_irq(x86_iframe_t *frame)
         ret = int_handler_table[vector].handler(int_handler_table[vector].arg);
 
     // ack the interrupt
-    issueEOI(vector);
+    if (vector >= INT_MSI_BASE && vector < INT_MSI_BASE + INT_MSI_COUNT)
+        lapic_eoi();
+    else
+        issueEOI(vector);
+
+    KEVLOG_IRQ_EXIT(vector);
+
+    prof_irq_sample(frame->ip, frame->bp);
 
     return ret;
 }
 
+status_t platform_alloc_msi_vector(uint *vector, uint64_t *addr, uint32_t *data)
+{
+    if (!lapic_present())
+        return ERR_NOT_SUPPORTED;
+
+    /* physical destination mode needs an 8 bit apic id without interrupt remapping */
+    if (lapic_id() > 0xff)
+        return ERR_NOT_SUPPORTED;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&lock, state);
+
+    uint v = msi_allocated;
+    if (v < INT_MSI_COUNT)
+        msi_allocated++;
+
+    spin_unlock_irqrestore(&lock, state);
+
+    if (v >= INT_MSI_COUNT)
+        return ERR_NO_RESOURCES;
+
+    /* fixed delivery, edge triggered, to the boot cpu */
+    *vector = INT_MSI_BASE + v;
+    *addr = 0xfee00000 | (lapic_id() << 12);
+    *data = *vector;
+
+    return NO_ERROR;
+}
+
 void register_int_handler(unsigned int vector, int_handler handler, void *arg)
 {
     if (vector >= INT_VECTORS)
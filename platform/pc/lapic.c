@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <debug.h>
+#include <err.h>
+#include <reg.h>
+#include <trace.h>
+#include <arch/x86.h>
+#include <kernel/vm.h>
+#include "platform_p.h"
+#include <platform/pc.h>
+
+/*
+ * The boot cpu's local apic. The 8259s keep delivering the legacy lines
+ * through LINT0 in virtual wire mode, the apic is only used for message
+ * signalled interrupts, which can't go anywhere else. x2apic is used when
+ * the cpu has it, which turns register accesses into msrs.
+ */
+
+#define LOCAL_TRACE 0
+
+#define MSR_APIC_BASE       0x1b
+#define APIC_BASE_X2APIC    (1u << 10)
+#define APIC_BASE_ENABLE    (1u << 11)
+#define APIC_BASE_ADDR_MASK 0xfffff000u
+
+#define MSR_X2APIC_BASE     0x800
+
+/* register offsets in the xapic page, msr 0x800 + (offset >> 4) in x2apic mode */
+#define LAPIC_ID            0x020
+#define LAPIC_VERSION       0x030
+#define LAPIC_TPR           0x080
+#define LAPIC_EOI           0x0b0
+#define LAPIC_SVR           0x0f0
+#define LAPIC_ESR           0x280
+#define LAPIC_LVT_LINT0     0x350
+#define LAPIC_LVT_LINT1     0x360
+#define LAPIC_LVT_ERROR     0x370
+
+#define SVR_ENABLE          (1u << 8)
+#define LVT_MASKED          (1u << 16)
+#define LVT_DELIVERY_NMI    (4u << 8)
+#define LVT_DELIVERY_EXTINT (7u << 8)
+
+#define CPUID_1_EDX_APIC    (1u << 9)
+#define CPUID_1_ECX_X2APIC  (1u << 21)
+
+static bool present;
+static bool x2apic;
+static volatile uint32_t *mmio;
+static uint32_t boot_id;
+
+static uint32_t lapic_read(uint offset)
+{
+    if (x2apic)
+        return read_msr(MSR_X2APIC_BASE + (offset >> 4));
+    return mmio[offset / 4];
+}
+
+static void lapic_write(uint offset, uint32_t val)
+{
+    if (x2apic)
+        write_msr(MSR_X2APIC_BASE + (offset >> 4), val);
+    else
+        mmio[offset / 4] = val;
+}
+
+bool lapic_present(void)
+{
+    return present;
+}
+
+uint32_t lapic_id(void)
+{
+    return boot_id;
+}
+
+void lapic_eoi(void)
+{
+    lapic_write(LAPIC_EOI, 0);
+}
+
+void lapic_init(void)
+{
+    uint32_t eax = 1, ebx, ecx = 0, edx;
+    __asm__ volatile("cpuid" : "+a" (eax), "=b" (ebx), "+c" (ecx), "=d" (edx));
+
+    if (!(edx & CPUID_1_EDX_APIC)) {
+        dprintf(INFO, "no local apic, msi unavailable\n");
+        return;
+    }
+
+    uint64_t base = read_msr(MSR_APIC_BASE);
+    if (ecx & CPUID_1_ECX_X2APIC) {
+        /* going to x2apic has to be done from xapic mode */
+        base |= APIC_BASE_ENABLE;
+        write_msr(MSR_APIC_BASE, base);
+        base |= APIC_BASE_X2APIC;
+        write_msr(MSR_APIC_BASE, base);
+        x2apic = true;
+    } else {
+        paddr_t pa = base & APIC_BASE_ADDR_MASK;
+        void *ptr;
+        status_t err = vmm_alloc_physical(vmm_get_kernel_aspace(), "lapic", PAGE_SIZE, &ptr, 0, pa,
+                                          0, ARCH_MMU_FLAG_UNCACHED_DEVICE);
+        if (err < 0) {
+            TRACEF("failed to map local apic at 0x%lx\n", pa);
+            return;
+        }
+        mmio = ptr;
+
+        base |= APIC_BASE_ENABLE;
+        write_msr(MSR_APIC_BASE, base);
+    }
+
+    boot_id = lapic_read(LAPIC_ID);
+    if (!x2apic)
+        boot_id >>= 24;
+
+    /* virtual wire: the pics come in on LINT0, nmi on LINT1 */
+    lapic_write(LAPIC_LVT_LINT0, LVT_DELIVERY_EXTINT);
+    lapic_write(LAPIC_LVT_LINT1, LVT_DELIVERY_NMI);
+    lapic_write(LAPIC_LVT_ERROR, LVT_MASKED);
+    lapic_write(LAPIC_ESR, 0);
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_SVR, SVR_ENABLE | INT_APIC_SPURIOUS);
+
+    present = true;
+
+    dprintf(INFO, "local apic id %u version 0x%x%s\n", boot_id, lapic_read(LAPIC_VERSION) & 0xff,
+            x2apic ? ", x2apic" : "");
+}
@@ -0,0 +1,894 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * NVMe controllers. Namespace 1 of each controller becomes a bio device.
+ * There is an I/O queue pair per cpu, each with its own MSI-X vector when
+ * the platform can deliver them, and commands go to the queue of the cpu
+ * that issues them. Data buffers are described with PRP lists, or with SGLs
+ * when the buffers don't line up on pages and the controller takes them.
+ */
+
+#include <reg.h>
+#include <debug.h>
+#include <trace.h>
+#include <assert.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <arch/ops.h>
+#include <kernel/event.h>
+#include <kernel/spinlock.h>
+#include <kernel/vm.h>
+#include <lib/bio.h>
+#include <platform.h>
+#include <platform/interrupts.h>
+#include <platform/nvme.h>
+#include <platform/pc.h>
+#include <dev/pci.h>
+
+#define LOCAL_TRACE 0
+
+/* mass storage, non volatile memory, nvme */
+#define NVME_PCI_CLASS          0x010802
+
+#define NVME_ADMIN_ENTRIES      16
+#define NVME_IO_ENTRIES         64
+
+/* a page of PRP entries per command bounds a transfer at 2MB */
+#define NVME_MAX_XFER           ((PAGE_SIZE / 8) * PAGE_SIZE)
+
+/*
+ * synchronous transfers spin on their completion queue instead of sleeping
+ * until the interrupt, which saves the wakeup on fast devices. the interrupt
+ * still backs it up, so asynchronous requests complete either way.
+ */
+#ifndef NVME_POLL_DEFAULT
+#define NVME_POLL_DEFAULT       1
+#endif
+
+/* controller registers */
+#define NVME_REG_CAP            0x00
+#define NVME_REG_VS             0x08
+#define NVME_REG_INTMS          0x0c
+#define NVME_REG_INTMC          0x10
+#define NVME_REG_CC             0x14
+#define NVME_REG_CSTS           0x1c
+#define NVME_REG_AQA            0x24
+#define NVME_REG_ASQ            0x28
+#define NVME_REG_ACQ            0x30
+#define NVME_REG_DOORBELL       0x1000
+
+#define NVME_CAP_MQES(cap)      ((cap) & 0xffff)
+#define NVME_CAP_TO(cap)        (((cap) >> 24) & 0xff)
+#define NVME_CAP_DSTRD(cap)     (((cap) >> 32) & 0xf)
+
+#define NVME_CC_EN              (1u << 0)
+#define NVME_CC_IOSQES          (6u << 16)
+#define NVME_CC_IOCQES          (4u << 20)
+
+#define NVME_CSTS_RDY           (1u << 0)
+#define NVME_CSTS_CFS           (1u << 1)
+
+/* admin commands */
+#define NVME_ADMIN_CREATE_SQ    0x01
+#define NVME_ADMIN_CREATE_CQ    0x05
+#define NVME_ADMIN_IDENTIFY     0x06
+#define NVME_ADMIN_SET_FEATURES 0x09
+
+#define NVME_FEAT_NUM_QUEUES    0x07
+
+/* nvm commands */
+#define NVME_CMD_FLUSH          0x00
+#define NVME_CMD_WRITE          0x01
+#define NVME_CMD_READ           0x02
+
+/* data pointer kinds in the command dword 0 PSDT field */
+#define NVME_PSDT_SGL           (1u << 14)
+
+#define NVME_SGL_DATA_BLOCK     0x00
+#define NVME_SGL_LAST_SEGMENT   0x30
+
+struct nvme_sqe {
+    uint32_t cdw0;      /* opcode, data pointer kind, command id */
+    uint32_t nsid;
+    uint64_t reserved;
+    uint64_t mptr;
+    uint64_t dptr[2];
+    uint32_t cdw10;
+    uint32_t cdw11;
+    uint32_t cdw12;
+    uint32_t cdw13;
+    uint32_t cdw14;
+    uint32_t cdw15;
+} __PACKED;
+
+struct nvme_cqe {
+    uint32_t result;
+    uint32_t reserved;
+    uint16_t sq_head;
+    uint16_t sq_id;
+    uint16_t cid;
+    uint16_t status;    /* phase in bit 0 */
+} __PACKED;
+
+struct nvme_sgl_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint8_t reserved[3];
+    uint8_t type;
+} __PACKED;
+
+STATIC_ASSERT(sizeof(struct nvme_sqe) == 64);
+STATIC_ASSERT(sizeof(struct nvme_cqe) == 16);
+STATIC_ASSERT(sizeof(struct nvme_sgl_desc) == 16);
+
+/* completion of a command, called from the irq handler or a poller */
+typedef void (*nvme_done_t)(void *arg, status_t err);
+
+struct nvme_txn {
+    nvme_done_t done;
+    void *done_arg;
+
+    /* PRP list or SGL segment for the command, a page of it */
+    void *list;
+    paddr_t list_pa;
+};
+
+struct nvme_ctrl;
+
+struct nvme_queue {
+    struct nvme_ctrl *ctrl;
+    uint id;
+    uint entries;
+
+    /* protects everything below */
+    spin_lock_t lock;
+
+    /* signaled as commands complete, for submitters waiting on a full queue */
+    event_t slot_event;
+
+    struct nvme_sqe *sq;
+    struct nvme_cqe *cq;
+    volatile uint32_t *sq_doorbell;
+    volatile uint32_t *cq_doorbell;
+    uint16_t sq_tail;
+    uint16_t cq_head;
+    uint8_t cq_phase;
+
+    /* command ids in use, one per txn */
+    uint64_t busy;
+    struct nvme_txn *txns;
+};
+
+struct nvme_ctrl {
+    volatile uint8_t *regs;
+    uint64_t cap;
+
+    struct nvme_queue admin;
+    struct nvme_queue *io;
+    uint io_count;
+
+    bool sgl;
+    bool polled;
+    bool volatile_cache;
+    size_t max_xfer;
+
+    uint32_t nsid;
+    bdev_t bdev;
+};
+
+static uint nvme_found;
+
+static inline uint32_t nvme_read32(struct nvme_ctrl *ctrl, uint reg)
+{
+    return *REG32(ctrl->regs + reg);
+}
+
+static inline void nvme_write32(struct nvme_ctrl *ctrl, uint reg, uint32_t val)
+{
+    *REG32(ctrl->regs + reg) = val;
+}
+
+static inline uint64_t nvme_read64(struct nvme_ctrl *ctrl, uint reg)
+{
+    return nvme_read32(ctrl, reg) | ((uint64_t)nvme_read32(ctrl, reg + 4) << 32);
+}
+
+static inline void nvme_write64(struct nvme_ctrl *ctrl, uint reg, uint64_t val)
+{
+    nvme_write32(ctrl, reg, (uint32_t)val);
+    nvme_write32(ctrl, reg + 4, val >> 32);
+}
+
+static status_t nvme_queue_init(struct nvme_ctrl *ctrl, struct nvme_queue *q, uint id, uint entries)
+{
+    q->ctrl = ctrl;
+    q->id = id;
+    q->entries = entries;
+    q->lock = SPIN_LOCK_INITIAL_VALUE;
+    event_init(&q->slot_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    q->cq_phase = 1;
+
+    size_t stride = 4u << NVME_CAP_DSTRD(ctrl->cap);
+    q->sq_doorbell = (volatile uint32_t *)(ctrl->regs + NVME_REG_DOORBELL + (2 * id) * stride);
+    q->cq_doorbell = (volatile uint32_t *)(ctrl->regs + NVME_REG_DOORBELL + (2 * id + 1) * stride);
+
+    /* both rings fit a page at these depths */
+    DEBUG_ASSERT(entries * sizeof(struct nvme_sqe) <= PAGE_SIZE);
+    q->sq = pmm_alloc_kpages(1, NULL);
+    q->cq = pmm_alloc_kpages(1, NULL);
+    q->txns = calloc(entries, sizeof(struct nvme_txn));
+    if (!q->sq || !q->cq || !q->txns)
+        return ERR_NO_MEMORY;
+    memset(q->sq, 0, PAGE_SIZE);
+    memset(q->cq, 0, PAGE_SIZE);
+
+    /* admin commands never carry more than a page, so only I/O needs lists */
+    if (id != 0) {
+        for (uint i = 0; i < entries; i++) {
+            q->txns[i].list = pmm_alloc_kpages(1, NULL);
+            if (!q->txns[i].list)
+                return ERR_NO_MEMORY;
+            q->txns[i].list_pa = vaddr_to_paddr(q->txns[i].list);
+        }
+    }
+
+    return NO_ERROR;
+}
+
+/*
+ * fill in the data pointer of a command for the buffers. PRPs want every
+ * buffer to start and end on a page boundary apart from the start of the
+ * first and the end of the last, anything else takes an SGL.
+ */
+static status_t nvme_build_dptr(struct nvme_queue *q, struct nvme_txn *txn, struct nvme_sqe *sqe,
+                                const bio_iovec_t *iov, uint iov_count)
+{
+    if (iov_count == 0)
+        return NO_ERROR;
+
+    bool prp_ok = true;
+    for (uint n = 0; n < iov_count; n++) {
+        vaddr_t start = (vaddr_t)iov[n].base;
+        vaddr_t end = start + iov[n].len;
+        if ((n > 0 && !IS_PAGE_ALIGNED(start)) || (n < iov_count - 1 && !IS_PAGE_ALIGNED(end)))
+            prp_ok = false;
+        if (start & 3)
+            prp_ok = false;
+    }
+
+    if (prp_ok) {
+        /* the first entry may start anywhere, the rest are whole pages */
+        uint64_t *list = txn->list;
+        uint count = 0;
+        for (uint n = 0; n < iov_count; n++) {
+            vaddr_t va = (vaddr_t)iov[n].base;
+            vaddr_t end = va + iov[n].len;
+            while (va < end) {
+                paddr_t pa = vaddr_to_paddr((void *)va);
+                if (count == 0)
+                    sqe->dptr[0] = pa;
+                else if (count - 1 < PAGE_SIZE / 8)
+                    list[count - 1] = pa;
+                else
+                    return ERR_TOO_BIG;
+                count++;
+                va = PAGE_ALIGN(va + 1);
+            }
+        }
+
+        /* two pages go directly in the command, more through the list */
+        if (count == 2)
+            sqe->dptr[1] = list[0];
+        else if (count > 2)
+            sqe->dptr[1] = txn->list_pa;
+        return NO_ERROR;
+    }
+
+    if (!q->ctrl->sgl)
+        return ERR_NOT_SUPPORTED;
+
+    /* a data block per physically contiguous run, in one last segment */
+    struct nvme_sgl_desc *descs = txn->list;
+    uint count = 0;
+    for (uint n = 0; n < iov_count; n++) {
+        vaddr_t va = (vaddr_t)iov[n].base;
+        size_t remaining = iov[n].len;
+        while (remaining > 0) {
+            paddr_t pa = vaddr_to_paddr((void *)va);
+            size_t seg = MIN(PAGE_ALIGN(va + 1) - va, remaining);
+            if (count > 0 && descs[count - 1].addr + descs[count - 1].len == pa) {
+                descs[count - 1].len += seg;
+            } else {
+                if (count == PAGE_SIZE / sizeof(struct nvme_sgl_desc))
+                    return ERR_TOO_BIG;
+                descs[count].addr = pa;
+                descs[count].len = seg;
+                memset(descs[count].reserved, 0, sizeof(descs[count].reserved));
+                descs[count].type = NVME_SGL_DATA_BLOCK;
+                count++;
+            }
+            va += seg;
+            remaining -= seg;
+        }
+    }
+
+    struct nvme_sgl_desc *seg = (struct nvme_sgl_desc *)sqe->dptr;
+    if (count == 1) {
+        *seg = descs[0];
+    } else {
+        seg->addr = txn->list_pa;
+        seg->len = count * sizeof(struct nvme_sgl_desc);
+        memset(seg->reserved, 0, sizeof(seg->reserved));
+        seg->type = NVME_SGL_LAST_SEGMENT;
+    }
+    sqe->cdw0 |= NVME_PSDT_SGL;
+
+    return NO_ERROR;
+}
+
+/*
+ * put a command on a queue, calling done when it completes. sqe is copied in
+ * with its command id filled out, and its data pointer too if there are
+ * buffers. waits for room on the queue if need be, so may block.
+ */
+static status_t nvme_submit(struct nvme_queue *q, struct nvme_sqe *sqe, const bio_iovec_t *iov, uint iov_count,
+                            nvme_done_t done, void *done_arg)
+{
+    /* one entry stays empty so a full ring can be told from an empty one */
+    uint64_t all = (q->entries == 64) ? ~0ULL : ((1ULL << q->entries) - 1);
+    all &= ~(1ULL << (q->entries - 1));
+
+    uint cid;
+    spin_lock_saved_state_t state;
+    for (;;) {
+        spin_lock_irqsave(&q->lock, state);
+        uint64_t free = ~q->busy & all;
+        if (free) {
+            cid = __builtin_ctzll(free);
+            break;
+        }
+        spin_unlock_irqrestore(&q->lock, state);
+        event_wait(&q->slot_event);
+    }
+
+    struct nvme_txn *txn = &q->txns[cid];
+    sqe->cdw0 = (sqe->cdw0 & 0xff) | (cid << 16);
+    status_t err = nvme_build_dptr(q, txn, sqe, iov, iov_count);
+    if (err < 0) {
+        spin_unlock_irqrestore(&q->lock, state);
+        return err;
+    }
+
+    q->busy |= (1ULL << cid);
+    txn->done = done;
+    txn->done_arg = done_arg;
+
+    q->sq[q->sq_tail] = *sqe;
+    q->sq_tail = (q->sq_tail + 1) % q->entries;
+
+    /* make the entry visible before the doorbell */
+    mb();
+    *q->sq_doorbell = q->sq_tail;
+
+    spin_unlock_irqrestore(&q->lock, state);
+
+    return NO_ERROR;
+}
+
+/* reap whatever has completed on a queue, returns whether anything did */
+static bool nvme_reap(struct nvme_queue *q)
+{
+    struct nvme_txn done[NVME_IO_ENTRIES];
+    status_t errs[NVME_IO_ENTRIES];
+    uint done_count = 0;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&q->lock, state);
+
+    for (;;) {
+        volatile struct nvme_cqe *cqe = &q->cq[q->cq_head];
+        uint16_t status = cqe->status;
+        if ((status & 1) != q->cq_phase)
+            break;
+
+        uint cid = cqe->cid;
+        DEBUG_ASSERT(cid < q->entries && (q->busy & (1ULL << cid)));
+        LTRACEF("queue %u cid %u status 0x%x\n", q->id, cid, status >> 1);
+
+        done[done_count] = q->txns[cid];
+        errs[done_count] = (status >> 1) ? ERR_IO : NO_ERROR;
+        done_count++;
+        q->txns[cid].done = NULL;
+        q->busy &= ~(1ULL << cid);
+
+        if (++q->cq_head == q->entries) {
+            q->cq_head = 0;
+            q->cq_phase ^= 1;
+        }
+    }
+
+    if (done_count > 0)
+        *q->cq_doorbell = q->cq_head;
+
+    spin_unlock_irqrestore(&q->lock, state);
+
+    for (uint i = 0; i < done_count; i++) {
+        if (done[i].done)
+            done[i].done(done[i].done_arg, errs[i]);
+    }
+    if (done_count > 0)
+        event_signal(&q->slot_event, false);
+
+    return done_count > 0;
+}
+
+static enum handler_return nvme_queue_irq(void *arg)
+{
+    return nvme_reap(arg) ? INT_RESCHEDULE : INT_NO_RESCHEDULE;
+}
+
+/* one vector for everything, look at every queue */
+static enum handler_return nvme_shared_irq(void *arg)
+{
+    struct nvme_ctrl *ctrl = (struct nvme_ctrl *)arg;
+    bool any = false;
+
+    for (uint i = 0; i < ctrl->io_count; i++)
+        any |= nvme_reap(&ctrl->io[i]);
+
+    return any ? INT_RESCHEDULE : INT_NO_RESCHEDULE;
+}
+
+/* a synchronous command, waited on by polling or sleeping */
+struct nvme_wait {
+    event_t event;
+    volatile int pending;
+    status_t err;
+};
+
+static void nvme_wait_done(void *arg, status_t err)
+{
+    struct nvme_wait *wait = (struct nvme_wait *)arg;
+
+    if (err < 0)
+        wait->err = err;
+    if (atomic_add(&wait->pending, -1) == 1)
+        event_signal(&wait->event, false);
+}
+
+static void nvme_wait_init(struct nvme_wait *wait)
+{
+    event_init(&wait->event, false, 0);
+    wait->pending = 1;
+    wait->err = NO_ERROR;
+}
+
+/* drop the caller's count and wait for the rest, spinning on q when polled */
+static status_t nvme_wait_finish(struct nvme_wait *wait, struct nvme_queue *q, bool poll)
+{
+    if (atomic_add(&wait->pending, -1) != 1) {
+        if (poll) {
+            while (wait->pending > 0)
+                nvme_reap(q);
+        } else {
+            event_wait(&wait->event);
+        }
+    }
+
+    event_destroy(&wait->event);
+
+    return wait->err;
+}
+
+/* admin commands are only issued at init, and always polled */
+static status_t nvme_admin(struct nvme_ctrl *ctrl, struct nvme_sqe *sqe, void *buf, uint32_t *result)
+{
+    struct nvme_wait wait;
+    nvme_wait_init(&wait);
+
+    bio_iovec_t iov = { .base = buf, .len = PAGE_SIZE };
+    atomic_add(&wait.pending, 1);
+    status_t err = nvme_submit(&ctrl->admin, sqe, &iov, buf ? 1 : 0, nvme_wait_done, &wait);
+    if (err < 0)
+        atomic_add(&wait.pending, -1);
+
+    lk_time_t start = current_time();
+    while (err == NO_ERROR && wait.pending > 1) {
+        nvme_reap(&ctrl->admin);
+        if (current_time() - start > 5000) {
+            TRACEF("admin command 0x%x timed out\n", sqe->cdw0 & 0xff);
+            return ERR_TIMED_OUT;
+        }
+    }
+
+    if (result) {
+        /* admin commands go one at a time, so the last completion is this one */
+        uint16_t head = ctrl->admin.cq_head ? (uint16_t)(ctrl->admin.cq_head - 1)
+                                            : (uint16_t)(ctrl->admin.entries - 1);
+        *result = ctrl->admin.cq[head].result;
+    }
+
+    status_t werr = nvme_wait_finish(&wait, &ctrl->admin, true);
+    return (err < 0) ? err : werr;
+}
+
+static inline struct nvme_queue *nvme_cpu_queue(struct nvme_ctrl *ctrl)
+{
+    return &ctrl->io[arch_curr_cpu_num() % ctrl->io_count];
+}
+
+static void nvme_rw_sqe(struct nvme_ctrl *ctrl, struct nvme_sqe *sqe, bool write, uint64_t lba, uint count)
+{
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->cdw0 = write ? NVME_CMD_WRITE : NVME_CMD_READ;
+    sqe->nsid = ctrl->nsid;
+    sqe->cdw10 = (uint32_t)lba;
+    sqe->cdw11 = lba >> 32;
+    sqe->cdw12 = count - 1;
+}
+
+static ssize_t nvme_read_write(struct nvme_ctrl *ctrl, void *buf, bnum_t block, uint count, bool write)
+{
+    struct nvme_queue *q = nvme_cpu_queue(ctrl);
+    struct nvme_wait wait;
+    nvme_wait_init(&wait);
+
+    /* dword aligned buffers only, anything else takes a bounce */
+    size_t len = (size_t)count * ctrl->bdev.block_size;
+    void *bounce = NULL;
+    if ((uintptr_t)buf & 3) {
+        bounce = memalign(PAGE_SIZE, len);
+        if (!bounce)
+            return ERR_NO_MEMORY;
+        if (write)
+            memcpy(bounce, buf, len);
+    }
+
+    /* as many commands as the transfer limit takes, all in flight at once */
+    vaddr_t va = (vaddr_t)(bounce ? bounce : buf);
+    size_t remaining = len;
+    bnum_t lba = block;
+    while (remaining > 0) {
+        /* the first page may be partial, so leave one out of the limit */
+        size_t piece = MIN(remaining, ctrl->max_xfer - PAGE_SIZE);
+        bio_iovec_t iov = { .base = (void *)va, .len = piece };
+        uint blocks = piece >> ctrl->bdev.block_shift;
+
+        struct nvme_sqe sqe;
+        nvme_rw_sqe(ctrl, &sqe, write, lba, blocks);
+
+        atomic_add(&wait.pending, 1);
+        status_t err = nvme_submit(q, &sqe, &iov, 1, nvme_wait_done, &wait);
+        if (err < 0) {
+            wait.err = err;
+            atomic_add(&wait.pending, -1);
+            break;
+        }
+
+        va += piece;
+        lba += blocks;
+        remaining -= piece;
+    }
+
+    status_t err = nvme_wait_finish(&wait, q, ctrl->polled);
+
+    if (bounce) {
+        if (!write && err == NO_ERROR)
+            memcpy(buf, bounce, len);
+        free(bounce);
+    }
+
+    return (err < 0) ? err : (ssize_t)len;
+}
+
+static ssize_t nvme_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count)
+{
+    struct nvme_ctrl *ctrl = containerof(bdev, struct nvme_ctrl, bdev);
+
+    LTRACEF("buf %p, block 0x%x, count %u\n", buf, block, count);
+
+    return nvme_read_write(ctrl, buf, block, count, false);
+}
+
+static ssize_t nvme_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t block, uint count)
+{
+    struct nvme_ctrl *ctrl = containerof(bdev, struct nvme_ctrl, bdev);
+
+    LTRACEF("buf %p, block 0x%x, count %u\n", buf, block, count);
+
+    return nvme_read_write(ctrl, (void *)buf, block, count, true);
+}
+
+static status_t nvme_bdev_flush(struct bdev *bdev)
+{
+    struct nvme_ctrl *ctrl = containerof(bdev, struct nvme_ctrl, bdev);
+    struct nvme_queue *q = nvme_cpu_queue(ctrl);
+
+    struct nvme_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.cdw0 = NVME_CMD_FLUSH;
+    sqe.nsid = ctrl->nsid;
+
+    struct nvme_wait wait;
+    nvme_wait_init(&wait);
+    atomic_add(&wait.pending, 1);
+    status_t err = nvme_submit(q, &sqe, NULL, 0, nvme_wait_done, &wait);
+    if (err < 0)
+        atomic_add(&wait.pending, -1);
+
+    status_t werr = nvme_wait_finish(&wait, q, ctrl->polled);
+    return (err < 0) ? err : werr;
+}
+
+static status_t nvme_bdev_submit(struct bdev *bdev, bio_request_t *req)
+{
+    struct nvme_ctrl *ctrl = containerof(bdev, struct nvme_ctrl, bdev);
+
+    LTRACEF("req %p, block 0x%x, count %u\n", req, req->block, req->count);
+
+    if ((size_t)req->count * bdev->block_size > ctrl->max_xfer - PAGE_SIZE)
+        return ERR_TOO_BIG;
+
+    struct nvme_sqe sqe;
+    nvme_rw_sqe(ctrl, &sqe, req->write, req->block, req->count);
+
+    return nvme_submit(nvme_cpu_queue(ctrl), &sqe, req->iov, req->iov_count, bio_request_complete_status, req);
+}
+
+static status_t nvme_wait_ready(struct nvme_ctrl *ctrl, bool ready)
+{
+    /* CAP.TO is in 500ms units */
+    lk_time_t timeout = MAX(NVME_CAP_TO(ctrl->cap), 1u) * 500;
+    lk_time_t start = current_time();
+    while (!!(nvme_read32(ctrl, NVME_REG_CSTS) & NVME_CSTS_RDY) != ready) {
+        if (nvme_read32(ctrl, NVME_REG_CSTS) & NVME_CSTS_CFS)
+            return ERR_IO;
+        if (current_time() - start > timeout)
+            return ERR_TIMED_OUT;
+    }
+    return NO_ERROR;
+}
+
+/* map a memory BAR, sizing it by the usual write of all ones */
+static volatile uint8_t *nvme_map_bar(const pci_location_t *loc, uint bar)
+{
+    uint reg = PCI_CONFIG_BASE_ADDRESSES + bar * 4;
+    uint32_t lo, hi = 0, size_lo;
+    pci_read_config_word(loc, reg, &lo);
+    if (lo & 0x1)
+        return NULL;
+    bool is64 = ((lo >> 1) & 0x3) == 0x2;
+    if (is64)
+        pci_read_config_word(loc, reg + 4, &hi);
+
+    pci_write_config_word(loc, reg, 0xffffffff);
+    pci_read_config_word(loc, reg, &size_lo);
+    pci_write_config_word(loc, reg, lo);
+    size_t size = ~(size_lo & ~0xfu) + 1;
+
+    paddr_t pa = ((uint64_t)hi << 32) | (lo & ~0xfu);
+    if (pa == 0 || size == 0)
+        return NULL;
+
+    void *ptr;
+    if (vmm_alloc_physical(vmm_get_kernel_aspace(), "nvme", ROUNDUP(size, PAGE_SIZE), &ptr, 0, pa,
+                           0, ARCH_MMU_FLAG_UNCACHED_DEVICE) < 0)
+        return NULL;
+
+    return ptr;
+}
+
+static status_t nvme_create_io_queue(struct nvme_ctrl *ctrl, struct nvme_queue *q, uint id, uint vector_index, bool irq)
+{
+    status_t err = nvme_queue_init(ctrl, q, id, MIN(NVME_IO_ENTRIES, NVME_CAP_MQES(ctrl->cap) + 1));
+    if (err < 0)
+        return err;
+
+    struct nvme_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.cdw0 = NVME_ADMIN_CREATE_CQ;
+    sqe.cdw10 = ((q->entries - 1) << 16) | id;
+    sqe.cdw11 = (vector_index << 16) | (irq ? 0x2 : 0) | 0x1;   /* physically contiguous */
+    sqe.dptr[0] = vaddr_to_paddr(q->cq);
+    err = nvme_admin(ctrl, &sqe, NULL, NULL);
+    if (err < 0)
+        return err;
+
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.cdw0 = NVME_ADMIN_CREATE_SQ;
+    sqe.cdw10 = ((q->entries - 1) << 16) | id;
+    sqe.cdw11 = (id << 16) | 0x1;
+    sqe.dptr[0] = vaddr_to_paddr(q->sq);
+    return nvme_admin(ctrl, &sqe, NULL, NULL);
+}
+
+static status_t nvme_ctrl_init(const pci_location_t *loc)
+{
+    struct nvme_ctrl *ctrl = calloc(1, sizeof(struct nvme_ctrl));
+    if (!ctrl)
+        return ERR_NO_MEMORY;
+
+    ctrl->regs = nvme_map_bar(loc, 0);
+    if (!ctrl->regs) {
+        free(ctrl);
+        return ERR_NOT_FOUND;
+    }
+
+    uint16_t command;
+    pci_read_config_half(loc, PCI_CONFIG_COMMAND, &command);
+    pci_write_config_half(loc, PCI_CONFIG_COMMAND, command | PCI_COMMAND_MEM_EN | PCI_COMMAND_BUS_MASTER_EN);
+
+    ctrl->cap = nvme_read64(ctrl, NVME_REG_CAP);
+    dprintf(INFO, "nvme: version 0x%x, cap 0x%llx\n", nvme_read32(ctrl, NVME_REG_VS),
+            (unsigned long long)ctrl->cap);
+
+    /* reset, then bring it up with just the admin queues */
+    nvme_write32(ctrl, NVME_REG_CC, 0);
+    status_t err = nvme_wait_ready(ctrl, false);
+    if (err < 0)
+        goto fail;
+
+    err = nvme_queue_init(ctrl, &ctrl->admin, 0, NVME_ADMIN_ENTRIES);
+    if (err < 0)
+        goto fail;
+
+    nvme_write32(ctrl, NVME_REG_AQA, ((NVME_ADMIN_ENTRIES - 1) << 16) | (NVME_ADMIN_ENTRIES - 1));
+    nvme_write64(ctrl, NVME_REG_ASQ, vaddr_to_paddr(ctrl->admin.sq));
+    nvme_write64(ctrl, NVME_REG_ACQ, vaddr_to_paddr(ctrl->admin.cq));
+    nvme_write32(ctrl, NVME_REG_CC, NVME_CC_EN | NVME_CC_IOSQES | NVME_CC_IOCQES);
+    err = nvme_wait_ready(ctrl, true);
+    if (err < 0)
+        goto fail;
+
+    /* identify the controller, then namespace 1 */
+    uint8_t *id = pmm_alloc_kpages(1, NULL);
+    if (!id) {
+        err = ERR_NO_MEMORY;
+        goto fail;
+    }
+
+    struct nvme_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.cdw0 = NVME_ADMIN_IDENTIFY;
+    sqe.cdw10 = 1;
+    err = nvme_admin(ctrl, &sqe, id, NULL);
+    if (err < 0)
+        goto fail_id;
+
+    /* MDTS is a power of two of the minimum page size, 0 for no limit */
+    uint8_t mdts = id[77];
+    ctrl->max_xfer = NVME_MAX_XFER;
+    if (mdts && ((size_t)PAGE_SIZE << mdts) < ctrl->max_xfer)
+        ctrl->max_xfer = (size_t)PAGE_SIZE << mdts;
+    uint32_t sgls = id[536] | (id[537] << 8) | (id[538] << 16) | ((uint32_t)id[539] << 24);
+    ctrl->sgl = (sgls & 0x3) != 0;
+    ctrl->volatile_cache = id[525] & 0x1;
+    ctrl->polled = NVME_POLL_DEFAULT;
+
+    ctrl->nsid = 1;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.cdw0 = NVME_ADMIN_IDENTIFY;
+    sqe.nsid = ctrl->nsid;
+    sqe.cdw10 = 0;
+    err = nvme_admin(ctrl, &sqe, id, NULL);
+    if (err < 0)
+        goto fail_id;
+
+    uint64_t nsze;
+    memcpy(&nsze, id, sizeof(nsze));
+    uint lbaf = id[26] & 0xf;
+    uint lbads = id[128 + lbaf * 4 + 2];
+    pmm_free_kpages(id, 1);
+    id = NULL;
+
+    if (nsze == 0 || lbads < 9 || lbads > PAGE_SIZE_SHIFT) {
+        TRACEF("nvme: namespace 1 unusable, size %llu lba shift %u\n", (unsigned long long)nsze, lbads);
+        err = ERR_NOT_SUPPORTED;
+        goto fail;
+    }
+
+    /* a queue pair per cpu, if the controller has that many */
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.cdw0 = NVME_ADMIN_SET_FEATURES;
+    sqe.cdw10 = NVME_FEAT_NUM_QUEUES;
+    sqe.cdw11 = ((SMP_MAX_CPUS - 1) << 16) | (SMP_MAX_CPUS - 1);
+    uint32_t result;
+    err = nvme_admin(ctrl, &sqe, NULL, &result);
+    if (err < 0)
+        goto fail;
+    ctrl->io_count = MIN(SMP_MAX_CPUS, MIN((result & 0xffff), (result >> 16)) + 1);
+
+    ctrl->io = calloc(ctrl->io_count, sizeof(struct nvme_queue));
+    if (!ctrl->io) {
+        err = ERR_NO_MEMORY;
+        goto fail;
+    }
+
+    /* a vector per queue, the admin queue taking the first which it never waits on */
+    uint vectors[SMP_MAX_CPUS + 1];
+    bool msix = pci_enable_msix(loc, ctrl->io_count + 1, vectors) == _PCI_SUCCESSFUL;
+    uint vector;
+    if (!msix && pci_enable_msi(loc, &vector) != _PCI_SUCCESSFUL &&
+            pci_get_irq_vector(loc, &vector) != _PCI_SUCCESSFUL) {
+        TRACEF("nvme controller has no interrupt\n");
+        err = ERR_NOT_SUPPORTED;
+        goto fail;
+    }
+
+    for (uint i = 0; i < ctrl->io_count; i++) {
+        err = nvme_create_io_queue(ctrl, &ctrl->io[i], i + 1, msix ? i + 1 : 0, true);
+        if (err < 0)
+            goto fail;
+        if (msix)
+            register_int_handler(vectors[i + 1], &nvme_queue_irq, &ctrl->io[i]);
+    }
+    if (!msix) {
+        register_int_handler(vector, &nvme_shared_irq, ctrl);
+        unmask_interrupt(vector);
+    }
+
+    char name[16];
+    snprintf(name, sizeof(name), "nvme%u", nvme_found++);
+    bio_initialize_bdev(&ctrl->bdev, name, 1u << lbads, MIN(nsze, (uint64_t)UINT32_MAX), 0, NULL, BIO_FLAGS_NONE);
+
+    ctrl->bdev.read_block = &nvme_bdev_read_block;
+    ctrl->bdev.write_block = &nvme_bdev_write_block;
+    ctrl->bdev.submit = &nvme_bdev_submit;
+    if (ctrl->volatile_cache)
+        ctrl->bdev.flush = &nvme_bdev_flush;
+    ctrl->bdev.max_queue_depth = ctrl->io_count * (ctrl->io[0].entries - 1);
+
+    /* merge adjacent requests, the controller does its own scheduling */
+    bio_queue_attach(&ctrl->bdev, 0, 0);
+
+    bio_register_device(&ctrl->bdev);
+
+    printf("nvme: %s, %llu blocks of %u bytes, %u queue%s, %s, max transfer %zu\n", name,
+           (unsigned long long)nsze, 1u << lbads, ctrl->io_count, ctrl->io_count == 1 ? "" : "s",
+           msix ? "msi-x" : "shared interrupt", ctrl->max_xfer);
+
+    return NO_ERROR;
+
+fail_id:
+    pmm_free_kpages(id, 1);
+fail:
+    TRACEF("nvme: init failed %d\n", err);
+    /* the controller is left disabled, its memory isn't worth getting back */
+    nvme_write32(ctrl, NVME_REG_CC, 0);
+    return err;
+}
+
+int nvme_init(void)
+{
+    pci_location_t loc;
+    for (uint16_t index = 0; pci_find_pci_class_code(&loc, NVME_PCI_CLASS, index) == _PCI_SUCCESSFUL; index++) {
+        LTRACEF("nvme controller at %02x:%02x.%u\n", loc.bus, loc.dev_fn >> 3, loc.dev_fn & 7);
+        nvme_ctrl_init(&loc);
+    }
+
+    return nvme_found;
+}
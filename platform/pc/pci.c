@@ -28,6 +28,9 @@
 #include <kernel/spinlock.h>
 #include <arch/x86/descriptor.h>
 #include <dev/pci.h>
+#include <kernel/vm.h>
+#include <platform/pc.h>
+#include "platform_p.h"
 
 static int last_bus = 0;
 static spin_lock_t lock;
@@ -191,9 +194,166 @@ int pci_set_irq_hw_int(const pci_location_t *state, uint8_t int_pin, uint8_t irq
     return res;
 }
 
+int pci_get_irq_vector(const pci_location_t *state, uint *vector)
+{
+    uint8_t line;
+    int res = pci_read_config_byte(state, PCI_CONFIG_INTERRUPT_LINE, &line);
+    if (res != _PCI_SUCCESSFUL)
+        return res;
+
+    /* the firmware routed it to one of the pic inputs, or nowhere */
+    if (line == 0 || line >= 16)
+        return _PCI_FUNC_NOT_SUPPORTED;
+
+    *vector = INT_BASE + line;
+    return _PCI_SUCCESSFUL;
+}
+
+#define PCI_CAP_ID_MSI              0x05
+#define PCI_CAP_ID_MSIX             0x11
+
+#define PCI_COMMAND_INTX_DISABLE    0x0400
+
+#define MSI_CTRL_ENABLE             0x0001
+#define MSI_CTRL_MME_MASK           0x0070
+#define MSI_CTRL_64BIT              0x0080
+
+#define MSIX_CTRL_TABLE_SIZE_MASK   0x07ff
+#define MSIX_CTRL_FUNCTION_MASK     0x4000
+#define MSIX_CTRL_ENABLE            0x8000
+
+#define MSIX_ENTRY_SIZE             16
+
+/* offset of the function's first capability with the given id, or 0 */
+static uint8_t pci_find_cap(const pci_location_t *state, uint8_t cap_id)
+{
+    uint16_t status;
+    if (pci_read_config_half(state, PCI_CONFIG_STATUS, &status) != _PCI_SUCCESSFUL ||
+            !(status & PCI_STATUS_NEW_CAPS))
+        return 0;
+
+    uint8_t cap;
+    pci_read_config_byte(state, PCI_CONFIG_CAPABILITIES, &cap);
+    for (uint guard = 0; cap >= 0x40 && guard < 48; guard++) {
+        uint8_t id;
+        pci_read_config_byte(state, cap, &id);
+        if (id == cap_id)
+            return cap;
+        pci_read_config_byte(state, cap + 1, &cap);
+    }
+
+    return 0;
+}
+
+static void pci_disable_intx(const pci_location_t *state)
+{
+    uint16_t command;
+    pci_read_config_half(state, PCI_CONFIG_COMMAND, &command);
+    pci_write_config_half(state, PCI_CONFIG_COMMAND, command | PCI_COMMAND_INTX_DISABLE);
+}
+
+int pci_enable_msi(const pci_location_t *state, uint *vector)
+{
+    uint8_t cap = pci_find_cap(state, PCI_CAP_ID_MSI);
+    if (!cap)
+        return _PCI_FUNC_NOT_SUPPORTED;
+
+    uint64_t addr;
+    uint32_t data;
+    if (platform_alloc_msi_vector(vector, &addr, &data) < 0)
+        return _PCI_FUNC_NOT_SUPPORTED;
+
+    uint16_t ctrl;
+    pci_read_config_half(state, cap + 2, &ctrl);
+
+    pci_write_config_word(state, cap + 4, (uint32_t)addr);
+    if (ctrl & MSI_CTRL_64BIT) {
+        pci_write_config_word(state, cap + 8, addr >> 32);
+        pci_write_config_half(state, cap + 12, data);
+    } else {
+        pci_write_config_half(state, cap + 8, data);
+    }
+
+    /* a single message */
+    ctrl &= ~MSI_CTRL_MME_MASK;
+    pci_write_config_half(state, cap + 2, ctrl | MSI_CTRL_ENABLE);
+
+    pci_disable_intx(state);
+
+    return _PCI_SUCCESSFUL;
+}
+
+int pci_enable_msix(const pci_location_t *state, uint count, uint *vectors)
+{
+    uint8_t cap = pci_find_cap(state, PCI_CAP_ID_MSIX);
+    if (!cap)
+        return _PCI_FUNC_NOT_SUPPORTED;
+
+    uint16_t ctrl;
+    pci_read_config_half(state, cap + 2, &ctrl);
+    if (count == 0 || count > (ctrl & MSIX_CTRL_TABLE_SIZE_MASK) + 1u)
+        return _PCI_BUFFER_TOO_SMALL;
+
+    /* the table lives in one of the memory BARs */
+    uint32_t table;
+    pci_read_config_word(state, cap + 4, &table);
+    uint bir = table & 0x7;
+    if (bir > 5)
+        return _PCI_FUNC_NOT_SUPPORTED;
+
+    uint32_t bar;
+    pci_read_config_word(state, PCI_CONFIG_BASE_ADDRESSES + bir * 4, &bar);
+    if (bar & 0x1)
+        return _PCI_FUNC_NOT_SUPPORTED;
+
+    uint64_t pa = bar & ~0xfu;
+    if (((bar >> 1) & 0x3) == 0x2 && bir < 5) {
+        uint32_t hi;
+        pci_read_config_word(state, PCI_CONFIG_BASE_ADDRESSES + (bir + 1) * 4, &hi);
+        pa |= (uint64_t)hi << 32;
+    }
+    if (pa == 0)
+        return _PCI_FUNC_NOT_SUPPORTED;
+    pa += table & ~0x7u;
+
+    paddr_t base = ROUNDDOWN(pa, PAGE_SIZE);
+    size_t size = ROUNDUP(pa + count * MSIX_ENTRY_SIZE, PAGE_SIZE) - base;
+    void *ptr;
+    if (vmm_alloc_physical(vmm_get_kernel_aspace(), "msix", size, &ptr, 0, base,
+                           0, ARCH_MMU_FLAG_UNCACHED_DEVICE) < 0)
+        return _PCI_FUNC_NOT_SUPPORTED;
+    volatile uint8_t *entries = (uint8_t *)ptr + (pa - base);
+
+    /* enable with the whole function masked while the entries are written */
+    pci_write_config_half(state, cap + 2, ctrl | MSIX_CTRL_ENABLE | MSIX_CTRL_FUNCTION_MASK);
+
+    for (uint i = 0; i < count; i++) {
+        uint64_t addr;
+        uint32_t data;
+        if (platform_alloc_msi_vector(&vectors[i], &addr, &data) < 0) {
+            pci_write_config_half(state, cap + 2, ctrl & ~MSIX_CTRL_ENABLE);
+            return _PCI_FUNC_NOT_SUPPORTED;
+        }
+
+        volatile uint32_t *entry = (volatile uint32_t *)(entries + i * MSIX_ENTRY_SIZE);
+        entry[0] = (uint32_t)addr;
+        entry[1] = addr >> 32;
+        entry[2] = data;
+        entry[3] = 0;   /* vector control, unmasked */
+    }
+
+    pci_write_config_half(state, cap + 2, (ctrl | MSIX_CTRL_ENABLE) & ~MSIX_CTRL_FUNCTION_MASK);
+
+    pci_disable_intx(state);
+
+    return _PCI_SUCCESSFUL;
+}
+
 void pci_init(void)
 {
-    if (!pci_bios_detect()) {
+    if (!pci_type1_detect()) {
+        dprintf(INFO, "pci config mechanism 1\n");
+    } else if (!pci_bios_detect()) {
         dprintf(INFO, "pci bios functions installed\n");
         dprintf(INFO, "last pci bus is %d\n", last_bus);
     }
@@ -590,3 +750,179 @@ static int pci_bios_detect(void)
 
     return -1;
 }
+
+/*
+ * configuration mechanism 1, an address written to 0xcf8 selects the dword
+ * at 0xcfc. works in long mode, unlike the BIOS32 calls.
+ */
+#define PCI_CONFIG_ADDRESS  0xcf8
+#define PCI_CONFIG_DATA     0xcfc
+
+static uint32_t type1_address(const pci_location_t *state, uint32_t reg)
+{
+    return 0x80000000 | ((uint32_t)state->bus << 16) | ((uint32_t)state->dev_fn << 8) | (reg & 0xfc);
+}
+
+static int type1_read_config_word(const pci_location_t *state, uint32_t reg, uint32_t *value)
+{
+    if (reg & 3)
+        return _PCI_BAD_REGISTER_NUMBER;
+
+    outpd(PCI_CONFIG_ADDRESS, type1_address(state, reg));
+    *value = inpd(PCI_CONFIG_DATA);
+
+    return _PCI_SUCCESSFUL;
+}
+
+static int type1_read_config_half(const pci_location_t *state, uint32_t reg, uint16_t *value)
+{
+    if (reg & 1)
+        return _PCI_BAD_REGISTER_NUMBER;
+
+    outpd(PCI_CONFIG_ADDRESS, type1_address(state, reg));
+    *value = inpw(PCI_CONFIG_DATA + (reg & 2));
+
+    return _PCI_SUCCESSFUL;
+}
+
+static int type1_read_config_byte(const pci_location_t *state, uint32_t reg, uint8_t *value)
+{
+    outpd(PCI_CONFIG_ADDRESS, type1_address(state, reg));
+    *value = inp(PCI_CONFIG_DATA + (reg & 3));
+
+    return _PCI_SUCCESSFUL;
+}
+
+static int type1_write_config_word(const pci_location_t *state, uint32_t reg, uint32_t value)
+{
+    if (reg & 3)
+        return _PCI_BAD_REGISTER_NUMBER;
+
+    outpd(PCI_CONFIG_ADDRESS, type1_address(state, reg));
+    outpd(PCI_CONFIG_DATA, value);
+
+    return _PCI_SUCCESSFUL;
+}
+
+static int type1_write_config_half(const pci_location_t *state, uint32_t reg, uint16_t value)
+{
+    if (reg & 1)
+        return _PCI_BAD_REGISTER_NUMBER;
+
+    outpd(PCI_CONFIG_ADDRESS, type1_address(state, reg));
+    outpw(PCI_CONFIG_DATA + (reg & 2), value);
+
+    return _PCI_SUCCESSFUL;
+}
+
+static int type1_write_config_byte(const pci_location_t *state, uint32_t reg, uint8_t value)
+{
+    outpd(PCI_CONFIG_ADDRESS, type1_address(state, reg));
+    outp(PCI_CONFIG_DATA + (reg & 3), value);
+
+    return _PCI_SUCCESSFUL;
+}
+
+/*
+ * walk every function on every bus, calling match on the ones that are there.
+ * the index'th match is returned in state.
+ */
+static int type1_find(pci_location_t *state, uint16_t index,
+                      bool (*match)(const pci_location_t *loc, uint32_t id, uint32_t class_rev, uint32_t arg),
+                      uint32_t arg)
+{
+    pci_location_t loc;
+
+    for (uint bus = 0; bus <= (uint)last_bus; bus++) {
+        for (uint dev = 0; dev < 32; dev++) {
+            for (uint fn = 0; fn < 8; fn++) {
+                loc.bus = bus;
+                loc.dev_fn = (dev << 3) | fn;
+
+                uint32_t id;
+                type1_read_config_word(&loc, PCI_CONFIG_VENDOR_ID, &id);
+                if ((id & 0xffff) == 0xffff) {
+                    /* no function 0 means no device */
+                    if (fn == 0)
+                        break;
+                    continue;
+                }
+
+                uint32_t class_rev;
+                type1_read_config_word(&loc, PCI_CONFIG_REVISION_ID, &class_rev);
+
+                if (match(&loc, id, class_rev, arg) && index-- == 0) {
+                    *state = loc;
+                    return _PCI_SUCCESSFUL;
+                }
+
+                /* only look past function 0 of multi function devices */
+                if (fn == 0) {
+                    uint8_t header_type;
+                    type1_read_config_byte(&loc, PCI_CONFIG_HEADER_TYPE, &header_type);
+                    if (!(header_type & PCI_HEADER_TYPE_MULTI_FN))
+                        break;
+                }
+            }
+        }
+    }
+
+    return _PCI_DEVICE_NOT_FOUND;
+}
+
+static bool type1_match_device(const pci_location_t *loc, uint32_t id, uint32_t class_rev, uint32_t arg)
+{
+    return id == arg;
+}
+
+static bool type1_match_class(const pci_location_t *loc, uint32_t id, uint32_t class_rev, uint32_t arg)
+{
+    return (class_rev >> 8) == arg;
+}
+
+static int type1_find_pci_device(pci_location_t *state, uint16_t device_id, uint16_t vendor_id, uint16_t index)
+{
+    return type1_find(state, index, type1_match_device, ((uint32_t)device_id << 16) | vendor_id);
+}
+
+static int type1_find_pci_class_code(pci_location_t *state, uint32_t class_code, uint16_t index)
+{
+    return type1_find(state, index, type1_match_class, class_code & 0xffffff);
+}
+
+static int type1_get_irq_routing_options(irq_routing_options_t *options, uint16_t *pci_irqs)
+{
+    return _PCI_FUNC_NOT_SUPPORTED;
+}
+
+static int type1_set_irq_hw_int(const pci_location_t *state, uint8_t int_pin, uint8_t irq)
+{
+    return _PCI_FUNC_NOT_SUPPORTED;
+}
+
+static int pci_type1_detect(void)
+{
+    /* the address register reads back what was written if the mechanism is there */
+    outpd(PCI_CONFIG_ADDRESS, 0x80000000);
+    if (inpd(PCI_CONFIG_ADDRESS) != 0x80000000)
+        return -1;
+
+    /* there's no cheap way to find the last bus, so look at all of them */
+    last_bus = 255;
+
+    g_pci_find_pci_device = type1_find_pci_device;
+    g_pci_find_pci_class_code = type1_find_pci_class_code;
+
+    g_pci_read_config_word = type1_read_config_word;
+    g_pci_read_config_half = type1_read_config_half;
+    g_pci_read_config_byte = type1_read_config_byte;
+
+    g_pci_write_config_word = type1_write_config_word;
+    g_pci_write_config_half = type1_write_config_half;
+    g_pci_write_config_byte = type1_write_config_byte;
+
+    g_pci_get_irq_routing_options = type1_get_irq_routing_options;
+    g_pci_set_irq_hw_int = type1_set_irq_hw_int;
+
+    return 0;
+}
@@ -29,10 +29,19 @@
 #include <platform.h>
 #include "platform_p.h"
 #include <platform/pc.h>
+#include <platform/ahci.h>
+#include <platform/nvme.h>
 #include <platform/multiboot.h>
 #include <platform/console.h>
 #include <platform/keyboard.h>
 #include <dev/pci.h>
+#if WITH_DEV_VIRTIO
+#include <dev/virtio.h>
+#include <dev/virtio/net.h>
+#endif
+#if WITH_LIB_MINIP
+#include <lib/minip.h>
+#endif
 #include <dev/uart.h>
 #include <arch/x86.h>
 #include <arch/mmu.h>
@@ -257,4 +266,29 @@ void platform_init(void)
 #endif
 
     platform_init_mmu_mappings();
+
+    lapic_init();
+
+    ahci_init();
+    nvme_init();
+
+#if WITH_DEV_VIRTIO
+    /* detect any virtio devices on the pci bus */
+    virtio_pci_detect();
+
+#if WITH_LIB_MINIP
+    if (virtio_net_found() > 0) {
+        uint8_t mac_addr[6];
+
+        virtio_net_get_mac_addr(mac_addr);
+
+        TRACEF("found virtio networking interface\n");
+
+        minip_set_macaddr(mac_addr);
+        minip_init_dhcp(virtio_net_send_minip_pkt, NULL);
+
+        virtio_net_start();
+    }
+#endif
+#endif
 }
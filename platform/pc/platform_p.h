@@ -31,3 +31,12 @@ void platform_init_debug(void);
 void platform_init_interrupts(void);
 void platform_init_timer(void);
 
+/* the boot cpu's local apic, used for message signalled interrupts */
+void lapic_init(void);
+bool lapic_present(void);
+uint32_t lapic_id(void);
+void lapic_eoi(void);
+
+/* a free msi vector and the message that raises it */
+status_t platform_alloc_msi_vector(uint *vector, uint64_t *addr, uint32_t *data);
+
@@ -5,15 +5,26 @@ MODULE := $(LOCAL_DIR)
 CPU := generic
 
 MODULE_DEPS += \
+    lib/bio \
     lib/cbuf \
+    dev/virtio/block \
+    dev/virtio/console \
+    dev/virtio/net \
+
+# pci.c provides config space access, used by the virtio pci transport
+PLATFORM_HAS_PCI := 1
+GLOBAL_DEFINES += PLATFORM_HAS_PCI=1
 
 MODULE_SRCS += \
+    $(LOCAL_DIR)/ahci.c \
     $(LOCAL_DIR)/interrupts.c \
     $(LOCAL_DIR)/platform.c \
     $(LOCAL_DIR)/timer.c \
     $(LOCAL_DIR)/debug.c \
     $(LOCAL_DIR)/console.c \
     $(LOCAL_DIR)/keyboard.c \
+    $(LOCAL_DIR)/lapic.c \
+    $(LOCAL_DIR)/nvme.c \
     $(LOCAL_DIR)/pci.c \
     $(LOCAL_DIR)/ide.c \
     $(LOCAL_DIR)/uart.c \
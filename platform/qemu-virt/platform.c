@@ -157,7 +157,12 @@ void platform_init(void)
 
     virtio_mmio_detect((void *)VIRTIO_BASE, NUM_VIRTIO_TRANSPORTS, virtio_irqs);
 
-#if WITH_LIB_MINIP
+#if WITH_LIB_LWIP
+    if (virtio_net_found() > 0) {
+        TRACEF("found virtio networking interface, starting lwip on it\n");
+        virtio_net_lwip_add();
+    }
+#elif WITH_LIB_MINIP
     if (virtio_net_found() > 0) {
         uint8_t mac_addr[6];
 
@@ -13,6 +13,11 @@ ARM_CPU ?= cortex-a15
 endif
 WITH_SMP ?= 1
 
+# the gicv3 driver needs qemu started with -machine virt,gic-version=3
+ifeq ($(ARCH),arm64)
+ARM_GIC_VERSION ?= 2
+endif
+
 LK_HEAP_IMPLEMENTATION ?= dlmalloc
 
 MODULE_SRCS += \
@@ -31,6 +36,7 @@ MODULE_DEPS += \
     dev/interrupt/arm_gic \
     dev/timer/arm_generic \
     dev/virtio/block \
+    dev/virtio/console \
     dev/virtio/gpu \
     dev/virtio/net \
 
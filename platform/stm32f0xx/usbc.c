@@ -31,6 +31,7 @@
 #include <err.h>
 #include <dev/usb.h>
 #include <dev/usbc.h>
+#include <kernel/spinlock.h>
 #include <arch/arm/cm.h>
 #include <platform/rcc.h>
 #include <platform/stm32.h>
@@ -48,11 +49,13 @@
 
 struct ep_status {
     bool ack_ep0_in;
-    usbc_transfer_t *transfer;
+    usbc_transfer_t *transfer;  // the one the hardware is working on
+    struct list_node queue;     // the ones waiting behind it
 };
 
 static struct {
     bool do_resched;
+    spin_lock_t lock;
 
     struct ep_status ep_in[NUM_EP];
     struct ep_status ep_out[NUM_EP];
@@ -88,6 +91,12 @@ void stm32_usbc_init(void)
 
     usbc.pma_highwater = 0x40;
 
+    usbc.lock = SPIN_LOCK_INITIAL_VALUE;
+    for (uint i = 0; i < NUM_EP; i++) {
+        list_initialize(&usbc.ep_in[i].queue);
+        list_initialize(&usbc.ep_out[i].queue);
+    }
+
     // Set LL Driver parameters
     usbc.handle.Instance = USB;
     usbc.handle.Init.dev_endpoints = 4;
@@ -116,27 +125,89 @@ void HAL_PCD_MspInit(PCD_HandleTypeDef *hpcd)
     NVIC_EnableIRQ(USB_IRQn);
 }
 
-void HAL_PCD_DataOutStageCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum)
+static struct ep_status *ep_status(ep_t ep, bool in)
 {
-    LTRACEF("epnum %u\n", epnum);
+    return in ? &usbc.ep_in[ep] : &usbc.ep_out[ep];
+}
 
-    if (epnum == 0) {
-        usbc_ep0_ack();
-    } else if (usbc.ep_out[epnum].transfer) {
-        // completing a transfer
-        usbc_transfer_t *t = usbc.ep_out[epnum].transfer;
-        usbc.ep_out[epnum].transfer = NULL;
+// Hand the next queued transfer to the hardware if the endpoint is idle.
+static void ep_start_next_locked(ep_t ep, bool in)
+{
+    struct ep_status *s = ep_status(ep, in);
+
+    if (s->transfer)
+        return;
 
+    usbc_transfer_t *t = list_remove_head_type(&s->queue, usbc_transfer_t, node);
+    if (!t)
+        return;
+
+    s->transfer = t;
+    if (in) {
+        HAL_PCD_EP_Transmit(&usbc.handle, ep, t->buf, t->buflen);
+    } else {
+        HAL_PCD_EP_Receive(&usbc.handle, ep, t->buf, t->buflen);
+    }
+}
+
+// Retire the transfer the hardware finished.  The next one is started
+// before calling back, so the endpoint doesn't sit idle meanwhile.
+static void ep_complete(ep_t ep, bool in, uint bufpos)
+{
+    struct ep_status *s = ep_status(ep, in);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&usbc.lock, state);
+    usbc_transfer_t *t = s->transfer;
+    s->transfer = NULL;
+    ep_start_next_locked(ep, in);
+    spin_unlock_irqrestore(&usbc.lock, state);
+
+    if (t) {
         LTRACEF("completing transfer %p\n", t);
 
-        PCD_EPTypeDef *ep = &hpcd->OUT_ep[epnum];
-        t->bufpos = ep->xfer_count;
+        t->bufpos = bufpos;
         t->result = 0;
-        t->callback(epnum, t);
+        t->callback(ep, t);
         usbc.do_resched = true;
     }
 }
 
+// Fail the current transfer and everything queued behind it.
+static void ep_cancel_all(ep_t ep, bool in)
+{
+    struct ep_status *s = ep_status(ep, in);
+    struct list_node cancelled = LIST_INITIAL_VALUE(cancelled);
+    usbc_transfer_t *t;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&usbc.lock, state);
+    if (s->transfer) {
+        list_add_tail(&cancelled, &s->transfer->node);
+        s->transfer = NULL;
+    }
+    while ((t = list_remove_head_type(&s->queue, usbc_transfer_t, node))) {
+        list_add_tail(&cancelled, &t->node);
+    }
+    spin_unlock_irqrestore(&usbc.lock, state);
+
+    while ((t = list_remove_head_type(&cancelled, usbc_transfer_t, node))) {
+        t->result = ERR_CANCELLED;
+        t->callback(ep, t);
+    }
+}
+
+void HAL_PCD_DataOutStageCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum)
+{
+    LTRACEF("epnum %u\n", epnum);
+
+    if (epnum == 0) {
+        usbc_ep0_ack();
+    } else {
+        ep_complete(epnum, false, hpcd->OUT_ep[epnum].xfer_count);
+    }
+}
+
 void HAL_PCD_DataInStageCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum)
 {
     PCD_EPTypeDef *ep = &hpcd->IN_ep[epnum];
@@ -154,19 +225,7 @@ void HAL_PCD_DataInStageCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum)
         }
     } else {
         // in transfer done
-        if (usbc.ep_in[epnum].transfer) {
-            // completing a transfer
-            usbc_transfer_t *t = usbc.ep_in[epnum].transfer;
-            usbc.ep_in[epnum].transfer = NULL;
-
-            LTRACEF("completing transfer %p\n", t);
-
-            PCD_EPTypeDef *ep = &hpcd->IN_ep[epnum];
-            t->bufpos = ep->xfer_count;
-            t->result = 0;
-            t->callback(epnum, t);
-            usbc.do_resched = true;
-        }
+        ep_complete(epnum, true, ep->xfer_count);
     }
 }
 
@@ -193,18 +252,8 @@ void HAL_PCD_ResetCallback(PCD_HandleTypeDef *hpcd)
 
     /* fail all the outstanding transactions */
     for (uint i = 0; i < NUM_EP; i++) {
-        if (usbc.ep_in[i].transfer) {
-            usbc_transfer_t *t = usbc.ep_in[i].transfer;
-            usbc.ep_in[i].transfer = NULL;
-            t->result = ERR_CANCELLED;
-            t->callback(i, t);
-        }
-        if (usbc.ep_out[i].transfer) {
-            usbc_transfer_t *t = usbc.ep_out[i].transfer;
-            usbc.ep_out[i].transfer = NULL;
-            t->result = ERR_CANCELLED;
-            t->callback(i, t);
-        }
+        ep_cancel_all(i, true);
+        ep_cancel_all(i, false);
     }
 
     HAL_PCD_EP_Open(&usbc.handle, 0, 0x40, PCD_EP_TYPE_CTRL);
@@ -326,11 +375,13 @@ status_t usbc_queue_rx(ep_t ep, usbc_transfer_t *transfer)
 {
     LTRACEF("ep %u, transfer %p (buf %p, buflen %zu)\n", ep, transfer, transfer->buf, transfer->buflen);
 
-    DEBUG_ASSERT(ep <= NUM_EP);
-    DEBUG_ASSERT(usbc.ep_out[ep].transfer == NULL);
+    DEBUG_ASSERT(ep < NUM_EP);
 
-    usbc.ep_out[ep].transfer = transfer;
-    HAL_PCD_EP_Receive(&usbc.handle, ep, transfer->buf, transfer->buflen);
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&usbc.lock, state);
+    list_add_tail(&usbc.ep_out[ep].queue, &transfer->node);
+    ep_start_next_locked(ep, false);
+    spin_unlock_irqrestore(&usbc.lock, state);
 
     return NO_ERROR;
 }
@@ -339,11 +390,13 @@ status_t usbc_queue_tx(ep_t ep, usbc_transfer_t *transfer)
 {
     LTRACEF("ep %u, transfer %p (buf %p, buflen %zu)\n", ep, transfer, transfer->buf, transfer->buflen);
 
-    DEBUG_ASSERT(ep <= NUM_EP);
-    DEBUG_ASSERT(usbc.ep_in[ep].transfer == NULL);
+    DEBUG_ASSERT(ep < NUM_EP);
 
-    usbc.ep_in[ep].transfer = transfer;
-    HAL_PCD_EP_Transmit(&usbc.handle, ep, transfer->buf, transfer->buflen);
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&usbc.lock, state);
+    list_add_tail(&usbc.ep_in[ep].queue, &transfer->node);
+    ep_start_next_locked(ep, true);
+    spin_unlock_irqrestore(&usbc.lock, state);
 
     return NO_ERROR;
 }
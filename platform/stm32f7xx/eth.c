@@ -61,7 +61,9 @@
 #include <dev/display.h>
 #include <kernel/event.h>
 #include <kernel/thread.h>
+#include <kernel/spinlock.h>
 #include <arch/ops.h>
+#include <arch/arm.h>
 #include <arch/arm/cm.h>
 #include <platform.h>
 #include <platform/stm32.h>
@@ -81,25 +83,57 @@
 /* KSZ8721 PHY Address*/
 #define KSZ8721_PHY_ADDRESS             0x01
 
+/* descriptors in each ring, the buffers they point at are pktbufs */
+#ifndef ETH_RX_DESC_CNT
+#define ETH_RX_DESC_CNT                 16
+#endif
+#ifndef ETH_TX_DESC_CNT
+#define ETH_TX_DESC_CNT                 16
+#endif
+
+/* received frames handled before their descriptors are handed back as a batch */
+#define ETH_RX_BUDGET                   8
+
+/* how long a sender waits for room in the tx ring */
+#define ETH_TX_TIMEOUT                  100
+
 struct eth_status {
     ETH_HandleTypeDef EthHandle;
 
     eth_phy_itf eth_phy;
-    event_t rx_event;
+    event_t event;      // rx or tx completion, for the worker thread
+    event_t tx_event;   // tx completion, for senders waiting on the ring
+
+    /* in DTCM, see below */
+    ETH_DMADescTypeDef  *DMARxDscrTab;  // ETH_RX_DESC_CNT
+    ETH_DMADescTypeDef  *DMATxDscrTab;  // ETH_TX_DESC_CNT
 
-    /* allocated directly out of DTCM below */
-    ETH_DMADescTypeDef  *DMARxDscrTab;  // ETH_RXBUFNB
-    ETH_DMADescTypeDef  *DMATxDscrTab;  // ETH_TXBUFNB
-    uint8_t             *Rx_Buff;       // ETH_RXBUFNB * ETH_RX_BUF_SIZE
-    uint8_t             *Tx_Buff;       // ETH_TXBUFNB * ETH_TX_BUF_SIZE
+#if WITH_LIB_MINIP
+    pktbuf_t *rx_pbufs[ETH_RX_DESC_CNT];
+    uint rx_head;
+
+    /* a frame's pktbuf chain is kept at its last descriptor and freed once that completes */
+    spin_lock_t tx_lock;
+    pktbuf_t *tx_pbufs[ETH_TX_DESC_CNT];
+    uint tx_head;   // next descriptor to fill
+    uint tx_tail;   // oldest descriptor in use
+    uint tx_count;
+#endif
 };
 
 static struct eth_status eth;
 
-static int eth_rx_worker(void *arg);
+/* descriptor rings live in DTCM, which the cpu doesn't cache */
+#if !WITH_FAST_SECTIONS
+#error ethernet descriptors need DTCM
+#endif
+static ETH_DMADescTypeDef eth_tx_desc[ETH_TX_DESC_CNT] __FAST_DATA;
+static ETH_DMADescTypeDef eth_rx_desc[ETH_RX_DESC_CNT] __FAST_DATA;
+
+static int eth_worker(void *arg);
 
 #if WITH_LIB_MINIP
-static int eth_send_raw_pkt(pktbuf_t *p);
+static status_t eth_rings_init(void);
 #endif
 
 status_t eth_init(const uint8_t *mac_addr, eth_phy_itf eth_phy)
@@ -108,6 +142,10 @@ status_t eth_init(const uint8_t *mac_addr, eth_phy_itf eth_phy)
 
     DEBUG_ASSERT(mac_addr);
 
+#if !WITH_LIB_MINIP
+    /* frames live in pktbufs, nothing to do without the stack */
+    return ERR_NOT_SUPPORTED;
+#else
     eth.eth_phy = eth_phy;
 
     /* Enable ETHERNET clock  */
@@ -136,39 +174,32 @@ status_t eth_init(const uint8_t *mac_addr, eth_phy_itf eth_phy)
     }
 
     eth.EthHandle.Init.RxMode = ETH_RXINTERRUPT_MODE;
-    //eth.EthHandle.Init.ChecksumMode = ETH_CHECKSUM_BY_HARDWARE; // XXX icmp checksums corrupted if stack stuff valid checksum
-    eth.EthHandle.Init.ChecksumMode = ETH_CHECKSUM_BY_SOFTWARE;
+    /* the mac checks received checksums. insertion on transmit is picked per frame in eth_send,
+     * since inserting over a checksum the stack already filled in corrupts it */
+    eth.EthHandle.Init.ChecksumMode = ETH_CHECKSUM_BY_HARDWARE;
 
     /* configure ethernet peripheral (GPIOs, clocks, MAC, DMA) */
     if (HAL_ETH_Init(&eth.EthHandle) != HAL_OK)
         return ERR_NOT_CONFIGURED;
 
-    /* allocate descriptor and buffer memory from DTCM */
-    /* XXX do in a more generic way */
-#if MEMBASE == 0x20000000
-#error DTCM will collide with MEMBASE
-#endif
-    addr_t tcm_ptr = RAMDTCM_BASE;
+    eth.DMATxDscrTab = eth_tx_desc;
+    eth.DMARxDscrTab = eth_rx_desc;
 
-    eth.DMATxDscrTab = (void *)tcm_ptr;
-    tcm_ptr += sizeof(*eth.DMATxDscrTab) * ETH_TXBUFNB;
-    eth.DMARxDscrTab = (void *)tcm_ptr;
-    tcm_ptr += sizeof(*eth.DMARxDscrTab) * ETH_RXBUFNB;
+    /* chain the descriptors and fill the rx ring */
+    status_t err = eth_rings_init();
+    if (err < 0)
+        return err;
 
-    eth.Tx_Buff = (void *)tcm_ptr;
-    tcm_ptr += ETH_TX_BUF_SIZE * ETH_TXBUFNB;
-    eth.Rx_Buff = (void *)tcm_ptr;
-    tcm_ptr += ETH_RX_BUF_SIZE * ETH_RXBUFNB;
-
-    /* Initialize Tx Descriptors list: Chain Mode */
-    HAL_ETH_DMATxDescListInit(&eth.EthHandle, eth.DMATxDscrTab, eth.Tx_Buff, ETH_TXBUFNB);
-
-    /* Initialize Rx Descriptors list: Chain Mode  */
-    HAL_ETH_DMARxDescListInit(&eth.EthHandle, eth.DMARxDscrTab, eth.Rx_Buff, ETH_RXBUFNB);
+    /* set up events to block the worker thread and senders on */
+    event_init(&eth.event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    event_init(&eth.tx_event, false, EVENT_FLAG_AUTOUNSIGNAL);
 
     /* Enable MAC and DMA transmission and reception */
     HAL_ETH_Start(&eth.EthHandle);
 
+    /* interrupt on frames going out too, so their pktbufs are freed promptly */
+    __HAL_ETH_DMA_ENABLE_IT(&eth.EthHandle, ETH_DMA_IT_T);
+
 #if 0
     // XXX DP83848 specific
     /**** Configure PHY to generate an interrupt when Eth Link state changes ****/
@@ -190,11 +221,11 @@ status_t eth_init(const uint8_t *mac_addr, eth_phy_itf eth_phy)
     HAL_ETH_WritePHYRegister(&eth.EthHandle, PHY_MISR, regvalue);
 #endif
 
-    /* set up an event to block the rx thread on */
-    event_init(&eth.rx_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    /* the mac fills in tcp checksums from here on */
+    minip_set_tx_offloads(MINIP_TX_OFFLOAD_CSUM, 0);
 
     /* start worker thread */
-    thread_resume(thread_create("eth_rx", &eth_rx_worker, NULL, HIGH_PRIORITY, DEFAULT_STACK_SIZE));
+    thread_resume(thread_create("eth", &eth_worker, NULL, HIGH_PRIORITY, DEFAULT_STACK_SIZE));
 
     /* enable interrupts */
     HAL_NVIC_EnableIRQ(ETH_IRQn);
@@ -202,6 +233,7 @@ status_t eth_init(const uint8_t *mac_addr, eth_phy_itf eth_phy)
     LTRACE_EXIT;
 
     return NO_ERROR;
+#endif
 }
 
 void stm32_ETH_IRQ(void)
@@ -209,6 +241,9 @@ void stm32_ETH_IRQ(void)
     arm_cm_irq_entry();
 
     HAL_ETH_IRQHandler(&eth.EthHandle);
+    /* it only handles one of rx and tx complete per call */
+    if (__HAL_ETH_DMA_GET_FLAG(&eth.EthHandle, ETH_DMA_FLAG_T))
+        HAL_ETH_IRQHandler(&eth.EthHandle);
 
     arm_cm_irq_exit(true);
 }
@@ -220,50 +255,307 @@ void stm32_ETH_IRQ(void)
   */
 void HAL_ETH_RxCpltCallback(ETH_HandleTypeDef *heth)
 {
-    event_signal(&eth.rx_event, false);
+    event_signal(&eth.event, false);
+}
+
+/**
+  * @brief  Ethernet Tx Transfer completed callback
+  * @param  heth: ETH handle
+  * @retval None
+  */
+void HAL_ETH_TxCpltCallback(ETH_HandleTypeDef *heth)
+{
+    event_signal(&eth.tx_event, false);
+    event_signal(&eth.event, false);
+}
+
+#if WITH_LIB_MINIP
+static void eth_rx_desc_set(uint i, pktbuf_t *p)
+{
+    eth.rx_pbufs[i] = p;
+    eth.DMARxDscrTab[i].Buffer1Addr = (uint32_t)p->buffer;
+}
+
+static status_t eth_rings_init(void)
+{
+    memset(eth.DMATxDscrTab, 0, sizeof(*eth.DMATxDscrTab) * ETH_TX_DESC_CNT);
+    for (uint i = 0; i < ETH_TX_DESC_CNT; i++) {
+        eth.DMATxDscrTab[i].Status = ETH_DMATXDESC_TCH;
+        eth.DMATxDscrTab[i].Buffer2NextDescAddr = (uint32_t)&eth.DMATxDscrTab[(i + 1) % ETH_TX_DESC_CNT];
+    }
+    eth.tx_lock = SPIN_LOCK_INITIAL_VALUE;
+    eth.tx_head = eth.tx_tail = eth.tx_count = 0;
+
+    /* the dma receives straight into pktbufs, each big enough for any frame */
+    memset(eth.DMARxDscrTab, 0, sizeof(*eth.DMARxDscrTab) * ETH_RX_DESC_CNT);
+    for (uint i = 0; i < ETH_RX_DESC_CNT; i++) {
+        pktbuf_t *p = pktbuf_alloc();
+        if (!p)
+            return ERR_NO_MEMORY;
+
+        eth_rx_desc_set(i, p);
+        eth.DMARxDscrTab[i].ControlBufferSize = ETH_DMARXDESC_RCH | (PKTBUF_SIZE & ETH_DMARXDESC_RBS1);
+        eth.DMARxDscrTab[i].Buffer2NextDescAddr = (uint32_t)&eth.DMARxDscrTab[(i + 1) % ETH_RX_DESC_CNT];
+
+        arch_clean_invalidate_cache_range((addr_t)p->buffer, PKTBUF_SIZE);
+    }
+    DSB;
+    for (uint i = 0; i < ETH_RX_DESC_CNT; i++) {
+        eth.DMARxDscrTab[i].Status = ETH_DMARXDESC_OWN;
+    }
+    eth.rx_head = 0;
+
+    eth.EthHandle.Instance->DMATDLAR = (uint32_t)eth.DMATxDscrTab;
+    eth.EthHandle.Instance->DMARDLAR = (uint32_t)eth.DMARxDscrTab;
+
+    return NO_ERROR;
 }
 
-static status_t eth_send(const void *buf, size_t len)
+/* the mac inserts tcp/udp checksums itself, but only over a zeroed checksum field */
+static void eth_tx_prep_csum(pktbuf_t *p)
 {
-    status_t err;
-    __IO ETH_DMADescTypeDef *DmaTxDesc;
+    uint8_t *frame = p->data;
 
-    LTRACEF("buf %p, len %zu\n", buf, len);
+    /* the stack keeps all the headers in the first segment */
+    DEBUG_ASSERT(frame[12] == 0x08 && frame[13] == 0x00);
 
-    DmaTxDesc = eth.EthHandle.TxDesc;
+    size_t l4_start = 14 + (frame[14] & 0xf) * 4;
+    switch (frame[14 + 9]) {
+        case 6: /* tcp */
+            frame[l4_start + 16] = frame[l4_start + 17] = 0;
+            break;
+        case 17: /* udp */
+            frame[l4_start + 6] = frame[l4_start + 7] = 0;
+            break;
+    }
+}
 
-    /* is the buffer available? */
-    if ((DmaTxDesc->Status & ETH_DMATXDESC_OWN) != 0) {
-        LTRACEF("tx buffer not available\n");
-        err = ERR_IO;
-        goto error;
+/* free the frames the dma has finished with */
+static void eth_tx_reap_locked(void)
+{
+    while (eth.tx_count > 0 && (eth.DMATxDscrTab[eth.tx_tail].Status & ETH_DMATXDESC_OWN) == 0) {
+        pktbuf_t *p = eth.tx_pbufs[eth.tx_tail];
+        if (p) {
+            eth.tx_pbufs[eth.tx_tail] = NULL;
+            pktbuf_free(p, false);
+        }
+
+        eth.tx_tail = (eth.tx_tail + 1) % ETH_TX_DESC_CNT;
+        eth.tx_count--;
+    }
+}
+
+static void eth_tx_reap(void)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&eth.tx_lock, state);
+    eth_tx_reap_locked();
+    spin_unlock_irqrestore(&eth.tx_lock, state);
+}
+
+/* put a frame, which may be a chain of pktbufs, on the tx ring as it is. takes ownership of p */
+static status_t eth_send(pktbuf_t *p)
+{
+    struct arch_cache_range ranges[ETH_TX_DESC_CNT];
+    uint segs = 0;
+
+    LTRACEF("p %p, len %zu\n", p, pktbuf_chain_len(p));
+
+    /* one descriptor per non empty segment */
+    for (pktbuf_t *q = p; q; q = q->next) {
+        if (q->dlen == 0)
+            continue;
+        if (segs == ETH_TX_DESC_CNT) {
+            pktbuf_free(p, true);
+            return ERR_TOO_BIG;
+        }
+        ranges[segs].start = (vaddr_t)q->data;
+        ranges[segs].len = q->dlen;
+        segs++;
+    }
+    if (segs == 0) {
+        pktbuf_free(p, true);
+        return NO_ERROR;
     }
 
-    uint8_t *buffer = (uint8_t *)(DmaTxDesc->Buffer1Addr);
-    memcpy(buffer, buf, len);
+    uint32_t csum = ETH_DMATXDESC_CIC_BYPASS;
+    if (p->flags & PKTBUF_FLAG_CKSUM_PARTIAL) {
+        eth_tx_prep_csum(p);
+        csum = ETH_DMATXDESC_CIC_TCPUDPICMP_FULL;
+    }
 
-    HAL_StatusTypeDef e = HAL_ETH_TransmitFrame(&eth.EthHandle, len);
+    /* make sure the frame is fully written to memory before the dma reads it */
+    arch_clean_cache_ranges(ranges, segs);
 
-    err = (e == HAL_OK) ? NO_ERROR : ERR_IO;
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&eth.tx_lock, state);
 
-error:
-    /* When Transmit Underflow flag is set, clear it and issue a Transmit Poll Demand to resume transmission */
+    eth_tx_reap_locked();
+    while (ETH_TX_DESC_CNT - eth.tx_count < segs) {
+        spin_unlock_irqrestore(&eth.tx_lock, state);
+        if (event_wait_timeout(&eth.tx_event, ETH_TX_TIMEOUT) < 0) {
+            LTRACEF("tx ring full\n");
+            pktbuf_free(p, true);
+            return ERR_TIMED_OUT;
+        }
+        spin_lock_irqsave(&eth.tx_lock, state);
+        eth_tx_reap_locked();
+    }
+
+    uint first = eth.tx_head;
+    uint i = first;
+    uint n = 0;
+    for (pktbuf_t *q = p; q; q = q->next) {
+        if (q->dlen == 0)
+            continue;
+
+        ETH_DMADescTypeDef *desc = &eth.DMATxDscrTab[i];
+        uint32_t status = ETH_DMATXDESC_TCH | csum;
+        if (n == 0)
+            status |= ETH_DMATXDESC_FS;
+        if (n == segs - 1)
+            status |= ETH_DMATXDESC_LS | ETH_DMATXDESC_IC;
+        /* the first descriptor goes to the dma last, so it never starts on a partial frame */
+        if (n != 0)
+            status |= ETH_DMATXDESC_OWN;
+
+        desc->Buffer1Addr = (uint32_t)q->data;
+        desc->ControlBufferSize = q->dlen & ETH_DMATXDESC_TBS1;
+        desc->Status = status;
+        eth.tx_pbufs[i] = (n == segs - 1) ? p : NULL;
+
+        i = (i + 1) % ETH_TX_DESC_CNT;
+        n++;
+    }
+    eth.tx_head = i;
+    eth.tx_count += segs;
+
+    DSB;
+    eth.DMATxDscrTab[first].Status |= ETH_DMATXDESC_OWN;
+    DSB;
+
+    /* When Transmit Underflow flag is set, clear it before the Transmit Poll Demand resumes transmission */
     if ((eth.EthHandle.Instance->DMASR & ETH_DMASR_TUS) != 0) {
-        /* Clear TUS ETHERNET DMA flag */
         eth.EthHandle.Instance->DMASR = ETH_DMASR_TUS;
+    }
+    eth.EthHandle.Instance->DMATPDR = 0;
+
+    spin_unlock_irqrestore(&eth.tx_lock, state);
 
-        /* Resume DMA transmission*/
-        eth.EthHandle.Instance->DMATPDR = 0;
+    return NO_ERROR;
+}
+
+/* with checksum offload on, the extended status says whether an ip frame's checksums checked out */
+static uint32_t eth_rx_csum_flags(const ETH_DMADescTypeDef *desc, uint32_t status)
+{
+    if ((status & ETH_DMARXDESC_MAMPCE) == 0)
+        return 0;
+
+    uint32_t ext = desc->ExtendedStatus;
+    if ((ext & ETH_DMAPTPRXDESC_IPV4PR) == 0 || (ext & (ETH_DMAPTPRXDESC_IPHE | ETH_DMAPTPRXDESC_IPPE)))
+        return 0;
+
+    switch (ext & ETH_DMAPTPRXDESC_IPPT) {
+        case ETH_DMAPTPRXDESC_IPPT_TCP:
+            return PKTBUF_FLAG_CKSUM_IP_GOOD | PKTBUF_FLAG_CKSUM_TCP_GOOD;
+        case ETH_DMAPTPRXDESC_IPPT_UDP:
+            return PKTBUF_FLAG_CKSUM_IP_GOOD | PKTBUF_FLAG_CKSUM_UDP_GOOD;
+        default:
+            return PKTBUF_FLAG_CKSUM_IP_GOOD;
+    }
+}
+
+/* hand a received frame up the stack, returning the pktbuf to put back on the ring */
+static pktbuf_t *eth_rx_deliver(pktbuf_t *p)
+{
+    /* give the frame away if there's a buffer to take its place */
+    pktbuf_t *fresh = pktbuf_alloc_nowait();
+    if (fresh) {
+        minip_rx_driver_callback_owned(p);
+        return fresh;
     }
 
-    return err;
+    /* otherwise just lend it out and keep the buffer */
+    minip_rx_driver_callback(p);
+    return p;
 }
 
-static int eth_rx_worker(void *arg)
+/* take up to budget frames off the rx ring, handing the descriptors back in one go */
+static int eth_rx_poll(int budget)
+{
+    struct arch_cache_range ranges[ETH_RX_BUDGET];
+    uint slots[ETH_RX_BUDGET];
+    int n = 0;
+
+    DEBUG_ASSERT(budget <= ETH_RX_BUDGET);
+
+    while (n < budget) {
+        uint i = eth.rx_head;
+        ETH_DMADescTypeDef *desc = &eth.DMARxDscrTab[i];
+        uint32_t status = desc->Status;
+
+        if (status & ETH_DMARXDESC_OWN)
+            break;
+
+        /* every buffer holds a whole frame, anything else is an error */
+        const uint32_t mask = ETH_DMARXDESC_ES | ETH_DMARXDESC_FS | ETH_DMARXDESC_LS;
+        if ((status & mask) == (ETH_DMARXDESC_FS | ETH_DMARXDESC_LS)) {
+            pktbuf_t *p = eth.rx_pbufs[i];
+
+            p->data = p->buffer;
+            /* strip the crc */
+            p->dlen = ((status & ETH_DMARXDESC_FL) >> ETH_DMARXDESC_FRAMELENGTHSHIFT) - 4;
+            p->flags &= ~(PKTBUF_FLAG_CKSUM_IP_GOOD | PKTBUF_FLAG_CKSUM_TCP_GOOD | PKTBUF_FLAG_CKSUM_UDP_GOOD);
+            p->flags |= eth_rx_csum_flags(desc, status);
+
+            LTRACEF("got packet len %zu, buffer %p, flags %#x\n", p->dlen, p->buffer, p->flags);
+
+            /* drop any lines the cpu pulled in while the dma owned the buffer */
+            arch_invalidate_cache_range((addr_t)p->data, p->dlen);
+
+            eth_rx_desc_set(i, eth_rx_deliver(p));
+        } else {
+            LTRACEF("dropping frame, status %#x\n", status);
+        }
+
+        /* whatever is in the slot now has its dirty lines flushed out below */
+        ranges[n].start = (vaddr_t)eth.rx_pbufs[i]->buffer;
+        ranges[n].len = PKTBUF_SIZE;
+        slots[n] = i;
+        n++;
+
+        eth.rx_head = (i + 1) % ETH_RX_DESC_CNT;
+    }
+
+    if (n == 0)
+        return 0;
+
+    arch_clean_invalidate_cache_ranges(ranges, n);
+    DSB;
+
+    /* Set Own bit in Rx descriptors: gives the buffers back to DMA */
+    for (int j = 0; j < n; j++) {
+        eth.DMARxDscrTab[slots[j]].Status = ETH_DMARXDESC_OWN;
+    }
+    DSB;
+
+    /* When Rx Buffer unavailable flag is set: clear it and resume reception */
+    if ((eth.EthHandle.Instance->DMASR & ETH_DMASR_RBUS) != (uint32_t)RESET) {
+        /* Clear RBUS ETHERNET DMA flag */
+        eth.EthHandle.Instance->DMASR = ETH_DMASR_RBUS;
+        /* Resume DMA reception */
+        eth.EthHandle.Instance->DMARPDR = 0;
+    }
+
+    return n;
+}
+#endif
+
+static int eth_worker(void *arg)
 {
     for (;;) {
 #if 0
-        status_t event_err = event_wait_timeout(&eth.rx_event, 1000);
+        status_t event_err = event_wait_timeout(&eth.event, 1000);
         if (event_err == ERR_TIMED_OUT) {
             /* periodically poll the phys status register */
             /* XXX specific to DP83848 */
@@ -289,51 +581,17 @@ static int eth_rx_worker(void *arg)
             }
         } else {
 #else
-        status_t event_err = event_wait(&eth.rx_event);
+        status_t event_err = event_wait(&eth.event);
         if (event_err >= NO_ERROR) {
 #endif
-            // XXX probably race with the event here
-            while (HAL_ETH_GetReceivedFrame_IT(&eth.EthHandle) == HAL_OK) {
-                LTRACEF("got packet len %u, buffer %p, seg count %u\n", eth.EthHandle.RxFrameInfos.length,
-                        (void *)eth.EthHandle.RxFrameInfos.buffer,
-                        eth.EthHandle.RxFrameInfos.SegCount);
-
 #if WITH_LIB_MINIP
-                /* allocate a pktbuf header, point it at our rx buffer, and pass up the stack */
-                pktbuf_t *p = pktbuf_alloc_empty();
-                if (p) {
-                    pktbuf_add_buffer(p, (void *)eth.EthHandle.RxFrameInfos.buffer, eth.EthHandle.RxFrameInfos.length,
-                                      0, 0, NULL, NULL);
-                    p->dlen = eth.EthHandle.RxFrameInfos.length;
-
-                    minip_rx_driver_callback(p);
+            /* a full budget means there's probably more, let anyone else waiting run in between */
+            while (eth_rx_poll(ETH_RX_BUDGET) == ETH_RX_BUDGET) {
+                thread_yield();
+            }
 
-                    pktbuf_free(p, true);
-                }
+            eth_tx_reap();
 #endif
-
-                /* Release descriptors to DMA */
-                /* Point to first descriptor */
-                __IO ETH_DMADescTypeDef *dmarxdesc;
-
-                dmarxdesc = eth.EthHandle.RxFrameInfos.FSRxDesc;
-                /* Set Own bit in Rx descriptors: gives the buffers back to DMA */
-                for (uint i=0; i< eth.EthHandle.RxFrameInfos.SegCount; i++) {
-                    dmarxdesc->Status |= ETH_DMARXDESC_OWN;
-                    dmarxdesc = (ETH_DMADescTypeDef *)(dmarxdesc->Buffer2NextDescAddr);
-                }
-
-                /* Clear Segment_Count */
-                eth.EthHandle.RxFrameInfos.SegCount =0;
-
-                /* When Rx Buffer unavailable flag is set: clear it and resume reception */
-                if ((eth.EthHandle.Instance->DMASR & ETH_DMASR_RBUS) != (uint32_t)RESET) {
-                    /* Clear RBUS ETHERNET DMA flag */
-                    eth.EthHandle.Instance->DMASR = ETH_DMASR_RBUS;
-                    /* Resume DMA reception */
-                    eth.EthHandle.Instance->DMARPDR = 0;
-                }
-            }
         }
     }
 
@@ -348,20 +606,7 @@ status_t stm32_eth_send_minip_pkt(pktbuf_t *p)
 
     DEBUG_ASSERT(p && p->dlen);
 
-    if (!(p->flags & PKTBUF_FLAG_EOF)) {
-        /* can't handle multi part packets yet */
-        PANIC_UNIMPLEMENTED;
-
-        return ERR_NOT_IMPLEMENTED;
-    }
-
-    status_t err = eth_send(p->data, p->dlen);
-
-    pktbuf_free(p, true);
-
-    return err;
+    return eth_send(p);
 }
 
 #endif
-
-
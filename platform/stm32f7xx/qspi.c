@@ -28,6 +28,7 @@
 #include <arch/arm/cm.h>
 #include <kernel/event.h>
 #include <kernel/mutex.h>
+#include <kernel/spinlock.h>
 #include <lib/bio.h>
 #include <platform.h>
 #include <platform/n25qxxa.h>
@@ -68,6 +69,7 @@ static ssize_t spiflash_bdev_read_block(struct bdev *device, void *buf, bnum_t b
 static ssize_t spiflash_bdev_write_block(struct bdev *device, const void *buf, bnum_t block, uint count);
 static ssize_t spiflash_bdev_erase(struct bdev *device, off_t offset, size_t len);
 static int spiflash_ioctl(struct bdev *device, int request, void *argp);
+static status_t spiflash_bdev_submit(struct bdev *device, bio_request_t *req);
 
 static ssize_t qspi_write_page_unsafe(uint32_t addr, const uint8_t *data);
 
@@ -80,9 +82,13 @@ static status_t qspi_auto_polling_mem_ready_unsafe(QSPI_HandleTypeDef *hqspi, ui
 static HAL_StatusTypeDef qspi_cmd(QSPI_HandleTypeDef *, QSPI_CommandTypeDef *);
 static HAL_StatusTypeDef qspi_tx_dma(QSPI_HandleTypeDef *, QSPI_CommandTypeDef *, uint8_t *);
 static HAL_StatusTypeDef qspi_rx_dma(QSPI_HandleTypeDef *, QSPI_CommandTypeDef *, uint8_t *);
+static HAL_StatusTypeDef qspi_rx_dma_start(QSPI_HandleTypeDef *, QSPI_CommandTypeDef *, uint8_t *, CpltCallback);
 
 static status_t qspi_enable_linear(void);
 static status_t qspi_disable_linear(void);
+static status_t qspi_enable_linear_unsafe(void);
+static status_t qspi_disable_linear_unsafe(void);
+static void qspi_linear_invalidate(uint32_t offset, size_t len);
 static bool qspi_is_linear(void);
 
 status_t qspi_dma_init(QSPI_HandleTypeDef *hqspi);
@@ -95,6 +101,33 @@ static event_t rx_event;
 static event_t tx_event;
 static event_t st_event;
 
+/*
+ * Reads submitted through the block device's submit hook are driven from the
+ * dma completion interrupt: each finished chunk starts the next, and a finished
+ * request starts the next pending one, so a run of queued reads keeps the flash
+ * busy without waiting on a thread to wake up in between. Anything else that
+ * drives the controller holds spiflash_mutex and waits for them to drain first.
+ */
+#define QSPI_ASYNC_MAX_CHUNK (32 * 1024) // the dma count register is 16 bits
+
+static struct {
+    spin_lock_t lock;
+    struct list_node pending;
+    event_t idle;
+
+    bio_request_t *cur;
+    uint iov_index;
+    size_t iov_offset;
+    uint32_t addr;
+    size_t chunk_len;
+    ssize_t result;
+} qspi_async = {
+    .lock = SPIN_LOCK_INITIAL_VALUE,
+    .pending = LIST_INITIAL_VALUE(qspi_async.pending),
+};
+
+static void qspi_async_wait_idle_unsafe(void);
+
 status_t hal_error_to_status(HAL_StatusTypeDef hal_status);
 
 // Unsetting the DMA Enable bit in the DMA Control register isn't enough to
@@ -322,11 +355,6 @@ static ssize_t spiflash_bdev_read_block(struct bdev *device, void *buf,
     LTRACEF("device %p, buf %p, block %u, count %u\n",
             device, buf, block, count);
 
-    if (!IS_ALIGNED((uintptr_t)buf, CACHE_LINE)) {
-        DEBUG_ASSERT(IS_ALIGNED((uintptr_t)buf, CACHE_LINE));
-        return ERR_INVALID_ARGS;
-    }
-
     count = bio_trim_block_range(device, block, count);
     if (count == 0)
         return 0;
@@ -336,6 +364,28 @@ static ssize_t spiflash_bdev_read_block(struct bdev *device, void *buf,
 
     uint64_t largest_offset = (block + count) * device->block_size - 1;
 
+    // Anything the 24 bit memory mapped window reaches is read straight out of
+    // it, leaving the controller to stream quad reads back to back.
+    if (largest_offset < FOUR_BYTE_ADDR_THRESHOLD) {
+        mutex_acquire(&spiflash_mutex);
+        qspi_async_wait_idle_unsafe();
+
+        status_t result = qspi_enable_linear_unsafe();
+        if (result == NO_ERROR) {
+            size_t len = count * device->block_size;
+            memcpy(buf, (const uint8_t *)QSPI_BASE + block * device->block_size, len);
+            mutex_release(&spiflash_mutex);
+            return len;
+        }
+
+        mutex_release(&spiflash_mutex);
+    }
+
+    if (!IS_ALIGNED((uintptr_t)buf, CACHE_LINE)) {
+        DEBUG_ASSERT(IS_ALIGNED((uintptr_t)buf, CACHE_LINE));
+        return ERR_INVALID_ARGS;
+    }
+
     // /* Initialize the read command */
     s_command.InstructionMode = QSPI_INSTRUCTION_1_LINE;
     s_command.Instruction = get_specialized_instruction(QUAD_OUT_FAST_READ_CMD, largest_offset);
@@ -353,6 +403,12 @@ static ssize_t spiflash_bdev_read_block(struct bdev *device, void *buf,
     ssize_t retcode = 0;
 
     mutex_acquire(&spiflash_mutex);
+    qspi_async_wait_idle_unsafe();
+
+    retcode = qspi_disable_linear_unsafe();
+    if (retcode != NO_ERROR) {
+        goto err;
+    }
 
     s_command.Address = block * device->block_size;
     for (uint i = 0; i < count; i++) {
@@ -393,10 +449,16 @@ static ssize_t spiflash_bdev_write_block(struct bdev *device, const void *_buf,
     }
 
     const uint8_t *buf = _buf;
+    bnum_t start_block = block;
 
     mutex_acquire(&spiflash_mutex);
+    qspi_async_wait_idle_unsafe();
+
+    ssize_t total_bytes_written = qspi_disable_linear_unsafe();
+    if (total_bytes_written != NO_ERROR) {
+        goto err;
+    }
 
-    ssize_t total_bytes_written = 0;
     for (; count > 0; count--, block++) {
         ssize_t bytes_written = qspi_write_page_unsafe(block * N25QXXA_PAGE_SIZE, buf);
         if (bytes_written < 0) {
@@ -411,6 +473,7 @@ static ssize_t spiflash_bdev_write_block(struct bdev *device, const void *_buf,
     }
 
 err:
+    qspi_linear_invalidate(start_block * N25QXXA_PAGE_SIZE, (block - start_block) * N25QXXA_PAGE_SIZE);
     mutex_release(&spiflash_mutex);
     return total_bytes_written;
 }
@@ -424,8 +487,15 @@ static ssize_t spiflash_bdev_erase(struct bdev *device, off_t offset,
     }
 
     ssize_t total_erased = 0;
+    off_t start = offset;
 
     mutex_acquire(&spiflash_mutex);
+    qspi_async_wait_idle_unsafe();
+
+    total_erased = qspi_disable_linear_unsafe();
+    if (total_erased != NO_ERROR) {
+        goto finish;
+    }
 
     // Choose an erase strategy based on the number of bytes being erased.
     if (len == device->total_size && offset == 0) {
@@ -457,6 +527,7 @@ static ssize_t spiflash_bdev_erase(struct bdev *device, off_t offset,
     }
 
 finish:
+    qspi_linear_invalidate(start, len);
     mutex_release(&spiflash_mutex);
     return total_erased;
 }
@@ -552,6 +623,7 @@ status_t qspi_flash_init(size_t flash_size)
     event_init(&tx_event, false, EVENT_FLAG_AUTOUNSIGNAL);
     event_init(&rx_event, false, EVENT_FLAG_AUTOUNSIGNAL);
     event_init(&st_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    event_init(&qspi_async.idle, true, 0);
 
     mutex_init(&spiflash_mutex);
     result = mutex_acquire(&spiflash_mutex);
@@ -636,10 +708,14 @@ status_t qspi_flash_init(size_t flash_size)
     qspi_flash_device.write_block = &spiflash_bdev_write_block;
     qspi_flash_device.erase = &spiflash_bdev_erase;
     qspi_flash_device.ioctl = &spiflash_ioctl;
+    qspi_flash_device.submit = &spiflash_bdev_submit;
 
     /* we erase to 0xff */
     qspi_flash_device.erase_byte = 0xff;
 
+    /* in address order, with the next read already waiting when one finishes */
+    bio_queue_attach(&qspi_flash_device, 2, BIO_QUEUE_FLAG_SORT);
+
     bio_register_device(&qspi_flash_device);
 
 err:
@@ -848,8 +924,9 @@ static HAL_StatusTypeDef qspi_tx_dma(QSPI_HandleTypeDef *qspi_handle, QSPI_Comma
     return HAL_OK;
 }
 
-// Send data and wait for interrupt.
-static HAL_StatusTypeDef qspi_rx_dma(QSPI_HandleTypeDef *qspi_handle, QSPI_CommandTypeDef *s_command, uint8_t *buf)
+// Start receiving data, callback is made from the dma interrupt.
+static HAL_StatusTypeDef qspi_rx_dma_start(QSPI_HandleTypeDef *qspi_handle, QSPI_CommandTypeDef *s_command,
+                                           uint8_t *buf, CpltCallback callback)
 {
     // Make sure the front and back of the buffer are cache aligned.
     DEBUG_ASSERT(IS_ALIGNED((uintptr_t)buf, CACHE_LINE));
@@ -870,7 +947,7 @@ static HAL_StatusTypeDef qspi_rx_dma(QSPI_HandleTypeDef *qspi_handle, QSPI_Comma
         DMA_PERIPH_TO_MEMORY
     );
 
-    cplt_callback = DMA_RxCpltCallback;
+    cplt_callback = callback;
 
     arch_invalidate_cache_range((addr_t)buf, s_command->NbData);
 
@@ -880,11 +957,187 @@ static HAL_StatusTypeDef qspi_rx_dma(QSPI_HandleTypeDef *qspi_handle, QSPI_Comma
     qspi_handle->Instance->AR = addr_reg;
     qspi_handle->Instance->CR |= QUADSPI_CR_DMAEN;
 
+    return HAL_OK;
+}
+
+// Receive data and wait for interrupt.
+static HAL_StatusTypeDef qspi_rx_dma(QSPI_HandleTypeDef *qspi_handle, QSPI_CommandTypeDef *s_command, uint8_t *buf)
+{
+    HAL_StatusTypeDef status = qspi_rx_dma_start(qspi_handle, s_command, buf, DMA_RxCpltCallback);
+    if (status != HAL_OK) {
+        return status;
+    }
+
     event_wait(&rx_event);
 
     return HAL_OK;
 }
 
+static void qspi_async_chunk_done(void);
+
+// Must hold spiflash_mutex before calling.
+static void qspi_async_wait_idle_unsafe(void)
+{
+    event_wait(&qspi_async.idle);
+}
+
+// Start the next chunk of async read, completing requests as they run out.
+// Must hold qspi_async.lock.
+static void qspi_async_run_locked(void)
+{
+    for (;;) {
+        bio_request_t *req = qspi_async.cur;
+        if (!req) {
+            req = list_remove_head_type(&qspi_async.pending, bio_request_t, node);
+            if (!req) {
+                event_signal(&qspi_async.idle, false);
+                return;
+            }
+            qspi_async.cur = req;
+            qspi_async.iov_index = 0;
+            qspi_async.iov_offset = 0;
+            qspi_async.addr = req->block * qspi_flash_device.block_size;
+            qspi_async.result = 0;
+        }
+
+        if (qspi_async.result < 0 || qspi_async.iov_index == req->iov_count) {
+            qspi_async.cur = NULL;
+            bio_request_complete(req, qspi_async.result);
+            continue;
+        }
+
+        const bio_iovec_t *iov = &req->iov[qspi_async.iov_index];
+        size_t len = MIN(iov->len - qspi_async.iov_offset, QSPI_ASYNC_MAX_CHUNK);
+        uint8_t *buf = (uint8_t *)iov->base + qspi_async.iov_offset;
+        uint32_t largest_offset = qspi_async.addr + len - 1;
+
+        QSPI_CommandTypeDef s_command = {
+            .InstructionMode   = QSPI_INSTRUCTION_1_LINE,
+            .Instruction       = get_specialized_instruction(QUAD_OUT_FAST_READ_CMD, largest_offset),
+            .AddressMode       = QSPI_ADDRESS_1_LINE,
+            .AddressSize       = get_address_size(largest_offset),
+            .AlternateByteMode = QSPI_ALTERNATE_BYTES_NONE,
+            .DataMode          = QSPI_DATA_4_LINES,
+            .DummyCycles       = N25QXXA_DUMMY_CYCLES_READ_QUAD,
+            .DdrMode           = QSPI_DDR_MODE_DISABLE,
+            .DdrHoldHalfCycle  = QSPI_DDR_HHC_ANALOG_DELAY,
+            .SIOOMode          = QSPI_SIOO_INST_EVERY_CMD,
+            .Address           = qspi_async.addr,
+            .NbData            = len
+        };
+
+        HAL_StatusTypeDef status = HAL_QSPI_Command(&qspi_handle, &s_command, HAL_QPSI_TIMEOUT_DEFAULT_VALUE);
+        if (status == HAL_OK) {
+            status = qspi_rx_dma_start(&qspi_handle, &s_command, buf, qspi_async_chunk_done);
+        }
+        if (status != HAL_OK) {
+            dprintf(CRITICAL, "%s: read at 0x%x failed with err = %d\n",
+                    __func__, qspi_async.addr, status);
+            qspi_async.result = hal_error_to_status(status);
+            continue;
+        }
+
+        qspi_async.chunk_len = len;
+        return;
+    }
+}
+
+/* IRQ Context */
+static void qspi_async_chunk_done(void)
+{
+    spin_lock(&qspi_async.lock);
+
+    size_t len = qspi_async.chunk_len;
+    qspi_async.addr += len;
+    qspi_async.result += len;
+    qspi_async.iov_offset += len;
+    if (qspi_async.iov_offset == qspi_async.cur->iov[qspi_async.iov_index].len) {
+        qspi_async.iov_index++;
+        qspi_async.iov_offset = 0;
+    }
+
+    qspi_async_run_locked();
+
+    spin_unlock(&qspi_async.lock);
+}
+
+static status_t spiflash_bdev_submit(struct bdev *device, bio_request_t *req)
+{
+    LTRACEF("device %p, req %p, write %d, block %u, iov_count %u\n",
+            device, req, req->write, req->block, req->iov_count);
+
+    if (req->write) {
+        // Programming is paced by the flash rather than the bus, so do it in line.
+        ssize_t total = 0;
+        bnum_t block = req->block;
+        for (uint i = 0; i < req->iov_count; i++) {
+            uint count = req->iov[i].len / device->block_size;
+            ssize_t written = spiflash_bdev_write_block(device, req->iov[i].base, block, count);
+            if (written < 0) {
+                total = written;
+                break;
+            }
+            total += written;
+            block += count;
+        }
+        bio_request_complete(req, total);
+        return NO_ERROR;
+    }
+
+    for (uint i = 0; i < req->iov_count; i++) {
+        if (!IS_ALIGNED((uintptr_t)req->iov[i].base, CACHE_LINE) ||
+                !IS_ALIGNED(req->iov[i].len, CACHE_LINE)) {
+            return ERR_INVALID_ARGS;
+        }
+    }
+
+    mutex_acquire(&spiflash_mutex);
+
+    // Reads under the memory mapped window are a copy, the rest need command mode.
+    uint64_t largest_offset = ((uint64_t)req->block + req->count) * device->block_size - 1;
+    if (largest_offset < FOUR_BYTE_ADDR_THRESHOLD) {
+        qspi_async_wait_idle_unsafe();
+
+        if (qspi_enable_linear_unsafe() == NO_ERROR) {
+            const uint8_t *src = (const uint8_t *)QSPI_BASE + req->block * device->block_size;
+            ssize_t total = 0;
+            for (uint i = 0; i < req->iov_count; i++) {
+                memcpy(req->iov[i].base, src + total, req->iov[i].len);
+                total += req->iov[i].len;
+            }
+            mutex_release(&spiflash_mutex);
+
+            bio_request_complete(req, total);
+            return NO_ERROR;
+        }
+    }
+
+    if (device_state != QSPI_STATE_COMMAND) {
+        qspi_async_wait_idle_unsafe();
+
+        status_t result = qspi_disable_linear_unsafe();
+        if (result != NO_ERROR) {
+            mutex_release(&spiflash_mutex);
+            return result;
+        }
+    }
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&qspi_async.lock, state);
+
+    list_add_tail(&qspi_async.pending, &req->node);
+    if (!qspi_async.cur) {
+        event_unsignal(&qspi_async.idle);
+        qspi_async_run_locked();
+    }
+
+    spin_unlock_irqrestore(&qspi_async.lock, state);
+
+    mutex_release(&spiflash_mutex);
+
+    return NO_ERROR;
+}
+
 void stm32_QUADSPI_IRQ(void)
 {
     arm_cm_irq_entry();
@@ -1003,13 +1256,23 @@ static uint32_t get_specialized_instruction(uint32_t instruction, uint32_t addre
 
 static status_t qspi_enable_linear(void)
 {
-    status_t result = NO_ERROR;
-
     mutex_acquire(&spiflash_mutex);
+    qspi_async_wait_idle_unsafe();
+
+    status_t result = qspi_enable_linear_unsafe();
+
+    mutex_release(&spiflash_mutex);
+    return result;
+}
+
+// Must hold spiflash_mutex, with no async reads running.
+static status_t qspi_enable_linear_unsafe(void)
+{
+    status_t result = NO_ERROR;
 
     if (device_state == QSPI_STATE_LINEAR) {
         // Device is already in linear mode, nothing to be done.
-        goto finish;
+        return NO_ERROR;
     }
 
     result = qspi_dummy_cycles_cfg_unsafe(&qspi_handle);
@@ -1036,26 +1299,34 @@ static status_t qspi_enable_linear(void)
         result = hal_error_to_status(hal_result);
         dprintf(CRITICAL, "%s: HAL_QSPI_MemoryMapped failed with err = %d\n",
                 __func__, hal_result);
-        goto finish;
+        return result;
     }
 
     device_state = QSPI_STATE_LINEAR;
 
-finish:
-    mutex_release(&spiflash_mutex);
     return result;
 }
 
 
 static status_t qspi_disable_linear(void)
 {
-    status_t result = NO_ERROR;
-
     mutex_acquire(&spiflash_mutex);
+    qspi_async_wait_idle_unsafe();
+
+    status_t result = qspi_disable_linear_unsafe();
+
+    mutex_release(&spiflash_mutex);
+    return result;
+}
+
+// Must hold spiflash_mutex, with no async reads running.
+static status_t qspi_disable_linear_unsafe(void)
+{
+    status_t result = NO_ERROR;
 
     if (device_state == QSPI_STATE_COMMAND) {
         // Device is already in Command mode, nothing to be done.
-        goto finish;
+        return NO_ERROR;
     }
 
     result = hal_error_to_status(HAL_QSPI_Abort(&qspi_handle));
@@ -1066,12 +1337,23 @@ static status_t qspi_disable_linear(void)
                 __func__, result);
     }
 
-
-finish:
-    mutex_release(&spiflash_mutex);
     return result;
 }
 
+// The memory mapped window is cacheable, so drop whatever it holds of a range
+// that has been programmed or erased behind its back.
+static void qspi_linear_invalidate(uint32_t offset, size_t len)
+{
+    if (offset >= FOUR_BYTE_ADDR_THRESHOLD || len == 0) {
+        return;
+    }
+    len = MIN(len, FOUR_BYTE_ADDR_THRESHOLD - offset);
+
+    addr_t start = ROUNDDOWN(QSPI_BASE + offset, CACHE_LINE);
+    addr_t end = ROUNDUP(QSPI_BASE + offset + len, CACHE_LINE);
+    arch_invalidate_cache_range(start, end - start);
+}
+
 static bool qspi_is_linear(void)
 {
     bool result;
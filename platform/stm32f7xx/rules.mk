@@ -12,6 +12,13 @@ MEMSIZE ?= 0x40000
 ARCH := arm
 ARM_CPU := cortex-m7-fpu-sp-d16
 
+# the tightly coupled memories, for __FAST_CODE and __FAST_DATA. DTCM sits
+# just below MEMBASE and isn't otherwise used.
+ARM_CM_ITCM_BASE := 0x00000000
+ARM_CM_ITCM_SIZE := 0x4000
+ARM_CM_DTCM_BASE := 0x20000000
+ARM_CM_DTCM_SIZE := 0x10000
+
 ifeq ($(STM32_CHIP),stm32f746)
 GLOBAL_DEFINES += STM32F746xx
 # XXX workaround for uppercasing in GLOBAL_DEFINES
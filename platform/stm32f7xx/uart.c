@@ -25,10 +25,13 @@
 #include <reg.h>
 #include <debug.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <err.h>
 #include <lib/cbuf.h>
 #include <kernel/thread.h>
+#include <kernel/spinlock.h>
+#include <arch/ops.h>
 #include <platform/debug.h>
 #include <arch/ops.h>
 #include <dev/uart.h>
@@ -39,13 +42,51 @@
 #define DEFAULT_FLOWCONTROL UART_HWCONTROL_NONE
 #define DEFAULT_BAUDRATE 115200
 #define DEFAULT_RXBUF_SIZE 16
+#define DEFAULT_DMA_RXRING_SIZE 256
+#define DEFAULT_DMA_TXBUF_SIZE 1024
 
 #define NUM_UARTS 8
 
+#if UART1_DMA || UART3_DMA
+#define WITH_UART_DMA 1
+#endif
+
+/*
+ * With UARTn_DMA set, receive runs as a circular dma into a ring that is drained
+ * into the rx cbuf on the half/full transfer interrupts and on line idle, and
+ * transmit queues into a cbuf that dma sends from in the background.
+ */
 struct uart_instance {
     UART_HandleTypeDef handle;
     cbuf_t rx_buf;
+#if WITH_UART_DMA
+    bool rx_dma_enabled;
+    bool tx_dma_enabled;
+
+    unsigned int id;
+
+    DMA_HandleTypeDef rx_dma;
+    uint8_t *rx_ring;
+    size_t rx_ring_size;
+    size_t rx_pos;          // next byte of the ring not yet copied out
+    spin_lock_t rx_lock;
+
+    DMA_HandleTypeDef tx_dma;
+    cbuf_t tx_buf;
+    size_t tx_len;          // bytes of tx_buf the running transfer covers, 0 if idle
+    spin_lock_t tx_lock;
+#endif
+};
+
+#if WITH_UART_DMA
+struct uart_dma_config {
+    DMA_Stream_TypeDef *rx_stream;
+    IRQn_Type rx_irq;
+    DMA_Stream_TypeDef *tx_stream;
+    IRQn_Type tx_irq;
+    uint32_t channel;
 };
+#endif
 
 #if ENABLE_UART1
 static struct uart_instance uart1;
@@ -58,6 +99,18 @@ static struct uart_instance uart1;
 #ifndef UART1_RXBUF_SIZE
 #define UART1_RXBUF_SIZE DEFAULT_RXBUF_SIZE
 #endif
+#if UART1_DMA
+#ifndef UART1_DMA_RXRING_SIZE
+#define UART1_DMA_RXRING_SIZE DEFAULT_DMA_RXRING_SIZE
+#endif
+static uint8_t uart1_rx_ring[UART1_DMA_RXRING_SIZE] __ALIGNED(CACHE_LINE);
+/* DMA2 stream 7, the only usart1 tx stream, belongs to qspi so transmit stays polled */
+static const struct uart_dma_config uart1_dma = {
+    .rx_stream = DMA2_Stream2,
+    .rx_irq = DMA2_Stream2_IRQn,
+    .channel = DMA_CHANNEL_4,
+};
+#endif
 #endif
 
 #if ENABLE_UART3
@@ -71,6 +124,22 @@ static struct uart_instance uart3;
 #ifndef UART3_RXBUF_SIZE
 #define UART3_RXBUF_SIZE DEFAULT_RXBUF_SIZE
 #endif
+#if UART3_DMA
+#ifndef UART3_DMA_RXRING_SIZE
+#define UART3_DMA_RXRING_SIZE DEFAULT_DMA_RXRING_SIZE
+#endif
+#ifndef UART3_DMA_TXBUF_SIZE
+#define UART3_DMA_TXBUF_SIZE DEFAULT_DMA_TXBUF_SIZE
+#endif
+static uint8_t uart3_rx_ring[UART3_DMA_RXRING_SIZE] __ALIGNED(CACHE_LINE);
+static const struct uart_dma_config uart3_dma = {
+    .rx_stream = DMA1_Stream1,
+    .rx_irq = DMA1_Stream1_IRQn,
+    .tx_stream = DMA1_Stream3,
+    .tx_irq = DMA1_Stream3_IRQn,
+    .channel = DMA_CHANNEL_4,
+};
+#endif
 #endif
 
 #if ENABLE_UART2 || ENABLE_UART4 || ENABLE_UART5 || ENABLE_UART6 || ENABLE_UART7 || ENABLE_UART8
@@ -125,7 +194,7 @@ static void usart_init_early(struct uart_instance *u, USART_TypeDef *usart, uint
     HAL_UART_Init(&u->handle);
 }
 
-static void usart_init(struct uart_instance *u, USART_TypeDef *usart, uint irqn, size_t rxsize)
+static void usart_init(struct uart_instance *u, USART_TypeDef *usart, uint irqn, size_t rxsize, bool dma)
 {
     cbuf_initialize(&u->rx_buf, rxsize);
 
@@ -135,12 +204,215 @@ static void usart_init(struct uart_instance *u, USART_TypeDef *usart, uint irqn,
     /* Enable the UART Error Interrupt: (Frame error, noise error, overrun error) */
     __HAL_UART_ENABLE_IT(&u->handle, UART_IT_ERR);
 
-    /* Enable the UART Data Register not empty Interrupt */
-    __HAL_UART_ENABLE_IT(&u->handle, UART_IT_RXNE);
+    if (dma) {
+        /* the dma takes each byte, the idle interrupt flushes out a partial ring */
+        __HAL_UART_ENABLE_IT(&u->handle, UART_IT_IDLE);
+    } else {
+        /* Enable the UART Data Register not empty Interrupt */
+        __HAL_UART_ENABLE_IT(&u->handle, UART_IT_RXNE);
+    }
 
     HAL_NVIC_EnableIRQ(irqn);
 }
 
+static cbuf_t *usart_rx_target(struct uart_instance *u, const unsigned int id)
+{
+#if CONSOLE_HAS_INPUT_BUFFER
+    if (id == DEBUG_UART) {
+        return &console_input_cbuf;
+    }
+#endif
+    return &u->rx_buf;
+}
+
+#if WITH_UART_DMA
+static void usart_dma_handle_init(DMA_HandleTypeDef *dma, struct uart_instance *u,
+                                  DMA_Stream_TypeDef *stream, uint32_t channel,
+                                  uint32_t direction, uint32_t mode)
+{
+    dma->Instance = stream;
+    dma->Init.Channel = channel;
+    dma->Init.Direction = direction;
+    dma->Init.PeriphInc = DMA_PINC_DISABLE;
+    dma->Init.MemInc = DMA_MINC_ENABLE;
+    dma->Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    dma->Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+    dma->Init.Mode = mode;
+    dma->Init.Priority = DMA_PRIORITY_LOW;
+    dma->Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+    dma->Init.FIFOThreshold = DMA_FIFO_THRESHOLD_FULL;
+    dma->Init.MemBurst = DMA_MBURST_SINGLE;
+    dma->Init.PeriphBurst = DMA_PBURST_SINGLE;
+    dma->Parent = u;
+
+    HAL_DMA_DeInit(dma);
+    HAL_DMA_Init(dma);
+}
+
+/* copy whatever the rx dma has written since the last call into the rx cbuf */
+static bool usart_dma_rx_drain(struct uart_instance *u, const unsigned int id)
+{
+    cbuf_t *target_buf = usart_rx_target(u, id);
+    bool got = false;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&u->rx_lock, state);
+
+    size_t pos = u->rx_ring_size - __HAL_DMA_GET_COUNTER(&u->rx_dma);
+    if (pos == u->rx_ring_size)
+        pos = 0;
+
+    while (u->rx_pos != pos) {
+        size_t len = (pos > u->rx_pos) ? pos - u->rx_pos : u->rx_ring_size - u->rx_pos;
+        uint8_t *ptr = u->rx_ring + u->rx_pos;
+
+        /* the ring is line aligned and never written by the cpu, so dropping lines is safe */
+        arch_invalidate_cache_range(ROUNDDOWN((addr_t)ptr, CACHE_LINE),
+                                    ROUNDUP(len + ((addr_t)ptr % CACHE_LINE), CACHE_LINE));
+
+        if (cbuf_write(target_buf, ptr, len, false) != len) {
+            printf("WARNING: uart cbuf overrun!\n");
+        }
+        got = true;
+
+        u->rx_pos += len;
+        if (u->rx_pos == u->rx_ring_size)
+            u->rx_pos = 0;
+    }
+
+    spin_unlock_irqrestore(&u->rx_lock, state);
+
+    return got;
+}
+
+static void usart_dma_rx_event(DMA_HandleTypeDef *dma)
+{
+    struct uart_instance *u = dma->Parent;
+
+    usart_dma_rx_drain(u, u->id);
+}
+
+/* start sending the first contiguous run of tx_buf if the stream is idle. tx_lock held */
+static void usart_dma_tx_start_locked(struct uart_instance *u)
+{
+    if (u->tx_len)
+        return;
+
+    iovec_t regions[2];
+    if (cbuf_peek(&u->tx_buf, regions) == 0)
+        return;
+
+    u->tx_len = regions[0].iov_len;
+    arch_clean_cache_range((addr_t)regions[0].iov_base, u->tx_len);
+
+    HAL_DMA_Start_IT(&u->tx_dma, (uint32_t)regions[0].iov_base,
+                     (uint32_t)&u->handle.Instance->TDR, u->tx_len);
+    SET_BIT(u->handle.Instance->CR3, USART_CR3_DMAT);
+}
+
+/* transfer done or failed, either way retire it and start the next. tx_lock held */
+static void usart_dma_tx_done(DMA_HandleTypeDef *dma)
+{
+    struct uart_instance *u = dma->Parent;
+
+    CLEAR_BIT(u->handle.Instance->CR3, USART_CR3_DMAT);
+    cbuf_read(&u->tx_buf, NULL, u->tx_len, false);
+    u->tx_len = 0;
+
+    usart_dma_tx_start_locked(u);
+}
+
+/* send everything queued, polling the stream instead of waiting for its irq. tx_lock held */
+static void usart_dma_tx_flush_locked(struct uart_instance *u)
+{
+    while (u->tx_len) {
+        while (__HAL_DMA_GET_FLAG(&u->tx_dma, __HAL_DMA_GET_TC_FLAG_INDEX(&u->tx_dma)) == RESET &&
+                __HAL_DMA_GET_FLAG(&u->tx_dma, __HAL_DMA_GET_TE_FLAG_INDEX(&u->tx_dma)) == RESET)
+            ;
+        HAL_DMA_IRQHandler(&u->tx_dma);
+    }
+}
+
+static void usart_dma_init(struct uart_instance *u, unsigned int id, const struct uart_dma_config *cfg,
+                           uint8_t *ring, size_t ringsize, size_t txsize)
+{
+    if ((uintptr_t)cfg->rx_stream < DMA2_BASE)
+        __HAL_RCC_DMA1_CLK_ENABLE();
+    else
+        __HAL_RCC_DMA2_CLK_ENABLE();
+
+    u->id = id;
+    u->rx_ring = ring;
+    u->rx_ring_size = ringsize;
+    u->rx_pos = 0;
+    u->rx_lock = SPIN_LOCK_INITIAL_VALUE;
+    arch_invalidate_cache_range((addr_t)ring, ringsize);
+
+    usart_dma_handle_init(&u->rx_dma, u, cfg->rx_stream, cfg->channel,
+                          DMA_PERIPH_TO_MEMORY, DMA_CIRCULAR);
+    u->rx_dma.XferHalfCpltCallback = usart_dma_rx_event;
+    u->rx_dma.XferCpltCallback = usart_dma_rx_event;
+
+    HAL_DMA_Start_IT(&u->rx_dma, (uint32_t)&u->handle.Instance->RDR, (uint32_t)ring, ringsize);
+    SET_BIT(u->handle.Instance->CR3, USART_CR3_DMAR);
+    u->rx_dma_enabled = true;
+
+    HAL_NVIC_EnableIRQ(cfg->rx_irq);
+
+    if (cfg->tx_stream) {
+        cbuf_initialize(&u->tx_buf, txsize);
+        u->tx_len = 0;
+        u->tx_lock = SPIN_LOCK_INITIAL_VALUE;
+
+        usart_dma_handle_init(&u->tx_dma, u, cfg->tx_stream, cfg->channel,
+                              DMA_MEMORY_TO_PERIPH, DMA_NORMAL);
+        u->tx_dma.XferCpltCallback = usart_dma_tx_done;
+        u->tx_dma.XferErrorCallback = usart_dma_tx_done;
+        u->tx_dma_enabled = true;
+
+        HAL_NVIC_EnableIRQ(cfg->tx_irq);
+    }
+}
+
+static void stm32_usart_dma_rx_irq(struct uart_instance *u)
+{
+    arm_cm_irq_entry();
+    HAL_DMA_IRQHandler(&u->rx_dma);
+    arm_cm_irq_exit(true);
+}
+
+static void stm32_usart_dma_tx_irq(struct uart_instance *u)
+{
+    arm_cm_irq_entry();
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&u->tx_lock, state);
+    HAL_DMA_IRQHandler(&u->tx_dma);
+    spin_unlock_irqrestore(&u->tx_lock, state);
+
+    arm_cm_irq_exit(false);
+}
+
+#if UART1_DMA
+void stm32_DMA2_Stream2_IRQ(void)
+{
+    stm32_usart_dma_rx_irq(uart[1]);
+}
+#endif
+
+#if UART3_DMA
+void stm32_DMA1_Stream1_IRQ(void)
+{
+    stm32_usart_dma_rx_irq(uart[3]);
+}
+
+void stm32_DMA1_Stream3_IRQ(void)
+{
+    stm32_usart_dma_tx_irq(uart[3]);
+}
+#endif
+#endif // WITH_UART_DMA
+
 void uart_init_early(void)
 {
 #if ENABLE_UART1
@@ -154,10 +426,20 @@ void uart_init_early(void)
 void uart_init(void)
 {
 #ifdef ENABLE_UART1
-    usart_init(uart[1], USART1, USART1_IRQn, UART1_RXBUF_SIZE);
+#if UART1_DMA
+    usart_dma_init(uart[1], 1, &uart1_dma, uart1_rx_ring, sizeof(uart1_rx_ring), 0);
+    usart_init(uart[1], USART1, USART1_IRQn, UART1_RXBUF_SIZE, true);
+#else
+    usart_init(uart[1], USART1, USART1_IRQn, UART1_RXBUF_SIZE, false);
+#endif
 #endif
 #ifdef ENABLE_UART3
-    usart_init(uart[3], USART3, USART3_IRQn, UART3_RXBUF_SIZE);
+#if UART3_DMA
+    usart_dma_init(uart[3], 3, &uart3_dma, uart3_rx_ring, sizeof(uart3_rx_ring), UART3_DMA_TXBUF_SIZE);
+    usart_init(uart[3], USART3, USART3_IRQn, UART3_RXBUF_SIZE, true);
+#else
+    usart_init(uart[3], USART3, USART3_IRQn, UART3_RXBUF_SIZE, false);
+#endif
 #endif
 }
 
@@ -201,13 +483,7 @@ static void stm32_usart_shared_irq(struct uart_instance *u, const unsigned int i
         /* we got a character */
         uint8_t c = (uint8_t)(u->handle.Instance->RDR & 0xff);
 
-        cbuf_t *target_buf = &u->rx_buf;
-
-#if CONSOLE_HAS_INPUT_BUFFER
-        if (id == DEBUG_UART) {
-            target_buf = &console_input_cbuf;
-        }
-#endif
+        cbuf_t *target_buf = usart_rx_target(u, id);
 
         if (cbuf_write_char(target_buf, c, false) != 1) {
             printf("WARNING: uart cbuf overrun!\n");
@@ -218,6 +494,16 @@ static void stm32_usart_shared_irq(struct uart_instance *u, const unsigned int i
         __HAL_UART_SEND_REQ(&u->handle, UART_RXDATA_FLUSH_REQUEST);
     }
 
+#if WITH_UART_DMA
+    /* UART idle line, pick up the tail of a burst the dma hasn't reported -----*/
+    if ((__HAL_UART_GET_IT(&u->handle, UART_IT_IDLE) != RESET) && (__HAL_UART_GET_IT_SOURCE(&u->handle, UART_IT_IDLE) != RESET)) {
+        __HAL_UART_CLEAR_IDLEFLAG(&u->handle);
+
+        if (u->rx_dma_enabled && usart_dma_rx_drain(u, id))
+            resched = true;
+    }
+#endif
+
     /* UART in mode Transmitter ------------------------------------------------*/
     if ((__HAL_UART_GET_IT(&u->handle, UART_IT_TXE) != RESET) &&(__HAL_UART_GET_IT_SOURCE(&u->handle, UART_IT_TXE) != RESET)) {
         ;
@@ -251,6 +537,23 @@ int uart_putc(int port, char c)
     if (port < 0 || port > NUM_UARTS || !u)
         return ERR_BAD_HANDLE;
 
+#if WITH_UART_DMA
+    if (u->tx_dma_enabled) {
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&u->tx_lock, state);
+
+        /* out of room, wait for the queue to drain rather than dropping output */
+        if (cbuf_space_avail(&u->tx_buf) == 0)
+            usart_dma_tx_flush_locked(u);
+
+        cbuf_write_char(&u->tx_buf, c, false);
+        usart_dma_tx_start_locked(u);
+
+        spin_unlock_irqrestore(&u->tx_lock, state);
+        return 1;
+    }
+#endif
+
     while (__HAL_UART_GET_FLAG(&u->handle, UART_FLAG_TXE) == RESET)
         ;
     u->handle.Instance->TDR = (c & (uint8_t)0xFF);
@@ -272,7 +575,25 @@ int uart_getc(int port, bool wait)
 
 int uart_pputc(int port, char c)
 {
-    return uart_putc(port, c);
+    struct uart_instance *u = uart[port];
+    if (port < 0 || port > NUM_UARTS || !u)
+        return ERR_BAD_HANDLE;
+
+#if WITH_UART_DMA
+    /* nothing may be left to finish the queue, so send it and then poll this one out */
+    if (u->tx_dma_enabled) {
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&u->tx_lock, state);
+        usart_dma_tx_flush_locked(u);
+        spin_unlock_irqrestore(&u->tx_lock, state);
+    }
+#endif
+
+    while (__HAL_UART_GET_FLAG(&u->handle, UART_FLAG_TXE) == RESET)
+        ;
+    u->handle.Instance->TDR = (c & (uint8_t)0xFF);
+
+    return 1;
 }
 
 int uart_pgetc(int port)
@@ -281,6 +602,19 @@ int uart_pgetc(int port)
     if (port < 0 || port > NUM_UARTS || !u)
         return ERR_BAD_HANDLE;
 
+#if WITH_UART_DMA
+    if (u->rx_dma_enabled) {
+        /* the dma owns RDR, pull from the ring instead */
+        cbuf_t *target_buf = usart_rx_target(u, port);
+        char c;
+
+        usart_dma_rx_drain(u, port);
+        if (cbuf_read_char(target_buf, &c, false) == 1)
+            return (uint8_t)c;
+        return ERR_IO;
+    }
+#endif
+
     if ((__HAL_UART_GET_IT(&u->handle, UART_IT_RXNE) != RESET) && (__HAL_UART_GET_IT_SOURCE(&u->handle, UART_IT_RXNE) != RESET)) {
         uint8_t c = (uint8_t)(u->handle.Instance->RDR & 0xff);
         return c;
@@ -288,7 +622,19 @@ int uart_pgetc(int port)
     return ERR_IO;
 }
 
-void uart_flush_tx(int port) {}
+void uart_flush_tx(int port)
+{
+#if WITH_UART_DMA
+    struct uart_instance *u = uart[port];
+    if (port < 0 || port > NUM_UARTS || !u || !u->tx_dma_enabled)
+        return;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&u->tx_lock, state);
+    usart_dma_tx_flush_locked(u);
+    spin_unlock_irqrestore(&u->tx_lock, state);
+#endif
+}
 
 void uart_flush_rx(int port) {}
 
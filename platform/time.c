@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <platform.h>
+#include <platform/timer.h>
+
+/*
+ * default implementations of the nanosecond time routines, for platforms
+ * without a finer clock than the ones they already provide.
+ */
+
+__WEAK lk_time_ns_t current_time_ns(void)
+{
+    return current_time_hires() * 1000;
+}
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+__WEAK status_t platform_set_oneshot_timer_ns(platform_timer_callback callback, void *arg,
+        lk_time_ns_t interval)
+{
+    /* round up, the timer must not go off early */
+    return platform_set_oneshot_timer(callback, arg, (interval + 999999) / 1000000);
+}
+#endif
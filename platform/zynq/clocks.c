@@ -387,3 +387,60 @@ void zynq_dump_clocks(void)
     }
 }
 
+#if WITH_LIB_DVFS
+#include <lib/dvfs.h>
+#include <lk/init.h>
+#include <kernel/spinlock.h>
+#include <dev/timer/arm_cortex_a9.h>
+
+/* the cpu clock divided by 1, 2 and 3 times its boot divisor, slowest first */
+#define ZYNQ_DVFS_STEPS 3
+
+static dvfs_opp_t zynq_opps[ZYNQ_DVFS_STEPS];
+static uint32_t zynq_opp_divisor[ZYNQ_DVFS_STEPS];
+
+static status_t zynq_dvfs_set(const dvfs_opp_t *opp, void *arg)
+{
+    uint32_t divisor = zynq_opp_divisor[opp - zynq_opps];
+
+    LTRACEF("divisor %u, %u khz\n", divisor, opp->freq_khz);
+
+    /* keep the timers from seeing the new clock for any longer than it takes to tell them */
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    zynq_slcr_unlock();
+    uint32_t ctrl = SLCR_REG(ARM_CLK_CTRL);
+    SLCR_REG(ARM_CLK_CTRL) = (ctrl & ~ARM_CLK_CTRL_DIVISOR(0x3f)) | ARM_CLK_CTRL_DIVISOR(divisor);
+    zynq_slcr_lock();
+
+    /* the private and global timers count cpu 3x2x cycles, which just changed with it */
+    arm_cortex_a9_timer_set_freq(zynq_get_arm_timer_freq());
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    return NO_ERROR;
+}
+
+static void zynq_dvfs_init(uint level)
+{
+    uint32_t boot_divisor = BITS_SHIFT(SLCR_REG(ARM_CLK_CTRL), 13, 8);
+    uint32_t src = get_cpu_input_freq() * boot_divisor;
+
+    uint count = 0;
+    for (uint i = ZYNQ_DVFS_STEPS; i > 0; i--) {
+        uint32_t divisor = boot_divisor * i;
+        if (divisor > 0x3f)
+            continue;
+
+        zynq_opp_divisor[count] = divisor;
+        zynq_opps[count].freq_khz = src / divisor / 1000;
+        zynq_opps[count].voltage_mv = 0;
+        count++;
+    }
+
+    dvfs_register(zynq_opps, count, count - 1, zynq_dvfs_set, NULL);
+}
+
+LK_INIT_HOOK(zynq_dvfs, zynq_dvfs_init, LK_INIT_LEVEL_PLATFORM);
+#endif // WITH_LIB_DVFS
@@ -70,8 +70,21 @@
 #define GEM_TX_BUF_SIZE     1536
 #endif
 
+/* rx buffers beyond the ring's own, for frames lent to the stack */
+#ifndef GEM_RX_LOAN_CNT
+#define GEM_RX_LOAN_CNT     64
+#endif
+
+/* most frames the poll thread takes off the rx ring before yielding */
+#define GEM_POLL_BUDGET     16
+
+/* the interrupts that hand work to the poll thread, masked while it runs */
+#define GEM_POLL_INTRS      (INTR_RX_COMPLETE | INTR_TX_COMPLETE)
+
 pool_t rx_buf_pool;
 static spin_lock_t lock = SPIN_LOCK_INITIAL_VALUE;
+/* rx buffers come back from the stack, possibly with lock held for a tx free */
+static spin_lock_t rx_pool_lock = SPIN_LOCK_INITIAL_VALUE;
 
 struct gem_desc {
     uint32_t addr;
@@ -82,11 +95,17 @@ struct gem_desc {
  * RX:
  *  rx_tbl contains rx descriptors. A pktbuf is allocated for each of these and a descriptor
  *  entry in the table points to a buffer in the pktbuf. rx_tbl[X]'s pktbuf is stored in rx_pbufs[X]
+ *  With an owned callback set, received pktbufs are handed to the stack outright and a fresh
+ *  buffer from rx_buf_pool takes their place, the old one returning to the pool when freed.
  *
  * TX:
  *  The current position to write new tx descriptors to is maintained by gem.tx_head. As frames are
  *  queued in tx_tbl their pktbufs are stored in the list queued_pbufs. As frame transmission is
- *  completed these pktbufs are released back to the pool by the interrupt handler for TX_COMPLETE
+ *  completed these pktbufs are released back to the pool by the poll thread, or by the next send.
+ *
+ * Polling:
+ *  RX_COMPLETE and TX_COMPLETE only wake the poll thread, and stay masked while it works through
+ *  the rings a budget at a time. They come back on once it finds nothing left to do.
  */
 struct gem_descs {
     struct gem_desc rx_tbl[GEM_RX_DESC_CNT];
@@ -106,9 +125,11 @@ struct gem_state {
     struct list_node queued_pbufs;
 
     gem_cb_t rx_callback;
-    event_t rx_pending;
+    gem_cb_t rx_owned_callback;
+    event_t poll_pending;
     event_t tx_complete;
     bool debug_rx;
+    unsigned int rx_head;
     pktbuf_t *rx_pbufs[GEM_RX_DESC_CNT];
 };
 
@@ -129,6 +150,7 @@ static int free_completed_pbuf_frames(void)
 
     gem.regs->tx_status = gem.regs->tx_status;
 
+    /* the hardware only marks the first descriptor of a frame used, free the whole frame */
     while (gem.tx_count > 0 &&
             (gem.descs->tx_tbl[gem.tx_tail].ctrl & TX_DESC_USED)) {
 
@@ -138,10 +160,10 @@ static int free_completed_pbuf_frames(void)
             DEBUG_ASSERT(p);
             eof = p->flags & PKTBUF_FLAG_EOF;
             ret += pktbuf_free(p, false);
-        } while (!eof);
 
-        gem.tx_tail = (gem.tx_tail + 1) % GEM_TX_DESC_CNT;
-        gem.tx_count--;
+            gem.tx_tail = (gem.tx_tail + 1) % GEM_TX_DESC_CNT;
+            gem.tx_count--;
+        } while (!eof);
     }
 
     return ret;
@@ -156,54 +178,116 @@ void queue_pkts_in_tx_tbl(void)
         return;
     }
 
-    // XXX handle multi part buffers
-
     /* Queue packets in the descriptor table until we're either out of space in the table
      * or out of packets in our tx queue. Any packets left will remain in the list and be
-     * processed the next time available */
-    while (gem.tx_count < GEM_TX_DESC_CNT &&
-            ((p = list_remove_head_type(&gem.tx_queue, pktbuf_t, list)) != NULL)) {
-        cur_pos = gem.tx_head;
-
-        uint32_t addr = pktbuf_data_phys(p);
-        uint32_t ctrl = gem.descs->tx_tbl[cur_pos].ctrl & TX_DESC_WRAP; /* protect the wrap bit */
-        ctrl |= TX_BUF_LEN(p->dlen);
-
-        DEBUG_ASSERT(p->flags & PKTBUF_FLAG_EOF); // a multi part buffer would have caused a race condition w/hardware
-        if (p->flags & PKTBUF_FLAG_EOF) {
-            ctrl |= TX_LAST_BUF;
-        }
+     * processed the next time available. A chained packet takes a descriptor per segment. */
+    while ((p = list_peek_head_type(&gem.tx_queue, pktbuf_t, list)) != NULL &&
+            gem.tx_count + pktbuf_chain_count(p) <= GEM_TX_DESC_CNT) {
+        list_delete(&p->list);
+
+        unsigned int first_pos = gem.tx_head;
+        uint32_t first_ctrl = 0;
 
-        /* fill in the descriptor, control word last (in case hardware is racing us) */
-        gem.descs->tx_tbl[cur_pos].addr = addr;
-        gem.descs->tx_tbl[cur_pos].ctrl = ctrl;
+        while (p) {
+            pktbuf_t *next = p->next;
 
-        gem.tx_head = (gem.tx_head + 1) % GEM_TX_DESC_CNT;
-        gem.tx_count++;
-        list_add_tail(&gem.queued_pbufs, &p->list);
+            cur_pos = gem.tx_head;
+
+            uint32_t addr = pktbuf_data_phys(p);
+            uint32_t ctrl = gem.descs->tx_tbl[cur_pos].ctrl & TX_DESC_WRAP; /* protect the wrap bit */
+            ctrl |= TX_BUF_LEN(p->dlen);
+
+            DEBUG_ASSERT(!next == !!(p->flags & PKTBUF_FLAG_EOF)); // only the last segment ends the frame
+            if (p->flags & PKTBUF_FLAG_EOF) {
+                ctrl |= TX_LAST_BUF;
+            }
+
+            /* fill in the descriptor, the first control word is held back until the rest are ready */
+            gem.descs->tx_tbl[cur_pos].addr = addr;
+            if (cur_pos == first_pos) {
+                first_ctrl = ctrl;
+            } else {
+                gem.descs->tx_tbl[cur_pos].ctrl = ctrl;
+            }
+
+            gem.tx_head = (gem.tx_head + 1) % GEM_TX_DESC_CNT;
+            gem.tx_count++;
+
+            /* each segment is freed on its own once sent */
+            p->next = NULL;
+            list_add_tail(&gem.queued_pbufs, &p->list);
+
+            p = next;
+        }
+
+        /* control word of the first descriptor last (in case hardware is racing us) */
+        DMB;
+        gem.descs->tx_tbl[first_pos].ctrl = first_ctrl;
     }
 
     DMB;
     gem.regs->net_ctrl |= NET_CTRL_START_TX;
 }
 
+/* the controller generates tcp/udp checksums itself, but only gets them right from a zeroed field */
+static void gem_prep_csum(pktbuf_t *p)
+{
+    uint8_t *frame = p->data;
+
+    /* the stack keeps all the headers in the first segment */
+    DEBUG_ASSERT(frame[12] == 0x08 && frame[13] == 0x00);
+
+    size_t l4_start = 14 + (frame[14] & 0xf) * 4;
+    switch (frame[14 + 9]) {
+        case 6: /* tcp */
+            frame[l4_start + 16] = frame[l4_start + 17] = 0;
+            break;
+        case 17: /* udp */
+            frame[l4_start + 6] = frame[l4_start + 7] = 0;
+            break;
+    }
+}
+
+static void gem_tx_reap(void)
+{
+    spin_lock_saved_state_t irqstate;
+    spin_lock_irqsave(&lock, irqstate);
+    free_completed_pbuf_frames();
+    queue_pkts_in_tx_tbl();
+    spin_unlock_irqrestore(&lock, irqstate);
+}
+
 int gem_send_raw_pkt(struct pktbuf *p)
 {
     status_t ret = NO_ERROR;
 
-    if (!p || !p->dlen) {
+    if (!p || !pktbuf_chain_len(p)) {
         ret = -1;
         goto err;
     }
 
-    /* make sure the output buffer is fully written to memory before
-     * placing on the outgoing list. */
+    if (p->flags & PKTBUF_FLAG_CKSUM_PARTIAL) {
+        gem_prep_csum(p);
+    }
 
-    // XXX handle multi part buffers
-    arch_clean_cache_range((vaddr_t)p->data, p->dlen);
+    /* make sure the output buffers are fully written to memory before
+     * placing on the outgoing list. */
+    struct arch_cache_range ranges[8];
+    size_t count = 0;
+    for (pktbuf_t *seg = p; seg; seg = seg->next) {
+        ranges[count].start = (vaddr_t)seg->data;
+        ranges[count].len = seg->dlen;
+        if (++count == countof(ranges)) {
+            arch_clean_cache_ranges(ranges, count);
+            count = 0;
+        }
+    }
+    arch_clean_cache_ranges(ranges, count);
 
+    /* reclaim whatever has gone out on the way, so a busy sender doesn't wait on the poll thread */
     spin_lock_saved_state_t irqstate;
     spin_lock_irqsave(&lock, irqstate);
+    free_completed_pbuf_frames();
     list_add_tail(&gem.tx_queue, &p->list);
     queue_pkts_in_tx_tbl();
     spin_unlock_irqrestore(&lock, irqstate);
@@ -226,15 +310,18 @@ enum handler_return gem_int_handler(void *arg)
         // clear any pending status
         gem.regs->intr_status = intr_status;
 
-        // Received an RX complete
-        if (intr_status & INTR_RX_COMPLETE) {
-            event_signal(&gem.rx_pending, false);
-
-            gem.regs->rx_status |= INTR_RX_COMPLETE;
+        // Frames received or sent, leave them to the poll thread
+        if (intr_status & GEM_POLL_INTRS) {
+            gem.regs->intr_dis = GEM_POLL_INTRS;
+            event_signal(&gem.poll_pending, false);
 
             resched = true;
         }
 
+        if (intr_status & INTR_RX_COMPLETE) {
+            gem.regs->rx_status |= INTR_RX_COMPLETE;
+        }
+
         if (intr_status & INTR_RX_USED_READ) {
 
             for (int i = 0; i < GEM_RX_DESC_CNT; i++) {
@@ -254,13 +341,6 @@ enum handler_return gem_int_handler(void *arg)
             }
         }
 
-        /* A frame has been completed so we can clean up ownership of its buffers */
-        if (intr_status & INTR_TX_COMPLETE) {
-            if (free_completed_pbuf_frames() > 0) {
-                resched = true;
-            }
-        }
-
         /* The controller has processed packets until it hit a buffer owned by the driver */
         if (intr_status & INTR_TX_USED_READ) {
             queue_pkts_in_tx_tbl();
@@ -295,33 +375,63 @@ static bool gem_phy_init(void)
     return wait_for_phy_idle();
 }
 
+/* called as a lent rx pktbuf is freed, from whichever thread had it */
+static void gem_rx_buf_free(void *buf, void *arg)
+{
+    spin_lock_saved_state_t irqstate;
+    spin_lock_irqsave(&rx_pool_lock, irqstate);
+    pool_free(&rx_buf_pool, buf);
+    spin_unlock_irqrestore(&rx_pool_lock, irqstate);
+}
+
+static pktbuf_t *gem_rx_alloc_buf(void)
+{
+    pktbuf_t *p = pktbuf_alloc_empty_nowait();
+    if (!p) {
+        return NULL;
+    }
+
+    spin_lock_saved_state_t irqstate;
+    spin_lock_irqsave(&rx_pool_lock, irqstate);
+    void *b = pool_alloc(&rx_buf_pool);
+    spin_unlock_irqrestore(&rx_pool_lock, irqstate);
+
+    if (!b) {
+        pktbuf_free(p, false);
+        return NULL;
+    }
+
+    pktbuf_add_buffer(p, b, GEM_RX_BUF_SIZE, 0, PKTBUF_FLAG_CACHED, gem_rx_buf_free, NULL);
+    return p;
+}
+
 static status_t gem_cfg_buffer_descs(void)
 {
     void *rx_buf_vaddr;
     status_t ret;
-
+    const unsigned int rx_buf_cnt = GEM_RX_DESC_CNT + GEM_RX_LOAN_CNT;
 
     if ((ret = vmm_alloc_contiguous(vmm_get_kernel_aspace(), "gem_rx_bufs",
-                                    GEM_RX_DESC_CNT * GEM_RX_BUF_SIZE,  (void **) &rx_buf_vaddr, 0, 0,
+                                    ROUNDUP(rx_buf_cnt * GEM_RX_BUF_SIZE, PAGE_SIZE),  (void **) &rx_buf_vaddr, 0, 0,
                                     ARCH_MMU_FLAG_CACHED)) < 0) {
         return ret;
     }
 
     /* Take pktbufs from the allocated target pool and assign them to the gem RX
-     * descriptor table */
-    pool_init(&rx_buf_pool, GEM_RX_BUF_SIZE, CACHE_LINE, GEM_RX_DESC_CNT, rx_buf_vaddr);
+     * descriptor table, the rest are swapped in as frames are lent out */
+    pool_init(&rx_buf_pool, GEM_RX_BUF_SIZE, CACHE_LINE, rx_buf_cnt, rx_buf_vaddr);
     for (unsigned int n = 0; n < GEM_RX_DESC_CNT; n++) {
-        void *b = pool_alloc(&rx_buf_pool);
-        pktbuf_t *p = pktbuf_alloc_empty();
-        if (!p || !b) {
+        pktbuf_t *p = gem_rx_alloc_buf();
+        if (!p) {
             return -1;
         }
 
-        pktbuf_add_buffer(p, b, GEM_RX_BUF_SIZE, 0, PKTBUF_FLAG_CACHED, NULL, NULL);
+        arch_clean_invalidate_cache_range((vaddr_t)p->buffer, GEM_RX_BUF_SIZE);
         gem.rx_pbufs[n] = p;
         gem.descs->rx_tbl[n].addr = (uintptr_t) p->phys_base;
         gem.descs->rx_tbl[n].ctrl = 0;
     }
+    gem.rx_head = 0;
 
     /* Claim ownership of TX descriptors for the driver */
     for (unsigned i = 0; i < GEM_TX_DESC_CNT; i++) {
@@ -360,50 +470,116 @@ static void gem_cfg_ints(void)
                         INTR_RX_USED_READ | INTR_TX_CORRUPT | INTR_TX_USED_READ | INTR_RX_OVERRUN;
 }
 
-int gem_rx_thread(void *arg)
+/* hand a received frame to the stack, returning the pktbuf to put back in its slot */
+static pktbuf_t *gem_rx_deliver(pktbuf_t *p)
 {
-    pktbuf_t *p;
-    int bp = 0;
+    if (unlikely(gem.debug_rx)) {
+        debug_rx_handler(p);
+    }
+
+    if (likely(gem.rx_owned_callback)) {
+        /* lend the frame out if there's a buffer to take its place */
+        pktbuf_t *fresh = gem_rx_alloc_buf();
+        if (fresh) {
+            gem.rx_owned_callback(p);
+            return fresh;
+        }
+
+        /* otherwise hand up a copy, or drop it if there's no room for that either */
+        pktbuf_t *copy = pktbuf_alloc_nowait();
+        if (copy) {
+            copy->data = copy->buffer;
+            pktbuf_append_data(copy, p->data, p->dlen);
+            copy->flags = (copy->flags & ~(PKTBUF_FLAG_CKSUM_IP_GOOD | PKTBUF_FLAG_CKSUM_TCP_GOOD |
+                                           PKTBUF_FLAG_CKSUM_UDP_GOOD)) |
+                          (p->flags & (PKTBUF_FLAG_CKSUM_IP_GOOD | PKTBUF_FLAG_CKSUM_TCP_GOOD |
+                                       PKTBUF_FLAG_CKSUM_UDP_GOOD));
+            gem.rx_owned_callback(copy);
+        }
+    } else if (likely(gem.rx_callback)) {
+        gem.rx_callback(p);
+    }
+
+    return p;
+}
+
+/* take up to budget frames off the rx ring, refilling the slots in one go */
+static int gem_rx_poll(int budget)
+{
+    struct arch_cache_range ranges[GEM_POLL_BUDGET];
+    unsigned int slots[GEM_POLL_BUDGET];
+    int n = 0;
+
+    DEBUG_ASSERT(budget <= GEM_POLL_BUDGET);
 
-    while (1) {
-        event_wait(&gem.rx_pending);
+    while (n < budget && (gem.descs->rx_tbl[gem.rx_head].addr & RX_DESC_USED)) {
+        unsigned int bp = gem.rx_head;
+        uint32_t ctrl = gem.descs->rx_tbl[bp].ctrl;
+
+        pktbuf_t *p = gem.rx_pbufs[bp];
+        p->dlen = RX_BUF_LEN(ctrl);
+        p->data = p->buffer + 2;
+
+        /* copy the checksum offloading bits */
+        p->flags &= ~(PKTBUF_FLAG_CKSUM_IP_GOOD | PKTBUF_FLAG_CKSUM_TCP_GOOD | PKTBUF_FLAG_CKSUM_UDP_GOOD);
+        p->flags |= (BITS_SHIFT(ctrl, 23, 22) != 0) ? PKTBUF_FLAG_CKSUM_IP_GOOD : 0;
+        p->flags |= (BITS_SHIFT(ctrl, 23, 22) == 1) ? PKTBUF_FLAG_CKSUM_UDP_GOOD : 0;
+        p->flags |= (BITS_SHIFT(ctrl, 23, 22) == 2) ? PKTBUF_FLAG_CKSUM_TCP_GOOD : 0;
+
+        /* invalidate any stale cache lines on the receive buffer to ensure
+         * the cpu has a fresh copy of incoming data. */
+        arch_invalidate_cache_range((vaddr_t)p->data, p->dlen);
+
+        p = gem_rx_deliver(p);
+        gem.rx_pbufs[bp] = p;
+
+        /* whatever goes back in the slot gets its dirty lines flushed out below */
+        ranges[n].start = (vaddr_t)p->buffer;
+        ranges[n].len = GEM_RX_BUF_SIZE;
+        slots[n] = bp;
+        n++;
+
+        gem.rx_head = (bp + 1) % GEM_RX_DESC_CNT;
+    }
+
+    if (n == 0) {
+        return 0;
+    }
+
+    arch_clean_invalidate_cache_ranges(ranges, n);
+    DSB;
+
+    for (int i = 0; i < n; i++) {
+        struct gem_desc *desc = &gem.descs->rx_tbl[slots[i]];
+
+        desc->ctrl = 0;
+        desc->addr = (uint32_t)gem.rx_pbufs[slots[i]]->phys_base | (desc->addr & RX_DESC_WRAP);
+    }
+
+    return n;
+}
+
+int gem_poll_thread(void *arg)
+{
+    for (;;) {
+        event_wait(&gem.poll_pending);
 
         for (;;) {
-            if (gem.descs->rx_tbl[bp].addr & RX_DESC_USED) {
-                uint32_t ctrl = gem.descs->rx_tbl[bp].ctrl;
-
-                p = gem.rx_pbufs[bp];
-                p->dlen = RX_BUF_LEN(ctrl);
-                p->data = p->buffer + 2;
-
-                /* copy the checksum offloading bits */
-                p->flags = 0;
-                p->flags |= (BITS_SHIFT(ctrl, 23, 22) != 0) ? PKTBUF_FLAG_CKSUM_IP_GOOD : 0;
-                p->flags |= (BITS_SHIFT(ctrl, 23, 22) == 1) ? PKTBUF_FLAG_CKSUM_UDP_GOOD : 0;
-                p->flags |= (BITS_SHIFT(ctrl, 23, 22) == 2) ? PKTBUF_FLAG_CKSUM_TCP_GOOD : 0;
-
-                /* invalidate any stale cache lines on the receive buffer to ensure
-                 * the cpu has a fresh copy of incomding data. */
-                arch_invalidate_cache_range((vaddr_t)p->data, p->dlen);
-
-                if (unlikely(gem.debug_rx)) {
-                    debug_rx_handler(p);
-                }
-
-                if (likely(gem.rx_callback)) {
-                    gem.rx_callback(p);
-                }
-
-                /* make sure all dirty data is flushed out of the buffer before
-                 * putting into the receive queue */
-                arch_clean_invalidate_cache_range((vaddr_t)p->buffer, PKTBUF_SIZE);
-
-                gem.descs->rx_tbl[bp].addr &= ~RX_DESC_USED;
-                gem.descs->rx_tbl[bp].ctrl = 0;
-                bp = (bp + 1) % GEM_RX_DESC_CNT;
-            } else {
+            int n = gem_rx_poll(GEM_POLL_BUDGET);
+            gem_tx_reap();
+
+            /* a full budget means there's probably more, let anyone else waiting run first */
+            if (n == GEM_POLL_BUDGET) {
+                thread_yield();
+                continue;
+            }
+
+            /* caught up, back to interrupts. catch a frame that landed before they were on */
+            gem.regs->intr_en = GEM_POLL_INTRS;
+            if (!(gem.descs->rx_tbl[gem.rx_head].addr & RX_DESC_USED)) {
                 break;
             }
+            gem.regs->intr_dis = GEM_POLL_INTRS;
         }
     }
 
@@ -457,7 +633,7 @@ status_t gem_init(uintptr_t gem_base)
 {
     status_t ret;
     uint32_t reg_val;
-    thread_t *rx_thread;
+    thread_t *poll_thread;
     void *descs_vaddr;
     paddr_t descs_paddr;
 
@@ -465,7 +641,7 @@ status_t gem_init(uintptr_t gem_base)
 
     /* Data structure init */
     event_init(&gem.tx_complete, false, EVENT_FLAG_AUTOUNSIGNAL);
-    event_init(&gem.rx_pending, false, EVENT_FLAG_AUTOUNSIGNAL);
+    event_init(&gem.poll_pending, false, EVENT_FLAG_AUTOUNSIGNAL);
     list_initialize(&gem.queued_pbufs);
     list_initialize(&gem.tx_queue);
 
@@ -481,9 +657,9 @@ status_t gem_init(uintptr_t gem_base)
     gem.descs_phys = descs_paddr;
     gem.regs = (struct gem_regs *)gem_base;
 
-    /* rx background thread */
-    rx_thread = thread_create("gem_rx", gem_rx_thread, NULL, HIGH_PRIORITY, DEFAULT_STACK_SIZE);
-    thread_resume(rx_thread);
+    /* rx and tx completion poll thread */
+    poll_thread = thread_create("gem_poll", gem_poll_thread, NULL, HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+    thread_resume(poll_thread);
 
     /* Bring whatever existing configuration is up down so we can do it cleanly */
     gem_deinit(gem_base);
@@ -543,6 +719,11 @@ void gem_set_callback(gem_cb_t rx)
     gem.rx_callback = rx;
 }
 
+void gem_set_owned_callback(gem_cb_t rx)
+{
+    gem.rx_owned_callback = rx;
+}
+
 void gem_set_macaddr(uint8_t mac[6])
 {
     uint32_t en = gem.regs->net_ctrl &= NET_CTRL_RX_EN | NET_CTRL_TX_EN;
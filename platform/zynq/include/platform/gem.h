@@ -5,7 +5,10 @@ struct pktbuf;
 
 typedef void (*gem_cb_t)(struct pktbuf *p);
 status_t gem_init(uintptr_t regsbase);
+/* rx callback that borrows the frame for the duration of the call */
 void gem_set_callback(gem_cb_t rx);
+/* rx callback that is given the frame, and frees it when done. takes precedence */
+void gem_set_owned_callback(gem_cb_t rx);
 void gem_set_macaddr(uint8_t mac[6]);
 int gem_send_raw_pkt(struct pktbuf *p);
 
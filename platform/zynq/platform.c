@@ -27,6 +27,7 @@
 #include <arch/arm/mmu.h>
 #include <kernel/vm.h>
 #include <dev/uart.h>
+#include <dev/cache/pl310.h>
 #include <dev/interrupt/arm_gic.h>
 #include <dev/timer/arm_cortex_a9.h>
 #include <lib/console.h>
@@ -359,6 +360,20 @@ void platform_early_init(void)
     /* zynq manual says this is mandatory for cache init */
     *REG32(SLCR_BASE + 0xa1c) = 0x020202;
 
+    /* the zynq's pl310 is r3p2, turn on the prefetcher features that help
+     * streaming and let it idle its clock while the cpus wait */
+    static const struct pl310_tuning l2_tuning = {
+        .early_bresp = true,
+        .instruction_prefetch = true,
+        .data_prefetch = true,
+        .double_linefill = true,
+        .prefetch_drop = true,
+        .prefetch_offset = 7,
+        .dynamic_clock_gating = true,
+        .standby = true,
+    };
+    pl310_set_tuning(&l2_tuning);
+
     /* save the reboot status register, clear bits we dont want to save */
     saved_reboot_status = SLCR->REBOOT_STATUS;
     SLCR->REBOOT_STATUS &= ~(0xff << 16);
@@ -230,6 +230,10 @@ void qspi_cs(struct qspi_ctxt *qspi, unsigned int cs)
 {
     DEBUG_ASSERT(cs <= 1);
 
+    /* every command transfer starts here, and they need manual chip select */
+    if (cs == 0 && qspi->linear_mode)
+        qspi_disable_linear(qspi);
+
     if (cs == 0)
         qspi->cfg &= ~(CFG_MANUAL_CS);
     else
@@ -10,6 +10,7 @@ SMP_MAX_CPUS := 2
 MODULE_DEPS := \
 	lib/bio \
 	lib/cbuf \
+	lib/dvfs \
 	lib/watchdog \
 	dev/cache/pl310 \
 	dev/interrupt/arm_gic \
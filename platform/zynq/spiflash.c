@@ -55,6 +55,9 @@
 
 #define MAX_GEOMETRY_COUNT (2)
 
+// reads inside the linear window go through it rather than command transfers
+#define LINEAR_WINDOW_SIZE (16*1024*1024)
+
 struct spi_flash {
     bool detected;
 
@@ -324,6 +327,9 @@ status_t spiflash_detect(void)
     /* we erase to 0xff */
     flash.bdev.erase_byte = 0xff;
 
+    /* one transfer at a time, in address order */
+    bio_queue_attach(&flash.bdev, 1, BIO_QUEUE_FLAG_SORT);
+
     bio_register_device(&flash.bdev);
 
     LTRACEF("found flash of size 0x%llx\n", flash.size);
@@ -339,6 +345,31 @@ nodetect:
     return ERR_NOT_FOUND;
 }
 
+// the linear window is mapped as device memory, so it has to be read a word at a time
+static void spiflash_linear_copy(void *buf, uint32_t offset, size_t len)
+{
+    const volatile uint32_t *src = (const volatile uint32_t *)(QSPI_LINEAR_BASE + ROUNDDOWN(offset, 4));
+    uint8_t *dst = buf;
+    size_t skip = offset & 3;
+
+    if (skip == 0 && IS_ALIGNED(dst, 4)) {
+        uint32_t *dst32 = (uint32_t *)dst;
+        for (; len >= 4; len -= 4)
+            *dst32++ = *src++;
+        dst = (uint8_t *)dst32;
+    }
+
+    while (len > 0) {
+        uint32_t word = *src++;
+        size_t n = MIN(len, 4 - skip);
+
+        memcpy(dst, (uint8_t *)&word + skip, n);
+        dst += n;
+        len -= n;
+        skip = 0;
+    }
+}
+
 // bio layer hooks
 static ssize_t spiflash_bdev_read(struct bdev *bdev, void *buf, off_t offset, size_t len)
 {
@@ -350,6 +381,14 @@ static ssize_t spiflash_bdev_read(struct bdev *bdev, void *buf, off_t offset, si
     if (len == 0)
         return 0;
 
+    if (offset + len <= LINEAR_WINDOW_SIZE) {
+        // the controller runs quad i/o reads back to back on its own, and drops
+        // back to command mode by itself the next time a command goes out
+        qspi_enable_linear(&flash.qspi);
+        spiflash_linear_copy(buf, offset, len);
+        return len;
+    }
+
     // XXX handle not multiple of 4
     qspi_rd32(&flash.qspi, offset, buf, len / 4);
 
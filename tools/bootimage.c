@@ -30,6 +30,7 @@
 #include <errno.h>
 
 #include <lib/mincrypt/sha256.h>
+#include <zlib.h>
 
 #include "bootimage.h"
 
@@ -40,6 +41,7 @@ struct bootimage {
     uint32_t length[64];
     unsigned count;
     uint32_t next_offset;
+    unsigned hash_chunk_shift;
 };
 
 bootimage *bootimage_init(void)
@@ -76,6 +78,34 @@ bootentry_data *bootimage_add_string(bootimage *img, unsigned kind, const char *
     return &(img->entry[n].data);
 }
 
+int bootimage_set_hash_chunk_shift(bootimage *img, unsigned shift)
+{
+    if (shift && (shift < BOOT_HASH_CHUNK_SHIFT_MIN || shift > BOOT_HASH_CHUNK_SHIFT_MAX)) {
+        return -1;
+    }
+    img->hash_chunk_shift = shift;
+    img->entry[1].info.hash_chunk_shift = shift;
+    return 0;
+}
+
+// sha256 of the sha256s of each chunk, see bootimage_struct.h
+static void tree_hash(const unsigned char *data, unsigned len, unsigned shift, uint8_t *hash)
+{
+    unsigned chunk = 1u << shift;
+    unsigned count = (len + chunk - 1) >> shift;
+    SHA256_CTX ctx;
+    unsigned n;
+
+    SHA256_init(&ctx);
+    for (n = 0; n < count; n++) {
+        unsigned off = n * chunk;
+        uint8_t leaf[SHA256_DIGEST_SIZE];
+        SHA256_hash(data + off, (len - off < chunk) ? len - off : chunk, leaf);
+        SHA256_update(&ctx, leaf, sizeof(leaf));
+    }
+    memcpy(hash, SHA256_final(&ctx), SHA256_DIGEST_SIZE);
+}
+
 bootentry_file *bootimage_add_filedata(bootimage *img, unsigned type, void *data, unsigned len)
 {
     unsigned n = img->count;
@@ -89,7 +119,11 @@ bootentry_file *bootimage_add_filedata(bootimage *img, unsigned type, void *data
     img->entry[n].file.type = type;
     img->entry[n].file.offset = img->next_offset;
     img->entry[n].file.length = len;
-    SHA256_hash(data, len, img->entry[n].file.sha256);
+    if (img->hash_chunk_shift) {
+        tree_hash(data, len, img->hash_chunk_shift, img->entry[n].file.sha256);
+    } else {
+        SHA256_hash(data, len, img->entry[n].file.sha256);
+    }
 
     img->data[n] = data;
     img->offset[n] = img->next_offset;
@@ -100,6 +134,34 @@ bootentry_file *bootimage_add_filedata(bootimage *img, unsigned type, void *data
     return &(img->entry[n].file);
 }
 
+bootentry_zfile *bootimage_add_zfiledata(bootimage *img, unsigned type, void *data, unsigned len)
+{
+    uLongf zlen = compressBound(len);
+    void *zdata = malloc(zlen);
+    if (zdata == NULL) return NULL;
+
+    if (compress2(zdata, &zlen, data, len, Z_BEST_COMPRESSION) != Z_OK) {
+        free(zdata);
+        return NULL;
+    }
+
+    // lay it out as a plain file of the compressed data, then fill in the rest
+    bootentry_file *file = bootimage_add_filedata(img, type, zdata, zlen);
+    if (file == NULL) {
+        free(zdata);
+        return NULL;
+    }
+
+    bootentry_zfile *zfile = (bootentry_zfile *)file;
+    zfile->kind = KIND_ZFILE;
+    zfile->inflated_length = len;
+    memset(zfile->name, 0, sizeof(zfile->name));
+    SHA256_hash(zdata, zlen, zfile->sha256);
+
+    free(data);
+    return zfile;
+}
+
 void bootimage_done(bootimage *img)
 {
     unsigned sz = img->next_offset;
@@ -205,7 +267,7 @@ fail:
     return NULL;
 }
 
-bootentry_file *bootimage_add_file(bootimage *img, unsigned type, const char *fn)
+static unsigned char *load_section(unsigned type, const char *fn, size_t *plen)
 {
     unsigned char *data;
     size_t len;
@@ -245,6 +307,31 @@ bootentry_file *bootimage_add_file(bootimage *img, unsigned type, const char *fn
 #undef SWAP_32
     }
 
+    *plen = len;
+    return data;
+}
+
+bootentry_file *bootimage_add_file(bootimage *img, unsigned type, const char *fn)
+{
+    unsigned char *data;
+    size_t len;
+
+    if ((data = load_section(type, fn, &len)) == NULL) {
+        return NULL;
+    }
+
     return bootimage_add_filedata(img, type, data, len);
 }
 
+bootentry_zfile *bootimage_add_zfile(bootimage *img, unsigned type, const char *fn)
+{
+    unsigned char *data;
+    size_t len;
+
+    if ((data = load_section(type, fn, &len)) == NULL) {
+        return NULL;
+    }
+
+    return bootimage_add_zfiledata(img, type, data, len);
+}
+
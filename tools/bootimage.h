@@ -29,6 +29,9 @@ typedef struct bootimage bootimage;
 
 bootimage *bootimage_init(void);
 
+// tree hash the file sections added after this, 0 for flat hashes
+int bootimage_set_hash_chunk_shift(bootimage *img, unsigned shift);
+
 bootentry_data *bootimage_add_string(
     bootimage *img, unsigned kind, const char *s);
 
@@ -38,6 +41,12 @@ bootentry_file *bootimage_add_filedata(
 bootentry_file *bootimage_add_file(
     bootimage *img, unsigned type, const char *fn);
 
+bootentry_zfile *bootimage_add_zfiledata(
+    bootimage *img, unsigned type, void *data, unsigned len);
+
+bootentry_zfile *bootimage_add_zfile(
+    bootimage *img, unsigned type, const char *fn);
+
 void bootimage_done(bootimage *img);
 
 int bootimage_write(bootimage *img, int fd);
@@ -23,6 +23,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
@@ -53,6 +54,18 @@ static int readx(int s, void *_data, int len)
     return 0;
 }
 
+/* zlib's crc32, which is what the target checks the data with */
+static uint32_t crc32(uint32_t crc, const unsigned char *buf, size_t len)
+{
+    crc = ~crc;
+    while (len--) {
+        crc ^= *buf++;
+        for (int k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
 static int upload(int s, int txfd, size_t txlen, int do_endian_swap)
 {
     int err = 0;
@@ -102,10 +115,13 @@ static int upload(int s, int txfd, size_t txlen, int do_endian_swap)
         pos += xfer;
     }
 
+    /* end with the crc of everything sent, for the target to check before it says okay */
+    uint32_t crc = crc32(0, (const unsigned char *)buf, txlen);
     hdr.opcode = MSG_END_DATA;
     hdr.extra = 0;
-    hdr.length = 0;
-    if (write(s, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+    hdr.length = sizeof(crc);
+    if (write(s, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+            write(s, &crc, sizeof(crc)) != sizeof(crc)) {
         fprintf(stderr, "error: writing socket\n");
         err = -1;
         goto done;
@@ -321,3 +337,86 @@ out:
         close(fd_out);
     return ret;
 }
+
+/* read all of fd into a malloced buffer */
+static void *read_file(int fd, size_t *len)
+{
+    off_t end = lseek(fd, 0, SEEK_END);
+    if (end < 0 || lseek(fd, 0, SEEK_SET) < 0)
+        return NULL;
+
+    void *buf = malloc(end ? end : 1);
+    if (!buf)
+        return NULL;
+    if (readx(fd, buf, end)) {
+        free(buf);
+        return NULL;
+    }
+    *len = end;
+    return buf;
+}
+
+int lkboot_make_delta(int basefd, int imagefd, unsigned block_size)
+{
+    unsigned char *base = NULL, *image = NULL, *blk = NULL;
+    size_t base_len = 0, image_len = 0;
+    unsigned changed = 0, blocks = 0;
+    FILE *out = NULL;
+    int ret = -1;
+
+    if (!(base = read_file(basefd, &base_len)) || !(image = read_file(imagefd, &image_len))) {
+        fprintf(stderr, "error: reading image\n");
+        goto done;
+    }
+    if (!(blk = malloc(block_size)) || !(out = tmpfile())) {
+        fprintf(stderr, "error: out of memory\n");
+        goto done;
+    }
+
+    lkb_delta_hdr_t hdr = {
+        .magic = LKB_DELTA_MAGIC,
+        .block_size = block_size,
+        .base_len = base_len,
+        .base_crc = crc32(0, base, base_len),
+        .image_len = image_len,
+        .image_crc = crc32(0, image, image_len),
+    };
+    fwrite(&hdr, sizeof(hdr), 1, out);
+
+    for (size_t pos = 0; pos < image_len; pos += block_size) {
+        size_t len = (image_len - pos > block_size) ? block_size : image_len - pos;
+        blocks++;
+
+        /* only the bytes up to image_len matter, past base_len we don't know what's there */
+        if (pos + len <= base_len && !memcmp(base + pos, image + pos, len))
+            continue;
+
+        uint32_t n = pos / block_size;
+        memset(blk, 0xff, block_size);
+        memcpy(blk, image + pos, len);
+        fwrite(&n, sizeof(n), 1, out);
+        fwrite(blk, block_size, 1, out);
+        changed++;
+    }
+
+    uint32_t end = LKB_DELTA_END;
+    fwrite(&end, sizeof(end), 1, out);
+    if (fflush(out)) {
+        fprintf(stderr, "error: writing delta\n");
+        goto done;
+    }
+
+    fprintf(stderr, "delta: %u of %u blocks changed\n", changed, blocks);
+
+    /* the temporary file goes away when the process exits */
+    ret = fileno(out);
+    out = NULL;
+
+done:
+    if (out)
+        fclose(out);
+    free(blk);
+    free(image);
+    free(base);
+    return ret;
+}
@@ -27,6 +27,10 @@
 // of that file as the command payload
 int lkboot_txn(const char *host, const char *cmd, int txfd, const char *args);
 
+// build a delta turning the contents of basefd into those of imagefd, for the
+// "delta" command, returning a temporary file holding it or -1 on error
+int lkboot_make_delta(int basefd, int imagefd, unsigned block_size);
+
 // return number of bytes of data the last txn resulted in and if nonzero
 // set *ptr = the buffer (which remains valid until next lkboot_txn())
 unsigned lkboot_get_reply(void **ptr);
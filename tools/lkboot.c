@@ -37,6 +37,7 @@ void usage(void)
             "usage: lkboot <hostname> <command> ...\n"
             "\n"
             "       lkboot <hostname> flash <partition> <filename>\n"
+            "       lkboot <hostname> delta <partition> <installed-file> <filename> [<blocksize>]\n"
             "       lkboot <hostname> erase <partition>\n"
             "       lkboot <hostname> remove <partition>\n"
             "       lkboot <hostname> fpga <bitfile>\n"
@@ -49,6 +50,10 @@ void usage(void)
             "       a tool 'zynq-dcc' to communicate with the device.\n"
             "       Make sure it is in your path.\n"
             "\n"
+            "delta sends only the blocks of <filename> that differ from\n"
+            "<installed-file>, which must be what the partition holds now.\n"
+            "<blocksize> must be a multiple of the flash erase size (default 4096).\n"
+            "\n"
            );
     exit(1);
 }
@@ -93,6 +98,23 @@ int main(int argc, char **argv)
     if (!strcmp(cmd, "flash")) {
         if (argc < 5) usage();
         fn = argv[4];
+    } else if (!strcmp(cmd, "delta")) {
+        if (argc < 6) usage();
+        unsigned block_size = (argc > 6) ? strtoul(argv[6], NULL, 0) : 4096;
+        int basefd = open(argv[4], O_RDONLY);
+        int imagefd = open(argv[5], O_RDONLY);
+        if (basefd < 0 || imagefd < 0) {
+            fprintf(stderr, "error; cannot open '%s'\n", basefd < 0 ? argv[4] : argv[5]);
+            return -1;
+        }
+        if (block_size == 0 || (block_size & (block_size - 1))) {
+            fprintf(stderr, "error; block size must be a power of two\n");
+            return -1;
+        }
+        fd = lkboot_make_delta(basefd, imagefd, block_size);
+        if (fd < 0)
+            return -1;
+        return lkboot_txn(host, cmd, fd, args);
     } else if (!strcmp(cmd, "fpga")) {
         fn = args;
         args = "";
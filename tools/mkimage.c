@@ -30,6 +30,7 @@
 #include "bootimage.h"
 
 static const char *outname = "boot.img";
+static int compress_files = 0;
 
 static struct {
     const char *cmd;
@@ -51,7 +52,10 @@ void usage(const char *binary)
 {
     unsigned n;
     fprintf(stderr, "usage:\n");
-    fprintf(stderr, "%s [-h] [-o <output file] section:file ...\n\n", binary);
+    fprintf(stderr, "%s [-h] [-o <output file] [-z] [-t <shift>] section:file ...\n\n", binary);
+    fprintf(stderr, "-z compresses the file sections that follow it\n");
+    fprintf(stderr, "-t tree hashes uncompressed file sections in chunks of 1 << shift bytes,\n");
+    fprintf(stderr, "   so the loader can check them on every cpu. 16 is a good choice\n\n");
 
     fprintf(stderr, "Supported section types:\n");
     for (n = 0; types[n].cmd != NULL; n++) {
@@ -76,7 +80,11 @@ int process(bootimage *img, char *cmd, char *arg)
         if (strcmp(cmd, types[n].cmd)) {
             continue;
         }
-        if (types[n].kind == KIND_FILE) {
+        if (types[n].kind == KIND_FILE && compress_files) {
+            if (bootimage_add_zfile(img, types[n].type, arg) == NULL) {
+                return -1;
+            }
+        } else if (types[n].kind == KIND_FILE) {
             if (bootimage_add_file(img, types[n].type, arg) == NULL) {
                 return -1;
             }
@@ -114,6 +122,17 @@ int main(int argc, char **argv)
             outname = argv[1];
             argc--;
             argv++;
+        } else if (!strcmp(cmd, "-z")) {
+            compress_files = 1;
+        } else if (!strcmp(cmd, "-t")) {
+            if (argc < 2 || count > 0 ||
+                    bootimage_set_hash_chunk_shift(img, strtoul(argv[1], NULL, 0))) {
+                fprintf(stderr, "error: -t needs a shift from %d to %d, before any sections\n",
+                        BOOT_HASH_CHUNK_SHIFT_MIN, BOOT_HASH_CHUNK_SHIFT_MAX);
+                return 1;
+            }
+            argc--;
+            argv++;
         } else {
             if (arg == NULL) {
                 fprintf(stderr, "error: invalid argument '%s'\n", cmd);
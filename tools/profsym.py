@@ -0,0 +1,41 @@
+#!/usr/bin/env python
+# vim: set expandtab ts=4 sw=4 tw=100:
+
+# Symbolize the output of the "prof dump" and "prof chains" console commands.
+# Every hex address in the input is replaced by symbol+offset from the kernel elf.
+#
+#   profsym.py -e build-foo/lk.elf [-n arm-eabi-nm] < capture.txt
+
+import bisect
+import re
+import subprocess
+import sys
+from optparse import OptionParser
+
+parser = OptionParser()
+parser.add_option("-e", "--elf", dest="elf", help="kernel elf the samples came from")
+parser.add_option("-n", "--nm", dest="nm", default="nm", help="nm to use, for cross toolchains")
+(options, args) = parser.parse_args()
+
+if not options.elf:
+    parser.error("need the kernel elf")
+
+addrs = []
+names = []
+out = subprocess.check_output([options.nm, "-n", "-C", "--defined-only", options.elf])
+for line in out.decode().splitlines():
+    parts = line.split(None, 2)
+    if len(parts) == 3 and parts[1] in "tTwW":
+        addrs.append(int(parts[0], 16))
+        names.append(parts[2])
+
+def symbolize(m):
+    addr = int(m.group(0), 16)
+    i = bisect.bisect_right(addrs, addr) - 1
+    if i < 0:
+        return m.group(0)
+    return "%s+0x%x" % (names[i], addr - addrs[i])
+
+infile = open(args[0]) if args else sys.stdin
+for line in infile:
+    sys.stdout.write(re.sub(r"0x[0-9a-fA-F]+", symbolize, line))
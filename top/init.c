@@ -32,7 +32,16 @@
 #include <assert.h>
 #include <compiler.h>
 #include <debug.h>
+#include <stdlib.h>
+#include <string.h>
 #include <trace.h>
+#include <kernel/event.h>
+#include <kernel/thread.h>
+
+#if WITH_LK_INIT_PROFILE
+#include <platform.h>
+#include <stdio.h>
+#endif
 
 #define LOCAL_TRACE 0
 #define TRACE_INIT (LK_DEBUGLEVEL >= 2)
@@ -43,6 +52,231 @@
 extern const struct lk_init_struct __lk_init[];
 extern const struct lk_init_struct __lk_init_end[];
 
+#if WITH_LK_INIT_PROFILE
+/*
+ * Every hook call is timed, on whichever cpu makes it. Hooks that run before
+ * the platform timer is up read as zero time, the cycle count still covers
+ * them where the arch has a cycle counter.
+ */
+#ifndef LK_INIT_PROFILE_MAX
+#define LK_INIT_PROFILE_MAX 256
+#endif
+
+struct init_profile_entry {
+    const struct lk_init_struct *hook;
+    uint cpu;
+    uint32_t cycles;
+    lk_bigtime_t start;
+    lk_bigtime_t duration;
+};
+
+static struct init_profile_entry init_profile[LK_INIT_PROFILE_MAX];
+static volatile int init_profile_count;
+
+static void init_profile_record(const struct lk_init_struct *hook, lk_bigtime_t start, uint32_t start_cycles)
+{
+    uint32_t cycles = arch_cycle_count() - start_cycles;
+    lk_bigtime_t duration = current_time_hires() - start;
+
+    int i = atomic_add(&init_profile_count, 1);
+    if (i >= LK_INIT_PROFILE_MAX)
+        return;
+
+    init_profile[i].hook = hook;
+    init_profile[i].cpu = arch_curr_cpu_num();
+    init_profile[i].cycles = cycles;
+    init_profile[i].start = start;
+    init_profile[i].duration = duration;
+}
+
+void lk_init_profile_dump(void)
+{
+    uint count = MIN(init_profile_count, LK_INIT_PROFILE_MAX);
+    uint16_t order[LK_INIT_PROFILE_MAX];
+    lk_bigtime_t total = 0;
+
+    /* insertion sort by duration, then cycles for the hooks that ran before the timer */
+    for (uint i = 0; i < count; i++) {
+        const struct init_profile_entry *e = &init_profile[i];
+        uint j = i;
+        for (; j > 0; j--) {
+            const struct init_profile_entry *prev = &init_profile[order[j - 1]];
+            if (prev->duration > e->duration ||
+                    (prev->duration == e->duration && prev->cycles >= e->cycles))
+                break;
+            order[j] = order[j - 1];
+        }
+        order[j] = i;
+        total += e->duration;
+    }
+
+    printf("init hook profile, %u calls, %llu usecs total:\n", count, total);
+    printf("%10s %10s %10s %10s %3s %s\n", "usecs", "cycles", "start", "level", "cpu", "name");
+    for (uint i = 0; i < count; i++) {
+        const struct init_profile_entry *e = &init_profile[order[i]];
+
+        printf("%10llu %10u %10llu %#10x %3u %s\n", e->duration, e->cycles, e->start,
+               e->hook->level, e->cpu, e->hook->name);
+    }
+    if (init_profile_count > LK_INIT_PROFILE_MAX)
+        printf("%d calls not recorded, raise LK_INIT_PROFILE_MAX\n", init_profile_count - LK_INIT_PROFILE_MAX);
+}
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+
+static int cmd_initprof(int argc, const cmd_args *argv)
+{
+    lk_init_profile_dump();
+    return 0;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("initprof", "show how long each init hook took", &cmd_initprof)
+STATIC_COMMAND_END(initprof);
+#endif
+
+#endif // WITH_LK_INIT_PROFILE
+
+static void call_hook(const struct lk_init_struct *hook)
+{
+#if TRACE_INIT
+    if (hook->level >= EARLIEST_TRACE_LEVEL) {
+        printf("INIT: cpu %d, calling hook %p (%s) at level %#x, flags %#x\n",
+               arch_curr_cpu_num(), hook->hook, hook->name, hook->level, hook->flags);
+    }
+#endif
+#if WITH_LK_INIT_PROFILE
+    lk_bigtime_t start = current_time_hires();
+    uint32_t start_cycles = arch_cycle_count();
+    hook->hook(hook->level);
+    init_profile_record(hook, start, start_cycles);
+#else
+    hook->hook(hook->level);
+#endif
+}
+
+/*
+ * A level with parallel hooks in it. Every hook at the level gets a job, so
+ * that any of them can be waited on, but only the parallel ones get a thread.
+ */
+struct init_run;
+
+struct init_job {
+    const struct lk_init_struct *hook;
+    struct init_run *run;
+    thread_t *thread;
+    event_t done;
+};
+
+struct init_run {
+    uint level;
+    uint count;
+    struct init_job *jobs;
+};
+
+static struct init_job *find_job(struct init_run *run, const char *name)
+{
+    for (uint i = 0; i < run->count; i++) {
+        if (!strcmp(run->jobs[i].hook->name, name))
+            return &run->jobs[i];
+    }
+    return NULL;
+}
+
+static void wait_for_deps(struct init_job *job)
+{
+    if (!job->hook->deps)
+        return;
+
+    for (const char * const *dep = job->hook->deps; *dep; dep++) {
+        struct init_job *other = find_job(job->run, *dep);
+        if (other && other != job) {
+            LTRACEF("%s waiting for %s\n", job->hook->name, *dep);
+            event_wait(&other->done);
+        }
+    }
+}
+
+static int init_job_thread(void *arg)
+{
+    struct init_job *job = arg;
+
+    wait_for_deps(job);
+    call_hook(job->hook);
+    event_signal(&job->done, true);
+
+    return 0;
+}
+
+/* set up a run for level, if it has anything to run in parallel */
+static void start_run(struct init_run *run, enum lk_init_flags required_flag, uint level)
+{
+    uint count = 0;
+    bool parallel = false;
+
+    run->level = level;
+    run->count = 0;
+    run->jobs = NULL;
+
+    for (const struct lk_init_struct *ptr = __lk_init; ptr != __lk_init_end; ptr++) {
+        if ((ptr->flags & required_flag) && ptr->level == level) {
+            count++;
+            if (ptr->flags & LK_INIT_FLAG_PARALLEL)
+                parallel = true;
+        }
+    }
+    if (!parallel)
+        return;
+
+    /* without memory the level just runs in turn */
+    run->jobs = calloc(count, sizeof(struct init_job));
+    if (!run->jobs)
+        return;
+
+    for (const struct lk_init_struct *ptr = __lk_init; ptr != __lk_init_end; ptr++) {
+        if ((ptr->flags & required_flag) && ptr->level == level) {
+            struct init_job *job = &run->jobs[run->count++];
+            job->hook = ptr;
+            job->run = run;
+            event_init(&job->done, false, 0);
+        }
+    }
+    LTRACEF("level %#x, %u hooks\n", level, count);
+}
+
+/* the level barrier, every hook at the level is done after this */
+static void finish_run(struct init_run *run)
+{
+    for (uint i = 0; i < run->count; i++) {
+        struct init_job *job = &run->jobs[i];
+
+        if (job->thread)
+            thread_join(job->thread, NULL, INFINITE_TIME);
+        else
+            event_wait(&job->done);
+        event_destroy(&job->done);
+    }
+
+    free(run->jobs);
+    run->jobs = NULL;
+    run->count = 0;
+}
+
+static void run_job(struct init_job *job)
+{
+    if (job->hook->flags & LK_INIT_FLAG_PARALLEL) {
+        job->thread = thread_create(job->hook->name, &init_job_thread, job,
+                                    DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        if (job->thread) {
+            thread_resume(job->thread);
+            return;
+        }
+    }
+
+    init_job_thread(job);
+}
+
 void lk_init_level(enum lk_init_flags required_flag, uint start_level, uint stop_level)
 {
     LTRACEF("flags %#x, start_level %#x, stop_level %#x\n",
@@ -51,6 +285,7 @@ void lk_init_level(enum lk_init_flags required_flag, uint start_level, uint stop
     ASSERT(start_level > 0);
     uint last_called_level = start_level - 1;
     const struct lk_init_struct *last = NULL;
+    struct init_run run = { .level = 0 };
     for (;;) {
         /* search for the lowest uncalled hook to call */
         LTRACEF("last %p, last_called_level %#x\n", last, last_called_level);
@@ -89,16 +324,24 @@ void lk_init_level(enum lk_init_flags required_flag, uint start_level, uint stop
             }
         }
 
+        /* moving past a level with parallel hooks waits for all of them */
+        if (run.count && (!found || found->level != run.level))
+            finish_run(&run);
+
         if (!found)
             break;
 
-#if TRACE_INIT
-        if (found->level >= EARLIEST_TRACE_LEVEL) {
-            printf("INIT: cpu %d, calling hook %p (%s) at level %#x, flags %#x\n",
-                   arch_curr_cpu_num(), found->hook, found->name, found->level, found->flags);
-        }
-#endif
-        found->hook(found->level);
+        /* hooks can only be spread across threads once there are threads */
+        if (required_flag == LK_INIT_FLAG_PRIMARY_CPU && found->level >= LK_INIT_LEVEL_THREADING &&
+                found->level != run.level)
+            start_run(&run, required_flag, found->level);
+
+        struct init_job *job = run.count ? find_job(&run, found->name) : NULL;
+        if (job)
+            run_job(job);
+        else
+            call_hook(found);
+
         last_called_level = found->level;
         last = found;
     }
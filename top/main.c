@@ -152,6 +152,10 @@ static int bootstrap2(void *arg)
 
     lk_primary_cpu_init_level(LK_INIT_LEVEL_APPS, LK_INIT_LEVEL_LAST);
 
+#if WITH_LK_INIT_PROFILE
+    lk_init_profile_dump();
+#endif
+
     return 0;
 }
 
@@ -193,7 +197,7 @@ void lk_init_secondary_cpus(uint secondary_cpu_count)
         thread_t *t = thread_create("secondarybootstrap2",
                                     &secondary_cpu_bootstrap2, NULL,
                                     DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
-        t->pinned_cpu = i + 1;
+        thread_set_pinned_cpu(t, i + 1);
         thread_detach(t);
         secondary_bootstrap_threads[i] = t;
     }